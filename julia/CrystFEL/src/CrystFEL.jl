@@ -51,12 +51,13 @@ export translategroup!, rotategroup!
 
 include("peaklist.jl")
 using .PeakLists
-export PeakList
+export PeakList, PeakRecord, peakarray
 
 include("reflists.jl")
 using .RefLists
 export RefList, loadreflist, savereflist!
 export Reflection, MergedReflection, UnmergedReflection
+export RefListColumns, columns, putcolumns!
 
 include("crystal.jl")
 using .Crystals
@@ -64,7 +65,7 @@ export Crystal, InternalCrystal
 
 include("image.jl")
 using .Images
-export Image, setreflections!
+export Image, setreflections!, paneldata
 
 include("diffcalc.jl")
 using .DiffractionCalculations
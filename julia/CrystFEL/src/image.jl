@@ -9,7 +9,7 @@ import ..CrystFEL.PeakLists: PeakList, InternalPeakList
 import ..CrystFEL.Crystals: Crystal, InternalCrystal
 import ..CrystFEL.RefLists: RefList, InternalRefList, UnmergedReflection
 import ..CrystFEL.Symmetry: SymOpList
-export Image, setreflections!
+export Image, setreflections!, paneldata
 
 const HEADER_CACHE_SIZE = 128
 
@@ -22,7 +22,7 @@ end
 
 mutable struct InternalImage
     dp::Ptr{Ptr{Cfloat}}
-    bad::Ptr{Ptr{Cint}}
+    bad::Ptr{Ptr{UInt8}}
     sat::Ptr{Ptr{Cfloat}}
     hit::Cint
     crystals::Ptr{CrystalRefListPair}
@@ -36,6 +36,9 @@ mutable struct InternalImage
     data_block::Ptr{Cvoid}
     data_block_size::Csize_t
     meta_data::Cstring
+    data_block_release::Ptr{Cvoid}
+    data_block_priv::Ptr{Cvoid}
+    dp_in_data_block::Ptr{Cint}
     header_cache::NTuple{HEADER_CACHE_SIZE, Ptr{Cvoid}}
     n_cached_headers::Cint
     id::Cint
@@ -313,6 +316,58 @@ function Image(dtempl::DataTemplate,
 end
 
 
+# Mirror of struct image_panel_view
+struct InternalPanelView
+    data::Ptr{Cfloat}
+    bad::Ptr{UInt8}
+    sat::Ptr{Cfloat}
+    w::Cint
+    h::Cint
+    stride::Cint
+end
+
+
+function wrappanel(p::Ptr{T}, pv) where T
+    if p == C_NULL
+        return nothing
+    end
+    arr = unsafe_wrap(Array, p, (Int(pv.stride), Int(pv.h)); own=false)
+    if pv.stride == pv.w
+        return arr
+    else
+        return view(arr, 1:pv.w, :)
+    end
+end
+
+
+"""
+    paneldata(image::Image, pn)
+
+Returns the image data, bad pixel mask and saturation values for panel number
+`pn` (counting from 1) as a named tuple `(data=..., bad=..., sat=...)`.  Each
+is a matrix indexed by `[fs, ss]` (counting from 1), or `nothing` if the image
+doesn't have it.
+
+The matrices are wrapped directly around libcrystfel's memory, without
+copying, so changes to them change the image.  They are only valid as long as
+`image` is alive (use `GC.@preserve` if necessary).
+
+Corresponds to CrystFEL C API function `image_get_panel_view()`.
+"""
+function paneldata(image::Image, pn)
+    pv = Ref{InternalPanelView}()
+    r = @ccall libcrystfel.image_get_panel_view(image.internalptr::Ptr{InternalImage},
+                                                (pn-1)::Cint,
+                                                pv::Ref{InternalPanelView})::Cint
+    if r != 0
+        throw(BoundsError(image, pn))
+    end
+    return (data=wrappanel(pv[].data, pv[]),
+            bad=wrappanel(pv[].bad, pv[]),
+            sat=wrappanel(pv[].sat, pv[]))
+end
+
+
 function Base.show(io::IO, mime::MIME"text/plain", image::Image)
 
     idata = unsafe_load(image.internalptr)
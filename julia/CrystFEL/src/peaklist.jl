@@ -2,7 +2,7 @@ module PeakLists
 
 using Printf
 import ..CrystFEL: libcrystfel
-export PeakList, InternalPeakList
+export PeakList, InternalPeakList, PeakRecord, peakarray
 
 mutable struct InternalPeak
     fs::Cdouble
@@ -114,4 +114,35 @@ function Base.show(io::IO, ::MIME"text/plain", peaklist::PeakList)
     end
 end
 
+# Mirror of struct imagefeature, for peakarray()
+struct PeakRecord
+    fs::Cdouble
+    ss::Cdouble
+    panelnumber::Cint
+    intensity::Cdouble
+    name::Cstring
+end
+
+
+"""
+    peakarray(peaklist)
+
+Returns the peaks in `peaklist` as a `Vector{PeakRecord}`, wrapped directly
+around libcrystfel's memory without copying.  The panel numbers count from
+zero.  The array is only valid until a peak is added to `peaklist`, and as
+long as `peaklist` is alive (use `GC.@preserve` if necessary).
+
+Corresponds to CrystFEL C API function `image_feature_list_array()`.
+"""
+function peakarray(peaklist::PeakList)
+    n = Ref{Cint}(0)
+    out = @ccall libcrystfel.image_feature_list_array(peaklist.internalptr::Ptr{InternalPeakList},
+                                                      n::Ref{Cint})::Ptr{PeakRecord}
+    if out == C_NULL
+        return PeakRecord[]
+    end
+    unsafe_wrap(Array, out, Int(n[]); own=false)
+end
+
+
 end   # of module
@@ -6,6 +6,7 @@ import ..CrystFEL.Symmetry: SymOpList, InternalSymOpList, symmetry_name
 export RefList, loadreflist, savereflist!
 export Reflection, UnmergedReflection, MergedReflection
 export InternalRefList
+export RefListColumns, columns, putcolumns!
 
 
 # The internal libcrystfel structures, not exposed directly
@@ -408,4 +409,130 @@ function Base.show(io::IO, refl::UnmergedReflection)
 end
 
 
+# Mirror of struct reflist_columns
+struct InternalRefListColumns
+    n::Cint
+    refls::Ptr{Ptr{InternalReflection}}
+    h::Ptr{Cint}
+    k::Ptr{Cint}
+    l::Ptr{Cint}
+    intensity::Ptr{Cdouble}
+    esd_i::Ptr{Cdouble}
+    partiality::Ptr{Cdouble}
+    lorentz::Ptr{Cdouble}
+    khalf::Ptr{Cdouble}
+    exerr::Ptr{Cdouble}
+    flag::Ptr{Cint}
+    fs::Ptr{Cdouble}
+    ss::Ptr{Cdouble}
+    panel_number::Ptr{Cint}
+    redundancy::Ptr{Cint}
+end
+
+mutable struct RefListColumns
+    internalptr::Ptr{InternalRefListColumns}
+    reflist::RefList
+    arrays::NamedTuple
+end
+
+# Values for reflist_put_columns(), from enum reflist_column_fields
+const COLUMN_FIELDS = (intensity=1, sigintensity=2, partiality=4,
+                       lorentzfactor=8, khalf=16, excitationerror=32,
+                       flag=64, detectorposition=128, nmeasurements=256)
+
+
+function wrapcolumn(p::Ptr{T}, n) where T
+    if n == 0
+        return T[]
+    end
+    unsafe_wrap(Array, p, n; own=false)
+end
+
+
+"""
+    columns(reflist)
+
+Returns a snapshot of the values of all the reflections in `reflist`, as one
+array per quantity, in the same order as iterating over the list.  The arrays
+are `h`, `k`, `l`, `intensity`, `sigintensity`, `partiality`, `lorentzfactor`,
+`khalf`, `excitationerror`, `flag`, `fs`, `ss`, `panelnumber` (counting from
+zero) and `nmeasurements`, accessed as e.g. `cols.intensity`.
+
+The arrays are wrapped directly around libcrystfel's memory, without copying,
+and are only valid as long as the returned object is alive.  Use
+`GC.@preserve` if the arrays are used without keeping a reference to it.
+Changes to the arrays are not written back to `reflist` until
+`putcolumns!()` is called.  Do not add reflections to `reflist` while the
+snapshot is in use.
+
+Corresponds to CrystFEL C API function `reflist_get_columns()`.
+"""
+function columns(reflist::RefList)
+
+    out = @ccall libcrystfel.reflist_get_columns(reflist.internalptr::Ptr{InternalRefList})::Ptr{InternalRefListColumns}
+    if out == C_NULL
+        throw(ErrorException("Failed to get reflection columns"))
+    end
+
+    c = unsafe_load(out)
+    n = Int(c.n)
+    arrays = (h=wrapcolumn(c.h, n),
+              k=wrapcolumn(c.k, n),
+              l=wrapcolumn(c.l, n),
+              intensity=wrapcolumn(c.intensity, n),
+              sigintensity=wrapcolumn(c.esd_i, n),
+              partiality=wrapcolumn(c.partiality, n),
+              lorentzfactor=wrapcolumn(c.lorentz, n),
+              khalf=wrapcolumn(c.khalf, n),
+              excitationerror=wrapcolumn(c.exerr, n),
+              flag=wrapcolumn(c.flag, n),
+              fs=wrapcolumn(c.fs, n),
+              ss=wrapcolumn(c.ss, n),
+              panelnumber=wrapcolumn(c.panel_number, n),
+              nmeasurements=wrapcolumn(c.redundancy, n))
+
+    finalizer(RefListColumns(out, reflist, arrays)) do x
+        @ccall libcrystfel.reflist_free_columns(x.internalptr::Ptr{InternalRefListColumns})::Cvoid
+    end
+
+end
+
+
+"""
+    putcolumns!(cols, fields...)
+
+Writes the values in `cols`, from `columns()`, back into the reflection list.
+Only the quantities named in `fields` are written, e.g.
+`putcolumns!(cols, :intensity, :sigintensity)`.  Use `:detectorposition` for
+`fs`, `ss` and `panelnumber` together.  The indices cannot be changed.
+
+Corresponds to CrystFEL C API function `reflist_put_columns()`.
+"""
+function putcolumns!(cols::RefListColumns, fields::Symbol...)
+    mask = 0
+    for f in fields
+        if !haskey(COLUMN_FIELDS, f)
+            throw(ArgumentError("Cannot write back column "*string(f)))
+        end
+        mask |= COLUMN_FIELDS[f]
+    end
+    @ccall libcrystfel.reflist_put_columns(cols.internalptr::Ptr{InternalRefListColumns},
+                                           mask::Cint)::Cvoid
+    return cols
+end
+
+
+Base.length(cols::RefListColumns) = length(getfield(cols, :arrays).h)
+
+function Base.getproperty(cols::RefListColumns, name::Symbol)
+    if name in fieldnames(RefListColumns)
+        getfield(cols, name)
+    else
+        getfield(getfield(cols, :arrays), name)
+    end
+end
+
+Base.propertynames(cols::RefListColumns; private=false) = keys(getfield(cols, :arrays))
+
+
 end  # of module
@@ -638,18 +638,38 @@ UnitCell *uncenter_cell(UnitCell *in, IntegerMatrix **pC, RationalMatrix **pCi)
 /* Return sin(theta)/lambda = 1/2d.  Multiply by two if you want 1/d */
 double resolution(UnitCell *cell, signed int h, signed int k, signed int l)
 {
-	double asx, asy, asz;
-	double bsx, bsy, bsz;
-	double csx, csy, csz;
+	struct cell_rmetric m;
+	cell_get_reciprocal_metric(cell, &m);
+	return resolution_fast(&m, h, k, l);
+}
 
-	cell_get_reciprocal(cell,
-	                    &asx, &asy, &asz,
-	                    &bsx, &bsy, &bsz,
-	                    &csx, &csy, &csz);
 
-	return modulus(h*asx + k*bsx + l*csx,
-	               h*asy + k*bsy + l*csy,
-	               h*asz + k*bsz + l*csz) / 2.0;
+/**
+ * \param cell: A %UnitCell
+ * \param h: Array of Miller indices h
+ * \param k: Array of Miller indices k
+ * \param l: Array of Miller indices l
+ * \param n: Number of reflections
+ * \param s: Array in which to store the values of s = 1/2d
+ *
+ * Calculates resolution() for \p n reflections at once, e.g. for the arrays
+ * in a \ref reflist_columns.
+ *
+ * \returns zero on success, non-zero if the cell has no parameters.
+ */
+int resolution_batch(UnitCell *cell, const signed int *h, const signed int *k,
+                     const signed int *l, int n, double *s)
+{
+	struct cell_rmetric m;
+	int i;
+
+	if ( cell_get_reciprocal_metric(cell, &m) ) return 1;
+
+	for ( i=0; i<n; i++ ) {
+		s[i] = resolution_fast(&m, h[i], k[i], l[i]);
+	}
+
+	return 0;
 }
 
 
@@ -1472,6 +1492,52 @@ int compare_cell_parameters_and_orientation(UnitCell *cell, UnitCell *reference,
 }
 
 
+/* The axes of a cell transformed by a "permutation" matrix are sums of the
+ * original axes with coefficients +1, 0 or -1.  Returns a bitmask with bit
+ * 9*(c0+1) + 3*(c1+1) + (c2+1) set for each combination c0*a + c1*b + c2*c
+ * which could match axis (rx,ry,rz) of the reference cell.  The tolerances
+ * are slightly looser than in compare_cell_parameters_and_orientation(), so
+ * that nothing is missed because of rounding. */
+static unsigned int axis_candidates(const double *axes,
+                                    double rx, double ry, double rz,
+                                    double len_tol, double ang_tol)
+{
+	unsigned int mask = 0;
+	int c0, c1, c2;
+
+	for ( c0=-1; c0<=+1; c0++ ) {
+	for ( c1=-1; c1<=+1; c1++ ) {
+	for ( c2=-1; c2<=+1; c2++ ) {
+
+		double x = c0*axes[0] + c1*axes[3] + c2*axes[6];
+		double y = c0*axes[1] + c1*axes[4] + c2*axes[7];
+		double z = c0*axes[2] + c1*axes[5] + c2*axes[8];
+
+		if ( (c0 == 0) && (c1 == 0) && (c2 == 0) ) continue;
+
+		if ( angle_between(x, y, z, rx, ry, rz) > ang_tol+1e-6 ) {
+			continue;
+		}
+		if ( moduli_check(x, y, z, rx, ry, rz) > len_tol*(1.0+1e-6) ) {
+			continue;
+		}
+
+		mask |= 1u << (9*(c0+1) + 3*(c1+1) + (c2+1));
+
+	}
+	}
+	}
+
+	return mask;
+}
+
+
+static int column_possible(unsigned int mask, int c0, int c1, int c2)
+{
+	return (mask >> (9*(c0+1) + 3*(c1+1) + (c2+1))) & 1;
+}
+
+
 /**
  * \param cell: A UnitCell
  * \param reference: Another UnitCell
@@ -1507,9 +1573,28 @@ int compare_permuted_cell_parameters_and_orientation(UnitCell *cell,
 {
 	IntegerMatrix *m;
 	int i[9];
+	double axes[9];
+	double ref[9];
+	unsigned int cand[3];
+	int ax;
 
 	if ( cell_get_centering(cell) != cell_get_centering(reference) ) return 0;
 
+	/* Before trying any transformations, find out which combinations of
+	 * axes could possibly match each axis of the reference cell.  Usually
+	 * there are only a few, and often none at all. */
+	cell_get_cartesian(cell, &axes[0], &axes[1], &axes[2],
+	                         &axes[3], &axes[4], &axes[5],
+	                         &axes[6], &axes[7], &axes[8]);
+	cell_get_cartesian(reference, &ref[0], &ref[1], &ref[2],
+	                              &ref[3], &ref[4], &ref[5],
+	                              &ref[6], &ref[7], &ref[8]);
+	for ( ax=0; ax<3; ax++ ) {
+		cand[ax] = axis_candidates(axes, ref[3*ax], ref[3*ax+1],
+		                           ref[3*ax+2], tols[ax], tols[ax+3]);
+		if ( cand[ax] == 0 ) return 0;
+	}
+
 	m = intmat_new(3, 3);
 
 	for ( i[0]=-1; i[0]<=+1; i[0]++ ) {
@@ -1527,6 +1612,11 @@ int compare_permuted_cell_parameters_and_orientation(UnitCell *cell,
 		int l = 0;
 		signed int det;
 
+		/* Column k of the matrix gives new axis k */
+		if ( !column_possible(cand[0], i[0], i[3], i[6]) ) continue;
+		if ( !column_possible(cand[1], i[1], i[4], i[7]) ) continue;
+		if ( !column_possible(cand[2], i[2], i[5], i[8]) ) continue;
+
 		for ( j=0; j<3; j++ )
 			for ( k=0; k<3; k++ )
 				intmat_set(m, j, k, i[l++]);
@@ -2191,21 +2281,93 @@ static int random_int(int max)
 }
 
 
-static IntegerMatrix *check_permutations(UnitCell *cell_reduced, UnitCell *reference,
-                                         RationalMatrix *CiARA, IntegerMatrix *RiBCB,
-                                         const double *tols)
+/* Precomputed information for comparing many cells against one reference */
+struct _cellcomparison
 {
-	IntegerMatrix *m;
-	int i[9];
+	UnitCell *reference;
+	double tols[6];
+	char centering;
 	double a, b, c, al, be, ga;
-	double best_diff = +INFINITY;
-	int s, sel;
-	IntegerMatrix *best_m[24];
-	int n_best = 0;
+	struct g6 g6ref;
 
-	m = intmat_new(3, 3);
-	cell_get_parameters(reference, &a, &b, &c, &al, &be, &ga);
+	/* Transformation from the reduced reference cell back to the
+	 * reference, and whether the centering after it matches */
+	IntegerMatrix *RiBCB;
+	int centering_ok;
+
+	/* All the 3x3 matrices with elements -1, 0 or +1 and determinant +1
+	 * (m, nine values each), and their products with RiBCB (q) */
+	int n_cands;
+	signed int *m;
+	double *q;
+};
+
+
+/**
+ * \param reference: A UnitCell
+ * \param tols: Pointer to tolerances for a,b,c (fractional), al,be,ga (radians)
+ *
+ * Prepares for comparing many unit cells against \p reference with
+ * \ref cell_comparison_match.  Everything which depends only on the reference
+ * cell, including its reduced form and the set of candidate transformations,
+ * is worked out here once instead of for every comparison.
+ *
+ * \returns A new \ref CellComparison, or NULL on error.
+ */
+CellComparison *cell_comparison_new(UnitCell *reference, const double *tols)
+{
+	CellComparison *cc;
+	UnitCell *ref_p;
+	UnitCell *ref_reduced;
+	UnitCell *tmp;
+	IntegerMatrix *CB;
+	IntegerMatrix *RB;
+	IntegerMatrix *RiB;
+	int i[9];
+	int j;
+
+	cc = cfmalloc(sizeof(struct _cellcomparison));
+	if ( cc == NULL ) return NULL;
+
+	ref_p = uncenter_cell(reference, &CB, NULL);
+	if ( ref_p == NULL ) {
+		cffree(cc);
+		return NULL;
+	}
+
+	RB = reduce_g6(cell_get_G6(ref_p), 1e-5);
+	ref_reduced = cell_transform_intmat(ref_p, RB);
+	cell_free(ref_p);
+
+	RiB = intmat_inverse(RB);
+	cc->RiBCB = intmat_times_intmat(RiB, CB);
+	intmat_free(RiB);
+	intmat_free(RB);
+	intmat_free(CB);
 
+	/* The centering of a transformed cell depends only on the last
+	 * transformation, because the reduced cells are primitive */
+	tmp = cell_transform_intmat(ref_reduced, cc->RiBCB);
+	cc->centering_ok = centering_equivalent(cell_get_centering(tmp),
+	                                        cell_get_centering(reference));
+	cell_free(tmp);
+	cell_free(ref_reduced);
+
+	cc->reference = cell_new_from_cell(reference);
+	cc->centering = cell_get_centering(reference);
+	cell_get_parameters(reference, &cc->a, &cc->b, &cc->c,
+	                    &cc->al, &cc->be, &cc->ga);
+	cc->g6ref = cell_get_G6(reference);
+	for ( j=0; j<6; j++ ) cc->tols[j] = tols[j];
+
+	cc->m = cfmalloc(19683*9*sizeof(signed int));
+	cc->q = cfmalloc(19683*9*sizeof(double));
+	if ( (cc->m == NULL) || (cc->q == NULL) ) {
+		cell_comparison_free(cc);
+		return NULL;
+	}
+
+	cc->n_cands = 0;
 	for ( i[0]=-1; i[0]<=+1; i[0]++ ) {
 	for ( i[1]=-1; i[1]<=+1; i[1]++ ) {
 	for ( i[2]=-1; i[2]<=+1; i[2]++ ) {
@@ -2216,53 +2378,29 @@ static IntegerMatrix *check_permutations(UnitCell *cell_reduced, UnitCell *refer
 	for ( i[7]=-1; i[7]<=+1; i[7]++ ) {
 	for ( i[8]=-1; i[8]<=+1; i[8]++ ) {
 
-		UnitCell *nc;
-		int j, k;
-		int l = 0;
 		signed int det;
-		UnitCell *tmp;
+		signed int *m;
+		double *q;
+		int k, l;
 
-		for ( j=0; j<3; j++ )
-			for ( k=0; k<3; k++ )
-				intmat_set(m, j, k, i[l++]);
-
-		det = intmat_det(m);
+		det = i[0]*(i[4]*i[8] - i[5]*i[7])
+		    - i[1]*(i[3]*i[8] - i[5]*i[6])
+		    + i[2]*(i[3]*i[7] - i[4]*i[6]);
 		if ( det != +1 ) continue;
 
-		tmp = cell_transform_intmat(cell_reduced, m);
-		nc = cell_transform_intmat(tmp, RiBCB);
-		cell_free(tmp);
-
-		if ( compare_cell_parameters(nc, reference, tols) ) {
-
-			double diff = g6_distance(nc, reference);
-			if ( diff < 0.999*best_diff ) {
-
-				/* New solution is significantly better,
-				 * dump all the previous ones */
-				for ( s=0; s<n_best; s++ ) {
-					intmat_free(best_m[s]);
-				}
-				best_diff = diff;
-				n_best = 0;
+		m = &cc->m[9*cc->n_cands];
+		q = &cc->q[9*cc->n_cands];
+		for ( k=0; k<9; k++ ) m[k] = i[k];
 
-				best_m[n_best++] = intmat_copy(m);
-
-			} else if ( diff < 1.001*best_diff ) {
-
-				/* If the new solution is the same as the
-				 * previous one, add it to the list */
-				if ( n_best == 24 ) {
-					ERROR("WARNING: Too many equivalent "
-					      "reindexed lattices\n");
-				} else {
-					best_m[n_best++] = intmat_copy(m);
-				}
-
-			} /* else worse, so ignore */
+		for ( k=0; k<3; k++ ) {
+			for ( l=0; l<3; l++ ) {
+				q[3*k+l] = m[3*k+0]*intmat_get(cc->RiBCB, 0, l)
+				         + m[3*k+1]*intmat_get(cc->RiBCB, 1, l)
+				         + m[3*k+2]*intmat_get(cc->RiBCB, 2, l);
+			}
 		}
 
-		cell_free(nc);
+		cc->n_cands++;
 
 	}
 	}
@@ -2274,144 +2412,273 @@ static IntegerMatrix *check_permutations(UnitCell *cell_reduced, UnitCell *refer
 	}
 	}
 
-	intmat_free(m);
+	/* Only about one in six of the matrices have determinant +1 */
+	cc->m = cfrealloc(cc->m, cc->n_cands*9*sizeof(signed int));
+	cc->q = cfrealloc(cc->q, cc->n_cands*9*sizeof(double));
 
-	if ( n_best == 0 ) return NULL;
+	return cc;
+}
+
+
+/**
+ * \param cc: A \ref CellComparison
+ *
+ * Frees \p cc and all associated resources.
+ */
+void cell_comparison_free(CellComparison *cc)
+{
+	if ( cc == NULL ) return;
+	cell_free(cc->reference);
+	intmat_free(cc->RiBCB);
+	cffree(cc->m);
+	cffree(cc->q);
+	cffree(cc);
+}
+
+
+/**
+ * \param cc: A \ref CellComparison, from \ref cell_comparison_new
+ * \param cell: A UnitCell
+ *
+ * Compares the parameters of \p cell directly with those of the reference
+ * cell of \p cc, without any reindexing.  This gives the same result as
+ * \ref compare_cell_parameters with the reference cell and tolerances of
+ * \p cc, but the reference cell parameters are only worked out once.
+ *
+ * \returns non-zero if the cells match.
+ */
+int cell_comparison_check_parameters(CellComparison *cc, UnitCell *cell)
+{
+	double a, b, c, al, be, ga;
+
+	if ( !centering_equivalent(cell_get_centering(cell),
+	                           cc->centering) ) return 0;
+
+	cell_get_parameters(cell, &a, &b, &c, &al, &be, &ga);
+
+	/* within_tolerance() takes a percentage */
+	if ( !within_tolerance(a, cc->a, cc->tols[0]*100.0) ) return 0;
+	if ( !within_tolerance(b, cc->b, cc->tols[1]*100.0) ) return 0;
+	if ( !within_tolerance(c, cc->c, cc->tols[2]*100.0) ) return 0;
+	if ( fabs(al-cc->al) > cc->tols[3] ) return 0;
+	if ( fabs(be-cc->be) > cc->tols[4] ) return 0;
+	if ( fabs(ga-cc->ga) > cc->tols[5] ) return 0;
+
+	return 1;
+}
+
+
+/* Finds the best candidate transformation for the reduced cell, as for
+ * compare_reindexed_cell_parameters().  Returns the index of the candidate,
+ * or -1 if none match. */
+static int best_candidate(CellComparison *cc, UnitCell *cell_reduced)
+{
+	double v[9];
+	double best_diff = +INFINITY;
+	int best[24];
+	int n_best = 0;
+	int n;
+
+	if ( !cc->centering_ok ) return -1;
+
+	cell_get_cartesian(cell_reduced, &v[0], &v[1], &v[2],
+	                                 &v[3], &v[4], &v[5],
+	                                 &v[6], &v[7], &v[8]);
+
+	for ( n=0; n<cc->n_cands; n++ ) {
+
+		const double *q = &cc->q[9*n];
+		double u[9];
+		double a, b, c, al, be, ga;
+		double ab, ac, bc;
+		double dA, dB, dC, dD, dE, dF;
+		double diff;
+		int j;
+
+		/* New axis j = sum over i of q[i][j] times old axis i */
+		for ( j=0; j<3; j++ ) {
+			u[3*j+0] = q[j]*v[0] + q[3+j]*v[3] + q[6+j]*v[6];
+			u[3*j+1] = q[j]*v[1] + q[3+j]*v[4] + q[6+j]*v[7];
+			u[3*j+2] = q[j]*v[2] + q[3+j]*v[5] + q[6+j]*v[8];
+		}
+
+		a = sqrt(u[0]*u[0] + u[1]*u[1] + u[2]*u[2]);
+		if ( !within_tolerance(a, cc->a, cc->tols[0]*100.0) ) continue;
+		b = sqrt(u[3]*u[3] + u[4]*u[4] + u[5]*u[5]);
+		if ( !within_tolerance(b, cc->b, cc->tols[1]*100.0) ) continue;
+		c = sqrt(u[6]*u[6] + u[7]*u[7] + u[8]*u[8]);
+		if ( !within_tolerance(c, cc->c, cc->tols[2]*100.0) ) continue;
+
+		bc = u[3]*u[6] + u[4]*u[7] + u[5]*u[8];
+		ac = u[0]*u[6] + u[1]*u[7] + u[2]*u[8];
+		ab = u[0]*u[3] + u[1]*u[4] + u[2]*u[5];
+		al = acos(bc/(b*c));
+		be = acos(ac/(a*c));
+		ga = acos(ab/(a*b));
+		if ( fabs(al-cc->al) > cc->tols[3] ) continue;
+		if ( fabs(be-cc->be) > cc->tols[4] ) continue;
+		if ( fabs(ga-cc->ga) > cc->tols[5] ) continue;
+
+		dA = a*a - cc->g6ref.A;
+		dB = b*b - cc->g6ref.B;
+		dC = c*c - cc->g6ref.C;
+		dD = 2.0*bc - cc->g6ref.D;
+		dE = 2.0*ac - cc->g6ref.E;
+		dF = 2.0*ab - cc->g6ref.F;
+		diff = sqrt(dA*dA + dB*dB + dC*dC + dD*dD + dE*dE + dF*dF);
+
+		if ( diff < 0.999*best_diff ) {
+
+			/* New solution is significantly better,
+			 * dump all the previous ones */
+			best_diff = diff;
+			n_best = 0;
+			best[n_best++] = n;
+
+		} else if ( diff < 1.001*best_diff ) {
+
+			/* If the new solution is the same as the
+			 * previous one, add it to the list */
+			if ( n_best == 24 ) {
+				ERROR("WARNING: Too many equivalent "
+				      "reindexed lattices\n");
+			} else {
+				best[n_best++] = n;
+			}
+
+		} /* else worse, so ignore */
 
-	/* Select a transformation at random from the equivalent versions,
-	 * and then free all the others */
-	sel = random_int(n_best);
-	for ( s=0; s<n_best; s++ ) {
-		if ( s != sel ) intmat_free(best_m[s]);
 	}
 
-	return best_m[sel];
+	if ( n_best == 0 ) return -1;
+
+	/* Select a transformation at random from the equivalent versions */
+	return best[random_int(n_best)];
 }
 
 
 /**
+ * \param cc: A \ref CellComparison, from \ref cell_comparison_new
  * \param cell_in: A UnitCell
- * \param reference_in: Another UnitCell
- * \param tols: Pointer to tolerances for a,b,c (fractional), al,be,ga (radians)
  * \param pmb: Place to store pointer to matrix, or NULL if not needed
  *
- * Compare the \p cell_in with \p reference_in.  If they represent the same
- * lattice, this function returns a copy of \p cell_in transformed to look
- * similar to \p reference_in.  Otherwise, it returns NULL.
+ * Compares \p cell_in with the reference cell of \p cc, in the same way as
+ * \ref compare_reindexed_cell_parameters.  The candidate transformations
+ * are tested without allocating any memory, so this is much faster when
+ * many cells need to be compared with the same reference.
  *
- * If \pmb is non-NULL, the transformation which needs to be applied to
- * \p cell_in will be stored there.
- *
- * Only the cell parameters will be compared.  The relative orientations are
- * irrelevant.  The tolerances will be applied to the transformed copy of
- * \p cell_in, i.e. the version of the input cell which looks similar to
- * \p reference_in.  Subject to the tolerances, the cell will be chosen which
- * has the lowest distance measured in G^6 unit cell space.
- *
- * There will usually be several transformation matrices which produce exactly
- * the same total absolute error.  A matrix will be selected at random from the
- * possibilities.  This avoids skewed distributions of unit cell parameters,
- * e.g. the angles always being greater than 90 degrees.
- *
- * This is the right function to use for deciding if an indexing solution
- * matches a reference cell or not.
+ * \p cc is not changed, so several threads can use it at the same time.
  *
  * \returns A newly allocated UnitCell, or NULL.
- *
  */
-UnitCell *compare_reindexed_cell_parameters(UnitCell *cell_in,
-                                            UnitCell *reference_in,
-                                            const double *tols,
-                                            RationalMatrix **pmb)
+UnitCell *cell_comparison_match(CellComparison *cc, UnitCell *cell_in,
+                                RationalMatrix **pmb)
 {
 	UnitCell *cell;
-	UnitCell *reference;
-	IntegerMatrix *CB;
+	UnitCell *cell_reduced;
 	RationalMatrix *CiA;
 	IntegerMatrix *RA;
-	IntegerMatrix *RB;
-	IntegerMatrix *RiB;
-	IntegerMatrix *P;
-	RationalMatrix *CiARA;
-	IntegerMatrix *RiBCB;
-	UnitCell *cell_reduced;
-	UnitCell *reference_reduced;
 	UnitCell *match;
-	struct g6 g6cell;
-	struct g6 g6ref;
-
-	//STATUS("The input cell:\n");
-	//cell_print(cell_in);
-
-	//STATUS("The reference cell:\n");
-	//cell_print(reference_in);
-
-	/* Un-center both cells */
-	reference = uncenter_cell(reference_in, &CB, NULL);
-	if ( reference == NULL ) return NULL;
+	int sel;
 
+	/* Un-center the cell and convert it to reduced basis (stably) */
 	cell = uncenter_cell(cell_in, NULL, &CiA);
 	if ( cell == NULL ) return NULL;
 
-	/* Calculate G6 components for both */
-	g6cell = cell_get_G6(cell);
-	g6ref = cell_get_G6(reference);
-
-	/* Convert both to reduced basis (stably) */
-	RA = reduce_g6(g6cell, 1e-5);
-	//STATUS("------------------------------------------\n");
-	RB = reduce_g6(g6ref, 1e-5);
-
+	RA = reduce_g6(cell_get_G6(cell), 1e-5);
 	cell_reduced = cell_transform_intmat(cell, RA);
-
-	//STATUS("Reduced cell:\n");
-	//cell_print(cell_reduced);
-	//STATUS("Reduced reference:\n");
-	reference_reduced = cell_transform_intmat(reference, RB);
-	//cell_print(reference_reduced);
-
-	/* The primitive (non-reduced) cells are no longer needed */
-	cell_free(reference);
 	cell_free(cell);
 
-	/* Within tolerance? */
-	RiB = intmat_inverse(RB);
-	RiBCB = intmat_times_intmat(RiB, CB);
-	intmat_free(RiB);
-	CiARA = rtnlmtx_times_intmat(CiA, RA);
-	P = check_permutations(cell_reduced, reference_in, CiARA, RiBCB, tols);
-	if ( P != NULL ) {
+	sel = best_candidate(cc, cell_reduced);
+	cell_free(cell_reduced);
 
+	if ( sel >= 0 ) {
+
+		IntegerMatrix *P;
+		RationalMatrix *CiARA;
 		RationalMatrix *tmp;
 		RationalMatrix *comb;
+		int j, k;
 
-		//STATUS("The best permutation matrix:\n");
-		//intmat_print(P);
+		P = intmat_new(3, 3);
+		for ( j=0; j<3; j++ ) {
+			for ( k=0; k<3; k++ ) {
+				intmat_set(P, j, k, cc->m[9*sel+3*j+k]);
+			}
+		}
 
 		/* Calculate combined matrix: CiA.RA.P.RiB.CB */
+		CiARA = rtnlmtx_times_intmat(CiA, RA);
 		tmp = rtnlmtx_times_intmat(CiARA, P);
-		comb = rtnlmtx_times_intmat(tmp, RiBCB);
+		comb = rtnlmtx_times_intmat(tmp, cc->RiBCB);
 		rtnl_mtx_free(tmp);
+		rtnl_mtx_free(CiARA);
+		intmat_free(P);
 
 		match = cell_transform_rational(cell_in, comb);
-		//STATUS("Original cell transformed to look like reference:\n");
-		//cell_print(match);
 
-		if ( pmb != NULL ) *pmb = comb;
+		if ( pmb != NULL ) {
+			*pmb = comb;
+		} else {
+			rtnl_mtx_free(comb);
+		}
 
 	} else {
 		match = NULL;
 	}
 
-	rtnl_mtx_free(CiARA);
 	rtnl_mtx_free(CiA);
-	intmat_free(RiBCB);
 	intmat_free(RA);
-	intmat_free(RB);
-	intmat_free(CB);
-	intmat_free(P);
-	cell_free(reference_reduced);
-	cell_free(cell_reduced);
+
+	return match;
+}
+
+
+/**
+ * \param cell_in: A UnitCell
+ * \param reference_in: Another UnitCell
+ * \param tols: Pointer to tolerances for a,b,c (fractional), al,be,ga (radians)
+ * \param pmb: Place to store pointer to matrix, or NULL if not needed
+ *
+ * Compare the \p cell_in with \p reference_in.  If they represent the same
+ * lattice, this function returns a copy of \p cell_in transformed to look
+ * similar to \p reference_in.  Otherwise, it returns NULL.
+ *
+ * If \pmb is non-NULL, the transformation which needs to be applied to
+ * \p cell_in will be stored there.
+ *
+ * Only the cell parameters will be compared.  The relative orientations are
+ * irrelevant.  The tolerances will be applied to the transformed copy of
+ * \p cell_in, i.e. the version of the input cell which looks similar to
+ * \p reference_in.  Subject to the tolerances, the cell will be chosen which
+ * has the lowest distance measured in G^6 unit cell space.
+ *
+ * There will usually be several transformation matrices which produce exactly
+ * the same total absolute error.  A matrix will be selected at random from the
+ * possibilities.  This avoids skewed distributions of unit cell parameters,
+ * e.g. the angles always being greater than 90 degrees.
+ *
+ * This is the right function to use for deciding if an indexing solution
+ * matches a reference cell or not.  If many cells need to be compared with
+ * the same reference, use \ref cell_comparison_new and
+ * \ref cell_comparison_match instead.
+ *
+ * \returns A newly allocated UnitCell, or NULL.
+ *
+ */
+UnitCell *compare_reindexed_cell_parameters(UnitCell *cell_in,
+                                            UnitCell *reference_in,
+                                            const double *tols,
+                                            RationalMatrix **pmb)
+{
+	CellComparison *cc;
+	UnitCell *match;
+
+	cc = cell_comparison_new(reference_in, tols);
+	if ( cc == NULL ) return NULL;
+
+	match = cell_comparison_match(cc, cell_in, pmb);
+	cell_comparison_free(cc);
 
 	return match;
 }
@@ -46,9 +46,39 @@ extern "C" {
  **/
 
 
+/**
+ * Opaque data structure for comparing many unit cells against the same
+ * reference cell.
+ **/
+typedef struct _cellcomparison CellComparison;
+
+
 extern double resolution(UnitCell *cell,
                          signed int h, signed int k, signed int l);
 
+/**
+ * \param m: Reciprocal metric tensor from cell_get_reciprocal_metric()
+ * \param h: Miller index h
+ * \param k: Miller index k
+ * \param l: Miller index l
+ *
+ * The same as resolution(), but without going through the %UnitCell for each
+ * reflection.
+ *
+ * \returns s = 1/2d for the reflection.
+ */
+static inline double resolution_fast(const struct cell_rmetric *m,
+                                     signed int h, signed int k, signed int l)
+{
+	double s2 = h*h*m->g11 + k*k*m->g22 + l*l*m->g33
+	          + h*k*m->g12 + h*l*m->g13 + k*l*m->g23;
+	return sqrt(s2) / 2.0;
+}
+
+extern int resolution_batch(UnitCell *cell, const signed int *h,
+                            const signed int *k, const signed int *l,
+                            int n, double *s);
+
 extern UnitCell *cell_rotate(UnitCell *in, struct quaternion quat);
 extern UnitCell *rotate_cell(UnitCell *in, double omega, double phi,
                              double rot);
@@ -103,6 +133,14 @@ extern UnitCell *compare_reindexed_cell_parameters(UnitCell *cell_in,
                                                    const double *tols,
                                                    RationalMatrix **pmb);
 
+extern CellComparison *cell_comparison_new(UnitCell *reference,
+                                           const double *tols);
+extern void cell_comparison_free(CellComparison *cc);
+extern UnitCell *cell_comparison_match(CellComparison *cc, UnitCell *cell_in,
+                                       RationalMatrix **pmb);
+extern int cell_comparison_check_parameters(CellComparison *cc,
+                                            UnitCell *cell);
+
 extern SymOpList *get_lattice_symmetry(UnitCell *cell);
 
 #ifdef __cplusplus
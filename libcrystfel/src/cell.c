@@ -79,6 +79,10 @@ struct _unitcell {
 	double axs;	double bxs;	double cxs;
 	double ays;	double bys;	double cys;
 	double azs;	double bzs;	double czs;
+
+	/* Reciprocal metric tensor, see cell_get_reciprocal_metric() */
+	int have_metric;
+	struct cell_rmetric rmetric;
 };
 
 typedef enum {
@@ -122,6 +126,7 @@ UnitCell *cell_new()
 	cell->have_cryst = 0;
 	cell->have_cart = 0;
 	cell->have_recip = 0;
+	cell->have_metric = 0;
 
 	cell->lattice_type = L_TRICLINIC;
 	cell->centering = 'P';
@@ -174,6 +179,7 @@ void cell_set_parameters(UnitCell *cell, double a, double b, double c,
 	cell->have_cryst = 1;
 	cell->have_cart = 0;
 	cell->have_recip = 0;
+	cell->have_metric = 0;
 }
 
 
@@ -191,6 +197,7 @@ void cell_set_cartesian(UnitCell *cell,
 	cell->have_cryst = 0;
 	cell->have_cart = 1;
 	cell->have_recip = 0;
+	cell->have_metric = 0;
 }
 
 
@@ -223,6 +230,7 @@ UnitCell *cell_new_from_reciprocal_axes(struct rvec as, struct rvec bs,
 	cell->have_cryst = 0;
 	cell->have_cart = 0;
 	cell->have_recip = 1;
+	cell->have_metric = 0;
 
 	return cell;
 }
@@ -242,6 +250,7 @@ UnitCell *cell_new_from_direct_axes(struct rvec a, struct rvec b, struct rvec c)
 	cell->have_cryst = 0;
 	cell->have_cart = 1;
 	cell->have_recip = 0;
+	cell->have_metric = 0;
 
 	return cell;
 }
@@ -270,6 +279,7 @@ void cell_set_reciprocal(UnitCell *cell,
 	cell->have_cryst = 0;
 	cell->have_cart = 0;
 	cell->have_recip = 1;
+	cell->have_metric = 0;
 }
 
 
@@ -567,6 +577,47 @@ int cell_get_reciprocal(UnitCell *cell,
 }
 
 
+/**
+ * \param cell: A %UnitCell
+ * \param m: Place to store the reciprocal metric tensor
+ *
+ * Gets the reciprocal metric tensor of \p cell, for use with
+ * resolution_fast().  The tensor is calculated the first time, and kept
+ * until the cell is changed using one of the setters.  Like the other
+ * getters, this updates \p cell, so make sure it has been called once before
+ * sharing the cell between threads.
+ *
+ * \returns zero on success, non-zero if the cell has no parameters.
+ */
+int cell_get_reciprocal_metric(UnitCell *cell, struct cell_rmetric *m)
+{
+	double asx, asy, asz, bsx, bsy, bsz, csx, csy, csz;
+
+	if ( cell == NULL ) return 1;
+
+	if ( !cell->have_metric ) {
+
+		struct cell_rmetric *g = &cell->rmetric;
+
+		if ( cell_get_reciprocal(cell, &asx, &asy, &asz,
+		                               &bsx, &bsy, &bsz,
+		                               &csx, &csy, &csz) ) return 1;
+
+		g->g11 = asx*asx + asy*asy + asz*asz;
+		g->g22 = bsx*bsx + bsy*bsy + bsz*bsz;
+		g->g33 = csx*csx + csy*csy + csz*csz;
+		g->g12 = 2.0*(asx*bsx + asy*bsy + asz*bsz);
+		g->g13 = 2.0*(asx*csx + asy*csy + asz*csz);
+		g->g23 = 2.0*(bsx*csx + bsy*csy + bsz*csz);
+		cell->have_metric = 1;
+
+	}
+
+	*m = cell->rmetric;
+	return 0;
+}
+
+
 char cell_get_centering(const UnitCell *cell)
 {
 	return cell->centering;
@@ -70,6 +70,22 @@ typedef enum
 } LatticeType;
 
 
+/**
+ * The reciprocal metric tensor of a unit cell, with the off-diagonal
+ * elements doubled, so that (2s)^2 = h^2 g11 + k^2 g22 + l^2 g33
+ * + hk g12 + hl g13 + kl g23.  See cell_get_reciprocal_metric().
+ **/
+struct cell_rmetric
+{
+	double g11;
+	double g22;
+	double g33;
+	double g12;
+	double g13;
+	double g23;
+};
+
+
 /**
  * Opaque data structure representing a unit cell.
  *
@@ -120,6 +136,8 @@ extern int cell_get_reciprocal(UnitCell *cell,
                                double *bsx, double *bsy, double *bsz,
                                double *csx, double *csy, double *csz);
 
+extern int cell_get_reciprocal_metric(UnitCell *cell, struct cell_rmetric *m);
+
 extern void cell_set_reciprocal(UnitCell *cell,
                                 double asx, double asy, double asz,
                                 double bsx, double bsy, double bsz,
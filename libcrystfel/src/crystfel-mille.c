@@ -30,6 +30,7 @@
 
 #include <stdlib.h>
 #include <assert.h>
+#include <sys/stat.h>
 
 #include "image.h"
 #include "geometry.h"
@@ -77,10 +78,20 @@ struct mille
 	int n_local;
 
 	FILE *fh;
+
+	/* Size of the output buffer, if it was enlarged, and the number of
+	 * bytes currently in it */
+	size_t buffer_size;
+	size_t buffered;
 };
 
 typedef struct mille Mille;
 
+/* Output buffer size when writing to a file.  Records are typically a few
+ * kilobytes each, and writing them one at a time costs a lot of system calls
+ * when there are many crystals. */
+#define MILLE_FILE_BUFFER (4*1024*1024)
+
 
 static void mille_add_measurement(Mille *m,
                                   int NLC, float *derLc,
@@ -310,11 +321,21 @@ static Mille *mille_new()
 	m->int_arr = NULL;
 	m->have_local = NULL;
 	m->n_local = 0;
+	m->buffer_size = 0;
+	m->buffered = 0;
 
 	return m;
 }
 
 
+static void set_file_buffer(Mille *m)
+{
+	if ( setvbuf(m->fh, NULL, _IOFBF, MILLE_FILE_BUFFER) == 0 ) {
+		m->buffer_size = MILLE_FILE_BUFFER;
+	}
+}
+
+
 Mille *crystfel_mille_new(const char *outFileName)
 {
 	Mille *m = mille_new();
@@ -326,6 +347,7 @@ Mille *crystfel_mille_new(const char *outFileName)
 		cffree(m);
 		return NULL;
 	}
+	set_file_buffer(m);
 
 	return m;
 }
@@ -333,6 +355,7 @@ Mille *crystfel_mille_new(const char *outFileName)
 
 Mille *crystfel_mille_new_fd(int fd)
 {
+	struct stat statbuf;
 	Mille *m = mille_new();
 	if ( m == NULL ) return NULL;
 
@@ -343,6 +366,12 @@ Mille *crystfel_mille_new_fd(int fd)
 		return NULL;
 	}
 
+	/* A pipe is better left with the default buffer, so that the data
+	 * doesn't arrive in big bursts */
+	if ( (fstat(fd, &statbuf) == 0) && S_ISREG(statbuf.st_mode) ) {
+		set_file_buffer(m);
+	}
+
 	return m;
 }
 
@@ -384,6 +413,18 @@ void crystfel_mille_write_record(Mille *m)
 		}
 	}
 
+	/* Flush the buffer between records, rather than letting it happen
+	 * part way through one.  Then, if the process gets killed, the file
+	 * will only contain complete records. */
+	if ( m->buffer_size > 0 ) {
+		size_t len = (2+m->n)*sizeof(int) + (1+m->n)*sizeof(float);
+		if ( m->buffered + len > m->buffer_size ) {
+			fflush(m->fh);
+			m->buffered = 0;
+		}
+		m->buffered += len;
+	}
+
 	fwrite(&nw, sizeof(int), 1, m->fh);
 
 	fwrite(&nf, sizeof(float), 1, m->fh);
@@ -0,0 +1,747 @@
+/*
+ * datatemplate-cache.c
+ *
+ * Binary cache of parsed data templates
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <libcrystfel-config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "datatemplate.h"
+#include "image.h"
+#include "datatemplate_priv.h"
+
+
+/* The cache file contains a dtc_header, then the geometry file text exactly
+ * as it was given to data_template_new_from_string(), then the contents of
+ * the DataTemplate.  The text is the key: the cache is only used if it's
+ * identical.  Everything is in the byte order of the machine which wrote it,
+ * and the structure sizes are recorded so that a file written by a different
+ * build (with different fields) is not used. */
+#define DTC_MAGIC "CFDTCACH"
+#define DTC_VERSION (1)
+#define DTC_BYTE_ORDER (0x01020304)
+
+struct dtc_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t text_hash;
+	uint64_t text_len;
+	uint64_t data_len;
+	uint32_t sizes[4];
+};
+
+
+static char *cache_dir = NULL;
+
+
+/**
+ * \param dir A directory for cache files, or NULL
+ *
+ * Sets the directory in which data_template_new_from_string() and
+ * data_template_new_from_file() keep the parsed versions of the geometry files
+ * they read.  If the same geometry is read again, from any process, the parsed
+ * version will be loaded instead of parsing the text again.  The geometry
+ * file text is always the key, so edited geometry files are never confused
+ * with old versions.
+ *
+ * If this function is never called, the directory given by the environment
+ * variable CRYSTFEL_GEOMETRY_CACHE is used, if it is set.  If \p dir is NULL,
+ * no cache will be used, even if the environment variable is set.
+ *
+ * This should be called before any threads are started.
+ */
+void data_template_set_cache_dir(const char *dir)
+{
+	cffree(cache_dir);
+	cache_dir = cfstrdup((dir == NULL) ? "" : dir);
+}
+
+
+static const char *get_cache_dir(void)
+{
+	const char *dir = cache_dir;
+	if ( dir == NULL ) dir = getenv("CRYSTFEL_GEOMETRY_CACHE");
+	if ( (dir == NULL) || (dir[0] == '\0') ) return NULL;
+	return dir;
+}
+
+
+static void dtc_sizes(uint32_t *sizes)
+{
+	sizes[0] = sizeof(struct panel_template);
+	sizes[1] = sizeof(struct dt_badregion);
+	sizes[2] = sizeof(struct panel_group_template);
+	sizes[3] = sizeof(DataTemplate);
+}
+
+
+static uint64_t hash_text(const char *text, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	/* FNV-1a */
+	for ( i=0; i<len; i++ ) {
+		h ^= (unsigned char)text[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+
+static char *cache_filename(const char *dir, uint64_t hash)
+{
+	size_t len = strlen(dir) + 64;
+	char *filename = cfmalloc(len);
+	if ( filename == NULL ) return NULL;
+	snprintf(filename, len, "%s/geom-%016llx.dtc", dir,
+	         (unsigned long long)hash);
+	return filename;
+}
+
+
+/******************************* Serialisation ********************************/
+
+struct dtc_buf
+{
+	char *data;
+	size_t len;
+	size_t max_len;
+	int fail;
+};
+
+
+static void put(struct dtc_buf *b, const void *v, size_t n)
+{
+	if ( b->fail ) return;
+	if ( b->len + n > b->max_len ) {
+		size_t new_max = 2*b->max_len + n;
+		char *nd = cfrealloc(b->data, new_max);
+		if ( nd == NULL ) {
+			b->fail = 1;
+			return;
+		}
+		b->data = nd;
+		b->max_len = new_max;
+	}
+	memcpy(b->data+b->len, v, n);
+	b->len += n;
+}
+
+
+static void put_int(struct dtc_buf *b, int v)
+{
+	int32_t i = v;
+	put(b, &i, sizeof(i));
+}
+
+
+static void put_double(struct dtc_buf *b, double v)
+{
+	put(b, &v, sizeof(v));
+}
+
+
+static void put_str(struct dtc_buf *b, const char *s)
+{
+	if ( s == NULL ) {
+		put_int(b, -1);
+	} else {
+		size_t len = strlen(s);
+		put_int(b, len);
+		put(b, s, len);
+	}
+}
+
+
+static void put_panel(struct dtc_buf *b, const struct panel_template *p)
+{
+	int i;
+
+	put_str(b, p->name);
+	put_double(b, p->cnx);
+	put_double(b, p->cny);
+	put_double(b, p->cnz_offset);
+	for ( i=0; i<MAX_MASKS; i++ ) {
+		put_str(b, p->masks[i].data_location);
+		put_str(b, p->masks[i].filename);
+		put_int(b, p->masks[i].bad_bits);
+		put_int(b, p->masks[i].good_bits);
+		put_int(b, p->masks[i].mask_default);
+	}
+	put_str(b, p->satmap);
+	put_int(b, p->satmap_default);
+	put_str(b, p->satmap_file);
+	put_int(b, p->satmap_file_default);
+	put_int(b, p->bad);
+	put_int(b, p->mask_edge_pixels);
+	put_int(b, p->mask_edge_pixels_default);
+	put_double(b, p->pixel_pitch);
+	put_int(b, p->pixel_pitch_default);
+	put_double(b, p->adu_scale);
+	put_int(b, p->adu_scale_unit);
+	put_int(b, p->adu_scale_default);
+	put_double(b, p->max_adu);
+	put_int(b, p->max_adu_default);
+	for ( i=0; i<MAX_FLAG_VALUES; i++ ) {
+		put_int(b, p->flag_types[i]);
+		put_int(b, p->flag_values[i]);
+	}
+	put_int(b, p->flag_values_default);
+	put_str(b, p->data);
+	put_int(b, p->data_default);
+	for ( i=0; i<MAX_DIMS; i++ ) {
+		put_int(b, p->dims[i]);
+		put_int(b, p->dims_default[i]);
+	}
+	put_double(b, p->fsx);
+	put_double(b, p->fsy);
+	put_double(b, p->fsz);
+	put_double(b, p->ssx);
+	put_double(b, p->ssy);
+	put_double(b, p->ssz);
+	put_int(b, p->orig_min_fs);
+	put_int(b, p->orig_max_fs);
+	put_int(b, p->orig_min_ss);
+	put_int(b, p->orig_max_ss);
+}
+
+
+static void put_bad(struct dtc_buf *b, const struct dt_badregion *r)
+{
+	put_str(b, r->name);
+	put_int(b, r->is_fsss);
+	put_double(b, r->min_x);
+	put_double(b, r->max_x);
+	put_double(b, r->min_y);
+	put_double(b, r->max_y);
+	put_int(b, r->panel_number);
+	put_str(b, r->panel_name);
+	put_int(b, r->min_fs);
+	put_int(b, r->max_fs);
+	put_int(b, r->min_ss);
+	put_int(b, r->max_ss);
+}
+
+
+static int group_index(const DataTemplate *dt,
+                       const struct panel_group_template *gt)
+{
+	int i;
+	for ( i=0; i<dt->n_groups; i++ ) {
+		if ( dt->groups[i] == gt ) return i;
+	}
+	return -1;
+}
+
+
+static void serialise(struct dtc_buf *b, const DataTemplate *dt)
+{
+	int i;
+
+	put_int(b, dt->n_panels);
+	for ( i=0; i<dt->n_panels; i++ ) {
+		put_panel(b, &dt->panels[i]);
+	}
+
+	put_int(b, dt->n_bad);
+	for ( i=0; i<dt->n_bad; i++ ) {
+		put_bad(b, &dt->bad[i]);
+	}
+
+	put_str(b, dt->wavelength_from);
+	put_int(b, dt->wavelength_unit);
+	put_double(b, dt->bandwidth);
+
+	put_int(b, dt->n_groups);
+	for ( i=0; i<dt->n_groups; i++ ) {
+		const struct panel_group_template *gt = dt->groups[i];
+		int j;
+		put_str(b, gt->name);
+		put_int(b, gt->n_children);
+		for ( j=0; j<gt->n_children; j++ ) {
+			int idx = group_index(dt, gt->children[j]);
+			if ( idx < 0 ) b->fail = 1;
+			put_int(b, idx);
+		}
+	}
+
+	put_str(b, dt->peak_list);
+	put_int(b, dt->peak_list_type);
+	put_str(b, dt->shift_x_from);
+	put_str(b, dt->shift_y_from);
+	put_str(b, dt->cnz_from);
+
+	put_int(b, dt->n_headers_to_copy);
+	for ( i=0; i<dt->n_headers_to_copy; i++ ) {
+		put_str(b, dt->headers_to_copy[i]);
+	}
+}
+
+
+/****************************** Deserialisation *******************************/
+
+struct dtc_reader
+{
+	const char *pos;
+	const char *end;
+	int fail;
+};
+
+
+static void get(struct dtc_reader *r, void *v, size_t n)
+{
+	if ( r->fail || ((size_t)(r->end - r->pos) < n) ) {
+		r->fail = 1;
+		memset(v, 0, n);
+		return;
+	}
+	memcpy(v, r->pos, n);
+	r->pos += n;
+}
+
+
+static int get_int(struct dtc_reader *r)
+{
+	int32_t i;
+	get(r, &i, sizeof(i));
+	return i;
+}
+
+
+static double get_double(struct dtc_reader *r)
+{
+	double v;
+	get(r, &v, sizeof(v));
+	return v;
+}
+
+
+static char *get_str(struct dtc_reader *r)
+{
+	int len = get_int(r);
+	char *s;
+
+	if ( r->fail || (len == -1) ) return NULL;
+	if ( (len < 0) || (r->end - r->pos < len) ) {
+		r->fail = 1;
+		return NULL;
+	}
+
+	s = cfmalloc(len+1);
+	if ( s == NULL ) {
+		r->fail = 1;
+		return NULL;
+	}
+	memcpy(s, r->pos, len);
+	s[len] = '\0';
+	r->pos += len;
+	return s;
+}
+
+
+/* Checks that a count read from the file is within limits */
+static int get_count(struct dtc_reader *r, int max)
+{
+	int n = get_int(r);
+	if ( (n < 0) || (n > max) ) {
+		r->fail = 1;
+		return 0;
+	}
+	return n;
+}
+
+
+static void get_panel(struct dtc_reader *r, struct panel_template *p)
+{
+	int i;
+
+	p->name = get_str(r);
+	p->cnx = get_double(r);
+	p->cny = get_double(r);
+	p->cnz_offset = get_double(r);
+	for ( i=0; i<MAX_MASKS; i++ ) {
+		p->masks[i].data_location = get_str(r);
+		p->masks[i].filename = get_str(r);
+		p->masks[i].bad_bits = get_int(r);
+		p->masks[i].good_bits = get_int(r);
+		p->masks[i].mask_default = get_int(r);
+	}
+	p->satmap = get_str(r);
+	p->satmap_default = get_int(r);
+	p->satmap_file = get_str(r);
+	p->satmap_file_default = get_int(r);
+	p->bad = get_int(r);
+	p->mask_edge_pixels = get_int(r);
+	p->mask_edge_pixels_default = get_int(r);
+	p->pixel_pitch = get_double(r);
+	p->pixel_pitch_default = get_int(r);
+	p->adu_scale = get_double(r);
+	p->adu_scale_unit = get_int(r);
+	p->adu_scale_default = get_int(r);
+	p->max_adu = get_double(r);
+	p->max_adu_default = get_int(r);
+	for ( i=0; i<MAX_FLAG_VALUES; i++ ) {
+		p->flag_types[i] = get_int(r);
+		p->flag_values[i] = get_int(r);
+	}
+	p->flag_values_default = get_int(r);
+	p->data = get_str(r);
+	p->data_default = get_int(r);
+	for ( i=0; i<MAX_DIMS; i++ ) {
+		p->dims[i] = get_int(r);
+		p->dims_default[i] = get_int(r);
+	}
+	p->fsx = get_double(r);
+	p->fsy = get_double(r);
+	p->fsz = get_double(r);
+	p->ssx = get_double(r);
+	p->ssy = get_double(r);
+	p->ssz = get_double(r);
+	p->orig_min_fs = get_int(r);
+	p->orig_max_fs = get_int(r);
+	p->orig_min_ss = get_int(r);
+	p->orig_max_ss = get_int(r);
+
+	if ( p->name == NULL ) r->fail = 1;
+}
+
+
+static void get_bad(struct dtc_reader *r, struct dt_badregion *b)
+{
+	char *name = get_str(r);
+
+	if ( (name == NULL) || (strlen(name) >= sizeof(b->name)) ) {
+		r->fail = 1;
+	} else {
+		strcpy(b->name, name);
+	}
+	cffree(name);
+
+	b->is_fsss = get_int(r);
+	b->min_x = get_double(r);
+	b->max_x = get_double(r);
+	b->min_y = get_double(r);
+	b->max_y = get_double(r);
+	b->panel_number = get_int(r);
+	b->panel_name = get_str(r);
+	b->min_fs = get_int(r);
+	b->max_fs = get_int(r);
+	b->min_ss = get_int(r);
+	b->max_ss = get_int(r);
+}
+
+
+static DataTemplate *deserialise(struct dtc_reader *r)
+{
+	DataTemplate *dt;
+	int n_groups;
+	int *children;
+	int i;
+
+	dt = cfcalloc(1, sizeof(DataTemplate));
+	if ( dt == NULL ) return NULL;
+
+	/* Each panel takes much more space than this in the file */
+	dt->n_panels = get_count(r, (r->end - r->pos)/64);
+	dt->panels = cfcalloc(dt->n_panels, sizeof(struct panel_template));
+	if ( dt->panels == NULL ) r->fail = 1;
+	for ( i=0; i<dt->n_panels; i++ ) {
+		if ( r->fail ) break;
+		get_panel(r, &dt->panels[i]);
+	}
+
+	if ( !r->fail ) {
+		dt->n_bad = get_count(r, (r->end - r->pos)/64);
+		dt->bad = cfcalloc(dt->n_bad, sizeof(struct dt_badregion));
+		if ( dt->bad == NULL ) r->fail = 1;
+		for ( i=0; i<dt->n_bad; i++ ) {
+			if ( r->fail ) break;
+			get_bad(r, &dt->bad[i]);
+		}
+	}
+
+	dt->wavelength_from = get_str(r);
+	dt->wavelength_unit = get_int(r);
+	dt->bandwidth = get_double(r);
+
+	/* The child links can only be made once all groups have been read */
+	n_groups = get_count(r, MAX_PANEL_GROUPS);
+	children = cfmalloc(n_groups*MAX_PANEL_GROUP_CHILDREN*sizeof(int));
+	if ( children == NULL ) r->fail = 1;
+	for ( i=0; i<n_groups; i++ ) {
+
+		struct panel_group_template *gt;
+		int j;
+
+		if ( r->fail ) break;
+
+		gt = cfcalloc(1, sizeof(struct panel_group_template));
+		if ( gt == NULL ) {
+			r->fail = 1;
+			break;
+		}
+		dt->groups[dt->n_groups++] = gt;
+
+		gt->name = get_str(r);
+		if ( gt->name == NULL ) r->fail = 1;
+		gt->n_children = get_count(r, MAX_PANEL_GROUP_CHILDREN);
+		for ( j=0; j<gt->n_children; j++ ) {
+			children[i*MAX_PANEL_GROUP_CHILDREN+j] = get_count(r, n_groups-1);
+		}
+
+	}
+	for ( i=0; i<dt->n_groups; i++ ) {
+		struct panel_group_template *gt = dt->groups[i];
+		int j;
+		if ( r->fail ) break;
+		for ( j=0; j<gt->n_children; j++ ) {
+			gt->children[j] = dt->groups[children[i*MAX_PANEL_GROUP_CHILDREN+j]];
+		}
+	}
+	cffree(children);
+
+	dt->peak_list = get_str(r);
+	dt->peak_list_type = get_int(r);
+	dt->shift_x_from = get_str(r);
+	dt->shift_y_from = get_str(r);
+	dt->cnz_from = get_str(r);
+
+	dt->n_headers_to_copy = get_count(r, MAX_COPY_HEADERS);
+	for ( i=0; i<dt->n_headers_to_copy; i++ ) {
+		dt->headers_to_copy[i] = get_str(r);
+		if ( dt->headers_to_copy[i] == NULL ) r->fail = 1;
+	}
+
+	if ( r->pos != r->end ) r->fail = 1;
+
+	if ( !r->fail ) {
+		dt->static_maps = cfcalloc(1, sizeof(struct static_maps));
+		if ( dt->static_maps == NULL ) {
+			r->fail = 1;
+		} else {
+			pthread_mutex_init(&dt->static_maps->lock, NULL);
+		}
+	}
+
+	/* Everything not read yet is still zero (or NULL), which
+	 * data_template_free() can cope with */
+	if ( r->fail ) {
+		data_template_free(dt);
+		return NULL;
+	}
+
+	return dt;
+}
+
+
+/******************************* Cache files **********************************/
+
+static int write_all(int fd, const void *vp, size_t len)
+{
+	const char *p = vp;
+
+	while ( len > 0 ) {
+		ssize_t r = write(fd, p, len);
+		if ( r <= 0 ) return 1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+
+/* Writes to a temporary file first, so that other processes never see a
+ * partially written cache file */
+static int write_cache(const char *filename, const DataTemplate *dt,
+                       const char *text, size_t text_len, uint64_t hash)
+{
+	struct dtc_header hdr;
+	struct dtc_buf b;
+	char *tmp;
+	size_t len;
+	int fd;
+	int fail = 0;
+
+	b.data = NULL;
+	b.len = 0;
+	b.max_len = 0;
+	b.fail = 0;
+	serialise(&b, dt);
+	if ( b.fail ) {
+		cffree(b.data);
+		return 1;
+	}
+
+	len = strlen(filename) + 32;
+	tmp = cfmalloc(len);
+	if ( tmp == NULL ) {
+		cffree(b.data);
+		return 1;
+	}
+	snprintf(tmp, len, "%s.tmp%i", filename, (int)getpid());
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if ( fd == -1 ) {
+		cffree(b.data);
+		cffree(tmp);
+		return 1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, DTC_MAGIC, 8);
+	hdr.version = DTC_VERSION;
+	hdr.byte_order = DTC_BYTE_ORDER;
+	hdr.text_hash = hash;
+	hdr.text_len = text_len;
+	hdr.data_len = b.len;
+	dtc_sizes(hdr.sizes);
+
+	fail |= write_all(fd, &hdr, sizeof(hdr));
+	fail |= write_all(fd, text, text_len);
+	fail |= write_all(fd, b.data, b.len);
+	cffree(b.data);
+
+	if ( close(fd) ) fail = 1;
+	if ( !fail && rename(tmp, filename) ) fail = 1;
+	if ( fail ) unlink(tmp);
+	cffree(tmp);
+	return fail;
+}
+
+
+/* Returns NULL if the file doesn't exist or is for a different geometry */
+static DataTemplate *read_cache(const char *filename, const char *text,
+                                size_t text_len, uint64_t hash)
+{
+	struct dtc_header hdr;
+	struct stat statbuf;
+	struct dtc_reader r;
+	uint32_t sizes[4];
+	DataTemplate *dt;
+	char *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if ( fd == -1 ) return NULL;
+
+	if ( (fstat(fd, &statbuf) == -1)
+	  || (statbuf.st_size < (off_t)sizeof(hdr))
+	  || (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) )
+	{
+		close(fd);
+		return NULL;
+	}
+
+	dtc_sizes(sizes);
+	if ( (memcmp(hdr.magic, DTC_MAGIC, 8) != 0)
+	  || (hdr.version != DTC_VERSION)
+	  || (hdr.byte_order != DTC_BYTE_ORDER)
+	  || (hdr.text_hash != hash)
+	  || (hdr.text_len != text_len)
+	  || (memcmp(hdr.sizes, sizes, sizeof(sizes)) != 0)
+	  || ((uint64_t)statbuf.st_size != sizeof(hdr) + hdr.text_len
+	                                                + hdr.data_len) )
+	{
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) return NULL;
+
+	if ( memcmp(map+sizeof(hdr), text, text_len) != 0 ) {
+		munmap(map, statbuf.st_size);
+		return NULL;
+	}
+
+	r.pos = map + sizeof(hdr) + text_len;
+	r.end = r.pos + hdr.data_len;
+	r.fail = 0;
+	dt = deserialise(&r);
+
+	munmap(map, statbuf.st_size);
+	return dt;
+}
+
+
+/* Returns the template for "text" from the cache, or NULL if there isn't one
+ * (or no cache is being used) */
+DataTemplate *data_template_cache_load(const char *text)
+{
+	const char *dir = get_cache_dir();
+	DataTemplate *dt;
+	char *filename;
+	uint64_t hash;
+	size_t len;
+
+	if ( dir == NULL ) return NULL;
+
+	len = strlen(text);
+	hash = hash_text(text, len);
+	filename = cache_filename(dir, hash);
+	if ( filename == NULL ) return NULL;
+
+	dt = read_cache(filename, text, len, hash);
+	cffree(filename);
+	return dt;
+}
+
+
+/* Puts the newly parsed template for "text" in the cache, if one is being
+ * used.  Failure is not fatal, because the text can always be parsed again. */
+void data_template_cache_save(const DataTemplate *dt, const char *text)
+{
+	const char *dir = get_cache_dir();
+	char *filename;
+	uint64_t hash;
+	size_t len;
+
+	if ( dir == NULL ) return;
+
+	len = strlen(text);
+	hash = hash_text(text, len);
+	filename = cache_filename(dir, hash);
+	if ( filename == NULL ) return;
+
+	if ( write_cache(filename, dt, text, len, hash) ) {
+		ERROR("WARNING: Couldn't write geometry cache file %s\n",
+		      filename);
+	}
+	cffree(filename);
+}
@@ -1058,7 +1058,7 @@ void data_template_show_hierarchy(const DataTemplate *dtempl)
 }
 
 
-DataTemplate *data_template_new_from_string(const char *string_in)
+static DataTemplate *parse_template(const char *string_in)
 {
 	DataTemplate *dt;
 	int done = 0;
@@ -1479,6 +1479,23 @@ DataTemplate *data_template_new_from_string(const char *string_in)
 
 	if ( reject ) return NULL;
 
+	dt->static_maps = cfcalloc(1, sizeof(struct static_maps));
+	if ( dt->static_maps == NULL ) return NULL;
+	pthread_mutex_init(&dt->static_maps->lock, NULL);
+
+	return dt;
+}
+
+
+DataTemplate *data_template_new_from_string(const char *string_in)
+{
+	DataTemplate *dt;
+
+	dt = data_template_cache_load(string_in);
+	if ( dt != NULL ) return dt;
+
+	dt = parse_template(string_in);
+	if ( dt != NULL ) data_template_cache_save(dt, string_in);
 	return dt;
 }
 
@@ -1500,12 +1517,54 @@ DataTemplate *data_template_new_from_file(const char *filename)
 }
 
 
+static void free_static_badmap(uint8_t **bad, int n_panels)
+{
+	int i;
+	if ( bad == NULL ) return;
+	for ( i=0; i<n_panels; i++ ) {
+		cffree(bad[i]);
+	}
+	cffree(bad);
+}
+
+
+/* Discard the cached static bad pixel and saturation maps, e.g. because the
+ * panel positions (and hence the bad regions in x/y) have changed. */
+void data_template_reset_static_maps(const DataTemplate *dt)
+{
+	struct static_maps *sm = dt->static_maps;
+	int i;
+
+	if ( sm == NULL ) return;
+
+	pthread_mutex_lock(&sm->lock);
+	free_static_badmap(sm->bad[0], dt->n_panels);
+	free_static_badmap(sm->bad[1], dt->n_panels);
+	sm->bad[0] = NULL;
+	sm->bad[1] = NULL;
+	if ( sm->sat != NULL ) {
+		for ( i=0; i<dt->n_panels; i++ ) {
+			cffree(sm->sat[i]);
+		}
+		cffree(sm->sat);
+		sm->sat = NULL;
+	}
+	pthread_mutex_unlock(&sm->lock);
+}
+
+
 void data_template_free(DataTemplate *dt)
 {
 	int i;
 
 	if ( dt == NULL ) return;
 
+	if ( dt->static_maps != NULL ) {
+		data_template_reset_static_maps(dt);
+		pthread_mutex_destroy(&dt->static_maps->lock);
+		cffree(dt->static_maps);
+	}
+
 	for ( i=0; i<dt->n_panels; i++ ) {
 
 		int j;
@@ -2005,6 +2064,7 @@ struct detgeom *create_detgeom(struct image *image,
 	if ( detgeom == NULL ) return NULL;
 
 	detgeom->top_group = NULL;
+	detgeom->lookup = NULL;
 
 	detgeom->panels = cfmalloc(dtempl->n_panels*sizeof(struct detgeom_panel));
 	if ( detgeom->panels == NULL ) {
@@ -2208,6 +2268,7 @@ int data_template_translate_group_px(DataTemplate *dtempl, const char *group_nam
 {
 	const struct panel_group_template *group = find_group(dtempl, group_name);
 	if ( group == NULL ) return 1;
+	data_template_reset_static_maps(dtempl);
 	return translate_group_contents(dtempl, group, x, y, z, 0);
 }
 
@@ -2223,6 +2284,7 @@ int data_template_translate_group_m(DataTemplate *dtempl, const char *group_name
 {
 	const struct panel_group_template *group = find_group(dtempl, group_name);
 	if ( group == NULL ) return 1;
+	data_template_reset_static_maps(dtempl);
 	return translate_group_contents(dtempl, group, x, y, z, 1);
 }
 
@@ -2362,6 +2424,7 @@ int data_template_rotate_group(DataTemplate *dtempl, const char *group_name,
 
 	if ( group_center(dtempl, group, &cx, &cy, &cz) ) return 1;
 
+	data_template_reset_static_maps(dtempl);
 	return rotate_all_panels(dtempl, group, axis, ang, cx, cy, cz);
 }
 
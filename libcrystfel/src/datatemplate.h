@@ -56,6 +56,7 @@ extern "C" {
 #endif
 
 extern DataTemplate *data_template_new_from_file(const char *filename);
+extern void data_template_set_cache_dir(const char *dir);
 extern DataTemplate *data_template_new_from_string(const char *string_in);
 extern void data_template_free(DataTemplate *dt);
 
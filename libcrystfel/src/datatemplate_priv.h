@@ -32,6 +32,8 @@
 #ifndef DATATEMPLATE_PRIV_H
 #define DATATEMPLATE_PRIV_H
 
+#include <pthread.h>
+
 #include "detgeom.h"
 
 /* Maximum number of dimensions expected in data files */
@@ -228,6 +230,22 @@ struct panel_group_template
 };
 
 
+/* Parts of the bad pixel and saturation maps which do not depend on the
+ * event.  These are built on first use by image.c, and discarded whenever
+ * the geometry changes. */
+struct static_maps
+{
+	pthread_mutex_t lock;
+
+	/* Bad pixel maps, indexed by no_mask_data (0 or 1).  Entries are NULL
+	 * for panels without any statically bad pixels. */
+	uint8_t **bad[2];
+
+	/* Saturation maps.  Entries are NULL if not (yet) loaded */
+	float **sat;
+};
+
+
 struct _datatemplate
 {
 	struct panel_template     *panels;
@@ -256,11 +274,18 @@ struct _datatemplate
 
 	char                      *headers_to_copy[MAX_COPY_HEADERS];
 	int                        n_headers_to_copy;
+
+	struct static_maps        *static_maps;
 };
 
 extern double convert_to_m(double val, int units);
 extern struct detgeom *create_detgeom(struct image *image,
                                       const DataTemplate *dtempl,
                                       int two_d_only);
+extern void data_template_reset_static_maps(const DataTemplate *dtempl);
+
+/* In datatemplate-cache.c */
+extern DataTemplate *data_template_cache_load(const char *text);
+extern void data_template_cache_save(const DataTemplate *dt, const char *text);
 
 #endif	/* DATATEMPLATE_PRIV_H */
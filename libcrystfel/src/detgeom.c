@@ -80,6 +80,588 @@ static void free_group(struct detgeom_panel_group *g)
 }
 
 
+/* Lookup table for finding which panels could be in a given direction from
+ * the sample.  The directions are spread over the faces of a cube, each divided
+ * into LOOKUP_CELLS*LOOKUP_CELLS cells.  Each cell has a list of panels, in
+ * ascending order, which might be seen in a direction somewhere in the cell.
+ *
+ * The list for a cell contains every panel whose bounding cone (of directions
+ * from the sample) overlaps the bounding cone of the cell.  The panel cones
+ * are made wide enough to allow for a detector shift of up to LOOKUP_SHIFT. */
+
+#define LOOKUP_CELLS (16)
+#define LOOKUP_MIN_PANELS (8)
+#define LOOKUP_SHIFT (2e-3)  /* metres */
+
+/* Geometry values which the lookup depends on, for each panel */
+#define LOOKUP_N_PARAMS (12)
+
+struct detgeom_lookup
+{
+	int n_panels;
+	double *params;
+
+	int *cell_start;   /* Cell i's panels start at cell_panels[cell_start[i]] */
+	int *cell_panels;
+};
+
+
+static void free_lookup(struct detgeom_lookup *lk)
+{
+	if ( lk == NULL ) return;
+	cffree(lk->params);
+	cffree(lk->cell_start);
+	cffree(lk->cell_panels);
+	cffree(lk);
+}
+
+
+static void panel_params(const struct detgeom_panel *p, double *v)
+{
+	v[0] = p->cnx;  v[1] = p->cny;  v[2] = p->cnz;
+	v[3] = p->fsx;  v[4] = p->fsy;  v[5] = p->fsz;
+	v[6] = p->ssx;  v[7] = p->ssy;  v[8] = p->ssz;
+	v[9] = p->w;  v[10] = p->h;
+	v[11] = p->pixel_pitch;
+}
+
+
+/* Non-zero if the panels are the same as when "params" was filled in */
+static int params_match(const struct detgeom *dg, const double *params,
+                        int n_panels)
+{
+	int i;
+
+	if ( n_panels != dg->n_panels ) return 0;
+
+	for ( i=0; i<dg->n_panels; i++ ) {
+		double v[LOOKUP_N_PARAMS];
+		int j;
+		panel_params(&dg->panels[i], v);
+		for ( j=0; j<LOOKUP_N_PARAMS; j++ ) {
+			if ( v[j] != params[i*LOOKUP_N_PARAMS+j] ) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+
+static int lookup_valid(const struct detgeom *dg)
+{
+	if ( dg->lookup == NULL ) return 0;
+	return params_match(dg, dg->lookup->params, dg->lookup->n_panels);
+}
+
+
+static void normalise(double *v)
+{
+	double m = sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+	v[0] /= m;
+	v[1] /= m;
+	v[2] /= m;
+}
+
+
+static double angle_between_v(const double *a, const double *b)
+{
+	return angle_between(a[0], a[1], a[2], b[0], b[1], b[2]);
+}
+
+
+/* Direction of position (u,v) on a cube face.  u and v go from -1 to +1 */
+static void face_direction(int face, double u, double v, double *dir)
+{
+	const int axis = face/2;
+	const double sign = (face % 2) ? -1.0 : +1.0;
+
+	dir[axis] = sign;
+	dir[(axis+1)%3] = u;
+	dir[(axis+2)%3] = v;
+	normalise(dir);
+}
+
+
+/* Bounding cone of the directions to a panel, allowing for the detector being
+ * shifted by up to LOOKUP_SHIFT.  Returns non-zero if the panel is too big or
+ * close for this to be useful. */
+static int panel_cone(const struct detgeom_panel *p, double *cen,
+                      double *alpha)
+{
+	double corners[4][3];
+	double nx, ny, nz, nm, dist;
+	int i;
+
+	for ( i=0; i<4; i++ ) {
+		const double fs = (i & 1) ? p->w : 0.0;
+		const double ss = (i & 2) ? p->h : 0.0;
+		corners[i][0] = p->cnx + fs*p->fsx + ss*p->ssx;
+		corners[i][1] = p->cny + fs*p->fsy + ss*p->ssy;
+		corners[i][2] = p->cnz + fs*p->fsz + ss*p->ssz;
+	}
+
+	/* Closest that any part of the plane gets to the sample, in metres */
+	nx = p->fsy*p->ssz - p->fsz*p->ssy;
+	ny = p->fsz*p->ssx - p->fsx*p->ssz;
+	nz = p->fsx*p->ssy - p->fsy*p->ssx;
+	nm = sqrt(nx*nx + ny*ny + nz*nz);
+	dist = fabs(nx*p->cnx + ny*p->cny + nz*p->cnz) / nm;
+	dist *= p->pixel_pitch;
+	if ( !(dist > 2.0*LOOKUP_SHIFT) ) return 1;
+
+	cen[0] = 0.0;  cen[1] = 0.0;  cen[2] = 0.0;
+	for ( i=0; i<4; i++ ) {
+		normalise(corners[i]);
+		cen[0] += corners[i][0];
+		cen[1] += corners[i][1];
+		cen[2] += corners[i][2];
+	}
+	normalise(cen);
+	if ( !isfinite(cen[0]) || !isfinite(cen[1]) || !isfinite(cen[2]) ) {
+		return 1;
+	}
+
+	*alpha = 0.0;
+	for ( i=0; i<4; i++ ) {
+		double a = angle_between_v(cen, corners[i]);
+		if ( a > *alpha ) *alpha = a;
+	}
+
+	/* The panel is convex, so it's all within the cone of its corners
+	 * (unless the cone is too wide).  A shift of s moves a point at
+	 * distance d by at most asin(s/d) in angle. */
+	*alpha += asin(LOOKUP_SHIFT/dist) + 1e-6;
+	if ( *alpha > M_PI/3.0 ) return 1;
+
+	return 0;
+}
+
+
+static void cell_cone(int face, int iu, int iv, double *cen, double *beta)
+{
+	const double step = 2.0/LOOKUP_CELLS;
+	double u0 = -1.0 + iu*step;
+	double v0 = -1.0 + iv*step;
+	int i;
+
+	face_direction(face, u0+0.5*step, v0+0.5*step, cen);
+
+	*beta = 0.0;
+	for ( i=0; i<4; i++ ) {
+		double corner[3];
+		double a;
+		face_direction(face, u0 + ((i & 1) ? step : 0.0),
+		                     v0 + ((i & 2) ? step : 0.0), corner);
+		a = angle_between_v(cen, corner);
+		if ( a > *beta ) *beta = a;
+	}
+	*beta += 1e-6;
+}
+
+
+/**
+ * \param dg A \ref detgeom structure
+ *
+ * Makes sure that \p dg has an up to date lookup table for
+ * detgeom_lookup_panels(), by making a new one if the panels have moved or
+ * changed since the last one was made.  It isn't worth having a table for
+ * detectors with only a few panels, in which case there will be none.
+ *
+ * This modifies \p dg, so it must not be called while other threads might be
+ * calling detgeom_lookup_panels() for the same structure.
+ *
+ * \returns zero if the table is usable, non-zero otherwise.
+ */
+int detgeom_update_lookup(struct detgeom *dg)
+{
+	struct detgeom_lookup *lk;
+	double *cen;
+	double *cos_alpha;
+	double *sin_alpha;
+	int *always;
+	const int n_cells = 6*LOOKUP_CELLS*LOOKUP_CELLS;
+	int i, face, iu, iv;
+	int n, max_n;
+
+	if ( lookup_valid(dg) ) return 0;
+
+	free_lookup(dg->lookup);
+	dg->lookup = NULL;
+	if ( dg->n_panels < LOOKUP_MIN_PANELS ) return 1;
+
+	lk = cfmalloc(sizeof(struct detgeom_lookup));
+	if ( lk == NULL ) return 1;
+	lk->n_panels = dg->n_panels;
+	lk->params = cfmalloc(dg->n_panels*LOOKUP_N_PARAMS*sizeof(double));
+	lk->cell_start = cfmalloc((n_cells+1)*sizeof(int));
+	max_n = 4*dg->n_panels;
+	lk->cell_panels = cfmalloc(max_n*sizeof(int));
+	cen = cfmalloc(3*dg->n_panels*sizeof(double));
+	cos_alpha = cfmalloc(dg->n_panels*sizeof(double));
+	sin_alpha = cfmalloc(dg->n_panels*sizeof(double));
+	always = cfmalloc(dg->n_panels*sizeof(int));
+	if ( (lk->params == NULL) || (lk->cell_start == NULL)
+	  || (lk->cell_panels == NULL) || (cen == NULL)
+	  || (cos_alpha == NULL) || (sin_alpha == NULL) || (always == NULL) )
+	{
+		free_lookup(lk);
+		cffree(cen);
+		cffree(cos_alpha);
+		cffree(sin_alpha);
+		cffree(always);
+		return 1;
+	}
+
+	for ( i=0; i<dg->n_panels; i++ ) {
+		double alpha;
+		panel_params(&dg->panels[i], &lk->params[i*LOOKUP_N_PARAMS]);
+		always[i] = panel_cone(&dg->panels[i], &cen[3*i], &alpha);
+		cos_alpha[i] = cos(alpha);
+		sin_alpha[i] = sin(alpha);
+	}
+
+	n = 0;
+	for ( face=0; face<6; face++ ) {
+	for ( iv=0; iv<LOOKUP_CELLS; iv++ ) {
+	for ( iu=0; iu<LOOKUP_CELLS; iu++ ) {
+
+		double ccen[3];
+		double beta, cos_beta, sin_beta;
+
+		cell_cone(face, iu, iv, ccen, &beta);
+		cos_beta = cos(beta);
+		sin_beta = sin(beta);
+		lk->cell_start[(face*LOOKUP_CELLS+iv)*LOOKUP_CELLS+iu] = n;
+
+		for ( i=0; i<dg->n_panels; i++ ) {
+
+			/* The cones overlap if the angle between the centres
+			 * is less than alpha+beta.  Both are less than 90
+			 * degrees, so compare the cosines. */
+			const double *pc = &cen[3*i];
+			double c = ccen[0]*pc[0] + ccen[1]*pc[1] + ccen[2]*pc[2];
+			double cos_sum = cos_alpha[i]*cos_beta
+			               - sin_alpha[i]*sin_beta;
+
+			if ( !always[i] && (c < cos_sum) ) continue;
+
+			if ( n == max_n ) {
+				int *nl;
+				max_n *= 2;
+				nl = cfrealloc(lk->cell_panels, max_n*sizeof(int));
+				if ( nl == NULL ) {
+					free_lookup(lk);
+					cffree(cen);
+					cffree(cos_alpha);
+					cffree(sin_alpha);
+					cffree(always);
+					return 1;
+				}
+				lk->cell_panels = nl;
+			}
+			lk->cell_panels[n++] = i;
+
+		}
+
+	}
+	}
+	}
+	lk->cell_start[n_cells] = n;
+
+	cffree(cen);
+	cffree(cos_alpha);
+	cffree(sin_alpha);
+	cffree(always);
+
+	dg->lookup = lk;
+	return 0;
+}
+
+
+/**
+ * \param dg A \ref detgeom structure
+ * \param x x component of a direction from the sample
+ * \param y y component of a direction from the sample
+ * \param z z component of a direction from the sample
+ * \param shift How far the detector is shifted, in metres
+ * \param n Place to store the number of panels
+ *
+ * Finds which panels could possibly be seen in the direction (\p x, \p y,
+ * \p z) from the sample, if the panels are all moved by up to \p shift.
+ * Only the panels in the list need to be checked, and no others.  This only
+ * works if the lookup table was made by detgeom_update_lookup() since the last
+ * change to the panels.
+ *
+ * \returns the panel numbers, in ascending order, or NULL if the lookup table
+ * can't be used.  In that case, all panels must be checked.
+ */
+const int *detgeom_lookup_panels(const struct detgeom *dg,
+                                 double x, double y, double z,
+                                 double shift, int *n)
+{
+	const struct detgeom_lookup *lk = dg->lookup;
+	double ax, ay, az, u, v, m;
+	int face, iu, iv, cell;
+
+	if ( lk == NULL ) return NULL;
+	if ( !(shift <= LOOKUP_SHIFT) ) return NULL;
+
+	ax = fabs(x);  ay = fabs(y);  az = fabs(z);
+	if ( (ax >= ay) && (ax >= az) ) {
+		face = (x < 0.0) ? 1 : 0;
+		u = y;  v = z;  m = ax;
+	} else if ( ay >= az ) {
+		face = (y < 0.0) ? 3 : 2;
+		u = z;  v = x;  m = ay;
+	} else {
+		face = (z < 0.0) ? 5 : 4;
+		u = x;  v = y;  m = az;
+	}
+	if ( !(m > 0.0) || !isfinite(m) ) return NULL;
+
+	iu = (u/m + 1.0) * LOOKUP_CELLS/2.0;
+	iv = (v/m + 1.0) * LOOKUP_CELLS/2.0;
+	if ( iu < 0 ) iu = 0;
+	if ( iu >= LOOKUP_CELLS ) iu = LOOKUP_CELLS-1;
+	if ( iv < 0 ) iv = 0;
+	if ( iv >= LOOKUP_CELLS ) iv = LOOKUP_CELLS-1;
+
+	cell = (face*LOOKUP_CELLS+iv)*LOOKUP_CELLS+iu;
+	*n = lk->cell_start[cell+1] - lk->cell_start[cell];
+	return &lk->cell_panels[lk->cell_start[cell]];
+}
+
+
+/* Per-pixel maps of the scattering vector and angle.  The values are for
+ * unit wavelength (|q| is stored as 2 sin(theta), and the scattering vector
+ * as q*lambda), so that the same maps do for any wavelength.  Like the lookup
+ * table, the maps remember the panel parameters, so it's easy to tell when
+ * they no longer match the geometry. */
+struct detgeom_qmaps
+{
+	int n_panels;
+	double *params;
+	int maps;
+
+	float **qmod;
+	float **twotheta;
+	float **qvec;
+};
+
+
+static float **alloc_maps(const struct detgeom *dg, int n_per_pixel)
+{
+	float **m;
+	int i;
+
+	m = cfcalloc(dg->n_panels, sizeof(float *));
+	if ( m == NULL ) return NULL;
+
+	for ( i=0; i<dg->n_panels; i++ ) {
+		const struct detgeom_panel *p = &dg->panels[i];
+		m[i] = cfmalloc((size_t)p->w*p->h*n_per_pixel*sizeof(float));
+		if ( m[i] == NULL ) return m;  /* Caller will check */
+	}
+
+	return m;
+}
+
+
+static void free_maps(float **m, int n_panels)
+{
+	int i;
+	if ( m == NULL ) return;
+	for ( i=0; i<n_panels; i++ ) cffree(m[i]);
+	cffree(m);
+}
+
+
+static int maps_ok(float **m, int n_panels)
+{
+	int i;
+	if ( m == NULL ) return 0;
+	for ( i=0; i<n_panels; i++ ) {
+		if ( m[i] == NULL ) return 0;
+	}
+	return 1;
+}
+
+
+/**
+ * \param qm A \ref detgeom_qmaps structure, or NULL
+ *
+ * Frees \p qm and all the maps in it.
+ */
+void detgeom_qmaps_free(struct detgeom_qmaps *qm)
+{
+	if ( qm == NULL ) return;
+	free_maps(qm->qmod, qm->n_panels);
+	free_maps(qm->twotheta, qm->n_panels);
+	free_maps(qm->qvec, qm->n_panels);
+	cffree(qm->params);
+	cffree(qm);
+}
+
+
+static void fill_qmaps(struct detgeom_qmaps *qm, const struct detgeom *dg,
+                       int pn)
+{
+	const struct detgeom_panel *p = &dg->panels[pn];
+	int fs, ss;
+
+	for ( ss=0; ss<p->h; ss++ ) {
+	for ( fs=0; fs<p->w; fs++ ) {
+
+		const size_t idx = fs + (size_t)p->w*ss;
+		double xs, ys, zs, d, rx, ry, rz;
+
+		/* Same as detgeom_transform_coords(), with wavelength=1 */
+		xs = p->cnx + fs*p->fsx + ss*p->ssx;
+		ys = p->cny + fs*p->fsy + ss*p->ssy;
+		zs = p->cnz + fs*p->fsz + ss*p->ssz;
+		d = sqrt(xs*xs + ys*ys + zs*zs);
+		rx = xs/d;
+		ry = ys/d;
+		rz = zs/d - 1.0;
+
+		if ( qm->qmod != NULL ) {
+			qm->qmod[pn][idx] = modulus(rx, ry, rz);
+		}
+		if ( qm->twotheta != NULL ) {
+			qm->twotheta[pn][idx] = atan2(sqrt(xs*xs + ys*ys), zs);
+		}
+		if ( qm->qvec != NULL ) {
+			qm->qvec[pn][3*idx+0] = rx;
+			qm->qvec[pn][3*idx+1] = ry;
+			qm->qvec[pn][3*idx+2] = rz;
+		}
+
+	}
+	}
+}
+
+
+/**
+ * \param dg A \ref detgeom structure
+ * \param maps Which maps to make, as a combination of \ref DetgeomMapType
+ *
+ * Calculates per-pixel maps of the scattering vector and/or angle for \p dg,
+ * at the same positions as detgeom_transform_coords() gives for integer
+ * values of fs and ss.  The maps don't depend on the wavelength.  The vector
+ * map (DETGEOM_MAP_QVEC) takes three times as much memory as the others, so
+ * only ask for it if it will be used.
+ *
+ * The maps stay valid only as long as the panels don't move.  Use
+ * detgeom_qmaps_valid() to check before using them with a different
+ * \ref detgeom structure, or after changing the geometry.
+ *
+ * \returns the new maps, or NULL on error.
+ */
+struct detgeom_qmaps *detgeom_qmaps_new(const struct detgeom *dg, int maps)
+{
+	struct detgeom_qmaps *qm;
+	int i;
+
+	qm = cfcalloc(1, sizeof(struct detgeom_qmaps));
+	if ( qm == NULL ) return NULL;
+
+	qm->n_panels = dg->n_panels;
+	qm->maps = maps;
+	qm->params = cfmalloc(dg->n_panels*LOOKUP_N_PARAMS*sizeof(double));
+	if ( qm->params == NULL ) {
+		cffree(qm);
+		return NULL;
+	}
+	for ( i=0; i<dg->n_panels; i++ ) {
+		panel_params(&dg->panels[i], &qm->params[i*LOOKUP_N_PARAMS]);
+	}
+
+	if ( maps & DETGEOM_MAP_QMOD ) {
+		qm->qmod = alloc_maps(dg, 1);
+		if ( !maps_ok(qm->qmod, dg->n_panels) ) goto fail;
+	}
+	if ( maps & DETGEOM_MAP_TWOTHETA ) {
+		qm->twotheta = alloc_maps(dg, 1);
+		if ( !maps_ok(qm->twotheta, dg->n_panels) ) goto fail;
+	}
+	if ( maps & DETGEOM_MAP_QVEC ) {
+		qm->qvec = alloc_maps(dg, 3);
+		if ( !maps_ok(qm->qvec, dg->n_panels) ) goto fail;
+	}
+
+	for ( i=0; i<dg->n_panels; i++ ) {
+		fill_qmaps(qm, dg, i);
+	}
+
+	return qm;
+
+fail:
+	ERROR("Failed to allocate reciprocal space maps\n");
+	detgeom_qmaps_free(qm);
+	return NULL;
+}
+
+
+/**
+ * \param qm A \ref detgeom_qmaps structure, or NULL
+ * \param dg A \ref detgeom structure
+ *
+ * \returns non-zero if \p qm was made by detgeom_qmaps_new() for panels in
+ * exactly the same positions as the ones in \p dg.
+ */
+int detgeom_qmaps_valid(const struct detgeom_qmaps *qm,
+                        const struct detgeom *dg)
+{
+	if ( qm == NULL ) return 0;
+	return params_match(dg, qm->params, qm->n_panels);
+}
+
+
+/**
+ * \param qm A \ref detgeom_qmaps structure
+ * \param pn Panel number
+ *
+ * \returns the map of |q| multiplied by the wavelength (i.e. 2 sin(theta))
+ * for panel \p pn, indexed by fs + w*ss, or NULL if \p qm doesn't have it.
+ */
+const float *detgeom_qmaps_qmod(const struct detgeom_qmaps *qm, int pn)
+{
+	if ( qm->qmod == NULL ) return NULL;
+	return qm->qmod[pn];
+}
+
+
+/**
+ * \param qm A \ref detgeom_qmaps structure
+ * \param pn Panel number
+ *
+ * \returns the map of the scattering angle 2theta, in radians, for panel
+ * \p pn, indexed by fs + w*ss, or NULL if \p qm doesn't have it.
+ */
+const float *detgeom_qmaps_twotheta(const struct detgeom_qmaps *qm, int pn)
+{
+	if ( qm->twotheta == NULL ) return NULL;
+	return qm->twotheta[pn];
+}
+
+
+/**
+ * \param qm A \ref detgeom_qmaps structure
+ * \param pn Panel number
+ *
+ * \returns the map of the scattering vector multiplied by the wavelength, for
+ * panel \p pn, as three values (x, y, z) at 3*(fs + w*ss), or NULL if \p qm
+ * doesn't have it.
+ */
+const float *detgeom_qmaps_qvec(const struct detgeom_qmaps *qm, int pn)
+{
+	if ( qm->qvec == NULL ) return NULL;
+	return qm->qvec[pn];
+}
+
+
 void detgeom_free(struct detgeom *detgeom)
 {
 	int i;
@@ -91,11 +673,117 @@ void detgeom_free(struct detgeom *detgeom)
 	}
 
 	free_group(detgeom->top_group);
+	free_lookup(detgeom->lookup);
 	cffree(detgeom->panels);
 	cffree(detgeom);
 }
 
 
+static struct detgeom_panel_group *copy_group(const struct detgeom_panel_group *g,
+                                              struct detgeom_panel_group *parent,
+                                              const struct detgeom *src,
+                                              struct detgeom *dst)
+{
+	struct detgeom_panel_group *n;
+	int i;
+
+	n = cfmalloc(sizeof(struct detgeom_panel_group));
+	if ( n == NULL ) return NULL;
+
+	*n = *g;
+	n->parent = parent;
+	n->name = NULL;
+	n->children = NULL;
+	n->n_children = 0;
+	n->panel = NULL;
+
+	if ( g->name != NULL ) {
+		n->name = cfstrdup(g->name);
+		if ( n->name == NULL ) {
+			free_group(n);
+			return NULL;
+		}
+	}
+
+	if ( g->n_children == 0 ) {
+		if ( g->panel != NULL ) {
+			int pn = g->panel - src->panels;
+			n->panel = &dst->panels[pn];
+			dst->panels[pn].group = n;
+		}
+		return n;
+	}
+
+	n->children = cfcalloc(g->n_children,
+	                       sizeof(struct detgeom_panel_group *));
+	if ( n->children == NULL ) {
+		free_group(n);
+		return NULL;
+	}
+	for ( i=0; i<g->n_children; i++ ) {
+		n->children[i] = copy_group(g->children[i], n, src, dst);
+		n->n_children = i+1;
+		if ( n->children[i] == NULL ) {
+			free_group(n);
+			return NULL;
+		}
+	}
+
+	return n;
+}
+
+
+/**
+ * \param detgeom A \ref detgeom structure
+ *
+ * Makes a copy of \p detgeom, including the panel group hierarchy.  The lookup
+ * table for detgeom_lookup_panels() is not copied, and can be re-made for the
+ * copy using detgeom_update_lookup().
+ *
+ * \returns The copy, or NULL on failure.
+ */
+struct detgeom *detgeom_copy(const struct detgeom *detgeom)
+{
+	struct detgeom *n;
+	int i;
+
+	if ( detgeom == NULL ) return NULL;
+
+	n = cfmalloc(sizeof(struct detgeom));
+	if ( n == NULL ) return NULL;
+
+	n->n_panels = 0;
+	n->top_group = NULL;
+	n->lookup = NULL;
+	n->panels = cfmalloc(detgeom->n_panels*sizeof(struct detgeom_panel));
+	if ( n->panels == NULL ) {
+		cffree(n);
+		return NULL;
+	}
+
+	for ( i=0; i<detgeom->n_panels; i++ ) {
+		n->panels[i] = detgeom->panels[i];
+		n->panels[i].group = NULL;
+		n->panels[i].name = cfstrdup(detgeom->panels[i].name);
+		n->n_panels = i+1;
+		if ( n->panels[i].name == NULL ) {
+			detgeom_free(n);
+			return NULL;
+		}
+	}
+
+	if ( detgeom->top_group != NULL ) {
+		n->top_group = copy_group(detgeom->top_group, NULL, detgeom, n);
+		if ( n->top_group == NULL ) {
+			detgeom_free(n);
+			return NULL;
+		}
+	}
+
+	return n;
+}
+
+
 static double panel_max_res(struct detgeom_panel *p,
                             double wavelength)
 {
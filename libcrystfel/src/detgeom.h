@@ -112,12 +112,18 @@ struct detgeom_panel_group
 };
 
 
+struct detgeom_lookup;
+
 struct detgeom
 {
 	struct detgeom_panel *panels;
 	int n_panels;
 
 	struct detgeom_panel_group *top_group;
+
+	/** Which panels might be in which direction, or NULL.
+	 * See detgeom_update_lookup() */
+	struct detgeom_lookup *lookup;
 };
 
 
@@ -129,6 +135,8 @@ extern void detgeom_transform_coords(struct detgeom_panel *p,
 
 extern void detgeom_free(struct detgeom *detgeom);
 
+extern struct detgeom *detgeom_copy(const struct detgeom *detgeom);
+
 extern double detgeom_max_resolution(struct detgeom *detgeom,
                                      double wavelength);
 
@@ -147,6 +155,45 @@ extern int detgeom_group_center(const struct detgeom_panel_group *grp,
 
 extern gsl_matrix **make_panel_minvs(struct detgeom *dg);
 
+extern int detgeom_update_lookup(struct detgeom *dg);
+
+extern const int *detgeom_lookup_panels(const struct detgeom *dg,
+                                        double x, double y, double z,
+                                        double shift, int *n);
+
+/**
+ * Per-pixel maps which can be made by detgeom_qmaps_new()
+ */
+typedef enum
+{
+	/** Modulus of the scattering vector, times the wavelength */
+	DETGEOM_MAP_QMOD = 1,
+
+	/** Scattering angle (2theta) */
+	DETGEOM_MAP_TWOTHETA = 2,
+
+	/** Scattering vector, times the wavelength */
+	DETGEOM_MAP_QVEC = 4,
+
+} DetgeomMapType;
+
+struct detgeom_qmaps;
+
+extern struct detgeom_qmaps *detgeom_qmaps_new(const struct detgeom *dg,
+                                               int maps);
+
+extern int detgeom_qmaps_valid(const struct detgeom_qmaps *qm,
+                               const struct detgeom *dg);
+
+extern const float *detgeom_qmaps_qmod(const struct detgeom_qmaps *qm, int pn);
+
+extern const float *detgeom_qmaps_twotheta(const struct detgeom_qmaps *qm,
+                                           int pn);
+
+extern const float *detgeom_qmaps_qvec(const struct detgeom_qmaps *qm, int pn);
+
+extern void detgeom_qmaps_free(struct detgeom_qmaps *qm);
+
 #ifdef __cplusplus
 }
 #endif
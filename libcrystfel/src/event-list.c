@@ -0,0 +1,232 @@
+/*
+ * event-list.c
+ *
+ * Binary lists of events
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <libcrystfel-config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "event-list.h"
+#include "utils.h"
+
+
+/* The file starts with this.  The leading zero byte can't be the start of a
+ * filename in a text list, so one byte is enough to tell the formats apart.
+ *
+ * Then come records, each a type byte followed by a 32-bit little-endian
+ * length and that many bytes of string (without a terminator):
+ *    'F' - a filename, which applies to the events after it
+ *    'E' - an event in the most recent file
+ */
+#define EVENT_LIST_MAGIC "\0CFEVL1\n"
+#define EVENT_LIST_MAGIC_LEN (8)
+
+/* Sanity limit for the length of a string */
+#define EVENT_LIST_MAX_STR (1024*1024)
+
+
+/**
+ * \param fh A file handle, open for writing
+ *
+ * Writes the start of a binary event list.  Call this once, before
+ * event_list_write_file() and event_list_write_event().
+ *
+ * \returns zero on success.
+ */
+int event_list_write_header(FILE *fh)
+{
+	if ( fwrite(EVENT_LIST_MAGIC, 1, EVENT_LIST_MAGIC_LEN, fh)
+	     != EVENT_LIST_MAGIC_LEN ) return 1;
+	return 0;
+}
+
+
+static int write_record(FILE *fh, char type, const char *str)
+{
+	size_t len = strlen(str);
+	unsigned char buf[5];
+
+	buf[0] = type;
+	buf[1] = len & 0xff;
+	buf[2] = (len >> 8) & 0xff;
+	buf[3] = (len >> 16) & 0xff;
+	buf[4] = (len >> 24) & 0xff;
+
+	if ( fwrite(buf, 1, 5, fh) != 5 ) return 1;
+	if ( fwrite(str, 1, len, fh) != len ) return 1;
+	return 0;
+}
+
+
+/**
+ * \param fh A file handle, open for writing
+ * \param filename A data filename
+ *
+ * Writes a record to a binary event list, saying that the following events
+ * are in \p filename.
+ *
+ * \returns zero on success.
+ */
+int event_list_write_file(FILE *fh, const char *filename)
+{
+	return write_record(fh, 'F', filename);
+}
+
+
+/**
+ * \param fh A file handle, open for writing
+ * \param ev An event ID
+ *
+ * Writes a record to a binary event list for event \p ev in the file most
+ * recently given to event_list_write_file().
+ *
+ * \returns zero on success.
+ */
+int event_list_write_event(FILE *fh, const char *ev)
+{
+	return write_record(fh, 'E', ev);
+}
+
+
+/**
+ * \param fh A file handle, open for reading, at the start of a list of events
+ *
+ * Finds out whether \p fh contains a binary event list or a text list.  If
+ * the list is binary, the header is read, and the events can be read with
+ * event_list_read().  Otherwise, nothing is taken from \p fh, so this works
+ * for pipes as well as files.
+ *
+ * \returns 1 for a binary event list, 0 for a text list, or -1 if the file
+ * looks like a binary list but is not a valid one.
+ */
+int event_list_is_binary(FILE *fh)
+{
+	char magic[EVENT_LIST_MAGIC_LEN];
+	int c;
+
+	c = fgetc(fh);
+	if ( c == EOF ) return 0;
+	if ( c != '\0' ) {
+		ungetc(c, fh);
+		return 0;
+	}
+
+	magic[0] = c;
+	if ( fread(&magic[1], 1, EVENT_LIST_MAGIC_LEN-1, fh)
+	     != EVENT_LIST_MAGIC_LEN-1 ) return -1;
+	if ( memcmp(magic, EVENT_LIST_MAGIC, EVENT_LIST_MAGIC_LEN) != 0 ) {
+		return -1;
+	}
+
+	return 1;
+}
+
+
+/* Returns 0 at the end of the file, -1 on error */
+static int read_record(FILE *fh, char *ptype, char **pstr)
+{
+	unsigned char buf[5];
+	uint32_t len;
+	size_t n;
+	char *str;
+
+	n = fread(buf, 1, 5, fh);
+	if ( n == 0 ) return feof(fh) ? 0 : -1;
+	if ( n != 5 ) return -1;
+
+	len = (uint32_t)buf[1]
+	    | ((uint32_t)buf[2] << 8)
+	    | ((uint32_t)buf[3] << 16)
+	    | ((uint32_t)buf[4] << 24);
+	if ( len > EVENT_LIST_MAX_STR ) return -1;
+
+	str = cfmalloc(len+1);
+	if ( str == NULL ) return -1;
+	if ( fread(str, 1, len, fh) != len ) {
+		cffree(str);
+		return -1;
+	}
+	str[len] = '\0';
+
+	*ptype = buf[0];
+	*pstr = str;
+	return 1;
+}
+
+
+/**
+ * \param fh A file handle, after event_list_is_binary() returned 1
+ * \param pfilename Location of the current filename
+ * \param pev Location at which to store the event ID
+ *
+ * Reads the next event from a binary event list.  If the event is in a
+ * different file from the previous one, a newly allocated filename is put in
+ * \p pfilename, replacing (but not freeing) the old value.  Otherwise,
+ * \p pfilename is not changed.  Set it to NULL before reading the first event,
+ * and compare the values before and after to know when the file changes.
+ *
+ * The event ID is newly allocated, and must be freed by the caller.
+ *
+ * \returns 1 if an event was read, 0 at the end of the list, or -1 on error.
+ */
+int event_list_read(FILE *fh, char **pfilename, char **pev)
+{
+	char *orig = *pfilename;
+
+	do {
+
+		char type;
+		char *str;
+		int r;
+
+		r = read_record(fh, &type, &str);
+		if ( r != 1 ) return r;
+
+		if ( type == 'F' ) {
+			/* A file without any events */
+			if ( *pfilename != orig ) cffree(*pfilename);
+			*pfilename = str;
+		} else if ( type == 'E' ) {
+			if ( *pfilename == NULL ) {
+				ERROR("Event list has an event before the "
+				      "first filename\n");
+				cffree(str);
+				return -1;
+			}
+			*pev = str;
+			return 1;
+		} else {
+			cffree(str);
+			ERROR("Unrecognised record in event list\n");
+			return -1;
+		}
+
+	} while ( 1 );
+}
@@ -0,0 +1,55 @@
+/*
+ * event-list.h
+ *
+ * Binary lists of events
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef EVENT_LIST_H
+#define EVENT_LIST_H
+
+#include <stdio.h>
+
+/**
+ * \file event-list.h
+ * Binary lists of events, as an alternative to text lists with one
+ * "filename event" per line.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int event_list_write_header(FILE *fh);
+extern int event_list_write_file(FILE *fh, const char *filename);
+extern int event_list_write_event(FILE *fh, const char *ev);
+
+extern int event_list_is_binary(FILE *fh);
+extern int event_list_read(FILE *fh, char **pfilename, char **pev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* EVENT_LIST_H */
@@ -31,6 +31,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <math.h>
 #include <string.h>
 #include <assert.h>
@@ -38,50 +39,203 @@
 #include <gsl/gsl_blas.h>
 
 #include "image.h"
+#include "thread-pool.h"
 
 /** \file filters.h */
 
-static void filter_noise_in_panel(float *data, int width, int height)
+/* Flags the pixels in one row which have a negative pixel next to them
+ * (or are negative themselves) along the row */
+static void noise_row_flags(const float *row, uint8_t *neg, uint8_t *flags,
+                            int width)
 {
-	int x, y;
+	int x;
 
-	for ( y=0; y<height; y++ ) {
 	for ( x=0; x<width; x++ ) {
+		neg[x] = row[x] < 0.0f;
+	}
 
-		int dx, dy;
-		float val = data[x+width*y];
+	flags[0] = neg[0] | ((width > 1) ? neg[1] : 0);
+	for ( x=1; x<width-1; x++ ) {
+		flags[x] = neg[x-1] | neg[x] | neg[x+1];
+	}
+	if ( width > 1 ) flags[width-1] = neg[width-2] | neg[width-1];
+}
 
-		/* This isn't really the right thing to do at the edges,
-		 * but this filter is so horrible it's unlikely to matter. */
-		if ( (x==0) || (x==width-1)
-		  || (y==0) || (y==height-1) ) {
-			if ( val < 0 ) {
-				data[x+width*y] = 0.0;
-			}
-			continue;
-		}
 
-		for ( dy=-1; dy<=+1; dy++ ) {
-		for ( dx=-1; dx<=+1; dx++ ) {
-			if ( data[(x+dx)+width*(y+dy)] ) val = 0.0;
+/* Sets each pixel to zero if any pixel in the 3x3 square centered on it is
+ * negative.  At the edges, only the part of the square inside the panel
+ * counts.  The flags for the rows above, at and below the current one are
+ * kept in a rolling buffer, so \p out can be the same as \p in.
+ * The scratch space needs to be 4*width bytes. */
+static void filter_noise_in_panel(const float *in, float *out,
+                                  int width, int height, uint8_t *scratch)
+{
+	uint8_t *neg = scratch;
+	uint8_t *rows[3];
+	int y;
+
+	rows[0] = scratch + width;
+	rows[1] = scratch + 2*width;
+	rows[2] = scratch + 3*width;
+
+	memset(rows[0], 0, width);
+	noise_row_flags(in, neg, rows[1], width);
+
+	for ( y=0; y<height; y++ ) {
+
+		const uint8_t *above = rows[y % 3];
+		const uint8_t *here = rows[(y+1) % 3];
+		uint8_t *below = rows[(y+2) % 3];
+		const float *src = in + width*y;
+		float *dst = out + width*y;
+		int x;
+
+		/* Must be done before row y is overwritten, or row y+1 */
+		if ( y+1 < height ) {
+			noise_row_flags(in + width*(y+1), neg, below, width);
+		} else {
+			memset(below, 0, width);
 		}
+
+		for ( x=0; x<width; x++ ) {
+			int zero = above[x] | here[x] | below[x];
+			dst[x] = zero ? 0.0f : src[x];
 		}
 
-		data[x+width*y] = val;
+	}
+}
+
+
+struct noise_job
+{
+	struct detgeom *det;
+	float **in;
+	float **out;
+	uint8_t **scratch;
+	int next_panel;
+};
+
+
+struct noise_task
+{
+	struct noise_job *job;
+	int pn;
+};
+
+
+static void *noise_get_task(void *vp)
+{
+	struct noise_job *job = vp;
+	struct noise_task *task;
+
+	if ( job->next_panel >= job->det->n_panels ) return NULL;
+
+	task = cfmalloc(sizeof(struct noise_task));
+	if ( task == NULL ) return NULL;
+	task->job = job;
+	task->pn = job->next_panel++;
+	return task;
+}
+
+
+static void noise_work(void *vp, int cookie)
+{
+	struct noise_task *task = vp;
+	struct noise_job *job = task->job;
+	struct detgeom_panel *p = &job->det->panels[task->pn];
+
+	/* The cookie is the worker number, so each one has its own scratch */
+	filter_noise_in_panel(job->in[task->pn], job->out[task->pn],
+	                      p->w, p->h, job->scratch[cookie]);
+}
+
+
+static void noise_final(void *vp, void *task)
+{
+	cffree(task);
+}
+
+
+/**
+ * \param det: Detector geometry
+ * \param in: Image data to filter, one array per panel
+ * \param out: Arrays for the filtered data, one per panel
+ * \param n_threads: Number of threads to use
+ *
+ * As filter_noise_data(), but if \p n_threads is more than one, the panels
+ * will be filtered in parallel, using the default thread pool if it has the
+ * right number of threads.
+ */
+void filter_noise_data_threaded(struct detgeom *det, float **in, float **out,
+                                int n_threads)
+{
+	uint8_t **scratch;
+	int max_w = 0;
+	int pn, i;
+
+	if ( n_threads < 1 ) n_threads = 1;
+	if ( det->n_panels < 2 ) n_threads = 1;
+
+	for ( pn=0; pn<det->n_panels; pn++ ) {
+		if ( det->panels[pn].w > max_w ) max_w = det->panels[pn].w;
+	}
 
+	/* One scratch area for each worker, shared by all of its panels */
+	scratch = cfcalloc(n_threads, sizeof(uint8_t *));
+	if ( scratch == NULL ) {
+		ERROR("Failed to allocate noise filter buffers.\n");
+		return;
 	}
+	for ( i=0; i<n_threads; i++ ) {
+		scratch[i] = cfmalloc(4*max_w);
+		if ( scratch[i] == NULL ) {
+			ERROR("Failed to allocate noise filter buffers.\n");
+			n_threads = i;
+			goto out;
+		}
+	}
+
+	if ( n_threads > 1 ) {
+		struct noise_job job;
+		job.det = det;
+		job.in = in;
+		job.out = out;
+		job.scratch = scratch;
+		job.next_panel = 0;
+		run_threads(n_threads, noise_work, noise_get_task,
+		            noise_final, &job, 0, 0, 0, 0);
+	} else {
+		for ( pn=0; pn<det->n_panels; pn++ ) {
+			struct detgeom_panel *p = &det->panels[pn];
+			filter_noise_in_panel(in[pn], out[pn], p->w, p->h,
+			                      scratch[0]);
+		}
 	}
+
+out:
+	for ( i=0; i<n_threads; i++ ) cffree(scratch[i]);
+	cffree(scratch);
 }
 
 
-void filter_noise(struct image *image)
+/**
+ * \param det: Detector geometry
+ * \param in: Image data to filter, one array per panel
+ * \param out: Arrays for the filtered data, one per panel
+ *
+ * Applies the noise filter to \p in, putting the result in \p out.  The two
+ * can be the same, to filter in place.  Each pixel is set to zero if any of
+ * the pixels in the 3x3 square centered on it are negative.
+ */
+void filter_noise_data(struct detgeom *det, float **in, float **out)
 {
-	int i;
+	filter_noise_data_threaded(det, in, out, 1);
+}
 
-	for ( i=0; i<image->detgeom->n_panels; i++ ) {
-		struct detgeom_panel *p = &image->detgeom->panels[i];
-		filter_noise_in_panel(image->dp[i], p->w, p->h);
-	}
+
+void filter_noise(struct image *image)
+{
+	filter_noise_data(image->detgeom, image->dp, image->dp);
 }
 
 
@@ -123,80 +277,535 @@ static float kth_smallest(float *a, int n, int k)
 #undef SWAP
 
 
-void filter_median(struct image *image, int size)
+/* The simple way, for panels where the fast way can't be used */
+static int median_panel_simple(const float *in, float *out, int w, int h,
+                               int size)
 {
-	int counter;
 	int nn;
 	float *buffer;
-	int pn;
-
-	if ( size <= 0 ) return;
+	float *localBg;
+	int fs, ss;
+	int i;
 
 	nn = 2*size+1;
 	nn = nn*nn;
 
-	/* "localBg" is way too big, but guaranteed big enough */
 	buffer = cfcalloc(nn, sizeof(float));
-	if ( buffer == NULL ) {
+	localBg = cfcalloc(w*h, sizeof(float));
+	if ( (buffer == NULL) || (localBg == NULL) ) {
 		ERROR("Failed to allocate LB buffer.\n");
-		return;
+		cffree(buffer);
+		cffree(localBg);
+		return 1;
 	}
 
-	/* Determine local background
-	 * (median over window width either side of current pixel) */
-	for ( pn=0; pn<image->detgeom->n_panels; pn++ ) {
+	for ( ss=0; ss<h; ss++ ) {
+	for ( fs=0; fs<w; fs++ ) {
 
-		int fs, ss;
-		int i;
-		struct detgeom_panel *p;
-		float *localBg;
+		int ifs, iss;
+		int counter = 0;
+
+		// Loop over median window
+		for ( iss=-size; iss<=size; iss++ ) {
+		for ( ifs=-size; ifs<=size; ifs++ ) {
+
+			int idx;
 
-		p = &image->detgeom->panels[pn];
+			if ( (fs+ifs) < 0 ) continue;
+			if ( (fs+ifs) >= w ) continue;
+			if ( (ss+iss) < 0 ) continue;
+			if ( (ss+iss) >= h ) continue;
 
-		localBg = cfcalloc(p->w*p->h, sizeof(float));
-		if ( localBg == NULL ) {
-			ERROR("Failed to allocate LB buffer.\n");
-			return;
+			idx = fs+ifs + (ss+iss)*w;
+			buffer[counter++] = in[idx];
+
+		}
 		}
 
-		for ( ss=0; ss<p->h; ss++ ) {
-		for ( fs=0; fs<p->w; fs++ ) {
+		// Find median value
+		localBg[fs+w*ss] = kth_smallest(buffer, counter, counter/2);
 
-			int ifs, iss;
+	}
+	}
 
-			counter = 0;
+	/* Do the background subtraction */
+	for ( i=0; i<w*h; i++ ) {
+		out[i] = in[i] - localBg[i];
+	}
 
-			// Loop over median window
-			for ( iss=-size; iss<=size; iss++ ) {
-			for ( ifs=-size; ifs<=size; ifs++ ) {
+	cffree(localBg);
+	cffree(buffer);
+	return 0;
+}
 
-				int idx;
 
-				if ( (fs+ifs) < 0 ) continue;
-				if ( (fs+ifs) >= p->w ) continue;
-				if ( (ss+iss) < 0 ) continue;
-				if ( (ss+iss) >= p->h ) continue;
+/* Sliding window median, after Huang et al., IEEE Trans. Acoust. Speech
+ * Signal Process. 27 (1979) 13.  The window moves one pixel at a time, in a
+ * zig-zag over the panel, and the histogram of the values in the window is
+ * updated by adding and removing one row or column of pixels.
+ *
+ * The histogram is over the ranks of the distinct values in the panel, not
+ * the values themselves, so the results are exactly the same as for
+ * median_panel_simple().  It has several levels, so that the median can move
+ * quickly over big gaps between values. */
 
-				idx = fs+ifs + (ss+iss)*p->w;
-				buffer[counter++] = image->dp[pn][idx];
+#define MEDIAN_HIST_MAX_LEVELS (3)
 
+struct median_hist
+{
+	/* count[0][q] is the number of pixels with rank q, and count[l][b] is
+	 * the number in block b of 2^(l*shift) ranks */
+	int *count[MEDIAN_HIST_MAX_LEVELS];
+	int n_levels;
+	int shift;
+	int n;         /* Number of pixels in the window */
+	int m;         /* Current guess for the rank of the median */
+	int lt;        /* Number of pixels in the window with ranks below m */
+};
+
+
+static void median_hist_update(struct median_hist *hist, const int *ranks,
+                               int w, int r0, int r1, int c0, int c1, int sign)
+{
+	int r, c;
+
+	for ( r=r0; r<=r1; r++ ) {
+		for ( c=c0; c<=c1; c++ ) {
+			int q = ranks[c+w*r];
+			int l;
+			for ( l=0; l<hist->n_levels; l++ ) {
+				hist->count[l][q >> (l*hist->shift)] += sign;
 			}
+			hist->n += sign;
+			if ( q < hist->m ) hist->lt += sign;
+		}
+	}
+}
+
+
+/* Changes the range of rows from [*pa0,*pa1] to [a0,a1], within columns
+ * [b0,b1], or (with swap=1) the range of columns within rows */
+static void median_hist_move(struct median_hist *hist, const int *ranks, int w,
+                             int *pa0, int *pa1, int a0, int a1,
+                             int b0, int b1, int swap)
+{
+	int old0 = *pa0;
+	int old1 = *pa1;
+	int lo, hi;
+
+	/* Remove the parts of the old range which are outside the new one */
+	hi = (old1 < a0-1) ? old1 : a0-1;
+	if ( old0 <= hi ) {
+		if ( swap ) median_hist_update(hist, ranks, w, b0, b1, old0, hi, -1);
+		else median_hist_update(hist, ranks, w, old0, hi, b0, b1, -1);
+	}
+	lo = (old0 > a1+1) ? old0 : a1+1;
+	if ( lo <= old1 ) {
+		if ( swap ) median_hist_update(hist, ranks, w, b0, b1, lo, old1, -1);
+		else median_hist_update(hist, ranks, w, lo, old1, b0, b1, -1);
+	}
+
+	/* Add the parts of the new range which weren't in the old one */
+	hi = (a1 < old0-1) ? a1 : old0-1;
+	if ( a0 <= hi ) {
+		if ( swap ) median_hist_update(hist, ranks, w, b0, b1, a0, hi, +1);
+		else median_hist_update(hist, ranks, w, a0, hi, b0, b1, +1);
+	}
+	lo = (a0 > old1+1) ? a0 : old1+1;
+	if ( lo <= a1 ) {
+		if ( swap ) median_hist_update(hist, ranks, w, b0, b1, lo, a1, +1);
+		else median_hist_update(hist, ranks, w, lo, a1, b0, b1, +1);
+	}
+
+	*pa0 = a0;
+	*pa1 = a1;
+}
+
+
+/* Returns the rank of the k-th smallest pixel in the window, starting from
+ * the previous answer.  Whole blocks are skipped at once where possible. */
+static int median_hist_kth(struct median_hist *hist, int k)
+{
+	while ( hist->lt > k ) {
+
+		int l;
+
+		for ( l=hist->n_levels-1; l>0; l-- ) {
+			int sh = l*hist->shift;
+			int b;
+			if ( hist->m & ((1<<sh)-1) ) continue;
+			b = (hist->m >> sh) - 1;
+			if ( hist->lt - hist->count[l][b] > k ) {
+				hist->lt -= hist->count[l][b];
+				hist->m -= 1<<sh;
+				break;
 			}
+		}
+
+		if ( l == 0 ) {
+			hist->m--;
+			hist->lt -= hist->count[0][hist->m];
+		}
+	}
+
+	while ( hist->lt + hist->count[0][hist->m] <= k ) {
+
+		int l;
+
+		for ( l=hist->n_levels-1; l>0; l-- ) {
+			int sh = l*hist->shift;
+			int b;
+			if ( hist->m & ((1<<sh)-1) ) continue;
+			b = hist->m >> sh;
+			if ( hist->lt + hist->count[l][b] <= k ) {
+				hist->lt += hist->count[l][b];
+				hist->m += 1<<sh;
+				break;
+			}
+		}
+
+		if ( l == 0 ) {
+			hist->lt += hist->count[0][hist->m];
+			hist->m++;
+		}
+	}
+
+	return hist->m;
+}
+
 
-			// Find median value
-			localBg[fs+p->w*ss] = kth_smallest(buffer, counter,
-			                                   counter/2);
+static void free_median_hist(struct median_hist *hist)
+{
+	int l;
+	for ( l=0; l<hist->n_levels; l++ ) cffree(hist->count[l]);
+}
+
+
+static int alloc_median_hist(struct median_hist *hist, int n_vals)
+{
+	int l;
+	int bits = 0;
+	int fail = 0;
+
+	/* Two levels are enough for a small number of distinct values, and
+	 * faster to update */
+	while ( (1<<bits) < n_vals ) bits++;
+	hist->n_levels = (bits > 12) ? 3 : 2;
+	hist->shift = (bits + hist->n_levels - 1) / hist->n_levels;
+	if ( hist->shift == 0 ) hist->shift = 1;
+
+	for ( l=0; l<hist->n_levels; l++ ) {
+		int n = (n_vals >> (l*hist->shift)) + 1;
+		hist->count[l] = cfcalloc(n, sizeof(int));
+		if ( hist->count[l] == NULL ) fail = 1;
+	}
+	if ( fail ) {
+		free_median_hist(hist);
+		return 1;
+	}
+
+	hist->n = 0;
+	hist->m = 0;
+	hist->lt = 0;
+	return 0;
+}
+
+
+static uint32_t float_sort_key(float v)
+{
+	uint32_t u;
+
+	/* Otherwise -0 and +0 would get different ranks */
+	if ( v == 0.0f ) v = 0.0f;
+
+	memcpy(&u, &v, sizeof(u));
+	if ( u & 0x80000000u ) return ~u;
+	return u | 0x80000000u;
+}
+
+
+/* Puts the ranks of the distinct values in ranks[], and the values in
+ * vals[] (which must be big enough for n values).  Returns the number of
+ * distinct values, or -1 on error. */
+static int rank_values_sorted(const float *data, int n, int *ranks, float *vals)
+{
+	uint32_t *keys[2];
+	int *idx[2];
+	int pass, i;
+	int cur = 0;
+	int n_vals = 0;
+
+	keys[0] = cfmalloc(n*sizeof(uint32_t));
+	keys[1] = cfmalloc(n*sizeof(uint32_t));
+	idx[0] = cfmalloc(n*sizeof(int));
+	idx[1] = cfmalloc(n*sizeof(int));
+	if ( (keys[0] == NULL) || (keys[1] == NULL)
+	  || (idx[0] == NULL) || (idx[1] == NULL) )
+	{
+		cffree(keys[0]);  cffree(keys[1]);
+		cffree(idx[0]);  cffree(idx[1]);
+		return -1;
+	}
+
+	for ( i=0; i<n; i++ ) {
+		keys[0][i] = float_sort_key(data[i]);
+		idx[0][i] = i;
+	}
 
+	/* Radix sort, one byte at a time */
+	for ( pass=0; pass<4; pass++ ) {
+
+		int count[257];
+		int shift = 8*pass;
+		int nxt = 1-cur;
+
+		for ( i=0; i<257; i++ ) count[i] = 0;
+		for ( i=0; i<n; i++ ) count[((keys[cur][i]>>shift) & 0xff)+1]++;
+		for ( i=0; i<256; i++ ) count[i+1] += count[i];
+
+		for ( i=0; i<n; i++ ) {
+			int d = count[(keys[cur][i]>>shift) & 0xff]++;
+			keys[nxt][d] = keys[cur][i];
+			idx[nxt][d] = idx[cur][i];
 		}
+		cur = nxt;
+	}
+
+	for ( i=0; i<n; i++ ) {
+		if ( (i == 0) || (keys[cur][i] != keys[cur][i-1]) ) {
+			vals[n_vals++] = data[idx[cur][i]];
+		}
+		ranks[idx[cur][i]] = n_vals-1;
+	}
+
+	cffree(keys[0]);  cffree(keys[1]);
+	cffree(idx[0]);  cffree(idx[1]);
+	return n_vals;
+}
+
+
+/* As rank_values_sorted(), but returns 0 if the fast way (for integer
+ * values, not too spread out) can't be used */
+static int rank_values_integer(const float *data, int n, int *ranks,
+                               float **pvals)
+{
+	float min = +INFINITY;
+	float max = -INFINITY;
+	float *vals;
+	int n_vals;
+	int i;
+
+	for ( i=0; i<n; i++ ) {
+		if ( data[i] != rintf(data[i]) ) return 0;
+		if ( data[i] < min ) min = data[i];
+		if ( data[i] > max ) max = data[i];
+	}
+
+	if ( (double)max - min >= (n > 65536 ? n : 65536) ) return 0;
+	n_vals = max - min + 1;
+
+	vals = cfmalloc(n_vals*sizeof(float));
+	if ( vals == NULL ) return -1;
+	for ( i=0; i<n_vals; i++ ) vals[i] = min + i;
+	for ( i=0; i<n; i++ ) ranks[i] = data[i] - min;
+
+	*pvals = vals;
+	return n_vals;
+}
+
+
+/* Returns -1 if the simple way would be faster, or 1 on error */
+static int median_panel_fast(const float *in, float *out, int w, int h,
+                             int size)
+{
+	struct median_hist hist;
+	int *ranks;
+	float *vals = NULL;
+	int n_vals;
+	int r0, r1, c0, c1;
+	int fs, ss;
+
+	ranks = cfmalloc(w*h*sizeof(int));
+	if ( ranks == NULL ) return 1;
+
+	n_vals = rank_values_integer(in, w*h, ranks, &vals);
+	if ( n_vals == 0 ) {
+
+		/* Sorting costs more than a small window saves */
+		if ( size <= 2 ) {
+			cffree(ranks);
+			return -1;
 		}
 
-		/* Do the background subtraction */
-		for ( i=0; i<p->w*p->h; i++ ) {
-			image->dp[pn][i] -= localBg[i];
+		vals = cfmalloc(w*h*sizeof(float));
+		if ( vals == NULL ) {
+			cffree(ranks);
+			return 1;
 		}
+		n_vals = rank_values_sorted(in, w*h, ranks, vals);
+	}
+	if ( n_vals < 0 ) {
+		cffree(ranks);
+		cffree(vals);
+		return 1;
+	}
 
-		cffree(localBg);
+	if ( alloc_median_hist(&hist, n_vals) ) {
+		cffree(ranks);
+		cffree(vals);
+		return 1;
 	}
 
-	cffree(buffer);
+	/* Start with an empty window */
+	r0 = 0;  r1 = -1;
+	c0 = 0;  c1 = -1;
+
+	for ( ss=0; ss<h; ss++ ) {
+
+		int nr0 = (ss-size < 0) ? 0 : ss-size;
+		int nr1 = (ss+size >= h) ? h-1 : ss+size;
+		int dir = (ss % 2) ? -1 : +1;
+		int i;
+
+		median_hist_move(&hist, ranks, w, &r0, &r1, nr0, nr1,
+		                 c0, c1, 0);
+
+		for ( i=0; i<w; i++ ) {
+
+			int nc0, nc1;
+
+			fs = (dir > 0) ? i : w-1-i;
+			nc0 = (fs-size < 0) ? 0 : fs-size;
+			nc1 = (fs+size >= w) ? w-1 : fs+size;
+
+			median_hist_move(&hist, ranks, w, &c0, &c1, nc0, nc1,
+			                 r0, r1, 1);
+
+			out[fs+w*ss] = in[fs+w*ss]
+			               - vals[median_hist_kth(&hist, hist.n/2)];
+		}
+	}
+
+	free_median_hist(&hist);
+	cffree(ranks);
+	cffree(vals);
+	return 0;
+}
+
+
+static int median_panel(const float *in, float *out, int w, int h, int size)
+{
+	int i, r;
+
+	/* NaNs can't be ranked */
+	for ( i=0; i<w*h; i++ ) {
+		if ( isnan(in[i]) ) {
+			return median_panel_simple(in, out, w, h, size);
+		}
+	}
+
+	r = median_panel_fast(in, out, w, h, size);
+	if ( r < 0 ) return median_panel_simple(in, out, w, h, size);
+	if ( r ) {
+		ERROR("Failed to allocate median filter buffers.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+struct median_job
+{
+	struct detgeom *det;
+	float **in;
+	float **out;
+	int size;
+	int next_panel;
+};
+
+
+struct median_task
+{
+	struct median_job *job;
+	int pn;
+};
+
+
+static void *median_get_task(void *vp)
+{
+	struct median_job *job = vp;
+	struct median_task *task;
+
+	if ( job->next_panel >= job->det->n_panels ) return NULL;
+
+	task = cfmalloc(sizeof(struct median_task));
+	if ( task == NULL ) return NULL;
+	task->job = job;
+	task->pn = job->next_panel++;
+	return task;
+}
+
+
+static void median_work(void *vp, int cookie)
+{
+	struct median_task *task = vp;
+	struct median_job *job = task->job;
+	struct detgeom_panel *p = &job->det->panels[task->pn];
+
+	median_panel(job->in[task->pn], job->out[task->pn], p->w, p->h,
+	             job->size);
+}
+
+
+static void median_final(void *vp, void *task)
+{
+	cffree(task);
+}
+
+
+/**
+ * \param det: Detector geometry
+ * \param in: Image data to filter, one array per panel
+ * \param out: Arrays for the filtered data, one per panel
+ * \param size: Half-width of the median window
+ * \param n_threads: Number of threads to use
+ *
+ * Subtracts the local median, over a window of \p size pixels either side of
+ * each pixel, from \p in and puts the result in \p out.  The two can be the
+ * same, to filter in place.
+ *
+ * The time taken grows linearly, rather than quadratically, with \p size.
+ * If \p n_threads is more than one, the panels will be filtered in parallel,
+ * using the default thread pool if it has the right number of threads.
+ */
+void filter_median_data(struct detgeom *det, float **in, float **out,
+                        int size, int n_threads)
+{
+	int pn;
+
+	if ( size <= 0 ) return;
+
+	if ( (n_threads > 1) && (det->n_panels > 1) ) {
+		struct median_job job;
+		job.det = det;
+		job.in = in;
+		job.out = out;
+		job.size = size;
+		job.next_panel = 0;
+		run_threads(n_threads, median_work, median_get_task,
+		            median_final, &job, 0, 0, 0, 0);
+		return;
+	}
+
+	for ( pn=0; pn<det->n_panels; pn++ ) {
+		struct detgeom_panel *p = &det->panels[pn];
+		median_panel(in[pn], out[pn], p->w, p->h, size);
+	}
+}
+
+
+void filter_median(struct image *image, int size)
+{
+	filter_median_data(image->detgeom, image->dp, image->dp, size, 1);
 }
@@ -29,6 +29,9 @@
 #ifndef FILTERS_H
 #define FILTERS_H
 
+#include "image.h"
+#include "detgeom.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -40,6 +43,11 @@ extern "C" {
 extern void filter_cm(struct image *image);
 extern void filter_noise(struct image *image);
 extern void filter_median(struct image *image, int size);
+extern void filter_noise_data(struct detgeom *det, float **in, float **out);
+extern void filter_noise_data_threaded(struct detgeom *det, float **in,
+                                       float **out, int n_threads);
+extern void filter_median_data(struct detgeom *det, float **in, float **out,
+                               int size, int n_threads);
 
 #ifdef __cplusplus
 }
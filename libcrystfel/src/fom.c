@@ -40,6 +40,8 @@
 #include "cell-utils.h"
 #include "reflist.h"
 #include "reflist-utils.h"
+#include "thread-pool.h"
+#include "possible-refls.h"
 
 /**
  * \file fom.h
@@ -73,6 +75,35 @@ struct fom_context
 };
 
 
+static void free_fom(struct fom_context *fctx)
+{
+	int i;
+
+	cffree(fctx->num2);
+	cffree(fctx->den2);
+	cffree(fctx->num);
+	cffree(fctx->den);
+	cffree(fctx->n_meas);
+	if ( fctx->vec1 != NULL ) {
+		for ( i=0; i<fctx->nshells; i++ ) {
+			cffree(fctx->vec1[i]);
+		}
+		cffree(fctx->vec1);
+	}
+	if ( fctx->vec2 != NULL ) {
+		for ( i=0; i<fctx->nshells; i++ ) {
+			cffree(fctx->vec2[i]);
+		}
+		cffree(fctx->vec2);
+	}
+	cffree(fctx->n);
+	cffree(fctx->n_within);
+	cffree(fctx->possible);
+	cffree(fctx->cts);
+	cffree(fctx);
+}
+
+
 static struct fom_context *init_fom(enum fom_type fom, int nmax, int nshells)
 {
 	struct fom_context *fctx;
@@ -180,27 +211,49 @@ static struct fom_context *init_fom(enum fom_type fom, int nmax, int nshells)
 	return fctx;
 
 out:
-	cffree(fctx->num2);
-	cffree(fctx->den2);
-	cffree(fctx->num);
-	cffree(fctx->den);
-	cffree(fctx->n_meas);
-	if ( fctx->vec1 != NULL ) {
-		for ( i=0; i<nshells; i++ ) {
-			cffree(fctx->vec1[i]);
+	free_fom(fctx);
+	return NULL;
+}
+
+
+/* Adds the sums from "from" to "to".  The CC values from "from" go after the
+ * ones already in "to", so the results don't depend on the number of threads */
+static void merge_fom(struct fom_context *to, struct fom_context *from)
+{
+	int i;
+
+	for ( i=0; i<to->nshells; i++ ) {
+
+		to->cts[i] += from->cts[i];
+
+		if ( to->num != NULL ) {
+			to->num[i] += from->num[i];
+			to->den[i] += from->den[i];
 		}
-		cffree(fctx->vec1);
-	}
-	if ( fctx->vec2 != NULL ) {
-		for ( i=0; i<nshells; i++ ) {
-			cffree(fctx->vec2[i]);
+
+		if ( to->num2 != NULL ) {
+			to->num2[i] += from->num2[i];
+			to->den2[i] += from->den2[i];
 		}
-		cffree(fctx->vec2);
+
+		if ( to->vec1 != NULL ) {
+			assert(to->n[i] + from->n[i] <= to->nmax);
+			memcpy(&to->vec1[i][to->n[i]], from->vec1[i],
+			       from->n[i]*sizeof(double));
+			memcpy(&to->vec2[i][to->n[i]], from->vec2[i],
+			       from->n[i]*sizeof(double));
+			to->n[i] += from->n[i];
+		}
+
+		if ( to->n_within != NULL ) {
+			to->n_within[i] += from->n_within[i];
+		}
+
+		if ( to->n_meas != NULL ) {
+			to->n_meas[i] += from->n_meas[i];
+		}
+
 	}
-	cffree(fctx->n);
-	cffree(fctx->n_within);
-	cffree(fctx);
-	return NULL;
 }
 
 
@@ -796,66 +849,38 @@ static int wilson_scale(RefList *list1, RefList *list2, UnitCell *cell)
 }
 
 
+/* Counts the possible unique reflections in each shell into "possible" */
+static int count_possible(long int *possible, struct fom_shells *shells,
+                          UnitCell *cell, const SymOpList *sym, int n_threads)
+{
+	PossibleRefls *p;
+
+	p = possible_refls_get(cell, sym, shells->rmaxs[shells->nshells-1],
+	                       n_threads);
+	if ( p == NULL ) return 1;
+
+	possible_refls_count_shells(p, shells->nshells, shells->rmins,
+	                            shells->rmaxs, possible);
+	possible_refls_free(p);
+	return 0;
+}
+
+
 static int calculate_possible(struct fom_context *fctx,
                               struct fom_shells *shells,
                               UnitCell *cell,
-                              const SymOpList *sym)
+                              const SymOpList *sym,
+                              int n_threads)
 {
-	RefList *counted;
-	int hmax, kmax, lmax;
-	double ax, ay, az;
-	double bx, by, bz;
-	double cx, cy, cz;
-	signed int h, k, l;
-
 	fctx->possible = cfcalloc(fctx->nshells, sizeof(long int));
 	if ( fctx->possible == NULL ) return 1;
 
-	counted = reflist_new();
-	if ( counted == NULL ) {
+	if ( count_possible(fctx->possible, shells, cell, sym, n_threads) ) {
 		cffree(fctx->possible);
+		fctx->possible = NULL;
 		return 1;
 	}
 
-	cell_get_cartesian(cell, &ax, &ay, &az,
-	                         &bx, &by, &bz,
-	                         &cx, &cy, &cz);
-	hmax = shells->rmaxs[fctx->nshells-1] * modulus(ax, ay, az);
-	kmax = shells->rmaxs[fctx->nshells-1] * modulus(bx, by, bz);
-	lmax = shells->rmaxs[fctx->nshells-1] * modulus(cx, cy, cz);
-	for ( h=-hmax; h<=hmax; h++ ) {
-	for ( k=-kmax; k<=kmax; k++ ) {
-	for ( l=-lmax; l<=lmax; l++ ) {
-
-		double d;
-		signed int hs, ks, ls;
-		int bin;
-		int i;
-
-		get_asymm(sym, h, k, l, &hs, &ks, &ls);
-		d = 2.0 * resolution(cell, hs, ks, ls);
-
-		if ( forbidden_reflection(cell, h, k, l) ) continue;
-
-		bin = -1;
-		for ( i=0; i<fctx->nshells; i++ ) {
-			if ( (d>shells->rmins[i]) && (d<=shells->rmaxs[i]) ) {
-				bin = i;
-				break;
-			}
-		}
-		if ( bin == -1 ) continue;
-
-		if ( find_refl(counted, hs, ks, ls) != NULL ) continue;
-		add_refl(counted, hs, ks, ls);
-
-		fctx->possible[bin]++;
-
-	}
-	}
-	}
-	reflist_free(counted);
-
 	return 0;
 }
 
@@ -953,6 +978,323 @@ static int is_single_list(enum fom_type fom)
 }
 
 
+/* Adds one reflection (and its partners) to the context.  Returns non-zero if
+ * the reflection was rejected by add_to_fom(). */
+static int calculate_refl(struct fom_context *fctx, Reflection *refl1,
+                          RefList *list1, RefList *list2, UnitCell *cell,
+                          struct fom_shells *shells, const SymOpList *sym,
+                          long int *n_out)
+{
+	enum fom_type fom = fctx->fom;
+	signed int h, k, l;
+	int bin;
+	Reflection *refl2;
+	Reflection *refl1_bij = NULL;
+	Reflection *refl2_bij = NULL;
+
+	get_indices(refl1, &h, &k, &l);
+
+	if ( is_single_list(fom) ) {
+		refl2 = NULL;
+	} else {
+		refl2 = find_refl(list2, h, k, l);
+		if ( refl2 == NULL ) return 0;
+	}
+
+	bin = get_bin(shells, refl1, cell);
+	if ( bin == -1 ) {
+		(*n_out)++;
+		return 0;
+	}
+
+	if ( fom_is_anomalous(fom) ) {
+
+		signed int hb, kb, lb;
+
+		if ( find_equiv_in_list(list1, -h, -k, -l, sym,
+		                        &hb, &kb, &lb) )
+		{
+			refl1_bij = find_refl(list1, hb, kb, lb);
+		}
+
+		if ( find_equiv_in_list(list2, -h, -k, -l, sym,
+		                        &hb, &kb, &lb) )
+		{
+			refl2_bij = find_refl(list2, hb, kb, lb);
+		}
+
+		/* Each reflection must only be counted once, whether
+		 * we are visiting it now as "normal" or "bij" */
+		if ( get_flag(refl1) ) return 0;
+		assert(!get_flag(refl2));
+		set_flag(refl1, 1);
+		set_flag(refl1_bij, 1);
+		set_flag(refl2, 1);
+		set_flag(refl2_bij, 1);
+
+		assert(refl1_bij != NULL);
+		assert(refl2_bij != NULL);
+
+	}
+
+	return add_to_fom(fctx, refl1, refl2, refl1_bij, refl2_bij, bin);
+}
+
+
+/* Adds one reflection to the context for each figure of merit.  With more than
+ * one, they must all be single-list figures of merit (see
+ * fom_calculate_multi()), and the resolution bin is only found once. */
+static void calculate_refl_multi(struct fom_context **fctx, int n_foms,
+                                 Reflection *refl1, RefList *list1,
+                                 RefList *list2, UnitCell *cell,
+                                 struct fom_shells *shells,
+                                 const SymOpList *sym,
+                                 long int *n_out, long int *n_rej)
+{
+	int bin;
+	int f;
+
+	if ( n_foms == 1 ) {
+		n_rej[0] += calculate_refl(fctx[0], refl1, list1, list2, cell,
+		                           shells, sym, n_out);
+		return;
+	}
+
+	bin = get_bin(shells, refl1, cell);
+	if ( bin == -1 ) {
+		(*n_out)++;
+		return;
+	}
+
+	for ( f=0; f<n_foms; f++ ) {
+		n_rej[f] += add_to_fom(fctx[f], refl1, NULL, NULL, NULL, bin);
+	}
+}
+
+
+struct fom_part
+{
+	struct fom_context **fctx;  /* One for each figure of merit */
+	long int n_out;
+	long int *n_rej;
+};
+
+
+struct fom_calc_args
+{
+	struct reflist_partition *part;
+	struct fom_part *parts;
+	int n_started;
+	const enum fom_type *foms;
+	int n_foms;
+	RefList *list1;
+	RefList *list2;
+	UnitCell *cell;
+	struct fom_shells *shells;
+	const SymOpList *sym;
+};
+
+
+struct fom_calc_job
+{
+	struct fom_calc_args *args;
+	int i;
+};
+
+
+static void *get_fom_part(void *vqargs)
+{
+	struct fom_calc_args *qargs = vqargs;
+	struct fom_calc_job *job;
+
+	job = cfmalloc(sizeof(struct fom_calc_job));
+	if ( job == NULL ) return NULL;
+	job->args = qargs;
+	job->i = qargs->n_started++;
+	return job;
+}
+
+
+static void calculate_fom_part(void *vjob, int cookie)
+{
+	struct fom_calc_job *job = vjob;
+	struct fom_calc_args *args = job->args;
+	struct fom_part *p = &args->parts[job->i];
+	int start = args->part->start[job->i];
+	int end = args->part->start[job->i+1];
+	int j, f;
+
+	p->n_out = 0;
+	p->n_rej = cfcalloc(args->n_foms, sizeof(long int));
+	p->fctx = cfcalloc(args->n_foms, sizeof(struct fom_context *));
+	if ( (p->n_rej == NULL) || (p->fctx == NULL) ) return;
+	for ( f=0; f<args->n_foms; f++ ) {
+		p->fctx[f] = init_fom(args->foms[f], end-start,
+		                      args->shells->nshells);
+		if ( p->fctx[f] == NULL ) return;
+	}
+
+	for ( j=start; j<end; j++ ) {
+		calculate_refl_multi(p->fctx, args->n_foms,
+		                     args->part->refls[j],
+		                     args->list1, args->list2, args->cell,
+		                     args->shells, args->sym,
+		                     &p->n_out, p->n_rej);
+	}
+}
+
+
+static void finalise_fom_part(void *vqargs, void *vjob)
+{
+	cffree(vjob);
+}
+
+
+/* Accumulates the reflections in parts (normally one per thread, see
+ * reduction_parts()), in parallel, and combines the parts in order.  Returns
+ * non-zero on error. */
+static int calculate_parallel(struct fom_context **fctx,
+                              const enum fom_type *foms, int n_foms,
+                              RefList *list1, RefList *list2, UnitCell *cell,
+                              struct fom_shells *shells, const SymOpList *sym,
+                              int n_threads, long int *n_out, long int *n_rej)
+{
+	struct fom_calc_args args;
+	int i, f;
+	int r = 0;
+	int n_parts = reduction_parts(n_threads);
+
+	args.part = reflist_partition(list1, n_parts);
+	if ( args.part == NULL ) return 1;
+	args.parts = cfcalloc(n_parts, sizeof(struct fom_part));
+	if ( args.parts == NULL ) {
+		reflist_free_partition(args.part);
+		return 1;
+	}
+	args.n_started = 0;
+	args.foms = foms;
+	args.n_foms = n_foms;
+	args.list1 = list1;
+	args.list2 = list2;
+	args.cell = cell;
+	args.shells = shells;
+	args.sym = sym;
+
+	/* Make sure the reciprocal cell has been calculated, because
+	 * resolution() would otherwise update the cell in each thread */
+	resolution(cell, 1, 0, 0);
+
+	run_threads(n_threads, calculate_fom_part, get_fom_part,
+	            finalise_fom_part, &args, n_parts, 0, 0, 0);
+
+	for ( i=0; i<n_parts; i++ ) {
+		struct fom_part *p = &args.parts[i];
+		if ( (p->fctx == NULL) || (p->n_rej == NULL) ) {
+			r = 1;
+		} else {
+			for ( f=0; f<n_foms; f++ ) {
+				if ( p->fctx[f] == NULL ) {
+					r = 1;
+					continue;
+				}
+				merge_fom(fctx[f], p->fctx[f]);
+				n_rej[f] += p->n_rej[f];
+				free_fom(p->fctx[f]);
+			}
+			*n_out += p->n_out;
+		}
+		cffree(p->fctx);
+		cffree(p->n_rej);
+	}
+
+	cffree(args.parts);
+	reflist_free_partition(args.part);
+	return r;
+}
+
+
+/* Calculates the figures of merit, with the lists already prepared for the
+ * comparison if necessary.  Returns non-zero on error. */
+static int calculate_foms(RefList *list1, RefList *list2, UnitCell *cell,
+                          struct fom_shells *shells,
+                          const enum fom_type *foms, int n_foms,
+                          const SymOpList *sym, int n_threads,
+                          struct fom_context **fctx)
+{
+	Reflection *refl1;
+	RefListIterator *iter;
+	long int n_out = 0;
+	long int *n_rej;
+	int f;
+
+	n_rej = cfcalloc(n_foms, sizeof(long int));
+	if ( n_rej == NULL ) return 1;
+
+	for ( f=0; f<n_foms; f++ ) {
+		fctx[f] = init_fom(foms[f], num_reflections(list1),
+		                   shells->nshells);
+		if ( fctx[f] == NULL ) {
+			ERROR("Couldn't allocate memory for resolution "
+			      "shells.\n");
+			while ( f-- > 0 ) free_fom(fctx[f]);
+			cffree(n_rej);
+			return 1;
+		}
+	}
+
+	if ( (reduction_parts(n_threads) > 1) && !fom_is_anomalous(foms[0]) ) {
+
+		if ( calculate_parallel(fctx, foms, n_foms, list1, list2,
+		                        cell, shells, sym, n_threads,
+		                        &n_out, n_rej) )
+		{
+			ERROR("Failed to calculate figure of merit.\n");
+			for ( f=0; f<n_foms; f++ ) free_fom(fctx[f]);
+			cffree(n_rej);
+			return 1;
+		}
+
+	} else {
+
+		for ( refl1 = first_refl(list1, &iter);
+		      refl1 != NULL;
+		      refl1 = next_refl(refl1, iter) )
+		{
+			calculate_refl_multi(fctx, n_foms, refl1, list1, list2,
+			                     cell, shells, sym, &n_out, n_rej);
+		}
+
+	}
+
+	if ( n_out )  {
+		ERROR("WARNING: %i reflection pairs outside range.\n", n_out);
+	}
+
+	for ( f=0; f<n_foms; f++ ) {
+
+		if ( n_rej[f] ) {
+			if ( foms[f] == FOM_SNR ) {
+				ERROR("WARNING: %li reflections had infinite "
+				      "or invalid values of I/sigma(I).\n",
+				      n_rej[f]);
+			} else {
+				ERROR("WARNING: %li reflections rejected by "
+				      "add_to_fom\n", n_rej[f]);
+			}
+		}
+
+		if ( foms[f] == FOM_COMPLETENESS ) {
+			calculate_possible(fctx[f], shells, cell, sym,
+			                   n_threads);
+		}
+
+	}
+
+	cffree(n_rej);
+	return 0;
+}
+
+
 /**
  * \param list1: A %RefList
  * \param list2: A %RefList
@@ -978,19 +1320,39 @@ static int is_single_list(enum fom_type fom)
 struct fom_context *fom_calculate(RefList *list1, RefList *list2, UnitCell *cell,
                                   struct fom_shells *shells, enum fom_type fom,
                                   int noscale, const SymOpList *sym)
+{
+	return fom_calculate_threaded(list1, list2, cell, shells, fom,
+	                              noscale, sym, 1);
+}
+
+
+/**
+ * \param list1: A %RefList
+ * \param list2: A %RefList
+ * \param cell: A %UnitCell
+ * \param shells: A %fom_shells structure
+ * \param fom: The figure of merit to calculate
+ * \param noscale: Non-zero to disable scaline of reflection lists
+ * \param sym: The symmetry of \p list1 and \p list2.
+ * \param n_threads: The number of threads to use
+ *
+ * Like fom_calculate(), but divides the reflections between \p n_threads
+ * threads.  The result is the same as with fom_calculate().  The anomalous
+ * figures of merit are always calculated with one thread, because they need
+ * to visit pairs of reflections.
+ *
+ * \returns a %fom_context structure.
+ */
+struct fom_context *fom_calculate_threaded(RefList *list1, RefList *list2,
+                                           UnitCell *cell,
+                                           struct fom_shells *shells,
+                                           enum fom_type fom, int noscale,
+                                           const SymOpList *sym,
+                                           int n_threads)
 {
 	Reflection *refl1;
 	RefListIterator *iter;
 	struct fom_context *fctx;
-	long int n_out = 0;
-	long int n_rej = 0;
-
-	fctx = init_fom(fom, num_reflections(list1), shells->nshells);
-
-	if ( fctx == NULL ) {
-		ERROR("Couldn't allocate memory for resolution shells.\n");
-		return NULL;
-	}
 
 	if ( !is_single_list(fom) ) {
 		if ( !noscale && wilson_scale(list1, list2, cell) ) {
@@ -1012,82 +1374,57 @@ struct fom_context *fom_calculate(RefList *list1, RefList *list2, UnitCell *cell
 		}
 	}
 
-	for ( refl1 = first_refl(list1, &iter);
-	      refl1 != NULL;
-	      refl1 = next_refl(refl1, iter) )
+	if ( calculate_foms(list1, list2, cell, shells, &fom, 1, sym,
+	                    n_threads, &fctx) )
 	{
-		signed int h, k, l;
-		int bin;
-		Reflection *refl2;
-		Reflection *refl1_bij = NULL;
-		Reflection *refl2_bij = NULL;
-
-		get_indices(refl1, &h, &k, &l);
-
-		if ( is_single_list(fom) ) {
-			refl2 = NULL;
-		} else {
-			refl2 = find_refl(list2, h, k, l);
-			if ( refl2 == NULL ) continue;
-		}
-
-		bin = get_bin(shells, refl1, cell);
-		if ( bin == -1 ) {
-			n_out++;
-			continue;
-		}
-
-		if ( fom_is_anomalous(fom) ) {
-
-			signed int hb, kb, lb;
-
-			if ( find_equiv_in_list(list1, -h, -k, -l, sym,
-			                        &hb, &kb, &lb) )
-			{
-				refl1_bij = find_refl(list1, hb, kb, lb);
-			}
-
-			if ( find_equiv_in_list(list2, -h, -k, -l, sym,
-			                        &hb, &kb, &lb) )
-			{
-				refl2_bij = find_refl(list2, hb, kb, lb);
-			}
+		return NULL;
+	}
 
-			/* Each reflection must only be counted once, whether
-			 * we are visiting it now as "normal" or "bij" */
-			if ( get_flag(refl1) ) continue;
-			assert(!get_flag(refl2));
-			set_flag(refl1, 1);
-			set_flag(refl1_bij, 1);
-			set_flag(refl2, 1);
-			set_flag(refl2_bij, 1);
+	return fctx;
+}
 
-			assert(refl1_bij != NULL);
-			assert(refl2_bij != NULL);
 
-		}
+/**
+ * \param list: A %RefList
+ * \param cell: A %UnitCell
+ * \param shells: A %fom_shells structure
+ * \param foms: The figures of merit to calculate
+ * \param n_foms: The number of figures of merit in \p foms
+ * \param sym: The symmetry of \p list
+ * \param n_threads: The number of threads to use
+ * \param fctx: Array of \p n_foms pointers, in which to store the results
+ *
+ * Calculates several figures of merit for one reflection list, visiting each
+ * reflection only once.  The results are the same as from calling
+ * fom_calculate_threaded() for each figure of merit in turn.
+ *
+ * Only the figures of merit which don't involve comparison or anomalous
+ * differences can be calculated in this way: %FOM_NUM_MEASUREMENTS,
+ * %FOM_REDUNDANCY, %FOM_SNR, %FOM_MEAN_INTENSITY and %FOM_COMPLETENESS.
+ * You should have called fom_select_reflections() to pre-process the list.
+ *
+ * \returns zero on success, or non-zero on error.
+ */
+int fom_calculate_multi(RefList *list, UnitCell *cell,
+                        struct fom_shells *shells,
+                        const enum fom_type *foms, int n_foms,
+                        const SymOpList *sym, int n_threads,
+                        struct fom_context **fctx)
+{
+	int f;
 
-		n_rej += add_to_fom(fctx, refl1, refl2, refl1_bij, refl2_bij, bin);
+	if ( n_foms < 1 ) return 1;
 
-	}
-	if ( n_out )  {
-		ERROR("WARNING: %i reflection pairs outside range.\n", n_out);
-	}
-	if ( n_rej ) {
-		if ( fom == FOM_SNR ) {
-			ERROR("WARNING: %li reflections had infinite or "
-			      "invalid values of I/sigma(I).\n", n_rej);
-		} else {
-			ERROR("WARNING: %li reflections rejected by add_to_fom\n",
-			      n_rej);
+	for ( f=0; f<n_foms; f++ ) {
+		if ( !is_single_list(foms[f]) ) {
+			ERROR("%s can't be calculated with "
+			      "fom_calculate_multi()\n", fom_name(foms[f]));
+			return 1;
 		}
 	}
 
-	if ( fom == FOM_COMPLETENESS ) {
-		calculate_possible(fctx, shells, cell, sym);
-	}
-
-	return fctx;
+	return calculate_foms(list, NULL, cell, shells, foms, n_foms, sym,
+	                      n_threads, fctx);
 }
 
 
@@ -1475,6 +1812,306 @@ int fom_shell_num_possible(struct fom_context *fctx, int i)
 }
 
 
+/* Running sums for one resolution shell of a %fom_stream */
+struct fom_stream_shell
+{
+	long int n_meas;
+	long int n_refl;
+	double sum_mean;
+
+	/* For CC1/2, with x and y being the means of the two half-sets */
+	long int cc_n;
+	double sx;
+	double sy;
+	double sxx;
+	double syy;
+	double sxy;
+
+	/* For Rsplit */
+	double rs_num;
+	double rs_den;
+
+	/* For I/sigI */
+	long int snr_n;
+	double snr_sum;
+};
+
+
+struct fom_stream
+{
+	UnitCell *cell;
+	struct fom_shells *shells;
+	const SymOpList *sym;
+	int min_meas;
+
+	/* For each half-set, the reflections hold the running mean as the
+	 * intensity, the sum of squared deviations as temp1, and the number
+	 * of measurements as the redundancy */
+	RefList *half[2];
+
+	struct fom_stream_shell *s;
+	long int *possible;
+};
+
+
+/**
+ * \param cell: A %UnitCell
+ * \param shells: A %fom_shells structure
+ * \param sym: The point group for merging
+ * \param min_meas: The minimum number of measurements for a reflection to count
+ *
+ * Creates a %fom_stream, which accumulates individual intensity measurements and
+ * can give the values of some figures of merit at any time, without merging the
+ * data again.  The \p cell, \p shells and \p sym must remain valid for as long
+ * as the %fom_stream is in use.
+ *
+ * \returns a new %fom_stream, or NULL on error.
+ */
+struct fom_stream *fom_stream_new(UnitCell *cell, struct fom_shells *shells,
+                                  const SymOpList *sym, int min_meas)
+{
+	struct fom_stream *fs;
+
+	fs = cfmalloc(sizeof(struct fom_stream));
+	if ( fs == NULL ) return NULL;
+
+	fs->cell = cell;
+	fs->shells = shells;
+	fs->sym = sym;
+	fs->min_meas = min_meas;
+	fs->half[0] = reflist_new();
+	fs->half[1] = reflist_new();
+	fs->s = cfcalloc(shells->nshells, sizeof(struct fom_stream_shell));
+	fs->possible = cfcalloc(shells->nshells, sizeof(long int));
+
+	if ( (fs->half[0] == NULL) || (fs->half[1] == NULL)
+	  || (fs->s == NULL) || (fs->possible == NULL)
+	  || count_possible(fs->possible, shells, cell, sym, 1) )
+	{
+		fom_stream_free(fs);
+		return NULL;
+	}
+
+	return fs;
+}
+
+
+/**
+ * \param fs: A %fom_stream
+ *
+ * Frees a %fom_stream created with fom_stream_new().
+ */
+void fom_stream_free(struct fom_stream *fs)
+{
+	if ( fs == NULL ) return;
+	reflist_free(fs->half[0]);
+	reflist_free(fs->half[1]);
+	cffree(fs->s);
+	cffree(fs->possible);
+	cffree(fs);
+}
+
+
+static int stream_bin(struct fom_shells *s, double d)
+{
+	int i;
+
+	for ( i=0; i<s->nshells; i++ ) {
+		if ( (d>s->rmins[i]) && (d<=s->rmaxs[i]) ) return i;
+	}
+	return -1;
+}
+
+
+/* Adds (sign=+1) or removes (sign=-1) the contribution of one unique reflection
+ * to the shell sums.  Either of the half-set reflections can be NULL. */
+static void stream_contribute(struct fom_stream_shell *sh, Reflection *r1,
+                              Reflection *r2, int min_meas, int sign)
+{
+	int n1 = (r1 != NULL) ? get_redundancy(r1) : 0;
+	int n2 = (r2 != NULL) ? get_redundancy(r2) : 0;
+	int n = n1 + n2;
+	double m1 = (n1 > 0) ? get_intensity(r1) : 0.0;
+	double m2 = (n2 > 0) ? get_intensity(r2) : 0.0;
+	double M2, mean, snr;
+
+	if ( (n == 0) || (n < min_meas) ) return;
+
+	mean = (n1*m1 + n2*m2) / n;
+	sh->n_meas += sign*n;
+	sh->n_refl += sign;
+	sh->sum_mean += sign*mean;
+
+	if ( (n1 > 0) && (n2 > 0) ) {
+		sh->cc_n += sign;
+		sh->sx += sign*m1;
+		sh->sy += sign*m2;
+		sh->sxx += sign*m1*m1;
+		sh->syy += sign*m2*m2;
+		sh->sxy += sign*m1*m2;
+		sh->rs_num += sign*fabs(m1-m2);
+		sh->rs_den += sign*(m1+m2);
+	}
+
+	if ( n < 2 ) return;
+
+	/* Combine the half-sets in the same way as process_hkl */
+	M2 = ((n1 > 0) ? get_temp1(r1) : 0.0) + ((n2 > 0) ? get_temp1(r2) : 0.0);
+	if ( (n1 > 0) && (n2 > 0) ) M2 += (m2-m1)*(m2-m1)*n1*n2/n;
+	snr = mean / (sqrt(M2/n)/sqrt(n));
+	if ( isfinite(snr) ) {
+		sh->snr_n += sign;
+		sh->snr_sum += sign*snr;
+	}
+}
+
+
+/**
+ * \param fs: A %fom_stream
+ * \param h: Indices of the measurement
+ * \param k: Indices of the measurement
+ * \param l: Indices of the measurement
+ * \param intensity: The measured intensity, already scaled and corrected
+ * \param half: The half-set (0 or 1) to which the measurement belongs
+ *
+ * Adds one intensity measurement to \p fs.  This takes a time which does not
+ * depend on the amount of data already added.
+ *
+ * \returns zero if the measurement was added, or non-zero if it was outside the
+ * resolution range of the shells.
+ */
+int fom_stream_add(struct fom_stream *fs, signed int h, signed int k,
+                   signed int l, double intensity, int half)
+{
+	struct fom_stream_shell *sh;
+	Reflection *r[2];
+	double mean, M2, delta;
+	int bin, n;
+
+	get_asymm(fs->sym, h, k, l, &h, &k, &l);
+	bin = stream_bin(fs->shells, 2.0*resolution(fs->cell, h, k, l));
+	if ( bin == -1 ) return 1;
+	sh = &fs->s[bin];
+
+	r[0] = find_refl(fs->half[0], h, k, l);
+	r[1] = find_refl(fs->half[1], h, k, l);
+	if ( r[half] == NULL ) r[half] = add_refl(fs->half[half], h, k, l);
+
+	stream_contribute(sh, r[0], r[1], fs->min_meas, -1);
+
+	n = get_redundancy(r[half]) + 1;
+	mean = get_intensity(r[half]);
+	M2 = get_temp1(r[half]);
+	delta = intensity - mean;
+	mean += delta/n;
+	M2 += delta*(intensity - mean);
+	set_intensity(r[half], mean);
+	set_temp1(r[half], M2);
+	set_redundancy(r[half], n);
+
+	stream_contribute(sh, r[0], r[1], fs->min_meas, +1);
+
+	return 0;
+}
+
+
+static double stream_value(struct fom_stream_shell *sh, long int possible,
+                           enum fom_type fom)
+{
+	double cc;
+
+	switch ( fom ) {
+
+		case FOM_CC :
+		case FOM_CCSTAR :
+		if ( sh->cc_n < 2 ) return NAN;
+		cc = (sh->cc_n*sh->sxy - sh->sx*sh->sy)
+		     / sqrt((sh->cc_n*sh->sxx - sh->sx*sh->sx)
+		           *(sh->cc_n*sh->syy - sh->sy*sh->sy));
+		if ( fom == FOM_CC ) return cc;
+		return sqrt((2.0*cc)/(1.0+cc));
+
+		case FOM_RSPLIT :
+		return 2.0*(sh->rs_num/sh->rs_den) / sqrt(2.0);
+
+		case FOM_SNR :
+		return sh->snr_sum / sh->snr_n;
+
+		case FOM_MEAN_INTENSITY :
+		return sh->sum_mean / sh->n_refl;
+
+		case FOM_REDUNDANCY :
+		return (double)sh->n_meas / sh->n_refl;
+
+		case FOM_NUM_MEASUREMENTS :
+		return sh->n_meas;
+
+		case FOM_COMPLETENESS :
+		return (double)sh->n_refl / possible;
+
+		default :
+		return NAN;
+
+	}
+}
+
+
+/**
+ * \param fs: A %fom_stream
+ * \param fom: The figure of merit
+ * \param i: Shell number
+ *
+ * Only %FOM_CC (i.e. CC1/2), %FOM_CCSTAR, %FOM_RSPLIT, %FOM_SNR,
+ * %FOM_MEAN_INTENSITY, %FOM_REDUNDANCY, %FOM_NUM_MEASUREMENTS and
+ * %FOM_COMPLETENESS can be calculated from a %fom_stream.
+ *
+ * \returns the current value of the figure of merit in shell \p i, or NAN if it
+ * can't be calculated.
+ */
+double fom_stream_shell_value(struct fom_stream *fs, enum fom_type fom, int i)
+{
+	return stream_value(&fs->s[i], fs->possible[i], fom);
+}
+
+
+/**
+ * \param fs: A %fom_stream
+ * \param fom: The figure of merit
+ *
+ * Like fom_stream_shell_value(), but for all shells together.  This takes a
+ * time proportional to the number of shells.
+ *
+ * \returns the current overall value of the figure of merit, or NAN if it can't
+ * be calculated.
+ */
+double fom_stream_overall_value(struct fom_stream *fs, enum fom_type fom)
+{
+	struct fom_stream_shell all = {0};
+	long int possible = 0;
+	int i;
+
+	for ( i=0; i<fs->shells->nshells; i++ ) {
+		struct fom_stream_shell *sh = &fs->s[i];
+		all.n_meas += sh->n_meas;
+		all.n_refl += sh->n_refl;
+		all.sum_mean += sh->sum_mean;
+		all.cc_n += sh->cc_n;
+		all.sx += sh->sx;
+		all.sy += sh->sy;
+		all.sxx += sh->sxx;
+		all.syy += sh->syy;
+		all.sxy += sh->sxy;
+		all.rs_num += sh->rs_num;
+		all.rs_den += sh->rs_den;
+		all.snr_n += sh->snr_n;
+		all.snr_sum += sh->snr_sum;
+		possible += fs->possible[i];
+	}
+
+	return stream_value(&all, possible, fom);
+}
+
+
 const char *fom_name(enum fom_type f)
 {
 	switch ( f ) {
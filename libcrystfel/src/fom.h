@@ -119,6 +119,21 @@ extern struct fom_context *fom_calculate(RefList *list1, RefList *list2,
                                          enum fom_type fom, int noscale,
                                          const SymOpList *sym);
 
+extern struct fom_context *fom_calculate_threaded(RefList *list1,
+                                                  RefList *list2,
+                                                  UnitCell *cell,
+                                                  struct fom_shells *shells,
+                                                  enum fom_type fom,
+                                                  int noscale,
+                                                  const SymOpList *sym,
+                                                  int n_threads);
+
+extern int fom_calculate_multi(RefList *list, UnitCell *cell,
+                               struct fom_shells *shells,
+                               const enum fom_type *foms, int n_foms,
+                               const SymOpList *sym, int n_threads,
+                               struct fom_context **fctx);
+
 extern struct fom_shells *fom_make_resolution_shells(double rmin, double rmax,
                                                      int nshells);
 
@@ -133,6 +148,23 @@ extern int fom_shell_num_reflections(struct fom_context *fctx, int i);
 extern int fom_overall_num_possible(struct fom_context *fctx);
 extern int fom_shell_num_possible(struct fom_context *fctx, int i);
 
+/**
+ * Accumulates intensity measurements for updating figures of merit as data
+ * arrive.  See fom_stream_new().
+ */
+struct fom_stream;
+
+extern struct fom_stream *fom_stream_new(UnitCell *cell,
+                                         struct fom_shells *shells,
+                                         const SymOpList *sym, int min_meas);
+extern void fom_stream_free(struct fom_stream *fs);
+extern int fom_stream_add(struct fom_stream *fs, signed int h, signed int k,
+                          signed int l, double intensity, int half);
+extern double fom_stream_shell_value(struct fom_stream *fs, enum fom_type fom,
+                                     int i);
+extern double fom_stream_overall_value(struct fom_stream *fs,
+                                       enum fom_type fom);
+
 extern int fom_is_anomalous(enum fom_type f);
 extern int fom_is_comparison(enum fom_type f);
 
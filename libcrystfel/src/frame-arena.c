@@ -0,0 +1,267 @@
+/*
+ * frame-arena.c
+ *
+ * Memory which is released in one go after processing each frame
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <libcrystfel-config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "frame-arena.h"
+#include "utils.h"
+
+
+/* Memory is taken from the system in blocks of this size, or larger for
+ * bigger requests.  The blocks are kept for the next frame. */
+#define FRAME_ARENA_BLOCK (1024*1024)
+
+/* With huge pages, blocks are a multiple of this size */
+#define FRAME_ARENA_HUGE_BLOCK (2*1024*1024)
+
+/* Everything handed out is aligned to this */
+#define FRAME_ARENA_ALIGN (16)
+
+
+struct _arenablock
+{
+	char *mem;
+	size_t size;
+	size_t used;
+};
+
+
+struct _framearena
+{
+	pthread_mutex_t lock;
+	struct _arenablock *blocks;
+	int n_blocks;
+	int max_blocks;
+	int cur;  /* Blocks before this one are full */
+	enum huge_pages hp;
+};
+
+
+static FrameArena *current_arena = NULL;
+
+
+/**
+ * Creates a new, empty \ref FrameArena.
+ *
+ * \returns the new \ref FrameArena, or NULL on error.
+ */
+FrameArena *frame_arena_new()
+{
+	return frame_arena_new_huge(HUGE_PAGES_NONE);
+}
+
+
+/**
+ * \param hp How to allocate the memory
+ *
+ * Creates a new, empty \ref FrameArena, which takes its memory from the system
+ * using cfmalloc_huge().
+ *
+ * \returns the new \ref FrameArena, or NULL on error.
+ */
+FrameArena *frame_arena_new_huge(enum huge_pages hp)
+{
+	FrameArena *fa = cfmalloc(sizeof(FrameArena));
+	if ( fa == NULL ) return NULL;
+	pthread_mutex_init(&fa->lock, NULL);
+	fa->blocks = NULL;
+	fa->n_blocks = 0;
+	fa->max_blocks = 0;
+	fa->cur = 0;
+	fa->hp = hp;
+	return fa;
+}
+
+
+/**
+ * \param fa A \ref FrameArena
+ *
+ * Frees \p fa, and all the memory which was allocated from it.
+ */
+void frame_arena_free(FrameArena *fa)
+{
+	int i;
+	if ( fa == NULL ) return;
+	if ( current_arena == fa ) current_arena = NULL;
+	for ( i=0; i<fa->n_blocks; i++ ) {
+		cffree_huge(fa->blocks[i].mem, fa->blocks[i].size, fa->hp);
+	}
+	cffree(fa->blocks);
+	pthread_mutex_destroy(&fa->lock);
+	cffree(fa);
+}
+
+
+static struct _arenablock *add_block(FrameArena *fa, size_t size)
+{
+	struct _arenablock *b;
+
+	if ( fa->n_blocks == fa->max_blocks ) {
+		int nmax = fa->max_blocks + 16;
+		struct _arenablock *nb;
+		nb = cfrealloc(fa->blocks, nmax*sizeof(struct _arenablock));
+		if ( nb == NULL ) return NULL;
+		fa->blocks = nb;
+		fa->max_blocks = nmax;
+	}
+
+	if ( size < FRAME_ARENA_BLOCK ) size = FRAME_ARENA_BLOCK;
+	if ( fa->hp != HUGE_PAGES_NONE ) {
+		size = (size + FRAME_ARENA_HUGE_BLOCK-1)
+		       & ~(size_t)(FRAME_ARENA_HUGE_BLOCK-1);
+	}
+	b = &fa->blocks[fa->n_blocks];
+	b->mem = cfmalloc_huge(size, fa->hp);
+	if ( b->mem == NULL ) return NULL;
+	b->size = size;
+	b->used = 0;
+	fa->n_blocks++;
+	return b;
+}
+
+
+/**
+ * \param fa A \ref FrameArena
+ * \param size The number of bytes needed
+ *
+ * Allocates \p size bytes from \p fa, set to zero.  The memory must not be
+ * freed individually, and can't be used after the next call to
+ * frame_arena_reset().  This function can be called from several threads at
+ * once.
+ *
+ * \returns a pointer to the memory, or NULL on error.
+ */
+void *frame_arena_alloc(FrameArena *fa, size_t size)
+{
+	struct _arenablock *b = NULL;
+	void *mem;
+	int i;
+
+	size = (size + FRAME_ARENA_ALIGN-1) & ~(size_t)(FRAME_ARENA_ALIGN-1);
+
+	pthread_mutex_lock(&fa->lock);
+
+	for ( i=fa->cur; i<fa->n_blocks; i++ ) {
+		if ( fa->blocks[i].size - fa->blocks[i].used >= size ) {
+			b = &fa->blocks[i];
+			break;
+		}
+	}
+	if ( b == NULL ) {
+		b = add_block(fa, size);
+		if ( b == NULL ) {
+			pthread_mutex_unlock(&fa->lock);
+			return NULL;
+		}
+	}
+
+	mem = b->mem + b->used;
+	b->used += size;
+
+	/* Move on when the current block is (nearly) full */
+	while ( (fa->cur < fa->n_blocks)
+	     && (fa->blocks[fa->cur].size - fa->blocks[fa->cur].used < 256) )
+	{
+		fa->cur++;
+	}
+
+	pthread_mutex_unlock(&fa->lock);
+
+	memset(mem, 0, size);
+	return mem;
+}
+
+
+/**
+ * \param fa A \ref FrameArena
+ *
+ * Takes back all of the memory allocated from \p fa, ready to be handed out
+ * again for the next frame.  The memory stays with \p fa, so after the first
+ * few frames there is no need to ask the system for more.
+ *
+ * Everything which uses memory from \p fa must have been freed (or abandoned)
+ * before calling this function.
+ */
+void frame_arena_reset(FrameArena *fa)
+{
+	int i;
+	if ( fa == NULL ) return;
+	pthread_mutex_lock(&fa->lock);
+	for ( i=0; i<fa->n_blocks; i++ ) {
+		fa->blocks[i].used = 0;
+	}
+	fa->cur = 0;
+	pthread_mutex_unlock(&fa->lock);
+}
+
+
+/**
+ * \param fa A \ref FrameArena
+ *
+ * \returns the total number of bytes held by \p fa, whether in use or not.
+ */
+size_t frame_arena_size(const FrameArena *fa)
+{
+	size_t total = 0;
+	int i;
+	for ( i=0; i<fa->n_blocks; i++ ) total += fa->blocks[i].size;
+	return total;
+}
+
+
+/**
+ * \param fa A \ref FrameArena, or NULL
+ *
+ * Sets the \ref FrameArena to be used by the parts of libcrystfel which can
+ * take their memory from one, for all threads in the current process.  At the
+ * moment, this is the individual reflections created by reflection_new(), and
+ * by add_refl() for lists not created with \ref REFLIST_ARENA.  Those
+ * reflections, and the lists containing them, must all be freed before the
+ * arena is reset.
+ *
+ * Set the current arena only while processing a frame, with nothing else going
+ * on in the process, and set it back to NULL before calling
+ * frame_arena_reset().
+ */
+void frame_arena_set_current(FrameArena *fa)
+{
+	current_arena = fa;
+}
+
+
+/**
+ * \returns the \ref FrameArena set by frame_arena_set_current(), or NULL.
+ */
+FrameArena *frame_arena_get_current()
+{
+	return current_arena;
+}
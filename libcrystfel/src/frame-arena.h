@@ -0,0 +1,68 @@
+/*
+ * frame-arena.h
+ *
+ * Memory which is released in one go after processing each frame
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FRAME_ARENA_H
+#define FRAME_ARENA_H
+
+#include <stddef.h>
+
+#include "utils.h"
+
+/**
+ * \file frame-arena.h
+ * Memory which is released in one go after processing each frame.
+ */
+
+/**
+ * A FrameArena hands out memory for things which only last as long as the
+ * processing of one frame, and takes it all back at once with
+ * frame_arena_reset().
+ *
+ * This data structure is opaque.
+ */
+typedef struct _framearena FrameArena;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern FrameArena *frame_arena_new(void);
+extern FrameArena *frame_arena_new_huge(enum huge_pages hp);
+extern void frame_arena_free(FrameArena *fa);
+extern void *frame_arena_alloc(FrameArena *fa, size_t size);
+extern void frame_arena_reset(FrameArena *fa);
+extern size_t frame_arena_size(const FrameArena *fa);
+
+extern void frame_arena_set_current(FrameArena *fa);
+extern FrameArena *frame_arena_get_current(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* FRAME_ARENA_H */
@@ -113,19 +113,27 @@ static signed int locate_peak(double x, double y, double z, double k,
                               double det_shift_x, double det_shift_y,
                               double *pfs, double *pss)
 {
-	int i;
+	int i, n;
+	const int *cands;
 
 	*pfs = -1;  *pss = -1;
 
-	for ( i=0; i<det->n_panels; i++ ) {
+	/* Only the panels in the right direction need to be checked */
+	cands = detgeom_lookup_panels(det, x, y, k+z,
+	                              sqrt(det_shift_x*det_shift_x
+	                                  + det_shift_y*det_shift_y), &n);
+	if ( cands == NULL ) n = det->n_panels;
+
+	for ( i=0; i<n; i++ ) {
 
 		struct detgeom_panel *p;
+		int pn = (cands != NULL) ? cands[i] : i;
 
-		p = &det->panels[i];
+		p = &det->panels[pn];
 
 		if ( locate_peak_on_panel(x, y, z, k, p,
 			                  det_shift_x, det_shift_y,
-			                  pfs, pss) ) return i; /* Woohoo! */
+			                  pfs, pss) ) return pn; /* Woohoo! */
 
 	}
 
@@ -244,115 +252,198 @@ static inline double safe_khalf(const double xl,
 }
 
 
-static Reflection *check_reflection(struct image *image, Crystal *cryst,
-                                    signed int h, signed int k, signed int l,
-                                    double xl, double yl, double zl,
-                                    Reflection *updateme)
+/* The spectrum, unpacked into separate arrays for ggpm_partialities(), along
+ * with the things which don't depend on the reflection */
+struct spectrum_arrays
 {
-	Reflection *refl;
-	double R;
-	int i, n;
-	double knom, khalf;
-	double dcs, exerr;
-	double partiality, mean_kpred, M2_kpred;
-	double sumw_k, mean_k, M2_k;
+	int n;
+	double *kcen;
+	double *sigma;
+	double *area;
 
-	/* This arbitrary value is there to mimic previous behaviour */
-	const double min_partiality = exp(-0.5*1.7*1.7);
+	double R;          /* Profile radius */
+	double w0;         /* 1/R^2 */
+	double lorentz;    /* For reverting the 'Lorentz' factor */
+};
 
-	/* Don't predict 000 */
-	if ( (updateme == NULL) && (abs(h)+abs(k)+abs(l) == 0) ) return NULL;
-
-	R = fabs(crystal_get_profile_radius(cryst));
-	n = spectrum_get_num_gaussians(image->spectrum);
-	assert(n > 0);
-
-	partiality = 0.0;
-	mean_kpred = 0.0;
-	M2_kpred = 0.0;
-	sumw_k = 0.0;
-	mean_k = 0.0;
-	M2_k = 0.0;
-	for ( i=0; i<n; i++ ) {
 
-		struct gaussian g;
-		double kpred;
-		double exerr2, x, y, z, norm;
-		double sigma_proj, w0, w1;
-		double sigma2, exponent, overlap_integral;
+static int spectrum_arrays_init(struct spectrum_arrays *sa,
+                                struct image *image, Crystal *cryst)
+{
+	int i;
+	double sumw_k = 0.0;
+	double mean_k = 0.0;
+	double M2_k = 0.0;
+
+	sa->n = spectrum_get_num_gaussians(image->spectrum);
+	assert(sa->n > 0);
+
+	sa->kcen = cfmalloc(3*sa->n*sizeof(double));
+	if ( sa->kcen == NULL ) return 1;
+	sa->sigma = sa->kcen + sa->n;
+	sa->area = sa->sigma + sa->n;
+
+	for ( i=0; i<sa->n; i++ ) {
+		struct gaussian g = spectrum_get_gaussian(image->spectrum, i);
+		sa->kcen[i] = g.kcen;
+		sa->sigma[i] = g.sigma;
+		sa->area[i] = g.area;
+		mean_variance(g.kcen, g.area, &sumw_k, &mean_k, &M2_k);
+		M2_k += g.area * g.sigma * g.sigma;
+	}
 
-		g = spectrum_get_gaussian(image->spectrum, i);
+	sa->R = fabs(crystal_get_profile_radius(cryst));
+	sa->w0 = 1.0/(sa->R*sa->R);
+	sa->lorentz = sqrt( ( sa->R*sa->R + M2_k/sumw_k) / ( sa->R*sa->R ) );
 
-		/* Project lattice point onto Ewald sphere */
-		x = xl;
-		y = yl;
-		z = zl + g.kcen;
-		norm = 1.0/sqrt(x*x+y*y+z*z);
-		x *= norm;
-		y *= norm;
-		z *= norm;
+	return 0;
+}
 
-		/* Width of Ewald sphere in the direction of the projection */
-		sigma_proj = (1-z)*g.sigma;
 
-		mean_variance(g.kcen, g.area, &sumw_k, &mean_k, &M2_k);
-		M2_k += g.area * g.sigma * g.sigma;
-		w0 = 1.0/(R*R);
-		w1 = 1.0/(sigma_proj*sigma_proj);
+static void spectrum_arrays_free(struct spectrum_arrays *sa)
+{
+	cffree(sa->kcen);
+}
 
-		x *= g.kcen;
-		y *= g.kcen;
-		z *= g.kcen;
-		z -= g.kcen;
 
-		/* Three because the general case fails in extreme cases */
-		if ( isinf(w0) || (w0 / w1 <= DBL_MIN) ) {
+/* Calculates the partialities and mean k values for 'n' lattice points at
+ * once, for the generalised Gaussian partiality model.  The loop over the
+ * lattice points is the inner one, so that everything to do with the Gaussian
+ * stays in registers, and there are as few divisions and square roots as
+ * possible.  'khalf' is for scratch space. */
+static void ggpm_partialities(const struct spectrum_arrays *sa, int n,
+                              const double *xls, const double *yls,
+                              const double *zls, double *khalf,
+                              double *partialities, double *kpreds)
+{
+	int i, j;
+	const double R = sa->R;
+	const double R2 = R*R;
+	const double w0 = sa->w0;
+	const int laue = isinf(w0);
+
+	for ( j=0; j<n; j++ ) {
+		khalf[j] = safe_khalf(xls[j], yls[j], zls[j]);
+		partialities[j] = 0.0;  /* Sum of weights */
+		kpreds[j] = 0.0;        /* Sum of weighted k values */
+	}
 
-			/* 'Laue' corner case */
-			kpred = g.kcen;
-			exerr2 = g.kcen - safe_khalf(xl, yl, zl);
-			exerr2 *= exerr2;
+	for ( i=0; i<sa->n; i++ ) {
+
+		const double kcen = sa->kcen[i];
+		const double sigma = sa->sigma[i];
+		const double area = sa->area[i];
+
+		for ( j=0; j<n; j++ ) {
+
+			const double xl = xls[j];
+			const double yl = yls[j];
+			const double zl = zls[j];
+			double kpred;
+			double exerr2, x, y, z, norm;
+			double sigma_proj2, w0w1, q;
+			double exponent, w;
+
+			/* Project lattice point onto Ewald sphere */
+			x = xl;
+			y = yl;
+			z = zl + kcen;
+			norm = 1.0/sqrt(x*x+y*y+z*z);
+			x *= norm;
+			y *= norm;
+			z *= norm;
+
+			/* Width of Ewald sphere in the direction of the
+			 * projection, and the ratio of the weights of the
+			 * lattice point and the sphere */
+			sigma_proj2 = (1-z)*sigma;
+			sigma_proj2 *= sigma_proj2;
+			w0w1 = w0*sigma_proj2;
+
+			x *= kcen;
+			y *= kcen;
+			z *= kcen;
+			z -= kcen;
+
+			/* Three because the general case fails in extreme
+			 * cases */
+			if ( laue || (w0w1 <= DBL_MIN) ) {
+
+				/* 'Laue' corner case */
+				kpred = kcen;
+				exerr2 = kcen - khalf[j];
+				exerr2 *= exerr2;
+
+			} else if ( w0w1 >= 1.0/DBL_MIN ) {
+
+				/* 'Monochromatic' corner case */
+				kpred = khalf[j];
+				exerr2 = kcen - kpred;
+				exerr2*= exerr2;
+
+			} else {
+
+				/* General case */
+
+				/* Closest point on Ewald sphere.
+				 * Project zl to 0, bit of a hack... */
+				const double zlp0 = zl<0?zl:0;
+				const double wn = 1.0/(w0w1 + 1.0);
+				exerr2 = (x-xl)*(x-xl) + (y-yl)*(y-yl)
+				       + (z-zl)*(z-zl);
+
+				/* Weighted average between projected lattice
+				 * point and Ewald sphere */
+				x = ( xl  *w0w1 + x ) * wn;
+				y = ( yl  *w0w1 + y ) * wn;
+				z = ( zlp0*w0w1 + z ) * wn;
+				kpred = safe_khalf(x,y,z);
+
+			}
+
+			/* Overlap integral is exp(exponent) * R/sqrt(sigma2),
+			 * where sigma2 = 1/q */
+			q = 1.0/(R2 + sigma_proj2);
+			exponent = - 0.5 * exerr2 * q;
+			if ( exponent <= -700.0 ) continue;
+			w = area * exp(exponent) * R * sqrt(q);
+
+			/* Same as mean_variance(), but without the variance */
+			if ( w >= DBL_MIN ) {
+				partialities[j] += w;
+				kpreds[j] += w*kpred;
+			}
 
-		} else if ( w1 / w0 <= DBL_MIN ) {
+		}
 
-			/* 'Monochromatic' corner case */
-			kpred = safe_khalf(xl,yl,zl);
-			exerr2 = g.kcen - kpred;
-			exerr2*= exerr2;
+	}
 
-		} else {
+	for ( j=0; j<n; j++ ) {
 
-			/* General case */
+		const double sumw = partialities[j];
 
-			/* Closest point on Ewald sphere.
-			 * Project zl to 0, bit of a hack... */
-			const double zlp0 = zl<0?zl:0;
-			exerr2 = (x-xl)*(x-xl) + (y-yl)*(y-yl) + (z-zl)*(z-zl);
+		kpreds[j] = (sumw > 0.0) ? kpreds[j]/sumw : 0.0;
 
-			/* Weighted average between projected lattice point
-			 * and Ewald sphere */
-			x = ( xl  *w0 + x*w1 ) / ( w0 + w1 );
-			y = ( yl  *w0 + y*w1 ) / ( w0 + w1 );
-			z = ( zlp0*w0 + z*w1 ) / ( w0 + w1 );
-			kpred = safe_khalf(x,y,z);
+		/* Revert the 'Lorentz' factor */
+		partialities[j] = sumw * sa->lorentz;
+		if ( isnan(partialities[j]) ) partialities[j] = 0.0;
 
-		}
-		sigma2 = R*R + sigma_proj*sigma_proj;
-		exponent = - 0.5 * exerr2 / sigma2;
-		if ( exponent > -700.0 ) {
-			overlap_integral = exp(exponent) * sqrt(2*M_PI*R*R) / sqrt(2*M_PI*sigma2);
-		} else {
-			overlap_integral = 0.0;
-		}
+	}
+}
 
-		mean_variance(kpred, g.area*overlap_integral,
-		              &partiality, &mean_kpred, &M2_kpred);
 
-	}
+static Reflection *check_reflection(struct image *image, Crystal *cryst,
+                                    signed int h, signed int k, signed int l,
+                                    double xl, double yl, double zl,
+                                    double partiality, double mean_kpred,
+                                    Reflection *updateme)
+{
+	Reflection *refl;
+	double knom, khalf;
+	double dcs, exerr;
 
-	/* Revert the 'Lorentz' factor */
-	partiality *= sqrt( ( R*R + M2_k/sumw_k) / ( R*R ) );
-	if ( isnan(partiality) ) partiality = 0.0;
+	/* This arbitrary value is there to mimic previous behaviour */
+	const double min_partiality = exp(-0.5*1.7*1.7);
 
 	if ( (updateme == NULL) && ( partiality < min_partiality ) ) return NULL;
 
@@ -424,6 +515,232 @@ static Reflection *check_reflection(struct image *image, Crystal *cryst,
 }
 
 
+/* For pruning the search for reflections in predict_to_res().  Each Gaussian
+ * in the spectrum gives a shell around its Ewald sphere, outside of which
+ * check_reflection() can't give a partiality above min_partiality.
+ *
+ * The partiality is at most L * sum_i area_i * exp(-exerr_i^2/(2*sigma2_i)) *
+ * R/sqrt(sigma2_i), where L is the 'Lorentz' factor and sigma2_i is at most
+ * R^2 + 4*sigma_i^2.  So if every exerr_i is more than t*sqrt(R^2+4*sigma_i^2),
+ * where exp(-t^2/2) = min_partiality/(L*sum_i area_i), the partiality is
+ * too small.  In the corner cases, exerr_i is a difference in k instead of
+ * the distance from the sphere, but it's never less than half the distance,
+ * so the shell is twice as thick.
+ *
+ * Returns non-zero if the shells can't be worked out, in which case all
+ * reflections need to be checked. */
+static int prediction_shells(const struct spectrum_arrays *sa,
+                             double min_partiality,
+                             double *rin, double *rout)
+{
+	int i;
+	double area = 0.0;
+	double ratio, t;
+
+	if ( !(sa->R > 0.0) ) return 1;
+
+	for ( i=0; i<sa->n; i++ ) {
+		if ( sa->area[i] > 0.0 ) area += sa->area[i];
+	}
+
+	ratio = sa->lorentz*area / (0.99*min_partiality);
+	if ( !isfinite(ratio) ) return 1;
+	t = (ratio > 1.0) ? sqrt(2.0*log(ratio)) : 0.0;
+
+	for ( i=0; i<sa->n; i++ ) {
+
+		double e;
+		const double R = sa->R;
+		const double kcen = sa->kcen[i];
+		const double sigma = sa->sigma[i];
+
+		if ( !(sa->area[i] >= DBL_MIN) ) {
+			/* No contribution at all */
+			rin[i] = 1.0;
+			rout[i] = -1.0;
+			continue;
+		}
+
+		/* A little extra for luck (and rounding) */
+		e = 2.0*1.1*t*sqrt(R*R + 4.0*sigma*sigma) + 1e-9*kcen;
+		if ( !isfinite(e) || !isfinite(kcen) ) return 1;
+		rin[i] = kcen - e;
+		rout[i] = kcen + e;
+
+	}
+
+	return 0;
+}
+
+
+struct l_range
+{
+	signed int lo;
+	signed int hi;
+};
+
+
+static void set_l_range(struct l_range *range, double lo, double hi,
+                        signed int lmax)
+{
+	/* Clamp both ends before converting, in case of silly values.
+	 * fmax() and fmin() also take care of NaN. */
+	lo = fmin(fmax(floor(lo), -lmax), lmax);
+	hi = fmin(fmax(ceil(hi), -lmax), lmax);
+	range->lo = lo;
+	range->hi = hi;
+}
+
+
+/* Adds to 'ranges' the values of l for which |r0 + l*cs - C| is between
+ * rin and rout, rounded outwards.  C is (0, 0, cz).  Returns the number of
+ * ranges added. */
+static int l_ranges_in_shell(double r0x, double r0y, double r0z,
+                             double csx, double csy, double csz,
+                             double cz, double rin, double rout,
+                             signed int lmax, struct l_range *ranges)
+{
+	double a, b, c, disc, sq;
+	double x1, x2;
+
+	if ( rout < rin ) return 0;
+
+	/* Quadratic in l: a*l^2 + 2*b*l + c - r^2 = 0 */
+	r0z -= cz;
+	a = csx*csx + csy*csy + csz*csz;
+	b = csx*r0x + csy*r0y + csz*r0z;
+	c = r0x*r0x + r0y*r0y + r0z*r0z;
+
+	disc = b*b - a*(c - rout*rout);
+	if ( disc < 0.0 ) return 0;
+	sq = sqrt(disc);
+	x1 = (-b - sq)/a;
+	x2 = (-b + sq)/a;
+
+	if ( rin > 0.0 ) {
+		disc = b*b - a*(c - rin*rin);
+		if ( disc > 0.0 ) {
+			/* Two ranges, either side of the inner sphere */
+			sq = sqrt(disc);
+			set_l_range(&ranges[0], x1, (-b - sq)/a, lmax);
+			set_l_range(&ranges[1], (-b + sq)/a, x2, lmax);
+			return 2;
+		}
+	}
+
+	set_l_range(&ranges[0], x1, x2, lmax);
+	return 1;
+}
+
+
+static int cmp_l_range(const void *av, const void *bv)
+{
+	const struct l_range *a = av;
+	const struct l_range *b = bv;
+	if ( a->lo < b->lo ) return -1;
+	if ( a->lo > b->lo ) return +1;
+	return 0;
+}
+
+
+/* Lattice points waiting for ggpm_partialities() */
+struct prediction_batch
+{
+	int n;
+	signed int *h;
+	signed int *k;
+	signed int *l;
+	double *xl;
+	double *yl;
+	double *zl;
+	double *partiality;
+	double *kpred;
+	double *khalf;
+};
+
+
+static int prediction_batch_init(struct prediction_batch *b, int max_n)
+{
+	b->n = 0;
+	b->h = cfmalloc(3*max_n*sizeof(signed int));
+	b->xl = cfmalloc(6*max_n*sizeof(double));
+	if ( (b->h == NULL) || (b->xl == NULL) ) {
+		cffree(b->h);
+		cffree(b->xl);
+		return 1;
+	}
+	b->k = b->h + max_n;
+	b->l = b->k + max_n;
+	b->yl = b->xl + max_n;
+	b->zl = b->yl + max_n;
+	b->partiality = b->zl + max_n;
+	b->kpred = b->partiality + max_n;
+	b->khalf = b->kpred + max_n;
+	return 0;
+}
+
+
+static void prediction_batch_free(struct prediction_batch *b)
+{
+	cffree(b->h);
+	cffree(b->xl);
+}
+
+
+static void predict_one(struct prediction_batch *b, UnitCell *cell,
+                        double max_res,
+                        signed int h, signed int k, signed int l,
+                        double asx, double asy, double asz,
+                        double bsx, double bsy, double bsz,
+                        double csx, double csy, double csz)
+{
+	/* Don't predict 000 */
+	if ( abs(h)+abs(k)+abs(l) == 0 ) return;
+
+	if ( forbidden_reflection(cell, h, k, l) ) return;
+	if ( 2.0*resolution(cell, h, k, l) > max_res ) return;
+
+	b->h[b->n] = h;
+	b->k[b->n] = k;
+	b->l[b->n] = l;
+
+	/* Get the coordinates of the reciprocal lattice point */
+	b->xl[b->n] = h*asx + k*bsx + l*csx;
+	b->yl[b->n] = h*asy + k*bsy + l*csy;
+	b->zl[b->n] = h*asz + k*bsz + l*csz;
+
+	b->n++;
+}
+
+
+static void predict_batch(struct prediction_batch *b,
+                          const struct spectrum_arrays *sa,
+                          struct image *image, Crystal *cryst,
+                          RefList *reflections)
+{
+	int i;
+
+	ggpm_partialities(sa, b->n, b->xl, b->yl, b->zl, b->khalf,
+	                  b->partiality, b->kpred);
+
+	for ( i=0; i<b->n; i++ ) {
+
+		Reflection *refl;
+
+		refl = check_reflection(image, cryst, b->h[i], b->k[i], b->l[i],
+		                        b->xl[i], b->yl[i], b->zl[i],
+		                        b->partiality[i], b->kpred[i], NULL);
+
+		if ( refl != NULL ) {
+			add_refl_to_list(refl, reflections);
+		}
+
+	}
+
+	b->n = 0;
+}
+
+
 /**
  * \param cryst: A \ref Crystal
  * \param image: An image structure
@@ -447,6 +764,11 @@ RefList *predict_to_res(Crystal *cryst, struct image *image, double max_res)
 	double mres;
 	signed int h, k, l;
 	UnitCell *cell;
+	struct spectrum_arrays sa;
+	struct prediction_batch batch;
+	double *rin, *rout;
+	struct l_range *ranges;
+	int prune;
 
 	cell = crystal_get_cell(cryst);
 	if ( cell == NULL ) return NULL;
@@ -483,32 +805,85 @@ RefList *predict_to_res(Crystal *cryst, struct image *image, double max_res)
 	                          &bsx, &bsy, &bsz,
 	                          &csx, &csy, &csz);
 
-	for ( h=-hmax; h<=hmax; h++ ) {
-	for ( k=-kmax; k<=kmax; k++ ) {
-	for ( l=-lmax; l<=lmax; l++ ) {
+	/* For locate_peak() */
+	detgeom_update_lookup(image->detgeom);
 
-		Reflection *refl;
-		double xl, yl, zl;
+	if ( spectrum_arrays_init(&sa, image, cryst) ) {
+		reflist_free(reflections);
+		return NULL;
+	}
 
-		if ( forbidden_reflection(cell, h, k, l) ) continue;
-		if ( 2.0*resolution(cell, h, k, l) > max_res ) continue;
+	/* The partialities are calculated for all the values of l at once */
+	if ( prediction_batch_init(&batch, 2*lmax+1) ) {
+		spectrum_arrays_free(&sa);
+		reflist_free(reflections);
+		return NULL;
+	}
 
-		/* Get the coordinates of the reciprocal lattice point */
-		xl = h*asx + k*bsx + l*csx;
-		yl = h*asy + k*bsy + l*csy;
-		zl = h*asz + k*bsz + l*csz;
+	/* Only the lattice points near the Ewald spheres (one for each Gaussian
+	 * in the spectrum) need to be checked.  For each value of h and k, the
+	 * values of l which are close enough can be found directly. */
+	rin = cfmalloc(sa.n*sizeof(double));
+	rout = cfmalloc(sa.n*sizeof(double));
+	ranges = cfmalloc((2*sa.n+1)*sizeof(struct l_range));
+	prune = (rin != NULL) && (rout != NULL) && (ranges != NULL)
+	     && (prediction_shells(&sa, exp(-0.5*1.7*1.7), rin, rout) == 0);
 
-		refl = check_reflection(image, cryst,
-		                        h, k, l, xl, yl, zl, NULL);
+	for ( h=-hmax; h<=hmax; h++ ) {
+	for ( k=-kmax; k<=kmax; k++ ) {
 
-		if ( refl != NULL ) {
-			add_refl_to_list(refl, reflections);
+		double r0x, r0y, r0z;
+		signed int next_l;
+		int i, n_ranges;
+
+		if ( !prune ) {
+			for ( l=-lmax; l<=lmax; l++ ) {
+				predict_one(&batch, cell, max_res, h, k, l,
+				            asx, asy, asz, bsx, bsy, bsz,
+				            csx, csy, csz);
+			}
+			predict_batch(&batch, &sa, image, cryst, reflections);
+			continue;
 		}
 
-	}
+		r0x = h*asx + k*bsx;
+		r0y = h*asy + k*bsy;
+		r0z = h*asz + k*bsz;
+
+		n_ranges = 0;
+		for ( i=0; i<sa.n; i++ ) {
+			n_ranges += l_ranges_in_shell(r0x, r0y, r0z,
+			                              csx, csy, csz,
+			                              -sa.kcen[i],
+			                              rin[i], rout[i], lmax,
+			                              &ranges[n_ranges]);
+		}
+		if ( n_ranges == 0 ) continue;
+		qsort(ranges, n_ranges, sizeof(struct l_range), cmp_l_range);
+
+		/* Each value of l only once, even if the ranges overlap */
+		next_l = -lmax;
+		for ( i=0; i<n_ranges; i++ ) {
+			signed int l0 = ranges[i].lo;
+			if ( l0 < next_l ) l0 = next_l;
+			for ( l=l0; l<=ranges[i].hi; l++ ) {
+				predict_one(&batch, cell, max_res, h, k, l,
+				            asx, asy, asz, bsx, bsy, bsz,
+				            csx, csy, csz);
+			}
+			if ( ranges[i].hi+1 > next_l ) next_l = ranges[i].hi+1;
+		}
+		predict_batch(&batch, &sa, image, cryst, reflections);
+
 	}
 	}
 
+	spectrum_arrays_free(&sa);
+	prediction_batch_free(&batch);
+	cffree(rin);
+	cffree(rout);
+	cffree(ranges);
+
 	return reflections;
 }
 
@@ -671,6 +1046,35 @@ static double do_integral(double q2, double zl, double R,
 }
 
 
+/**
+ * \param q2 Squared length of the reciprocal lattice vector, in m^-2
+ * \param zl z-component of the reciprocal lattice vector, in m^-1
+ * \param R Radius of the reciprocal lattice point profile, in m^-1
+ * \param lambda Nominal wavelength, in m
+ * \param spectrum The \ref Spectrum of the incident radiation
+ *
+ * Calculates the partiality of a single reflection according to
+ * PMODEL_XSPHERE, given the quantities which the model depends on.  This is
+ * the same calculation as \ref calculate_partialities does for each
+ * reflection, for callers which can work out these quantities for themselves
+ * more quickly than by setting up a \ref Crystal and \ref image.
+ *
+ * \returns The partiality.
+ */
+double xsphere_partiality(double q2, double zl, double R, double lambda,
+                          Spectrum *spectrum)
+{
+	double total, norm;
+
+	total = do_integral(q2, zl, R, spectrum, NULL);
+	norm = do_integral(q2, -0.5*q2*lambda, R, spectrum, NULL);
+
+	assert(total <= 2.0*norm);
+
+	return total/norm;
+}
+
+
 static void ginn_spectrum_partialities(RefList *list, Crystal *cryst, struct image *image)
 {
 	Reflection *refl;
@@ -704,7 +1108,6 @@ static void ginn_spectrum_partialities(RefList *list, Crystal *cryst, struct ima
 		signed int h, k, l;
 		double xl, yl, zl;
 		double q2;
-		double total, norm;
 
 		get_symmetric_indices(refl, &h, &k, &l);
 		xl = h*asx + k*bsx + l*csx;
@@ -716,19 +1119,10 @@ static void ginn_spectrum_partialities(RefList *list, Crystal *cryst, struct ima
 
 		R = r0 + m * sqrt(q2);
 
-		//char tmp[256];
-		//snprintf(tmp, 255, "-%i,%i,%i", h, k, l);
-		char *tmp = NULL;
-
-		total = do_integral(q2, zl, R, image->spectrum, tmp);
-		norm = do_integral(q2, -0.5*q2*image->lambda, R,
-		                   image->spectrum, NULL);
-
-	        set_partiality(refl, total/norm);
+		set_partiality(refl, xsphere_partiality(q2, zl, R, image->lambda,
+		                                        image->spectrum));
 		set_lorentz(refl, 1.0);
 
-		assert(total <= 2.0*norm);
-
 	}
 }
 
@@ -847,6 +1241,28 @@ void calculate_partialities(RefList *list, Crystal *cryst, struct image *image,
  * If you need to update the partialities as well, call
  * \ref calculate_partialities afterwards.
  */
+/* Number of reflections to update at once */
+#define UPDATE_BATCH (256)
+
+static void update_batch(struct prediction_batch *b, Reflection **refls,
+                         const struct spectrum_arrays *sa,
+                         struct image *image, Crystal *cryst)
+{
+	int i;
+
+	ggpm_partialities(sa, b->n, b->xl, b->yl, b->zl, b->khalf,
+	                  b->partiality, b->kpred);
+
+	for ( i=0; i<b->n; i++ ) {
+		check_reflection(image, cryst, b->h[i], b->k[i], b->l[i],
+		                 b->xl[i], b->yl[i], b->zl[i],
+		                 b->partiality[i], b->kpred[i], refls[i]);
+	}
+
+	b->n = 0;
+}
+
+
 void update_predictions(RefList *list, Crystal *cryst, struct image *image)
 {
 	Reflection *refl;
@@ -854,6 +1270,15 @@ void update_predictions(RefList *list, Crystal *cryst, struct image *image)
 	double asx, asy, asz;
 	double bsx, bsy, bsz;
 	double csx, csy, csz;
+	struct spectrum_arrays sa;
+	struct prediction_batch batch;
+	Reflection *refls[UPDATE_BATCH];
+
+	if ( spectrum_arrays_init(&sa, image, cryst) ) return;
+	if ( prediction_batch_init(&batch, UPDATE_BATCH) ) {
+		spectrum_arrays_free(&sa);
+		return;
+	}
 
 	cell_get_reciprocal(crystal_get_cell(cryst), &asx, &asy, &asz,
 	                    &bsx, &bsy, &bsz, &csx, &csy, &csz);
@@ -862,20 +1287,31 @@ void update_predictions(RefList *list, Crystal *cryst, struct image *image)
 	      refl != NULL;
 	      refl = next_refl(refl, iter) )
 	{
-		double xl, yl, zl;
 		signed int h, k, l;
+		const int n = batch.n;
 
 		get_symmetric_indices(refl, &h, &k, &l);
 
+		batch.h[n] = h;
+		batch.k[n] = k;
+		batch.l[n] = l;
+		refls[n] = refl;
+
 		/* Get the coordinates of the reciprocal lattice point */
-		xl = h*asx + k*bsx + l*csx;
-		yl = h*asy + k*bsy + l*csy;
-		zl = h*asz + k*bsz + l*csz;
+		batch.xl[n] = h*asx + k*bsx + l*csx;
+		batch.yl[n] = h*asy + k*bsy + l*csy;
+		batch.zl[n] = h*asz + k*bsz + l*csz;
 
-		check_reflection(image, cryst, h, k, l,
-		                 xl, yl, zl, refl);
+		batch.n++;
+		if ( batch.n == UPDATE_BATCH ) {
+			update_batch(&batch, refls, &sa, image, cryst);
+		}
 
 	}
+	update_batch(&batch, refls, &sa, image, cryst);
+
+	spectrum_arrays_free(&sa);
+	prediction_batch_free(&batch);
 }
 
 
@@ -85,6 +85,9 @@ extern void calculate_partialities(RefList *list,
                                    struct image *image,
                                    PartialityModel pmodel);
 
+extern double xsphere_partiality(double q2, double zl, double R, double lambda,
+                                 Spectrum *spectrum);
+
 extern void update_predictions(RefList *list, Crystal *cryst, struct image *image);
 extern struct polarisation parse_polarisation(const char *text);
 extern void polarisation_correction(RefList *list, UnitCell *cell,
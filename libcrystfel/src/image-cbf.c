@@ -32,7 +32,10 @@
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #ifdef HAVE_ZLIB
 #include <zlib.h>
@@ -41,69 +44,224 @@
 #include "image.h"
 #include "utils.h"
 #include "detgeom.h"
+#include "thread-pool.h"
 
 #include "datatemplate.h"
 #include "datatemplate_priv.h"
 
-static void add_out(float val, float *data_out, int nmemb_out,
-                    int *outpos, int *nrej)
+/* Number of output elements decoded by each thread at a time */
+#define CBF_BLOCK_LEN (65536)
+
+static int cbf_decode_threads = 0;
+
+
+void image_cbf_set_decode_threads(int n_threads)
 {
-	if ( *outpos < nmemb_out ) {
-		data_out[(*outpos)++] = val;
-	} else {
-		(*nrej)++;
+	cbf_decode_threads = n_threads;
+}
+
+
+/* Reads the multi-byte delta following an escape byte (0x80) at in[*pos],
+ * and moves *pos past it.  Returns non-zero if the data is truncated. */
+static int read_escaped_delta(const uint8_t *in, size_t n, size_t *pos,
+                              int64_t *delta)
+{
+	size_t p = *pos + 1;
+	int16_t d16;
+	int32_t d32;
+	int64_t d64;
+	int i;
+
+	if ( p + 2 > n ) return 1;
+	d16 = (int16_t)(in[p] | (in[p+1] << 8));
+	p += 2;
+	if ( d16 != INT16_MIN ) {
+		*delta = d16;
+		*pos = p;
+		return 0;
+	}
+
+	if ( p + 4 > n ) return 1;
+	d32 = (int32_t)((uint32_t)in[p] | ((uint32_t)in[p+1] << 8)
+	              | ((uint32_t)in[p+2] << 16) | ((uint32_t)in[p+3] << 24));
+	p += 4;
+	if ( d32 != INT32_MIN ) {
+		*delta = d32;
+		*pos = p;
+		return 0;
+	}
+
+	if ( p + 8 > n ) return 1;
+	d64 = 0;
+	for ( i=7; i>=0; i-- ) {
+		d64 = (d64 << 8) | in[p+i];
 	}
+	*delta = d64;
+	*pos = p + 8;
+	return 0;
+}
+
+
+/* Length of the run of one-byte deltas starting at in[pos] */
+static size_t one_byte_run(const uint8_t *in, size_t n, size_t pos)
+{
+	const uint8_t *esc = memchr(in+pos, 0x80, n-pos);
+	if ( esc == NULL ) return n - pos;
+	return esc - (in+pos);
+}
+
+
+struct cbf_block
+{
+	const uint8_t *in;
+	size_t n_in;
+	size_t in_pos;      /* Where this block starts in the input */
+	int64_t val;        /* Value of the element before the block */
+	float *out;         /* First output element for this block */
+	size_t n_out;
+};
+
+
+/* Decodes one block.  Runs of one-byte deltas, which are most of the data,
+ * are decoded without any branches apart from the loop itself. */
+static void decode_cbf_block(void *vp, int cookie)
+{
+	struct cbf_block *blk = vp;
+	const uint8_t *in = blk->in;
+	size_t pos = blk->in_pos;
+	int64_t val = blk->val;
+	size_t k = 0;
+
+	while ( (k < blk->n_out) && (pos < blk->n_in) ) {
+
+		size_t len, i;
+		int64_t delta;
+
+		len = one_byte_run(in, blk->n_in, pos);
+		if ( len > blk->n_out - k ) len = blk->n_out - k;
+		for ( i=0; i<len; i++ ) {
+			val += (int8_t)in[pos+i];
+			blk->out[k+i] = val;
+		}
+		pos += len;
+		k += len;
+
+		if ( (k < blk->n_out) && (pos < blk->n_in) ) {
+			if ( read_escaped_delta(in, blk->n_in, &pos, &delta) ) {
+				break;
+			}
+			val += delta;
+			blk->out[k++] = val;
+		}
+
+	}
+}
+
+
+struct cbf_block_queue
+{
+	struct cbf_block *blocks;
+	int n_blocks;
+	int next;
+};
+
+
+static void *get_cbf_block(void *vp)
+{
+	struct cbf_block_queue *q = vp;
+	if ( q->next == q->n_blocks ) return NULL;
+	return &q->blocks[q->next++];
 }
 
 
 /* Reverses byte offset compression and converts to single precision float.
  * Note that this compression scheme specifies the data format of the input
- * data, therefore the X-Binary-Element-Type is completely ignored. */
+ * data, therefore the X-Binary-Element-Type is completely ignored.
+ *
+ * The first pass finds where each block of output elements starts in the
+ * input, and the value at that point, by looking for the escape bytes and
+ * adding up the one-byte deltas between them.  The blocks are then decoded,
+ * in parallel if image_cbf_set_decode_threads() was used. */
 static void decode_cbf_byte_offset(float *data_out, int nmemb_out,
                                    const int8_t *data_in, const size_t n)
 {
-	int inpos = 0;
-	int outpos = 0;
-	int nrej = 0;
-	float val = 0.0;
+	const uint8_t *in = (const uint8_t *)data_in;
+	struct cbf_block_queue q;
+	size_t pos = 0;
+	size_t n_elem = 0;
+	int64_t val = 0;
+	int max_blocks;
+
+	max_blocks = (nmemb_out + CBF_BLOCK_LEN - 1) / CBF_BLOCK_LEN;
+	q.blocks = cfmalloc(max_blocks*sizeof(struct cbf_block));
+	if ( q.blocks == NULL ) {
+		ERROR("Failed to allocate CBF decoding blocks\n");
+		return;
+	}
+	q.n_blocks = 0;
+	q.next = 0;
 
-	while ( inpos < n ) {
+	while ( pos < n ) {
 
-		int64_t delta = data_in[inpos++];
+		size_t len, i;
+		int64_t sum = 0;
+		int64_t delta;
 
-		if ( (delta >= -127) && (delta <= 127) ) {
-			val += delta;
-			add_out(val, data_out, nmemb_out, &outpos, &nrej);
-			continue;
+		/* Start a new block? */
+		if ( (n_elem < nmemb_out)
+		  && (n_elem == q.n_blocks*CBF_BLOCK_LEN) )
+		{
+			struct cbf_block *blk = &q.blocks[q.n_blocks++];
+			blk->in = in;
+			blk->n_in = n;
+			blk->in_pos = pos;
+			blk->val = val;
+			blk->out = data_out + n_elem;
+			blk->n_out = nmemb_out - n_elem;
+			if ( blk->n_out > CBF_BLOCK_LEN ) {
+				blk->n_out = CBF_BLOCK_LEN;
+			}
 		}
 
-		delta = *(int16_t *)(data_in+inpos);
-		inpos += 2;
-
-		if ( (delta >= -32767) && (delta <= 32767) ) {
-			val += delta;
-			add_out(val, data_out, nmemb_out, &outpos, &nrej);
-			continue;
+		/* Up to the next escape or block boundary */
+		len = one_byte_run(in, n, pos);
+		if ( n_elem < nmemb_out ) {
+			size_t to_boundary = q.n_blocks*CBF_BLOCK_LEN - n_elem;
+			if ( len > to_boundary ) len = to_boundary;
+		}
+		for ( i=0; i<len; i++ ) {
+			sum += (int8_t)in[pos+i];
 		}
+		val += sum;
+		pos += len;
+		n_elem += len;
 
-		delta = *(int32_t *)(data_in+inpos);
-		inpos += 4;
+		/* The next block starts here, even if with an escape */
+		if ( (n_elem < nmemb_out)
+		  && (n_elem == q.n_blocks*CBF_BLOCK_LEN) ) continue;
 
-		if ( (delta >= -2147483647) && (delta <= 2147483647) ) {
+		if ( pos < n ) {
+			if ( read_escaped_delta(in, n, &pos, &delta) ) break;
 			val += delta;
-			add_out(val, data_out, nmemb_out, &outpos, &nrej);
-			continue;
+			n_elem++;
 		}
 
-		delta = *(int64_t *)(data_in+inpos);
-		inpos += 8;
-		val += delta;
-		add_out(val, data_out, nmemb_out, &outpos, &nrej);
+	}
 
+	if ( (cbf_decode_threads > 1) && (q.n_blocks > 1) ) {
+		run_threads(cbf_decode_threads, decode_cbf_block,
+		            get_cbf_block, NULL, &q, 0, 0, 0, 0);
+	} else {
+		int i;
+		for ( i=0; i<q.n_blocks; i++ ) {
+			decode_cbf_block(&q.blocks[i], 0);
+		}
 	}
 
-	if ( nrej > 0 ) {
-		STATUS("%i elements rejected\n", nrej);
+	cffree(q.blocks);
+
+	if ( n_elem > nmemb_out ) {
+		STATUS("%li elements rejected\n", (long int)(n_elem - nmemb_out));
 	}
 }
 
@@ -263,76 +421,214 @@ static int convert_type(float *data_out, long nmemb_exp,
 }
 
 
-static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
+/* Reads a CBF file, either completely into memory with one read(), or
+ * decompressing it from gzip a piece at a time.  The header is parsed line by
+ * line from the buffer, and the binary data is then taken from the buffer or
+ * read directly from the gzip stream. */
+struct cbf_reader
 {
-	FILE *fh;
-	char *buf = NULL;
-	char *rval;
-	size_t data_compressed_len = 0;
-	float *data_out = NULL;
-	enum cbf_data_conversion data_conversion = CBF_NO_CONVERSION;
-	enum cbf_data_type data_type = CBF_ELEMENT_U32;  /* ITG (2006) 2.3.3.3 */
-	int in_binary_section = 0;
+	char *buf;
+	size_t len;    /* Bytes in buf */
+	size_t pos;    /* Current read position in buf */
+	size_t size;   /* Allocated size of buf */
+	int gz;
+	#ifdef HAVE_ZLIB
+	gzFile gzfh;
+	#endif
+	int eof;
+};
 
-	*w = 0;
-	*h = 0;
+
+static int cbf_reader_open(struct cbf_reader *rd, const char *filename, int gz)
+{
+	rd->pos = 0;
+	rd->len = 0;
+	rd->gz = gz;
+	rd->eof = 0;
 
 	if ( !gz ) {
 
-		fh = fopen(filename, "rb");
-		if ( fh == NULL ) {
+		int fd;
+		struct stat s;
+
+		fd = open(filename, O_RDONLY);
+		if ( fd == -1 ) {
 			ERROR("Failed to open '%s'\n", filename);
-			return NULL;
+			return 1;
 		}
 
+		if ( fstat(fd, &s) == -1 ) {
+			ERROR("Failed to stat '%s'\n", filename);
+			close(fd);
+			return 1;
+		}
+
+		rd->size = s.st_size;
+		rd->buf = cfmalloc(rd->size+1);
+		if ( rd->buf == NULL ) {
+			close(fd);
+			return 1;
+		}
+
+		while ( rd->len < rd->size ) {
+			ssize_t r = read(fd, rd->buf+rd->len, rd->size-rd->len);
+			if ( r <= 0 ) break;
+			rd->len += r;
+		}
+		close(fd);
+		rd->eof = 1;
+		return 0;
+
 	} else {
 
 		#if defined(HAVE_ZLIB) && !(defined(__aarch64__) && defined(__APPLE__))
-		gzFile gzfh;
-		int len_read;
-		size_t len;
-		const size_t bufinc = 8*1024*1024;  /* Allocate buffer in 8Mb chunks */
-		size_t bufsz = bufinc;
-
-		gzfh = gzopen(filename, "rb");
-		if ( gzfh == NULL ) return NULL;
+		rd->gzfh = gzopen(filename, "rb");
+		if ( rd->gzfh == NULL ) return 1;
 
 		#ifdef HAVE_GZBUFFER
 		/* Set larger buffer size for hopefully faster uncompression */
-		gzbuffer(gzfh, 128*1024);
+		gzbuffer(rd->gzfh, 128*1024);
 		#endif
 
-		buf = cfmalloc(bufsz);
-		if ( buf == NULL ) return NULL;
+		rd->size = 64*1024;
+		rd->buf = cfmalloc(rd->size+1);
+		if ( rd->buf == NULL ) {
+			gzclose(rd->gzfh);
+			return 1;
+		}
+		return 0;
+
+		#else
+		return 1;
+		#endif
 
-		len = 0;
-		do {
+	}
+}
 
-			len_read = gzread(gzfh, buf+len, bufinc);
-			if ( len_read == -1 ) return NULL;
-			len += len_read;
 
-			if ( len_read == bufinc ) {
-				bufsz += bufinc;
-				buf = srealloc(buf, bufsz);
-				if ( buf == NULL ) return NULL;
-			}
+static void cbf_reader_close(struct cbf_reader *rd)
+{
+	cffree(rd->buf);
+	#if defined(HAVE_ZLIB) && !(defined(__aarch64__) && defined(__APPLE__))
+	if ( rd->gz ) gzclose(rd->gzfh);
+	#endif
+}
 
-		} while ( len_read == bufinc );
 
-		fh = fmemopen(buf, len, "rb");
-		if ( fh == NULL ) {
-			cffree(buf);
+/* Decompresses more of the file into the buffer, keeping the unread part */
+static int cbf_reader_fill(struct cbf_reader *rd)
+{
+	#if defined(HAVE_ZLIB) && !(defined(__aarch64__) && defined(__APPLE__))
+	int len_read;
+
+	if ( rd->eof ) return 1;
+
+	memmove(rd->buf, rd->buf+rd->pos, rd->len-rd->pos);
+	rd->len -= rd->pos;
+	rd->pos = 0;
+
+	if ( rd->len == rd->size ) {
+		char *nbuf = cfrealloc(rd->buf, 2*rd->size+1);
+		if ( nbuf == NULL ) return 1;
+		rd->buf = nbuf;
+		rd->size *= 2;
+	}
+
+	len_read = gzread(rd->gzfh, rd->buf+rd->len, rd->size-rd->len);
+	if ( len_read <= 0 ) {
+		rd->eof = 1;
+		return 1;
+	}
+	rd->len += len_read;
+	return 0;
+	#else
+	return 1;
+	#endif
+}
+
+
+/* Like fgets(), with the position of the start of the line in the buffer */
+static char *cbf_reader_gets(struct cbf_reader *rd, char *line, size_t max,
+                             size_t *line_start)
+{
+	char *nl;
+	size_t line_len;
+
+	do {
+		nl = memchr(rd->buf+rd->pos, '\n', rd->len-rd->pos);
+	} while ( (nl == NULL) && !cbf_reader_fill(rd) );
+
+	if ( nl == NULL ) {
+		/* Last line without a newline */
+		if ( rd->pos == rd->len ) return NULL;
+		nl = rd->buf + rd->len - 1;
+	}
+
+	*line_start = rd->pos;
+	line_len = nl - (rd->buf+rd->pos) + 1;
+	if ( line_len > max-1 ) line_len = max-1;
+	memcpy(line, rd->buf+rd->pos, line_len);
+	line[line_len] = '\0';
+	rd->pos = nl - rd->buf + 1;
+
+	return line;
+}
+
+
+/* Gets 'len' bytes of binary data starting at 'start' in the buffer.  For
+ * an uncompressed file, this points into the buffer.  Otherwise, the data is
+ * copied into a new block of memory, and *must_free is set. */
+static void *cbf_reader_binary(struct cbf_reader *rd, size_t start, size_t len,
+                               int *must_free)
+{
+	*must_free = 0;
+	if ( !rd->gz ) {
+		if ( start + len > rd->len ) return NULL;
+		return rd->buf + start;
+	}
+
+	#if defined(HAVE_ZLIB) && !(defined(__aarch64__) && defined(__APPLE__))
+	char *data;
+	size_t have;
+
+	data = cfmalloc(len);
+	if ( data == NULL ) return NULL;
+
+	have = (start < rd->len) ? rd->len - start : 0;
+	if ( have > len ) have = len;
+	memcpy(data, rd->buf+start, have);
+
+	while ( have < len ) {
+		int len_read = gzread(rd->gzfh, data+have, len-have);
+		if ( len_read <= 0 ) {
+			cffree(data);
 			return NULL;
 		}
+		have += len_read;
+	}
 
-		gzclose(gzfh);
+	*must_free = 1;
+	return data;
+	#else
+	return NULL;
+	#endif
+}
 
-		#else
-		return NULL;
-		#endif
 
-	}
+static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
+{
+	struct cbf_reader rd;
+	char *rval;
+	size_t data_compressed_len = 0;
+	float *data_out = NULL;
+	enum cbf_data_conversion data_conversion = CBF_NO_CONVERSION;
+	enum cbf_data_type data_type = CBF_ELEMENT_U32;  /* ITG (2006) 2.3.3.3 */
+	int in_binary_section = 0;
+
+	*w = 0;
+	*h = 0;
+
+	if ( cbf_reader_open(&rd, filename, gz) ) return NULL;
 
 	/* This is really horrible, but there are at least three different types
 	 * of header mingled together (CIF, MIME, DECTRIS), so a real parser
@@ -340,10 +636,9 @@ static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
 	do {
 
 		char line[1024];
-		long line_start;
+		size_t line_start;
 
-		line_start = ftell(fh);
-		rval = fgets(line, 1023, fh);
+		rval = cbf_reader_gets(&rd, line, 1024, &line_start);
 		if ( rval == NULL ) break;
 		chomp(line);
 
@@ -365,8 +660,7 @@ static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
 				const char *elbo = line+29;
 				if ( strcmp(elbo, "LITTLE_ENDIAN") != 0 ) {
 					ERROR("Unsupported endianness: %s\n", elbo);
-					cffree(buf);
-					fclose(fh);
+					cbf_reader_close(&rd);
 					return NULL;
 				}
 			}
@@ -380,8 +674,7 @@ static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
 				data_conversion = CBF_PACKED;
 			} else if ( strstr(line, "conversions=") != NULL ) {
 				ERROR("Unrecognised CBF content conversion: %s\n", line);
-				cffree(buf);
-				fclose(fh);
+				cbf_reader_close(&rd);
 				return NULL;
 			}
 
@@ -393,8 +686,7 @@ static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
 				if ( data_type == CBF_NO_TYPE ) {
 					ERROR("Unrecognised element type: %s\n",
 					      eltype);
-					cffree(buf);
-					fclose(fh);
+					cbf_reader_close(&rd);
 					return NULL;
 				}
 			}
@@ -411,47 +703,35 @@ static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
 
 		if ( in_binary_section && binary_start(line) ) {
 
-			size_t len_read;
 			int nmemb_exp;
 			void *data_compressed;
+			int must_free;
 			int r = 0;
 
 			if ( data_compressed_len == 0 ) {
 				ERROR("Found CBF data before X-Binary-Size!\n");
-				cffree(buf);
-				fclose(fh);
+				cbf_reader_close(&rd);
 				return NULL;
 			}
 
 			if ( (*w == 0) || (*h == 0) ) {
 				ERROR("Found CBF data before dimensions!\n");
-				cffree(buf);
-				fclose(fh);
+				cbf_reader_close(&rd);
 				return NULL;
 			}
 
 			if ( data_compressed_len > 100*1024*1024 ) {
 				ERROR("Stated CBF data size too big\n");
-				cffree(buf);
-				fclose(fh);
+				cbf_reader_close(&rd);
 				return NULL;
 			}
 
-			data_compressed = cfmalloc(data_compressed_len);
+			data_compressed = cbf_reader_binary(&rd, line_start+4,
+			                                    data_compressed_len,
+			                                    &must_free);
 			if ( data_compressed == NULL ) {
-				ERROR("Failed to allocate memory for CBF data\n");
-				cffree(buf);
-				fclose(fh);
-				return NULL;
-			}
-
-			fseek(fh, line_start+4, SEEK_SET);
-			len_read = fread(data_compressed, 1, data_compressed_len, fh);
-			if ( len_read < data_compressed_len ) {
 				ERROR("Couldn't read entire CBF data\n");
-				cffree(buf);
-				cffree(data_compressed);
-				fclose(fh);
+				cbf_reader_close(&rd);
 				return NULL;
 			}
 
@@ -459,9 +739,8 @@ static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
 			data_out = cfmalloc(nmemb_exp*sizeof(float));
 			if ( data_out == NULL ) {
 				ERROR("Failed to allocate memory for CBF data\n");
-				cffree(buf);
-				cffree(data_compressed);
-				fclose(fh);
+				if ( must_free ) cffree(data_compressed);
+				cbf_reader_close(&rd);
 				return NULL;
 			}
 
@@ -483,24 +762,21 @@ static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
 				case CBF_CANONICAL:
 				ERROR("Don't yet know how to decompress "
 				      "CBF_PACKED or CBF_CANONICAL\n");
-				cffree(buf);
-				cffree(data_compressed);
-				fclose(fh);
+				if ( must_free ) cffree(data_compressed);
+				cbf_reader_close(&rd);
 				return NULL;
 
 			}
 
-			cffree(data_compressed);
+			if ( must_free ) cffree(data_compressed);
 
 			if ( r ) {
-				cffree(buf);
+				cbf_reader_close(&rd);
 				cffree(data_out);
-				fclose(fh);
 				return NULL;
 			}
 
-			cffree(buf);
-			fclose(fh);
+			cbf_reader_close(&rd);
 			return data_out;
 
 		}
@@ -508,14 +784,14 @@ static float *read_cbf_data(const char *filename, int gz, int *w, int *h)
 	} while ( rval != NULL );
 
 	ERROR("Reached end of CBF file before finding data.\n");
-	cffree(buf);  /* might be NULL */
+	cbf_reader_close(&rd);
 	return NULL;
 }
 
 
 int image_cbf_read_mask(struct panel_template *p,
                         const char *filename, const char *event,
-                        int gz, int *bad, int mask_good, int mask_bad)
+                        int gz, uint8_t *bad, int mask_good, int mask_bad)
 {
 	ERROR("Mask loading from CBF not yet supported\n");
 	return 1;
@@ -44,9 +44,11 @@ extern int image_cbf_read(struct image *image,
 
 extern int image_cbf_read_mask(struct panel_template *p,
                                const char *filename, const char *event,
-                               int gz, int *bad,
+                               int gz, uint8_t *bad,
                                int mask_good, int mask_bad);
 
+extern void image_cbf_set_decode_threads(int n_threads);
+
 extern int image_cbf_read_header_to_cache(struct image *image,
                                           const char *from);
 
@@ -34,18 +34,32 @@
 #include <math.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
 #ifdef HAVE_HDF5
 #include <hdf5.h>
 #include <hdf5_hl.h>
 #endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "image.h"
 #include "utils.h"
 #include "detgeom.h"
 #include "profile.h"
+#include "thread-pool.h"
 
 #include "datatemplate.h"
 #include "datatemplate_priv.h"
+#include "image-hdf5.h"
 
 
 /* Get the path parts of the event ID
@@ -360,84 +374,993 @@ static void close_hdf5(hid_t fh)
 }
 
 
-static int load_hdf5_hyperslab(struct panel_template *p,
-                               hid_t fh,
-                               const char *event,
-                               void *data,
-                               hid_t el_type, size_t el_size,
-                               int skip_placeholders_ok,
-                               const char *path_spec,
-                               hid_t *orig_type)
+/* Cache of open files and datasets, so that consecutive events from the same
+ * file don't have to open it again.  Like the rest of the HDF5 reading, this
+ * must not be used from more than one thread at once. */
+
+/* Header arrays larger than this won't be held in memory */
+#define MAX_HEADER_ARRAY (1024*1024)
+
+/* Number of rows of a table (e.g. CXI peak list) to read at once */
+#define TABLE_BLOCK_ROWS (64)
+
+struct cached_dataset
 {
-	int total_dt_dims;
-	int plh_dt_dims;
-	int dt_dims[MAX_DIMS];
-	int n_dt_dims;
-	herr_t r;
-	hsize_t *f_offset, *f_count;
+	char *path;
 	hid_t dh;
-	herr_t check;
-	hid_t dataspace, memspace;
-	hsize_t dims[2];
-	char *panel_full_path;
+
+	/* Entire contents, if this is an array of header values */
+	void *header_vals;
+	int header_vals_int;
+	hsize_t n_header_vals;
+
+	/* Block of rows, if this is a table read one row per event */
+	float *rows;
+	hsize_t rows_first;
+	hsize_t n_rows;
+	hsize_t row_len;
+
+	/* Block of consecutive frames, see image_hdf5_set_batch_frames() */
+	float *frames;
+	size_t frames_size;
+	int frames_ndims;  /* Zero if the block doesn't hold anything */
+	int frames_dim;
+	hsize_t frames_offset[MAX_DIMS];
+	hsize_t frames_count[MAX_DIMS];
+};
+
+struct cached_file
+{
+	char *filename;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	hid_t fh;
+	unsigned long int last_used;
+	struct cached_dataset *datasets;
+	int n_datasets;
+};
+
+static struct cached_file *file_cache = NULL;
+static int n_cached_files = 0;
+static int max_cached_files = 0;
+static size_t chunk_cache_bytes = 0;
+static unsigned long int cache_clock = 0;
+static int batch_frames = 1;
+
+
+static void drop_cached_file(struct cached_file *cf)
+{
+	int i;
+
+	/* close_hdf5() closes the datasets as well */
+	close_hdf5(cf->fh);
+	for ( i=0; i<cf->n_datasets; i++ ) {
+		cffree(cf->datasets[i].path);
+		cffree(cf->datasets[i].header_vals);
+		cffree(cf->datasets[i].rows);
+		cffree(cf->datasets[i].frames);
+	}
+	cffree(cf->datasets);
+	cffree(cf->filename);
+}
+
+
+void image_hdf5_close_cached_files()
+{
+	int i;
+
+	for ( i=0; i<n_cached_files; i++ ) {
+		drop_cached_file(&file_cache[i]);
+	}
+	cffree(file_cache);
+	file_cache = NULL;
+	n_cached_files = 0;
+}
+
+
+void image_hdf5_set_file_cache(int max_files, size_t chunk_cache_size)
+{
+	image_hdf5_close_cached_files();
+	max_cached_files = max_files;
+	chunk_cache_bytes = chunk_cache_size;
+}
+
+
+void image_hdf5_set_batch_frames(int n_frames)
+{
+	batch_frames = (n_frames > 1) ? n_frames : 1;
+}
+
+
+static struct cached_file *find_cached_file(hid_t fh)
+{
+	int i;
+
+	for ( i=0; i<n_cached_files; i++ ) {
+		if ( file_cache[i].fh == fh ) return &file_cache[i];
+	}
+	return NULL;
+}
+
+
+/* Like close_hdf5(), but leaves cached files open */
+static void release_hdf5(hid_t fh)
+{
+	if ( find_cached_file(fh) == NULL ) close_hdf5(fh);
+}
+
+
+static hid_t open_hdf5_dataset(hid_t fh, const char *path)
+{
+	struct cached_file *cf;
+	struct cached_dataset *new_ds;
+	hid_t dh;
+	int i;
+
+	cf = find_cached_file(fh);
+	if ( cf == NULL ) return H5Dopen2(fh, path, H5P_DEFAULT);
+
+	for ( i=0; i<cf->n_datasets; i++ ) {
+		if ( strcmp(cf->datasets[i].path, path) == 0 ) {
+			return cf->datasets[i].dh;
+		}
+	}
+
+	dh = H5Dopen2(fh, path, H5P_DEFAULT);
+	if ( dh < 0 ) return dh;
+
+	new_ds = cfrealloc(cf->datasets,
+	                   (cf->n_datasets+1)*sizeof(struct cached_dataset));
+	if ( new_ds == NULL ) return dh;  /* Just don't cache it */
+	cf->datasets = new_ds;
+	cf->datasets[cf->n_datasets].path = cfstrdup(path);
+	cf->datasets[cf->n_datasets].dh = dh;
+	cf->datasets[cf->n_datasets].header_vals = NULL;
+	cf->datasets[cf->n_datasets].rows = NULL;
+	cf->datasets[cf->n_datasets].frames = NULL;
+	cf->datasets[cf->n_datasets].frames_size = 0;
+	cf->datasets[cf->n_datasets].frames_ndims = 0;
+	cf->n_datasets++;
+
+	return dh;
+}
+
+
+static struct cached_dataset *find_cached_dataset(hid_t fh, hid_t dh)
+{
+	struct cached_file *cf;
+	int i;
+
+	cf = find_cached_file(fh);
+	if ( cf == NULL ) return NULL;
+
+	for ( i=0; i<cf->n_datasets; i++ ) {
+		if ( cf->datasets[i].dh == dh ) return &cf->datasets[i];
+	}
+	return NULL;
+}
+
+
+/* Returns the entire contents of a header array with n elements, as ints or
+ * doubles, reading it on first use.  Returns NULL if the file isn't cached
+ * or the array is too large to be worth keeping, in which case the caller
+ * should read the value it needs directly. */
+static void *header_array(hid_t fh, hid_t dh, int is_int, hsize_t n)
+{
+	struct cached_dataset *ds;
+	void *vals;
+
+	ds = find_cached_dataset(fh, dh);
+	if ( ds == NULL ) return NULL;
+
+	if ( ds->header_vals != NULL ) {
+		if ( (ds->header_vals_int != is_int)
+		  || (ds->n_header_vals != n) ) return NULL;
+		return ds->header_vals;
+	}
+
+	if ( n > MAX_HEADER_ARRAY ) return NULL;
+
+	vals = cfmalloc(n * (is_int ? sizeof(int) : sizeof(double)));
+	if ( vals == NULL ) return NULL;
+
+	if ( H5Dread(dh, is_int ? H5T_NATIVE_INT : H5T_NATIVE_DOUBLE,
+	             H5S_ALL, H5S_ALL, H5P_DEFAULT, vals) < 0 )
+	{
+		cffree(vals);
+		return NULL;
+	}
+
+	ds->header_vals = vals;
+	ds->header_vals_int = is_int;
+	ds->n_header_vals = n;
+	return vals;
+}
+
+
+/* Returns row 'line' of a two-dimensional float table with n_lines rows of
+ * row_len elements, reading a block of rows starting at 'line' if it isn't
+ * already in memory.  Returns NULL if the file isn't cached, in which case
+ * the caller should read the row directly. */
+static float *table_row(hid_t fh, hid_t dh, hsize_t line,
+                        hsize_t n_lines, hsize_t row_len)
+{
+	struct cached_dataset *ds;
+	hid_t sh, mh;
+	hsize_t offset[2], count[2];
+	float *rows;
+
+	ds = find_cached_dataset(fh, dh);
+	if ( ds == NULL ) return NULL;
+
+	if ( (ds->rows != NULL) && (ds->row_len == row_len)
+	  && (line >= ds->rows_first) && (line < ds->rows_first+ds->n_rows) )
+	{
+		return &ds->rows[(line-ds->rows_first)*row_len];
+	}
+
+	offset[0] = line;
+	offset[1] = 0;
+	count[0] = n_lines - line;
+	if ( count[0] > TABLE_BLOCK_ROWS ) count[0] = TABLE_BLOCK_ROWS;
+	count[1] = row_len;
+
+	rows = cfmalloc(count[0]*row_len*sizeof(float));
+	if ( rows == NULL ) return NULL;
+
+	sh = H5Dget_space(dh);
+	mh = H5Screate_simple(2, count, NULL);
+	if ( (H5Sselect_hyperslab(sh, H5S_SELECT_SET, offset, NULL,
+	                          count, NULL) < 0)
+	  || (H5Dread(dh, H5T_NATIVE_FLOAT, mh, sh, H5P_DEFAULT, rows) < 0) )
+	{
+		H5Sclose(sh);
+		H5Sclose(mh);
+		cffree(rows);
+		return NULL;
+	}
+	H5Sclose(sh);
+	H5Sclose(mh);
+
+	cffree(ds->rows);
+	ds->rows = rows;
+	ds->rows_first = line;
+	ds->n_rows = count[0];
+	ds->row_len = row_len;
+	return rows;
+}
+
+
+/* Like H5Dclose(), but leaves cached datasets open */
+static void release_hdf5_dataset(hid_t fh, hid_t dh)
+{
+	struct cached_file *cf;
+	int i;
+
+	cf = find_cached_file(fh);
+	if ( cf != NULL ) {
+		for ( i=0; i<cf->n_datasets; i++ ) {
+			if ( cf->datasets[i].dh == dh ) return;
+		}
+	}
+	H5Dclose(dh);
+}
+
+
+static hid_t really_open_hdf5_file(const char *filename)
+{
+	hid_t fh;
+	hid_t fapl;
+
+	fapl = H5Pcreate(H5P_FILE_ACCESS);
+	H5Pset_fclose_degree(fapl, H5F_CLOSE_STRONG);
+
+	if ( chunk_cache_bytes > 0 ) {
+
+		int mdc_nelmts;
+		size_t nslots, nbytes;
+		double w0;
+
+		/* Scale up the number of hash slots along with the size,
+		 * keeping it odd so that it spreads the chunks well */
+		H5Pget_cache(fapl, &mdc_nelmts, &nslots, &nbytes, &w0);
+		if ( chunk_cache_bytes > nbytes ) {
+			nslots = (nslots * (chunk_cache_bytes/nbytes)) | 1;
+		}
+		H5Pset_cache(fapl, mdc_nelmts, nslots, chunk_cache_bytes, w0);
+
+	}
+
+	fh = H5Fopen(filename, H5F_ACC_RDONLY, fapl);
+	H5Pclose(fapl);
+	return fh;
+}
+
+
+static hid_t open_cached_hdf5_file(const char *filename, struct stat *s)
+{
+	int i;
+	struct cached_file *cf;
+	hid_t fh;
+
+	for ( i=0; i<n_cached_files; i++ ) {
+
+		cf = &file_cache[i];
+		if ( strcmp(cf->filename, filename) != 0 ) continue;
+
+		/* Re-open the file if it was replaced or changed */
+		if ( (cf->dev == s->st_dev) && (cf->ino == s->st_ino)
+		  && (cf->mtime == s->st_mtime) )
+		{
+			cf->last_used = ++cache_clock;
+			return cf->fh;
+		}
+
+		drop_cached_file(cf);
+		file_cache[i] = file_cache[--n_cached_files];
+		break;
+
+	}
+
+	fh = really_open_hdf5_file(filename);
+	if ( fh < 0 ) return fh;
+
+	if ( file_cache == NULL ) {
+		file_cache = cfmalloc(max_cached_files*sizeof(struct cached_file));
+		if ( file_cache == NULL ) return fh;  /* Just don't cache it */
+	}
+
+	/* Make room by closing the least recently used file */
+	if ( n_cached_files == max_cached_files ) {
+		int lru = 0;
+		for ( i=1; i<n_cached_files; i++ ) {
+			if ( file_cache[i].last_used < file_cache[lru].last_used ) {
+				lru = i;
+			}
+		}
+		drop_cached_file(&file_cache[lru]);
+		file_cache[lru] = file_cache[--n_cached_files];
+	}
+
+	cf = &file_cache[n_cached_files];
+	cf->filename = cfstrdup(filename);
+	if ( cf->filename == NULL ) return fh;
+	n_cached_files++;
+	cf->dev = s->st_dev;
+	cf->ino = s->st_ino;
+	cf->mtime = s->st_mtime;
+	cf->fh = fh;
+	cf->last_used = ++cache_clock;
+	cf->datasets = NULL;
+	cf->n_datasets = 0;
+
+	return fh;
+}
+
+
+/* Reading of compressed chunks with H5Dread_chunk(), decompressing them in
+ * several threads here instead of in HDF5's filter pipeline, which only uses
+ * one thread.  Only the HDF5 calls are made from the calling thread. */
+
+#define FILTER_BITSHUFFLE (32008)
+#define FILTER_ZSTD (32015)
+#define BSHUF_LZ4 (2)
+#define BSHUF_ZSTD (3)
+
+enum chunk_codec
+{
+	CODEC_DEFLATE,
+	CODEC_BSHUF_LZ4,
+	CODEC_BSHUF_ZSTD,
+	CODEC_ZSTD,
+};
+
+enum chunk_elem
+{
+	ELEM_FLOAT,
+	ELEM_DOUBLE,
+	ELEM_INT8,
+	ELEM_UINT8,
+	ELEM_INT16,
+	ELEM_UINT16,
+	ELEM_INT32,
+	ELEM_UINT32,
+};
+
+struct direct_read;
+
+struct raw_chunk
+{
+	struct direct_read *dr;
+	hsize_t offset[MAX_DIMS];
+	unsigned char *data;
+	size_t size;
+};
+
+struct direct_read
+{
+	enum chunk_codec codec;
+	int byte_shuffle;   /* Byte shuffle filter before the codec */
+	enum chunk_elem elem;
+	size_t elem_size;
 	int ndims;
-	int dim;
-	int *dim_vals;
-	int n_dim_vals;
-	int pl_pos;
+	hsize_t chunk_dims[MAX_DIMS];
+	size_t chunk_nelem;
+	const hsize_t *b_offset;
+	const hsize_t *b_count;
+	float *out;
+	struct raw_chunk *chunks;
+	int n_chunks;
+	int next_chunk;
+	int failed;
+};
 
-	panel_full_path = substitute_path(event, path_spec,
-	                                  skip_placeholders_ok);
-	if ( panel_full_path == NULL ) {
-		ERROR("Invalid path substitution: '%s' '%s'\n",
-		      event, path_spec);
+static int direct_chunk_threads = 0;
+
+
+void image_hdf5_set_direct_chunk_threads(int n_threads)
+{
+	direct_chunk_threads = n_threads;
+}
+
+
+static int direct_codec_available(enum chunk_codec codec)
+{
+	switch ( codec ) {
+
+		case CODEC_DEFLATE :
+		#ifdef HAVE_ZLIB
+		return 1;
+		#else
+		return 0;
+		#endif
+
+		case CODEC_BSHUF_LZ4 :
+		#ifdef HAVE_LZ4
+		return 1;
+		#else
+		return 0;
+		#endif
+
+		case CODEC_BSHUF_ZSTD :
+		case CODEC_ZSTD :
+		#ifdef HAVE_ZSTD
 		return 1;
+		#else
+		return 0;
+		#endif
+
 	}
+	return 0;
+}
 
-	profile_start("H5Dopen2");
-	dh = H5Dopen2(fh, panel_full_path, H5P_DEFAULT);
-	if ( dh < 0 ) {
-		ERROR("Cannot open data for panel %s (%s)\n",
-		      p->name, panel_full_path);
-		profile_end("H5Dopen2");
-		cffree(panel_full_path);
+
+/* Finds out if the dataset's chunks can be decoded here */
+static int direct_read_setup(hid_t dh, struct direct_read *dr)
+{
+	hid_t dcpl, type;
+	int n_filters, i;
+	int have_codec = 0;
+
+	type = H5Dget_type(dh);
+	if ( H5Tequal(type, H5T_NATIVE_FLOAT) > 0 ) dr->elem = ELEM_FLOAT;
+	else if ( H5Tequal(type, H5T_NATIVE_DOUBLE) > 0 ) dr->elem = ELEM_DOUBLE;
+	else if ( H5Tequal(type, H5T_NATIVE_INT8) > 0 ) dr->elem = ELEM_INT8;
+	else if ( H5Tequal(type, H5T_NATIVE_UINT8) > 0 ) dr->elem = ELEM_UINT8;
+	else if ( H5Tequal(type, H5T_NATIVE_INT16) > 0 ) dr->elem = ELEM_INT16;
+	else if ( H5Tequal(type, H5T_NATIVE_UINT16) > 0 ) dr->elem = ELEM_UINT16;
+	else if ( H5Tequal(type, H5T_NATIVE_INT32) > 0 ) dr->elem = ELEM_INT32;
+	else if ( H5Tequal(type, H5T_NATIVE_UINT32) > 0 ) dr->elem = ELEM_UINT32;
+	else {
+		H5Tclose(type);
 		return 1;
 	}
-	profile_end("H5Dopen2");
+	dr->elem_size = H5Tget_size(type);
+	H5Tclose(type);
 
-	cffree(panel_full_path);
+	dcpl = H5Dget_create_plist(dh);
+	if ( dcpl < 0 ) return 1;
 
-	/* Set up dataspace for file
-	 * (determine where to read the data from) */
-	dataspace = H5Dget_space(dh);
-	ndims = H5Sget_simple_extent_ndims(dataspace);
-	if ( ndims < 0 ) {
-		ERROR("Failed to get number of dimensions for panel %s\n",
-		      p->name);
-		H5Sclose(dataspace);
-		H5Dclose(dh);
+	if ( (H5Pget_layout(dcpl) != H5D_CHUNKED)
+	  || (H5Pget_chunk(dcpl, dr->ndims, dr->chunk_dims) != dr->ndims) )
+	{
+		H5Pclose(dcpl);
 		return 1;
 	}
 
-	/* Does the array have the expected number of dimensions? */
-	total_dt_dims = total_dimensions(p);
-	plh_dt_dims = imh_num_placeholders(p);
-	if ( ndims != total_dt_dims ) {
-		/* If the dimensions match after excluding
-		 * placeholders, it's OK - probably a static mask
-		 * in a multi-event file. */
-		if ( skip_placeholders_ok
-		  && (ndims == total_dt_dims - plh_dt_dims) )
-		{
-			make_placeholder_skip(dt_dims, p->dims);
-			n_dt_dims = total_dt_dims - plh_dt_dims;
-		} else {
-			ERROR("Unexpected number of dimensions for "
-			      "panel %s (%i, but expected %i or %i)\n",
-			      p->name, ndims, total_dt_dims,
+	dr->chunk_nelem = 1;
+	for ( i=0; i<dr->ndims; i++ ) {
+		dr->chunk_nelem *= dr->chunk_dims[i];
+	}
+
+	/* Optionally a byte shuffle, then exactly one codec */
+	dr->byte_shuffle = 0;
+	n_filters = H5Pget_nfilters(dcpl);
+	for ( i=0; i<n_filters; i++ ) {
+
+		H5Z_filter_t filter;
+		unsigned int flags;
+		unsigned int cd_values[8];
+		size_t cd_nelmts = 8;
+
+		filter = H5Pget_filter2(dcpl, i, &flags, &cd_nelmts, cd_values,
+		                        0, NULL, NULL);
+
+		if ( have_codec ) {
+			have_codec = 0;
+			break;
+		}
+
+		if ( (filter == H5Z_FILTER_SHUFFLE) && (i == 0) ) {
+			dr->byte_shuffle = 1;
+		} else if ( filter == H5Z_FILTER_DEFLATE ) {
+			dr->codec = CODEC_DEFLATE;
+			have_codec = 1;
+		} else if ( (filter == FILTER_BITSHUFFLE) && (cd_nelmts > 4)
+		         && (cd_values[4] == BSHUF_LZ4) )
+		{
+			dr->codec = CODEC_BSHUF_LZ4;
+			have_codec = 1;
+		} else if ( (filter == FILTER_BITSHUFFLE) && (cd_nelmts > 4)
+		         && (cd_values[4] == BSHUF_ZSTD) )
+		{
+			dr->codec = CODEC_BSHUF_ZSTD;
+			have_codec = 1;
+		} else if ( filter == FILTER_ZSTD ) {
+			dr->codec = CODEC_ZSTD;
+			have_codec = 1;
+		} else {
+			break;
+		}
+
+	}
+	H5Pclose(dcpl);
+
+	/* Uncompressed chunks are better left to HDF5 */
+	if ( !have_codec ) return 1;
+	if ( (dr->codec == CODEC_BSHUF_LZ4 || dr->codec == CODEC_BSHUF_ZSTD)
+	  && dr->byte_shuffle ) return 1;
+
+	return !direct_codec_available(dr->codec);
+}
+
+
+static uint32_t read_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+	     | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+
+static uint64_t read_be64(const unsigned char *p)
+{
+	return ((uint64_t)read_be32(p) << 32) | read_be32(p+4);
+}
+
+
+/* Reverses the bitshuffle transform for n elements (a multiple of 8).  The
+ * input is elem_size*8 rows of n bits, one for each bit of each byte of the
+ * elements.  Each group of eight rows for one byte of eight neighbouring
+ * elements is an 8x8 bit matrix, transposed with 64-bit operations.  The loop
+ * over groups has no dependencies between iterations, so that the compiler
+ * can vectorise it. */
+static void bit_unshuffle(const unsigned char *in, unsigned char *out,
+                          size_t n, size_t elem_size)
+{
+	size_t row_bytes = n/8;
+	size_t b, q;
+
+	for ( b=0; b<elem_size; b++ ) {
+
+		const unsigned char *rows = in + b*8*row_bytes;
+
+		for ( q=0; q<row_bytes; q++ ) {
+
+			uint64_t x = 0;
+			uint64_t t;
+			int k;
+
+			for ( k=0; k<8; k++ ) {
+				x |= (uint64_t)rows[k*row_bytes+q] << (8*k);
+			}
+
+			t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+			x = x ^ t ^ (t << 7);
+			t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+			x = x ^ t ^ (t << 14);
+			t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+			x = x ^ t ^ (t << 28);
+
+			for ( k=0; k<8; k++ ) {
+				out[(8*q+k)*elem_size+b] = (x >> (8*k)) & 0xff;
+			}
+
+		}
+	}
+}
+
+
+static void byte_unshuffle(const unsigned char *in, unsigned char *out,
+                           size_t n, size_t elem_size)
+{
+	size_t b, j;
+
+	for ( b=0; b<elem_size; b++ ) {
+		for ( j=0; j<n; j++ ) {
+			out[j*elem_size+b] = in[b*n+j];
+		}
+	}
+}
+
+
+static int decompress_block(enum chunk_codec codec,
+                            const unsigned char *in, size_t in_size,
+                            unsigned char *out, size_t out_size)
+{
+	switch ( codec ) {
+
+		case CODEC_DEFLATE :
+		#ifdef HAVE_ZLIB
+		{
+			uLongf len = out_size;
+			if ( uncompress(out, &len, in, in_size) != Z_OK ) return 1;
+			return (len != out_size);
+		}
+		#else
+		return 1;
+		#endif
+
+		case CODEC_BSHUF_LZ4 :
+		#ifdef HAVE_LZ4
+		return LZ4_decompress_safe((const char *)in, (char *)out,
+		                           in_size, out_size) != (int)out_size;
+		#else
+		return 1;
+		#endif
+
+		case CODEC_BSHUF_ZSTD :
+		case CODEC_ZSTD :
+		#ifdef HAVE_ZSTD
+		{
+			size_t r = ZSTD_decompress(out, out_size, in, in_size);
+			if ( ZSTD_isError(r) ) return 1;
+			return (r != out_size);
+		}
+		#else
+		return 1;
+		#endif
+
+	}
+	return 1;
+}
+
+
+/* Decodes the bitshuffle filter's format: a header with the total size and
+ * the block size, then the compressed blocks, each with its size.  The
+ * elements left over after the last multiple of 8 are stored uncompressed. */
+static int bshuf_decompress(enum chunk_codec codec,
+                            const unsigned char *in, size_t in_size,
+                            unsigned char *out, size_t out_size,
+                            size_t elem_size, unsigned char *tmp)
+{
+	size_t n_elem, block_size, done, pos, leftover;
+
+	if ( in_size < 12 ) return 1;
+	if ( read_be64(in) != out_size ) return 1;
+	block_size = read_be32(in+8) / elem_size;
+	if ( (block_size == 0) || (block_size % 8) ) return 1;
+
+	n_elem = out_size / elem_size;
+	done = 0;
+	pos = 12;
+	while ( n_elem - done >= 8 ) {
+
+		size_t this_block = block_size;
+		size_t csize;
+
+		if ( n_elem - done < block_size ) {
+			this_block = (n_elem - done) - (n_elem - done) % 8;
+		}
+
+		if ( pos + 4 > in_size ) return 1;
+		csize = read_be32(in+pos);
+		pos += 4;
+		if ( pos + csize > in_size ) return 1;
+
+		if ( decompress_block(codec, in+pos, csize,
+		                      tmp, this_block*elem_size) ) return 1;
+		pos += csize;
+
+		bit_unshuffle(tmp, out+done*elem_size, this_block, elem_size);
+		done += this_block;
+
+	}
+
+	leftover = (n_elem - done)*elem_size;
+	if ( pos + leftover > in_size ) return 1;
+	memcpy(out+done*elem_size, in+pos, leftover);
+
+	return 0;
+}
+
+
+static void convert_to_float(const unsigned char *in, enum chunk_elem elem,
+                             float *out, size_t n)
+{
+	size_t i;
+
+	switch ( elem ) {
+
+		case ELEM_FLOAT :
+		memcpy(out, in, n*sizeof(float));
+		break;
+
+		case ELEM_DOUBLE :
+		for ( i=0; i<n; i++ ) out[i] = ((const double *)in)[i];
+		break;
+
+		case ELEM_INT8 :
+		for ( i=0; i<n; i++ ) out[i] = ((const int8_t *)in)[i];
+		break;
+
+		case ELEM_UINT8 :
+		for ( i=0; i<n; i++ ) out[i] = ((const uint8_t *)in)[i];
+		break;
+
+		case ELEM_INT16 :
+		for ( i=0; i<n; i++ ) out[i] = ((const int16_t *)in)[i];
+		break;
+
+		case ELEM_UINT16 :
+		for ( i=0; i<n; i++ ) out[i] = ((const uint16_t *)in)[i];
+		break;
+
+		case ELEM_INT32 :
+		for ( i=0; i<n; i++ ) out[i] = ((const int32_t *)in)[i];
+		break;
+
+		case ELEM_UINT32 :
+		for ( i=0; i<n; i++ ) out[i] = ((const uint32_t *)in)[i];
+		break;
+
+	}
+}
+
+
+/* Copies the part of the chunk which is inside the region */
+static void copy_chunk_to_region(struct direct_read *dr,
+                                 const hsize_t *c_offset,
+                                 const unsigned char *plain)
+{
+	hsize_t lo[MAX_DIMS], hi[MAX_DIMS], idx[MAX_DIMS];
+	hsize_t c_stride[MAX_DIMS], b_stride[MAX_DIMS];
+	hsize_t cs = 1, bs = 1;
+	int last = dr->ndims - 1;
+	int d;
+
+	for ( d=last; d>=0; d-- ) {
+		hsize_t c_end = c_offset[d] + dr->chunk_dims[d];
+		hsize_t b_end = dr->b_offset[d] + dr->b_count[d];
+		lo[d] = (c_offset[d] > dr->b_offset[d]) ? c_offset[d]
+		                                       : dr->b_offset[d];
+		hi[d] = (c_end < b_end) ? c_end : b_end;
+		if ( lo[d] >= hi[d] ) return;
+		c_stride[d] = cs;
+		b_stride[d] = bs;
+		cs *= dr->chunk_dims[d];
+		bs *= dr->b_count[d];
+		idx[d] = lo[d];
+	}
+
+	/* One contiguous run along the last dimension at a time */
+	do {
+
+		hsize_t c_pos = 0;
+		hsize_t b_pos = 0;
+
+		for ( d=0; d<=last; d++ ) {
+			c_pos += (idx[d] - c_offset[d]) * c_stride[d];
+			b_pos += (idx[d] - dr->b_offset[d]) * b_stride[d];
+		}
+		convert_to_float(plain + c_pos*dr->elem_size, dr->elem,
+		                 dr->out + b_pos, hi[last] - lo[last]);
+
+		for ( d=last-1; d>=0; d-- ) {
+			if ( ++idx[d] < hi[d] ) break;
+			idx[d] = lo[d];
+		}
+
+	} while ( d >= 0 );
+}
+
+
+static void *get_chunk(void *vp)
+{
+	struct direct_read *dr = vp;
+	if ( dr->next_chunk == dr->n_chunks ) return NULL;
+	return &dr->chunks[dr->next_chunk++];
+}
+
+
+static void decode_chunk(void *vp, int cookie)
+{
+	struct raw_chunk *chunk = vp;
+	struct direct_read *dr = chunk->dr;
+	size_t nbytes = dr->chunk_nelem * dr->elem_size;
+	unsigned char *plain;
+	unsigned char *tmp;
+	int r;
+
+	plain = thread_pool_scratch(2*nbytes);
+	if ( plain == NULL ) {
+		dr->failed = 1;
+		return;
+	}
+	tmp = plain + nbytes;
+
+	if ( (dr->codec == CODEC_BSHUF_LZ4) || (dr->codec == CODEC_BSHUF_ZSTD) ) {
+		r = bshuf_decompress(dr->codec, chunk->data, chunk->size,
+		                     plain, nbytes, dr->elem_size, tmp);
+	} else if ( dr->byte_shuffle ) {
+		r = decompress_block(dr->codec, chunk->data, chunk->size,
+		                     tmp, nbytes);
+		if ( !r ) byte_unshuffle(tmp, plain, dr->chunk_nelem,
+		                         dr->elem_size);
+	} else {
+		r = decompress_block(dr->codec, chunk->data, chunk->size,
+		                     plain, nbytes);
+	}
+
+	if ( r ) {
+		dr->failed = 1;
+		return;
+	}
+
+	copy_chunk_to_region(dr, chunk->offset, plain);
+}
+
+
+/* Reads the region of the dataset given by b_offset and b_count into out, as
+ * floats, by fetching the compressed chunks and decoding them here.  Returns
+ * non-zero if this isn't possible, in which case H5Dread() should be used. */
+static int read_region_direct(hid_t dh, int ndims,
+                              const hsize_t *b_offset, const hsize_t *b_count,
+                              float *out)
+{
+	struct direct_read dr;
+	hsize_t first[MAX_DIMS], last[MAX_DIMS], idx[MAX_DIMS];
+	int d, i;
+	int n_chunks;
+
+	#if !H5_VERSION_GE(1,10,3)
+	return 1;
+	#endif
+
+	if ( direct_chunk_threads < 1 ) return 1;
+	if ( (ndims < 1) || (ndims > MAX_DIMS) ) return 1;
+
+	dr.ndims = ndims;
+	if ( direct_read_setup(dh, &dr) ) return 1;
+
+	/* Which chunks cover the region? */
+	n_chunks = 1;
+	for ( d=0; d<ndims; d++ ) {
+		first[d] = b_offset[d] / dr.chunk_dims[d];
+		last[d] = (b_offset[d] + b_count[d] - 1) / dr.chunk_dims[d];
+		n_chunks *= last[d] - first[d] + 1;
+		idx[d] = first[d];
+	}
+
+	dr.chunks = cfcalloc(n_chunks, sizeof(struct raw_chunk));
+	if ( dr.chunks == NULL ) return 1;
+	dr.n_chunks = n_chunks;
+	dr.next_chunk = 0;
+	dr.failed = 0;
+	dr.b_offset = b_offset;
+	dr.b_count = b_count;
+	dr.out = out;
+
+	/* Fetch the compressed chunks, in this thread only */
+	profile_start("read-chunks");
+	for ( i=0; i<n_chunks; i++ ) {
+
+		struct raw_chunk *chunk = &dr.chunks[i];
+		hsize_t size;
+		uint32_t filter_mask;
+
+		chunk->dr = &dr;
+		for ( d=0; d<ndims; d++ ) {
+			chunk->offset[d] = idx[d] * dr.chunk_dims[d];
+		}
+		for ( d=ndims-1; d>=0; d-- ) {
+			if ( ++idx[d] <= last[d] ) break;
+			idx[d] = first[d];
+		}
+
+		/* Unallocated chunks (fill value) are left to HDF5 */
+		if ( (H5Dget_chunk_storage_size(dh, chunk->offset, &size) < 0)
+		  || (size == 0) )
+		{
+			dr.failed = 1;
+			break;
+		}
+
+		chunk->data = cfmalloc(size);
+		if ( chunk->data == NULL ) {
+			dr.failed = 1;
+			break;
+		}
+		chunk->size = size;
+
+		if ( (H5Dread_chunk(dh, H5P_DEFAULT, chunk->offset,
+		                    &filter_mask, chunk->data) < 0)
+		  || (filter_mask != 0) )
+		{
+			dr.failed = 1;
+			break;
+		}
+
+	}
+	profile_end("read-chunks");
+
+	/* Decode them in parallel */
+	if ( !dr.failed ) {
+		profile_start("decode-chunks");
+		if ( (direct_chunk_threads > 1) && (n_chunks > 1) ) {
+			run_threads(direct_chunk_threads, decode_chunk,
+			            get_chunk, NULL, &dr, 0, 0, 0, 0);
+		} else {
+			for ( i=0; i<n_chunks; i++ ) {
+				decode_chunk(&dr.chunks[i], 0);
+			}
+		}
+		profile_end("decode-chunks");
+	}
+
+	for ( i=0; i<n_chunks; i++ ) {
+		cffree(dr.chunks[i].data);
+	}
+	cffree(dr.chunks);
+
+	return dr.failed;
+}
+
+/* Works out where in the dataset, which has ndims dimensions, to read the
+ * panel's data from.  f_offset and f_count must have room for ndims values.
+ * The positions of the fast and slow scan dimensions are put in *fs_dim and
+ * *ss_dim, or -1 if the panel doesn't have them. */
+static int panel_selection(struct panel_template *p, const char *event,
+                           int ndims, int skip_placeholders_ok,
+                           hsize_t *f_offset, hsize_t *f_count,
+                           int *fs_dim, int *ss_dim)
+{
+	int total_dt_dims;
+	int plh_dt_dims;
+	int dt_dims[MAX_DIMS];
+	int n_dt_dims;
+	int dim;
+	int *dim_vals;
+	int n_dim_vals;
+	int pl_pos;
+
+	/* Does the array have the expected number of dimensions? */
+	total_dt_dims = total_dimensions(p);
+	plh_dt_dims = imh_num_placeholders(p);
+	if ( ndims != total_dt_dims ) {
+		/* If the dimensions match after excluding
+		 * placeholders, it's OK - probably a static mask
+		 * in a multi-event file. */
+		if ( skip_placeholders_ok
+		  && (ndims == total_dt_dims - plh_dt_dims) )
+		{
+			make_placeholder_skip(dt_dims, p->dims);
+			n_dt_dims = total_dt_dims - plh_dt_dims;
+		} else {
+			ERROR("Unexpected number of dimensions for "
+			      "panel %s (%i, but expected %i or %i)\n",
+			      p->name, ndims, total_dt_dims,
 			      total_dt_dims - plh_dt_dims);
-			H5Dclose(dh);
-			H5Sclose(dataspace);
 			return 1;
 		}
 	} else {
@@ -445,106 +1368,504 @@ static int load_hdf5_hyperslab(struct panel_template *p,
 		for ( i=0; i<MAX_DIMS; i++ ) {
 			dt_dims[i] = p->dims[i];
 		}
-		n_dt_dims = total_dt_dims;
+		n_dt_dims = total_dt_dims;
+	}
+
+	/* Get those placeholder values from the event ID */
+	dim_vals = read_dim_parts(event, &n_dim_vals);
+
+	*fs_dim = -1;
+	*ss_dim = -1;
+	pl_pos = 0;
+	for ( dim=0; dim<n_dt_dims; dim++ ) {
+
+		switch ( dt_dims[dim] ) {
+
+			case DIM_FS:
+			f_offset[dim] = p->orig_min_fs;
+			f_count[dim] = p->orig_max_fs - p->orig_min_fs+1;
+			*fs_dim = dim;
+			break;
+
+			case DIM_SS:
+			f_offset[dim] = p->orig_min_ss;
+			f_count[dim] = p->orig_max_ss - p->orig_min_ss+1;
+			*ss_dim = dim;
+			break;
+
+			case DIM_PLACEHOLDER:
+			f_offset[dim] = dim_vals[pl_pos++];
+			f_count[dim] = 1;
+			break;
+
+			case DIM_UNDEFINED:
+			ERROR("Undefined dimension found!\n");
+			break;
+
+			default:
+			/* Fixed value */
+			f_offset[dim] = dt_dims[dim];
+			f_count[dim] = 1;
+			break;
+
+		}
+	}
+
+	cffree(dim_vals);
+	return 0;
+}
+
+
+static int load_hdf5_hyperslab(struct panel_template *p,
+                               hid_t fh,
+                               const char *event,
+                               void *data,
+                               hid_t el_type, size_t el_size,
+                               int skip_placeholders_ok,
+                               const char *path_spec,
+                               hid_t *orig_type)
+{
+	herr_t r;
+	hsize_t *f_offset, *f_count;
+	hid_t dh;
+	herr_t check;
+	hid_t dataspace, memspace;
+	hsize_t dims[2];
+	char *panel_full_path;
+	int ndims;
+	int fs_dim, ss_dim;
+
+	panel_full_path = substitute_path(event, path_spec,
+	                                  skip_placeholders_ok);
+	if ( panel_full_path == NULL ) {
+		ERROR("Invalid path substitution: '%s' '%s'\n",
+		      event, path_spec);
+		return 1;
+	}
+
+	profile_start("H5Dopen2");
+	dh = open_hdf5_dataset(fh, panel_full_path);
+	if ( dh < 0 ) {
+		ERROR("Cannot open data for panel %s (%s)\n",
+		      p->name, panel_full_path);
+		profile_end("H5Dopen2");
+		cffree(panel_full_path);
+		return 1;
+	}
+	profile_end("H5Dopen2");
+
+	cffree(panel_full_path);
+
+	/* Set up dataspace for file
+	 * (determine where to read the data from) */
+	dataspace = H5Dget_space(dh);
+	ndims = H5Sget_simple_extent_ndims(dataspace);
+	if ( ndims < 0 ) {
+		ERROR("Failed to get number of dimensions for panel %s\n",
+		      p->name);
+		H5Sclose(dataspace);
+		release_hdf5_dataset(fh, dh);
+		return 1;
+	}
+
+	f_offset = cfmalloc(ndims*sizeof(hsize_t));
+	f_count = cfmalloc(ndims*sizeof(hsize_t));
+	if ( (f_offset == NULL) || (f_count == NULL ) ) {
+		ERROR("Failed to allocate offset or count.\n");
+		cffree(f_offset);
+		cffree(f_count);
+		release_hdf5_dataset(fh, dh);
+		H5Sclose(dataspace);
+		return 1;
+	}
+
+	if ( panel_selection(p, event, ndims, skip_placeholders_ok,
+	                     f_offset, f_count, &fs_dim, &ss_dim) )
+	{
+		cffree(f_offset);
+		cffree(f_count);
+		release_hdf5_dataset(fh, dh);
+		H5Sclose(dataspace);
+		return 1;
+	}
+
+	check = H5Sselect_hyperslab(dataspace, H5S_SELECT_SET,
+	                            f_offset, NULL, f_count, NULL);
+	if ( check < 0 ) {
+		ERROR("Error selecting file dataspace for panel %s\n",
+		      p->name);
+		cffree(f_offset);
+		cffree(f_count);
+		release_hdf5_dataset(fh, dh);
+		H5Sclose(dataspace);
+		return 1;
+	}
+
+	dims[0] = p->orig_max_ss - p->orig_min_ss + 1;
+	dims[1] = p->orig_max_fs - p->orig_min_fs + 1;
+
+	/* The panel's elements are in the same order in the region as they
+	 * would be in the two-dimensional memory space */
+	if ( (el_type == H5T_NATIVE_FLOAT)
+	  && (read_region_direct(dh, ndims, f_offset, f_count, data) == 0) )
+	{
+		r = 0;
+		H5Sclose(dataspace);
+	} else {
+		memspace = H5Screate_simple(2, dims, NULL);
+		profile_start("H5Dread");
+		r = H5Dread(dh, el_type, memspace, dataspace, H5P_DEFAULT,
+		            data);
+		H5Sclose(memspace);
+		H5Sclose(dataspace);
+		profile_end("H5Dread");
+	}
+	if ( r < 0 ) {
+		ERROR("Couldn't read data for panel %s\n",
+		      p->name);
+		cffree(f_offset);
+		cffree(f_count);
+		cffree(data);
+		release_hdf5_dataset(fh, dh);
+		return 1;
+	}
+
+	cffree(f_offset);
+	cffree(f_count);
+
+	if ( orig_type != NULL ) {
+		*orig_type = H5Dget_type(dh);
+	}
+
+	release_hdf5_dataset(fh, dh);
+
+	return 0;
+}
+
+
+/* Returns the region b_offset/b_count of dataset dh, which must be one frame
+ * along dimension frame_dim, from a block of up to batch_frames consecutive
+ * frames.  The block is read, starting with this frame, if the frame isn't
+ * already in memory.  Returns NULL if the file isn't cached or the frames
+ * can't be read like this, in which case the caller should read the region
+ * by itself. */
+static float *frame_from_block(hid_t fh, hid_t dh, hid_t dataspace,
+                               int ndims, int frame_dim,
+                               const hsize_t *b_offset, const hsize_t *b_count,
+                               hsize_t n_box)
+{
+	struct cached_dataset *ds;
+	hsize_t dims[MAX_DIMS];
+	hsize_t offset[MAX_DIMS];
+	hsize_t count[MAX_DIMS];
+	hsize_t n_frames;
+	size_t size;
+	int dim;
+
+	if ( ndims > MAX_DIMS ) return NULL;
+
+	/* The frames in the block are only contiguous if the region doesn't
+	 * extend along any slower-changing dimension */
+	for ( dim=0; dim<frame_dim; dim++ ) {
+		if ( b_count[dim] != 1 ) return NULL;
+	}
+
+	ds = find_cached_dataset(fh, dh);
+	if ( ds == NULL ) return NULL;
+
+	if ( (ds->frames_ndims == ndims) && (ds->frames_dim == frame_dim) ) {
+		int match = 1;
+		for ( dim=0; dim<ndims; dim++ ) {
+			if ( dim == frame_dim ) {
+				hsize_t first = ds->frames_offset[dim];
+				hsize_t end = first + ds->frames_count[dim];
+				if ( (b_offset[dim] < first)
+				  || (b_offset[dim] >= end) ) match = 0;
+			} else if ( (b_offset[dim] != ds->frames_offset[dim])
+			         || (b_count[dim] != ds->frames_count[dim]) )
+			{
+				match = 0;
+			}
+		}
+		if ( match ) {
+			hsize_t n = b_offset[frame_dim]
+			          - ds->frames_offset[frame_dim];
+			return &ds->frames[n*n_box];
+		}
+	}
+
+	if ( H5Sget_simple_extent_dims(dataspace, dims, NULL) != ndims ) {
+		return NULL;
+	}
+	if ( b_offset[frame_dim] >= dims[frame_dim] ) return NULL;
+
+	for ( dim=0; dim<ndims; dim++ ) {
+		offset[dim] = b_offset[dim];
+		count[dim] = b_count[dim];
+	}
+	n_frames = dims[frame_dim] - b_offset[frame_dim];
+	if ( n_frames > batch_frames ) n_frames = batch_frames;
+	count[frame_dim] = n_frames;
+
+	size = n_frames*n_box*sizeof(float);
+	if ( size > ds->frames_size ) {
+		float *frames = cfmalloc(size);
+		if ( frames == NULL ) return NULL;
+		cffree(ds->frames);
+		ds->frames = frames;
+		ds->frames_size = size;
+	}
+
+	/* In case the read fails part of the way through */
+	ds->frames_ndims = 0;
+
+	if ( read_region_direct(dh, ndims, offset, count, ds->frames) ) {
+		hid_t memspace;
+		herr_t r;
+		r = H5Sselect_hyperslab(dataspace, H5S_SELECT_SET,
+		                        offset, NULL, count, NULL);
+		if ( r < 0 ) return NULL;
+		memspace = H5Screate_simple(ndims, count, NULL);
+		profile_start("H5Dread");
+		r = H5Dread(dh, H5T_NATIVE_FLOAT, memspace, dataspace,
+		            H5P_DEFAULT, ds->frames);
+		profile_end("H5Dread");
+		H5Sclose(memspace);
+		if ( r < 0 ) return NULL;
+	}
+
+	ds->frames_ndims = ndims;
+	ds->frames_dim = frame_dim;
+	for ( dim=0; dim<ndims; dim++ ) {
+		ds->frames_offset[dim] = offset[dim];
+		ds->frames_count[dim] = count[dim];
+	}
+	return ds->frames;
+}
+
+
+/* Reads the data for several panels which are all in the same dataset, with
+ * one read of the region which covers all of them.  The region is then split
+ * up into the panel buffers.  Returns non-zero if the panels can't be read
+ * like this, e.g. if they are far apart in the dataset, so that the caller
+ * can read them one by one instead.  If 'ida' isn't NULL, its scratch space
+ * is used for the region, so that it's kept for the next frame.  With
+ * image_hdf5_set_batch_frames(), the region is read for several frames at
+ * once, and also works for a single panel. */
+static int load_hdf5_panel_group(struct panel_template **panels,
+                                 float **data, int n_panels,
+                                 hid_t fh, const char *event,
+                                 const char *path_spec,
+                                 hid_t *orig_type, ImageDataArrays *ida)
+{
+	hid_t dh;
+	hid_t dataspace, memspace;
+	char *full_path;
+	int ndims;
+	int i, dim;
+	hsize_t *f_offset, *f_count;
+	hsize_t *b_offset, *b_count;
+	hsize_t *stride;
+	int *outer_dim, *inner_dim;
+	hsize_t n_box, n_panel_total;
+	float *box;
+	int box_in_block = 0;
+	int frame_dim = -1;
+	herr_t r;
+
+	full_path = substitute_path(event, path_spec, 0);
+	if ( full_path == NULL ) return 1;
+
+	profile_start("H5Dopen2");
+	dh = open_hdf5_dataset(fh, full_path);
+	profile_end("H5Dopen2");
+	cffree(full_path);
+	if ( dh < 0 ) return 1;
+
+	dataspace = H5Dget_space(dh);
+	ndims = H5Sget_simple_extent_ndims(dataspace);
+	if ( ndims <= 0 ) {
+		H5Sclose(dataspace);
+		release_hdf5_dataset(fh, dh);
+		return 1;
+	}
+
+	f_offset = cfmalloc(n_panels*ndims*sizeof(hsize_t));
+	f_count = cfmalloc(n_panels*ndims*sizeof(hsize_t));
+	b_offset = cfmalloc(ndims*sizeof(hsize_t));
+	b_count = cfmalloc(ndims*sizeof(hsize_t));
+	stride = cfmalloc(ndims*sizeof(hsize_t));
+	outer_dim = cfmalloc(n_panels*sizeof(int));
+	inner_dim = cfmalloc(n_panels*sizeof(int));
+	if ( (f_offset == NULL) || (f_count == NULL) || (b_offset == NULL)
+	  || (b_count == NULL) || (stride == NULL) || (outer_dim == NULL)
+	  || (inner_dim == NULL) )
+	{
+		r = -1;
+		goto out;
+	}
+
+	/* Find the region covering all the panels */
+	n_panel_total = 0;
+	for ( i=0; i<n_panels; i++ ) {
+
+		hsize_t *po = &f_offset[i*ndims];
+		hsize_t *pc = &f_count[i*ndims];
+		int fs_dim, ss_dim;
+
+		if ( panel_selection(panels[i], event, ndims, 0, po, pc,
+		                     &fs_dim, &ss_dim)
+		  || (fs_dim < 0) || (ss_dim < 0) )
+		{
+			r = -1;
+			goto out;
+		}
+
+		/* H5Dread() fills the panel buffer in the order of the
+		 * dimensions in the file */
+		outer_dim[i] = (fs_dim < ss_dim) ? fs_dim : ss_dim;
+		inner_dim[i] = (fs_dim < ss_dim) ? ss_dim : fs_dim;
+
+		for ( dim=0; dim<ndims; dim++ ) {
+			hsize_t end = po[dim] + pc[dim];
+			if ( i == 0 ) {
+				b_offset[dim] = po[dim];
+				b_count[dim] = pc[dim];
+			} else {
+				hsize_t b_end = b_offset[dim] + b_count[dim];
+				if ( po[dim] < b_offset[dim] ) {
+					b_offset[dim] = po[dim];
+				}
+				if ( end > b_end ) b_end = end;
+				b_count[dim] = b_end - b_offset[dim];
+			}
+		}
+		n_panel_total += pc[outer_dim[i]] * pc[inner_dim[i]];
+
+	}
+
+	n_box = 1;
+	for ( dim=ndims-1; dim>=0; dim-- ) {
+		stride[dim] = n_box;
+		n_box *= b_count[dim];
+	}
+
+	/* Not worth it if much of the region isn't in any panel */
+	if ( n_box > 2*n_panel_total ) {
+		r = -1;
+		goto out;
+	}
+
+	/* The frames are numbered along the last placeholder dimension */
+	if ( (batch_frames > 1) && (total_dimensions(panels[0]) == ndims) ) {
+		for ( dim=0; dim<ndims; dim++ ) {
+			if ( panels[0]->dims[dim] == DIM_PLACEHOLDER ) {
+				frame_dim = dim;
+			}
+		}
+		for ( i=1; i<n_panels; i++ ) {
+			if ( (frame_dim >= 0)
+			  && (panels[i]->dims[frame_dim] != DIM_PLACEHOLDER) )
+			{
+				frame_dim = -1;
+			}
+		}
 	}
 
-	f_offset = cfmalloc(ndims*sizeof(hsize_t));
-	f_count = cfmalloc(ndims*sizeof(hsize_t));
-	if ( (f_offset == NULL) || (f_count == NULL ) ) {
-		ERROR("Failed to allocate offset or count.\n");
-		cffree(f_offset);
-		cffree(f_count);
-		H5Dclose(dh);
-		H5Sclose(dataspace);
-		return 1;
+	if ( frame_dim >= 0 ) {
+		box = frame_from_block(fh, dh, dataspace, ndims, frame_dim,
+		                       b_offset, b_count, n_box);
+		if ( box != NULL ) box_in_block = 1;
 	}
 
-	/* Get those placeholder values from the event ID */
-	dim_vals = read_dim_parts(event, &n_dim_vals);
+	if ( box_in_block ) {
+		r = 0;
+		goto scatter;
+	}
 
-	pl_pos = 0;
-	for ( dim=0; dim<n_dt_dims; dim++ ) {
+	if ( ida != NULL ) {
+		box = image_data_arrays_scratch(ida, n_box*sizeof(float));
+	} else {
+		box = cfmalloc(n_box*sizeof(float));
+	}
+	if ( box == NULL ) {
+		r = -1;
+		goto out;
+	}
 
-		switch ( dt_dims[dim] ) {
+	if ( read_region_direct(dh, ndims, b_offset, b_count, box) == 0 ) {
+		r = 0;
+	} else {
+		r = H5Sselect_hyperslab(dataspace, H5S_SELECT_SET,
+		                        b_offset, NULL, b_count, NULL);
+		if ( r >= 0 ) {
+			memspace = H5Screate_simple(ndims, b_count, NULL);
+			profile_start("H5Dread");
+			r = H5Dread(dh, H5T_NATIVE_FLOAT, memspace, dataspace,
+			            H5P_DEFAULT, box);
+			profile_end("H5Dread");
+			H5Sclose(memspace);
+		}
+	}
 
-			case DIM_FS:
-			f_offset[dim] = p->orig_min_fs;
-			f_count[dim] = p->orig_max_fs - p->orig_min_fs+1;
-			break;
+scatter:
+	if ( r >= 0 ) {
 
-			case DIM_SS:
-			f_offset[dim] = p->orig_min_ss;
-			f_count[dim] = p->orig_max_ss - p->orig_min_ss+1;
-			break;
+		profile_start("scatter-panels");
+		for ( i=0; i<n_panels; i++ ) {
 
-			case DIM_PLACEHOLDER:
-			f_offset[dim] = dim_vals[pl_pos++];
-			f_count[dim] = 1;
-			break;
+			hsize_t *po = &f_offset[i*ndims];
+			hsize_t *pc = &f_count[i*ndims];
+			hsize_t base = 0;
+			hsize_t a, b;
+			hsize_t so = stride[outer_dim[i]];
+			hsize_t si = stride[inner_dim[i]];
+			float *out = data[i];
 
-			case DIM_UNDEFINED:
-			ERROR("Undefined dimension found!\n");
-			break;
+			for ( dim=0; dim<ndims; dim++ ) {
+				base += (po[dim] - b_offset[dim]) * stride[dim];
+			}
 
-			default:
-			/* Fixed value */
-			f_offset[dim] = dt_dims[dim];
-			f_count[dim] = 1;
-			break;
+			for ( a=0; a<pc[outer_dim[i]]; a++ ) {
+				const float *src = &box[base + a*so];
+				if ( si == 1 ) {
+					memcpy(out, src,
+					       pc[inner_dim[i]]*sizeof(float));
+					out += pc[inner_dim[i]];
+				} else {
+					for ( b=0; b<pc[inner_dim[i]]; b++ ) {
+						*out++ = src[b*si];
+					}
+				}
+			}
 
 		}
-	}
+		profile_end("scatter-panels");
 
-	cffree(dim_vals);
+		*orig_type = H5Dget_type(dh);
 
-	check = H5Sselect_hyperslab(dataspace, H5S_SELECT_SET,
-	                            f_offset, NULL, f_count, NULL);
-	if ( check < 0 ) {
-		ERROR("Error selecting file dataspace for panel %s\n",
-		      p->name);
-		cffree(f_offset);
-		cffree(f_count);
-		H5Dclose(dh);
-		H5Sclose(dataspace);
-		return 1;
 	}
 
-	dims[0] = p->orig_max_ss - p->orig_min_ss + 1;
-	dims[1] = p->orig_max_fs - p->orig_min_fs + 1;
-	memspace = H5Screate_simple(2, dims, NULL);
+	if ( (ida == NULL) && !box_in_block ) cffree(box);
 
-	profile_start("H5Dread");
-	r = H5Dread(dh, el_type, memspace, dataspace, H5P_DEFAULT, data);
-	H5Sclose(memspace);
+out:
 	H5Sclose(dataspace);
-	profile_end("H5Dread");
-	if ( r < 0 ) {
-		ERROR("Couldn't read data for panel %s\n",
-		      p->name);
-		cffree(f_offset);
-		cffree(f_count);
-		cffree(data);
-		H5Dclose(dh);
-		return 1;
-	}
-
+	release_hdf5_dataset(fh, dh);
 	cffree(f_offset);
 	cffree(f_count);
-
-	if ( orig_type != NULL ) {
-		*orig_type = H5Dget_type(dh);
-	}
-
-	H5Dclose(dh);
-
-	return 0;
+	cffree(b_offset);
+	cffree(b_count);
+	cffree(stride);
+	cffree(outer_dim);
+	cffree(inner_dim);
+	return (r < 0);
 }
 
 
 static hid_t open_hdf5_file(const char *filename)
 {
 	hid_t fh;
-	hid_t fapl;
+	struct stat s;
 
 	if ( access(filename, R_OK) == -1 ) {
 		ERROR("File does not exist or cannot be read: %s\n",
@@ -552,10 +1873,11 @@ static hid_t open_hdf5_file(const char *filename)
 		return -1;
 	}
 
-	fapl = H5Pcreate(H5P_FILE_ACCESS);
-	H5Pset_fclose_degree(fapl, H5F_CLOSE_STRONG);
-	fh = H5Fopen(filename, H5F_ACC_RDONLY, fapl);
-	H5Pclose(fapl);
+	if ( (max_cached_files > 0) && (stat(filename, &s) == 0) ) {
+		fh = open_cached_hdf5_file(filename, &s);
+	} else {
+		fh = really_open_hdf5_file(filename);
+	}
 	if ( fh < 0 ) {
 		ERROR("Couldn't open HDF5 file: %s\n", filename);
 		return -1;
@@ -591,89 +1913,179 @@ static hid_t open_hdf5(struct image *image)
 }
 
 
+static void mark_nonfinite_pixels(struct image *image, int i,
+                                  struct panel_template *p)
+{
+	long int j;
+
+	profile_start("nan-inf");
+	for ( j=0; j<PANEL_WIDTH(p)*PANEL_HEIGHT(p); j++ ) {
+		if ( !isfinite(image->dp[i][j]) ) {
+			image->bad[i][j] = 1;
+		}
+	}
+	profile_end("nan-inf");
+}
+
+
 int image_hdf5_read(struct image *image,
                     const DataTemplate *dtempl)
 {
 	int i;
 	hid_t fh;
+	int *done;
+	int *group;
+	struct panel_template **group_panels;
+	float **group_data;
 
 	if ( image->ev == NULL ) {
 		image->ev = "//";
 	}
 
+	done = cfcalloc(dtempl->n_panels, sizeof(int));
+	group = cfmalloc(dtempl->n_panels*sizeof(int));
+	group_panels = cfmalloc(dtempl->n_panels*sizeof(struct panel_template *));
+	group_data = cfmalloc(dtempl->n_panels*sizeof(float *));
+	if ( (done == NULL) || (group == NULL) || (group_panels == NULL)
+	  || (group_data == NULL) )
+	{
+		ERROR("Failed to allocate panel groups\n");
+		cffree(done);
+		cffree(group);
+		cffree(group_panels);
+		cffree(group_data);
+		return 1;
+	}
+
 	profile_start("open-hdf5");
 	fh = open_hdf5(image);
 	profile_end("open-hdf5");
 	if ( fh < 0 ) {
 		ERROR("Failed to open file\n");
+		cffree(done);
+		cffree(group);
+		cffree(group_panels);
+		cffree(group_data);
 		return 1;
 	}
 
 	for ( i=0; i<dtempl->n_panels; i++ ) {
-		long int j;
-		struct panel_template *p = &dtempl->panels[i];
+
+		int j, n_group;
 		hid_t orig_type;
+
+		if ( done[i] ) continue;
+
+		/* Panels which are in the same dataset (e.g. the modules of
+		 * a multi-module detector) can all be read at once */
+		n_group = 0;
+		for ( j=i; j<dtempl->n_panels; j++ ) {
+			if ( done[j] ) continue;
+			if ( strcmp(dtempl->panels[j].data,
+			            dtempl->panels[i].data) != 0 ) continue;
+			group[n_group] = j;
+			group_panels[n_group] = &dtempl->panels[j];
+			group_data[n_group] = image->dp[j];
+			n_group++;
+		}
+
 		profile_start("load-hdf5-hyperslab");
-		if ( load_hdf5_hyperslab(p, fh,
-		                         image->ev, image->dp[i],
-		                         H5T_NATIVE_FLOAT,
-		                         sizeof(float), 0,
-		                         dtempl->panels[i].data,
-		                         &orig_type) )
+		if ( ((n_group > 1) || (batch_frames > 1))
+		  && !load_hdf5_panel_group(group_panels, group_data, n_group,
+		                            fh, image->ev,
+		                            dtempl->panels[i].data,
+		                            &orig_type, image->ida) )
 		{
-			ERROR("Failed to load panel data\n");
 			profile_end("load-hdf5-hyperslab");
-			close_hdf5(fh);
-			return 1;
-		}
-		profile_end("load-hdf5-hyperslab");
-		if ( H5Tget_class(orig_type) == H5T_FLOAT ) {
-			profile_start("nan-inf");
-			for ( j=0; j<PANEL_WIDTH(p)*PANEL_HEIGHT(p); j++ ) {
-				if ( !isfinite(image->dp[i][j]) ) {
-					image->bad[i][j] = 1;
+			for ( j=0; j<n_group; j++ ) {
+				if ( H5Tget_class(orig_type) == H5T_FLOAT ) {
+					mark_nonfinite_pixels(image, group[j],
+					                      group_panels[j]);
 				}
+				done[group[j]] = 1;
+			}
+			H5Tclose(orig_type);
+			continue;
+		}
+
+		/* Otherwise, read the panels one by one */
+		for ( j=0; j<n_group; j++ ) {
+			struct panel_template *p = group_panels[j];
+			if ( load_hdf5_hyperslab(p, fh,
+			                         image->ev, image->dp[group[j]],
+			                         H5T_NATIVE_FLOAT,
+			                         sizeof(float), 0,
+			                         p->data,
+			                         &orig_type) )
+			{
+				ERROR("Failed to load panel data\n");
+				profile_end("load-hdf5-hyperslab");
+				release_hdf5(fh);
+				cffree(done);
+				cffree(group);
+				cffree(group_panels);
+				cffree(group_data);
+				return 1;
+			}
+			if ( H5Tget_class(orig_type) == H5T_FLOAT ) {
+				mark_nonfinite_pixels(image, group[j], p);
 			}
-			profile_end("nan-inf");
+			H5Tclose(orig_type);
+			done[group[j]] = 1;
 		}
-		H5Tclose(orig_type);
+		profile_end("load-hdf5-hyperslab");
 	}
 
-	close_hdf5(fh);
+	release_hdf5(fh);
+	cffree(done);
+	cffree(group);
+	cffree(group_panels);
+	cffree(group_data);
 	return 0;
 }
 
 
-int image_hdf5_read_satmap(struct panel_template *p,
-                           const char *filename,
-                           const char *event,
-                           const char *map_location,
-                           float *map_data)
+float *image_hdf5_read_satmap(struct panel_template *p,
+                              const char *filename,
+                              const char *event,
+                              const char *map_location)
 {
 	hid_t fh;
+	float *map_data;
+	int p_w, p_h;
+
+	p_w = p->orig_max_fs - p->orig_min_fs + 1;
+	p_h = p->orig_max_ss - p->orig_min_ss + 1;
+
+	map_data = cfmalloc(p_w*p_h*sizeof(float));
+	if ( map_data == NULL ) return NULL;
 
 	fh = open_hdf5_file(filename);
-	if ( fh < 0 ) return 1;
+	if ( fh < 0 ) {
+		cffree(map_data);
+		return NULL;
+	}
 
 	if ( load_hdf5_hyperslab(p, fh, event,
 	                         map_data, H5T_NATIVE_FLOAT,
 	                         sizeof(float), 1, map_location, NULL) )
 	{
 		ERROR("Failed to load saturation map data\n");
-		close_hdf5(fh);
-		return 1;
+		release_hdf5(fh);
+		cffree(map_data);
+		return NULL;
 	}
 
-	close_hdf5(fh);
+	release_hdf5(fh);
 
-	return 0;
+	return map_data;
 }
 
 
 
 int image_hdf5_read_mask(struct panel_template *p,
                          const char *filename, const char *event,
-                         int *bad, const char *mask_location,
+                         uint8_t *bad, const char *mask_location,
                          int mask_good, int mask_bad)
 {
 	int p_w, p_h;
@@ -698,12 +2110,12 @@ int image_hdf5_read_mask(struct panel_template *p,
 	                         sizeof(int), 1, mask_location, NULL) )
 	{
 		ERROR("Failed to load mask data\n");
-		close_hdf5(fh);
+		release_hdf5(fh);
 		cffree(mask);
 		return 1;
 	}
 
-	close_hdf5(fh);
+	release_hdf5(fh);
 
 	for ( j=0; j<p_w*p_h; j++ ) {
 
@@ -809,20 +2221,21 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 	subst_name = substitute_path(image->ev, name, 1);
 	if ( subst_name == NULL ) {
 		ERROR("Invalid event ID '%s'\n", image->ev);
-		close_hdf5(fh);
+		release_hdf5(fh);
 		return 1;
 	}
 
-	dh = H5Dopen2(fh, subst_name, H5P_DEFAULT);
+	dh = open_hdf5_dataset(fh, subst_name);
 	if ( dh < 0 ) {
 		ERROR("No such numeric field '%s'\n", subst_name);
 		cffree(subst_name);
-		close_hdf5(fh);
+		release_hdf5(fh);
 		return 1;
 	}
 
 	type = H5Dget_type(dh);
 	class = H5Tget_class(type);
+	H5Tclose(type);
 
 	switch ( class ) {
 
@@ -835,7 +2248,7 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 		default:
 		ERROR("HDF5 header is not a recognised type (%s).\n",
 		      subst_name);
-		close_hdf5(fh);
+		release_hdf5(fh);
 		cffree(subst_name);
 		return 1;
 	}
@@ -847,7 +2260,7 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 	if ( ndims > 64 ) {
 		ERROR("Too many dimensions for numeric value\n");
 		H5Sclose(sh);
-		close_hdf5(fh);
+		release_hdf5(fh);
 		cffree(subst_name);
 		return 1;
 	}
@@ -873,7 +2286,7 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 				cffree(subst_name);
 				H5Sclose(sh);
 				H5Sclose(ms);
-				close_hdf5(fh);
+				release_hdf5(fh);
 				return 1;
 			}
 			image_cache_header_float(image, name, val);
@@ -893,7 +2306,7 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 				ERROR("Couldn't read scalar value from %s.\n",
 				      subst_name);
 				cffree(subst_name);
-				close_hdf5(fh);
+				release_hdf5(fh);
 				return 1;
 			}
 			image_cache_header_int(image, name, val);
@@ -932,7 +2345,7 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 			}
 
 			cffree(subst_name);
-			close_hdf5(fh);
+			release_hdf5(fh);
 			H5Sclose(sh);
 			H5Sclose(ms);
 			return rv;
@@ -950,7 +2363,7 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 	dim_vals = read_dim_parts(image->ev, &n_dim_vals);
 	if ( dim_vals == NULL ) {
 		ERROR("Couldn't parse event '%s'\n");
-		close_hdf5(fh);
+		release_hdf5(fh);
 		cffree(subst_name);
 		H5Sclose(sh);
 		H5Sclose(ms);
@@ -961,7 +2374,7 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 	f_count = cfmalloc(ndims*sizeof(hsize_t));
 	if ( (f_offset == NULL) || (f_count == NULL) ) {
 		ERROR("Couldn't allocate dimension arrays\n");
-		close_hdf5(fh);
+		release_hdf5(fh);
 		cffree(subst_name);
 		H5Sclose(sh);
 		H5Sclose(ms);
@@ -981,7 +2394,7 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 				      " size %i)\n",
 				      subst_name, i,
 				      dim_vals[dim_val_pos], size[i]);
-				close_hdf5(fh);
+				release_hdf5(fh);
 				H5Sclose(sh);
 				H5Sclose(ms);
 				cffree(subst_name);
@@ -1003,6 +2416,37 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 	}
 	cffree(dim_vals);
 
+	/* Serve numeric values from the whole array, if possible */
+	if ( class != H5T_STRING ) {
+
+		hsize_t n = 1;
+		hsize_t idx = 0;
+		void *vals;
+
+		for ( i=0; i<ndims; i++ ) {
+			n *= size[i];
+			idx = idx*size[i] + f_offset[i];
+		}
+
+		vals = header_array(fh, dh, class == H5T_INTEGER, n);
+		if ( vals != NULL ) {
+			if ( class == H5T_INTEGER ) {
+				image_cache_header_int(image, name,
+				                       ((int *)vals)[idx]);
+			} else {
+				image_cache_header_float(image, name,
+				                         ((double *)vals)[idx]);
+			}
+			cffree(f_offset);
+			cffree(f_count);
+			cffree(subst_name);
+			H5Sclose(sh);
+			H5Sclose(ms);
+			release_hdf5(fh);
+			return 0;
+		}
+	}
+
 	check = H5Sselect_hyperslab(sh, H5S_SELECT_SET,
 	                            f_offset, NULL, f_count, NULL);
 	if ( check < 0 ) {
@@ -1012,7 +2456,7 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 		cffree(subst_name);
 		H5Sclose(sh);
 		H5Sclose(ms);
-		close_hdf5(fh);
+		release_hdf5(fh);
 		return 1;
 	}
 
@@ -1023,7 +2467,7 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 	                            m_offset, NULL, m_count, NULL);
 	if ( check < 0 ) {
 		ERROR("Error selecting memory dataspace for header value\n");
-		close_hdf5(fh);
+		release_hdf5(fh);
 		H5Sclose(sh);
 		H5Sclose(ms);
 		cffree(subst_name);
@@ -1038,13 +2482,13 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 		H5Sclose(ms);
 		if ( r < 0 )  {
 			ERROR("Couldn't read value.\n");
-			close_hdf5(fh);
+			release_hdf5(fh);
 			cffree(subst_name);
 			return 1;
 		}
 
 		image_cache_header_float(image, name, val);
-		close_hdf5(fh);
+		release_hdf5(fh);
 		cffree(subst_name);
 		return 0;
 
@@ -1056,13 +2500,13 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 		H5Sclose(ms);
 		if ( r < 0 )  {
 			ERROR("Couldn't read value.\n");
-			close_hdf5(fh);
+			release_hdf5(fh);
 			cffree(subst_name);
 			return 1;
 		}
 
 		image_cache_header_int(image, name, val);
-		close_hdf5(fh);
+		release_hdf5(fh);
 		cffree(subst_name);
 		return 0;
 
@@ -1085,14 +2529,14 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 				ERROR("Can't read HDF5 vlen string from array - %s\n",
 				      subst_name);
 				cffree(subst_name);
-				close_hdf5(fh);
+				release_hdf5(fh);
 				return 1;
 			} else {
 
 				chomp(val);
 				image_cache_header_str(image, name, val);
 				cffree(val);
-				close_hdf5(fh);
+				release_hdf5(fh);
 				cffree(subst_name);
 				return 0;
 			}
@@ -1108,7 +2552,7 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 			ssize = H5Tget_size(stype);
 			val = cfmalloc(ssize+1);
 			if ( val == NULL ) {
-				close_hdf5(fh);
+				release_hdf5(fh);
 				H5Sclose(ms);
 				H5Sclose(sh);
 				cffree(subst_name);
@@ -1121,7 +2565,7 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 			if ( rv < 0 ) {
 				ERROR("Couldn't read HDF5 fixed string from array - %s\n",
 				      subst_name);
-				close_hdf5(fh);
+				release_hdf5(fh);
 				cffree(subst_name);
 				return 1;
 			} else {
@@ -1130,7 +2574,7 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 				chomp(val);
 				image_cache_header_str(image, name, val);
 				cffree(val);
-				close_hdf5(fh);
+				release_hdf5(fh);
 				cffree(subst_name);
 				return 0;
 
@@ -1143,7 +2587,7 @@ int image_hdf5_read_header_to_cache(struct image *image, const char *name)
 		ERROR("Invalid HDF5 class %i\n", class);
 		H5Sclose(sh);
 		H5Sclose(ms);
-		close_hdf5(fh);
+		release_hdf5(fh);
 		cffree(subst_name);
 		return 1;
 	}
@@ -1160,8 +2604,9 @@ static int read_peak_count(hid_t fh, char *path, int line,
 	hsize_t offset[1], count[1];
 	hsize_t m_offset[1], m_count[1], dimmh[1];
 	int tw, r;
+	int *counts;
 
-	dh = H5Dopen2(fh, path, H5P_DEFAULT);
+	dh = open_hdf5_dataset(fh, path);
 	if ( dh < 0 ) {
 		ERROR("Data block %s not found.\n", path);
 		return 1;
@@ -1169,7 +2614,7 @@ static int read_peak_count(hid_t fh, char *path, int line,
 
 	sh = H5Dget_space(dh);
 	if ( sh < 0 ) {
-		H5Dclose(dh);
+		release_hdf5_dataset(fh, dh);
 		ERROR("Couldn't get dataspace for data.\n");
 		return 1;
 	}
@@ -1178,7 +2623,7 @@ static int read_peak_count(hid_t fh, char *path, int line,
 		ERROR("Data block %s has the wrong dimensionality (%i).\n",
 		      path, H5Sget_simple_extent_ndims(sh));
 		H5Sclose(sh);
-		H5Dclose(dh);
+		release_hdf5_dataset(fh, dh);
 		return 1;
 	}
 
@@ -1188,12 +2633,20 @@ static int read_peak_count(hid_t fh, char *path, int line,
 
 	if ( line > tw-1 ) {
 		H5Sclose(sh);
-		H5Dclose(dh);
+		release_hdf5_dataset(fh, dh);
 		ERROR("Data block %s does not contain data for required event.\n",
 		      path);
 		return 1;
 	}
 
+	counts = header_array(fh, dh, 1, size[0]);
+	if ( counts != NULL ) {
+		*num_peaks = counts[line];
+		H5Sclose(sh);
+		release_hdf5_dataset(fh, dh);
+		return 0;
+	}
+
 	offset[0] = line;
 	count[0] = 1;
 
@@ -1202,7 +2655,7 @@ static int read_peak_count(hid_t fh, char *path, int line,
 	if ( r < 0 ) {
 		ERROR("Error selecting file dataspace "
 		      "for data block %s\n", path);
-		H5Dclose(dh);
+		release_hdf5_dataset(fh, dh);
 		H5Sclose(sh);
 		return 1;
 	}
@@ -1216,7 +2669,7 @@ static int read_peak_count(hid_t fh, char *path, int line,
 	if ( r < 0 ) {
 		ERROR("Error selecting memory dataspace "
 		      "for data block %s\n", path);
-		H5Dclose(dh);
+		release_hdf5_dataset(fh, dh);
 		H5Sclose(sh);
 		H5Sclose(mh);
 		return 1;
@@ -1226,13 +2679,13 @@ static int read_peak_count(hid_t fh, char *path, int line,
 	            sh, H5P_DEFAULT, num_peaks);
 	if ( r < 0 ) {
 		ERROR("Couldn't read data for block %s, line %i\n", path, line);
-		H5Dclose(dh);
+		release_hdf5_dataset(fh, dh);
 		H5Sclose(sh);
 		H5Sclose(mh);
 		return 1;
 	}
 
-	H5Dclose(dh);
+	release_hdf5_dataset(fh, dh);
 	H5Sclose(sh);
 	H5Sclose(mh);
 	return 0;
@@ -1249,9 +2702,10 @@ static float *read_peak_line(hid_t fh, char *path, int line,
 	hsize_t offset[2], count[2];
 	hsize_t m_offset[2], m_count[2], dimmh[2];
 	float *buf;
+	float *row;
 	int tw, r;
 
-	dh = H5Dopen2(fh, path, H5P_DEFAULT);
+	dh = open_hdf5_dataset(fh, path);
 	if ( dh < 0 ) {
 		ERROR("Data block (%s) not found.\n", path);
 		return NULL;
@@ -1259,7 +2713,7 @@ static float *read_peak_line(hid_t fh, char *path, int line,
 
 	sh = H5Dget_space(dh);
 	if ( sh < 0 ) {
-		H5Dclose(dh);
+		release_hdf5_dataset(fh, dh);
 		ERROR("Couldn't get dataspace for data.\n");
 		return NULL;
 	}
@@ -1268,7 +2722,7 @@ static float *read_peak_line(hid_t fh, char *path, int line,
 		ERROR("Data block %s has the wrong dimensionality (%i).\n",
 		      path, H5Sget_simple_extent_ndims(sh));
 		H5Sclose(sh);
-		H5Dclose(dh);
+		release_hdf5_dataset(fh, dh);
 		return NULL;
 	}
 
@@ -1277,7 +2731,7 @@ static float *read_peak_line(hid_t fh, char *path, int line,
 	tw = size[0];
 	if ( line > tw-1 ) {
 		H5Sclose(sh);
-		H5Dclose(dh);
+		release_hdf5_dataset(fh, dh);
 		ERROR("Data block %s does not contain data for required event.\n",
 		      path);
 		return NULL;
@@ -1288,10 +2742,19 @@ static float *read_peak_line(hid_t fh, char *path, int line,
 		ERROR("Data block %s is too small for the specified number of "
 		      "peaks (has %i, expected %i)\n", path, size[1], num_peaks);
 		H5Sclose(sh);
-		H5Dclose(dh);
+		release_hdf5_dataset(fh, dh);
 		return NULL;
 	}
 
+	row = table_row(fh, dh, line, size[0], size[1]);
+	if ( row != NULL ) {
+		buf = cfmalloc(size[1]*sizeof(float));
+		if ( buf != NULL ) memcpy(buf, row, size[1]*sizeof(float));
+		H5Sclose(sh);
+		release_hdf5_dataset(fh, dh);
+		return buf;
+	}
+
 	offset[0] = line;
 	offset[1] = 0;
 	count[0] = 1;
@@ -1301,7 +2764,7 @@ static float *read_peak_line(hid_t fh, char *path, int line,
 	if ( r < 0 ) {
 	    ERROR("Error selecting file dataspace "
 	          "for data block %s\n", path);
-	    H5Dclose(dh);
+	    release_hdf5_dataset(fh, dh);
 	    H5Sclose(sh);
 	    return NULL;
 	}
@@ -1319,7 +2782,7 @@ static float *read_peak_line(hid_t fh, char *path, int line,
 	if ( r < 0 ) {
 		ERROR("Error selecting memory dataspace "
 		      "for data block %s\n", path);
-		H5Dclose(dh);
+		release_hdf5_dataset(fh, dh);
 		H5Sclose(sh);
 		H5Sclose(mh);
 		return NULL;
@@ -1330,13 +2793,13 @@ static float *read_peak_line(hid_t fh, char *path, int line,
 	r = H5Dread(dh, H5T_NATIVE_FLOAT, mh, sh, H5P_DEFAULT, buf);
 	if ( r < 0 ) {
 		ERROR("Couldn't read data for block %s, line %i\n", path, line);
-		H5Dclose(dh);
+		release_hdf5_dataset(fh, dh);
 		H5Sclose(sh);
 		H5Sclose(mh);
 		return NULL;
 	}
 
-	H5Dclose(dh);
+	release_hdf5_dataset(fh, dh);
 	H5Sclose(sh);
 	H5Sclose(mh);
 	return buf;
@@ -1349,7 +2812,7 @@ ImageFeatureList *image_hdf5_read_peaks_cxi(const DataTemplate *dtempl,
                                             int half_pixel_shift)
 {
 	ImageFeatureList *features;
-	hid_t fh, fapl;
+	hid_t fh;
 	char path_n[1024];
 	char path_x[1024];
 	char path_y[1024];
@@ -1401,10 +2864,7 @@ ImageFeatureList *image_hdf5_read_peaks_cxi(const DataTemplate *dtempl,
 	snprintf(path_y, 1024, "%s/peakYPosRaw", subst_name);
 	snprintf(path_i, 1024, "%s/peakTotalIntensity", subst_name);
 
-	fapl = H5Pcreate(H5P_FILE_ACCESS);
-	H5Pset_fclose_degree(fapl, H5F_CLOSE_STRONG);
-	fh = H5Fopen(filename, H5F_ACC_RDONLY, fapl);
-	H5Pclose(fapl);
+	fh = open_hdf5_file(filename);
 	if ( fh < 0 ) {
 		ERROR("Couldn't open file (peaks/cxi): %s\n", filename);
 		cffree(subst_name);
@@ -1413,14 +2873,14 @@ ImageFeatureList *image_hdf5_read_peaks_cxi(const DataTemplate *dtempl,
 
 	r = read_peak_count(fh, path_n, line, &num_peaks);
 	if ( r != 0 ) {
-		close_hdf5(fh);
+		release_hdf5(fh);
 		cffree(subst_name);
 		return NULL;
 	}
 
 	buf_x = read_peak_line(fh, path_x, line, num_peaks);
 	if ( buf_x == NULL ) {
-		close_hdf5(fh);
+		release_hdf5(fh);
 		cffree(subst_name);
 		return NULL;
 	}
@@ -1429,7 +2889,7 @@ ImageFeatureList *image_hdf5_read_peaks_cxi(const DataTemplate *dtempl,
 	if ( buf_y == NULL ) {
 		cffree(buf_x);
 		cffree(subst_name);
-		close_hdf5(fh);
+		release_hdf5(fh);
 		return NULL;
 	}
 
@@ -1438,11 +2898,12 @@ ImageFeatureList *image_hdf5_read_peaks_cxi(const DataTemplate *dtempl,
 		cffree(buf_x);
 		cffree(buf_y);
 		cffree(subst_name);
-		close_hdf5(fh);
+		release_hdf5(fh);
 		return NULL;
 	}
 
 	features = image_feature_list_new();
+	image_feature_list_reserve(features, num_peaks);
 
 	for ( pk=0; pk<num_peaks; pk++ ) {
 
@@ -1469,7 +2930,7 @@ ImageFeatureList *image_hdf5_read_peaks_cxi(const DataTemplate *dtempl,
 	cffree(buf_i);
 	cffree(subst_name);
 
-	close_hdf5(fh);
+	release_hdf5(fh);
 
 	return features;
 }
@@ -1573,6 +3034,7 @@ ImageFeatureList *image_hdf5_read_peaks_hdf5(const DataTemplate *dtempl,
 		close_hdf5(fh);
 		return NULL;
 	}
+	image_feature_list_reserve(features, size[0]);
 
 	for ( i=0; i<size[0]; i++ ) {
 
@@ -1639,10 +3101,11 @@ struct ev_list
 static int add_ev_to_list(struct ev_list *list, char *ev_str)
 {
 	if ( list->n_events == list->max_events ) {
+		int new_max = list->max_events*2 + 128;
 		char **new_events = cfrealloc(list->events,
-		                              (list->max_events+128)*sizeof(char *));
+		                              new_max*sizeof(char *));
 		if ( new_events == NULL ) return 1;
-		list->max_events += 128;
+		list->max_events = new_max;
 		list->events = new_events;
 	}
 
@@ -1838,64 +3301,6 @@ char **expand_paths(hid_t fh, char *pattern, int *n_evs)
 }
 
 
-static int rec_expand_dims(struct ev_list *list,
-                           int *placeholder_sizes,
-                           int n_placeholder_dims,
-                           char *path_ev)
-{
-	int i;
-	char *dim_ev;
-	size_t len;
-
-	len = strlen(path_ev);
-	dim_ev = cfmalloc(len+16);
-	if ( dim_ev == NULL ) return 1;
-
-	if ( n_placeholder_dims == 1 ) {
-		for ( i=0; i<placeholder_sizes[0]; i++ ) {
-			snprintf(dim_ev, 16, "%s/%i", path_ev, i);
-			if ( add_ev_to_list(list, dim_ev) ) return 1;
-		}
-	} else {
-
-		for ( i=0; i<placeholder_sizes[0]; i++ ) {
-			snprintf(dim_ev, 16, "%s/%i", path_ev, i);
-			if ( rec_expand_dims(list,
-			                     &placeholder_sizes[1],
-			                     n_placeholder_dims - 1,
-			                     dim_ev) ) return 1;
-		}
-
-	}
-
-	cffree(dim_ev);
-	return 0;
-}
-
-
-static char **expand_dims(int *placeholder_sizes,
-                          int n_placeholder_dims,
-                          char *path_ev,
-                          int *n_evs)
-{
-	struct ev_list list;
-
-	list.n_events = 0;
-	list.max_events = 0;
-	list.events = NULL;
-
-	if ( rec_expand_dims(&list, placeholder_sizes,
-	                     n_placeholder_dims, path_ev) )
-	{
-		*n_evs = 0;
-		return NULL;
-	}
-
-	*n_evs = list.n_events;
-	return list.events;
-}
-
-
 static int n_dims_expected(struct panel_template *p)
 {
 	int i;
@@ -1907,31 +3312,31 @@ static int n_dims_expected(struct panel_template *p)
 }
 
 
-char **image_hdf5_expand_frames(const DataTemplate *dtempl,
-                                const char *filename,
-                                int *pn_frames)
+struct frame_block *image_hdf5_frame_blocks(const DataTemplate *dtempl,
+                                            const char *filename,
+                                            int *pn_blocks)
 {
 	char **path_evs;
 	int n_path_evs;
 	hid_t fh, fapl;
 	int i;
 	int dims_expected;
-	struct ev_list full_evs;
+	struct frame_block *blocks;
+	int n_blocks = 0;
 
 	if ( dtempl->n_panels == 0 ) return NULL;
 
-	full_evs.events = NULL;
-	full_evs.n_events = 0;
-	full_evs.max_events = 0;
-
 	/* If the DataTemplate already says that one frame will be
 	 * found per file, short-circuit this whole affair */
 	if ( (imh_num_placeholders(&dtempl->panels[0]) == 0)
 	  && (imh_num_path_placeholders(dtempl->panels[0].data) == 0) )
 	{
-		add_ev_to_list(&full_evs, "//");
-		*pn_frames = full_evs.n_events;
-		return full_evs.events;
+		blocks = cfmalloc(sizeof(struct frame_block));
+		if ( blocks == NULL ) return NULL;
+		blocks[0].path_ev = cfstrdup("//");
+		blocks[0].n_dims = 0;
+		*pn_blocks = 1;
+		return blocks;
 	}
 
 	if ( !file_exists(filename) ) {
@@ -1963,23 +3368,28 @@ char **image_hdf5_expand_frames(const DataTemplate *dtempl,
 		return NULL;
 	}
 
+	blocks = cfmalloc(n_path_evs*sizeof(struct frame_block));
+	if ( blocks == NULL ) {
+		close_hdf5(fh);
+		return NULL;
+	}
+
 	dims_expected = n_dims_expected(&dtempl->panels[0]);
 
-	/* For each expanded path, enumerate the placeholder
+	/* For each expanded path, find the sizes of the placeholder
 	 * dimensions.  Once again, since the number of placeholders
 	 * must be the same for each panel, and the substituted values
 	 * will be the same, this only needs to be done for one panel.
-	 */
+	 * The individual event IDs are generated later, when needed. */
 	for ( i=0; i<n_path_evs; i++ ) {
 
 		hid_t dh, sh;
 		char *path;
-		hsize_t *size;
+		hsize_t size[MAX_DIMS];
 		int dims;
-		int *placeholder_sizes;
-		int n_placeholder_dims;
 		int j;
 		struct panel_template *p = &dtempl->panels[0];
+		struct frame_block *b = &blocks[n_blocks];
 
 		path = substitute_path(path_evs[i], p->data, 0);
 		if ( path == NULL ) {
@@ -1987,7 +3397,7 @@ char **image_hdf5_expand_frames(const DataTemplate *dtempl,
 			      "expansion of '%s' with partial event "
 			      "ID '%s'\n",
 			      p->data, path_evs[i]);
-			return NULL;
+			goto fail;
 		}
 
 		dh = H5Dopen2(fh, path, H5P_DEFAULT);
@@ -1995,84 +3405,66 @@ char **image_hdf5_expand_frames(const DataTemplate *dtempl,
 			ERROR("Error opening '%s'\n", path);
 			ERROR("Failed to enumerate events.  "
 			      "Check your geometry file.\n");
-			close_hdf5(fh);
-			return NULL;
+			cffree(path);
+			goto fail;
 		}
 
 		sh = H5Dget_space(dh);
 		dims = H5Sget_simple_extent_ndims(sh);
-		if ( dims != dims_expected ) {
+		if ( (dims != dims_expected) || (dims > MAX_DIMS) ) {
 			ERROR("Unexpected number of dimensions"
 			      "(%s has %i, expected %i)\n",
 			      path, dims, dims_expected);
-			close_hdf5(fh);
-			H5Sclose(sh);
-			return NULL;
-		}
-
-		size = cfmalloc(dims*sizeof(hsize_t));
-		placeholder_sizes = cfmalloc(dims*sizeof(int));
-		if ( (size == NULL) || (placeholder_sizes == NULL) ) {
-			ERROR("Failed to allocate dimensions\n");
-			close_hdf5(fh);
 			H5Sclose(sh);
-			return NULL;
+			cffree(path);
+			goto fail;
 		}
 
 		if ( H5Sget_simple_extent_dims(sh, size, NULL) < 0 ) {
 			ERROR("Failed to get size\n");
-			close_hdf5(fh);
 			H5Sclose(sh);
-			return NULL;
+			cffree(path);
+			goto fail;
 		}
 
 		H5Sclose(sh);
+		H5Dclose(dh);
+		cffree(path);
 
-		n_placeholder_dims = 0;
+		b->n_dims = 0;
 		for ( j=0; j<dims; j++ ) {
 			if ( p->dims[j] == DIM_PLACEHOLDER ) {
-				placeholder_sizes[n_placeholder_dims++] = size[j];
+				b->sizes[b->n_dims++] = size[j];
 			}
 		}
-		cffree(size);
-
-		/* Path event ID ends with //, but expand_dims will
-		 * add a slash.  So, remove one slash */
-		if ( n_placeholder_dims > 0 ) {
-
-			char **evs_this_path;
-			int n_evs_this_path;
 
+		/* Path event ID ends with //, but each placeholder
+		 * dimension will add a slash.  So, remove one slash */
+		if ( b->n_dims > 0 ) {
 			path_evs[i][strlen(path_evs[i])-1] = '\0';
-			evs_this_path = expand_dims(placeholder_sizes,
-			                            n_placeholder_dims,
-			                            path_evs[i],
-			                            &n_evs_this_path);
-
-			for ( j=0; j<n_evs_this_path; j++ ) {
-				add_ev_to_list(&full_evs, evs_this_path[j]);
-				cffree(evs_this_path[j]);
-			}
-
-			cffree(evs_this_path);
-
-		} else {
-
-			/* Easy case with no dims to expand */
-			add_ev_to_list(&full_evs, path_evs[i]);
-
 		}
-
-		cffree(placeholder_sizes);
-		cffree(path);
-		cffree(path_evs[i]);
+		b->path_ev = path_evs[i];
+		path_evs[i] = NULL;
+		n_blocks++;
 
 	}
 
 	close_hdf5(fh);
 	cffree(path_evs);
-	*pn_frames = full_evs.n_events;
-	return full_evs.events;
+	*pn_blocks = n_blocks;
+	return blocks;
+
+fail:
+	close_hdf5(fh);
+	for ( i=0; i<n_path_evs; i++ ) {
+		cffree(path_evs[i]);
+	}
+	cffree(path_evs);
+	for ( i=0; i<n_blocks; i++ ) {
+		cffree(blocks[i].path_ev);
+	}
+	cffree(blocks);
+	return NULL;
 }
 
 
@@ -42,7 +42,7 @@ extern int image_hdf5_read(struct image *image,
 
 extern int image_hdf5_read_mask(struct panel_template *p,
                                 const char *filename,
-                                const char *event, int *bad,
+                                const char *event, uint8_t *bad,
                                 const char *mask_location,
                                 int mask_good, int mask_bad);
 
@@ -61,8 +61,26 @@ extern ImageFeatureList *image_hdf5_read_peaks_hdf5(const DataTemplate *dtempl,
                                                     const char *event,
                                                     int half_pixel_shift);
 
-extern char **image_hdf5_expand_frames(const DataTemplate *dtempl,
-                                       const char *filename,
-                                       int *n_frames);
+extern void image_hdf5_set_file_cache(int max_files,
+                                      size_t chunk_cache_size);
+
+extern void image_hdf5_close_cached_files(void);
+
+extern void image_hdf5_set_direct_chunk_threads(int n_threads);
+
+extern void image_hdf5_set_batch_frames(int n_frames);
+
+/* A set of frames in a file, all with the same path.  The event IDs are
+ * path_ev followed by one "/index" for each placeholder dimension. */
+struct frame_block
+{
+	char *path_ev;
+	int n_dims;
+	int sizes[MAX_DIMS];
+};
+
+extern struct frame_block *image_hdf5_frame_blocks(const DataTemplate *dtempl,
+                                                   const char *filename,
+                                                   int *n_blocks);
 
 #endif	/* IMAGE_HDF5_H */
@@ -33,6 +33,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <math.h>
 #include <assert.h>
 #include <unistd.h>
 
@@ -203,6 +205,7 @@ ImageFeatureList *image_msgpack_read_peaks(const DataTemplate *dtempl,
 	}
 
 	features = image_feature_list_new();
+	image_feature_list_reserve(features, num_peaks);
 
 	for ( pk=0; pk<num_peaks; pk++ ) {
 
@@ -315,9 +318,43 @@ int image_msgpack_read_header_to_cache(struct image *image,
 }
 
 
-static int load_msgpack_data(struct panel_template *p,
+/* Makes panel 'pn' use 'data', which is somewhere inside image->data_block,
+ * instead of its own array */
+static int use_data_block_for_panel(struct image *image, int n_panels, int pn,
+                                    float *data)
+{
+	if ( image->dp_in_data_block == NULL ) {
+
+		image->dp_in_data_block = cfcalloc(n_panels, sizeof(int));
+		if ( image->dp_in_data_block == NULL ) return 1;
+
+		/* Don't change the pointers in the ImageDataArrays */
+		if ( image->ida != NULL ) {
+			float **dp = cfmalloc(n_panels*sizeof(float *));
+			if ( dp == NULL ) {
+				cffree(image->dp_in_data_block);
+				image->dp_in_data_block = NULL;
+				return 1;
+			}
+			memcpy(dp, image->dp, n_panels*sizeof(float *));
+			image->dp = dp;
+		}
+
+	}
+
+	if ( (image->ida == NULL) && !image->dp_in_data_block[pn] ) {
+		cffree(image->dp[pn]);
+	}
+	image->dp[pn] = data;
+	image->dp_in_data_block[pn] = 1;
+	return 0;
+}
+
+
+static int load_msgpack_data(struct image *image, int pn, int n_panels,
+                             struct panel_template *p,
                              msgpack_object *map_obj,
-                             float *data, int *bad)
+                             float *data, uint8_t *bad)
 {
 	msgpack_object *obj;
 	msgpack_object *type_obj;
@@ -420,6 +457,26 @@ static int load_msgpack_data(struct panel_template *p,
 		int fs, ss;
 		float *in_data = (float *)data_obj->via.bin.ptr;
 
+		/* If the panel covers whole rows of the array, its data can be
+		 * used where it is, if the data block may be changed */
+		if ( (image->data_block_release != NULL)
+		  && (p->orig_min_fs == 0)
+		  && (PANEL_WIDTH(p) == data_size_fs)
+		  && ((uintptr_t)in_data % sizeof(float) == 0) )
+		{
+			float *panel_data = in_data + p->orig_min_ss*data_size_fs;
+			if ( !use_data_block_for_panel(image, n_panels, pn,
+			                               panel_data) )
+			{
+				long int j;
+				for ( j=0; j<PANEL_WIDTH(p)*PANEL_HEIGHT(p); j++ ) {
+					if ( !isfinite(panel_data[j]) ) bad[j] = 1;
+				}
+				cffree(dtype);
+				return 0;
+			}
+		}
+
 		for ( ss=0; ss<PANEL_HEIGHT(p); ss++ ) {
 			for ( fs=0; fs<PANEL_WIDTH(p); fs++ ) {
 				size_t idx = fs+p->orig_min_fs + (ss+p->orig_min_ss)*data_size_fs;
@@ -475,7 +532,8 @@ int image_msgpack_read(struct image *image,
 	}
 
 	for ( i=0; i<dtempl->n_panels; i++ ) {
-		if ( load_msgpack_data(&dtempl->panels[i], obj,
+		if ( load_msgpack_data(image, i, dtempl->n_panels,
+		                       &dtempl->panels[i], obj,
 		                       image->dp[i], image->bad[i]) )
 		{
 			ERROR("Failed to load data for panel '%s'\n",
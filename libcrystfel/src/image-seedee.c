@@ -39,6 +39,7 @@
 #include <image.h>
 #include <utils.h>
 #include <profile.h>
+#include <thread-pool.h>
 
 #include "datatemplate_priv.h"
 
@@ -51,7 +52,7 @@
 
 static int load_seedee_data(struct panel_template *p,
                             struct SeedeeNDArray *array,
-                            float *data, int *bad)
+                            float *data, uint8_t *bad)
 {
 	int data_size_fs, data_size_ss;
 
@@ -183,11 +184,18 @@ int image_seedee_read(struct image *image,
 	                                  data_block, data_block_size,
 	                                  &zero_copy, &array);
 	profile_end("seedee-get-size");
-	array.data = cfmalloc(array.size);
+
+	/* If the data can be used where it is in the data block, seedee will
+	 * just point to it.  Otherwise, decode it into this thread's scratch
+	 * space, which is kept from one frame to the next. */
+	if ( zero_copy ) {
+		array.data = NULL;
+	} else {
+		array.data = thread_pool_scratch(array.size);
+	}
 	array.shape = cfmalloc(array.ndims*sizeof(int));
-	if ( (array.data == NULL) || (array.shape == NULL) ) {
+	if ( (!zero_copy && (array.data == NULL)) || (array.shape == NULL) ) {
 		cJSON_Delete(json);
-		cffree(array.data);
 		cffree(array.shape);
 		return 1;
 	}
@@ -195,7 +203,7 @@ int image_seedee_read(struct image *image,
 	if ( array.ndims != 2 ) {
 		ERROR("Seedee data has unexpected number of dimensions "
 		      "(%i, expected 2)\n", array.ndims);
-		cffree(array.data);
+		cJSON_Delete(json);
 		cffree(array.shape);
 		return 1;
 	}
@@ -203,12 +211,11 @@ int image_seedee_read(struct image *image,
 	profile_start("seedee-deserialize");
 	r = seedee_deserialize_ndarray(data_format_str->valuestring,
 	                               data_block, data_block_size,
-	                               0, &array);
+	                               zero_copy, &array);
 	profile_end("seedee-deserialize");
 	cJSON_Delete(json);
 	if ( r < 0 ) {
 		ERROR("Seedee deserialiation failed.\n");
-		cffree(array.data);
 		cffree(array.shape);
 		return 1;
 	}
@@ -221,14 +228,12 @@ int image_seedee_read(struct image *image,
 			ERROR("Failed to load data for panel '%s'\n",
 			      dtempl->panels[i].name);
 			profile_end("seedee-panel");
-			cffree(array.data);
 			cffree(array.shape);
 			return 1;
 		}
 	}
 	profile_end("seedee-panel");
 
-	cffree(array.data);
 	cffree(array.shape);
 
 	return 0;
@@ -34,6 +34,7 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <fenv.h>
+#include <pthread.h>
 
 #ifdef HAVE_ZLIB
 #include <zlib.h>
@@ -144,24 +145,479 @@ int is_cbfgz_file(const char *filename, int *err)
 }
 
 
+/* Spatial index for image_feature_closest().  The features are put into
+ * square cells, which are found using a hash table.  The index is built the
+ * first time it's needed, kept up to date when features are added, and thrown
+ * away when features are removed (because the indices change). */
+
+/* Lists shorter than this are just searched one feature at a time */
+#define FEATURE_INDEX_MIN (64)
+
+/* Limits for the size of the cells, in pixels */
+#define FEATURE_CELL_MIN (4.0)
+#define FEATURE_CELL_MAX (256.0)
+
+/* Features further than this from the origin can't be indexed */
+#define FEATURE_INDEX_MAX_COORD (1e7)
+
+struct feature_panel_box
+{
+	int n;
+	int min_cfs;
+	int max_cfs;
+	int min_css;
+	int max_css;
+};
+
+struct feature_index
+{
+	double cell_size;
+	int n_buckets;   /* Power of two */
+	int *head;       /* First feature in each bucket, or -1 */
+	int *next;       /* Next feature in the same bucket, or -1 */
+	int *cfs;        /* Cell coordinates of each feature */
+	int *css;
+	int max;         /* Size of next, cfs and css */
+
+	struct feature_panel_box *boxes;  /* Extent of cells, for each panel */
+	int n_boxes;
+};
+
+
+/* Separate arrays of the coordinates, panel numbers and intensities, for
+ * image_feature_list_arrays().  Built the first time they're needed, and kept
+ * up to date in the same way as the spatial index. */
+struct feature_soa
+{
+	int     max;
+	double *fs;
+	double *ss;
+	int    *pn;
+	double *intensity;
+};
+
+
 struct _imagefeaturelist
 {
 	struct imagefeature *features;
 	int                  max_features;
 	int                  n_features;
+
+	struct feature_index *index;
+	int                  index_failed;
+
+	struct feature_soa   *soa;
 };
 
 
+static void free_feature_soa(struct feature_soa *soa)
+{
+	if ( soa == NULL ) return;
+	cffree(soa->fs);
+	cffree(soa->ss);
+	cffree(soa->pn);
+	cffree(soa->intensity);
+	cffree(soa);
+}
+
+
+static void invalidate_feature_soa(ImageFeatureList *flist)
+{
+	free_feature_soa(flist->soa);
+	flist->soa = NULL;
+}
+
+
+static void set_feature_soa(struct feature_soa *soa, int i,
+                            const struct imagefeature *f)
+{
+	soa->fs[i] = f->fs;
+	soa->ss[i] = f->ss;
+	soa->pn[i] = f->pn;
+	soa->intensity[i] = f->intensity;
+}
+
+
+static struct feature_soa *build_feature_soa(ImageFeatureList *flist)
+{
+	struct feature_soa *soa;
+	int i;
+
+	soa = cfmalloc(sizeof(struct feature_soa));
+	if ( soa == NULL ) return NULL;
+
+	soa->max = flist->max_features;
+	if ( soa->max < 1 ) soa->max = 1;
+	soa->fs = cfmalloc(soa->max*sizeof(double));
+	soa->ss = cfmalloc(soa->max*sizeof(double));
+	soa->pn = cfmalloc(soa->max*sizeof(int));
+	soa->intensity = cfmalloc(soa->max*sizeof(double));
+	if ( (soa->fs == NULL) || (soa->ss == NULL)
+	  || (soa->pn == NULL) || (soa->intensity == NULL) )
+	{
+		free_feature_soa(soa);
+		return NULL;
+	}
+
+	for ( i=0; i<flist->n_features; i++ ) {
+		set_feature_soa(soa, i, &flist->features[i]);
+	}
+
+	return soa;
+}
+
+
+static void free_feature_index(struct feature_index *fi)
+{
+	if ( fi == NULL ) return;
+	cffree(fi->head);
+	cffree(fi->next);
+	cffree(fi->cfs);
+	cffree(fi->css);
+	cffree(fi->boxes);
+	cffree(fi);
+}
+
+
+static void invalidate_feature_index(ImageFeatureList *flist)
+{
+	free_feature_index(flist->index);
+	flist->index = NULL;
+	flist->index_failed = 0;
+}
+
+
+static unsigned int feature_cell_hash(int pn, int cfs, int css)
+{
+	return ((unsigned int)pn * 73856093u)
+	     ^ ((unsigned int)cfs * 19349663u)
+	     ^ ((unsigned int)css * 83492791u);
+}
+
+
+static int feature_cell(struct feature_index *fi, double v)
+{
+	return floor(v / fi->cell_size);
+}
+
+
+/* Chooses the cell size so that there are a few features per cell */
+static double choose_cell_size(ImageFeatureList *flist)
+{
+	double min_fs = +HUGE_VAL;
+	double max_fs = -HUGE_VAL;
+	double min_ss = +HUGE_VAL;
+	double max_ss = -HUGE_VAL;
+	int max_pn = 0;
+	double area, size;
+	int i;
+
+	for ( i=0; i<flist->n_features; i++ ) {
+		struct imagefeature *f = &flist->features[i];
+		if ( isnan(f->fs) || isnan(f->ss) ) continue;
+		if ( f->fs < min_fs ) min_fs = f->fs;
+		if ( f->fs > max_fs ) max_fs = f->fs;
+		if ( f->ss < min_ss ) min_ss = f->ss;
+		if ( f->ss > max_ss ) max_ss = f->ss;
+		if ( f->pn > max_pn ) max_pn = f->pn;
+	}
+
+	if ( min_fs > max_fs ) return FEATURE_CELL_MAX;
+
+	/* Assume the features are spread out over all the panels */
+	area = (max_fs-min_fs) * (max_ss-min_ss) * (max_pn+1);
+	size = sqrt(4.0 * area / flist->n_features);
+
+	if ( !(size > FEATURE_CELL_MIN) ) return FEATURE_CELL_MIN;
+	if ( size > FEATURE_CELL_MAX ) return FEATURE_CELL_MAX;
+	return size;
+}
+
+
+/* Returns non-zero if the feature couldn't be added, in which case the index
+ * must not be used any more */
+static int feature_index_insert(struct feature_index *fi,
+                                const struct imagefeature *f, int i)
+{
+	struct feature_panel_box *box;
+	unsigned int b;
+	int cfs, css;
+
+	if ( f->pn < 0 ) return 1;
+
+	/* Features which can't be the closest to anything are left out */
+	if ( isnan(f->fs) || isnan(f->ss) ) {
+		fi->next[i] = -1;
+		return 0;
+	}
+
+	if ( (fabs(f->fs) > FEATURE_INDEX_MAX_COORD)
+	  || (fabs(f->ss) > FEATURE_INDEX_MAX_COORD) ) return 1;
+
+	if ( f->pn >= fi->n_boxes ) {
+		struct feature_panel_box *nb;
+		int j;
+		nb = cfrealloc(fi->boxes, (f->pn+1)*sizeof(*nb));
+		if ( nb == NULL ) return 1;
+		for ( j=fi->n_boxes; j<=f->pn; j++ ) nb[j].n = 0;
+		fi->boxes = nb;
+		fi->n_boxes = f->pn+1;
+	}
+
+	cfs = feature_cell(fi, f->fs);
+	css = feature_cell(fi, f->ss);
+
+	box = &fi->boxes[f->pn];
+	if ( box->n == 0 ) {
+		box->min_cfs = cfs;
+		box->max_cfs = cfs;
+		box->min_css = css;
+		box->max_css = css;
+	} else {
+		if ( cfs < box->min_cfs ) box->min_cfs = cfs;
+		if ( cfs > box->max_cfs ) box->max_cfs = cfs;
+		if ( css < box->min_css ) box->min_css = css;
+		if ( css > box->max_css ) box->max_css = css;
+	}
+	box->n++;
+
+	b = feature_cell_hash(f->pn, cfs, css) & (fi->n_buckets-1);
+	fi->cfs[i] = cfs;
+	fi->css[i] = css;
+	fi->next[i] = fi->head[b];
+	fi->head[b] = i;
+	return 0;
+}
+
+
+static struct feature_index *build_feature_index(ImageFeatureList *flist)
+{
+	struct feature_index *fi;
+	int i;
+
+	fi = cfmalloc(sizeof(struct feature_index));
+	if ( fi == NULL ) return NULL;
+
+	fi->cell_size = choose_cell_size(flist);
+	fi->n_buckets = 1;
+	while ( fi->n_buckets < 2*flist->n_features ) fi->n_buckets *= 2;
+	fi->max = flist->max_features;
+	if ( fi->max < flist->n_features ) fi->max = flist->n_features;
+	fi->head = cfmalloc(fi->n_buckets*sizeof(int));
+	fi->next = cfmalloc(fi->max*sizeof(int));
+	fi->cfs = cfmalloc(fi->max*sizeof(int));
+	fi->css = cfmalloc(fi->max*sizeof(int));
+	fi->boxes = NULL;
+	fi->n_boxes = 0;
+	if ( (fi->head == NULL) || (fi->next == NULL)
+	  || (fi->cfs == NULL) || (fi->css == NULL) )
+	{
+		free_feature_index(fi);
+		return NULL;
+	}
+
+	for ( i=0; i<fi->n_buckets; i++ ) fi->head[i] = -1;
+
+	for ( i=0; i<flist->n_features; i++ ) {
+		if ( feature_index_insert(fi, &flist->features[i], i) ) {
+			free_feature_index(fi);
+			return NULL;
+		}
+	}
+
+	return fi;
+}
+
+
+/* Called after a feature has been added to the end of the list */
+static void update_feature_index(ImageFeatureList *flist)
+{
+	struct feature_index *fi = flist->index;
+	int i = flist->n_features - 1;
+
+	flist->index_failed = 0;
+	if ( fi == NULL ) return;
+
+	/* Re-build it later with a bigger hash table */
+	if ( (flist->n_features > 2*fi->n_buckets)
+	  || (flist->n_features > fi->max) )
+	{
+		invalidate_feature_index(flist);
+		return;
+	}
+
+	if ( feature_index_insert(fi, &flist->features[i], i) ) {
+		invalidate_feature_index(flist);
+	}
+}
+
+
+/* Called after a feature has been added to the end of the list.  The spatial
+ * index uses the arrays, so it can't be kept without them. */
+static void update_feature_soa(ImageFeatureList *flist)
+{
+	struct feature_soa *soa = flist->soa;
+	int i = flist->n_features - 1;
+
+	if ( soa == NULL ) return;
+
+	if ( i >= soa->max ) {
+
+		int max = flist->max_features;
+		double *fs = cfrealloc(soa->fs, max*sizeof(double));
+		double *ss = cfrealloc(soa->ss, max*sizeof(double));
+		int *pn = cfrealloc(soa->pn, max*sizeof(int));
+		double *intensity = cfrealloc(soa->intensity,
+		                              max*sizeof(double));
+
+		if ( fs != NULL ) soa->fs = fs;
+		if ( ss != NULL ) soa->ss = ss;
+		if ( pn != NULL ) soa->pn = pn;
+		if ( intensity != NULL ) soa->intensity = intensity;
+		if ( (fs == NULL) || (ss == NULL)
+		  || (pn == NULL) || (intensity == NULL) )
+		{
+			invalidate_feature_soa(flist);
+			invalidate_feature_index(flist);
+			return;
+		}
+		soa->max = max;
+	}
+
+	set_feature_soa(soa, i, &flist->features[i]);
+}
+
+
+static void search_feature_cell(ImageFeatureList *flist, int pn,
+                                int cfs, int css, double fs, double ss,
+                                double *dmin, int *closest)
+{
+	struct feature_index *fi = flist->index;
+	const struct feature_soa *soa = flist->soa;
+	unsigned int b = feature_cell_hash(pn, cfs, css) & (fi->n_buckets-1);
+	int i;
+
+	for ( i=fi->head[b]; i!=-1; i=fi->next[i] ) {
+
+		double ds;
+
+		if ( (fi->cfs[i] != cfs) || (fi->css[i] != css) ) continue;
+		if ( soa->pn[i] != pn ) continue;
+
+		ds = distance(soa->fs[i], soa->ss[i], fs, ss);
+
+		/* Same choice as the simple search, i.e. the first one in the
+		 * list if there's a tie */
+		if ( (ds < *dmin) || ((ds == *dmin) && (i < *closest)) ) {
+			*dmin = ds;
+			*closest = i;
+		}
+	}
+}
+
+
+/* Searches outwards from the cell containing (fs,ss), one ring of cells at a
+ * time, until nothing further out could be closer */
+static int indexed_closest(ImageFeatureList *flist, double fs, double ss,
+                           int pn, double *pdmin)
+{
+	struct feature_index *fi = flist->index;
+	struct feature_panel_box *box;
+	double dmin = +HUGE_VAL;
+	int closest = -1;
+	int qcfs, qcss;
+	int k;
+
+	if ( pn >= fi->n_boxes ) return -1;
+	box = &fi->boxes[pn];
+	if ( box->n == 0 ) return -1;
+
+	qcfs = feature_cell(fi, fs);
+	qcss = feature_cell(fi, ss);
+
+	for ( k=0; ; k++ ) {
+
+		int css, cfs;
+		int css_min = qcss-k;
+		int css_max = qcss+k;
+		int more_left, more_right, more_below, more_above;
+		double bound;
+
+		if ( css_min < box->min_css ) css_min = box->min_css;
+		if ( css_max > box->max_css ) css_max = box->max_css;
+
+		for ( css=css_min; css<=css_max; css++ ) {
+
+			if ( (css == qcss-k) || (css == qcss+k) ) {
+
+				/* Top or bottom row of the ring */
+				int cfs_min = qcfs-k;
+				int cfs_max = qcfs+k;
+				if ( cfs_min < box->min_cfs ) cfs_min = box->min_cfs;
+				if ( cfs_max > box->max_cfs ) cfs_max = box->max_cfs;
+				for ( cfs=cfs_min; cfs<=cfs_max; cfs++ ) {
+					search_feature_cell(flist, pn, cfs, css,
+					                    fs, ss, &dmin, &closest);
+				}
+
+			} else {
+
+				/* Just the ends of the row */
+				if ( (qcfs-k >= box->min_cfs)
+				  && (qcfs-k <= box->max_cfs) )
+				{
+					search_feature_cell(flist, pn, qcfs-k, css,
+					                    fs, ss, &dmin, &closest);
+				}
+				if ( (k > 0) && (qcfs+k >= box->min_cfs)
+				  && (qcfs+k <= box->max_cfs) )
+				{
+					search_feature_cell(flist, pn, qcfs+k, css,
+					                    fs, ss, &dmin, &closest);
+				}
+
+			}
+		}
+
+		/* Anything not yet searched is outside the square of cells
+		 * searched so far, so it can't be closer than the nearest side
+		 * of the square which has cells beyond it */
+		more_left = (qcfs-k > box->min_cfs);
+		more_right = (qcfs+k < box->max_cfs);
+		more_below = (qcss-k > box->min_css);
+		more_above = (qcss+k < box->max_css);
+		if ( !more_left && !more_right && !more_below && !more_above ) {
+			break;
+		}
+
+		bound = +HUGE_VAL;
+		if ( more_left ) {
+			bound = fmin(bound, fs - (qcfs-k)*fi->cell_size);
+		}
+		if ( more_right ) {
+			bound = fmin(bound, (qcfs+k+1)*fi->cell_size - fs);
+		}
+		if ( more_below ) {
+			bound = fmin(bound, ss - (qcss-k)*fi->cell_size);
+		}
+		if ( more_above ) {
+			bound = fmin(bound, (qcss+k+1)*fi->cell_size - ss);
+		}
+		if ( dmin < bound ) break;
+	}
+
+	*pdmin = dmin;
+	return closest;
+}
+
+
 void image_add_feature(ImageFeatureList *flist, double fs, double ss,
                        int pn, double intensity, const char *name)
 {
 	if ( flist->n_features == flist->max_features ) {
-		struct imagefeature *nf;
-		int nmf = flist->max_features + 128;
-		nf = cfrealloc(flist->features, nmf*sizeof(struct imagefeature));
-		if ( nf == NULL ) return;
-		flist->features = nf;
-		flist->max_features = nmf;
+		int nmf = 2*flist->max_features;
+		if ( nmf < 128 ) nmf = 128;
+		if ( image_feature_list_reserve(flist, nmf) ) return;
 	}
 
 	flist->features[flist->n_features].fs = fs;
@@ -171,6 +627,33 @@ void image_add_feature(ImageFeatureList *flist, double fs, double ss,
 	flist->features[flist->n_features].name = name;
 
 	flist->n_features++;
+	update_feature_index(flist);
+	update_feature_soa(flist);
+}
+
+
+/**
+ * \param flist An \ref ImageFeatureList
+ * \param n The number of features which will be in the list
+ *
+ * Makes space for \p n features in \p flist, so that it won't need to grow
+ * while they are being added.  A peak search which knows how many peaks it
+ * will add can use this to avoid copying the list as it grows.  Otherwise,
+ * the space doubles each time it runs out.
+ *
+ * \returns zero on success, or non-zero if the memory could not be allocated.
+ */
+int image_feature_list_reserve(ImageFeatureList *flist, int n)
+{
+	struct imagefeature *nf;
+
+	if ( n <= flist->max_features ) return 0;
+
+	nf = cfrealloc(flist->features, n*sizeof(struct imagefeature));
+	if ( nf == NULL ) return 1;
+	flist->features = nf;
+	flist->max_features = n;
+	return 0;
 }
 
 
@@ -183,6 +666,9 @@ ImageFeatureList *image_feature_list_new()
 	flist->n_features = 0;
 	flist->max_features = 0;
 	flist->features = NULL;
+	flist->index = NULL;
+	flist->index_failed = 0;
+	flist->soa = NULL;
 
 	return flist;
 }
@@ -221,6 +707,7 @@ ImageFeatureList *image_feature_list_copy(const ImageFeatureList *flist)
 		n->features[nf++] = flist->features[i];
 	}
 	n->n_features = nf;
+	n->max_features = flist->n_features;
 
 	return n;
 }
@@ -241,11 +728,20 @@ ImageFeatureList *sort_peaks(ImageFeatureList *flist)
 void image_feature_list_free(ImageFeatureList *flist)
 {
 	if ( flist == NULL ) return;
+	free_feature_index(flist->index);
+	free_feature_soa(flist->soa);
 	cffree(flist->features);
 	cffree(flist);
 }
 
 
+/**
+ * Finds the closest feature to (fs,ss) on panel pn.  For long lists, this uses
+ * a spatial index, which is built the first time it's needed.  The index will
+ * be wrong if the coordinates of features are changed via image_get_feature()
+ * afterwards, and it's not safe to call this from several threads at once for
+ * the same list.
+ */
 struct imagefeature *image_feature_closest(ImageFeatureList *flist,
                                            double fs, double ss,
                                            int pn, double *d, int *idx)
@@ -254,6 +750,28 @@ struct imagefeature *image_feature_closest(ImageFeatureList *flist,
 	double dmin = +HUGE_VAL;
 	int closest = 0;
 
+	if ( (flist->index == NULL) && !flist->index_failed
+	  && (flist->n_features >= FEATURE_INDEX_MIN) )
+	{
+		if ( flist->soa == NULL ) flist->soa = build_feature_soa(flist);
+		if ( flist->soa != NULL ) flist->index = build_feature_index(flist);
+		if ( flist->index == NULL ) flist->index_failed = 1;
+	}
+
+	if ( (flist->index != NULL) && !isnan(fs) && !isnan(ss)
+	  && (fabs(fs) <= FEATURE_INDEX_MAX_COORD)
+	  && (fabs(ss) <= FEATURE_INDEX_MAX_COORD) )
+	{
+		closest = indexed_closest(flist, fs, ss, pn, &dmin);
+		if ( closest >= 0 ) {
+			*d = dmin;
+			*idx = closest;
+			return &flist->features[closest];
+		}
+		*d = +INFINITY;
+		return NULL;
+	}
+
 	for ( i=0; i<flist->n_features; i++ ) {
 
 		double ds;
@@ -309,8 +827,105 @@ struct imagefeature *image_get_feature(ImageFeatureList *flist, int idx)
 }
 
 
+/**
+ * \param flist An \ref ImageFeatureList
+ * \param n Location at which to store the number of features
+ *
+ * Gives direct access to the array of features in \p flist, for example so
+ * that language bindings can wrap it without copying.  The array is only valid
+ * until a feature is added to or removed from \p flist.
+ *
+ * \returns a pointer to the first of \p n features, or NULL if there are none.
+ */
+struct imagefeature *image_feature_list_array(ImageFeatureList *flist, int *n)
+{
+	if ( flist == NULL ) {
+		*n = 0;
+		return NULL;
+	}
+	*n = flist->n_features;
+	if ( flist->n_features == 0 ) return NULL;
+	return flist->features;
+}
+
+
+/**
+ * \param flist An \ref ImageFeatureList
+ * \param arr Location at which to store the arrays
+ *
+ * Gives the coordinates, panel numbers and intensities of the features in
+ * \p flist as separate arrays, for code which works on all the features at
+ * once, such as converting them to reciprocal space.  The arrays are made the
+ * first time they're needed, and kept up to date when features are added.
+ * They are only valid until a feature is removed from \p flist, and will be
+ * wrong if a feature is changed via image_get_feature().
+ *
+ * \returns zero on success, or non-zero if the memory could not be allocated.
+ */
+int image_feature_list_arrays(ImageFeatureList *flist,
+                              struct imagefeature_arrays *arr)
+{
+	arr->n = 0;
+	arr->fs = NULL;
+	arr->ss = NULL;
+	arr->pn = NULL;
+	arr->intensity = NULL;
+	if ( (flist == NULL) || (flist->n_features == 0) ) return 0;
+
+	if ( flist->soa == NULL ) {
+		flist->soa = build_feature_soa(flist);
+		if ( flist->soa == NULL ) return 1;
+	}
+
+	arr->n = flist->n_features;
+	arr->fs = flist->soa->fs;
+	arr->ss = flist->soa->ss;
+	arr->pn = flist->soa->pn;
+	arr->intensity = flist->soa->intensity;
+	return 0;
+}
+
+
+/**
+ * \param flist An \ref ImageFeatureList
+ * \param remove An array with one entry for each feature in \p flist
+ *
+ * Removes all the features for which the corresponding entry in \p remove is
+ * non-zero, keeping the others in the same order.  This takes one pass over
+ * the list, however many features are removed, so it's much faster than
+ * calling image_remove_feature() for each one.  It also means that the
+ * features can be marked while looping over the list, without the indices
+ * changing.
+ *
+ * \returns the number of features removed.
+ */
+int image_remove_features(ImageFeatureList *flist, const char *remove)
+{
+	int i, n;
+
+	if ( flist == NULL ) return 0;
+
+	n = 0;
+	for ( i=0; i<flist->n_features; i++ ) {
+		if ( remove[i] ) continue;
+		if ( n != i ) flist->features[n] = flist->features[i];
+		n++;
+	}
+
+	if ( n == flist->n_features ) return 0;
+
+	invalidate_feature_index(flist);
+	invalidate_feature_soa(flist);
+	i = flist->n_features - n;
+	flist->n_features = n;
+	return i;
+}
+
+
 void image_remove_feature(ImageFeatureList *flist, int idx)
 {
+	invalidate_feature_index(flist);
+	invalidate_feature_soa(flist);
 	memmove(&flist->features[idx], &flist->features[idx+1],
 	        (flist->n_features-idx-1)*sizeof(struct imagefeature));
 	flist->n_features--;
@@ -335,6 +950,7 @@ void image_add_crystal_refls(struct image *image,
 	crs[n].refls = reflist;
 	crs[n].image_owns_crystal = 1;
 	crs[n].image_owns_refls = 1;
+	crs[n].refls_text = NULL;
 	image->crystals = crs;
 	image->n_crystals = n+1;
 }
@@ -356,6 +972,7 @@ int remove_flagged_crystals(struct image *image)
 			int j;
 			crystal_free(image->crystals[i].cr);
 			reflist_free(image->crystals[i].refls);
+			cffree(image->crystals[i].refls_text);
 			for ( j=i; j<image->n_crystals-1; j++ ) {
 				image->crystals[j] = image->crystals[j+1];
 			}
@@ -381,6 +998,7 @@ void free_all_crystals(struct image *image)
 		if ( image->crystals[i].image_owns_refls ) {
 			reflist_free(image->crystals[i].refls);
 		}
+		cffree(image->crystals[i].refls_text);
 	}
 	cffree(image->crystals);
 	image->crystals = NULL;
@@ -615,57 +1233,213 @@ int image_set_zero_data(struct image *image,
 }
 
 
+/* The large arrays for one worker (or other reader of many frames), which are
+ * kept from one frame to the next instead of being allocated every time */
 struct _image_data_arrays
 {
 	float **dp;
-	int **bad;
+	uint8_t **bad;
+	float **sat;  /* NULL if there aren't any saturation maps */
+	size_t *nel;  /* Number of pixels in each panel */
 	int np;
+
+	/* With huge pages, all the panels are in one block, and all the masks
+	 * in another */
+	enum huge_pages hp;
+	char *dp_block;
+	char *bad_block;
+	size_t dp_block_size;
+	size_t bad_block_size;
+
+	/* Temporary space used while reading the data */
+	void *scratch;
+	size_t scratch_size;
 };
 
 
 ImageDataArrays *image_data_arrays_new()
+{
+	return image_data_arrays_new_huge(HUGE_PAGES_NONE);
+}
+
+
+/**
+ * \param hp How to allocate the arrays
+ *
+ * Like image_data_arrays_new(), but the panel data arrays and bad pixel masks
+ * will be allocated with cfmalloc_huge().
+ *
+ * \returns a new \ref ImageDataArrays, or NULL on error.
+ */
+ImageDataArrays *image_data_arrays_new_huge(enum huge_pages hp)
 {
 	ImageDataArrays *ida = cfmalloc(sizeof(struct _image_data_arrays));
 	if ( ida == NULL ) return NULL;
 
 	ida->dp = NULL;
 	ida->bad = NULL;
+	ida->sat = NULL;
+	ida->nel = NULL;
 	ida->np = 0;
+	ida->hp = hp;
+	ida->dp_block = NULL;
+	ida->bad_block = NULL;
+	ida->dp_block_size = 0;
+	ida->bad_block_size = 0;
+	ida->scratch = NULL;
+	ida->scratch_size = 0;
 
 	return ida;
 }
 
 
-void image_data_arrays_free(ImageDataArrays *ida)
+/* Frees the panel arrays, but keeps the scratch space */
+static void image_data_arrays_release(ImageDataArrays *ida)
 {
 	int i;
 
-	for ( i=0; i<ida->np; i++ ) {
-		if ( ida->dp != NULL ) cffree(ida->dp[i]);
-		if ( ida->bad != NULL ) cffree(ida->bad[i]);
+	if ( ida->dp_block != NULL ) {
+		cffree_huge(ida->dp_block, ida->dp_block_size, ida->hp);
+		cffree_huge(ida->bad_block, ida->bad_block_size, ida->hp);
+	} else {
+		for ( i=0; i<ida->np; i++ ) {
+			if ( ida->dp != NULL ) cffree(ida->dp[i]);
+			if ( ida->bad != NULL ) cffree(ida->bad[i]);
+		}
+	}
+	if ( ida->sat != NULL ) {
+		for ( i=0; i<ida->np; i++ ) cffree(ida->sat[i]);
 	}
 
 	cffree(ida->dp);
 	cffree(ida->bad);
+	cffree(ida->sat);
+	cffree(ida->nel);
+	ida->dp = NULL;
+	ida->bad = NULL;
+	ida->sat = NULL;
+	ida->nel = NULL;
+	ida->np = 0;
+	ida->dp_block = NULL;
+	ida->bad_block = NULL;
+}
+
 
+void image_data_arrays_free(ImageDataArrays *ida)
+{
+	image_data_arrays_release(ida);
+	cffree_huge(ida->scratch, ida->scratch_size, ida->hp);
 	cffree(ida);
 }
 
 
-int image_create_dp_bad(struct image *image,
-                        const DataTemplate *dtempl)
+/* Whether the arrays in 'ida' fit the panels in 'dtempl' */
+static int image_data_arrays_fit(ImageDataArrays *ida,
+                                 const DataTemplate *dtempl)
 {
 	int i;
 
-	if ( (image->ida != NULL) && (image->ida->np > 0) ) {
-
-		assert(dtempl->n_panels == image->ida->np);
+	if ( ida->np != dtempl->n_panels ) return 0;
+	for ( i=0; i<dtempl->n_panels; i++ ) {
+		size_t nel = PANEL_WIDTH(&dtempl->panels[i]) * PANEL_HEIGHT(&dtempl->panels[i]);
+		if ( ida->nel[i] != nel ) return 0;
+	}
+	return 1;
+}
 
-		/* (Re-)use the provided arrays */
-		image->dp = image->ida->dp;
-		image->bad = image->ida->bad;
 
-	} else {
+/**
+ * \param ida An \ref ImageDataArrays
+ * \param size The number of bytes needed
+ *
+ * Returns temporary space for use while reading an image with \p ida.  The
+ * space is kept for the next image, and is only valid until the next call to
+ * this function.  This is for the file format readers.
+ *
+ * \returns a pointer to the space, or NULL on error.
+ */
+void *image_data_arrays_scratch(ImageDataArrays *ida, size_t size)
+{
+	if ( ida->scratch_size < size ) {
+		cffree_huge(ida->scratch, ida->scratch_size, ida->hp);
+		ida->scratch = cfmalloc_huge(size, ida->hp);
+		if ( ida->scratch == NULL ) {
+			ida->scratch_size = 0;
+			return NULL;
+		}
+		ida->scratch_size = size;
+	}
+	return ida->scratch;
+}
+
+
+/* Each panel starts on a new cache line */
+static size_t panel_block_size(size_t size)
+{
+	return (size + 63) & ~(size_t)63;
+}
+
+
+/* Allocates the panel data and masks from huge pages, all in one block each
+ * so that small panels don't each take up a whole huge page */
+static int alloc_huge_panels(ImageDataArrays *ida, const DataTemplate *dtempl,
+                             float **dp, uint8_t **bad)
+{
+	size_t dp_size = 0;
+	size_t bad_size = 0;
+	size_t dp_pos = 0;
+	size_t bad_pos = 0;
+	int i;
+
+	for ( i=0; i<dtempl->n_panels; i++ ) {
+		size_t nel = PANEL_WIDTH(&dtempl->panels[i]) * PANEL_HEIGHT(&dtempl->panels[i]);
+		dp_size += panel_block_size(nel*sizeof(float));
+		bad_size += panel_block_size(nel);
+	}
+
+	ida->dp_block = cfmalloc_huge(dp_size, ida->hp);
+	ida->bad_block = cfmalloc_huge(bad_size, ida->hp);
+	if ( (ida->dp_block == NULL) || (ida->bad_block == NULL) ) {
+		cffree_huge(ida->dp_block, dp_size, ida->hp);
+		cffree_huge(ida->bad_block, bad_size, ida->hp);
+		ida->dp_block = NULL;
+		ida->bad_block = NULL;
+		return 1;
+	}
+	ida->dp_block_size = dp_size;
+	ida->bad_block_size = bad_size;
+
+	for ( i=0; i<dtempl->n_panels; i++ ) {
+		size_t nel = PANEL_WIDTH(&dtempl->panels[i]) * PANEL_HEIGHT(&dtempl->panels[i]);
+		dp[i] = (float *)(ida->dp_block + dp_pos);
+		bad[i] = (uint8_t *)(ida->bad_block + bad_pos);
+		dp_pos += panel_block_size(nel*sizeof(float));
+		bad_pos += panel_block_size(nel);
+	}
+
+	return 0;
+}
+
+
+int image_create_dp_bad(struct image *image,
+                        const DataTemplate *dtempl)
+{
+	int i;
+
+	/* The arrays are kept as long as the panels stay the same size */
+	if ( (image->ida != NULL) && (image->ida->np > 0)
+	  && !image_data_arrays_fit(image->ida, dtempl) )
+	{
+		image_data_arrays_release(image->ida);
+	}
+
+	if ( (image->ida != NULL) && (image->ida->np > 0) ) {
+
+		/* (Re-)use the provided arrays */
+		image->dp = image->ida->dp;
+		image->bad = image->ida->bad;
+
+	} else {
 
 		/* Allocate new arrays */
 
@@ -675,7 +1449,7 @@ int image_create_dp_bad(struct image *image,
 			return 1;
 		}
 
-		image->bad = cfmalloc(dtempl->n_panels*sizeof(int *));
+		image->bad = cfmalloc(dtempl->n_panels*sizeof(uint8_t *));
 		if ( image->bad == NULL ) {
 			ERROR("Failed to allocate bad pixel mask\n");
 			cffree(image->dp);
@@ -688,12 +1462,23 @@ int image_create_dp_bad(struct image *image,
 			image->bad[i] = NULL;
 		}
 
+		if ( (image->ida != NULL) && (image->ida->hp != HUGE_PAGES_NONE)
+		  && alloc_huge_panels(image->ida, dtempl, image->dp, image->bad) )
+		{
+			ERROR("Failed to allocate panel data arrays\n");
+			cffree(image->dp);
+			cffree(image->bad);
+			return 1;
+		}
+
 		for ( i=0; i<dtempl->n_panels; i++ ) {
 
 			size_t nel = PANEL_WIDTH(&dtempl->panels[i]) * PANEL_HEIGHT(&dtempl->panels[i]);
 
+			if ( image->dp[i] != NULL ) continue;  /* Huge pages */
+
 			image->dp[i] = cfmalloc(nel*sizeof(float));
-			image->bad[i] = cfmalloc(nel*sizeof(int));
+			image->bad[i] = cfmalloc(nel);
 
 			if ( (image->dp[i] == NULL)|| (image->bad[i] == NULL) ) {
 				ERROR("Failed to allocate panel data arrays\n");
@@ -709,9 +1494,21 @@ int image_create_dp_bad(struct image *image,
 		}
 
 		if ( image->ida != NULL ) {
-			image->ida->dp = image->dp;
-			image->ida->bad = image->bad;
-			image->ida->np = dtempl->n_panels;
+			size_t *nel = cfmalloc(dtempl->n_panels*sizeof(size_t));
+			if ( nel == NULL ) {
+				/* The image will still own the arrays */
+				ERROR("Failed to allocate panel sizes\n");
+				image->ida = NULL;
+			} else {
+				for ( i=0; i<dtempl->n_panels; i++ ) {
+					nel[i] = PANEL_WIDTH(&dtempl->panels[i])
+					       * PANEL_HEIGHT(&dtempl->panels[i]);
+				}
+				image->ida->dp = image->dp;
+				image->ida->bad = image->bad;
+				image->ida->nel = nel;
+				image->ida->np = dtempl->n_panels;
+			}
 		}
 
 	}
@@ -721,7 +1518,7 @@ int image_create_dp_bad(struct image *image,
 		size_t nel = PANEL_WIDTH(&dtempl->panels[i]) * PANEL_HEIGHT(&dtempl->panels[i]);
 
 		profile_start("zero-mask");
-		memset(image->bad[i], 0, nel*sizeof(int));
+		memset(image->bad[i], 0, nel);
 		profile_end("zero-mask");
 
 	}
@@ -805,7 +1602,7 @@ static int set_image_parameters(struct image *image,
 }
 
 
-static void mark_flagged_pixels_lessthan(float *dp, int *bad,
+static void mark_flagged_pixels_lessthan(float *dp, uint8_t *bad,
                                          long int n, float val)
 {
 	long int i;
@@ -815,7 +1612,7 @@ static void mark_flagged_pixels_lessthan(float *dp, int *bad,
 }
 
 
-static void mark_flagged_pixels_morethan(float *dp, int *bad,
+static void mark_flagged_pixels_morethan(float *dp, uint8_t *bad,
                                          long int n, float val)
 {
 	long int i;
@@ -825,7 +1622,7 @@ static void mark_flagged_pixels_morethan(float *dp, int *bad,
 }
 
 
-static void mark_flagged_pixels_equal(float *dp, int *bad,
+static void mark_flagged_pixels_equal(float *dp, uint8_t *bad,
                                       long int n, float val)
 {
 	long int i;
@@ -843,7 +1640,7 @@ static void mark_flagged_pixels_equal(float *dp, int *bad,
 
 
 static void mark_flagged_pixels(struct panel_template *p,
-                                float *dp, int *bad)
+                                float *dp, uint8_t *bad)
 {
 	int p_w, p_h;
 	long int n;
@@ -895,7 +1692,7 @@ static int region_within_panel(struct dt_badregion *region,
 
 
 static void draw_bad_region_fsss(struct dt_badregion *region,
-                                 int **bad,
+                                 uint8_t **bad,
                                  struct detgeom *detgeom)
 {
 	struct detgeom_panel *panel;
@@ -918,7 +1715,7 @@ static void draw_bad_region_fsss(struct dt_badregion *region,
 
 
 static void draw_bad_region_xy(struct dt_badregion *region,
-                               int **bad,
+                               uint8_t **bad,
                                struct detgeom *detgeom)
 {
 	int i;
@@ -950,20 +1747,16 @@ static void draw_bad_region_xy(struct dt_badregion *region,
 }
 
 
-static void mark_bad_regions(struct image *image,
+static void mark_bad_regions(uint8_t **bad, struct detgeom *detgeom,
                              const DataTemplate *dtempl)
 {
 	int i;
 
 	for ( i=0; i<dtempl->n_bad; i++ ) {
 		if ( dtempl->bad[i].is_fsss ) {
-			draw_bad_region_fsss(&dtempl->bad[i],
-			                     image->bad,
-			                     image->detgeom);
+			draw_bad_region_fsss(&dtempl->bad[i], bad, detgeom);
 		} else {
-			draw_bad_region_xy(&dtempl->bad[i],
-			                   image->bad,
-			                   image->detgeom);
+			draw_bad_region_xy(&dtempl->bad[i], bad, detgeom);
 		}
 	}
 }
@@ -972,7 +1765,7 @@ static void mark_bad_regions(struct image *image,
 static int load_mask(struct panel_template *p,
                      const char *mask_fn,
                      const char *ev,
-                     int *bad,
+                     uint8_t *bad,
                      const char *mask_location,
                      unsigned int mask_good,
                      unsigned int mask_bad)
@@ -1000,7 +1793,7 @@ static int load_mask(struct panel_template *p,
 }
 
 
-static void mask_panel_edges(int *bad, int p_w, int p_h, int edgew)
+static void mask_panel_edges(uint8_t *bad, int p_w, int p_h, int edgew)
 {
 	int i;
 
@@ -1023,15 +1816,171 @@ static void mask_panel_edges(int *bad, int p_w, int p_h, int edgew)
 }
 
 
+static int panel_has_placeholders(const struct panel_template *p)
+{
+	int i;
+	for ( i=0; i<MAX_DIMS; i++ ) {
+		if ( p->dims[i] == DIM_PLACEHOLDER ) return 1;
+	}
+	return 0;
+}
+
+
+/* A mask or saturation map is the same for every event if it comes from a
+ * separate file, and neither its location nor the panel's dimensions contain
+ * placeholders. */
+static int map_is_static(const struct panel_template *p,
+                         const char *filename, const char *location)
+{
+	if ( filename == NULL ) return 0;
+	if ( strchr(location, '%') != NULL ) return 0;
+	return !panel_has_placeholders(p);
+}
+
+
+/* Bad regions specified in x/y depend on the detector geometry, which
+ * is only fixed if it doesn't include a shift read from the headers. */
+static int bad_regions_static(const DataTemplate *dtempl)
+{
+	return (dtempl->shift_x_from == NULL)
+	    && (dtempl->shift_y_from == NULL);
+}
+
+
+static int panel_any_bad(const uint8_t *bad, long int n)
+{
+	long int i;
+	for ( i=0; i<n; i++ ) {
+		if ( bad[i] ) return 1;
+	}
+	return 0;
+}
+
+
+static uint8_t **build_static_badmap(struct image *image,
+                                 const DataTemplate *dtempl,
+                                 int no_mask_data)
+{
+	int i;
+	uint8_t **bad;
+
+	bad = cfcalloc(dtempl->n_panels, sizeof(uint8_t *));
+	if ( bad == NULL ) return NULL;
+
+	for ( i=0; i<dtempl->n_panels; i++ ) {
+		struct panel_template *p = &dtempl->panels[i];
+		bad[i] = cfcalloc(PANEL_WIDTH(p)*PANEL_HEIGHT(p), 1);
+		if ( bad[i] == NULL ) goto fail;
+	}
+
+	for ( i=0; i<dtempl->n_panels; i++ ) {
+
+		int j;
+		struct panel_template *p = &dtempl->panels[i];
+
+		/* Whole panel will be marked bad anyway */
+		if ( p->bad ) continue;
+
+		if ( p->mask_edge_pixels > 0 ) {
+			mask_panel_edges(bad[i], PANEL_WIDTH(p), PANEL_HEIGHT(p),
+			                 p->mask_edge_pixels);
+		}
+
+		if ( no_mask_data ) continue;
+
+		for ( j=0; j<MAX_MASKS; j++ ) {
+
+			if ( p->masks[j].data_location == NULL ) continue;
+
+			if ( !map_is_static(p, p->masks[j].filename,
+			                    p->masks[j].data_location) )
+			{
+				continue;
+			}
+
+			if ( load_mask(p, p->masks[j].filename, image->ev, bad[i],
+			               p->masks[j].data_location,
+			               p->masks[j].good_bits,
+			               p->masks[j].bad_bits) )
+			{
+				ERROR("Failed to load mask for %s\n", p->name);
+				goto fail;
+			}
+		}
+	}
+
+	if ( bad_regions_static(dtempl) ) {
+		mark_bad_regions(bad, image->detgeom, dtempl);
+	}
+
+	/* Don't bother keeping panels with nothing to add */
+	for ( i=0; i<dtempl->n_panels; i++ ) {
+		struct panel_template *p = &dtempl->panels[i];
+		if ( !panel_any_bad(bad[i], PANEL_WIDTH(p)*PANEL_HEIGHT(p)) ) {
+			cffree(bad[i]);
+			bad[i] = NULL;
+		}
+	}
+
+	return bad;
+
+fail:
+	for ( i=0; i<dtempl->n_panels; i++ ) {
+		cffree(bad[i]);
+	}
+	cffree(bad);
+	return NULL;
+}
+
+
+/* Returns the part of the bad pixel map which is the same for every event,
+ * building it if necessary.  The result belongs to the DataTemplate. */
+static uint8_t **static_badmap(struct image *image,
+                           const DataTemplate *dtempl,
+                           int no_mask_data)
+{
+	struct static_maps *sm = dtempl->static_maps;
+	uint8_t **bad;
+
+	no_mask_data = no_mask_data ? 1 : 0;
+
+	pthread_mutex_lock(&sm->lock);
+	if ( sm->bad[no_mask_data] == NULL ) {
+		profile_start("static-badmap");
+		sm->bad[no_mask_data] = build_static_badmap(image, dtempl,
+		                                            no_mask_data);
+		profile_end("static-badmap");
+	}
+	bad = sm->bad[no_mask_data];
+	pthread_mutex_unlock(&sm->lock);
+
+	return bad;
+}
+
+
+static void add_static_bad(uint8_t *bad, const uint8_t *sbad, long int n)
+{
+	long int i;
+	for ( i=0; i<n; i++ ) {
+		bad[i] |= sbad[i];
+	}
+}
+
+
 static int create_badmap(struct image *image,
                          const DataTemplate *dtempl,
                          int no_mask_data)
 {
 	int i;
+	uint8_t **sbad;
 
 	/* The bad pixel map array is already created (see image_create_dp_bad),
 	 * and a preliminary mask (with NaN/inf pixels marked) has already been
-	 * created when the image data was loaded. */
+	 * created when the image data was loaded.  Edge pixels, masks from
+	 * separate files and bad regions are the same for every event, and
+	 * come from the DataTemplate's cache. */
+	sbad = static_badmap(image, dtempl, no_mask_data);
+	if ( sbad == NULL ) return 1;
 
 	for ( i=0; i<dtempl->n_panels; i++ ) {
 
@@ -1044,30 +1993,23 @@ static int create_badmap(struct image *image,
 		/* Panel marked as bad? */
 		if ( p->bad ) {
 			profile_start("whole-panel");
-			/* NB this sets every element to 0x1111,
-			 * but that's OK - value is still 'true'. */
 			memset(image->bad[i], 1, p_w*p_h);
 			profile_end("whole-panel");
+			continue;
 		}
 
-		/* Add bad regions (skip if panel is bad anyway) */
-		if ( !p->bad ) {
-			profile_start("flagged-pixels");
-			mark_flagged_pixels(p, image->dp[i],
-			                    image->bad[i]);
-			profile_end("flagged-pixels");
-		}
+		profile_start("flagged-pixels");
+		mark_flagged_pixels(p, image->dp[i], image->bad[i]);
+		profile_end("flagged-pixels");
 
-		/* Mask panel edges (skip if panel is bad anyway) */
-		if ( (p->mask_edge_pixels > 0) && !p->bad ) {
-			profile_start("panel-edges");
-			mask_panel_edges(image->bad[i], p_w, p_h,
-			                 p->mask_edge_pixels);
-			profile_end("panel-edges");
+		if ( sbad[i] != NULL ) {
+			profile_start("static-bad");
+			add_static_bad(image->bad[i], sbad[i], p_w*p_h);
+			profile_end("static-bad");
 		}
 
-		/* Load masks (skip if panel is bad anyway) */
-		if ( (!no_mask_data) && (!p->bad) ) {
+		/* Load per-event masks */
+		if ( !no_mask_data ) {
 
 			int j;
 			profile_start("load-masks");
@@ -1080,6 +2022,12 @@ static int create_badmap(struct image *image,
 					continue;
 				}
 
+				if ( map_is_static(p, p->masks[j].filename,
+				                   p->masks[j].data_location) )
+				{
+					continue;
+				}
+
 				if ( p->masks[j].filename == NULL ) {
 					mask_fn = image->filename;
 				} else {
@@ -1102,19 +2050,75 @@ static int create_badmap(struct image *image,
 		}
 	}
 
-	profile_start("mark-regions");
-	mark_bad_regions(image, dtempl);
-	profile_end("mark-regions");
+	if ( !bad_regions_static(dtempl) ) {
+		profile_start("mark-regions");
+		mark_bad_regions(image->bad, image->detgeom, dtempl);
+		profile_end("mark-regions");
+	}
 
 	return 0;
 }
 
 
+static float *load_satmap(struct image *image, struct panel_template *p)
+{
+	const char *map_fn;
+
+	if ( p->satmap_file == NULL ) {
+		map_fn = image->filename;
+	} else {
+		map_fn = p->satmap_file;
+	}
+
+	if ( is_hdf5_file(map_fn, NULL) ) {
+		#ifdef HAVE_HDF5
+		return image_hdf5_read_satmap(p, map_fn, image->ev, p->satmap);
+		#endif
+	} else {
+		ERROR("Saturation map must be in HDF5 format\n");
+	}
+
+	return NULL;
+}
+
+
+/* Copies the saturation map for panel 'pn', which must be the same for every
+ * event, into 'sat', loading it into the DataTemplate's cache if necessary. */
+static int static_satmap(struct image *image, const DataTemplate *dtempl,
+                         int pn, float *sat)
+{
+	struct static_maps *sm = dtempl->static_maps;
+	struct panel_template *p = &dtempl->panels[pn];
+	int r = 1;
+
+	pthread_mutex_lock(&sm->lock);
+
+	if ( sm->sat == NULL ) {
+		sm->sat = cfcalloc(dtempl->n_panels, sizeof(float *));
+	}
+
+	if ( (sm->sat != NULL) && (sm->sat[pn] == NULL) ) {
+		sm->sat[pn] = load_satmap(image, p);
+	}
+
+	if ( (sm->sat != NULL) && (sm->sat[pn] != NULL) ) {
+		size_t sz = PANEL_WIDTH(p)*PANEL_HEIGHT(p)*sizeof(float);
+		memcpy(sat, sm->sat[pn], sz);
+		r = 0;
+	}
+
+	pthread_mutex_unlock(&sm->lock);
+
+	return r;
+}
+
+
 static int create_satmap(struct image *image,
                          const DataTemplate *dtempl)
 {
 	int i;
 	int any;
+	float **sat;
 
 	/* The panels will be treated separately, but we'll only bother at all
 	 * if at least one of them has a saturation map. */
@@ -1128,58 +2132,59 @@ static int create_satmap(struct image *image,
 
 	if ( !any ) return 0;
 
-	image->sat = cfmalloc(dtempl->n_panels * sizeof(float *));
-	if ( image->sat == NULL ) {
+	/* If there are ImageDataArrays, the maps are kept in there, and the
+	 * arrays are re-used for the next image */
+	if ( image->ida != NULL ) {
+		if ( image->ida->sat == NULL ) {
+			image->ida->sat = cfcalloc(dtempl->n_panels,
+			                           sizeof(float *));
+		}
+		sat = image->ida->sat;
+	} else {
+		sat = cfcalloc(dtempl->n_panels, sizeof(float *));
+	}
+	if ( sat == NULL ) {
 		ERROR("Failed to allocate saturation map\n");
 		return 1;
 	}
+	image->sat = sat;
 
 	for ( i=0; i<dtempl->n_panels; i++ ) {
 
 		struct panel_template *p = &dtempl->panels[i];
+		size_t nel = PANEL_WIDTH(p) * PANEL_HEIGHT(p);
 
-		if ( p->satmap == NULL ) {
-
-			/* At least one other panel has a saturation map,
-			 * but it isn't this one.  Therefore make a fake
-			 * saturation map */
-
-			int p_w, p_h;
+		if ( (p->satmap == NULL)
+		  || map_is_static(p, p->satmap_file, p->satmap) )
+		{
+			if ( sat[i] == NULL ) {
+				sat[i] = cfmalloc(nel*sizeof(float));
+			}
 
-			p_w = p->orig_max_fs - p->orig_min_fs + 1;
-			p_h = p->orig_max_ss - p->orig_min_ss + 1;
+			if ( sat[i] == NULL ) {
+				/* Error, see below */
 
-			image->sat[i] = cfmalloc(p_w*p_h*sizeof(float));
+			} else if ( p->satmap == NULL ) {
 
-			if ( image->sat[i] != NULL ) {
-				long int j;
-				for ( j=0; j<p_w*p_h; j++ ) {
-					image->sat[i][j] = INFINITY;
+				/* At least one other panel has a saturation
+				 * map, but it isn't this one.  Therefore make
+				 * a fake saturation map */
+				size_t j;
+				for ( j=0; j<nel; j++ ) {
+					sat[i][j] = INFINITY;
 				}
-			}
-
-		} else {
-
-			const char *map_fn;
 
-			if ( p->satmap_file == NULL ) {
-				map_fn = image->filename;
-			} else {
-				map_fn = p->satmap_file;
+			} else if ( static_satmap(image, dtempl, i, sat[i]) ) {
+				cffree(sat[i]);
+				sat[i] = NULL;
 			}
 
-			if ( is_hdf5_file(map_fn, NULL) ) {
-				#ifdef HAVE_HDF5
-				image_hdf5_read_satmap(p, map_fn, image->ev, p->satmap);
-				#endif
-
-			} else {
-				ERROR("Saturation map must be in HDF5 format\n");
-				return 1;
-			}
+		} else {
+			cffree(sat[i]);
+			sat[i] = load_satmap(image, p);
 		}
 
-		if ( image->sat[i] == NULL ) {
+		if ( sat[i] == NULL ) {
 			ERROR("Failed to allocate saturation map (panel %s)\n",
 			      p->name);
 			return 1;
@@ -1362,6 +2367,38 @@ struct image *image_read_data_block(const DataTemplate *dtempl,
                                     int no_image_data,
                                     int no_mask_data,
                                     ImageDataArrays *ida)
+{
+	return image_read_data_block_ref(dtempl, data_block, data_block_size,
+	                                 NULL, NULL, meta_data, type, serial,
+	                                 no_image_data, no_mask_data, ida);
+}
+
+
+/**
+ * As image_read_data_block(), except that \p data_block will be released by
+ * calling \p release with \p release_priv, instead of being freed.  This
+ * allows the image to keep a reference to memory which belongs to something
+ * else, for example a received ZeroMQ message, without copying it.
+ *
+ * If the data is in a suitable format (currently MessagePack, with 32-bit
+ * little-endian floats and panels covering whole rows of the array), the
+ * panel data arrays will point directly into \p data_block.  The contents of
+ * \p data_block might then be changed, e.g. by filtering.
+ *
+ * \p data_block will be released by image_free(), or before this function
+ * returns if it fails.
+ */
+struct image *image_read_data_block_ref(const DataTemplate *dtempl,
+                                        void *data_block,
+                                        size_t data_block_size,
+                                        void (*release)(void *priv),
+                                        void *release_priv,
+                                        char *meta_data,
+                                        DataSourceType type,
+                                        int serial,
+                                        int no_image_data,
+                                        int no_mask_data,
+                                        ImageDataArrays *ida)
 {
 	struct image *image;
 
@@ -1381,6 +2418,8 @@ struct image *image_read_data_block(const DataTemplate *dtempl,
 	image->ev = NULL;
 	image->data_block = data_block;
 	image->data_block_size = data_block_size;
+	image->data_block_release = release;
+	image->data_block_priv = release_priv;
 	image->meta_data = meta_data;
 
 	image->data_source_type = type;
@@ -1405,7 +2444,6 @@ void image_free(struct image *image)
 	spectrum_free(image->spectrum);
 	cffree(image->filename);
 	cffree(image->ev);
-	cffree(image->data_block);
 	cffree(image->meta_data);
 
 	if ( image->detgeom != NULL ) {
@@ -1418,7 +2456,12 @@ void image_free(struct image *image)
 	if ( image->ida == NULL ) {
 
 		for ( i=0; i<np; i++ ) {
-			if ( image->dp != NULL ) cffree(image->dp[i]);
+			if ( (image->dp != NULL)
+			  && ((image->dp_in_data_block == NULL)
+			      || !image->dp_in_data_block[i]) )
+			{
+				cffree(image->dp[i]);
+			}
 			if ( image->sat != NULL ) cffree(image->sat[i]);
 			if ( image->bad != NULL ) cffree(image->bad[i]);
 		}
@@ -1427,7 +2470,20 @@ void image_free(struct image *image)
 		cffree(image->sat);
 		cffree(image->bad);
 
+	} else if ( image->dp_in_data_block != NULL ) {
+
+		/* Only the list of panel pointers belongs to the image */
+		cffree(image->dp);
+
 	} /* else the arrays belong to the IDA structure */
+	cffree(image->dp_in_data_block);
+
+	/* After the panel data, which might point into it */
+	if ( image->data_block_release != NULL ) {
+		image->data_block_release(image->data_block_priv);
+	} else {
+		cffree(image->data_block);
+	}
 
 	for ( i=0; i<image->n_cached_headers; i++ ) {
 		cffree(image->header_cache[i]->header_name);
@@ -1460,6 +2516,9 @@ struct image *image_new()
 	image->ev = NULL;
 	image->data_block = NULL;
 	image->data_block_size = 0;
+	image->data_block_release = NULL;
+	image->data_block_priv = NULL;
+	image->dp_in_data_block = NULL;
 	image->meta_data = NULL;
 	image->data_source_type = DATA_SOURCE_TYPE_UNKNOWN;
 	image->ida = NULL;
@@ -1479,6 +2538,163 @@ struct image *image_new()
 }
 
 
+static int copy_panel_arrays(struct image *n, const struct image *image)
+{
+	int i;
+	int np = image->detgeom->n_panels;
+
+	n->dp = cfcalloc(np, sizeof(float *));
+	if ( n->dp == NULL ) return 1;
+	if ( image->bad != NULL ) {
+		n->bad = cfcalloc(np, sizeof(uint8_t *));
+		if ( n->bad == NULL ) return 1;
+	}
+	if ( image->sat != NULL ) {
+		n->sat = cfcalloc(np, sizeof(float *));
+		if ( n->sat == NULL ) return 1;
+	}
+
+	for ( i=0; i<np; i++ ) {
+
+		struct detgeom_panel *p = &image->detgeom->panels[i];
+		size_t npx = (size_t)p->w * p->h;
+
+		n->dp[i] = cfmalloc(npx*sizeof(float));
+		if ( n->dp[i] == NULL ) return 1;
+		memcpy(n->dp[i], image->dp[i], npx*sizeof(float));
+
+		if ( (image->bad != NULL) && (image->bad[i] != NULL) ) {
+			n->bad[i] = cfmalloc(npx*sizeof(uint8_t));
+			if ( n->bad[i] == NULL ) return 1;
+			memcpy(n->bad[i], image->bad[i], npx*sizeof(uint8_t));
+		}
+
+		if ( (image->sat != NULL) && (image->sat[i] != NULL) ) {
+			n->sat[i] = cfmalloc(npx*sizeof(float));
+			if ( n->sat[i] == NULL ) return 1;
+			memcpy(n->sat[i], image->sat[i], npx*sizeof(float));
+		}
+	}
+
+	return 0;
+}
+
+
+static int copy_header_cache(struct image *n, const struct image *image)
+{
+	int i;
+
+	for ( i=0; i<image->n_cached_headers; i++ ) {
+
+		const struct header_cache_entry *ce = image->header_cache[i];
+		struct header_cache_entry *nce;
+
+		nce = cfmalloc(sizeof(struct header_cache_entry));
+		if ( nce == NULL ) return 1;
+		*nce = *ce;
+		nce->header_name = cfstrdup(ce->header_name);
+		if ( ce->type == HEADER_STR ) {
+			nce->val_str = cfstrdup(ce->val_str);
+		}
+		n->header_cache[i] = nce;
+		n->n_cached_headers = i+1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * \param image An image structure
+ *
+ * Makes a copy of \p image, as it would be straight after reading: the panel
+ * data, masks, saturation values, detector geometry, beam parameters, cached
+ * headers, filename and event are copied, but the peak list and crystals are
+ * not.  The copy owns all of its arrays, even if the original uses an
+ * \ref ImageDataArrays structure or data block.
+ *
+ * \returns The copy, or NULL on failure.
+ */
+struct image *image_copy(const struct image *image)
+{
+	struct image *n;
+
+	if ( image == NULL ) return NULL;
+
+	n = image_new();
+	if ( n == NULL ) return NULL;
+
+	n->data_source_type = image->data_source_type;
+	n->id = image->id;
+	n->serial = image->serial;
+	n->lambda = image->lambda;
+	n->div = image->div;
+	n->bw = image->bw;
+
+	if ( image->filename != NULL ) n->filename = cfstrdup(image->filename);
+	if ( image->ev != NULL ) n->ev = cfstrdup(image->ev);
+	if ( image->meta_data != NULL ) {
+		n->meta_data = cfstrdup(image->meta_data);
+	}
+
+	if ( image->spectrum != NULL ) {
+		n->spectrum = spectrum_copy(image->spectrum);
+		if ( n->spectrum == NULL ) {
+			image_free(n);
+			return NULL;
+		}
+	}
+
+	if ( image->detgeom != NULL ) {
+		n->detgeom = detgeom_copy(image->detgeom);
+		if ( (n->detgeom == NULL)
+		  || ((image->dp != NULL) && copy_panel_arrays(n, image)) )
+		{
+			image_free(n);
+			return NULL;
+		}
+	}
+
+	if ( copy_header_cache(n, image) ) {
+		image_free(n);
+		return NULL;
+	}
+
+	return n;
+}
+
+
+/**
+ * \param image An image structure
+ * \param pn The panel number
+ * \param view Location at which to store the information
+ *
+ * Fills in \p view with pointers to the data, mask and saturation arrays for
+ * panel \p pn of \p image, along with their dimensions.  Nothing is copied,
+ * so the pointers are only valid until \p image is freed.  This is intended
+ * for language bindings, which can then wrap the arrays directly.
+ *
+ * \returns zero on success, or non-zero if the panel does not exist or has no
+ * data.
+ */
+int image_get_panel_view(const struct image *image, int pn,
+                         struct image_panel_view *view)
+{
+	if ( image->detgeom == NULL ) return 1;
+	if ( (pn < 0) || (pn >= image->detgeom->n_panels) ) return 1;
+	if ( image->dp == NULL ) return 1;
+	if ( image->dp[pn] == NULL ) return 1;
+
+	view->data = image->dp[pn];
+	view->bad = (image->bad != NULL) ? image->bad[pn] : NULL;
+	view->sat = (image->sat != NULL) ? image->sat[pn] : NULL;
+	view->w = image->detgeom->panels[pn].w;
+	view->h = image->detgeom->panels[pn].h;
+	view->stride = view->w;
+	return 0;
+}
+
+
 ImageFeatureList *image_read_peaks(const DataTemplate *dtempl,
                                    const char *filename,
                                    const char *event,
@@ -1539,45 +2755,292 @@ ImageFeatureList *image_read_peaks(const DataTemplate *dtempl,
 }
 
 
-char **image_expand_frames(const DataTemplate *dtempl,
-                           const char *filename, int *n_frames)
+struct _image_event_iter
+{
+	struct frame_block *blocks;
+	int n_blocks;
+
+	/* Position of the next event */
+	int block;
+	int idx[MAX_DIMS];
+};
+
+
+/**
+ * \param dtempl: A DataTemplate
+ * \param filename: The name of a file
+ *
+ * Prepares to enumerate the frames (events) in \p filename, according to
+ * \p dtempl.  Only the sizes of the arrays in the file are read at this
+ * stage, and the event IDs are generated one at a time by
+ * image_event_iter_next().  This uses very little memory even for files
+ * containing millions of frames.
+ *
+ * \returns the new iterator, or NULL on error.
+ */
+ImageEventIter *image_event_iter_new(const DataTemplate *dtempl,
+                                     const char *filename)
 {
+	ImageEventIter *iter;
+
+	iter = cfmalloc(sizeof(struct _image_event_iter));
+	if ( iter == NULL ) return NULL;
+
+	iter->block = 0;
+	memset(iter->idx, 0, sizeof(iter->idx));
+
 	if ( is_hdf5_file(filename, NULL) ) {
 		#ifdef HAVE_HDF5
-		return image_hdf5_expand_frames(dtempl, filename,
-		                                n_frames);
+		iter->blocks = image_hdf5_frame_blocks(dtempl, filename,
+		                                       &iter->n_blocks);
 		#else
 		ERROR("Can't expand frames - compiled without HDF5\n");
-		return NULL;
+		iter->blocks = NULL;
 		#endif
 
 	} else {
-		char **list;
-		list = cfmalloc(sizeof(char *));
-		if ( list == NULL ) return NULL;
-		list[0] = cfstrdup("//");
-		if ( list[0] == NULL ) {
-			cffree(list);
-			return NULL;
+		iter->blocks = cfmalloc(sizeof(struct frame_block));
+		if ( iter->blocks != NULL ) {
+			iter->blocks[0].path_ev = cfstrdup("//");
+			iter->blocks[0].n_dims = 0;
+			iter->n_blocks = 1;
 		}
-		*n_frames = 1;
-		return list;
 	}
+
+	if ( iter->blocks == NULL ) {
+		cffree(iter);
+		return NULL;
+	}
+
+	return iter;
 }
 
 
-void mark_resolution_range_as_bad(struct image *image,
-                                  double min, double max)
+static int block_empty(const struct frame_block *b)
+{
+	int i;
+	for ( i=0; i<b->n_dims; i++ ) {
+		if ( b->sizes[i] == 0 ) return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * \param iter: An ImageEventIter
+ *
+ * \returns the next event ID, which must be freed by the caller, or NULL if
+ * there are no more events.
+ */
+char *image_event_iter_next(ImageEventIter *iter)
+{
+	struct frame_block *b;
+	char *ev;
+	size_t len;
+	int i;
+
+	while ( (iter->block < iter->n_blocks)
+	     && block_empty(&iter->blocks[iter->block]) )
+	{
+		iter->block++;
+	}
+	if ( iter->block >= iter->n_blocks ) return NULL;
+
+	b = &iter->blocks[iter->block];
+
+	len = strlen(b->path_ev) + 12*b->n_dims + 1;
+	ev = cfmalloc(len);
+	if ( ev == NULL ) return NULL;
+
+	strcpy(ev, b->path_ev);
+	for ( i=0; i<b->n_dims; i++ ) {
+		size_t l = strlen(ev);
+		snprintf(ev+l, len-l, "/%i", iter->idx[i]);
+	}
+
+	/* Advance, with the last dimension varying fastest */
+	for ( i=b->n_dims-1; i>=0; i-- ) {
+		if ( ++iter->idx[i] < b->sizes[i] ) break;
+		iter->idx[i] = 0;
+	}
+	if ( i < 0 ) iter->block++;
+
+	return ev;
+}
+
+
+void image_event_iter_free(ImageEventIter *iter)
+{
+	int i;
+
+	if ( iter == NULL ) return;
+	for ( i=0; i<iter->n_blocks; i++ ) {
+		cffree(iter->blocks[i].path_ev);
+	}
+	cffree(iter->blocks);
+	cffree(iter);
+}
+
+
+char **image_expand_frames(const DataTemplate *dtempl,
+                           const char *filename, int *n_frames)
+{
+	ImageEventIter *iter;
+	char **list = NULL;
+	int n = 0;
+	int max = 0;
+	char *ev;
+
+	iter = image_event_iter_new(dtempl, filename);
+	if ( iter == NULL ) return NULL;
+
+	while ( (ev = image_event_iter_next(iter)) != NULL ) {
+		if ( n == max ) {
+			char **new_list;
+			max = max*2 + 128;
+			new_list = cfrealloc(list, max*sizeof(char *));
+			if ( new_list == NULL ) {
+				cffree(ev);
+				break;
+			}
+			list = new_list;
+		}
+		list[n++] = ev;
+	}
+
+	image_event_iter_free(iter);
+
+	*n_frames = n;
+	return list;
+}
+
+
+/**
+ * \param max_files: The number of files to keep open, or zero for none
+ * \param chunk_cache_size: Size of the HDF5 chunk cache for each dataset, in
+ *   bytes, or zero to use the HDF5 library's default
+ *
+ * Keeps up to \p max_files HDF5 files, and the datasets read from them, open
+ * after reading an image.  Further events from the same files can then be
+ * read without opening them again.  The least recently used file is closed
+ * when the limit is reached.  Files which have changed on disk since they
+ * were opened are opened again.
+ *
+ * Calling this function closes any files which are already open.  Like the
+ * rest of the image reading, the cache must not be used from more than one
+ * thread at once.
+ */
+void image_set_file_cache(int max_files, size_t chunk_cache_size)
+{
+	#ifdef HAVE_HDF5
+	image_hdf5_set_file_cache(max_files, chunk_cache_size);
+	#endif
+}
+
+
+/**
+ * Closes all files kept open by the cache set up with
+ * image_set_file_cache().
+ */
+void image_close_cached_files()
+{
+	#ifdef HAVE_HDF5
+	image_hdf5_close_cached_files();
+	#endif
+}
+
+
+/**
+ * \param n_frames: The number of frames to read at once
+ *
+ * Reads \p n_frames consecutive frames of a multi-frame HDF5 dataset at once,
+ * with one hyperslab, when the first of them is read.  The following events
+ * are then read from memory, provided that they are read in order and
+ * straight afterwards.  The frames are numbered along the last placeholder
+ * dimension of the panel data.
+ *
+ * This only works for files kept open by image_set_file_cache().  Up to
+ * \p n_frames frames are held in memory for each dataset of each cached file.
+ */
+void image_set_batch_frames(int n_frames)
+{
+	#ifdef HAVE_HDF5
+	image_hdf5_set_batch_frames(n_frames);
+	#endif
+}
+
+
+/**
+ * \param n_threads: The number of threads for decompression, or zero
+ *
+ * If \p n_threads is not zero, compressed HDF5 data will be read by fetching
+ * the compressed chunks from the file and decompressing them in libcrystfel,
+ * using \p n_threads threads.  Otherwise, HDF5's own filters will be used,
+ * which decompress the chunks one at a time.
+ *
+ * This works for the deflate (optionally with byte shuffle), Zstandard and
+ * bitshuffle/LZ4 and bitshuffle/Zstandard filters, if libcrystfel was built
+ * with the corresponding libraries.  Other data will still be read by HDF5.
+ * The data must be stored in the native byte order, as an integer of up to
+ * 32 bits or as a floating point number.
+ *
+ * CBF data with byte offset compression will be decoded in blocks, using
+ * \p n_threads threads if it is more than one.
+ */
+void image_set_decompression_threads(int n_threads)
+{
+	#ifdef HAVE_HDF5
+	image_hdf5_set_direct_chunk_threads(n_threads);
+	#endif
+	image_cbf_set_decode_threads(n_threads);
+}
+
+
+/**
+ * \param image An \ref image structure
+ * \param qm Maps made by detgeom_qmaps_new() with DETGEOM_MAP_QMOD, or NULL
+ * \param min Lower limit of resolution range, in m^-1
+ * \param max Upper limit of resolution range, in m^-1
+ *
+ * Same as mark_resolution_range_as_bad(), but uses the pre-calculated values
+ * of |q| in \p qm if they are there and match the geometry of \p image.
+ * Otherwise, |q| is calculated for each pixel.
+ */
+void mark_resolution_range_as_bad_maps(struct image *image,
+                                       const struct detgeom_qmaps *qm,
+                                       double min, double max)
 {
 	int i;
 
 	if ( isinf(min) && isinf(max) ) return;  /* nothing to do */
 
+	if ( (qm != NULL) && !detgeom_qmaps_valid(qm, image->detgeom) ) {
+		qm = NULL;
+	}
+	if ( (qm != NULL) && (detgeom_qmaps_qmod(qm, 0) == NULL) ) qm = NULL;
+
 	for ( i=0; i<image->detgeom->n_panels; i++ ) {
 
 		int fs, ss;
 		struct detgeom_panel *p = &image->detgeom->panels[i];
 
+		if ( qm != NULL ) {
+
+			const float *qmod = detgeom_qmaps_qmod(qm, i);
+			const double lmin = min*image->lambda;
+			const double lmax = max*image->lambda;
+			const int n = p->w*p->h;
+			int j;
+
+			for ( j=0; j<n; j++ ) {
+				if ( (qmod[j] >= lmin) && (qmod[j] <= lmax) ) {
+					image->bad[i][j] = 1;
+				}
+			}
+			continue;
+
+		}
+
 		for ( ss=0; ss<p->h; ss++ ) {
 			for ( fs=0; fs<p->w; fs++ ) {
 				double q[3];
@@ -1594,3 +3057,10 @@ void mark_resolution_range_as_bad(struct image *image,
 
 	}
 }
+
+
+void mark_resolution_range_as_bad(struct image *image,
+                                  double min, double max)
+{
+	mark_resolution_range_as_bad_maps(image, NULL, min, max);
+}
@@ -75,8 +75,25 @@ struct imagefeature {
 /** An opaque type representing a list of image features */
 typedef struct _imagefeaturelist ImageFeatureList;
 
+
+/**
+ * The features in an \ref ImageFeatureList, as separate arrays, from
+ * image_feature_list_arrays().
+ */
+struct imagefeature_arrays
+{
+	int                             n;          /**< Number of features */
+	const double                    *fs;        /**< Fast scan coordinates */
+	const double                    *ss;        /**< Slow scan coordinates */
+	const int                       *pn;        /**< Panel numbers */
+	const double                    *intensity; /**< Intensities */
+};
+
 typedef struct _image_data_arrays ImageDataArrays;
 
+/** An opaque type for enumerating the frames in a file */
+typedef struct _image_event_iter ImageEventIter;
+
 
 #define HEADER_CACHE_SIZE (128)
 
@@ -116,6 +133,10 @@ struct crystal_refls
 	RefList *refls;
 	int image_owns_crystal;
 	int image_owns_refls;
+
+	/* Text of the reflection list, if parsing it was deferred (see
+	 * stream_crystal_refls()) */
+	char *refls_text;
 };
 
 struct image
@@ -123,8 +144,8 @@ struct image
 	/** The image data, by panel */
 	float                   **dp;
 
-	/** The bad pixel mask, by panel */
-	int                     **bad;
+	/** The bad pixel mask, by panel (non-zero for bad pixels) */
+	uint8_t                 **bad;
 
 	/** The per-pixel saturation values, by panel */
 	float                   **sat;
@@ -161,6 +182,15 @@ struct image
 	size_t                   data_block_size;
 	char                    *meta_data;
 
+	/** If not NULL, image_free() calls this with \p data_block_priv to
+	 * release \p data_block, instead of freeing it */
+	void                   (*data_block_release)(void *priv);
+	void                    *data_block_priv;
+
+	/** If not NULL, non-zero for each panel whose \p dp array points
+	 * into \p data_block instead of being allocated separately */
+	int                     *dp_in_data_block;
+
 	/** A list of metadata read from the stream */
 	struct header_cache_entry *header_cache[HEADER_CACHE_SIZE];
 	int                        n_cached_headers;
@@ -198,6 +228,29 @@ struct image
 
 };
 
+
+/**
+ * The arrays for one panel of an image, as returned by
+ * image_get_panel_view().  The arrays belong to the image.
+ *
+ * Pixel (fs, ss) is at index \c fs + \c ss*stride in each array.
+ */
+struct image_panel_view
+{
+	/** The image data, mask and saturation values.  \p bad and \p sat
+	 * can be NULL if the image doesn't have them. */
+	float   *data;
+	uint8_t *bad;
+	float   *sat;
+
+	/** Size of the panel, in the fast and slow scan directions */
+	int      w;
+	int      h;
+
+	/** Number of array elements from one row (slow scan) to the next */
+	int      stride;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -215,8 +268,12 @@ extern void image_feature_list_free(ImageFeatureList *flist);
 extern void image_add_feature(ImageFeatureList *flist, double x, double y,
                               int pn, double intensity, const char *name);
 
+extern int image_feature_list_reserve(ImageFeatureList *flist, int n);
+
 extern void image_remove_feature(ImageFeatureList *flist, int idx);
 
+extern int image_remove_features(ImageFeatureList *flist, const char *remove);
+
 extern struct imagefeature *image_feature_closest(ImageFeatureList *flist,
                                                   double fs, double ss,
                                                   int pn,
@@ -224,8 +281,12 @@ extern struct imagefeature *image_feature_closest(ImageFeatureList *flist,
 
 extern int image_feature_count(ImageFeatureList *flist);
 extern struct imagefeature *image_get_feature(ImageFeatureList *flist, int idx);
+extern struct imagefeature *image_feature_list_array(ImageFeatureList *flist,
+                                                     int *n);
 extern const struct imagefeature *image_get_feature_const(const ImageFeatureList *flist,
                                                           int idx);
+extern int image_feature_list_arrays(ImageFeatureList *flist,
+                                     struct imagefeature_arrays *arr);
 extern ImageFeatureList *sort_peaks(ImageFeatureList *flist);
 extern ImageFeatureList *image_feature_list_copy(const ImageFeatureList *flist);
 
@@ -237,6 +298,9 @@ extern void free_all_crystals(struct image *image);
 
 extern void mark_resolution_range_as_bad(struct image *image,
                                          double min, double max);
+extern void mark_resolution_range_as_bad_maps(struct image *image,
+                                              const struct detgeom_qmaps *qm,
+                                              double min, double max);
 
 extern struct image *image_new(void);
 extern struct image *image_read(const DataTemplate *dtempl,
@@ -256,7 +320,21 @@ extern struct image *image_read_data_block(const DataTemplate *dtempl,
                                            int no_image_data,
                                            int no_mask_data,
                                            ImageDataArrays *ida);
+extern struct image *image_read_data_block_ref(const DataTemplate *dtempl,
+                                               void *data_block,
+                                               size_t data_block_size,
+                                               void (*release)(void *priv),
+                                               void *release_priv,
+                                               char *meta_data,
+                                               DataSourceType type,
+                                               int serial,
+                                               int no_image_data,
+                                               int no_mask_data,
+                                               ImageDataArrays *ida);
 extern void image_free(struct image *image);
+extern struct image *image_copy(const struct image *image);
+extern int image_get_panel_view(const struct image *image, int pn,
+                                struct image_panel_view *view);
 
 extern int image_read_header_float(struct image *image, const char *from,
                                    double *val);
@@ -284,9 +362,24 @@ extern ImageFeatureList *image_read_peaks(const DataTemplate *dtempl,
 extern char **image_expand_frames(const DataTemplate *dtempl,
                                   const char *filename, int *nframes);
 
+extern ImageEventIter *image_event_iter_new(const DataTemplate *dtempl,
+                                            const char *filename);
+extern char *image_event_iter_next(ImageEventIter *iter);
+extern void image_event_iter_free(ImageEventIter *iter);
+
+extern void image_set_file_cache(int max_files, size_t chunk_cache_size);
+
+extern void image_close_cached_files(void);
+
+extern void image_set_decompression_threads(int n_threads);
+
+extern void image_set_batch_frames(int n_frames);
+
 extern ImageDataArrays *image_data_arrays_new(void);
+extern ImageDataArrays *image_data_arrays_new_huge(enum huge_pages hp);
 
 extern void image_data_arrays_free(ImageDataArrays *ida);
+extern void *image_data_arrays_scratch(ImageDataArrays *ida, size_t size);
 
 extern int image_create_dp_bad(struct image *image,
                                const DataTemplate *dtempl);
@@ -41,6 +41,9 @@
 #include <assert.h>
 #include <fenv.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "image.h"
 #include "utils.h"
@@ -71,6 +74,7 @@ struct _indexingprivate
 	IndexingFlags flags;
 	UnitCell *target_cell;
 	double tolerance[6];
+	CellComparison *target_cmp;  /* For checking against target_cell */
 	double wavelength_estimate;
 	double clen_estimate;
 	int n_threads;
@@ -78,6 +82,15 @@ struct _indexingprivate
 	int n_methods;
 	IndexingMethod *methods;
 	void **engine_private;
+
+	/* Statistics for each method since the last indexing_method_stats() */
+	int *n_attempts;
+	int *n_successes;
+	double *time_spent;
+
+	int n_recent;                        /* Recent orientations to try */
+	struct recent_orientations *recent;  /* Possibly shared */
+	struct recent_orientations *own_recent;  /* If not shared */
 };
 
 
@@ -101,6 +114,10 @@ static void show_indexing_flags(IndexingFlags flags)
 	       onoff(flags & INDEXING_MULTI));
 	STATUS("                              Retry indexing: %s\n",
 	       onoff(flags & INDEXING_RETRY));
+	STATUS("            Run indexing methods in parallel: %s\n",
+	       onoff(flags & INDEXING_RACE));
+	STATUS("     Keep indexing programs between patterns: %s\n",
+	       onoff(flags & INDEXING_PERSISTENT));
 }
 
 
@@ -190,6 +207,7 @@ static char *friendly_indexer_name(IndexingMethod m)
 
 
 static void *prepare_method(IndexingMethod *m, UnitCell *cell,
+                            IndexingFlags flags,
                             double wavelength_estimate,
                             double clen_estimate,
                             struct xgandalf_options *xgandalf_opts,
@@ -210,7 +228,7 @@ static void *prepare_method(IndexingMethod *m, UnitCell *cell,
 		break;
 
 		case INDEXING_DIRAX :
-		priv = dirax_prepare(m, cell);
+		priv = dirax_prepare(m, cell, flags & INDEXING_PERSISTENT);
 		break;
 
 		case INDEXING_ASDF :
@@ -218,7 +236,7 @@ static void *prepare_method(IndexingMethod *m, UnitCell *cell,
 		break;
 
 		case INDEXING_MOSFLM :
-		priv = mosflm_prepare(m, cell);
+		priv = mosflm_prepare(m, cell, flags & INDEXING_PERSISTENT);
 		break;
 
 		case INDEXING_XDS :
@@ -393,6 +411,7 @@ IndexingPrivate *setup_indexing(const char *method_list,
 		int j;
 
 		ipriv->engine_private[i] = prepare_method(&methods[i], cell,
+		                                          flags,
 		                                          wavelength_estimate,
 		                                          clen_estimate,
 		                                          xgandalf_opts,
@@ -419,10 +438,16 @@ IndexingPrivate *setup_indexing(const char *method_list,
 
 	ipriv->methods = methods;
 	ipriv->n_methods = n;
+	ipriv->n_attempts = cfcalloc(n, sizeof(int));
+	ipriv->n_successes = cfcalloc(n, sizeof(int));
+	ipriv->time_spent = cfcalloc(n, sizeof(double));
 	ipriv->flags = flags;
 	ipriv->wavelength_estimate = wavelength_estimate;
 	ipriv->clen_estimate = clen_estimate;
 	ipriv->n_threads = n_threads;
+	ipriv->n_recent = 0;
+	ipriv->recent = NULL;
+	ipriv->own_recent = NULL;
 
 	if ( cell != NULL ) {
 		ipriv->target_cell = cell_new_from_cell(cell);
@@ -431,6 +456,17 @@ IndexingPrivate *setup_indexing(const char *method_list,
 	}
 	for ( i=0; i<6; i++ ) ipriv->tolerance[i] = tols[i];
 
+	/* Everything about the target cell is worked out here, once, instead
+	 * of for every cell check */
+	ipriv->target_cmp = NULL;
+	if ( (cell != NULL) && (flags & INDEXING_CHECK_CELL) ) {
+		if ( !right_handed(cell) ) {
+			STATUS("WARNING: reference cell is left handed\n");
+		}
+		ipriv->target_cmp = cell_comparison_new(cell,
+		                                        ipriv->tolerance);
+	}
+
 	STATUS("List of indexing methods:\n");
 	for ( i=0; i<n; i++ ) {
 		char *str = indexer_str(methods[i]);
@@ -452,6 +488,113 @@ const IndexingMethod *indexing_methods(IndexingPrivate *p, int *n)
 }
 
 
+/**
+ * \param ipriv: An \ref IndexingPrivate
+ * \param n_attempts: Array to add the numbers of attempts to
+ * \param n_successes: Array to add the numbers of successful attempts to
+ * \param time_spent: Array to add the time spent, in seconds, to
+ *
+ * Adds the statistics for each indexing method since the last call to this
+ * function (or since \ref setup_indexing) to the arrays, and resets them.  The
+ * arrays must have one element for each method, in the same order as returned
+ * by \ref indexing_methods.  Any of the arrays can be NULL.
+ *
+ * Only patterns which are not indexed using recent orientations, and not
+ * raced (\ref INDEXING_RACE), are counted.
+ */
+void indexing_method_stats(IndexingPrivate *ipriv, int *n_attempts,
+                           int *n_successes, double *time_spent)
+{
+	int i;
+
+	for ( i=0; i<ipriv->n_methods; i++ ) {
+		if ( n_attempts != NULL ) n_attempts[i] += ipriv->n_attempts[i];
+		if ( n_successes != NULL ) n_successes[i] += ipriv->n_successes[i];
+		if ( time_spent != NULL ) time_spent[i] += ipriv->time_spent[i];
+		ipriv->n_attempts[i] = 0;
+		ipriv->n_successes[i] = 0;
+		ipriv->time_spent[i] = 0.0;
+	}
+}
+
+
+/**
+ * \param ipriv: An \ref IndexingPrivate
+ * \param order: The indexing methods, in the new order
+ *
+ * Changes the order in which the indexing methods are tried.  \p order must
+ * contain each of the methods returned by \ref indexing_methods exactly once.
+ *
+ * \returns zero on success, or non-zero if \p order isn't a rearrangement of
+ * the current methods.
+ */
+int indexing_set_method_order(IndexingPrivate *ipriv,
+                              const IndexingMethod *order)
+{
+	int i;
+	int n = ipriv->n_methods;
+	int *from;
+
+	from = cfmalloc(n*sizeof(int));
+	if ( from == NULL ) return 1;
+
+	for ( i=0; i<n; i++ ) {
+		int j;
+		from[i] = -1;
+		for ( j=0; j<n; j++ ) {
+			if ( ipriv->methods[j] == order[i] ) from[i] = j;
+		}
+		for ( j=0; j<i; j++ ) {
+			if ( from[j] == from[i] ) from[i] = -1;
+		}
+		if ( from[i] == -1 ) {
+			cffree(from);
+			return 1;
+		}
+	}
+
+	/* Rotate each cycle of the permutation in place */
+	for ( i=0; i<n; i++ ) {
+
+		IndexingMethod m;
+		void *priv;
+		int att, succ;
+		double t;
+		int j;
+
+		if ( from[i] == i ) continue;
+		if ( from[i] < 0 ) continue;  /* Already moved */
+
+		m = ipriv->methods[i];
+		priv = ipriv->engine_private[i];
+		att = ipriv->n_attempts[i];
+		succ = ipriv->n_successes[i];
+		t = ipriv->time_spent[i];
+
+		j = i;
+		while ( from[j] != i ) {
+			int k = from[j];
+			ipriv->methods[j] = ipriv->methods[k];
+			ipriv->engine_private[j] = ipriv->engine_private[k];
+			ipriv->n_attempts[j] = ipriv->n_attempts[k];
+			ipriv->n_successes[j] = ipriv->n_successes[k];
+			ipriv->time_spent[j] = ipriv->time_spent[k];
+			from[j] = -1;
+			j = k;
+		}
+		ipriv->methods[j] = m;
+		ipriv->engine_private[j] = priv;
+		ipriv->n_attempts[j] = att;
+		ipriv->n_successes[j] = succ;
+		ipriv->time_spent[j] = t;
+		from[j] = -1;
+	}
+
+	cffree(from);
+	return 0;
+}
+
+
 void cleanup_indexing(IndexingPrivate *ipriv)
 {
 	int n;
@@ -510,16 +653,113 @@ void cleanup_indexing(IndexingPrivate *ipriv)
 
 	}
 
+	if ( ipriv->own_recent != NULL ) {
+		pthread_mutex_destroy(&ipriv->own_recent->lock);
+		cffree(ipriv->own_recent);
+	}
+
 	cffree(ipriv->methods);
 	cffree(ipriv->engine_private);
+	cffree(ipriv->n_attempts);
+	cffree(ipriv->n_successes);
+	cffree(ipriv->time_spent);
 	cell_free(ipriv->target_cell);
+	cell_comparison_free(ipriv->target_cmp);
 	cffree(ipriv);
 }
 
 
+/**
+ * \param ro: A \ref recent_orientations structure
+ * \param shared: Non-zero if \p ro is in memory shared between processes
+ *
+ * Initialises \p ro to be empty.
+ *
+ * \returns zero on success.
+ */
+int recent_orientations_init(struct recent_orientations *ro, int shared)
+{
+	pthread_mutexattr_t attr;
+	int r;
+
+	if ( pthread_mutexattr_init(&attr) ) return 1;
+	if ( shared
+	  && pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) )
+	{
+		pthread_mutexattr_destroy(&attr);
+		return 1;
+	}
+	r = pthread_mutex_init(&ro->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if ( r ) return 1;
+
+	ro->n = 0;
+	ro->next = 0;
+	return 0;
+}
+
+
+/**
+ * \param ipriv: An \ref IndexingPrivate
+ * \param n: The number of recent orientations to try
+ * \param ro: Where to keep the orientations, or NULL
+ *
+ * Before running the indexing methods, try refining the orientations of the
+ * last \p n crystals to be indexed against the new peaks, and accept the
+ * first one which passes the usual checks.  This saves a lot of time if
+ * consecutive patterns come from the same crystal in nearly the same
+ * orientation.  The full indexing methods are only used if this fails.
+ *
+ * If \p ro is NULL, the orientations will be kept privately.  Otherwise, they
+ * will be kept in \p ro, which must have been initialised using
+ * \ref recent_orientations_init and which might be shared with other
+ * processes.  If \p n is zero, the recent orientations will not be used.
+ *
+ * \returns zero on success.
+ */
+int indexing_use_recent_orientations(IndexingPrivate *ipriv, int n,
+                                     struct recent_orientations *ro)
+{
+	if ( n > MAX_RECENT_ORIENTATIONS ) n = MAX_RECENT_ORIENTATIONS;
+	if ( n <= 0 ) {
+		ipriv->n_recent = 0;
+		ipriv->recent = NULL;
+		return 0;
+	}
+
+	if ( ro == NULL ) {
+		if ( ipriv->own_recent == NULL ) {
+			ipriv->own_recent = cfmalloc(sizeof(struct recent_orientations));
+			if ( ipriv->own_recent == NULL ) return 1;
+			if ( recent_orientations_init(ipriv->own_recent, 0) ) {
+				cffree(ipriv->own_recent);
+				ipriv->own_recent = NULL;
+				return 1;
+			}
+		}
+		ro = ipriv->own_recent;
+	}
+
+	ipriv->n_recent = n;
+	ipriv->recent = ro;
+	return 0;
+}
+
+
+/* Return non-zero if the cell parameters match the target directly */
+static int matches_target(IndexingPrivate *ipriv, UnitCell *cell)
+{
+	if ( ipriv->target_cmp != NULL ) {
+		return cell_comparison_check_parameters(ipriv->target_cmp, cell);
+	}
+	return compare_cell_parameters(cell, ipriv->target_cell,
+	                               ipriv->tolerance);
+}
+
+
 /* Return 0 for cell OK, 1 for cell incorrect */
 static int check_cell(IndexingFlags flags, Crystal *cr, UnitCell *target,
-                      double *tolerance)
+                      CellComparison *target_cmp, double *tolerance)
 {
 	UnitCell *out;
 	RationalMatrix *rm;
@@ -527,14 +767,16 @@ static int check_cell(IndexingFlags flags, Crystal *cr, UnitCell *target,
 	/* Check at all? */
 	if ( !(flags & INDEXING_CHECK_CELL) ) return 0;
 
-	if ( !right_handed(target) ) {
-		STATUS("WARNING: reference cell is left handed\n");
-	}
 	if ( !right_handed(crystal_get_cell(cr)) ) {
 		STATUS("WARNING: unmatched cell is left handed\n");
 	}
-	out = compare_reindexed_cell_parameters(crystal_get_cell(cr), target,
-	                                        tolerance, &rm);
+	if ( target_cmp != NULL ) {
+		out = cell_comparison_match(target_cmp, crystal_get_cell(cr),
+		                            &rm);
+	} else {
+		out = compare_reindexed_cell_parameters(crystal_get_cell(cr),
+		                                        target, tolerance, &rm);
+	}
 
 	if ( out != NULL ) {
 
@@ -673,7 +915,7 @@ static int try_indexer(struct image *image, IndexingMethod indm,
 		/* Pre-refinement unit cell check if requested */
 		profile_start("prerefine-cell-check");
 		r = check_cell(ipriv->flags, cr, ipriv->target_cell,
-		               ipriv->tolerance);
+		               ipriv->target_cmp, ipriv->tolerance);
 		profile_end("prerefine-cell-check");
 		if ( r ) {
 			crystal_set_user_flag(cr, 1);
@@ -696,8 +938,7 @@ static int try_indexer(struct image *image, IndexingMethod indm,
 		/* After refinement unit cell check if requested */
 		profile_start("postrefine-cell-check");
 		if ( (ipriv->flags & INDEXING_CHECK_CELL)
-		  && !compare_cell_parameters(crystal_get_cell(cr), ipriv->target_cell,
-		                              ipriv->tolerance) )
+		  && !matches_target(ipriv, crystal_get_cell(cr)) )
 		{
 			profile_end("postrefine-cell-check");
 			crystal_set_user_flag(cr, 1);
@@ -789,6 +1030,14 @@ static int delete_explained_peaks(struct image *image, Crystal *cr)
 	double dx, dy;
 	const double min_dist = 0.25;
 	int i, nspots = 0, nindexed = 0;
+	struct imagefeature_arrays pk;
+	char *remove;
+
+	if ( image_feature_list_arrays(image->features, &pk) ) return 1;
+	if ( pk.n == 0 ) return 1;
+
+	remove = cfmalloc(pk.n);
+	if ( remove == NULL ) return 1;
 
 	/* Round towards nearest */
 	fesetround(1);
@@ -800,21 +1049,18 @@ static int delete_explained_peaks(struct image *image, Crystal *cr)
 	crystal_get_det_shift(cr, &dx, &dy);
 
 	/* Loop over peaks, checking proximity to nearest reflection */
-	for ( i=0; i<image_feature_count(image->features); i++ ) {
+	for ( i=0; i<pk.n; i++ ) {
 
-		struct imagefeature *f;
 		double q[3];
 		double h, k, l, hd, kd, ld;
 		double dsq;
 
-		f = image_get_feature(image->features, i);
-		if ( f == NULL ) continue;
 		nspots++;
 
 		/* Reciprocal space position of found peak */
-		detgeom_transform_coords(&image->detgeom->panels[f->pn],
-		                         f->fs, f->ss, image->lambda, dx, dy,
-		                         q);
+		detgeom_transform_coords(&image->detgeom->panels[pk.pn[i]],
+		                         pk.fs[i], pk.ss[i], image->lambda,
+		                         dx, dy, q);
 
 		/* Decimal and fractional Miller indices of nearest
 		 * reciprocal lattice point */
@@ -828,12 +1074,14 @@ static int delete_explained_peaks(struct image *image, Crystal *cr)
 		/* Check distance */
 		dsq = pow(h-hd, 2.0) + pow(k-kd, 2.0) + pow(l-ld, 2.0);
 
-		if ( sqrt(dsq) < min_dist ) {
-			image_remove_feature(image->features, i);
-			nindexed++;
-		}
+		remove[i] = ( sqrt(dsq) < min_dist );
+		if ( remove[i] ) nindexed++;
 	}
 
+	/* The arrays aren't valid after this */
+	image_remove_features(image->features, remove);
+	cffree(remove);
+
 	/* Return TRUE if not enough peaks to continue */
 	return (nspots - nindexed) < 5;
 
@@ -880,6 +1128,356 @@ static int finished_retry(IndexingMethod indm, IndexingFlags flags,
 }
 
 
+/* Indexing methods racing against one another.  Each method runs in its own
+ * thread, on its own copy of the image structure which has its own peak list
+ * and crystals.  Everything else in the image is shared, read-only. */
+struct race_slot
+{
+	struct race *race;
+	int n;                  /* Index into ipriv->methods */
+	struct image image;
+	pthread_t thread;
+	int started;
+	int success;
+	int ntry;
+	pid_t child;            /* External indexing program, or zero */
+};
+
+
+struct race
+{
+	IndexingPrivate *ipriv;
+	pthread_mutex_t lock;
+	int cancelled;
+	int winner;             /* Index into slots, or -1 */
+	struct race_slot *slots;
+};
+
+
+/* Each racing thread knows its own slot */
+static pthread_key_t race_key;
+static pthread_once_t race_key_once = PTHREAD_ONCE_INIT;
+
+static void make_race_key(void)
+{
+	pthread_key_create(&race_key, NULL);
+}
+
+
+static struct race_slot *current_race_slot(void)
+{
+	pthread_once(&race_key_once, make_race_key);
+	return pthread_getspecific(race_key);
+}
+
+
+/**
+ * \returns non-zero if the current indexing attempt has been abandoned,
+ * because another indexing method has already succeeded.  Indexing engines
+ * which do a lot of work in-process should check this from time to time, and
+ * return zero crystals as soon as possible if it becomes true.
+ *
+ * Outside a race between indexing methods (see \ref INDEXING_RACE), this
+ * always returns zero.
+ */
+int indexing_cancelled(void)
+{
+	struct race_slot *slot = current_race_slot();
+	int c;
+
+	if ( slot == NULL ) return 0;
+
+	pthread_mutex_lock(&slot->race->lock);
+	c = slot->race->cancelled;
+	pthread_mutex_unlock(&slot->race->lock);
+	return c;
+}
+
+
+/**
+ * \param pid: Process ID of an external indexing program, or zero
+ *
+ * Indexing engines which run an external program should call this as soon as
+ * the program has been started, and again with \p pid = 0 after it has been
+ * reaped.  If the indexing attempt is abandoned (see \ref indexing_cancelled),
+ * the program will be killed, so that the engine sees it exit early.
+ */
+void indexing_set_child(pid_t pid)
+{
+	struct race_slot *slot = current_race_slot();
+
+	if ( slot == NULL ) return;
+
+	pthread_mutex_lock(&slot->race->lock);
+	slot->child = pid;
+	if ( (pid > 0) && slot->race->cancelled ) kill(pid, SIGKILL);
+	pthread_mutex_unlock(&slot->race->lock);
+}
+
+
+/* Must be called with race->lock held */
+static void cancel_race(struct race *race)
+{
+	int i;
+
+	race->cancelled = 1;
+	for ( i=0; i<race->ipriv->n_methods; i++ ) {
+		if ( race->slots[i].child > 0 ) {
+			kill(race->slots[i].child, SIGKILL);
+		}
+	}
+}
+
+
+static void *race_thread(void *vp)
+{
+	struct race_slot *slot = vp;
+	struct race *race = slot->race;
+	IndexingPrivate *ipriv = race->ipriv;
+	int done = 0;
+
+	pthread_once(&race_key_once, make_race_key);
+	pthread_setspecific(race_key, slot);
+
+	do {
+
+		int r;
+
+		r = try_indexer(&slot->image, ipriv->methods[slot->n],
+		                ipriv, ipriv->engine_private[slot->n],
+		                NULL, 0);
+		slot->success += r;
+		slot->ntry++;
+		done = finished_retry(ipriv->methods[slot->n], ipriv->flags,
+		                      r, &slot->image);
+		if ( slot->ntry > 5 ) done = 1;
+		if ( indexing_cancelled() ) done = 1;
+		notify_alive();
+
+	} while ( !done );
+
+	pthread_mutex_lock(&race->lock);
+	if ( slot->success && !race->cancelled ) {
+		race->winner = slot - race->slots;
+		cancel_race(race);
+	}
+	pthread_mutex_unlock(&race->lock);
+
+	pthread_setspecific(race_key, NULL);
+	return NULL;
+}
+
+
+static void race_indexers(struct image *image, IndexingPrivate *ipriv,
+                          ImageFeatureList *orig)
+{
+	struct race race;
+	int i;
+
+	race.ipriv = ipriv;
+	race.cancelled = 0;
+	race.winner = -1;
+	race.slots = cfmalloc(ipriv->n_methods*sizeof(struct race_slot));
+	if ( race.slots == NULL ) {
+		ERROR("Failed to allocate indexing race\n");
+		image->indexed_by = INDEXING_NONE;
+		return;
+	}
+	pthread_mutex_init(&race.lock, NULL);
+
+	for ( i=0; i<ipriv->n_methods; i++ ) {
+
+		struct race_slot *slot = &race.slots[i];
+
+		slot->race = &race;
+		slot->n = i;
+		slot->image = *image;
+		slot->image.features = sort_peaks(orig);
+		slot->image.crystals = NULL;
+		slot->image.n_crystals = 0;
+		slot->success = 0;
+		slot->ntry = 0;
+		slot->child = 0;
+
+		slot->started = (pthread_create(&slot->thread, NULL,
+		                                race_thread, slot) == 0);
+		if ( !slot->started ) {
+			ERROR("Failed to start indexing thread for method %i\n",
+			      i);
+		}
+
+	}
+
+	/* Join all the threads.  Cancelled external programs will already
+	 * have been killed, but in-process engines which don't check
+	 * indexing_cancelled() will run until they finish. */
+	for ( i=0; i<ipriv->n_methods; i++ ) {
+		if ( race.slots[i].started ) {
+			pthread_join(race.slots[i].thread, NULL);
+		}
+	}
+
+	for ( i=0; i<ipriv->n_methods; i++ ) {
+
+		struct race_slot *slot = &race.slots[i];
+
+		if ( i == race.winner ) {
+			image->crystals = slot->image.crystals;
+			image->n_crystals = slot->image.n_crystals;
+			image->n_indexing_tries = slot->ntry;
+		} else {
+			free_all_crystals(&slot->image);
+		}
+		image_feature_list_free(slot->image.features);
+
+	}
+
+	if ( race.winner >= 0 ) {
+		image->indexed_by = ipriv->methods[race.winner];
+	} else {
+		image->indexed_by = INDEXING_NONE;
+	}
+
+	pthread_mutex_destroy(&race.lock);
+	cffree(race.slots);
+}
+
+
+static void orientation_from_crystal(Crystal *cr, IndexingMethod indm,
+                                     struct recent_orientation *o)
+{
+	UnitCell *cell = crystal_get_cell(cr);
+
+	cell_get_reciprocal(cell, &o->recip[0], &o->recip[1], &o->recip[2],
+	                          &o->recip[3], &o->recip[4], &o->recip[5],
+	                          &o->recip[6], &o->recip[7], &o->recip[8]);
+	o->lattice_type = cell_get_lattice_type(cell);
+	o->centering = cell_get_centering(cell);
+	o->unique_axis = cell_get_unique_axis(cell);
+	o->indexed_by = indm;
+}
+
+
+static Crystal *crystal_from_orientation(struct recent_orientation *o)
+{
+	UnitCell *cell;
+	Crystal *cr;
+
+	cell = cell_new();
+	if ( cell == NULL ) return NULL;
+	cell_set_reciprocal(cell, o->recip[0], o->recip[1], o->recip[2],
+	                          o->recip[3], o->recip[4], o->recip[5],
+	                          o->recip[6], o->recip[7], o->recip[8]);
+	cell_set_lattice_type(cell, o->lattice_type);
+	cell_set_centering(cell, o->centering);
+	cell_set_unique_axis(cell, o->unique_axis);
+
+	cr = crystal_new();
+	if ( cr == NULL ) {
+		cell_free(cell);
+		return NULL;
+	}
+	crystal_set_cell(cr, cell);
+	crystal_set_profile_radius(cr, 0.02e9);
+	crystal_set_mosaicity(cr, 0.0);
+
+	return cr;
+}
+
+
+/* Add the crystals on the image to the list of recent orientations */
+static void remember_orientations(struct image *image, IndexingPrivate *ipriv)
+{
+	struct recent_orientations *ro = ipriv->recent;
+	int i;
+
+	for ( i=0; i<image->n_crystals; i++ ) {
+
+		struct recent_orientation o;
+
+		orientation_from_crystal(image->crystals[i].cr,
+		                         image->indexed_by, &o);
+
+		pthread_mutex_lock(&ro->lock);
+		ro->entries[ro->next] = o;
+		ro->next = (ro->next + 1) % MAX_RECENT_ORIENTATIONS;
+		if ( ro->n < MAX_RECENT_ORIENTATIONS ) ro->n++;
+		pthread_mutex_unlock(&ro->lock);
+
+	}
+}
+
+
+/* Try refining the most recent orientations against the peaks, newest first.
+ * Returns 1 (and adds a crystal to the image) if one of them fits. */
+static int try_recent_orientations(struct image *image,
+                                   IndexingPrivate *ipriv)
+{
+	struct recent_orientations *ro = ipriv->recent;
+	struct recent_orientation cands[MAX_RECENT_ORIENTATIONS];
+	int slots[MAX_RECENT_ORIENTATIONS];
+	int i, n;
+
+	/* Take a copy, so that the lock isn't held while refining */
+	pthread_mutex_lock(&ro->lock);
+	n = ro->n;
+	if ( n > ipriv->n_recent ) n = ipriv->n_recent;
+	for ( i=0; i<n; i++ ) {
+		int slot = ro->next - 1 - i;
+		if ( slot < 0 ) slot += MAX_RECENT_ORIENTATIONS;
+		slots[i] = slot;
+		cands[i] = ro->entries[slot];
+	}
+	pthread_mutex_unlock(&ro->lock);
+
+	for ( i=0; i<n; i++ ) {
+
+		Crystal *cr;
+
+		cr = crystal_from_orientation(&cands[i]);
+		if ( cr == NULL ) return 0;
+
+		profile_start("refine-recent");
+		if ( refine_prediction(image, cr, NULL, 0) ) {
+			profile_end("refine-recent");
+			crystal_free(cr);
+			continue;
+		}
+		profile_end("refine-recent");
+
+		if ( (ipriv->flags & INDEXING_CHECK_CELL)
+		  && !matches_target(ipriv, crystal_get_cell(cr)) )
+		{
+			crystal_free(cr);
+			continue;
+		}
+
+		/* A stale orientation can often be refined into something,
+		 * so the peak check is always done here */
+		if ( !indexing_peak_check(image, image->features, &cr, 1, 0) ) {
+			crystal_free(cr);
+			continue;
+		}
+
+		image_add_crystal(image, cr);
+		image->indexed_by = cands[i].indexed_by;
+		image->n_indexing_tries = 0;
+
+		/* Keep up with slow drift of the orientation, in place so
+		 * that a stationary crystal doesn't fill up the list */
+		pthread_mutex_lock(&ro->lock);
+		orientation_from_crystal(cr, cands[i].indexed_by,
+		                         &ro->entries[slots[i]]);
+		pthread_mutex_unlock(&ro->lock);
+
+		return 1;
+
+	}
+
+	return 0;
+}
+
+
 void index_pattern(struct image *image, IndexingPrivate *ipriv)
 {
 	index_pattern_4(image, ipriv, NULL, NULL, NULL, 0);
@@ -899,6 +1497,18 @@ void index_pattern_3(struct image *image, IndexingPrivate *ipriv, int *ping,
 }
 
 
+static double index_time()
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+#else
+	return time(NULL);
+#endif
+}
+
+
 void index_pattern_4(struct image *image, IndexingPrivate *ipriv, int *ping,
                      char *last_task, Mille *mille, int max_mille_level)
 {
@@ -938,6 +1548,29 @@ void index_pattern_4(struct image *image, IndexingPrivate *ipriv, int *ping,
 
 	orig = image->features;
 
+	/* Try the orientations of recently-indexed crystals first.  This
+	 * doesn't write any Millepede records, so it isn't used with them. */
+	if ( (ipriv->recent != NULL) && (mille == NULL)
+	  && (ipriv->methods[0] != INDEXING_FILE) )
+	{
+		set_last_task("indexing:recent");
+		if ( try_recent_orientations(image, ipriv) ) return;
+	}
+
+	/* Race the methods against each other, if requested.  Millepede
+	 * records can't be written from several threads, and a results file
+	 * doesn't need to be raced. */
+	if ( (ipriv->flags & INDEXING_RACE) && (ipriv->n_methods > 1)
+	  && (mille == NULL) && (ipriv->methods[0] != INDEXING_FILE) )
+	{
+		race_indexers(image, ipriv, orig);
+		image->features = orig;
+		if ( ipriv->recent != NULL ) {
+			remember_orientations(image, ipriv);
+		}
+		return;
+	}
+
 	for ( n=0; n<ipriv->n_methods; n++ ) {
 
 		int done = 0;
@@ -951,10 +1584,15 @@ void index_pattern_4(struct image *image, IndexingPrivate *ipriv, int *ping,
 		do {
 
 			int r;
+			double t;
 
+			t = index_time();
 			r = try_indexer(image, ipriv->methods[n],
 			                ipriv, ipriv->engine_private[n],
 			                mille, max_mille_level);
+			ipriv->time_spent[n] += index_time() - t;
+			ipriv->n_attempts[n]++;
+			if ( r ) ipriv->n_successes[n]++;
 			success += r;
 			ntry++;
 			done = finished_retry(ipriv->methods[n], ipriv->flags,
@@ -984,6 +1622,8 @@ void index_pattern_4(struct image *image, IndexingPrivate *ipriv, int *ping,
 	}
 
 	image->features = orig;
+
+	if ( ipriv->recent != NULL ) remember_orientations(image, ipriv);
 }
 
 
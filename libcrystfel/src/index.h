@@ -123,6 +123,14 @@ typedef enum {
 	/** Check that the unit cell agrees with the target cell */
 	INDEXING_CHECK_CELL = 64,
 
+	/** Run all the indexing methods at the same time, and take the first
+	 * one to succeed */
+	INDEXING_RACE = 128,
+
+	/** Keep external indexing programs running between patterns, where
+	 * possible, instead of starting them afresh for each one */
+	INDEXING_PERSISTENT = 256,
+
 } IndexingFlags;
 
 
@@ -132,6 +140,7 @@ typedef enum {
 
 struct asdf_options {
 	int fast_execution;
+	char *wisdom_dir;  /* For caching FFTW wisdom, or NULL */
 };
 
 
@@ -164,6 +173,7 @@ struct taketwo_options
 	double len_tol;
 	double angle_tol;
 	double trace_tol;
+	int skip_unmatched;
 };
 
 
@@ -188,6 +198,9 @@ struct felix_options
 };
 
 
+#include <sys/types.h>
+#include <pthread.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -212,6 +225,30 @@ extern char *base_indexer_str(IndexingMethod indm);
 #include "datatemplate.h"
 #include "predict-refine.h"
 
+/* Maximum number of entries in a struct recent_orientations */
+#define MAX_RECENT_ORIENTATIONS (64)
+
+struct recent_orientation
+{
+	double recip[9];  /* a*, b*, c* in Cartesian coordinates */
+	LatticeType lattice_type;
+	char centering;
+	char unique_axis;
+	IndexingMethod indexed_by;
+};
+
+/**
+ * Ring buffer of the orientations of recently indexed crystals.  It contains
+ * no pointers, so it can be placed in memory shared between processes.
+ **/
+struct recent_orientations
+{
+	pthread_mutex_t lock;
+	int n;     /* Number of valid entries */
+	int next;  /* Entry to be overwritten next */
+	struct recent_orientation entries[MAX_RECENT_ORIENTATIONS];
+};
+
 extern struct argp felix_argp;
 extern struct argp pinkIndexer_argp;
 extern struct argp taketwo_argp;
@@ -242,6 +279,12 @@ extern IndexingPrivate *setup_indexing(const char *methods,
 
 extern const IndexingMethod *indexing_methods(IndexingPrivate *p, int *n);
 
+extern void indexing_method_stats(IndexingPrivate *ipriv, int *n_attempts,
+                                  int *n_successes, double *time_spent);
+
+extern int indexing_set_method_order(IndexingPrivate *ipriv,
+                                     const IndexingMethod *order);
+
 extern char *detect_indexing_methods(UnitCell *cell);
 
 extern void index_pattern(struct image *image, IndexingPrivate *ipriv);
@@ -261,6 +304,20 @@ extern void index_pattern_5(struct image *image, IndexingPrivate *ipriv,
 
 extern void cleanup_indexing(IndexingPrivate *ipriv);
 
+extern int recent_orientations_init(struct recent_orientations *ro,
+                                    int shared);
+extern int indexing_use_recent_orientations(IndexingPrivate *ipriv, int n,
+                                            struct recent_orientations *ro);
+
+/* For use by indexing engines, to allow their work to be abandoned */
+extern int indexing_cancelled(void);
+extern void indexing_set_child(pid_t pid);
+
+/* Binary solution index for 'fromfile' indexing */
+extern int fromfile_is_index(const char *filename);
+extern int fromfile_write_index(const char *sol_filename,
+                                const char *index_filename);
+
 #ifdef __cplusplus
 }
 #endif
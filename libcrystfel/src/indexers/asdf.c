@@ -34,6 +34,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <unistd.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_blas.h>
@@ -64,11 +65,15 @@
 
 #include <fftw3.h>
 
+/* Number of directions for which the FFTs are done together */
+#define ASDF_FFT_BATCH (16)
+
 struct fftw_vars {
 	int N;
+	int howmany;
 	fftw_plan p;
-	double *in;
-	fftw_complex *out;
+	double *in;          /* howmany rows of N */
+	fftw_complex *out;   /* howmany rows of N/2+1 */
 };
 
 
@@ -88,15 +93,70 @@ struct tvector {
 };
 
 
-struct fftw_vars fftw_vars_new()
+/* Name of the file for caching FFTW wisdom, or NULL if there isn't one */
+static char *wisdom_filename(const char *wisdom_dir, int N, int howmany)
+{
+	size_t len;
+	char *fn;
+
+	if ( wisdom_dir == NULL ) return NULL;
+
+	len = strlen(wisdom_dir)+64;
+	fn = cfmalloc(len);
+	if ( fn == NULL ) return NULL;
+	snprintf(fn, len, "%s/asdf-wisdom-%i-%i", wisdom_dir, N, howmany);
+	return fn;
+}
+
+
+static void save_wisdom(const char *fn)
+{
+	size_t len;
+	char *tmp;
+
+	/* Other worker processes might be reading or writing the same file,
+	 * so write it somewhere else and move it into place */
+	len = strlen(fn)+32;
+	tmp = cfmalloc(len);
+	if ( tmp == NULL ) return;
+	snprintf(tmp, len, "%s.%i", fn, getpid());
+
+	if ( fftw_export_wisdom_to_filename(tmp) ) {
+		if ( rename(tmp, fn) ) {
+			ERROR("Failed to save FFTW wisdom to %s\n", fn);
+			remove(tmp);
+		}
+	} else {
+		ERROR("Failed to write FFTW wisdom to %s\n", tmp);
+	}
+	cffree(tmp);
+}
+
+
+struct fftw_vars fftw_vars_new(const char *wisdom_dir)
 {
 	struct fftw_vars fftw;
 	int N = 1024;
+	int howmany = ASDF_FFT_BATCH;
+	char *wisdom_fn;
+	int have_wisdom = 0;
+
+	wisdom_fn = wisdom_filename(wisdom_dir, N, howmany);
+	if ( wisdom_fn != NULL ) {
+		have_wisdom = fftw_import_wisdom_from_filename(wisdom_fn);
+	}
 
 	fftw.N = N;
-	fftw.in = fftw_alloc_real(N);
-	fftw.out = fftw_alloc_complex(N);
-	fftw.p = fftw_plan_dft_r2c_1d(N, fftw.in, fftw.out, FFTW_MEASURE);
+	fftw.howmany = howmany;
+	fftw.in = fftw_alloc_real(N*howmany);
+	fftw.out = fftw_alloc_complex((N/2+1)*howmany);
+	fftw.p = fftw_plan_many_dft_r2c(1, &N, howmany,
+	                                fftw.in, NULL, 1, N,
+	                                fftw.out, NULL, 1, N/2+1,
+	                                FFTW_MEASURE);
+
+	if ( (wisdom_fn != NULL) && !have_wisdom ) save_wisdom(wisdom_fn);
+	cffree(wisdom_fn);
 
 	return fftw;
 }
@@ -377,39 +437,45 @@ static int calc_normal(gsl_vector *c1, gsl_vector *c2, gsl_vector *c3,
 }
 
 
-static float find_ds_fft(double *projections, int N_projections, double d_max,
-                         struct fftw_vars fftw)
+/* Puts the histogram of the projections into one row of FFT input.
+ * Returns the range of the projections, or -1 on error. */
+static double fill_fft_input(double *projections, int n, double *in, int N)
 {
-	int n = N_projections;
-	double projections_sorted[n];
-	memcpy(projections_sorted, projections, sizeof(double) * n);
-	qsort(projections_sorted, n, sizeof(double), compare_doubles);
-
+	double pmin, pmax;
 	int i;
 
-	int N = fftw.N; // number of points in fft calculation
+	pmin = projections[0];
+	pmax = projections[0];
+	for ( i=1; i<n; i++ ) {
+		if ( projections[i] < pmin ) pmin = projections[i];
+		if ( projections[i] > pmax ) pmax = projections[i];
+	}
 
 	for ( i=0; i<N; i++ ) {
-		fftw.in[i] = 0;
+		in[i] = 0;
 	}
 
 	for ( i=0; i<n; i++ ) {
 		int k;
-		k = (int)((projections_sorted[i] - projections_sorted[0]) /
-		          (projections_sorted[n - 1] - projections_sorted[0]) *
-		          (N - 1));
+		k = (int)((projections[i] - pmin) / (pmax - pmin) * (N - 1));
 		if ( (k>=N) || (k<0) ) {
-			ERROR("Bad k value in find_ds_fft() (k=%i, N=%i)\n",
+			ERROR("Bad k value in fill_fft_input() (k=%i, N=%i)\n",
 			      k, N);
 			return -1.0;
 		}
-		fftw.in[k]++;
+		in[k]++;
 	}
 
-	fftw_execute(fftw.p);
+	return pmax - pmin;
+}
+
 
-	int i_max = (int)(d_max * (projections_sorted[n - 1] -
-	                           projections_sorted[0]));
+/* Finds ds from one row of FFT output, given the range of the projections */
+static float find_ds_fft(fftw_complex *out, int N, double range,
+                         double d_max)
+{
+	int i;
+	int i_max = (int)(d_max * range);
 
 	if ( i_max > N / 2 ) i_max = N / 2;
 
@@ -417,14 +483,14 @@ static float find_ds_fft(double *projections, int N_projections, double d_max,
 	double maxval = 0;
 	for ( i=1; i<=i_max; i++ ) {
 		double a;
-		a = sqrt(fftw.out[i][0] * fftw.out[i][0] + fftw.out[i][1] * fftw.out[i][1]);
+		a = sqrt(out[i][0] * out[i][0] + out[i][1] * out[i][1]);
 		if (a > maxval) {
 			maxval = a;
 			d = i;
 		}
 	}
 
-	double ds = (projections_sorted[n - 1] - projections_sorted[0]) / d;
+	double ds = range / d;
 
 	return ds;
 }
@@ -1005,6 +1071,7 @@ static int index_refls(gsl_vector **reflections, int N_reflections, int N_refl_m
 {
 
 	int i, k, n;
+	int i0, b;
 
 	int N_triplets;
 	int **triplets;
@@ -1035,15 +1102,24 @@ static int index_refls(gsl_vector **reflections, int N_reflections, int N_refl_m
 
 	if ( N_triplets == 0 ) return 0;
 
-	gsl_vector *normal = gsl_vector_alloc(3);
-
-	double projections[N_refl_max];
+	int howmany = fftw.howmany;
+	int N = fftw.N;
+	gsl_vector *normals[howmany];
+	int normal_ok[howmany];
+	double range[howmany];
+	double *projections;
 	double ds;
 
+	for ( b = 0; b < howmany; b++ ) normals[b] = gsl_vector_alloc(3);
+
+	projections = cfmalloc(howmany * N_refl_max * sizeof(double));
 	int *fits = cfmalloc(N_refl_max * sizeof(int));
-	if ( fits == NULL ) {
+	if ( (fits == NULL) || (projections == NULL) ) {
 		ERROR("Failed to allocate fits in index_refls!\n");
 		if ( N_reflections > N_refl_max ) cffree(refl_sample);
+		for ( b = 0; b < howmany; b++ ) gsl_vector_free(normals[b]);
+		cffree(fits);
+		cffree(projections);
 		return 0;
 	}
 
@@ -1051,74 +1127,110 @@ static int index_refls(gsl_vector **reflections, int N_reflections, int N_refl_m
 	if ( tvectors == NULL ) {
 		ERROR("Failed to allocate tvectors in index_refls!\n");
 		if ( N_reflections > N_refl_max ) cffree(refl_sample);
+		for ( b = 0; b < howmany; b++ ) gsl_vector_free(normals[b]);
 		cffree(fits);
+		cffree(projections);
 		return 0;
 	}
 
 	int N_tvectors = 0;
+	int finished = 0;
 
 	int n_max = 0; // maximum number of reflections fitting one of tvectors
 	profile_start("asdf-search");
-	for ( i = 0; i < N_triplets; i++ ) {
-		if ( calc_normal(refl_sample[triplets[i][0]],
-				 refl_sample[triplets[i][1]],
-				 refl_sample[triplets[i][2]],
-				 normal) )
-		{
+	for ( i0 = 0; (i0 < N_triplets) && !finished; i0 += howmany ) {
+
+		int nb = howmany;
+		if ( i0 + nb > N_triplets ) nb = N_triplets - i0;
+
+		/* Calculate projections of reflections to the normals of a
+		 * batch of triplets, and the FFTs of all of them together */
+		for ( b = 0; b < nb; b++ ) {
+
+			double *proj = &projections[b*N_refl_max];
+
+			i = i0 + b;
+			normal_ok[b] = calc_normal(refl_sample[triplets[i][0]],
+			                           refl_sample[triplets[i][1]],
+			                           refl_sample[triplets[i][2]],
+			                           normals[b]);
+			if ( !normal_ok[b] ) continue;
 
-			/* Calculate projections of reflections to normal */
 			for ( k = 0; k < N_refl_max; k++ ) {
-				gsl_blas_ddot(normal, refl_sample[k], &projections[k]);
+				gsl_blas_ddot(normals[b], refl_sample[k], &proj[k]);
 			}
 
-			/* Find ds - period in 1d lattice of projections */
-			ds = find_ds_fft(projections, N_refl_max, d_max, fftw);
-			if ( ds < 0.0 ) {
-				ERROR("find_ds_fft() failed.\n");
-				continue;
-			}
+			range[b] = fill_fft_input(proj, N_refl_max,
+			                          &fftw.in[b*N], N);
+		}
+		fftw_execute(fftw.p);
+
+		for ( b = 0; b < nb; b++ ) {
 
-			/* Refine ds, write 1 to fits[i] if reflections[i]
-			 * fits ds */
-			ds = refine_ds(projections, N_refl_max, ds, LevelFit, fits);
+			double *proj = &projections[b*N_refl_max];
+			gsl_vector *normal = normals[b];
 
-			/* n - number of reflections fitting ds */
-			n = check_refl_fitting_ds(projections, N_refl_max, ds, LevelFit);
+			i = i0 + b;
 
-			/* normal/ds - possible direct vector */
-			gsl_vector_scale(normal, 1/ds);
+			if ( normal_ok[b] ) {
 
-			if ( n > N_refl_max / 3 && n > 6 ) {
+				/* Find ds - period in 1d lattice of projections */
+				if ( range[b] < 0.0 ) {
+					ERROR("find_ds_fft() failed.\n");
+					continue;
+				}
+				ds = find_ds_fft(&fftw.out[b*(N/2+1)], N,
+				                 range[b], d_max);
 
-				tvectors[N_tvectors] = tvector_new(N_refl_max);
+				/* Refine ds, write 1 to fits[i] if reflections[i]
+				 * fits ds */
+				ds = refine_ds(proj, N_refl_max, ds, LevelFit, fits);
 
-				gsl_vector_memcpy(tvectors[N_tvectors].t, normal);
-				memcpy(tvectors[N_tvectors].fits, fits,
-				       N_refl_max * sizeof(int));
+				/* n - number of reflections fitting ds */
+				n = check_refl_fitting_ds(proj, N_refl_max, ds, LevelFit);
 
-				tvectors[N_tvectors].n = n;
+				/* normal/ds - possible direct vector */
+				gsl_vector_scale(normal, 1/ds);
 
-				N_tvectors++;
+				if ( n > N_refl_max / 3 && n > 6 ) {
 
-				if (n > n_max) n_max = n;
+					tvectors[N_tvectors] = tvector_new(N_refl_max);
+
+					gsl_vector_memcpy(tvectors[N_tvectors].t, normal);
+					memcpy(tvectors[N_tvectors].fits, fits,
+					       N_refl_max * sizeof(int));
+
+					tvectors[N_tvectors].n = n;
+
+					N_tvectors++;
+
+					if (n > n_max) n_max = n;
+				}
 			}
-		}
 
-		if ( (i != 0 && i % (N_triplets_max/2) == 0) || i == N_triplets - 1 ) {
-			/* Sort tvectors by length */
-			qsort(tvectors, N_tvectors, sizeof(struct tvector),
-			      compare_tvectors);
-
-			/* Three shortest independent tvectors with t.n > acl
-			 * determine the final cell. acl is selected for the
-			 * solution with the maximum number of fitting
-			 * reflections */
-			profile_start("asdf-findcell");
-			find_cell(tvectors, N_tvectors, IndexFit, volume_min,
-				  volume_max, n_max, refl_sample, N_refl_max, c);
-			profile_end("asdf-findcell");
-
-			if ( c->n > 4 * n_max / 5 ) {
+			if ( (i != 0 && i % (N_triplets_max/2) == 0) || i == N_triplets - 1 ) {
+				/* Sort tvectors by length */
+				qsort(tvectors, N_tvectors, sizeof(struct tvector),
+				      compare_tvectors);
+
+				/* Three shortest independent tvectors with t.n > acl
+				 * determine the final cell. acl is selected for the
+				 * solution with the maximum number of fitting
+				 * reflections */
+				profile_start("asdf-findcell");
+				find_cell(tvectors, N_tvectors, IndexFit, volume_min,
+					  volume_max, n_max, refl_sample, N_refl_max, c);
+				profile_end("asdf-findcell");
+
+				if ( c->n > 4 * n_max / 5 ) {
+					finished = 1;
+					break;
+				}
+			}
+
+			/* Another indexing method got there first */
+			if ( indexing_cancelled() ) {
+				finished = 1;
 				break;
 			}
 		}
@@ -1136,7 +1248,8 @@ static int index_refls(gsl_vector **reflections, int N_reflections, int N_refl_m
 	}
 	cffree(triplets);
 
-	gsl_vector_free(normal);
+	for ( b = 0; b < howmany; b++ ) gsl_vector_free(normals[b]);
+	cffree(projections);
 	if ( N_reflections > N_refl_max ) cffree(refl_sample);
 
 	if ( c->n ) return 1;
@@ -1279,7 +1392,7 @@ void *asdf_prepare(IndexingMethod *indm, UnitCell *cell, struct asdf_options *as
 	dp->template = cell;
 	dp->indm = *indm;
 	dp->fast_execution = asdf_opts->fast_execution;
-	dp->fftw = fftw_vars_new();
+	dp->fftw = fftw_vars_new(asdf_opts->wisdom_dir);
 
 	return (void *)dp;
 }
@@ -1335,6 +1448,9 @@ static void asdf_show_help()
 "                           Speed up execution by limiting maximum number of peaks\n"
 "                            used for indexing and the number of unit cell search\n"
 "                            iterations\n"
+"     --asdf-wisdom=dir\n"
+"                           Keep FFTW wisdom in this folder, so that the FFTs\n"
+"                            don't have to be measured again next time\n"
 );
 }
 
@@ -1347,6 +1463,7 @@ int asdf_default_options(struct asdf_options **opts_ptr)
 	if ( opts == NULL ) return ENOMEM;
 
 	opts->fast_execution = 0;
+	opts->wisdom_dir = NULL;
 
 	*opts_ptr = opts;
 	return 0;
@@ -1374,6 +1491,11 @@ static error_t asdf_parse_arg(int key, char *arg,
 		(*opts_ptr)->fast_execution = 1;
 		break;
 
+		case 3 :
+		cffree((*opts_ptr)->wisdom_dir);
+		(*opts_ptr)->wisdom_dir = cfstrdup(arg);
+		break;
+
 	}
 
 	return 0;
@@ -1386,6 +1508,7 @@ static struct argp_option asdf_options[] = {
 	 "Show options for asdf indexing algorithm", 99},
 
 	{"asdf-fast", 2, NULL, OPTION_HIDDEN, NULL},
+	{"asdf-wisdom", 3, "dir", OPTION_HIDDEN, NULL},
 
 	{0}
 };
@@ -38,6 +38,7 @@
 #include <assert.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <signal.h>
 
 #ifdef HAVE_FORKPTY_PTY_H
 #include <pty.h>
@@ -59,6 +60,10 @@
 
 #define MAX_DIRAX_CELL_CANDIDATES (5)
 
+/* The first step of dirax_send_next() which depends on the pattern.  A
+ * persistent DirAx session starts each new pattern at this step. */
+#define DIRAX_FIRST_PATTERN_STEP (2)
+
 
 typedef enum {
 	DIRAX_INPUT_NONE,
@@ -71,6 +76,10 @@ typedef enum {
 struct dirax_private {
 	IndexingMethod          indm;
 	UnitCell                *template;
+	int                     persistent;
+
+	/* DirAx process kept between patterns, if persistent */
+	struct dirax_data       *session;
 };
 
 
@@ -93,6 +102,7 @@ struct dirax_data {
 	int                     n_acls_tried;
 	int                     done;
 	int                     success;
+	int                     idle;    /* Waiting at prompt for next pattern */
 
 	float                   ax;
 	float                   ay;
@@ -265,6 +275,18 @@ static void dirax_sendline(const char *line, struct dirax_data *dirax)
 }
 
 
+/* Finish with this pattern */
+static void dirax_end(struct dirax_data *dirax)
+{
+	if ( dirax->dp->persistent ) {
+		/* Leave DirAx at the prompt, ready for the next pattern */
+		dirax->idle = 1;
+	} else {
+		dirax_sendline("exit\n", dirax);
+	}
+}
+
+
 static void dirax_send_next(struct image *image, struct dirax_data *dirax)
 {
 	char tmp[32];
@@ -307,6 +329,11 @@ static void dirax_send_next(struct image *image, struct dirax_data *dirax)
 			 * and waiting for a single number.  Use an extra
 			 * newline to choose automatic ACL selection before
 			 * exiting. */
+			if ( dirax->dp->persistent ) {
+				dirax_sendline("\n", dirax);
+				dirax->step = 11;  /* Finish at the next prompt */
+				return;
+			}
 			dirax_sendline("\nexit\n", dirax);
 			break;
 		}
@@ -320,8 +347,9 @@ static void dirax_send_next(struct image *image, struct dirax_data *dirax)
 		break;
 
 		case 10 :
-		if ( dirax->n_acls_tried == MAX_DIRAX_CELL_CANDIDATES ) {
-			dirax_sendline("exit\n", dirax);
+		if ( dirax->success
+		  || (dirax->n_acls_tried == MAX_DIRAX_CELL_CANDIDATES) ) {
+			dirax_end(dirax);
 		} else {
 			/* Go back round for another cell */
 			dirax->best_acl_nh = 0;
@@ -331,7 +359,7 @@ static void dirax_send_next(struct image *image, struct dirax_data *dirax)
 		break;
 
 		default:
-		dirax_sendline("exit\n", dirax);
+		dirax_end(dirax);
 		return;
 
 	}
@@ -501,25 +529,22 @@ static void write_drx(struct image *image)
 }
 
 
-int run_dirax(struct image *image, void *ipriv)
+static struct dirax_data *start_dirax(struct dirax_private *dp)
 {
 	unsigned int opts;
-	int status;
-	int rval;
 	struct dirax_data *dirax;
 
-	write_drx(image);
-
 	dirax = cfmalloc(sizeof(struct dirax_data));
 	if ( dirax == NULL ) {
 		ERROR("Couldn't allocate memory for DirAx data.\n");
-		return 0;
+		return NULL;
 	}
 
 	dirax->pid = forkpty(&dirax->pty, NULL, NULL, NULL);
 	if ( dirax->pid == -1 ) {
 		ERROR("Failed to fork for DirAx: %s\n", strerror(errno));
-		return 0;
+		cffree(dirax);
+		return NULL;
 	}
 	if ( dirax->pid == 0 ) {
 
@@ -546,14 +571,57 @@ int run_dirax(struct image *image, void *ipriv)
 	fcntl(dirax->pty, F_SETFL, opts | O_NONBLOCK);
 
 	dirax->step = 1;	/* This starts the "initialisation" procedure */
+	dirax->dp = dp;
+
+	return dirax;
+}
+
+
+static void stop_dirax(struct dirax_data *dirax, int force)
+{
+	int status;
+
+	/* A persistent DirAx which stopped responding won't exit by itself */
+	if ( force ) kill(dirax->pid, SIGKILL);
+
+	close(dirax->pty);
+	cffree(dirax->rbuffer);
+	waitpid(dirax->pid, &status, 0);
+}
+
+
+int run_dirax(struct image *image, void *ipriv)
+{
+	struct dirax_private *dp = (struct dirax_private *)ipriv;
+	int rval;
+	struct dirax_data *dirax;
+
+	write_drx(image);
+
+	if ( dp->session != NULL ) {
+		dirax = dp->session;
+		dp->session = NULL;
+		dirax->step = DIRAX_FIRST_PATTERN_STEP;
+	} else {
+		dirax = start_dirax(dp);
+		if ( dirax == NULL ) return 0;
+	}
+	indexing_set_child(dirax->pid);
+
 	dirax->finished_ok = 0;
 	dirax->read_cell = 0;
 	dirax->n_acls_tried = 0;
 	dirax->best_acl_nh = 0;
 	dirax->done = 0;
 	dirax->success = 0;
-	dirax->dp = (struct dirax_private *)ipriv;
+	dirax->idle = 0;
+
+	/* A persistent DirAx has already shown its prompt */
+	if ( dirax->step == DIRAX_FIRST_PATTERN_STEP ) {
+		dirax_send_next(image, dirax);
+	}
 
+	rval = 0;
 	do {
 
 		fd_set fds;
@@ -591,23 +659,32 @@ int run_dirax(struct image *image, void *ipriv)
 			rval = 1;
 		}
 
-	} while ( !rval && !dirax->success );
+		/* A persistent DirAx has to be brought back to the prompt
+		 * even after success */
+		if ( dirax->success && !dp->persistent ) break;
 
-	close(dirax->pty);
-	cffree(dirax->rbuffer);
-	waitpid(dirax->pid, &status, 0);
+	} while ( !rval && !dirax->idle );
+
+	/* Keep DirAx for the next pattern if it's still behaving.  If not,
+	 * a new one will be started next time. */
+	if ( dirax->idle ) {
+		dp->session = dirax;
+	} else {
+		stop_dirax(dirax, dp->persistent);
+	}
+	indexing_set_child(0);
 
 	if ( dirax->finished_ok == 0 ) {
 		ERROR("DirAx doesn't seem to be working properly.\n");
 	}
 
 	rval = dirax->success;
-	cffree(dirax);
+	if ( dp->session == NULL ) cffree(dirax);
 	return rval;
 }
 
 
-void *dirax_prepare(IndexingMethod *indm, UnitCell *cell)
+void *dirax_prepare(IndexingMethod *indm, UnitCell *cell, int persistent)
 {
 	struct dirax_private *dp;
 
@@ -625,6 +702,8 @@ void *dirax_prepare(IndexingMethod *indm, UnitCell *cell)
 
 	dp->template = cell;
 	dp->indm = *indm;
+	dp->persistent = persistent;
+	dp->session = NULL;
 
 	return (IndexingPrivate *)dp;
 }
@@ -634,6 +713,11 @@ void dirax_cleanup(void *pp)
 {
 	struct dirax_private *p;
 	p = (struct dirax_private *)pp;
+	if ( p->session != NULL ) {
+		dirax_sendline("exit\n", p->session);
+		stop_dirax(p->session, 0);
+		cffree(p->session);
+	}
 	cffree(p);
 }
 
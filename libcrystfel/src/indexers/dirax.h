@@ -40,7 +40,8 @@ extern "C" {
  */
 extern int run_dirax(struct image *image, void *ipriv);
 
-extern void *dirax_prepare(IndexingMethod *indm, UnitCell *cell);
+extern void *dirax_prepare(IndexingMethod *indm, UnitCell *cell,
+                           int persistent);
 extern const char *dirax_probe(UnitCell *cell);
 
 extern void dirax_cleanup(void *pp);
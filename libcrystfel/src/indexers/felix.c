@@ -482,6 +482,7 @@ int felix_index(struct image *image, IndexingPrivate *ipriv)
 		_exit(0);
 
 	}
+	indexing_set_child(felix->pid);
 
 	cffree(ini_filename);
 
@@ -536,6 +537,7 @@ int felix_index(struct image *image, IndexingPrivate *ipriv)
 	close(felix->pty);
 	cffree(felix->rbuffer);
 	waitpid(felix->pid, &status, 0);
+	indexing_set_child(0);
 
 	if ( status != 0 ) {
 		ERROR("Felix either timed out, or is not working properly.\n");
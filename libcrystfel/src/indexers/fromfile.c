@@ -39,6 +39,10 @@
 #include <fenv.h>
 #include <unistd.h>
 #include <argp.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "image.h"
 #include "uthash.h"
@@ -65,9 +69,59 @@ struct fromfile_entry
 };
 
 
+/* The binary solution index (see fromfile_write_index()) consists of the
+ * header, the events sorted by filename then event ID, the crystals (in
+ * groups, one group per event) and finally the strings for the keys. */
+#define FROMFILE_INDEX_MAGIC "CFSOLIX1"
+
+struct fromfile_index_header
+{
+	char magic[8];
+	uint64_t n_events;
+	uint64_t n_crystals;
+	uint64_t strings_size;
+};
+
+
+struct fromfile_index_event
+{
+	uint64_t key;            /* Offset of "filename\0event\0" in strings */
+	uint32_t first_crystal;
+	uint32_t n_crystals;
+};
+
+
+struct fromfile_index_crystal
+{
+	float vals[11];          /* As in the text file */
+	char lattice[4];         /* Not necessarily terminated */
+};
+
+
 struct fromfile_private
 {
 	struct fromfile_entry *sol_hash;
+
+	/* If using a binary index, the mapping of the file */
+	void *map;
+	size_t map_size;
+	uint64_t n_events;
+	uint64_t n_index_crystals;
+	uint64_t strings_size;
+	const struct fromfile_index_event *events;
+	const struct fromfile_index_crystal *crystals;
+	const char *strings;
+};
+
+
+struct solution_line
+{
+	char *filename;   /* Points into the line */
+	char *event;      /* These point into bits */
+	char *lattice;
+	float vals[11];
+	char **bits;
+	int n_bits;
 };
 
 
@@ -183,28 +237,185 @@ static int set_lattice(UnitCell *cell, const char *ltsym)
 }
 
 
-void *fromfile_prepare(IndexingMethod *indm, struct fromfile_options *opts)
+static void free_solution_line(struct solution_line *sl)
 {
-	FILE *fh;
-	struct fromfile_private *dp;
+	int i;
+	for ( i=0; i<sl->n_bits; i++ ) cffree(sl->bits[i]);
+	cffree(sl->bits);
+	sl->bits = NULL;
+	sl->n_bits = 0;
+}
 
-	if ( opts->filename == NULL ) {
-		ERROR("Please try again with --fromfile-input-file\n");
+
+/* Splits a line of the solution file into its parts, in place */
+static int parse_solution_line(char *line, struct solution_line *sl)
+{
+	int i;
+	size_t len;
+	int n_sp;
+
+	chomp(line);
+	notrail(line);
+
+	len = strlen(line);
+	n_sp = 0;
+	for ( i=len-1; i>0; i-- ) {
+		if ( line[i] == ' ' ) {
+			n_sp++;
+			if ( n_sp == 13 ) {
+				line[i] = '\0';
+				break;
+			}
+		}
+	}
+
+	sl->n_bits = assplode(line+i+1, " \t,", &sl->bits, ASSPLODE_NONE);
+	if ( sl->n_bits < 13 ) {
+		ERROR("Badly formatted line '%s'\n", line);
+		free_solution_line(sl);
+		return 1;
+	}
+
+	/* filename, event, asx, asy, asz, bsx, bsy, bsz, csx, csy, csz,
+	 * det_shift_x, det_shift_y, latticetype+centering */
+	for ( i=1; i<12; i++ ) {
+		if (sscanf(sl->bits[i], "%f", &sl->vals[i-1]) != 1)
+		{
+			ERROR("Invalid value for number %i\n", i);
+			free_solution_line(sl);
+			return 1;
+		}
+	}
+
+	sl->filename = line;
+	sl->event = sl->bits[0];
+	sl->lattice = sl->bits[12];
+	return 0;
+}
+
+
+/* vals[] are the reciprocal axes in nm^-1 and the detector shift in mm, as in
+ * the solution file */
+static Crystal *make_crystal(const float *vals, const char *ltsym)
+{
+	Crystal *cr;
+	UnitCell *cell;
+
+	cell = cell_new();
+	cell_set_reciprocal(cell, vals[0]*1e9, vals[1]*1e9, vals[2]*1e9,
+	                          vals[3]*1e9, vals[4]*1e9, vals[5]*1e9,
+	                          vals[6]*1e9, vals[7]*1e9, vals[8]*1e9);
+	if ( set_lattice(cell, ltsym) ) {
+		ERROR("Invalid lattice type '%s'\n", ltsym);
+		cell_free(cell);
 		return NULL;
 	}
 
+	cr = crystal_new();
+
+	/* mm -> m */
+	crystal_set_det_shift(cr, vals[9]*1e-3, vals[10]*1e-3);
+	crystal_set_cell(cr, cell);
+	return cr;
+}
+
+
+static FILE *open_solution_file(const char *filename)
+{
+	FILE *fh;
+
 	/* If filename is not absolute, jump out of working directory */
-	if ( opts->filename[0] == '/' ) {
-		fh = fopen(opts->filename, "r");
+	if ( filename[0] == '/' ) {
+		fh = fopen(filename, "r");
 	} else {
-		char *prefixed_fn = cfmalloc(4+strlen(opts->filename));
+		char *prefixed_fn = cfmalloc(4+strlen(filename));
 		if ( prefixed_fn == NULL ) return NULL;
 		strcpy(prefixed_fn, "../");
-		strcat(prefixed_fn, opts->filename);
+		strcat(prefixed_fn, filename);
 		fh = fopen(prefixed_fn, "r");
 		cffree(prefixed_fn);
 	}
 
+	return fh;
+}
+
+
+static int is_index(FILE *fh)
+{
+	char magic[8];
+	int r;
+
+	r = (fread(magic, 1, 8, fh) == 8)
+	  && (memcmp(magic, FROMFILE_INDEX_MAGIC, 8) == 0);
+	rewind(fh);
+	return r;
+}
+
+
+static int map_index(struct fromfile_private *dp, FILE *fh,
+                     const char *filename)
+{
+	struct stat st;
+	const struct fromfile_index_header *hdr;
+	uint64_t expected;
+
+	if ( fstat(fileno(fh), &st) ) {
+		ERROR("Couldn't stat solution index '%s'\n", filename);
+		return 1;
+	}
+	if ( st.st_size < (off_t)sizeof(struct fromfile_index_header) ) {
+		ERROR("Solution index '%s' is truncated\n", filename);
+		return 1;
+	}
+
+	/* Read-only and shared, so all the workers use the same pages */
+	dp->map_size = st.st_size;
+	dp->map = mmap(NULL, dp->map_size, PROT_READ, MAP_SHARED,
+	               fileno(fh), 0);
+	if ( dp->map == MAP_FAILED ) {
+		ERROR("Couldn't map solution index '%s': %s\n",
+		      filename, strerror(errno));
+		dp->map = NULL;
+		return 1;
+	}
+
+	hdr = dp->map;
+	expected = sizeof(struct fromfile_index_header)
+	         + hdr->n_events*sizeof(struct fromfile_index_event)
+	         + hdr->n_crystals*sizeof(struct fromfile_index_crystal)
+	         + hdr->strings_size;
+	if ( (hdr->n_events > UINT32_MAX) || (hdr->n_crystals > UINT32_MAX)
+	  || (hdr->strings_size > dp->map_size) || (expected != dp->map_size) )
+	{
+		ERROR("Solution index '%s' is corrupted\n", filename);
+		munmap(dp->map, dp->map_size);
+		dp->map = NULL;
+		return 1;
+	}
+
+	dp->n_events = hdr->n_events;
+	dp->n_index_crystals = hdr->n_crystals;
+	dp->strings_size = hdr->strings_size;
+	dp->events = (void *)((char *)dp->map
+	                      + sizeof(struct fromfile_index_header));
+	dp->crystals = (void *)(dp->events + dp->n_events);
+	dp->strings = (char *)(dp->crystals + dp->n_index_crystals);
+
+	return 0;
+}
+
+
+void *fromfile_prepare(IndexingMethod *indm, struct fromfile_options *opts)
+{
+	FILE *fh;
+	struct fromfile_private *dp;
+
+	if ( opts->filename == NULL ) {
+		ERROR("Please try again with --fromfile-input-file\n");
+		return NULL;
+	}
+
+	fh = open_solution_file(opts->filename);
 	if ( fh == NULL ) {
 		ERROR("Couldn't find solution file '%s'\n", opts->filename);
 		return NULL;
@@ -217,96 +428,63 @@ void *fromfile_prepare(IndexingMethod *indm, struct fromfile_options *opts)
 	}
 
 	dp->sol_hash = NULL;
+	dp->map = NULL;
+
+	if ( is_index(fh) ) {
+		int r = map_index(dp, fh, opts->filename);
+		fclose(fh);
+		if ( r ) {
+			cffree(dp);
+			return NULL;
+		}
+		STATUS("Using solution index %s (%lli frames)\n",
+		       opts->filename, (long long int)dp->n_events);
+		return dp;
+	}
 
 	/* Read indexing solutions */
 	do {
 
 		char *rval;
 		char line[1024];
-		int i, n;
-		char **bits;
-		float vals[11];
+		struct solution_line sl;
 		struct fromfile_key key;
-		Crystal *cr;
-		size_t len;
-		int n_sp;
 		struct fromfile_entry *item = NULL;
 
 		rval = fgets(line, 1023, fh);
 		if ( rval == NULL ) break;
 
-		chomp(line);
-		notrail(line);
-
-		len = strlen(line);
-		n_sp = 0;
-		for ( i=len-1; i>0; i-- ) {
-			if ( line[i] == ' ' ) {
-				n_sp++;
-				if ( n_sp == 13 ) {
-					line[i] = '\0';
-					break;
-				}
-			}
-		}
-
-		n = assplode(line+i+1, " \t,", &bits, ASSPLODE_NONE);
-		if ( n < 13 ) {
-			ERROR("Badly formatted line '%s'\n", line);
+		if ( parse_solution_line(line, &sl) ) {
+			fclose(fh);
 			return NULL;
 		}
 
-		/* filename, event, asx, asy, asz, bsx, bsy, bsz, csx, csy, csz,
-		 * det_shift_x, det_shift_y, latticetype+centering */
-		for ( i=1; i<12; i++ ) {
-			if (sscanf(bits[i], "%f", &vals[i-1]) != 1)
-			{
-				ERROR("Invalid value for number %i\n", i);
-				return NULL;
-			}
-		}
-
-		if ( make_key(&key, line, bits[0]) ) {
+		if ( make_key(&key, sl.filename, sl.event) ) {
 			ERROR("Failed to make key for %s %s\n",
-			      line, bits[0]);
+			      sl.filename, sl.event);
+			free_solution_line(&sl);
 			continue;
 		}
 
 		item = add_unique(&dp->sol_hash, key);
 		if ( item == NULL ) {
 			ERROR("Failed to add/find entry for %s %s\n",
-			      line, bits[0]);
+			      sl.filename, sl.event);
+			free_solution_line(&sl);
 			continue;
 		}
 
 		if ( item->n_crystals == MAX_CRYSTALS ) {
-
-			ERROR("Too many crystals for %s %s\n", line, bits[0]);
-
+			ERROR("Too many crystals for %s %s\n",
+			      sl.filename, sl.event);
 		} else {
-
-			UnitCell *cell;
-
-			cr = crystal_new();
-
-			/* mm -> m */
-			crystal_set_det_shift(cr, vals[9]*1e-3, vals[10]*1e-3);
-
-			cell = cell_new();
-			cell_set_reciprocal(cell, vals[0]*1e9, vals[1]*1e9, vals[2]*1e9,
-			                          vals[3]*1e9, vals[4]*1e9, vals[5]*1e9,
-			                          vals[6]*1e9, vals[7]*1e9, vals[8]*1e9);
-			if ( set_lattice(cell, bits[12]) ) {
-				ERROR("Invalid lattice type '%s'\n", bits[12]);
-			} else {
-				crystal_set_cell(cr, cell);
+			Crystal *cr = make_crystal(sl.vals, sl.lattice);
+			if ( cr != NULL ) {
 				item->crystals[item->n_crystals++] = cr;
 			}
-
 		}
 
-		for ( i=0; i<n; i++ ) cffree(bits[i]);
-		cffree(bits);
+		free_solution_line(&sl);
 
 	} while ( 1 );
 
@@ -319,6 +497,68 @@ void *fromfile_prepare(IndexingMethod *indm, struct fromfile_options *opts)
 }
 
 
+static int compare_key(const char *filename, const char *ev, const char *key)
+{
+	int r = strcmp(filename, key);
+	if ( r != 0 ) return r;
+	return strcmp(ev, key+strlen(key)+1);
+}
+
+
+static int index_from_index(struct image *image, struct fromfile_private *dp)
+{
+	uint64_t lo = 0;
+	uint64_t hi = dp->n_events;
+	const struct fromfile_index_event *e = NULL;
+	int i, n;
+
+	/* Binary search for the first (and only) matching entry */
+	while ( lo < hi ) {
+		uint64_t mid = lo + (hi-lo)/2;
+		int r;
+		if ( dp->events[mid].key >= dp->strings_size ) {
+			ERROR("Solution index is corrupted\n");
+			return 0;
+		}
+		r = compare_key(image->filename, image->ev,
+		                dp->strings + dp->events[mid].key);
+		if ( r == 0 ) {
+			e = &dp->events[mid];
+			break;
+		}
+		if ( r < 0 ) {
+			hi = mid;
+		} else {
+			lo = mid+1;
+		}
+	}
+
+	if ( (e == NULL)
+	  || (e->first_crystal + (uint64_t)e->n_crystals > dp->n_index_crystals) )
+	{
+		STATUS("WARNING: No solution for %s %s\n",
+		       image->filename, image->ev);
+		return 0;
+	}
+
+	n = 0;
+	for ( i=0; i<e->n_crystals; i++ ) {
+		const struct fromfile_index_crystal *c;
+		char ltsym[5];
+		Crystal *cr;
+		c = &dp->crystals[e->first_crystal+i];
+		memcpy(ltsym, c->lattice, 4);
+		ltsym[4] = '\0';
+		cr = make_crystal(c->vals, ltsym);
+		if ( cr == NULL ) continue;
+		image_add_crystal(image, cr);
+		n++;
+	}
+
+	return n;
+}
+
+
 int fromfile_index(struct image *image, void *mpriv)
 {
 	struct fromfile_entry *p;
@@ -326,6 +566,8 @@ int fromfile_index(struct image *image, void *mpriv)
 	struct fromfile_key key;
 	int i;
 
+	if ( dp->map != NULL ) return index_from_index(image, dp);
+
 	make_key(&key, image->filename, image->ev);
 
 	HASH_FIND(hh, dp->sol_hash, &key, sizeof(struct fromfile_key), p);
@@ -350,20 +592,256 @@ void fromfile_cleanup(void *mpriv)
 	struct fromfile_private *dp = mpriv;
 	struct fromfile_entry *item, *tmp;
 
+	if ( dp->map != NULL ) munmap(dp->map, dp->map_size);
+
 	HASH_ITER(hh, dp->sol_hash, item, tmp) {
 		int i;
 		HASH_DEL(dp->sol_hash, item);
 		for ( i=0; i<item->n_crystals; i++ ) {
-			Crystal *cr = item->crystals[i];
-			cell_free(crystal_get_cell(cr));
-			crystal_free(cr);
+			/* The crystal owns its cell */
+			crystal_free(item->crystals[i]);
 		}
+		cffree(item);
 	}
 
 	cffree(dp);
 }
 
 
+/**
+ * \param filename The name of a file
+ *
+ * \returns non-zero if \p filename is a solution index written by
+ * fromfile_write_index(), rather than a text solution file.
+ */
+int fromfile_is_index(const char *filename)
+{
+	FILE *fh;
+	int r;
+
+	fh = fopen(filename, "rb");
+	if ( fh == NULL ) return 0;
+	r = is_index(fh);
+	fclose(fh);
+	return r;
+}
+
+
+struct index_record
+{
+	char *filename;
+	char *event;
+	float vals[11];
+	char lattice[4];
+	int serial;
+};
+
+
+static int cmp_record(const void *av, const void *bv)
+{
+	const struct index_record *a = av;
+	const struct index_record *b = bv;
+	int r;
+
+	r = strcmp(a->filename, b->filename);
+	if ( r != 0 ) return r;
+	r = strcmp(a->event, b->event);
+	if ( r != 0 ) return r;
+
+	/* Keep the crystals in the same order as in the file */
+	return (a->serial > b->serial) - (a->serial < b->serial);
+}
+
+
+static int same_key(const struct index_record *a,
+                    const struct index_record *b)
+{
+	return (strcmp(a->filename, b->filename) == 0)
+	    && (strcmp(a->event, b->event) == 0);
+}
+
+
+static void free_records(struct index_record *recs, int n)
+{
+	int i;
+	for ( i=0; i<n; i++ ) {
+		cffree(recs[i].filename);
+		cffree(recs[i].event);
+	}
+	cffree(recs);
+}
+
+
+static int write_index(FILE *fh, struct index_record *recs, int n)
+{
+	struct fromfile_index_header hdr;
+	struct fromfile_index_event *events;
+	uint64_t n_events = 0;
+	uint64_t n_crystals = 0;
+	uint64_t strings_size = 0;
+	int i;
+
+	events = cfmalloc(n*sizeof(struct fromfile_index_event));
+	if ( (n > 0) && (events == NULL) ) return 1;
+
+	/* Work out the events and string table layout */
+	for ( i=0; i<n; i++ ) {
+		if ( (i == 0) || !same_key(&recs[i-1], &recs[i]) ) {
+			struct fromfile_index_event *e = &events[n_events++];
+			e->key = strings_size;
+			e->first_crystal = n_crystals;
+			e->n_crystals = 0;
+			strings_size += strlen(recs[i].filename)+1
+			              + strlen(recs[i].event)+1;
+		}
+		if ( events[n_events-1].n_crystals == MAX_CRYSTALS ) {
+			ERROR("Too many crystals for %s %s\n",
+			      recs[i].filename, recs[i].event);
+			recs[i].serial = -1;
+			continue;
+		}
+		events[n_events-1].n_crystals++;
+		n_crystals++;
+	}
+
+	memcpy(hdr.magic, FROMFILE_INDEX_MAGIC, 8);
+	hdr.n_events = n_events;
+	hdr.n_crystals = n_crystals;
+	hdr.strings_size = strings_size;
+
+	if ( (fwrite(&hdr, sizeof(hdr), 1, fh) != 1)
+	  || (fwrite(events, sizeof(struct fromfile_index_event),
+	             n_events, fh) != n_events) )
+	{
+		cffree(events);
+		return 1;
+	}
+
+	for ( i=0; i<n; i++ ) {
+		struct fromfile_index_crystal c;
+		if ( recs[i].serial < 0 ) continue;
+		memcpy(c.vals, recs[i].vals, sizeof(c.vals));
+		memcpy(c.lattice, recs[i].lattice, 4);
+		if ( fwrite(&c, sizeof(c), 1, fh) != 1 ) {
+			cffree(events);
+			return 1;
+		}
+	}
+
+	for ( i=0; i<n; i++ ) {
+		if ( (i > 0) && same_key(&recs[i-1], &recs[i]) ) continue;
+		if ( (fwrite(recs[i].filename, strlen(recs[i].filename)+1, 1, fh) != 1)
+		  || (fwrite(recs[i].event, strlen(recs[i].event)+1, 1, fh) != 1) )
+		{
+			cffree(events);
+			return 1;
+		}
+	}
+
+	cffree(events);
+	return 0;
+}
+
+
+/**
+ * \param sol_filename The name of a solution file, in the text format
+ * \param index_filename The name of the index file to write
+ *
+ * Converts a solution file for the 'fromfile' indexer into a sorted binary
+ * index.  The index can be given to the indexer instead of the text file.  It
+ * will be mapped into memory instead of read, so it loads almost instantly
+ * and only one copy is needed, however many processes use it.
+ *
+ * \returns zero on success.
+ */
+int fromfile_write_index(const char *sol_filename, const char *index_filename)
+{
+	FILE *fh;
+	struct index_record *recs = NULL;
+	int n_recs = 0;
+	int max_recs = 0;
+	int r;
+
+	fh = fopen(sol_filename, "r");
+	if ( fh == NULL ) {
+		ERROR("Couldn't open solution file '%s'\n", sol_filename);
+		return 1;
+	}
+
+	do {
+
+		char line[1024];
+		struct solution_line sl;
+		UnitCell *cell;
+		struct index_record *rec;
+
+		if ( fgets(line, 1023, fh) == NULL ) break;
+
+		if ( parse_solution_line(line, &sl) ) {
+			free_records(recs, n_recs);
+			fclose(fh);
+			return 1;
+		}
+
+		/* Check the lattice type now, rather than for every lookup */
+		cell = cell_new();
+		if ( (strlen(sl.lattice) > 3) || set_lattice(cell, sl.lattice) ) {
+			ERROR("Invalid lattice type '%s'\n", sl.lattice);
+			cell_free(cell);
+			free_solution_line(&sl);
+			continue;
+		}
+		cell_free(cell);
+
+		if ( n_recs == max_recs ) {
+			struct index_record *nrecs;
+			int nmax = (max_recs == 0) ? 1024 : max_recs*2;
+			nrecs = cfrealloc(recs, nmax*sizeof(struct index_record));
+			if ( nrecs == NULL ) {
+				free_solution_line(&sl);
+				free_records(recs, n_recs);
+				fclose(fh);
+				return 1;
+			}
+			recs = nrecs;
+			max_recs = nmax;
+		}
+
+		rec = &recs[n_recs];
+		rec->filename = cfstrdup(sl.filename);
+		rec->event = cfstrdup(sl.event);
+		memcpy(rec->vals, sl.vals, sizeof(rec->vals));
+		memset(rec->lattice, 0, 4);
+		memcpy(rec->lattice, sl.lattice, strlen(sl.lattice));
+		rec->serial = n_recs;
+		n_recs++;
+
+		free_solution_line(&sl);
+
+	} while ( 1 );
+
+	fclose(fh);
+
+	qsort(recs, n_recs, sizeof(struct index_record), cmp_record);
+
+	fh = fopen(index_filename, "wb");
+	if ( fh == NULL ) {
+		ERROR("Couldn't open '%s' for writing\n", index_filename);
+		free_records(recs, n_recs);
+		return 1;
+	}
+
+	r = write_index(fh, recs, n_recs);
+	if ( fclose(fh) ) r = 1;
+	if ( r ) {
+		ERROR("Failed to write solution index '%s'\n", index_filename);
+	}
+
+	free_records(recs, n_recs);
+	return r;
+}
+
+
 static void fromfile_show_help()
 {
 	printf("Parameters for 'fromfile' indexing:\n"
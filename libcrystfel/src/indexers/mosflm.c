@@ -42,6 +42,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
 
 #ifdef HAVE_FORKPTY_PTY_H
 #include <pty.h>
@@ -67,6 +68,10 @@
 #define MOSFLM_VERBOSE 0
 #define FAKE_CLEN (0.1)
 
+/* The first step of mosflm_send_next() which depends on the pattern.  A
+ * persistent MOSFLM session starts each new pattern at this step. */
+#define MOSFLM_FIRST_PATTERN_STEP (6)
+
 
 typedef enum {
 	MOSFLM_INPUT_NONE,
@@ -79,6 +84,10 @@ typedef enum {
 struct mosflm_private {
 	IndexingMethod          indm;
 	UnitCell                *template;
+	int                     persistent;
+
+	/* MOSFLM process kept between patterns, if persistent */
+	struct mosflm_data      *session;
 };
 
 
@@ -99,6 +108,7 @@ struct mosflm_data {
 	int                     finished_ok;
 	int                     done;
 	int                     success;
+	int                     idle;    /* Waiting at prompt for next pattern */
 
 	struct mosflm_private  *mp;
 
@@ -573,7 +583,13 @@ static void mosflm_send_next(struct image *image, struct mosflm_data *mosflm)
 		break;
 
 		default:
-		mosflm_sendline("exit\n", mosflm);
+		if ( mosflm->mp->persistent ) {
+			/* Leave MOSFLM at the prompt, ready for the next
+			 * pattern */
+			mosflm->idle = 1;
+		} else {
+			mosflm_sendline("exit\n", mosflm);
+		}
 		return;
 	}
 
@@ -693,34 +709,27 @@ static int mosflm_readable(struct image *image, struct mosflm_data *mosflm)
 }
 
 
-int run_mosflm(struct image *image, void *ipriv)
+static struct mosflm_data *start_mosflm(struct mosflm_private *mp)
 {
 	struct mosflm_data *mosflm;
 	unsigned int opts;
-	int status;
-	int rval;
 
 	mosflm = cfmalloc(sizeof(struct mosflm_data));
 	if ( mosflm == NULL ) {
 		ERROR("Couldn't allocate memory for MOSFLM data.\n");
-		return 0;
+		return NULL;
 	}
 
 	snprintf(mosflm->imagefile, 127, "xfel_001.img");
-	write_img(image, mosflm->imagefile); /* Dummy image */
-
 	snprintf(mosflm->sptfile, 127, "xfel_001.spt");
-	write_spt(image, mosflm->sptfile);
-
 	snprintf(mosflm->newmatfile, 127, "xfel.newmat");
-	remove(mosflm->newmatfile);
 
 	mosflm->pid = forkpty(&mosflm->pty, NULL, NULL, NULL);
 
 	if ( mosflm->pid == -1 ) {
 		ERROR("Failed to fork for MOSFLM: %s\n", strerror(errno));
 		cffree(mosflm);
-		return 0;
+		return NULL;
 	}
 	if ( mosflm->pid == 0 ) {
 
@@ -749,10 +758,54 @@ int run_mosflm(struct image *image, void *ipriv)
 	fcntl(mosflm->pty, F_SETFL, opts | O_NONBLOCK);
 
 	mosflm->step = 1;	/* This starts the "initialisation" procedure */
+	mosflm->mp = mp;
+
+	return mosflm;
+}
+
+
+static void stop_mosflm(struct mosflm_data *mosflm, int force)
+{
+	int status;
+
+	/* A persistent MOSFLM which stopped responding won't exit by itself */
+	if ( force ) kill(mosflm->pid, SIGKILL);
+
+	close(mosflm->pty);
+	cffree(mosflm->rbuffer);
+	waitpid(mosflm->pid, &status, 0);
+}
+
+
+int run_mosflm(struct image *image, void *ipriv)
+{
+	struct mosflm_private *mp = (struct mosflm_private *)ipriv;
+	struct mosflm_data *mosflm;
+	int rval;
+
+	if ( mp->session != NULL ) {
+		mosflm = mp->session;
+		mp->session = NULL;
+		mosflm->step = MOSFLM_FIRST_PATTERN_STEP;
+	} else {
+		mosflm = start_mosflm(mp);
+		if ( mosflm == NULL ) return 0;
+	}
+	indexing_set_child(mosflm->pid);
+
+	write_img(image, mosflm->imagefile); /* Dummy image */
+	write_spt(image, mosflm->sptfile);
+	remove(mosflm->newmatfile);
+
 	mosflm->finished_ok = 0;
-	mosflm->mp = (struct mosflm_private *)ipriv;
 	mosflm->done = 0;
 	mosflm->success = 0;
+	mosflm->idle = 0;
+
+	/* A persistent MOSFLM has already shown its prompt */
+	if ( mosflm->step == MOSFLM_FIRST_PATTERN_STEP ) {
+		mosflm_send_next(image, mosflm);
+	}
 
 	rval = 0;
 	do {
@@ -792,11 +845,16 @@ int run_mosflm(struct image *image, void *ipriv)
 			rval = 1;
 		}
 
-	} while ( !rval );
+	} while ( !rval && !mosflm->idle );
 
-	close(mosflm->pty);
-	cffree(mosflm->rbuffer);
-	waitpid(mosflm->pid, &status, 0);
+	/* Keep MOSFLM for the next pattern if it's still behaving.  If not,
+	 * a new one will be started next time. */
+	if ( mosflm->idle ) {
+		mp->session = mosflm;
+	} else {
+		stop_mosflm(mosflm, mp->persistent);
+	}
+	indexing_set_child(0);
 
 	if ( mosflm->finished_ok == 0 ) {
 		ERROR("MOSFLM doesn't seem to be working properly.\n");
@@ -806,12 +864,12 @@ int run_mosflm(struct image *image, void *ipriv)
 	}
 
 	rval = mosflm->success;
-	cffree(mosflm);
+	if ( mp->session == NULL ) cffree(mosflm);
 	return rval;
 }
 
 
-void *mosflm_prepare(IndexingMethod *indm, UnitCell *cell)
+void *mosflm_prepare(IndexingMethod *indm, UnitCell *cell, int persistent)
 {
 	struct mosflm_private *mp;
 
@@ -839,6 +897,8 @@ void *mosflm_prepare(IndexingMethod *indm, UnitCell *cell)
 
 	mp->template = cell;
 	mp->indm = *indm;
+	mp->persistent = persistent;
+	mp->session = NULL;
 
 	return (IndexingPrivate *)mp;
 }
@@ -848,6 +908,11 @@ void mosflm_cleanup(void *pp)
 {
 	struct mosflm_private *p;
 	p = (struct mosflm_private *)pp;
+	if ( p->session != NULL ) {
+		mosflm_sendline("exit\n", p->session);
+		stop_mosflm(p->session, 0);
+		cffree(p->session);
+	}
 	cffree(p);
 }
 
@@ -44,7 +44,8 @@ extern "C" {
 
 extern int run_mosflm(struct image *image, void *ipriv);
 
-extern void *mosflm_prepare(IndexingMethod *indm, UnitCell *cell);
+extern void *mosflm_prepare(IndexingMethod *indm, UnitCell *cell,
+                            int persistent);
 extern const char *mosflm_probe(UnitCell *cell);
 
 extern void mosflm_cleanup(void *pp);
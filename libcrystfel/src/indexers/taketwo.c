@@ -92,6 +92,8 @@
 #include <gsl/gsl_blas.h>
 #include <float.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <time.h>
 
@@ -141,6 +143,15 @@ struct TheoryVec
  * seed
  */
 
+/**
+ * Fixed-size 3x3 matrix, stored row-major.  Used for the rotations in the
+ * seed-growth loop so that no GSL matrices need to be allocated there.
+ */
+struct rot3
+{
+	double m[9];
+};
+
 struct Seed
 {
 	int obs1;
@@ -150,6 +161,19 @@ struct Seed
 	double score;
 };
 
+/**
+ * Theoretical vectors matched to one observed vector, kept between attempts
+ * on the same image.  Retries and multi-lattice passes only remove peaks, so
+ * most of the observed vectors will be the same next time.  The matches
+ * depend only on the observed vector, so that is the key.
+ */
+struct match_cache_entry
+{
+	struct rvec obsvec;
+	struct TheoryVec *matches;
+	int match_num;
+};
+
 struct taketwo_private
 {
 	IndexingMethod indm;
@@ -161,11 +185,22 @@ struct taketwo_private
 	struct TheoryVec *theory_vecs; /**< Theoretical vectors for given unit cell */
 	unsigned int vec_count; /**< Number of theoretical vectors */
 
+	/* Theoretical vectors binned by length, for match_obs_to_cell_vecs() */
+	unsigned int *len_order; /**< Indices into theory_vecs, shortest first */
+	double *sorted_lens; /**< Lengths of theory_vecs, in the same order */
+	double bin_width; /**< Width of each length bin, in m^-1 */
+	int n_bins; /**< Number of length bins */
+	unsigned int *bin_start; /**< First len_order entry of each bin (n_bins+1) */
+
 	gsl_matrix     **prevSols; /**< Previous solutions to be ignored */
 	unsigned int   numPrevs; /**< Previous solution count */
 	double *prevScores; /**< previous solution scores */
 	unsigned int *membership; /**< previous solution was success or failure */
 
+	struct match_cache_entry *match_cache; /**< Sorted by obsvec */
+	int n_match_cache; /**< Number of entries in match_cache */
+	ImageFeatureList *cache_features; /**< Peak list for match_cache */
+
 };
 
 /**
@@ -174,7 +209,7 @@ struct taketwo_private
 struct TakeTwoCell
 {
 	UnitCell       *cell; /**< Contains unit cell dimensions */
-	gsl_matrix     **rotSymOps;
+	struct rot3    *rotSymOps;
 	unsigned int   numOps;
 
 	struct SpotVec *obs_vecs;
@@ -195,14 +230,16 @@ struct TakeTwoCell
 	double y_ang; /**< Rotations in radians to apply to y axis of solution */
 	double z_ang; /**< Rotations in radians to apply to z axis of solution */
 
-	/**< Temporary memory always allocated for calculations */
-	gsl_matrix *twiz1Tmp;
-	/**< Temporary memory always allocated for calculations */
-	gsl_matrix *twiz2Tmp;
 	/**< Temporary memory always allocated for calculations */
 	gsl_vector *vec1Tmp;
 	/**< Temporary memory always allocated for calculations */
 	gsl_vector *vec2Tmp;
+
+	/* Scratch space for growing networks, see alloc_network_scratch() */
+	struct rot3 *rot_tmp; /**< Candidate rotations */
+	double *score_tmp; /**< Scores of the candidate rotations */
+	int *obs_members; /**< Observed vector indices of network members */
+	int *match_members; /**< Theoretical vector indices of members */
 };
 
 
@@ -228,6 +265,12 @@ struct TakeTwoCell
 /* Maximum number of seeds to start from in start_seeds() */
 #define MAX_SEEDS 10
 
+/* Maximum number of length bins for theoretical vectors */
+#define MAX_LENGTH_BINS (1<<20)
+
+/* Maximum number of boxes along each axis for gen_observed_vecs() */
+#define MAX_GRID_BOXES (64)
+
 /* Tolerance for two angles to be considered the same */
 #define ANGLE_TOLERANCE (deg2rad(0.6))
 
@@ -402,20 +445,95 @@ static UnitCell *cell_post_smiley_face(UnitCell *in, gsl_matrix *m)
 }
 
 
-static void rotation_around_axis(struct rvec c, double th,
-				 gsl_matrix *res)
+static void rot3_from_gsl(gsl_matrix *g, struct rot3 *r)
+{
+	int i, j;
+
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			r->m[3*i+j] = gsl_matrix_get(g, i, j);
+		}
+	}
+}
+
+
+static void rot3_to_gsl(const struct rot3 *r, gsl_matrix *g)
+{
+	int i, j;
+
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			gsl_matrix_set(g, i, j, r->m[3*i+j]);
+		}
+	}
+}
+
+
+/* res = a * b.  res must not be the same as a or b. */
+static void rot3_multiply(const struct rot3 *a, const struct rot3 *b,
+                          struct rot3 *res)
+{
+	int i, j;
+
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			res->m[3*i+j] = a->m[3*i+0] * b->m[0+j]
+			              + a->m[3*i+1] * b->m[3+j]
+			              + a->m[3*i+2] * b->m[6+j];
+		}
+	}
+}
+
+
+static struct rvec rot3_apply(const struct rot3 *r, struct rvec v)
+{
+	return new_rvec(r->m[0]*v.u + r->m[1]*v.v + r->m[2]*v.w,
+	                r->m[3]*v.u + r->m[4]*v.v + r->m[5]*v.w,
+	                r->m[6]*v.u + r->m[7]*v.v + r->m[8]*v.w);
+}
+
+
+/* For each of the n matrices in mats, scores[i] = Tr(S S^T) where
+ * S = ref - mats[i], i.e. the sum of the squared element differences.
+ * The inner loop has a fixed length so that it vectorises. */
+static void rot3_distances(const struct rot3 *ref, const struct rot3 *mats,
+                           int n, double *scores)
+{
+	int i, k;
+
+	for ( i=0; i<n; i++ ) {
+		double tr = 0.0;
+		for ( k=0; k<9; k++ ) {
+			double d = ref->m[k] - mats[i].m[k];
+			tr += d*d;
+		}
+		scores[i] = tr;
+	}
+}
+
+
+static void rot3_around_axis(struct rvec c, double th, struct rot3 *res)
 {
 	double omc = 1.0 - cos(th);
 	double s = sin(th);
-	gsl_matrix_set(res, 0, 0, cos(th) + c.u*c.u*omc);
-	gsl_matrix_set(res, 0, 1, c.u*c.v*omc - c.w*s);
-	gsl_matrix_set(res, 0, 2, c.u*c.w*omc + c.v*s);
-	gsl_matrix_set(res, 1, 0, c.u*c.v*omc + c.w*s);
-	gsl_matrix_set(res, 1, 1, cos(th) + c.v*c.v*omc);
-	gsl_matrix_set(res, 1, 2, c.v*c.w*omc - c.u*s);
-	gsl_matrix_set(res, 2, 0, c.w*c.u*omc - c.v*s);
-	gsl_matrix_set(res, 2, 1, c.w*c.v*omc + c.u*s);
-	gsl_matrix_set(res, 2, 2, cos(th) + c.w*c.w*omc);
+	res->m[0] = cos(th) + c.u*c.u*omc;
+	res->m[1] = c.u*c.v*omc - c.w*s;
+	res->m[2] = c.u*c.w*omc + c.v*s;
+	res->m[3] = c.u*c.v*omc + c.w*s;
+	res->m[4] = cos(th) + c.v*c.v*omc;
+	res->m[5] = c.v*c.w*omc - c.u*s;
+	res->m[6] = c.w*c.u*omc - c.v*s;
+	res->m[7] = c.w*c.v*omc + c.u*s;
+	res->m[8] = cos(th) + c.w*c.w*omc;
+}
+
+
+static void rotation_around_axis(struct rvec c, double th,
+				 gsl_matrix *res)
+{
+	struct rot3 r;
+	rot3_around_axis(c, th, &r);
+	rot3_to_gsl(&r, res);
 }
 
 /** Rotate GSL matrix by three angles along x, y and z axes */
@@ -457,7 +575,7 @@ static void rotate_gsl_by_angles(gsl_matrix *sol, double x, double y,
 /* Rotate vector (vec1) around axis (axis) by angle theta. Find value of
  * theta for which the angle between (vec1) and (vec2) is minimised. */
 static void closest_rot_mat(struct rvec vec1, struct rvec vec2,
-			    struct rvec axis, gsl_matrix *twizzle)
+			    struct rvec axis, struct rot3 *twizzle)
 {
 	/* Let's have unit vectors */
 	normalise_rvec(&vec1);
@@ -507,76 +625,47 @@ static void closest_rot_mat(struct rvec vec1, struct rvec vec2,
 
 	/* Don't return an identity matrix which has been rotated by
 	 * theta around "axis", but do assign it to twizzle. */
-	rotation_around_axis(axis, bestAngle, twizzle);
-}
-
-static double matrix_trace(gsl_matrix *a)
-{
-	int i;
-	double tr = 0.0;
-
-	assert(a->size1 == a->size2);
-	for ( i=0; i<a->size1; i++ ) {
-		tr += gsl_matrix_get(a, i, i);
-	}
-	return tr;
+	rot3_around_axis(axis, bestAngle, twizzle);
 }
 
-static int rot_mats_are_similar(gsl_matrix *rot1, gsl_matrix *rot2,
-                                gsl_matrix *sub, gsl_matrix *mul,
+static int rot_mats_are_similar(const struct rot3 *rot1,
+                                const struct rot3 *rot2,
                                 double *score, struct TakeTwoCell *cell)
 {
 	double tr;
 
-	gsl_matrix_memcpy(sub, rot1);
-	gsl_matrix_sub(sub, rot2);  /* sub = rot1 - rot2 */
-
-	gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, sub, sub, 0.0, mul);
-
-	tr = matrix_trace(mul);
+	rot3_distances(rot1, rot2, 1, &tr);
 	if (score != NULL) *score = tr;
 
 	return (tr < cell->trace_tol);
 }
 
-static int symm_rot_mats_are_similar(gsl_matrix *rot1, gsl_matrix *rot2,
+static int symm_rot_mats_are_similar(const struct rot3 *rot1,
+                                     const struct rot3 *rot2,
                                      struct TakeTwoCell *cell)
 {
 	int i;
 
-	gsl_matrix *sub = gsl_matrix_calloc(3, 3);
-	gsl_matrix *mul = gsl_matrix_calloc(3, 3);
-
 	for (i = 0; i < cell->numOps; i++) {
-		gsl_matrix *testRot = gsl_matrix_alloc(3, 3);
-		gsl_matrix *symOp = cell->rotSymOps[i];
+		rot3_multiply(rot1, &cell->rotSymOps[i], &cell->rot_tmp[i]);
+	}
 
-		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, rot1, symOp,
-		0.0, testRot);
+	rot3_distances(rot2, cell->rot_tmp, cell->numOps, cell->score_tmp);
 
-		if (rot_mats_are_similar(testRot, rot2, sub, mul, NULL, cell)) {
-			gsl_matrix_free(testRot);
-			gsl_matrix_free(sub);
-			gsl_matrix_free(mul);
-			return 1;
-		}
-
-		gsl_matrix_free(testRot);
+	for (i = 0; i < cell->numOps; i++) {
+		if (cell->score_tmp[i] < cell->trace_tol) return 1;
 	}
 
-	gsl_matrix_free(sub);
-	gsl_matrix_free(mul);
-
 	return 0;
 }
 
 static void rotation_between_vectors(struct rvec a, struct rvec b,
-				     gsl_matrix *twizzle)
+				     struct rot3 *twizzle)
 {
 	double th = rvec_angle(a, b);
 	struct rvec c = rvec_cross(a, b);
 	normalise_rvec(&c);
-	rotation_around_axis(c, th, twizzle);
+	rot3_around_axis(c, th, twizzle);
 }
 
 
@@ -598,45 +687,36 @@ struct rvec gsl_to_rvec(gsl_vector *a)
 }
 
 
-/* Code me in gsl_matrix language to copy the contents of the function
- * in cppxfel (IndexingSolution::createSolution). This function is quite
- * intensive on the number crunching side so simple angle checks are used
- * to 'pre-scan' vectors beforehand. */
-static gsl_matrix *generate_rot_mat(struct rvec obs1, struct rvec obs2,
-				    struct rvec cell1, struct rvec cell2,
-				    struct TakeTwoCell *cell)
+/* Copies the contents of the function in cppxfel
+ * (IndexingSolution::createSolution).  This function is quite intensive on
+ * the number crunching side so simple angle checks are used to 'pre-scan'
+ * vectors beforehand. */
+static void generate_rot_mat(struct rvec obs1, struct rvec obs2,
+                             struct rvec cell1, struct rvec cell2,
+                             struct rot3 *fullMat)
 {
-	gsl_matrix *fullMat;
-	rvec_to_gsl(cell->vec1Tmp, cell2);
+	struct rot3 twiz1;
+	struct rot3 twiz2;
+	struct rvec cell2vr;
 
 	normalise_rvec(&obs1);
 	normalise_rvec(&obs2);
 	normalise_rvec(&cell1);
-	normalise_rvec(&cell2);
 
 	/* Rotate reciprocal space so that the first simulated vector lines up
 	 * with the observed vector. */
-	rotation_between_vectors(cell1, obs1, cell->twiz1Tmp);
-
-	normalise_rvec(&obs1);
+	rotation_between_vectors(cell1, obs1, &twiz1);
 
 	/* Multiply cell2 by rotateSpotDiffMatrix --> cell2vr */
-	gsl_blas_dgemv(CblasNoTrans, 1.0, cell->twiz1Tmp, cell->vec1Tmp,
-		       0.0, cell->vec2Tmp);
+	cell2vr = rot3_apply(&twiz1, cell2);
 
 	/* Now we twirl around the firstAxisUnit until the rotated simulated
 	 * vector matches the second observed vector as closely as possible. */
-
-	closest_rot_mat(gsl_to_rvec(cell->vec2Tmp), obs2, obs1, cell->twiz2Tmp);
+	closest_rot_mat(cell2vr, obs2, obs1, &twiz2);
 
 	/* We want to apply the first matrix and then the second matrix,
 	 * so we multiply these. */
-	fullMat = gsl_matrix_calloc(3, 3);
-	gsl_blas_dgemm(CblasTrans, CblasTrans, 1.0,
-		       cell->twiz1Tmp, cell->twiz2Tmp, 0.0, fullMat);
-	gsl_matrix_transpose(fullMat);
-
-	return fullMat;
+	rot3_multiply(&twiz2, &twiz1, fullMat);
 }
 
 
@@ -793,16 +873,12 @@ static int obs_vecs_match_angles(int her, int his,
  * core functions regarding the meat of the TakeTwo algorithm (Level 2)
  * ------------------------------------------------------------------------*/
 
-static signed int finish_solution(gsl_matrix *rot, struct SpotVec *obs_vecs,
+static signed int finish_solution(struct rot3 *rot, struct SpotVec *obs_vecs,
                                     int *obs_members, int *match_members,
                                     int member_num, struct TakeTwoCell *cell)
 {
-	gsl_matrix *sub = gsl_matrix_calloc(3, 3);
-	gsl_matrix *mul = gsl_matrix_calloc(3, 3);
-
-	gsl_matrix **rotations = cfmalloc(sizeof(*rotations)* pow(member_num, 2)
-	                                  - member_num);
-
+	struct rot3 *rotations = cell->rot_tmp;
+	double *scores = cell->score_tmp;
 	int i, j, count;
 
 	count = 0;
@@ -817,9 +893,8 @@ static signed int finish_solution(gsl_matrix *rot, struct SpotVec *obs_vecs,
 			struct rvec i_cellvec = i_vec.matches[match_members[i]].vec;
 			struct rvec j_cellvec = j_vec.matches[match_members[j]].vec;
 
-			rotations[count] = generate_rot_mat(i_obsvec, j_obsvec,
-							    i_cellvec, j_cellvec,
-							    cell);
+			generate_rot_mat(i_obsvec, j_obsvec, i_cellvec,
+			                 j_cellvec, &rotations[count]);
 
 			count++;
 		}
@@ -830,13 +905,10 @@ static signed int finish_solution(gsl_matrix *rot, struct SpotVec *obs_vecs,
 
 	for (i=0; i<count; i++) {
 		double current_score = 0;
-		for (j=0; j<count; j++) {
-			double addition;
-			rot_mats_are_similar(rotations[i], rotations[j],
-					     sub, mul,
-					     &addition, cell);
 
-			current_score += addition;
+		rot3_distances(&rotations[i], rotations, count, scores);
+		for (j=0; j<count; j++) {
+			current_score += scores[j];
 		}
 
 		if (current_score < min_score) {
@@ -845,22 +917,14 @@ static signed int finish_solution(gsl_matrix *rot, struct SpotVec *obs_vecs,
 		}
 	}
 
-	gsl_matrix_memcpy(rot, rotations[min_rot_index]);
-
-	for (i=0; i<count; i++) {
-		gsl_matrix_free(rotations[i]);
-	}
-
-	cffree(rotations);
-	gsl_matrix_free(sub);
-	gsl_matrix_free(mul);
+	*rot = rotations[min_rot_index];
 
 	return 1;
 }
 
-gsl_matrix *rot_mat_from_indices(int her, int his,
+static void rot_mat_from_indices(int her, int his,
                                  int her_match, int his_match,
-                                 struct TakeTwoCell *cell)
+                                 struct TakeTwoCell *cell, struct rot3 *mat)
 {
 	struct SpotVec *obs_vecs = cell->obs_vecs;
 	struct SpotVec *her_obs = &obs_vecs[her];
@@ -870,17 +934,14 @@ gsl_matrix *rot_mat_from_indices(int her, int his,
 	struct rvec i_cellvec = her_obs->matches[her_match].vec;
 	struct rvec j_cellvec = his_obs->matches[his_match].vec;
 
-	gsl_matrix *mat = generate_rot_mat(i_obsvec, j_obsvec,
-	                                   i_cellvec, j_cellvec, cell);
-
-	return mat;
+	generate_rot_mat(i_obsvec, j_obsvec, i_cellvec, j_cellvec, mat);
 }
 
 static int weed_duplicate_matches(struct Seed **seeds,
                                   int *match_count, struct TakeTwoCell *cell)
 {
 	int num_occupied = 0;
-	gsl_matrix **old_mats = calloc(*match_count, sizeof(gsl_matrix *));
+	struct rot3 *old_mats = cfmalloc(*match_count * sizeof(struct rot3));
 
 	if (old_mats == NULL)
 	{
@@ -898,15 +959,14 @@ static int weed_duplicate_matches(struct Seed **seeds,
 		int her_match = (*seeds)[i].idx1;
 		int his_match = (*seeds)[i].idx2;
 
-		gsl_matrix *mat;
-		mat = rot_mat_from_indices((*seeds)[i].obs1, (*seeds)[i].obs2,
-		                           her_match, his_match, cell);
+		struct rot3 mat;
+		rot_mat_from_indices((*seeds)[i].obs1, (*seeds)[i].obs2,
+		                     her_match, his_match, cell, &mat);
 
 		int found = 0;
 
 		for (j = 0; j < num_occupied; j++) {
-			if (old_mats[j] && mat &&
-			    symm_rot_mats_are_similar(old_mats[j], mat, cell))
+			if (symm_rot_mats_are_similar(&old_mats[j], &mat, cell))
 			{
 				// we have found a duplicate, so flag as bad.
 				(*seeds)[i].idx1 = -1;
@@ -914,8 +974,6 @@ static int weed_duplicate_matches(struct Seed **seeds,
 				found = 1;
 
 				duplicates++;
-
-				gsl_matrix_free(mat);
 				break;
 			}
 		}
@@ -927,25 +985,19 @@ static int weed_duplicate_matches(struct Seed **seeds,
 		}
 	}
 
-	for (i = 0; i < num_occupied; i++) {
-		if (old_mats[i]) {
-			gsl_matrix_free(old_mats[i]);
-		}
-	}
-
 	cffree(old_mats);
 
 	return 1;
 }
 
-static signed int find_next_index(gsl_matrix *rot, int *obs_members,
+static signed int find_next_index(const struct rot3 *rot, int *obs_members,
 				  int *match_members, int start, int member_num,
 				  int *match_found, struct TakeTwoCell *cell)
 {
 	struct SpotVec *obs_vecs = cell->obs_vecs;
 	int obs_vec_count = cell->obs_vec_count;
-	gsl_matrix *sub = gsl_matrix_calloc(3, 3);
-	gsl_matrix *mul = gsl_matrix_calloc(3, 3);
+	struct rot3 *test_rots = cell->rot_tmp;
+	double *traces = cell->score_tmp;
 
 	int i, j, k;
 
@@ -979,26 +1031,19 @@ static signed int find_next_index(gsl_matrix *rot, int *obs_members,
 
 			int one_is_okay = 0;
 
-			/* Loop through all possible theoretical vector
-			* matches for the newcomer.. */
-
+			/* Generate the rotations for all possible theoretical
+			 * vector matches for the newcomer, then compare them
+			 * all against the seed rotation in one go. */
 			for ( k=0; k<me->match_num; k++ ) {
-
-				gsl_matrix *test_rot;
-
 				struct rvec me_cell = me->matches[k].vec;
+				generate_rot_mat(me_obs, you_obs, me_cell,
+				                 you_cell, &test_rots[k]);
+			}
+			rot3_distances(rot, test_rots, me->match_num, traces);
 
-				test_rot = generate_rot_mat(me_obs,
-					    you_obs, me_cell, you_cell,
-					    cell);
-
-				double trace = 0;
-				int ok = rot_mats_are_similar(rot, test_rot,
-						       sub, mul, &trace, cell);
-
-				gsl_matrix_free(test_rot);
+			for ( k=0; k<me->match_num; k++ ) {
 
-				if (ok) {
+				if (traces[k] < cell->trace_tol) {
 					one_is_okay = 1;
 
 					/* We are only happy if the vector
@@ -1025,15 +1070,11 @@ static signed int find_next_index(gsl_matrix *rot, int *obs_members,
 
 
 		if (all_ok) {
-			gsl_matrix_free(sub);
-			gsl_matrix_free(mul);
 			return i;
 		}
 	}
 
 	/* give up. */
-	gsl_matrix_free(sub);
-	gsl_matrix_free(mul);
 	return -1;
 }
 
@@ -1214,15 +1255,15 @@ static void refine_solution(struct TakeTwoCell *ttCell)
 }
 
 
-static unsigned int grow_network(gsl_matrix *rot, int obs_idx1, int obs_idx2,
+static unsigned int grow_network(struct rot3 *rot, int obs_idx1, int obs_idx2,
                                  int match_idx1, int match_idx2,
 			         struct TakeTwoCell *cell)
 {
 
 	struct SpotVec *obs_vecs = cell->obs_vecs;
 	int obs_vec_count = cell->obs_vec_count;
-	int *obs_members;
-	int *match_members;
+	int *obs_members = cell->obs_members;
+	int *match_members = cell->match_members;
 
 	/* Clear the in_network status of all vectors to start */
 	int i;
@@ -1231,14 +1272,6 @@ static unsigned int grow_network(gsl_matrix *rot, int obs_idx1, int obs_idx2,
 		obs_vecs[i].in_network = 0;
 	}
 
-	/* indices of members of the self-consistent network of vectors */
-	obs_members = cfmalloc((cell->member_thresh+3)*sizeof(int));
-	match_members = cfmalloc((cell->member_thresh+3)*sizeof(int));
-	if ( (obs_members == NULL) || (match_members == NULL) ) {
-		apologise();
-		return 0;
-	}
-
 	/* initialise the ones we know already */
 	obs_members[0] = obs_idx1;
 	obs_members[1] = obs_idx2;
@@ -1256,8 +1289,6 @@ static unsigned int grow_network(gsl_matrix *rot, int obs_idx1, int obs_idx2,
 	while ( 1 ) {
 
 		if (start > obs_vec_count) {
-			cffree(obs_members);
-			cffree(match_members);
 			return 0;
 		}
 
@@ -1269,8 +1300,6 @@ static unsigned int grow_network(gsl_matrix *rot, int obs_idx1, int obs_idx2,
 							&match_found, cell);
 
 		if ( member_num < 2 ) {
-			cffree(obs_members);
-			cffree(match_members);
 			return 0;
 		}
 
@@ -1305,34 +1334,26 @@ static unsigned int grow_network(gsl_matrix *rot, int obs_idx1, int obs_idx2,
 	finish_solution(rot, obs_vecs, obs_members,
 	                match_members, member_num, cell);
 
-	cffree(obs_members);
-	cffree(match_members);
-
 	return ( member_num );
 }
 
 
 static unsigned int start_seed(int i, int j, int i_match, int j_match,
-                               gsl_matrix **rotation, struct TakeTwoCell *cell)
+                               struct rot3 *rotation, struct TakeTwoCell *cell)
 {
 	struct SpotVec *obs_vecs = cell->obs_vecs;
 
-	gsl_matrix *rot_mat;
-
-	rot_mat = generate_rot_mat(obs_vecs[i].obsvec,
-				   obs_vecs[j].obsvec,
-				   obs_vecs[i].matches[i_match].vec,
-				   obs_vecs[j].matches[j_match].vec,
-				   cell);
+	generate_rot_mat(obs_vecs[i].obsvec, obs_vecs[j].obsvec,
+	                 obs_vecs[i].matches[i_match].vec,
+	                 obs_vecs[j].matches[j_match].vec,
+	                 rotation);
 
 	/* Try to expand this rotation matrix to a larger network */
 
-	int member_num = grow_network(rot_mat, i, j, i_match, j_match,
+	int member_num = grow_network(rotation, i, j, i_match, j_match,
 	                              cell);
 
-	/* return this matrix and if it was immediately successful */
-	*rotation = rot_mat;
-
+	/* return if it was immediately successful */
 	return member_num;
 }
 
@@ -1349,27 +1370,35 @@ static void remove_old_solutions(struct TakeTwoCell *cell,
 	int duplicates = 0;
 	struct Seed *seeds = cell->seeds;
 	unsigned int total = cell->seed_count;
+	struct rot3 *prevs;
 
-	/* First we remove duplicates with previous solutions */
+	if ( tp->numPrevs == 0 ) return;
+
+	prevs = cfmalloc(tp->numPrevs * sizeof(struct rot3));
+	if ( prevs == NULL ) {
+		apologise();
+		return;
+	}
 
 	int i, j;
+	for (j = 0; j < tp->numPrevs; j++) {
+		rot3_from_gsl(tp->prevSols[j], &prevs[j]);
+	}
+
+	/* First we remove duplicates with previous solutions */
+
 	for (i = total - 1; i >= 0; i--) {
 		int her_match = seeds[i].idx1;
 		int his_match = seeds[i].idx2;
 
-		gsl_matrix *mat;
-		mat = rot_mat_from_indices(seeds[i].obs1, seeds[i].obs2,
-		                           her_match, his_match, cell);
-
-		if (mat == NULL)
-		{
-			continue;
-		}
+		struct rot3 mat;
+		rot_mat_from_indices(seeds[i].obs1, seeds[i].obs2,
+		                     her_match, his_match, cell, &mat);
 
 		for (j = 0; j < tp->numPrevs; j++)
 		{
-			int sim = symm_rot_mats_are_similar(tp->prevSols[j],
-			                                    mat, cell);
+			int sim = symm_rot_mats_are_similar(&prevs[j],
+			                                    &mat, cell);
 
 			/* Found a duplicate with a previous solution */
 			if (sim)
@@ -1380,10 +1409,10 @@ static void remove_old_solutions(struct TakeTwoCell *cell,
 				break;
 			}
 		}
-
-		gsl_matrix_free(mat);
 	}
 
+	cffree(prevs);
+
 //	STATUS("Removing %i duplicates due to prev solutions.\n", duplicates);
 }
 
@@ -1478,7 +1507,8 @@ static unsigned int start_seeds(gsl_matrix **rotation, struct TakeTwoCell *cell)
 	int seed_num = cell->seed_count;
 	int member_num = 0;
 	int max_members = 0;
-	gsl_matrix *rot = NULL;
+	struct rot3 rot;
+	struct rot3 best;
 	int k;
 
 	if ( seed_num > MAX_SEEDS ) seed_num = MAX_SEEDS;
@@ -1501,24 +1531,23 @@ static unsigned int start_seeds(gsl_matrix **rotation, struct TakeTwoCell *cell)
 
 		if (member_num > max_members)
 		{
-			if ( *rotation != NULL ) {
-				/* Free previous best */
-				gsl_matrix_free(*rotation);
-			}
-			*rotation = rot;
+			best = rot;
 			max_members = member_num;
-		} else {
-			gsl_matrix_free(rot);
 		}
 
-		if (member_num >= NETWORK_MEMBER_THRESHOLD) {
-			cffree(seeds);
-			return max_members;
-		}
+		if (member_num >= NETWORK_MEMBER_THRESHOLD) break;
+
+		/* Another indexing method got there first */
+		if ( indexing_cancelled() ) break;
 	}
 
 	cffree(seeds);
 
+	if ( max_members > 0 ) {
+		*rotation = gsl_matrix_alloc(3, 3);
+		rot3_to_gsl(&best, *rotation);
+	}
+
 	return max_members;
 }
 
@@ -1574,7 +1603,7 @@ static int generate_rotation_sym_ops(struct TakeTwoCell *ttCell)
 	int i, j, k;
 	int numOps = num_equivs(rawList, NULL);
 
-	ttCell->rotSymOps = cfmalloc(numOps * sizeof(gsl_matrix *));
+	ttCell->rotSymOps = cfmalloc(numOps * sizeof(struct rot3));
 	ttCell->numOps = numOps;
 
 	if (ttCell->rotSymOps == NULL) {
@@ -1610,10 +1639,11 @@ static int generate_rotation_sym_ops(struct TakeTwoCell *ttCell)
 		               1.0, cart, first,
 		               0.0, second);
 
-		ttCell->rotSymOps[i] = second;
+		rot3_from_gsl(second, &ttCell->rotSymOps[i]);
 
 		gsl_matrix_free(symOp);
 		gsl_matrix_free(first);
+		gsl_matrix_free(second);
 	}
 
 	gsl_matrix_free(cart);
@@ -1628,6 +1658,7 @@ struct sortme
 {
 	struct TheoryVec v;
 	double dist;
+	unsigned int idx;
 };
 
 static int sort_theory_distances(const void *av, const void *bv)
@@ -1637,7 +1668,99 @@ static int sort_theory_distances(const void *av, const void *bv)
 	return a->dist > b->dist;
 }
 
-static int match_obs_to_cell_vecs(struct TheoryVec *cell_vecs, int cell_vec_count,
+static int sort_theory_indices(const void *av, const void *bv)
+{
+	const struct sortme *a = av;
+	const struct sortme *b = bv;
+	if ( a->idx < b->idx ) return -1;
+	if ( a->idx > b->idx ) return 1;
+	return 0;
+}
+
+static int length_bin(struct taketwo_private *tp, double len)
+{
+	if ( len <= 0.0 ) return 0;
+	if ( len / tp->bin_width >= tp->n_bins ) return tp->n_bins - 1;
+	return len / tp->bin_width;
+}
+
+static int compare_match_cache_keys(const void *av, const void *bv)
+{
+	const struct match_cache_entry *a = av;
+	const struct match_cache_entry *b = bv;
+	if ( a->obsvec.u < b->obsvec.u ) return -1;
+	if ( a->obsvec.u > b->obsvec.u ) return 1;
+	if ( a->obsvec.v < b->obsvec.v ) return -1;
+	if ( a->obsvec.v > b->obsvec.v ) return 1;
+	if ( a->obsvec.w < b->obsvec.w ) return -1;
+	if ( a->obsvec.w > b->obsvec.w ) return 1;
+	return 0;
+}
+
+static void free_match_cache(struct taketwo_private *tp)
+{
+	int i;
+
+	for ( i=0; i<tp->n_match_cache; i++ ) {
+		cffree(tp->match_cache[i].matches);
+	}
+	cffree(tp->match_cache);
+	tp->match_cache = NULL;
+	tp->n_match_cache = 0;
+}
+
+/* Find the matches for this observed vector from the last attempt on the
+ * same image, or NULL */
+static struct match_cache_entry *find_cached_matches(struct taketwo_private *tp,
+                                                     struct SpotVec *obs_vec)
+{
+	struct match_cache_entry key;
+
+	if ( tp->match_cache == NULL ) return NULL;
+
+	key.obsvec = obs_vec->obsvec;
+	return bsearch(&key, tp->match_cache, tp->n_match_cache,
+	               sizeof(struct match_cache_entry),
+	               compare_match_cache_keys);
+}
+
+/* Replace the cached matches with the ones for the current observed vectors */
+static void update_match_cache(struct taketwo_private *tp,
+                               struct TakeTwoCell *cell)
+{
+	struct match_cache_entry *cache;
+	int i;
+
+	cache = cfmalloc(cell->obs_vec_count*sizeof(struct match_cache_entry));
+
+	free_match_cache(tp);
+	if ( cache == NULL ) return;
+
+	for ( i=0; i<cell->obs_vec_count; i++ ) {
+
+		struct SpotVec *obs_vec = &cell->obs_vecs[i];
+		size_t sz = obs_vec->match_num*sizeof(struct TheoryVec);
+
+		cache[i].obsvec = obs_vec->obsvec;
+		cache[i].match_num = obs_vec->match_num;
+		cache[i].matches = cfmalloc(sz);
+		if ( cache[i].matches == NULL ) {
+			tp->match_cache = cache;
+			tp->n_match_cache = i;
+			free_match_cache(tp);
+			return;
+		}
+		memcpy(cache[i].matches, obs_vec->matches, sz);
+
+	}
+
+	qsort(cache, cell->obs_vec_count, sizeof(struct match_cache_entry),
+	      compare_match_cache_keys);
+	tp->match_cache = cache;
+	tp->n_match_cache = cell->obs_vec_count;
+}
+
+static int match_obs_to_cell_vecs(struct taketwo_private *tp,
 				  struct TakeTwoCell *cell)
 {
 	struct SpotVec *obs_vecs = cell->obs_vecs;
@@ -1648,11 +1771,28 @@ static int match_obs_to_cell_vecs(struct TheoryVec *cell_vecs, int cell_vec_coun
 
 		int count = 0;
 		struct sortme *for_sort = NULL;
+		double obs_length = obs_vecs[i].distance;
+		unsigned int k, k_start, k_end;
+		struct match_cache_entry *cached;
+
+		/* Seen on the last attempt at this image? */
+		cached = find_cached_matches(tp, &obs_vecs[i]);
+		if ( cached != NULL ) {
+			size_t sz = cached->match_num*sizeof(struct TheoryVec);
+			obs_vecs[i].matches = cfmalloc(sz);
+			if ( obs_vecs[i].matches == NULL ) return 0;
+			memcpy(obs_vecs[i].matches, cached->matches, sz);
+			obs_vecs[i].match_num = cached->match_num;
+			continue;
+		}
+
+		/* Only the bins which could be within tolerance */
+		k_start = tp->bin_start[length_bin(tp, obs_length - cell->len_tol)];
+		k_end = tp->bin_start[length_bin(tp, obs_length + cell->len_tol)+1];
 
-		for ( j=0; j<cell_vec_count; j++ ) {
+		for ( k=k_start; k<k_end; k++ ) {
 			/* get distance for unit cell vector */
-			double cell_length = rvec_length(cell_vecs[j].vec);
-			double obs_length = obs_vecs[i].distance;
+			double cell_length = tp->sorted_lens[k];
 
 			/* check if this matches the observed length */
 			double dist_diff = fabs(cell_length - obs_length);
@@ -1666,8 +1806,9 @@ static int match_obs_to_cell_vecs(struct TheoryVec *cell_vecs, int cell_vec_coun
 
 			if ( for_sort == NULL ) return 0;
 
-			for_sort[count].v = cell_vecs[j];
+			for_sort[count].v = tp->theory_vecs[tp->len_order[k]];
 			for_sort[count].dist = dist_diff;
+			for_sort[count].idx = tp->len_order[k];
 			count++;
 
 		}
@@ -1684,6 +1825,11 @@ static int match_obs_to_cell_vecs(struct TheoryVec *cell_vecs, int cell_vec_coun
 			return 0;
 		}
 
+		/* Put the matches back in the order of theory_vecs, so that
+		 * equally good matches come out in the same order as if all
+		 * theory_vecs had been searched */
+		qsort(for_sort, count, sizeof(struct sortme), sort_theory_indices);
+
 		/* Sort in order to get most agreeable matches first */
 		qsort(for_sort, count, sizeof(struct sortme), sort_theory_distances);
 		*match_array = cfmalloc(count*sizeof(struct TheoryVec));
@@ -1695,9 +1841,138 @@ static int match_obs_to_cell_vecs(struct TheoryVec *cell_vecs, int cell_vec_coun
 		cffree(for_sort);
 	}
 
+	update_match_cache(tp, cell);
+
 	return 1;
 }
 
+/* True if there is a theoretical vector with a length within tolerance of
+ * 'len', i.e. if match_obs_to_cell_vecs() would find any matches */
+static int length_has_matches(struct taketwo_private *tp, double len,
+                              double tol)
+{
+	unsigned int k, k_start, k_end;
+
+	k_start = tp->bin_start[length_bin(tp, len - tol)];
+	k_end = tp->bin_start[length_bin(tp, len + tol)+1];
+	for ( k=k_start; k<k_end; k++ ) {
+		if ( fabs(tp->sorted_lens[k] - len) <= tol ) return 1;
+	}
+	return 0;
+}
+
+
+/* The reciprocal lattice points, sorted into a grid of boxes at least as big
+ * as the longest observed vector which could be useful, so that only the
+ * neighbouring boxes need to be searched for the other end of a vector */
+struct rlp_grid
+{
+	double min[3];
+	double size[3];
+	int n[3];
+	int *start;  /**< First entry in 'order' for each box (n_boxes+1) */
+	int *order;  /**< rlp indices, in order of box then index */
+};
+
+
+static void rlp_to_xyz(struct rvec r, double xyz[3])
+{
+	xyz[0] = r.u;
+	xyz[1] = r.v;
+	xyz[2] = r.w;
+}
+
+
+static void grid_box(const struct rlp_grid *g, struct rvec r, int c[3])
+{
+	double xyz[3];
+	int d;
+
+	rlp_to_xyz(r, xyz);
+	for ( d=0; d<3; d++ ) {
+		c[d] = (xyz[d] - g->min[d]) / g->size[d];
+		if ( c[d] < 0 ) c[d] = 0;
+		if ( c[d] >= g->n[d] ) c[d] = g->n[d] - 1;
+	}
+}
+
+
+static int grid_box_index(const struct rlp_grid *g, const int c[3])
+{
+	return (c[2]*g->n[1] + c[1])*g->n[0] + c[0];
+}
+
+
+static int make_rlp_grid(struct rlp_grid *g, struct rvec *rlps, int n,
+                         double size)
+{
+	double max[3];
+	int *pos;
+	int d, i, n_boxes;
+
+	for ( d=0; d<3; d++ ) {
+		g->min[d] = +INFINITY;
+		max[d] = -INFINITY;
+	}
+	for ( i=0; i<n; i++ ) {
+		double xyz[3];
+		rlp_to_xyz(rlps[i], xyz);
+		for ( d=0; d<3; d++ ) {
+			if ( xyz[d] < g->min[d] ) g->min[d] = xyz[d];
+			if ( xyz[d] > max[d] ) max[d] = xyz[d];
+		}
+	}
+
+	for ( d=0; d<3; d++ ) {
+		double extent = max[d] - g->min[d];
+		g->size[d] = size;
+		if ( extent / size >= MAX_GRID_BOXES ) {
+			g->size[d] = extent / (MAX_GRID_BOXES - 1);
+		}
+		g->n[d] = extent / g->size[d] + 1;
+		if ( g->n[d] > MAX_GRID_BOXES ) g->n[d] = MAX_GRID_BOXES;
+	}
+	n_boxes = g->n[0]*g->n[1]*g->n[2];
+
+	g->start = cfcalloc(n_boxes+1, sizeof(int));
+	g->order = cfmalloc(n*sizeof(int));
+	pos = cfmalloc(n*sizeof(int));
+	if ( (g->start == NULL) || (g->order == NULL) || (pos == NULL) ) {
+		cffree(g->start);
+		cffree(g->order);
+		cffree(pos);
+		return 1;
+	}
+
+	/* Counting sort, keeping the rlps in order within each box */
+	for ( i=0; i<n; i++ ) {
+		int c[3];
+		grid_box(g, rlps[i], c);
+		pos[i] = grid_box_index(g, c);
+		g->start[pos[i]+1]++;
+	}
+	for ( i=0; i<n_boxes; i++ ) g->start[i+1] += g->start[i];
+	for ( i=0; i<n; i++ ) {
+		g->order[g->start[pos[i]]++] = i;
+	}
+	for ( i=n_boxes; i>0; i-- ) g->start[i] = g->start[i-1];
+	g->start[0] = 0;
+
+	cffree(pos);
+	return 0;
+}
+
+
+static int compare_ints(const void *av, const void *bv)
+{
+	const int *a = av;
+	const int *b = bv;
+	if ( *a < *b ) return -1;
+	if ( *a > *b ) return 1;
+	return 0;
+}
+
+
 static int compare_spot_vecs(const void *av, const void *bv)
 {
 	struct SpotVec *a = (struct SpotVec *)av;
@@ -1705,54 +1980,133 @@ static int compare_spot_vecs(const void *av, const void *bv)
 	return a->distance > b->distance;
 }
 
+/* Vectors longer than MAX_RECIP_DISTANCE are left out, and so are vectors
+ * which can't match any theoretical vector if --taketwo-skip-unmatched was
+ * given.  The vectors are generated in the same order as if all pairs of rlps
+ * were looked at, but only pairs in neighbouring boxes of a grid are actually
+ * tested. */
 static int gen_observed_vecs(struct rvec *rlps, int rlp_count,
-			     struct TakeTwoCell *cell)
+                             struct TakeTwoCell *cell,
+                             struct taketwo_private *tp)
 {
-	int i, j;
+	struct rlp_grid grid;
+	int *row;
+	int i;
 	int count = 0;
+	int max_count = 0;
+	int skip_unmatched = tp->opts->skip_unmatched;
+	double max_len = MAX_RECIP_DISTANCE;
 
 	/* maximum distance squared for comparisons */
 	double max_sq_length = pow(MAX_RECIP_DISTANCE, 2);
 
+	/* No vector which can match is longer than this */
+	if ( skip_unmatched ) {
+		double max_match = tp->sorted_lens[tp->vec_count-1]
+		                     + cell->len_tol;
+		if ( max_match < max_len ) max_len = max_match;
+	}
+
+	/* A little bigger, to be sure of not missing anything to rounding */
+	if ( make_rlp_grid(&grid, rlps, rlp_count, max_len*(1.0+1e-6)) ) {
+		return 0;
+	}
+
+	row = cfmalloc(rlp_count*sizeof(int));
+	if ( row == NULL ) {
+		cffree(grid.start);
+		cffree(grid.order);
+		return 0;
+	}
+
 	for ( i=0; i<rlp_count-1 && count < MAX_OBS_VECTORS; i++ ) {
-		for ( j=i+1; j<rlp_count; j++ ) {
 
-			/* calculate difference vector between rlps */
-			struct rvec diff = diff_vec(rlps[i], rlps[j]);
+		int c[3], nb[3];
+		int n_row = 0;
+		int k;
 
-			/* are these two far from each other? */
-			double sqlength = sq_length(diff);
+		/* Find the other ends of all the vectors from this rlp */
+		grid_box(&grid, rlps[i], c);
+		for ( nb[2]=c[2]-1; nb[2]<=c[2]+1; nb[2]++ ) {
+		for ( nb[1]=c[1]-1; nb[1]<=c[1]+1; nb[1]++ ) {
+		for ( nb[0]=c[0]-1; nb[0]<=c[0]+1; nb[0]++ ) {
 
-			if ( sqlength > max_sq_length ) continue;
+			int b;
 
-			count++;
+			if ( (nb[0] < 0) || (nb[0] >= grid.n[0])
+			  || (nb[1] < 0) || (nb[1] >= grid.n[1])
+			  || (nb[2] < 0) || (nb[2] >= grid.n[2]) ) continue;
+
+			b = grid_box_index(&grid, nb);
+			for ( k=grid.start[b]; k<grid.start[b+1]; k++ ) {
+
+				int j = grid.order[k];
+				struct rvec diff;
+				double sqlength;
+
+				if ( j <= i ) continue;
 
+				/* calculate difference vector between rlps */
+				diff = diff_vec(rlps[i], rlps[j]);
+
+				/* are these two far from each other? */
+				sqlength = sq_length(diff);
+				if ( sqlength > max_sq_length ) continue;
+
+				if ( skip_unmatched
+				  && !length_has_matches(tp, sqrt(sqlength),
+				                         cell->len_tol) ) continue;
+
+				row[n_row++] = j;
+			}
+		}
+		}
+		}
+
+		if ( n_row == 0 ) continue;
+		qsort(row, n_row, sizeof(int), compare_ints);
+
+		if ( count + n_row > max_count ) {
 			struct SpotVec *temp_obs_vecs;
+			int new_max = 2*max_count;
+			if ( new_max < count + n_row ) new_max = count + n_row;
 			temp_obs_vecs = cfrealloc(cell->obs_vecs,
-			                          count*sizeof(struct SpotVec));
-
+			                          new_max*sizeof(struct SpotVec));
 			if ( temp_obs_vecs == NULL ) {
+				cffree(row);
+				cffree(grid.start);
+				cffree(grid.order);
 				return 0;
-			} else {
-				cell->obs_vecs = temp_obs_vecs;
+			}
+			cell->obs_vecs = temp_obs_vecs;
+			max_count = new_max;
+		}
 
-				/* initialise all SpotVec struct members */
+		for ( k=0; k<n_row; k++ ) {
 
-				struct SpotVec spot_vec;
-				spot_vec.obsvec = diff;
-				spot_vec.distance = sqrt(sqlength);
-				spot_vec.matches = NULL;
-				spot_vec.assignment = -1;
-				spot_vec.match_num = 0;
-				spot_vec.her_rlp = &rlps[i];
-				spot_vec.his_rlp = &rlps[j];
-				spot_vec.in_network = 0;
+			/* initialise all SpotVec struct members */
 
-				cell->obs_vecs[count - 1] = spot_vec;
-			}
+			struct SpotVec spot_vec;
+			int j = row[k];
+			struct rvec diff = diff_vec(rlps[i], rlps[j]);
+
+			spot_vec.obsvec = diff;
+			spot_vec.distance = sqrt(sq_length(diff));
+			spot_vec.matches = NULL;
+			spot_vec.assignment = -1;
+			spot_vec.match_num = 0;
+			spot_vec.her_rlp = &rlps[i];
+			spot_vec.his_rlp = &rlps[j];
+			spot_vec.in_network = 0;
+
+			cell->obs_vecs[count++] = spot_vec;
 		}
 	}
 
+	cffree(row);
+	cffree(grid.start);
+	cffree(grid.order);
+
 	if ( count == 0 ) {
 		ERROR("No observed vectors for cell!\n");
 		return 0;
@@ -1842,6 +2196,66 @@ static int gen_theoretical_vecs(UnitCell *cell, struct TheoryVec **cell_vecs,
 }
 
 
+static int sort_by_length(const void *av, const void *bv)
+{
+	const struct sortme *a = av;
+	const struct sortme *b = bv;
+	if ( a->dist < b->dist ) return -1;
+	if ( a->dist > b->dist ) return 1;
+	return sort_theory_indices(av, bv);
+}
+
+
+/* Sort the theoretical vectors by length, and divide them into bins of
+ * the given width, so that only a few bins have to be looked at to find
+ * the matches for an observed vector. */
+static int bin_theoretical_vecs(struct taketwo_private *tp, double width)
+{
+	struct sortme *by_len;
+	unsigned int i;
+	int bin;
+	double max_len;
+
+	tp->len_order = cfmalloc(tp->vec_count*sizeof(unsigned int));
+	tp->sorted_lens = cfmalloc(tp->vec_count*sizeof(double));
+	by_len = cfmalloc(tp->vec_count*sizeof(struct sortme));
+	if ( (tp->len_order == NULL) || (tp->sorted_lens == NULL)
+	  || (by_len == NULL) ) return 0;
+
+	for ( i=0; i<tp->vec_count; i++ ) {
+		by_len[i].dist = rvec_length(tp->theory_vecs[i].vec);
+		by_len[i].idx = i;
+	}
+	qsort(by_len, tp->vec_count, sizeof(struct sortme), sort_by_length);
+	for ( i=0; i<tp->vec_count; i++ ) {
+		tp->len_order[i] = by_len[i].idx;
+		tp->sorted_lens[i] = by_len[i].dist;
+	}
+	cffree(by_len);
+
+	max_len = (tp->vec_count > 0) ? tp->sorted_lens[tp->vec_count-1] : 0.0;
+	tp->bin_width = width;
+	if ( max_len / width >= MAX_LENGTH_BINS - 1 ) {
+		tp->bin_width = max_len / (MAX_LENGTH_BINS - 1);
+	}
+	tp->n_bins = max_len / tp->bin_width + 1;
+	if ( tp->n_bins > MAX_LENGTH_BINS ) tp->n_bins = MAX_LENGTH_BINS;
+
+	tp->bin_start = cfmalloc((tp->n_bins+1)*sizeof(unsigned int));
+	if ( tp->bin_start == NULL ) return 0;
+
+	i = 0;
+	for ( bin=0; bin<tp->n_bins; bin++ ) {
+		while ( (i < tp->vec_count)
+		     && (length_bin(tp, tp->sorted_lens[i]) < bin) ) i++;
+		tp->bin_start[bin] = i;
+	}
+	tp->bin_start[tp->n_bins] = tp->vec_count;
+
+	return 1;
+}
+
+
 /* ------------------------------------------------------------------------
  * cleanup functions - called from run_taketwo().
  * ------------------------------------------------------------------------*/
@@ -1861,19 +2275,48 @@ static void cleanup_taketwo_cell(struct TakeTwoCell *ttCell)
 {
 	/* n.b. solutions in ttCell are taken care of in the
 	* partial taketwo cleanup. */
-	int i;
-	for ( i=0; i<ttCell->numOps; i++ ) {
-		gsl_matrix_free(ttCell->rotSymOps[i]);
-	}
 	cffree(ttCell->rotSymOps);
+	cffree(ttCell->rot_tmp);
+	cffree(ttCell->score_tmp);
+	cffree(ttCell->obs_members);
+	cffree(ttCell->match_members);
 
 	cleanup_taketwo_obs_vecs(ttCell->obs_vecs,
 	                         ttCell->obs_vec_count);
 
 	gsl_vector_free(ttCell->vec1Tmp);
 	gsl_vector_free(ttCell->vec2Tmp);
-	gsl_matrix_free(ttCell->twiz1Tmp);
-	gsl_matrix_free(ttCell->twiz2Tmp);
+}
+
+
+/* Allocates the scratch space used while growing networks, so that nothing
+ * needs to be allocated inside the seed-growth loop.  Must be called after
+ * the observed vectors have been matched to the theoretical ones. */
+static int alloc_network_scratch(struct TakeTwoCell *ttCell)
+{
+	int i;
+	int n = ttCell->member_thresh + 3;
+
+	if ( ttCell->numOps > n ) n = ttCell->numOps;
+	for ( i=0; i<ttCell->obs_vec_count; i++ ) {
+		if ( ttCell->obs_vecs[i].match_num > n ) {
+			n = ttCell->obs_vecs[i].match_num;
+		}
+	}
+
+	ttCell->rot_tmp = cfmalloc(n*sizeof(struct rot3));
+	ttCell->score_tmp = cfmalloc(n*sizeof(double));
+	ttCell->obs_members = cfmalloc((ttCell->member_thresh+3)*sizeof(int));
+	ttCell->match_members = cfmalloc((ttCell->member_thresh+3)*sizeof(int));
+
+	if ( (ttCell->rot_tmp == NULL) || (ttCell->score_tmp == NULL)
+	  || (ttCell->obs_members == NULL) || (ttCell->match_members == NULL) )
+	{
+		apologise();
+		return 0;
+	}
+
+	return 1;
 }
 
 
@@ -1904,10 +2347,12 @@ static UnitCell *run_taketwo(UnitCell *cell, const struct taketwo_options *opts,
 	ttCell.seed_count = 0;
 	ttCell.rotSymOps = NULL;
 	ttCell.obs_vecs = NULL;
-	ttCell.twiz1Tmp = gsl_matrix_calloc(3, 3);
-	ttCell.twiz2Tmp = gsl_matrix_calloc(3, 3);
 	ttCell.vec1Tmp = gsl_vector_calloc(3);
 	ttCell.vec2Tmp = gsl_vector_calloc(3);
+	ttCell.rot_tmp = NULL;
+	ttCell.score_tmp = NULL;
+	ttCell.obs_members = NULL;
+	ttCell.match_members = NULL;
 	ttCell.numOps = 0;
 	ttCell.obs_vec_count = 0;
 	ttCell.solution = NULL;
@@ -1921,12 +2366,6 @@ static UnitCell *run_taketwo(UnitCell *cell, const struct taketwo_options *opts,
 		return NULL;
 	}
 
-	success = gen_observed_vecs(rlps, rlp_count, &ttCell);
-	if ( !success ) {
-		cleanup_taketwo_cell(&ttCell);
-		return NULL;
-	}
-
 	if ( opts->member_thresh < 0 ) {
 		ttCell.member_thresh = NETWORK_MEMBER_THRESHOLD;
 	} else {
@@ -1951,8 +2390,20 @@ static UnitCell *run_taketwo(UnitCell *cell, const struct taketwo_options *opts,
 		ttCell.trace_tol = sqrt(4.0*(1.0-cos(opts->trace_tol)));
 	}
 
-	success = match_obs_to_cell_vecs(tp->theory_vecs, tp->vec_count,
-					 &ttCell);
+	success = gen_observed_vecs(rlps, rlp_count, &ttCell, tp);
+	if ( !success ) {
+		cleanup_taketwo_cell(&ttCell);
+		return NULL;
+	}
+
+	success = match_obs_to_cell_vecs(tp, &ttCell);
+
+	if ( !success ) {
+		cleanup_taketwo_cell(&ttCell);
+		return NULL;
+	}
+
+	success = alloc_network_scratch(&ttCell);
 
 	if ( !success ) {
 		cleanup_taketwo_cell(&ttCell);
@@ -2029,6 +2480,8 @@ static void partial_taketwo_cleanup(struct taketwo_private *tp)
 	tp->numPrevs = 0;
 	tp->prevSols = NULL;
 
+	free_match_cache(tp);
+	tp->cache_features = NULL;
 }
 
 /* CrystFEL interface hooks */
@@ -2040,6 +2493,7 @@ int taketwo_index(struct image *image, void *priv)
 	struct rvec *rlps;
 	int n_rlps = 0;
 	int i;
+	struct imagefeature_arrays pk;
 	struct taketwo_private *tp = (struct taketwo_private *)priv;
 
 	/* Check serial number against previous for solution tracking */
@@ -2065,15 +2519,22 @@ int taketwo_index(struct image *image, void *priv)
 		tp->xtal_num = image->n_crystals;
 	}
 
-	rlps = cfmalloc((image_feature_count(image->features)+1)*sizeof(struct rvec));
-	for ( i=0; i<image_feature_count(image->features); i++ ) {
+	/* Retries and multi-lattice passes remove peaks from the same list,
+	 * so most observed vectors will have been matched last time */
+	if ( tp->cache_features != image->features ) {
+		free_match_cache(tp);
+		tp->cache_features = image->features;
+	}
+
+	if ( image_feature_list_arrays(image->features, &pk) ) return 0;
+	rlps = cfmalloc((pk.n+1)*sizeof(struct rvec));
+	if ( rlps == NULL ) return 0;
+	for ( i=0; i<pk.n; i++ ) {
 
 		double r[3];
-		struct imagefeature *pk = image_get_feature(image->features, i);
-		if ( pk == NULL ) continue;
 
-		detgeom_transform_coords(&image->detgeom->panels[pk->pn],
-		                         pk->fs, pk->ss, image->lambda,
+		detgeom_transform_coords(&image->detgeom->panels[pk.pn[i]],
+		                         pk.fs[i], pk.ss[i], image->lambda,
 		                         0.0, 0.0, r);
 
 		rlps[n_rlps].u = r[0];
@@ -2158,9 +2619,23 @@ void *taketwo_prepare(IndexingMethod *indm, struct taketwo_options *opts,
 	tp->membership = NULL;
 	tp->vec_count = 0;
 	tp->theory_vecs = NULL;
+	tp->len_order = NULL;
+	tp->sorted_lens = NULL;
+	tp->bin_start = NULL;
+	tp->match_cache = NULL;
+	tp->n_match_cache = 0;
+	tp->cache_features = NULL;
 
 	gen_theoretical_vecs(cell, &tp->theory_vecs, &tp->vec_count);
 
+	if ( !bin_theoretical_vecs(tp, (opts->len_tol < 0.0) ? RECIP_TOLERANCE
+	                                                     : opts->len_tol) )
+	{
+		ERROR("Failed to set up TakeTwo vector lookup\n");
+		taketwo_cleanup((IndexingPrivate *)tp);
+		return NULL;
+	}
+
 	return tp;
 }
 
@@ -2171,6 +2646,9 @@ void taketwo_cleanup(IndexingPrivate *pp)
 
 	partial_taketwo_cleanup(tp);
 	cffree(tp->theory_vecs);
+	cffree(tp->len_order);
+	cffree(tp->sorted_lens);
+	cffree(tp->bin_start);
 
 	cffree(tp);
 }
@@ -2194,6 +2672,9 @@ static void taketwo_show_help()
 "                           Reciprocal space angle tolerance (in degrees)\n"
 "     --taketwo-trace-tolerance\n"
 "                           Rotation matrix equivalence tolerance (in degrees)\n"
+"     --taketwo-skip-unmatched\n"
+"                           Ignore vectors which don't match any cell vector\n"
+"                            length, instead of giving up\n"
 );
 }
 
@@ -2208,6 +2689,7 @@ int taketwo_default_options(struct taketwo_options **opts_ptr)
 	opts->len_tol = -1.0;
 	opts->angle_tol = -1.0;
 	opts->trace_tol = -1.0;
+	opts->skip_unmatched = 0;
 
 	*opts_ptr = opts;
 	return 0;
@@ -2267,6 +2749,10 @@ static error_t taketwo_parse_arg(int key, char *arg,
 		(*opts_ptr)->trace_tol = deg2rad(tmp);
 		break;
 
+		case 6 :
+		(*opts_ptr)->skip_unmatched = 1;
+		break;
+
 		default :
 		return ARGP_ERR_UNKNOWN;
 
@@ -2285,6 +2771,7 @@ static struct argp_option taketwo_options[] = {
 	{"taketwo-len-tolerance", 3, "one_over_A", OPTION_HIDDEN, NULL},
 	{"taketwo-angle-tolerance", 4, "deg", OPTION_HIDDEN, NULL},
 	{"taketwo-trace-tolerance", 5, "deg", OPTION_HIDDEN, NULL},
+	{"taketwo-skip-unmatched", 6, NULL, OPTION_HIDDEN, NULL},
 	{0}
 };
 
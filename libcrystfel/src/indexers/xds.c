@@ -424,7 +424,9 @@ int run_xds(struct image *image, void *priv)
 		_exit(0);
 
 	}
+	indexing_set_child(pid);
 	waitpid(pid, &status, 0);
+	indexing_set_child(0);
 
 	close(pty);
 	rval = read_cell(image);
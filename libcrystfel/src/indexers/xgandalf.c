@@ -77,19 +77,15 @@ int run_xgandalf(struct image *image, void *ipriv)
 	struct xgandalf_private_data *xgandalf_private_data = (struct xgandalf_private_data*) ipriv;
 	reciprocalPeaks_1_per_A_t *reciprocalPeaks_1_per_A = &(xgandalf_private_data->reciprocalPeaks_1_per_A);
 
-	int peakCountMax = image_feature_count(image->features);
+	struct imagefeature_arrays pk;
+	if ( image_feature_list_arrays(image->features, &pk) ) return 0;
+
 	reciprocalPeaks_1_per_A->peakCount = 0;
-	for ( i = 0; i < peakCountMax && i < MAX_PEAK_COUNT_FOR_INDEXER; i++) {
-		struct imagefeature *f;
+	for ( i = 0; i < pk.n && i < MAX_PEAK_COUNT_FOR_INDEXER; i++) {
 		double r[3];
 
-		f = image_get_feature(image->features, i);
-		if (f == NULL) {
-			continue;
-		}
-
-		detgeom_transform_coords(&image->detgeom->panels[f->pn],
-		                         f->fs, f->ss, image->lambda,
+		detgeom_transform_coords(&image->detgeom->panels[pk.pn[i]],
+		                         pk.fs[i], pk.ss[i], image->lambda,
 		                         0.0, 0.0, r);
 
 		reciprocalPeaks_1_per_A->coordinates_x[reciprocalPeaks_1_per_A->peakCount] = r[0] * 1e-10;
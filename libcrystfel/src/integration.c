@@ -46,6 +46,7 @@
 #include "peaks.h"
 #include "integration.h"
 #include "detgeom.h"
+#include "thread-pool.h"
 
 
 /** \file integration.h */
@@ -74,6 +75,11 @@ struct intcontext
 	int n_boxes;
 	int max_boxes;
 
+	/* Box masks from deleted boxes, ready to be used again */
+	enum boxmask_val **spare;
+	int n_spare;
+	int max_spare;
+
 	UnitCell *cell;
 	double k;
 
@@ -82,6 +88,9 @@ struct intcontext
 	double **reference_den;
 	int *n_profiles_in_reference;
 
+	/* Working space for prof2d_fit_batch(), allocated when first used */
+	struct prof2d_batch *batch;
+
 	int ir_inn;
 	int ir_mid;
 	int ir_out;
@@ -102,6 +111,7 @@ struct peak_box
 	int css;
 
 	enum boxmask_val *bm;  /* Box mask */
+	float *px;  /* Pixel values, copied from the image by check_box() */
 
 	int pn;           /* Panel number */
 	struct detgeom_panel *p;  /* The panel itself */
@@ -119,7 +129,7 @@ struct peak_box
 	double pks_q;
 	int m;
 
-	gsl_matrix *bgm;  /* Background estimation matrix */
+	double bgm[3][3];  /* Background estimation matrix */
 
 	/* Measured intensity (tentative, profile fitted or otherwise) */
 	double intensity;
@@ -139,38 +149,177 @@ struct peak_box
 };
 
 
-static void addm(gsl_matrix *m, int i, int j, double val)
+/* Number of boxes fitted together by prof2d_fit_batch(), one for each lane
+ * of the widest current vector unit (eight doubles).  Larger batches would
+ * not fit in the L1 cache, and then gathering the boxes costs more than the
+ * fitting itself. */
+#define PROF2D_BATCH (8)
+
+/* Contiguous copies of the box contents for prof2d_fit_batch().  The pixel
+ * arrays are stored pixel-major, i.e. element [k*PROF2D_BATCH+i] is pixel k of
+ * box i, so that the innermost loops run across the boxes with unit stride
+ * and no dependency between iterations. */
+struct prof2d_batch
+{
+	int n_px;     /* Pixels per box */
+
+	float *px;    /* Pixel values, zero outside the peak and background */
+	float *wpk;   /* 1 in the peak region, 0 elsewhere */
+	float *wbg;   /* 1 in the background region, 0 elsewhere */
+	double *prof; /* Reference profile, zero outside the peak region */
+
+	/* Per-box values */
+	double a[PROF2D_BATCH];
+	double b[PROF2D_BATCH];
+	double c[PROF2D_BATCH];
+	double sj[PROF2D_BATCH];
+	double den[PROF2D_BATCH];
+	double ps[PROF2D_BATCH];
+	double bs[PROF2D_BATCH];
+	double nbg[PROF2D_BATCH];
+	double s2[PROF2D_BATCH];
+	double sb[PROF2D_BATCH];
+	double J[PROF2D_BATCH];
+	double bgmean[PROF2D_BATCH];
+	double bpk[PROF2D_BATCH];    /* Sum of background under peak */
+	double npk[PROF2D_BATCH];    /* Number of peak pixels */
+	double pkmax[PROF2D_BATCH];  /* Highest pixel value in peak */
+};
+
+
+static void free_prof2d_batch(struct prof2d_batch *pb)
 {
-	double v = gsl_matrix_get(m, i, j);
-	gsl_matrix_set(m, i, j, v+val);
+	if ( pb == NULL ) return;
+	cffree(pb->px);
+	cffree(pb->wpk);
+	cffree(pb->wbg);
+	cffree(pb->prof);
+	cffree(pb);
 }
 
 
-static void addv(gsl_vector *v, int i, double val)
+static struct prof2d_batch *alloc_prof2d_batch(int n_px)
 {
-	double k = gsl_vector_get(v, i);
-	gsl_vector_set(v, i, k+val);
+	struct prof2d_batch *pb;
+	size_t n = (size_t)n_px * PROF2D_BATCH;
+
+	pb = cfmalloc(sizeof(struct prof2d_batch));
+	if ( pb == NULL ) return NULL;
+
+	pb->n_px = n_px;
+	pb->px = cfmalloc(n*sizeof(float));
+	pb->wpk = cfmalloc(n*sizeof(float));
+	pb->wbg = cfmalloc(n*sizeof(float));
+	pb->prof = cfmalloc(n*sizeof(double));
+	if ( (pb->px == NULL) || (pb->wpk == NULL) || (pb->wbg == NULL)
+	  || (pb->prof == NULL) )
+	{
+		free_prof2d_batch(pb);
+		return NULL;
+	}
+
+	return pb;
 }
 
 
-static float boxi(struct intcontext *ic, struct peak_box *bx, int p, int q)
+/* Solves M.x = v for the background gradient, without allocating anything.
+ * The matrix is symmetric and positive (semi-)definite, so after rescaling it
+ * to have a unit diagonal, as solve_svd() does, it can be Cholesky-decomposed.
+ * The determinant of the rescaled matrix limits how small its smallest
+ * eigenvalue can be.  If it's too small, solve_svd() would filter some of the
+ * eigenvalues, so this returns non-zero and solve_svd() should be used. */
+static int solve_bg_3x3(double M[3][3], const double v[3], double x[3])
+{
+	double s[3];
+	double A[3][3];
+	double b[3];
+	double l00, l10, l20, l11, l21, l22;
+	double d, det;
+	double y0, y1, y2;
+	double z0, z1, z2;
+	int i, j;
+
+	for ( i=0; i<3; i++ ) {
+		if ( !(M[i][i] > 0.0) ) return 1;
+		s[i] = 1.0/sqrt(M[i][i]);
+	}
+
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			A[i][j] = s[i]*M[i][j]*s[j];
+		}
+		b[i] = s[i]*v[i];
+	}
+
+	l00 = sqrt(A[0][0]);
+	l10 = A[1][0]/l00;
+	l20 = A[2][0]/l00;
+	d = A[1][1] - l10*l10;
+	if ( !(d > 0.0) ) return 1;
+	l11 = sqrt(d);
+	l21 = (A[2][1] - l20*l10)/l11;
+	d = A[2][2] - l20*l20 - l21*l21;
+	if ( !(d > 0.0) ) return 1;
+	l22 = sqrt(d);
+
+	/* The largest eigenvalue is at most 3 (the trace), so the product of
+	 * the other two is at most 2.25, and the smallest one is at least
+	 * det/2.25.  solve_svd() filters below 1e-6 times the largest. */
+	det = l00*l00 * l11*l11 * l22*l22;
+	if ( !(det >= 2.25*3.0e-6) ) return 1;
+
+	y0 = b[0]/l00;
+	y1 = (b[1] - l10*y0)/l11;
+	y2 = (b[2] - l20*y0 - l21*y1)/l22;
+
+	z2 = y2/l22;
+	z1 = (y1 - l21*z2)/l11;
+	z0 = (y0 - l10*z1 - l20*z2)/l00;
+
+	x[0] = s[0]*z0;
+	x[1] = s[1]*z1;
+	x[2] = s[2]*z2;
+
+	return 0;
+}
+
+
+static void solve_bg_svd(double M[3][3], const double v[3], double x[3])
 {
-	int fs, ss;
+	gsl_matrix *m;
+	gsl_vector *gv;
+	gsl_vector *ans;
+	int i, j;
+
+	m = gsl_matrix_alloc(3, 3);
+	gv = gsl_vector_alloc(3);
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) gsl_matrix_set(m, i, j, M[i][j]);
+		gsl_vector_set(gv, i, v[i]);
+	}
+
+	ans = solve_svd(gv, m, NULL, 0);
+	gsl_matrix_free(m);
+	gsl_vector_free(gv);
+
+	if ( ans == NULL ) {
+		x[0] = 0.0;  x[1] = 0.0;  x[2] = 0.0;
+		return;
+	}
 
-	fs = bx->cfs + p;
-	ss = bx->css + q;
+	for ( i=0; i<3; i++ ) x[i] = gsl_vector_get(ans, i);
+	gsl_vector_free(ans);
+}
 
-	assert(fs >= 0);
-	assert(fs < bx->p->w);
-	assert(ss >= 0);
-	assert(ss < bx->p->h);
 
+static float boxi(struct intcontext *ic, struct peak_box *bx, int p, int q)
+{
 	assert(p >= 0);
 	assert(p < ic->w);
 	assert(q >= 0);
 	assert(q < ic->w);
 
-	return ic->image->dp[bx->pn][fs + bx->p->w*ss];
+	return bx->px[p + ic->w*q];
 }
 
 
@@ -308,10 +457,8 @@ static void show_peak_box(struct intcontext *ic, struct peak_box *bx,
 static void fit_gradient_bg(struct intcontext *ic, struct peak_box *bx)
 {
 	int p, q;
-	gsl_vector *v;
-	gsl_vector *ans;
-
-	v = gsl_vector_calloc(3);
+	double v[3] = {0.0, 0.0, 0.0};
+	double ans[3];
 
 	for ( p=0; p<ic->w; p++ ) {
 	for ( q=0; q<ic->w; q++ ) {
@@ -321,24 +468,23 @@ static void fit_gradient_bg(struct intcontext *ic, struct peak_box *bx)
 			double bi;
 			bi = boxi(ic, bx, p, q);
 
-			addv(v, 0, bi*p);
-			addv(v, 1, bi*q);
-			addv(v, 2, bi);
+			v[0] += bi*p;
+			v[1] += bi*q;
+			v[2] += bi;
 
 		}
 
 	}
 	}
 
-	/* SVD is massive overkill here, but the routine is right there. */
-	ans = solve_svd(v, bx->bgm, NULL, 0);
-	gsl_vector_free(v);
-
-	bx->a = gsl_vector_get(ans, 0);
-	bx->b = gsl_vector_get(ans, 1);
-	bx->c = gsl_vector_get(ans, 2);
+	/* SVD is only needed if the background region is a strange shape */
+	if ( solve_bg_3x3(bx->bgm, v, ans) ) {
+		solve_bg_svd(bx->bgm, v, ans);
+	}
 
-	gsl_vector_free(ans);
+	bx->a = ans[0];
+	bx->b = ans[1];
+	bx->c = ans[2];
 }
 
 
@@ -402,14 +548,60 @@ static int alloc_boxes(struct intcontext *ic, int new_max_boxes)
 }
 
 
+/* Keeps the memory from a box for the next one */
+static void release_box_mem(struct intcontext *ic, struct peak_box *bx)
+{
+	if ( bx->bm == NULL ) return;
+
+	if ( ic->n_spare == ic->max_spare ) {
+		enum boxmask_val **spare_new;
+		int max_new = ic->max_spare + 32;
+		spare_new = cfrealloc(ic->spare,
+		                      max_new*sizeof(enum boxmask_val *));
+		if ( spare_new == NULL ) {
+			cffree(bx->bm);
+			return;
+		}
+		ic->spare = spare_new;
+		ic->max_spare = max_new;
+	}
+
+	ic->spare[ic->n_spare++] = bx->bm;
+}
+
+
+static void free_box_mem(struct intcontext *ic)
+{
+	int i;
+
+	for ( i=0; i<ic->n_boxes; i++ ) {
+		cffree(ic->boxes[i].bm);
+	}
+	ic->n_boxes = 0;
+
+	for ( i=0; i<ic->n_spare; i++ ) {
+		cffree(ic->spare[i]);
+	}
+	ic->n_spare = 0;
+}
+
+
 static void setup_ring_masks(struct intcontext *ic,
-                             double ir_inn,
-                             double ir_mid,
-                             double ir_out)
+                             int ir_inn,
+                             int ir_mid,
+                             int ir_out)
 {
 	double lim_sq, out_lim_sq, mid_lim_sq;
 	int p, q;
 
+	/* Nothing to do if the radii haven't changed */
+	if ( (ic->ir_inn == ir_inn) && (ic->ir_mid == ir_mid)
+	  && (ic->ir_out == ir_out) ) return;
+
+	ic->ir_inn = ir_inn;
+	ic->ir_mid = ir_mid;
+	ic->ir_out = ir_out;
+
 	lim_sq = pow(ir_inn, 2.0);
 	mid_lim_sq = pow(ir_mid, 2.0);
 	out_lim_sq = pow(ir_out, 2.0);
@@ -458,95 +650,167 @@ void intcontext_set_diag(struct intcontext *ic,
 }
 
 
-struct intcontext *intcontext_new(struct image *image,
-                                  UnitCell *cell,
-                                  IntegrationMethod meth,
-                                  int ir_inn, int ir_mid, int ir_out,
-                                  int **masks)
+static void free_box_size_arrays(struct intcontext *ic)
 {
 	int i;
-	struct intcontext *ic;
 
-	ic = cfmalloc(sizeof(struct intcontext));
-	if ( ic == NULL ) return NULL;
+	if ( ic->reference_profiles != NULL ) {
+		for ( i=0; i<ic->n_reference_profiles; i++ ) {
+			cffree(ic->reference_profiles[i]);
+		}
+	}
+	if ( ic->reference_den != NULL ) {
+		for ( i=0; i<ic->n_reference_profiles; i++ ) {
+			cffree(ic->reference_den[i]);
+		}
+	}
+	cffree(ic->reference_profiles);
+	cffree(ic->reference_den);
+	cffree(ic->n_profiles_in_reference);
+	cffree(ic->bm);
+	free_prof2d_batch(ic->batch);
+	ic->reference_profiles = NULL;
+	ic->reference_den = NULL;
+	ic->n_profiles_in_reference = NULL;
+	ic->bm = NULL;
+	ic->batch = NULL;
+}
+
+
+/* Allocates everything which depends on the box size */
+static int alloc_box_size_arrays(struct intcontext *ic, int ir_out)
+{
+	int i;
 
 	ic->halfw = ir_out;
-	ic->image = image;
-	ic->k = 1.0/image->lambda;
-	ic->meth = meth;
-	ic->n_saturated = 0;
-	ic->n_implausible = 0;
-	ic->cell = cell;
-	ic->masks = masks;
-	ic->int_diag = INTDIAG_NONE;
 	ic->w = 2*ic->halfw + 1;
 
+	/* Force the ring masks to be calculated */
+	ic->ir_inn = -1;
+	ic->ir_mid = -1;
+	ic->ir_out = -1;
+
 	ic->bm = cfmalloc(ic->w * ic->w * sizeof(enum boxmask_val));
 	if ( ic->bm == NULL ) {
 		ERROR("Failed to allocate box mask.\n");
-		cffree(ic);
-		return NULL;
+		return 1;
 	}
 
 	/* How many reference profiles? */
 	ic->n_reference_profiles = 1;
 	ic->reference_profiles = cfcalloc(ic->n_reference_profiles,
 	                                  sizeof(double *));
-	if ( ic->reference_profiles == NULL ) {
-		cffree(ic);
-		return NULL;
-	}
+	if ( ic->reference_profiles == NULL ) return 1;
 	ic->reference_den = cfcalloc(ic->n_reference_profiles, sizeof(double *));
-	if ( ic->reference_den == NULL ) {
-		cffree(ic);
-		return NULL;
-	}
+	if ( ic->reference_den == NULL ) return 1;
 	ic->n_profiles_in_reference = cfcalloc(ic->n_reference_profiles,
 	                                       sizeof(int));
-	if ( ic->n_profiles_in_reference == NULL ) {
-		cffree(ic);
-		return NULL;
-	}
+	if ( ic->n_profiles_in_reference == NULL ) return 1;
 	for ( i=0; i<ic->n_reference_profiles; i++ ) {
 		ic->reference_profiles[i] = cfmalloc(ic->w*ic->w*sizeof(double));
-		if ( ic->reference_profiles[i] == NULL ) return NULL;
+		if ( ic->reference_profiles[i] == NULL ) return 1;
 		ic->reference_den[i] = cfmalloc(ic->w*ic->w*sizeof(double));
-		if ( ic->reference_den[i] == NULL ) return NULL;
+		if ( ic->reference_den[i] == NULL ) return 1;
 	}
-	zero_profiles(ic);
 
+	return 0;
+}
+
+
+struct intcontext *intcontext_new(struct image *image,
+                                  UnitCell *cell,
+                                  IntegrationMethod meth,
+                                  int ir_inn, int ir_mid, int ir_out,
+                                  int **masks)
+{
+	struct intcontext *ic;
+
+	ic = cfmalloc(sizeof(struct intcontext));
+	if ( ic == NULL ) return NULL;
+
+	ic->bm = NULL;
+	ic->reference_profiles = NULL;
+	ic->reference_den = NULL;
+	ic->n_profiles_in_reference = NULL;
+	ic->batch = NULL;
 	ic->boxes = NULL;
 	ic->n_boxes = 0;
 	ic->max_boxes = 0;
-	if ( alloc_boxes(ic, 32) ) {
-		cffree(ic);
+	ic->spare = NULL;
+	ic->n_spare = 0;
+	ic->max_spare = 0;
+
+	if ( alloc_box_size_arrays(ic, ir_out) || alloc_boxes(ic, 32) ) {
+		intcontext_free(ic);
 		return NULL;
 	}
 
-	setup_ring_masks(ic, ir_inn, ir_mid, ir_out);
+	intcontext_reset(ic, image, cell, meth, ir_inn, ir_mid, ir_out, masks);
 
 	return ic;
 }
 
 
-void intcontext_free(struct intcontext *ic)
+/**
+ * \param ic: An integration context from intcontext_new()
+ * \param image: The image for the next integration
+ * \param cell: The unit cell for the next integration
+ * \param meth: The integration method
+ * \param ir_inn: Inner integration radius
+ * \param ir_mid: Middle integration radius
+ * \param ir_out: Outer integration radius
+ * \param masks: Peak location masks from make_BgMask(), one per panel
+ *
+ * Prepares \p ic for integrating another crystal, possibly on a different
+ * image, as if it had just been created with intcontext_new().  The memory
+ * for the peak boxes is kept for re-use, and the ring masks are only
+ * re-calculated if the radii have changed.
+ *
+ * \returns zero on success, non-zero on error.  If there is an error, \p ic
+ * can only be freed with intcontext_free().
+ */
+int intcontext_reset(struct intcontext *ic, struct image *image,
+                     UnitCell *cell, IntegrationMethod meth,
+                     int ir_inn, int ir_mid, int ir_out, int **masks)
 {
 	int i;
 
+	/* Keep the memory from the previous boxes */
 	for ( i=0; i<ic->n_boxes; i++ ) {
-		cffree(ic->boxes[i].bm);
-		gsl_matrix_free(ic->boxes[i].bgm);
+		release_box_mem(ic, &ic->boxes[i]);
 	}
-	cffree(ic->boxes);
+	ic->n_boxes = 0;
 
-	for ( i=0; i<ic->n_reference_profiles; i++ ) {
-		cffree(ic->reference_profiles[i]);
-		cffree(ic->reference_den[i]);
+	/* A different box size needs everything to be allocated again */
+	if ( ir_out != ic->halfw ) {
+		free_box_mem(ic);
+		free_box_size_arrays(ic);
+		if ( alloc_box_size_arrays(ic, ir_out) ) return 1;
 	}
-	cffree(ic->reference_profiles);
-	cffree(ic->reference_den);
-	cffree(ic->n_profiles_in_reference);
-	cffree(ic->bm);
+
+	ic->image = image;
+	ic->k = 1.0/image->lambda;
+	ic->meth = meth;
+	ic->n_saturated = 0;
+	ic->n_implausible = 0;
+	ic->cell = cell;
+	ic->masks = masks;
+	ic->int_diag = INTDIAG_NONE;
+
+	zero_profiles(ic);
+	setup_ring_masks(ic, ir_inn, ir_mid, ir_out);
+
+	return 0;
+}
+
+
+void intcontext_free(struct intcontext *ic)
+{
+	if ( ic == NULL ) return;
+	free_box_mem(ic);
+	cffree(ic->boxes);
+	cffree(ic->spare);
+	free_box_size_arrays(ic);
 	cffree(ic);
 }
 
@@ -565,7 +829,6 @@ static struct peak_box *add_box(struct intcontext *ic)
 
 	ic->boxes[idx].cfs = 0;
 	ic->boxes[idx].css = 0;
-	ic->boxes[idx].bm = NULL;
 	ic->boxes[idx].pn = -1;
 	ic->boxes[idx].p = NULL;
 	ic->boxes[idx].a = 0.0;
@@ -577,11 +840,13 @@ static struct peak_box *add_box(struct intcontext *ic)
 	ic->boxes[idx].rp = -1;
 	ic->boxes[idx].refl = NULL;
 
-	ic->boxes[idx].bgm = gsl_matrix_calloc(3, 3);
-	if ( ic->boxes[idx].bgm == NULL ) {
-		ERROR("Failed to initialise matrix.\n");
-		return NULL;
+	/* The box mask will be allocated by check_box(), if necessary */
+	if ( ic->n_spare > 0 ) {
+		ic->boxes[idx].bm = ic->spare[--ic->n_spare];
+	} else {
+		ic->boxes[idx].bm = NULL;
 	}
+	memset(ic->boxes[idx].bgm, 0, sizeof(ic->boxes[idx].bgm));
 
 	return &ic->boxes[idx];
 }
@@ -604,8 +869,7 @@ static void delete_box(struct intcontext *ic, struct peak_box *bx)
 		return;
 	}
 
-	cffree(bx->bm);
-	gsl_matrix_free(bx->bgm);
+	release_box_mem(ic, bx);
 
 	memmove(&ic->boxes[i], &ic->boxes[i+1],
 	        (ic->n_boxes-i-1)*sizeof(struct peak_box));
@@ -744,15 +1008,7 @@ static void setup_peak_integrals(struct intcontext *ic, struct peak_box *bx)
 	bx->pks_q = 0.0;
 	bx->m = 0;
 
-	gsl_matrix_set(bx->bgm, 0, 0, 0.0);
-	gsl_matrix_set(bx->bgm, 0, 1, 0.0);
-	gsl_matrix_set(bx->bgm, 0, 2, 0.0);
-	gsl_matrix_set(bx->bgm, 1, 0, 0.0);
-	gsl_matrix_set(bx->bgm, 1, 1, 0.0);
-	gsl_matrix_set(bx->bgm, 1, 2, 0.0);
-	gsl_matrix_set(bx->bgm, 2, 0, 0.0);
-	gsl_matrix_set(bx->bgm, 2, 1, 0.0);
-	gsl_matrix_set(bx->bgm, 2, 2, 0.0);
+	memset(bx->bgm, 0, sizeof(bx->bgm));
 
 	for ( p=0; p<ic->w; p++ ) {
 	for ( q=0; q<ic->w; q++ ) {
@@ -764,15 +1020,15 @@ static void setup_peak_integrals(struct intcontext *ic, struct peak_box *bx)
 			break;
 
 			case BM_BG :
-			addm(bx->bgm, 0, 0, p*p);
-			addm(bx->bgm, 0, 1, p*q);
-			addm(bx->bgm, 0, 2, p);
-			addm(bx->bgm, 1, 0, p*q);
-			addm(bx->bgm, 1, 1, q*q);
-			addm(bx->bgm, 1, 2, q);
-			addm(bx->bgm, 2, 0, p);
-			addm(bx->bgm, 2, 1, q);
-			addm(bx->bgm, 2, 2, 1);
+			bx->bgm[0][0] += p*p;
+			bx->bgm[0][1] += p*q;
+			bx->bgm[0][2] += p;
+			bx->bgm[1][0] += p*q;
+			bx->bgm[1][1] += q*q;
+			bx->bgm[1][2] += q;
+			bx->bgm[2][0] += p;
+			bx->bgm[2][1] += q;
+			bx->bgm[2][2] += 1;
 			break;
 
 			case BM_PK :
@@ -803,9 +1059,20 @@ static int check_box(struct intcontext *ic, struct peak_box *bx, int *sat)
 
 	if ( sat != NULL ) *sat = 0;
 
-	bx->bm = cfmalloc(ic->w*ic->w*sizeof(enum boxmask_val));
+	/* The pixel values go in the same block of memory as the box mask,
+	 * so that they are kept together when the box is re-used */
 	if ( bx->bm == NULL ) {
-		ERROR("Failed to allocate box mask\n");
+		bx->bm = cfmalloc(ic->w*ic->w*(sizeof(enum boxmask_val)
+		                               + sizeof(float)));
+		if ( bx->bm == NULL ) {
+			ERROR("Failed to allocate box mask\n");
+			return 1;
+		}
+	}
+	bx->px = (float *)&bx->bm[ic->w*ic->w];
+
+	if ( (bx->cfs < 0) || (bx->cfs+ic->w > bx->p->w)
+	  || (bx->css < 0) || (bx->css+ic->w > bx->p->h) ) {
 		return 1;
 	}
 
@@ -815,78 +1082,71 @@ static int check_box(struct intcontext *ic, struct peak_box *bx, int *sat)
 	                   &cdx, &cdy, &cdz);
 	get_indices(bx->refl, &hr, &kr, &lr);
 
+	/* Gather the pixel values, and fold the bad pixel, peak location and
+	 * saturation information into the box mask, in one pass along the
+	 * rows of the image */
 	bx->peak = -INFINITY;
-	for ( p=0; p<ic->w; p++ ) {
 	for ( q=0; q<ic->w; q++ ) {
 
-		int fs, ss;
-		float lsat;
+		long int row = bx->cfs + bx->p->w*(long int)(bx->css + q);
+		const float *dp = &ic->image->dp[bx->pn][row];
+		const uint8_t *bad = &ic->image->bad[bx->pn][row];
+		const int *masks = NULL;
+		const float *satmap = NULL;
 
-		fs = bx->cfs + p;
-		ss = bx->css + q;
-
-		if ( (fs < 0) || (fs >= bx->p->w)
-		  || (ss < 0) || (ss >= bx->p->h) ) {
-			return 1;
+		if ( ic->masks != NULL ) masks = &ic->masks[bx->pn][row];
+		if ( ic->image->sat != NULL ) {
+			satmap = &ic->image->sat[bx->pn][row];
 		}
 
-		bx->bm[p+ic->w*q] = ic->bm[p+ic->w*q];
+		for ( p=0; p<ic->w; p++ ) {
+
+			enum boxmask_val b = ic->bm[p+ic->w*q];
+			float val = dp[p];
+			float lsat;
 
-		if ( ic->image->bad[bx->pn][fs + bx->p->w*ss] ) {
-			bx->bm[p+ic->w*q] = BM_BH;
-		}
+			bx->px[p+ic->w*q] = val;
 
-		/* If this is a background pixel, it shouldn't contain any
-		 * pixels which are in the peak region of ANY reflection */
-		if ( ic->masks != NULL ) {
+			if ( bad[p] ) b = BM_BH;
 
-			switch ( bx->bm[p+ic->w*q] ) {
+			/* If this is a background pixel, it shouldn't contain
+			 * any pixels which are in the peak region of ANY
+			 * reflection */
+			if ( masks != NULL ) {
 
-				case BM_BG:
-				case BM_IG:
-				if ( ic->masks[bx->pn][fs + bx->p->w*ss] > 0 ) {
-					bx->bm[p+ic->w*q] = BM_BH;
-				}
-				break;
+				switch ( b ) {
 
-				case BM_PK:
-				if ( ic->masks[bx->pn][fs + bx->p->w*ss] > 1 ) {
-					bx->bm[p+ic->w*q] = BM_BH;
-				}
-				break;
+					case BM_BG:
+					case BM_IG:
+					if ( masks[p] > 0 ) b = BM_BH;
+					break;
 
-				case BM_BH:
-				break;
+					case BM_PK:
+					if ( masks[p] > 1 ) b = BM_BH;
+					break;
 
+					case BM_BH:
+					break;
+
+				}
 			}
-		}
 
-		/* Per-pixel saturation value */
-		if ( ic->image->sat != NULL ) {
-			lsat = ic->image->sat[bx->pn][fs + bx->p->w*ss];
-		} else {
-			lsat = INFINITY;
-		}
-		if ( (bx->bm[p+ic->w*q] != BM_IG)
-		  && (bx->bm[p+ic->w*q] != BM_BH)
-		  && ((boxi(ic, bx, p, q) > bx->p->max_adu)
-		  || (boxi(ic, bx, p, q) > lsat)) )
-		{
-			if ( sat != NULL ) *sat = 1;
-		}
+			bx->bm[p+ic->w*q] = b;
 
-		/* Find brightest pixel */
-		if ( (bx->bm[p+ic->w*q] != BM_IG)
-		  && (bx->bm[p+ic->w*q] != BM_BH)
-		  && (boxi(ic, bx, p, q) > bx->peak) )
-		{
-			bx->peak = boxi(ic, bx, p, q);
-		}
+			if ( b == BM_PK ) n_pk++;
+			if ( b == BM_BG ) n_bg++;
+			if ( (b == BM_IG) || (b == BM_BH) ) continue;
 
-		if ( bx->bm[p+ic->w*q] == BM_PK ) n_pk++;
-		if ( bx->bm[p+ic->w*q] == BM_BG ) n_bg++;
+			/* Per-pixel saturation value */
+			lsat = (satmap != NULL) ? satmap[p] : INFINITY;
+			if ( (val > bx->p->max_adu) || (val > lsat) ) {
+				if ( sat != NULL ) *sat = 1;
+			}
 
-	}
+			/* Find brightest pixel */
+			if ( val > bx->peak ) bx->peak = val;
+
+		}
 	}
 
 	setup_peak_integrals(ic, bx);
@@ -916,7 +1176,7 @@ static double fit_J(struct intcontext *ic, struct peak_box *bx)
 
 		sum += bi*P;
 		sum += - bx->a*p*P - bx->b*q*P - bx->c*P;
-		den += pow(P, 2.0);
+		den += P*P;
 
 	}
 	}
@@ -980,7 +1240,6 @@ static int center_and_check_box(struct intcontext *ic, struct peak_box *bx,
 		t_offs_fs += ifs;
 		t_offs_ss += iss;
 
-		cffree(bx->bm);
 		if ( check_box(ic, bx, sat) ) {
 			return 1;
 		}
@@ -1046,7 +1305,7 @@ static double calc_sigma(struct intcontext *ic, struct peak_box *bx)
 			p1 = bx->J * ic->reference_profiles[bx->rp][p+ic->w*q];
 
 			p2 = bi - bx->a*p - bx->b*q - bx->c;
-			sum += pow(p1-p2, 2.0);
+			sum += (p1-p2)*(p1-p2);
 
 		} else if ( bx->bm[p + ic->w*q] == BM_BG ) {
 
@@ -1067,7 +1326,7 @@ static double calc_sigma(struct intcontext *ic, struct peak_box *bx)
 
 		if ( bx->bm[p + ic->w*q] != BM_BG ) continue;
 		bi = boxi(ic, bx, p, q);
-		sigb2 += pow(bi - mb, 2.0);
+		sigb2 += (bi-mb)*(bi-mb);
 
 	}
 	}
@@ -1152,11 +1411,11 @@ static double peak_height(struct intcontext *ic, struct peak_box *bx)
 }
 
 
-static int bg_ok(struct intcontext *ic, struct peak_box *bx)
+static int bg_gradient_ok(struct peak_box *bx, double height, double bg)
 {
 	double max_grad;
 
-	max_grad = fabs((peak_height(ic, bx) - bg_under_peak(ic, bx))) / 10.0;
+	max_grad = fabs(height - bg) / 10.0;
 
 	if ( (fabs(bx->a) > max_grad) || (fabs(bx->b) > max_grad) ) {
 		return 0;
@@ -1166,6 +1425,12 @@ static int bg_ok(struct intcontext *ic, struct peak_box *bx)
 }
 
 
+static int bg_ok(struct intcontext *ic, struct peak_box *bx)
+{
+	return bg_gradient_ok(bx, peak_height(ic, bx), bg_under_peak(ic, bx));
+}
+
+
 static int suitable_reference(struct intcontext *ic, struct peak_box *bx)
 {
 	int height_ok;
@@ -1220,19 +1485,13 @@ static int get_int_diag(struct intcontext *ic, Reflection *refl)
 
 
 
-static void integrate_prof2d_once(struct intcontext *ic, struct peak_box *bx,
-                                  pthread_mutex_t *term_lock)
+static void finish_prof2d_box(struct intcontext *ic, struct peak_box *bx,
+                              int ok, double bgmean,
+                              pthread_mutex_t *term_lock)
 {
-	bx->intensity = fit_intensity(ic, bx);
-	bx->sigma = calc_sigma(ic, bx);
-
-	if ( bg_ok(ic, bx) ) {
+	if ( ok ) {
 
 		double pfs, pss;
-		double bgmean;
-		double sig2_bg;  /* unused */
-
-		mean_var_area(ic, bx, BM_BG, &bgmean, &sig2_bg);
 
 		set_intensity(bx->refl, bx->intensity);
 		set_esd_intensity(bx->refl, bx->sigma);
@@ -1263,129 +1522,401 @@ static void integrate_prof2d_once(struct intcontext *ic, struct peak_box *bx,
 }
 
 
-static void setup_profile_boxes(struct intcontext *ic, RefList *list)
+static void integrate_prof2d_once(struct intcontext *ic, struct peak_box *bx,
+                                  pthread_mutex_t *term_lock)
 {
-	Reflection *refl;
-	RefListIterator *iter;
+	double bgmean;
+	double sig2_bg;  /* unused */
 
-	for ( refl = first_refl(list, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
-	{
-		double pfs, pss;
-		struct peak_box *bx;
-		int pn;
-		int fid_fs, fid_ss;  /* Center coordinates, rounded,
-		                      * in overall data block */
-		int cfs, css;  /* Corner coordinates */
-		int saturated;
-		int r;
+	bx->intensity = fit_intensity(ic, bx);
+	bx->sigma = calc_sigma(ic, bx);
+	mean_var_area(ic, bx, BM_BG, &bgmean, &sig2_bg);
 
-		set_redundancy(refl, 0);
+	finish_prof2d_box(ic, bx, bg_ok(ic, bx), bgmean, term_lock);
+}
 
-		get_detector_pos(refl, &pfs, &pss);
-		pn = get_panel_number(refl);
-
-		/* Explicit truncation of digits after the decimal point.
-		 * This is actually the correct thing to do here, not
-		 * e.g. lrint().  pfs/pss is the position of the spot, measured
-		 * in numbers of pixels, from the panel corner (not the center
-		 * of the first pixel).  So any coordinate from 2.0 to 2.9999
-		 * belongs to pixel index 2. */
-		fid_fs = pfs;
-		fid_ss = pss;
-
-		cfs = fid_fs - ic->halfw;
-		css = fid_ss - ic->halfw;
-
-		/* Add the box */
-		bx = add_box(ic);
-		bx->refl = refl;
-		bx->cfs = cfs;
-		bx->css = css;
-		bx->p = &ic->image->detgeom->panels[pn];
-		bx->pn = pn;
-
-		/* Which reference profile? */
-		bx->rp = 0;//bx->pn;
-
-		if ( ic->meth & INTEGRATION_CENTER ) {
-			r = center_and_check_box(ic, bx, &saturated);
-		} else {
-			r = check_box(ic, bx, &saturated);
-			bx->offs_fs = 0.0;
-			bx->offs_ss = 0.0;
-		}
-		if ( r ) {
-			delete_box(ic, bx);
-			continue;
-		}
 
-		if ( saturated ) {
-			ic->n_saturated++;
-			if ( !(ic->meth & INTEGRATION_SATURATED) ) {
-				delete_box(ic, bx);
-				continue;
-			}
-		}
+/* One pixel (p,q) of nv boxes, for prof2d_fit_batch().  The pointers are
+ * restrict-qualified function parameters so that the compiler knows it can
+ * vectorise the loop without checking for overlaps. */
+static void prof2d_sums(int nv, double p, double q,
+                        const float *restrict px,
+                        const float *restrict wpk,
+                        const float *restrict wbg,
+                        const double *restrict prof,
+                        const double *restrict a,
+                        const double *restrict b,
+                        const double *restrict c,
+                        double *restrict sj, double *restrict den,
+                        double *restrict ps, double *restrict bs,
+                        double *restrict nbg, double *restrict bpk,
+                        double *restrict npk, double *restrict pkmax)
+{
+	int i;
 
-		fit_bg(ic, bx);
+	for ( i=0; i<nv; i++ ) {
+		double P = prof[i];
+		double bg = a[i]*p + b[i]*q + c[i];
+		double d = px[i] - bg;
+		double v = wpk[i]*px[i];
+		sj[i] += d*P;
+		den[i] += P*P;
+		ps[i] += P;
+		bs[i] += wbg[i]*px[i];
+		nbg[i] += wbg[i];
+		bpk[i] += wpk[i]*bg;
+		npk[i] += wpk[i];
+		pkmax[i] = (v > pkmax[i]) ? v : pkmax[i];
+	}
+}
 
-		bx->intensity = tentative_intensity(ic, bx);
-		set_intensity(refl, bx->intensity);
 
-		if ( suitable_reference(ic, bx) ) {
-			add_to_reference_profile(ic, bx);
-		}
+static void prof2d_residuals(int nv, double p, double q,
+                             const float *restrict px,
+                             const float *restrict wpk,
+                             const float *restrict wbg,
+                             const double *restrict prof,
+                             const double *restrict a,
+                             const double *restrict b,
+                             const double *restrict c,
+                             const double *restrict J,
+                             const double *restrict bgmean,
+                             double *restrict s2, double *restrict sb)
+{
+	int i;
+
+	for ( i=0; i<nv; i++ ) {
+		double d = px[i] - (a[i]*p + b[i]*q + c[i]);
+		double r = J[i]*prof[i] - wpk[i]*d;
+		double e = px[i] - bgmean[i];
+		s2[i] += r*r;
+		sb[i] += wbg[i]*e*e;
 	}
 }
 
 
-void integrate_prof2d(IntegrationMethod meth,
-                      Crystal *cr, RefList *list,
-                      struct image *image, IntDiag int_diag,
-                      signed int idh, signed int idk, signed int idl,
-                      double ir_inn, double ir_mid, double ir_out,
-                      pthread_mutex_t *term_lock, int **masks)
+/* Does the same as fit_intensity(), calc_sigma(), the background part of
+ * mean_var_area() and the sums for bg_ok() for up to PROF2D_BATCH boxes at
+ * once.  The masks and profiles are folded into weights while gathering the
+ * boxes, after which the sums are simple element-wise operations across the
+ * boxes, which the compiler can vectorise.
+ *
+ * The pixels are summed in a different order to the per-box functions, and
+ * the background is subtracted before multiplying by the profile instead of
+ * afterwards, so the results differ from them by rounding only.  The
+ * difference in the intensity or its sigma is less than 10^-12 times the
+ * larger of the two. */
+static int prof2d_fit_batch(struct intcontext *ic, struct peak_box *boxes,
+                            int n)
 {
-	UnitCell *cell;
-	struct intcontext *ic;
-	int i;
+	struct prof2d_batch *pb;
+	const int nv = PROF2D_BATCH;
+	int sz = ic->w*ic->w;
+	int i, k;
 
-	cell = crystal_get_cell(cr);
+	assert(n <= PROF2D_BATCH);
 
-	ic = intcontext_new(image, cell, meth,
-	                    ir_inn, ir_mid, ir_out,
-	                    masks);
-	if ( ic == NULL ) {
-		ERROR("Failed to initialise integration.\n");
-		return;
+	if ( ic->batch == NULL ) {
+		ic->batch = alloc_prof2d_batch(sz);
+		if ( ic->batch == NULL ) return 1;
 	}
+	pb = ic->batch;
+	assert(pb->n_px == sz);
 
-	intcontext_set_diag(ic, int_diag, idh, idk, idl);
-	setup_profile_boxes(ic, list);
-	calculate_reference_profiles(ic);
+	/* A short batch is padded with empty boxes */
+	for ( k=0; k<sz; k++ ) {
+		for ( i=0; i<nv; i++ ) {
+
+			int pk, bg;
+
+			if ( i >= n ) {
+				pb->px[k*nv+i] = 0.0f;
+				pb->wpk[k*nv+i] = 0.0f;
+				pb->wbg[k*nv+i] = 0.0f;
+				pb->prof[k*nv+i] = 0.0;
+				continue;
+			}
+
+			pk = (boxes[i].bm[k] == BM_PK);
+			bg = (boxes[i].bm[k] == BM_BG);
+
+			/* Anything outside the peak and background regions
+			 * might be NaN, which would survive multiplication by
+			 * a zero weight */
+			pb->px[k*nv+i] = (pk || bg) ? boxes[i].px[k] : 0.0f;
+			pb->wpk[k*nv+i] = pk;
+			pb->wbg[k*nv+i] = bg;
+			pb->prof[k*nv+i] = pk ? ic->reference_profiles[boxes[i].rp][k]
+			                      : 0.0;
 
-	for ( i=0; i<ic->n_reference_profiles; i++ ) {
-		if ( ic->n_profiles_in_reference[i] == 0 ) {
-			ERROR("Reference profile %i has no contributions.\n",
-			      i);
-			intcontext_free(ic);
-			return;
 		}
 	}
 
-	for ( i=0; i<ic->n_boxes; i++ ) {
-		struct peak_box *bx;
-		bx = &ic->boxes[i];
-		integrate_prof2d_once(ic, bx, term_lock);
+	for ( i=0; i<nv; i++ ) {
+		pb->a[i] = (i < n) ? boxes[i].a : 0.0;
+		pb->b[i] = (i < n) ? boxes[i].b : 0.0;
+		pb->c[i] = (i < n) ? boxes[i].c : 0.0;
+		pb->sj[i] = 0.0;
+		pb->den[i] = 0.0;
+		pb->ps[i] = 0.0;
+		pb->bs[i] = 0.0;
+		pb->nbg[i] = 0.0;
+		pb->s2[i] = 0.0;
+		pb->sb[i] = 0.0;
+		pb->bpk[i] = 0.0;
+		pb->npk[i] = 0.0;
+		pb->pkmax[i] = 0.0;
+	}
+
+	/* Profile scale factors, profile sums and background means */
+	for ( k=0; k<sz; k++ ) {
+		prof2d_sums(nv, k % ic->w, k / ic->w,
+		            &pb->px[k*nv], &pb->wpk[k*nv], &pb->wbg[k*nv],
+		            &pb->prof[k*nv], pb->a, pb->b, pb->c,
+		            pb->sj, pb->den, pb->ps, pb->bs, pb->nbg,
+		            pb->bpk, pb->npk, pb->pkmax);
+	}
+
+	for ( i=0; i<nv; i++ ) {
+		if ( i < n ) {
+			pb->J[i] = pb->sj[i] / pb->den[i];
+			pb->bgmean[i] = pb->bs[i] / pb->nbg[i];
+			boxes[i].J = pb->J[i];
+			boxes[i].intensity = pb->J[i] * pb->ps[i];
+		} else {
+			pb->J[i] = 0.0;
+			pb->bgmean[i] = 0.0;
+		}
 	}
 
-	intcontext_free(ic);
+	/* Residuals from the fitted profile, and background variance */
+	for ( k=0; k<sz; k++ ) {
+		prof2d_residuals(nv, k % ic->w, k / ic->w,
+		                 &pb->px[k*nv], &pb->wpk[k*nv], &pb->wbg[k*nv],
+		                 &pb->prof[k*nv], pb->a, pb->b, pb->c,
+		                 pb->J, pb->bgmean, pb->s2, pb->sb);
+	}
+
+	for ( i=0; i<n; i++ ) {
+		boxes[i].sigma = sqrt(pb->s2[i] + pb->sb[i]);
+	}
+
+	return 0;
 }
 
 
-int integrate_rings_once(Reflection *refl,
+static int prof2d_batched = 1;
+
+
+/**
+ * \param batched: Non-zero to fit the boxes in batches
+ *
+ * Selects whether two-dimensional profile fitting fits the boxes in batches
+ * (the default) or one at a time.  The results are the same apart from
+ * rounding errors: the intensities and their sigmas differ by less than
+ * 10^-12 times the larger of the two.  This is mostly useful for testing.
+ */
+void integration_set_prof2d_batch(int batched)
+{
+	prof2d_batched = batched;
+}
+
+
+/* Fits boxes i0 to i1-1 of the context, which must have its final reference
+ * profiles */
+static void integrate_prof2d_boxes(struct intcontext *ic, int i0, int i1,
+                                   pthread_mutex_t *term_lock)
+{
+	int i, j;
+
+	for ( i=i0; i<i1; i+=PROF2D_BATCH ) {
+
+		int n = i1 - i;
+		if ( n > PROF2D_BATCH ) n = PROF2D_BATCH;
+
+		if ( !prof2d_batched || prof2d_fit_batch(ic, &ic->boxes[i], n) ) {
+			for ( j=i; j<i+n; j++ ) {
+				integrate_prof2d_once(ic, &ic->boxes[j],
+				                      term_lock);
+			}
+			continue;
+		}
+
+		for ( j=0; j<n; j++ ) {
+			struct prof2d_batch *pb = ic->batch;
+			finish_prof2d_box(ic, &ic->boxes[i+j],
+			                  bg_gradient_ok(&ic->boxes[i+j],
+			                                 pb->pkmax[j],
+			                                 pb->bpk[j]/pb->npk[j]),
+			                  pb->bgmean[j], term_lock);
+		}
+
+	}
+}
+
+
+static void setup_profile_box(struct intcontext *ic, Reflection *refl)
+{
+	double pfs, pss;
+	struct peak_box *bx;
+	int pn;
+	int fid_fs, fid_ss;  /* Center coordinates, rounded,
+	                      * in overall data block */
+	int cfs, css;  /* Corner coordinates */
+	int saturated;
+	int r;
+
+	set_redundancy(refl, 0);
+
+	get_detector_pos(refl, &pfs, &pss);
+	pn = get_panel_number(refl);
+
+	/* Explicit truncation of digits after the decimal point.
+	 * This is actually the correct thing to do here, not
+	 * e.g. lrint().  pfs/pss is the position of the spot, measured
+	 * in numbers of pixels, from the panel corner (not the center
+	 * of the first pixel).  So any coordinate from 2.0 to 2.9999
+	 * belongs to pixel index 2. */
+	fid_fs = pfs;
+	fid_ss = pss;
+
+	cfs = fid_fs - ic->halfw;
+	css = fid_ss - ic->halfw;
+
+	/* Add the box */
+	bx = add_box(ic);
+	bx->refl = refl;
+	bx->cfs = cfs;
+	bx->css = css;
+	bx->p = &ic->image->detgeom->panels[pn];
+	bx->pn = pn;
+
+	/* Which reference profile? */
+	bx->rp = 0;//bx->pn;
+
+	if ( ic->meth & INTEGRATION_CENTER ) {
+		r = center_and_check_box(ic, bx, &saturated);
+	} else {
+		r = check_box(ic, bx, &saturated);
+		bx->offs_fs = 0.0;
+		bx->offs_ss = 0.0;
+	}
+	if ( r ) {
+		delete_box(ic, bx);
+		return;
+	}
+
+	if ( saturated ) {
+		ic->n_saturated++;
+		if ( !(ic->meth & INTEGRATION_SATURATED) ) {
+			delete_box(ic, bx);
+			return;
+		}
+	}
+
+	fit_bg(ic, bx);
+
+	bx->intensity = tentative_intensity(ic, bx);
+	set_intensity(refl, bx->intensity);
+
+	if ( suitable_reference(ic, bx) ) {
+		add_to_reference_profile(ic, bx);
+	}
+}
+
+
+static void setup_profile_boxes(struct intcontext *ic, RefList *list)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		setup_profile_box(ic, refl);
+	}
+}
+
+
+/* Gets an integration context for a crystal, re-using the one in *pic if
+ * possible and storing a new one there if not.  If pic is NULL, the caller
+ * must free the context afterwards. */
+static struct intcontext *get_intcontext(struct intcontext **pic,
+                                         struct image *image, UnitCell *cell,
+                                         IntegrationMethod meth,
+                                         IntDiag int_diag, signed int idh,
+                                         signed int idk, signed int idl,
+                                         double ir_inn, double ir_mid,
+                                         double ir_out, int **masks)
+{
+	struct intcontext *ic;
+
+	if ( (pic != NULL) && (*pic != NULL) ) {
+		ic = *pic;
+		if ( intcontext_reset(ic, image, cell, meth,
+		                      ir_inn, ir_mid, ir_out, masks) )
+		{
+			intcontext_free(ic);
+			*pic = NULL;
+			ERROR("Failed to initialise integration.\n");
+			return NULL;
+		}
+	} else {
+		ic = intcontext_new(image, cell, meth, ir_inn, ir_mid, ir_out,
+		                    masks);
+		if ( ic == NULL ) {
+			ERROR("Failed to initialise integration.\n");
+			return NULL;
+		}
+		if ( pic != NULL ) *pic = ic;
+	}
+
+	intcontext_set_diag(ic, int_diag, idh, idk, idl);
+	return ic;
+}
+
+
+static void integrate_prof2d_ctx(struct intcontext *ic, RefList *list,
+                                 pthread_mutex_t *term_lock)
+{
+	int i;
+
+	setup_profile_boxes(ic, list);
+	calculate_reference_profiles(ic);
+
+	for ( i=0; i<ic->n_reference_profiles; i++ ) {
+		if ( ic->n_profiles_in_reference[i] == 0 ) {
+			ERROR("Reference profile %i has no contributions.\n",
+			      i);
+			return;
+		}
+	}
+
+	integrate_prof2d_boxes(ic, 0, ic->n_boxes, term_lock);
+}
+
+
+void integrate_prof2d(IntegrationMethod meth,
+                      Crystal *cr, RefList *list,
+                      struct image *image, IntDiag int_diag,
+                      signed int idh, signed int idk, signed int idl,
+                      double ir_inn, double ir_mid, double ir_out,
+                      pthread_mutex_t *term_lock, int **masks)
+{
+	struct intcontext *ic;
+
+	ic = get_intcontext(NULL, image, crystal_get_cell(cr), meth,
+	                    int_diag, idh, idk, idl,
+	                    ir_inn, ir_mid, ir_out, masks);
+	if ( ic == NULL ) return;
+
+	integrate_prof2d_ctx(ic, list, term_lock);
+	intcontext_free(ic);
+}
+
+
+int integrate_rings_once(Reflection *refl,
                          struct intcontext *ic,
                          pthread_mutex_t *term_lock)
 {
@@ -1586,32 +2117,14 @@ static double estimate_resolution(Crystal *cr, struct image *image)
 }
 
 
-static void integrate_rings(IntegrationMethod meth,
-                            Crystal *cr, RefList *list,
-                            struct image *image, IntDiag int_diag,
-                            signed int idh, signed int idk, signed int idl,
-                            double ir_inn, double ir_mid, double ir_out,
-                            pthread_mutex_t *term_lock, int **masks)
+static void integrate_rings_ctx(struct intcontext *ic, Crystal *cr,
+                                RefList *list, pthread_mutex_t *term_lock)
 {
 	Reflection *refl;
 	RefListIterator *iter;
-	UnitCell *cell;
-	struct intcontext *ic;
 	int n_rej = 0;
 	int n_refl = 0;
 
-	cell = crystal_get_cell(cr);
-
-	ic = intcontext_new(image, cell, meth,
-	                    ir_inn, ir_mid, ir_out,
-	                    masks);
-	if ( ic == NULL ) {
-		ERROR("Failed to initialise integration.\n");
-		return;
-	}
-
-	intcontext_set_diag(ic, int_diag, idh, idk, idl);
-
 	for ( refl = first_refl(list, &iter);
 	      refl != NULL;
 	      refl = next_refl(refl, iter) )
@@ -1628,19 +2141,464 @@ static void integrate_rings(IntegrationMethod meth,
 
 	crystal_set_num_saturated_reflections(cr, ic->n_saturated);
 	crystal_set_num_implausible_reflections(cr, ic->n_implausible);
+}
 
-	intcontext_free(ic);
+
+/* Reflections are shared out between the threads in chunks of this size */
+#define INT_CHUNK (256)
+
+struct int_job
+{
+	int rings;
+	int phase;  /* For prof2d: 0 = set up boxes, 1 = integrate them */
+	struct intcontext **ics;  /* One for each thread */
+	int n_ics;
+	Reflection **refls;
+	int n_refls;
+	pthread_mutex_t *term_lock;
+	int next_task;
+	int n_tasks;
+
+	/* Results for each chunk, to be combined in order afterwards */
+	int *chunk_rej;
+	double *chunk_prof;
+	double *chunk_den;
+	int *chunk_n;
+};
+
+
+struct int_task
+{
+	struct int_job *job;
+	int idx;
+};
+
+
+static void *int_get_task(void *vp)
+{
+	struct int_job *job = vp;
+	struct int_task *task;
+
+	if ( job->next_task >= job->n_tasks ) return NULL;
+
+	task = cfmalloc(sizeof(struct int_task));
+	if ( task == NULL ) return NULL;
+	task->job = job;
+	task->idx = job->next_task++;
+	return task;
 }
 
 
-void integrate_all_5(struct image *image, IntegrationMethod meth,
+static void int_work(void *vp, int cookie)
+{
+	struct int_task *task = vp;
+	struct int_job *job = task->job;
+	struct intcontext *ic;
+	int i, i0, i1, sz;
+
+	if ( job->phase == 1 ) {
+		/* One task for each context, with all of its boxes */
+		ic = job->ics[task->idx];
+		integrate_prof2d_boxes(ic, 0, ic->n_boxes, job->term_lock);
+		return;
+	}
+
+	/* The cookie is the worker number, so each one has its own context */
+	ic = job->ics[cookie];
+	i0 = task->idx*INT_CHUNK;
+	i1 = i0 + INT_CHUNK;
+	if ( i1 > job->n_refls ) i1 = job->n_refls;
+
+	if ( job->rings ) {
+		int n_rej = 0;
+		for ( i=i0; i<i1; i++ ) {
+			n_rej += integrate_rings_once(job->refls[i], ic,
+			                              job->term_lock);
+		}
+		job->chunk_rej[task->idx] = n_rej;
+		return;
+	}
+
+	/* Collect the reference profile contributions from this chunk
+	 * separately, so that the totals don't depend on which thread did
+	 * which chunk */
+	zero_profiles(ic);
+	for ( i=i0; i<i1; i++ ) {
+		setup_profile_box(ic, job->refls[i]);
+	}
+	sz = ic->w*ic->w;
+	for ( i=0; i<ic->n_reference_profiles; i++ ) {
+		int base = (task->idx*ic->n_reference_profiles + i)*sz;
+		memcpy(&job->chunk_prof[base], ic->reference_profiles[i],
+		       sz*sizeof(double));
+		memcpy(&job->chunk_den[base], ic->reference_den[i],
+		       sz*sizeof(double));
+		job->chunk_n[task->idx*ic->n_reference_profiles + i]
+		                          = ic->n_profiles_in_reference[i];
+	}
+}
+
+
+static void int_final(void *vp, void *task)
+{
+	cffree(task);
+}
+
+
+/* Combines the reference profiles from all the chunks into the first
+ * context, and copies the result to all the others */
+static int merge_reference_profiles(struct int_job *job)
+{
+	struct intcontext *ic = job->ics[0];
+	int sz = ic->w*ic->w;
+	int nrp = ic->n_reference_profiles;
+	int i, j, k;
+
+	zero_profiles(ic);
+	for ( j=0; j<job->n_tasks; j++ ) {
+		for ( i=0; i<nrp; i++ ) {
+			int base = (j*nrp + i)*sz;
+			for ( k=0; k<sz; k++ ) {
+				ic->reference_profiles[i][k]
+				                      += job->chunk_prof[base+k];
+				ic->reference_den[i][k]
+				                      += job->chunk_den[base+k];
+			}
+			ic->n_profiles_in_reference[i] += job->chunk_n[j*nrp+i];
+		}
+	}
+
+	calculate_reference_profiles(ic);
+
+	for ( i=0; i<nrp; i++ ) {
+		if ( ic->n_profiles_in_reference[i] == 0 ) {
+			ERROR("Reference profile %i has no contributions.\n",
+			      i);
+			return 1;
+		}
+	}
+
+	for ( j=1; j<job->n_ics; j++ ) {
+		for ( i=0; i<nrp; i++ ) {
+			memcpy(job->ics[j]->reference_profiles[i],
+			       ic->reference_profiles[i], sz*sizeof(double));
+		}
+	}
+
+	return 0;
+}
+
+
+/* Integrates one crystal using several threads.  Returns non-zero if it
+ * couldn't be done this way, in which case nothing has been changed. */
+static int integrate_crystal_threaded(struct intcontext **pic,
+                                      struct image *image, Crystal *cr,
+                                      RefList *list, IntegrationMethod meth,
+                                      IntDiag int_diag, signed int idh,
+                                      signed int idk, signed int idl,
+                                      double ir_inn, double ir_mid,
+                                      double ir_out, int **masks,
+                                      pthread_mutex_t *term_lock,
+                                      int n_threads)
+{
+	struct int_job job;
+	Reflection *refl;
+	RefListIterator *iter;
+	UnitCell *cell = crystal_get_cell(cr);
+	int i, n, fail = 0;
+	int n_rej = 0;
+	int n_sat = 0;
+	int n_impl = 0;
+
+	n = num_reflections(list);
+	if ( n < 2*INT_CHUNK ) return 1;
+
+	job.rings = ((meth & INTEGRATION_METHOD_MASK) == INTEGRATION_RINGS);
+	job.n_refls = n;
+	job.n_tasks = (n + INT_CHUNK - 1)/INT_CHUNK;
+	job.n_ics = n_threads;
+	job.term_lock = term_lock;
+	job.refls = cfmalloc(n*sizeof(Reflection *));
+	job.ics = cfcalloc(n_threads, sizeof(struct intcontext *));
+	job.chunk_rej = cfcalloc(job.n_tasks, sizeof(int));
+	job.chunk_n = cfcalloc(job.n_tasks, sizeof(int));
+	job.chunk_prof = NULL;
+	job.chunk_den = NULL;
+	if ( (job.refls == NULL) || (job.ics == NULL)
+	  || (job.chunk_rej == NULL) || (job.chunk_n == NULL) )
+	{
+		cffree(job.refls);
+		cffree(job.ics);
+		cffree(job.chunk_rej);
+		cffree(job.chunk_n);
+		return 1;
+	}
+
+	i = 0;
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		job.refls[i++] = refl;
+	}
+
+	/* The first context can be kept for next time */
+	job.ics[0] = get_intcontext(pic, image, cell, meth,
+	                            int_diag, idh, idk, idl,
+	                            ir_inn, ir_mid, ir_out, masks);
+	if ( job.ics[0] == NULL ) fail = 1;
+	for ( i=1; i<n_threads; i++ ) {
+		if ( fail ) break;
+		job.ics[i] = get_intcontext(NULL, image, cell, meth,
+		                            int_diag, idh, idk, idl,
+		                            ir_inn, ir_mid, ir_out, masks);
+		if ( job.ics[i] == NULL ) fail = 1;
+	}
+
+	if ( !fail && !job.rings ) {
+		int sz = job.ics[0]->w * job.ics[0]->w
+		           * job.ics[0]->n_reference_profiles;
+		cffree(job.chunk_n);
+		job.chunk_n = cfcalloc(job.n_tasks
+		                       * job.ics[0]->n_reference_profiles,
+		                       sizeof(int));
+		job.chunk_prof = cfmalloc(job.n_tasks*sz*sizeof(double));
+		job.chunk_den = cfmalloc(job.n_tasks*sz*sizeof(double));
+		if ( (job.chunk_n == NULL) || (job.chunk_prof == NULL)
+		  || (job.chunk_den == NULL) ) fail = 1;
+	}
+
+	if ( !fail ) {
+
+		job.phase = 0;
+		job.next_task = 0;
+		run_threads(n_threads, int_work, int_get_task, int_final,
+		            &job, 0, 0, 0, 0);
+
+		if ( !job.rings && (merge_reference_profiles(&job) == 0) ) {
+			job.phase = 1;
+			job.next_task = 0;
+			job.n_tasks = n_threads;
+			run_threads(n_threads, int_work, int_get_task,
+			            int_final, &job, 0, 0, 0, 0);
+		}
+
+		for ( i=0; i<n_threads; i++ ) {
+			n_sat += job.ics[i]->n_saturated;
+			n_impl += job.ics[i]->n_implausible;
+		}
+
+		if ( job.rings ) {
+			for ( i=0; i<(n+INT_CHUNK-1)/INT_CHUNK; i++ ) {
+				n_rej += job.chunk_rej[i];
+			}
+			if ( n_rej*4 > n ) {
+				ERROR("WARNING: %i reflections could not be "
+				      "integrated\n", n_rej);
+			}
+			crystal_set_num_saturated_reflections(cr, n_sat);
+			crystal_set_num_implausible_reflections(cr, n_impl);
+		}
+
+	} else {
+		ERROR("Failed to set up threads for integration.\n");
+	}
+
+	if ( pic == NULL ) intcontext_free(job.ics[0]);
+	for ( i=1; i<n_threads; i++ ) intcontext_free(job.ics[i]);
+	cffree(job.ics);
+	cffree(job.refls);
+	cffree(job.chunk_rej);
+	cffree(job.chunk_n);
+	cffree(job.chunk_prof);
+	cffree(job.chunk_den);
+
+	return fail;
+}
+
+
+struct xtal_job
+{
+	struct image *image;
+	IntegrationMethod meth;
+	IntDiag int_diag;
+	signed int idh;
+	signed int idk;
+	signed int idl;
+	double ir_inn;
+	double ir_mid;
+	double ir_out;
+	int **masks;
+	pthread_mutex_t *term_lock;
+	struct intcontext **ics;  /* One for each thread, kept between crystals */
+	int next_crystal;
+};
+
+
+struct xtal_task
+{
+	struct xtal_job *job;
+	int idx;
+};
+
+
+static void *xtal_get_task(void *vp)
+{
+	struct xtal_job *job = vp;
+	struct xtal_task *task;
+
+	if ( job->next_crystal >= job->image->n_crystals ) return NULL;
+
+	task = cfmalloc(sizeof(struct xtal_task));
+	if ( task == NULL ) return NULL;
+	task->job = job;
+	task->idx = job->next_crystal++;
+	return task;
+}
+
+
+static void integrate_crystal(struct intcontext *ic, Crystal *cr,
+                              RefList *list, IntegrationMethod meth,
+                              pthread_mutex_t *term_lock)
+{
+	if ( (meth & INTEGRATION_METHOD_MASK) == INTEGRATION_RINGS ) {
+		integrate_rings_ctx(ic, cr, list, term_lock);
+	} else {
+		integrate_prof2d_ctx(ic, list, term_lock);
+	}
+}
+
+
+static void xtal_work(void *vp, int cookie)
+{
+	struct xtal_task *task = vp;
+	struct xtal_job *job = task->job;
+	struct crystal_refls *c = &job->image->crystals[task->idx];
+	struct intcontext *ic;
+
+	/* The cookie is the worker number, so each one has its own context */
+	ic = get_intcontext(&job->ics[cookie], job->image,
+	                    crystal_get_cell(c->cr), job->meth,
+	                    job->int_diag, job->idh, job->idk, job->idl,
+	                    job->ir_inn, job->ir_mid, job->ir_out,
+	                    job->masks);
+	if ( ic == NULL ) return;
+
+	integrate_crystal(ic, c->cr, c->refls, job->meth, job->term_lock);
+}
+
+
+static void xtal_final(void *vp, void *task)
+{
+	cffree(task);
+}
+
+
+/* Integrates the crystals of an image at the same time, one per thread.
+ * Returns non-zero if it couldn't be done this way, in which case nothing has
+ * been changed. */
+static int integrate_crystals_threaded(struct intcontext **pic,
+                                       struct image *image,
+                                       IntegrationMethod meth,
+                                       IntDiag int_diag, signed int idh,
+                                       signed int idk, signed int idl,
+                                       double ir_inn, double ir_mid,
+                                       double ir_out, int **masks,
+                                       pthread_mutex_t *term_lock,
+                                       int n_threads)
+{
+	struct xtal_job job;
+	int i;
+
+	job.ics = cfcalloc(n_threads, sizeof(struct intcontext *));
+	if ( job.ics == NULL ) return 1;
+
+	/* The first context can be kept for next time */
+	if ( pic != NULL ) job.ics[0] = *pic;
+
+	job.image = image;
+	job.meth = meth;
+	job.int_diag = int_diag;
+	job.idh = idh;
+	job.idk = idk;
+	job.idl = idl;
+	job.ir_inn = ir_inn;
+	job.ir_mid = ir_mid;
+	job.ir_out = ir_out;
+	job.masks = masks;
+	job.term_lock = term_lock;
+	job.next_crystal = 0;
+
+	run_threads(n_threads, xtal_work, xtal_get_task, xtal_final,
+	            &job, 0, 0, 0, 0);
+
+	if ( pic != NULL ) {
+		*pic = job.ics[0];
+	} else {
+		intcontext_free(job.ics[0]);
+	}
+	for ( i=1; i<n_threads; i++ ) intcontext_free(job.ics[i]);
+	cffree(job.ics);
+
+	return 0;
+}
+
+
+/**
+ * \param pic: Place to keep an integration context between calls
+ * \param n_threads: Number of threads to use for each crystal
+ *
+ * As integrate_all_5(), but keeps the integration context in \p pic, for the
+ * next call to use.  This saves allocating and freeing the peak boxes for
+ * every crystal, which helps when processing many images in each thread.
+ * \p *pic should be NULL to begin with, and the context must eventually be
+ * freed with intcontext_free().  Each thread must have its own context.
+ *
+ * If \p n_threads is more than one, the reflections of crystals with many
+ * reflections will be shared out between several threads, using the default
+ * thread pool if it has the right number of threads.  For the rings method,
+ * the results are the same as with one thread.  For prof2d, the reference
+ * profile is added up in a fixed order which does not depend on the number
+ * of threads, but which is different to the order with one thread, so the
+ * results might differ by rounding errors.
+ */
+void integrate_all_7(struct image *image, IntegrationMethod meth,
                      PartialityModel pmodel, double push_res,
                      double ir_inn, double ir_mid, double ir_out,
                      IntDiag int_diag,
                      signed int idh, signed int idk, signed int idl,
-                     pthread_mutex_t *term_lock, int overpredict)
+                     pthread_mutex_t *term_lock, int overpredict,
+                     struct intcontext **pic, int n_threads)
+{
+	integrate_all_8(image, meth, pmodel, push_res, ir_inn, ir_mid, ir_out,
+	                int_diag, idh, idk, idl, term_lock, overpredict, pic,
+	                n_threads, 0);
+}
+
+
+/**
+ * \param pic: Place to keep an integration context between calls
+ * \param n_threads: Number of threads to use
+ * \param parallel_crystals: Non-zero to integrate several crystals at once
+ *
+ * As integrate_all_7(), but if \p parallel_crystals is non-zero and the image
+ * has more than one crystal, the crystals will be integrated at the same time,
+ * one per thread, instead of one after the other.  This suits images with many
+ * small crystals.  The crystals are integrated independently of each other,
+ * exactly as with one thread, so the results do not depend on the number of
+ * threads or on which thread integrates which crystal.
+ */
+void integrate_all_8(struct image *image, IntegrationMethod meth,
+                     PartialityModel pmodel, double push_res,
+                     double ir_inn, double ir_mid, double ir_out,
+                     IntDiag int_diag,
+                     signed int idh, signed int idk, signed int idl,
+                     pthread_mutex_t *term_lock, int overpredict,
+                     struct intcontext **pic, int n_threads,
+                     int parallel_crystals)
 {
 	int i;
+	int im = meth & INTEGRATION_METHOD_MASK;
 	int *masks[image->detgeom->n_panels];
 
 	/* Predict all reflections */
@@ -1670,38 +2628,49 @@ void integrate_all_5(struct image *image, IntegrationMethod meth,
 		                       i, ir_inn);
 	}
 
+	if ( parallel_crystals && (n_threads > 1) && (image->n_crystals > 1)
+	  && ((im == INTEGRATION_RINGS) || (im == INTEGRATION_PROF2D))
+	  && (integrate_crystals_threaded(pic, image, meth, int_diag,
+	                                  idh, idk, idl, ir_inn, ir_mid, ir_out,
+	                                  masks, term_lock, n_threads) == 0) )
+	{
+		for ( i=0; i<image->detgeom->n_panels; i++ ) {
+			cffree(masks[i]);
+		}
+		return;
+	}
+
 	for ( i=0; i<image->n_crystals; i++ ) {
 
-		switch ( meth & INTEGRATION_METHOD_MASK ) {
+		struct intcontext *ic;
 
-			case INTEGRATION_NONE :
-			break;
+		if ( im == INTEGRATION_NONE ) continue;
+		if ( (im != INTEGRATION_RINGS) && (im != INTEGRATION_PROF2D) ) {
+			ERROR("Unrecognised integration method %i\n", meth);
+			continue;
+		}
 
-			case INTEGRATION_RINGS :
-			integrate_rings(meth,
-			                image->crystals[i].cr,
-			                image->crystals[i].refls,
-			                image,
-			                int_diag, idh, idk, idl,
-			                ir_inn, ir_mid, ir_out,
-			                term_lock, masks);
-			break;
+		if ( (n_threads > 1)
+		  && (integrate_crystal_threaded(pic, image,
+		                                 image->crystals[i].cr,
+		                                 image->crystals[i].refls,
+		                                 meth, int_diag, idh, idk, idl,
+		                                 ir_inn, ir_mid, ir_out, masks,
+		                                 term_lock, n_threads) == 0) )
+		{
+			continue;
+		}
 
-			case INTEGRATION_PROF2D :
-			integrate_prof2d(meth,
-			                 image->crystals[i].cr,
-			                 image->crystals[i].refls,
-			                 image,
-			                 int_diag, idh, idk, idl,
-			                 ir_inn, ir_mid, ir_out,
-			                 term_lock, masks);
-			break;
+		ic = get_intcontext(pic, image,
+		                    crystal_get_cell(image->crystals[i].cr),
+		                    meth, int_diag, idh, idk, idl,
+		                    ir_inn, ir_mid, ir_out, masks);
+		if ( ic == NULL ) continue;
 
-			default :
-			ERROR("Unrecognised integration method %i\n", meth);
-			break;
+		integrate_crystal(ic, image->crystals[i].cr,
+		                  image->crystals[i].refls, meth, term_lock);
 
-		}
+		if ( pic == NULL ) intcontext_free(ic);
 
 	}
 
@@ -1711,6 +2680,31 @@ void integrate_all_5(struct image *image, IntegrationMethod meth,
 }
 
 
+void integrate_all_6(struct image *image, IntegrationMethod meth,
+                     PartialityModel pmodel, double push_res,
+                     double ir_inn, double ir_mid, double ir_out,
+                     IntDiag int_diag,
+                     signed int idh, signed int idk, signed int idl,
+                     pthread_mutex_t *term_lock, int overpredict,
+                     struct intcontext **pic)
+{
+	integrate_all_7(image, meth, pmodel, push_res, ir_inn, ir_mid, ir_out,
+	                int_diag, idh, idk, idl, term_lock, overpredict, pic, 1);
+}
+
+
+void integrate_all_5(struct image *image, IntegrationMethod meth,
+                     PartialityModel pmodel, double push_res,
+                     double ir_inn, double ir_mid, double ir_out,
+                     IntDiag int_diag,
+                     signed int idh, signed int idk, signed int idl,
+                     pthread_mutex_t *term_lock, int overpredict)
+{
+	integrate_all_6(image, meth, pmodel, push_res, ir_inn, ir_mid, ir_out,
+	                int_diag, idh, idk, idl, term_lock, overpredict, NULL);
+}
+
+
 void integrate_all_4(struct image *image, IntegrationMethod meth,
                      PartialityModel pmodel, double push_res,
                      double ir_inn, double ir_mid, double ir_out,
@@ -115,6 +115,8 @@ extern IntegrationMethod integration_method(const char *t, int *err);
 
 extern char *str_integration_method(IntegrationMethod m);
 
+extern void integration_set_prof2d_batch(int batched);
+
 extern struct intcontext *intcontext_new(struct image *image,
                                          UnitCell *cell,
                                          IntegrationMethod meth,
@@ -125,6 +127,10 @@ extern int integrate_rings_once(Reflection *refl,
                                 struct intcontext *ic,
                                 pthread_mutex_t *term_lock);
 
+extern int intcontext_reset(struct intcontext *ic, struct image *image,
+                            UnitCell *cell, IntegrationMethod meth,
+                            int ir_inn, int ir_mid, int ir_out, int **masks);
+
 extern void intcontext_free(struct intcontext *ic);
 
 extern void integrate_all(struct image *image, IntegrationMethod meth,
@@ -158,6 +164,31 @@ extern void integrate_all_5(struct image *image, IntegrationMethod meth,
                      signed int idh, signed int idk, signed int idl,
                      pthread_mutex_t *term_lock, int overpredict);
 
+extern void integrate_all_6(struct image *image, IntegrationMethod meth,
+                     PartialityModel pmodel, double push_res,
+                     double ir_inn, double ir_mid, double ir_out,
+                     IntDiag int_diag,
+                     signed int idh, signed int idk, signed int idl,
+                     pthread_mutex_t *term_lock, int overpredict,
+                     struct intcontext **pic);
+
+extern void integrate_all_7(struct image *image, IntegrationMethod meth,
+                     PartialityModel pmodel, double push_res,
+                     double ir_inn, double ir_mid, double ir_out,
+                     IntDiag int_diag,
+                     signed int idh, signed int idk, signed int idl,
+                     pthread_mutex_t *term_lock, int overpredict,
+                     struct intcontext **pic, int n_threads);
+
+extern void integrate_all_8(struct image *image, IntegrationMethod meth,
+                     PartialityModel pmodel, double push_res,
+                     double ir_inn, double ir_mid, double ir_out,
+                     IntDiag int_diag,
+                     signed int idh, signed int idk, signed int idl,
+                     pthread_mutex_t *term_lock, int overpredict,
+                     struct intcontext **pic, int n_threads,
+                     int parallel_crystals);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,415 @@
+/*
+ * peakfinder8-opencl.c
+ *
+ * Radial statistics for peakfinder8, on a GPU
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Only the iterative sigma clipping, which is most of the work of
+ * peakfinder8, is done on the GPU.  The pixel values are gathered into radial
+ * bin order by the CPU beforehand, so that each bin is one contiguous run of
+ * values.  One work group handles one bin of one frame. */
+
+#include <libcrystfel-config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "utils.h"
+#include "peakfinder8_priv.h"
+
+
+#if defined(HAVE_OPENCL)
+
+#define CL_TARGET_OPENCL_VERSION 120
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+/* Must be a power of two */
+#define PF8_GPU_GROUP_SIZE (64)
+
+static const char *pf8_kernel_source =
+"#define WG (64)\n"
+"__kernel void pf8_rstats(__global const float *vals,\n"
+"                         __global const int *vcount,\n"
+"                         __global const int *bin_start,\n"
+"                         const int n_bins, const int n_order,\n"
+"                         const float min_snr, const float threshold,\n"
+"                         const int iterations,\n"
+"                         __global float *roffset,\n"
+"                         __global float *rthreshold)\n"
+"{\n"
+"	const int r = get_group_id(0);\n"
+"	const int f = get_global_id(1);\n"
+"	const int l = get_local_id(0);\n"
+"	__local float lsum[WG];\n"
+"	__local float lsumsq[WG];\n"
+"	__local int lcount[WG];\n"
+"	__global const float *v = vals + (size_t)f*n_order + bin_start[r];\n"
+"	const int n = vcount[(size_t)f*n_bins + r];\n"
+"	float rt = 1e9f;\n"
+"	float lt = -1e9f;\n"
+"	float offset = 0.0f;\n"
+"	int it, k, s;\n"
+"\n"
+"	for ( it=0; it<iterations; it++ ) {\n"
+"\n"
+"		float sum = 0.0f;\n"
+"		float sumsq = 0.0f;\n"
+"		int count = 0;\n"
+"\n"
+"		for ( k=l; k<n; k+=WG ) {\n"
+"			float value = v[k];\n"
+"			if ( (value < rt) && (value > lt) ) {\n"
+"				sum += value;\n"
+"				sumsq += value*value;\n"
+"				count += 1;\n"
+"			}\n"
+"		}\n"
+"		lsum[l] = sum;\n"
+"		lsumsq[l] = sumsq;\n"
+"		lcount[l] = count;\n"
+"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"		for ( s=WG/2; s>0; s>>=1 ) {\n"
+"			if ( l < s ) {\n"
+"				lsum[l] += lsum[l+s];\n"
+"				lsumsq[l] += lsumsq[l+s];\n"
+"				lcount[l] += lcount[l+s];\n"
+"			}\n"
+"			barrier(CLK_LOCAL_MEM_FENCE);\n"
+"		}\n"
+"\n"
+"		/* Same as compute_radial_stats() in peakfinder8.c */\n"
+"		if ( lcount[0] == 0 ) {\n"
+"			offset = 0.0f;\n"
+"			rt = FLT_MAX;\n"
+"			lt = FLT_MIN;\n"
+"		} else {\n"
+"			float sigma;\n"
+"			offset = lsum[0] / lcount[0];\n"
+"			sigma = lsumsq[0] / lcount[0] - offset*offset;\n"
+"			if ( sigma >= 0.0f ) sigma = sqrt(sigma);\n"
+"			rt = offset + min_snr*sigma;\n"
+"			lt = offset - min_snr*sigma;\n"
+"			if ( rt < threshold ) rt = threshold;\n"
+"		}\n"
+"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+"	}\n"
+"\n"
+"	if ( l == 0 ) {\n"
+"		roffset[(size_t)f*n_bins + r] = offset;\n"
+"		rthreshold[(size_t)f*n_bins + r] = rt;\n"
+"	}\n"
+"}\n";
+
+
+struct pf8_gpu
+{
+	cl_context ctx;
+	cl_command_queue queue;
+	cl_program prog;
+	cl_kernel kern;
+
+	int n_bins;
+	int n_order;
+	cl_mem bin_start;
+
+	/* Re-used between calls, enlarged as needed */
+	int max_frames;
+	cl_mem vals;
+	cl_mem vcount;
+	cl_mem roffset;
+	cl_mem rthreshold;
+};
+
+
+static void free_batch_buffers(struct pf8_gpu *gpu)
+{
+	if ( gpu->vals != NULL ) clReleaseMemObject(gpu->vals);
+	if ( gpu->vcount != NULL ) clReleaseMemObject(gpu->vcount);
+	if ( gpu->roffset != NULL ) clReleaseMemObject(gpu->roffset);
+	if ( gpu->rthreshold != NULL ) clReleaseMemObject(gpu->rthreshold);
+	gpu->vals = NULL;
+	gpu->vcount = NULL;
+	gpu->roffset = NULL;
+	gpu->rthreshold = NULL;
+	gpu->max_frames = 0;
+}
+
+
+void pf8_gpu_free(struct pf8_gpu *gpu)
+{
+	if ( gpu == NULL ) return;
+	free_batch_buffers(gpu);
+	if ( gpu->bin_start != NULL ) clReleaseMemObject(gpu->bin_start);
+	if ( gpu->kern != NULL ) clReleaseKernel(gpu->kern);
+	if ( gpu->prog != NULL ) clReleaseProgram(gpu->prog);
+	if ( gpu->queue != NULL ) clReleaseCommandQueue(gpu->queue);
+	if ( gpu->ctx != NULL ) clReleaseContext(gpu->ctx);
+	cffree(gpu);
+}
+
+
+static int find_device(cl_platform_id *pplat, cl_device_id *pdev)
+{
+	cl_platform_id platforms[8];
+	cl_uint n_plat;
+	cl_uint i;
+
+	if ( clGetPlatformIDs(8, platforms, &n_plat) != CL_SUCCESS ) {
+		ERROR("Couldn't get OpenCL platforms\n");
+		return 1;
+	}
+	if ( n_plat > 8 ) n_plat = 8;
+
+	for ( i=0; i<n_plat; i++ ) {
+		cl_uint n_dev;
+		if ( clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 1, pdev,
+		                    &n_dev) == CL_SUCCESS )
+		{
+			*pplat = platforms[i];
+			return 0;
+		}
+	}
+
+	ERROR("Couldn't find a GPU for OpenCL\n");
+	return 1;
+}
+
+
+static void show_build_log(cl_program prog, cl_device_id dev)
+{
+	char log[4096];
+
+	if ( clGetProgramBuildInfo(prog, dev, CL_PROGRAM_BUILD_LOG,
+	                           sizeof(log), log, NULL) == CL_SUCCESS )
+	{
+		log[sizeof(log)-1] = '\0';
+		ERROR("%s\n", log);
+	}
+}
+
+
+struct pf8_gpu *pf8_gpu_new(const int *bin_start, int n_bins, int n_order)
+{
+	struct pf8_gpu *gpu;
+	cl_platform_id plat;
+	cl_device_id dev;
+	cl_context_properties prop[3];
+	cl_int err;
+
+	if ( find_device(&plat, &dev) ) return NULL;
+
+	gpu = cfcalloc(1, sizeof(struct pf8_gpu));
+	if ( gpu == NULL ) return NULL;
+	gpu->n_bins = n_bins;
+	gpu->n_order = n_order;
+
+	prop[0] = CL_CONTEXT_PLATFORM;
+	prop[1] = (cl_context_properties)plat;
+	prop[2] = 0;
+	gpu->ctx = clCreateContext(prop, 1, &dev, NULL, NULL, &err);
+	if ( err != CL_SUCCESS ) {
+		ERROR("Couldn't create OpenCL context: %i\n", err);
+		gpu->ctx = NULL;
+		pf8_gpu_free(gpu);
+		return NULL;
+	}
+
+	gpu->queue = clCreateCommandQueue(gpu->ctx, dev, 0, &err);
+	if ( err != CL_SUCCESS ) {
+		ERROR("Couldn't create OpenCL command queue: %i\n", err);
+		gpu->queue = NULL;
+		pf8_gpu_free(gpu);
+		return NULL;
+	}
+
+	gpu->prog = clCreateProgramWithSource(gpu->ctx, 1, &pf8_kernel_source,
+	                                      NULL, &err);
+	if ( err != CL_SUCCESS ) {
+		ERROR("Couldn't create OpenCL program: %i\n", err);
+		gpu->prog = NULL;
+		pf8_gpu_free(gpu);
+		return NULL;
+	}
+
+	/* No fast maths, to keep the results as close as possible to the
+	 * CPU version */
+	err = clBuildProgram(gpu->prog, 1, &dev, "", NULL, NULL);
+	if ( err != CL_SUCCESS ) {
+		ERROR("Couldn't build OpenCL program: %i\n", err);
+		show_build_log(gpu->prog, dev);
+		pf8_gpu_free(gpu);
+		return NULL;
+	}
+
+	gpu->kern = clCreateKernel(gpu->prog, "pf8_rstats", &err);
+	if ( err != CL_SUCCESS ) {
+		ERROR("Couldn't create OpenCL kernel: %i\n", err);
+		gpu->kern = NULL;
+		pf8_gpu_free(gpu);
+		return NULL;
+	}
+
+	gpu->bin_start = clCreateBuffer(gpu->ctx,
+	                                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+	                                n_bins*sizeof(cl_int),
+	                                (void *)bin_start, &err);
+	if ( err != CL_SUCCESS ) {
+		ERROR("Couldn't create OpenCL buffer: %i\n", err);
+		gpu->bin_start = NULL;
+		pf8_gpu_free(gpu);
+		return NULL;
+	}
+
+	return gpu;
+}
+
+
+static int alloc_batch_buffers(struct pf8_gpu *gpu, int n_frames)
+{
+	cl_int err[4];
+	size_t n_vals = (size_t)n_frames * gpu->n_order;
+	size_t n_bins = (size_t)n_frames * gpu->n_bins;
+
+	if ( n_frames <= gpu->max_frames ) return 0;
+	free_batch_buffers(gpu);
+
+	gpu->vals = clCreateBuffer(gpu->ctx, CL_MEM_READ_ONLY,
+	                           n_vals*sizeof(cl_float), NULL, &err[0]);
+	gpu->vcount = clCreateBuffer(gpu->ctx, CL_MEM_READ_ONLY,
+	                             n_bins*sizeof(cl_int), NULL, &err[1]);
+	gpu->roffset = clCreateBuffer(gpu->ctx, CL_MEM_WRITE_ONLY,
+	                              n_bins*sizeof(cl_float), NULL, &err[2]);
+	gpu->rthreshold = clCreateBuffer(gpu->ctx, CL_MEM_WRITE_ONLY,
+	                                 n_bins*sizeof(cl_float), NULL, &err[3]);
+	if ( (err[0] != CL_SUCCESS) || (err[1] != CL_SUCCESS)
+	  || (err[2] != CL_SUCCESS) || (err[3] != CL_SUCCESS) )
+	{
+		ERROR("Couldn't create OpenCL buffers\n");
+		if ( err[0] != CL_SUCCESS ) gpu->vals = NULL;
+		if ( err[1] != CL_SUCCESS ) gpu->vcount = NULL;
+		if ( err[2] != CL_SUCCESS ) gpu->roffset = NULL;
+		if ( err[3] != CL_SUCCESS ) gpu->rthreshold = NULL;
+		free_batch_buffers(gpu);
+		return 1;
+	}
+
+	gpu->max_frames = n_frames;
+	return 0;
+}
+
+
+int pf8_gpu_radial_stats(struct pf8_gpu *gpu, int n_frames,
+                         const float **vals, const int **vcount,
+                         float **roffset, float **rthreshold,
+                         float min_snr, float threshold, int iterations)
+{
+	size_t gsize[2];
+	size_t lsize[2];
+	cl_int err = CL_SUCCESS;
+	cl_int n_bins = gpu->n_bins;
+	cl_int n_order = gpu->n_order;
+	int i;
+
+	if ( alloc_batch_buffers(gpu, n_frames) ) return 1;
+
+	for ( i=0; i<n_frames; i++ ) {
+		err |= clEnqueueWriteBuffer(gpu->queue, gpu->vals, CL_FALSE,
+		                            (size_t)i*n_order*sizeof(cl_float),
+		                            n_order*sizeof(cl_float), vals[i],
+		                            0, NULL, NULL);
+		err |= clEnqueueWriteBuffer(gpu->queue, gpu->vcount, CL_FALSE,
+		                            (size_t)i*n_bins*sizeof(cl_int),
+		                            n_bins*sizeof(cl_int), vcount[i],
+		                            0, NULL, NULL);
+	}
+
+	err |= clSetKernelArg(gpu->kern, 0, sizeof(cl_mem), &gpu->vals);
+	err |= clSetKernelArg(gpu->kern, 1, sizeof(cl_mem), &gpu->vcount);
+	err |= clSetKernelArg(gpu->kern, 2, sizeof(cl_mem), &gpu->bin_start);
+	err |= clSetKernelArg(gpu->kern, 3, sizeof(cl_int), &n_bins);
+	err |= clSetKernelArg(gpu->kern, 4, sizeof(cl_int), &n_order);
+	err |= clSetKernelArg(gpu->kern, 5, sizeof(cl_float), &min_snr);
+	err |= clSetKernelArg(gpu->kern, 6, sizeof(cl_float), &threshold);
+	err |= clSetKernelArg(gpu->kern, 7, sizeof(cl_int), &iterations);
+	err |= clSetKernelArg(gpu->kern, 8, sizeof(cl_mem), &gpu->roffset);
+	err |= clSetKernelArg(gpu->kern, 9, sizeof(cl_mem), &gpu->rthreshold);
+
+	gsize[0] = (size_t)n_bins * PF8_GPU_GROUP_SIZE;
+	gsize[1] = n_frames;
+	lsize[0] = PF8_GPU_GROUP_SIZE;
+	lsize[1] = 1;
+	err |= clEnqueueNDRangeKernel(gpu->queue, gpu->kern, 2, NULL,
+	                              gsize, lsize, 0, NULL, NULL);
+
+	for ( i=0; i<n_frames; i++ ) {
+		err |= clEnqueueReadBuffer(gpu->queue, gpu->roffset, CL_FALSE,
+		                           (size_t)i*n_bins*sizeof(cl_float),
+		                           n_bins*sizeof(cl_float), roffset[i],
+		                           0, NULL, NULL);
+		err |= clEnqueueReadBuffer(gpu->queue, gpu->rthreshold, CL_FALSE,
+		                           (size_t)i*n_bins*sizeof(cl_float),
+		                           n_bins*sizeof(cl_float), rthreshold[i],
+		                           0, NULL, NULL);
+	}
+
+	err |= clFinish(gpu->queue);
+	if ( err != CL_SUCCESS ) {
+		ERROR("OpenCL radial statistics failed\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+#else /* defined(HAVE_OPENCL) */
+
+struct pf8_gpu *pf8_gpu_new(const int *bin_start, int n_bins, int n_order)
+{
+	ERROR("This version of CrystFEL was compiled without GPU support.\n");
+	return NULL;
+}
+
+
+void pf8_gpu_free(struct pf8_gpu *gpu)
+{
+}
+
+
+int pf8_gpu_radial_stats(struct pf8_gpu *gpu, int n_frames,
+                         const float **vals, const int **vcount,
+                         float **roffset, float **rthreshold,
+                         float min_snr, float threshold, int iterations)
+{
+	return 1;
+}
+
+#endif /* defined(HAVE_OPENCL) */
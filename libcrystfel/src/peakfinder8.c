@@ -34,11 +34,21 @@
 #include <float.h>
 #include <math.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <profile.h>
 
 #include "peakfinder8.h"
+#include "peakfinder8_priv.h"
 #include "detgeom.h"
 #include "image.h"
+#include "thread-pool.h"
+#include "utils.h"
 
 
 /** \file peakfinder8.h */
@@ -62,6 +72,17 @@ struct radial_stats_pixels
 };
 
 
+/* Pixels used for the radial statistics, sorted by radial bin */
+struct radial_bin_order
+{
+	int n_bins;
+	int *bin_start;  // bin_start[0..n_bins], index into panel and idx
+	int *panel;      // panel[0..n_pixels]
+	int *idx;        // idx[0..n_pixels], index within panel
+	int n_pixels;
+};
+
+
 struct peakfinder_mask
 {
 	char **masks;
@@ -330,7 +351,134 @@ static void free_radius_maps(struct radius_maps *r_maps)
 }
 
 
+static void free_radial_bin_order(struct radial_bin_order *ro)
+{
+	if ( ro == NULL ) return;
+	cffree(ro->bin_start);
+	cffree(ro->panel);
+	cffree(ro->idx);
+	cffree(ro);
+}
+
+
+/* Sorts the pixels by radial bin, so that the statistics for each bin can
+ * be worked out from a contiguous block.  If rsp is not NULL, only the pixels
+ * selected for "fast mode" are included. */
+static struct radial_bin_order *compute_radial_bin_order(struct radius_maps *rmaps,
+                                                         struct radial_stats_pixels *rsp)
+{
+	struct radial_bin_order *ro;
+	int p, i, r;
+	float max_r = -1e9;
+	int *fill;
+
+	ro = cfmalloc(sizeof(struct radial_bin_order));
+	if ( ro == NULL ) return NULL;
+
+	for ( p=0; p<rmaps->n_rmaps; p++ ) {
+		for ( i=0; i<rmaps->n_pixels[p]; i++ ) {
+			if ( rmaps->r_maps[p][i] > max_r ) {
+				max_r = rmaps->r_maps[p][i];
+			}
+		}
+	}
+	ro->n_bins = (int)ceil(max_r) + 1;
+
+	ro->n_pixels = 0;
+	for ( p=0; p<rmaps->n_rmaps; p++ ) {
+		ro->n_pixels += (rsp != NULL) ? rsp->n_pixels[p]
+		                              : rmaps->n_pixels[p];
+	}
+
+	ro->bin_start = cfcalloc(ro->n_bins+1, sizeof(int));
+	ro->panel = cfmalloc(ro->n_pixels*sizeof(int));
+	ro->idx = cfmalloc(ro->n_pixels*sizeof(int));
+	fill = cfcalloc(ro->n_bins, sizeof(int));
+	if ( (ro->bin_start == NULL) || (ro->panel == NULL)
+	  || (ro->idx == NULL) || (fill == NULL) )
+	{
+		cffree(fill);
+		free_radial_bin_order(ro);
+		return NULL;
+	}
+
+	/* Counting sort: first count the pixels in each bin... */
+	for ( p=0; p<rmaps->n_rmaps; p++ ) {
+		if ( rsp != NULL ) {
+			for ( i=0; i<rsp->n_pixels[p]; i++ ) {
+				ro->bin_start[rsp->radius[p][i]+1]++;
+			}
+		} else {
+			for ( i=0; i<rmaps->n_pixels[p]; i++ ) {
+				r = (int)rint(rmaps->r_maps[p][i]);
+				ro->bin_start[r+1]++;
+			}
+		}
+	}
+	for ( r=0; r<ro->n_bins; r++ ) {
+		ro->bin_start[r+1] += ro->bin_start[r];
+	}
+
+	/* ... then put them in place */
+	for ( p=0; p<rmaps->n_rmaps; p++ ) {
+		int n = (rsp != NULL) ? rsp->n_pixels[p] : rmaps->n_pixels[p];
+		for ( i=0; i<n; i++ ) {
+			int k, pidx;
+			if ( rsp != NULL ) {
+				r = rsp->radius[p][i];
+				pidx = rsp->pidx[p][i];
+			} else {
+				r = (int)rint(rmaps->r_maps[p][i]);
+				pidx = i;
+			}
+			k = ro->bin_start[r] + fill[r]++;
+			ro->panel[k] = p;
+			ro->idx[k] = pidx;
+		}
+	}
+
+	cffree(fill);
+	return ro;
+}
+
+
 // CrystFEL-only block 2
+static void hash_bytes(uint64_t *h, const void *vp, size_t len)
+{
+	const unsigned char *p = vp;
+	size_t i;
+
+	/* FNV-1a */
+	for ( i=0; i<len; i++ ) {
+		*h ^= p[i];
+		*h *= 0x100000001b3ULL;
+	}
+}
+
+
+/* Hash of everything in the geometry which affects the radius maps */
+static uint64_t pf8_geom_hash(struct detgeom *det, int fast_mode)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int i;
+
+	hash_bytes(&h, &fast_mode, sizeof(int));
+	hash_bytes(&h, &det->n_panels, sizeof(int));
+	for ( i=0; i<det->n_panels; i++ ) {
+		struct detgeom_panel *p = &det->panels[i];
+		hash_bytes(&h, &p->w, sizeof(int));
+		hash_bytes(&h, &p->h, sizeof(int));
+		hash_bytes(&h, &p->cnx, sizeof(double));
+		hash_bytes(&h, &p->cny, sizeof(double));
+		hash_bytes(&h, &p->fsx, sizeof(double));
+		hash_bytes(&h, &p->fsy, sizeof(double));
+		hash_bytes(&h, &p->ssx, sizeof(double));
+		hash_bytes(&h, &p->ssy, sizeof(double));
+	}
+	return h;
+}
+
+
 struct pf8_private_data *prepare_peakfinder8(struct detgeom *det, int fast_mode)
 {
 	struct pf8_private_data *data = NULL;
@@ -351,81 +499,478 @@ struct pf8_private_data *prepare_peakfinder8(struct detgeom *det, int fast_mode)
 		data->rpixels = compute_rstats_pixels(data->rmaps);
 		if ( data->rpixels == NULL ) {
 			free_radius_maps(data->rmaps);
-			free(data);
+			cffree(data);
 			return NULL;
 		}
 	} else {
 		data->rpixels = NULL;
 	}
+	data->rorder = compute_radial_bin_order(data->rmaps, data->rpixels);
+	if ( data->rorder == NULL ) {
+		if ( fast_mode ) free_rstats_pixels(data->rpixels);
+		free_radius_maps(data->rmaps);
+		cffree(data);
+		return NULL;
+	}
+	data->fast_mode = fast_mode;
+	data->geom_hash = pf8_geom_hash(det, fast_mode);
+	data->n_threads = 1;
+	data->map = NULL;
+	data->map_size = 0;
+	data->gpu = NULL;
+	data->resmask = NULL;
+	return data;
+}
+
+
+/* The cache file contains a pf8_cache_header, then the width and height of
+ * each panel, then the radius maps for all panels, then the bin order
+ * (bin_start, panel and idx, in that order).  Everything is in the byte order
+ * of the machine which wrote it. */
+#define PF8_CACHE_MAGIC "CFPF8MAP"
+#define PF8_CACHE_VERSION (1)
+#define PF8_CACHE_BYTE_ORDER (0x01020304)
+
+struct pf8_cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t geom_hash;
+	int32_t fast_mode;
+	int32_t n_panels;
+	int32_t n_bins;
+	int32_t n_pixels;  /* Number of pixels in the bin order */
+};
+
+
+static size_t pf8_cache_size(struct detgeom *det, int n_bins, int n_pixels)
+{
+	size_t size = sizeof(struct pf8_cache_header);
+	int i;
+
+	size += 2*det->n_panels*sizeof(int32_t);
+	for ( i=0; i<det->n_panels; i++ ) {
+		size += det->panels[i].w * det->panels[i].h * sizeof(float);
+	}
+	size += (n_bins+1)*sizeof(int);
+	size += 2*n_pixels*sizeof(int);
+	return size;
+}
+
+
+static char *pf8_cache_filename(const char *cache_dir, uint64_t hash)
+{
+	size_t len = strlen(cache_dir) + 64;
+	char *filename = cfmalloc(len);
+	if ( filename == NULL ) return NULL;
+	snprintf(filename, len, "%s/pf8-%016llx.map", cache_dir,
+	         (unsigned long long)hash);
+	return filename;
+}
+
+
+static int write_all(int fd, const void *vp, size_t len)
+{
+	const char *p = vp;
+
+	while ( len > 0 ) {
+		ssize_t r = write(fd, p, len);
+		if ( r <= 0 ) return 1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+
+/* Writes to a temporary file first, so that other processes never see a
+ * partially written cache file */
+static int write_pf8_cache(const char *filename, struct detgeom *det,
+                           struct pf8_private_data *data, uint64_t hash)
+{
+	struct pf8_cache_header hdr;
+	struct radial_bin_order *ro = data->rorder;
+	char *tmp;
+	size_t len;
+	int fd;
+	int i;
+	int fail = 0;
+
+	len = strlen(filename) + 32;
+	tmp = cfmalloc(len);
+	if ( tmp == NULL ) return 1;
+	snprintf(tmp, len, "%s.tmp%i", filename, (int)getpid());
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if ( fd == -1 ) {
+		cffree(tmp);
+		return 1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PF8_CACHE_MAGIC, 8);
+	hdr.version = PF8_CACHE_VERSION;
+	hdr.byte_order = PF8_CACHE_BYTE_ORDER;
+	hdr.geom_hash = hash;
+	hdr.fast_mode = data->fast_mode;
+	hdr.n_panels = det->n_panels;
+	hdr.n_bins = ro->n_bins;
+	hdr.n_pixels = ro->n_pixels;
+	fail |= write_all(fd, &hdr, sizeof(hdr));
+
+	for ( i=0; i<det->n_panels; i++ ) {
+		int32_t wh[2];
+		wh[0] = det->panels[i].w;
+		wh[1] = det->panels[i].h;
+		fail |= write_all(fd, wh, sizeof(wh));
+	}
+	for ( i=0; i<det->n_panels; i++ ) {
+		fail |= write_all(fd, data->rmaps->r_maps[i],
+		                  data->rmaps->n_pixels[i]*sizeof(float));
+	}
+	fail |= write_all(fd, ro->bin_start, (ro->n_bins+1)*sizeof(int));
+	fail |= write_all(fd, ro->panel, ro->n_pixels*sizeof(int));
+	fail |= write_all(fd, ro->idx, ro->n_pixels*sizeof(int));
+
+	if ( close(fd) ) fail = 1;
+	if ( !fail && rename(tmp, filename) ) fail = 1;
+	if ( fail ) unlink(tmp);
+	cffree(tmp);
+	return fail;
+}
+
+
+/* Maps the cache file read-only.  Returns NULL if the file doesn't exist or
+ * doesn't match the geometry. */
+static struct pf8_private_data *read_pf8_cache(const char *filename,
+                                               struct detgeom *det,
+                                               int fast_mode, uint64_t hash)
+{
+	struct pf8_private_data *data;
+	struct pf8_cache_header hdr;
+	struct stat statbuf;
+	struct radius_maps *rm;
+	struct radial_bin_order *ro;
+	const int32_t *wh;
+	char *map;
+	char *pos;
+	int fd;
+	int i;
+
+	fd = open(filename, O_RDONLY);
+	if ( fd == -1 ) return NULL;
+
+	if ( (fstat(fd, &statbuf) == -1)
+	  || (statbuf.st_size < (off_t)sizeof(hdr))
+	  || (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) )
+	{
+		close(fd);
+		return NULL;
+	}
+
+	if ( (memcmp(hdr.magic, PF8_CACHE_MAGIC, 8) != 0)
+	  || (hdr.version != PF8_CACHE_VERSION)
+	  || (hdr.byte_order != PF8_CACHE_BYTE_ORDER)
+	  || (hdr.geom_hash != hash)
+	  || (hdr.fast_mode != fast_mode)
+	  || (hdr.n_panels != det->n_panels)
+	  || (hdr.n_bins < 1) || (hdr.n_pixels < 0)
+	  || ((size_t)statbuf.st_size != pf8_cache_size(det, hdr.n_bins,
+	                                                hdr.n_pixels)) )
+	{
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) return NULL;
+
+	pos = map + sizeof(hdr);
+	wh = (const int32_t *)pos;
+	for ( i=0; i<det->n_panels; i++ ) {
+		if ( (wh[2*i] != det->panels[i].w)
+		  || (wh[2*i+1] != det->panels[i].h) )
+		{
+			munmap(map, statbuf.st_size);
+			return NULL;
+		}
+	}
+	pos += 2*det->n_panels*sizeof(int32_t);
+
+	data = cfmalloc(sizeof(struct pf8_private_data));
+	rm = cfmalloc(sizeof(struct radius_maps));
+	ro = cfmalloc(sizeof(struct radial_bin_order));
+	if ( (data == NULL) || (rm == NULL) || (ro == NULL) ) {
+		cffree(data);
+		cffree(rm);
+		cffree(ro);
+		munmap(map, statbuf.st_size);
+		return NULL;
+	}
+	rm->r_maps = cfmalloc(det->n_panels*sizeof(float *));
+	rm->n_pixels = cfmalloc(det->n_panels*sizeof(int));
+	if ( (rm->r_maps == NULL) || (rm->n_pixels == NULL) ) {
+		cffree(rm->r_maps);
+		cffree(rm->n_pixels);
+		cffree(data);
+		cffree(rm);
+		cffree(ro);
+		munmap(map, statbuf.st_size);
+		return NULL;
+	}
+
+	rm->n_rmaps = det->n_panels;
+	for ( i=0; i<det->n_panels; i++ ) {
+		rm->n_pixels[i] = det->panels[i].w * det->panels[i].h;
+		rm->r_maps[i] = (float *)pos;
+		pos += rm->n_pixels[i]*sizeof(float);
+	}
+
+	ro->n_bins = hdr.n_bins;
+	ro->n_pixels = hdr.n_pixels;
+	ro->bin_start = (int *)pos;
+	pos += (ro->n_bins+1)*sizeof(int);
+	ro->panel = (int *)pos;
+	pos += ro->n_pixels*sizeof(int);
+	ro->idx = (int *)pos;
+
+	data->rmaps = rm;
+	data->rpixels = NULL;
+	data->rorder = ro;
 	data->fast_mode = fast_mode;
+	data->geom_hash = hash;
+	data->n_threads = 1;
+	data->map = map;
+	data->map_size = statbuf.st_size;
+	data->gpu = NULL;
+	data->resmask = NULL;
 	return data;
 }
 
 
+/**
+ * \param det A \ref detgeom structure
+ * \param fast_mode Non-zero to use the pixel sampling for fast mode
+ * \param cache_dir A directory for cache files
+ *
+ * As prepare_peakfinder8(), but the results are kept in a file in
+ * \p cache_dir, with a name based on a hash of the geometry.  If the file
+ * already exists, it will be mapped into memory read-only, instead of doing the
+ * calculations again.  All the processes using the same file will share the
+ * same memory.
+ *
+ * If the cache file can't be written, the results will be calculated as
+ * normal, so this function only fails when prepare_peakfinder8() would.
+ *
+ * \returns a new \ref pf8_private_data structure, or NULL on error.
+ */
+struct pf8_private_data *prepare_peakfinder8_cached(struct detgeom *det,
+                                                    int fast_mode,
+                                                    const char *cache_dir)
+{
+	struct pf8_private_data *data;
+	uint64_t hash;
+	char *filename;
+
+	if ( det == NULL ) return NULL;
+	if ( cache_dir == NULL ) return prepare_peakfinder8(det, fast_mode);
+
+	hash = pf8_geom_hash(det, fast_mode);
+	filename = pf8_cache_filename(cache_dir, hash);
+	if ( filename == NULL ) return prepare_peakfinder8(det, fast_mode);
+
+	data = read_pf8_cache(filename, det, fast_mode, hash);
+	if ( data != NULL ) {
+		cffree(filename);
+		return data;
+	}
+
+	data = prepare_peakfinder8(det, fast_mode);
+	if ( data == NULL ) {
+		cffree(filename);
+		return NULL;
+	}
+
+	if ( write_pf8_cache(filename, det, data, hash) ) {
+		ERROR("WARNING: Couldn't write peakfinder8 cache file %s\n",
+		      filename);
+	} else {
+		/* Use the file, so that the memory is shared with the other
+		 * processes which will use it */
+		struct pf8_private_data *mapped;
+		mapped = read_pf8_cache(filename, det, fast_mode, hash);
+		if ( mapped != NULL ) {
+			free_pf8_private_data(data);
+			data = mapped;
+		}
+	}
+
+	cffree(filename);
+	return data;
+}
+
+
+/**
+ * \param data A \ref pf8_private_data structure
+ * \param det A \ref detgeom structure
+ * \param fast_mode Non-zero for fast mode
+ *
+ * Checks whether \p data could be used for a peak search in \p det, with or
+ * without fast mode, i.e. whether it would be the same as if it was prepared
+ * again with prepare_peakfinder8(det, fast_mode).  This allows \p data to be
+ * kept for images which might have different geometries.
+ *
+ * \returns non-zero if \p data matches.
+ */
+int pf8_private_data_matches(struct pf8_private_data *data,
+                             struct detgeom *det, int fast_mode)
+{
+	if ( (data == NULL) || (det == NULL) ) return 0;
+	if ( data->fast_mode != fast_mode ) return 0;
+	return data->geom_hash == pf8_geom_hash(det, fast_mode);
+}
+
+
+static void free_peakfinder_mask(struct peakfinder_mask * pfmask)
+{
+	int i;
+
+	for ( i=0 ; i<pfmask->n_masks ; i++ ) {
+		cffree(pfmask->masks[i]);
+	}
+	cffree(pfmask->masks);
+	cffree(pfmask);
+}
+
+
 void free_pf8_private_data(struct pf8_private_data *data)
 {
+	pf8_gpu_free(data->gpu);
+	if ( data->resmask != NULL ) free_peakfinder_mask(data->resmask);
+
+	if ( data->map != NULL ) {
+		/* Only the pointers are ours, the arrays are in the map */
+		cffree(data->rmaps->r_maps);
+		cffree(data->rmaps->n_pixels);
+		cffree(data->rmaps);
+		cffree(data->rorder);
+		munmap(data->map, data->map_size);
+		cffree(data);
+		return;
+	}
+
 	free_radius_maps(data->rmaps);
 	if ( data->fast_mode ) {
 		free_rstats_pixels(data->rpixels);
 	}
+	free_radial_bin_order(data->rorder);
 	cffree(data);
 }
 
 
-static struct peakfinder_mask *create_peakfinder_mask(const struct image *img,
-                                                      struct radius_maps *rmps,
-                                                      int min_res,
-                                                      int max_res)
+static struct peakfinder_mask *alloc_peakfinder_mask(struct detgeom *det)
 {
 	int i;
 	struct peakfinder_mask *msk;
 
-	msk = (struct peakfinder_mask *)cfmalloc(sizeof(struct peakfinder_mask));
-	msk->masks =(char **) cfmalloc(img->detgeom->n_panels*sizeof(char*));
-	msk->n_masks = img->detgeom->n_panels;
-	for ( i=0; i<img->detgeom->n_panels; i++) {
+	msk = cfmalloc(sizeof(struct peakfinder_mask));
+	if ( msk == NULL ) return NULL;
+	msk->masks = cfcalloc(det->n_panels, sizeof(char *));
+	if ( msk->masks == NULL ) {
+		cffree(msk);
+		return NULL;
+	}
+	msk->n_masks = det->n_panels;
 
-		struct detgeom_panel p;
-		int iss, ifs;
+	for ( i=0; i<det->n_panels; i++ ) {
+		struct detgeom_panel *p = &det->panels[i];
+		msk->masks[i] = cfmalloc(p->w*p->h*sizeof(char));
+		if ( msk->masks[i] == NULL ) {
+			free_peakfinder_mask(msk);
+			return NULL;
+		}
+	}
 
-		p = img->detgeom->panels[i];
+	return msk;
+}
 
-		msk->masks[i] = (char *)cfcalloc(p.w*p.h,sizeof(char));
 
-		for ( iss=0 ; iss<p.h ; iss++ ) {
-			for ( ifs=0 ; ifs<p.w ; ifs++ ) {
+/* The part of the mask which only depends on the geometry and resolution
+ * limits is kept in the private data, and only re-calculated if the limits
+ * change */
+static struct peakfinder_mask *get_resolution_mask(struct pf8_private_data *data,
+                                                   struct detgeom *det,
+                                                   int min_res, int max_res)
+{
+	struct radius_maps *rmps = data->rmaps;
+	struct peakfinder_mask *msk;
+	int i;
 
-				int idx;
+	if ( (data->resmask != NULL)
+	  && (data->resmask_min_res == min_res)
+	  && (data->resmask_max_res == max_res) )
+	{
+		return data->resmask;
+	}
 
-				idx = ifs + iss*p.w;
+	msk = alloc_peakfinder_mask(det);
+	if ( msk == NULL ) return NULL;
 
-				if ( ((max_res == 0) || (rmps->r_maps[i][idx] < max_res))
-				  && rmps->r_maps[i][idx] > min_res )
-				{
+	for ( i=0; i<det->n_panels; i++ ) {
 
-					if  (! ( ( img->bad != NULL )
-					      && ( img->bad[i] != NULL )
-					      && ( img->bad[i][idx] != 0 ) ) ) {
-						msk->masks[i][idx] = 1;
-					}
+		int idx;
+		int n = det->panels[i].w * det->panels[i].h;
 
-				}
-			}
+		for ( idx=0; idx<n; idx++ ) {
+			msk->masks[i][idx] = ((max_res == 0)
+			                      || (rmps->r_maps[i][idx] < max_res))
+			                  && (rmps->r_maps[i][idx] > min_res);
 		}
 	}
+
+	if ( data->resmask != NULL ) free_peakfinder_mask(data->resmask);
+	data->resmask = msk;
+	data->resmask_min_res = min_res;
+	data->resmask_max_res = max_res;
 	return msk;
 }
 
 
-static void free_peakfinder_mask(struct peakfinder_mask * pfmask)
+/* Combines the resolution mask with the bad pixels of this frame.  If there
+ * is no bad pixel map, the resolution mask itself will be returned, which
+ * must not be freed. */
+static struct peakfinder_mask *create_peakfinder_mask(const struct image *img,
+                                                      struct peakfinder_mask *resmask)
 {
 	int i;
+	struct peakfinder_mask *msk;
 
-	for ( i=0 ; i<pfmask->n_masks ; i++ ) {
-		cffree(pfmask->masks[i]);
+	if ( img->bad == NULL ) return resmask;
+
+	msk = alloc_peakfinder_mask(img->detgeom);
+	if ( msk == NULL ) return NULL;
+
+	for ( i=0; i<img->detgeom->n_panels; i++) {
+
+		struct detgeom_panel *p = &img->detgeom->panels[i];
+		const char *rm = resmask->masks[i];
+		const uint8_t *bad = img->bad[i];
+		char *m = msk->masks[i];
+		int idx;
+		int n = p->w*p->h;
+
+		if ( bad == NULL ) {
+			memcpy(m, rm, n);
+			continue;
+		}
+
+		for ( idx=0; idx<n; idx++ ) {
+			m[idx] = rm[idx] & (bad[idx] == 0);
+		}
 	}
-	cffree(pfmask->masks);
-	cffree(pfmask);
+	return msk;
 }
 
 
@@ -475,20 +1020,6 @@ static void free_panel_data(struct peakfinder_panel_data *pfdata)
 }
 
 
-static void compute_num_radial_bins(int w, int h, float *r_map, float *max_r)
-{
-	int ifs, iss;
-	int pidx;
-
-	for ( iss=0 ; iss<h ; iss++ ) {
-		for ( ifs=0 ; ifs<w ; ifs++ ) {
-			pidx = iss * w + ifs;
-			if ( r_map[pidx] > *max_r ) {
-				*max_r = r_map[pidx];
-			}
-		}
-	}
-}
 // End of CrystFEL-only block 2
 
 
@@ -558,66 +1089,89 @@ static void free_radial_stats(struct radial_stats *rstats)
 }
 
 
-static void fill_radial_bins(float *data,
-                             int w,
-                             int h,
-                             float *r_map,
-                             char *mask,
-                             float *rthreshold,
-                             float *lthreshold,
-                             float *roffset,
-                             float *rsigma,
-                             int *rcount)
+/* Gathers the unmasked pixel values for bins r0 to r1-1, in order of radial
+ * bin.  The values for bin r will start at vals[ro->bin_start[r]], and there
+ * will be vcount[r] of them. */
+static void gather_radial_bins(struct radial_bin_order *ro, float **data,
+                               char **masks, int r0, int r1,
+                               float *vals, int *vcount)
 {
-	int iss, ifs;
-	int pidx;
-
-	int curr_r;
-	float value;
-
-	for ( iss=0; iss<h; iss++ ) {
-		for ( ifs=0; ifs<w; ifs++ ) {
-			pidx = iss * w + ifs;
-			if ( mask[pidx] != 0 ) {
-				curr_r = (int)rint(r_map[pidx]);
-				value = data[pidx];
-				if ( value < rthreshold[curr_r]
-				  && value > lthreshold[curr_r] )
-				{
-					roffset[curr_r] += value;
-					rsigma[curr_r] += (value * value);
-					rcount[curr_r] += 1;
-				}
+	int r;
+
+	for ( r=r0; r<r1; r++ ) {
+
+		int k;
+		int n = ro->bin_start[r];
+
+		for ( k=ro->bin_start[r]; k<ro->bin_start[r+1]; k++ ) {
+			int p = ro->panel[k];
+			int i = ro->idx[k];
+			if ( masks[p][i] != 0 ) {
+				vals[n++] = data[p][i];
 			}
 		}
+		vcount[r] = n - ro->bin_start[r];
+
 	}
 }
 
-static void fill_radial_bins_fast(float *data, int w, int h, int n_pixels,
-				  int *pidx, int *radius, char *mask,
-				  float *rthreshold, float *lthreshold,
-				  float *roffset, float *rsigma, int *rcount)
+
+/* The values for each bin are contiguous, so the sums can be done in blocks
+ * of RBIN_BLOCK with independent accumulators, which the compiler can turn
+ * into vector instructions */
+#define RBIN_BLOCK (8)
+static void fill_radial_bins(const float *vals, const int *vstart,
+                             const int *vcount, int n_bins,
+                             float *rthreshold, float *lthreshold,
+                             float *roffset, float *rsigma, int *rcount)
 {
-	int i;
+	int r;
+
+	for ( r=0; r<n_bins; r++ ) {
+
+		float sum[RBIN_BLOCK];
+		float sumsq[RBIN_BLOCK];
+		int count[RBIN_BLOCK];
+		const float rt = rthreshold[r];
+		const float lt = lthreshold[r];
+		const int end = vstart[r] + vcount[r];
+		int k, j;
+
+		for ( j=0; j<RBIN_BLOCK; j++ ) {
+			sum[j] = 0.0;
+			sumsq[j] = 0.0;
+			count[j] = 0;
+		}
 
-	int curr_r;
-	float value;
+		for ( k=vstart[r]; k+RBIN_BLOCK<=end; k+=RBIN_BLOCK ) {
+			for ( j=0; j<RBIN_BLOCK; j++ ) {
+				float value = vals[k+j];
+				int in = (value < rt) & (value > lt);
+				float w = in;
+				sum[j] += w*value;
+				sumsq[j] += w*value*value;
+				count[j] += in;
+			}
+		}
 
-	for (i = 0; i < n_pixels; i++)
-	{
-		if (mask[pidx[i]] != 0)
-		{
-			curr_r = radius[i];
-			value = data[pidx[i]];
-			if (value < rthreshold[curr_r] && value > lthreshold[curr_r])
-			{
-				roffset[curr_r] += value;
-				rsigma[curr_r] += (value * value);
-				rcount[curr_r] += 1;
+		for ( j=0; k<end; k++, j++ ) {
+			float value = vals[k];
+			if ( (value < rt) && (value > lt) ) {
+				sum[j] += value;
+				sumsq[j] += value*value;
+				count[j] += 1;
 			}
 		}
+
+		for ( j=0; j<RBIN_BLOCK; j++ ) {
+			roffset[r] += sum[j];
+			rsigma[r] += sumsq[j];
+			rcount[r] += count[j];
+		}
 	}
 }
+#undef RBIN_BLOCK
+
 
 static void compute_radial_stats(float *rthreshold,
                                  float *lthreshold,
@@ -1236,211 +1790,422 @@ static int peakfinder8_base(float *roffset, float *rthreshold,
 }
 
 
-/**
- * \param img An \ref image structure
- * \param max_n_peaks The maximum number of peaks to be searched for
- * \param threshold The image threshold value, in detector units
- * \param min_snr The minimum signal to noise ratio for a peak
- * \param min_pix_count The minimum number of pixels in a peak
- * \param max_pix_count The maximum number of pixels in a peak
- * \param local_bg_radius The averaging radius for background calculation
- * \param min_res The minimum number of pixels out from the center
- * \param max_res The maximum number of pixels out from the center
- * \param use_saturated Whether saturated peaks should be considered
- *
- * Runs the peakfinder8 peak search algorithm, and returns an \ref ImageFeatureList,
- * or NULL on error.
- */
-ImageFeatureList *peakfinder8(const struct image *img, int max_n_peaks,
-                              float threshold, float min_snr,
-                              int min_pix_count, int max_pix_count,
-                              int local_bg_radius, int min_res,
-                              int max_res, int use_saturated,
-                              int fast_mode, struct pf8_private_data *private_data)
+/* The work for one frame, which can be shared between several threads.  The
+ * radial statistics are split into ranges of bins, and the peak search is
+ * split by panel. */
+struct pf8_frame_job
 {
-	struct pf8_private_data *geomdata;
-	struct radius_maps *rmaps;
-	struct radial_stats_pixels *rspixels;
-
-	struct peakfinder_mask *pfmask;
-	struct peakfinder_panel_data *pfdata;
+	/* Radial statistics */
+	struct radial_bin_order *rorder;
 	struct radial_stats *rstats;
-	struct peakfinder_peak_data *pkdata;
-	int num_rad_bins;
-	int pi;
-	int i, it_counter;
-	int num_found_peaks;
-	int remaining_max_num_peaks;
+	struct peakfinder_mask *pfmask;
+	int own_mask;                  /* Zero if pfmask is the resolution mask */
+	char **masks;
+	float *vals;
+	int *vcount;
 	int iterations;
-	float max_r;
-	ImageFeatureList *peaks;
+	float min_snr;
+	float threshold;
+	int bins_per_task;
 
-	iterations = 5;
+	/* Peak search */
+	struct peakfinder_panel_data *pfdata;
+	struct radius_maps *rmaps;
+	struct peakfinder_peak_data **pkdata;  /* One per panel */
+	int *num_found_peaks;                  /* One per panel */
+	int *ret;                              /* One per panel */
+	int max_n_peaks;
+	int min_pix_count;
+	int max_pix_count;
+	int local_bg_radius;
+
+	int n_tasks;
+	int next_task;
+};
 
-	if ( img->detgeom == NULL) return NULL;
 
-	profile_start("pf8-rmaps");
-	if ( private_data == NULL ) {
-		geomdata = prepare_peakfinder8(img->detgeom, fast_mode);
-	} else {
-		geomdata = private_data;
-	}
-	rmaps = geomdata->rmaps;
-	rspixels = geomdata->rpixels;
-	profile_end("pf8-rmaps");
-	if (geomdata == NULL) return NULL;
+struct pf8_task
+{
+	struct pf8_frame_job *job;
+	int n;
+};
 
-	profile_start("pf8-mask");
-	pfmask = create_peakfinder_mask(img, rmaps, min_res, max_res);
-	profile_end("pf8-mask");
-	if ( pfmask == NULL ) {
-		if ( private_data == NULL ) free_pf8_private_data(geomdata);
-		return NULL;
-	}
 
-	pfdata = allocate_panel_data(img->detgeom->n_panels);
-	if ( pfdata == NULL) {
-		if ( private_data == NULL ) free_pf8_private_data(geomdata);
-		free_peakfinder_mask(pfmask);
-		return NULL;
-	}
+static void *pf8_get_task(void *vp)
+{
+	struct pf8_frame_job *job = vp;
+	struct pf8_task *task;
 
-	for ( pi=0 ; pi<img->detgeom->n_panels ; pi++ ) {
-		pfdata->panel_h[pi] = img->detgeom->panels[pi].h;
-		pfdata->panel_w[pi] = img->detgeom->panels[pi].w;
-		pfdata->panel_data[pi] = img->dp[pi];
-		pfdata->num_panels = img->detgeom->n_panels;
-	}
+	if ( job->next_task >= job->n_tasks ) return NULL;
 
-	max_r = -1e9;
+	task = cfmalloc(sizeof(struct pf8_task));
+	if ( task == NULL ) return NULL;
+	task->job = job;
+	task->n = job->next_task++;
+	return task;
+}
 
-	for ( pi=0 ; pi<pfdata->num_panels ; pi++ ) {
 
-		compute_num_radial_bins(pfdata->panel_w[pi],
-		                        pfdata->panel_h[pi],
-		                        rmaps->r_maps[pi],
-		                        &max_r);
-	}
+static void pf8_final(void *vp, void *work)
+{
+	cffree(work);
+}
 
-	num_rad_bins = (int)ceil(max_r) + 1;
 
-	rstats = allocate_radial_stats(num_rad_bins);
-	if ( rstats == NULL ) {
-		if ( private_data == NULL ) free_pf8_private_data(geomdata);
-		free_peakfinder_mask(pfmask);
-		free_panel_data(pfdata);
-		return NULL;
-	}
+static void pf8_rstats_work(void *work, int cookie)
+{
+	struct pf8_task *task = work;
+	struct pf8_frame_job *job = task->job;
+	struct radial_stats *rstats = job->rstats;
+	int r0, r1, n, i, it_counter;
+
+	r0 = task->n * job->bins_per_task;
+	r1 = r0 + job->bins_per_task;
+	if ( r1 > rstats->n_rad_bins ) r1 = rstats->n_rad_bins;
+	n = r1 - r0;
 
-	for ( i=0 ; i<rstats->n_rad_bins ; i++) {
+	gather_radial_bins(job->rorder, job->pfdata->panel_data, job->masks,
+	                   r0, r1, job->vals, job->vcount);
+
+	for ( i=r0; i<r1; i++ ) {
 		rstats->rthreshold[i] = 1e9;
 		rstats->lthreshold[i] = -1e9;
 	}
-	profile_start("pf8-rstats");
-	for ( it_counter=0 ; it_counter<iterations ; it_counter++ ) {
 
-		for ( i=0; i<num_rad_bins; i++ ) {
+	/* Each bin is independent of all the others, so the iterations can
+	 * be done separately for each range of bins */
+	for ( it_counter=0 ; it_counter<job->iterations ; it_counter++ ) {
+
+		for ( i=r0; i<r1; i++ ) {
 			rstats->roffset[i] = 0;
 			rstats->rsigma[i] = 0;
 			rstats->rcount[i] = 0;
 		}
 
-		for ( pi=0 ; pi<pfdata->num_panels ; pi++ ) {
-			if ( fast_mode ) {
-				fill_radial_bins_fast(pfdata->panel_data[pi],
-						      pfdata->panel_w[pi],
-						      pfdata->panel_h[pi],
-						      rspixels->n_pixels[pi],
-						      rspixels->pidx[pi],
-						      rspixels->radius[pi],
-						      pfmask->masks[pi],
-						      rstats->rthreshold,
-						      rstats->lthreshold,
-						      rstats->roffset,
-						      rstats->rsigma,
-						      rstats->rcount);
-			} else {
-				fill_radial_bins(pfdata->panel_data[pi],
-						 pfdata->panel_w[pi],
-						 pfdata->panel_h[pi],
-						 rmaps->r_maps[pi],
-						 pfmask->masks[pi],
-						 rstats->rthreshold,
-						 rstats->lthreshold,
-						 rstats->roffset,
-						 rstats->rsigma,
-						 rstats->rcount);
+		fill_radial_bins(job->vals, job->rorder->bin_start+r0,
+		                 job->vcount+r0, n,
+		                 rstats->rthreshold+r0,
+		                 rstats->lthreshold+r0,
+		                 rstats->roffset+r0,
+		                 rstats->rsigma+r0,
+		                 rstats->rcount+r0);
+
+		compute_radial_stats(rstats->rthreshold+r0,
+		                     rstats->lthreshold+r0,
+		                     rstats->roffset+r0,
+		                     rstats->rsigma+r0,
+		                     rstats->rcount+r0,
+		                     n, job->min_snr, job->threshold);
+
+	}
+}
+
+
+static void pf8_search_work(void *work, int cookie)
+{
+	struct pf8_task *task = work;
+	struct pf8_frame_job *job = task->job;
+	struct peakfinder_peak_data *pkdata = job->pkdata[task->n];
+	int pi = task->n;
+
+	job->num_found_peaks[pi] = 0;
+	job->ret[pi] = peakfinder8_base(job->rstats->roffset,
+	                                job->rstats->rthreshold,
+	                                job->pfdata->panel_data[pi],
+	                                job->masks[pi],
+	                                job->rmaps->r_maps[pi],
+	                                job->pfdata->panel_w[pi], 1,
+	                                job->pfdata->panel_h[pi], 1,
+	                                job->max_n_peaks,
+	                                &job->num_found_peaks[pi],
+	                                pkdata->npix,
+	                                pkdata->com_fs,
+	                                pkdata->com_ss,
+	                                pkdata->com_index,
+	                                pkdata->tot_i,
+	                                pkdata->max_i,
+	                                pkdata->sigma,
+	                                pkdata->snr,
+	                                job->min_pix_count,
+	                                job->max_pix_count,
+	                                job->local_bg_radius,
+	                                job->min_snr,
+	                                NULL);
+}
+
+
+static void pf8_run_tasks(struct pf8_frame_job *job, TPWorkFunc work,
+                          int n_tasks, int n_threads)
+{
+	job->n_tasks = n_tasks;
+	job->next_task = 0;
+
+	if ( (n_threads > 1) && (n_tasks > 1) ) {
+		run_threads(n_threads, work, pf8_get_task, pf8_final, job, 0,
+		            0, 0, 0);
+	} else {
+		int i;
+		for ( i=0; i<n_tasks; i++ ) {
+			struct pf8_task task;
+			task.job = job;
+			task.n = i;
+			work(&task, 0);
+		}
+	}
+}
+
+
+/**
+ * \param data A \ref pf8_private_data structure from prepare_peakfinder8()
+ * \param n_threads The number of threads to use
+ *
+ * Sets the number of threads which peakfinder8() will use for each frame,
+ * when given \p data.  The radial statistics will be divided up between the
+ * threads, and the panels will be searched in parallel.  The results are the
+ * same as for a single thread.
+ *
+ * The threads will come from the default thread pool, if one with the right
+ * number of threads has been set with set_default_thread_pool().  Otherwise,
+ * they will be started and stopped for every frame.
+ */
+void pf8_set_num_threads(struct pf8_private_data *data, int n_threads)
+{
+	if ( n_threads < 1 ) n_threads = 1;
+	data->n_threads = n_threads;
+}
+
+
+/**
+ * \param data A \ref pf8_private_data structure from prepare_peakfinder8()
+ *
+ * Sets up a GPU to do the radial statistics for peakfinder8() and
+ * peakfinder8_multi(), when given \p data.  The connected pixels will still
+ * be found by the CPU.  If the GPU fails later, the CPU will be used instead.
+ *
+ * The GPU can't be shared over fork(), so this should be called in the
+ * process which will do the peak search.
+ *
+ * \returns zero on success, or non-zero if no GPU could be used.
+ */
+int pf8_enable_gpu(struct pf8_private_data *data)
+{
+	if ( data->gpu != NULL ) return 0;
+	data->gpu = pf8_gpu_new(data->rorder->bin_start, data->rorder->n_bins,
+	                        data->rorder->n_pixels);
+	return data->gpu == NULL;
+}
+
+
+static void free_pkdata_list(struct peakfinder_peak_data **pkdata, int n)
+{
+	int i;
+
+	if ( pkdata == NULL ) return;
+	for ( i=0; i<n; i++ ) {
+		if ( pkdata[i] != NULL ) free_peak_data(pkdata[i]);
+	}
+	cffree(pkdata);
+}
+
+
+static void free_frame_job(struct pf8_frame_job *job, int n_panels)
+{
+	if ( job->own_mask ) free_peakfinder_mask(job->pfmask);
+	if ( job->pfdata != NULL ) free_panel_data(job->pfdata);
+	if ( job->rstats != NULL ) free_radial_stats(job->rstats);
+	cffree(job->vals);
+	cffree(job->vcount);
+	cffree(job->num_found_peaks);
+	cffree(job->ret);
+	free_pkdata_list(job->pkdata, n_panels);
+}
+
+
+/* Sets up everything needed to search one frame */
+static int setup_frame_job(struct pf8_frame_job *job, const struct image *img,
+                           struct pf8_private_data *geomdata,
+                           int max_n_peaks, float threshold, float min_snr,
+                           int min_pix_count, int max_pix_count,
+                           int local_bg_radius, int min_res, int max_res)
+{
+	int n_panels = img->detgeom->n_panels;
+	int num_rad_bins = geomdata->rorder->n_bins;
+	int n_threads = geomdata->n_threads;
+	int n_tasks;
+	int pi;
+
+	job->rorder = geomdata->rorder;
+	job->own_mask = 0;
+	job->rmaps = geomdata->rmaps;
+	job->rstats = NULL;
+	job->pfdata = NULL;
+	job->vals = NULL;
+	job->vcount = NULL;
+	job->num_found_peaks = NULL;
+	job->ret = NULL;
+	job->pkdata = NULL;
+
+	profile_start("pf8-mask");
+	job->pfmask = get_resolution_mask(geomdata, img->detgeom,
+	                                  min_res, max_res);
+	if ( job->pfmask != NULL ) {
+		job->pfmask = create_peakfinder_mask(img, job->pfmask);
+	}
+	profile_end("pf8-mask");
+	if ( job->pfmask == NULL ) return 1;
+	job->own_mask = (job->pfmask != geomdata->resmask);
+	job->masks = job->pfmask->masks;
+
+	job->pfdata = allocate_panel_data(n_panels);
+	if ( job->pfdata == NULL ) {
+		free_frame_job(job, n_panels);
+		return 1;
+	}
+
+	for ( pi=0 ; pi<n_panels ; pi++ ) {
+		job->pfdata->panel_h[pi] = img->detgeom->panels[pi].h;
+		job->pfdata->panel_w[pi] = img->detgeom->panels[pi].w;
+		job->pfdata->panel_data[pi] = img->dp[pi];
+		job->pfdata->num_panels = n_panels;
+	}
+
+	job->rstats = allocate_radial_stats(num_rad_bins);
+	job->vals = cfmalloc(job->rorder->n_pixels*sizeof(float));
+	job->vcount = cfmalloc(num_rad_bins*sizeof(int));
+	job->num_found_peaks = cfmalloc(n_panels*sizeof(int));
+	job->ret = cfmalloc(n_panels*sizeof(int));
+	job->pkdata = cfcalloc(n_panels, sizeof(struct peakfinder_peak_data *));
+	if ( job->pkdata != NULL ) {
+		for ( pi=0; pi<n_panels; pi++ ) {
+			job->pkdata[pi] = allocate_peak_data(max_n_peaks);
+			if ( job->pkdata[pi] == NULL ) {
+				free_pkdata_list(job->pkdata, n_panels);
+				job->pkdata = NULL;
+				break;
 			}
 		}
+	}
+	if ( (job->rstats == NULL) || (job->vals == NULL)
+	  || (job->vcount == NULL) || (job->num_found_peaks == NULL)
+	  || (job->ret == NULL) || (job->pkdata == NULL) )
+	{
+		free_frame_job(job, n_panels);
+		return 1;
+	}
 
-		compute_radial_stats(rstats->rthreshold,
-		                     rstats->lthreshold,
-		                     rstats->roffset,
-		                     rstats->rsigma,
-		                     rstats->rcount,
-		                     num_rad_bins,
-		                     min_snr,
-		                     threshold);
+	job->iterations = 5;
+	job->min_snr = min_snr;
+	job->threshold = threshold;
+	job->max_n_peaks = max_n_peaks;
+	job->min_pix_count = min_pix_count;
+	job->max_pix_count = max_pix_count;
+	job->local_bg_radius = local_bg_radius;
+
+	/* A few ranges of bins per thread, to even out the load */
+	n_tasks = (n_threads > 1) ? 4*n_threads : 1;
+	job->bins_per_task = (num_rad_bins + n_tasks - 1) / n_tasks;
+
+	return 0;
+}
 
+
+static void radial_stats_cpu(struct pf8_frame_job *job, int n_threads)
+{
+	int n_bins = job->rstats->n_rad_bins;
+	int n_tasks = (n_bins + job->bins_per_task - 1) / job->bins_per_task;
+
+	pf8_run_tasks(job, pf8_rstats_work, n_tasks, n_threads);
+}
+
+
+/* Does the radial statistics for several frames at once on the GPU */
+static int radial_stats_gpu(struct pf8_gpu *gpu, struct pf8_frame_job *jobs,
+                            int n_frames)
+{
+	const float **vals;
+	const int **vcount;
+	float **roffset;
+	float **rthreshold;
+	int i, r;
+
+	vals = cfmalloc(n_frames*sizeof(float *));
+	vcount = cfmalloc(n_frames*sizeof(int *));
+	roffset = cfmalloc(n_frames*sizeof(float *));
+	rthreshold = cfmalloc(n_frames*sizeof(float *));
+	if ( (vals == NULL) || (vcount == NULL)
+	  || (roffset == NULL) || (rthreshold == NULL) )
+	{
+		cffree(vals);
+		cffree(vcount);
+		cffree(roffset);
+		cffree(rthreshold);
+		return 1;
 	}
-	profile_end("pf8-rstats");
 
-	pkdata = allocate_peak_data(max_n_peaks);
-	if ( pkdata == NULL ) {
-		if ( private_data == NULL ) free_pf8_private_data(geomdata);
-		free_peakfinder_mask(pfmask);
-		free_panel_data(pfdata);
-		free_radial_stats(rstats);
-		return NULL;
+	for ( i=0; i<n_frames; i++ ) {
+		struct pf8_frame_job *job = &jobs[i];
+		gather_radial_bins(job->rorder, job->pfdata->panel_data,
+		                   job->masks, 0, job->rorder->n_bins,
+		                   job->vals, job->vcount);
+		vals[i] = job->vals;
+		vcount[i] = job->vcount;
+		roffset[i] = job->rstats->roffset;
+		rthreshold[i] = job->rstats->rthreshold;
 	}
 
-	remaining_max_num_peaks = max_n_peaks;
-	peaks = image_feature_list_new();
+	r = pf8_gpu_radial_stats(gpu, n_frames, vals, vcount,
+	                         roffset, rthreshold, jobs[0].min_snr,
+	                         jobs[0].threshold, jobs[0].iterations);
+
+	cffree(vals);
+	cffree(vcount);
+	cffree(roffset);
+	cffree(rthreshold);
+	return r;
+}
+
+
+/* Searches the panels, and merges the results in panel order, as if the
+ * panels had been searched one after the other */
+static ImageFeatureList *search_frame(struct pf8_frame_job *job,
+                                      const struct image *img,
+                                      int use_saturated, int n_threads)
+{
+	int n_panels = img->detgeom->n_panels;
+	int remaining_max_num_peaks;
+	ImageFeatureList *peaks;
+	int pi;
+
 	profile_start("pf8-search");
-	for ( pi=0 ; pi<img->detgeom->n_panels ; pi++) {
+	pf8_run_tasks(job, pf8_search_work, n_panels, n_threads);
+
+	remaining_max_num_peaks = job->max_n_peaks;
+	peaks = image_feature_list_new();
+	for ( pi=0 ; pi<n_panels ; pi++) {
+		int n = job->num_found_peaks[pi];
+		if ( job->ret[pi] != 0 ) break;
+		if ( n > remaining_max_num_peaks ) n = remaining_max_num_peaks;
+		remaining_max_num_peaks -= n;
+	}
+	image_feature_list_reserve(peaks,
+	                           job->max_n_peaks - remaining_max_num_peaks);
 
+	remaining_max_num_peaks = job->max_n_peaks;
+	for ( pi=0 ; pi<n_panels ; pi++) {
+
+		struct peakfinder_peak_data *pkdata = job->pkdata[pi];
 		int peaks_to_add;
 		int pki;
-		int ret;
-
-		num_found_peaks = 0;
-
-		ret = peakfinder8_base(rstats->roffset,
-		                       rstats->rthreshold,
-		                       pfdata->panel_data[pi],
-		                       pfmask->masks[pi],
-		                       rmaps->r_maps[pi],
-		                       pfdata->panel_w[pi], 1,
-		                       pfdata->panel_h[pi], 1,
-		                       max_n_peaks,
-		                       &num_found_peaks,
-		                       pkdata->npix,
-		                       pkdata->com_fs,
-		                       pkdata->com_ss,
-		                       pkdata->com_index,
-		                       pkdata->tot_i,
-		                       pkdata->max_i,
-		                       pkdata->sigma,
-		                       pkdata->snr,
-		                       min_pix_count,
-		                       max_pix_count,
-		                       local_bg_radius,
-		                       min_snr,
-		                       NULL);
-
-		if ( ret != 0 ) {
-			if ( private_data == NULL ) free_pf8_private_data(geomdata);
-			free_peakfinder_mask(pfmask);
-			free_panel_data(pfdata);
-			free_radial_stats(rstats);
+
+		if ( job->ret[pi] != 0 ) {
 			image_feature_list_free(peaks);
 			profile_end("pf8-search");
 			return NULL;
 		}
 
-		peaks_to_add = num_found_peaks;
+		peaks_to_add = job->num_found_peaks[pi];
 
-		if ( num_found_peaks > remaining_max_num_peaks ) {
+		if ( job->num_found_peaks[pi] > remaining_max_num_peaks ) {
 			peaks_to_add = remaining_max_num_peaks;
 		}
 
@@ -1466,10 +2231,142 @@ ImageFeatureList *peakfinder8(const struct image *img, int max_n_peaks,
 	}
 	profile_end("pf8-search");
 
-	if ( private_data == NULL ) free_pf8_private_data(geomdata);
-	free_peakfinder_mask(pfmask);
-	free_panel_data(pfdata);
-	free_radial_stats(rstats);
-	free_peak_data(pkdata);
 	return peaks;
 }
+
+
+/**
+ * \param images An array of \ref image structures
+ * \param n_images The number of images
+ * \param peaks An array of \p n_images pointers, for the results
+ * \param max_n_peaks The maximum number of peaks to be searched for
+ * \param threshold The image threshold value, in detector units
+ * \param min_snr The minimum signal to noise ratio for a peak
+ * \param min_pix_count The minimum number of pixels in a peak
+ * \param max_pix_count The maximum number of pixels in a peak
+ * \param local_bg_radius The averaging radius for background calculation
+ * \param min_res The minimum number of pixels out from the center
+ * \param max_res The maximum number of pixels out from the center
+ * \param use_saturated Whether saturated peaks should be considered
+ * \param private_data A \ref pf8_private_data for the geometry of the images
+ *
+ * As peakfinder8(), but for several images with the same geometry.  If
+ * pf8_enable_gpu() has been used on \p private_data, the radial statistics for
+ * all the images will be worked out in one go on the GPU.
+ *
+ * The list of peaks for each image will be put in \p peaks.  If the peak
+ * search fails for an image, its entry will be NULL.
+ *
+ * \returns zero on success, or non-zero if nothing could be done.
+ */
+int peakfinder8_multi(struct image **images, int n_images,
+                      ImageFeatureList **peaks, int max_n_peaks,
+                      float threshold, float min_snr,
+                      int min_pix_count, int max_pix_count,
+                      int local_bg_radius, int min_res,
+                      int max_res, int use_saturated,
+                      struct pf8_private_data *private_data)
+{
+	struct pf8_frame_job *jobs;
+	int i;
+	int n_threads;
+
+	if ( (private_data == NULL) || (n_images < 1) ) return 1;
+	n_threads = private_data->n_threads;
+
+	jobs = cfmalloc(n_images*sizeof(struct pf8_frame_job));
+	if ( jobs == NULL ) return 1;
+
+	for ( i=0; i<n_images; i++ ) {
+		if ( setup_frame_job(&jobs[i], images[i], private_data,
+		                     max_n_peaks, threshold, min_snr,
+		                     min_pix_count, max_pix_count,
+		                     local_bg_radius, min_res, max_res) )
+		{
+			int j;
+			for ( j=0; j<i; j++ ) {
+				free_frame_job(&jobs[j],
+				               images[j]->detgeom->n_panels);
+			}
+			cffree(jobs);
+			return 1;
+		}
+	}
+
+	profile_start("pf8-rstats");
+	if ( (private_data->gpu == NULL)
+	  || radial_stats_gpu(private_data->gpu, jobs, n_images) )
+	{
+		if ( private_data->gpu != NULL ) {
+			ERROR("GPU peakfinder8 failed, using the CPU.\n");
+		}
+		for ( i=0; i<n_images; i++ ) {
+			radial_stats_cpu(&jobs[i], n_threads);
+		}
+	}
+	profile_end("pf8-rstats");
+
+	for ( i=0; i<n_images; i++ ) {
+		cffree(jobs[i].vals);
+		cffree(jobs[i].vcount);
+		jobs[i].vals = NULL;
+		jobs[i].vcount = NULL;
+		peaks[i] = search_frame(&jobs[i], images[i], use_saturated,
+		                        n_threads);
+		free_frame_job(&jobs[i], images[i]->detgeom->n_panels);
+	}
+
+	cffree(jobs);
+	return 0;
+}
+
+
+/**
+ * \param img An \ref image structure
+ * \param max_n_peaks The maximum number of peaks to be searched for
+ * \param threshold The image threshold value, in detector units
+ * \param min_snr The minimum signal to noise ratio for a peak
+ * \param min_pix_count The minimum number of pixels in a peak
+ * \param max_pix_count The maximum number of pixels in a peak
+ * \param local_bg_radius The averaging radius for background calculation
+ * \param min_res The minimum number of pixels out from the center
+ * \param max_res The maximum number of pixels out from the center
+ * \param use_saturated Whether saturated peaks should be considered
+ *
+ * Runs the peakfinder8 peak search algorithm, and returns an \ref ImageFeatureList,
+ * or NULL on error.
+ */
+ImageFeatureList *peakfinder8(const struct image *img, int max_n_peaks,
+                              float threshold, float min_snr,
+                              int min_pix_count, int max_pix_count,
+                              int local_bg_radius, int min_res,
+                              int max_res, int use_saturated,
+                              int fast_mode, struct pf8_private_data *private_data)
+{
+	struct pf8_private_data *geomdata;
+	struct image *imgs[1];
+	ImageFeatureList *peaks[1];
+
+	if ( img->detgeom == NULL) return NULL;
+
+	profile_start("pf8-rmaps");
+	if ( private_data == NULL ) {
+		geomdata = prepare_peakfinder8(img->detgeom, fast_mode);
+	} else {
+		geomdata = private_data;
+	}
+	profile_end("pf8-rmaps");
+	if (geomdata == NULL) return NULL;
+
+	/* The image itself won't be changed */
+	imgs[0] = (struct image *)img;
+	if ( peakfinder8_multi(imgs, 1, peaks, max_n_peaks, threshold, min_snr,
+	                       min_pix_count, max_pix_count, local_bg_radius,
+	                       min_res, max_res, use_saturated, geomdata) )
+	{
+		peaks[0] = NULL;
+	}
+
+	if ( private_data == NULL ) free_pf8_private_data(geomdata);
+	return peaks[0];
+}
@@ -46,14 +46,34 @@ extern "C" {
 struct pf8_private_data
 {
     int fast_mode;
+    uint64_t geom_hash;  /* Geometry which the maps were calculated for */
     struct radius_maps *rmaps;
     struct radial_stats_pixels *rpixels;
+    struct radial_bin_order *rorder;
+    int n_threads;
+    void *map;        /* If not NULL, the arrays are in a mapped cache file */
+    size_t map_size;
+    struct pf8_gpu *gpu;  /* If not NULL, use the GPU for radial stats */
+    struct peakfinder_mask *resmask;  /* Pixels within resolution limits */
+    int resmask_min_res;
+    int resmask_max_res;
 };
 
 struct pf8_private_data *prepare_peakfinder8(struct detgeom *det, int fast_mode);
 
+struct pf8_private_data *prepare_peakfinder8_cached(struct detgeom *det,
+                                                    int fast_mode,
+                                                    const char *cache_dir);
+
 void free_pf8_private_data(struct pf8_private_data *data);
 
+extern int pf8_private_data_matches(struct pf8_private_data *data,
+                                    struct detgeom *det, int fast_mode);
+
+extern void pf8_set_num_threads(struct pf8_private_data *data, int n_threads);
+
+extern int pf8_enable_gpu(struct pf8_private_data *data);
+
 extern ImageFeatureList *peakfinder8(const struct image *img, int max_n_peaks,
                                      float threshold, float min_snr,
                                      int mix_pix_count, int max_pix_count,
@@ -62,6 +82,14 @@ extern ImageFeatureList *peakfinder8(const struct image *img, int max_n_peaks,
                                      int fast_mode,
                                      struct pf8_private_data *private_data);
 
+extern int peakfinder8_multi(struct image **images, int n_images,
+                             ImageFeatureList **peaks, int max_n_peaks,
+                             float threshold, float min_snr,
+                             int min_pix_count, int max_pix_count,
+                             int local_bg_radius, int min_res,
+                             int max_res, int use_saturated,
+                             struct pf8_private_data *private_data);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,52 @@
+/*
+ * peakfinder8_priv.h
+ *
+ * The peakfinder8 algorithm (private parts)
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* NB This file is NOT part of the public API, and should NOT
+ * be installed, but rather stays in the libcrystfel source folder. */
+
+#ifndef PEAKFINDER8_PRIV_H
+#define PEAKFINDER8_PRIV_H
+
+struct pf8_gpu;
+
+/* Sets up the GPU for radial statistics over n_bins bins, where the values
+ * for bin r start at bin_start[r] in an array of n_order values */
+extern struct pf8_gpu *pf8_gpu_new(const int *bin_start, int n_bins,
+                                   int n_order);
+
+extern void pf8_gpu_free(struct pf8_gpu *gpu);
+
+/* Does the iterative sigma clipping for n_frames frames, putting the results
+ * in roffset[frame][bin] and rthreshold[frame][bin] */
+extern int pf8_gpu_radial_stats(struct pf8_gpu *gpu, int n_frames,
+                                const float **vals, const int **vcount,
+                                float **roffset, float **rthreshold,
+                                float min_snr, float threshold,
+                                int iterations);
+
+#endif /* PEAKFINDER8_PRIV_H */
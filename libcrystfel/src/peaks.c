@@ -59,6 +59,7 @@
 #include "cell-utils.h"
 #include "geometry.h"
 #include "peakfinder8.h"
+#include "thread-pool.h"
 
 /** \file peaks.h */
 
@@ -254,6 +255,101 @@ int integrate_peak(const struct image *image,
 }
 
 
+static int gradient_ok(const float *row, const float *prev, const float *next,
+                       int fs, float min_sq_gradient)
+{
+	double dx1, dx2, dy1, dy2;
+	double dxs, dys;
+	double grad;
+
+	/* Get gradients */
+	dx1 = row[fs] - row[fs+1];
+	dx2 = row[fs-1] - row[fs];
+	dy1 = row[fs] - next[fs+1];
+	dy2 = prev[fs] - row[fs];
+
+	/* Average gradient measurements from both sides */
+	dxs = ((dx1*dx1) + (dx2*dx2)) / 2;
+	dys = ((dy1*dy1) + (dy2*dy2)) / 2;
+
+	/* Calculate overall (squared) gradient */
+	grad = dxs + dys;
+
+	return !(grad < min_sq_gradient);
+}
+
+
+/* The largest float which is not more than max_adu, so that comparing floats
+ * against it gives the same result as comparing against max_adu itself */
+static float float_max_adu(double max_adu)
+{
+	float fmax = max_adu;
+	if ( fmax > max_adu ) fmax = nextafterf(fmax, -INFINITY);
+	return fmax;
+}
+
+
+#define ZAEF_BLOCK (16)
+
+/* Finds the candidate peak pixels in one row, i.e. the ones which are above
+ * the threshold and have a high enough gradient.  The threshold is checked
+ * for a block of pixels at a time without branches, so that it can be
+ * vectorised, and most blocks can then be skipped straight away.  Only the
+ * pixels above the threshold need their gradients checking.  The positions of
+ * the candidates are put in cand[], and the number of them is returned. */
+static int find_candidates_in_row(const float *data, int stride, int w, int ss,
+                                  float threshold, float min_sq_gradient,
+                                  double max_adu, int use_saturated,
+                                  int *cand)
+{
+	const float *row = data + stride*ss;
+	const float *prev = row - stride;
+	const float *next = row + stride;
+	const int reject_sat = !use_saturated;
+	const float fmax = float_max_adu(max_adu);
+	int fs0, fs, j;
+	int n = 0;
+
+	for ( fs0=1; fs0+ZAEF_BLOCK<=w-1; fs0+=ZAEF_BLOCK ) {
+
+		int flags[ZAEF_BLOCK];
+		int any = 0;
+
+		/* Overall threshold, and immediate rejection of pixels
+		 * above max_adu */
+		for ( j=0; j<ZAEF_BLOCK; j++ ) {
+			float v = row[fs0+j];
+			int reject = (v < threshold) | (reject_sat & (v > fmax));
+			flags[j] = !reject;
+		}
+
+		for ( j=0; j<ZAEF_BLOCK; j++ ) any |= flags[j];
+		if ( !any ) continue;
+
+		for ( j=0; j<ZAEF_BLOCK; j++ ) {
+			if ( flags[j] && gradient_ok(row, prev, next, fs0+j,
+			                             min_sq_gradient) )
+			{
+				cand[n++] = fs0+j;
+			}
+		}
+	}
+
+	/* The rest of the row */
+	for ( fs=fs0; fs<w-1; fs++ ) {
+		if ( row[fs] < threshold ) continue;
+		if ( reject_sat && (row[fs] > max_adu) ) continue;
+		if ( gradient_ok(row, prev, next, fs, min_sq_gradient) ) {
+			cand[n++] = fs;
+		}
+	}
+
+	return n;
+}
+
+#undef ZAEF_BLOCK
+
+
 static void search_peaks_in_panel(ImageFeatureList *peaklist,
                                   const struct image *image, float threshold,
                                   float min_sq_gradient, float min_snr, int pn,
@@ -276,46 +372,34 @@ static void search_peaks_in_panel(ImageFeatureList *peaklist,
 	int nrej_snr = 0;
 	int nrej_sat = 0;
 	int nacc = 0;
+	int *cand;
+	int n_cand, ci;
 
 	p = &image->detgeom->panels[pn];
 	data = image->dp[pn];
 	stride = p->w;
 
+	cand = cfmalloc(p->w*sizeof(int));
+	if ( cand == NULL ) {
+		ERROR("Failed to allocate peak search buffer\n");
+		return;
+	}
+
 	for ( ss=1; ss<p->h-1; ss++ ) {
-	for ( fs=1; fs<p->w-1; fs++ ) {
 
-		double dx1, dx2, dy1, dy2;
-		double dxs, dys;
-		double grad;
+	n_cand = find_candidates_in_row(data, stride, p->w, ss, threshold,
+	                                min_sq_gradient, p->max_adu,
+	                                use_saturated, cand);
+
+	for ( ci=0; ci<n_cand; ci++ ) {
+
 		int mask_fs, mask_ss;
 		int s_fs, s_ss;
 		unsigned int did_something;
 		int r;
 		int saturated;
 
-		/* Overall threshold */
-		if ( data[fs+stride*ss] < threshold ) continue;
-
-		/* Immediate rejection of pixels above max_adu */
-		if ( !use_saturated && (data[fs+stride*ss] > p->max_adu) ) {
-			continue;
-		}
-
-		/* Get gradients */
-		dx1 = data[fs+stride*ss] - data[(fs+1)+stride*ss];
-		dx2 = data[(fs-1)+stride*ss] - data[fs+stride*ss];
-		dy1 = data[fs+stride*ss] - data[(fs+1)+stride*(ss+1)];
-		dy2 = data[fs+stride*(ss-1)] - data[fs+stride*ss];
-
-		/* Average gradient measurements from both sides */
-		dxs = ((dx1*dx1) + (dx2*dx2)) / 2;
-		dys = ((dy1*dy1) + (dy2*dy2)) / 2;
-
-		/* Calculate overall (squared) gradient */
-		grad = dxs + dys;
-
-		if ( grad < min_sq_gradient ) continue;
-
+		fs = cand[ci];
 		mask_fs = fs;
 		mask_ss = ss;
 
@@ -406,12 +490,15 @@ static void search_peaks_in_panel(ImageFeatureList *peaklist,
 		if ( nacc > 10000 ) {
 			ERROR("Too many peaks!  Aborting peak seach "
 			      "for panel %s\n", p->name);
+			cffree(cand);
 			return;
 		}
 
 	}
 	}
 
+	cffree(cand);
+
 	//STATUS("%i accepted, %i box, %i proximity, %i outside panel, "
 	//       "%i failed integration, %i with SNR < %g, %i badrow culled, "
 	//        "%i saturated.\n",
@@ -446,21 +533,389 @@ ImageFeatureList *search_peaks(const struct image *image,
 
 #ifdef HAVE_FDIP
 
+/* More peaks per panel should not appear */
+#define PF9_MAX_PEAKS (10000)
+
+struct pf9_panel_cache
+{
+	int w;
+	int h;
+	detectorRawFormat_t layout;
+
+	/* peakfinder9 wants the bad pixel mask as ints.  The conversion is
+	 * only done again if the mask changes. */
+	int *mask;
+	uint8_t *bad;
+	int mask_ok;
+
+	/* Peaks found in this panel */
+	int n_peaks;
+	int max_peaks;
+	float *fs;
+	float *ss;
+	float *intensity;
+	int ret;
+};
+
+
+struct pf9_private_data
+{
+	int n_threads;
+
+	int n_panels;
+	struct pf9_panel_cache *panels;
+
+	/* One of each for each thread */
+	int n_bufs;
+	long int buf_size;
+	float **data_copy;
+	peakList_t *peak_lists;
+};
+
+
+static void free_pf9_buffers(struct pf9_private_data *data)
+{
+	int i;
+
+	for ( i=0; i<data->n_bufs; i++ ) {
+		cffree(data->data_copy[i]);
+		freePeakList(data->peak_lists[i]);
+	}
+	cffree(data->data_copy);
+	cffree(data->peak_lists);
+	data->data_copy = NULL;
+	data->peak_lists = NULL;
+	data->n_bufs = 0;
+}
+
+
+static void free_pf9_panels(struct pf9_private_data *data)
+{
+	int i;
+
+	for ( i=0; i<data->n_panels; i++ ) {
+		cffree(data->panels[i].mask);
+		cffree(data->panels[i].bad);
+		cffree(data->panels[i].fs);
+		cffree(data->panels[i].ss);
+		cffree(data->panels[i].intensity);
+	}
+	cffree(data->panels);
+	data->panels = NULL;
+	data->n_panels = 0;
+}
+
+
+/**
+ * \returns A new \ref pf9_private_data structure, for use with
+ * search_peaks_peakfinder9(), or NULL on error.
+ *
+ * The structure holds the detector layout and bad pixel masks converted into
+ * the form which peakfinder9 needs, and the buffers for the search.  Using the
+ * same structure for each frame avoids setting them up every time.  If the
+ * detector geometry changes, they will be set up again.
+ *
+ * Because the structure contains buffers, it must not be used for more than
+ * one frame at once.  Use a separate one for each worker.
+ */
+struct pf9_private_data *prepare_peakfinder9()
+{
+	struct pf9_private_data *data;
+
+	data = cfmalloc(sizeof(struct pf9_private_data));
+	if ( data == NULL ) return NULL;
+
+	data->n_threads = 1;
+	data->n_panels = 0;
+	data->panels = NULL;
+	data->n_bufs = 0;
+	data->buf_size = 0;
+	data->data_copy = NULL;
+	data->peak_lists = NULL;
+
+	return data;
+}
+
+
+/**
+ * \param data A \ref pf9_private_data structure from prepare_peakfinder9()
+ *
+ * Frees \p data.
+ */
+void free_pf9_private_data(struct pf9_private_data *data)
+{
+	if ( data == NULL ) return;
+	free_pf9_buffers(data);
+	free_pf9_panels(data);
+	cffree(data);
+}
+
+
+/**
+ * \param data A \ref pf9_private_data structure from prepare_peakfinder9()
+ * \param n_threads The number of threads to use
+ *
+ * Sets the number of threads which search_peaks_peakfinder9() will use for
+ * each frame, when given \p data.  The panels will be searched in parallel.
+ * The results are the same as for a single thread.
+ *
+ * As for pf8_set_num_threads(), the threads will come from the default thread
+ * pool if it has the right number of threads.
+ */
+void pf9_set_num_threads(struct pf9_private_data *data, int n_threads)
+{
+	if ( data == NULL ) return;
+	if ( n_threads < 1 ) n_threads = 1;
+	data->n_threads = n_threads;
+}
+
+
+static int pf9_layout_matches(struct pf9_private_data *data,
+                              struct detgeom *det)
+{
+	int i;
+
+	if ( data->n_panels != det->n_panels ) return 0;
+	for ( i=0; i<det->n_panels; i++ ) {
+		if ( data->panels[i].w != det->panels[i].w ) return 0;
+		if ( data->panels[i].h != det->panels[i].h ) return 0;
+	}
+	return 1;
+}
+
+
+/* Sets up the per-panel layouts, and the buffers for each thread */
+static int pf9_setup(struct pf9_private_data *data, struct detgeom *det)
+{
+	int i;
+	long int max_pix = 0;
+
+	if ( !pf9_layout_matches(data, det) ) {
+
+		free_pf9_panels(data);
+		data->panels = cfcalloc(det->n_panels,
+		                        sizeof(struct pf9_panel_cache));
+		if ( data->panels == NULL ) return 1;
+		data->n_panels = det->n_panels;
+
+		for ( i=0; i<det->n_panels; i++ ) {
+
+			struct pf9_panel_cache *pc = &data->panels[i];
+			int w = det->panels[i].w;
+			int h = det->panels[i].h;
+
+			pc->w = w;
+			pc->h = h;
+			pc->layout.asic_nx = w;
+			pc->layout.asic_ny = h;
+			pc->layout.nasics_x = 1;
+			pc->layout.nasics_y = 1;
+			pc->layout.pix_nx = w;
+			pc->layout.pix_ny = h;
+			pc->layout.pix_nn = w * h;
+			pc->mask = cfmalloc(w*h*sizeof(int));
+			pc->bad = cfmalloc(w*h);
+			pc->mask_ok = 0;
+			if ( (pc->mask == NULL) || (pc->bad == NULL) ) return 1;
+
+		}
+
+	}
+
+	for ( i=0; i<det->n_panels; i++ ) {
+		long int npx = (long int)det->panels[i].w * det->panels[i].h;
+		if ( npx > max_pix ) max_pix = npx;
+	}
+
+	if ( (data->n_bufs < data->n_threads) || (data->buf_size < max_pix) ) {
+
+		free_pf9_buffers(data);
+
+		data->data_copy = cfcalloc(data->n_threads, sizeof(float *));
+		data->peak_lists = cfcalloc(data->n_threads, sizeof(peakList_t));
+		if ( (data->data_copy == NULL) || (data->peak_lists == NULL) ) {
+			return 1;
+		}
+
+		for ( i=0; i<data->n_threads; i++ ) {
+			data->data_copy[i] = cfmalloc(max_pix*sizeof(float));
+			if ( data->data_copy[i] == NULL ) return 1;
+			if ( allocatePeakList(&data->peak_lists[i],
+			                      PF9_MAX_PEAKS) ) return 1;
+			data->n_bufs = i+1;
+		}
+		data->buf_size = max_pix;
+
+	}
+
+	return 0;
+}
+
+
+struct pf9_job
+{
+	const struct image *image;
+	struct pf9_private_data *data;
+	peakFinder9_accuracyConstants_t accuracy_consts;
+	int next_panel;
+};
+
+
+struct pf9_task
+{
+	struct pf9_job *job;
+	int pn;
+};
+
+
+static void *pf9_get_task(void *vp)
+{
+	struct pf9_job *job = vp;
+	struct pf9_task *task;
+
+	if ( job->next_panel >= job->data->n_panels ) return NULL;
+
+	task = cfmalloc(sizeof(struct pf9_task));
+	if ( task == NULL ) return NULL;
+	task->job = job;
+	task->pn = job->next_panel++;
+	return task;
+}
+
+
+static void pf9_final(void *vp, void *work)
+{
+	cffree(work);
+}
+
+
+static void pf9_search_panel(struct pf9_job *job, int pn, int cookie)
+{
+	struct pf9_panel_cache *pc = &job->data->panels[pn];
+	const struct image *image = job->image;
+	float *data_copy = job->data->data_copy[cookie];
+	peakList_t *peakList = &job->data->peak_lists[cookie];
+	size_t npx = (size_t)pc->w * pc->h;
+	int i;
+
+	if ( !pc->mask_ok || (memcmp(pc->bad, image->bad[pn], npx) != 0) ) {
+		size_t j;
+		memcpy(pc->bad, image->bad[pn], npx);
+		for ( j=0; j<npx; j++ ) {
+			pc->mask[j] = pc->bad[j];
+		}
+		pc->mask_ok = 1;
+	}
+
+	mergeMaskAndDataIntoDataCopy(image->dp[pn], data_copy, pc->mask,
+	                             &pc->layout);
+
+	peakList->peakCount = 0;
+	peakFinder9_onePanel_noSlab(data_copy, &job->accuracy_consts,
+	                            &pc->layout, peakList);
+
+	/* Keep the peaks, because the peak list belongs to the thread */
+	pc->ret = 0;
+	if ( peakList->peakCount > pc->max_peaks ) {
+		cffree(pc->fs);
+		cffree(pc->ss);
+		cffree(pc->intensity);
+		pc->fs = cfmalloc(peakList->peakCount*sizeof(float));
+		pc->ss = cfmalloc(peakList->peakCount*sizeof(float));
+		pc->intensity = cfmalloc(peakList->peakCount*sizeof(float));
+		if ( (pc->fs == NULL) || (pc->ss == NULL)
+		  || (pc->intensity == NULL) )
+		{
+			pc->max_peaks = 0;
+			pc->n_peaks = 0;
+			pc->ret = 1;
+			return;
+		}
+		pc->max_peaks = peakList->peakCount;
+	}
+
+	for ( i=0; i<peakList->peakCount; i++ ) {
+		pc->fs[i] = peakList->centerOfMass_rawX[i];
+		pc->ss[i] = peakList->centerOfMass_rawY[i];
+		pc->intensity[i] = peakList->totalIntensity[i];
+	}
+	pc->n_peaks = peakList->peakCount;
+}
+
+
+static void pf9_work(void *work, int cookie)
+{
+	struct pf9_task *task = work;
+	pf9_search_panel(task->job, task->pn, cookie);
+}
+
+
+static ImageFeatureList *run_peakfinder9(const struct image *image,
+                                         struct pf9_private_data *data,
+                                         peakFinder9_accuracyConstants_t *ac)
+{
+	struct pf9_job job;
+	ImageFeatureList *peaks;
+	int pn;
+	int n_peaks;
+
+	if ( pf9_setup(data, image->detgeom) ) return NULL;
+
+	job.image = image;
+	job.data = data;
+	job.accuracy_consts = *ac;
+	job.next_panel = 0;
+
+	if ( (data->n_threads > 1) && (data->n_panels > 1) ) {
+		run_threads(data->n_threads, pf9_work, pf9_get_task, pf9_final,
+		            &job, 0, 0, 0, 0);
+	} else {
+		for ( pn=0; pn<data->n_panels; pn++ ) {
+			pf9_search_panel(&job, pn, 0);
+		}
+	}
+
+	/* Peaks are added in panel order, whatever order the panels were
+	 * searched in */
+	peaks = image_feature_list_new();
+	n_peaks = 0;
+	for ( pn=0; pn<data->n_panels; pn++ ) {
+		if ( !data->panels[pn].ret ) n_peaks += data->panels[pn].n_peaks;
+	}
+	image_feature_list_reserve(peaks, n_peaks);
+	for ( pn=0; pn<data->n_panels; pn++ ) {
+
+		struct pf9_panel_cache *pc = &data->panels[pn];
+		int i;
+
+		if ( pc->ret ) {
+			image_feature_list_free(peaks);
+			return NULL;
+		}
+
+		for ( i=0; i<pc->n_peaks; i++ ) {
+			image_add_feature(peaks, pc->fs[i], pc->ss[i], pn,
+			                  pc->intensity[i], NULL);
+		}
+
+	}
+
+	return peaks;
+}
+
+
 ImageFeatureList *search_peaks_peakfinder9(const struct image *image,
                                            float min_snr_biggest_pix,
                                            float min_snr_peak_pix,
                                            float min_snr_whole_peak,
                                            float min_sig,
                                            float min_peak_over_neighbour,
-                                           int window_radius)
+                                           int window_radius,
+                                           struct pf9_private_data *private_data)
 {
 	peakFinder9_accuracyConstants_t accuracy_consts;
-	peakList_t peakList;
-	long NpeaksMax = 10000; //more peaks per panel should not appear
-	float *data_copy = NULL;
-	float *data_copy_new;
-	int panel_number;
 	ImageFeatureList *peaks;
+	struct pf9_private_data *data = private_data;
 
 	accuracy_consts.minSNR_biggestPixel = min_snr_biggest_pix;
 	accuracy_consts.minSNR_peakPixel = min_snr_peak_pix;
@@ -469,63 +924,35 @@ ImageFeatureList *search_peaks_peakfinder9(const struct image *image,
 	accuracy_consts.minimumPeakOversizeOverNeighbours = min_peak_over_neighbour;
 	accuracy_consts.windowRadius = window_radius;
 
-	if ( allocatePeakList(&peakList, NpeaksMax) ) return NULL;
-
-	peaks = image_feature_list_new();
+	if ( data == NULL ) {
+		data = prepare_peakfinder9();
+		if ( data == NULL ) return NULL;
+	}
 
-	for ( panel_number=0; panel_number<image->detgeom->n_panels; panel_number++ ) {
+	peaks = run_peakfinder9(image, data, &accuracy_consts);
 
-		int w, h;
-		int peak_number;
-		detectorRawFormat_t det_size_one_panel;
+	if ( private_data == NULL ) free_pf9_private_data(data);
+	return peaks;
+}
 
-		w = image->detgeom->panels[panel_number].w;
-		h = image->detgeom->panels[panel_number].h;
+#else
 
-		det_size_one_panel.asic_nx = w;
-		det_size_one_panel.asic_ny = h;
-		det_size_one_panel.nasics_x = 1;
-		det_size_one_panel.nasics_y = 1;
-		det_size_one_panel.pix_nx = w;
-		det_size_one_panel.pix_ny = h;
-		det_size_one_panel.pix_nn = w * h;
+struct pf9_private_data *prepare_peakfinder9()
+{
+	ERROR("This copy of CrystFEL was compiled without peakfinder9 support.\n");
+	return NULL;
+}
 
-		data_copy_new = cfrealloc(data_copy, w*h*sizeof(*data_copy));
-		if ( data_copy_new == NULL ) {
-			if ( data_copy != NULL ) {
-				cffree(data_copy);
-			}
-			freePeakList(peakList);
-			return NULL;
-		} else {
-			data_copy = data_copy_new;
-		}
 
-		mergeMaskAndDataIntoDataCopy(image->dp[panel_number], data_copy,
-		                             image->bad[panel_number],
-		                             &det_size_one_panel);
-
-		peakList.peakCount = 0;
-		peakFinder9_onePanel_noSlab(data_copy, &accuracy_consts,
-		                            &det_size_one_panel, &peakList);
-
-		for ( peak_number=0; peak_number<peakList.peakCount; peak_number++) {
-			image_add_feature(peaks,
-			                  peakList.centerOfMass_rawX[peak_number],
-			                  peakList.centerOfMass_rawY[peak_number],
-			                  panel_number,
-			                  peakList.totalIntensity[peak_number],
-			                  NULL);
-		}
+void free_pf9_private_data(struct pf9_private_data *data)
+{
+}
 
-	}
 
-	freePeakList(peakList);
-	cffree(data_copy);
-	return peaks;
+void pf9_set_num_threads(struct pf9_private_data *data, int n_threads)
+{
 }
 
-#else
 
 ImageFeatureList *search_peaks_peakfinder9(const struct image *image,
                                            float min_snr_biggest_pix,
@@ -533,7 +960,8 @@ ImageFeatureList *search_peaks_peakfinder9(const struct image *image,
                                            float min_snr_whole_peak,
                                            float min_sig,
                                            float min_peak_over_neighbour,
-                                           int window_radius)
+                                           int window_radius,
+                                           struct pf9_private_data *private_data)
 {
 	ERROR("This copy of CrystFEL was compiled without peakfinder9 support.\n");
 	return NULL;
@@ -651,6 +1079,7 @@ ImageFeatureList *validate_peaks(const struct image *image, ImageFeatureList *pe
 	if ( flist == NULL ) return NULL;
 
 	n = image_feature_count(peaks);
+	image_feature_list_reserve(flist, n);
 
 	/* Loop over peaks, putting each one through the integrator */
 	n_wtf = 0;  n_int = 0;  n_snr = 0;  n_sat = 0;
@@ -749,6 +1178,7 @@ const char *str_peaksearch(enum peak_search_method meth)
 	case PEAK_HDF5: return "hdf5";
 	case PEAK_CXI: return "cxi";
 	case PEAK_MSGPACK: return "msgpack";
+	case PEAK_PEAKFINDER8_GPU: return "peakfinder8-gpu";
 	case PEAK_NONE: return "none";
 	default: return "???";
 	}
@@ -768,6 +1198,8 @@ enum peak_search_method parse_peaksearch(const char *arg)
 		return PEAK_PEAKFINDER9;
 	} else if ( strcmp(arg, "msgpack") == 0 ) {
 		return PEAK_MSGPACK;
+	} else if ( strcmp(arg, "peakfinder8-gpu") == 0 ) {
+		return PEAK_PEAKFINDER8_GPU;
 	} else if ( strcmp(arg, "none") == 0 ) {
 		return PEAK_NONE;
 	}
@@ -54,6 +54,7 @@ enum peak_search_method {
 	PEAK_HDF5,
 	PEAK_CXI,
 	PEAK_MSGPACK,
+	PEAK_PEAKFINDER8_GPU,
 	PEAK_NONE,
 	PEAK_ERROR
 };
@@ -101,12 +102,22 @@ extern ImageFeatureList *search_peaks(const struct image *image, float threshold
                                       float min_gradient, float min_snr, double ir_inn,
                                       double ir_mid, double ir_out, int use_saturated);
 
+/**
+ * Opaque data for search_peaks_peakfinder9(), from prepare_peakfinder9()
+ */
+struct pf9_private_data;
+
+extern struct pf9_private_data *prepare_peakfinder9(void);
+extern void free_pf9_private_data(struct pf9_private_data *data);
+extern void pf9_set_num_threads(struct pf9_private_data *data, int n_threads);
+
 extern ImageFeatureList *search_peaks_peakfinder9(const struct image *image,
                                                   float min_snr_biggest_pix,
                                                   float min_snr_peak_pix,
                                                   float min_snr_whole_peak, float min_sig,
                                                   float min_peak_over_neighbour,
-                                                  int window_radius);
+                                                  int window_radius,
+                                                  struct pf9_private_data *private_data);
 
 extern int indexing_peak_check(const struct image *image, ImageFeatureList *peaks,
                                Crystal **crystals,
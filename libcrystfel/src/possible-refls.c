@@ -0,0 +1,698 @@
+/*
+ * possible-refls.c
+ *
+ * Enumeration of the unique reflections allowed for a cell and point group
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <libcrystfel-config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "cell.h"
+#include "cell-utils.h"
+#include "symmetry.h"
+#include "thread-pool.h"
+#include "possible-refls.h"
+
+
+/* Number of lists kept in memory */
+#define POSSIBLE_CACHE_SIZE (8)
+
+/* The cache file contains a pr_header, then the name of the point group, then
+ * the list of reflections.  The cell parameters, centering, point group and
+ * resolution limit are the key, and must all be identical for the file to be
+ * used.  Everything is in the byte order of the machine which wrote it. */
+#define PR_MAGIC "CFPOSREF"
+#define PR_VERSION (1)
+#define PR_BYTE_ORDER (0x01020304)
+
+struct pr_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t refl_size;
+	uint32_t sym_name_len;
+	double cellpar[6];
+	double max_res;
+	char cen;
+	char pad[7];
+	uint64_t n;
+};
+
+
+struct _possiblerefls
+{
+	/* Key */
+	double cellpar[6];
+	char cen;
+	char *sym_name;
+	double max_res;
+
+	struct possible_refl *refls;
+	int n;
+
+	/* Number of users, including the cache */
+	int refcount;
+	unsigned long int last_use;
+};
+
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static PossibleRefls *cache[POSSIBLE_CACHE_SIZE];
+static unsigned long int use_counter = 0;
+static char *cache_dir = NULL;
+
+
+/**
+ * \param dir A directory for cache files, or NULL
+ *
+ * Sets the directory in which possible_refls_get() keeps the lists of
+ * reflections it makes.  If the same list is needed again, by any process,
+ * it will be loaded instead of being worked out again.
+ *
+ * If this function is never called, the directory given by the environment
+ * variable CRYSTFEL_REFLECTION_CACHE is used, if it is set.  If \p dir is
+ * NULL, no cache files will be used, even if the environment variable is set.
+ * The lists are always kept in memory for a while, regardless.
+ *
+ * This should be called before any threads are started.
+ */
+void possible_refls_set_cache_dir(const char *dir)
+{
+	cffree(cache_dir);
+	cache_dir = cfstrdup((dir == NULL) ? "" : dir);
+}
+
+
+static const char *get_cache_dir(void)
+{
+	const char *dir = cache_dir;
+	if ( dir == NULL ) dir = getenv("CRYSTFEL_REFLECTION_CACHE");
+	if ( (dir == NULL) || (dir[0] == '\0') ) return NULL;
+	return dir;
+}
+
+
+static void really_free(PossibleRefls *p)
+{
+	cffree(p->sym_name);
+	cffree(p->refls);
+	cffree(p);
+}
+
+
+static int key_match(const PossibleRefls *p, const double *cellpar, char cen,
+                     const char *sym_name, double max_res)
+{
+	int i;
+
+	if ( p->cen != cen ) return 0;
+	if ( p->max_res != max_res ) return 0;
+	for ( i=0; i<6; i++ ) {
+		if ( p->cellpar[i] != cellpar[i] ) return 0;
+	}
+	return strcmp(p->sym_name, sym_name) == 0;
+}
+
+
+/******************************** Enumeration *********************************/
+
+struct enum_args
+{
+	UnitCell *cell;
+	const SymOpList *sym;
+	double max_res;
+	signed int h;
+	signed int hmax;
+	signed int kmax;
+	signed int lmax;
+	struct possible_refl *refls;
+	int n;
+	int max;
+	int fail;
+};
+
+
+struct enum_job
+{
+	struct enum_args *args;
+	signed int h;
+	struct possible_refl *refls;
+	int n;
+	int max;
+	int fail;
+};
+
+
+static void *get_enum_job(void *vqargs)
+{
+	struct enum_args *qargs = vqargs;
+	struct enum_job *job;
+
+	if ( qargs->h > qargs->hmax ) return NULL;
+
+	job = cfmalloc(sizeof(struct enum_job));
+	if ( job == NULL ) {
+		qargs->fail = 1;
+		return NULL;
+	}
+	job->args = qargs;
+	job->h = qargs->h++;
+	job->refls = NULL;
+	job->n = 0;
+	job->max = 0;
+	job->fail = 0;
+	return job;
+}
+
+
+/* Finds the reflections in one plane of constant h which are their own
+ * asymmetric equivalents.  Each unique reflection within the resolution limit
+ * has exactly one of those, and it's within the range of indices searched
+ * because all the equivalents have the same resolution. */
+static void enumerate_plane(void *vjob, int cookie)
+{
+	struct enum_job *job = vjob;
+	struct enum_args *args = job->args;
+	signed int h = job->h;
+	signed int k, l;
+	SymOpMask *mask;
+
+	mask = new_symopmask(args->sym);
+	if ( mask == NULL ) {
+		job->fail = 1;
+		return;
+	}
+
+	for ( k=-args->kmax; k<=args->kmax; k++ ) {
+	for ( l=-args->lmax; l<=args->lmax; l++ ) {
+
+		signed int hs, ks, ls;
+		struct possible_refl *r;
+		double res;
+
+		if ( (h == 0) && (k == 0) && (l == 0) ) continue;
+
+		get_asymm(args->sym, h, k, l, &hs, &ks, &ls);
+		if ( (hs != h) || (ks != k) || (ls != l) ) continue;
+
+		if ( forbidden_reflection(args->cell, h, k, l) ) continue;
+
+		res = 2.0 * resolution(args->cell, h, k, l);
+		if ( res > args->max_res ) continue;
+
+		if ( job->n == job->max ) {
+			int new_max = job->max + 256;
+			struct possible_refl *new_refls;
+			new_refls = cfrealloc(job->refls,
+			                      new_max*sizeof(struct possible_refl));
+			if ( new_refls == NULL ) {
+				job->fail = 1;
+				free_symopmask(mask);
+				return;
+			}
+			job->refls = new_refls;
+			job->max = new_max;
+		}
+
+		special_position(args->sym, mask, h, k, l);
+
+		r = &job->refls[job->n++];
+		r->h = h;
+		r->k = k;
+		r->l = l;
+		r->multiplicity = num_equivs(args->sym, mask);
+		r->res = res;
+
+	}
+	}
+
+	free_symopmask(mask);
+}
+
+
+static void add_plane(void *vqargs, void *vjob)
+{
+	struct enum_args *qargs = vqargs;
+	struct enum_job *job = vjob;
+
+	if ( job->fail ) qargs->fail = 1;
+
+	if ( !qargs->fail && (job->n > 0) ) {
+		if ( qargs->n + job->n > qargs->max ) {
+			int new_max = 2*(qargs->n + job->n);
+			struct possible_refl *new_refls;
+			new_refls = cfrealloc(qargs->refls,
+			                      new_max*sizeof(struct possible_refl));
+			if ( new_refls == NULL ) {
+				qargs->fail = 1;
+			} else {
+				qargs->refls = new_refls;
+				qargs->max = new_max;
+			}
+		}
+		if ( !qargs->fail ) {
+			memcpy(&qargs->refls[qargs->n], job->refls,
+			       job->n*sizeof(struct possible_refl));
+			qargs->n += job->n;
+		}
+	}
+
+	cffree(job->refls);
+	cffree(job);
+}
+
+
+static int cmp_refl(const void *av, const void *bv)
+{
+	const struct possible_refl *a = av;
+	const struct possible_refl *b = bv;
+
+	if ( a->res < b->res ) return -1;
+	if ( a->res > b->res ) return +1;
+	if ( a->h != b->h ) return (a->h < b->h) ? -1 : +1;
+	if ( a->k != b->k ) return (a->k < b->k) ? -1 : +1;
+	if ( a->l != b->l ) return (a->l < b->l) ? -1 : +1;
+	return 0;
+}
+
+
+static int enumerate(PossibleRefls *p, UnitCell *cell, const SymOpList *sym,
+                     int n_threads)
+{
+	struct enum_args args;
+	double ax, ay, az;
+	double bx, by, bz;
+	double cx, cy, cz;
+
+	cell_get_cartesian(cell, &ax, &ay, &az,
+	                         &bx, &by, &bz,
+	                         &cx, &cy, &cz);
+	args.cell = cell;
+	args.sym = sym;
+	args.max_res = p->max_res;
+	args.hmax = p->max_res * modulus(ax, ay, az);
+	args.kmax = p->max_res * modulus(bx, by, bz);
+	args.lmax = p->max_res * modulus(cx, cy, cz);
+	args.h = -args.hmax;
+	args.refls = NULL;
+	args.n = 0;
+	args.max = 0;
+	args.fail = 0;
+
+	/* Make sure the reciprocal cell has been calculated, because
+	 * resolution() would otherwise update the cell in each thread */
+	resolution(cell, 1, 0, 0);
+
+	if ( n_threads < 1 ) n_threads = 1;
+	run_threads(n_threads, enumerate_plane, get_enum_job, add_plane,
+	            &args, 0, 0, 0, 0);
+
+	if ( args.fail ) {
+		cffree(args.refls);
+		return 1;
+	}
+
+	/* The planes were finished in any order */
+	qsort(args.refls, args.n, sizeof(struct possible_refl), cmp_refl);
+	p->refls = args.refls;
+	p->n = args.n;
+	return 0;
+}
+
+
+/******************************** Cache files *********************************/
+
+static uint64_t hash_key(const double *cellpar, char cen, const char *sym_name,
+                         double max_res)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	const unsigned char *bytes;
+	size_t i;
+
+	/* FNV-1a */
+	bytes = (const unsigned char *)cellpar;
+	for ( i=0; i<6*sizeof(double); i++ ) {
+		h ^= bytes[i];
+		h *= 0x100000001b3ULL;
+	}
+	bytes = (const unsigned char *)&max_res;
+	for ( i=0; i<sizeof(double); i++ ) {
+		h ^= bytes[i];
+		h *= 0x100000001b3ULL;
+	}
+	h ^= (unsigned char)cen;
+	h *= 0x100000001b3ULL;
+	for ( i=0; sym_name[i] != '\0'; i++ ) {
+		h ^= (unsigned char)sym_name[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+
+static char *cache_filename(const char *dir, const PossibleRefls *p)
+{
+	size_t len = strlen(dir) + 64;
+	char *filename = cfmalloc(len);
+	if ( filename == NULL ) return NULL;
+	snprintf(filename, len, "%s/possible-%016llx.cpr", dir,
+	         (unsigned long long)hash_key(p->cellpar, p->cen, p->sym_name,
+	                                      p->max_res));
+	return filename;
+}
+
+
+/* Returns non-zero if the file doesn't exist or is for something else */
+static int read_cache(const char *filename, PossibleRefls *p)
+{
+	struct pr_header hdr;
+	FILE *fh;
+	char *sym_name;
+	struct possible_refl *refls;
+
+	fh = fopen(filename, "rb");
+	if ( fh == NULL ) return 1;
+
+	if ( fread(&hdr, sizeof(hdr), 1, fh) != 1 ) {
+		fclose(fh);
+		return 1;
+	}
+
+	if ( (memcmp(hdr.magic, PR_MAGIC, 8) != 0)
+	  || (hdr.version != PR_VERSION)
+	  || (hdr.byte_order != PR_BYTE_ORDER)
+	  || (hdr.refl_size != sizeof(struct possible_refl))
+	  || (hdr.sym_name_len != strlen(p->sym_name))
+	  || (hdr.n > INT_MAX) )
+	{
+		fclose(fh);
+		return 1;
+	}
+
+	sym_name = cfmalloc(hdr.sym_name_len+1);
+	if ( sym_name == NULL ) {
+		fclose(fh);
+		return 1;
+	}
+	if ( fread(sym_name, 1, hdr.sym_name_len, fh) != hdr.sym_name_len ) {
+		cffree(sym_name);
+		fclose(fh);
+		return 1;
+	}
+	sym_name[hdr.sym_name_len] = '\0';
+
+	if ( !key_match(p, hdr.cellpar, hdr.cen, sym_name, hdr.max_res) ) {
+		cffree(sym_name);
+		fclose(fh);
+		return 1;
+	}
+	cffree(sym_name);
+
+	refls = cfmalloc(hdr.n*sizeof(struct possible_refl));
+	if ( (refls == NULL) && (hdr.n > 0) ) {
+		fclose(fh);
+		return 1;
+	}
+	if ( fread(refls, sizeof(struct possible_refl), hdr.n, fh) != hdr.n ) {
+		cffree(refls);
+		fclose(fh);
+		return 1;
+	}
+	fclose(fh);
+
+	p->refls = refls;
+	p->n = hdr.n;
+	return 0;
+}
+
+
+/* Writes to a temporary file first, so that other processes never see a
+ * partially written cache file */
+static int write_cache(const char *filename, const PossibleRefls *p)
+{
+	struct pr_header hdr;
+	FILE *fh;
+	char *tmp;
+	size_t len;
+	int fail = 0;
+
+	len = strlen(filename) + 32;
+	tmp = cfmalloc(len);
+	if ( tmp == NULL ) return 1;
+	snprintf(tmp, len, "%s.tmp%i", filename, (int)getpid());
+
+	fh = fopen(tmp, "wb");
+	if ( fh == NULL ) {
+		cffree(tmp);
+		return 1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PR_MAGIC, 8);
+	hdr.version = PR_VERSION;
+	hdr.byte_order = PR_BYTE_ORDER;
+	hdr.refl_size = sizeof(struct possible_refl);
+	hdr.sym_name_len = strlen(p->sym_name);
+	memcpy(hdr.cellpar, p->cellpar, 6*sizeof(double));
+	hdr.max_res = p->max_res;
+	hdr.cen = p->cen;
+	hdr.n = p->n;
+
+	if ( fwrite(&hdr, sizeof(hdr), 1, fh) != 1 ) fail = 1;
+	if ( fwrite(p->sym_name, 1, hdr.sym_name_len, fh)
+	     != hdr.sym_name_len ) fail = 1;
+	if ( fwrite(p->refls, sizeof(struct possible_refl), p->n, fh)
+	     != (size_t)p->n ) fail = 1;
+
+	if ( fclose(fh) ) fail = 1;
+	if ( !fail && rename(tmp, filename) ) fail = 1;
+	if ( fail ) unlink(tmp);
+	cffree(tmp);
+	return fail;
+}
+
+
+/****************************** Public interface ******************************/
+
+/* Must be called with cache_lock held.  The cache takes a reference. */
+static void add_to_cache(PossibleRefls *p)
+{
+	int i;
+	int oldest = 0;
+
+	for ( i=0; i<POSSIBLE_CACHE_SIZE; i++ ) {
+		if ( cache[i] == NULL ) {
+			oldest = i;
+			break;
+		}
+		if ( cache[i]->last_use < cache[oldest]->last_use ) oldest = i;
+	}
+
+	if ( cache[oldest] != NULL ) {
+		if ( --cache[oldest]->refcount == 0 ) {
+			really_free(cache[oldest]);
+		}
+	}
+
+	cache[oldest] = p;
+	p->refcount++;
+}
+
+
+/**
+ * \param cell A %UnitCell
+ * \param sym The point group
+ * \param max_res The resolution limit, 1/d in m^-1
+ * \param n_threads The number of threads to use
+ *
+ * Finds all of the unique reflections, other than 000, which are allowed by
+ * the centering of \p cell and have 1/d no greater than \p max_res.  The
+ * reflections are given by their asymmetric indices in \p sym, in order of
+ * increasing resolution.  Absences due to screw axes and glide planes are not
+ * taken into account.
+ *
+ * The lists are kept in memory, and also in files if a directory has been set
+ * with possible_refls_set_cache_dir().  Asking again for the same cell
+ * parameters, centering, point group and resolution limit will give the same
+ * list immediately.
+ *
+ * The list must be released with possible_refls_free() when no longer needed.
+ *
+ * \returns the list of reflections, or NULL on error.
+ */
+PossibleRefls *possible_refls_get(UnitCell *cell, const SymOpList *sym,
+                                  double max_res, int n_threads)
+{
+	PossibleRefls *p;
+	const char *sym_name;
+	const char *dir;
+	double cellpar[6];
+	char cen;
+	int i;
+
+	cell_get_parameters(cell, &cellpar[0], &cellpar[1], &cellpar[2],
+	                          &cellpar[3], &cellpar[4], &cellpar[5]);
+	cen = cell_get_centering(cell);
+	sym_name = symmetry_name(sym);
+
+	/* Only point groups with names can be recognised again */
+	if ( sym_name != NULL ) {
+		pthread_mutex_lock(&cache_lock);
+		for ( i=0; i<POSSIBLE_CACHE_SIZE; i++ ) {
+			if ( (cache[i] != NULL)
+			  && key_match(cache[i], cellpar, cen, sym_name,
+			               max_res) )
+			{
+				cache[i]->refcount++;
+				cache[i]->last_use = ++use_counter;
+				pthread_mutex_unlock(&cache_lock);
+				return cache[i];
+			}
+		}
+		pthread_mutex_unlock(&cache_lock);
+	}
+
+	p = cfmalloc(sizeof(PossibleRefls));
+	if ( p == NULL ) return NULL;
+	memcpy(p->cellpar, cellpar, 6*sizeof(double));
+	p->cen = cen;
+	p->sym_name = cfstrdup((sym_name != NULL) ? sym_name : "");
+	p->max_res = max_res;
+	p->refls = NULL;
+	p->n = 0;
+	p->refcount = 1;
+	p->last_use = 0;
+	if ( p->sym_name == NULL ) {
+		cffree(p);
+		return NULL;
+	}
+
+	dir = (sym_name != NULL) ? get_cache_dir() : NULL;
+	if ( dir != NULL ) {
+
+		char *filename = cache_filename(dir, p);
+
+		if ( (filename == NULL) || read_cache(filename, p) ) {
+			if ( enumerate(p, cell, sym, n_threads) ) {
+				cffree(filename);
+				really_free(p);
+				return NULL;
+			}
+			if ( (filename != NULL) && write_cache(filename, p) ) {
+				ERROR("WARNING: Couldn't write reflection "
+				      "cache file %s\n", filename);
+			}
+		}
+		cffree(filename);
+
+	} else if ( enumerate(p, cell, sym, n_threads) ) {
+		really_free(p);
+		return NULL;
+	}
+
+	if ( sym_name != NULL ) {
+		pthread_mutex_lock(&cache_lock);
+		p->last_use = ++use_counter;
+		add_to_cache(p);
+		pthread_mutex_unlock(&cache_lock);
+	}
+
+	return p;
+}
+
+
+/**
+ * \param p A list from possible_refls_get()
+ *
+ * Releases the list.  It might still be kept in memory, in case it's needed
+ * again.
+ */
+void possible_refls_free(PossibleRefls *p)
+{
+	int last;
+
+	if ( p == NULL ) return;
+
+	pthread_mutex_lock(&cache_lock);
+	last = (--p->refcount == 0);
+	pthread_mutex_unlock(&cache_lock);
+
+	if ( last ) really_free(p);
+}
+
+
+/**
+ * \param p A list from possible_refls_get()
+ * \param n Location at which to store the number of reflections
+ *
+ * \returns the reflections in \p p, in order of increasing resolution.  The
+ * array belongs to \p p, and must not be changed.
+ */
+const struct possible_refl *possible_refls_list(const PossibleRefls *p, int *n)
+{
+	*n = p->n;
+	return p->refls;
+}
+
+
+/**
+ * \param p A list from possible_refls_get()
+ * \param nshells The number of resolution shells
+ * \param rmins The lower resolution limit of each shell, 1/d in m^-1
+ * \param rmaxs The upper resolution limit of each shell, 1/d in m^-1
+ * \param counts Location at which to store the number of reflections in each
+ *   shell
+ *
+ * Counts the reflections in \p p with 1/d greater than rmins[i], but no
+ * greater than rmaxs[i], for each shell i.  If the shells overlap, each
+ * reflection is only counted in the first one.
+ */
+void possible_refls_count_shells(const PossibleRefls *p, int nshells,
+                                 const double *rmins, const double *rmaxs,
+                                 long int *counts)
+{
+	int i, j;
+
+	for ( j=0; j<nshells; j++ ) counts[j] = 0;
+
+	for ( i=0; i<p->n; i++ ) {
+		double d = p->refls[i].res;
+		for ( j=0; j<nshells; j++ ) {
+			if ( (d>rmins[j]) && (d<=rmaxs[j]) ) {
+				counts[j]++;
+				break;
+			}
+		}
+	}
+}
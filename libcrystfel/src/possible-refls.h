@@ -0,0 +1,83 @@
+/*
+ * possible-refls.h
+ *
+ * Enumeration of the unique reflections allowed for a cell and point group
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef POSSIBLE_REFLS_H
+#define POSSIBLE_REFLS_H
+
+#include "cell.h"
+#include "symmetry.h"
+
+/**
+ * \file possible-refls.h
+ * Enumeration of the unique reflections allowed for a cell and point group.
+ */
+
+/**
+ * One unique reflection, as found by possible_refls_get().
+ */
+struct possible_refl
+{
+	/** Asymmetric indices of the reflection */
+	signed int h;
+	signed int k;
+	signed int l;
+
+	/** Number of distinct symmetry equivalents, including itself */
+	int multiplicity;
+
+	/** Resolution, 1/d, in m^-1 */
+	double res;
+};
+
+/**
+ * A list of the unique reflections allowed by the centering of a unit cell,
+ * up to a resolution limit, for a point group.
+ *
+ * This data structure is opaque.
+ */
+typedef struct _possiblerefls PossibleRefls;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern PossibleRefls *possible_refls_get(UnitCell *cell, const SymOpList *sym,
+                                         double max_res, int n_threads);
+extern void possible_refls_free(PossibleRefls *p);
+extern const struct possible_refl *possible_refls_list(const PossibleRefls *p,
+                                                       int *n);
+extern void possible_refls_count_shells(const PossibleRefls *p, int nshells,
+                                        const double *rmins,
+                                        const double *rmaxs, long int *counts);
+extern void possible_refls_set_cache_dir(const char *dir);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* POSSIBLE_REFLS_H */
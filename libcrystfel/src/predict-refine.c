@@ -48,6 +48,10 @@
 /* Weighting of excitation error term (m^-1) compared to position term (pixels) */
 #define EXC_WEIGHT (1.0e-7)
 
+/* Number of refinement cycles between exact prediction updates.  In between,
+ * the predictions are updated to first order using the gradients */
+#define PRED_RESYNC (2)
+
 
 double r_dev(struct reflpeak *rp)
 {
@@ -359,6 +363,97 @@ int fs_ss_gradient(int param, Reflection *refl, UnitCell *cell,
 }
 
 
+/**
+ * \param rps: Array of paired reflections and peaks
+ * \param n: Number of entries in \p rps
+ * \param cell: The current unit cell
+ * \param image: The image, for the wavelength and detector geometry
+ * \param Minvs: Inverse panel matrices, from make_panel_minvs()
+ * \param r_grads: Space for N_CELL_PARAMS*\p n excitation error gradients
+ * \param fs_grads: Space for N_CELL_PARAMS*\p n fast scan position gradients
+ * \param ss_grads: Space for N_CELL_PARAMS*\p n slow scan position gradients
+ *
+ * Calculates the gradients of \ref r_dev, \ref fs_dev and \ref ss_dev with
+ * respect to all of the reciprocal cell components, in the order of
+ * \ref gparam (GPARAM_ASX to GPARAM_CSZ), for all of \p rps in one sweep.
+ * The gradients for reflection \p i start at index N_CELL_PARAMS*\p i.
+ *
+ * The results are the same as from \ref r_gradient and \ref fs_ss_gradient,
+ * but nothing is allocated, and the parts of the calculation which don't
+ * depend on the parameter are done only once per reflection.
+ */
+void cell_gradients(struct reflpeak *rps, int n, UnitCell *cell,
+                    struct image *image, gsl_matrix **Minvs,
+                    float *r_grads, float *fs_grads, float *ss_grads)
+{
+	double asx, asy, asz;
+	double bsx, bsy, bsz;
+	double csx, csy, csz;
+	int i;
+
+	cell_get_reciprocal(cell, &asx, &asy, &asz,
+	                          &bsx, &bsy, &bsz,
+	                          &csx, &csy, &csz);
+
+	for ( i=0; i<n; i++ ) {
+
+		gsl_matrix *Minv = Minvs[rps[i].peak->pn];
+		float *r_g = &r_grads[N_CELL_PARAMS*i];
+		float *fs_g = &fs_grads[N_CELL_PARAMS*i];
+		float *ss_g = &ss_grads[N_CELL_PARAMS*i];
+		signed int hkl[3];
+		double xl, yl, zl, kpred;
+		double tl, phi, azi;
+		double rc[3];
+		double t[3];
+		double vv[3];
+		double mu, fs, ss;
+		int j, c;
+
+		get_symmetric_indices(rps[i].refl, &hkl[0], &hkl[1], &hkl[2]);
+		kpred = get_kpred(rps[i].refl);
+		xl = hkl[0]*asx + hkl[1]*bsx + hkl[2]*csx;
+		yl = hkl[0]*asy + hkl[1]*bsy + hkl[2]*csy;
+		zl = hkl[0]*asz + hkl[1]*bsz + hkl[2]*csz;
+
+		/* Excitation error: see r_gradient() */
+		tl = sqrt(xl*xl + yl*yl);
+		phi = angle_between_2d(tl, zl+1.0/image->lambda, 0.0, 1.0);
+		azi = atan2(yl, xl);
+		rc[0] = -sin(phi) * cos(azi) * EXC_WEIGHT;
+		rc[1] = -sin(phi) * sin(azi) * EXC_WEIGHT;
+		rc[2] = -cos(phi) * EXC_WEIGHT;
+
+		/* Spot position: see fs_ss_gradient().  Minv is the inverse of
+		 * the matrix in that function, so no need to solve. */
+		t[0] = xl;
+		t[1] = yl;
+		t[2] = kpred+zl;
+		for ( c=0; c<3; c++ ) {
+			vv[c] = gsl_matrix_get(Minv, c, 0)*t[0]
+			      + gsl_matrix_get(Minv, c, 1)*t[1]
+			      + gsl_matrix_get(Minv, c, 2)*t[2];
+		}
+		mu = 1.0 / vv[0];
+		fs = mu*vv[1];
+		ss = mu*vv[2];
+
+		/* Parameter 3*j+c is component c of axis j */
+		for ( j=0; j<3; j++ ) {
+			for ( c=0; c<3; c++ ) {
+				double m0 = gsl_matrix_get(Minv, 0, c)*hkl[j];
+				double m1 = gsl_matrix_get(Minv, 1, c)*hkl[j];
+				double m2 = gsl_matrix_get(Minv, 2, c)*hkl[j];
+				r_g[3*j+c] = hkl[j] * rc[c];
+				fs_g[3*j+c] = mu*(m1 - fs*m0);
+				ss_g[3*j+c] = mu*(m2 - ss*m0);
+			}
+		}
+
+	}
+}
+
+
 static int cmpd2(const void *av, const void *bv)
 {
 	struct reflpeak *a, *b;
@@ -581,153 +676,194 @@ int refine_radius(Crystal *cr, struct image *image)
 }
 
 
-static int iterate(struct reflpeak *rps, int n, UnitCell *cell,
-                   struct image *image, gsl_matrix **Minvs,
-                   double *total_shifts)
+/* Update the excitation errors and spot positions to first order, using the
+ * gradients from iterate() */
+static void update_first_order(struct reflpeak *rps, int n,
+                               const float *r_grads, const float *fs_grads,
+                               const float *ss_grads, const double *shifts)
 {
 	int i;
-	gsl_matrix *M;
-	gsl_vector *v;
-	gsl_vector *shifts;
-	double asx, asy, asz;
-	double bsx, bsy, bsz;
-	double csx, csy, csz;
-	const enum gparam rv[] = {
-		GPARAM_ASX,
-		GPARAM_ASY,
-		GPARAM_ASZ,
-		GPARAM_BSX,
-		GPARAM_BSY,
-		GPARAM_BSZ,
-		GPARAM_CSX,
-		GPARAM_CSY,
-		GPARAM_CSZ,
-	};
-	const int num_params = 9;
-
-	/* Number of parameters to refine */
-	M = gsl_matrix_calloc(num_params, num_params);
-	v = gsl_vector_calloc(num_params);
 
 	for ( i=0; i<n; i++ ) {
 
+		double d_r = 0.0;
+		double d_fs = 0.0;
+		double d_ss = 0.0;
+		double fs, ss;
 		int k;
-		float fs_gradients[num_params];
-		float ss_gradients[num_params];
-		float r_gradients[num_params];
-
-		/* Calculate all gradients for this parameter */
-		for ( k=0; k<num_params; k++ ) {
-			int pn = rps[i].peak->pn;
-			r_gradients[k] = r_gradient(rv[k], rps[i].refl, cell, image->lambda);
-			fs_ss_gradient(rv[k], rps[i].refl, cell, &image->detgeom->panels[pn],
-			               Minvs[pn], 0, 0, 0, &fs_gradients[k], &ss_gradients[k]);
-		}
-
-		/* Excitation error terms */
-		for ( k=0; k<num_params; k++ ) {
 
-			int g;
-			double v_c, v_curr;
-
-			for ( g=0; g<num_params; g++ ) {
+		for ( k=0; k<N_CELL_PARAMS; k++ ) {
+			d_r += r_grads[N_CELL_PARAMS*i+k] * shifts[k];
+			d_fs += fs_grads[N_CELL_PARAMS*i+k] * shifts[k];
+			d_ss += ss_grads[N_CELL_PARAMS*i+k] * shifts[k];
+		}
 
-				double M_c, M_curr;
+		set_exerr(rps[i].refl, get_exerr(rps[i].refl) + d_r/EXC_WEIGHT);
+		get_detector_pos(rps[i].refl, &fs, &ss);
+		set_detector_pos(rps[i].refl, fs+d_fs, ss+d_ss);
 
-				/* Matrix is symmetric */
-				if ( g > k ) continue;
+	}
+}
 
-				M_c = r_gradients[g] * r_gradients[k];
-				M_curr = gsl_matrix_get(M, k, g);
-				gsl_matrix_set(M, k, g, M_curr + M_c);
-				gsl_matrix_set(M, g, k, M_curr + M_c);
 
-			}
+/* Solves M.x = v for the cell shifts without allocating anything, in the same
+ * way as solve_bg_3x3() in integration.c.  After rescaling the matrix to have
+ * a unit diagonal, as solve_svd() does, it can be Cholesky-decomposed.  Its
+ * smallest eigenvalue is at least 1/trace(A^-1), and trace(A^-1) is the sum
+ * of the squares of the elements of L^-1.  The largest eigenvalue is at most
+ * N_CELL_PARAMS (the trace).  If the smallest one could be small enough for
+ * solve_svd() to filter it, this returns non-zero and solve_svd() should be
+ * used instead. */
+static int solve_cell_shifts(double M[N_CELL_PARAMS][N_CELL_PARAMS],
+                             const double *v, double *x)
+{
+	const int n = N_CELL_PARAMS;
+	double s[N_CELL_PARAMS];
+	double b[N_CELL_PARAMS];
+	double L[N_CELL_PARAMS][N_CELL_PARAMS];
+	double Linv[N_CELL_PARAMS][N_CELL_PARAMS];
+	double y[N_CELL_PARAMS];
+	double trace_inv;
+	int i, j, k;
 
-			v_c = r_dev(&rps[i]);
-			v_c *= -r_gradients[k];
-			v_curr = gsl_vector_get(v, k);
-			gsl_vector_set(v, k, v_curr + v_c);
+	for ( i=0; i<n; i++ ) {
+		if ( !(M[i][i] > 0.0) ) return 1;
+		if ( isnan(v[i]) ) return 1;
+		s[i] = 1.0/sqrt(M[i][i]);
+		b[i] = s[i]*v[i];
+	}
 
+	for ( j=0; j<n; j++ ) {
+		double d = s[j]*M[j][j]*s[j];
+		for ( k=0; k<j; k++ ) d -= L[j][k]*L[j][k];
+		if ( !(d > 0.0) ) return 1;
+		L[j][j] = sqrt(d);
+		for ( i=j+1; i<n; i++ ) {
+			double a = s[i]*M[i][j]*s[j];
+			for ( k=0; k<j; k++ ) a -= L[i][k]*L[j][k];
+			L[i][j] = a/L[j][j];
 		}
+	}
 
-		/* Positional fs terms */
-		for ( k=0; k<num_params; k++ ) {
-
-			int g;
-			double v_c, v_curr;
-
-			for ( g=0; g<num_params; g++ ) {
-
-				double M_c, M_curr;
+	trace_inv = 0.0;
+	for ( j=0; j<n; j++ ) {
+		Linv[j][j] = 1.0/L[j][j];
+		trace_inv += Linv[j][j]*Linv[j][j];
+		for ( i=j+1; i<n; i++ ) {
+			double a = 0.0;
+			for ( k=j; k<i; k++ ) a -= L[i][k]*Linv[k][j];
+			Linv[i][j] = a/L[i][i];
+			trace_inv += Linv[i][j]*Linv[i][j];
+		}
+	}
 
-				/* Matrix is symmetric */
-				if ( g > k ) continue;
+	/* solve_svd() filters below 1e-6 times the largest eigenvalue */
+	if ( !(trace_inv*n <= 1.0e6) ) return 1;
 
-				M_c = fs_gradients[g] * fs_gradients[k];
-				M_curr = gsl_matrix_get(M, k, g);
-				gsl_matrix_set(M, k, g, M_curr + M_c);
-				gsl_matrix_set(M, g, k, M_curr + M_c);
+	for ( i=0; i<n; i++ ) {
+		y[i] = 0.0;
+		for ( k=0; k<=i; k++ ) y[i] += Linv[i][k]*b[k];
+	}
+	for ( i=0; i<n; i++ ) {
+		double z = 0.0;
+		for ( k=i; k<n; k++ ) z += Linv[k][i]*y[k];
+		x[i] = s[i]*z;
+	}
 
-			}
+	return 0;
+}
 
-			v_c = fs_dev(&rps[i], image->detgeom);
-			v_c *= -fs_gradients[k];
-			v_curr = gsl_vector_get(v, k);
-			gsl_vector_set(v, k, v_curr + v_c);
 
+static int solve_cell_shifts_svd(double M[N_CELL_PARAMS][N_CELL_PARAMS],
+                                 const double *v, double *x)
+{
+	gsl_matrix *m;
+	gsl_vector *gv;
+	gsl_vector *ans;
+	int i, j;
+
+	m = gsl_matrix_alloc(N_CELL_PARAMS, N_CELL_PARAMS);
+	gv = gsl_vector_alloc(N_CELL_PARAMS);
+	if ( (m == NULL) || (gv == NULL) ) return 1;
+	for ( i=0; i<N_CELL_PARAMS; i++ ) {
+		for ( j=0; j<N_CELL_PARAMS; j++ ) {
+			gsl_matrix_set(m, i, j, M[i][j]);
 		}
+		gsl_vector_set(gv, i, v[i]);
+	}
 
-		/* Positional ss terms */
-		for ( k=0; k<num_params; k++ ) {
+	ans = solve_svd(gv, m, NULL, 0);
+	gsl_matrix_free(m);
+	gsl_vector_free(gv);
+	if ( ans == NULL ) return 1;
 
-			int g;
-			double v_c, v_curr;
+	for ( i=0; i<N_CELL_PARAMS; i++ ) x[i] = gsl_vector_get(ans, i);
+	gsl_vector_free(ans);
 
-			for ( g=0; g<num_params; g++ ) {
+	return 0;
+}
 
-				double M_c, M_curr;
 
-				/* Matrix is symmetric */
-				if ( g > k ) continue;
+/* 'grads' must have space for 3*N_CELL_PARAMS gradients per reflection */
+static int iterate(struct reflpeak *rps, int n, UnitCell *cell,
+                   struct image *image, gsl_matrix **Minvs,
+                   double *total_shifts, float *grads)
+{
+	int i, k, g;
+	double M[N_CELL_PARAMS][N_CELL_PARAMS];
+	double v[N_CELL_PARAMS];
+	double shifts[N_CELL_PARAMS];
+	float *r_grads = grads;
+	float *fs_grads = grads + N_CELL_PARAMS*n;
+	float *ss_grads = grads + 2*N_CELL_PARAMS*n;
+	double asx, asy, asz;
+	double bsx, bsy, bsz;
+	double csx, csy, csz;
 
-				M_c = ss_gradients[g] * ss_gradients[k];
-				M_curr = gsl_matrix_get(M, k, g);
-				gsl_matrix_set(M, k, g, M_curr + M_c);
-				gsl_matrix_set(M, g, k, M_curr + M_c);
+	cell_gradients(rps, n, cell, image, Minvs, r_grads, fs_grads, ss_grads);
 
-			}
+	for ( k=0; k<N_CELL_PARAMS; k++ ) {
+		for ( g=0; g<N_CELL_PARAMS; g++ ) M[k][g] = 0.0;
+		v[k] = 0.0;
+	}
 
-			v_c = ss_dev(&rps[i], image->detgeom);
-			v_c *= -ss_gradients[k];
-			v_curr = gsl_vector_get(v, k);
-			gsl_vector_set(v, k, v_curr + v_c);
+	/* Excitation error and positional fs/ss terms.  The matrix is
+	 * symmetric, so only fill in the lower triangle for now. */
+	for ( i=0; i<n; i++ ) {
 
+		const float *r_g = &r_grads[N_CELL_PARAMS*i];
+		const float *fs_g = &fs_grads[N_CELL_PARAMS*i];
+		const float *ss_g = &ss_grads[N_CELL_PARAMS*i];
+		double r_d = r_dev(&rps[i]);
+		double fs_d = fs_dev(&rps[i], image->detgeom);
+		double ss_d = ss_dev(&rps[i], image->detgeom);
+
+		for ( k=0; k<N_CELL_PARAMS; k++ ) {
+			for ( g=0; g<=k; g++ ) {
+				M[k][g] += r_g[g]*r_g[k] + fs_g[g]*fs_g[k]
+				         + ss_g[g]*ss_g[k];
+			}
+			v[k] -= r_d*r_g[k] + fs_d*fs_g[k] + ss_d*ss_g[k];
 		}
 
 	}
 
-	int k;
-	for ( k=0; k<num_params; k++ ) {
-		double M_curr = gsl_matrix_get(M, k, k);
-		gsl_matrix_set(M, k, k, M_curr+1e-18);
+	for ( k=0; k<N_CELL_PARAMS; k++ ) {
+		for ( g=0; g<k; g++ ) M[g][k] = M[k][g];
+		M[k][k] += 1e-18;
 	}
 
-	//show_matrix_eqn(M, v);
-	shifts = solve_svd(v, M, NULL, 0);
-	if ( shifts == NULL ) {
+	if ( solve_cell_shifts(M, v, shifts)
+	  && solve_cell_shifts_svd(M, v, shifts) )
+	{
 		ERROR("Failed to solve equations.\n");
-		gsl_matrix_free(M);
-		gsl_vector_free(v);
 		return 1;
 	}
 
-	for ( i=0; i<num_params; i++ ) {
-	//	STATUS("Shift %i = %e\n", i, gsl_vector_get(shifts, i));
-		if ( isnan(gsl_vector_get(shifts, i)) ) {
-			gsl_vector_set(shifts, i, 0.0);
-		}
-		total_shifts[i] += gsl_vector_get(shifts, i);
+	for ( i=0; i<N_CELL_PARAMS; i++ ) {
+	//	STATUS("Shift %i = %e\n", i, shifts[i]);
+		if ( isnan(shifts[i]) ) shifts[i] = 0.0;
+		total_shifts[i] += shifts[i];
 	}
 
 	/* Apply shifts */
@@ -735,22 +871,20 @@ static int iterate(struct reflpeak *rps, int n, UnitCell *cell,
 	                          &bsx, &bsy, &bsz,
 	                          &csx, &csy, &csz);
 
-	/* Ensure the order here matches the order in rv[] */
-	asx += gsl_vector_get(shifts, 0);
-	asy += gsl_vector_get(shifts, 1);
-	asz += gsl_vector_get(shifts, 2);
-	bsx += gsl_vector_get(shifts, 3);
-	bsy += gsl_vector_get(shifts, 4);
-	bsz += gsl_vector_get(shifts, 5);
-	csx += gsl_vector_get(shifts, 6);
-	csy += gsl_vector_get(shifts, 7);
-	csz += gsl_vector_get(shifts, 8);
+	/* The order here is the order of enum gparam */
+	asx += shifts[0];
+	asy += shifts[1];
+	asz += shifts[2];
+	bsx += shifts[3];
+	bsy += shifts[4];
+	bsz += shifts[5];
+	csx += shifts[6];
+	csy += shifts[7];
+	csz += shifts[8];
 
 	cell_set_reciprocal(cell, asx, asy, asz, bsx, bsy, bsz, csx, csy, csz);
 
-	gsl_vector_free(shifts);
-	gsl_matrix_free(M);
-	gsl_vector_free(v);
+	update_first_order(rps, n, r_grads, fs_grads, ss_grads, shifts);
 
 	return 0;
 }
@@ -804,6 +938,7 @@ int refine_prediction(struct image *image, Crystal *cr,
 	gsl_matrix **Minvs;
 	double total_shifts[12];
 	double res_r, res_fs, res_ss, res_overall;
+	float *grads;
 
 	rps = cfmalloc(image_feature_count(image->features)
 	                         * sizeof(struct reflpeak));
@@ -847,11 +982,18 @@ int refine_prediction(struct image *image, Crystal *cr,
 
 	for ( i=0; i<12; i++ ) total_shifts[i] = 0.0;
 
+	grads = cfmalloc(3*N_CELL_PARAMS*n*sizeof(float));
+	if ( grads == NULL ) return 1;
+
 	/* Refine (max 5 cycles) */
 	for ( i=0; i<5; i++ ) {
-		update_predictions(reflist, cr, image);
-		if ( iterate(rps, n, crystal_get_cell(cr), image, Minvs, total_shifts) )
+		if ( i % PRED_RESYNC == 0 ) {
+			update_predictions(reflist, cr, image);
+		}
+		if ( iterate(rps, n, crystal_get_cell(cr), image, Minvs,
+		             total_shifts, grads) )
 		{
+			cffree(grads);
 			return 1;
 		}
 
@@ -860,6 +1002,8 @@ int refine_prediction(struct image *image, Crystal *cr,
 		//       i, res_overall, res_r, res_fs, res_ss);
 	}
 
+	cffree(grads);
+
 	res_overall = pred_residual(rps, n, image->detgeom, &res_r, &res_fs, &res_ss);
 	snprintf(tmp, 255, "predict_refine/final_residual = %f (%f %f %f)",
 	         res_overall, res_r, res_fs, res_ss);
@@ -52,6 +52,9 @@ enum gparam {
 	GPARAM_DET_RZ,  /* Detector panel (group) rotation about +z */
 };
 
+/** Number of reciprocal cell parameters, GPARAM_ASX to GPARAM_CSZ */
+#define N_CELL_PARAMS (9)
+
 
 #include "crystal.h"
 #include "crystfel-mille.h"
@@ -86,4 +89,8 @@ extern int fs_ss_gradient(int param, Reflection *refl, UnitCell *cell,
                           double cx, double cy, double cz,
                           float *fsg, float *ssg);
 
+extern void cell_gradients(struct reflpeak *rps, int n, UnitCell *cell,
+                           struct image *image, gsl_matrix **Minvs,
+                           float *r_grads, float *fs_grads, float *ss_grads);
+
 #endif	/* PREDICT_REFINE_H */
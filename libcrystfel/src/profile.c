@@ -31,9 +31,25 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <math.h>
 #include <time.h>
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+#ifdef HAVE_MALLOC_USABLE_SIZE
+#include <malloc.h>
+#endif
+
+#ifdef HAVE_PERF_EVENT
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#endif
 
 #include "profile.h"
 #include "utils.h"
@@ -42,88 +58,399 @@
 #define CLOCK_MONOTONIC_RAW (CLOCK_MONOTONIC)
 #endif
 
-struct _profile_block
+/* Maximum number of different blocks (name and position in the tree) for each
+ * thread.  Blocks beyond this are not recorded, and their time counts towards
+ * their parents only. */
+#define PROFILE_MAX_NODES (128)
+
+/* The durations of each block are histogrammed in quarter-octave bins,
+ * starting at 1 us.  The last bin takes everything longer than about
+ * 30 seconds. */
+#define PROFILE_N_BINS (100)
+#define PROFILE_BINS_PER_OCTAVE (4)
+#define PROFILE_BIN_MIN (1e-6)
+
+#define PROFILE_FILE_HEADER_V1 "CrystFEL profile data version 1"
+#define PROFILE_FILE_HEADER_V2 "CrystFEL profile data version 2"
+#define PROFILE_FILE_HEADER "CrystFEL profile data version 3"
+
+/* Hardware counters, if enabled with profile_enable_counters(): CPU cycles,
+ * instructions, last level cache misses and branch mispredictions */
+#define PROFILE_N_COUNTERS (4)
+
+/* Trace records for each thread are kept in a buffer of this size, which is
+ * written out when it's full, or every PROFILE_TRACE_FLUSH_INTERVAL seconds */
+#define PROFILE_TRACE_BUFFER (4096)
+#define PROFILE_TRACE_FLUSH_INTERVAL (1.0)
+
+struct _profile_node
 {
-	char *name;
+	/* Not copied, so must not be freed or changed while profiling */
+	const char *name;
 
-	time_t start_sec;
-	long start_nsec;
+	int parent;
+	int first_child;
+	int next_sibling;
+
+	double start_time;
+	long count;
 	double total_time;
+	uint64_t hist[PROFILE_N_BINS];
+
+	uint64_t start_counters[PROFILE_N_COUNTERS];
+	uint64_t counters[PROFILE_N_COUNTERS];
+
+	/* Allocations made while this was the innermost block, and the most
+	 * memory allocated (by the whole process) at any of those times */
+	uint64_t n_allocs;
+	uint64_t alloc_bytes;
+	int64_t peak_alloc;
+};
+
 
-	struct _profile_block *parent;
-	struct _profile_block **children;
-	int n_children;
-	int max_children;
+struct _trace_record
+{
+	const char *name;
+	double time;
+	int serial;
+	char phase;
 };
 
 
 struct _profiledata
 {
-	struct _profile_block *root;
-	struct _profile_block *current;
+	/* Process which made this data, to recognise data inherited across
+	 * fork() */
+	pid_t owner;
+
+	/* Node 0 is the root */
+	struct _profile_node nodes[PROFILE_MAX_NODES];
+	int n_nodes;
+	int current;
+
+	/* Number of currently open blocks which could not be recorded */
+	int n_lost;
+
+	/* Time of last profile_print_and_reset() */
+	double reset_time;
+
+	/* For tracing */
+	int tid;
+	int serial;
+	struct _trace_record *trace;
+	int n_trace;
+	double last_flush;
+
+	/* For hardware counters.  counter_fd[0] is the group leader */
+	int counters_tried;
+	int counter_fd[PROFILE_N_COUNTERS];
+
+	struct _profiledata *next;
 };
 
 
-struct _profiledata *pd = NULL;
+struct _profileentry
+{
+	char *path;
+	long count;
+	double total_time;
+	uint64_t hist[PROFILE_N_BINS];
+	uint64_t counters[PROFILE_N_COUNTERS];
+	uint64_t n_allocs;
+	uint64_t alloc_bytes;
+	int64_t peak_alloc;
+};
 
 
-static struct _profile_block *start_profile_block(const char *name)
+struct _profilesummary
 {
-	struct _profile_block *b;
+	struct _profileentry *entries;
+	int n_entries;
+	int max_entries;
+	int n_threads;
+	long max_rss;  /* Largest peak RSS of any process, in kB */
+};
 
-	b = cfmalloc(sizeof(struct _profile_block));
-	if ( b == NULL ) return NULL;
 
-	b->name = cfstrdup(name);
-	if ( b->name == NULL ) {
-		cffree(b);
-		return NULL;
-	}
-	b->n_children = 0;
-	b->max_children = 0;
-	b->children = NULL;
+/* Set by profile_init().  When zero, profile_start() and profile_end() return
+ * straight away. */
+static int profile_enabled = 0;
 
-#ifdef HAVE_CLOCK_GETTIME
-	struct timespec tp;
-	clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
-	b->start_sec = tp.tv_sec;
-	b->start_nsec = tp.tv_nsec;
-#endif
+/* Each thread has its own profiling data, made the first time it is needed.
+ * All of them are also kept in a list, for profile_write(). */
+static pthread_key_t profile_key;
+static pthread_once_t profile_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t profile_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct _profiledata *profile_list = NULL;
+static int next_tid = 0;
 
-	return b;
+/* Set by profile_enable_counters() */
+static int profile_counters = 0;
+
+/* Set by profile_trace_start() */
+static int profile_tracing = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static int trace_pid = 0;
+static pid_t trace_owner = 0;
+
+/* Set by profile_enable_alloc_stats().  The memory management functions which
+ * were in use before are called to do the actual work.  The amount of memory
+ * allocated is only known if they are the standard ones, in which case
+ * alloc_track_size is set. */
+static int profile_allocs = 0;
+static int alloc_track_size = 0;
+static atomic_llong alloc_current = 0;
+static void *(*alloc_prev_malloc)(size_t size);
+static void (*alloc_prev_free)(void *ptr);
+static void *(*alloc_prev_calloc)(size_t nmemb, size_t size);
+static void *(*alloc_prev_realloc)(void *ptr, size_t size);
+
+static void make_profile_key(void)
+{
+	pthread_key_create(&profile_key, NULL);
 }
 
 
-static void stop_profile_block(struct _profile_block *b)
+static double profile_time(void)
 {
 #ifdef HAVE_CLOCK_GETTIME
 	struct timespec tp;
 	clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
-	time_t sec = tp.tv_sec - b->start_sec;
-	long nsec = tp.tv_nsec - b->start_nsec;
-	b->total_time = sec + nsec*1e-9;
+	return tp.tv_sec + tp.tv_nsec*1e-9;
 #else
-	b->total_time = 0.0;
+	return 0.0;
 #endif
 }
 
 
-void profile_init()
+static void init_node(struct _profile_node *n, const char *name, int parent)
 {
-	if ( pd != NULL ) {
-		fprintf(stderr, "Attempted to initialise profiling twice!\n");
-		fflush(stderr);
-		abort();
+	n->name = name;
+	n->parent = parent;
+	n->first_child = -1;
+	n->next_sibling = -1;
+	n->start_time = 0.0;
+	n->count = 0;
+	n->total_time = 0.0;
+	memset(n->hist, 0, sizeof(n->hist));
+	memset(n->counters, 0, sizeof(n->counters));
+	n->n_allocs = 0;
+	n->alloc_bytes = 0;
+	n->peak_alloc = 0;
+}
+
+
+static void close_counters(struct _profiledata *pd)
+{
+	int i;
+	for ( i=0; i<PROFILE_N_COUNTERS; i++ ) {
+		if ( pd->counter_fd[i] != -1 ) close(pd->counter_fd[i]);
+		pd->counter_fd[i] = -1;
 	}
+	pd->counters_tried = 0;
+}
+
+
+#ifdef HAVE_PERF_EVENT
+
+static int open_counter(uint64_t config, int group)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.disabled = (group == -1);
+
+	/* Calling thread, any CPU */
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+
+/* Opens the counters for the calling thread.  If any of them aren't available,
+ * none of them are used. */
+static int open_counters(struct _profiledata *pd)
+{
+	const uint64_t config[PROFILE_N_COUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES
+	};
+	int i;
+
+	pd->counters_tried = 1;
+	for ( i=0; i<PROFILE_N_COUNTERS; i++ ) {
+		pd->counter_fd[i] = open_counter(config[i], pd->counter_fd[0]);
+		if ( pd->counter_fd[i] == -1 ) {
+			close_counters(pd);
+			pd->counters_tried = 1;
+			return 1;
+		}
+	}
+
+	ioctl(pd->counter_fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(pd->counter_fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	return 0;
+}
+
+
+static void read_counters(struct _profiledata *pd, uint64_t *vals)
+{
+	/* Format for PERF_FORMAT_GROUP: number of values, then the values */
+	uint64_t buf[PROFILE_N_COUNTERS+1];
+
+	if ( !pd->counters_tried ) open_counters(pd);
+	if ( (pd->counter_fd[0] == -1)
+	  || (read(pd->counter_fd[0], buf, sizeof(buf)) != sizeof(buf)) )
+	{
+		memset(vals, 0, PROFILE_N_COUNTERS*sizeof(uint64_t));
+		return;
+	}
+	memcpy(vals, &buf[1], PROFILE_N_COUNTERS*sizeof(uint64_t));
+}
+
+#else /* HAVE_PERF_EVENT */
+
+static int open_counters(struct _profiledata *pd)
+{
+	pd->counters_tried = 1;
+	return 1;
+}
+
+
+static void read_counters(struct _profiledata *pd, uint64_t *vals)
+{
+	memset(vals, 0, PROFILE_N_COUNTERS*sizeof(uint64_t));
+}
+
+#endif /* HAVE_PERF_EVENT */
+
+
+static struct _profiledata *get_profile_data(void)
+{
+	struct _profiledata *pd;
+	int i;
+
+	pd = pthread_getspecific(profile_key);
+	if ( pd != NULL ) return pd;
+
+	pd = cfmalloc(sizeof(struct _profiledata));
+	if ( pd == NULL ) return NULL;
+
+	pd->owner = getpid();
+	init_node(&pd->nodes[0], "root", -1);
+	pd->n_nodes = 1;
+	pd->current = 0;
+	pd->n_lost = 0;
+	pd->reset_time = profile_time();
+	pd->serial = 0;
+	pd->trace = NULL;
+	pd->n_trace = 0;
+	pd->last_flush = pd->reset_time;
+	pd->counters_tried = 0;
+	for ( i=0; i<PROFILE_N_COUNTERS; i++ ) pd->counter_fd[i] = -1;
+	pthread_setspecific(profile_key, pd);
+
+	pthread_mutex_lock(&profile_list_lock);
+	pd->tid = next_tid++;
+	pd->next = profile_list;
+	profile_list = pd;
+	pthread_mutex_unlock(&profile_list_lock);
+
+	return pd;
+}
+
+
+static int time_bin(double t)
+{
+	int bin;
+	if ( !(t > PROFILE_BIN_MIN) ) return 0;
+	bin = PROFILE_BINS_PER_OCTAVE * log2(t/PROFILE_BIN_MIN);
+	if ( bin >= PROFILE_N_BINS ) bin = PROFILE_N_BINS-1;
+	return bin;
+}
+
+
+static double bin_centre(int bin)
+{
+	return PROFILE_BIN_MIN * pow(2.0, (bin+0.5)/PROFILE_BINS_PER_OCTAVE);
+}
+
+
+/* Forget any profiling data, trace file and counters inherited from the parent
+ * process.  The thread which called fork() is the only one which exists in the
+ * child, and it keeps its data structure, with the contents reset.  The
+ * counters belong to the parent's threads, so they have to be opened again. */
+static void discard_inherited_data(void)
+{
+	struct _profiledata *pd;
+	struct _profiledata *mine;
+	pid_t pid = getpid();
 
-	if ( pd == NULL ) {
-		pd = cfmalloc(sizeof(struct _profiledata));
-		if ( pd == NULL ) return;
+	pthread_mutex_lock(&trace_lock);
+	if ( (trace_fd != -1) && (trace_owner != pid) ) {
+		close(trace_fd);
+		trace_fd = -1;
+		profile_tracing = 0;
 	}
+	pthread_mutex_unlock(&trace_lock);
 
-	pd->root = start_profile_block("root");
-	pd->current = pd->root;
-	pd->root->parent = NULL;
+	mine = pthread_getspecific(profile_key);
+
+	pthread_mutex_lock(&profile_list_lock);
+	pd = profile_list;
+	profile_list = NULL;
+	while ( pd != NULL ) {
+		struct _profiledata *next = pd->next;
+		if ( pd->owner == pid ) {
+			pd->next = profile_list;
+			profile_list = pd;
+		} else if ( pd != mine ) {
+			close_counters(pd);
+			cffree(pd->trace);
+			cffree(pd);
+		}
+		pd = next;
+	}
+	if ( profile_list == NULL ) next_tid = 0;
+	if ( (mine != NULL) && (mine->owner != pid) ) {
+		mine->owner = pid;
+		init_node(&mine->nodes[0], "root", -1);
+		mine->n_nodes = 1;
+		mine->current = 0;
+		mine->n_lost = 0;
+		mine->n_trace = 0;
+		mine->reset_time = profile_time();
+		close_counters(mine);
+		mine->tid = next_tid++;
+		mine->next = profile_list;
+		profile_list = mine;
+	}
+	pthread_mutex_unlock(&profile_list_lock);
+}
+
+
+/**
+ * Enables profiling for all threads in the current process.  Each thread
+ * records its own timings, starting the first time it calls profile_start().
+ *
+ * Until this function is called, profile_start() and profile_end() do nothing
+ * and cost almost no time, so they can be left in place in production code.
+ *
+ * If this process was created using fork() by a process which was already
+ * profiling, the timings and trace (if any) from the parent are discarded.
+ */
+void profile_init()
+{
+	pthread_once(&profile_key_once, make_profile_key);
+	discard_inherited_data();
+	profile_enabled = 1;
 
 #ifndef HAVE_CLOCK_GETTIME
 	printf("Profiling disabled because clock_gettime is not available\n");
@@ -131,129 +458,945 @@ void profile_init()
 }
 
 
-static char *format_profile_block(struct _profile_block *b)
+/**
+ * Enables hardware performance counters (CPU cycles, instructions, last level
+ * cache misses and branch mispredictions) for all threads in the current
+ * process.  The counts for each block are accumulated along with the timings,
+ * and included in the output of profile_write().  Only the counts from user
+ * space are included.
+ *
+ * Call this after profile_init(), and before timing any blocks.  The counters
+ * are opened separately for each thread, the first time it calls
+ * profile_start().  If this process is created using fork() afterwards, the
+ * child process must call profile_init() and this function again.
+ *
+ * The counters are not available on all systems.  On Linux, they are often
+ * restricted by the kernel.perf_event_paranoid setting.
+ *
+ * \returns zero on success, or non-zero if the counters are not available.
+ */
+int profile_enable_counters()
 {
-	int i;
-	size_t total_len = 0;
-	char **subbufs;
-	char *full_buf;
+	struct _profiledata *pd;
+
+	if ( !profile_enabled ) return 1;
 
-	subbufs = cfmalloc(b->n_children * sizeof(char *));
-	if ( subbufs == NULL ) return NULL;
+	pd = get_profile_data();
+	if ( pd == NULL ) return 1;
 
-	total_len = 32 + strlen(b->name);
-	for ( i=0; i<b->n_children; i++ ) {
-		subbufs[i] = format_profile_block(b->children[i]);
-		if ( subbufs[i] == NULL ) return NULL;
-		total_len += 1 + strlen(subbufs[i]);
+	if ( pd->counter_fd[0] == -1 ) {
+		if ( open_counters(pd) ) return 1;
 	}
 
-	full_buf = cfmalloc(total_len);
-	snprintf(full_buf, 32, "(%s %.3f", b->name, b->total_time);
-	for ( i=0; i<b->n_children; i++ ) {
-		strcat(full_buf, " ");
-		strcat(full_buf, subbufs[i]);
-		cffree(subbufs[i]);
+	profile_counters = 1;
+	return 0;
+}
+
+
+static size_t alloc_size(void *ptr, size_t size)
+{
+#ifdef HAVE_MALLOC_USABLE_SIZE
+	if ( alloc_track_size ) return malloc_usable_size(ptr);
+#endif
+	return size;
+}
+
+
+/* Must not allocate any memory itself */
+static void count_alloc(void *ptr, size_t size)
+{
+	struct _profiledata *pd;
+	struct _profile_node *n;
+	long long current = 0;
+
+	if ( ptr == NULL ) return;
+
+	size = alloc_size(ptr, size);
+	if ( alloc_track_size ) {
+		current = atomic_fetch_add_explicit(&alloc_current, size,
+		                                    memory_order_relaxed) + size;
 	}
-	strcat(full_buf, ")");
 
-	cffree(subbufs);
+	pd = pthread_getspecific(profile_key);
+	if ( pd == NULL ) return;
+
+	n = &pd->nodes[pd->current];
+	n->n_allocs++;
+	n->alloc_bytes += size;
+	if ( current > n->peak_alloc ) n->peak_alloc = current;
+}
+
 
-	return full_buf;
+static void count_free(size_t size)
+{
+	if ( !alloc_track_size ) return;
+	atomic_fetch_sub_explicit(&alloc_current, size, memory_order_relaxed);
 }
 
 
-static void free_profile_block(struct _profile_block *b)
+static void *alloc_stats_malloc(size_t size)
 {
-	int i;
-	for ( i=0; i<b->n_children; i++ ) {
-		free_profile_block(b->children[i]);
+	void *ptr = alloc_prev_malloc(size);
+	count_alloc(ptr, size);
+	return ptr;
+}
+
+
+static void alloc_stats_free(void *ptr)
+{
+	if ( ptr == NULL ) return;
+	count_free(alloc_size(ptr, 0));
+	alloc_prev_free(ptr);
+}
+
+
+static void *alloc_stats_calloc(size_t nmemb, size_t size)
+{
+	void *ptr = alloc_prev_calloc(nmemb, size);
+	count_alloc(ptr, nmemb*size);
+	return ptr;
+}
+
+
+static void *alloc_stats_realloc(void *ptr, size_t size)
+{
+	size_t old_size = (ptr != NULL) ? alloc_size(ptr, 0) : 0;
+	void *nptr = alloc_prev_realloc(ptr, size);
+	if ( nptr != NULL ) {
+		count_free(old_size);
+		count_alloc(nptr, size);
 	}
-	cffree(b->children);
-	cffree(b->name);
-	cffree(b);
+	return nptr;
 }
 
 
+/**
+ * Counts the memory allocations made with cfmalloc(), cfcalloc(), cfrealloc()
+ * and the functions which use them, such as cfstrdup(), for all threads in the
+ * current process.  This works by installing counting versions of the memory
+ * management functions with set_mm_funcs(), which call the previous ones to do
+ * the actual work.  Memory allocated directly with malloc() etc is not
+ * counted.
+ *
+ * The number and size of the allocations are accumulated for the innermost
+ * block which is open in the thread at the time, and included in the output
+ * of profile_write().  If the standard memory management functions are in use,
+ * and malloc_usable_size() is available, the total amount of memory allocated
+ * by the process is also tracked, and the largest amount at the time of any
+ * allocation inside each block is recorded.  This is only approximate, because
+ * memory allocated with one set of functions is sometimes freed with another.
+ *
+ * Call this after profile_init(), and as early as possible, because memory
+ * allocated before this function is called is not counted.  Each process must
+ * call this function itself.
+ *
+ * \returns zero on success, or non-zero if profiling is not enabled.
+ */
+int profile_enable_alloc_stats()
+{
+	if ( !profile_enabled ) return 1;
+	if ( profile_allocs ) return 0;
+
+	get_mm_funcs(&alloc_prev_malloc, &alloc_prev_free,
+	             &alloc_prev_calloc, &alloc_prev_realloc);
+
+#ifdef HAVE_MALLOC_USABLE_SIZE
+	alloc_track_size = (alloc_prev_malloc == malloc)
+	                && (alloc_prev_free == free)
+	                && (alloc_prev_calloc == calloc)
+	                && (alloc_prev_realloc == realloc);
+#endif
+
+	set_mm_funcs(alloc_stats_malloc, alloc_stats_free,
+	             alloc_stats_calloc, alloc_stats_realloc);
+	profile_allocs = 1;
+	return 0;
+}
+
+
+/* Appends 'str' to the buffer, which is enlarged if necessary */
+static int append_str(char **pbuf, size_t *plen, size_t *pmax, const char *str)
+{
+	size_t len = strlen(str);
+	if ( *plen + len + 1 > *pmax ) {
+		char *nbuf;
+		size_t nmax = *plen + len + 1024;
+		nbuf = cfrealloc(*pbuf, nmax);
+		if ( nbuf == NULL ) return 1;
+		*pbuf = nbuf;
+		*pmax = nmax;
+	}
+	memcpy(*pbuf + *plen, str, len+1);
+	*plen += len;
+	return 0;
+}
+
+
+static int format_profile_block(struct _profiledata *pd, int n, double t,
+                                char **pbuf, size_t *plen, size_t *pmax)
+{
+	char tmp[64];
+	int c;
+
+	snprintf(tmp, 64, " %.3f", t);
+	if ( append_str(pbuf, plen, pmax, (n == 0) ? "(" : " (") ) return 1;
+	if ( append_str(pbuf, plen, pmax, pd->nodes[n].name) ) return 1;
+	if ( append_str(pbuf, plen, pmax, tmp) ) return 1;
+
+	for ( c=pd->nodes[n].first_child; c!=-1; c=pd->nodes[c].next_sibling ) {
+		if ( pd->nodes[c].count == 0 ) continue;
+		if ( format_profile_block(pd, c, pd->nodes[c].total_time,
+		                          pbuf, plen, pmax) ) return 1;
+	}
+
+	return append_str(pbuf, plen, pmax, ")");
+}
+
+
+/**
+ * \param worker_id A number to identify the output
+ *
+ * Writes the timings for the current thread to standard output, in the form
+ * "worker_id (root time (block time ...) ...)", then resets them.  The time
+ * for each block is the total since the previous call, and the time for the
+ * root is the wall clock time since then.
+ */
 void profile_print_and_reset(int worker_id)
 {
+	struct _profiledata *pd;
 	char *buf;
-	char *buf2;
+	size_t len = 0;
+	size_t max_len = 256;
+	double now;
+	int i;
 
-	if ( pd == NULL ) {
+	if ( !profile_enabled ) {
 		fprintf(stderr, "Profiling not initialised yet!\n");
 		fflush(stderr);
 		abort();
 	}
 
-	if ( pd->current != pd->root ) {
+	pd = get_profile_data();
+	if ( pd == NULL ) return;
+
+	if ( (pd->current != 0) || (pd->n_lost > 0) ) {
 		fprintf(stderr, "Attempted to finalise profiling while not "
-		        "on root block (%s)\n", pd->current->name);
+		        "on root block (%s)\n", pd->nodes[pd->current].name);
 		fflush(stderr);
 		abort();
 	}
 
-	stop_profile_block(pd->root);
+	now = profile_time();
+	buf = cfmalloc(max_len);
+	if ( buf == NULL ) return;
+	snprintf(buf, max_len, "%i ", worker_id);
+	len = strlen(buf);
+	if ( (format_profile_block(pd, 0, now - pd->reset_time,
+	                           &buf, &len, &max_len) == 0)
+	  && (append_str(&buf, &len, &max_len, "\n") == 0) )
+	{
+		write(STDOUT_FILENO, buf, len);
+	}
+	cffree(buf);
+
+	for ( i=1; i<pd->n_nodes; i++ ) {
+		pd->nodes[i].count = 0;
+		pd->nodes[i].total_time = 0.0;
+		memset(pd->nodes[i].hist, 0, sizeof(pd->nodes[i].hist));
+		memset(pd->nodes[i].counters, 0,
+		       sizeof(pd->nodes[i].counters));
+		pd->nodes[i].n_allocs = 0;
+		pd->nodes[i].alloc_bytes = 0;
+		pd->nodes[i].peak_alloc = 0;
+	}
+	pd->reset_time = now;
+}
+
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+	while ( len > 0 ) {
+		ssize_t r = write(fd, buf, len);
+		if ( r <= 0 ) return;
+		buf += r;
+		len -= r;
+	}
+}
+
+
+/* Writes out the trace records for one thread */
+static void flush_trace(struct _profiledata *pd, double now)
+{
+	size_t max_len = 0;
+	size_t len = 0;
+	char *buf;
+	int i;
+
+	pd->last_flush = now;
+	if ( pd->n_trace == 0 ) return;
+
+	for ( i=0; i<pd->n_trace; i++ ) {
+		max_len += 128 + strlen(pd->trace[i].name);
+	}
+	buf = cfmalloc(max_len);
+	if ( buf == NULL ) return;
+
+	for ( i=0; i<pd->n_trace; i++ ) {
+		struct _trace_record *r = &pd->trace[i];
+		len += snprintf(buf+len, max_len-len,
+		                "{\"name\":\"%s\",\"ph\":\"%c\","
+		                "\"ts\":%.3f,\"pid\":%i,\"tid\":%i",
+		                r->name, r->phase, r->time*1e6,
+		                trace_pid, pd->tid);
+		if ( (r->phase == 'B') && (r->serial > 0) ) {
+			len += snprintf(buf+len, max_len-len,
+			                ",\"args\":{\"serial\":%i}", r->serial);
+		}
+		len += snprintf(buf+len, max_len-len, "},\n");
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	if ( trace_fd != -1 ) write_all(trace_fd, buf, len);
+	pthread_mutex_unlock(&trace_lock);
 
-	buf = format_profile_block(pd->root);
-	buf2 = cfmalloc(8+strlen(buf));
-	size_t len = 8+strlen(buf);
-	snprintf(buf2, len, "%i %s\n", worker_id, buf);
-	write(STDOUT_FILENO, buf2, strlen(buf2));
 	cffree(buf);
-	cffree(buf2);
+	pd->n_trace = 0;
+}
+
+
+static void trace_record(struct _profiledata *pd, const char *name,
+                         char phase, double t)
+{
+	struct _trace_record *r;
+
+	if ( pd->trace == NULL ) {
+		pd->trace = cfmalloc(PROFILE_TRACE_BUFFER
+		                     * sizeof(struct _trace_record));
+		if ( pd->trace == NULL ) return;
+		pd->n_trace = 0;
+		pd->last_flush = t;
+	}
+
+	r = &pd->trace[pd->n_trace++];
+	r->name = name;
+	r->time = t;
+	r->serial = pd->serial;
+	r->phase = phase;
 
-	free_profile_block(pd->root);
-	pd->root = start_profile_block("root");
-	pd->current = pd->root;
-	pd->root->parent = NULL;
+	if ( (pd->n_trace == PROFILE_TRACE_BUFFER)
+	  || (t - pd->last_flush > PROFILE_TRACE_FLUSH_INTERVAL) )
+	{
+		flush_trace(pd, t);
+	}
+}
+
+
+/* Returns the index of the child of 'parent' called 'name', adding it if
+ * necessary, or -1 if there's no room */
+static int find_child(struct _profiledata *pd, int parent, const char *name)
+{
+	int c;
+	int last = -1;
+
+	for ( c=pd->nodes[parent].first_child;
+	      c != -1;
+	      c=pd->nodes[c].next_sibling )
+	{
+		/* The names are almost always the same string constants */
+		if ( pd->nodes[c].name == name ) return c;
+		if ( strcmp(pd->nodes[c].name, name) == 0 ) return c;
+		last = c;
+	}
+
+	if ( pd->n_nodes == PROFILE_MAX_NODES ) return -1;
+
+	c = pd->n_nodes++;
+	init_node(&pd->nodes[c], name, parent);
+	if ( last == -1 ) {
+		pd->nodes[parent].first_child = c;
+	} else {
+		pd->nodes[last].next_sibling = c;
+	}
+	return c;
 }
 
 
+/**
+ * \param name The name of the block, which must be a string constant
+ *
+ * Starts timing a block of code, inside the current block (if any).  The
+ * timings are accumulated for each different block, according to its name and
+ * the names of the blocks containing it.
+ *
+ * This function does nothing unless profile_init() has been called.
+ */
 void profile_start(const char *name)
 {
-	struct _profile_block *b;
+	struct _profiledata *pd;
+	double t;
+	int c;
+
+	if ( !profile_enabled ) return;
 
+	pd = get_profile_data();
 	if ( pd == NULL ) return;
 
-	if ( pd->current->n_children >= pd->current->max_children ) {
-		struct _profile_block **nblock;
-		int nmax = pd->current->n_children + 64;
-		nblock = cfrealloc(pd->current->children, nmax*sizeof(struct _profile_block *));
-		if ( nblock == NULL ) {
-			fprintf(stderr, "Failed to allocate profiling record. "
-			                "Try again without --profile.\n");
-			abort();
-		}
-		pd->current->children = nblock;
-		pd->current->max_children = nmax;
+	t = profile_time();
+	if ( profile_tracing ) trace_record(pd, name, 'B', t);
+
+	if ( pd->n_lost > 0 ) {
+		pd->n_lost++;
+		return;
+	}
+
+	c = find_child(pd, pd->current, name);
+	if ( c == -1 ) {
+		pd->n_lost++;
+		return;
 	}
 
-	b = start_profile_block(name);
-	b->parent = pd->current;
-	pd->current->children[pd->current->n_children++] = b;
-	pd->current = b;
+	pd->current = c;
+	pd->nodes[c].start_time = t;
+	if ( profile_counters ) read_counters(pd, pd->nodes[c].start_counters);
 }
 
 
+/**
+ * \param name The name of the block, which must match the most recent call to
+ * profile_start() which hasn't already been ended
+ *
+ * Stops timing a block of code.
+ *
+ * This function does nothing unless profile_init() has been called.
+ */
 void profile_end(const char *name)
 {
+	struct _profiledata *pd;
+	struct _profile_node *n;
+	double t;
+
+	if ( !profile_enabled ) return;
+
+	pd = get_profile_data();
 	if ( pd == NULL ) return;
 
-	if ( pd->current == NULL ) {
+	t = profile_time();
+	if ( profile_tracing ) trace_record(pd, name, 'E', t);
+
+	if ( pd->n_lost > 0 ) {
+		pd->n_lost--;
+		return;
+	}
+
+	if ( pd->current == 0 ) {
 		fprintf(stderr, "No current profile block!\n");
 		fflush(stderr);
 		abort();
 	}
 
-	if ( strcmp(name, pd->current->name) != 0 ) {
+	n = &pd->nodes[pd->current];
+	if ( (n->name != name) && (strcmp(name, n->name) != 0) ) {
 		fprintf(stderr, "Attempt to close wrong profile block (%s) "
-		        "current block is %s\n", name, pd->current->name);
+		        "current block is %s\n", name, n->name);
 		fflush(stderr);
 		abort();
 	}
 
-	stop_profile_block(pd->current);
+	if ( profile_counters ) {
+		uint64_t vals[PROFILE_N_COUNTERS];
+		int i;
+		read_counters(pd, vals);
+		for ( i=0; i<PROFILE_N_COUNTERS; i++ ) {
+			n->counters[i] += vals[i] - n->start_counters[i];
+		}
+	}
+
+	t -= n->start_time;
+	n->count++;
+	n->total_time += t;
+	n->hist[time_bin(t)]++;
+
+	pd->current = n->parent;
+}
+
+
+/**
+ * \param filename Filename for the trace
+ * \param pid Number to identify this process in the trace
+ * \param label Name for this process in the trace, without any quote marks
+ *
+ * Starts recording the beginning and end of every block timed with
+ * profile_start() and profile_end(), in all threads, as well as accumulating
+ * the timings.  The records are written to \p filename in the Chrome JSON
+ * trace format, with one event on each line followed by a comma.  The opening
+ * square bracket is not included, so that the files from several processes
+ * can be joined together.
+ *
+ * The records are buffered separately for each thread, and written out when
+ * the buffer fills up, or every second when the thread is active.  The time
+ * stamps come from the system's monotonic clock, so traces from different
+ * processes on the same computer can be combined.
+ *
+ * If profile_init() has not already been called, this function calls it.
+ *
+ * \returns zero on success.
+ */
+int profile_trace_start(const char *filename, int pid, const char *label)
+{
+	char meta[256];
+	int fd;
+
+	if ( !profile_enabled ) profile_init();
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ( fd == -1 ) return 1;
+
+	snprintf(meta, 256, "{\"name\":\"process_name\",\"ph\":\"M\","
+	         "\"pid\":%i,\"tid\":0,\"args\":{\"name\":\"%s\"}},\n",
+	         pid, label);
+
+	pthread_mutex_lock(&trace_lock);
+	if ( trace_fd != -1 ) close(trace_fd);
+	trace_fd = fd;
+	trace_pid = pid;
+	trace_owner = getpid();
+	write_all(trace_fd, meta, strlen(meta));
+	pthread_mutex_unlock(&trace_lock);
+
+	profile_tracing = 1;
+	return 0;
+}
+
+
+/**
+ * \param serial A serial number for the current frame, or zero for none
+ *
+ * Sets the frame serial number for the current thread.  Subsequent trace
+ * records for the start of each block will include it.
+ */
+void profile_trace_set_serial(int serial)
+{
+	struct _profiledata *pd;
+	if ( !profile_enabled ) return;
+	pd = get_profile_data();
+	if ( pd == NULL ) return;
+	pd->serial = serial;
+}
+
+
+/**
+ * Writes out all remaining trace records from all threads, and closes the
+ * trace file.  Call it when no more blocks are being timed, for example after
+ * the other threads have finished.
+ */
+void profile_trace_stop()
+{
+	struct _profiledata *pd;
+	double now = profile_time();
+
+	if ( !profile_tracing ) return;
+
+	pthread_mutex_lock(&profile_list_lock);
+	for ( pd=profile_list; pd!=NULL; pd=pd->next ) {
+		flush_trace(pd, now);
+	}
+	pthread_mutex_unlock(&profile_list_lock);
+
+	profile_tracing = 0;
+
+	pthread_mutex_lock(&trace_lock);
+	if ( trace_fd != -1 ) close(trace_fd);
+	trace_fd = -1;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+
+static void write_node_path(FILE *fh, struct _profiledata *pd, int n)
+{
+	if ( pd->nodes[n].parent > 0 ) {
+		write_node_path(fh, pd, pd->nodes[n].parent);
+		fputc('/', fh);
+	}
+	fputs(pd->nodes[n].name, fh);
+}
+
+
+/**
+ * \param fh A file handle
+ *
+ * Writes the timings for all threads in the current process to \p fh, in a
+ * form which can be read by profile_summary_read().  This is for combining the
+ * timings from several processes.  Call it when no more blocks are being
+ * timed, for example after the other threads have finished.  The largest
+ * resident set size of the process so far is also written.
+ *
+ * \returns zero on success.
+ */
+int profile_write(FILE *fh)
+{
+	struct _profiledata *pd;
+	struct rusage ru;
+
+	fprintf(fh, "%s\n", PROFILE_FILE_HEADER);
+	if ( getrusage(RUSAGE_SELF, &ru) == 0 ) {
+		fprintf(fh, "maxrss %li\n", (long)ru.ru_maxrss);
+	}
+
+	pthread_mutex_lock(&profile_list_lock);
+	for ( pd=profile_list; pd!=NULL; pd=pd->next ) {
+
+		int i;
+
+		fprintf(fh, "thread\n");
+		for ( i=1; i<pd->n_nodes; i++ ) {
+
+			struct _profile_node *n = &pd->nodes[i];
+			int j;
+
+			if ( n->count == 0 ) continue;
+
+			fprintf(fh, "%li %.9f", n->count, n->total_time);
+			for ( j=0; j<PROFILE_N_COUNTERS; j++ ) {
+				fprintf(fh, " %llu",
+				        (unsigned long long)n->counters[j]);
+			}
+			fprintf(fh, " %llu %llu %lli",
+			        (unsigned long long)n->n_allocs,
+			        (unsigned long long)n->alloc_bytes,
+			        (long long)n->peak_alloc);
+			for ( j=0; j<PROFILE_N_BINS; j++ ) {
+				if ( n->hist[j] == 0 ) continue;
+				fprintf(fh, " %i:%llu", j,
+				        (unsigned long long)n->hist[j]);
+			}
+			fprintf(fh, " ");
+			write_node_path(fh, pd, i);
+			fprintf(fh, "\n");
+
+		}
 
-	pd->current = pd->current->parent;
+	}
+	pthread_mutex_unlock(&profile_list_lock);
+
+	if ( ferror(fh) ) return 1;
+	return 0;
+}
+
+
+/**
+ * Creates a new, empty \ref ProfileSummary, for combining the timings from
+ * several processes.
+ *
+ * \returns the new \ref ProfileSummary, or NULL on error.
+ */
+ProfileSummary *profile_summary_new()
+{
+	ProfileSummary *ps = cfmalloc(sizeof(ProfileSummary));
+	if ( ps == NULL ) return NULL;
+	ps->entries = NULL;
+	ps->n_entries = 0;
+	ps->max_entries = 0;
+	ps->n_threads = 0;
+	ps->max_rss = 0;
+	return ps;
+}
+
+
+/**
+ * \param ps A \ref ProfileSummary
+ *
+ * Frees \p ps.
+ */
+void profile_summary_free(ProfileSummary *ps)
+{
+	int i;
+	if ( ps == NULL ) return;
+	for ( i=0; i<ps->n_entries; i++ ) {
+		cffree(ps->entries[i].path);
+	}
+	cffree(ps->entries);
+	cffree(ps);
+}
+
+
+static struct _profileentry *find_entry(ProfileSummary *ps, const char *path)
+{
+	int i;
+	struct _profileentry *e;
+
+	for ( i=0; i<ps->n_entries; i++ ) {
+		if ( strcmp(ps->entries[i].path, path) == 0 ) {
+			return &ps->entries[i];
+		}
+	}
+
+	if ( ps->n_entries == ps->max_entries ) {
+		struct _profileentry *ne;
+		int nmax = ps->max_entries + 64;
+		ne = cfrealloc(ps->entries, nmax*sizeof(struct _profileentry));
+		if ( ne == NULL ) return NULL;
+		ps->entries = ne;
+		ps->max_entries = nmax;
+	}
+
+	e = &ps->entries[ps->n_entries];
+	e->path = cfstrdup(path);
+	if ( e->path == NULL ) return NULL;
+	e->count = 0;
+	e->total_time = 0.0;
+	memset(e->hist, 0, sizeof(e->hist));
+	memset(e->counters, 0, sizeof(e->counters));
+	e->n_allocs = 0;
+	e->alloc_bytes = 0;
+	e->peak_alloc = 0;
+	ps->n_entries++;
+	return e;
+}
+
+
+/**
+ * \param ps A \ref ProfileSummary
+ * \param fh A file handle
+ *
+ * Reads timings written by profile_write() from \p fh, and adds them to \p ps.
+ * Files written by older versions, without hardware counters or allocation
+ * statistics, can also be read.
+ *
+ * \returns zero on success.
+ */
+int profile_summary_read(ProfileSummary *ps, FILE *fh)
+{
+	char line[4096];
+	int has_counters;
+	int has_allocs;
+
+	if ( fgets(line, sizeof(line), fh) == NULL ) return 1;
+	chomp(line);
+	if ( strcmp(line, PROFILE_FILE_HEADER) == 0 ) {
+		has_counters = 1;
+		has_allocs = 1;
+	} else if ( strcmp(line, PROFILE_FILE_HEADER_V2) == 0 ) {
+		has_counters = 1;
+		has_allocs = 0;
+	} else if ( strcmp(line, PROFILE_FILE_HEADER_V1) == 0 ) {
+		has_counters = 0;
+		has_allocs = 0;
+	} else {
+		return 1;
+	}
+
+	while ( fgets(line, sizeof(line), fh) != NULL ) {
+
+		struct _profileentry *e;
+		uint64_t hist[PROFILE_N_BINS];
+		unsigned long long counters[PROFILE_N_COUNTERS];
+		unsigned long long n_allocs = 0;
+		unsigned long long alloc_bytes = 0;
+		long long peak_alloc = 0;
+		long rss;
+		long count;
+		double total;
+		char *pos;
+		int n;
+		int i;
+
+		chomp(line);
+		if ( strcmp(line, "thread") == 0 ) {
+			ps->n_threads++;
+			continue;
+		}
+		if ( sscanf(line, "maxrss %li", &rss) == 1 ) {
+			if ( rss > ps->max_rss ) ps->max_rss = rss;
+			continue;
+		}
+
+		if ( sscanf(line, "%li %lf%n", &count, &total, &n) != 2 ) {
+			return 1;
+		}
+		pos = line + n;
+
+		memset(counters, 0, sizeof(counters));
+		if ( has_counters ) {
+			for ( i=0; i<PROFILE_N_COUNTERS; i++ ) {
+				if ( sscanf(pos, " %llu%n", &counters[i], &n) != 1 ) {
+					return 1;
+				}
+				pos += n;
+			}
+		}
+
+		if ( has_allocs ) {
+			if ( sscanf(pos, " %llu %llu %lli%n", &n_allocs,
+			            &alloc_bytes, &peak_alloc, &n) != 3 )
+			{
+				return 1;
+			}
+			pos += n;
+		}
+
+		memset(hist, 0, sizeof(hist));
+		for ( ;; ) {
+			int bin;
+			unsigned long long v;
+			if ( sscanf(pos, " %i:%llu%n", &bin, &v, &n) != 2 ) break;
+			if ( (bin < 0) || (bin >= PROFILE_N_BINS) ) return 1;
+			hist[bin] += v;
+			pos += n;
+		}
+		if ( *pos != ' ' ) return 1;
+
+		e = find_entry(ps, pos+1);
+		if ( e == NULL ) return 1;
+		e->count += count;
+		e->total_time += total;
+		for ( i=0; i<PROFILE_N_BINS; i++ ) e->hist[i] += hist[i];
+		for ( i=0; i<PROFILE_N_COUNTERS; i++ ) {
+			e->counters[i] += counters[i];
+		}
+		e->n_allocs += n_allocs;
+		e->alloc_bytes += alloc_bytes;
+		if ( peak_alloc > e->peak_alloc ) e->peak_alloc = peak_alloc;
+
+	}
+
+	return 0;
+}
+
+
+/* Sorts the blocks so that each one comes straight after its parent */
+static int cmp_path(const void *va, const void *vb)
+{
+	const struct _profileentry *a = va;
+	const struct _profileentry *b = vb;
+	const char *pa = a->path;
+	const char *pb = b->path;
+
+	while ( (*pa != '\0') && (*pa == *pb) ) {
+		pa++;
+		pb++;
+	}
+	if ( *pa == *pb ) return 0;
+	if ( *pa == '\0' ) return -1;
+	if ( *pb == '\0' ) return +1;
+	if ( *pa == '/' ) return -1;
+	if ( *pb == '/' ) return +1;
+	return (unsigned char)*pa - (unsigned char)*pb;
+}
+
+
+static double hist_percentile(const uint64_t *hist, long count, double frac)
+{
+	uint64_t target = ceil(frac*count);
+	uint64_t total = 0;
+	int i;
+
+	if ( target < 1 ) target = 1;
+	for ( i=0; i<PROFILE_N_BINS; i++ ) {
+		total += hist[i];
+		if ( total >= target ) return bin_centre(i);
+	}
+	return bin_centre(PROFILE_N_BINS-1);
+}
+
+
+/**
+ * \param ps A \ref ProfileSummary
+ * \param fh A file handle
+ *
+ * Writes a table of the combined timings in \p ps to \p fh.  For each block,
+ * the table shows the number of times it ran, the total and mean time, and the
+ * median and 99th percentile times.  The percentiles are only accurate to
+ * about 10%.
+ *
+ * If there are any hardware counts, the table also shows the total number of
+ * CPU cycles, the number of instructions per cycle, and the number of last
+ * level cache misses and branch mispredictions per thousand instructions.
+ *
+ * If there are any allocation statistics, the table also shows the number of
+ * allocations and the number of kilobytes allocated per run of each block
+ * (not including the blocks inside it), and the most memory allocated by any
+ * one process while the block was running.  The largest resident set size of
+ * any of the processes is shown at the end.
+ */
+void profile_summary_print(ProfileSummary *ps, FILE *fh)
+{
+	int i;
+	int show_counters = 0;
+	int show_allocs = 0;
+
+	qsort(ps->entries, ps->n_entries, sizeof(struct _profileentry),
+	      cmp_path);
+
+	for ( i=0; i<ps->n_entries; i++ ) {
+		if ( ps->entries[i].counters[1] > 0 ) show_counters = 1;
+		if ( ps->entries[i].n_allocs > 0 ) show_allocs = 1;
+	}
+
+	fprintf(fh, "Timing summary from %i threads:\n", ps->n_threads);
+	fprintf(fh, "%-40s %10s %11s %10s %10s %10s", "Block", "Count",
+	        "Total/s", "Mean/ms", "p50/ms", "p99/ms");
+	if ( show_counters ) {
+		fprintf(fh, " %10s %6s %10s %10s", "Mcycles", "IPC",
+		        "LLCmiss/ki", "BRmiss/ki");
+	}
+	if ( show_allocs ) {
+		fprintf(fh, " %11s %10s %10s", "Allocs/run", "kB/run",
+		        "PeakMB");
+	}
+	fprintf(fh, "\n");
+
+	for ( i=0; i<ps->n_entries; i++ ) {
+
+		struct _profileentry *e = &ps->entries[i];
+		char label[41];
+		const char *name;
+		const char *pos;
+		int depth = 0;
+
+		name = e->path;
+		for ( pos=e->path; *pos!='\0'; pos++ ) {
+			if ( *pos == '/' ) {
+				depth++;
+				name = pos+1;
+			}
+		}
+		if ( depth > 10 ) depth = 10;
+		snprintf(label, 41, "%*s%s", 2*depth, "", name);
+
+		fprintf(fh, "%-40s %10li %11.3f %10.3f %10.3f %10.3f",
+		        label, e->count, e->total_time,
+		        1e3*e->total_time/e->count,
+		        1e3*hist_percentile(e->hist, e->count, 0.5),
+		        1e3*hist_percentile(e->hist, e->count, 0.99));
+
+		if ( show_counters && (e->counters[0] > 0)
+		  && (e->counters[1] > 0) )
+		{
+			double kinstr = e->counters[1]/1e3;
+			fprintf(fh, " %10.1f %6.2f %10.3f %10.3f",
+			        e->counters[0]/1e6,
+			        (double)e->counters[1]/e->counters[0],
+			        e->counters[2]/kinstr,
+			        e->counters[3]/kinstr);
+		} else if ( show_counters && show_allocs ) {
+			fprintf(fh, " %10s %6s %10s %10s", "-", "-", "-", "-");
+		}
+		if ( show_allocs ) {
+			fprintf(fh, " %11.1f %10.1f",
+			        (double)e->n_allocs/e->count,
+			        e->alloc_bytes/1024.0/e->count);
+			if ( e->peak_alloc > 0 ) {
+				fprintf(fh, " %10.1f", e->peak_alloc/1048576.0);
+			} else {
+				fprintf(fh, " %10s", "-");
+			}
+		}
+		fprintf(fh, "\n");
+
+	}
+
+	if ( ps->max_rss > 0 ) {
+		fprintf(fh, "Largest peak resident set size of any process: "
+		        "%.1f MB\n", ps->max_rss/1024.0);
+	}
 }
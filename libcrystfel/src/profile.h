@@ -34,9 +34,31 @@
  * Simple wall-clock profiling
  */
 
+#include <stdio.h>
+
+/**
+ * A ProfileSummary combines the timings from several processes.
+ *
+ * This data structure is opaque.
+ */
+typedef struct _profilesummary ProfileSummary;
+
 extern void profile_init();
+extern int profile_enable_counters(void);
+extern int profile_enable_alloc_stats(void);
 extern void profile_print_and_reset(int worker_id);
 extern void profile_start(const char *name);
 extern void profile_end(const char *name);
+extern int profile_write(FILE *fh);
+
+extern int profile_trace_start(const char *filename, int pid,
+                               const char *label);
+extern void profile_trace_set_serial(int serial);
+extern void profile_trace_stop(void);
+
+extern ProfileSummary *profile_summary_new(void);
+extern int profile_summary_read(ProfileSummary *ps, FILE *fh);
+extern void profile_summary_print(ProfileSummary *ps, FILE *fh);
+extern void profile_summary_free(ProfileSummary *ps);
 
 #endif	/* PROFILE_H */
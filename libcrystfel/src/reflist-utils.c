@@ -601,7 +601,7 @@ RefList *asymmetric_indices(RefList *in, const SymOpList *sym)
 	RefListIterator *iter;
 	RefList *new;
 
-	new = reflist_new();
+	new = reflist_new_with_flags(reflist_get_flags(in));
 	if ( new == NULL ) return NULL;
 
 	for ( refl = first_refl(in, &iter);
@@ -780,6 +780,7 @@ void free_contribs(RefList *list)
 	{
 		struct reflection_contributions *c;
 		c = get_contributions(refl);
+		if ( c == NULL ) continue;
 		cffree(c->contribs);
 		cffree(c->contrib_crystals);
 		cffree(c);
@@ -32,9 +32,15 @@
 #include <assert.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
 
 #include "reflist.h"
 #include "utils.h"
+#include "frame-arena.h"
 
 /** \file reflist.h */
 
@@ -89,6 +95,39 @@ struct _refldata {
 };
 
 
+/* Compact version of the above, for lists created with REFLIST_LEAN.
+ * There is no phase or contribution list, and single precision is used for
+ * everything except the temporary values (which are often accumulators) */
+struct _refldata_lean {
+
+	signed short hs;
+	signed short ks;
+	signed short ls;
+
+	float khalf;
+	float kpred;
+	float exerr;
+	float p;
+	float L;
+
+	float fs;
+	float ss;
+	int panel_number;
+
+	float intensity;
+	float esd_i;
+
+	int redundancy;
+
+	float peak;
+	float mean_bg;
+
+	double temp1;
+	double temp2;
+	int flag;
+};
+
+
 enum _nodecol {
 	RED,
 	BLACK
@@ -104,29 +143,271 @@ struct _reflection {
 	struct _reflection *prev;     /*  list of duplicate reflections */
 	enum _nodecol col;            /* Colour (red or black) */
 	int in_list;                  /* If 0, reflection is not in a list */
+	int in_arena;                 /* If 1, memory belongs to an arena
+	                               * (the list's, or a FrameArena) */
+	int has_lock;                 /* If 1, node is in a _locked_reflection */
+	int is_lean;                  /* If 1, payload is "lean", not "full" */
+
+	/* Payload.  Lean nodes are allocated without room for the full version */
+	union {
+		struct _refldata full;
+		struct _refldata_lean lean;
+	} data;
+};
+
+#define GET_FIELD(r, field) ((r)->is_lean ? (r)->data.lean.field \
+                                          : (r)->data.full.field)
+
+#define SET_FIELD(r, field, val) do { \
+		if ( (r)->is_lean ) { \
+			(r)->data.lean.field = (val); \
+		} else { \
+			(r)->data.full.field = (val); \
+		} \
+	} while (0)
+
+
+/* A reflection which can be locked with lock_reflection().  The lock comes
+ * first, so that the Reflection itself is the same for all nodes */
+struct _locked_reflection {
 
-	/* Payload */
 	pthread_mutex_t lock;         /* Protects the contents of "data" */
-	struct _refldata data;
+	struct _reflection refl;
 };
 
+#define LOCKED_REFL(r) ((struct _locked_reflection *)((char *)(r) \
+                         - offsetof(struct _locked_reflection, refl)))
+
+
+/* Arena slabs start small, so that per-crystal lists stay small, and double
+ * in size up to a limit as the list grows */
+#define ARENA_SLAB_MIN (64)
+#define ARENA_SLAB_MAX (65536)
+
+struct _reflslab {
+
+	struct _reflslab *next;
+	int n_nodes;
+	int n_used;
+	size_t node_size;
+	char *nodes;
+	int spilled;               /* If 1, nodes are in the working file */
+
+};
+
+
+/* Working file for lists created with REFLIST_SPILL.  The file is mapped in
+ * large regions, and slabs are handed out from the current region in order.
+ * Freed slabs are kept (with their size in the first few bytes) for re-use by
+ * later slabs of the same size. */
+#define SPILL_REGION_SIZE ((size_t)256*1024*1024)
+
+struct _spill_free {
+	struct _spill_free *next;
+	size_t size;
+};
+
+static struct {
+	int fd;
+	off_t len;
+	char *region;
+	size_t region_used;
+	struct _spill_free *free;
+	pthread_mutex_t lock;
+} spill = { -1, 0, NULL, 0, NULL, PTHREAD_MUTEX_INITIALIZER };
+
 
 struct _reflist {
 
 	struct _reflection *head;
 	char *notes;
 
+	int flags;                 /* See enum reflist_flags */
+	struct _reflslab *slabs;   /* Most recently allocated slab first */
+
+	/* Hash table for lookups in a frozen list, or NULL */
+	Reflection **frozen;
+	int frozen_bits;           /* Table has 2^frozen_bits slots */
+
+	/* Changes whenever a reflection is added, and is never the same for
+	 * two different lists */
+	unsigned long long version;
+
+	/* Result of reflist_match(), or NULL */
+	const Reflection **match;
+	unsigned long long match_version;        /* Version of this list ... */
+	unsigned long long match_other_version;  /* ... and the other list */
+
 };
 
 
+static atomic_ullong reflist_versions = 0;
+
+static unsigned long long new_version(void)
+{
+	return atomic_fetch_add(&reflist_versions, 1) + 1;
+}
+
+
 /**************************** Creation / deletion *****************************/
 
-static Reflection *new_node(unsigned int serial)
+static size_t node_size(int locks, int lean)
+{
+	size_t size;
+
+	size = offsetof(struct _reflection, data);
+	if ( lean ) {
+		size += sizeof(struct _refldata_lean);
+	} else {
+		size += sizeof(struct _refldata);
+	}
+
+	if ( locks ) size += offsetof(struct _locked_reflection, refl);
+
+	/* Keep nodes aligned when packed together in an arena */
+	return (size + sizeof(double)-1) & ~(sizeof(double)-1);
+}
+
+
+/* Returns zeroed memory for a slab from the working file, or NULL if the
+ * working file isn't set up or can't be extended */
+static char *spill_alloc(size_t size)
+{
+	struct _spill_free **pf;
+	char *mem = NULL;
+
+	/* Keep the free list entries aligned */
+	size = (size + sizeof(double)-1) & ~(sizeof(double)-1);
+	if ( size > SPILL_REGION_SIZE ) return NULL;
+
+	pthread_mutex_lock(&spill.lock);
+
+	if ( spill.fd < 0 ) {
+		pthread_mutex_unlock(&spill.lock);
+		return NULL;
+	}
+
+	for ( pf=&spill.free; *pf!=NULL; pf=&(*pf)->next ) {
+		if ( (*pf)->size == size ) {
+			mem = (char *)*pf;
+			*pf = (*pf)->next;
+			break;
+		}
+	}
+
+	if ( mem == NULL ) {
+
+		if ( (spill.region == NULL)
+		  || (spill.region_used + size > SPILL_REGION_SIZE) )
+		{
+			char *region;
+			if ( ftruncate(spill.fd, spill.len+SPILL_REGION_SIZE) ) {
+				pthread_mutex_unlock(&spill.lock);
+				return NULL;
+			}
+			region = mmap(NULL, SPILL_REGION_SIZE,
+			              PROT_READ | PROT_WRITE, MAP_SHARED,
+			              spill.fd, spill.len);
+			if ( region == MAP_FAILED ) {
+				pthread_mutex_unlock(&spill.lock);
+				return NULL;
+			}
+			spill.len += SPILL_REGION_SIZE;
+			spill.region = region;
+			spill.region_used = 0;
+		}
+
+		/* Fresh space in the file reads as zeroes */
+		mem = spill.region + spill.region_used;
+		spill.region_used += size;
+		pthread_mutex_unlock(&spill.lock);
+		return mem;
+
+	}
+
+	pthread_mutex_unlock(&spill.lock);
+	memset(mem, 0, size);
+	return mem;
+}
+
+
+static void spill_free(char *mem, size_t size)
+{
+	struct _spill_free *f = (struct _spill_free *)mem;
+
+	f->size = (size + sizeof(double)-1) & ~(sizeof(double)-1);
+	pthread_mutex_lock(&spill.lock);
+	f->next = spill.free;
+	spill.free = f;
+	pthread_mutex_unlock(&spill.lock);
+}
+
+
+/**
+ * \param dir: Directory in which to create the working file
+ *
+ * Sets up a working file in \p dir for the reflections in lists created with
+ * \ref REFLIST_SPILL.  The file is memory-mapped, so the reflections can be
+ * used in exactly the same way as usual, but the operating system can move
+ * them out of memory when they are not being used.  This allows many more
+ * reflections to be handled than would fit in memory.  The file is deleted
+ * straight away, so it does not need to be cleaned up afterwards, but the disk
+ * space will only be released when the program exits.
+ *
+ * This only needs to be called once.  Lists created with \ref REFLIST_SPILL
+ * before this function is called, or after it fails, will be stored in memory
+ * as usual.
+ *
+ * \returns zero on success, non-zero on error.
+ */
+int reflist_set_spill_dir(const char *dir)
+{
+	char *tmpl;
+	int fd;
+
+	tmpl = cfmalloc(strlen(dir)+32);
+	if ( tmpl == NULL ) return 1;
+	sprintf(tmpl, "%s/crystfel-reflist-XXXXXX", dir);
+
+	fd = mkstemp(tmpl);
+	if ( fd == -1 ) {
+		ERROR("Failed to create reflection working file in %s\n", dir);
+		cffree(tmpl);
+		return 1;
+	}
+	unlink(tmpl);
+	cffree(tmpl);
+
+	pthread_mutex_lock(&spill.lock);
+	if ( spill.fd >= 0 ) {
+		pthread_mutex_unlock(&spill.lock);
+		close(fd);
+		ERROR("Reflection working file has already been set up\n");
+		return 1;
+	}
+	spill.fd = fd;
+	pthread_mutex_unlock(&spill.lock);
+
+	return 0;
+}
+
+
+/* Returns the Reflection within a newly allocated (and zeroed) node */
+static Reflection *init_node(void *mem, unsigned int serial, int locks,
+                             int lean)
 {
 	Reflection *new;
 
-	new = cfcalloc(1, sizeof(struct _reflection));
-	if ( new == NULL ) return NULL;
+	if ( locks ) {
+		struct _locked_reflection *lr = mem;
+		pthread_mutex_init(&lr->lock, NULL);
+		new = &lr->refl;
+	} else {
+		new = mem;
+	}
+
+	new->has_lock = locks;
+	new->is_lean = lean;
 	new->in_list = 0;
 	new->serial = serial;
 	new->next = NULL;
@@ -134,18 +415,120 @@ static Reflection *new_node(unsigned int serial)
 	new->child[0] = NULL;
 	new->child[1] = NULL;
 	new->col = RED;
-	pthread_mutex_init(&new->lock, NULL);
+
+	return new;
+}
+
+
+static Reflection *new_node(unsigned int serial, int locks, int lean)
+{
+	Reflection *new;
+	FrameArena *fa;
+	void *mem;
+
+	fa = frame_arena_get_current();
+	if ( fa != NULL ) {
+		mem = frame_arena_alloc(fa, node_size(locks, lean));
+	} else {
+		mem = cfcalloc(1, node_size(locks, lean));
+	}
+	if ( mem == NULL ) return NULL;
+	new = init_node(mem, serial, locks, lean);
+	new->in_arena = (fa != NULL);
+
+	return new;
+}
+
+
+static Reflection *new_arena_node(RefList *list, unsigned int serial,
+                                  int locks, int lean)
+{
+	Reflection *new;
+	struct _reflslab *slab = list->slabs;
+	void *mem;
+
+	/* All nodes in a list have the same size, because the flags cannot be
+	 * changed after the list is created */
+	if ( (slab == NULL) || (slab->n_used == slab->n_nodes) ) {
+
+		struct _reflslab *nslab;
+		int n_nodes;
+
+		if ( slab == NULL ) {
+			n_nodes = ARENA_SLAB_MIN;
+		} else {
+			n_nodes = smallest(2*slab->n_nodes, ARENA_SLAB_MAX);
+		}
+
+		nslab = cfmalloc(sizeof(struct _reflslab));
+		if ( nslab == NULL ) return NULL;
+		nslab->node_size = node_size(locks, lean);
+		nslab->nodes = NULL;
+		nslab->spilled = 0;
+		if ( list->flags & REFLIST_SPILL ) {
+			nslab->nodes = spill_alloc(n_nodes*nslab->node_size);
+			nslab->spilled = (nslab->nodes != NULL);
+		}
+		if ( nslab->nodes == NULL ) {
+			nslab->nodes = cfcalloc(n_nodes, nslab->node_size);
+		}
+		if ( nslab->nodes == NULL ) {
+			cffree(nslab);
+			return NULL;
+		}
+		nslab->n_nodes = n_nodes;
+		nslab->n_used = 0;
+		nslab->next = slab;
+		list->slabs = nslab;
+		slab = nslab;
+
+	}
+
+	mem = slab->nodes + slab->node_size*slab->n_used++;
+	new = init_node(mem, serial, locks, lean);
+	new->in_arena = 1;
 
 	return new;
 }
 
 
 /**
- * Creates a new reflection list.
+ * \param flags: Zero, or a combination of values from \ref reflist_flags
+ *
+ * Creates a new reflection list, with non-default options.
+ *
+ * If \p flags includes \ref REFLIST_ARENA, the reflections will be allocated
+ * in large blocks ("slabs") instead of individually.  Adding reflections to
+ * the list is then faster, and reflist_free() can release the memory in bulk.
+ * The reflections created by add_refl() belong to the list, and their memory
+ * can only be released by reflist_free().  Reflections created separately with
+ * reflection_new() can still be added using add_refl_to_list(), and will be
+ * freed individually as usual.
+ *
+ * If \p flags includes \ref REFLIST_NO_LOCKS, the reflections created by
+ * add_refl() will not contain a lock, which makes them considerably smaller.
+ * The list must then not be used with lock_reflection() and
+ * unlock_reflection().
+ *
+ * If \p flags includes \ref REFLIST_LEAN, the reflections created by
+ * add_refl() will store their values in single precision (except for the
+ * temporary values), and will not store phases or contribution lists.
+ * get_phase() will report that there is no phase, set_phase() will have no
+ * effect, and set_contributions() must not be used.  The symmetric indices must
+ * be less than 32768 in magnitude.  This reduces the size of each reflection
+ * by more than half, which adds up for lists of reflections from individual
+ * crystals.
+ *
+ * If \p flags includes \ref REFLIST_SPILL, the reflections created by
+ * add_refl() will be stored in the working file set up with
+ * reflist_set_spill_dir().  This implies \ref REFLIST_ARENA.
+ *
+ * In all other respects, the list can be used in exactly the same way as
+ * one created with reflist_new().
  *
  * \returns the new reflection list, or NULL on error.
  */
-RefList *reflist_new()
+RefList *reflist_new_with_flags(int flags)
 {
 	RefList *new;
 
@@ -154,11 +537,55 @@ RefList *reflist_new()
 
 	new->head = NULL;
 	new->notes = NULL;
+	if ( flags & REFLIST_SPILL ) flags |= REFLIST_ARENA;
+	new->flags = flags;
+	new->slabs = NULL;
+	new->frozen = NULL;
+	new->frozen_bits = 0;
+	new->version = new_version();
+	new->match = NULL;
 
 	return new;
 }
 
 
+/**
+ * Creates a new reflection list.
+ *
+ * \returns the new reflection list, or NULL on error.
+ */
+RefList *reflist_new()
+{
+	return reflist_new_with_flags(0);
+}
+
+
+/**
+ * Creates a new reflection list, for which the reflections will be allocated
+ * in large blocks.  This is the same as calling reflist_new_with_flags() with
+ * \ref REFLIST_ARENA.
+ *
+ * \returns the new reflection list, or NULL on error.
+ */
+RefList *reflist_new_arena()
+{
+	return reflist_new_with_flags(REFLIST_ARENA);
+}
+
+
+/**
+ * \param list: A %RefList
+ *
+ * \returns the flags which were given to reflist_new_with_flags() when
+ * \p list was created.  This can be used to create another list of the same
+ * type.
+ */
+int reflist_get_flags(const RefList *list)
+{
+	return list->flags;
+}
+
+
 /**
  * \param h The h index of the new reflection
  * \param k The k index of the new reflection
@@ -172,7 +599,7 @@ Reflection *reflection_new(signed int h, signed int k, signed int l)
 	assert(abs(h)<512);
 	assert(abs(k)<512);
 	assert(abs(l)<512);
-	return new_node(SERIAL(h, k, l));
+	return new_node(SERIAL(h, k, l), 1, 0);
 }
 
 
@@ -183,8 +610,17 @@ Reflection *reflection_new(signed int h, signed int k, signed int l)
  */
 void reflection_free(Reflection *refl)
 {
-	pthread_mutex_destroy(&refl->lock);
-	cffree(refl);
+	void *mem = refl;
+
+	if ( refl->has_lock ) {
+		struct _locked_reflection *lr = LOCKED_REFL(refl);
+		pthread_mutex_destroy(&lr->lock);
+		mem = lr;
+	}
+
+	/* Memory from an arena will be freed along with the list, or when
+	 * the frame arena is reset */
+	if ( !refl->in_arena ) cffree(mem);
 }
 
 
@@ -201,6 +637,21 @@ static void recursive_free(Reflection *refl)
 }
 
 
+static void free_slabs(struct _reflslab *slab)
+{
+	while ( slab != NULL ) {
+		struct _reflslab *next = slab->next;
+		if ( slab->spilled ) {
+			spill_free(slab->nodes, slab->n_nodes*slab->node_size);
+		} else {
+			cffree(slab->nodes);
+		}
+		cffree(slab);
+		slab = next;
+	}
+}
+
+
 /**
  * \param list: The reflection list to free.
  *
@@ -212,6 +663,9 @@ void reflist_free(RefList *list)
 	if ( list->head != NULL ) {
 		recursive_free(list->head);
 	} /* else empty list */
+	free_slabs(list->slabs);
+	cffree(list->frozen);
+	cffree(list->match);
 	if ( list->notes != NULL ) cffree(list->notes);
 	cffree(list);
 }
@@ -219,6 +673,27 @@ void reflist_free(RefList *list)
 
 /********************************** Search ************************************/
 
+static unsigned int frozen_slot(unsigned int serial, int bits)
+{
+	/* Fibonacci hashing: take the top bits of the product */
+	return (serial * 2654435769U) >> (32-bits);
+}
+
+
+static Reflection *find_refl_frozen(const RefList *list, unsigned int search)
+{
+	unsigned int mask = (1U << list->frozen_bits) - 1;
+	unsigned int i = frozen_slot(search, list->frozen_bits);
+
+	while ( list->frozen[i] != NULL ) {
+		if ( list->frozen[i]->serial == search ) return list->frozen[i];
+		i = (i+1) & mask;
+	}
+
+	return NULL;
+}
+
+
 /**
  * \param list: The reflection list to search in
  * \param h: The 'h' index to search for
@@ -249,6 +724,8 @@ Reflection *find_refl(const RefList *list,
 	if ( abs(k) >= 512 ) return NULL;
 	if ( abs(l) >= 512 ) return NULL;
 
+	if ( list->frozen != NULL ) return find_refl_frozen(list, search);
+
 	refl = list->head;
 
 	while ( refl != NULL ) {
@@ -307,8 +784,8 @@ Reflection *next_found_refl(Reflection *refl)
  **/
 void get_detector_pos(const Reflection *refl, double *fs, double *ss)
 {
-	*fs = refl->data.fs;
-	*ss = refl->data.ss;
+	*fs = GET_FIELD(refl, fs);
+	*ss = GET_FIELD(refl, ss);
 }
 
 
@@ -321,7 +798,7 @@ void get_detector_pos(const Reflection *refl, double *fs, double *ss)
  **/
 int get_panel_number(const Reflection *refl)
 {
-	return refl->data.panel_number;
+	return GET_FIELD(refl, panel_number);
 }
 
 
@@ -357,9 +834,9 @@ void get_symmetric_indices(const Reflection *refl,
                                   signed int *hs, signed int *ks,
                                   signed int *ls)
 {
-	*hs = refl->data.hs;
-	*ks = refl->data.ks;
-	*ls = refl->data.ls;
+	*hs = GET_FIELD(refl, hs);
+	*ks = GET_FIELD(refl, ks);
+	*ls = GET_FIELD(refl, ls);
 }
 
 
@@ -370,7 +847,7 @@ void get_symmetric_indices(const Reflection *refl,
  **/
 double get_partiality(const Reflection *refl)
 {
-	return refl->data.p;
+	return GET_FIELD(refl, p);
 }
 
 
@@ -382,7 +859,7 @@ double get_partiality(const Reflection *refl)
  **/
 double get_lorentz(const Reflection *refl)
 {
-	return refl->data.L;
+	return GET_FIELD(refl, L);
 }
 
 
@@ -393,7 +870,7 @@ double get_lorentz(const Reflection *refl)
  **/
 double get_intensity(const Reflection *refl)
 {
-	return refl->data.intensity;
+	return GET_FIELD(refl, intensity);
 }
 
 
@@ -406,7 +883,7 @@ double get_intensity(const Reflection *refl)
  **/
 double get_khalf(const Reflection *refl)
 {
-	return refl->data.khalf;
+	return GET_FIELD(refl, khalf);
 }
 
 
@@ -420,7 +897,7 @@ double get_khalf(const Reflection *refl)
  **/
 double get_kpred(const Reflection *refl)
 {
-	return refl->data.kpred;
+	return GET_FIELD(refl, kpred);
 }
 
 
@@ -432,7 +909,7 @@ double get_kpred(const Reflection *refl)
  **/
 double get_exerr(const Reflection *refl)
 {
-	return refl->data.exerr;
+	return GET_FIELD(refl, exerr);
 }
 
 
@@ -451,7 +928,7 @@ double get_exerr(const Reflection *refl)
  **/
 int get_redundancy(const Reflection *refl)
 {
-	return refl->data.redundancy;
+	return GET_FIELD(refl, redundancy);
 }
 
 
@@ -464,7 +941,7 @@ int get_redundancy(const Reflection *refl)
  **/
 double get_esd_intensity(const Reflection *refl)
 {
-	return refl->data.esd_i;
+	return GET_FIELD(refl, esd_i);
 }
 
 
@@ -477,8 +954,12 @@ double get_esd_intensity(const Reflection *refl)
  **/
 double get_phase(const Reflection *refl, int *have_phase)
 {
-	if ( have_phase != NULL ) *have_phase = refl->data.have_phase;
-	return refl->data.phase;
+	if ( refl->is_lean ) {
+		if ( have_phase != NULL ) *have_phase = 0;
+		return 0.0;
+	}
+	if ( have_phase != NULL ) *have_phase = refl->data.full.have_phase;
+	return refl->data.full.phase;
 }
 
 
@@ -491,7 +972,7 @@ double get_phase(const Reflection *refl, int *have_phase)
  **/
 double get_peak(const Reflection *refl)
 {
-	return refl->data.peak;
+	return GET_FIELD(refl, peak);
 }
 
 
@@ -503,7 +984,7 @@ double get_peak(const Reflection *refl)
  **/
 double get_mean_bg(const Reflection *refl)
 {
-	return refl->data.mean_bg;
+	return GET_FIELD(refl, mean_bg);
 }
 
 
@@ -518,7 +999,7 @@ double get_mean_bg(const Reflection *refl)
  **/
 double get_temp1(const Reflection *refl)
 {
-	return refl->data.temp1;
+	return GET_FIELD(refl, temp1);
 }
 
 
@@ -533,7 +1014,7 @@ double get_temp1(const Reflection *refl)
  **/
 double get_temp2(const Reflection *refl)
 {
-	return refl->data.temp2;
+	return GET_FIELD(refl, temp2);
 }
 
 
@@ -548,7 +1029,7 @@ double get_temp2(const Reflection *refl)
  **/
 int get_flag(const Reflection *refl)
 {
-	return refl->data.flag;
+	return GET_FIELD(refl, flag);
 }
 
 
@@ -560,7 +1041,8 @@ int get_flag(const Reflection *refl)
  **/
 struct reflection_contributions *get_contributions(const Reflection *refl)
 {
-	return refl->data.contribs;
+	if ( refl->is_lean ) return NULL;
+	return refl->data.full.contribs;
 }
 
 /********************************** Setters ***********************************/
@@ -578,7 +1060,38 @@ struct reflection_contributions *get_contributions(const Reflection *refl)
  **/
 void copy_data(Reflection *to, const Reflection *from)
 {
-	memcpy(&to->data, &from->data, sizeof(struct _refldata));
+	if ( to->is_lean && from->is_lean ) {
+		memcpy(&to->data.lean, &from->data.lean,
+		       sizeof(struct _refldata_lean));
+	} else if ( !to->is_lean && !from->is_lean ) {
+		memcpy(&to->data.full, &from->data.full,
+		       sizeof(struct _refldata));
+	} else {
+		double phase;
+		int have_phase;
+		set_symmetric_indices(to, GET_FIELD(from, hs), GET_FIELD(from, ks),
+		                      GET_FIELD(from, ls));
+		set_khalf(to, GET_FIELD(from, khalf));
+		set_kpred(to, GET_FIELD(from, kpred));
+		set_exerr(to, GET_FIELD(from, exerr));
+		set_partiality(to, GET_FIELD(from, p));
+		set_lorentz(to, GET_FIELD(from, L));
+		set_detector_pos(to, GET_FIELD(from, fs), GET_FIELD(from, ss));
+		set_panel_number(to, GET_FIELD(from, panel_number));
+		set_intensity(to, GET_FIELD(from, intensity));
+		set_esd_intensity(to, GET_FIELD(from, esd_i));
+		set_redundancy(to, GET_FIELD(from, redundancy));
+		set_peak(to, GET_FIELD(from, peak));
+		set_mean_bg(to, GET_FIELD(from, mean_bg));
+		set_temp1(to, GET_FIELD(from, temp1));
+		set_temp2(to, GET_FIELD(from, temp2));
+		set_flag(to, GET_FIELD(from, flag));
+		phase = get_phase(from, &have_phase);
+		if ( have_phase ) set_phase(to, phase);
+		if ( !to->is_lean ) {
+			to->data.full.contribs = get_contributions(from);
+		}
+	}
 }
 
 
@@ -590,8 +1103,8 @@ void copy_data(Reflection *to, const Reflection *from)
  **/
 void set_detector_pos(Reflection *refl, double fs, double ss)
 {
-	refl->data.fs = fs;
-	refl->data.ss = ss;
+	SET_FIELD(refl, fs, fs);
+	SET_FIELD(refl, ss, ss);
 }
 
 
@@ -603,7 +1116,7 @@ void set_detector_pos(Reflection *refl, double fs, double ss)
  **/
 void set_panel_number(Reflection *refl, int pn)
 {
-	refl->data.panel_number = pn;
+	SET_FIELD(refl, panel_number, pn);
 }
 
 
@@ -615,7 +1128,7 @@ void set_panel_number(Reflection *refl, int pn)
  **/
 void set_khalf(Reflection *refl, double khalf)
 {
-	refl->data.khalf = khalf;
+	SET_FIELD(refl, khalf, khalf);
 }
 
 
@@ -628,7 +1141,7 @@ void set_khalf(Reflection *refl, double khalf)
  **/
 void set_kpred(Reflection *refl, double kpred)
 {
-	refl->data.kpred = kpred;
+	SET_FIELD(refl, kpred, kpred);
 }
 
 
@@ -639,7 +1152,7 @@ void set_kpred(Reflection *refl, double kpred)
  **/
 void set_exerr(Reflection *refl, double exerr)
 {
-	refl->data.exerr = exerr;
+	SET_FIELD(refl, exerr, exerr);
 }
 
 
@@ -651,7 +1164,7 @@ void set_exerr(Reflection *refl, double exerr)
  **/
 void set_partiality(Reflection *refl, double p)
 {
-	refl->data.p = p;
+	SET_FIELD(refl, p, p);
 }
 
 /**
@@ -663,7 +1176,7 @@ void set_partiality(Reflection *refl, double p)
  **/
 void set_lorentz(Reflection *refl, double L)
 {
-	refl->data.L = L;
+	SET_FIELD(refl, L, L);
 }
 
 
@@ -675,7 +1188,7 @@ void set_lorentz(Reflection *refl, double L)
  **/
 void set_intensity(Reflection *refl, double intensity)
 {
-	refl->data.intensity = intensity;
+	SET_FIELD(refl, intensity, intensity);
 }
 
 
@@ -693,7 +1206,7 @@ void set_intensity(Reflection *refl, double intensity)
  **/
 void set_redundancy(Reflection *refl, int red)
 {
-	refl->data.redundancy = red;
+	SET_FIELD(refl, redundancy, red);
 }
 
 
@@ -704,7 +1217,7 @@ void set_redundancy(Reflection *refl, int red)
  **/
 void set_esd_intensity(Reflection *refl, double esd)
 {
-	refl->data.esd_i = esd;
+	SET_FIELD(refl, esd_i, esd);
 }
 
 
@@ -715,8 +1228,9 @@ void set_esd_intensity(Reflection *refl, double esd)
  **/
 void set_phase(Reflection *refl, double phase)
 {
-	refl->data.phase = phase;
-	refl->data.have_phase = 1;
+	if ( refl->is_lean ) return;
+	refl->data.full.phase = phase;
+	refl->data.full.have_phase = 1;
 }
 
 
@@ -727,7 +1241,7 @@ void set_phase(Reflection *refl, double phase)
  **/
 void set_peak(Reflection *refl, double peak)
 {
-	refl->data.peak = peak;
+	SET_FIELD(refl, peak, peak);
 }
 
 
@@ -738,7 +1252,7 @@ void set_peak(Reflection *refl, double peak)
  **/
 void set_mean_bg(Reflection *refl, double mean_bg)
 {
-	refl->data.mean_bg = mean_bg;
+	SET_FIELD(refl, mean_bg, mean_bg);
 }
 
 
@@ -757,9 +1271,9 @@ void set_mean_bg(Reflection *refl, double mean_bg)
 void set_symmetric_indices(Reflection *refl,
                            signed int hs, signed int ks, signed int ls)
 {
-	refl->data.hs = hs;
-	refl->data.ks = ks;
-	refl->data.ls = ls;
+	SET_FIELD(refl, hs, hs);
+	SET_FIELD(refl, ks, ks);
+	SET_FIELD(refl, ls, ls);
 }
 
 
@@ -773,7 +1287,7 @@ void set_symmetric_indices(Reflection *refl,
  **/
 void set_temp1(Reflection *refl, double temp)
 {
-	refl->data.temp1 = temp;
+	SET_FIELD(refl, temp1, temp);
 }
 
 
@@ -787,7 +1301,7 @@ void set_temp1(Reflection *refl, double temp)
  **/
 void set_temp2(Reflection *refl, double temp)
 {
-	refl->data.temp2 = temp;
+	SET_FIELD(refl, temp2, temp);
 }
 
 
@@ -801,7 +1315,7 @@ void set_temp2(Reflection *refl, double temp)
  **/
 void set_flag(Reflection *refl, int flag)
 {
-	refl->data.flag = flag;
+	SET_FIELD(refl, flag, flag);
 }
 
 
@@ -815,7 +1329,8 @@ void set_flag(Reflection *refl, int flag)
 void set_contributions(Reflection *refl,
                        struct reflection_contributions *contribs)
 {
-	refl->data.contribs = contribs;
+	assert(!refl->is_lean);
+	refl->data.full.contribs = contribs;
 }
 
 
@@ -899,6 +1414,11 @@ static void add_refl_to_list_real(RefList *list,
 
 	assert(!new->in_list);
 
+	/* Adding a reflection un-freezes the list (for new indices, the hash
+	 * table would need to be rebuilt anyway) */
+	reflist_unfreeze(list);
+	list->version = new_version();
+
 	f = find_refl(list, h, k, l);
 	if ( f == NULL ) {
 
@@ -935,12 +1455,19 @@ static void add_refl_to_list_real(RefList *list,
 Reflection *add_refl(RefList *list, signed int h, signed int k, signed int l)
 {
 	Reflection *new;
+	int locks, lean;
 
 	assert(abs(h)<512);
 	assert(abs(k)<512);
 	assert(abs(l)<512);
 
-	new = new_node(SERIAL(h, k, l));
+	locks = !(list->flags & REFLIST_NO_LOCKS);
+	lean = list->flags & REFLIST_LEAN;
+	if ( list->flags & REFLIST_ARENA ) {
+		new = new_arena_node(list, SERIAL(h, k, l), locks, lean);
+	} else {
+		new = new_node(SERIAL(h, k, l), locks, lean);
+	}
 	if ( new == NULL ) return NULL;
 
 	add_refl_to_list_real(list, new, h, k, l);
@@ -1203,6 +1730,383 @@ void free_reflistiterator(RefListIterator *iter)
 }
 
 
+/****************************** Columnar access *******************************/
+
+/**
+ * \param list: A %RefList
+ *
+ * Copies the most commonly used values of all reflections in \p list into a
+ * set of contiguous arrays, one array per quantity.  This allows loops over all
+ * reflections to be written as simple passes over arrays, which the compiler
+ * can vectorise, instead of calling the getters for each reflection.
+ *
+ * Changes to the arrays do not affect the list until reflist_put_columns() is
+ * called.  Reflections must not be added to the list while the snapshot is in
+ * use, otherwise reflist_put_columns() will not know about them.
+ *
+ * \returns a newly allocated \ref reflist_columns, or NULL on error.  Free it
+ * with reflist_free_columns().  For an empty list, the result is not NULL
+ * but has zero length.
+ */
+struct reflist_columns *reflist_get_columns(RefList *list)
+{
+	struct reflist_columns *cols;
+	Reflection *refl;
+	RefListIterator *iter;
+	int n, n_alloc, i;
+
+	cols = cfmalloc(sizeof(struct reflist_columns));
+	if ( cols == NULL ) return NULL;
+
+	n = num_reflections(list);
+	cols->n = n;
+
+	/* At least one element, so that an empty list doesn't look like an
+	 * allocation failure */
+	n_alloc = (n > 0) ? n : 1;
+
+	/* One block for each type, so that there are only a few allocations */
+	cols->refls = cfmalloc(n_alloc*sizeof(Reflection *));
+	cols->h = cfmalloc(3*n_alloc*sizeof(signed int));
+	cols->intensity = cfmalloc(8*n_alloc*sizeof(double));
+	cols->flag = cfmalloc(3*n_alloc*sizeof(int));
+	if ( (cols->refls == NULL) || (cols->h == NULL)
+	  || (cols->intensity == NULL) || (cols->flag == NULL) )
+	{
+		reflist_free_columns(cols);
+		return NULL;
+	}
+	cols->k = cols->h + n;
+	cols->l = cols->k + n;
+	cols->esd_i = cols->intensity + n;
+	cols->partiality = cols->esd_i + n;
+	cols->lorentz = cols->partiality + n;
+	cols->khalf = cols->lorentz + n;
+	cols->exerr = cols->khalf + n;
+	cols->fs = cols->exerr + n;
+	cols->ss = cols->fs + n;
+	cols->panel_number = cols->flag + n;
+	cols->redundancy = cols->panel_number + n;
+
+	i = 0;
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		assert(i < n);
+		cols->refls[i] = refl;
+		cols->h[i] = GET_H(refl->serial);
+		cols->k[i] = GET_K(refl->serial);
+		cols->l[i] = GET_L(refl->serial);
+		cols->intensity[i] = GET_FIELD(refl, intensity);
+		cols->esd_i[i] = GET_FIELD(refl, esd_i);
+		cols->partiality[i] = GET_FIELD(refl, p);
+		cols->lorentz[i] = GET_FIELD(refl, L);
+		cols->khalf[i] = GET_FIELD(refl, khalf);
+		cols->exerr[i] = GET_FIELD(refl, exerr);
+		cols->flag[i] = GET_FIELD(refl, flag);
+		cols->fs[i] = GET_FIELD(refl, fs);
+		cols->ss[i] = GET_FIELD(refl, ss);
+		cols->panel_number[i] = GET_FIELD(refl, panel_number);
+		cols->redundancy[i] = GET_FIELD(refl, redundancy);
+		i++;
+	}
+
+	return cols;
+}
+
+
+/**
+ * \param cols: A \ref reflist_columns from reflist_get_columns()
+ * \param fields: The fields to write back, from \ref reflist_column_fields
+ *
+ * Copies the values in \p cols back into the reflections they came from.
+ * Only the fields selected by \p fields will be written.  The indices cannot
+ * be changed.
+ */
+void reflist_put_columns(struct reflist_columns *cols, int fields)
+{
+	int i;
+
+	for ( i=0; i<cols->n; i++ ) {
+		Reflection *r = cols->refls[i];
+		if ( fields & RCOL_INTENSITY ) SET_FIELD(r, intensity, cols->intensity[i]);
+		if ( fields & RCOL_ESD_I ) SET_FIELD(r, esd_i, cols->esd_i[i]);
+		if ( fields & RCOL_PARTIALITY ) SET_FIELD(r, p, cols->partiality[i]);
+		if ( fields & RCOL_LORENTZ ) SET_FIELD(r, L, cols->lorentz[i]);
+		if ( fields & RCOL_KHALF ) SET_FIELD(r, khalf, cols->khalf[i]);
+		if ( fields & RCOL_EXERR ) SET_FIELD(r, exerr, cols->exerr[i]);
+		if ( fields & RCOL_FLAG ) SET_FIELD(r, flag, cols->flag[i]);
+		if ( fields & RCOL_DETECTOR_POS ) {
+			SET_FIELD(r, fs, cols->fs[i]);
+			SET_FIELD(r, ss, cols->ss[i]);
+			SET_FIELD(r, panel_number, cols->panel_number[i]);
+		}
+		if ( fields & RCOL_REDUNDANCY ) SET_FIELD(r, redundancy, cols->redundancy[i]);
+	}
+}
+
+
+/**
+ * \param cols: A \ref reflist_columns from reflist_get_columns()
+ *
+ * Frees \p cols.  The reflection list itself is not affected.
+ */
+void reflist_free_columns(struct reflist_columns *cols)
+{
+	if ( cols == NULL ) return;
+	cffree(cols->refls);
+	cffree(cols->h);
+	cffree(cols->intensity);
+	cffree(cols->flag);
+	cffree(cols);
+}
+
+
+/******************************** Partitioning ********************************/
+
+/**
+ * \param list: A %RefList
+ * \param n_parts: The number of ranges to divide the list into
+ *
+ * Divides \p list into \p n_parts disjoint ranges of roughly equal size.  The
+ * ranges can then be processed at the same time by different threads, with
+ * each thread looping over the reflections in its range:
+ *
+ * \code
+ * for ( i=part->start[n]; i<part->start[n+1]; i++ ) {
+ *         Reflection *refl = part->refls[i];
+ *         ...
+ * }
+ * \endcode
+ *
+ * All reflections with the same indices will be in the same range, so the
+ * ranges can be used for operations which look at all copies of a reflection
+ * together.  Some ranges may be empty if the list is small.  For an empty
+ * list, the result is not NULL but all ranges are empty.
+ *
+ * The partition remains valid until a reflection is added to the list.
+ *
+ * \returns a newly allocated \ref reflist_partition, or NULL on error.  Free
+ * it with reflist_free_partition().
+ */
+struct reflist_partition *reflist_partition(RefList *list, int n_parts)
+{
+	struct reflist_partition *part;
+	Reflection *refl;
+	RefListIterator *iter;
+	int n, n_alloc, i;
+
+	if ( n_parts < 1 ) return NULL;
+
+	part = cfmalloc(sizeof(struct reflist_partition));
+	if ( part == NULL ) return NULL;
+
+	n = num_reflections(list);
+	part->n_parts = n_parts;
+	part->start = cfmalloc((n_parts+1)*sizeof(int));
+
+	/* At least one element, so that an empty list doesn't look like an
+	 * allocation failure */
+	n_alloc = (n > 0) ? n : 1;
+	part->refls = cfmalloc(n_alloc*sizeof(Reflection *));
+	if ( (part->start == NULL) || (part->refls == NULL) ) {
+		reflist_free_partition(part);
+		return NULL;
+	}
+
+	i = 0;
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		part->refls[i++] = refl;
+	}
+	assert(i == n);
+
+	part->start[0] = 0;
+	for ( i=1; i<n_parts; i++ ) {
+
+		int s = (long int)n*i/n_parts;
+
+		if ( s < part->start[i-1] ) s = part->start[i-1];
+
+		/* Don't split up reflections with the same indices */
+		while ( (s > 0) && (s < n)
+		     && (part->refls[s]->serial == part->refls[s-1]->serial) )
+		{
+			s++;
+		}
+
+		part->start[i] = s;
+
+	}
+	part->start[n_parts] = n;
+
+	return part;
+}
+
+
+/**
+ * \param part: A \ref reflist_partition from reflist_partition()
+ *
+ * Frees \p part.  The reflection list itself is not affected.
+ */
+void reflist_free_partition(struct reflist_partition *part)
+{
+	if ( part == NULL ) return;
+	cffree(part->start);
+	cffree(part->refls);
+	cffree(part);
+}
+
+
+/*********************************** Freezing *********************************/
+
+static void recursive_freeze(RefList *list, Reflection *refl)
+{
+	unsigned int mask = (1U << list->frozen_bits) - 1;
+	unsigned int i;
+
+	if ( refl == NULL ) return;
+
+	/* Only the first of each set of duplicates is in the tree */
+	i = frozen_slot(refl->serial, list->frozen_bits);
+	while ( list->frozen[i] != NULL ) i = (i+1) & mask;
+	list->frozen[i] = refl;
+
+	recursive_freeze(list, refl->child[0]);
+	recursive_freeze(list, refl->child[1]);
+}
+
+
+static int recursive_count_unique(Reflection *refl)
+{
+	if ( refl == NULL ) return 0;
+	return 1 + recursive_count_unique(refl->child[0])
+	         + recursive_count_unique(refl->child[1]);
+}
+
+
+/**
+ * \param list: A %RefList
+ *
+ * Builds a hash table for \p list, after which find_refl() will take a
+ * constant amount of time instead of searching the tree.  This is worthwhile
+ * when the list is complete, and will be searched many times (for example, a
+ * list of merged reflections during scaling and post-refinement).
+ *
+ * All other operations on the list will continue to work as normal, including
+ * getting and setting the values of reflections.  If a reflection is added to
+ * the list, it will become un-frozen, and reflist_freeze() will need to be
+ * called again to restore fast lookups.
+ *
+ * \returns zero on success, non-zero on error (the list will then still be
+ * usable, but not frozen).
+ */
+int reflist_freeze(RefList *list)
+{
+	int n_unique;
+	int bits = 1;
+
+	reflist_unfreeze(list);
+
+	/* Keep the load factor below 0.5 */
+	n_unique = recursive_count_unique(list->head);
+	while ( (1 << bits) < 2*n_unique ) bits++;
+
+	list->frozen = cfcalloc(1 << bits, sizeof(Reflection *));
+	if ( list->frozen == NULL ) return 1;
+	list->frozen_bits = bits;
+
+	recursive_freeze(list, list->head);
+
+	return 0;
+}
+
+
+/**
+ * \param list: A %RefList
+ *
+ * Removes the hash table created by reflist_freeze().  It is not necessary to
+ * call this function before modifying the list, but it can be used to release
+ * the memory used by the hash table.
+ */
+void reflist_unfreeze(RefList *list)
+{
+	cffree(list->frozen);
+	list->frozen = NULL;
+	list->frozen_bits = 0;
+}
+
+
+/**
+ * \param list: A %RefList
+ *
+ * \returns non-zero if \p list has been frozen using reflist_freeze().
+ */
+int reflist_is_frozen(const RefList *list)
+{
+	return list->frozen != NULL;
+}
+
+
+/**
+ * \param list: A %RefList
+ * \param other: Another %RefList
+ *
+ * Finds the reflection in \p other which has the same indices as each
+ * reflection in \p list.  The results are in the same order as the
+ * reflections are visited by first_refl() and next_refl(), and there is a NULL
+ * entry for each reflection in \p list which is not in \p other.  If there
+ * are several reflections with the same indices in \p other, the first one
+ * will be used.
+ *
+ * The results are kept along with \p list, and will be re-used by later calls
+ * with the same \p other, until a reflection is added to either of the lists.
+ * This avoids repeating the same lookups over and over, for example when
+ * comparing the reflections from one crystal with a list of merged
+ * reflections many times.  Changing the values of the reflections does not
+ * matter.  This function must not be called for the same \p list from more
+ * than one thread at a time.
+ *
+ * \returns an array of reflections from \p other, or NULL on error.  The
+ * array belongs to \p list, and must not be freed.
+ */
+const Reflection **reflist_match(RefList *list, const RefList *other)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	const Reflection **match;
+	int i = 0;
+
+	if ( (list->match != NULL)
+	  && (list->match_version == list->version)
+	  && (list->match_other_version == other->version) )
+	{
+		return list->match;
+	}
+
+	match = cfrealloc(list->match,
+	                  (num_reflections(list)+1)*sizeof(Reflection *));
+	if ( match == NULL ) return NULL;
+	list->match = match;
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		get_indices(refl, &h, &k, &l);
+		match[i++] = find_refl(other, h, k, l);
+	}
+
+	list->match_version = list->version;
+	list->match_other_version = other->version;
+	return match;
+}
+
+
 /*********************************** Voodoo ***********************************/
 
 static int recursive_depth(Reflection *refl)
@@ -1269,11 +2173,13 @@ int tree_depth(RefList *list)
 /**
  * \param refl: Reflection
  *
- * Acquires a lock on the reflection.
+ * Acquires a lock on the reflection.  The reflection must not belong to a list
+ * created with \ref REFLIST_NO_LOCKS.
  */
 void lock_reflection(Reflection *refl)
 {
-	pthread_mutex_lock(&refl->lock);
+	assert(refl->has_lock);
+	pthread_mutex_lock(&LOCKED_REFL(refl)->lock);
 }
 
 
@@ -1284,7 +2190,8 @@ void lock_reflection(Reflection *refl)
  */
 void unlock_reflection(Reflection *refl)
 {
-	pthread_mutex_unlock(&refl->lock);
+	assert(refl->has_lock);
+	pthread_mutex_unlock(&LOCKED_REFL(refl)->lock);
 }
 
 
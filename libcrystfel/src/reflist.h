@@ -92,7 +92,31 @@ struct reflection_contributions
 	Crystal    **contrib_crystals;
 };
 
+/**
+ * Options for reflist_new_with_flags()
+ */
+enum reflist_flags
+{
+	/** Allocate reflections in large blocks, and free them in bulk */
+	REFLIST_ARENA = 1,
+
+	/** Leave out the per-reflection locks */
+	REFLIST_NO_LOCKS = 2,
+
+	/** Use a compact, single precision representation of reflections,
+	 * without phases or contribution lists */
+	REFLIST_LEAN = 4,
+
+	/** Store the reflections in the working file set up with
+	 * reflist_set_spill_dir() */
+	REFLIST_SPILL = 8,
+};
+
 extern RefList *reflist_new(void);
+extern RefList *reflist_new_arena(void);
+extern RefList *reflist_new_with_flags(int flags);
+extern int reflist_get_flags(const RefList *list);
+extern int reflist_set_spill_dir(const char *dir);
 
 
 extern void reflist_free(RefList *list);
@@ -162,6 +186,91 @@ extern void free_reflistiterator(RefListIterator *iter);
 extern const Reflection *first_refl_const(const RefList *list, RefListIterator **piter);
 extern const Reflection *next_refl_const(const Reflection *refl, RefListIterator *iter);
 
+/* Columnar access */
+
+/**
+ * A snapshot of some of the values of all the reflections in a %RefList,
+ * stored as parallel arrays, in the same order as the list would be iterated
+ * over.  See reflist_get_columns().
+ */
+struct reflist_columns
+{
+	/** Number of reflections */
+	int n;
+
+	/** The reflections themselves, used by reflist_put_columns() */
+	Reflection **refls;
+
+	signed int *h;
+	signed int *k;
+	signed int *l;
+	double *intensity;
+	double *esd_i;
+	double *partiality;
+	double *lorentz;
+	double *khalf;
+	double *exerr;
+	int *flag;
+
+	/** Detector position: fast and slow scan coordinates, and panel
+	 * number.  See get_detector_pos() and get_panel_number(). */
+	double *fs;
+	double *ss;
+	int *panel_number;
+
+	/** Number of measurements (for merged lists) */
+	int *redundancy;
+};
+
+/**
+ * Selects the fields to be written back by reflist_put_columns()
+ */
+enum reflist_column_fields
+{
+	RCOL_INTENSITY = 1,
+	RCOL_ESD_I = 2,
+	RCOL_PARTIALITY = 4,
+	RCOL_LORENTZ = 8,
+	RCOL_KHALF = 16,
+	RCOL_EXERR = 32,
+	RCOL_FLAG = 64,
+	RCOL_DETECTOR_POS = 128,  /**< fs, ss and panel_number */
+	RCOL_REDUNDANCY = 256,
+	RCOL_ALL = 511,
+};
+
+extern struct reflist_columns *reflist_get_columns(RefList *list);
+extern void reflist_put_columns(struct reflist_columns *cols, int fields);
+extern void reflist_free_columns(struct reflist_columns *cols);
+
+/* Partitioning */
+
+/**
+ * A division of a %RefList into disjoint ranges, which can be iterated over
+ * concurrently.  See reflist_partition().
+ */
+struct reflist_partition
+{
+	/** Number of ranges */
+	int n_parts;
+
+	/** Range \c i consists of \c refls[start[i]] up to, but not including,
+	 * \c refls[start[i+1]].  There are \c n_parts+1 entries. */
+	int *start;
+
+	/** All the reflections in the list, in iteration order */
+	Reflection **refls;
+};
+
+extern struct reflist_partition *reflist_partition(RefList *list, int n_parts);
+extern void reflist_free_partition(struct reflist_partition *part);
+
+/* Freezing */
+extern int reflist_freeze(RefList *list);
+extern void reflist_unfreeze(RefList *list);
+extern int reflist_is_frozen(const RefList *list);
+extern const Reflection **reflist_match(RefList *list, const RefList *other);
+
 /* Misc */
 extern int num_reflections(RefList *list);
 extern int tree_depth(RefList *list);
@@ -29,6 +29,7 @@
 #include <libcrystfel-config.h>
 
 #include <assert.h>
+#include <string.h>
 #include <gsl/gsl_sort.h>
 
 #include "spectrum.h"
@@ -58,6 +59,13 @@ struct _spectrum
 	double *k;
 	double *pdf;
 	int n_samples;
+
+	/* Tabulated density, for spectrum_get_density_at_k() */
+	double *table;
+	int n_table;
+	double table_kmin;
+	double table_inc;
+	int table_stale;
 };
 
 
@@ -83,6 +91,10 @@ Spectrum *spectrum_new()
 	s->pdf = NULL;
 	s->n_samples = 0;
 
+	s->table = NULL;
+	s->n_table = 0;
+	s->table_stale = 0;
+
 	return s;
 }
 
@@ -98,10 +110,56 @@ void spectrum_free(Spectrum *s)
 	cffree(s->gaussians);
 	cffree(s->k);
 	cffree(s->pdf);
+	cffree(s->table);
 	cffree(s);
 }
 
 
+static void *copy_array(const void *src, size_t size, int *fail)
+{
+	void *dst;
+	if ( (src == NULL) || (size == 0) ) return NULL;
+	dst = cfmalloc(size);
+	if ( dst == NULL ) {
+		*fail = 1;
+		return NULL;
+	}
+	memcpy(dst, src, size);
+	return dst;
+}
+
+
+/**
+ * \param s A \ref Spectrum
+ *
+ * \returns A new \ref Spectrum which is a copy of \p s, or NULL on failure.
+ */
+Spectrum *spectrum_copy(const Spectrum *s)
+{
+	Spectrum *n;
+	int fail = 0;
+
+	if ( s == NULL ) return NULL;
+
+	n = cfmalloc(sizeof(Spectrum));
+	if ( n == NULL ) return NULL;
+
+	*n = *s;
+	n->gaussians = copy_array(s->gaussians,
+	                          s->n_gaussians*sizeof(struct gaussian),
+	                          &fail);
+	n->k = copy_array(s->k, s->n_samples*sizeof(double), &fail);
+	n->pdf = copy_array(s->pdf, s->n_samples*sizeof(double), &fail);
+	n->table = copy_array(s->table, s->n_table*sizeof(double), &fail);
+	if ( fail ) {
+		spectrum_free(n);
+		return NULL;
+	}
+
+	return n;
+}
+
+
 /**
  * \param s A \ref Spectrum
  *
@@ -142,27 +200,25 @@ struct gaussian spectrum_get_gaussian(Spectrum *s, int n)
 }
 
 
-/**
- * \param s A \ref Spectrum
- * \param k A wavenumber (in 1/metres)
- *
- * Retrieves the spectral density at wavenumber \p k.
- * This is a sample from a probability density function, so to calculate the
- * "amount of intensity" from this, you'll need to multiply the value by a
- * small width of k.
- *
- * \returns The density at \p k.
- */
-double spectrum_get_density_at_k(Spectrum *s, double k)
+static double exact_density_at_k(Spectrum *s, double k)
 {
 	if ( s->rep == SPEC_HISTOGRAM ) {
-		int i = 0;
+		int lo = 0;
+		int i = s->n_samples-1;
 		double frac;
 		if ( k <= s->k[0] ) return 0.0;
 		if ( k >= s->k[s->n_samples-1] ) return 0.0;
 		/* k is definitely after the first sample, and definitely
-		 * before the last one */
-		while ( (i<s->n_samples) && (s->k[i] < k) ) i++;
+		 * before the last one.  Find the first sample at or after k,
+		 * keeping s->k[lo] < k <= s->k[i] */
+		while ( i - lo > 1 ) {
+			int mid = lo + (i-lo)/2;
+			if ( s->k[mid] < k ) {
+				lo = mid;
+			} else {
+				i = mid;
+			}
+		}
 		assert(i < s->n_samples);
 		frac = (k - s->k[i-1]) / (s->k[i] - s->k[i-1]);
 		return s->pdf[i-1] + frac * (s->pdf[i] - s->pdf[i-1]);
@@ -184,6 +240,52 @@ double spectrum_get_density_at_k(Spectrum *s, double k)
 }
 
 
+static double table_density_at_k(Spectrum *s, double k)
+{
+	double pos = (k - s->table_kmin) / s->table_inc;
+	int i;
+	double frac;
+
+	if ( !(pos >= 0.0) || (pos >= s->n_table-1) ) return 0.0;
+	i = pos;
+	frac = pos - i;
+	return s->table[i] + frac * (s->table[i+1] - s->table[i]);
+}
+
+
+static int make_density_table(Spectrum *s);
+
+
+/**
+ * \param s A \ref Spectrum
+ * \param k A wavenumber (in 1/metres)
+ *
+ * Retrieves the spectral density at wavenumber \p k.
+ * This is a sample from a probability density function, so to calculate the
+ * "amount of intensity" from this, you'll need to multiply the value by a
+ * small width of k.
+ *
+ * If the spectrum has been tabulated using spectrum_set_density_table(), the
+ * value will be interpolated from the table.  If the spectrum has changed
+ * since then, the table will be re-calculated first, which means that this
+ * function modifies \p s and must not be called on the same spectrum from
+ * more than one thread at once.
+ *
+ * \returns The density at \p k.
+ */
+double spectrum_get_density_at_k(Spectrum *s, double k)
+{
+	if ( s->table_stale ) {
+		/* If this fails, there will be no table and the density will be
+		 * calculated directly until the spectrum changes again */
+		make_density_table(s);
+		s->table_stale = 0;
+	}
+	if ( s->table != NULL ) return table_density_at_k(s, k);
+	return exact_density_at_k(s, k);
+}
+
+
 static double smallest_in_list(double *vals, int n_vals)
 {
 	int i;
@@ -276,6 +378,46 @@ static void normalise_gaussians(struct gaussian *gauss, int n_gauss)
 }
 
 
+/* Fills in the density table for the current spectrum, if there should be
+ * one.  Returns non-zero on error, in which case there will be no table. */
+static int make_density_table(Spectrum *s)
+{
+	double kmin, kmax;
+	int i;
+
+	/* An existing table always has n_table entries, so it can be
+	 * re-used */
+	if ( (s->n_table < 2)
+	  || ((s->rep == SPEC_GAUSSIANS) && (s->n_gaussians == 0))
+	  || ((s->rep == SPEC_HISTOGRAM) && (s->n_samples == 0)) )
+	{
+		cffree(s->table);
+		s->table = NULL;
+		return (s->n_table < 2) ? 0 : 1;
+	}
+
+	spectrum_get_range(s, &kmin, &kmax);
+	if ( !(kmax > kmin) || !isfinite(kmax-kmin) ) {
+		cffree(s->table);
+		s->table = NULL;
+		return 1;
+	}
+
+	if ( s->table == NULL ) {
+		s->table = cfmalloc(s->n_table*sizeof(double));
+		if ( s->table == NULL ) return 1;
+	}
+
+	s->table_kmin = kmin;
+	s->table_inc = (kmax - kmin) / (s->n_table-1);
+	for ( i=0; i<s->n_table; i++ ) {
+		s->table[i] = exact_density_at_k(s, kmin + i*s->table_inc);
+	}
+
+	return 0;
+}
+
+
 /**
  * \param s A \ref Spectrum
  * \param gs Pointer to array of \ref gaussian structures
@@ -291,13 +433,20 @@ static void normalise_gaussians(struct gaussian *gauss, int n_gauss)
  */
 void spectrum_set_gaussians(Spectrum *s, struct gaussian *gs, int n_gauss)
 {
-	/* Free old contents (if any - may be NULL) */
-	cffree(s->gaussians);
+	/* Free old contents (if any - may be NULL), unless they can be
+	 * re-used because the number of Gaussians is the same */
 	cffree(s->k);
 	cffree(s->pdf);
+	s->k = NULL;
+	s->pdf = NULL;
 
-	s->gaussians = cfmalloc(n_gauss * sizeof(struct gaussian));
-	if ( s->gaussians == NULL ) return;
+	if ( (s->gaussians == NULL) || (s->rep != SPEC_GAUSSIANS)
+	  || (s->n_gaussians != n_gauss) )
+	{
+		cffree(s->gaussians);
+		s->gaussians = cfmalloc(n_gauss * sizeof(struct gaussian));
+		if ( s->gaussians == NULL ) return;
+	}
 
 	memcpy(s->gaussians, gs, n_gauss*sizeof(struct gaussian));
 	s->n_gaussians = n_gauss;
@@ -305,6 +454,8 @@ void spectrum_set_gaussians(Spectrum *s, struct gaussian *gs, int n_gauss)
 
 	qsort(s->gaussians, s->n_gaussians, sizeof(struct gaussian), cmp_gauss);
 	normalise_gaussians(s->gaussians, s->n_gaussians);
+
+	s->table_stale = (s->n_table > 1);
 }
 
 
@@ -351,6 +502,8 @@ void spectrum_set_pdf(Spectrum *s, double *kvals, double *heights, int n)
 	cffree(s->gaussians);
 	cffree(s->k);
 	cffree(s->pdf);
+	s->gaussians = NULL;
+	s->n_gaussians = 0;
 
 	s->k = cfmalloc(n * sizeof(double));
 	if ( s->k == NULL ) return;
@@ -373,6 +526,74 @@ void spectrum_set_pdf(Spectrum *s, double *kvals, double *heights, int n)
 	s->rep = SPEC_HISTOGRAM;
 
 	normalise_pdf(s->k, s->pdf, s->n_samples);
+
+	s->table_stale = (s->n_table > 1);
+}
+
+
+/**
+ * \param s A \ref Spectrum
+ * \param n_samples Number of samples in the table, or zero for no table
+ *
+ * Tabulates the spectral density of \p s at \p n_samples evenly spaced values
+ * of k, covering the range given by spectrum_get_range().  Afterwards,
+ * spectrum_get_density_at_k() will interpolate linearly between the samples,
+ * which is much faster than evaluating the spectrum directly.  This is most
+ * useful for the PMODEL_XSPHERE partiality model.
+ *
+ * The table will be re-calculated, the next time spectrum_get_density_at_k()
+ * is called, whenever the spectrum is changed with spectrum_set_gaussians() or
+ * spectrum_set_pdf().  A spectrum which is changed many times between uses,
+ * as in post-refinement, therefore doesn't pay for tabulating each version.  If the table can't be made
+ * (for example, because the spectrum is empty or has zero width), the density
+ * will be calculated directly until then.
+ *
+ * The difference between the tabulated and exact densities is checked half
+ * way between each pair of samples, where the interpolation error is largest.
+ *
+ * \returns The largest difference found, as a fraction of the largest value
+ * in the table.  Zero if \p n_samples is zero, or a negative number on error.
+ */
+double spectrum_set_density_table(Spectrum *s, int n_samples)
+{
+	int i;
+	double max_err = 0.0;
+	double max_val = 0.0;
+
+	/* The size might be changing */
+	cffree(s->table);
+	s->table = NULL;
+
+	s->n_table = (n_samples > 1) ? n_samples : 0;
+	s->table_stale = 0;
+	if ( make_density_table(s) ) return -1.0;
+	if ( s->table == NULL ) return 0.0;
+
+	for ( i=0; i<s->n_table-1; i++ ) {
+		double k = s->table_kmin + (i+0.5)*s->table_inc;
+		double err = fabs(table_density_at_k(s, k)
+		                  - exact_density_at_k(s, k));
+		if ( err > max_err ) max_err = err;
+		if ( s->table[i] > max_val ) max_val = s->table[i];
+	}
+	if ( s->table[s->n_table-1] > max_val ) {
+		max_val = s->table[s->n_table-1];
+	}
+
+	if ( max_val <= 0.0 ) return 0.0;
+	return max_err / max_val;
+}
+
+
+/**
+ * \param s A \ref Spectrum
+ *
+ * \returns The number of samples in the table set up by
+ * spectrum_set_density_table(), or zero if there is no table.
+ */
+int spectrum_get_density_table_size(Spectrum *s)
+{
+	return s->n_table;
 }
 
 
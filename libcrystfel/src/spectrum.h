@@ -61,6 +61,7 @@ extern "C" {
 /* Alloc/free */
 extern Spectrum *spectrum_new(void);
 extern void spectrum_free(Spectrum *s);
+extern Spectrum *spectrum_copy(const Spectrum *s);
 extern Spectrum *spectrum_load(const char *filename);
 
 /* Representation as Gaussians */
@@ -74,6 +75,8 @@ extern void spectrum_set_pdf(Spectrum *s, double *kcens, double *heights,
                              int nbins);
 extern void spectrum_get_range(Spectrum *s, double *kmin, double *kmax);
 extern double spectrum_get_density_at_k(Spectrum *s, double k);
+extern double spectrum_set_density_table(Spectrum *s, int n_samples);
+extern int spectrum_get_density_table_size(Spectrum *s);
 
 /* Generation of spectra */
 extern Spectrum *spectrum_generate_tophat(double wavelength, double bandwidth);
@@ -36,10 +36,24 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "cell.h"
 #include "cell-utils.h"
@@ -76,13 +90,69 @@ struct _stream
 	 * reading things.  We own this. */
 	DataTemplate *dtempl_read;
 
+	/* Panel name lookup for dtempl_read */
+	struct panel_lookup *panels;
+
+	/* If not NULL, text is read from here instead of 'fh', starting at
+	 * map_pos.  This is the file itself, memory-mapped if map_owned is
+	 * true, otherwise one chunk in memory (see parse_raw_chunk()). */
+	const char *map;
+	size_t map_len;
+	size_t map_pos;
+	int map_owned;
+
+	/* For zstd-compressed text streams.  When reading, 'map' points to
+	 * the decompressed contents of the current frame. */
+	struct zstd_reader *zr;
+	struct zstd_writer *zw;
+
+	/* When writing a compressed stream, or with a writer thread, 'fh' is
+	 * a memory buffer (mem, mem_len) which collects the text of each
+	 * chunk, and the output goes to 'out_fh' via write_out(). */
+	FILE *out_fh;
+	char *mem;
+	size_t mem_len;
+	struct writer_thread *wt;
+
 	long long int ln;
 
 	int old_indexers;  /* True if the stream reader encountered a deprecated
 	                    * indexing method */
 
+	/* Offsets and keys of the chunks written so far, for the index at
+	 * the end of a binary stream */
 	long *chunk_offsets;
+	char **chunk_keys;
 	int n_chunks;
+	int max_chunks;
+
+	int binary;          /* True if the stream is in the binary format */
+	int binary_write;    /* True if writing a binary stream */
+	int binary_started;  /* True once STREAM_BINARY_START_MARKER written */
+	int binary_end;      /* True if the reader reached the index */
+	long binary_start;   /* Offset of the first binary chunk */
+
+	/* If the stream was opened from a manifest, the list of shards.
+	 * Otherwise, n_shards is zero. */
+	char **shards;
+	int n_shards;
+	int cur_shard;
+
+	/* Set by stream_set_reflection_cutoffs() */
+	int have_cutoffs;
+	double cut_max_peak;
+	double cut_min_res;
+	double cut_push_res;
+};
+
+
+/* The cutoffs for the reflections of one crystal */
+struct refl_cut
+{
+	int active;
+	double max_peak;
+	double max_res;  /* 1/d in m^-1, or +INFINITY */
+	struct cell_rmetric m;
 };
 
 
@@ -92,815 +162,3526 @@ int stream_has_old_indexers(Stream *st)
 }
 
 
-static ImageFeatureList *read_peaks(Stream *st, struct image *image)
+static void set_u32(unsigned char *p, uint32_t v)
 {
-	char *rval = NULL;
-	int first = 1;
-	ImageFeatureList *features;
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
 
-	features = image_feature_list_new();
 
+static uint32_t get_u32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+	     | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+#define ZSTD_SKIPPABLE_MAGIC (0x184D2A50)
+#define ZSTD_SKIPPABLE_MASK (0xFFFFFFF0)
+#define ZSTD_SEEKABLE_MAGIC (0x8F92EAB1)
+#define ZSTD_SEEK_TABLE_MAGIC (0x184D2A5E)
+
+struct zstd_reader
+{
+	const unsigned char *in;  /* The whole compressed file (mapped) */
+	size_t in_len;
+	size_t frame_pos;         /* Offset of the current frame */
+	size_t next_pos;          /* Offset of the next frame */
+	char *out;                /* Contents of the current frame */
+	size_t out_max;
+	#ifdef HAVE_ZSTD
+	ZSTD_DCtx *dctx;
+	#endif
+};
+
+
+struct zstd_writer
+{
+	uint32_t *sizes;  /* Compressed and decompressed size of each frame */
+	int n_frames;
+	int max_frames;
+	int err;
+	#ifdef HAVE_ZSTD
+	ZSTD_CCtx *cctx;
+	#endif
+};
+
+
+struct out_buf
+{
+	char *data;
+	size_t len;
+	struct out_buf *next;
+};
+
+
+struct writer_thread
+{
+	FILE *fh;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct out_buf *first;
+	struct out_buf *last;
+	size_t queued;  /* Bytes handed to the thread but not yet written */
+	int finish;
+	int err;
+};
+
+
+/* The producer waits if more than this much is waiting to be written */
+#define WRITER_MAX_QUEUED (64*1024*1024)
+
+
+static void *writer_thread_main(void *vp)
+{
+	struct writer_thread *wt = vp;
+
+	pthread_mutex_lock(&wt->lock);
 	do {
 
-		char line[1024];
-		float x, y, d, intensity;
-		int r;
-		char panel_name[1024];
-		int pn;
+		struct out_buf *b;
+		int ok;
 
-		rval = fgets(line, 1023, st->fh);
-		st->ln++;
-		if ( rval == NULL ) {
-			image_feature_list_free(features);
-			return NULL;
+		while ( (wt->first == NULL) && !wt->finish ) {
+			pthread_cond_wait(&wt->cond, &wt->lock);
 		}
-		chomp(line);
 
-		if ( strcmp(line, STREAM_PEAK_LIST_END_MARKER) == 0 ) {
-			return features;
+		b = wt->first;
+		if ( b == NULL ) break;
+		wt->first = b->next;
+		if ( wt->first == NULL ) wt->last = NULL;
+		pthread_mutex_unlock(&wt->lock);
+
+		ok = (fwrite(b->data, 1, b->len, wt->fh) == b->len);
+		cffree(b->data);
+
+		/* Flush whenever we catch up, so that anyone reading the
+		 * stream sees complete chunks as soon as possible */
+		pthread_mutex_lock(&wt->lock);
+		if ( wt->first == NULL ) {
+			pthread_mutex_unlock(&wt->lock);
+			if ( fflush(wt->fh) ) ok = 0;
+			pthread_mutex_lock(&wt->lock);
 		}
+		if ( !ok ) wt->err = 1;
+		wt->queued -= b->len;
+		pthread_cond_broadcast(&wt->cond);
+		cffree(b);
 
-		if ( first ) {
-			first = 0;
-			continue;
-		}
+	} while ( 1 );
+	pthread_mutex_unlock(&wt->lock);
 
-		r = sscanf(line, "%f %f %f %f %64s",
-		           &x, &y, &d, &intensity, panel_name);
+	return NULL;
+}
 
-		if ( r != 5 ) {
-			ERROR("Failed to parse peak list line.\n");
-			ERROR("The failed line was: '%s'\n", line);
-			image_feature_list_free(features);
-			return NULL;
-		}
 
-		if ( data_template_panel_name_to_number(st->dtempl_read,
-		                                        panel_name,
-		                                        &pn) )
-		{
-			ERROR("No such panel '%s'\n", panel_name);
-		} else {
+/* Sends output to the real output file, via the writer thread if there is
+ * one */
+static int write_out(Stream *st, const void *data, size_t len)
+{
+	struct writer_thread *wt = st->wt;
+	struct out_buf *b;
+	int err;
 
-			if ( data_template_file_to_panel_coords(st->dtempl_read,
-			                                        &x, &y, pn) )
-			{
-				ERROR("Failed to convert peak coords\n");
-			} else {
-				image_add_feature(features, x, y,
-				                  pn, intensity, NULL);
-			}
+	if ( wt == NULL ) {
+		if ( fwrite(data, 1, len, st->out_fh) != len ) return 1;
+		return fflush(st->out_fh) != 0;
+	}
 
-		}
+	b = cfmalloc(sizeof(struct out_buf));
+	if ( b == NULL ) return 1;
+	b->data = cfmalloc(len);
+	if ( b->data == NULL ) {
+		cffree(b);
+		return 1;
+	}
+	memcpy(b->data, data, len);
+	b->len = len;
+	b->next = NULL;
 
-	} while ( rval != NULL );
+	pthread_mutex_lock(&wt->lock);
+	while ( (wt->queued > WRITER_MAX_QUEUED) && !wt->err ) {
+		pthread_cond_wait(&wt->cond, &wt->lock);
+	}
+	if ( wt->last != NULL ) {
+		wt->last->next = b;
+	} else {
+		wt->first = b;
+	}
+	wt->last = b;
+	wt->queued += len;
+	err = wt->err;
+	pthread_cond_broadcast(&wt->cond);
+	pthread_mutex_unlock(&wt->lock);
 
-	return features;
+	return err;
 }
 
 
-static int write_peaks(const struct image *image,
-                       const DataTemplate *dtempl, FILE *ofh)
+static void stop_writer_thread(Stream *st)
 {
-	int i;
+	struct writer_thread *wt = st->wt;
 
-	fprintf(ofh, STREAM_PEAK_LIST_START_MARKER"\n");
-	fprintf(ofh, "  fs/px   ss/px (1/d)/nm^-1   Intensity  Panel\n");
+	if ( wt == NULL ) return;
 
-	for ( i=0; i<image_feature_count(image->features); i++ ) {
+	pthread_mutex_lock(&wt->lock);
+	wt->finish = 1;
+	pthread_cond_broadcast(&wt->cond);
+	pthread_mutex_unlock(&wt->lock);
+	pthread_join(wt->thread, NULL);
 
-		struct imagefeature *f;
-		double r[3];
-		double q;
-		float write_fs, write_ss;
-		struct detgeom_panel *p;
+	if ( wt->err ) ERROR("Failed to write stream.\n");
+	pthread_mutex_destroy(&wt->lock);
+	pthread_cond_destroy(&wt->cond);
+	cffree(wt);
+	st->wt = NULL;
+}
 
-		f = image_get_feature(image->features, i);
-		if ( f == NULL ) continue;
 
-		p = &image->detgeom->panels[f->pn];
-		detgeom_transform_coords(p, f->fs, f->ss,
-		                         image->lambda, 0.0, 0.0, r);
-		q = modulus(r[0], r[1], r[2]);
+/* Makes 'fh' collect the text in memory, with the real file in 'out_fh' */
+static int start_mem_output(Stream *st)
+{
+	FILE *mem;
 
-		write_fs = f->fs;
-		write_ss = f->ss;
-		data_template_panel_to_file_coords(dtempl, f->pn,
-		                                   &write_fs, &write_ss);
+	if ( st->out_fh != NULL ) return 0;
 
-		fprintf(ofh, "%7.2f %7.2f %10.2f  %10.2f   %s\n",
-		        write_fs, write_ss, q/1.0e9, f->intensity,
-		        data_template_panel_number_to_name(dtempl, f->pn));
+	fflush(st->fh);
+	mem = open_memstream(&st->mem, &st->mem_len);
+	if ( mem == NULL ) return 1;
+	st->out_fh = st->fh;
+	st->fh = mem;
+	return 0;
+}
 
-	}
 
-	fprintf(ofh, STREAM_PEAK_LIST_END_MARKER"\n");
-	return 0;
+static int has_zstd_suffix(const char *filename)
+{
+	size_t len = strlen(filename);
+	return (len > 4) && (strcmp(filename+len-4, ".zst") == 0);
 }
 
 
-static RefList *read_stream_reflections_2_3(Stream *st, double kpred)
+/* Checks for the zstd magic number at the start of 'fh', which must be at
+ * the start of the file, and returns to the start */
+static int is_zstd_file(FILE *fh)
 {
-	char *rval = NULL;
-	int first = 1;
-	RefList *out;
+	unsigned char magic[4];
+	int r;
 
-	out = reflist_new();
-	if ( out == NULL ) {
-		ERROR("Failed to allocate reflection list\n");
-		return NULL;
-	}
+	r = (fread(magic, 1, 4, fh) == 4) && (get_u32(magic) == 0xFD2FB528);
+	rewind(fh);
+	return r;
+}
 
-	do {
 
-		char line[1024];
-		signed int h, k, l;
-		float intensity, sigma, fs, ss, pk, bg;
-		char pname[64];
-		int r;
+static void free_zstd_reader(Stream *st)
+{
+	struct zstd_reader *zr = st->zr;
+
+	if ( zr == NULL ) return;
+	munmap((void *)zr->in, zr->in_len);
+	cffree(zr->out);
+	#ifdef HAVE_ZSTD
+	ZSTD_freeDCtx(zr->dctx);
+	#endif
+	cffree(zr);
+	st->zr = NULL;
+	st->map = NULL;
+	st->map_len = 0;
+	st->map_pos = 0;
+}
 
-		rval = fgets(line, 1023, st->fh);
-		st->ln++;
-		if ( rval == NULL ) continue;
-		chomp(line);
 
-		if ( strcmp(line, STREAM_REFLECTION_END_MARKER) == 0 ) return out;
+#ifdef HAVE_ZSTD
 
-		r = sscanf(line, "%i %i %i %f %f %f %f %f %f %63s",
-		           &h, &k, &l, &intensity, &sigma, &pk, &bg,
-			   &fs, &ss, pname);
+/* Skips the seek table, and any other skippable frames */
+static size_t skip_zstd_skippable(struct zstd_reader *zr, size_t pos)
+{
+	while ( (pos+8 <= zr->in_len)
+	     && ((get_u32(zr->in+pos) & ZSTD_SKIPPABLE_MASK)
+	           == ZSTD_SKIPPABLE_MAGIC) )
+	{
+		pos += 8 + (size_t)get_u32(zr->in+pos+4);
+	}
+	return pos;
+}
 
-		if ( (r != 10) && (!first) ) {
-			reflist_free(out);
-			return NULL;
-		}
 
-		first = 0;
+/* Decompresses the frame starting at 'pos' into 'st->map'.
+ * Returns non-zero at the end of the file, or on error. */
+static int load_zstd_frame(Stream *st, size_t pos)
+{
+	struct zstd_reader *zr = st->zr;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t csize;
+	size_t r;
+
+	st->map_len = 0;
+	st->map_pos = 0;
+
+	pos = skip_zstd_skippable(zr, pos);
+	zr->frame_pos = pos;
+	zr->next_pos = zr->in_len;
+	if ( pos >= zr->in_len ) return 1;
+
+	csize = ZSTD_findFrameCompressedSize(zr->in+pos, zr->in_len-pos);
+	if ( ZSTD_isError(csize) ) {
+		ERROR("Compressed stream is damaged: %s\n",
+		      ZSTD_getErrorName(csize));
+		return 1;
+	}
 
-		if ( r == 10 ) {
+	ZSTD_DCtx_reset(zr->dctx, ZSTD_reset_session_only);
+	in.src = zr->in+pos;
+	in.size = csize;
+	in.pos = 0;
+	out.pos = 0;
+	do {
 
-			Reflection *refl;
-			refl = add_refl(out, h, k, l);
-			if ( refl == NULL ) {
-				ERROR("Failed to add reflection\n");
-				return NULL;
-			}
-			set_intensity(refl, intensity);
-			if ( st->dtempl_read != NULL ) {
-				int pn;
+		if ( out.pos == zr->out_max ) {
+			size_t new_max = (zr->out_max == 0) ? 65536
+			                                    : 2*zr->out_max;
+			char *new_out = cfrealloc(zr->out, new_max);
+			if ( new_out == NULL ) return 1;
+			zr->out = new_out;
+			zr->out_max = new_max;
+		}
 
-				if ( data_template_panel_name_to_number(st->dtempl_read,
-			                                                pname, &pn) )
-				{
-					ERROR("No such panel '%s'\n", pname);
-				} else {
-					if ( data_template_file_to_panel_coords(st->dtempl_read, &fs, &ss, pn) ) {
-						ERROR("Failed to convert\n");
-					} else {
-						set_detector_pos(refl, fs, ss);
-						set_panel_number(refl, pn);
-					}
-				}
-			}
-			set_esd_intensity(refl, sigma);
-			set_peak(refl, pk);
-			set_mean_bg(refl, bg);
-			set_redundancy(refl, 1);
-			set_symmetric_indices(refl, h, k, l);
-			set_kpred(refl, kpred);
+		out.dst = zr->out;
+		out.size = zr->out_max;
+		r = ZSTD_decompressStream(zr->dctx, &out, &in);
+		if ( ZSTD_isError(r) ) {
+			ERROR("Failed to decompress stream: %s\n",
+			      ZSTD_getErrorName(r));
+			return 1;
+		}
+		if ( (r != 0) && (in.pos == in.size) && (out.pos < out.size) ) {
+			ERROR("Compressed stream is truncated.\n");
+			return 1;
 		}
 
-	} while ( rval != NULL );
+	} while ( r != 0 );
 
-	/* Got read error of some kind before finding STREAM_PEAK_LIST_END_MARKER */
-	return NULL;
+	st->map = zr->out;
+	st->map_len = out.pos;
+	zr->next_pos = skip_zstd_skippable(zr, pos+csize);
+	return 0;
 }
 
 
-static int write_stream_reflections(FILE *fh, RefList *list,
-                                    const DataTemplate *dtempl)
+static int open_zstd_reader(Stream *st)
 {
-	Reflection *refl;
-	RefListIterator *iter;
+	struct zstd_reader *zr;
+	struct stat s;
+	void *in;
 
-	fprintf(fh, "   h    k    l          I   sigma(I)       "
-	            "peak background  fs/px  ss/px panel\n");
+	if ( fstat(fileno(st->fh), &s) != 0 ) return 1;
+	if ( !S_ISREG(s.st_mode) ) return 1;
 
-	for ( refl = first_refl(list, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
-	{
+	in = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fileno(st->fh), 0);
+	if ( in == MAP_FAILED ) return 1;
+	madvise(in, s.st_size, MADV_SEQUENTIAL);
 
-		signed int h, k, l;
-		double intensity, esd_i, pk, bg;
-		double dfs, dss;
-		float fs, ss;
-		int pn;
+	zr = cfmalloc(sizeof(struct zstd_reader));
+	if ( zr == NULL ) {
+		munmap(in, s.st_size);
+		return 1;
+	}
+	zr->in = in;
+	zr->in_len = s.st_size;
+	zr->out = NULL;
+	zr->out_max = 0;
+	zr->dctx = ZSTD_createDCtx();
+	st->zr = zr;
+	if ( zr->dctx == NULL ) {
+		free_zstd_reader(st);
+		return 1;
+	}
 
-		get_indices(refl, &h, &k, &l);
-		get_detector_pos(refl, &dfs, &dss);
-		fs = dfs;  ss = dss;
-		pn = get_panel_number(refl);
-		intensity = get_intensity(refl);
-		esd_i = get_esd_intensity(refl);
-		pk = get_peak(refl);
-		bg = get_mean_bg(refl);
+	if ( load_zstd_frame(st, 0) ) {
+		free_zstd_reader(st);
+		return 1;
+	}
+	return 0;
+}
 
-		/* Reflections with redundancy = 0 are not written */
-		if ( get_redundancy(refl) == 0 ) continue;
 
-		data_template_panel_to_file_coords(dtempl, pn,
-		                                   &fs, &ss);
+static int open_zstd_writer(Stream *st)
+{
+	struct zstd_writer *zw;
 
-		fprintf(fh, "%4i %4i %4i %10.2f %10.2f %10.2f %10.2f "
-		        "%6.1f %6.1f %s\n",
-		        h, k, l, intensity, esd_i, pk, bg,
-		        fs, ss, data_template_panel_number_to_name(dtempl, pn));
+	if ( start_mem_output(st) ) return 1;
+
+	zw = cfmalloc(sizeof(struct zstd_writer));
+	if ( zw == NULL ) return 1;
 
+	zw->sizes = NULL;
+	zw->n_frames = 0;
+	zw->max_frames = 0;
+	zw->err = 0;
+	zw->cctx = ZSTD_createCCtx();
+	if ( zw->cctx == NULL ) {
+		cffree(zw);
+		return 1;
 	}
+
+	st->zw = zw;
 	return 0;
 }
 
 
-static int num_integrated_reflections(RefList *list)
+/* Compresses the text in st->mem as a single frame */
+static int write_zstd_frame(Stream *st)
 {
-	Reflection *refl;
-	RefListIterator *iter;
-	int n = 0;
+	struct zstd_writer *zw = st->zw;
+	void *buf;
+	size_t clen;
 
-	for ( refl = first_refl(list, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
-	{
-		if ( get_redundancy(refl) > 0 ) n++;
+	buf = cfmalloc(ZSTD_compressBound(st->mem_len));
+	if ( buf == NULL ) {
+		zw->err = 1;
+		return 1;
 	}
 
-	return n;
+	clen = ZSTD_compressCCtx(zw->cctx, buf,
+	                         ZSTD_compressBound(st->mem_len),
+	                         st->mem, st->mem_len, ZSTD_CLEVEL_DEFAULT);
+	if ( ZSTD_isError(clen) || write_out(st, buf, clen) ) {
+		ERROR("Failed to write compressed stream.\n");
+		zw->err = 1;
+	}
+	cffree(buf);
+
+	if ( zw->n_frames == zw->max_frames ) {
+		int new_max = (zw->max_frames == 0) ? 1024 : 2*zw->max_frames;
+		uint32_t *new_sizes = cfrealloc(zw->sizes,
+		                                2*new_max*sizeof(uint32_t));
+		if ( new_sizes != NULL ) {
+			zw->sizes = new_sizes;
+			zw->max_frames = new_max;
+		}
+	}
+	if ( zw->n_frames < zw->max_frames ) {
+		zw->sizes[2*zw->n_frames] = clen;
+		zw->sizes[2*zw->n_frames+1] = st->mem_len;
+		zw->n_frames++;
+	} else {
+		zw->err = 1;
+	}
+
+	return zw->err;
 }
 
 
-static int write_crystal(Stream *st, Crystal *cr, RefList *reflist)
+/* Writes the seek table, in the format of the zstd "seekable" extension, so
+ * that other programs can also find the chunks quickly */
+static void close_zstd_writer(Stream *st)
 {
-	UnitCell *cell;
-	double asx, asy, asz;
-	double bsx, bsy, bsz;
-	double csx, csy, csz;
-	double a, b, c, al, be, ga;
-	double rad;
-	double det_shift_x, det_shift_y;
-	int ret = 0;
+	struct zstd_writer *zw = st->zw;
+	unsigned char *tab;
+	size_t tab_len;
+	int i;
 
-	fprintf(st->fh, STREAM_CRYSTAL_START_MARKER"\n");
+	if ( zw == NULL ) return;
 
-	cell = crystal_get_cell(cr);
-	assert(cell != NULL);
+	if ( !zw->err ) {
+		tab_len = 8*zw->n_frames + 17;
+		tab = cfmalloc(tab_len);
+		if ( tab != NULL ) {
+			set_u32(tab, ZSTD_SEEK_TABLE_MAGIC);
+			set_u32(tab+4, tab_len-8);
+			for ( i=0; i<2*zw->n_frames; i++ ) {
+				set_u32(tab+8+4*i, zw->sizes[i]);
+			}
+			set_u32(tab+tab_len-9, zw->n_frames);
+			tab[tab_len-5] = 0;  /* No checksums */
+			set_u32(tab+tab_len-4, ZSTD_SEEKABLE_MAGIC);
+			write_out(st, tab, tab_len);
+			cffree(tab);
+		}
+	}
 
-	cell_get_parameters(cell, &a, &b, &c, &al, &be, &ga);
-	fprintf(st->fh, "Cell parameters %7.5f %7.5f %7.5f nm,"
-			" %7.5f %7.5f %7.5f deg\n",
-			a*1.0e9, b*1.0e9, c*1.0e9,
-			rad2deg(al), rad2deg(be), rad2deg(ga));
+	ZSTD_freeCCtx(zw->cctx);
+	cffree(zw->sizes);
+	cffree(zw);
+	st->zw = NULL;
+}
 
-	cell_get_reciprocal(cell, &asx, &asy, &asz,
-				  &bsx, &bsy, &bsz,
-				  &csx, &csy, &csz);
-	fprintf(st->fh, "astar = %+9.7f %+9.7f %+9.7f nm^-1\n",
-	        asx/1e9, asy/1e9, asz/1e9);
-	fprintf(st->fh, "bstar = %+9.7f %+9.7f %+9.7f nm^-1\n",
-	        bsx/1e9, bsy/1e9, bsz/1e9);
-	fprintf(st->fh, "cstar = %+9.7f %+9.7f %+9.7f nm^-1\n",
-		csx/1e9, csy/1e9, csz/1e9);
+#else  /* HAVE_ZSTD */
 
-	fprintf(st->fh, "lattice_type = %s\n",
-		str_lattice(cell_get_lattice_type(cell)));
-	fprintf(st->fh, "centering = %c\n", cell_get_centering(cell));
-	fprintf(st->fh, "unique_axis = %c\n", cell_get_unique_axis(cell));
+static int load_zstd_frame(Stream *st, size_t pos)
+{
+	return 1;
+}
 
-	rad = crystal_get_profile_radius(cr);
-	fprintf(st->fh, "profile_radius = %.5f nm^-1\n", rad/1e9);
 
-	if ( crystal_get_notes(cr) != NULL ) {
-		fprintf(st->fh, "%s\n", crystal_get_notes(cr));
+static int open_zstd_reader(Stream *st)
+{
+	ERROR("This version of CrystFEL was compiled without zstd support, "
+	      "so compressed streams can't be read.\n");
+	return 1;
+}
+
+
+static int open_zstd_writer(Stream *st)
+{
+	ERROR("This version of CrystFEL was compiled without zstd support, "
+	      "so compressed streams can't be written.\n");
+	return 1;
+}
+
+
+static int write_zstd_frame(Stream *st)
+{
+	return 1;
+}
+
+
+static void close_zstd_writer(Stream *st)
+{
+}
+
+#endif  /* HAVE_ZSTD */
+
+
+/* Sends everything written to 'fh' since the last call to the output, as
+ * a separate frame if the stream is compressed */
+static int flush_mem_output(Stream *st)
+{
+	int r;
+
+	if ( st->out_fh == NULL ) return 0;
+
+	fflush(st->fh);
+	if ( st->mem_len == 0 ) return 0;
+
+	if ( st->zw != NULL ) {
+		r = write_zstd_frame(st);
+	} else {
+		r = write_out(st, st->mem, st->mem_len);
 	}
 
-	crystal_get_det_shift(cr, &det_shift_x, &det_shift_y);
+	/* Start again at the beginning of the buffer */
+	fseek(st->fh, 0, SEEK_SET);
+	fflush(st->fh);
 
-	fprintf(st->fh, "predict_refine/det_shift x = %.3f y = %.3f mm\n",
-	        det_shift_x*1e3, det_shift_y*1e3);
+	return r;
+}
 
-	if ( reflist != NULL ) {
 
-		fprintf(st->fh, "diffraction_resolution_limit"
-				" = %.2f nm^-1 or %.2f A\n",
-				crystal_get_resolution_limit(cr)/1e9,
-				1e10 / crystal_get_resolution_limit(cr));
+/* Sends the rest of the output, and makes 'fh' the real file again */
+static void end_mem_output(Stream *st)
+{
+	if ( st->out_fh == NULL ) return;
 
-		fprintf(st->fh, "num_reflections = %i\n",
-		                num_integrated_reflections(reflist));
-		fprintf(st->fh, "num_saturated_reflections = %lli\n",
-		                crystal_get_num_saturated_reflections(cr));
-		fprintf(st->fh, "num_implausible_reflections = %lli\n",
-		                crystal_get_num_implausible_reflections(cr));
+	flush_mem_output(st);
+	close_zstd_writer(st);
+	stop_writer_thread(st);
+
+	fclose(st->fh);
+	free(st->mem);  /* Allocated by open_memstream() */
+	st->fh = st->out_fh;
+	st->out_fh = NULL;
+	st->mem = NULL;
+	st->mem_len = 0;
+}
+
+
+/* Equivalent to fgets(line, size, st->fh), but reads from the mapping if
+ * there is one.  For a compressed stream, the lines must not cross the
+ * boundaries between frames, which is true for streams we wrote ourselves. */
+static char *stream_gets(Stream *st, char *line, int size)
+{
+	const char *start;
+	const char *nl;
+	size_t avail, len;
 
+	if ( st->map == NULL ) return fgets(line, size, st->fh);
+
+	while ( st->map_pos >= st->map_len ) {
+		if ( st->zr == NULL ) return NULL;
+		if ( load_zstd_frame(st, st->zr->next_pos) ) return NULL;
 	}
 
-	if ( reflist != NULL ) {
+	start = st->map + st->map_pos;
+	avail = st->map_len - st->map_pos;
+	if ( avail > (size_t)size-1 ) avail = size-1;
 
-		fprintf(st->fh, STREAM_REFLECTION_START_MARKER"\n");
-		ret = write_stream_reflections(st->fh, reflist,
-		                               st->dtempl_write);
-		fprintf(st->fh, STREAM_REFLECTION_END_MARKER"\n");
+	nl = memchr(start, '\n', avail);
+	len = (nl != NULL) ? (size_t)(nl - start) + 1 : avail;
+	memcpy(line, start, len);
+	line[len] = '\0';
+	st->map_pos += len;
+	return line;
+}
 
-	} else {
 
-		fprintf(st->fh, "No integrated reflections.\n");
+static int stream_eof(Stream *st)
+{
+	if ( st->zr != NULL ) {
+		return (st->map_pos >= st->map_len)
+		    && (st->zr->next_pos >= st->zr->in_len);
+	}
+	if ( st->map != NULL ) return st->map_pos >= st->map_len;
+	return feof(st->fh);
+}
 
+
+/* Position of the next line, for the index.  For a compressed stream, this
+ * is only possible at the start of a frame, otherwise -1 is returned. */
+static long int stream_tell(Stream *st)
+{
+	if ( st->zr != NULL ) {
+		if ( st->map_pos >= st->map_len ) return st->zr->next_pos;
+		if ( st->map_pos == 0 ) return st->zr->frame_pos;
+		return -1;
 	}
+	if ( st->map != NULL ) return st->map_pos;
+	return ftell(st->fh);
+}
 
-	fprintf(st->fh, STREAM_CRYSTAL_END_MARKER"\n");
 
-	return ret;
+static void unmap_stream(Stream *st)
+{
+	if ( st->map_owned ) munmap((void *)st->map, st->map_len);
+	st->map = NULL;
+	st->map_len = 0;
+	st->map_pos = 0;
+	st->map_owned = 0;
 }
 
 
-/**
- * \param st A \ref Stream
- * \param i An \ref image structure
- * \param srf A \ref StreamFlags enum saying what to write
- *
- * Writes a new chunk to \p st.
- *
- * \returns non-zero on error.
- */
-int stream_write_chunk(Stream *st, const struct image *i,
-                       StreamFlags srf)
+/* Memory-maps the file behind st->fh, so that the chunks can be read
+ * without going through stdio.  Reading continues from the current position
+ * of st->fh.  If the file can't be mapped (e.g. because it's a pipe), the
+ * stream is read using st->fh as before. */
+static void map_stream(Stream *st)
 {
-	int j;
-	char *indexer;
-	int ret = 0;
+	struct stat s;
+	long pos;
+	void *map;
+
+	unmap_stream(st);
+	if ( st->binary ) return;
+
+	pos = ftell(st->fh);
+	if ( pos < 0 ) return;
+	if ( fstat(fileno(st->fh), &s) != 0 ) return;
+	if ( !S_ISREG(s.st_mode) || (s.st_size == 0) ) return;
+
+	map = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE,
+	           fileno(st->fh), 0);
+	if ( map == MAP_FAILED ) return;
+	madvise(map, s.st_size, MADV_SEQUENTIAL);
+
+	st->map = map;
+	st->map_len = s.st_size;
+	st->map_pos = pos;
+	st->map_owned = 1;
+}
 
-	fprintf(st->fh, STREAM_CHUNK_START_MARKER"\n");
 
-	fprintf(st->fh, "Image filename: %s\n", i->filename);
-	fprintf(st->fh, "Event: %s\n", i->ev);
-	fprintf(st->fh, "Image serial number: %i\n", i->serial);
+/* Fast, locale-independent parsing of the numbers in the stream.  These
+ * handle everything written by stream_write_chunk().  Anything else, such as
+ * "nan" or numbers with too many digits, makes them fail, in which case the
+ * caller falls back to sscanf(). */
 
-	fprintf(st->fh, "hit = %i\n", i->hit);
-	indexer = indexer_str(i->indexed_by);
-	fprintf(st->fh, "indexed_by = %s\n", indexer);
-	cffree(indexer);
-	if ( i->indexed_by != INDEXING_NONE ) {
-		fprintf(st->fh, "n_indexing_tries = %i\n", i->n_indexing_tries);
-	}
+static const double pow10_table[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-	fprintf(st->fh, "photon_energy_eV = %f\n",
-	        J_to_eV(ph_lambda_to_en(i->lambda)));
 
-	fprintf(st->fh, "beam_divergence = %.2e rad\n", i->div);
-	fprintf(st->fh, "beam_bandwidth = %.2e (fraction)\n", i->bw);
+static int is_digit(char c)
+{
+	return (c >= '0') && (c <= '9');
+}
 
-	for ( j=0; j<i->n_cached_headers; j++ ) {
-		struct header_cache_entry *ce = i->header_cache[j];
-		switch ( ce->type ) {
 
-			case HEADER_FLOAT:
-			fprintf(st->fh, "header/float/%s = %f\n",
-			        ce->header_name, ce->val_float);
-			break;
+static int is_end_of_field(char c)
+{
+	return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\0');
+}
 
-			case HEADER_INT:
-			fprintf(st->fh, "header/int/%s = %i\n",
-			        ce->header_name, ce->val_int);
-			break;
 
-			case HEADER_STR:
-			fprintf(st->fh, "header/str/%s = %s\n",
-			        ce->header_name, ce->val_str);
-			break;
+static const char *skip_space(const char *p)
+{
+	while ( (*p == ' ') || (*p == '\t') ) p++;
+	return p;
+}
 
-			default:
-			ERROR("Unrecognised header cache type %i\n", ce->type);
-			break;
 
-		}
+static int fast_int(const char **pp, int *v)
+{
+	const char *p = skip_space(*pp);
+	const char *start;
+	long long int n = 0;
+	int neg = 0;
+
+	if ( *p == '-' ) {
+		neg = 1;
+		p++;
+	} else if ( *p == '+' ) {
+		p++;
 	}
 
-	if ( i->detgeom != NULL ) {
+	start = p;
+	while ( is_digit(*p) ) {
+		n = 10*n + (*p++ - '0');
+		if ( n > INT_MAX ) return 1;
+	}
+	if ( (p == start) || !is_end_of_field(*p) ) return 1;
 
-		int pn;
-		double tclen = 0.0;
+	*v = neg ? -n : n;
+	*pp = p;
+	return 0;
+}
 
-		for ( pn=0; pn<i->detgeom->n_panels; pn++ ) {
-			tclen += i->detgeom->panels[pn].cnz
-				* i->detgeom->panels[pn].pixel_pitch;
-		}
-		fprintf(st->fh, "average_camera_length = %f m\n",
-		        tclen / i->detgeom->n_panels);
 
+static int fast_double(const char **pp, double *v)
+{
+	const char *p = skip_space(*pp);
+	uint64_t m = 0;
+	int n_digits = 0;
+	int exponent = 0;
+	int neg = 0;
+	double d;
+
+	if ( *p == '-' ) {
+		neg = 1;
+		p++;
+	} else if ( *p == '+' ) {
+		p++;
 	}
 
-	fprintf(st->fh, "num_peaks = %i\n", image_feature_count(i->features));
-	fprintf(st->fh, "peak_resolution = %f nm^-1 or %f A\n",
-	        i->peak_resolution/1e9, 1e10/i->peak_resolution);
-	if ( srf & STREAM_PEAKS ) {
-		ret = write_peaks(i, st->dtempl_write, st->fh);
+	while ( is_digit(*p) ) {
+		m = 10*m + (*p++ - '0');
+		n_digits++;
 	}
-
-	for ( j=0; j<i->n_crystals; j++ ) {
-		if ( crystal_get_user_flag(i->crystals[j].cr) ) {
-			continue;
+	if ( *p == '.' ) {
+		p++;
+		while ( is_digit(*p) ) {
+			m = 10*m + (*p++ - '0');
+			n_digits++;
+			exponent--;
 		}
-		ret = write_crystal(st, i->crystals[j].cr,
-		                    srf & STREAM_REFLECTIONS ? i->crystals[j].refls : NULL);
 	}
 
-	fprintf(st->fh, STREAM_CHUNK_END_MARKER"\n");
+	/* Beyond 15 digits, the mantissa might not be exact */
+	if ( (n_digits == 0) || (n_digits > 15) ) return 1;
 
-	fflush(st->fh);
+	if ( (*p == 'e') || (*p == 'E') ) {
+		int e;
+		p++;
+		if ( fast_int(&p, &e) ) return 1;
+		if ( (e < -100) || (e > 100) ) return 1;
+		exponent += e;
+	}
+	if ( !is_end_of_field(*p) ) return 1;
+
+	/* Both the mantissa and the power of ten are exact, so the result is
+	 * correctly rounded */
+	if ( (exponent < -22) || (exponent > 22) ) return 1;
+	d = m;
+	if ( exponent < 0 ) {
+		d /= pow10_table[-exponent];
+	} else {
+		d *= pow10_table[exponent];
+	}
 
-	return ret;
+	*v = neg ? -d : d;
+	*pp = p;
+	return 0;
 }
 
 
-static int find_start_of_chunk(Stream *st)
+static int fast_float(const char **pp, float *v)
 {
-	char *rval = NULL;
-	char line[1024];
-
-	do {
-
-		rval = fgets(line, 1023, st->fh);
-		st->ln++;
+	double d;
+	if ( fast_double(pp, &d) ) return 1;
+	*v = d;
+	return 0;
+}
 
-		/* Trouble? */
-		if ( rval == NULL ) return 1;
 
-		chomp(line);
+/* Copies the next whitespace-delimited word, of at most max_len-1 chars */
+static int fast_word(const char **pp, char *word, size_t max_len)
+{
+	const char *p = skip_space(*pp);
+	size_t len = 0;
 
-	} while ( strcmp(line, STREAM_CHUNK_START_MARKER) != 0 );
+	while ( !is_end_of_field(p[len]) ) {
+		if ( len == max_len-1 ) return 1;
+		word[len] = p[len];
+		len++;
+	}
+	if ( len == 0 ) return 1;
+	word[len] = '\0';
 
+	*pp = p + len;
 	return 0;
 }
 
 
-static void read_crystal(Stream *st, struct image *image,
-                         StreamFlags srf)
+/* Hash table of panel names, so that the panel name on each peak and
+ * reflection line can be looked up quickly.  It's only read after being
+ * created, so it can be shared between the threads of a StreamReader. */
+struct panel_lookup
 {
-	char line[1024];
-	char *rval = NULL;
-	struct rvec as, bs, cs;
-	int have_as = 0;
-	int have_bs = 0;
-	int have_cs = 0;
-	int have_latt = 0;
-	int have_cen = 0;
-	int have_ua = 0;
-	char centering = 'P';
-	char unique_axis = '*';
-	LatticeType lattice_type = L_TRICLINIC;
-	Crystal *cr;
-	RefList *reflist = NULL;
-	double shift_x, shift_y;
+	const DataTemplate *dtempl;
+	int *hash;
+	size_t size;
+};
 
-	as.u = 0.0;  as.v = 0.0;  as.w = 0.0;
-	bs.u = 0.0;  bs.v = 0.0;  bs.w = 0.0;
-	cs.u = 0.0;  cs.v = 0.0;  cs.w = 0.0;
 
-	cr = crystal_new();
-	if ( cr == NULL ) {
-		ERROR("Failed to allocate crystal!\n");
-		return;
+/* FNV-1a */
+static uint64_t hash_string(const char *s)
+{
+	uint64_t h = 14695981039346656037ULL;
+	while ( *s != '\0' ) {
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211ULL;
 	}
+	return h;
+}
 
-	do {
 
-		float u, v, w, lim, rad;
-		char c;
+static struct panel_lookup *make_panel_lookup(const DataTemplate *dtempl)
+{
+	struct panel_lookup *pl;
+	size_t size = 16;
+	size_t i;
 
-		rval = fgets(line, 1023, st->fh);
-		st->ln++;
+	pl = cfmalloc(sizeof(struct panel_lookup));
+	if ( pl == NULL ) return NULL;
 
-		/* Trouble? */
-		if ( rval == NULL ) break;
+	while ( size < 2*(size_t)dtempl->n_panels ) size *= 2;
+	pl->hash = cfmalloc(size*sizeof(int));
+	if ( pl->hash == NULL ) {
+		cffree(pl);
+		return NULL;
+	}
+	pl->size = size;
+	pl->dtempl = dtempl;
+
+	for ( i=0; i<size; i++ ) pl->hash[i] = -1;
+	for ( i=0; i<(size_t)dtempl->n_panels; i++ ) {
+		size_t h = hash_string(dtempl->panels[i].name) & (size-1);
+		while ( pl->hash[h] != -1 ) h = (h+1) & (size-1);
+		pl->hash[h] = i;
+	}
 
-		chomp(line);
-		if ( sscanf(line, "astar = %f %f %f", &u, &v, &w) == 3 )
-		{
-			as.u = u*1e9;  as.v = v*1e9;  as.w = w*1e9;
-			have_as = 1;
-		}
+	return pl;
+}
 
-		if ( sscanf(line, "bstar = %f %f %f", &u, &v, &w) == 3 )
-		{
-			bs.u = u*1e9;  bs.v = v*1e9;  bs.w = w*1e9;
-			have_bs = 1;
-		}
 
-		if ( sscanf(line, "cstar = %f %f %f", &u, &v, &w) == 3 )
-		{
-			cs.u = u*1e9;  cs.v = v*1e9;  cs.w = w*1e9;
-			have_cs = 1;
-		}
+static void free_panel_lookup(struct panel_lookup *pl)
+{
+	if ( pl == NULL ) return;
+	cffree(pl->hash);
+	cffree(pl);
+}
 
-		if ( sscanf(line, "centering = %c", &c) == 1 )
-		{
-			if ( !have_cen ) {
-				centering = c;
-				have_cen = 1;
-			} else {
-				ERROR("Duplicate centering (line %lli) - "
-				      "stream may be corrupted!\n", st->ln);
-			}
+
+static int panel_name_to_number(Stream *st, const char *name, int *pn)
+{
+	struct panel_lookup *pl = st->panels;
+	size_t h;
+
+	if ( pl == NULL ) {
+		return data_template_panel_name_to_number(st->dtempl_read,
+		                                          name, pn);
+	}
+
+	h = hash_string(name) & (pl->size-1);
+	while ( pl->hash[h] != -1 ) {
+		if ( strcmp(pl->dtempl->panels[pl->hash[h]].name, name) == 0 ) {
+			*pn = pl->hash[h];
+			return 0;
 		}
+		h = (h+1) & (pl->size-1);
+	}
+	return 1;
+}
 
-		if ( sscanf(line, "unique_axis = %c", &c) == 1 )
+
+/* Equivalent to sscanf(line, "%f %f %f %f %64s", ...) */
+static int parse_peak_line(const char *line, float *x, float *y, float *d,
+                           float *intensity, char *panel_name)
+{
+	const char *p = line;
+
+	if ( fast_float(&p, x) || fast_float(&p, y) || fast_float(&p, d)
+	  || fast_float(&p, intensity) || fast_word(&p, panel_name, 65) )
+	{
+		return sscanf(line, "%f %f %f %f %64s",
+		              x, y, d, intensity, panel_name);
+	}
+	return 5;
+}
+
+
+/* Equivalent to sscanf(line, "%i %i %i %f %f %f %f %f %f %63s", ...) */
+static int parse_reflection_line(const char *line,
+                                 signed int *h, signed int *k, signed int *l,
+                                 float *intensity, float *sigma,
+                                 float *pk, float *bg, float *fs, float *ss,
+                                 char *pname)
+{
+	const char *p = line;
+
+	if ( fast_int(&p, h) || fast_int(&p, k) || fast_int(&p, l)
+	  || fast_float(&p, intensity) || fast_float(&p, sigma)
+	  || fast_float(&p, pk) || fast_float(&p, bg)
+	  || fast_float(&p, fs) || fast_float(&p, ss)
+	  || fast_word(&p, pname, 64) )
+	{
+		return sscanf(line, "%i %i %i %f %f %f %f %f %f %63s",
+		              h, k, l, intensity, sigma, pk, bg, fs, ss, pname);
+	}
+	return 10;
+}
+
+
+/* Equivalent to sscanf(line+len(prefix), "%f %f %f", ...) for a line
+ * starting with 'prefix' */
+static int parse_vector_line(const char *line, const char *prefix,
+                             float *u, float *v, float *w)
+{
+	size_t len = strlen(prefix);
+	const char *p = line + len;
+
+	if ( strncmp(line, prefix, len) != 0 ) return 0;
+
+	if ( fast_float(&p, u) || fast_float(&p, v) || fast_float(&p, w) ) {
+		return sscanf(line+len, "%f %f %f", u, v, w);
+	}
+	return 3;
+}
+
+
+static ImageFeatureList *read_peaks(Stream *st, struct image *image)
+{
+	char *rval = NULL;
+	int first = 1;
+	ImageFeatureList *features;
+
+	features = image_feature_list_new();
+
+	do {
+
+		char line[1024];
+		float x, y, d, intensity;
+		int r;
+		char panel_name[1024];
+		int pn;
+
+		rval = stream_gets(st, line, 1023);
+		st->ln++;
+		if ( rval == NULL ) {
+			image_feature_list_free(features);
+			return NULL;
+		}
+		chomp(line);
+
+		if ( strcmp(line, STREAM_PEAK_LIST_END_MARKER) == 0 ) {
+			return features;
+		}
+
+		if ( first ) {
+			first = 0;
+			continue;
+		}
+
+		r = parse_peak_line(line, &x, &y, &d, &intensity, panel_name);
+
+		if ( r != 5 ) {
+			ERROR("Failed to parse peak list line.\n");
+			ERROR("The failed line was: '%s'\n", line);
+			image_feature_list_free(features);
+			return NULL;
+		}
+
+		if ( panel_name_to_number(st, panel_name, &pn) )
 		{
-			if ( !have_ua ) {
-				unique_axis = c;
-				have_ua = 1;
+			ERROR("No such panel '%s'\n", panel_name);
+		} else {
+
+			if ( data_template_file_to_panel_coords(st->dtempl_read,
+			                                        &x, &y, pn) )
+			{
+				ERROR("Failed to convert peak coords\n");
 			} else {
-				ERROR("Duplicate unique axis (line %lli) - "
-				      "stream may be corrupted!\n", st->ln);
+				image_add_feature(features, x, y,
+				                  pn, intensity, NULL);
 			}
+
 		}
 
-		if ( strncmp(line, "lattice_type = ", 15) == 0 )
-		{
-			if ( !have_latt ) {
-				lattice_type = lattice_from_str(line+15);
-				have_latt = 1;
-			} else {
-				ERROR("Duplicate lattice type (line %lli) - "
-				      "stream may be corrupted!\n", st->ln);
+	} while ( rval != NULL );
+
+	return features;
+}
+
+
+static int write_peaks(const struct image *image,
+                       const DataTemplate *dtempl, FILE *ofh)
+{
+	int i;
+
+	fprintf(ofh, STREAM_PEAK_LIST_START_MARKER"\n");
+	fprintf(ofh, "  fs/px   ss/px (1/d)/nm^-1   Intensity  Panel\n");
+
+	for ( i=0; i<image_feature_count(image->features); i++ ) {
+
+		struct imagefeature *f;
+		double r[3];
+		double q;
+		float write_fs, write_ss;
+		struct detgeom_panel *p;
+
+		f = image_get_feature(image->features, i);
+		if ( f == NULL ) continue;
+
+		p = &image->detgeom->panels[f->pn];
+		detgeom_transform_coords(p, f->fs, f->ss,
+		                         image->lambda, 0.0, 0.0, r);
+		q = modulus(r[0], r[1], r[2]);
+
+		write_fs = f->fs;
+		write_ss = f->ss;
+		data_template_panel_to_file_coords(dtempl, f->pn,
+		                                   &write_fs, &write_ss);
+
+		fprintf(ofh, "%7.2f %7.2f %10.2f  %10.2f   %s\n",
+		        write_fs, write_ss, q/1.0e9, f->intensity,
+		        data_template_panel_number_to_name(dtempl, f->pn));
+
+	}
+
+	fprintf(ofh, STREAM_PEAK_LIST_END_MARKER"\n");
+	return 0;
+}
+
+
+static void refl_cut_init(const Stream *st, struct refl_cut *cut,
+                          UnitCell *cell, double lim)
+{
+	cut->active = st->have_cutoffs;
+	if ( !cut->active ) return;
+	cut->max_peak = st->cut_max_peak;
+	cut->max_res = lim + st->cut_push_res;
+	if ( (cell == NULL) || cell_get_reciprocal_metric(cell, &cut->m) ) {
+		cut->max_res = +INFINITY;
+	}
+}
+
+
+/* Same test as in merge_all(), for consistency */
+static int refl_cut_keep(const struct refl_cut *cut,
+                         signed int h, signed int k, signed int l, double pk)
+{
+	if ( (cut == NULL) || !cut->active ) return 1;
+	if ( !(pk < cut->max_peak) ) return 0;
+	if ( isinf(cut->max_res) ) return 1;
+	return !(2.0*resolution_fast(&cut->m, h, k, l) > cut->max_res);
+}
+
+
+/* True if the reflections of a crystal with resolution limit 'lim' should not
+ * be read at all */
+static int refl_cut_crystal(const Stream *st, double lim)
+{
+	return st->have_cutoffs && (lim < st->cut_min_res);
+}
+
+
+static RefList *read_stream_reflections_2_3(Stream *st, double kpred, int lean,
+                                            const struct refl_cut *cut)
+{
+	char *rval = NULL;
+	int first = 1;
+	RefList *out;
+	int flags = REFLIST_ARENA | REFLIST_NO_LOCKS;
+
+	if ( lean ) flags |= REFLIST_LEAN;
+	out = reflist_new_with_flags(flags);
+	if ( out == NULL ) {
+		ERROR("Failed to allocate reflection list\n");
+		return NULL;
+	}
+
+	do {
+
+		char line[1024];
+		signed int h, k, l;
+		float intensity, sigma, fs, ss, pk, bg;
+		char pname[64];
+		int r;
+
+		rval = stream_gets(st, line, 1023);
+		st->ln++;
+		if ( rval == NULL ) continue;
+		chomp(line);
+
+		if ( strcmp(line, STREAM_REFLECTION_END_MARKER) == 0 ) return out;
+
+		r = parse_reflection_line(line, &h, &k, &l, &intensity, &sigma,
+		                          &pk, &bg, &fs, &ss, pname);
+
+		if ( (r != 10) && (!first) ) {
+			reflist_free(out);
+			return NULL;
+		}
+
+		first = 0;
+
+		if ( (r == 10) && refl_cut_keep(cut, h, k, l, pk) ) {
+
+			Reflection *refl;
+			refl = add_refl(out, h, k, l);
+			if ( refl == NULL ) {
+				ERROR("Failed to add reflection\n");
+				return NULL;
+			}
+			set_intensity(refl, intensity);
+			if ( st->dtempl_read != NULL ) {
+				int pn;
+
+				if ( panel_name_to_number(st, pname, &pn) )
+				{
+					ERROR("No such panel '%s'\n", pname);
+				} else {
+					if ( data_template_file_to_panel_coords(st->dtempl_read, &fs, &ss, pn) ) {
+						ERROR("Failed to convert\n");
+					} else {
+						set_detector_pos(refl, fs, ss);
+						set_panel_number(refl, pn);
+					}
+				}
 			}
+			set_esd_intensity(refl, sigma);
+			set_peak(refl, pk);
+			set_mean_bg(refl, bg);
+			set_redundancy(refl, 1);
+			set_symmetric_indices(refl, h, k, l);
+			set_kpred(refl, kpred);
 		}
 
-		if ( strncmp(line, "num_saturated_reflections = ", 28) == 0 ) {
-			int nsat = atoi(line+28);
-			crystal_set_num_saturated_reflections(cr, nsat);
-		}
+	} while ( rval != NULL );
+
+	/* Got read error of some kind before finding STREAM_PEAK_LIST_END_MARKER */
+	return NULL;
+}
+
+
+static int write_stream_reflections(FILE *fh, RefList *list,
+                                    const DataTemplate *dtempl)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+
+	fprintf(fh, "   h    k    l          I   sigma(I)       "
+	            "peak background  fs/px  ss/px panel\n");
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+
+		signed int h, k, l;
+		double intensity, esd_i, pk, bg;
+		double dfs, dss;
+		float fs, ss;
+		int pn;
+
+		get_indices(refl, &h, &k, &l);
+		get_detector_pos(refl, &dfs, &dss);
+		fs = dfs;  ss = dss;
+		pn = get_panel_number(refl);
+		intensity = get_intensity(refl);
+		esd_i = get_esd_intensity(refl);
+		pk = get_peak(refl);
+		bg = get_mean_bg(refl);
+
+		/* Reflections with redundancy = 0 are not written */
+		if ( get_redundancy(refl) == 0 ) continue;
+
+		data_template_panel_to_file_coords(dtempl, pn,
+		                                   &fs, &ss);
+
+		fprintf(fh, "%4i %4i %4i %10.2f %10.2f %10.2f %10.2f "
+		        "%6.1f %6.1f %s\n",
+		        h, k, l, intensity, esd_i, pk, bg,
+		        fs, ss, data_template_panel_number_to_name(dtempl, pn));
+
+	}
+	return 0;
+}
+
+
+static int num_integrated_reflections(RefList *list)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	int n = 0;
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		if ( get_redundancy(refl) > 0 ) n++;
+	}
+
+	return n;
+}
+
+
+static int write_crystal(Stream *st, Crystal *cr, RefList *reflist)
+{
+	UnitCell *cell;
+	double asx, asy, asz;
+	double bsx, bsy, bsz;
+	double csx, csy, csz;
+	double a, b, c, al, be, ga;
+	double rad;
+	double det_shift_x, det_shift_y;
+	int ret = 0;
+
+	fprintf(st->fh, STREAM_CRYSTAL_START_MARKER"\n");
+
+	cell = crystal_get_cell(cr);
+	assert(cell != NULL);
+
+	cell_get_parameters(cell, &a, &b, &c, &al, &be, &ga);
+	fprintf(st->fh, "Cell parameters %7.5f %7.5f %7.5f nm,"
+			" %7.5f %7.5f %7.5f deg\n",
+			a*1.0e9, b*1.0e9, c*1.0e9,
+			rad2deg(al), rad2deg(be), rad2deg(ga));
+
+	cell_get_reciprocal(cell, &asx, &asy, &asz,
+				  &bsx, &bsy, &bsz,
+				  &csx, &csy, &csz);
+	fprintf(st->fh, "astar = %+9.7f %+9.7f %+9.7f nm^-1\n",
+	        asx/1e9, asy/1e9, asz/1e9);
+	fprintf(st->fh, "bstar = %+9.7f %+9.7f %+9.7f nm^-1\n",
+	        bsx/1e9, bsy/1e9, bsz/1e9);
+	fprintf(st->fh, "cstar = %+9.7f %+9.7f %+9.7f nm^-1\n",
+		csx/1e9, csy/1e9, csz/1e9);
+
+	fprintf(st->fh, "lattice_type = %s\n",
+		str_lattice(cell_get_lattice_type(cell)));
+	fprintf(st->fh, "centering = %c\n", cell_get_centering(cell));
+	fprintf(st->fh, "unique_axis = %c\n", cell_get_unique_axis(cell));
+
+	rad = crystal_get_profile_radius(cr);
+	fprintf(st->fh, "profile_radius = %.5f nm^-1\n", rad/1e9);
+
+	if ( crystal_get_notes(cr) != NULL ) {
+		fprintf(st->fh, "%s\n", crystal_get_notes(cr));
+	}
+
+	crystal_get_det_shift(cr, &det_shift_x, &det_shift_y);
+
+	fprintf(st->fh, "predict_refine/det_shift x = %.3f y = %.3f mm\n",
+	        det_shift_x*1e3, det_shift_y*1e3);
+
+	if ( reflist != NULL ) {
+
+		fprintf(st->fh, "diffraction_resolution_limit"
+				" = %.2f nm^-1 or %.2f A\n",
+				crystal_get_resolution_limit(cr)/1e9,
+				1e10 / crystal_get_resolution_limit(cr));
+
+		fprintf(st->fh, "num_reflections = %i\n",
+		                num_integrated_reflections(reflist));
+		fprintf(st->fh, "num_saturated_reflections = %lli\n",
+		                crystal_get_num_saturated_reflections(cr));
+		fprintf(st->fh, "num_implausible_reflections = %lli\n",
+		                crystal_get_num_implausible_reflections(cr));
+
+	}
+
+	if ( reflist != NULL ) {
+
+		fprintf(st->fh, STREAM_REFLECTION_START_MARKER"\n");
+		ret = write_stream_reflections(st->fh, reflist,
+		                               st->dtempl_write);
+		fprintf(st->fh, STREAM_REFLECTION_END_MARKER"\n");
+
+	} else {
+
+		fprintf(st->fh, "No integrated reflections.\n");
+
+	}
+
+	fprintf(st->fh, STREAM_CRYSTAL_END_MARKER"\n");
+
+	return ret;
+}
+
+
+static char *make_key(const char *filename,
+                      const char *ev)
+{
+	char *key;
+
+	if ( ev == NULL ) ev = "//";
+
+	key = cfmalloc(strlen(filename)+strlen(ev)+2);
+	if ( key == NULL ) return NULL;
+
+	strcpy(key, filename);
+	strcat(key, " ");
+	strcat(key, ev);
+
+	return key;
+}
+
+
+/* Binary stream format
+ *
+ * The header is the same text as in a normal stream (audit information,
+ * geometry file and target unit cell), except that the first line is
+ * STREAM_BINARY_MARKER.  It ends with STREAM_BINARY_START_MARKER, after which
+ * come the chunks.  Each chunk is a record consisting of BIN_CHUNK_MAGIC, the
+ * compression method, the stored length and the uncompressed length, followed
+ * by the (possibly compressed) contents.  Within a chunk, the peaks and
+ * reflections are stored as tables, one column after the other, in panel
+ * coordinates.  All numbers are little-endian.
+ *
+ * When the stream is closed, an index is written after the last chunk:
+ * BIN_INDEX_MAGIC, the number of chunks and the offset and key (see
+ * make_key()) of each chunk.  The last twelve bytes of the file are the
+ * offset of the index followed by BIN_END_MAGIC.  If the index is missing,
+ * e.g. because the writer crashed, the chunks can still be read in order.
+ */
+
+#define BIN_CHUNK_MAGIC "CFBC"
+#define BIN_INDEX_MAGIC "CFBI"
+#define BIN_END_MAGIC "CFBE"
+#define BIN_COMPRESS_NONE (0)
+#define BIN_COMPRESS_ZLIB (1)
+#define BIN_MAX_CHUNK (1024*1024*1024)
+#define BIN_PEAK_COLS (4)
+#define BIN_REFL_COLS (10)
+
+struct bin_buf
+{
+	unsigned char *data;
+	size_t len;
+	size_t max;
+	int err;
+};
+
+
+struct bin_rd
+{
+	const unsigned char *data;
+	size_t len;
+	size_t pos;
+	int err;
+};
+
+
+static void set_f32(unsigned char *p, float v)
+{
+	uint32_t u;
+	memcpy(&u, &v, 4);
+	set_u32(p, u);
+}
+
+
+static float get_f32(const unsigned char *p)
+{
+	uint32_t u = get_u32(p);
+	float v;
+	memcpy(&v, &u, 4);
+	return v;
+}
+
+
+static uint64_t get_u64(const unsigned char *p)
+{
+	return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p+4) << 32);
+}
+
+
+/* Address of row j of column c in a table of n rows */
+static unsigned char *col(unsigned char *p, int c, uint32_t n, uint32_t j)
+{
+	return p + 4*((size_t)c*n + j);
+}
+
+
+static const unsigned char *ccol(const unsigned char *p, int c,
+                                 uint32_t n, uint32_t j)
+{
+	return p + 4*((size_t)c*n + j);
+}
+
+
+/* Returns space for 'n' more bytes at the end of the buffer */
+static unsigned char *bb_extend(struct bin_buf *b, size_t n)
+{
+	unsigned char *p;
+
+	if ( b->err ) return NULL;
+
+	if ( b->len + n > b->max ) {
+		size_t nmax = 2*(b->len + n) + 4096;
+		unsigned char *ndata = cfrealloc(b->data, nmax);
+		if ( ndata == NULL ) {
+			b->err = 1;
+			return NULL;
+		}
+		b->data = ndata;
+		b->max = nmax;
+	}
+
+	p = b->data + b->len;
+	b->len += n;
+	return p;
+}
+
+
+static void bb_u32(struct bin_buf *b, uint32_t v)
+{
+	unsigned char *p = bb_extend(b, 4);
+	if ( p != NULL ) set_u32(p, v);
+}
+
+
+static void bb_u64(struct bin_buf *b, uint64_t v)
+{
+	bb_u32(b, v & 0xffffffff);
+	bb_u32(b, v >> 32);
+}
+
+
+static void bb_f64(struct bin_buf *b, double v)
+{
+	uint64_t u;
+	memcpy(&u, &v, 8);
+	bb_u64(b, u);
+}
+
+
+static void bb_magic(struct bin_buf *b, const char *magic)
+{
+	unsigned char *p = bb_extend(b, 4);
+	if ( p != NULL ) memcpy(p, magic, 4);
+}
+
+
+/* NULL is stored as length 0xffffffff */
+static void bb_str(struct bin_buf *b, const char *s)
+{
+	size_t len;
+	unsigned char *p;
+
+	if ( s == NULL ) {
+		bb_u32(b, 0xffffffff);
+		return;
+	}
+
+	len = strlen(s);
+	bb_u32(b, len);
+	p = bb_extend(b, len);
+	if ( p != NULL ) memcpy(p, s, len);
+}
+
+
+static const unsigned char *rd_take(struct bin_rd *r, size_t n)
+{
+	const unsigned char *p;
+
+	if ( r->err || (n > r->len - r->pos) ) {
+		r->err = 1;
+		return NULL;
+	}
+
+	p = r->data + r->pos;
+	r->pos += n;
+	return p;
+}
+
+
+static uint32_t rd_u32(struct bin_rd *r)
+{
+	const unsigned char *p = rd_take(r, 4);
+	if ( p == NULL ) return 0;
+	return get_u32(p);
+}
+
+
+static uint64_t rd_u64(struct bin_rd *r)
+{
+	const unsigned char *p = rd_take(r, 8);
+	if ( p == NULL ) return 0;
+	return get_u64(p);
+}
+
+
+static double rd_f64(struct bin_rd *r)
+{
+	uint64_t u = rd_u64(r);
+	double v;
+	memcpy(&v, &u, 8);
+	return v;
+}
+
+
+static char *rd_str(struct bin_rd *r)
+{
+	uint32_t len;
+	const unsigned char *p;
+	char *s;
+
+	len = rd_u32(r);
+	if ( r->err || (len == 0xffffffff) ) return NULL;
+
+	p = rd_take(r, len);
+	if ( p == NULL ) return NULL;
+
+	s = cfmalloc(len+1);
+	if ( s == NULL ) {
+		r->err = 1;
+		return NULL;
+	}
+	memcpy(s, p, len);
+	s[len] = '\0';
+	return s;
+}
+
+
+static void bin_write_peaks(struct bin_buf *b, ImageFeatureList *features)
+{
+	int i;
+	uint32_t n = 0;
+	uint32_t j = 0;
+	unsigned char *p;
+
+	for ( i=0; i<image_feature_count(features); i++ ) {
+		if ( image_get_feature(features, i) != NULL ) n++;
+	}
+
+	bb_u32(b, n);
+	p = bb_extend(b, 4*BIN_PEAK_COLS*(size_t)n);
+	if ( p == NULL ) return;
+
+	for ( i=0; i<image_feature_count(features); i++ ) {
+		struct imagefeature *f = image_get_feature(features, i);
+		if ( f == NULL ) continue;
+		set_f32(col(p, 0, n, j), f->fs);
+		set_f32(col(p, 1, n, j), f->ss);
+		set_f32(col(p, 2, n, j), f->intensity);
+		set_u32(col(p, 3, n, j), f->pn);
+		j++;
+	}
+}
+
+
+static ImageFeatureList *bin_read_peaks(const unsigned char *p, uint32_t n)
+{
+	ImageFeatureList *features;
+	uint32_t j;
+
+	features = image_feature_list_new();
+	if ( features == NULL ) return NULL;
+
+	for ( j=0; j<n; j++ ) {
+		image_add_feature(features,
+		                  get_f32(ccol(p, 0, n, j)),
+		                  get_f32(ccol(p, 1, n, j)),
+		                  (int32_t)get_u32(ccol(p, 3, n, j)),
+		                  get_f32(ccol(p, 2, n, j)), NULL);
+	}
+
+	return features;
+}
+
+
+static void bin_write_reflections(struct bin_buf *b, RefList *list)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	uint32_t n;
+	uint32_t j = 0;
+	unsigned char *p;
+
+	n = num_integrated_reflections(list);
+	bb_u32(b, n);
+	p = bb_extend(b, 4*BIN_REFL_COLS*(size_t)n);
+	if ( p == NULL ) return;
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		double fs, ss;
+
+		/* Reflections with redundancy = 0 are not written */
+		if ( get_redundancy(refl) == 0 ) continue;
+
+		get_indices(refl, &h, &k, &l);
+		get_detector_pos(refl, &fs, &ss);
+
+		set_u32(col(p, 0, n, j), h);
+		set_u32(col(p, 1, n, j), k);
+		set_u32(col(p, 2, n, j), l);
+		set_f32(col(p, 3, n, j), get_intensity(refl));
+		set_f32(col(p, 4, n, j), get_esd_intensity(refl));
+		set_f32(col(p, 5, n, j), get_peak(refl));
+		set_f32(col(p, 6, n, j), get_mean_bg(refl));
+		set_f32(col(p, 7, n, j), fs);
+		set_f32(col(p, 8, n, j), ss);
+		set_u32(col(p, 9, n, j), get_panel_number(refl));
+		j++;
+	}
+}
+
+
+static RefList *bin_read_reflections(const unsigned char *p, uint32_t n,
+                                     double kpred, int lean,
+                                     const struct refl_cut *cut)
+{
+	RefList *out;
+	uint32_t j;
+	int flags = REFLIST_ARENA | REFLIST_NO_LOCKS;
+
+	if ( lean ) flags |= REFLIST_LEAN;
+	out = reflist_new_with_flags(flags);
+	if ( out == NULL ) {
+		ERROR("Failed to allocate reflection list\n");
+		return NULL;
+	}
+
+	for ( j=0; j<n; j++ ) {
+
+		Reflection *refl;
+		signed int h, k, l;
+
+		h = (int32_t)get_u32(ccol(p, 0, n, j));
+		k = (int32_t)get_u32(ccol(p, 1, n, j));
+		l = (int32_t)get_u32(ccol(p, 2, n, j));
+
+		if ( !refl_cut_keep(cut, h, k, l, get_f32(ccol(p, 5, n, j))) ) {
+			continue;
+		}
+
+		refl = add_refl(out, h, k, l);
+		if ( refl == NULL ) {
+			ERROR("Failed to add reflection\n");
+			reflist_free(out);
+			return NULL;
+		}
+		set_intensity(refl, get_f32(ccol(p, 3, n, j)));
+		set_esd_intensity(refl, get_f32(ccol(p, 4, n, j)));
+		set_peak(refl, get_f32(ccol(p, 5, n, j)));
+		set_mean_bg(refl, get_f32(ccol(p, 6, n, j)));
+		set_detector_pos(refl, get_f32(ccol(p, 7, n, j)),
+		                 get_f32(ccol(p, 8, n, j)));
+		set_panel_number(refl, (int32_t)get_u32(ccol(p, 9, n, j)));
+		set_redundancy(refl, 1);
+		set_symmetric_indices(refl, h, k, l);
+		set_kpred(refl, kpred);
+	}
+
+	return out;
+}
+
+
+static void bin_write_crystal(struct bin_buf *b, Crystal *cr, RefList *reflist)
+{
+	UnitCell *cell;
+	double asx, asy, asz;
+	double bsx, bsy, bsz;
+	double csx, csy, csz;
+	double shift_x, shift_y;
+
+	cell = crystal_get_cell(cr);
+	assert(cell != NULL);
+
+	cell_get_reciprocal(cell, &asx, &asy, &asz,
+	                          &bsx, &bsy, &bsz,
+	                          &csx, &csy, &csz);
+	bb_f64(b, asx);  bb_f64(b, asy);  bb_f64(b, asz);
+	bb_f64(b, bsx);  bb_f64(b, bsy);  bb_f64(b, bsz);
+	bb_f64(b, csx);  bb_f64(b, csy);  bb_f64(b, csz);
+	bb_u32(b, cell_get_lattice_type(cell));
+	bb_u32(b, cell_get_centering(cell));
+	bb_u32(b, cell_get_unique_axis(cell));
+
+	crystal_get_det_shift(cr, &shift_x, &shift_y);
+	bb_f64(b, crystal_get_profile_radius(cr));
+	bb_f64(b, crystal_get_resolution_limit(cr));
+	bb_f64(b, shift_x);
+	bb_f64(b, shift_y);
+	bb_u64(b, crystal_get_num_saturated_reflections(cr));
+	bb_u64(b, crystal_get_num_implausible_reflections(cr));
+	bb_str(b, crystal_get_notes(cr));
+
+	bb_u32(b, reflist != NULL);
+	if ( reflist != NULL ) bin_write_reflections(b, reflist);
+}
+
+
+static int bin_read_crystal(const Stream *st, struct bin_rd *r,
+                            struct image *image, StreamFlags srf)
+{
+	struct rvec as, bs, cs;
+	LatticeType lattice_type;
+	char centering, unique_axis;
+	double rad, lim, shift_x, shift_y;
+	long long int n_sat, n_impl;
+	char *notes;
+	uint32_t n_refls = 0;
+	const unsigned char *refls = NULL;
+	UnitCell *cell;
+	Crystal *cr;
+	RefList *reflist = NULL;
+
+	as.u = rd_f64(r);  as.v = rd_f64(r);  as.w = rd_f64(r);
+	bs.u = rd_f64(r);  bs.v = rd_f64(r);  bs.w = rd_f64(r);
+	cs.u = rd_f64(r);  cs.v = rd_f64(r);  cs.w = rd_f64(r);
+	lattice_type = rd_u32(r);
+	centering = rd_u32(r);
+	unique_axis = rd_u32(r);
+	rad = rd_f64(r);
+	lim = rd_f64(r);
+	shift_x = rd_f64(r);
+	shift_y = rd_f64(r);
+	n_sat = rd_u64(r);
+	n_impl = rd_u64(r);
+	notes = rd_str(r);
+	if ( rd_u32(r) ) {
+		n_refls = rd_u32(r);
+		refls = rd_take(r, 4*BIN_REFL_COLS*(size_t)n_refls);
+	}
+
+	if ( r->err ) {
+		cffree(notes);
+		return 1;
+	}
+
+	cr = crystal_new();
+	cell = cell_new_from_reciprocal_axes(as, bs, cs);
+	if ( (cr == NULL) || (cell == NULL) ) {
+		ERROR("Failed to allocate crystal!\n");
+		crystal_free(cr);
+		cell_free(cell);
+		cffree(notes);
+		return 1;
+	}
+	cell_set_centering(cell, centering);
+	cell_set_unique_axis(cell, unique_axis);
+	cell_set_lattice_type(cell, lattice_type);
+	crystal_set_cell(cr, cell);
+
+	crystal_set_profile_radius(cr, rad);
+	crystal_set_resolution_limit(cr, lim);
+	crystal_set_det_shift(cr, shift_x, shift_y);
+	crystal_set_num_saturated_reflections(cr, n_sat);
+	crystal_set_num_implausible_reflections(cr, n_impl);
+	if ( notes != NULL ) crystal_set_notes(cr, notes);
+	cffree(notes);
+
+	/* Unused at the moment */
+	crystal_set_mosaicity(cr, 0.0);
+
+	if ( (refls != NULL)
+	  && (srf & (STREAM_REFLECTIONS | STREAM_DEFER_REFLECTIONS))
+	  && !refl_cut_crystal(st, lim) )
+	{
+		struct refl_cut cut;
+		refl_cut_init(st, &cut, cell, lim);
+		reflist = bin_read_reflections(refls, n_refls,
+		                               1.0/image->lambda,
+		                               srf & STREAM_LEAN_REFLECTIONS,
+		                               &cut);
+		if ( reflist == NULL ) {
+			ERROR("Failed while reading reflections\n");
+			ERROR("Filename = %s\n", image->filename);
+			ERROR("Event = %s\n", image->ev);
+		}
+	}
+
+	image_add_crystal_refls(image, cr, reflist);
+	return 0;
+}
+
+
+static void bin_encode_chunk(struct bin_buf *b, const struct image *i,
+                             StreamFlags srf)
+{
+	char *indexer;
+	int j;
+	uint32_t n_crystals = 0;
+
+	bb_str(b, i->filename);
+	bb_str(b, i->ev);
+	bb_u32(b, i->serial);
+	bb_u32(b, i->hit);
+	indexer = indexer_str(i->indexed_by);
+	bb_str(b, indexer);
+	cffree(indexer);
+	bb_u32(b, i->n_indexing_tries);
+	bb_f64(b, i->lambda);
+	bb_f64(b, i->div);
+	bb_f64(b, i->bw);
+	bb_f64(b, i->peak_resolution);
+
+	bb_u32(b, i->n_cached_headers);
+	for ( j=0; j<i->n_cached_headers; j++ ) {
+		struct header_cache_entry *ce = i->header_cache[j];
+		bb_u32(b, ce->type);
+		bb_str(b, ce->header_name);
+		switch ( ce->type ) {
+
+			case HEADER_FLOAT:
+			bb_f64(b, ce->val_float);
+			break;
+
+			case HEADER_INT:
+			bb_u32(b, ce->val_int);
+			break;
+
+			case HEADER_STR:
+			bb_str(b, ce->val_str);
+			break;
+
+			default:
+			ERROR("Unrecognised header cache type %i\n", ce->type);
+			b->err = 1;
+			break;
+
+		}
+	}
+
+	bb_u32(b, (srf & STREAM_PEAKS) != 0);
+	if ( srf & STREAM_PEAKS ) bin_write_peaks(b, i->features);
+
+	for ( j=0; j<i->n_crystals; j++ ) {
+		if ( !crystal_get_user_flag(i->crystals[j].cr) ) n_crystals++;
+	}
+	bb_u32(b, n_crystals);
+	for ( j=0; j<i->n_crystals; j++ ) {
+		if ( crystal_get_user_flag(i->crystals[j].cr) ) continue;
+		bin_write_crystal(b, i->crystals[j].cr,
+		                  srf & STREAM_REFLECTIONS ? i->crystals[j].refls : NULL);
+	}
+}
+
+
+/* Sets up the things which are not stored in the stream.
+ * Frees the image and returns non-zero on error. */
+static int finish_chunk(Stream *st, struct image *image, StreamFlags srf)
+{
+	if ( srf & STREAM_DATA_DETGEOM ) {
+		image->detgeom = create_detgeom(image, st->dtempl_read, 0);
+		if ( image->detgeom == NULL ) {
+			image_free(image);
+			return 1;
+		}
+		image_create_dp_bad(image, st->dtempl_read);
+		image_set_zero_data(image, st->dtempl_read);
+	}
+	image->spectrum = spectrum_generate_gaussian(image->lambda,
+	                                             image->bw);
+	return 0;
+}
+
+
+static struct image *bin_decode_chunk(Stream *st, const unsigned char *data,
+                                      size_t len, StreamFlags srf)
+{
+	struct bin_rd r;
+	struct image *image;
+	char *indexer;
+	uint32_t n_headers, n_crystals, j;
+
+	r.data = data;
+	r.len = len;
+	r.pos = 0;
+	r.err = 0;
+
+	image = image_new();
+	if ( image == NULL ) return NULL;
+
+	image->data_source_type = DATA_SOURCE_TYPE_NONE;
+
+	image->filename = rd_str(&r);
+	image->ev = rd_str(&r);
+	image->serial = rd_u32(&r);
+	image->hit = rd_u32(&r);
+	indexer = rd_str(&r);
+	if ( indexer != NULL ) {
+		int err = 0;
+		image->indexed_by = get_indm_from_string_2(indexer, &err);
+		if ( image->indexed_by == INDEXING_ERROR ) {
+			ERROR("Failed to read indexer list\n");
+		}
+		if ( err ) {
+			st->old_indexers = 1;
+		}
+		cffree(indexer);
+	}
+	image->n_indexing_tries = rd_u32(&r);
+	image->lambda = rd_f64(&r);
+	image->div = rd_f64(&r);
+	image->bw = rd_f64(&r);
+	image->peak_resolution = rd_f64(&r);
+
+	n_headers = rd_u32(&r);
+	for ( j=0; (j<n_headers) && !r.err; j++ ) {
+
+		HeaderCacheType type = rd_u32(&r);
+		char *name = rd_str(&r);
+		double vf;
+		int vi;
+		char *vs;
+
+		if ( name == NULL ) {
+			r.err = 1;
+			break;
+		}
+
+		switch ( type ) {
+
+			case HEADER_FLOAT:
+			vf = rd_f64(&r);
+			if ( !r.err ) image_cache_header_float(image, name, vf);
+			break;
+
+			case HEADER_INT:
+			vi = (int32_t)rd_u32(&r);
+			if ( !r.err ) image_cache_header_int(image, name, vi);
+			break;
+
+			case HEADER_STR:
+			vs = rd_str(&r);
+			if ( !r.err ) image_cache_header_str(image, name, vs);
+			cffree(vs);
+			break;
+
+			default:
+			r.err = 1;
+			break;
+		}
+		cffree(name);
+	}
+
+	if ( rd_u32(&r) ) {
+		uint32_t n = rd_u32(&r);
+		const unsigned char *p = rd_take(&r, 4*BIN_PEAK_COLS*(size_t)n);
+		if ( (p != NULL) && (srf & STREAM_PEAKS) ) {
+			image->features = bin_read_peaks(p, n);
+		}
+	}
+
+	n_crystals = rd_u32(&r);
+	for ( j=0; (j<n_crystals) && !r.err; j++ ) {
+		if ( bin_read_crystal(st, &r, image, srf) ) break;
+	}
+
+	if ( r.err || (image->filename == NULL) ) {
+		ERROR("Corrupted chunk in binary stream.\n");
+		image_free(image);
+		return NULL;
+	}
+
+	if ( finish_chunk(st, image, srf) ) return NULL;
+	return image;
+}
+
+
+/* Reads the record at the current position of 'fh', and returns its
+ * uncompressed contents.  Sets 'pend' if the end of the chunks was reached,
+ * including at an incomplete chunk at the end of the file. */
+static unsigned char *read_binary_record(FILE *fh, size_t *plen, int *pend)
+{
+	unsigned char hdr[16];
+	uint32_t method, stored_len, raw_len;
+	unsigned char *stored;
+
+	*pend = 0;
+
+	if ( fread(hdr, 1, 4, fh) != 4 ) {
+		*pend = feof(fh);
+		return NULL;
+	}
+
+	if ( memcmp(hdr, BIN_INDEX_MAGIC, 4) == 0 ) {
+		*pend = 1;
+		return NULL;
+	}
+
+	if ( memcmp(hdr, BIN_CHUNK_MAGIC, 4) != 0 ) {
+		ERROR("Invalid chunk in binary stream.\n");
+		return NULL;
+	}
+
+	if ( fread(hdr+4, 1, 12, fh) != 12 ) {
+		*pend = feof(fh);
+		return NULL;
+	}
+
+	method = get_u32(hdr+4);
+	stored_len = get_u32(hdr+8);
+	raw_len = get_u32(hdr+12);
+	if ( (stored_len > BIN_MAX_CHUNK) || (raw_len > BIN_MAX_CHUNK) ) {
+		ERROR("Invalid chunk in binary stream.\n");
+		return NULL;
+	}
+
+	stored = cfmalloc(stored_len);
+	if ( stored == NULL ) return NULL;
+
+	if ( fread(stored, 1, stored_len, fh) != stored_len ) {
+		*pend = feof(fh);
+		cffree(stored);
+		return NULL;
+	}
+
+	if ( method == BIN_COMPRESS_NONE ) {
+		*plen = stored_len;
+		return stored;
+	}
+
+	#ifdef HAVE_ZLIB
+	if ( method == BIN_COMPRESS_ZLIB ) {
+
+		unsigned char *raw;
+		uLongf len = raw_len;
+
+		raw = cfmalloc(raw_len);
+		if ( raw == NULL ) {
+			cffree(stored);
+			return NULL;
+		}
+
+		if ( (uncompress(raw, &len, stored, stored_len) != Z_OK)
+		  || (len != raw_len) )
+		{
+			ERROR("Failed to decompress chunk.\n");
+			cffree(raw);
+			cffree(stored);
+			return NULL;
+		}
+
+		cffree(stored);
+		*plen = raw_len;
+		return raw;
+
+	}
+	#endif
+
+	ERROR("Unsupported compression method %i in binary stream.\n",
+	      method);
+	cffree(stored);
+	return NULL;
+}
+
+
+static struct image *read_binary_chunk(Stream *st, StreamFlags srf)
+{
+	unsigned char *data;
+	size_t len;
+	struct image *image;
+
+	data = read_binary_record(st->fh, &len, &st->binary_end);
+	if ( data == NULL ) return NULL;
+
+	image = bin_decode_chunk(st, data, len, srf);
+	cffree(data);
+	return image;
+}
+
+
+static void add_chunk_record(Stream *st, long pos, char *key)
+{
+	if ( key == NULL ) return;
+
+	if ( st->n_chunks == st->max_chunks ) {
+
+		int new_max = st->max_chunks + 1024;
+		long *new_offsets;
+		char **new_keys;
+
+		new_offsets = cfrealloc(st->chunk_offsets,
+		                        new_max*sizeof(long));
+		if ( new_offsets == NULL ) return;
+		st->chunk_offsets = new_offsets;
+
+		new_keys = cfrealloc(st->chunk_keys, new_max*sizeof(char *));
+		if ( new_keys == NULL ) return;
+		st->chunk_keys = new_keys;
+
+		st->max_chunks = new_max;
+	}
+
+	st->chunk_offsets[st->n_chunks] = pos;
+	st->chunk_keys[st->n_chunks] = key;
+	st->n_chunks++;
+}
+
+
+static void start_binary_chunks(Stream *st)
+{
+	if ( st->binary_started ) return;
+	fprintf(st->fh, STREAM_BINARY_START_MARKER"\n");
+	st->binary_started = 1;
+}
+
+
+static int write_binary_chunk(Stream *st, const struct image *i,
+                              StreamFlags srf)
+{
+	struct bin_buf b = {NULL, 0, 0, 0};
+	unsigned char hdr[16];
+	unsigned char *out;
+	size_t out_len;
+	uint32_t method = BIN_COMPRESS_NONE;
+	unsigned char *zbuf = NULL;
+	long pos;
+	int ret = 0;
+
+	bin_encode_chunk(&b, i, srf);
+	if ( b.err || (b.len > BIN_MAX_CHUNK) ) {
+		ERROR("Failed to encode chunk for binary stream.\n");
+		cffree(b.data);
+		return 1;
+	}
+
+	out = b.data;
+	out_len = b.len;
+
+	#ifdef HAVE_ZLIB
+	uLongf zlen = compressBound(b.len);
+	zbuf = cfmalloc(zlen);
+	if ( (zbuf != NULL)
+	  && (compress2(zbuf, &zlen, b.data, b.len, Z_BEST_SPEED) == Z_OK)
+	  && (zlen < b.len) )
+	{
+		out = zbuf;
+		out_len = zlen;
+		method = BIN_COMPRESS_ZLIB;
+	}
+	#endif
+
+	start_binary_chunks(st);
+	pos = ftell(st->fh);
+
+	memcpy(hdr, BIN_CHUNK_MAGIC, 4);
+	set_u32(hdr+4, method);
+	set_u32(hdr+8, out_len);
+	set_u32(hdr+12, b.len);
+
+	if ( (fwrite(hdr, 1, 16, st->fh) != 16)
+	  || (fwrite(out, 1, out_len, st->fh) != out_len) )
+	{
+		ERROR("Failed to write chunk to binary stream.\n");
+		ret = 1;
+	} else {
+		add_chunk_record(st, pos, make_key(i->filename, i->ev));
+	}
+
+	fflush(st->fh);
+	cffree(zbuf);
+	cffree(b.data);
+	return ret;
+}
+
+
+static void write_binary_index(Stream *st)
+{
+	struct bin_buf b = {NULL, 0, 0, 0};
+	long pos;
+	int i;
+
+	start_binary_chunks(st);
+	fflush(st->fh);
+	pos = ftell(st->fh);
+
+	bb_magic(&b, BIN_INDEX_MAGIC);
+	bb_u32(&b, st->n_chunks);
+	for ( i=0; i<st->n_chunks; i++ ) {
+		bb_u64(&b, st->chunk_offsets[i]);
+		bb_str(&b, st->chunk_keys[i]);
+	}
+	bb_u64(&b, pos);
+	bb_magic(&b, BIN_END_MAGIC);
+
+	if ( b.err || (fwrite(b.data, 1, b.len, st->fh) != b.len) ) {
+		ERROR("Failed to write binary stream index.\n");
+	}
+	cffree(b.data);
+}
+
+
+/* Moves past the text header of a binary stream, to the first chunk */
+static int find_binary_start(FILE *fh, long long int *pln)
+{
+	char line[1024];
+
+	do {
+		if ( fgets(line, 1023, fh) == NULL ) return 1;
+		if ( pln != NULL ) (*pln)++;
+		chomp(line);
+	} while ( strcmp(line, STREAM_BINARY_START_MARKER) != 0 );
+
+	return 0;
+}
+
+
+/**
+ * \param st A \ref Stream
+ * \param i An \ref image structure
+ * \param srf A \ref StreamFlags enum saying what to write
+ *
+ * Writes a new chunk to \p st.
+ *
+ * \returns non-zero on error.
+ */
+int stream_write_chunk(Stream *st, const struct image *i,
+                       StreamFlags srf)
+{
+	int j;
+	char *indexer;
+	int ret = 0;
+
+	if ( st->binary_write ) return write_binary_chunk(st, i, srf);
+
+	/* Each chunk of a compressed stream gets its own frame */
+	if ( flush_mem_output(st) ) return 1;
+
+	fprintf(st->fh, STREAM_CHUNK_START_MARKER"\n");
+
+	fprintf(st->fh, "Image filename: %s\n", i->filename);
+	fprintf(st->fh, "Event: %s\n", i->ev);
+	fprintf(st->fh, "Image serial number: %i\n", i->serial);
+
+	fprintf(st->fh, "hit = %i\n", i->hit);
+	indexer = indexer_str(i->indexed_by);
+	fprintf(st->fh, "indexed_by = %s\n", indexer);
+	cffree(indexer);
+	if ( i->indexed_by != INDEXING_NONE ) {
+		fprintf(st->fh, "n_indexing_tries = %i\n", i->n_indexing_tries);
+	}
+
+	fprintf(st->fh, "photon_energy_eV = %f\n",
+	        J_to_eV(ph_lambda_to_en(i->lambda)));
+
+	fprintf(st->fh, "beam_divergence = %.2e rad\n", i->div);
+	fprintf(st->fh, "beam_bandwidth = %.2e (fraction)\n", i->bw);
+
+	for ( j=0; j<i->n_cached_headers; j++ ) {
+		struct header_cache_entry *ce = i->header_cache[j];
+		switch ( ce->type ) {
+
+			case HEADER_FLOAT:
+			fprintf(st->fh, "header/float/%s = %f\n",
+			        ce->header_name, ce->val_float);
+			break;
+
+			case HEADER_INT:
+			fprintf(st->fh, "header/int/%s = %i\n",
+			        ce->header_name, ce->val_int);
+			break;
+
+			case HEADER_STR:
+			fprintf(st->fh, "header/str/%s = %s\n",
+			        ce->header_name, ce->val_str);
+			break;
+
+			default:
+			ERROR("Unrecognised header cache type %i\n", ce->type);
+			break;
+
+		}
+	}
+
+	if ( i->detgeom != NULL ) {
+
+		int pn;
+		double tclen = 0.0;
+
+		for ( pn=0; pn<i->detgeom->n_panels; pn++ ) {
+			tclen += i->detgeom->panels[pn].cnz
+				* i->detgeom->panels[pn].pixel_pitch;
+		}
+		fprintf(st->fh, "average_camera_length = %f m\n",
+		        tclen / i->detgeom->n_panels);
+
+	}
+
+	fprintf(st->fh, "num_peaks = %i\n", image_feature_count(i->features));
+	fprintf(st->fh, "peak_resolution = %f nm^-1 or %f A\n",
+	        i->peak_resolution/1e9, 1e10/i->peak_resolution);
+	if ( srf & STREAM_PEAKS ) {
+		ret = write_peaks(i, st->dtempl_write, st->fh);
+	}
+
+	for ( j=0; j<i->n_crystals; j++ ) {
+		if ( crystal_get_user_flag(i->crystals[j].cr) ) {
+			continue;
+		}
+		ret = write_crystal(st, i->crystals[j].cr,
+		                    srf & STREAM_REFLECTIONS ? i->crystals[j].refls : NULL);
+	}
+
+	fprintf(st->fh, STREAM_CHUNK_END_MARKER"\n");
+
+	fflush(st->fh);
+	if ( flush_mem_output(st) ) ret = 1;
+
+	return ret;
+}
+
+
+/**
+ * \param st A \ref Stream
+ * \param chunk Text of a chunk
+ * \param len Length of \p chunk
+ *
+ * Writes a chunk which is already in the text format, for example one which
+ * was written by another process using \ref stream_write_chunk.  Use this
+ * instead of writing to the stream's file handle directly, so that chunks in
+ * compressed streams stay separate.
+ *
+ * \returns non-zero on error.
+ */
+int stream_write_raw_chunk(Stream *st, const char *chunk, size_t len)
+{
+	if ( st->binary_write ) {
+		ERROR("Can't write a text chunk to a binary stream.\n");
+		return 1;
+	}
+
+	if ( flush_mem_output(st) ) return 1;
+	if ( fwrite(chunk, 1, len, st->fh) != len ) return 1;
+	fflush(st->fh);
+	return flush_mem_output(st);
+}
+
+
+/* Returns the start of the first line in buf (of length len) which is
+ * exactly 'marker', and adds the number of lines before it to *n_lines.
+ * Only the first character of each line is looked at, unless it matches
+ * the marker.  Returns NULL if there is no such line. */
+static const char *find_marker_line(const char *buf, size_t len,
+                                    const char *marker, long long int *n_lines)
+{
+	const char *p = buf;
+	const char *end = buf + len;
+	size_t mlen = strlen(marker);
+
+	while ( p < end ) {
+
+		const char *nl = memchr(p, '\n', end-p);
+		const char *eol = (nl != NULL) ? nl : end;
+
+		if ( (p[0] == marker[0]) && ((size_t)(eol-p) >= mlen)
+		  && (memcmp(p, marker, mlen) == 0)
+		  && ((p+mlen == eol) || (p[mlen] == '\r')) )
+		{
+			return p;
+		}
+
+		if ( nl == NULL ) break;
+		(*n_lines)++;
+		p = nl+1;
+
+	}
+
+	return NULL;
+}
+
+
+/* Moves the position of a memory-mapped stream to just after the line which
+ * is exactly 'marker', and returns the position of the start of that line.
+ * Returns NULL if the marker isn't in the part of the stream which is in
+ * memory, in which case the position is unchanged. */
+static const char *map_skip_to_marker(Stream *st, const char *marker)
+{
+	const char *start = st->map + st->map_pos;
+	const char *m;
+	const char *nl;
+	long long int n_lines = 0;
+
+	m = find_marker_line(start, st->map_len - st->map_pos, marker,
+	                     &n_lines);
+	if ( m == NULL ) return NULL;
+
+	nl = memchr(m, '\n', st->map + st->map_len - m);
+	st->map_pos = (nl != NULL) ? (size_t)(nl+1 - st->map) : st->map_len;
+	st->ln += n_lines + 1;
+	return m;
+}
+
+
+/* Skips over everything up to and including the line which is exactly
+ * end_marker, e.g. a section which the caller doesn't want.  Returns
+ * non-zero if the end of the stream was reached first. */
+static int skip_section(Stream *st, const char *end_marker)
+{
+	char line[1024];
+
+	if ( (st->map != NULL) && (map_skip_to_marker(st, end_marker) != NULL) ) {
+		return 0;
+	}
+
+	/* Not memory-mapped, or (for a compressed stream) the section carries
+	 * on in the next frame */
+	do {
+		if ( stream_gets(st, line, 1023) == NULL ) return 1;
+		st->ln++;
+		chomp(line);
+	} while ( strcmp(line, end_marker) != 0 );
+
+	return 0;
+}
+
+
+/* Returns a copy of everything up to and including the line which is
+ * exactly end_marker, or NULL if the end of the stream was reached first */
+static char *read_section_text(Stream *st, const char *end_marker)
+{
+	struct bin_buf b = {NULL, 0, 0, 0};
+	char line[1024];
+	unsigned char *p;
+	int done = 0;
+
+	if ( st->map != NULL ) {
+		const char *start = st->map + st->map_pos;
+		if ( map_skip_to_marker(st, end_marker) != NULL ) {
+			size_t len = st->map + st->map_pos - start;
+			char *text = cfmalloc(len+1);
+			if ( text == NULL ) return NULL;
+			memcpy(text, start, len);
+			text[len] = '\0';
+			return text;
+		}
+	}
+
+	while ( !done && (stream_gets(st, line, 1023) != NULL) ) {
+		size_t len = strlen(line);
+		st->ln++;
+		p = bb_extend(&b, len+1);
+		if ( p != NULL ) {
+			memcpy(p, line, len+1);
+			b.len--;  /* Overwrite the terminator next time */
+		}
+		chomp(line);
+		if ( strcmp(line, end_marker) == 0 ) done = 1;
+	}
+
+	if ( !done || b.err ) {
+		cffree(b.data);
+		return NULL;
+	}
+	return (char *)b.data;
+}
+
+
+static int find_start_of_chunk(Stream *st)
+{
+	char *rval = NULL;
+	char line[1024];
+
+	do {
+
+		rval = stream_gets(st, line, 1023);
+		st->ln++;
+
+		/* Trouble? */
+		if ( rval == NULL ) return 1;
+
+		chomp(line);
+
+	} while ( strcmp(line, STREAM_CHUNK_START_MARKER) != 0 );
+
+	return 0;
+}
+
+
+static void read_crystal(Stream *st, struct image *image,
+                         StreamFlags srf)
+{
+	char line[1024];
+	char *rval = NULL;
+	struct rvec as, bs, cs;
+	int have_as = 0;
+	int have_bs = 0;
+	int have_cs = 0;
+	int have_latt = 0;
+	int have_cen = 0;
+	int have_ua = 0;
+	char centering = 'P';
+	char unique_axis = '*';
+	LatticeType lattice_type = L_TRICLINIC;
+	Crystal *cr;
+	RefList *reflist = NULL;
+	char *refls_text = NULL;
+	double shift_x, shift_y;
+
+	as.u = 0.0;  as.v = 0.0;  as.w = 0.0;
+	bs.u = 0.0;  bs.v = 0.0;  bs.w = 0.0;
+	cs.u = 0.0;  cs.v = 0.0;  cs.w = 0.0;
+
+	cr = crystal_new();
+	if ( cr == NULL ) {
+		ERROR("Failed to allocate crystal!\n");
+		return;
+	}
+
+	do {
+
+		float u, v, w, lim, rad;
+		char c;
+
+		rval = stream_gets(st, line, 1023);
+		st->ln++;
+
+		/* Trouble? */
+		if ( rval == NULL ) break;
+
+		chomp(line);
+		if ( parse_vector_line(line, "astar = ", &u, &v, &w) == 3 )
+		{
+			as.u = u*1e9;  as.v = v*1e9;  as.w = w*1e9;
+			have_as = 1;
+		}
+
+		if ( parse_vector_line(line, "bstar = ", &u, &v, &w) == 3 )
+		{
+			bs.u = u*1e9;  bs.v = v*1e9;  bs.w = w*1e9;
+			have_bs = 1;
+		}
+
+		if ( parse_vector_line(line, "cstar = ", &u, &v, &w) == 3 )
+		{
+			cs.u = u*1e9;  cs.v = v*1e9;  cs.w = w*1e9;
+			have_cs = 1;
+		}
+
+		if ( sscanf(line, "centering = %c", &c) == 1 )
+		{
+			if ( !have_cen ) {
+				centering = c;
+				have_cen = 1;
+			} else {
+				ERROR("Duplicate centering (line %lli) - "
+				      "stream may be corrupted!\n", st->ln);
+			}
+		}
+
+		if ( sscanf(line, "unique_axis = %c", &c) == 1 )
+		{
+			if ( !have_ua ) {
+				unique_axis = c;
+				have_ua = 1;
+			} else {
+				ERROR("Duplicate unique axis (line %lli) - "
+				      "stream may be corrupted!\n", st->ln);
+			}
+		}
+
+		if ( strncmp(line, "lattice_type = ", 15) == 0 )
+		{
+			if ( !have_latt ) {
+				lattice_type = lattice_from_str(line+15);
+				have_latt = 1;
+			} else {
+				ERROR("Duplicate lattice type (line %lli) - "
+				      "stream may be corrupted!\n", st->ln);
+			}
+		}
+
+		if ( strncmp(line, "num_saturated_reflections = ", 28) == 0 ) {
+			int nsat = atoi(line+28);
+			crystal_set_num_saturated_reflections(cr, nsat);
+		}
+
+		if ( sscanf(line, "diffraction_resolution_limit = %f nm^-1",
+		            &lim) == 1 ) {
+			crystal_set_resolution_limit(cr, lim*1e9);
+		}
+
+		if ( sscanf(line, "profile_radius = %e nm^-1", &rad) == 1 ) {
+			crystal_set_profile_radius(cr, rad*1e9);
+		}
+
+		if ( sscanf(line, "predict_refine/det_shift x = %lf "
+		                  "y = %lf mm\n", &shift_x, &shift_y ) == 2 ) {
+			crystal_set_det_shift(cr, shift_x*1e-3, shift_y*1e-3);
+		}
+
+
+		if ( (strcmp(line, STREAM_REFLECTION_START_MARKER) == 0)
+		  && refl_cut_crystal(st, crystal_get_resolution_limit(cr)) )
+		{
+			/* Rejected, so don't look at the lines at all */
+			if ( skip_section(st, STREAM_REFLECTION_END_MARKER) ) {
+				break;
+			}
+
+		} else if ( (strcmp(line, STREAM_REFLECTION_START_MARKER) == 0)
+		         && (srf & STREAM_DEFER_REFLECTIONS) )
+		{
+			refls_text = read_section_text(st,
+			                          STREAM_REFLECTION_END_MARKER);
+			if ( refls_text == NULL ) {
+				ERROR("Failed while reading reflections\n");
+				ERROR("Filename = %s\n", image->filename);
+				ERROR("Event = %s\n", image->ev);
+				break;
+			}
+
+		} else if ( (strcmp(line, STREAM_REFLECTION_START_MARKER) == 0)
+		         && (srf & STREAM_REFLECTIONS) )
+		{
+			struct refl_cut cut;
+			UnitCell *tcell = NULL;
+			if ( st->have_cutoffs && have_as && have_bs && have_cs ) {
+				tcell = cell_new_from_reciprocal_axes(as, bs, cs);
+			}
+			refl_cut_init(st, &cut, tcell,
+			              crystal_get_resolution_limit(cr));
+			cell_free(tcell);
+			reflist = read_stream_reflections_2_3(st, 1.0/image->lambda,
+			                          srf & STREAM_LEAN_REFLECTIONS,
+			                          &cut);
+			if ( reflist == NULL ) {
+				ERROR("Failed while reading reflections\n");
+				ERROR("Filename = %s\n", image->filename);
+				ERROR("Event = %s\n", image->ev);
+				break;
+			}
+
+		} else if ( strcmp(line, STREAM_REFLECTION_START_MARKER) == 0 ) {
+			/* Not wanted, so don't look at the lines at all */
+			if ( skip_section(st, STREAM_REFLECTION_END_MARKER) ) {
+				break;
+			}
+		}
+
+		if ( strcmp(line, STREAM_CRYSTAL_END_MARKER) == 0 ) break;
+
+	} while ( 1 );
+
+	if ( have_as && have_bs && have_cs ) {
+
+		UnitCell *cell;
+
+		cell = crystal_get_cell(cr);
+
+		if ( cell != NULL ) {
+			ERROR("Duplicate cell found in stream!\n");
+			ERROR("I'll use the most recent one.\n");
+			cell_free(cell);
+		}
+
+		cell = cell_new_from_reciprocal_axes(as, bs, cs);
+		if ( cell == NULL ) {
+			ERROR("Failed to allocate cell\n");
+			return;
+		}
+
+		if ( have_cen && have_ua && have_latt ) {
+			cell_set_centering(cell, centering);
+			cell_set_unique_axis(cell, unique_axis);
+			cell_set_lattice_type(cell, lattice_type);
+		} /* else keep default triclinic P */
+
+		crystal_set_cell(cr, cell);
+
+	}
+
+	/* Unused at the moment */
+	crystal_set_mosaicity(cr, 0.0);
+
+	image_add_crystal_refls(image, cr, reflist);
+	if ( refls_text != NULL ) {
+		if ( image->crystals[image->n_crystals-1].cr == cr ) {
+			image->crystals[image->n_crystals-1].refls_text = refls_text;
+		} else {
+			cffree(refls_text);
+		}
+	}
+}
+
+
+static void parse_header(const char *line_in, struct image *image,
+                         HeaderCacheType type)
+{
+	char *line;
+	char *pos;
+
+	line = cfstrdup(line_in);
+	chomp(line);
+
+	pos = strchr(line, ' ');
+	if ( pos == NULL ) {
+		ERROR("Invalid header line '%s' (no space)\n", line);
+		return;
+	}
+	pos[0] = '\0';
+
+	if ( strlen(line_in) < strlen(line) + 3 ) {
+		ERROR("Invalid header line '%s' (too short)\n", line);
+		return;
+	}
+
+	if ( (pos[1] != '=') || (pos[2] != ' ') ) {
+		ERROR("Invalid header line '%s' (wrong separator)\n", line);
+		return;
+	}
+
+	switch ( type ) {
+
+		double vf;
+		int vi;
+
+		case HEADER_FLOAT:
+		if ( convert_float(pos+3, &vf) != 0 ) {
+			ERROR("Invalid header line '%s' (invalid value)\n", line);
+			return;
+		}
+		image_cache_header_float(image, line, vf);
+		break;
+
+		case HEADER_INT:
+		if ( convert_int(pos+3, &vi) != 0 ) {
+			ERROR("Invalid header line '%s' (invalid value)\n", line);
+			return;
+		}
+		image_cache_header_int(image, line, vi);
+		break;
+
+		case HEADER_STR:
+		image_cache_header_str(image, line, pos+3);
+		break;
+
+		default:
+		ERROR("Unrecognised header cache type %i (from stream)\n", type);
+		break;
+	}
+}
+
+
+/* Reads the next chunk from the current file of the stream */
+static struct image *read_chunk(Stream *st, StreamFlags srf)
+{
+	char line[1024];
+	char *rval = NULL;
+	int have_filename = 0;
+	int have_ev = 0;
+	struct image *image;
+
+	if ( st->binary ) return read_binary_chunk(st, srf);
+
+	if ( find_start_of_chunk(st) ) return NULL;
+
+	image = image_new();
+	if ( image == NULL ) return NULL;
+
+	image->data_source_type = DATA_SOURCE_TYPE_NONE;
+
+	do {
+		int ser;
+		float div, bw;
+
+		rval = stream_gets(st, line, 1023);
+		st->ln++;
+
+		/* Trouble? */
+		if ( rval == NULL ) break;
+
+		chomp(line);
+
+		if ( strncmp(line, "Image filename: ", 16) == 0 ) {
+			image->filename = cfstrdup(line+16);
+			have_filename = 1;
+		}
+
+		if ( strncmp(line, "Event: ", 7) == 0 ) {
+			image->ev = cfstrdup(line+7);
+		}
+
+		if ( strncmp(line, "hdf5/", 5) == 0 ) {
+			parse_header(line+4, image, HEADER_FLOAT);
+		}
+
+		if ( strncmp(line, "header/int/", 11) == 0 ) {
+			parse_header(line+11, image, HEADER_INT);
+		}
+
+		if ( strncmp(line, "header/float/", 13) == 0 ) {
+			parse_header(line+13, image, HEADER_FLOAT);
+		}
+
+		if ( strncmp(line, "header/str/", 13) == 0 ) {
+			parse_header(line+11, image, HEADER_STR);
+		}
+
+		if ( strncmp(line, "indexed_by = ", 13) == 0 ) {
+			int err = 0;
+			image->indexed_by = get_indm_from_string_2(line+13, &err);
+			if ( image->indexed_by == INDEXING_ERROR ) {
+				ERROR("Failed to read indexer list\n");
+			}
+			if ( err ) {
+				st->old_indexers = 1;
+			}
+		}
+
+		if ( strncmp(line, "photon_energy_eV = ", 19) == 0 ) {
+			image->lambda = ph_en_to_lambda(eV_to_J(atof(line+19)));
+			have_ev = 1;
+		}
+
+		if ( sscanf(line, "beam_divergence = %e rad", &div) == 1 ) {
+			image->div = div;
+		}
+
+		if ( sscanf(line, "beam_bandwidth = %f", &bw) == 1 ) {
+			image->bw = bw;
+		}
+
+		if ( sscanf(line, "Image serial number: %i", &ser) == 1 ) {
+			image->serial = ser;
+		}
+
+
+		if ( (srf & STREAM_PEAKS)
+		    && strcmp(line, STREAM_PEAK_LIST_START_MARKER) == 0 ) {
+
+			ImageFeatureList *peaks;
+			peaks = read_peaks(st, image);
+
+			if ( peaks == NULL ) {
+				ERROR("Failed while reading peaks\n");
+				image_free(image);
+				return NULL;
+			}
+
+			image->features = peaks;
+
+		} else if ( strcmp(line, STREAM_PEAK_LIST_START_MARKER) == 0 ) {
+
+			/* Not wanted, so don't look at the lines at all */
+			if ( skip_section(st, STREAM_PEAK_LIST_END_MARKER) ) {
+				break;
+			}
+
+		}
+
+		if ( strcmp(line, STREAM_CRYSTAL_START_MARKER) == 0 ) {
+			read_crystal(st, image, srf);
+		}
+
+		/* A chunk must have at least a filename and a wavelength,
+		 * otherwise it's incomplete */
+		if ( strcmp(line, STREAM_CHUNK_END_MARKER) == 0 ) {
+			if ( have_filename && have_ev ) {
+				/* Success */
+				if ( finish_chunk(st, image, srf) ) return NULL;
+				return image;
+			}
+			ERROR("Incomplete chunk found in input file.\n");
+			image_free(image);
+			return NULL;
+		}
+
+	} while ( 1 );
+
+	if ( !stream_eof(st) ) {
+		ERROR("Error reading stream.\n");
+	}
+
+	image_free(image);
+	return NULL;  /* Either error or EOF, don't care because we will complain
+	               * on the terminal if it was an error. */
+}
+
+
+static int open_shard(Stream *st, int i)
+{
+	FILE *fh;
+
+	fh = fopen(st->shards[i], "r");
+	if ( fh == NULL ) {
+		ERROR("Failed to open stream shard '%s'\n", st->shards[i]);
+		return 1;
+	}
+
+	/* For text streams, the headers will be skipped by
+	 * find_start_of_chunk() */
+	if ( st->binary && find_binary_start(fh, NULL) ) {
+		ERROR("Stream shard '%s' is not a binary stream\n",
+		      st->shards[i]);
+		fclose(fh);
+		return 1;
+	}
+
+	free_zstd_reader(st);
+	if ( st->fh != NULL ) fclose(st->fh);
+	st->fh = fh;
+	st->cur_shard = i;
+	st->ln = 0;
+	st->binary_end = 0;
+	if ( !st->binary && is_zstd_file(fh) ) {
+		unmap_stream(st);
+		if ( open_zstd_reader(st) ) {
+			ERROR("Failed to open compressed stream shard '%s'\n",
+			      st->shards[i]);
+			return 1;
+		}
+	} else {
+		map_stream(st);
+	}
+	return 0;
+}
+
+
+/* Move on to the next shard which can be opened.
+ * Returns non-zero if there are no more. */
+static int next_shard(Stream *st)
+{
+	int i;
+	for ( i=st->cur_shard+1; i<st->n_shards; i++ ) {
+		if ( open_shard(st, i) == 0 ) return 0;
+	}
+	return 1;
+}
+
+
+/**
+ * Read the next chunk from a stream and return an image structure.
+ *
+ * If the stream was opened from a manifest, the shards will be read one after
+ * the other.  An incomplete chunk at the end of a shard (e.g. because the
+ * worker writing it crashed) will be skipped.
+ */
+struct image *stream_read_chunk(Stream *st, StreamFlags srf)
+{
+	do {
+		struct image *image = read_chunk(st, srf);
+		if ( image != NULL ) return image;
+		if ( !stream_eof(st) && !st->binary_end ) return NULL;
+	} while ( next_shard(st) == 0 );
+
+	return NULL;
+}
+
+
+/**
+ * \param st The \ref Stream which \p image was read from
+ * \param image An image read with STREAM_DEFER_REFLECTIONS
+ * \param i The index of the crystal in \p image
+ * \param srf Flags for reading the reflections: only
+ *   STREAM_LEAN_REFLECTIONS makes a difference
+ *
+ * Parses the reflection list for crystal \p i, if this hasn't been done
+ * already, and puts it in image->crystals[i].refls.  This can be called from
+ * any thread, as long as \p st is still open.  The lists must be read like
+ * this before writing the image to another stream.
+ *
+ * \returns the reflection list, or NULL if the crystal doesn't have one.
+ */
+RefList *stream_crystal_refls(Stream *st, struct image *image, int i,
+                              StreamFlags srf)
+{
+	struct crystal_refls *c = &image->crystals[i];
+	struct _stream tmp;
+	struct refl_cut cut;
+	RefList *list;
+
+	if ( c->refls_text == NULL ) return c->refls;
+
+	/* read_stream_reflections_2_3() only needs these parts */
+	tmp.fh = NULL;
+	tmp.map = c->refls_text;
+	tmp.map_len = strlen(c->refls_text);
+	tmp.map_pos = 0;
+	tmp.map_owned = 0;
+	tmp.zr = NULL;
+	tmp.dtempl_read = st->dtempl_read;
+	tmp.panels = st->panels;
+	tmp.ln = 0;
+
+	refl_cut_init(st, &cut, crystal_get_cell(c->cr),
+	              crystal_get_resolution_limit(c->cr));
+	list = read_stream_reflections_2_3(&tmp, 1.0/image->lambda,
+	                                   srf & STREAM_LEAN_REFLECTIONS,
+	                                   &cut);
+	if ( list == NULL ) {
+		ERROR("Failed while reading reflections\n");
+		ERROR("Filename = %s\n", image->filename);
+		ERROR("Event = %s\n", image->ev);
+	}
+
+	cffree(c->refls_text);
+	c->refls_text = NULL;
+	c->refls = list;
+	c->image_owns_refls = 1;
+	return list;
+}
+
+
+/* Parallel reading */
+
+struct raw_chunk
+{
+	unsigned char *data;
+	size_t len;
+	long long int seq;
+	struct image *image;
+	struct raw_chunk *next;
+};
+
+
+struct _streamreader
+{
+	Stream *st;
+	StreamFlags srf;
+	int ordered;
+
+	/* Copied from the Stream, because the splitter thread changes it */
+	int binary;
+	DataTemplate *dtempl;
+	struct panel_lookup *panels;
+
+	pthread_t splitter;
+	int n_workers;
+	pthread_t *workers;
+
+	/* Everything below is protected by 'lock'.  'cond' is broadcast
+	 * whenever anything changes. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* Chunks waiting to be parsed, oldest first */
+	struct raw_chunk *in_head;
+	struct raw_chunk *in_tail;
+
+	/* Chunks which have been parsed, waiting to be delivered */
+	struct raw_chunk *out;
+
+	int n_in_flight;       /* Read, but not yet delivered */
+	int max_in_flight;
+	long long int n_read;
+	long long int next_deliver;
+	int eof;               /* Splitter has finished */
+	int stop;              /* Reader is being freed */
+};
+
+
+/* Reads the text of the next chunk of a text stream, including the start
+ * and end markers */
+static struct raw_chunk *read_raw_text_chunk(Stream *st)
+{
+	struct bin_buf b = {NULL, 0, 0, 0};
+	struct raw_chunk *rc;
+	char line[1024];
+	size_t len;
+	unsigned char *p;
+	int done = 0;
+
+	if ( find_start_of_chunk(st) ) return NULL;
+
+	len = strlen(STREAM_CHUNK_START_MARKER"\n");
+	p = bb_extend(&b, len);
+	if ( p != NULL ) memcpy(p, STREAM_CHUNK_START_MARKER"\n", len);
+
+	/* If the stream is in memory, the whole chunk can be copied at once */
+	if ( st->map != NULL ) {
+		const char *start = st->map + st->map_pos;
+		if ( map_skip_to_marker(st, STREAM_CHUNK_END_MARKER) != NULL ) {
+			len = st->map + st->map_pos - start;
+			p = bb_extend(&b, len);
+			if ( p != NULL ) memcpy(p, start, len);
+			done = 1;
+		}
+	}
+
+	while ( !done && (stream_gets(st, line, 1023) != NULL) ) {
+		st->ln++;
+		len = strlen(line);
+		p = bb_extend(&b, len);
+		if ( p != NULL ) memcpy(p, line, len);
+		if ( strcmp(line, STREAM_CHUNK_END_MARKER"\n") == 0 ) done = 1;
+	}
+
+	/* Incomplete chunk at the end of the file is skipped */
+	if ( !done || b.err ) {
+		cffree(b.data);
+		return NULL;
+	}
+
+	rc = cfmalloc(sizeof(struct raw_chunk));
+	if ( rc == NULL ) {
+		cffree(b.data);
+		return NULL;
+	}
+	rc->data = b.data;
+	rc->len = b.len;
+	return rc;
+}
+
+
+/* Reads the record for the next chunk of a binary stream, without
+ * decompressing it */
+static struct raw_chunk *read_raw_binary_chunk(Stream *st)
+{
+	unsigned char hdr[16];
+	unsigned char *data;
+	uint32_t stored_len;
+	struct raw_chunk *rc;
+
+	st->binary_end = 0;
+
+	if ( fread(hdr, 1, 4, st->fh) != 4 ) {
+		st->binary_end = feof(st->fh);
+		return NULL;
+	}
+
+	if ( memcmp(hdr, BIN_INDEX_MAGIC, 4) == 0 ) {
+		st->binary_end = 1;
+		return NULL;
+	}
 
-		if ( sscanf(line, "diffraction_resolution_limit = %f nm^-1",
-		            &lim) == 1 ) {
-			crystal_set_resolution_limit(cr, lim*1e9);
-		}
+	if ( (memcmp(hdr, BIN_CHUNK_MAGIC, 4) != 0)
+	  || (fread(hdr+4, 1, 12, st->fh) != 12) )
+	{
+		st->binary_end = feof(st->fh);
+		if ( !st->binary_end ) ERROR("Invalid chunk in binary stream.\n");
+		return NULL;
+	}
 
-		if ( sscanf(line, "profile_radius = %e nm^-1", &rad) == 1 ) {
-			crystal_set_profile_radius(cr, rad*1e9);
-		}
+	stored_len = get_u32(hdr+8);
+	if ( stored_len > BIN_MAX_CHUNK ) {
+		ERROR("Invalid chunk in binary stream.\n");
+		return NULL;
+	}
 
-		if ( sscanf(line, "predict_refine/det_shift x = %lf "
-		                  "y = %lf mm\n", &shift_x, &shift_y ) == 2 ) {
-			crystal_set_det_shift(cr, shift_x*1e-3, shift_y*1e-3);
-		}
+	data = cfmalloc(16+stored_len);
+	if ( data == NULL ) return NULL;
+	memcpy(data, hdr, 16);
+	if ( fread(data+16, 1, stored_len, st->fh) != stored_len ) {
+		st->binary_end = feof(st->fh);
+		cffree(data);
+		return NULL;
+	}
 
+	rc = cfmalloc(sizeof(struct raw_chunk));
+	if ( rc == NULL ) {
+		cffree(data);
+		return NULL;
+	}
+	rc->data = data;
+	rc->len = 16+stored_len;
+	return rc;
+}
 
-		if ( (strcmp(line, STREAM_REFLECTION_START_MARKER) == 0)
-		  && (srf & STREAM_REFLECTIONS) )
-		{
-			reflist = read_stream_reflections_2_3(st, 1.0/image->lambda);
-			if ( reflist == NULL ) {
-				ERROR("Failed while reading reflections\n");
-				ERROR("Filename = %s\n", image->filename);
-				ERROR("Event = %s\n", image->ev);
-				break;
-			}
+
+/* Equivalent of stream_read_chunk(), but without parsing the chunk */
+static struct raw_chunk *read_raw_chunk(Stream *st)
+{
+	do {
+		struct raw_chunk *rc;
+		if ( st->binary ) {
+			rc = read_raw_binary_chunk(st);
+		} else {
+			rc = read_raw_text_chunk(st);
 		}
+		if ( rc != NULL ) return rc;
+		if ( !stream_eof(st) && !st->binary_end ) return NULL;
+	} while ( next_shard(st) == 0 );
 
-		if ( strcmp(line, STREAM_CRYSTAL_END_MARKER) == 0 ) break;
+	return NULL;
+}
 
-	} while ( 1 );
 
-	if ( have_as && have_bs && have_cs ) {
+static void *split_chunks(void *vp)
+{
+	StreamReader *sr = vp;
 
-		UnitCell *cell;
+	do {
 
-		cell = crystal_get_cell(cr);
+		struct raw_chunk *rc;
 
-		if ( cell != NULL ) {
-			ERROR("Duplicate cell found in stream!\n");
-			ERROR("I'll use the most recent one.\n");
-			cell_free(cell);
+		pthread_mutex_lock(&sr->lock);
+		while ( (sr->n_in_flight >= sr->max_in_flight) && !sr->stop ) {
+			pthread_cond_wait(&sr->cond, &sr->lock);
 		}
-
-		cell = cell_new_from_reciprocal_axes(as, bs, cs);
-		if ( cell == NULL ) {
-			ERROR("Failed to allocate cell\n");
-			return;
+		if ( sr->stop ) {
+			pthread_mutex_unlock(&sr->lock);
+			break;
 		}
+		pthread_mutex_unlock(&sr->lock);
 
-		if ( have_cen && have_ua && have_latt ) {
-			cell_set_centering(cell, centering);
-			cell_set_unique_axis(cell, unique_axis);
-			cell_set_lattice_type(cell, lattice_type);
-		} /* else keep default triclinic P */
+		rc = read_raw_chunk(sr->st);
+		if ( rc == NULL ) break;
 
-		crystal_set_cell(cr, cell);
+		rc->image = NULL;
+		rc->next = NULL;
 
-	}
+		pthread_mutex_lock(&sr->lock);
+		rc->seq = sr->n_read++;
+		if ( sr->in_tail != NULL ) {
+			sr->in_tail->next = rc;
+		} else {
+			sr->in_head = rc;
+		}
+		sr->in_tail = rc;
+		sr->n_in_flight++;
+		pthread_cond_broadcast(&sr->cond);
+		pthread_mutex_unlock(&sr->lock);
 
-	/* Unused at the moment */
-	crystal_set_mosaicity(cr, 0.0);
+	} while ( 1 );
 
-	image_add_crystal_refls(image, cr, reflist);
+	pthread_mutex_lock(&sr->lock);
+	sr->eof = 1;
+	pthread_cond_broadcast(&sr->cond);
+	pthread_mutex_unlock(&sr->lock);
+
+	return NULL;
 }
 
 
-static void parse_header(const char *line_in, struct image *image,
-                         HeaderCacheType type)
+static struct image *parse_raw_chunk(StreamReader *sr, struct raw_chunk *rc)
 {
-	char *line;
-	char *pos;
-
-	line = cfstrdup(line_in);
-	chomp(line);
+	struct _stream tmp;
+	struct image *image;
 
-	pos = strchr(line, ' ');
-	if ( pos == NULL ) {
-		ERROR("Invalid header line '%s' (no space)\n", line);
-		return;
+	/* read_chunk() only needs these parts of the Stream.  Text chunks are
+	 * read straight from the buffer, binary ones through stdio */
+	tmp.map = NULL;
+	tmp.map_len = 0;
+	tmp.map_pos = 0;
+	tmp.map_owned = 0;
+	tmp.zr = NULL;
+	tmp.zw = NULL;
+	if ( sr->binary ) {
+		tmp.fh = fmemopen(rc->data, rc->len, "r");
+		if ( tmp.fh == NULL ) {
+			ERROR("Failed to open chunk for parsing\n");
+			return NULL;
+		}
+	} else {
+		tmp.fh = NULL;
+		tmp.map = (const char *)rc->data;
+		tmp.map_len = rc->len;
 	}
-	pos[0] = '\0';
-
-	if ( strlen(line_in) < strlen(line) + 3 ) {
-		ERROR("Invalid header line '%s' (too short)\n", line);
-		return;
+	tmp.binary = sr->binary;
+	tmp.binary_end = 0;
+	tmp.dtempl_read = sr->dtempl;
+	tmp.panels = sr->panels;
+	tmp.old_indexers = 0;
+	tmp.ln = 0;
+	tmp.have_cutoffs = sr->st->have_cutoffs;
+	tmp.cut_max_peak = sr->st->cut_max_peak;
+	tmp.cut_min_res = sr->st->cut_min_res;
+	tmp.cut_push_res = sr->st->cut_push_res;
+
+	image = read_chunk(&tmp, sr->srf);
+	if ( tmp.fh != NULL ) fclose(tmp.fh);
+
+	if ( tmp.old_indexers ) {
+		pthread_mutex_lock(&sr->lock);
+		sr->st->old_indexers = 1;
+		pthread_mutex_unlock(&sr->lock);
 	}
 
-	if ( (pos[1] != '=') || (pos[2] != ' ') ) {
-		ERROR("Invalid header line '%s' (wrong separator)\n", line);
-		return;
-	}
+	return image;
+}
 
-	switch ( type ) {
 
-		double vf;
-		int vi;
+static void *parse_chunks(void *vp)
+{
+	StreamReader *sr = vp;
 
-		case HEADER_FLOAT:
-		if ( convert_float(pos+3, &vf) != 0 ) {
-			ERROR("Invalid header line '%s' (invalid value)\n", line);
-			return;
+	do {
+
+		struct raw_chunk *rc;
+
+		pthread_mutex_lock(&sr->lock);
+		while ( (sr->in_head == NULL) && !sr->eof && !sr->stop ) {
+			pthread_cond_wait(&sr->cond, &sr->lock);
 		}
-		image_cache_header_float(image, line, vf);
-		break;
+		if ( (sr->in_head == NULL) || sr->stop ) {
+			pthread_mutex_unlock(&sr->lock);
+			break;
+		}
+		rc = sr->in_head;
+		sr->in_head = rc->next;
+		if ( sr->in_head == NULL ) sr->in_tail = NULL;
+		pthread_mutex_unlock(&sr->lock);
 
-		case HEADER_INT:
-		if ( convert_int(pos+3, &vi) != 0 ) {
-			ERROR("Invalid header line '%s' (invalid value)\n", line);
-			return;
+		rc->image = parse_raw_chunk(sr, rc);
+
+		/* The text is kept for stream_reader_next_with_text() */
+		if ( sr->binary || (rc->image == NULL) ) {
+			cffree(rc->data);
+			rc->data = NULL;
 		}
-		image_cache_header_int(image, line, vi);
-		break;
 
-		case HEADER_STR:
-		image_cache_header_str(image, line, pos+3);
-		break;
+		pthread_mutex_lock(&sr->lock);
+		rc->next = sr->out;
+		sr->out = rc;
+		pthread_cond_broadcast(&sr->cond);
+		pthread_mutex_unlock(&sr->lock);
 
-		default:
-		ERROR("Unrecognised header cache type %i (from stream)\n", type);
-		break;
+	} while ( 1 );
+
+	return NULL;
+}
+
+
+static void free_raw_chunks(struct raw_chunk *rc)
+{
+	while ( rc != NULL ) {
+		struct raw_chunk *next = rc->next;
+		cffree(rc->data);
+		image_free(rc->image);
+		cffree(rc);
+		rc = next;
 	}
 }
 
 
 /**
- * Read the next chunk from a stream and return an image structure
+ * \param st A \ref Stream, opened with \ref stream_open_for_read
+ * \param srf A \ref StreamFlags enum saying what to read
+ * \param n_threads The number of threads to use for parsing chunks
+ * \param ordered Non-zero if the chunks should be returned in the same order
+ *   as they appear in the stream
+ *
+ * Starts reading the chunks from \p st in parallel.  One thread reads the
+ * text (or records, for a binary stream) of the chunks from the file, and
+ * \p n_threads threads parse them.  Use \ref stream_reader_next to get the
+ * chunks.
+ *
+ * If \p ordered is zero, the chunks will be returned as soon as they have been
+ * parsed, which might not be in the same order as in the stream.  This is
+ * slightly faster if some chunks take much longer to parse than others.
+ *
+ * \p st must not be used in any other way until the reader has been freed
+ * with \ref stream_reader_free.
+ *
+ * \returns A \ref StreamReader, or NULL on failure.
  */
-struct image *stream_read_chunk(Stream *st, StreamFlags srf)
+StreamReader *stream_reader_new(Stream *st, StreamFlags srf, int n_threads,
+                                int ordered)
 {
-	char line[1024];
-	char *rval = NULL;
-	int have_filename = 0;
-	int have_ev = 0;
-	struct image *image;
+	StreamReader *sr;
+	int i;
 
-	if ( find_start_of_chunk(st) ) return NULL;
+	if ( n_threads < 1 ) n_threads = 1;
 
-	image = image_new();
-	if ( image == NULL ) return NULL;
+	sr = cfmalloc(sizeof(StreamReader));
+	if ( sr == NULL ) return NULL;
 
-	image->data_source_type = DATA_SOURCE_TYPE_NONE;
+	sr->workers = cfmalloc(n_threads*sizeof(pthread_t));
+	if ( sr->workers == NULL ) {
+		cffree(sr);
+		return NULL;
+	}
 
-	do {
-		int ser;
-		float div, bw;
+	sr->st = st;
+	sr->srf = srf;
+	sr->ordered = ordered;
+	sr->binary = st->binary;
+	sr->dtempl = st->dtempl_read;
+	sr->panels = st->panels;
+	sr->n_workers = 0;
+	sr->in_head = NULL;
+	sr->in_tail = NULL;
+	sr->out = NULL;
+	sr->n_in_flight = 0;
+	sr->max_in_flight = 4*n_threads;
+	sr->n_read = 0;
+	sr->next_deliver = 0;
+	sr->eof = 0;
+	sr->stop = 0;
+	pthread_mutex_init(&sr->lock, NULL);
+	pthread_cond_init(&sr->cond, NULL);
+
+	if ( pthread_create(&sr->splitter, NULL, split_chunks, sr) ) {
+		ERROR("Failed to start stream reader thread\n");
+		pthread_mutex_destroy(&sr->lock);
+		pthread_cond_destroy(&sr->cond);
+		cffree(sr->workers);
+		cffree(sr);
+		return NULL;
+	}
 
-		rval = fgets(line, 1023, st->fh);
-		st->ln++;
+	for ( i=0; i<n_threads; i++ ) {
+		if ( pthread_create(&sr->workers[i], NULL, parse_chunks, sr) ) {
+			ERROR("Failed to start stream parsing thread\n");
+			break;
+		}
+		sr->n_workers++;
+	}
 
-		/* Trouble? */
-		if ( rval == NULL ) break;
+	if ( sr->n_workers == 0 ) {
+		stream_reader_free(sr);
+		return NULL;
+	}
 
-		chomp(line);
+	return sr;
+}
 
-		if ( strncmp(line, "Image filename: ", 16) == 0 ) {
-			image->filename = cfstrdup(line+16);
-			have_filename = 1;
-		}
 
-		if ( strncmp(line, "Event: ", 7) == 0 ) {
-			image->ev = cfstrdup(line+7);
+/* Removes and returns the next chunk to be delivered, or NULL if it is not
+ * ready yet.  Must be called with the lock held. */
+static struct raw_chunk *take_parsed_chunk(StreamReader *sr)
+{
+	struct raw_chunk **prc;
+
+	for ( prc=&sr->out; *prc!=NULL; prc=&(*prc)->next ) {
+		struct raw_chunk *rc = *prc;
+		if ( !sr->ordered || (rc->seq == sr->next_deliver) ) {
+			*prc = rc->next;
+			sr->next_deliver++;
+			sr->n_in_flight--;
+			return rc;
 		}
+	}
 
-		if ( strncmp(line, "hdf5/", 5) == 0 ) {
-			parse_header(line+4, image, HEADER_FLOAT);
-		}
+	return NULL;
+}
 
-		if ( strncmp(line, "header/int/", 11) == 0 ) {
-			parse_header(line+11, image, HEADER_INT);
-		}
 
-		if ( strncmp(line, "header/float/", 13) == 0 ) {
-			parse_header(line+13, image, HEADER_FLOAT);
-		}
+/* Returns the next successfully parsed chunk, or NULL at the end */
+static struct raw_chunk *next_parsed_chunk(StreamReader *sr)
+{
+	pthread_mutex_lock(&sr->lock);
 
-		if ( strncmp(line, "header/str/", 13) == 0 ) {
-			parse_header(line+11, image, HEADER_STR);
-		}
+	do {
 
-		if ( strncmp(line, "indexed_by = ", 13) == 0 ) {
-			int err = 0;
-			image->indexed_by = get_indm_from_string_2(line+13, &err);
-			if ( image->indexed_by == INDEXING_ERROR ) {
-				ERROR("Failed to read indexer list\n");
-			}
-			if ( err ) {
-				st->old_indexers = 1;
+		struct raw_chunk *rc = take_parsed_chunk(sr);
+
+		if ( rc != NULL ) {
+			pthread_cond_broadcast(&sr->cond);
+			if ( rc->image != NULL ) {
+				pthread_mutex_unlock(&sr->lock);
+				return rc;
 			}
+			cffree(rc->data);
+			cffree(rc);
+			continue;
 		}
 
-		if ( strncmp(line, "photon_energy_eV = ", 19) == 0 ) {
-			image->lambda = ph_en_to_lambda(eV_to_J(atof(line+19)));
-			have_ev = 1;
-		}
+		if ( sr->eof && (sr->n_in_flight == 0) ) break;
 
-		if ( sscanf(line, "beam_divergence = %e rad", &div) == 1 ) {
-			image->div = div;
-		}
+		pthread_cond_wait(&sr->cond, &sr->lock);
 
-		if ( sscanf(line, "beam_bandwidth = %f", &bw) == 1 ) {
-			image->bw = bw;
-		}
+	} while ( 1 );
 
-		if ( sscanf(line, "Image serial number: %i", &ser) == 1 ) {
-			image->serial = ser;
-		}
+	pthread_mutex_unlock(&sr->lock);
+	return NULL;
+}
 
 
-		if ( (srf & STREAM_PEAKS)
-		    && strcmp(line, STREAM_PEAK_LIST_START_MARKER) == 0 ) {
+/**
+ * \param sr A \ref StreamReader
+ *
+ * Returns the next chunk from \p sr, waiting for it to be parsed if
+ * necessary.  As with \ref stream_read_chunk, chunks which could not be read
+ * are skipped.
+ *
+ * \returns An image structure, or NULL at the end of the stream.
+ */
+struct image *stream_reader_next(StreamReader *sr)
+{
+	struct raw_chunk *rc;
+	struct image *image;
 
-			ImageFeatureList *peaks;
-			peaks = read_peaks(st, image);
+	rc = next_parsed_chunk(sr);
+	if ( rc == NULL ) return NULL;
 
-			if ( peaks == NULL ) {
-				ERROR("Failed while reading peaks\n");
-				image_free(image);
-				return NULL;
-			}
+	image = rc->image;
+	cffree(rc->data);
+	cffree(rc);
+	return image;
+}
 
-			image->features = peaks;
 
+/**
+ * \param sr A \ref StreamReader
+ * \param text Location to store the text of the chunk
+ * \param len Location to store the length of the text
+ *
+ * Like \ref stream_reader_next, but also returns the text of the chunk
+ * exactly as it appears in the stream, including the start and end markers.
+ * The text can be written to another stream with
+ * \ref stream_write_raw_chunk, which is much faster than writing the chunk
+ * again with \ref stream_write_chunk.  The text is not NUL-terminated, and
+ * must be freed by the caller.
+ *
+ * For binary streams, the text is not available and \p text will be set to
+ * NULL.
+ *
+ * \returns An image structure, or NULL at the end of the stream.
+ */
+struct image *stream_reader_next_with_text(StreamReader *sr, char **text,
+                                           size_t *len)
+{
+	struct raw_chunk *rc;
+	struct image *image;
 
-		}
+	*text = NULL;
+	*len = 0;
 
-		if ( strcmp(line, STREAM_CRYSTAL_START_MARKER) == 0 ) {
-			read_crystal(st, image, srf);
-		}
+	rc = next_parsed_chunk(sr);
+	if ( rc == NULL ) return NULL;
 
-		/* A chunk must have at least a filename and a wavelength,
-		 * otherwise it's incomplete */
-		if ( strcmp(line, STREAM_CHUNK_END_MARKER) == 0 ) {
-			if ( have_filename && have_ev ) {
-				/* Success */
-				if ( srf & STREAM_DATA_DETGEOM ) {
-					image->detgeom = create_detgeom(image, st->dtempl_read, 0);
-					if ( image->detgeom == NULL ) {
-						image_free(image);
-						return NULL;
-					}
-					image_create_dp_bad(image, st->dtempl_read);
-					image_set_zero_data(image, st->dtempl_read);
-				}
-				image->spectrum = spectrum_generate_gaussian(image->lambda,
-				                                             image->bw);
-				return image;
-			}
-			ERROR("Incomplete chunk found in input file.\n");
-			image_free(image);
-			return NULL;
-		}
+	image = rc->image;
+	*text = (char *)rc->data;
+	*len = (rc->data != NULL) ? rc->len : 0;
+	cffree(rc);
+	return image;
+}
 
-	} while ( 1 );
 
-	if ( !feof(st->fh) ) {
-		ERROR("Error reading stream.\n");
+/**
+ * \param sr A \ref StreamReader
+ *
+ * Stops the threads of \p sr and frees it, including any chunks which have
+ * not yet been returned by \ref stream_reader_next.  The \ref Stream itself
+ * is not closed.
+ */
+void stream_reader_free(StreamReader *sr)
+{
+	int i;
+
+	if ( sr == NULL ) return;
+
+	pthread_mutex_lock(&sr->lock);
+	sr->stop = 1;
+	pthread_cond_broadcast(&sr->cond);
+	pthread_mutex_unlock(&sr->lock);
+
+	pthread_join(sr->splitter, NULL);
+	for ( i=0; i<sr->n_workers; i++ ) {
+		pthread_join(sr->workers[i], NULL);
 	}
 
-	image_free(image);
-	return NULL;  /* Either error or EOF, don't care because we will complain
-	               * on the terminal if it was an error. */
+	free_raw_chunks(sr->in_head);
+	free_raw_chunks(sr->out);
+	pthread_mutex_destroy(&sr->lock);
+	pthread_cond_destroy(&sr->cond);
+	cffree(sr->workers);
+	cffree(sr);
 }
 
 
@@ -917,6 +3698,47 @@ char *stream_geometry_file(Stream *st)
 }
 
 
+/**
+ * \param st A \ref Stream
+ *
+ * \returns non-zero if \p st is in the binary format (see
+ * \ref stream_open_for_write_binary).
+ */
+int stream_is_binary(Stream *st)
+{
+	return st->binary;
+}
+
+
+/**
+ * \param st A \ref Stream
+ * \param max_peak Maximum peak height
+ * \param min_res Minimum resolution limit for crystals, in m^-1
+ * \param push_res Resolution margin, in m^-1
+ *
+ * Sets cutoffs to be applied to the integrated reflections while they are
+ * read from \p st, so that unwanted reflections never take up memory.  Only
+ * reflections with a peak height below \p max_peak will be kept, and only
+ * those within \p push_res of the resolution limit of their crystal.  Use
+ * +INFINITY for no resolution cutoff.  The reflections of crystals with a
+ * resolution limit lower than \p min_res will not be read at all.
+ *
+ * The resolution of each reflection is calculated using the unit cell of its
+ * crystal as it is in the stream.  If the cell is changed later, for example by
+ * post-refinement, the reflections will not be re-examined.
+ *
+ * This must be called before starting a \ref StreamReader for \p st.
+ */
+void stream_set_reflection_cutoffs(Stream *st, double max_peak,
+                                   double min_res, double push_res)
+{
+	st->have_cutoffs = 1;
+	st->cut_max_peak = max_peak;
+	st->cut_min_res = min_res;
+	st->cut_push_res = push_res;
+}
+
+
 static int read_geometry_file(Stream *st)
 {
 	int done = 0;
@@ -936,7 +3758,7 @@ static int read_geometry_file(Stream *st)
 		char line[1024];
 		char *rval;
 
-		rval = fgets(line, 1023, st->fh);
+		rval = stream_gets(st, line, 1023);
 		st->ln++;
 		if ( rval == NULL ) {
 			ERROR("Failed to read stream geometry file.\n");
@@ -964,7 +3786,9 @@ static int read_geometry_file(Stream *st)
 
 	st->geometry_file = geom;
 	st->dtempl_read = data_template_new_from_string(geom);
-	return (st->dtempl_read == NULL);
+	if ( st->dtempl_read == NULL ) return 1;
+	st->panels = make_panel_lookup(st->dtempl_read);
+	return 0;
 }
 
 
@@ -987,7 +3811,7 @@ static int read_headers(Stream *st)
 		char line[1024];
 		char *rval;
 
-		rval = fgets(line, 1023, st->fh);
+		rval = stream_gets(st, line, 1023);
 		st->ln++;
 		if ( rval == NULL ) {
 			ERROR("Failed to read stream audit info.\n");
@@ -1016,6 +3840,111 @@ static int read_headers(Stream *st)
 }
 
 
+static char *shard_path(const char *manifest, const char *shard)
+{
+	const char *slash;
+	char *path;
+	size_t dlen;
+
+	slash = strrchr(manifest, '/');
+	if ( (shard[0] == '/') || (slash == NULL) ) return cfstrdup(shard);
+
+	/* Relative to the location of the manifest */
+	dlen = slash - manifest + 1;
+	path = cfmalloc(dlen + strlen(shard) + 1);
+	if ( path == NULL ) return NULL;
+	strncpy(path, manifest, dlen);
+	strcpy(path+dlen, shard);
+	return path;
+}
+
+
+/* Reads the list of shards from a manifest, after the first line */
+static char **read_manifest(FILE *fh, const char *filename, int *pn)
+{
+	char **shards = NULL;
+	int n = 0;
+	int max = 0;
+	char line[1024];
+
+	while ( fgets(line, 1023, fh) != NULL ) {
+
+		chomp(line);
+		if ( line[0] == '\0' ) continue;
+
+		if ( n == max ) {
+			char **nshards;
+			max += 64;
+			nshards = cfrealloc(shards, max*sizeof(char *));
+			if ( nshards == NULL ) break;
+			shards = nshards;
+		}
+
+		shards[n] = shard_path(filename, line);
+		if ( shards[n] != NULL ) n++;
+	}
+
+	*pn = n;
+	return shards;
+}
+
+
+static void free_shards(char **shards, int n)
+{
+	int i;
+	for ( i=0; i<n; i++ ) {
+		cffree(shards[i]);
+	}
+	cffree(shards);
+}
+
+
+/**
+ * \param filename Filename of a stream manifest
+ * \param pn Place to store the number of shards
+ *
+ * Reads the list of shards from a stream manifest (see
+ * \ref stream_open_for_read).  The filenames are adjusted to be relative to
+ * the current directory.  The caller should free each filename as well as
+ * the array itself.
+ *
+ * \returns an array of filenames, or NULL if \p filename is not a manifest.
+ */
+char **stream_manifest_shards(const char *filename, int *pn)
+{
+	FILE *fh;
+	char line[1024];
+	char **shards = NULL;
+
+	*pn = 0;
+	fh = fopen(filename, "r");
+	if ( fh == NULL ) return NULL;
+
+	if ( (fgets(line, 1023, fh) != NULL)
+	  && (strncmp(line, STREAM_MANIFEST_MARKER,
+	              strlen(STREAM_MANIFEST_MARKER)) == 0) )
+	{
+		shards = read_manifest(fh, filename, pn);
+		if ( shards == NULL ) shards = cfmalloc(sizeof(char *));
+	}
+
+	fclose(fh);
+	return shards;
+}
+
+
+/**
+ * \param filename Filename of stream, or "-" for standard input
+ *
+ * Opens \p filename for reading.  As well as a normal stream, it can be a
+ * manifest, which lists several stream files ("shards") which should be read
+ * as one.  The first line of a manifest is \ref STREAM_MANIFEST_MARKER, and
+ * each following line contains the filename of one shard, relative to the
+ * location of the manifest.  Each shard is a complete stream, including
+ * headers.  The headers are taken from the first shard.
+ *
+ * \returns A \ref Stream, or NULL on failure.
+ */
 Stream *stream_open_for_read(const char *filename)
 {
 	Stream *st;
@@ -1026,9 +3955,31 @@ Stream *stream_open_for_read(const char *filename)
 	st->audit_info = NULL;
 	st->geometry_file = NULL;
 	st->n_chunks = 0;
+	st->max_chunks = 0;
 	st->chunk_offsets = NULL;
+	st->chunk_keys = NULL;
+	st->binary = 0;
+	st->binary_write = 0;
+	st->binary_started = 0;
+	st->binary_end = 0;
+	st->binary_start = 0;
 	st->dtempl_read = NULL;
+	st->panels = NULL;
+	st->map = NULL;
+	st->map_len = 0;
+	st->map_pos = 0;
+	st->map_owned = 0;
+	st->zr = NULL;
+	st->zw = NULL;
+	st->out_fh = NULL;
+	st->mem = NULL;
+	st->mem_len = 0;
+	st->wt = NULL;
 	st->dtempl_write = NULL;
+	st->shards = NULL;
+	st->n_shards = 0;
+	st->cur_shard = 0;
+	st->have_cutoffs = 0;
 
 	if ( strcmp(filename, "-") == 0 ) {
 		st->fh = stdin;
@@ -1041,19 +3992,56 @@ Stream *stream_open_for_read(const char *filename)
 		return NULL;
 	}
 
+	if ( (st->fh != stdin) && is_zstd_file(st->fh)
+	  && open_zstd_reader(st) )
+	{
+		ERROR("Failed to open compressed stream.\n");
+		stream_close(st);
+		return NULL;
+	}
+
 	char line[1024];
 	char *rval;
 
-	rval = fgets(line, 1023, st->fh);
+	rval = stream_gets(st, line, 1023);
 	if ( rval == NULL ) {
 		ERROR("Failed to read stream version.\n");
 		stream_close(st);
 		return NULL;
 	}
 
+	if ( strncmp(line, STREAM_MANIFEST_MARKER,
+	             strlen(STREAM_MANIFEST_MARKER)) == 0 )
+	{
+		st->shards = read_manifest(st->fh, filename, &st->n_shards);
+		if ( st->n_shards == 0 ) {
+			ERROR("No shards listed in stream manifest.\n");
+			stream_close(st);
+			return NULL;
+		}
+		st->cur_shard = -1;
+		if ( next_shard(st) ) {
+			ERROR("None of the stream shards could be opened.\n");
+			stream_close(st);
+			return NULL;
+		}
+		rval = stream_gets(st, line, 1023);
+		if ( rval == NULL ) {
+			ERROR("Failed to read stream version.\n");
+			stream_close(st);
+			return NULL;
+		}
+	}
+
 	if ( strncmp(line, "CrystFEL stream format 2.3", 26) == 0 ) {
 		st->major_version = 2;
 		st->minor_version = 3;
+	} else if ( strncmp(line, STREAM_BINARY_MARKER,
+	                    strlen(STREAM_BINARY_MARKER)) == 0 ) {
+		/* The contents are the same as format 2.3 */
+		st->major_version = 2;
+		st->minor_version = 3;
+		st->binary = 1;
 	} else {
 		ERROR("Invalid stream, or stream format is not understood.\n");
 		stream_close(st);
@@ -1066,6 +4054,29 @@ Stream *stream_open_for_read(const char *filename)
 		return NULL;
 	}
 
+	if ( st->binary && (st->zr != NULL) ) {
+		ERROR("Compressed binary streams are not supported.\n");
+		stream_close(st);
+		return NULL;
+	}
+
+	if ( st->binary ) {
+		/* The first shard of a manifest was mapped before we knew
+		 * that the stream is binary */
+		if ( st->map != NULL ) {
+			fseek(st->fh, st->map_pos, SEEK_SET);
+			unmap_stream(st);
+		}
+		if ( find_binary_start(st->fh, &st->ln) ) {
+			ERROR("Binary stream has no chunks.\n");
+			stream_close(st);
+			return NULL;
+		}
+		st->binary_start = ftell(st->fh);
+	} else if ( (st->map == NULL) && (st->zr == NULL) ) {
+		map_stream(st);
+	}
+
 	return st;
 }
 
@@ -1093,9 +4104,31 @@ Stream *stream_open_fd_for_write(int fd, const DataTemplate *dtempl)
 	st->audit_info = NULL;
 	st->geometry_file = NULL;
 	st->n_chunks = 0;
+	st->max_chunks = 0;
 	st->chunk_offsets = NULL;
+	st->chunk_keys = NULL;
+	st->binary = 0;
+	st->binary_write = 0;
+	st->binary_started = 0;
+	st->binary_end = 0;
+	st->binary_start = 0;
 	st->dtempl_read = NULL;
+	st->panels = NULL;
+	st->map = NULL;
+	st->map_len = 0;
+	st->map_pos = 0;
+	st->map_owned = 0;
+	st->zr = NULL;
+	st->zw = NULL;
+	st->out_fh = NULL;
+	st->mem = NULL;
+	st->mem_len = 0;
+	st->wt = NULL;
 	st->dtempl_write = NULL;
+	st->shards = NULL;
+	st->n_shards = 0;
+	st->cur_shard = 0;
+	st->have_cutoffs = 0;
 
 	st->fh = fdopen(fd, "w");
 	if ( st->fh == NULL ) {
@@ -1124,23 +4157,9 @@ void stream_write_target_cell(Stream *st, UnitCell *cell)
 }
 
 
-/**
- * \param filename Filename of new stream
- * \param dtempl A DataTemplate
- *
- * Creates a new stream with name \p filename.  If \p filename already
- * exists, it will be overwritten.
- *
- * The CrystFEL version number will be written, but you should call
- * stream_write_geometry_file, stream_write_target_cell,
- * stream_write_commandline_args and stream_write_Indexing_methods to write
- * extended audit information.
- *
- * \returns A \ref Stream, or NULL on failure.
- */
-Stream *stream_open_for_write(const char *filename,
-                              const DataTemplate *dtempl)
-
+static Stream *open_for_write(const char *filename,
+                              const DataTemplate *dtempl,
+                              int binary)
 {
 	Stream *st;
 
@@ -1150,9 +4169,31 @@ Stream *stream_open_for_write(const char *filename,
 	st->audit_info = NULL;
 	st->geometry_file = NULL;
 	st->n_chunks = 0;
+	st->max_chunks = 0;
 	st->chunk_offsets = NULL;
+	st->chunk_keys = NULL;
+	st->binary = 0;
+	st->binary_write = 0;
+	st->binary_started = 0;
+	st->binary_end = 0;
+	st->binary_start = 0;
 	st->dtempl_write = dtempl;
 	st->dtempl_read = NULL;
+	st->panels = NULL;
+	st->map = NULL;
+	st->map_len = 0;
+	st->map_pos = 0;
+	st->map_owned = 0;
+	st->zr = NULL;
+	st->zw = NULL;
+	st->out_fh = NULL;
+	st->mem = NULL;
+	st->mem_len = 0;
+	st->wt = NULL;
+	st->shards = NULL;
+	st->n_shards = 0;
+	st->cur_shard = 0;
+	st->have_cutoffs = 0;
 
 	st->fh = fopen(filename, "w");
 	if ( st->fh == NULL ) {
@@ -1161,11 +4202,25 @@ Stream *stream_open_for_write(const char *filename,
 		return NULL;
 	}
 
+	if ( !binary && has_zstd_suffix(filename) && open_zstd_writer(st) ) {
+		ERROR("Failed to set up stream compression.\n");
+		end_mem_output(st);
+		fclose(st->fh);
+		cffree(st);
+		return NULL;
+	}
+
 	st->major_version = LATEST_MAJOR_VERSION;
 	st->minor_version = LATEST_MINOR_VERSION;
+	st->binary = binary;
+	st->binary_write = binary;
 
-	fprintf(st->fh, "CrystFEL stream format %i.%i\n",
-	        st->major_version, st->minor_version);
+	if ( binary ) {
+		fprintf(st->fh, STREAM_BINARY_MARKER"\n");
+	} else {
+		fprintf(st->fh, "CrystFEL stream format %i.%i\n",
+		        st->major_version, st->minor_version);
+	}
 	fprintf(st->fh, "Generated by CrystFEL %s\n",
 	        libcrystfel_version_string());
 	fflush(st->fh);
@@ -1174,6 +4229,107 @@ Stream *stream_open_for_write(const char *filename,
 }
 
 
+/**
+ * \param filename Filename of new stream
+ * \param dtempl A DataTemplate
+ *
+ * Creates a new stream with name \p filename.  If \p filename already
+ * exists, it will be overwritten.
+ *
+ * The CrystFEL version number will be written, but you should call
+ * stream_write_geometry_file, stream_write_target_cell,
+ * stream_write_commandline_args and stream_write_Indexing_methods to write
+ * extended audit information.
+ *
+ * If \p filename ends with ".zst", the stream will be compressed with zstd.
+ * Each chunk is compressed separately, so that the stream can still be read
+ * in parallel and with random access.  \ref stream_open_for_read recognises
+ * compressed streams automatically, and they can also be decompressed with
+ * the zstd program.
+ *
+ * \returns A \ref Stream, or NULL on failure.
+ */
+Stream *stream_open_for_write(const char *filename,
+                              const DataTemplate *dtempl)
+{
+	return open_for_write(filename, dtempl, 0);
+}
+
+
+/**
+ * \param filename Filename of new stream
+ * \param dtempl A DataTemplate
+ *
+ * Like \ref stream_open_for_write, but the stream will be written in the
+ * binary format.  The headers are the same as for a normal stream, but the
+ * chunks are stored in a compact, compressed form with the peak and
+ * reflection tables as arrays of numbers, and an index is written at the end
+ * by \ref stream_close.  Binary streams can be read with
+ * \ref stream_open_for_read, just like normal streams, and the program
+ * convert_stream converts between the two formats.
+ *
+ * The panel numbers of the peaks and reflections are stored directly, so the
+ * geometry file written to the stream must be the one for \p dtempl.
+ *
+ * \returns A \ref Stream, or NULL on failure.
+ */
+Stream *stream_open_for_write_binary(const char *filename,
+                                     const DataTemplate *dtempl)
+{
+	return open_for_write(filename, dtempl, 1);
+}
+
+
+/**
+ * \param st A \ref Stream opened for writing
+ *
+ * Makes \p st do its writing in a separate thread.  After this,
+ * \ref stream_write_chunk formats each chunk in memory and hands it over to
+ * the thread, so the caller doesn't have to wait for the file to be written.
+ * If the thread falls too far behind, \ref stream_write_chunk will wait for
+ * it to catch up.  \ref stream_close waits until everything has been
+ * written.
+ *
+ * This can't be used for binary streams.
+ *
+ * \returns non-zero on error.
+ */
+int stream_start_writer_thread(Stream *st)
+{
+	struct writer_thread *wt;
+
+	if ( st->binary_write ) {
+		ERROR("Can't use a writer thread for a binary stream.\n");
+		return 1;
+	}
+	if ( st->wt != NULL ) return 0;
+	if ( start_mem_output(st) ) return 1;
+
+	wt = cfmalloc(sizeof(struct writer_thread));
+	if ( wt == NULL ) return 1;
+
+	wt->fh = st->out_fh;
+	wt->first = NULL;
+	wt->last = NULL;
+	wt->queued = 0;
+	wt->finish = 0;
+	wt->err = 0;
+	pthread_mutex_init(&wt->lock, NULL);
+	pthread_cond_init(&wt->cond, NULL);
+
+	if ( pthread_create(&wt->thread, NULL, writer_thread_main, wt) ) {
+		ERROR("Failed to start stream writer thread.\n");
+		pthread_mutex_destroy(&wt->lock);
+		pthread_cond_destroy(&wt->cond);
+		cffree(wt);
+		return 1;
+	}
+
+	st->wt = wt;
+	return 0;
+}
+
+
 FILE *stream_get_fh(Stream *st)
 {
 	return st->fh;
@@ -1187,10 +4343,23 @@ FILE *stream_get_fh(Stream *st)
  */
 void stream_close(Stream *st)
 {
+	int i;
+
 	if ( st == NULL ) return;
+	if ( st->binary_write ) write_binary_index(st);
+	end_mem_output(st);
+	for ( i=0; i<st->n_chunks; i++ ) {
+		cffree(st->chunk_keys[i]);
+	}
+	cffree(st->chunk_keys);
+	cffree(st->chunk_offsets);
 	cffree(st->audit_info);
 	cffree(st->geometry_file);
+	free_zstd_reader(st);
+	unmap_stream(st);
+	free_panel_lookup(st->panels);
 	data_template_free(st->dtempl_read);
+	free_shards(st->shards, st->n_shards);
 	fclose(st->fh);
 	cffree(st);
 }
@@ -1300,44 +4469,132 @@ void stream_write_geometry_file(Stream *st, const char *geom_filename)
  */
 int stream_rewind(Stream *st)
 {
+	if ( st->n_shards > 0 ) {
+		st->cur_shard = -1;
+		return next_shard(st);
+	}
+	if ( st->binary ) {
+		st->binary_end = 0;
+		return fseek(st->fh, st->binary_start, SEEK_SET);
+	}
 	st->ln = 0;
+	if ( st->zr != NULL ) {
+		load_zstd_frame(st, 0);
+		return 0;
+	}
+	if ( st->map != NULL ) {
+		st->map_pos = 0;
+		return 0;
+	}
 	return fseek(st->fh, 0, SEEK_SET);
 }
 
 
+#define STREAM_INDEX_SUFFIX ".idx"
+#define STREAM_INDEX_MAGIC "CFSI"
+#define STREAM_INDEX_VERSION (2)
+
+/* Size and modification time of a stream file (or shard), used to check
+ * whether a saved index is still valid */
+struct file_stamp
+{
+	uint64_t size;
+	uint64_t mtime;
+};
+
+
 struct _streamindex
 {
 	char **keys;
 	long int *ptrs;
+	int *shards;
 	int n_keys;
 	int max_keys;
+
+	/* Open-addressing hash table of positions in 'keys', -1 for empty */
+	int *hash;
+	size_t hash_size;  /* Power of two */
+
+	/* Stamps of the stream (and its shards) when they were indexed, and
+	 * the position in each file up to which all chunks have been indexed.
+	 * The position is -1 if the file can only be indexed from the start.
+	 * Entry 0 is the stream itself, followed by the shards if the stream
+	 * is a manifest. */
+	int n_stamps;
+	struct file_stamp *stamps;
+	long int *resume;
 };
 
 
 void stream_index_free(StreamIndex *index)
 {
+	int i;
 	if ( index == NULL ) return;
+	for ( i=0; i<index->n_keys; i++ ) {
+		cffree(index->keys[i]);
+	}
 	cffree(index->keys);
 	cffree(index->ptrs);
+	cffree(index->shards);
+	cffree(index->hash);
+	cffree(index->stamps);
+	cffree(index->resume);
 	cffree(index);
 }
 
 
-static char *make_key(const char *filename,
-                      const char *ev)
+static void build_index_hash(StreamIndex *index)
 {
-	char *key;
+	size_t size = 16;
+	int i;
 
-	if ( ev == NULL ) ev = "//";
+	while ( size < 2*(size_t)index->n_keys ) size *= 2;
 
-	key = cfmalloc(strlen(filename)+strlen(ev)+2);
-	if ( key == NULL ) return NULL;
+	cffree(index->hash);
+	index->hash = cfmalloc(size*sizeof(int));
+	if ( index->hash == NULL ) return;
+	index->hash_size = size;
 
-	strcpy(key, filename);
-	strcat(key, " ");
-	strcat(key, ev);
+	for ( i=0; i<(int)size; i++ ) index->hash[i] = -1;
 
-	return key;
+	for ( i=0; i<index->n_keys; i++ ) {
+		size_t h = hash_string(index->keys[i]) & (size-1);
+		int dup = 0;
+		while ( index->hash[h] != -1 ) {
+			/* Keep the first occurrence of a key */
+			if ( strcmp(index->keys[index->hash[h]],
+			            index->keys[i]) == 0 )
+			{
+				dup = 1;
+				break;
+			}
+			h = (h+1) & (size-1);
+		}
+		if ( !dup ) index->hash[h] = i;
+	}
+}
+
+
+/* Returns the position of 'key' in the index, or -1 */
+static int find_index_key(StreamIndex *index, const char *key)
+{
+	int i;
+
+	if ( index->hash != NULL ) {
+		size_t h = hash_string(key) & (index->hash_size-1);
+		while ( index->hash[h] != -1 ) {
+			if ( strcmp(index->keys[index->hash[h]], key) == 0 ) {
+				return index->hash[h];
+			}
+			h = (h+1) & (index->hash_size-1);
+		}
+		return -1;
+	}
+
+	for ( i=0; i<index->n_keys; i++ ) {
+		if ( strcmp(index->keys[i], key) == 0 ) return i;
+	}
+	return -1;
 }
 
 
@@ -1349,94 +4606,197 @@ int stream_select_chunk(Stream *st,
 	int i;
 	char *key;
 
-	if ( index == NULL ) return 1;
+	if ( index == NULL ) return 1;
+
+	key = make_key(filename, ev);
+	if ( key == NULL ) return 1;
+	i = find_index_key(index, key);
+	cffree(key);
+	if ( i < 0 ) return 1;
+
+	if ( st != NULL ) {
+		if ( (st->n_shards > 0)
+		  && (index->shards[i] != st->cur_shard)
+		  && open_shard(st, index->shards[i]) )
+		{
+			return 1;
+		}
+		if ( st->zr != NULL ) {
+			if ( load_zstd_frame(st, index->ptrs[i]) ) return 1;
+		} else if ( st->map != NULL ) {
+			if ( (size_t)index->ptrs[i] > st->map_len ) return 1;
+			st->map_pos = index->ptrs[i];
+		} else {
+			fseek(st->fh, index->ptrs[i], SEEK_SET);
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * \param index A \ref StreamIndex
+ *
+ * \returns the number of entries in \p index, including any repeated entries
+ * for the same frame.
+ */
+int stream_index_num_chunks(StreamIndex *index)
+{
+	if ( index == NULL ) return 0;
+	return index->n_keys;
+}
+
+
+/**
+ * \param index A \ref StreamIndex
+ * \param i Entry number, from zero to one less than the value returned by
+ *   \ref stream_index_num_chunks
+ * \param pfilename Location at which to store the filename
+ * \param pev Location at which to store the event ID
+ *
+ * Looks up entry \p i in \p index, in the order in which the chunks appear in
+ * the stream.  The filename and event ID are newly allocated, and must be
+ * freed by the caller.  The event ID will be NULL if the chunk did not have
+ * one.
+ *
+ * If the same frame appears more than once in the stream, only the first
+ * entry can be selected with \ref stream_select_chunk.  The later ones are
+ * reported as an error, so that iterating over all the entries visits each
+ * frame once.
+ *
+ * \returns zero on success, non-zero on error or for a repeated entry.
+ */
+int stream_index_get_chunk(StreamIndex *index, int i,
+                           char **pfilename, char **pev)
+{
+	const char *key;
+	const char *sp;
+	char *filename;
+
+	if ( (index == NULL) || (i < 0) || (i >= index->n_keys) ) return 1;
+	if ( find_index_key(index, index->keys[i]) != i ) return 1;
+
+	/* Event IDs don't contain spaces, but filenames might */
+	key = index->keys[i];
+	sp = strrchr(key, ' ');
+	if ( sp == NULL ) return 1;
+
+	filename = cfmalloc(sp-key+1);
+	if ( filename == NULL ) return 1;
+	memcpy(filename, key, sp-key);
+	filename[sp-key] = '\0';
 
-	key = make_key(filename, ev);
-	for ( i=0; i<index->n_keys; i++ ) {
-		if ( strcmp(index->keys[i], key) == 0 ) {
-			if ( st != NULL ) {
-				fseek(st->fh, index->ptrs[i], SEEK_SET);
-			}
-			return 0;
+	if ( strcmp(sp+1, "//") == 0 ) {
+		*pev = NULL;
+	} else {
+		*pev = cfstrdup(sp+1);
+		if ( *pev == NULL ) {
+			cffree(filename);
+			return 1;
 		}
 	}
-	return 1;
+	*pfilename = filename;
+	return 0;
 }
 
 
-static void add_index_record(StreamIndex *index,
-                             long int ptr,
-                             const char *filename,
-                             const char *ev)
+/* Takes ownership of 'key' */
+static void add_index_key(StreamIndex *index, long int ptr, int shard,
+                          char *key)
 {
-	char *key;
+	if ( key == NULL ) return;
 
 	if ( index->n_keys == index->max_keys ) {
 
 		int new_max_keys = index->max_keys + 256;
 		char **new_keys;
 		long int *new_ptrs;
+		int *new_shards;
 
 		new_keys = cfrealloc(index->keys,
 		                     new_max_keys*sizeof(char *));
-		if ( new_keys == NULL ) return;
+		if ( new_keys == NULL ) {
+			cffree(key);
+			return;
+		}
+		index->keys = new_keys;
 
 		new_ptrs = cfrealloc(index->ptrs,
 		                     new_max_keys*sizeof(long int));
 		if ( new_ptrs == NULL ) {
-			cffree(new_keys);
+			cffree(key);
 			return;
 		}
-
-		index->keys = new_keys;
 		index->ptrs = new_ptrs;
+
+		new_shards = cfrealloc(index->shards,
+		                       new_max_keys*sizeof(int));
+		if ( new_shards == NULL ) {
+			cffree(key);
+			return;
+		}
+		index->shards = new_shards;
+
 		index->max_keys = new_max_keys;
 
 	}
 
-	key = make_key(filename, ev);
-	if ( key == NULL ) return;
-
 	index->keys[index->n_keys] = key;
 	index->ptrs[index->n_keys] = ptr;
+	index->shards[index->n_keys] = shard;
 	index->n_keys++;
 }
 
 
-StreamIndex *stream_make_index(const char *filename)
+static void add_index_record(StreamIndex *index,
+                             long int ptr, int shard,
+                             const char *filename,
+                             const char *ev)
 {
-	FILE *fh;
-	StreamIndex *index;
-	long int last_start_pos = 0;
-	char *last_filename = NULL;
-	char *last_ev = NULL;
-	int done = 0;
+	add_index_key(index, ptr, shard, make_key(filename, ev));
+}
 
-	fh = fopen(filename, "r");
-	if ( fh == NULL ) return NULL;
 
-	index = cfmalloc(sizeof(StreamIndex));
-	if ( index == NULL ) {
-		fclose(fh);
-		return NULL;
+/* Removes all the entries for one shard (or all entries, if 'shard' is
+ * negative).  The hash table needs to be built again afterwards. */
+static void remove_index_keys(StreamIndex *index, int shard)
+{
+	int i;
+	int n = 0;
+
+	for ( i=0; i<index->n_keys; i++ ) {
+		if ( (shard < 0) || (index->shards[i] == shard) ) {
+			cffree(index->keys[i]);
+			continue;
+		}
+		index->keys[n] = index->keys[i];
+		index->ptrs[n] = index->ptrs[i];
+		index->shards[n] = index->shards[i];
+		n++;
 	}
+	index->n_keys = n;
+}
 
-	index->keys = NULL;
-	index->ptrs = NULL;
-	index->n_keys = 0;
-	index->max_keys = 0;
 
-	STATUS("Scanning %s\n", filename);
+/* Returns the position after the last complete chunk */
+static long int scan_for_index(StreamIndex *index, Stream *st, int shard)
+{
+	long int last_start_pos = 0;
+	char *last_filename = NULL;
+	char *last_ev = NULL;
+	long int resume = stream_tell(st);
 
 	do {
 
 		char *rval;
 		char line[1024];
 		long int pos;
+		int complete;
 
-		pos = ftell(fh);
-		rval = fgets(line, 1024, fh);
+		pos = stream_tell(st);
+		rval = stream_gets(st, line, 1024);
 		if ( rval == NULL ) break;
+		complete = (line[0] != '\0') && (line[strlen(line)-1] == '\n');
 		chomp(line);
 
 		if ( strcmp(line, STREAM_CHUNK_START_MARKER) == 0 ) {
@@ -1454,11 +4814,15 @@ StreamIndex *stream_make_index(const char *filename)
 		}
 
 		if ( strcmp(line, STREAM_CHUNK_END_MARKER) == 0 ) {
-			if ( (last_start_pos != 0)
+
+			/* The end of the chunk might still be being written */
+			if ( !complete ) break;
+
+			if ( (last_start_pos > 0)
 			     && (last_filename != NULL) )
 			{
 				add_index_record(index,
-				                 last_start_pos,
+				                 last_start_pos, shard,
 				                 last_filename,
 				                 last_ev);
 			}
@@ -1467,10 +4831,514 @@ StreamIndex *stream_make_index(const char *filename)
 			last_start_pos = 0;
 			last_filename = NULL;
 			last_ev = NULL;
+			resume = stream_tell(st);
+		}
+
+	} while ( 1 );
+
+	cffree(last_filename);
+	cffree(last_ev);
+	return resume;
+}
+
+
+/* Reads the index from the end of a binary stream */
+static int read_binary_index(StreamIndex *index, FILE *fh, int shard)
+{
+	unsigned char tail[12];
+	unsigned char *buf;
+	const unsigned char *magic;
+	struct bin_rd r;
+	long end;
+	uint64_t pos;
+	uint32_t i, n;
+
+	if ( fseek(fh, -12, SEEK_END) ) return 1;
+	if ( fread(tail, 1, 12, fh) != 12 ) return 1;
+	if ( memcmp(tail+8, BIN_END_MAGIC, 4) != 0 ) return 1;
+
+	end = ftell(fh) - 12;
+	pos = get_u64(tail);
+	if ( (end < 0) || (pos >= (uint64_t)end) ) return 1;
+	if ( fseek(fh, pos, SEEK_SET) ) return 1;
+
+	buf = cfmalloc(end - pos);
+	if ( buf == NULL ) return 1;
+	if ( fread(buf, 1, end - pos, fh) != end - pos ) {
+		cffree(buf);
+		return 1;
+	}
+
+	r.data = buf;
+	r.len = end - pos;
+	r.pos = 0;
+	r.err = 0;
+
+	magic = rd_take(&r, 4);
+	if ( (magic == NULL) || (memcmp(magic, BIN_INDEX_MAGIC, 4) != 0) ) {
+		cffree(buf);
+		return 1;
+	}
+
+	n = rd_u32(&r);
+	for ( i=0; (i<n) && !r.err; i++ ) {
+		long int ptr = rd_u64(&r);
+		add_index_key(index, ptr, shard, rd_str(&r));
+	}
+
+	cffree(buf);
+	return r.err;
+}
+
+
+/* Returns the position after the last complete chunk, or -1 if the index at
+ * the end of the stream was used */
+static long int scan_binary_for_index(StreamIndex *index, FILE *fh, int shard,
+                                      long int start)
+{
+	long int resume;
+
+	if ( start > 0 ) {
+		if ( fseek(fh, start, SEEK_SET) ) return start;
+	} else {
+
+		if ( read_binary_index(index, fh, shard) == 0 ) return -1;
+		remove_index_keys(index, shard);
+
+		/* No index, e.g. because the writer did not finish.
+		 * Go through the chunks one by one instead. */
+		rewind(fh);
+		if ( find_binary_start(fh, NULL) ) return 0;
+
+	}
+
+	resume = ftell(fh);
+
+	do {
+
+		long int pos;
+		unsigned char *data;
+		size_t len;
+		int end;
+		struct bin_rd r;
+		char *filename;
+		char *ev;
+
+		pos = ftell(fh);
+		data = read_binary_record(fh, &len, &end);
+		if ( data == NULL ) break;
+
+		r.data = data;
+		r.len = len;
+		r.pos = 0;
+		r.err = 0;
+		filename = rd_str(&r);
+		ev = rd_str(&r);
+		if ( filename != NULL ) {
+			add_index_record(index, pos, shard, filename, ev);
+		}
+		cffree(filename);
+		cffree(ev);
+		cffree(data);
+		resume = ftell(fh);
+
+	} while ( 1 );
+
+	return resume;
+}
+
+
+/* Checks that a text stream has the end of a chunk just before 'pos', so that
+ * it's safe to carry on indexing from there */
+static int text_resume_ok(FILE *fh, long int pos)
+{
+	char tmp[64];
+	const size_t len = strlen(STREAM_CHUNK_END_MARKER"\n");
+
+	if ( pos < (long int)len ) return 0;
+	if ( fseek(fh, pos-len, SEEK_SET) ) return 0;
+	if ( fread(tmp, 1, len, fh) != len ) return 0;
+	return memcmp(tmp, STREAM_CHUNK_END_MARKER"\n", len) == 0;
+}
+
+
+/* Indexes one stream file, which can be text, compressed text or binary.
+ * If possible, only the chunks after 'start' are indexed.  Otherwise, the
+ * existing entries for the file are removed and the whole file is indexed.
+ * Returns the position after the last complete chunk, or -1 if the file can
+ * only be indexed from the start. */
+static long int index_stream_file(StreamIndex *index, const char *filename,
+                                  FILE *fh, int shard, long int start)
+{
+	char line[1024];
+	struct _stream tmp;
+	long int resume;
+	int binary;
+
+	binary = (fgets(line, 1023, fh) != NULL)
+	      && (strncmp(line, STREAM_BINARY_MARKER,
+	                  strlen(STREAM_BINARY_MARKER)) == 0);
+
+	/* The file might have been truncated and written again */
+	if ( (fseek(fh, 0, SEEK_END) != 0) || (start > ftell(fh)) ) start = 0;
+
+	rewind(fh);
+	if ( !binary && is_zstd_file(fh) ) start = 0;
+	if ( !binary && (start > 0) && !text_resume_ok(fh, start) ) start = 0;
+
+	if ( start <= 0 ) {
+		STATUS("Scanning %s\n", filename);
+		remove_index_keys(index, shard);
+		start = 0;
+	}
+
+	if ( binary ) {
+		return scan_binary_for_index(index, fh, shard, start);
+	}
+
+	/* scan_for_index() only needs these parts of the Stream */
+	rewind(fh);
+	tmp.fh = fh;
+	tmp.map = NULL;
+	tmp.map_len = 0;
+	tmp.map_pos = 0;
+	tmp.map_owned = 0;
+	tmp.zr = NULL;
+	tmp.zw = NULL;
+	if ( is_zstd_file(fh) ) {
+		if ( open_zstd_reader(&tmp) ) return -1;
+		scan_for_index(index, &tmp, shard);
+		free_zstd_reader(&tmp);
+		return -1;
+	}
+
+	if ( fseek(fh, start, SEEK_SET) ) return -1;
+	resume = scan_for_index(index, &tmp, shard);
+	return resume;
+}
+
+
+static StreamIndex *new_stream_index(void)
+{
+	StreamIndex *index = cfmalloc(sizeof(StreamIndex));
+	if ( index == NULL ) return NULL;
+
+	index->keys = NULL;
+	index->ptrs = NULL;
+	index->shards = NULL;
+	index->n_keys = 0;
+	index->max_keys = 0;
+	index->hash = NULL;
+	index->hash_size = 0;
+	index->n_stamps = 0;
+	index->stamps = NULL;
+	index->resume = NULL;
+	return index;
+}
+
+
+/* Stamps for the stream itself, followed by those for the shards */
+static struct file_stamp *get_stamps(const char *filename,
+                                     char **shards, int n_shards)
+{
+	struct file_stamp *stamps;
+	int i;
+
+	stamps = cfmalloc((n_shards+1)*sizeof(struct file_stamp));
+	if ( stamps == NULL ) return NULL;
+
+	for ( i=0; i<=n_shards; i++ ) {
+		struct stat s;
+		const char *fn = (i==0) ? filename : shards[i-1];
+		if ( stat(fn, &s) == 0 ) {
+			stamps[i].size = s.st_size;
+			stamps[i].mtime = s.st_mtime;
+		} else {
+			stamps[i].size = UINT64_MAX;
+			stamps[i].mtime = 0;
+		}
+	}
+
+	return stamps;
+}
+
+
+static char *index_filename(const char *filename)
+{
+	char *fn = cfmalloc(strlen(filename)+strlen(STREAM_INDEX_SUFFIX)+1);
+	if ( fn == NULL ) return NULL;
+	strcpy(fn, filename);
+	strcat(fn, STREAM_INDEX_SUFFIX);
+	return fn;
+}
+
+
+/* Reads the index saved next to the stream.  The index might be out of date,
+ * which will be dealt with by stream_update_index() */
+static StreamIndex *load_index(const char *filename)
+{
+	char *fn;
+	FILE *fh;
+	struct stat s;
+	unsigned char *buf;
+	const unsigned char *magic;
+	struct bin_rd r;
+	StreamIndex *index;
+	uint32_t i, n;
+
+	fn = index_filename(filename);
+	if ( fn == NULL ) return NULL;
+	fh = fopen(fn, "rb");
+	cffree(fn);
+	if ( fh == NULL ) return NULL;
+
+	if ( (fstat(fileno(fh), &s) != 0) || (s.st_size < 12) ) {
+		fclose(fh);
+		return NULL;
+	}
+
+	buf = cfmalloc(s.st_size);
+	if ( buf == NULL ) {
+		fclose(fh);
+		return NULL;
+	}
+	if ( fread(buf, 1, s.st_size, fh) != (size_t)s.st_size ) {
+		cffree(buf);
+		fclose(fh);
+		return NULL;
+	}
+	fclose(fh);
+
+	r.data = buf;
+	r.len = s.st_size;
+	r.pos = 0;
+	r.err = 0;
+
+	magic = rd_take(&r, 4);
+	if ( (magic == NULL) || (memcmp(magic, STREAM_INDEX_MAGIC, 4) != 0)
+	  || (rd_u32(&r) != STREAM_INDEX_VERSION) )
+	{
+		cffree(buf);
+		return NULL;
+	}
+
+	index = new_stream_index();
+	if ( index == NULL ) {
+		cffree(buf);
+		return NULL;
+	}
+
+	n = rd_u32(&r);
+	if ( (n == 0) || (n > r.len/24) ) r.err = 1;
+	if ( !r.err ) {
+		index->stamps = cfmalloc(n*sizeof(struct file_stamp));
+		index->resume = cfmalloc(n*sizeof(long int));
+		if ( (index->stamps == NULL) || (index->resume == NULL) ) {
+			r.err = 1;
+		} else {
+			index->n_stamps = n;
+		}
+	}
+	for ( i=0; (i<(uint32_t)index->n_stamps) && !r.err; i++ ) {
+		index->stamps[i].size = rd_u64(&r);
+		index->stamps[i].mtime = rd_u64(&r);
+		index->resume[i] = (int64_t)rd_u64(&r);
+	}
+
+	n = rd_u32(&r);
+	for ( i=0; (i<n) && !r.err; i++ ) {
+		long int ptr = rd_u64(&r);
+		int shard = rd_u32(&r);
+		add_index_key(index, ptr, shard, rd_str(&r));
+	}
+
+	cffree(buf);
+
+	if ( r.err || (index->n_keys != (int)n) ) {
+		stream_index_free(index);
+		return NULL;
+	}
+
+	return index;
+}
+
+
+/* Saves the index next to the stream.  Failure doesn't matter, because the
+ * stream will just be scanned again next time. */
+static void save_index(StreamIndex *index, const char *filename)
+{
+	struct bin_buf b = {NULL, 0, 0, 0};
+	char *fn;
+	char *tmp;
+	FILE *fh;
+	int i;
+	int ok;
+
+	bb_magic(&b, STREAM_INDEX_MAGIC);
+	bb_u32(&b, STREAM_INDEX_VERSION);
+	bb_u32(&b, index->n_stamps);
+	for ( i=0; i<index->n_stamps; i++ ) {
+		bb_u64(&b, index->stamps[i].size);
+		bb_u64(&b, index->stamps[i].mtime);
+		bb_u64(&b, (int64_t)index->resume[i]);
+	}
+	bb_u32(&b, index->n_keys);
+	for ( i=0; i<index->n_keys; i++ ) {
+		bb_u64(&b, index->ptrs[i]);
+		bb_u32(&b, index->shards[i]);
+		bb_str(&b, index->keys[i]);
+	}
+
+	fn = index_filename(filename);
+	tmp = (fn == NULL) ? NULL : index_filename(fn);
+	if ( b.err || (tmp == NULL) ) {
+		cffree(b.data);
+		cffree(fn);
+		cffree(tmp);
+		return;
+	}
+
+	/* Write to a temporary file first, so that another process never
+	 * sees a partial index */
+	fh = fopen(tmp, "wb");
+	if ( fh != NULL ) {
+		ok = (fwrite(b.data, 1, b.len, fh) == b.len);
+		if ( fclose(fh) != 0 ) ok = 0;
+		if ( !ok || (rename(tmp, fn) != 0) ) unlink(tmp);
+	}
+
+	cffree(b.data);
+	cffree(fn);
+	cffree(tmp);
+}
+
+
+static int same_stamp(struct file_stamp a, struct file_stamp b)
+{
+	return (a.size == b.size) && (a.mtime == b.mtime);
+}
+
+
+/**
+ * \param index A \ref StreamIndex
+ * \param filename Filename of the stream, or stream manifest, which was used
+ *    to create \p index
+ *
+ * Brings \p index up to date with the contents of \p filename.  Only streams
+ * (or shards) which have changed since they were last indexed will be looked
+ * at.  If a stream is still being written, only the chunks which have been
+ * added since the last time will be scanned, unless the stream is compressed.
+ *
+ * The updated index will be saved next to the stream, in the same way as for
+ * \ref stream_make_index.
+ *
+ * \returns non-zero on error.
+ */
+int stream_update_index(StreamIndex *index, const char *filename)
+{
+	char **shards;
+	int n_shards;
+	struct file_stamp *stamps;
+	long int *resume;
+	int n_stamps;
+	int fresh;
+	int changed = 0;
+	int i;
+
+	shards = stream_manifest_shards(filename, &n_shards);
+	if ( shards == NULL ) n_shards = 0;
+	n_stamps = n_shards+1;
+
+	/* Stamps are taken before scanning, so that changes to the stream
+	 * during the scan will be picked up next time */
+	stamps = get_stamps(filename, shards, n_shards);
+	resume = cfmalloc(n_stamps*sizeof(long int));
+	if ( (stamps == NULL) || (resume == NULL) ) {
+		free_shards(shards, n_shards);
+		cffree(stamps);
+		cffree(resume);
+		return 1;
+	}
+
+	/* If the stream has been replaced by a different manifest, or the
+	 * manifest has changed, everything has to be done again */
+	fresh = (index->n_stamps != n_stamps)
+	     || ((shards != NULL) && !same_stamp(index->stamps[0], stamps[0]));
+	if ( fresh ) {
+		remove_index_keys(index, -1);
+		for ( i=0; i<n_stamps; i++ ) resume[i] = 0;
+		changed = 1;
+	} else {
+		for ( i=0; i<n_stamps; i++ ) resume[i] = index->resume[i];
+	}
+
+	for ( i=0; i<((shards == NULL) ? 1 : n_shards); i++ ) {
+
+		int k = (shards == NULL) ? 0 : i+1;
+		const char *fn = (shards == NULL) ? filename : shards[i];
+		FILE *fh;
+
+		if ( !fresh && same_stamp(index->stamps[k], stamps[k]) ) {
+			continue;
+		}
+		changed = 1;
+
+		fh = fopen(fn, "r");
+		if ( fh == NULL ) {
+			remove_index_keys(index, i);
+			resume[k] = 0;
+			continue;
 		}
 
-	} while ( !done );
+		resume[k] = index_stream_file(index, fn, fh, i, resume[k]);
+		fclose(fh);
+
+	}
+	free_shards(shards, n_shards);
+
+	cffree(index->stamps);
+	cffree(index->resume);
+	index->stamps = stamps;
+	index->resume = resume;
+	index->n_stamps = n_stamps;
+
+	if ( changed || (index->hash == NULL) ) build_index_hash(index);
+	if ( changed ) save_index(index, filename);
+
+	return 0;
+}
+
+
+/**
+ * \param filename Filename of a stream, or of a stream manifest
+ *
+ * Creates an index of the chunks in \p filename, for use with
+ * \ref stream_select_chunk.
+ *
+ * The index is saved in a file next to the stream, with ".idx" added to the
+ * filename, and will be used next time instead of scanning the stream again.
+ * If the stream has changed since then, the saved index will be brought up to
+ * date using \ref stream_update_index.
+ *
+ * \returns the index, or NULL on error.
+ */
+StreamIndex *stream_make_index(const char *filename)
+{
+	FILE *fh;
+	StreamIndex *index;
 
+	fh = fopen(filename, "r");
+	if ( fh == NULL ) return NULL;
 	fclose(fh);
+
+	index = load_index(filename);
+	if ( index == NULL ) index = new_stream_index();
+	if ( index == NULL ) return NULL;
+
+	if ( stream_update_index(index, filename) ) {
+		stream_index_free(index);
+		return NULL;
+	}
+
 	return index;
 }
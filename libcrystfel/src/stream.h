@@ -42,6 +42,7 @@ struct image;
 
 #include "datatemplate.h"
 #include "cell.h"
+#include "reflist.h"
 
 #define STREAM_GEOM_START_MARKER "----- Begin geometry file -----"
 #define STREAM_GEOM_END_MARKER "----- End geometry file -----"
@@ -55,12 +56,21 @@ struct image;
 #define STREAM_CRYSTAL_END_MARKER "--- End crystal"
 #define STREAM_REFLECTION_START_MARKER "Reflections measured after indexing"
 #define STREAM_REFLECTION_END_MARKER "End of reflections"
+#define STREAM_MANIFEST_MARKER "CrystFEL stream manifest 1.0"
+#define STREAM_BINARY_MARKER "CrystFEL binary stream format 1.0"
+#define STREAM_BINARY_START_MARKER "----- Binary chunks follow -----"
 
 /**
  * An opaque structure representing a stream being read or written
  */
 typedef struct _stream Stream;
 
+/**
+ * An opaque structure representing a stream being read by several threads
+ * (see \ref stream_reader_new)
+ */
+typedef struct _streamreader StreamReader;
+
 /**
  * A bitfield of things that can be read from or written to a stream.
  * Use this together with stream_{read,write}_chunk to read/write the
@@ -82,6 +92,17 @@ typedef enum {
 	 * (NB this is (currently) a slow operation) */
 	STREAM_DATA_DETGEOM = 8,
 
+	/** Store the integrated reflections in compact form, without phases,
+	 * contribution lists, peak heights or backgrounds
+	 * (see \ref REFLIST_LEAN) */
+	STREAM_LEAN_REFLECTIONS = 16,
+
+	/** Keep the text of the integrated reflections, and parse each list
+	 * only when \ref stream_crystal_refls is called for it.  Reflections
+	 * in binary streams are read straight away, as with
+	 * STREAM_REFLECTIONS */
+	STREAM_DEFER_REFLECTIONS = 32,
+
 } StreamFlags;
 
 #ifdef __cplusplus
@@ -94,7 +115,10 @@ extern Stream *stream_open_for_write(const char *filename,
                                      const DataTemplate *dtempl);
 extern Stream *stream_open_fd_for_write(int fd,
                                         const DataTemplate *dtempl);
+extern Stream *stream_open_for_write_binary(const char *filename,
+                                            const DataTemplate *dtempl);
 extern void stream_close(Stream *st);
+extern char **stream_manifest_shards(const char *filename, int *pn);
 
 /* Writing things to stream header */
 extern void stream_write_data_template(Stream *st,
@@ -112,6 +136,9 @@ extern void stream_write_indexing_methods(Stream *st,
 extern int stream_has_old_indexers(Stream *st);
 extern char *stream_audit_info(Stream *st);
 extern char *stream_geometry_file(Stream *st);
+extern int stream_is_binary(Stream *st);
+extern void stream_set_reflection_cutoffs(Stream *st, double max_peak,
+                                          double min_res, double push_res);
 
 /* Low-level stuff used for indexamajig sandbox */
 extern FILE *stream_get_fh(Stream *st);
@@ -120,15 +147,31 @@ extern int stream_rewind(Stream *st);
 /* Random access */
 typedef struct _streamindex StreamIndex;
 extern StreamIndex *stream_make_index(const char *filename);
+extern int stream_update_index(StreamIndex *index, const char *filename);
 extern int stream_select_chunk(Stream *st, StreamIndex *index,
                                const char *filename,
                                const char *ev);
+extern int stream_index_num_chunks(StreamIndex *index);
+extern int stream_index_get_chunk(StreamIndex *index, int i,
+                                  char **pfilename, char **pev);
 extern void stream_index_free(StreamIndex *index);
 
 /* Read/write chunks */
 extern struct image *stream_read_chunk(Stream *st, StreamFlags srf);
+extern RefList *stream_crystal_refls(Stream *st, struct image *image, int i,
+                                     StreamFlags srf);
 extern int stream_write_chunk(Stream *st, const struct image *image,
                               StreamFlags srf);
+extern int stream_write_raw_chunk(Stream *st, const char *chunk, size_t len);
+extern int stream_start_writer_thread(Stream *st);
+
+/* Parallel reading */
+extern StreamReader *stream_reader_new(Stream *st, StreamFlags srf,
+                                       int n_threads, int ordered);
+extern struct image *stream_reader_next(StreamReader *sr);
+extern struct image *stream_reader_next_with_text(StreamReader *sr,
+                                                  char **text, size_t *len);
+extern void stream_reader_free(StreamReader *sr);
 
 #ifdef __cplusplus
 }
@@ -32,11 +32,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <math.h>
 #include <assert.h>
 #include <ctype.h>
 
 #include "symmetry.h"
+#include "cell.h"
 #include "utils.h"
 #include "integer_matrix.h"
 #include "symop-parse.h"
@@ -46,6 +48,16 @@
 
 /** \file symmetry.h */
 
+/* An entry in the lookup table for get_asymm() */
+struct asymm_entry
+{
+	int16_t h;
+	int16_t k;
+	int16_t l;
+	int16_t op;
+};
+
+
 struct _symoplist
 {
 	IntegerMatrix **ops;
@@ -53,6 +65,18 @@ struct _symoplist
 	int max_ops;
 	char *name;
 	int num_equivs;
+
+	/* The same operations as packed 3x3 matrices, nine values each in the
+	 * same order as intmat_get(op, 0, 0), (0, 1) ..., for apply_op().
+	 * Only valid if all the elements fit (packed_ok) */
+	int8_t *packed;
+	int packed_ok;
+
+	/* Lookup table for get_asymm() (see make_asymm_table), or NULL */
+	struct asymm_entry *asymm;
+	signed int asymm_max_h;
+	signed int asymm_max_k;
+	signed int asymm_max_l;
 };
 
 
@@ -67,6 +91,31 @@ struct _symopmask
 static void alloc_ops(SymOpList *ops)
 {
 	ops->ops = cfrealloc(ops->ops, ops->max_ops*sizeof(IntegerMatrix *));
+	ops->packed = cfrealloc(ops->packed, ops->max_ops*9*sizeof(int8_t));
+}
+
+
+/* Updates the packed version of operation 'i' */
+static void pack_op(SymOpList *ops, int i)
+{
+	unsigned int rows, cols;
+	int ii, jj;
+
+	intmat_size(ops->ops[i], &rows, &cols);
+	if ( (rows != 3) || (cols != 3) ) {
+		ops->packed_ok = 0;
+		return;
+	}
+
+	for ( ii=0; ii<3; ii++ ) {
+		for ( jj=0; jj<3; jj++ ) {
+			signed int val = intmat_get(ops->ops[i], ii, jj);
+			if ( (val < INT8_MIN) || (val > INT8_MAX) ) {
+				ops->packed_ok = 0;
+			}
+			ops->packed[9*i+3*ii+jj] = val;
+		}
+	}
 }
 
 
@@ -109,8 +158,11 @@ static SymOpList *new_symoplist()
 	new->max_ops = 16;
 	new->n_ops = 0;
 	new->ops = NULL;
+	new->packed = NULL;
+	new->packed_ok = 1;
 	new->name = NULL;
 	new->num_equivs = 1;
+	new->asymm = NULL;
 	alloc_ops(new);
 	return new;
 }
@@ -130,7 +182,9 @@ void free_symoplist(SymOpList *ops)
 		intmat_free(ops->ops[i]);
 	}
 	if ( ops->ops != NULL ) cffree(ops->ops);
+	cffree(ops->packed);
 	if ( ops->name != NULL ) cffree(ops->name);
+	cffree(ops->asymm);
 	cffree(ops);
 }
 
@@ -163,12 +217,18 @@ static int num_ops(const SymOpList *ops)
  **/
 void add_symop(SymOpList *ops, IntegerMatrix *m)
 {
+	/* The lookup table would be out of date */
+	cffree(ops->asymm);
+	ops->asymm = NULL;
+
 	if ( ops->n_ops == ops->max_ops ) {
 		ops->max_ops += 16;
 		alloc_ops(ops);
 	}
 
-	ops->ops[ops->n_ops++] = m;
+	ops->ops[ops->n_ops] = m;
+	pack_op(ops, ops->n_ops);
+	ops->n_ops++;
 }
 
 
@@ -377,6 +437,10 @@ static void transform_ops(SymOpList *s, IntegerMatrix *P)
 		return;
 	}
 
+	cffree(s->asymm);
+	s->asymm = NULL;
+	s->packed_ok = 1;
+
 	n = num_ops(s);
 	for ( i=0; i<n; i++ ) {
 
@@ -398,6 +462,7 @@ static void transform_ops(SymOpList *s, IntegerMatrix *P)
 		intmat_free(s->ops[i]);
 		s->ops[i] = intmat_copy(f);
 		intmat_free(f);
+		pack_op(s, i);
 
 	}
 
@@ -1102,6 +1167,18 @@ void pointgroup_warning(const char *sym)
 }
 
 
+/* Applies operation 'p' using the packed matrices, like do_op() */
+static inline void apply_op(const SymOpList *ops, int p,
+                            signed int h, signed int k, signed int l,
+                            signed int *he, signed int *ke, signed int *le)
+{
+	const int8_t *m = &ops->packed[9*p];
+	*he = m[0]*h + m[3]*k + m[6]*l;
+	*ke = m[1]*h + m[4]*k + m[7]*l;
+	*le = m[2]*h + m[5]*k + m[8]*l;
+}
+
+
 static void do_op(const IntegerMatrix *op,
                   signed int h, signed int k, signed int l,
                   signed int *he, signed int *ke, signed int *le)
@@ -1145,6 +1222,14 @@ void get_equiv(const SymOpList *ops, const SymOpMask *m, int idx,
                signed int *he, signed int *ke, signed int *le)
 {
 	IntegerMatrix *op;
+
+	if ( ops->packed_ok && (m == NULL) && (idx >= 0)
+	  && (idx < num_ops(ops)) )
+	{
+		apply_op(ops, idx, h, k, l, he, ke, le);
+		return;
+	}
+
 	op = get_symop(ops, m, idx);
 	if ( op == NULL ) {
 		fprintf(stderr, "Cannot proceed.\n");
@@ -1168,16 +1253,19 @@ void special_position(const SymOpList *ops, SymOpMask *m,
                       signed int h, signed int k, signed int l)
 {
 	int i, n;
-	signed int *htest;
-	signed int *ktest;
-	signed int *ltest;
+	signed int test_stack[3*48];
+	signed int *test;
 
 	assert(m->list == ops);
 
+	/* No point group has more than 48 operations */
 	n = num_equivs(ops, NULL);
-	htest = cfmalloc(n*sizeof(signed int));
-	ktest = cfmalloc(n*sizeof(signed int));
-	ltest = cfmalloc(n*sizeof(signed int));
+	if ( n <= 48 ) {
+		test = test_stack;
+	} else {
+		test = cfmalloc(3*n*sizeof(signed int));
+		if ( test == NULL ) return;
+	}
 
 	for ( i=0; i<n; i++ ) {
 
@@ -1188,23 +1276,21 @@ void special_position(const SymOpList *ops, SymOpMask *m,
 
 		m->mask[i] = 1;
 		for ( j=0; j<i; j++ ) {
-			if ( (he==htest[j]) && (ke==ktest[j])
-			  && (le==ltest[j]) )
+			if ( (he==test[3*j]) && (ke==test[3*j+1])
+			  && (le==test[3*j+2]) )
 			{
 				m->mask[i] = 0;
 				break;  /* Only need to find one */
 			}
 		}
 
-		htest[i] = he;
-		ktest[i] = ke;
-		ltest[i] = le;
+		test[3*i] = he;
+		test[3*i+1] = ke;
+		test[3*i+2] = le;
 
 	}
 
-	cffree(htest);
-	cffree(ktest);
-	cffree(ltest);
+	if ( test != test_stack ) cffree(test);
 }
 
 
@@ -1230,17 +1316,18 @@ static int any_negative(signed int h, signed int k, signed int l)
  **/
 int is_centric(signed int h, signed int k, signed int l, const SymOpList *ops)
 {
-	signed int ha, ka, la;
-	signed int hb, kb, lb;
+	int p, n;
 
-	get_asymm(ops, h, k, l, &ha, &ka, &la);
-	get_asymm(ops, -h, -k, -l, &hb, &kb, &lb);
-
-	if ( ha != hb ) return 0;
-	if ( ka != kb ) return 0;
-	if ( la != lb ) return 0;
+	/* The asymmetric indices of the reflection and its Friedel partner
+	 * are the same exactly when one of the operations relates them */
+	n = num_equivs(ops, NULL);
+	for ( p=0; p<n; p++ ) {
+		signed int he, ke, le;
+		get_equiv(ops, NULL, p, h, k, l, &he, &ke, &le);
+		if ( (he == -h) && (ke == -k) && (le == -l) ) return 1;
+	}
 
-	return 1;
+	return 0;
 }
 
 
@@ -1267,10 +1354,20 @@ int is_centric(signed int h, signed int k, signed int l, const SymOpList *ops)
 void get_asymm(const SymOpList *ops,
                signed int h, signed int k, signed int l,
                signed int *hp, signed int *kp, signed int *lp)
+{
+	get_asymm_op(ops, h, k, l, hp, kp, lp);
+}
+
+
+/* Does the work of get_asymm() without the lookup table */
+static int asymm_op(const SymOpList *ops,
+                    signed int h, signed int k, signed int l,
+                    signed int *hp, signed int *kp, signed int *lp)
 {
 	int nequiv;
 	int p;
 	signed int best_h, best_k, best_l;
+	int best_p = -1;
 	int have_negs;
 
 	nequiv = num_equivs(ops, NULL);
@@ -1281,7 +1378,11 @@ void get_asymm(const SymOpList *ops,
 
 		int will_have_negs;
 
-		get_equiv(ops, NULL, p, h, k, l, hp, kp, lp);
+		if ( ops->packed_ok ) {
+			apply_op(ops, p, h, k, l, hp, kp, lp);
+		} else {
+			get_equiv(ops, NULL, p, h, k, l, hp, kp, lp);
+		}
 
 		will_have_negs = any_negative(*hp, *kp, *lp);
 
@@ -1290,12 +1391,14 @@ void get_asymm(const SymOpList *ops,
 
 		if ( have_negs && !will_have_negs ) {
 			best_h = *hp;  best_k = *kp;  best_l = *lp;
+			best_p = p;
 			have_negs = 0;
 			continue;
 		}
 
 		if ( *hp > best_h ) {
 			best_h = *hp;  best_k = *kp;  best_l = *lp;
+			best_p = p;
 			have_negs = any_negative(best_h, best_k, best_l);
 			continue;
 		}
@@ -1303,6 +1406,7 @@ void get_asymm(const SymOpList *ops,
 
 		if ( *kp > best_k ) {
 			best_h = *hp;  best_k = *kp;  best_l = *lp;
+			best_p = p;
 			have_negs = any_negative(best_h, best_k, best_l);
 			continue;
 		}
@@ -1310,6 +1414,7 @@ void get_asymm(const SymOpList *ops,
 
 		if ( *lp > best_l ) {
 			best_h = *hp;  best_k = *kp;  best_l = *lp;
+			best_p = p;
 			have_negs = any_negative(best_h, best_k, best_l);
 			continue;
 		}
@@ -1317,6 +1422,153 @@ void get_asymm(const SymOpList *ops,
 	}
 
 	*hp = best_h;  *kp = best_k;  *lp = best_l;
+
+	/* The original indices were kept, so find the operation which gives
+	 * them (normally the identity) */
+	if ( best_p == -1 ) {
+		for ( p=0; p<nequiv; p++ ) {
+			IntegerMatrix *op = get_symop(ops, NULL, p);
+			if ( intmat_is_identity(op) ) return p;
+		}
+	}
+
+	return best_p;
+}
+
+
+/**
+ * \param ops A \ref SymOpList, usually corresponding to a point group
+ * \param h index of a reflection
+ * \param k index of a reflection
+ * \param l index of a reflection
+ * \param hp location for asymmetric index of reflection
+ * \param kp location for asymmetric index of reflection
+ * \param lp location for asymmetric index of reflection
+ *
+ * Like \ref get_asymm, but also returns the index of the operation which
+ * gives the asymmetric version of the reflection, i.e. such that
+ * \ref get_equiv(ops, NULL, idx, h, k, l, ...) gives the same result.
+ *
+ * \returns The index of the operation in \p ops.
+ **/
+int get_asymm_op(const SymOpList *ops,
+                 signed int h, signed int k, signed int l,
+                 signed int *hp, signed int *kp, signed int *lp)
+{
+	if ( (ops->asymm != NULL)
+	  && (abs(h) <= ops->asymm_max_h)
+	  && (abs(k) <= ops->asymm_max_k)
+	  && (abs(l) <= ops->asymm_max_l) )
+	{
+		size_t nk = 2*ops->asymm_max_k + 1;
+		size_t nl = 2*ops->asymm_max_l + 1;
+		const struct asymm_entry *e;
+
+		e = &ops->asymm[((h + ops->asymm_max_h)*nk
+		                  + (k + ops->asymm_max_k))*nl
+		                  + (l + ops->asymm_max_l)];
+		*hp = e->h;  *kp = e->k;  *lp = e->l;
+		return e->op;
+	}
+
+	return asymm_op(ops, h, k, l, hp, kp, lp);
+}
+
+
+/* Limit on the size of the lookup table, in entries */
+#define ASYMM_TABLE_MAX (64*1024*1024)
+
+
+/**
+ * \param ops A \ref SymOpList
+ * \param max_h Largest magnitude of h to include
+ * \param max_k Largest magnitude of k to include
+ * \param max_l Largest magnitude of l to include
+ *
+ * Makes a lookup table for \ref get_asymm and \ref get_asymm_op, covering
+ * all reflections with indices within the given limits.  After this, the
+ * asymmetric indices of these reflections can be found with a single memory
+ * read instead of applying every symmetry operation.  Reflections outside the
+ * table are handled in the usual way.
+ *
+ * The table uses eight bytes per reflection.  If \p ops is changed, for
+ * example by \ref add_symop, the table will be discarded.
+ *
+ * This function must not be called while other threads are using \p ops.
+ *
+ * \returns Non-zero on error, in which case \p ops can still be used
+ * normally.
+ **/
+int make_asymm_table(SymOpList *ops, signed int max_h, signed int max_k,
+                     signed int max_l)
+{
+	struct asymm_entry *table;
+	size_t n;
+	signed int h, k, l;
+	size_t i;
+
+	cffree(ops->asymm);
+	ops->asymm = NULL;
+
+	if ( (max_h < 0) || (max_k < 0) || (max_l < 0) ) return 1;
+
+	/* All the equivalents of the reflections in the table must fit
+	 * into the table entries, with room to spare for operations such as
+	 * h+k, h+2k in hexagonal settings */
+	if ( (max_h > 8191) || (max_k > 8191) || (max_l > 8191) ) return 1;
+	if ( !ops->packed_ok ) return 1;
+
+	n = (size_t)(2*max_h+1) * (2*max_k+1) * (2*max_l+1);
+	if ( n > ASYMM_TABLE_MAX ) return 1;
+
+	table = cfmalloc(n*sizeof(struct asymm_entry));
+	if ( table == NULL ) return 1;
+
+	i = 0;
+	for ( h=-max_h; h<=max_h; h++ ) {
+	for ( k=-max_k; k<=max_k; k++ ) {
+	for ( l=-max_l; l<=max_l; l++ ) {
+		signed int ha, ka, la;
+		int op = asymm_op(ops, h, k, l, &ha, &ka, &la);
+		table[i].h = ha;
+		table[i].k = ka;
+		table[i].l = la;
+		table[i].op = op;
+		i++;
+	}
+	}
+	}
+	assert(i == n);
+
+	ops->asymm = table;
+	ops->asymm_max_h = max_h;
+	ops->asymm_max_k = max_k;
+	ops->asymm_max_l = max_l;
+	return 0;
+}
+
+
+/**
+ * \param ops A \ref SymOpList
+ * \param cell A \ref UnitCell
+ * \param max_res Resolution limit, in m^-1 (i.e. 1/d)
+ *
+ * Like \ref make_asymm_table, but the table will cover all reflections up to
+ * resolution \p max_res for unit cell \p cell.
+ *
+ * \returns Non-zero on error, in which case \p ops can still be used
+ * normally.
+ **/
+int make_asymm_table_for_cell(SymOpList *ops, UnitCell *cell, double max_res)
+{
+	double a, b, c, al, be, ga;
+
+	if ( !isfinite(max_res) || (max_res <= 0.0) ) return 1;
+	if ( cell_get_parameters(cell, &a, &b, &c, &al, &be, &ga) ) return 1;
+
+	/* h = a.q, so |h| <= |a||q| */
+	return make_asymm_table(ops, ceil(a*max_res), ceil(b*max_res),
+	                        ceil(c*max_res));
 }
 
 
@@ -32,6 +32,7 @@
 
 #include "integer_matrix.h"
 #include "rational.h"
+#include "cell.h"
 
 /**
  * \file symmetry.h
@@ -68,6 +69,13 @@ extern void special_position(const SymOpList *ops, SymOpMask *m,
 extern void get_asymm(const SymOpList *ops,
                       signed int h, signed int k, signed int l,
                       signed int *hp, signed int *kp, signed int *lp);
+extern int get_asymm_op(const SymOpList *ops,
+                        signed int h, signed int k, signed int l,
+                        signed int *hp, signed int *kp, signed int *lp);
+extern int make_asymm_table(SymOpList *ops, signed int max_h,
+                            signed int max_k, signed int max_l);
+extern int make_asymm_table_for_cell(SymOpList *ops, UnitCell *cell,
+                                     double max_res);
 extern int num_equivs(const SymOpList *ops, const SymOpMask *m);
 extern void get_equiv(const SymOpList *ops, const SymOpMask *m, int idx,
                       signed int h, signed int k, signed int l,
@@ -28,6 +28,11 @@
 
 #include <libcrystfel-config.h>
 
+#ifdef HAVE_SCHED_SETAFFINITY
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -35,6 +40,8 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <assert.h>
+#include <signal.h>
+#include <time.h>
 
 #include "utils.h"
 
@@ -45,15 +52,38 @@
 
 static int use_status_labels = 0;
 static pthread_key_t status_label_key;
+static pthread_key_t scratch_key;
+static pthread_once_t status_label_once = PTHREAD_ONCE_INIT;
 
 struct worker_args
 {
-	struct task_queue_range *tqr;
-	struct task_queue *tq;
+	struct _threadpool *pool;
 	int id;
 };
 
 
+struct scratch
+{
+	void *mem;
+	size_t size;
+};
+
+
+static void free_scratch(void *vscratch)
+{
+	struct scratch *scratch = vscratch;
+	cffree(scratch->mem);
+	cffree(scratch);
+}
+
+
+static void make_status_label_key()
+{
+	pthread_key_create(&status_label_key, NULL);
+	pthread_key_create(&scratch_key, free_scratch);
+}
+
+
 signed int get_status_label()
 {
 	int *cookie;
@@ -63,17 +93,132 @@ signed int get_status_label()
 	}
 
 	cookie = pthread_getspecific(status_label_key);
+	if ( cookie == NULL ) return -1;  /* Not a worker thread */
 	return *cookie;
 }
 
 
+/* ------------------------------ Cancellation ------------------------------ */
+
+struct _tpcancel
+{
+	volatile sig_atomic_t cancelled;
+	double deadline;              /* From monotonic_time(), or zero */
+};
+
+
+static double monotonic_time()
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+#else
+	return time(NULL);
+#endif
+}
+
+
+/**
+ * Creates a new \ref TPCancelToken, which is not cancelled and has no
+ * deadline.
+ *
+ * \returns the new token, or NULL on error.
+ **/
+TPCancelToken *tp_cancel_token_new()
+{
+	TPCancelToken *tok = cfmalloc(sizeof(struct _tpcancel));
+	if ( tok == NULL ) return NULL;
+	tok->cancelled = 0;
+	tok->deadline = 0.0;
+	return tok;
+}
+
+
+/**
+ * \param tok A \ref TPCancelToken
+ *
+ * Frees \p tok, which must not be in use by any batch of work.
+ **/
+void tp_cancel_token_free(TPCancelToken *tok)
+{
+	cffree(tok);
+}
+
+
+/**
+ * \param tok A \ref TPCancelToken
+ *
+ * Cancels \p tok.  Any batch of work using \p tok will stop as soon as the
+ * tasks already started have been completed, and tp_cancelled() will return
+ * non-zero until tp_cancel_reset() is called.
+ *
+ * This function may be called from any thread, including from a work
+ * function, and is safe to call from a signal handler.
+ **/
+void tp_cancel(TPCancelToken *tok)
+{
+	tok->cancelled = 1;
+}
+
+
+/**
+ * \param tok A \ref TPCancelToken
+ *
+ * Returns \p tok to its original state: not cancelled, and with no deadline.
+ * This must not be called while a batch of work is using \p tok.
+ **/
+void tp_cancel_reset(TPCancelToken *tok)
+{
+	tok->cancelled = 0;
+	tok->deadline = 0.0;
+}
+
+
+/**
+ * \param tok A \ref TPCancelToken
+ * \param seconds Time limit in seconds
+ *
+ * Makes \p tok cancel itself automatically after \p seconds seconds from now.
+ * Set the time limit before starting the work which uses \p tok.
+ **/
+void tp_cancel_set_timeout(TPCancelToken *tok, double seconds)
+{
+	tok->deadline = monotonic_time() + seconds;
+}
+
+
+/**
+ * \param tok A \ref TPCancelToken, or NULL
+ *
+ * \returns non-zero if \p tok has been cancelled or its deadline has passed,
+ * otherwise zero.  If \p tok is NULL, the return value is always zero.
+ **/
+int tp_cancelled(TPCancelToken *tok)
+{
+	if ( tok == NULL ) return 0;
+	if ( tok->cancelled ) return 1;
+	if ( (tok->deadline > 0.0) && (monotonic_time() > tok->deadline) ) {
+		tok->cancelled = 1;
+		return 1;
+	}
+	return 0;
+}
+
+
+/* ------------------------------- Task queues ------------------------------ */
+
 struct task_queue
 {
 	pthread_mutex_t  lock;
+	pthread_mutex_t  final_lock;  /* Used unless TP_FINAL_LOCKED */
 
 	int              n_started;
 	int              n_completed;
 	int              max;
+	int              chunk_size;
+	enum tp_final_locking final_locking;
+	TPCancelToken   *cancel;
 
 	void *(*get_task)(void *);
 	void (*finalise)(void *, void *);
@@ -82,11 +227,160 @@ struct task_queue
 };
 
 
-static void *task_worker(void *pargsv)
+struct _threadpool
+{
+	int n_threads;
+	pthread_t *workers;
+	int flags;                    /* See enum thread_pool_flags */
+
+	pthread_mutex_t lock;
+	pthread_cond_t start_cond;    /* Signalled when a batch is ready */
+	pthread_cond_t done_cond;     /* Signalled when a batch is finished */
+	int generation;               /* Incremented for each new batch */
+	int n_finished;               /* Workers finished with current batch */
+	int busy;                     /* Non-zero while a batch is running */
+	int shutdown;
+	struct task_queue *q;         /* Current batch */
+};
+
+
+/* The pool used by run_threads(), if any.  See set_default_thread_pool() */
+static ThreadPool *default_pool = NULL;
+
+/* See set_deterministic_reductions() */
+#define DETERMINISTIC_REDUCTION_PARTS (64)
+static int deterministic_reductions = 0;
+
+
+static void finalise_tasks(struct task_queue *q, void **tasks, int n)
+{
+	int i;
+
+	switch ( q->final_locking ) {
+
+		case TP_FINAL_LOCKED :
+		pthread_mutex_lock(&q->lock);
+		break;
+
+		case TP_FINAL_SEPARATE_LOCK :
+		pthread_mutex_lock(&q->final_lock);
+		break;
+
+		case TP_FINAL_UNLOCKED :
+		break;
+
+	}
+
+	if ( q->finalise ) {
+		for ( i=0; i<n; i++ ) {
+			q->finalise(q->queue_args, tasks[i]);
+		}
+	}
+
+	switch ( q->final_locking ) {
+
+		case TP_FINAL_LOCKED :
+		q->n_completed += n;
+		pthread_mutex_unlock(&q->lock);
+		break;
+
+		case TP_FINAL_SEPARATE_LOCK :
+		q->n_completed += n;
+		pthread_mutex_unlock(&q->final_lock);
+		break;
+
+		case TP_FINAL_UNLOCKED :
+		pthread_mutex_lock(&q->final_lock);
+		q->n_completed += n;
+		pthread_mutex_unlock(&q->final_lock);
+		break;
+
+	}
+}
+
+
+static void run_tasks(struct task_queue *q, int cookie)
+{
+	void **tasks;
+
+	tasks = cfmalloc(q->chunk_size*sizeof(void *));
+	if ( tasks == NULL ) return;
+
+	do {
+
+		int n_got = 0;
+		int i;
+
+		/* Get a chunk of tasks */
+		pthread_mutex_lock(&q->lock);
+		while ( n_got < q->chunk_size ) {
+
+			void *task;
+
+			if ( (q->max) && (q->n_started >= q->max) ) break;
+			if ( tp_cancelled(q->cancel) ) break;
+			task = q->get_task(q->queue_args);
+
+			/* No more tasks? */
+			if ( task == NULL ) break;
+
+			tasks[n_got++] = task;
+			q->n_started++;
+
+		}
+		pthread_mutex_unlock(&q->lock);
+
+		if ( n_got == 0 ) break;
+
+		for ( i=0; i<n_got; i++ ) {
+			q->work(tasks[i], cookie);
+		}
+
+		/* Update totals etc */
+		finalise_tasks(q, tasks, n_got);
+
+	} while ( 1 );
+
+	cffree(tasks);
+}
+
+
+static void pin_to_cpu(int slot)
+{
+	#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t allowed;
+	cpu_set_t c;
+	int n_allowed, i, n;
+
+	/* Only use the CPUs we were given, e.g. by a batch system */
+	if ( sched_getaffinity(0, sizeof(cpu_set_t), &allowed) ) return;
+	n_allowed = CPU_COUNT(&allowed);
+	if ( n_allowed == 0 ) return;
+
+	slot = slot % n_allowed;
+	n = 0;
+	for ( i=0; i<CPU_SETSIZE; i++ ) {
+		if ( !CPU_ISSET(i, &allowed) ) continue;
+		if ( n++ == slot ) break;
+	}
+
+	CPU_ZERO(&c);
+	CPU_SET(i, &c);
+	if ( sched_setaffinity(0, sizeof(cpu_set_t), &c) ) {
+		/* Not ERROR() here */
+		fprintf(stderr, "Failed to set CPU affinity for thread %i\n",
+		        slot);
+	}
+	#endif
+}
+
+
+static void *pool_worker(void *pargsv)
 {
 	struct worker_args *w = pargsv;
-	struct task_queue *q = w->tq;
+	ThreadPool *pool = w->pool;
 	int *cookie_slot;
+	int generation = 0;
 
 	cookie_slot = cfmalloc(sizeof(int));
 	*cookie_slot = w->id;
@@ -94,40 +388,32 @@ static void *task_worker(void *pargsv)
 
 	cffree(w);
 
+	if ( pool->flags & TP_PIN_THREADS ) pin_to_cpu(*cookie_slot);
+
+	pthread_mutex_lock(&pool->lock);
 	do {
 
-		void *task;
-		int cookie;
+		struct task_queue *q;
 
-		/* Get a task */
-		pthread_mutex_lock(&q->lock);
-		if ( (q->max) && (q->n_started >= q->max) ) {
-			pthread_mutex_unlock(&q->lock);
-			break;
+		while ( !pool->shutdown && (pool->generation == generation) ) {
+			pthread_cond_wait(&pool->start_cond, &pool->lock);
 		}
-		task = q->get_task(q->queue_args);
+		if ( pool->shutdown ) break;
 
-		/* No more tasks? */
-		if ( task == NULL ) {
-			pthread_mutex_unlock(&q->lock);
-			break;
-		}
+		generation = pool->generation;
+		q = pool->q;
+		pthread_mutex_unlock(&pool->lock);
 
-		q->n_started++;
-		pthread_mutex_unlock(&q->lock);
-
-		cookie = *(int *)pthread_getspecific(status_label_key);
-		q->work(task, cookie);
+		run_tasks(q, *cookie_slot);
 
-		/* Update totals etc */
-		pthread_mutex_lock(&q->lock);
-		q->n_completed++;
-		if ( q->finalise ) {
-			q->finalise(q->queue_args, task);
+		pthread_mutex_lock(&pool->lock);
+		pool->n_finished++;
+		if ( pool->n_finished == pool->n_threads ) {
+			pthread_cond_broadcast(&pool->done_cond);
 		}
-		pthread_mutex_unlock(&q->lock);
 
 	} while ( 1 );
+	pthread_mutex_unlock(&pool->lock);
 
 	cffree(cookie_slot);
 
@@ -135,6 +421,352 @@ static void *task_worker(void *pargsv)
 }
 
 
+/**
+ * \param n_threads The number of threads in the pool
+ *
+ * Creates a pool of \p n_threads worker threads, which will wait to be given
+ * work by thread_pool_run().  Using the same pool for several batches of work
+ * avoids the cost of starting and stopping the threads each time.
+ *
+ * \returns the new thread pool, or NULL on error.
+ **/
+ThreadPool *thread_pool_new(int n_threads)
+{
+	return thread_pool_new_with_flags(n_threads, 0);
+}
+
+
+/**
+ * \param n_threads The number of threads in the pool
+ * \param flags Zero, or a combination of values from \ref thread_pool_flags
+ *
+ * As thread_pool_new(), with extra options.
+ *
+ * If \p flags includes \ref TP_PIN_THREADS, each worker thread will be pinned
+ * to one of the CPUs which the process is allowed to use.  Together with
+ * thread_pool_scratch(), this keeps each thread's working memory on its own
+ * NUMA node.  If CPU pinning is not available on this system, the flag will be
+ * ignored.
+ *
+ * \returns the new thread pool, or NULL on error.
+ **/
+ThreadPool *thread_pool_new_with_flags(int n_threads, int flags)
+{
+	ThreadPool *pool;
+	int i;
+
+	if ( n_threads < 1 ) return NULL;
+
+	pthread_once(&status_label_once, make_status_label_key);
+
+	pool = cfmalloc(sizeof(struct _threadpool));
+	if ( pool == NULL ) return NULL;
+
+	pool->workers = cfmalloc(n_threads * sizeof(pthread_t));
+	if ( pool->workers == NULL ) {
+		cffree(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	pool->generation = 0;
+	pool->n_finished = 0;
+	pool->busy = 0;
+	pool->shutdown = 0;
+	pool->q = NULL;
+	pool->flags = flags;
+
+	/* Start threads */
+	for ( i=0; i<n_threads; i++ ) {
+
+		struct worker_args *w;
+
+		w = cfmalloc(sizeof(struct worker_args));
+
+		w->pool = pool;
+		w->id = i;
+
+		if ( pthread_create(&pool->workers[i], NULL, pool_worker, w) ) {
+			/* Not ERROR() here */
+			fprintf(stderr, "Couldn't start thread %i\n", i);
+			cffree(w);
+			break;
+		}
+
+	}
+	pool->n_threads = i;
+
+	if ( pool->n_threads == 0 ) {
+		thread_pool_free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+
+/**
+ * \param pool A \ref ThreadPool
+ *
+ * Stops all the threads in \p pool, and frees it.  This must not be called
+ * while thread_pool_run() is running on the pool.
+ **/
+void thread_pool_free(ThreadPool *pool)
+{
+	int i;
+
+	if ( pool == NULL ) return;
+
+	assert(!pool->busy);
+	if ( default_pool == pool ) default_pool = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for ( i=0; i<pool->n_threads; i++ ) {
+		pthread_join(pool->workers[i], NULL);
+	}
+
+	pthread_cond_destroy(&pool->start_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_mutex_destroy(&pool->lock);
+	cffree(pool->workers);
+	cffree(pool);
+}
+
+
+/**
+ * \param pool A \ref ThreadPool
+ *
+ * \returns the number of threads in \p pool.
+ **/
+int thread_pool_get_num_threads(ThreadPool *pool)
+{
+	return pool->n_threads;
+}
+
+
+/**
+ * \param size The number of bytes needed
+ *
+ * Returns a block of memory belonging to the calling thread, which can be used
+ * as temporary working space by a \ref TPWorkFunc.  The memory is allocated
+ * and zeroed by the calling thread on first use, so on most systems it will be
+ * placed on the same NUMA node as the CPU running the thread.  The same block
+ * will be returned by later calls from the same thread (including in later
+ * batches of a \ref ThreadPool), and will be enlarged if \p size is bigger
+ * than before.  The contents are not cleared between calls.
+ *
+ * The memory will be freed when the thread exits.  Do not free it yourself.
+ *
+ * \returns a pointer to at least \p size bytes, or NULL on error.
+ **/
+void *thread_pool_scratch(size_t size)
+{
+	struct scratch *scratch;
+
+	pthread_once(&status_label_once, make_status_label_key);
+
+	scratch = pthread_getspecific(scratch_key);
+	if ( scratch == NULL ) {
+		scratch = cfcalloc(1, sizeof(struct scratch));
+		if ( scratch == NULL ) return NULL;
+		pthread_setspecific(scratch_key, scratch);
+	}
+
+	if ( scratch->size < size ) {
+		cffree(scratch->mem);
+		scratch->mem = cfcalloc(1, size);
+		if ( scratch->mem == NULL ) {
+			scratch->size = 0;
+			return NULL;
+		}
+		scratch->size = size;
+	}
+
+	return scratch->mem;
+}
+
+
+/* Must be called with pool->lock held, and pool->busy set */
+static int run_batch(ThreadPool *pool, TPWorkFunc work,
+                     TPGetTaskFunc get_task, TPFinalFunc final,
+                     void *queue_args, int max,
+                     const struct thread_pool_opts *opts)
+{
+	struct task_queue q;
+
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_mutex_init(&q.final_lock, NULL);
+	q.chunk_size = 1;
+	q.final_locking = TP_FINAL_LOCKED;
+	q.cancel = NULL;
+	if ( opts != NULL ) {
+		if ( opts->chunk_size > 1 ) q.chunk_size = opts->chunk_size;
+		q.final_locking = opts->final_locking;
+		q.cancel = opts->cancel;
+	}
+	q.work = work;
+	q.get_task = get_task;
+	q.finalise = final;
+	q.queue_args = queue_args;
+	q.n_started = 0;
+	q.n_completed = 0;
+	q.max = max;
+
+	/* Now it's safe to start using the status labels */
+	if ( pool->n_threads > 1 ) use_status_labels = 1;
+
+	pool->q = &q;
+	pool->n_finished = 0;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start_cond);
+
+	while ( pool->n_finished < pool->n_threads ) {
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	}
+
+	use_status_labels = 0;
+	pool->q = NULL;
+	pthread_mutex_destroy(&q.lock);
+	pthread_mutex_destroy(&q.final_lock);
+
+	return q.n_completed;
+}
+
+
+/**
+ * \param pool The \ref ThreadPool to use
+ * \param work The function to be called to do the work
+ * \param get_task The function which will determine the next unassigned task
+ * \param final The function which will be called to clean up after a task
+ * \param queue_args A pointer to any data required to determine the next task
+ * \param max Stop calling get_task after starting this number of jobs
+ *
+ * As run_threads(), but uses the existing threads in \p pool.  The function
+ * returns when all the tasks have been completed, after which \p pool can be
+ * used again.  If another thread is already using \p pool, this function will
+ * wait for it to finish first.
+ *
+ * \returns The number of tasks completed.
+ **/
+int thread_pool_run(ThreadPool *pool, TPWorkFunc work,
+                    TPGetTaskFunc get_task, TPFinalFunc final,
+                    void *queue_args, int max)
+{
+	return thread_pool_run_opts(pool, work, get_task, final, queue_args,
+	                            max, NULL);
+}
+
+
+/**
+ * \param pool The \ref ThreadPool to use
+ * \param work The function to be called to do the work
+ * \param get_task The function which will determine the next unassigned task
+ * \param final The function which will be called to clean up after a task
+ * \param queue_args A pointer to any data required to determine the next task
+ * \param max Stop calling get_task after starting this number of jobs
+ * \param opts A \ref thread_pool_opts, or NULL for the default behaviour
+ *
+ * As thread_pool_run(), with extra options.  See run_threads_opts() for
+ * details.
+ *
+ * \returns The number of tasks completed.
+ **/
+int thread_pool_run_opts(ThreadPool *pool, TPWorkFunc work,
+                         TPGetTaskFunc get_task, TPFinalFunc final,
+                         void *queue_args, int max,
+                         const struct thread_pool_opts *opts)
+{
+	int n;
+
+	pthread_mutex_lock(&pool->lock);
+	while ( pool->busy ) {
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	}
+	pool->busy = 1;
+
+	n = run_batch(pool, work, get_task, final, queue_args, max, opts);
+
+	pool->busy = 0;
+	pthread_cond_broadcast(&pool->done_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return n;
+}
+
+
+/**
+ * \param pool A \ref ThreadPool, or NULL
+ *
+ * Makes run_threads() use \p pool, instead of starting new threads, whenever
+ * the number of threads requested matches the size of the pool.  This allows
+ * programs which call run_threads() many times to re-use the same threads,
+ * without changing every call.  If the pool is already in use (for example,
+ * if run_threads() is called from within a work function), new threads will
+ * be started as usual.
+ *
+ * Call this function again with NULL before freeing the pool.
+ **/
+void set_default_thread_pool(ThreadPool *pool)
+{
+	default_pool = pool;
+}
+
+
+/**
+ * \param det Non-zero for deterministic reductions
+ *
+ * Sums over many items, such as merging reflections or calculating figures of
+ * merit, are normally split into one part per thread.  The parts are added up
+ * in a fixed order, so the result is the same from run to run, but it depends
+ * in the last few digits on the number of threads.  If \p det is non-zero,
+ * these sums will always be split into the same number of parts (see
+ * reduction_parts()), whatever the number of threads, so that the results
+ * are identical for any number of threads.
+ **/
+void set_deterministic_reductions(int det)
+{
+	deterministic_reductions = det;
+}
+
+
+/**
+ * \param n_threads The number of threads which will be used
+ *
+ * \returns the number of parts into which a sum (reduction) should be split,
+ * when it is to be done using \p n_threads threads.  This is simply
+ * \p n_threads, unless set_deterministic_reductions() has been called, in
+ * which case it's a constant.
+ **/
+int reduction_parts(int n_threads)
+{
+	if ( deterministic_reductions ) return DETERMINISTIC_REDUCTION_PARTS;
+	return n_threads;
+}
+
+
+static ThreadPool *claim_default_pool(int n_threads)
+{
+	ThreadPool *pool = default_pool;
+
+	if ( pool == NULL ) return NULL;
+	if ( pool->n_threads != n_threads ) return NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if ( pool->busy ) {
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+	pool->busy = 1;
+	return pool;
+}
+
+
 /**
  * \param n_threads The number of threads to run in parallel
  * \param work The function to be called to do the work
@@ -160,6 +792,10 @@ static void *task_worker(void *pargsv)
  * Work will stop after \p max tasks have been processed whether get_task
  * returned NULL or not.  If \p max is zero, all tasks will be processed.
  *
+ * If a pool has been set using set_default_thread_pool(), and it has
+ * \p n_threads threads, the work will be done using the threads in the pool.
+ * Otherwise, new threads will be started and stopped for this call only.
+ *
  * \returns The number of tasks completed.
  **/
 int run_threads(int n_threads, TPWorkFunc work,
@@ -167,54 +803,55 @@ int run_threads(int n_threads, TPWorkFunc work,
                 void *queue_args, int max,
                 int cpu_num, int cpu_groupsize, int cpu_offset)
 {
-	pthread_t *workers;
-	int i;
-	struct task_queue q;
-
-	pthread_key_create(&status_label_key, NULL);
-
-	workers = cfmalloc(n_threads * sizeof(pthread_t));
-
-	pthread_mutex_init(&q.lock, NULL);
-	q.work = work;
-	q.get_task = get_task;
-	q.finalise = final;
-	q.queue_args = queue_args;
-	q.n_started = 0;
-	q.n_completed = 0;
-	q.max = max;
-
-	/* Now it's safe to start using the status labels */
-	if ( n_threads > 1 ) use_status_labels = 1;
-
-	/* Start threads */
-	for ( i=0; i<n_threads; i++ ) {
-
-		struct worker_args *w;
-
-		w = cfmalloc(sizeof(struct worker_args));
-
-		w->tq = &q;
-		w->tqr = NULL;
-		w->id = i;
-
-		if ( pthread_create(&workers[i], NULL, task_worker, w) ) {
-			/* Not ERROR() here */
-			fprintf(stderr, "Couldn't start thread %i\n", i);
-			n_threads = i;
-			break;
-		}
+	return run_threads_opts(n_threads, work, get_task, final, queue_args,
+	                        max, NULL);
+}
 
-	}
 
-	/* Join threads */
-	for ( i=0; i<n_threads; i++ ) {
-		pthread_join(workers[i], NULL);
+/**
+ * \param n_threads The number of threads to run in parallel
+ * \param work The function to be called to do the work
+ * \param get_task The function which will determine the next unassigned task
+ * \param final The function which will be called to clean up after a task
+ * \param queue_args A pointer to any data required to determine the next task
+ * \param max Stop calling get_task after starting this number of jobs
+ * \param opts A \ref thread_pool_opts, or NULL for the default behaviour
+ *
+ * As run_threads(), with extra options.
+ *
+ * If \p opts contains a \ref TPCancelToken, \p get_task will not be called
+ * again after the token has been cancelled.  Tasks which were already started
+ * will still be given to \p work and \p final, so that they can be cleaned up.
+ * Long-running work functions can call tp_cancelled() to find out if they
+ * should give up early.
+ *
+ * \returns The number of tasks completed.
+ **/
+int run_threads_opts(int n_threads, TPWorkFunc work,
+                     TPGetTaskFunc get_task, TPFinalFunc final,
+                     void *queue_args, int max,
+                     const struct thread_pool_opts *opts)
+{
+	ThreadPool *pool;
+	int n;
+
+	pool = claim_default_pool(n_threads);
+	if ( pool != NULL ) {
+		n = run_batch(pool, work, get_task, final, queue_args, max, opts);
+		pool->busy = 0;
+		pthread_cond_broadcast(&pool->done_cond);
+		pthread_mutex_unlock(&pool->lock);
+		return n;
 	}
 
-	use_status_labels = 0;
+	pool = thread_pool_new(n_threads);
+	if ( pool == NULL ) return 0;
+	pthread_mutex_lock(&pool->lock);
+	pool->busy = 1;
+	n = run_batch(pool, work, get_task, final, queue_args, max, opts);
+	pool->busy = 0;
+	pthread_mutex_unlock(&pool->lock);
+	thread_pool_free(pool);
 
-	cffree(workers);
-
-	return q.n_completed;
+	return n;
 }
@@ -30,6 +30,7 @@
 #define THREAD_POOL_H
 
 #include <pthread.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -74,11 +75,104 @@ typedef void (*TPWorkFunc)(void *work, int cookie);
 typedef void (*TPFinalFunc)(void *qargs, void *work);
 
 
+/**
+ * Says how calls to the \ref TPFinalFunc are protected.
+ **/
+enum tp_final_locking
+{
+	/** Called under the same lock as the \ref TPGetTaskFunc (the default) */
+	TP_FINAL_LOCKED = 0,
+
+	/** Called under a separate lock, so it may run at the same time as the
+	 * \ref TPGetTaskFunc, but not at the same time as itself */
+	TP_FINAL_SEPARATE_LOCK = 1,
+
+	/** Called without any lock, so it must be thread safe */
+	TP_FINAL_UNLOCKED = 2,
+};
+
+
+/**
+ * A TPCancelToken is used to ask a batch of work to stop early.  Work
+ * functions can also poll it using tp_cancelled(), to abandon a long
+ * calculation.
+ *
+ * This data structure is opaque.
+ **/
+typedef struct _tpcancel TPCancelToken;
+
+
+/**
+ * Extra options for thread_pool_run_opts() and run_threads_opts().  A value
+ * of zero for any field gives the default behaviour.
+ **/
+struct thread_pool_opts
+{
+	/** Number of tasks for each worker to take at once, to reduce
+	 * contention when the tasks are small.  Default 1. */
+	int chunk_size;
+
+	/** How calls to the \ref TPFinalFunc are protected */
+	enum tp_final_locking final_locking;
+
+	/** If not NULL, no more tasks will be started after this token has
+	 * been cancelled, or its deadline has passed */
+	TPCancelToken *cancel;
+};
+
+
+extern TPCancelToken *tp_cancel_token_new(void);
+extern void tp_cancel_token_free(TPCancelToken *tok);
+extern void tp_cancel(TPCancelToken *tok);
+extern void tp_cancel_reset(TPCancelToken *tok);
+extern void tp_cancel_set_timeout(TPCancelToken *tok, double seconds);
+extern int tp_cancelled(TPCancelToken *tok);
+
+
 extern int run_threads(int n_threads, TPWorkFunc work,
                        TPGetTaskFunc get_task, TPFinalFunc final,
                        void *queue_args, int max,
                        int cpu_num, int cpu_groupsize, int cpu_offset);
 
+extern int run_threads_opts(int n_threads, TPWorkFunc work,
+                            TPGetTaskFunc get_task, TPFinalFunc final,
+                            void *queue_args, int max,
+                            const struct thread_pool_opts *opts);
+
+
+/**
+ * A ThreadPool is a set of worker threads which can be used for many batches
+ * of work, using thread_pool_run().
+ *
+ * This data structure is opaque.
+ **/
+typedef struct _threadpool ThreadPool;
+
+/**
+ * Options for thread_pool_new_with_flags()
+ **/
+enum thread_pool_flags
+{
+	/** Pin each worker thread to its own CPU */
+	TP_PIN_THREADS = 1,
+};
+
+extern ThreadPool *thread_pool_new(int n_threads);
+extern ThreadPool *thread_pool_new_with_flags(int n_threads, int flags);
+extern void thread_pool_free(ThreadPool *pool);
+extern int thread_pool_get_num_threads(ThreadPool *pool);
+extern int thread_pool_run(ThreadPool *pool, TPWorkFunc work,
+                           TPGetTaskFunc get_task, TPFinalFunc final,
+                           void *queue_args, int max);
+extern int thread_pool_run_opts(ThreadPool *pool, TPWorkFunc work,
+                                TPGetTaskFunc get_task, TPFinalFunc final,
+                                void *queue_args, int max,
+                                const struct thread_pool_opts *opts);
+extern void set_default_thread_pool(ThreadPool *pool);
+extern void set_deterministic_reductions(int det);
+extern int reduction_parts(int n_threads);
+extern void *thread_pool_scratch(size_t size);
+
 #ifdef __cplusplus
 }
 #endif
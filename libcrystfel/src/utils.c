@@ -34,8 +34,10 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_blas.h>
@@ -430,6 +432,17 @@ int set_mm_funcs(void *(*cfmalloc)(size_t size),
 	return 0;
 }
 
+void get_mm_funcs(void *(**cfmalloc)(size_t size),
+                  void (**cffree)(void *ptr),
+                  void *(**cfcalloc)(size_t nmemb, size_t size),
+                  void *(**cfrealloc)(void *ptr, size_t size))
+{
+	*cfmalloc = mm_conf.malloc;
+	*cffree = mm_conf.free;
+	*cfcalloc = mm_conf.calloc;
+	*cfrealloc = mm_conf.realloc;
+}
+
 char *cfstrdup(const char *s)
 {
 	size_t l = strlen(s);
@@ -448,6 +461,111 @@ char *cfstrndup(const char *s, size_t n)
 	return r;
 }
 
+/* The usual size of a huge page on x86-64 and ARM64 */
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+static size_t huge_round(size_t size)
+{
+	return (size + HUGE_PAGE_SIZE-1) & ~(size_t)(HUGE_PAGE_SIZE-1);
+}
+
+
+/**
+ * \param size The number of bytes needed
+ * \param hp How to allocate the memory
+ *
+ * Allocates a large buffer, which will be used for a long time, optionally
+ * from huge pages to reduce TLB misses.  With \ref HUGE_PAGES_EXPLICIT, the
+ * memory comes from the pages reserved with /proc/sys/vm/nr_hugepages, and
+ * transparent huge pages are used if there aren't enough.  The size is
+ * rounded up to a whole number of huge pages, so this is only worthwhile for
+ * buffers of a few megabytes or more.
+ *
+ * The memory is not initialised (unless it comes from huge pages, in which
+ * case it's set to zero), and must be freed with cffree_huge().
+ *
+ * \returns a pointer to the memory, or NULL on error.
+ */
+void *cfmalloc_huge(size_t size, enum huge_pages hp)
+{
+	size_t len;
+	char *mem;
+	char *aligned;
+
+	if ( (hp != HUGE_PAGES_TRANSPARENT) && (hp != HUGE_PAGES_EXPLICIT) ) {
+		return cfmalloc(size);
+	}
+
+	len = huge_round(size);
+
+#ifdef MAP_HUGETLB
+	if ( hp == HUGE_PAGES_EXPLICIT ) {
+		static int warned = 0;
+		mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if ( mem != MAP_FAILED ) return mem;
+		if ( !warned ) {
+			ERROR("WARNING: Not enough huge pages reserved (see "
+			      "/proc/sys/vm/nr_hugepages).  Using transparent "
+			      "huge pages instead.\n");
+			warned = 1;
+		}
+	}
+#endif
+
+	/* Map an extra huge page, so that the start can be aligned */
+	mem = mmap(NULL, len+HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ( mem == MAP_FAILED ) return NULL;
+
+	aligned = (char *)(((uintptr_t)mem + HUGE_PAGE_SIZE-1)
+	                   & ~(uintptr_t)(HUGE_PAGE_SIZE-1));
+	if ( aligned > mem ) munmap(mem, aligned-mem);
+	if ( mem+HUGE_PAGE_SIZE > aligned ) {
+		munmap(aligned+len, mem+HUGE_PAGE_SIZE-aligned);
+	}
+
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, len, MADV_HUGEPAGE);
+#endif
+
+	return aligned;
+}
+
+
+/**
+ * \param ptr Memory from cfmalloc_huge()
+ * \param size The size which was given to cfmalloc_huge()
+ * \param hp The value which was given to cfmalloc_huge()
+ *
+ * Frees memory allocated with cfmalloc_huge().
+ */
+void cffree_huge(void *ptr, size_t size, enum huge_pages hp)
+{
+	if ( ptr == NULL ) return;
+	if ( (hp == HUGE_PAGES_TRANSPARENT) || (hp == HUGE_PAGES_EXPLICIT) ) {
+		munmap(ptr, huge_round(size));
+	} else {
+		cffree(ptr);
+	}
+}
+
+
+/**
+ * \param str A string, e.g. from the command line
+ *
+ * \returns the \ref huge_pages value for "none", "transparent" or
+ * "explicit", or \ref HUGE_PAGES_ERROR if \p str is none of these.
+ */
+enum huge_pages parse_huge_pages(const char *str)
+{
+	if ( strcmp(str, "none") == 0 ) return HUGE_PAGES_NONE;
+	if ( strcmp(str, "transparent") == 0 ) return HUGE_PAGES_TRANSPARENT;
+	if ( strcmp(str, "explicit") == 0 ) return HUGE_PAGES_EXPLICIT;
+	return HUGE_PAGES_ERROR;
+}
+
+
 void *srealloc(void *arr, size_t new_size)
 {
 	void *new_arr = cfrealloc(arr, new_size);
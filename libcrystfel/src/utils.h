@@ -252,6 +252,23 @@ extern int set_mm_funcs(void *(*cfmalloc)(size_t size),
                         void (*cffree)(void *ptr),
                         void *(*cfcalloc)(size_t nmemb, size_t size),
                         void *(*cfrealloc)(void *ptr, size_t size));
+extern void get_mm_funcs(void *(**cfmalloc)(size_t size),
+                         void (**cffree)(void *ptr),
+                         void *(**cfcalloc)(size_t nmemb, size_t size),
+                         void *(**cfrealloc)(void *ptr, size_t size));
+
+/** How to allocate large buffers which are used for a long time */
+enum huge_pages
+{
+	HUGE_PAGES_NONE,         /**< Normal allocation with cfmalloc() */
+	HUGE_PAGES_TRANSPARENT,  /**< Ask for transparent huge pages */
+	HUGE_PAGES_EXPLICIT,     /**< Use reserved huge pages, if available */
+	HUGE_PAGES_ERROR,        /**< Unrecognised, from parse_huge_pages() */
+};
+
+extern void *cfmalloc_huge(size_t size, enum huge_pages hp);
+extern void cffree_huge(void *ptr, size_t size, enum huge_pages hp);
+extern enum huge_pages parse_huge_pages(const char *str);
 
 
 /* -------------------------------- Debugging ------------------------------- */
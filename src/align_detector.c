@@ -40,6 +40,8 @@
 #include <string.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <limits.h>
+#include <gsl/gsl_errno.h>
 
 #include <datatemplate.h>
 #include <utils.h>
@@ -47,6 +49,7 @@
 #include <crystfel-mille.h>
 
 #include "version.h"
+#include "mille-solver.h"
 
 
 static void show_syntax(const char *s)
@@ -66,6 +69,8 @@ static void show_help(const char *s)
 	       "      --out-of-plane         Refine (relative) z-direction shifts\n"
 	       "      --out-of-plane-tilts   Refine panel rotations around x and y\n"
 	       "      --camera-length        Refine overall camera length\n"
+	       "      --internal-solver      Solve without running Millepede\n"
+	       "  -j <n>                     Use n threads (with --internal-solver)\n"
 	       "\n"
 	       "  -h, --help                 Display this help message\n"
 	       "      --version              Print version number and exit\n");
@@ -136,34 +141,91 @@ static int is_child(struct dg_group_info *parent, struct dg_group_info *child)
 }
 
 
-static void write_zero_sum(FILE *fh, struct dg_group_info *g,
-                           struct dg_group_info *groups, int n_groups,
-                           enum gparam p)
+/* The things which go into the Millepede steering file */
+struct alignment
+{
+	char **files;
+	int n_files;
+	int max_files;
+
+	struct mille_param *params;
+	int n_params;
+
+	struct mille_constraint *cons;
+	int n_cons;
+	int max_cons;
+};
+
+
+static int add_file(struct alignment *al, const char *filename)
+{
+	if ( al->n_files == al->max_files ) {
+		char **nf;
+		int nmax = (al->max_files == 0) ? 64 : 2*al->max_files;
+		nf = realloc(al->files, nmax*sizeof(char *));
+		if ( nf == NULL ) return 1;
+		al->files = nf;
+		al->max_files = nmax;
+	}
+	al->files[al->n_files] = strdup(filename);
+	if ( al->files[al->n_files] == NULL ) return 1;
+	al->n_files++;
+	return 0;
+}
+
+
+static void add_param(struct alignment *al, int label, int fixed)
+{
+	al->params[al->n_params].label = label;
+	al->params[al->n_params].fixed = fixed;
+	al->params[al->n_params].shift = 0.0;
+	al->n_params++;
+}
+
+
+static int add_zero_sum(struct alignment *al, struct dg_group_info *g,
+                        struct dg_group_info *groups, int n_groups,
+                        enum gparam p)
 {
 	int i;
-	int found = 0;
+	struct mille_constraint *c;
+
+	if ( al->n_cons == al->max_cons ) {
+		struct mille_constraint *nc;
+		int nmax = (al->max_cons == 0) ? 64 : 2*al->max_cons;
+		nc = realloc(al->cons, nmax*sizeof(struct mille_constraint));
+		if ( nc == NULL ) return 1;
+		al->cons = nc;
+		al->max_cons = nmax;
+	}
+
+	c = &al->cons[al->n_cons];
+	c->labels = malloc(n_groups*sizeof(int));
+	if ( c->labels == NULL ) return 1;
+	c->n = 0;
 
 	for ( i=0; i<n_groups; i++ ) {
 		if ( is_child(g, &groups[i]) ) {
-			if ( !found ) {
-				fprintf(fh, "Constraint 0\n");
-				found = 1;
-			}
-			fprintf(fh, "%i 1\n", mille_label(groups[i].serial, p));
+			c->labels[c->n++] = mille_label(groups[i].serial, p);
 		}
 	}
 
-	if ( found ) {
-		fprintf(fh, "\n");
+	if ( c->n > 0 ) {
+		al->n_cons++;
+	} else {
+		free(c->labels);
 	}
+	return 0;
 }
 
 
-static int make_zero_sum(FILE *fh, struct dg_group_info *groups, int n_groups,
+static int make_zero_sum(struct alignment *al,
+                         struct dg_group_info *groups, int n_groups,
                          const char *group_name, int level,
                          int out_of_plane_shift, int out_of_plane_tilts)
 {
 	int i;
+	int r = 0;
 	struct dg_group_info *g = find_group(groups, n_groups, group_name);
 
 	if ( g == NULL ) {
@@ -174,22 +236,21 @@ static int make_zero_sum(FILE *fh, struct dg_group_info *groups, int n_groups,
 	/* Millepede doesn't like excessive constraints */
 	if ( g->hierarchy_level >= level ) return 0;
 
-	fprintf(fh, "! Hierarchy constraints for group %s\n", group_name);
-	write_zero_sum(fh, g, groups, n_groups, GPARAM_DET_TX);
-	write_zero_sum(fh, g, groups, n_groups, GPARAM_DET_TY);
+	r += add_zero_sum(al, g, groups, n_groups, GPARAM_DET_TX);
+	r += add_zero_sum(al, g, groups, n_groups, GPARAM_DET_TY);
 	if ( out_of_plane_shift ) {
-		write_zero_sum(fh, g, groups, n_groups, GPARAM_DET_TZ);
+		r += add_zero_sum(al, g, groups, n_groups, GPARAM_DET_TZ);
 	}
 	if ( out_of_plane_tilts ) {
-		write_zero_sum(fh, g, groups, n_groups, GPARAM_DET_RX);
-		write_zero_sum(fh, g, groups, n_groups, GPARAM_DET_RY);
+		r += add_zero_sum(al, g, groups, n_groups, GPARAM_DET_RX);
+		r += add_zero_sum(al, g, groups, n_groups, GPARAM_DET_RY);
 	}
-	write_zero_sum(fh, g, groups, n_groups, GPARAM_DET_RZ);
-	fprintf(fh, "\n");
+	r += add_zero_sum(al, g, groups, n_groups, GPARAM_DET_RZ);
+	if ( r ) return 1;
 
 	for ( i=0; i<n_groups; i++ ) {
 		if ( is_child(g, &groups[i]) ) {
-			if ( make_zero_sum(fh, groups, n_groups, groups[i].name,
+			if ( make_zero_sum(al, groups, n_groups, groups[i].name,
 			                   level, out_of_plane_shift,
 			                   out_of_plane_tilts) ) return 1;
 		}
@@ -199,6 +260,46 @@ static int make_zero_sum(FILE *fh, struct dg_group_info *groups, int n_groups,
 }
 
 
+static int write_steering_file(const char *filename, struct alignment *al)
+{
+	FILE *fh;
+	int i, j;
+
+	fh = fopen(filename, "w");
+	if ( fh == NULL ) {
+		ERROR("Couldn't open Millepede steering file\n");
+		return 1;
+	}
+
+	for ( i=0; i<al->n_files; i++ ) {
+		fprintf(fh, "%s\n", al->files[i]);
+	}
+
+	fprintf(fh, "\nParameter\n");
+	for ( i=0; i<al->n_params; i++ ) {
+		fprintf(fh, "%i 0 %i\n", al->params[i].label,
+		        al->params[i].fixed ? -1 : 0);
+	}
+	fprintf(fh, "\n");
+
+	/* All corrections must sum to zero at each level of hierarchy */
+	for ( i=0; i<al->n_cons; i++ ) {
+		fprintf(fh, "Constraint 0\n");
+		for ( j=0; j<al->cons[i].n; j++ ) {
+			fprintf(fh, "%i 1\n", al->cons[i].labels[j]);
+		}
+		fprintf(fh, "\n");
+	}
+
+	fprintf(fh, "method inversion 5 0.1\n");
+	fprintf(fh, "closeandreopen\n");
+	fprintf(fh, "end\n");
+	fclose(fh);
+
+	return 0;
+}
+
+
 static void print_time_warning()
 {
 	ERROR("\n\n");
@@ -263,19 +364,176 @@ static int run_pede()
 }
 
 
-static void write_children(FILE *fh, const char *dir)
+static int add_children(struct alignment *al, const char *dir)
 {
 	DIR *d = opendir(dir);
 	struct dirent *dent = readdir(d);
+	char *filename;
+
+	filename = malloc(strlen(dir)+NAME_MAX+2);
+	if ( filename == NULL ) return 1;
 
 	while ( dent != NULL ) {
 		if ( dent->d_name[0] == 'm' ) {
-			fprintf(fh, "%s/%s\n", dir, dent->d_name);
+			sprintf(filename, "%s/%s", dir, dent->d_name);
+			if ( add_file(al, filename) ) {
+				free(filename);
+				closedir(d);
+				return 1;
+			}
 		}
 		dent = readdir(d);
 	}
 
+	free(filename);
 	closedir(d);
+	return 0;
+}
+
+
+/* Applies the result for one parameter to the geometry */
+static int apply_shift(DataTemplate *dtempl, struct dg_group_info *groups,
+                       int n_groups, int code, double shift,
+                       int *last_group_serial)
+{
+	int p;
+	const char *group_name;
+	int group_serial;
+
+	p = mille_unlabel(code % 100);
+	group_serial = code - (code % 100);
+	group_name = group_serial_to_name(group_serial, groups, n_groups);
+
+	if ( *last_group_serial != group_serial ) {
+		STATUS("Group %s:\n", group_name);
+		*last_group_serial = group_serial;
+	}
+
+	switch ( p ) {
+		case GPARAM_DET_TX:
+		case GPARAM_DET_TY:
+		case GPARAM_DET_TZ:
+		STATUS("   %14s %+f mm\n", str_param(p), 1e3*shift);
+		break;
+
+		case GPARAM_DET_RX:
+		case GPARAM_DET_RY:
+		case GPARAM_DET_RZ:
+		STATUS("   %14s %+f deg\n", str_param(p), rad2deg(shift));
+		break;
+	}
+
+	if ( group_name == NULL ) {
+		ERROR("Invalid group serial number %i\n", code);
+		return 1;
+	}
+
+	switch ( p ) {
+
+		case GPARAM_DET_TX:
+		data_template_translate_group_m(dtempl, group_name,
+		                                -shift, 0, 0);
+		break;
+
+		case GPARAM_DET_TY:
+		data_template_translate_group_m(dtempl, group_name,
+		                                0, -shift, 0);
+		break;
+
+		case GPARAM_DET_TZ:
+		data_template_translate_group_m(dtempl, group_name,
+		                                0, 0, -shift);
+		break;
+
+		case GPARAM_DET_RX:
+		data_template_rotate_group(dtempl, group_name,
+		                           -shift, 'x');
+		break;
+
+		case GPARAM_DET_RY:
+		data_template_rotate_group(dtempl, group_name,
+		                           -shift, 'y');
+		break;
+
+		case GPARAM_DET_RZ:
+		data_template_rotate_group(dtempl, group_name,
+		                           -shift, 'z');
+		break;
+
+		default:
+		ERROR("Invalid parameter %i\n", p);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static int read_pede_results(DataTemplate *dtempl,
+                             struct dg_group_info *groups, int n_groups)
+{
+	FILE *fh;
+	char line[256];
+	char *rval;
+	int last_group_serial = -1;
+
+	fh = fopen("millepede.res", "r");
+	if ( fh == NULL ) {
+		ERROR("Failed to open millepede.res\n");
+		return 1;
+	}
+
+	if ( fgets(line, 256, fh) != line ) {
+		ERROR("Failed to read first line of millepede.res\n");
+		return 1;
+	}
+	if ( strncmp(line, " Parameter ", 11) != 0 ) {
+		ERROR("First line of millepede.res is not as expected.\n");
+		return 1;
+	}
+
+	do {
+
+		char **bits;
+		int i, n;
+
+		rval = fgets(line, 256, fh);
+		if ( rval != line ) continue;
+
+		chomp(line);
+		notrail(line);
+		n = assplode(line, " ", &bits, ASSPLODE_NONE);
+		if ( (n != 3) && (n != 5) ) {
+			ERROR("Didn't understand this line from Millepede: (%i) %s", n, line);
+			return 1;
+		}
+
+		if ( n == 5 ) {
+
+			int code;
+			double shift;
+
+			if ( convert_int(bits[0], &code) ) {
+				ERROR("Didn't understand '%s'\n", bits[0]);
+				return 1;
+			}
+			if ( convert_float(bits[1], &shift) ) {
+				ERROR("Didn't understand '%s'\n", bits[1]);
+				return 1;
+			}
+
+			if ( apply_shift(dtempl, groups, n_groups, code, shift,
+			                 &last_group_serial) ) return 1;
+
+		}
+
+		for ( i=0; i<n; i++ ) free(bits[i]);
+		free(bits);
+
+	} while ( rval == line );
+
+	fclose(fh);
+	return 0;
 }
 
 
@@ -287,17 +545,18 @@ int main(int argc, char *argv[])
 	int level = 0;
 	char *rval;
 	int i;
-	FILE *fh;
 	DataTemplate *dtempl;
 	struct dg_group_info *groups;
 	int n_groups;
 	int r;
-	char line[256];
 	time_t first_mtime = 0;
 	int warn_times = 0;
 	int out_of_plane_shift = 0;
 	int out_of_plane_tilts = 0;
 	int refine_clen = 0;
+	int internal_solver = 0;
+	int n_threads = 1;
+	struct alignment al;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -312,12 +571,13 @@ int main(int argc, char *argv[])
 		{"out-of-plane",       0, &out_of_plane_shift, 1},
 		{"out-of-plane-tilts", 0, &out_of_plane_tilts, 1},
 		{"camera-length",      0, &refine_clen,        1},
+		{"internal-solver",    0, &internal_solver,    1},
 
 		{0, 0, NULL, 0}
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "hVo:g:i:l:",
+	while ((c = getopt_long(argc, argv, "hVo:g:i:l:j:",
 	                        longopts, NULL)) != -1)
 	{
 
@@ -348,6 +608,15 @@ int main(int argc, char *argv[])
 				ERROR("Invalid value for --level.\n");
 				return 1;
 			}
+			break;
+
+			case 'j' :
+			n_threads = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (n_threads < 1) ) {
+				ERROR("Invalid number of threads.\n");
+				return 1;
+			}
+			break;
 
 			case 0 :
 			break;
@@ -368,11 +637,12 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	fh = fopen("millepede.txt", "w");
-	if ( fh == NULL ) {
-		ERROR("Couldn't open Millepede steering file\n");
-		return 1;
-	}
+	al.files = NULL;
+	al.n_files = 0;
+	al.max_files = 0;
+	al.cons = NULL;
+	al.n_cons = 0;
+	al.max_cons = 0;
 
 	for ( i=optind; i<argc; i++ ) {
 
@@ -393,9 +663,13 @@ int main(int argc, char *argv[])
 		}
 
 		if ( is_dir(argv[i]) ) {
-			write_children(fh, argv[i]);
+			r = add_children(&al, argv[i]);
 		} else {
-			fprintf(fh, "%s\n", argv[i]);
+			r = add_file(&al, argv[i]);
+		}
+		if ( r ) {
+			ERROR("Failed to add Mille files\n");
+			return 1;
 		}
 	}
 
@@ -404,168 +678,64 @@ int main(int argc, char *argv[])
 	dtempl = data_template_new_from_file(in_geom);
 	groups = data_template_group_info(dtempl, &n_groups);
 
-	fprintf(fh, "\nParameter\n");
+	al.params = malloc(6*(n_groups+1)*sizeof(struct mille_param));
+	if ( al.params == NULL ) return 1;
+	al.n_params = 0;
 
 	/* Top level */
-	fprintf(fh, "%i 0 0\n", mille_label(0, GPARAM_DET_TX));
-	fprintf(fh, "%i 0 0\n", mille_label(0, GPARAM_DET_TY));
-	fprintf(fh, "%i 0 %i\n", mille_label(0, GPARAM_DET_TZ), refine_clen ? 0 : -1);
-	fprintf(fh, "%i 0 %i\n", mille_label(0, GPARAM_DET_RX), out_of_plane_tilts ? 0 : -1);
-	fprintf(fh, "%i 0 %i\n", mille_label(0, GPARAM_DET_RY), out_of_plane_tilts ? 0 : -1);
-	fprintf(fh, "%i 0 -1\n", mille_label(0, GPARAM_DET_RZ));
+	add_param(&al, mille_label(0, GPARAM_DET_TX), 0);
+	add_param(&al, mille_label(0, GPARAM_DET_TY), 0);
+	add_param(&al, mille_label(0, GPARAM_DET_TZ), !refine_clen);
+	add_param(&al, mille_label(0, GPARAM_DET_RX), !out_of_plane_tilts);
+	add_param(&al, mille_label(0, GPARAM_DET_RY), !out_of_plane_tilts);
+	add_param(&al, mille_label(0, GPARAM_DET_RZ), 1);
 
 	for ( i=0; i<n_groups; i++ ) {
-		int f_inplane = (groups[i].hierarchy_level > level) ? -1 : 0;
-		int f_outplane_shift = out_of_plane_shift ? f_inplane : -1;
-		int f_outplane_tilts = out_of_plane_tilts ? f_inplane : -1;
+		int f_inplane = (groups[i].hierarchy_level > level);
+		int f_outplane_shift = out_of_plane_shift ? f_inplane : 1;
+		int f_outplane_tilts = out_of_plane_tilts ? f_inplane : 1;
+		int serial = groups[i].serial;
 		if ( groups[i].hierarchy_level == 0 ) continue;
-		fprintf(fh, "%i 0 %i\n", mille_label(groups[i].serial, GPARAM_DET_TX), f_inplane);
-		fprintf(fh, "%i 0 %i\n", mille_label(groups[i].serial, GPARAM_DET_TY), f_inplane);
-		fprintf(fh, "%i 0 %i\n", mille_label(groups[i].serial, GPARAM_DET_TZ), f_outplane_shift);
-		fprintf(fh, "%i 0 %i\n", mille_label(groups[i].serial, GPARAM_DET_RX), f_outplane_tilts);
-		fprintf(fh, "%i 0 %i\n", mille_label(groups[i].serial, GPARAM_DET_RY), f_outplane_tilts);
-		fprintf(fh, "%i 0 %i\n", mille_label(groups[i].serial, GPARAM_DET_RZ), f_inplane);
+		add_param(&al, mille_label(serial, GPARAM_DET_TX), f_inplane);
+		add_param(&al, mille_label(serial, GPARAM_DET_TY), f_inplane);
+		add_param(&al, mille_label(serial, GPARAM_DET_TZ), f_outplane_shift);
+		add_param(&al, mille_label(serial, GPARAM_DET_RX), f_outplane_tilts);
+		add_param(&al, mille_label(serial, GPARAM_DET_RY), f_outplane_tilts);
+		add_param(&al, mille_label(serial, GPARAM_DET_RZ), f_inplane);
 	}
-	fprintf(fh, "\n");
 
 	/* All corrections must sum to zero at each level of hierarchy */
-	if ( make_zero_sum(fh, groups, n_groups, "all", level,
+	if ( make_zero_sum(&al, groups, n_groups, "all", level,
 	                   out_of_plane_shift, out_of_plane_tilts) ) return 1;
 
-	fprintf(fh, "method inversion 5 0.1\n");
-	fprintf(fh, "closeandreopen\n");
-	fprintf(fh, "end\n");
-	fclose(fh);
-
-	unlink("millepede.res");
-
-	if ( run_pede() ) return 1;
-	STATUS("Millepede succeeded.\n\n");
-
-	fh = fopen("millepede.res", "r");
-	if ( fh == NULL ) {
-		ERROR("Failed to open millepede.res\n");
-		return 1;
-	}
-
-	if ( fgets(line, 256, fh) != line ) {
-		ERROR("Failed to read first line of millepede.res\n");
-		return 1;
-	}
-	if ( strncmp(line, " Parameter ", 11) != 0 ) {
-		ERROR("First line of millepede.res is not as expected.\n");
-		return 1;
-	}
-
-	int last_group_serial = -1;
-	do {
+	if ( internal_solver ) {
 
-		char **bits;
-		int i, n;
+		int last_group_serial = -1;
 
-		rval = fgets(line, 256, fh);
-		if ( rval != line ) continue;
+		gsl_set_error_handler_off();
+		if ( mille_solve(al.files, al.n_files, al.params, al.n_params,
+		                 al.cons, al.n_cons, n_threads) ) return 1;
+		STATUS("Solved for alignment parameters.\n\n");
 
-		chomp(line);
-		notrail(line);
-		n = assplode(line, " ", &bits, ASSPLODE_NONE);
-		if ( (n != 3) && (n != 5) ) {
-			ERROR("Didn't understand this line from Millepede: (%i) %s", n, line);
-			return 1;
+		for ( i=0; i<al.n_params; i++ ) {
+			if ( al.params[i].fixed ) continue;
+			if ( apply_shift(dtempl, groups, n_groups,
+			                 al.params[i].label, al.params[i].shift,
+			                 &last_group_serial) ) return 1;
 		}
 
-		if ( n == 5 ) {
-
-			int code;
-			double shift;
-			int p;
-			const char *group_name;
-			int group_serial;
-
-			if ( convert_int(bits[0], &code) ) {
-				ERROR("Didn't understand '%s'\n", bits[0]);
-				return 1;
-			}
-			if ( convert_float(bits[1], &shift) ) {
-				ERROR("Didn't understand '%s'\n", bits[1]);
-				return 1;
-			}
-
-			p = mille_unlabel(code % 100);
-			group_serial = code - (code % 100);
-			group_name = group_serial_to_name(group_serial,
-			                                  groups,
-			                                  n_groups);
-
-			if ( last_group_serial != group_serial ) {
-				STATUS("Group %s:\n", group_name);
-				last_group_serial = group_serial;
-			}
-
-			switch ( p ) {
-				case GPARAM_DET_TX:
-				case GPARAM_DET_TY:
-				case GPARAM_DET_TZ:
-				STATUS("   %14s %+f mm\n", str_param(p), 1e3*shift);
-				break;
-
-				case GPARAM_DET_RX:
-				case GPARAM_DET_RY:
-				case GPARAM_DET_RZ:
-				STATUS("   %14s %+f deg\n", str_param(p), rad2deg(shift));
-				break;
-			}
-
-			if ( group_name == NULL ) {
-				ERROR("Invalid group serial number %i\n", code);
-				return 1;
-			}
-
-			switch ( p ) {
-
-				case GPARAM_DET_TX:
-				data_template_translate_group_m(dtempl, group_name,
-				                                -shift, 0, 0);
-				break;
-
-				case GPARAM_DET_TY:
-				data_template_translate_group_m(dtempl, group_name,
-				                                0, -shift, 0);
-				break;
-
-				case GPARAM_DET_TZ:
-				data_template_translate_group_m(dtempl, group_name,
-				                                0, 0, -shift);
-				break;
-
-				case GPARAM_DET_RX:
-				data_template_rotate_group(dtempl, group_name,
-				                           -shift, 'x');
-				break;
-
-				case GPARAM_DET_RY:
-				data_template_rotate_group(dtempl, group_name,
-				                           -shift, 'y');
-				break;
-
-				case GPARAM_DET_RZ:
-				data_template_rotate_group(dtempl, group_name,
-				                           -shift, 'z');
-				break;
+	} else {
 
-				default:
-				ERROR("Invalid parameter %i\n", p);
-				return 1;
-			}
+		if ( write_steering_file("millepede.txt", &al) ) return 1;
 
-		}
+		unlink("millepede.res");
 
-		for ( i=0; i<n; i++ ) free(bits[i]);
-		free(bits);
+		if ( run_pede() ) return 1;
+		STATUS("Millepede succeeded.\n\n");
 
-	} while ( rval == line );
+		if ( read_pede_results(dtempl, groups, n_groups) ) return 1;
 
-	fclose(fh);
+	}
 
 	data_template_write_to_file(dtempl, out_geom);
 
@@ -0,0 +1,488 @@
+/*
+ * ambigator-opencl.c
+ *
+ * Correlation calculations for ambigator, on a GPU
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* The reflection lists of all the crystals are copied to the GPU once, packed
+ * one after the other.  After that, only the lists of crystal pairs to
+ * correlate, and the results, need to be transferred.  One work item handles
+ * one pair, in one indexing assignment. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <utils.h>
+
+#include "ambigator-opencl.h"
+
+
+#if defined(HAVE_OPENCL)
+
+#define CL_TARGET_OPENCL_VERSION 120
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#define AMB_GPU_GROUP_SIZE (64)
+
+static const char *amb_kernel_source =
+"__kernel void amb_corr(__global const long *offs,\n"
+"                       __global const uint *s,\n"
+"                       __global const float *iv,\n"
+"                       __global const uint *grp,\n"
+"                       __global const uint *s_reidx,\n"
+"                       __global const float *iv_reidx,\n"
+"                       __global const uint *grp_reidx,\n"
+"                       const int n_groups, const int n_pairs,\n"
+"                       __global const int *pa,\n"
+"                       __global const int *pb,\n"
+"                       __global float *cc,\n"
+"                       __global int *nout)\n"
+"{\n"
+"	const int p = get_global_id(0);\n"
+"	const int reidx = get_global_id(1);\n"
+"	__global const uint *sa;\n"
+"	__global const float *ia;\n"
+"	__global const uint *ga;\n"
+"	float s_xy[3], s_x[3], s_y[3], s_x2[3], s_y2[3];\n"
+"	int n[3];\n"
+"	long a, a_end, b, b_end;\n"
+"	float total = 0.0f;\n"
+"	int g;\n"
+"\n"
+"	if ( p >= n_pairs ) return;\n"
+"\n"
+"	if ( reidx ) {\n"
+"		sa = s_reidx;\n"
+"		ia = iv_reidx;\n"
+"		ga = grp_reidx;\n"
+"	} else {\n"
+"		sa = s;\n"
+"		ia = iv;\n"
+"		ga = grp;\n"
+"	}\n"
+"\n"
+"	for ( g=0; g<3; g++ ) {\n"
+"		s_xy[g] = 0.0f;\n"
+"		s_x[g] = 0.0f;\n"
+"		s_y[g] = 0.0f;\n"
+"		s_x2[g] = 0.0f;\n"
+"		s_y2[g] = 0.0f;\n"
+"		n[g] = 0;\n"
+"	}\n"
+"\n"
+"	a = offs[pa[p]];\n"
+"	a_end = offs[pa[p]+1];\n"
+"	b = offs[pb[p]];\n"
+"	b_end = offs[pb[p]+1];\n"
+"	while ( (a < a_end) && (b < b_end) ) {\n"
+"		const uint va = sa[a];\n"
+"		const uint vb = s[b];\n"
+"		if ( va < vb ) {\n"
+"			a++;\n"
+"		} else if ( va > vb ) {\n"
+"			b++;\n"
+"		} else {\n"
+"			const uint k = ga[a];\n"
+"			const float x = ia[a];\n"
+"			const float y = iv[b];\n"
+"			s_xy[k] += x*y;\n"
+"			s_x[k] += x;\n"
+"			s_y[k] += y;\n"
+"			s_x2[k] += x*x;\n"
+"			s_y2[k] += y*y;\n"
+"			n[k]++;\n"
+"			a++;\n"
+"			b++;\n"
+"		}\n"
+"	}\n"
+"\n"
+"	/* Same as corr() in ambigator.c */\n"
+"	for ( g=0; g<n_groups; g++ ) {\n"
+"		float t1, t2, v;\n"
+"		t1 = s_x2[g] - s_x[g]*s_x[g] / n[g];\n"
+"		t2 = s_y2[g] - s_y[g]*s_y[g] / n[g];\n"
+"		if ( (t1 <= 0.0f) || (t2 <= 0.0f) ) continue;\n"
+"		v = (s_xy[g] - s_x[g]*s_y[g]/n[g]) / sqrt(t1*t2);\n"
+"		if ( !isnan(v) ) total += v;\n"
+"	}\n"
+"\n"
+"	cc[(size_t)reidx*n_pairs + p] = total/n_groups;\n"
+"	nout[(size_t)reidx*n_pairs + p] = n[n_groups-1];\n"
+"}\n";
+
+
+struct amb_gpu
+{
+	cl_context ctx;
+	cl_command_queue queue;
+	cl_program prog;
+	cl_kernel kern;
+
+	int n_groups;
+	int have_reidx;
+	cl_mem offs;
+	cl_mem s;
+	cl_mem i;
+	cl_mem group;
+	cl_mem s_reidx;
+	cl_mem i_reidx;
+	cl_mem group_reidx;
+
+	/* Re-used between calls, enlarged as needed */
+	int max_pairs;
+	cl_mem pa;
+	cl_mem pb;
+	cl_mem cc;
+	cl_mem n;
+};
+
+
+static void release(cl_mem *mem)
+{
+	if ( *mem != NULL ) clReleaseMemObject(*mem);
+	*mem = NULL;
+}
+
+
+static void free_pair_buffers(struct amb_gpu *gpu)
+{
+	release(&gpu->pa);
+	release(&gpu->pb);
+	release(&gpu->cc);
+	release(&gpu->n);
+	gpu->max_pairs = 0;
+}
+
+
+void amb_gpu_free(struct amb_gpu *gpu)
+{
+	if ( gpu == NULL ) return;
+	free_pair_buffers(gpu);
+	release(&gpu->offs);
+	release(&gpu->s);
+	release(&gpu->i);
+	release(&gpu->group);
+	release(&gpu->s_reidx);
+	release(&gpu->i_reidx);
+	release(&gpu->group_reidx);
+	if ( gpu->kern != NULL ) clReleaseKernel(gpu->kern);
+	if ( gpu->prog != NULL ) clReleaseProgram(gpu->prog);
+	if ( gpu->queue != NULL ) clReleaseCommandQueue(gpu->queue);
+	if ( gpu->ctx != NULL ) clReleaseContext(gpu->ctx);
+	free(gpu);
+}
+
+
+static int find_device(cl_platform_id *pplat, cl_device_id *pdev)
+{
+	cl_platform_id platforms[8];
+	cl_uint n_plat;
+	cl_uint i;
+
+	if ( clGetPlatformIDs(8, platforms, &n_plat) != CL_SUCCESS ) {
+		ERROR("Couldn't get OpenCL platforms\n");
+		return 1;
+	}
+	if ( n_plat > 8 ) n_plat = 8;
+
+	for ( i=0; i<n_plat; i++ ) {
+		cl_uint n_dev;
+		if ( clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 1, pdev,
+		                    &n_dev) == CL_SUCCESS )
+		{
+			*pplat = platforms[i];
+			return 0;
+		}
+	}
+
+	ERROR("Couldn't find a GPU for OpenCL\n");
+	return 1;
+}
+
+
+static void show_build_log(cl_program prog, cl_device_id dev)
+{
+	char log[4096];
+
+	if ( clGetProgramBuildInfo(prog, dev, CL_PROGRAM_BUILD_LOG,
+	                           sizeof(log), log, NULL) == CL_SUCCESS )
+	{
+		log[sizeof(log)-1] = '\0';
+		ERROR("%s\n", log);
+	}
+}
+
+
+static cl_mem upload(struct amb_gpu *gpu, const void *data, size_t size,
+                     cl_int *perr)
+{
+	cl_mem mem;
+	cl_int err;
+
+	/* Zero-sized buffers are not allowed */
+	if ( size == 0 ) size = sizeof(cl_uint);
+
+	mem = clCreateBuffer(gpu->ctx, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+	                     size, (void *)data, &err);
+	if ( err != CL_SUCCESS ) {
+		*perr = err;
+		return NULL;
+	}
+	return mem;
+}
+
+
+struct amb_gpu *amb_gpu_new(int n_crystals, const long *offs, int n_groups,
+                            const unsigned int *s, const float *i,
+                            const unsigned int *group,
+                            const unsigned int *s_reidx, const float *i_reidx,
+                            const unsigned int *group_reidx)
+{
+	struct amb_gpu *gpu;
+	cl_platform_id plat;
+	cl_device_id dev;
+	cl_context_properties prop[3];
+	cl_long *loffs;
+	size_t n_refl;
+	cl_uint dummy = 0;
+	cl_int err;
+	int j;
+
+	if ( find_device(&plat, &dev) ) return NULL;
+
+	gpu = calloc(1, sizeof(struct amb_gpu));
+	if ( gpu == NULL ) return NULL;
+	gpu->n_groups = n_groups;
+	gpu->have_reidx = (s_reidx != NULL);
+
+	prop[0] = CL_CONTEXT_PLATFORM;
+	prop[1] = (cl_context_properties)plat;
+	prop[2] = 0;
+	gpu->ctx = clCreateContext(prop, 1, &dev, NULL, NULL, &err);
+	if ( err != CL_SUCCESS ) {
+		ERROR("Couldn't create OpenCL context: %i\n", err);
+		gpu->ctx = NULL;
+		amb_gpu_free(gpu);
+		return NULL;
+	}
+
+	gpu->queue = clCreateCommandQueue(gpu->ctx, dev, 0, &err);
+	if ( err != CL_SUCCESS ) {
+		ERROR("Couldn't create OpenCL command queue: %i\n", err);
+		gpu->queue = NULL;
+		amb_gpu_free(gpu);
+		return NULL;
+	}
+
+	gpu->prog = clCreateProgramWithSource(gpu->ctx, 1, &amb_kernel_source,
+	                                      NULL, &err);
+	if ( err != CL_SUCCESS ) {
+		ERROR("Couldn't create OpenCL program: %i\n", err);
+		gpu->prog = NULL;
+		amb_gpu_free(gpu);
+		return NULL;
+	}
+
+	/* No fast maths, to keep the results as close as possible to the
+	 * CPU version */
+	err = clBuildProgram(gpu->prog, 1, &dev, "", NULL, NULL);
+	if ( err != CL_SUCCESS ) {
+		ERROR("Couldn't build OpenCL program: %i\n", err);
+		show_build_log(gpu->prog, dev);
+		amb_gpu_free(gpu);
+		return NULL;
+	}
+
+	gpu->kern = clCreateKernel(gpu->prog, "amb_corr", &err);
+	if ( err != CL_SUCCESS ) {
+		ERROR("Couldn't create OpenCL kernel: %i\n", err);
+		gpu->kern = NULL;
+		amb_gpu_free(gpu);
+		return NULL;
+	}
+
+	loffs = malloc((n_crystals+1)*sizeof(cl_long));
+	if ( loffs == NULL ) {
+		amb_gpu_free(gpu);
+		return NULL;
+	}
+	for ( j=0; j<=n_crystals; j++ ) loffs[j] = offs[j];
+	n_refl = offs[n_crystals];
+
+	err = CL_SUCCESS;
+	gpu->offs = upload(gpu, loffs, (n_crystals+1)*sizeof(cl_long), &err);
+	gpu->s = upload(gpu, s, n_refl*sizeof(cl_uint), &err);
+	gpu->i = upload(gpu, i, n_refl*sizeof(cl_float), &err);
+	gpu->group = upload(gpu, group, n_refl*sizeof(cl_uint), &err);
+	if ( gpu->have_reidx ) {
+		gpu->s_reidx = upload(gpu, s_reidx, n_refl*sizeof(cl_uint),
+		                      &err);
+		gpu->i_reidx = upload(gpu, i_reidx, n_refl*sizeof(cl_float),
+		                      &err);
+		gpu->group_reidx = upload(gpu, group_reidx,
+		                          n_refl*sizeof(cl_uint), &err);
+	} else {
+		/* Never read, but the kernel arguments must be set */
+		gpu->s_reidx = upload(gpu, &dummy, sizeof(cl_uint), &err);
+		gpu->i_reidx = upload(gpu, &dummy, sizeof(cl_uint), &err);
+		gpu->group_reidx = upload(gpu, &dummy, sizeof(cl_uint), &err);
+	}
+	free(loffs);
+	if ( err != CL_SUCCESS ) {
+		ERROR("Couldn't copy reflection lists to GPU: %i\n", err);
+		amb_gpu_free(gpu);
+		return NULL;
+	}
+
+	return gpu;
+}
+
+
+static int alloc_pair_buffers(struct amb_gpu *gpu, int n_pairs)
+{
+	cl_int err[4];
+
+	if ( n_pairs <= gpu->max_pairs ) return 0;
+	free_pair_buffers(gpu);
+
+	gpu->pa = clCreateBuffer(gpu->ctx, CL_MEM_READ_ONLY,
+	                         n_pairs*sizeof(cl_int), NULL, &err[0]);
+	gpu->pb = clCreateBuffer(gpu->ctx, CL_MEM_READ_ONLY,
+	                         n_pairs*sizeof(cl_int), NULL, &err[1]);
+	gpu->cc = clCreateBuffer(gpu->ctx, CL_MEM_WRITE_ONLY,
+	                         2*n_pairs*sizeof(cl_float), NULL, &err[2]);
+	gpu->n = clCreateBuffer(gpu->ctx, CL_MEM_WRITE_ONLY,
+	                        2*n_pairs*sizeof(cl_int), NULL, &err[3]);
+	if ( (err[0] != CL_SUCCESS) || (err[1] != CL_SUCCESS)
+	  || (err[2] != CL_SUCCESS) || (err[3] != CL_SUCCESS) )
+	{
+		ERROR("Couldn't create OpenCL buffers\n");
+		if ( err[0] != CL_SUCCESS ) gpu->pa = NULL;
+		if ( err[1] != CL_SUCCESS ) gpu->pb = NULL;
+		if ( err[2] != CL_SUCCESS ) gpu->cc = NULL;
+		if ( err[3] != CL_SUCCESS ) gpu->n = NULL;
+		free_pair_buffers(gpu);
+		return 1;
+	}
+
+	gpu->max_pairs = n_pairs;
+	return 0;
+}
+
+
+int amb_gpu_corr(struct amb_gpu *gpu, int n_pairs, const int *pa,
+                 const int *pb, int do_reidx, float *cc, int *n)
+{
+	size_t gsize[2];
+	size_t lsize[2];
+	cl_int err = CL_SUCCESS;
+	cl_int n_groups = gpu->n_groups;
+	cl_int cl_n_pairs = n_pairs;
+	int n_assign;
+
+	if ( n_pairs == 0 ) return 0;
+	if ( do_reidx && !gpu->have_reidx ) return 1;
+	n_assign = do_reidx ? 2 : 1;
+
+	if ( alloc_pair_buffers(gpu, n_pairs) ) return 1;
+
+	err |= clEnqueueWriteBuffer(gpu->queue, gpu->pa, CL_FALSE, 0,
+	                            n_pairs*sizeof(cl_int), pa, 0, NULL, NULL);
+	err |= clEnqueueWriteBuffer(gpu->queue, gpu->pb, CL_FALSE, 0,
+	                            n_pairs*sizeof(cl_int), pb, 0, NULL, NULL);
+
+	err |= clSetKernelArg(gpu->kern, 0, sizeof(cl_mem), &gpu->offs);
+	err |= clSetKernelArg(gpu->kern, 1, sizeof(cl_mem), &gpu->s);
+	err |= clSetKernelArg(gpu->kern, 2, sizeof(cl_mem), &gpu->i);
+	err |= clSetKernelArg(gpu->kern, 3, sizeof(cl_mem), &gpu->group);
+	err |= clSetKernelArg(gpu->kern, 4, sizeof(cl_mem), &gpu->s_reidx);
+	err |= clSetKernelArg(gpu->kern, 5, sizeof(cl_mem), &gpu->i_reidx);
+	err |= clSetKernelArg(gpu->kern, 6, sizeof(cl_mem), &gpu->group_reidx);
+	err |= clSetKernelArg(gpu->kern, 7, sizeof(cl_int), &n_groups);
+	err |= clSetKernelArg(gpu->kern, 8, sizeof(cl_int), &cl_n_pairs);
+	err |= clSetKernelArg(gpu->kern, 9, sizeof(cl_mem), &gpu->pa);
+	err |= clSetKernelArg(gpu->kern, 10, sizeof(cl_mem), &gpu->pb);
+	err |= clSetKernelArg(gpu->kern, 11, sizeof(cl_mem), &gpu->cc);
+	err |= clSetKernelArg(gpu->kern, 12, sizeof(cl_mem), &gpu->n);
+
+	gsize[0] = ((n_pairs + AMB_GPU_GROUP_SIZE - 1) / AMB_GPU_GROUP_SIZE)
+	               * AMB_GPU_GROUP_SIZE;
+	gsize[1] = n_assign;
+	lsize[0] = AMB_GPU_GROUP_SIZE;
+	lsize[1] = 1;
+	err |= clEnqueueNDRangeKernel(gpu->queue, gpu->kern, 2, NULL,
+	                              gsize, lsize, 0, NULL, NULL);
+
+	err |= clEnqueueReadBuffer(gpu->queue, gpu->cc, CL_FALSE, 0,
+	                           n_assign*n_pairs*sizeof(cl_float), cc,
+	                           0, NULL, NULL);
+	err |= clEnqueueReadBuffer(gpu->queue, gpu->n, CL_FALSE, 0,
+	                           n_assign*n_pairs*sizeof(cl_int), n,
+	                           0, NULL, NULL);
+
+	err |= clFinish(gpu->queue);
+	if ( err != CL_SUCCESS ) {
+		ERROR("OpenCL correlation calculation failed\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+#else /* defined(HAVE_OPENCL) */
+
+struct amb_gpu *amb_gpu_new(int n_crystals, const long *offs, int n_groups,
+                            const unsigned int *s, const float *i,
+                            const unsigned int *group,
+                            const unsigned int *s_reidx, const float *i_reidx,
+                            const unsigned int *group_reidx)
+{
+	ERROR("This version of CrystFEL was compiled without GPU support.\n");
+	return NULL;
+}
+
+
+void amb_gpu_free(struct amb_gpu *gpu)
+{
+}
+
+
+int amb_gpu_corr(struct amb_gpu *gpu, int n_pairs, const int *pa,
+                 const int *pb, int do_reidx, float *cc, int *n)
+{
+	return 1;
+}
+
+#endif /* defined(HAVE_OPENCL) */
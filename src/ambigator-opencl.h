@@ -0,0 +1,56 @@
+/*
+ * ambigator-opencl.h
+ *
+ * Correlation calculations for ambigator, on a GPU
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef AMBIGATOR_OPENCL_H
+#define AMBIGATOR_OPENCL_H
+
+struct amb_gpu;
+
+/* Copies the reflection lists of n_crystals crystals to the GPU.  The lists
+ * are packed one after the other, and the reflections of crystal i are at
+ * positions offs[i] to offs[i+1]-1.  The reindexed lists may be NULL if there
+ * is no ambiguity operator. */
+extern struct amb_gpu *amb_gpu_new(int n_crystals, const long *offs,
+                                   int n_groups,
+                                   const unsigned int *s, const float *i,
+                                   const unsigned int *group,
+                                   const unsigned int *s_reidx,
+                                   const float *i_reidx,
+                                   const unsigned int *group_reidx);
+
+extern void amb_gpu_free(struct amb_gpu *gpu);
+
+/* Calculates the CCs of crystal pa[p] with crystal pb[p], for n_pairs pairs,
+ * in the same way as corr() in ambigator.c.  The results go in cc[p] and
+ * n[p].  If do_reidx is set, the results with crystal pa[p] reindexed go in
+ * cc[n_pairs+p] and n[n_pairs+p]. */
+extern int amb_gpu_corr(struct amb_gpu *gpu, int n_pairs,
+                        const int *pa, const int *pb, int do_reidx,
+                        float *cc, int *n);
+
+#endif /* AMBIGATOR_OPENCL_H */
@@ -40,9 +40,13 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <assert.h>
+#include <stdint.h>
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_permutation.h>
 #include <gsl/gsl_randist.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #ifdef HAVE_HDF5
 #include <hdf5.h>
 #endif
@@ -58,6 +62,7 @@
 #include <thread-pool.h>
 
 #include "version.h"
+#include "ambigator-opencl.h"
 
 
 static void show_help(const char *s)
@@ -78,41 +83,222 @@ static void show_help(const char *s)
 "      --lowres=<n>            Low resolution cutoff in A.\n"
 "      --start-assignments=<f> Read starting assignments from file.\n"
 "      --end-assignments=<f>   Save end assignments to file.\n"
+"      --assignment-list=<f>   Save end assignments with filenames and events.\n"
 "      --fg-graph=<f>          Save f and g correlation values to file.\n"
 "      --ncorr=<n>             Use <n> correlations per crystal.  Default 1000\n"
+"      --sketch=<n>            Choose the crystals to correlate using sketches\n"
+"                               with <n> dimensions.\n"
 "  -j <n>                      Use <n> threads for CC calculation.\n"
 "      --really-random         Be non-deterministic.\n"
 "      --corr-matrix=<f>       Write the correlation matrix to file.\n"
+"      --cpu-pin               Pin worker threads to CPUs.\n"
+"      --gpu                   Calculate the CCs on a GPU.\n"
+"      --float16               Store the intensities in half precision, to\n"
+"                               save memory.\n"
+"      --save-graph=<f>        Save the CCs and assignments to file.\n"
+"      --load-graph=<f>        Load CCs and assignments from an earlier run,\n"
+"                               and only process the crystals added since.\n"
 );
 }
 
+/* One crystal's reflections, in order of serial number.  After loading, the
+ * arrays point into the arena (see struct flist_arena). */
 struct flist
 {
 	int n;
 	int n_groups;
+	long int offs;  /* Position in the arena */
+
+	unsigned int *s;
+	unsigned char *group;
+	float *i;       /* NULL if the intensities are in half precision */
+	uint16_t *ih;
+
+	/* Random projections of the intensities (see make_sketch), or NULL */
+	float *sketch;
+	float *sketch_reidx;
+};
+
 
+/* The reflections of all the crystals, one after the other.  Only the
+ * reflections in the original indexing assignment are kept.  The reindexed
+ * lists are made when they are needed, by reindex_flist(). */
+struct flist_arena
+{
+	long int n;
+	long int max;
 	unsigned int *s;
-	unsigned int *group;
+	unsigned char *group;
 	float *i;
+	uint16_t *ih;
+	int half;
+};
 
-	unsigned int *s_reidx;
-	unsigned int *group_reidx;
-	float *i_reidx;
+
+struct merge_item
+{
+	unsigned int s;
+	int pos;
+	int red;
+	double i;
+	unsigned char group;
+};
+
+
+/* Working space for one crystal's reflections */
+struct flist_buf
+{
+	int max;
+	unsigned int *s;
+	unsigned char *group;
+	float *i;
+	struct merge_item *items;
 };
 
 
-static struct flist *asymm_and_merge(RefList *in, const SymOpList *sym,
-                                     UnitCell *cell, double rmin, double rmax,
-                                     SymOpList *amb, int auto_res)
+static float half_table[65536];
+
+
+static float half_to_float(uint16_t h)
+{
+	union { float f; uint32_t u; } v;
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	int exp = (h >> 10) & 0x1f;
+	uint32_t mant = h & 0x3ff;
+
+	if ( exp == 0 ) {
+		float f = ldexpf(mant, -24);
+		return sign ? -f : f;
+	}
+
+	v.u = sign | ((uint32_t)(exp - 15 + 127) << 23) | (mant << 13);
+	return v.f;
+}
+
+
+/* Values must be less than 65504 in magnitude, which is guaranteed because
+ * the intensities are divided by the largest one for each crystal */
+static uint16_t float_to_half(float x)
+{
+	union { float f; uint32_t u; } v;
+	uint32_t sign, mant, h;
+	int exp;
+
+	v.f = x;
+	sign = (v.u >> 16) & 0x8000;
+	exp = (int)((v.u >> 23) & 0xff) - 127 + 15;
+	mant = v.u & 0x7fffff;
+
+	if ( exp <= 0 ) {
+		int shift = 14 - exp;
+		if ( shift > 24 ) return sign;
+		mant |= 0x800000;
+		h = mant >> shift;
+		if ( (mant >> (shift-1)) & 1 ) h++;
+		return sign | h;
+	}
+
+	/* Round to nearest.  A carry into the exponent is correct. */
+	h = ((uint32_t)exp << 10) | (mant >> 13);
+	if ( mant & 0x1000 ) h++;
+	return sign | h;
+}
+
+
+static void setup_half_table()
+{
+	int i;
+	for ( i=0; i<65536; i++ ) half_table[i] = half_to_float(i);
+}
+
+
+static float flist_intensity(const struct flist *f, int k)
+{
+	if ( f->i != NULL ) return f->i[k];
+	return half_table[f->ih[k]];
+}
+
+
+static int flist_buf_reserve(struct flist_buf *buf, int n)
+{
+	if ( n <= buf->max ) return 0;
+
+	free(buf->s);
+	free(buf->group);
+	free(buf->i);
+	free(buf->items);
+	buf->s = malloc(n*sizeof(unsigned int));
+	buf->group = malloc(n);
+	buf->i = malloc(n*sizeof(float));
+	buf->items = malloc(n*sizeof(struct merge_item));
+	if ( (buf->s == NULL) || (buf->group == NULL) || (buf->i == NULL)
+	  || (buf->items == NULL) )
+	{
+		buf->max = 0;
+		return 1;
+	}
+	buf->max = n;
+	return 0;
+}
+
+
+static void flist_buf_free(struct flist_buf *buf)
+{
+	free(buf->s);
+	free(buf->group);
+	free(buf->i);
+	free(buf->items);
+	buf->max = 0;
+	buf->s = NULL;
+	buf->group = NULL;
+	buf->i = NULL;
+	buf->items = NULL;
+}
+
+
+static void flist_from_buf(struct flist *f, struct flist_buf *buf, int n,
+                           int n_groups)
+{
+	f->n = n;
+	f->n_groups = n_groups;
+	f->offs = 0;
+	f->s = buf->s;
+	f->group = buf->group;
+	f->i = buf->i;
+	f->ih = NULL;
+	f->sketch = NULL;
+	f->sketch_reidx = NULL;
+}
+
+
+static int cmp_merge_item(const void *av, const void *bv)
+{
+	const struct merge_item *a = av;
+	const struct merge_item *b = bv;
+	if ( a->s != b->s ) return (a->s > b->s) - (a->s < b->s);
+	return (a->pos > b->pos) - (a->pos < b->pos);
+}
+
+
+/* Puts the reflections into the asymmetric unit, and merges the ones which
+ * end up with the same indices by sorting them.  The result is in "buf", and
+ * "f" is set up to point to it. */
+static int asymm_and_merge(RefList *in, const SymOpList *sym,
+                           UnitCell *cell, double rmin, double rmax,
+                           SymOpList *amb, int auto_res,
+                           struct flist_buf *buf, struct flist *f)
 {
 	Reflection *refl;
 	RefListIterator *iter;
-	RefList *asym;
-	struct flist *f;
-	int n;
+	struct merge_item *items;
+	int n_in = 0;
+	int n, k;
 
-	asym = reflist_new();
-	if ( asym == NULL ) return NULL;
+	if ( flist_buf_reserve(buf, num_reflections(in)) ) {
+		ERROR("Failed to allocate flist\n");
+		return 1;
+	}
+	items = buf->items;
 
 	for ( refl = first_refl(in, &iter);
 	      refl != NULL;
@@ -120,7 +306,6 @@ static struct flist *asymm_and_merge(RefList *in, const SymOpList *sym,
 	{
 		signed int h, k, l;
 		signed int ha, ka, la;
-		Reflection *cr;
 		int group = 0;
 
 		get_indices(refl, &h, &k, &l);
@@ -160,221 +345,437 @@ static struct flist *asymm_and_merge(RefList *in, const SymOpList *sym,
 
 		}
 
-		cr = find_refl(asym, ha, ka, la);
-		if ( cr == NULL ) {
-			cr = add_refl(asym, ha, ka, la);
-			assert(cr != NULL);
-			copy_data(cr, refl);
-		} else {
-			const double i = get_intensity(cr);
-			const int r = get_redundancy(cr);
-			set_intensity(cr, (r*i + get_intensity(refl))/(r+1));
-			set_redundancy(cr, r+1);
-		}
-		set_flag(cr, group);
+		items[n_in].s = SERIAL(ha, ka, la);
+		items[n_in].pos = n_in;
+		items[n_in].red = get_redundancy(refl);
+		items[n_in].i = get_intensity(refl);
+		items[n_in].group = group;
+		n_in++;
 	}
 
-	f = malloc(sizeof(struct flist));
-	if ( f == NULL ) {
-		ERROR("Failed to allocate flist\n");
-		return NULL;
+	qsort(items, n_in, sizeof(struct merge_item), cmp_merge_item);
+
+	/* Merge in the original order, as a running mean */
+	n = 0;
+	for ( k=0; k<n_in; k++ ) {
+		if ( (n > 0) && (buf->s[n-1] == items[k].s) ) {
+			double i = items[k-1].i;
+			int r = items[k-1].red;
+			items[k].i = (r*i + items[k].i)/(r+1);
+			items[k].red = r+1;
+			n--;
+		}
+		buf->s[n] = items[k].s;
+		buf->i[n] = items[k].i;
+		buf->group[n] = items[k].group;
+		n++;
 	}
 
-	if ( auto_res ) {
-		f->n_groups = 3;
-	} else {
-		f->n_groups = 1;
-	}
-
-	n = num_reflections(asym);
-	f->s = malloc(n*sizeof(unsigned int));
-	f->s_reidx = malloc(n*sizeof(unsigned int));
-	f->i = malloc(n*sizeof(float));
-	f->i_reidx = malloc(n*sizeof(float));
-	f->group = malloc(n*sizeof(unsigned int));
-	f->group_reidx = malloc(n*sizeof(unsigned int));
-	if ( (f->s == NULL) || (f->i == NULL)
-	   || (f->s_reidx == NULL) || (f->i_reidx == NULL)
-	   || (f->group_reidx == NULL) || (f->group == NULL) ) {
-		ERROR("Failed to allocate flist\n");
-		goto out;
-	}
+	flist_from_buf(f, buf, n, auto_res ? 3 : 1);
+	return 0;
+}
 
-	f->n = 0;
-	for ( refl = first_refl(asym, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
-	{
-		signed int h, k, l;
 
-		get_indices(refl, &h, &k, &l);
-		f->s[f->n] = SERIAL(h, k, l);
-		f->group[f->n] = get_flag(refl);
+/* Makes the list of reflections of "f" after applying the ambiguity operator,
+ * in order of the new serial numbers */
+static int reindex_flist(const struct flist *f, const SymOpList *sym,
+                         const SymOpList *amb, struct flist_buf *buf,
+                         struct flist *r)
+{
+	struct merge_item *items;
+	int k;
+
+	if ( flist_buf_reserve(buf, f->n) ) return 1;
+	items = buf->items;
 
-		f->i[f->n] = get_intensity(refl);
-		f->n++;
+	for ( k=0; k<f->n; k++ ) {
+
+		signed int h, kk, l;
+		signed int hr, kr, lr;
+		signed int hra, kra, lra;
+
+		h = GET_H(f->s[k]);
+		kk = GET_K(f->s[k]);
+		l = GET_L(f->s[k]);
+		get_equiv(amb, NULL, 0, h, kk, l, &hr, &kr, &lr);
+		get_asymm(sym, hr, kr, lr, &hra, &kra, &lra);
+
+		items[k].s = SERIAL(hra, kra, lra);
+		items[k].pos = k;
 	}
-	assert(f->n == n);
 
-	if ( amb != NULL ) {
+	qsort(items, f->n, sizeof(struct merge_item), cmp_merge_item);
 
-		RefList *reidx = reflist_new();
-		if ( reidx == NULL ) goto out;
+	for ( k=0; k<f->n; k++ ) {
+		int pos = items[k].pos;
+		buf->s[k] = items[k].s;
+		buf->i[k] = flist_intensity(f, pos);
+		buf->group[k] = f->group[pos];
+	}
 
-		for ( refl = first_refl(asym, &iter);
-		      refl != NULL;
-		      refl = next_refl(refl, iter) )
-		{
-			signed int h, k, l;
-			signed int hr, kr, lr;
-			signed int hra, kra, lra;
-			Reflection *cr;
+	flist_from_buf(r, buf, f->n, f->n_groups);
+	return 0;
+}
 
-			get_indices(refl, &h, &k, &l);
-			get_equiv(amb, NULL, 0, h, k, l, &hr, &kr, &lr);
-			get_asymm(sym, hr, kr, lr, &hra, &kra, &lra);
 
-			cr = add_refl(reidx, hra, kra, lra);
-			if ( cr == NULL ) {
-				ERROR("Failed to add reflection\n");
-				reflist_free(reidx);
-				goto out;
-			}
-			copy_data(cr, refl);
-		}
+/* Makes a version of "f" with the intensities as floats */
+static int decode_flist(const struct flist *f, struct flist_buf *buf,
+                        struct flist *r)
+{
+	int k;
 
-		n = 0;
-		for ( refl = first_refl(reidx, &iter);
-		      refl != NULL;
-		      refl = next_refl(refl, iter) )
-		{
-			signed int h, k, l;
-			get_indices(refl, &h, &k, &l);
-			f->s_reidx[n] = SERIAL(h, k, l);
-			f->group_reidx[n] = get_flag(refl);
-			f->i_reidx[n++] = get_intensity(refl);
-		}
-		assert(f->n == n);
+	if ( f->i != NULL ) {
+		*r = *f;
+		return 0;
+	}
 
-		reflist_free(reidx);
+	if ( flist_buf_reserve(buf, f->n) ) return 1;
+	for ( k=0; k<f->n; k++ ) {
+		buf->i[k] = half_table[f->ih[k]];
 	}
+	*r = *f;
+	r->i = buf->i;
+	r->ih = NULL;
+	return 0;
+}
 
-	reflist_free(asym);
 
-	return f;
+static void arena_init(struct flist_arena *a, int half)
+{
+	a->n = 0;
+	a->max = 0;
+	a->s = NULL;
+	a->group = NULL;
+	a->i = NULL;
+	a->ih = NULL;
+	a->half = half;
+	if ( half ) setup_half_table();
+}
 
-out:
-	free(f->s);
-	free(f->s_reidx);
-	free(f->i);
-	free(f->i_reidx);
-	free(f->group);
-	free(f->group_reidx);
-	free(f);
-	return NULL;
+
+static void arena_free(struct flist_arena *a)
+{
+	free(a->s);
+	free(a->group);
+	free(a->i);
+	free(a->ih);
 }
 
 
-static float corr_group(struct flist *a, struct flist *b, int *pn, int a_reidx,
-                        int group)
+/* Copies the reflections of "f" to the end of the arena.  In half precision,
+ * the intensities are divided by the largest one, which doesn't affect the
+ * CCs. */
+static int arena_add(struct flist_arena *a, struct flist *f)
 {
-	float s_xy = 0.0;
-	float s_x = 0.0;
-	float s_y = 0.0;
-	float s_x2 = 0.0;
-	float s_y2 = 0.0;
-	int n = 0;
-	float t1, t2;
-	int ap = 0;
-	int bp = 0;
-	int done = 0;
-	unsigned int *sa;
-	float *ia;
-	unsigned int *ga;
-
-	if ( a_reidx ) {
-		sa = a->s_reidx;
-		ia = a->i_reidx;
-		ga = a->group_reidx;
-	} else {
-		sa = a->s;
-		ia = a->i;
-		ga = a->group;
-	}
+	long int k;
 
-	if ( (a->n == 0) || (b->n == 0) ) {
-		*pn = 0;
-		return 0.0;
+	if ( a->n + f->n > a->max ) {
+
+		long int max = a->max + a->max/2 + f->n + 65536;
+		unsigned int *s_new;
+		unsigned char *group_new;
+
+		s_new = realloc(a->s, max*sizeof(unsigned int));
+		if ( s_new == NULL ) return 1;
+		a->s = s_new;
+		group_new = realloc(a->group, max);
+		if ( group_new == NULL ) return 1;
+		a->group = group_new;
+
+		if ( a->half ) {
+			uint16_t *ih_new = realloc(a->ih, max*sizeof(uint16_t));
+			if ( ih_new == NULL ) return 1;
+			a->ih = ih_new;
+		} else {
+			float *i_new = realloc(a->i, max*sizeof(float));
+			if ( i_new == NULL ) return 1;
+			a->i = i_new;
+		}
+
+		a->max = max;
 	}
 
-	while ( 1 ) {
+	memcpy(&a->s[a->n], f->s, f->n*sizeof(unsigned int));
+	memcpy(&a->group[a->n], f->group, f->n);
 
-		while ( sa[ap] > b->s[bp] ) {
-			if ( ++bp == b->n ) {
-				done = 1;
-				break;
-			}
+	if ( a->half ) {
+		float max = 0.0;
+		for ( k=0; k<f->n; k++ ) {
+			if ( fabs(f->i[k]) > max ) max = fabs(f->i[k]);
 		}
-		if ( done ) break;
+		if ( max == 0.0 ) max = 1.0;
+		for ( k=0; k<f->n; k++ ) {
+			a->ih[a->n+k] = float_to_half(f->i[k]/max);
+		}
+	} else {
+		memcpy(&a->i[a->n], f->i, f->n*sizeof(float));
+	}
 
-		while ( sa[ap] < b->s[bp] ) {
-			if ( ++ap == a->n ) {
-				done = 1;
-				break;
-			}
+	f->offs = a->n;
+	a->n += f->n;
+	return 0;
+}
+
+
+/* Points the reflection lists at their places in the arena, which won't move
+ * any more */
+static void arena_finish(struct flist_arena *a, struct flist *flists, int n)
+{
+	int j;
+
+	for ( j=0; j<n; j++ ) {
+		struct flist *f = &flists[j];
+		f->s = a->s + f->offs;
+		f->group = a->group + f->offs;
+		if ( a->half ) {
+			f->i = NULL;
+			f->ih = a->ih + f->offs;
+		} else {
+			f->i = a->i + f->offs;
+			f->ih = NULL;
 		}
-		if ( done ) break;
+	}
+}
 
-		if ( sa[ap] == b->s[bp] ) {
 
-			if ( ga[ap] == group ) {
+/* Finds the common values in two sorted lists of unique values, and puts their
+ * positions in "ma" and "mb".  With SSE2, blocks of four values from each list
+ * are compared all-against-all, and the block with the smaller last value is
+ * replaced.  Returns the number of common values. */
+static int intersect(const unsigned int *a, int na,
+                     const unsigned int *b, int nb, int *ma, int *mb)
+{
+	int ap = 0;
+	int bp = 0;
+	int n = 0;
 
-				float aint, bint;
+#ifdef __SSE2__
+	while ( (ap+4 <= na) && (bp+4 <= nb) ) {
 
-				aint = ia[ap];
-				bint = b->i[bp];
+		__m128i va = _mm_loadu_si128((const __m128i *)&a[ap]);
+		__m128i vb = _mm_loadu_si128((const __m128i *)&b[bp]);
+		unsigned int amax = a[ap+3];
+		unsigned int bmax = b[bp+3];
+		int r;
+
+		/* After r rotations, lane i of vb holds b[bp+(i+r)%4] */
+		for ( r=0; r<4; r++ ) {
 
-				s_xy += aint*bint;
-				s_x += aint;
-				s_y += bint;
-				s_x2 += aint*aint;
-				s_y2 += bint*bint;
-				n++;
+			int m, lane;
 
+			m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(va,
+			                                                     vb)));
+			for ( lane=0; m && (lane<4); lane++ ) {
+				if ( m & (1<<lane) ) {
+					ma[n] = ap + lane;
+					mb[n] = bp + ((lane+r) & 3);
+					n++;
+				}
 			}
 
+			vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0,3,2,1));
+		}
+
+		if ( amax <= bmax ) ap += 4;
+		if ( bmax <= amax ) bp += 4;
 
-			if ( ++ap == a->n ) break;
-			if ( ++bp == b->n ) break;
+	}
+#endif
 
+	while ( (ap < na) && (bp < nb) ) {
+		if ( a[ap] < b[bp] ) {
+			ap++;
+		} else if ( a[ap] > b[bp] ) {
+			bp++;
+		} else {
+			ma[n] = ap++;
+			mb[n] = bp++;
+			n++;
 		}
-
 	}
-	*pn = n;
 
-	t1 = s_x2 - s_x*s_x / n;
-	t2 = s_y2 - s_y*s_y / n;
+	return n;
+}
 
-	if ( (t1 <= 0.0) || (t2 <= 0.0) ) return 0.0;
 
-	return (s_xy - s_x*s_y/n) / sqrt(t1*t2);
-}
+/* Running sums for the CC in one resolution group */
+struct corr_sums
+{
+	float s_xy;
+	float s_x;
+	float s_y;
+	float s_x2;
+	float s_y2;
+	int n;
+};
 
 
-static float corr(struct flist *a, struct flist *b, int *pn, int a_reidx)
+/* Calculates the CC in each resolution group in one pass over the common
+ * reflections, and returns the mean over the groups.  *pn will be set to the
+ * number of common reflections in the last group.  The intensities of "a"
+ * must be floats (see decode_flist), but "b" can be in half precision. */
+static float corr(const struct flist *a, const struct flist *b, int *pn)
 {
+	struct corr_sums sums[3];
+	int *ma;
+	int *mb;
+	int n_match, max_match;
 	int i;
 	double total = 0.0;
 
+	if ( (a->n == 0) || (b->n == 0) ) {
+		*pn = 0;
+		return 0.0;
+	}
+
+	max_match = (a->n < b->n) ? a->n : b->n;
+	ma = thread_pool_scratch(2*max_match*sizeof(int));
+	if ( ma == NULL ) {
+		*pn = 0;
+		return 0.0;
+	}
+	mb = ma + max_match;
+
+	n_match = intersect(a->s, a->n, b->s, b->n, ma, mb);
+
+	assert(a->n_groups <= 3);
+	for ( i=0; i<a->n_groups; i++ ) {
+		sums[i].s_xy = 0.0;
+		sums[i].s_x = 0.0;
+		sums[i].s_y = 0.0;
+		sums[i].s_x2 = 0.0;
+		sums[i].s_y2 = 0.0;
+		sums[i].n = 0;
+	}
+
+	for ( i=0; i<n_match; i++ ) {
+
+		struct corr_sums *g = &sums[a->group[ma[i]]];
+		float aint = a->i[ma[i]];
+		float bint = flist_intensity(b, mb[i]);
+
+		g->s_xy += aint*bint;
+		g->s_x += aint;
+		g->s_y += bint;
+		g->s_x2 += aint*aint;
+		g->s_y2 += bint*bint;
+		g->n++;
+
+	}
+
 	for ( i=0; i<a->n_groups; i++ ) {
-		double v = corr_group(a, b, pn, a_reidx, i);
+
+		struct corr_sums *g = &sums[i];
+		int n = g->n;
+		float t1, t2;
+		double v;
+
 		/* NaN means no reflections in this range for this pair */
+		t1 = g->s_x2 - g->s_x*g->s_x / n;
+		t2 = g->s_y2 - g->s_y*g->s_y / n;
+		if ( (t1 <= 0.0) || (t2 <= 0.0) ) continue;
+
+		v = (g->s_xy - g->s_x*g->s_y/n) / sqrt(t1*t2);
 		if ( !isnan(v) ) total += v;
 	}
+
+	*pn = sums[a->n_groups-1].n;
 	return total/a->n_groups;
 }
 
 
+/* Number of candidates to rank by sketch similarity, for each correlation */
+#define SKETCH_POOL (8)
+
+
+/* A pseudo-random +1 or -1 for each reflection in each dimension, the same
+ * for every crystal */
+static float sketch_sign(unsigned int serial, int k)
+{
+	uint64_t x = ((uint64_t)serial << 8) ^ (uint64_t)k;
+
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+
+	return (x & 1) ? 1.0 : -1.0;
+}
+
+
+static float *sketch_list(const unsigned int *s, const float *in, int n,
+                          int dim)
+{
+	float *sk;
+	double mean = 0.0;
+	double var = 0.0;
+	double norm = 0.0;
+	int j, k;
+
+	sk = calloc(dim, sizeof(float));
+	if ( sk == NULL ) return NULL;
+	if ( n < 2 ) return sk;
+
+	for ( j=0; j<n; j++ ) mean += in[j];
+	mean /= n;
+	for ( j=0; j<n; j++ ) var += (in[j]-mean)*(in[j]-mean);
+	if ( var <= 0.0 ) return sk;
+
+	for ( j=0; j<n; j++ ) {
+		float x = (in[j]-mean)/sqrt(var);
+		for ( k=0; k<dim; k++ ) {
+			sk[k] += sketch_sign(s[j], k)*x;
+		}
+	}
+
+	for ( k=0; k<dim; k++ ) norm += sk[k]*sk[k];
+	if ( norm > 0.0 ) {
+		for ( k=0; k<dim; k++ ) sk[k] /= sqrt(norm);
+	}
+
+	return sk;
+}
+
+
+/* Projects the standardised intensities onto "dim" random directions in the
+ * space of all reflections.  The dot product of two sketches is then roughly
+ * the CC between the crystals, weighted by the number of common reflections,
+ * so it can be used to find the most informative pairs without merging the
+ * reflection lists. */
+static int make_sketch(struct flist *f, int dim, const SymOpList *sym,
+                       const SymOpList *amb, struct flist_buf *buf)
+{
+	f->sketch = sketch_list(f->s, f->i, f->n, dim);
+	if ( f->sketch == NULL ) return 1;
+	if ( amb != NULL ) {
+		struct flist r;
+		if ( reindex_flist(f, sym, amb, buf, &r) ) return 1;
+		f->sketch_reidx = sketch_list(r.s, r.i, r.n, dim);
+		if ( f->sketch_reidx == NULL ) return 1;
+	}
+	return 0;
+}
+
+
+static float sketch_dot(const float *a, const float *b, int dim)
+{
+	float t = 0.0;
+	int k;
+	for ( k=0; k<dim; k++ ) t += a[k]*b[k];
+	return t;
+}
+
+
+/* Where a crystal came from, for --assignment-list */
+struct crystal_id
+{
+	char *filename;
+	char *ev;
+	int n;
+};
+
+
 struct cc_list
 {
 	signed int *ind;
@@ -396,9 +797,13 @@ struct ambigator_queue_args
 	struct cc_list *ccs;
 	struct flist **crystals;
 	int n_crystals;
+	int first;
 	int ncorr;
+	int sketch_dim;
+	const SymOpList *sym;
 	SymOpList *amb;
 	gsl_rng **rngs;
+	struct flist_buf *bufs;
 };
 
 
@@ -413,8 +818,11 @@ struct cc_job
 	struct flist **crystals;
 	int n_crystals;
 	int ncorr;
+	int sketch_dim;
+	const SymOpList *sym;
 	SymOpList *amb;
 	gsl_rng **rngs;
+	struct flist_buf *bufs;  /* Two for each thread */
 };
 
 
@@ -429,13 +837,16 @@ static void *get_task(void *vp)
 	if ( job == NULL ) return NULL;
 
 	job->ccs = qargs->ccs;
-	job->i = qargs->n_started++;
+	job->i = qargs->first + qargs->n_started++;
 
 	job->crystals = qargs->crystals;
 	job->n_crystals = qargs->n_crystals;
 	job->ncorr = qargs->ncorr;
+	job->sketch_dim = qargs->sketch_dim;
+	job->sym = qargs->sym;
 	job->amb = qargs->amb;
 	job->rngs = qargs->rngs;
+	job->bufs = qargs->bufs;
 
 	return job;
 }
@@ -460,89 +871,227 @@ static void final(void *qp, void *wp)
 }
 
 
-static void work(void *wp, int cookie)
+struct sketch_cand
+{
+	int j;
+	float score;
+};
+
+
+static int cmp_cand_j(const void *av, const void *bv)
+{
+	const struct sketch_cand *a = av;
+	const struct sketch_cand *b = bv;
+	return (a->j > b->j) - (a->j < b->j);
+}
+
+
+static int cmp_cand_score(const void *av, const void *bv)
+{
+	const struct sketch_cand *a = av;
+	const struct sketch_cand *b = bv;
+	return (a->score < b->score) - (a->score > b->score);
+}
+
+
+/* Gets the crystal ready to correlate with the others, with its intensities
+ * as floats, and makes the reindexed version if there's an ambiguity */
+static int prepare_crystal(struct cc_job *job, int cookie, struct flist *a,
+                           struct flist *a_reidx)
+{
+	struct flist_buf *bufs = &job->bufs[2*cookie];
+
+	if ( decode_flist(job->crystals[job->i], &bufs[0], a) ) return 1;
+	if ( job->amb == NULL ) return 0;
+	return reindex_flist(a, job->sym, job->amb, &bufs[1], a_reidx);
+}
+
+
+/* Chooses up to SKETCH_POOL*(ncorr-1) random candidates, ranks them by how
+ * differently they correlate with the crystal in each indexing assignment,
+ * according to the sketches, and calculates the real CCs for the best ones */
+static void work_sketch(struct cc_job *job, int cookie)
 {
-	struct cc_job *job = wp;
 	int i = job->i;
-	int k, l;
 	struct cc_list *ccs = job->ccs;
 	struct flist **crystals = job->crystals;
+	struct flist *a = crystals[i];
+	struct flist fa, fa_reidx;
 	int n_crystals = job->n_crystals;
 	int ncorr = job->ncorr;
-	SymOpList *amb = job->amb;
-	int mean_nac = 0;
-	int nmean_nac = 0;
-	gsl_permutation *p;
+	int dim = job->sketch_dim;
+	int have_amb = (job->amb != NULL);
+	struct sketch_cand *cand;
+	int n_cand, max_cand;
+	int l, k, kr;
 
 	job->fail = 1;
 
-	p = gsl_permutation_alloc(n_crystals);
-	if ( p == NULL ) return;
-	gsl_permutation_init(p);
-	gsl_ran_shuffle(job->rngs[cookie], p->data, n_crystals, sizeof(size_t));
+	if ( prepare_crystal(job, cookie, &fa, &fa_reidx) ) return;
 
 	ccs[i].ind = malloc(ncorr*sizeof(int));
 	ccs[i].cc = malloc(ncorr*sizeof(float));
 	ccs[i].ind_reidx = calloc(ncorr, sizeof(int));
 	ccs[i].cc_reidx = calloc(ncorr, sizeof(float));
+	max_cand = SKETCH_POOL*(ncorr-1);
+	if ( max_cand > n_crystals-1 ) max_cand = n_crystals-1;
+	cand = malloc((max_cand+1)*sizeof(struct sketch_cand));
 	if ( (ccs[i].ind==NULL) || (ccs[i].cc==NULL) ||
-	     (ccs[i].ind_reidx==NULL) ||  (ccs[i].cc_reidx==NULL) ) {
+	     (ccs[i].ind_reidx==NULL) ||  (ccs[i].cc_reidx==NULL)
+	  || (cand == NULL) ) {
+		free(cand);
 		return;
 	}
 
+	n_cand = 0;
+	if ( max_cand == n_crystals-1 ) {
+		for ( l=0; l<n_crystals; l++ ) {
+			if ( l != i ) cand[n_cand++].j = l;
+		}
+	} else {
+		int n_unique = 0;
+		for ( l=0; l<max_cand; l++ ) {
+			int j = gsl_rng_uniform_int(job->rngs[cookie],
+			                            n_crystals);
+			if ( j != i ) cand[n_cand++].j = j;
+		}
+		qsort(cand, n_cand, sizeof(struct sketch_cand), cmp_cand_j);
+		for ( l=0; l<n_cand; l++ ) {
+			if ( (l > 0) && (cand[l].j == cand[l-1].j) ) continue;
+			cand[n_unique++] = cand[l];
+		}
+		n_cand = n_unique;
+	}
+
+	for ( l=0; l<n_cand; l++ ) {
+		const float *b = crystals[cand[l].j]->sketch;
+		float sc = sketch_dot(a->sketch, b, dim);
+		if ( have_amb ) {
+			sc -= sketch_dot(a->sketch_reidx, b, dim);
+		}
+		cand[l].score = fabs(sc);
+	}
+	qsort(cand, n_cand, sizeof(struct sketch_cand), cmp_cand_score);
+
 	k = 0;
-	for ( l=0; l<n_crystals; l++ ) {
+	kr = 0;
+	for ( l=0; l<n_cand; l++ ) {
 
 		int n;
-		int j;
+		int j = cand[l].j;
 		float cc;
 
-		j = gsl_permutation_get(p, l);
-		if ( i == j ) continue;
+		if ( (k == ncorr-1) || (have_amb && (kr == ncorr-1)) ) break;
 
-		cc = corr(crystals[i], crystals[j], &n, 0);
+		cc = corr(&fa, crystals[j], &n);
+		if ( n >= 4 ) {
+			ccs[i].ind[k] = j+1;
+			ccs[i].cc[k] = cc;
+			k++;
+		}
 
-		if ( n < 4 ) continue;
+		if ( have_amb ) {
+			cc = corr(&fa_reidx, crystals[j], &n);
+			if ( n >= 4 ) {
+				ccs[i].ind_reidx[kr] = j+1;
+				ccs[i].cc_reidx[kr] = cc;
+				kr++;
+			}
+		}
+
+	}
+	ccs[i].ind[k] = 0;
+	ccs[i].ind_reidx[kr] = 0;
+
+	job->mean_nac = k + kr;
+	job->nmean_nac = have_amb ? 2 : 1;
+	job->fail = 0;
+	free(cand);
+}
 
-		ccs[i].ind[k] = j+1;
-		ccs[i].cc[k] = cc;
-		k++;
 
-		if ( k == ncorr-1 ) break;
+static void work(void *wp, int cookie)
+{
+	struct cc_job *job = wp;
+	int i = job->i;
+	int k, kr, l;
+	struct cc_list *ccs = job->ccs;
+	struct flist **crystals = job->crystals;
+	int n_crystals = job->n_crystals;
+	int ncorr = job->ncorr;
+	SymOpList *amb = job->amb;
+	int mean_nac = 0;
+	int nmean_nac = 0;
+	gsl_permutation *p;
+	struct flist a, a_reidx;
 
+	if ( job->sketch_dim > 0 ) {
+		work_sketch(job, cookie);
+		return;
 	}
-	ccs[i].ind[k] = 0;
-	mean_nac += k;
-	nmean_nac++;
 
-	if ( amb != NULL ) {
+	job->fail = 1;
 
-		k = 0;
-		for ( l=0; l<n_crystals; l++ ) {
+	if ( prepare_crystal(job, cookie, &a, &a_reidx) ) return;
 
-			int n;
-			int j;
-			float cc;
+	p = gsl_permutation_alloc(n_crystals);
+	if ( p == NULL ) return;
+	gsl_permutation_init(p);
+	gsl_ran_shuffle(job->rngs[cookie], p->data, n_crystals, sizeof(size_t));
 
-			j = gsl_permutation_get(p, l);
-			if ( i == j ) continue;
+	ccs[i].ind = malloc(ncorr*sizeof(int));
+	ccs[i].cc = malloc(ncorr*sizeof(float));
+	ccs[i].ind_reidx = calloc(ncorr, sizeof(int));
+	ccs[i].cc_reidx = calloc(ncorr, sizeof(float));
+	if ( (ccs[i].ind==NULL) || (ccs[i].cc==NULL) ||
+	     (ccs[i].ind_reidx==NULL) ||  (ccs[i].cc_reidx==NULL) ) {
+		return;
+	}
 
-			cc = corr(crystals[i], crystals[j], &n, 1);
+	/* Both lists are filled in the same pass over the other crystals, while
+	 * each one's reflections are still in the cache */
+	k = 0;
+	kr = 0;
+	for ( l=0; l<n_crystals; l++ ) {
 
-			if ( n < 4 ) continue;
+		int n;
+		int j;
+		float cc;
 
-			ccs[i].ind_reidx[k] = j+1;
-			ccs[i].cc_reidx[k] = cc;
-			k++;
+		if ( (k == ncorr-1) && ((amb == NULL) || (kr == ncorr-1)) ) {
+			break;
+		}
 
-			if ( k == ncorr-1 ) break;
+		j = gsl_permutation_get(p, l);
+		if ( i == j ) continue;
 
+		if ( k < ncorr-1 ) {
+			cc = corr(&a, crystals[j], &n);
+			if ( n >= 4 ) {
+				ccs[i].ind[k] = j+1;
+				ccs[i].cc[k] = cc;
+				k++;
+			}
+		}
+
+		if ( (amb != NULL) && (kr < ncorr-1) ) {
+			cc = corr(&a_reidx, crystals[j], &n);
+			if ( n >= 4 ) {
+				ccs[i].ind_reidx[kr] = j+1;
+				ccs[i].cc_reidx[kr] = cc;
+				kr++;
+			}
 		}
-		ccs[i].ind_reidx[k] = 0;
-		mean_nac += k;
-		nmean_nac++;
 
 	}
+	ccs[i].ind[k] = 0;
+	mean_nac += k;
+	nmean_nac++;
+	if ( amb != NULL ) {
+		ccs[i].ind_reidx[kr] = 0;
+		mean_nac += kr;
+		nmean_nac++;
+	}
 
 	gsl_permutation_free(p);
 
@@ -570,9 +1119,13 @@ static gsl_rng **setup_random(gsl_rng *rng, int n)
 }
 
 
+/* Calculates the CC lists for crystals first to n_crystals-1.  The lists for
+ * the crystals before "first" are left empty, for the caller to fill in. */
 static struct cc_list *calc_ccs(struct flist **crystals, int n_crystals,
-                                int ncorr, SymOpList *amb, gsl_rng *rng,
-                                float *pmean_nac, int nthreads)
+                                int first, int ncorr, const SymOpList *sym,
+                                SymOpList *amb, gsl_rng *rng,
+                                float *pmean_nac, int nthreads,
+                                int sketch_dim)
 {
 	struct cc_list *ccs;
 	struct ambigator_queue_args qargs;
@@ -587,36 +1140,390 @@ static struct cc_list *calc_ccs(struct flist **crystals, int n_crystals,
 		return NULL;
 	}
 
-	ccs = malloc(n_crystals*sizeof(struct cc_list));
+	qargs.bufs = calloc(2*nthreads, sizeof(struct flist_buf));
+	if ( qargs.bufs == NULL ) return NULL;
+
+	ccs = calloc(n_crystals, sizeof(struct cc_list));
 	if ( ccs == NULL ) return NULL;
 
 	qargs.n_started = 0;
 	qargs.n_finished = 0;
-	qargs.n_to_do = n_crystals;
+	qargs.n_to_do = n_crystals - first;
 	qargs.ccs = ccs;
 	qargs.mean_nac = 0;
 	qargs.nmean_nac = 0;
 
 	qargs.crystals = crystals;
 	qargs.n_crystals = n_crystals;
+	qargs.first = first;
 	qargs.ncorr = ncorr;
+	qargs.sketch_dim = sketch_dim;
+	qargs.sym = sym;
 	qargs.amb = amb;
 
-	run_threads(nthreads, work, get_task, final, &qargs, n_crystals,
+	run_threads(nthreads, work, get_task, final, &qargs, qargs.n_to_do,
 	            0, 0, 0);
 
 	for ( i=0; i<nthreads; i++ ) {
 		gsl_rng_free(qargs.rngs[i]);
 	}
+	for ( i=0; i<2*nthreads; i++ ) {
+		flist_buf_free(&qargs.bufs[i]);
+	}
+	free(qargs.bufs);
+
+	if ( qargs.nmean_nac > 0 ) {
+		*pmean_nac = (float)qargs.mean_nac/qargs.nmean_nac;
+	} else {
+		*pmean_nac = 0.0;
+	}
+
+	return ccs;
+}
+
+
+/* Maximum number of crystal pairs to correlate in one batch on the GPU */
+#define GPU_MAX_PAIRS (1<<20)
+
+
+/* Packs the reflection lists of all the crystals one after the other, and
+ * copies them to the GPU */
+static struct amb_gpu *upload_crystals(struct flist **crystals, int n_crystals,
+                                       const SymOpList *sym,
+                                       const SymOpList *amb)
+{
+	struct amb_gpu *gpu = NULL;
+	long *offs;
+	unsigned int *s = NULL;
+	unsigned int *group = NULL;
+	float *in = NULL;
+	unsigned int *s_reidx = NULL;
+	unsigned int *group_reidx = NULL;
+	float *i_reidx = NULL;
+	int have_amb = (amb != NULL);
+	struct flist_buf bufs[2] = {{0}, {0}};
+	int i;
+
+	offs = malloc((n_crystals+1)*sizeof(long));
+	if ( offs == NULL ) return NULL;
+	offs[0] = 0;
+	for ( i=0; i<n_crystals; i++ ) {
+		offs[i+1] = offs[i] + crystals[i]->n;
+	}
+
+	s = malloc(offs[n_crystals]*sizeof(unsigned int));
+	group = malloc(offs[n_crystals]*sizeof(unsigned int));
+	in = malloc(offs[n_crystals]*sizeof(float));
+	if ( (s == NULL) || (group == NULL) || (in == NULL) ) goto out;
+	if ( have_amb ) {
+		s_reidx = malloc(offs[n_crystals]*sizeof(unsigned int));
+		group_reidx = malloc(offs[n_crystals]*sizeof(unsigned int));
+		i_reidx = malloc(offs[n_crystals]*sizeof(float));
+		if ( (s_reidx == NULL) || (group_reidx == NULL)
+		  || (i_reidx == NULL) ) goto out;
+	}
+
+	for ( i=0; i<n_crystals; i++ ) {
+
+		struct flist f, r;
+		long int k;
+
+		if ( decode_flist(crystals[i], &bufs[0], &f) ) goto out;
+		memcpy(&s[offs[i]], f.s, f.n*sizeof(unsigned int));
+		memcpy(&in[offs[i]], f.i, f.n*sizeof(float));
+		for ( k=0; k<f.n; k++ ) group[offs[i]+k] = f.group[k];
+		if ( !have_amb ) continue;
+
+		if ( reindex_flist(&f, sym, amb, &bufs[1], &r) ) goto out;
+		memcpy(&s_reidx[offs[i]], r.s, r.n*sizeof(unsigned int));
+		memcpy(&i_reidx[offs[i]], r.i, r.n*sizeof(float));
+		for ( k=0; k<r.n; k++ ) group_reidx[offs[i]+k] = r.group[k];
+
+	}
 
-	*pmean_nac = (float)qargs.mean_nac/qargs.nmean_nac;
+	gpu = amb_gpu_new(n_crystals, offs,
+	                  (n_crystals > 0) ? crystals[0]->n_groups : 1,
+	                  s, in, group, s_reidx, i_reidx, group_reidx);
 
+out:
+	free(offs);
+	free(s);
+	free(group);
+	free(in);
+	free(s_reidx);
+	free(group_reidx);
+	free(i_reidx);
+	flist_buf_free(&bufs[0]);
+	flist_buf_free(&bufs[1]);
+	return gpu;
+}
+
+
+/* Maximum number of entries in the orders of the other crystals for the
+ * block of crystals being worked on by calc_ccs_gpu() */
+#define GPU_MAX_ORDER (1<<24)
+
+
+/* Where each crystal has got to in its walk through the other crystals */
+struct gpu_walk
+{
+	int *order;
+	int pos;
+	int k;
+	int kr;
+};
+
+
+static int walk_done(struct gpu_walk *w, int ncorr, int have_amb,
+                     int n_crystals)
+{
+	if ( w->pos == n_crystals ) return 1;
+	if ( w->k < ncorr-1 ) return 0;
+	if ( have_amb && (w->kr < ncorr-1) ) return 0;
+	return 1;
+}
+
+
+/* Calculates the CC lists for crystals i0 to i1-1 on the GPU.  For each
+ * crystal, only as many pairs are sent to the GPU as would be needed if every
+ * CC were usable, and more are sent in the next batch if not. */
+static int gpu_walk_block(struct amb_gpu *gpu, struct cc_list *ccs,
+                          struct gpu_walk *walks, int i0, int i1,
+                          int n_crystals, int ncorr, int have_amb,
+                          int *pa, int *pb, float *cc, int *n,
+                          int n_before, int n_total)
+{
+	int n_done = 0;
+	int i;
+
+	while ( n_done < i1-i0 ) {
+
+		int n_pairs = 0;
+		int p;
+
+		for ( i=i0; i<i1; i++ ) {
+
+			struct gpu_walk *w = &walks[i-i0];
+			int want;
+
+			if ( walk_done(w, ncorr, have_amb, n_crystals) ) continue;
+
+			want = ncorr-1 - w->k;
+			if ( have_amb && (ncorr-1 - w->kr > want) ) {
+				want = ncorr-1 - w->kr;
+			}
+
+			while ( (want > 0) && (w->pos < n_crystals)
+			     && (n_pairs < GPU_MAX_PAIRS) )
+			{
+				int j = w->order[w->pos++];
+				if ( j == i ) continue;
+				pa[n_pairs] = i;
+				pb[n_pairs] = j;
+				n_pairs++;
+				want--;
+			}
+
+			if ( n_pairs == GPU_MAX_PAIRS ) break;
+		}
+
+		if ( amb_gpu_corr(gpu, n_pairs, pa, pb, have_amb, cc, n) ) {
+			return 1;
+		}
+
+		/* The pairs for each crystal are in the order they were
+		 * visited, so the lists are filled in the same way as by
+		 * work() */
+		for ( p=0; p<n_pairs; p++ ) {
+
+			struct gpu_walk *w = &walks[pa[p]-i0];
+			struct cc_list *c = &ccs[pa[p]];
+
+			if ( (w->k < ncorr-1) && (n[p] >= 4) ) {
+				c->ind[w->k] = pb[p]+1;
+				c->cc[w->k] = cc[p];
+				w->k++;
+			}
+
+			if ( have_amb && (w->kr < ncorr-1)
+			  && (n[n_pairs+p] >= 4) )
+			{
+				c->ind_reidx[w->kr] = pb[p]+1;
+				c->cc_reidx[w->kr] = cc[n_pairs+p];
+				w->kr++;
+			}
+
+		}
+
+		n_done = 0;
+		for ( i=i0; i<i1; i++ ) {
+			n_done += walk_done(&walks[i-i0], ncorr, have_amb,
+			                    n_crystals);
+		}
+		progress_bar(n_before+n_done, n_total, "Calculating CCs");
+
+	}
+
+	return 0;
+}
+
+
+static void free_ccs(struct cc_list *ccs, int n_crystals)
+{
+	int i;
+
+	if ( ccs == NULL ) return;
+	for ( i=0; i<n_crystals; i++ ) {
+		free(ccs[i].ind);
+		free(ccs[i].cc);
+		free(ccs[i].ind_reidx);
+		free(ccs[i].cc_reidx);
+	}
+	free(ccs);
+}
+
+
+/* Same as calc_ccs(), but with the CCs calculated on the GPU.  The other
+ * crystals are visited in the same random orders as calc_ccs() uses with one
+ * thread, so the same crystals are correlated.  The orders are made for a block
+ * of crystals at a time, to limit the memory needed.  "rng" is only used up if
+ * the calculation succeeds, so that falling back to calc_ccs() gives the same
+ * result as not using the GPU at all. */
+static struct cc_list *calc_ccs_gpu(struct flist **crystals, int n_crystals,
+                                    int first, int ncorr,
+                                    const SymOpList *sym, SymOpList *amb,
+                                    gsl_rng *rng, float *pmean_nac,
+                                    int nthreads)
+{
+	struct amb_gpu *gpu = NULL;
+	struct cc_list *ccs = NULL;
+	struct gpu_walk *walks = NULL;
+	int *order = NULL;
+	int *pa = NULL;
+	int *pb = NULL;
+	float *cc = NULL;
+	int *n = NULL;
+	gsl_rng *rng_copy = NULL;
+	gsl_rng **rngs = NULL;
+	gsl_permutation *perm = NULL;
+	int have_amb = (amb != NULL);
+	long long int mean_nac = 0;
+	int block;
+	int i, i0;
+	int ok = 0;
+
+	assert(n_crystals >= ncorr);
+	ncorr++;  /* Extra value at end for sentinel */
+
+	block = GPU_MAX_ORDER / n_crystals;
+	if ( block < 1 ) block = 1;
+	if ( block > n_crystals-first ) block = n_crystals-first;
+
+	gpu = upload_crystals(crystals, n_crystals, sym, amb);
+	if ( gpu == NULL ) goto out;
+
+	/* The random numbers are set up in the same way as by calc_ccs() */
+	rng_copy = gsl_rng_clone(rng);
+	if ( rng_copy == NULL ) goto out;
+	rngs = setup_random(rng_copy, nthreads);
+	if ( rngs == NULL ) goto out;
+
+	ccs = calloc(n_crystals, sizeof(struct cc_list));
+	walks = malloc(block*sizeof(struct gpu_walk));
+	order = malloc((long)block*n_crystals*sizeof(int));
+	perm = gsl_permutation_alloc(n_crystals);
+	pa = malloc(GPU_MAX_PAIRS*sizeof(int));
+	pb = malloc(GPU_MAX_PAIRS*sizeof(int));
+	cc = malloc(2*GPU_MAX_PAIRS*sizeof(float));
+	n = malloc(2*GPU_MAX_PAIRS*sizeof(int));
+	if ( (ccs == NULL) || (walks == NULL) || (order == NULL)
+	  || (perm == NULL) || (pa == NULL) || (pb == NULL)
+	  || (cc == NULL) || (n == NULL) ) goto out;
+
+	for ( i0=first; i0<n_crystals; i0+=block ) {
+
+		int i1 = i0 + block;
+		if ( i1 > n_crystals ) i1 = n_crystals;
+
+		for ( i=i0; i<i1; i++ ) {
+
+			struct gpu_walk *w = &walks[i-i0];
+			int l;
+
+			ccs[i].ind = malloc(ncorr*sizeof(int));
+			ccs[i].cc = malloc(ncorr*sizeof(float));
+			ccs[i].ind_reidx = calloc(ncorr, sizeof(int));
+			ccs[i].cc_reidx = calloc(ncorr, sizeof(float));
+			if ( (ccs[i].ind==NULL) || (ccs[i].cc==NULL) ||
+			     (ccs[i].ind_reidx==NULL) ||  (ccs[i].cc_reidx==NULL) ) {
+				goto out;
+			}
+
+			/* Same as in work() */
+			gsl_permutation_init(perm);
+			gsl_ran_shuffle(rngs[0], perm->data, n_crystals,
+			                sizeof(size_t));
+
+			w->order = order + (long)(i-i0)*n_crystals;
+			for ( l=0; l<n_crystals; l++ ) {
+				w->order[l] = gsl_permutation_get(perm, l);
+			}
+			w->pos = 0;
+			w->k = 0;
+			w->kr = 0;
+		}
+
+		if ( gpu_walk_block(gpu, ccs, walks, i0, i1, n_crystals,
+		                    ncorr, have_amb, pa, pb, cc, n,
+		                    i0-first, n_crystals-first) ) goto out;
+
+		for ( i=i0; i<i1; i++ ) {
+			ccs[i].ind[walks[i-i0].k] = 0;
+			mean_nac += walks[i-i0].k;
+			if ( have_amb ) {
+				ccs[i].ind_reidx[walks[i-i0].kr] = 0;
+				mean_nac += walks[i-i0].kr;
+			}
+		}
+	}
+
+	if ( n_crystals > first ) {
+		*pmean_nac = (float)mean_nac/(n_crystals-first);
+		if ( have_amb ) *pmean_nac /= 2;
+	} else {
+		*pmean_nac = 0.0;
+	}
+
+	/* Leave the random number generator as calc_ccs() would have done */
+	gsl_rng_memcpy(rng, rng_copy);
+	ok = 1;
+
+out:
+	if ( !ok ) {
+		ERROR("Failed to calculate CCs on GPU\n");
+		free_ccs(ccs, n_crystals);
+		ccs = NULL;
+	}
+	amb_gpu_free(gpu);
+	if ( rngs != NULL ) {
+		for ( i=0; i<nthreads; i++ ) gsl_rng_free(rngs[i]);
+		free(rngs);
+	}
+	if ( rng_copy != NULL ) gsl_rng_free(rng_copy);
+	if ( perm != NULL ) gsl_permutation_free(perm);
+	free(walks);
+	free(order);
+	free(pa);
+	free(pb);
+	free(cc);
+	free(n);
 	return ccs;
 }
 
 
-static void detwin(struct cc_list *ccs, int n_crystals, int *assignments,
-                   FILE *fh)
+/* Only the assignments of crystals first to n_crystals-1 will be changed */
+static void detwin(struct cc_list *ccs, int n_crystals, int first,
+                   int *assignments, FILE *fh)
 {
 	int i;
 	int nch = 0;
@@ -625,7 +1532,7 @@ static void detwin(struct cc_list *ccs, int n_crystals, int *assignments,
 	int nmf = 0;
 	int ndud = 0;
 
-	for ( i=0; i<n_crystals; i++ ) {
+	for ( i=first; i<n_crystals; i++ ) {
 
 		int k;
 		float f = 0.0;
@@ -735,47 +1642,272 @@ static void reindex_reflections(FILE *fh, FILE *ofh, int assignment,
 }
 
 
-/* This is nasty, but means the output includes absolutely everything in the
- * input, even stuff ignored by read_chunk() */
-static void write_reindexed_stream(const char *infile, const char *outfile,
-                                   int *assignments, SymOpList *amb,
-                                   int argc, char *argv[])
+/* Copies the text of one chunk from fh to ofh, changing the indexing
+ * assignments.  i is the number of crystals before this chunk, and the new
+ * number is returned. */
+static int reindex_chunk_text(FILE *fh, FILE *ofh, const int *assignments,
+                              SymOpList *amb, int i)
 {
-	FILE *fh;
-	FILE *ofh;
-	int i;
 	struct rvec as, bs, cs;
 	int have_as = 0;
 	int have_bs = 0;
 	int have_cs = 0;
+
+	do {
+
+		char *rval;
+		char line[1024];
+		int d = 0;
+		float u, v, w;
+
+		rval = fgets(line, 1023, fh);
+		if ( rval == NULL ) break;
+
+		if ( strncmp(line, "Cell parameters ", 16) == 0 ) {
+			d = 1;
+		}
+
+		if ( sscanf(line, "astar = %f %f %f", &u, &v, &w) == 3 ) {
+			as.u = u*1e9;  as.v = v*1e9;  as.w = w*1e9;
+			have_as = 1;
+			d = 1;
+		}
+
+		if ( sscanf(line, "bstar = %f %f %f", &u, &v, &w) == 3 ) {
+			bs.u = u*1e9;  bs.v = v*1e9;  bs.w = w*1e9;
+			have_bs = 1;
+			d = 1;
+		}
+
+		if ( sscanf(line, "cstar = %f %f %f", &u, &v, &w) == 3 ) {
+			cs.u = u*1e9;  cs.v = v*1e9;  cs.w = w*1e9;
+			have_cs = 1;
+			d = 1;
+		}
+
+		if ( have_as && have_bs && have_cs ) {
+
+			UnitCell *cell;
+			double asx, asy, asz;
+			double bsx, bsy, bsz;
+			double csx, csy, csz;
+			double a, b, c, al, be, ga;
+
+			cell = cell_new_from_reciprocal_axes(as, bs, cs);
+			assert(cell != NULL);
+
+			if ( assignments[i] ) {
+
+				signed int h, k, l;
+				struct rvec na, nb, nc;
+
+				get_equiv(amb, NULL, 0, 1, 0, 0, &h, &k, &l);
+				na.u = as.u*h + bs.u*k + cs.u*l;
+				na.v = as.v*h + bs.v*k + cs.v*l;
+				na.w = as.w*h + bs.w*k + cs.w*l;
+
+				get_equiv(amb, NULL, 0, 0, 1, 0, &h, &k, &l);
+				nb.u = as.u*h + bs.u*k + cs.u*l;
+				nb.v = as.v*h + bs.v*k + cs.v*l;
+				nb.w = as.w*h + bs.w*k + cs.w*l;
+
+				get_equiv(amb, NULL, 0, 0, 0, 1, &h, &k, &l);
+				nc.u = as.u*h + bs.u*k + cs.u*l;
+				nc.v = as.v*h + bs.v*k + cs.v*l;
+				nc.w = as.w*h + bs.w*k + cs.w*l;
+
+				cell_set_reciprocal(cell, na.u, na.v, na.w,
+				                          nb.u, nb.v, nb.w,
+				                          nc.u, nc.v, nc.w);
+
+			}
+
+			/* The cell parameters might change, so update them.
+			 * Unique axis, centering and lattice type can't change,
+			 * though. */
+			cell_get_parameters(cell, &a, &b, &c, &al, &be, &ga);
+			fprintf(ofh, "Cell parameters %7.5f %7.5f %7.5f nm,"
+			        " %7.5f %7.5f %7.5f deg\n",
+			        a*1.0e9, b*1.0e9, c*1.0e9,
+			        rad2deg(al), rad2deg(be), rad2deg(ga));
+
+			cell_get_reciprocal(cell, &asx, &asy, &asz,
+			                   &bsx, &bsy, &bsz,
+			                   &csx, &csy, &csz);
+			fprintf(ofh, "astar = %+9.7f %+9.7f %+9.7f nm^-1\n",
+			        asx/1e9, asy/1e9, asz/1e9);
+			fprintf(ofh, "bstar = %+9.7f %+9.7f %+9.7f nm^-1\n",
+			        bsx/1e9, bsy/1e9, bsz/1e9);
+			fprintf(ofh, "cstar = %+9.7f %+9.7f %+9.7f nm^-1\n",
+			        csx/1e9, csy/1e9, csz/1e9);
+
+			cell_free(cell);
+			have_as = 0;  have_bs = 0;  have_cs = 0;
+
+		}
+
+		/* Not a bug: STREAM_REFLECTION_START_MARKER gets passed through */
+		if ( !d ) fputs(line, ofh);
+
+		if ( strcmp(line, STREAM_REFLECTION_START_MARKER"\n") == 0 ) {
+			reindex_reflections(fh, ofh, assignments[i++], amb);
+		}
+
+	} while ( 1 );
+
+	return i;
+}
+
+
+/* Number of chunks to read before re-indexing them in parallel */
+#define REINDEX_BATCH (1024)
+
+
+struct reindex_chunk
+{
+	char *text;
+	size_t len;
+	int first;       /* Number of the first crystal in this chunk */
+	int n_crystals;
+	int reindex;     /* Non-zero if any of the crystals need re-indexing */
+
+	char *out;
+	size_t out_len;
+
+	const int *assignments;
+	SymOpList *amb;
+};
+
+
+struct reindex_queue_args
+{
+	struct reindex_chunk *chunks;
+	int n_chunks;
+	int n_started;
+};
+
+
+static void *get_reindex_task(void *vp)
+{
+	struct reindex_queue_args *qargs = vp;
+
+	while ( qargs->n_started < qargs->n_chunks ) {
+		struct reindex_chunk *c = &qargs->chunks[qargs->n_started++];
+		if ( c->reindex ) return c;
+	}
+	return NULL;
+}
+
+
+static void reindex_work(void *wp, int cookie)
+{
+	struct reindex_chunk *c = wp;
+	FILE *fh;
+	FILE *ofh;
+	int i;
+
+	fh = fmemopen(c->text, c->len, "r");
+	if ( fh == NULL ) return;
+	ofh = open_memstream(&c->out, &c->out_len);
+	if ( ofh == NULL ) {
+		fclose(fh);
+		return;
+	}
+
+	i = reindex_chunk_text(fh, ofh, c->assignments, c->amb, c->first);
+
+	fclose(fh);
+	fclose(ofh);
+
+	if ( i != c->first + c->n_crystals ) {
+		ERROR("Chunk with %i crystals has %i reflection lists\n",
+		      c->n_crystals, i - c->first);
+	}
+}
+
+
+/* Re-indexes the chunks which need it in parallel, and writes the batch in
+ * order.  Chunks containing only crystals before number "skip" are left
+ * out. */
+static int write_reindex_batch(struct reindex_chunk *chunks, int n_chunks,
+                               int skip, FILE *ofh, int n_threads)
+{
+	struct reindex_queue_args qargs;
+	int i;
+	int r = 0;
+
+	qargs.chunks = chunks;
+	qargs.n_chunks = n_chunks;
+	qargs.n_started = 0;
+	run_threads(n_threads, reindex_work, get_reindex_task, NULL, &qargs,
+	            n_chunks, 0, 0, 0);
+
+	for ( i=0; i<n_chunks; i++ ) {
+
+		struct reindex_chunk *c = &chunks[i];
+		int end = c->first + c->n_crystals;
+
+		if ( (c->first >= skip) || (end > skip) ) {
+			if ( !c->reindex ) {
+				if ( fwrite(c->text, 1, c->len, ofh) != c->len ) r = 1;
+			} else if ( c->out != NULL ) {
+				if ( fwrite(c->out, 1, c->out_len, ofh)
+				       != c->out_len ) r = 1;
+			} else {
+				ERROR("Failed to re-index a chunk\n");
+				r = 1;
+			}
+		}
+
+		free(c->text);
+		free(c->out);
+
+	}
+
+	return r;
+}
+
+
+/* Copies the headers of the stream, or of the first shard of a manifest, up to
+ * the first chunk, adding our own information */
+static int copy_stream_headers(const char *infile, FILE *ofh,
+                               int argc, char *argv[])
+{
+	FILE *fh;
+	char **shards;
+	int n_shards;
+	int i;
 	int done = 0;
 
-	fh = fopen(infile, "r");
+	shards = stream_manifest_shards(infile, &n_shards);
+	if ( shards != NULL ) {
+		if ( n_shards == 0 ) {
+			ERROR("No shards listed in '%s'\n", infile);
+			free(shards);
+			return 1;
+		}
+		fh = fopen(shards[0], "r");
+		for ( i=0; i<n_shards; i++ ) free(shards[i]);
+		free(shards);
+	} else {
+		fh = fopen(infile, "r");
+	}
 	if ( fh == NULL ) {
 		ERROR("Failed to open '%s'\n", infile);
-		return;
-	}
-
-	ofh = fopen(outfile, "w");
-	if ( ofh == NULL ) {
-		ERROR("Failed to open '%s'\n", outfile);
-		fclose(fh);
-		return;
+		return 1;
 	}
 
-	/* Copy the header */
 	do {
 
 		char line[1024];
 		char *rval;
 
 		rval = fgets(line, 1023, fh);
-		if ( rval == NULL ) {
-			ERROR("Failed to read stream audit info.\n");
-			return;
-		}
+		if ( rval == NULL ) break;
 
-		if ( strncmp(line, "-----", 5) == 0 ) {
+		if ( strcmp(line, STREAM_CHUNK_START_MARKER"\n") == 0 ) break;
+
+		if ( !done && (strncmp(line, "-----", 5) == 0) ) {
 
 			done = 1;
 
@@ -794,117 +1926,120 @@ static void write_reindexed_stream(const char *infile, const char *outfile,
 
 		fputs(line, ofh);
 
-	} while  ( !done );
-
-	i = 0;
-	do {
-
-		char *rval;
-		char line[1024];
-		int d = 0;
-		float u, v, w;
-
-		rval = fgets(line, 1023, fh);
-		if ( rval == NULL ) break;
-
-		if ( strncmp(line, "Cell parameters ", 16) == 0 ) {
-			d = 1;
-		}
-
-		if ( sscanf(line, "astar = %f %f %f", &u, &v, &w) == 3 ) {
-			as.u = u*1e9;  as.v = v*1e9;  as.w = w*1e9;
-			have_as = 1;
-			d = 1;
-		}
-
-		if ( sscanf(line, "bstar = %f %f %f", &u, &v, &w) == 3 ) {
-			bs.u = u*1e9;  bs.v = v*1e9;  bs.w = w*1e9;
-			have_bs = 1;
-			d = 1;
-		}
+	} while ( 1 );
 
-		if ( sscanf(line, "cstar = %f %f %f", &u, &v, &w) == 3 ) {
-			cs.u = u*1e9;  cs.v = v*1e9;  cs.w = w*1e9;
-			have_cs = 1;
-			d = 1;
-		}
+	fclose(fh);
+	if ( !done ) {
+		ERROR("Failed to read stream audit info.\n");
+		return 1;
+	}
+	return 0;
+}
 
-		if ( have_as && have_bs && have_cs ) {
 
-			UnitCell *cell;
-			double asx, asy, asz;
-			double bsx, bsy, bsz;
-			double csx, csy, csz;
-			double a, b, c, al, be, ga;
+/* The chunks are read in parallel by a StreamReader, which also gives the
+ * original text of each chunk.  Chunks which don't need any changes are
+ * copied without looking at the text, and the others are re-indexed by
+ * several threads.  Everything in the chunks is included in the output, even
+ * things ignored by stream_read_chunk(). */
+static void write_reindexed_stream(const char *infile, const char *outfile,
+                                   int *assignments, SymOpList *amb,
+                                   int skip, int n_threads,
+                                   int argc, char *argv[])
+{
+	Stream *st;
+	StreamReader *sr;
+	FILE *ofh;
+	struct reindex_chunk *chunks;
+	int n_chunks = 0;
+	int n_cryst = 0;
+	int n_written = 0;
+	int r = 0;
 
-			cell = cell_new_from_reciprocal_axes(as, bs, cs);
-			assert(cell != NULL);
+	st = stream_open_for_read(infile);
+	if ( st == NULL ) {
+		ERROR("Failed to open '%s'\n", infile);
+		return;
+	}
 
-			if ( assignments[i] ) {
+	if ( stream_is_binary(st) ) {
+		ERROR("Can't write a re-indexed version of a binary stream.\n");
+		ERROR("Convert it to text first, using convert_stream.\n");
+		stream_close(st);
+		return;
+	}
 
-				signed int h, k, l;
-				struct rvec na, nb, nc;
+	ofh = fopen(outfile, "w");
+	if ( ofh == NULL ) {
+		ERROR("Failed to open '%s'\n", outfile);
+		stream_close(st);
+		return;
+	}
+	setvbuf(ofh, NULL, _IOFBF, 16*1024*1024);
 
-				get_equiv(amb, NULL, 0, 1, 0, 0, &h, &k, &l);
-				na.u = as.u*h + bs.u*k + cs.u*l;
-				na.v = as.v*h + bs.v*k + cs.v*l;
-				na.w = as.w*h + bs.w*k + cs.w*l;
+	if ( copy_stream_headers(infile, ofh, argc, argv) ) {
+		fclose(ofh);
+		stream_close(st);
+		return;
+	}
 
-				get_equiv(amb, NULL, 0, 0, 1, 0, &h, &k, &l);
-				nb.u = as.u*h + bs.u*k + cs.u*l;
-				nb.v = as.v*h + bs.v*k + cs.v*l;
-				nb.w = as.w*h + bs.w*k + cs.w*l;
+	chunks = malloc(REINDEX_BATCH*sizeof(struct reindex_chunk));
+	sr = stream_reader_new(st, 0, n_threads, 1);
+	if ( (chunks == NULL) || (sr == NULL) ) {
+		ERROR("Failed to start reading stream.\n");
+		free(chunks);
+		fclose(ofh);
+		stream_close(st);
+		return;
+	}
 
-				get_equiv(amb, NULL, 0, 0, 0, 1, &h, &k, &l);
-				nc.u = as.u*h + bs.u*k + cs.u*l;
-				nc.v = as.v*h + bs.v*k + cs.v*l;
-				nc.w = as.w*h + bs.w*k + cs.w*l;
+	do {
 
-				cell_set_reciprocal(cell, na.u, na.v, na.w,
-				                          nb.u, nb.v, nb.w,
-				                          nc.u, nc.v, nc.w);
+		struct image *image;
+		struct reindex_chunk *c;
+		int j;
 
+		image = stream_reader_next_with_text(sr, &chunks[n_chunks].text,
+		                                     &chunks[n_chunks].len);
+		if ( image != NULL ) {
+
+			c = &chunks[n_chunks++];
+			c->first = n_cryst;
+			c->n_crystals = image->n_crystals;
+			c->out = NULL;
+			c->out_len = 0;
+			c->assignments = assignments;
+			c->amb = amb;
+			c->reindex = 0;
+			for ( j=0; j<image->n_crystals; j++ ) {
+				if ( assignments[n_cryst+j] ) c->reindex = 1;
 			}
-
-			/* The cell parameters might change, so update them.
-			 * Unique axis, centering and lattice type can't change,
-			 * though. */
-			cell_get_parameters(cell, &a, &b, &c, &al, &be, &ga);
-			fprintf(ofh, "Cell parameters %7.5f %7.5f %7.5f nm,"
-			        " %7.5f %7.5f %7.5f deg\n",
-			        a*1.0e9, b*1.0e9, c*1.0e9,
-			        rad2deg(al), rad2deg(be), rad2deg(ga));
-
-			cell_get_reciprocal(cell, &asx, &asy, &asz,
-			                   &bsx, &bsy, &bsz,
-			                   &csx, &csy, &csz);
-			fprintf(ofh, "astar = %+9.7f %+9.7f %+9.7f nm^-1\n",
-			        asx/1e9, asy/1e9, asz/1e9);
-			fprintf(ofh, "bstar = %+9.7f %+9.7f %+9.7f nm^-1\n",
-			        bsx/1e9, bsy/1e9, bsz/1e9);
-			fprintf(ofh, "cstar = %+9.7f %+9.7f %+9.7f nm^-1\n",
-			        csx/1e9, csy/1e9, csz/1e9);
-
-			cell_free(cell);
-			have_as = 0;  have_bs = 0;  have_cs = 0;
+			n_cryst += image->n_crystals;
+			image_free(image);
 
 		}
 
-		/* Not a bug: STREAM_REFLECTION_START_MARKER gets passed through */
-		if ( !d ) fputs(line, ofh);
-
-		if ( strcmp(line, STREAM_REFLECTION_START_MARKER"\n") == 0 ) {
-			reindex_reflections(fh, ofh, assignments[i++], amb);
+		if ( (n_chunks == REINDEX_BATCH)
+		  || ((image == NULL) && (n_chunks > 0)) )
+		{
+			r |= write_reindex_batch(chunks, n_chunks, skip, ofh,
+			                         n_threads);
+			n_written += n_chunks;
+			n_chunks = 0;
+			fprintf(stderr, "Written %i chunks\r", n_written);
 		}
 
+		if ( image == NULL ) break;
+
 	} while ( 1 );
+	fprintf(stderr, "\n");
 
-	if ( !feof(fh) ) {
-		ERROR("Error reading stream.\n");
-	}
+	stream_reader_free(sr);
+	stream_close(st);
+	free(chunks);
 
-	fclose(fh);
-	fclose(ofh);
+	if ( fclose(ofh) ) r = 1;
+	if ( r ) ERROR("Failed to write '%s'\n", outfile);
 }
 
 
@@ -1044,6 +2179,161 @@ static void save_corr(const char *filename, struct cc_list *ccs, int n_crystals,
 }
 
 
+/* Writes the assignments with the filename, event and crystal number within
+ * the chunk, so that they can be applied to the stream later */
+static void write_assignment_list(const char *filename,
+                                  struct crystal_id *ids, int n_crystals,
+                                  int *assignments)
+{
+	FILE *fh;
+	int i;
+
+	fh = fopen(filename, "w");
+	if ( fh == NULL ) {
+		ERROR("Failed to open '%s'\n", filename);
+		return;
+	}
+
+	for ( i=0; i<n_crystals; i++ ) {
+		fprintf(fh, "%s %s %i %i\n", ids[i].filename,
+		        (ids[i].ev != NULL) ? ids[i].ev : "//", ids[i].n,
+		        assignments[i]);
+	}
+
+	if ( fclose(fh) ) {
+		ERROR("Failed to write '%s'\n", filename);
+	}
+}
+
+
+#define GRAPH_MAGIC "CrystFEL ambigator correlation graph 1\n"
+
+
+/* Saves the CC lists and indexing assignments, so that a later run can
+ * continue from them.  The file is binary, in the byte order of this
+ * machine.  After the header line and number of crystals, each crystal has
+ * its assignment, the lengths of its two CC lists, then the lists. */
+static int save_graph(const char *filename, struct cc_list *ccs,
+                      int n_crystals, int *assignments)
+{
+	FILE *fh;
+	int32_t v;
+	int i;
+	int r = 0;
+
+	fh = fopen(filename, "wb");
+	if ( fh == NULL ) {
+		ERROR("Failed to open '%s'\n", filename);
+		return 1;
+	}
+
+	fputs(GRAPH_MAGIC, fh);
+	v = n_crystals;
+	fwrite(&v, sizeof(int32_t), 1, fh);
+
+	for ( i=0; i<n_crystals; i++ ) {
+
+		int32_t hdr[3];
+		int k, kr;
+
+		for ( k=0; ccs[i].ind[k] != 0; k++ );
+		for ( kr=0; ccs[i].ind_reidx[kr] != 0; kr++ );
+
+		hdr[0] = assignments[i];
+		hdr[1] = k;
+		hdr[2] = kr;
+		fwrite(hdr, sizeof(int32_t), 3, fh);
+		fwrite(ccs[i].ind, sizeof(int), k, fh);
+		fwrite(ccs[i].cc, sizeof(float), k, fh);
+		fwrite(ccs[i].ind_reidx, sizeof(int), kr, fh);
+		fwrite(ccs[i].cc_reidx, sizeof(float), kr, fh);
+
+	}
+
+	if ( ferror(fh) ) r = 1;
+	if ( fclose(fh) ) r = 1;
+	if ( r ) {
+		ERROR("Failed to write '%s'\n", filename);
+	} else {
+		STATUS("Saved CCs for %i crystals to %s\n", n_crystals,
+		       filename);
+	}
+	return r;
+}
+
+
+static int read_list(FILE *fh, int n, int **pind, float **pcc)
+{
+	*pind = malloc((n+1)*sizeof(int));
+	*pcc = malloc((n+1)*sizeof(float));
+	if ( (*pind == NULL) || (*pcc == NULL) ) return 1;
+	if ( fread(*pind, sizeof(int), n, fh) != n ) return 1;
+	if ( fread(*pcc, sizeof(float), n, fh) != n ) return 1;
+	(*pind)[n] = 0;
+	return 0;
+}
+
+
+/* Reads a file written by save_graph().  The CC lists and assignments go in
+ * the first entries of ccs and assignments, which must have space for
+ * max_crystals entries.  Returns the number of crystals, or -1 on error. */
+static int load_graph(const char *filename, struct cc_list *ccs,
+                      int *assignments, int max_crystals)
+{
+	FILE *fh;
+	char line[64];
+	int32_t n;
+	int i;
+
+	fh = fopen(filename, "rb");
+	if ( fh == NULL ) {
+		ERROR("Failed to open '%s'\n", filename);
+		return -1;
+	}
+
+	if ( (fgets(line, sizeof(line), fh) == NULL)
+	  || (strcmp(line, GRAPH_MAGIC) != 0)
+	  || (fread(&n, sizeof(int32_t), 1, fh) != 1) )
+	{
+		ERROR("'%s' is not an ambigator graph file\n", filename);
+		fclose(fh);
+		return -1;
+	}
+
+	if ( n > max_crystals ) {
+		ERROR("'%s' contains %i crystals, but only %i were read from "
+		      "the stream\n", filename, n, max_crystals);
+		fclose(fh);
+		return -1;
+	}
+
+	for ( i=0; i<n; i++ ) {
+
+		int32_t hdr[3];
+
+		if ( (fread(hdr, sizeof(int32_t), 3, fh) != 3)
+		  || (hdr[0] < 0) || (hdr[0] > 1)
+		  || (hdr[1] < 0) || (hdr[2] < 0)
+		  || read_list(fh, hdr[1], &ccs[i].ind, &ccs[i].cc)
+		  || read_list(fh, hdr[2], &ccs[i].ind_reidx,
+		               &ccs[i].cc_reidx) )
+		{
+			ERROR("Failed to read crystal %i from '%s'\n",
+			      i, filename);
+			fclose(fh);
+			return -1;
+		}
+
+		assignments[i] = hdr[0];
+		progress_bar(i+1, n, "Loading CCs");
+
+	}
+
+	fclose(fh);
+	return n;
+}
+
+
 int main(int argc, char *argv[])
 {
 	int c;
@@ -1061,7 +2351,13 @@ int main(int argc, char *argv[])
 	int n_crystals, n_chunks, max_crystals;
 	int n_dif;
 	struct flist **crystals;
+	struct flist *flists;
+	struct flist_arena arena;
+	struct flist_buf merge_buf = {0};
+	struct flist_buf reidx_buf = {0};
+	int use_float16 = 0;
 	Stream *st;
+	StreamReader *sr;
 	int j;
 	int *assignments;
 	int *orig_assignments;
@@ -1069,6 +2365,7 @@ int main(int argc, char *argv[])
 	float highres, lowres;
 	double rmin = 0.0;  /* m^-1 */
 	double rmax = INFINITY;  /* m^-1 */
+	int have_asymm_table = 0;
 	FILE *fgfh = NULL;
 	struct cc_list *ccs;
 	int ncorr;
@@ -1079,6 +2376,16 @@ int main(int argc, char *argv[])
 	char *operator = NULL;
 	char *corr_matrix_fn = NULL;
 	int auto_res = 1;
+	int cpu_pin = 0;
+	int sketch_dim = 0;
+	int use_gpu = 0;
+	char *save_graph_fn = NULL;
+	char *load_graph_fn = NULL;
+	int n_old = 0;
+	struct cc_list *old_ccs = NULL;
+	char *ass_list_fn = NULL;
+	struct crystal_id *ids = NULL;
+	ThreadPool *pool;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -1096,8 +2403,15 @@ int main(int argc, char *argv[])
 		{"start-assignments",  1, NULL,                7},
 		{"operator",           1, NULL,                8},
 		{"corr-matrix",        1, NULL,                9},
+		{"sketch",             1, NULL,               11},
+		{"save-graph",         1, NULL,               12},
+		{"load-graph",         1, NULL,               13},
+		{"assignment-list",    1, NULL,               14},
 
 		{"really-random",      0, &config_random,      1},
+		{"cpu-pin",            0, &cpu_pin,            1},
+		{"gpu",                0, &use_gpu,            1},
+		{"float16",            0, &use_float16,        1},
 
 		{0, 0, NULL, 0}
 	};
@@ -1182,10 +2496,31 @@ int main(int argc, char *argv[])
 			start_ass_fn = strdup(optarg);
 			break;
 
+			case 11 :
+			if ( (sscanf(optarg, "%i", &sketch_dim) != 1)
+			  || (sketch_dim < 1) )
+			{
+				ERROR("Invalid value for --sketch\n");
+				return 1;
+			}
+			break;
+
 			case 8 :
 			operator = strdup(optarg);
 			break;
 
+			case 12 :
+			save_graph_fn = strdup(optarg);
+			break;
+
+			case 13 :
+			load_graph_fn = strdup(optarg);
+			break;
+
+			case 14 :
+			ass_list_fn = strdup(optarg);
+			break;
+
 			case 9 :
 			corr_matrix_fn = strdup(optarg);
 			break;
@@ -1267,7 +2602,15 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	crystals = NULL;
+	/* In order, so that the assignments match the crystals in the stream */
+	sr = stream_reader_new(st, STREAM_REFLECTIONS, n_threads, 1);
+	if ( sr == NULL ) {
+		ERROR("Failed to start reading input stream\n");
+		return 1;
+	}
+
+	arena_init(&arena, use_float16);
+	flists = NULL;
 	n_crystals = 0;
 	max_crystals = 0;
 	n_chunks = 0;
@@ -1276,7 +2619,7 @@ int main(int argc, char *argv[])
 		struct image *image;
 		int i;
 
-		image = stream_read_chunk(st, STREAM_REFLECTIONS);
+		image = stream_reader_next(sr);
 		if ( image == NULL ) break;
 
 		image_feature_list_free(image->features);
@@ -1293,30 +2636,72 @@ int main(int argc, char *argv[])
 
 			if ( n_crystals == max_crystals ) {
 
-				struct flist **crystals_new;
+				struct flist *flists_new;
 				size_t ns;
 
-				ns = (max_crystals+1024)*sizeof(struct flist *);
-				crystals_new = realloc(crystals, ns);
-				if ( crystals_new == NULL ) {
+				ns = (max_crystals+1024)*sizeof(struct flist);
+				flists_new = realloc(flists, ns);
+				if ( flists_new == NULL ) {
 					fprintf(stderr, "Failed to allocate "
 					        "memory for crystals.\n");
 					return 1;
 				}
 
 				max_crystals += 1024;
-				crystals = crystals_new;
+				flists = flists_new;
+
+				if ( ass_list_fn != NULL ) {
+					struct crystal_id *ids_new;
+					ns = max_crystals*sizeof(struct crystal_id);
+					ids_new = realloc(ids, ns);
+					if ( ids_new == NULL ) {
+						ERROR("Failed to allocate memory "
+						      "for crystal IDs.\n");
+						return 1;
+					}
+					ids = ids_new;
+				}
+
+			}
 
+			if ( ass_list_fn != NULL ) {
+				ids[n_crystals].filename = strdup(image->filename);
+				ids[n_crystals].ev = NULL;
+				if ( image->ev != NULL ) {
+					ids[n_crystals].ev = strdup(image->ev);
+				}
+				ids[n_crystals].n = i;
+			}
+
+			/* Size the symmetry lookup table using the first
+			 * crystal.  Anything outside it is still handled */
+			if ( !have_asymm_table && (cell != NULL) ) {
+				double lo, hi;
+				resolution_limits(list, cell, &lo, &hi);
+				if ( hi > rmax ) hi = rmax;
+				make_asymm_table_for_cell(s_sym, cell, hi);
+				have_asymm_table = 1;
 			}
 
-			crystals[n_crystals] = asymm_and_merge(list, s_sym,
-			                                       cell,
-			                                       rmin, rmax,
-			                                       amb, auto_res);
-			if ( crystals[n_crystals] == NULL ) {
+			if ( asymm_and_merge(list, s_sym, cell, rmin, rmax,
+			                     amb, auto_res, &merge_buf,
+			                     &flists[n_crystals]) )
+			{
 				ERROR("asymm_and_merge failed!\n");
 				return 1;
 			}
+			if ( (sketch_dim > 0)
+			  && make_sketch(&flists[n_crystals], sketch_dim,
+			                 s_sym, amb, &reidx_buf) )
+			{
+				ERROR("Failed to make sketch\n");
+				return 1;
+			}
+			if ( arena_add(&arena, &flists[n_crystals]) ) {
+				ERROR("Failed to allocate memory for "
+				      "reflections.\n");
+				return 1;
+			}
 			cell_free(cell);
 			n_crystals++;
 			reflist_free(list);
@@ -1329,7 +2714,24 @@ int main(int argc, char *argv[])
 	} while ( 1 );
 	fprintf(stderr, "\n");
 
+	stream_reader_free(sr);
 	stream_close(st);
+	flist_buf_free(&merge_buf);
+	flist_buf_free(&reidx_buf);
+
+	crystals = malloc(n_crystals*sizeof(struct flist *));
+	if ( crystals == NULL ) {
+		ERROR("Couldn't allocate memory for crystals.\n");
+		return 1;
+	}
+	arena_finish(&arena, flists, n_crystals);
+	for ( j=0; j<n_crystals; j++ ) {
+		crystals[j] = &flists[j];
+	}
+	STATUS("%li reflections in total, using %.1f MB.\n", arena.n,
+	       arena.n*(sizeof(unsigned int) + 1
+	                + (use_float16 ? sizeof(uint16_t) : sizeof(float)))
+	       / 1048576.0);
 
 	assignments = malloc(n_crystals*sizeof(int));
 	if ( assignments == NULL ) {
@@ -1400,6 +2802,21 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* Crystals from the earlier run keep their assignments */
+	if ( load_graph_fn != NULL ) {
+		old_ccs = calloc(n_crystals, sizeof(struct cc_list));
+		if ( old_ccs == NULL ) {
+			ERROR("Couldn't allocate memory for CCs.\n");
+			return 1;
+		}
+		n_old = load_graph(load_graph_fn, old_ccs, assignments,
+		                   n_crystals);
+		if ( n_old < 0 ) return 1;
+		STATUS("Loaded CCs for %i crystals from %s.  %i crystals are "
+		       "new.\n", n_old, load_graph_fn, n_crystals - n_old);
+		free(load_graph_fn);
+	}
+
 	for ( j=0; j<n_crystals; j++ ) {
 		orig_assignments[j] = assignments[j];
 	}
@@ -1415,25 +2832,49 @@ int main(int argc, char *argv[])
 		ncorr = n_crystals;
 	}
 
-	ccs = calc_ccs(crystals, n_crystals, ncorr, amb, rng, &mean_nac,
-	               n_threads);
+	pool = thread_pool_new_with_flags(n_threads,
+	                                  cpu_pin ? TP_PIN_THREADS : 0);
+	set_default_thread_pool(pool);
+
+	ccs = NULL;
+	if ( use_gpu ) {
+		if ( sketch_dim > 0 ) {
+			ERROR("--sketch is not used with --gpu\n");
+		}
+		ccs = calc_ccs_gpu(crystals, n_crystals, n_old, ncorr, s_sym,
+		                   amb, rng, &mean_nac, n_threads);
+		if ( ccs == NULL ) {
+			ERROR("Calculating the CCs on the CPU instead.\n");
+		}
+	}
+	if ( ccs == NULL ) {
+		ccs = calc_ccs(crystals, n_crystals, n_old, ncorr, s_sym, amb,
+		               rng, &mean_nac, n_threads, sketch_dim);
+	}
+
 	if ( ccs == NULL ) {
 		ERROR("Failed to allocate CCs\n");
 		return 1;
 	}
 	STATUS("Mean number of correlations per crystal: %.1f\n", mean_nac);
 
+	if ( old_ccs != NULL ) {
+		for ( j=0; j<n_old; j++ ) {
+			ccs[j] = old_ccs[j];
+		}
+		free(old_ccs);
+	}
+
 	for ( j=0; j<n_crystals; j++ ) {
-		free(crystals[j]->s);
-		free(crystals[j]->i);
-		free(crystals[j]->s_reidx);
-		free(crystals[j]->i_reidx);
-		free(crystals[j]);
+		free(flists[j].sketch);
+		free(flists[j].sketch_reidx);
 	}
+	free(flists);
 	free(crystals);
+	arena_free(&arena);
 
 	for ( j=0; j<n_iter; j++ ) {
-		detwin(ccs, n_crystals, assignments, fgfh);
+		detwin(ccs, n_crystals, n_old, assignments, fgfh);
 	}
 
 	if ( corr_matrix_fn != NULL ) {
@@ -1458,6 +2899,22 @@ int main(int argc, char *argv[])
 		fclose(fh);
 	}
 
+	if ( save_graph_fn != NULL ) {
+		save_graph(save_graph_fn, ccs, n_crystals, assignments);
+		free(save_graph_fn);
+	}
+
+	if ( ass_list_fn != NULL ) {
+		write_assignment_list(ass_list_fn, ids, n_crystals,
+		                      assignments);
+		for ( j=0; j<n_crystals; j++ ) {
+			free(ids[j].filename);
+			free(ids[j].ev);
+		}
+		free(ids);
+		free(ass_list_fn);
+	}
+
 	n_dif = 0;
 	for ( j=0; j<n_crystals; j++ ) {
 		if ( orig_assignments[j] != assignments[j] ) n_dif++;
@@ -1467,12 +2924,15 @@ int main(int argc, char *argv[])
 
 	if ( (outfile != NULL) && (amb != NULL) ) {
 		write_reindexed_stream(infile, outfile, assignments, amb,
-		                       argc, argv);
+		                       n_old, n_threads, argc, argv);
 	} else if ( outfile != NULL ) {
 		ERROR("Can only write stream with known ambiguity operator.\n");
 		ERROR("Try again with -w or --operator.\n");
 	}
 
+	set_default_thread_pool(NULL);
+	thread_pool_free(pool);
+
 	free(assignments);
 	gsl_rng_free(rng);
 
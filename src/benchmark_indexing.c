@@ -0,0 +1,534 @@
+/*
+ * benchmark_indexing.c
+ *
+ * Measure the speed and success rate of indexing methods
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <getopt.h>
+
+#include <image.h>
+#include <utils.h>
+#include <stream.h>
+#include <index.h>
+#include <cell.h>
+#include <cell-utils.h>
+#include <crystal.h>
+
+#include "version.h"
+#include "json-utils.h"
+
+
+struct frame
+{
+	struct image *image;
+	UnitCell **refs;  /* Crystals found when the stream was written */
+	int n_refs;
+};
+
+
+struct method_result
+{
+	char *method;
+	int n_runs;
+	int n_indexed;
+	int n_with_ref;   /* Runs on frames which have a reference crystal */
+	int n_matched;    /* ... of which at least one crystal matched it */
+	double *latency;  /* Seconds, one per run */
+};
+
+
+static void show_syntax(const char *s)
+{
+	printf("Syntax: %s [options] -i <input.stream> --indexing=<methods>\n", s);
+}
+
+
+static void show_help(const char *s)
+{
+	show_syntax(s);
+	printf("\nMeasure the speed and success rate of indexing methods.\n"
+	       "\n"
+	       "  -i, --input=file           Stream containing peak lists\n"
+	       "  -o, --output=file          Write results (JSON) to file, not stdout\n"
+	       "  -p, --pdb=file             Unit cell file\n"
+	       "      --indexing=methods     Comma-separated list of methods to test\n"
+	       "  -n, --repeats=n            Index each frame n times (default 1)\n"
+	       "      --max-frames=n         Use only the first n frames with peaks\n"
+	       "      --tolerance=tol        Tolerances for cell checks and\n"
+	       "                              comparison with the stream (default\n"
+	       "                              5,5,5,1.5,1.5,1.5)\n"
+	       "      --no-check-cell        Don't check cell parameters\n"
+	       "      --no-retry             Don't repeat indexing with fewer peaks\n"
+	       "      --no-refine            Skip prediction refinement\n"
+	       "      --no-check-peaks       Don't check the solutions using the peaks\n"
+	       "\n"
+	       "  -h, --help                 Display this help message\n"
+	       "      --version              Print CrystFEL version number and exit\n");
+}
+
+
+#ifdef HAVE_CLOCK_GETTIME
+
+static double get_time()
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+}
+
+#else
+
+static double get_time()
+{
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return tp.tv_sec + tp.tv_usec*1e-6;
+}
+
+#endif
+
+
+static int cmpd(const void *av, const void *bv)
+{
+	double a = *(double *)av;
+	double b = *(double *)bv;
+	if ( a < b ) return -1;
+	if ( a > b ) return 1;
+	return 0;
+}
+
+
+/* Nearest-rank percentile of sorted values */
+static double percentile(const double *vals, int n, double p)
+{
+	int i;
+
+	if ( n == 0 ) return NAN;
+	i = ceil(p/100.0*n) - 1;
+	if ( i < 0 ) i = 0;
+	if ( i >= n ) i = n-1;
+	return vals[i];
+}
+
+
+static struct frame *read_frames(const char *filename, int max_frames,
+                                 int *pn)
+{
+	Stream *st;
+	struct frame *frames = NULL;
+	int n = 0;
+	int max_n = 0;
+
+	st = stream_open_for_read(filename);
+	if ( st == NULL ) {
+		ERROR("Failed to open '%s'\n", filename);
+		return NULL;
+	}
+
+	while ( (max_frames == 0) || (n < max_frames) ) {
+
+		struct image *image;
+		int i;
+
+		image = stream_read_chunk(st, STREAM_PEAKS | STREAM_DATA_DETGEOM);
+		if ( image == NULL ) break;
+
+		if ( (image->features == NULL)
+		  || (image_feature_count(image->features) == 0) )
+		{
+			image_free(image);
+			continue;
+		}
+
+		if ( n == max_n ) {
+			struct frame *nf;
+			max_n += 1024;
+			nf = realloc(frames, max_n*sizeof(struct frame));
+			if ( nf == NULL ) {
+				ERROR("Failed to allocate frames\n");
+				image_free(image);
+				break;
+			}
+			frames = nf;
+		}
+
+		/* Keep the original crystals for comparison.  Indexing will
+		 * replace them. */
+		frames[n].image = image;
+		frames[n].n_refs = image->n_crystals;
+		frames[n].refs = malloc(image->n_crystals*sizeof(UnitCell *));
+		for ( i=0; i<image->n_crystals; i++ ) {
+			UnitCell *cell = crystal_get_cell(image->crystals[i].cr);
+			frames[n].refs[i] = cell_new_from_cell(cell);
+		}
+		free_all_crystals(image);
+		n++;
+
+	}
+
+	stream_close(st);
+	*pn = n;
+	return frames;
+}
+
+
+static int matches_reference(struct image *image, struct frame *fr,
+                             double *tols)
+{
+	int i, j;
+
+	for ( i=0; i<image->n_crystals; i++ ) {
+		UnitCell *cell = crystal_get_cell(image->crystals[i].cr);
+		for ( j=0; j<fr->n_refs; j++ ) {
+			if ( compare_permuted_cell_parameters_and_orientation(cell,
+			                                                      fr->refs[j],
+			                                                      tols,
+			                                                      NULL) )
+			{
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+static int run_method(const char *method, struct frame *frames, int n_frames,
+                      int n_repeats, UnitCell *cell, float *tols,
+                      IndexingFlags flags, struct method_result *res)
+{
+	IndexingPrivate *ipriv;
+	struct taketwo_options *taketwo_opts;
+	struct xgandalf_options *xgandalf_opts;
+	struct pinkindexer_options *pinkindexer_opts;
+	struct felix_options *felix_opts;
+	struct fromfile_options *fromfile_opts;
+	struct asdf_options *asdf_opts;
+	double dtols[6];
+	int i, k;
+
+	default_method_options(&taketwo_opts, &xgandalf_opts,
+	                       &pinkindexer_opts, &felix_opts,
+	                       &fromfile_opts, &asdf_opts);
+
+	ipriv = setup_indexing(method, cell, tols, flags, NAN, NAN, 1,
+	                       taketwo_opts, xgandalf_opts, pinkindexer_opts,
+	                       felix_opts, fromfile_opts, asdf_opts);
+	if ( ipriv == NULL ) {
+		ERROR("Failed to set up indexing method '%s'\n", method);
+		return 1;
+	}
+
+	for ( i=0; i<6; i++ ) dtols[i] = tols[i];
+
+	res->method = strdup(method);
+	res->n_runs = 0;
+	res->n_indexed = 0;
+	res->n_with_ref = 0;
+	res->n_matched = 0;
+	res->latency = malloc(n_frames*n_repeats*sizeof(double));
+	if ( res->latency == NULL ) {
+		cleanup_indexing(ipriv);
+		return 1;
+	}
+
+	for ( i=0; i<n_frames; i++ ) {
+		for ( k=0; k<n_repeats; k++ ) {
+
+			struct image *image = frames[i].image;
+			double t0;
+
+			t0 = get_time();
+			index_pattern(image, ipriv);
+			res->latency[res->n_runs++] = get_time() - t0;
+
+			if ( image->n_crystals > 0 ) res->n_indexed++;
+			if ( frames[i].n_refs > 0 ) {
+				res->n_with_ref++;
+				if ( matches_reference(image, &frames[i], dtols) ) {
+					res->n_matched++;
+				}
+			}
+
+			free_all_crystals(image);
+
+		}
+		progress_bar(i+1, n_frames, method);
+	}
+
+	cleanup_indexing(ipriv);
+	return 0;
+}
+
+
+static void write_result(FILE *fh, struct method_result *res, int last)
+{
+	qsort(res->latency, res->n_runs, sizeof(double), cmpd);
+
+	fprintf(fh, "  {\n");
+	write_str(fh, 1, "method", res->method);
+	write_int(fh, 1, "runs", res->n_runs);
+	write_int(fh, 1, "indexed", res->n_indexed);
+	write_float(fh, 1, "success_rate", (double)res->n_indexed/res->n_runs);
+	write_int(fh, 1, "runs_with_reference", res->n_with_ref);
+	write_int(fh, 1, "matched_reference", res->n_matched);
+	write_float(fh, 1, "match_rate", (double)res->n_matched/res->n_with_ref);
+	write_float(fh, 1, "latency_p50_s", percentile(res->latency, res->n_runs, 50.0));
+	write_float(fh, 1, "latency_p90_s", percentile(res->latency, res->n_runs, 90.0));
+	write_float(fh, 1, "latency_p99_s", percentile(res->latency, res->n_runs, 99.0));
+	write_float(fh, 0, "latency_max_s", percentile(res->latency, res->n_runs, 100.0));
+	fprintf(fh, "  }%s\n", last ? "" : ",");
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c;
+	char *infile = NULL;
+	char *outfile = NULL;
+	char *cellfile = NULL;
+	char *methods_str = NULL;
+	int n_repeats = 1;
+	int max_frames = 0;
+	float tols[6] = {0.05, 0.05, 0.05, deg2rad(1.5), deg2rad(1.5), deg2rad(1.5)};
+	IndexingFlags flags = INDEXING_CHECK_CELL | INDEXING_CHECK_PEAKS
+	                    | INDEXING_REFINE | INDEXING_RETRY;
+	UnitCell *cell = NULL;
+	struct frame *frames;
+	int n_frames;
+	struct method_result *results;
+	int n_results = 0;
+	int n_methods;
+	char *start;
+	char *comma;
+	FILE *fh;
+	int i;
+
+	const struct option longopts[] = {
+		{"help",               0, NULL,               'h'},
+		{"version",            0, NULL,                2 },
+		{"input",              1, NULL,               'i'},
+		{"output",             1, NULL,               'o'},
+		{"pdb",                1, NULL,               'p'},
+		{"repeats",            1, NULL,               'n'},
+		{"indexing",           1, NULL,                3 },
+		{"max-frames",         1, NULL,                4 },
+		{"tolerance",          1, NULL,                5 },
+		{"no-check-cell",      0, NULL,                6 },
+		{"no-retry",           0, NULL,                7 },
+		{"no-refine",          0, NULL,                8 },
+		{"no-check-peaks",     0, NULL,                9 },
+		{0, 0, NULL, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "hi:o:p:n:",
+	                        longopts, NULL)) != -1) {
+
+		switch (c) {
+
+			case 'h' :
+			show_help(argv[0]);
+			return 0;
+
+			case 2 :
+			printf("CrystFEL: %s\n", crystfel_version_string());
+			printf("%s\n", crystfel_licence_string());
+			return 0;
+
+			case 'i' :
+			infile = strdup(optarg);
+			break;
+
+			case 'o' :
+			outfile = strdup(optarg);
+			break;
+
+			case 'p' :
+			cellfile = strdup(optarg);
+			break;
+
+			case 'n' :
+			if ( (sscanf(optarg, "%d", &n_repeats) != 1)
+			  || (n_repeats < 1) )
+			{
+				ERROR("Invalid value for --repeats\n");
+				return 1;
+			}
+			break;
+
+			case 3 :
+			methods_str = strdup(optarg);
+			break;
+
+			case 4 :
+			if ( (sscanf(optarg, "%d", &max_frames) != 1)
+			  || (max_frames < 0) )
+			{
+				ERROR("Invalid value for --max-frames\n");
+				return 1;
+			}
+			break;
+
+			case 5 :
+			if ( sscanf(optarg, "%f,%f,%f,%f,%f,%f",
+			            &tols[0], &tols[1], &tols[2],
+			            &tols[3], &tols[4], &tols[5]) != 6 )
+			{
+				ERROR("Invalid value for --tolerance\n");
+				return 1;
+			}
+			for ( i=0; i<3; i++ ) tols[i] /= 100.0;
+			for ( i=3; i<6; i++ ) tols[i] = deg2rad(tols[i]);
+			break;
+
+			case 6 :
+			flags &= ~INDEXING_CHECK_CELL;
+			break;
+
+			case 7 :
+			flags &= ~INDEXING_RETRY;
+			break;
+
+			case 8 :
+			flags &= ~INDEXING_REFINE;
+			break;
+
+			case 9 :
+			flags &= ~INDEXING_CHECK_PEAKS;
+			break;
+
+			case 0 :
+			break;
+
+			case '?' :
+			break;
+
+			default :
+			ERROR("Unhandled option '%c'\n", c);
+			break;
+
+		}
+
+	}
+
+	if ( infile == NULL ) {
+		ERROR("You must specify the input stream (-i).\n");
+		return 1;
+	}
+
+	if ( cellfile != NULL ) {
+		cell = load_cell_from_file(cellfile);
+		if ( cell == NULL ) {
+			ERROR("Failed to load cell from '%s'\n", cellfile);
+			return 1;
+		}
+	}
+
+	if ( methods_str == NULL ) {
+		methods_str = detect_indexing_methods(cell);
+		if ( methods_str == NULL ) {
+			ERROR("No indexing methods available.\n");
+			return 1;
+		}
+		STATUS("Auto-detected indexing methods: %s\n", methods_str);
+	}
+
+	frames = read_frames(infile, max_frames, &n_frames);
+	if ( frames == NULL ) return 1;
+	if ( n_frames == 0 ) {
+		ERROR("No frames with peaks found in '%s'\n", infile);
+		return 1;
+	}
+	STATUS("Read %i frames with peaks from %s\n", n_frames, infile);
+
+	n_methods = 1;
+	for ( i=0; methods_str[i] != '\0'; i++ ) {
+		if ( methods_str[i] == ',' ) n_methods++;
+	}
+	results = malloc(n_methods*sizeof(struct method_result));
+	if ( results == NULL ) return 1;
+
+	/* Each method is set up and timed on its own */
+	start = methods_str;
+	do {
+		comma = strchr(start, ',');
+		if ( comma != NULL ) *comma = '\0';
+		if ( run_method(start, frames, n_frames, n_repeats, cell, tols,
+		                flags, &results[n_results]) == 0 )
+		{
+			n_results++;
+		}
+		if ( comma != NULL ) start = comma+1;
+	} while ( comma != NULL );
+
+	if ( outfile != NULL ) {
+		fh = fopen(outfile, "w");
+		if ( fh == NULL ) {
+			ERROR("Failed to open '%s'\n", outfile);
+			return 1;
+		}
+	} else {
+		fh = stdout;
+	}
+
+	fprintf(fh, "[\n");
+	for ( i=0; i<n_results; i++ ) {
+		write_result(fh, &results[i], i == n_results-1);
+		free(results[i].method);
+		free(results[i].latency);
+	}
+	fprintf(fh, "]\n");
+	if ( fh != stdout ) fclose(fh);
+
+	for ( i=0; i<n_frames; i++ ) {
+		int j;
+		for ( j=0; j<frames[i].n_refs; j++ ) {
+			cell_free(frames[i].refs[j]);
+		}
+		free(frames[i].refs);
+		image_free(frames[i].image);
+	}
+	free(frames);
+	free(results);
+	cell_free(cell);
+	free(methods_str);
+	free(cellfile);
+	free(outfile);
+	free(infile);
+
+	return 0;
+}
@@ -46,6 +46,7 @@
 #include "utils.h"
 #include "index.h"
 #include "cell-utils.h"
+#include "thread-pool.h"
 
 #include "multihistogram.h"
 #include "version.h"
@@ -59,6 +60,8 @@ static void show_help(const char *s)
 "\n"
 " -h, --help              Display this help message.\n"
 "     --version           Print CrystFEL version number and exit.\n"
+" -j <n>                  Use <n> threads for reading the streams and\n"
+"                          updating the histograms.\n"
 
 );
 }
@@ -74,6 +77,9 @@ static void show_help(const char *s)
 #define CAT_R (7)
 #define CAT_EXCLUDE (8)
 
+/* Number of cells in each task when categorising the cells */
+#define CELL_CHUNK_SIZE (65536)
+
 
 typedef struct {
 
@@ -82,6 +88,8 @@ typedef struct {
 	double min;
 	double max;
 	int n;
+	int n_binned;  /* Number of bins in h, or 0 if it needs rebuilding */
+	const double *vals;  /* The parameter value for each cell */
 	const char *units;
 	const char *label;
 
@@ -117,9 +125,24 @@ typedef struct _cellwindow {
 
 	GtkWidget *indmlist;
 
-	UnitCell **cells;
-	IndexingMethod *indms;
+	/* Parameters of each cell, in Ångstroms and degrees */
+	double *a;
+	double *b;
+	double *c;
+	double *al;
+	double *be;
+	double *ga;
+	signed char *centering;  /* CAT_P etc */
+	int *indm;  /* Index into unique_indms, or -1 */
 	int n_cells;
+	int max_cells;
+
+	/* The category in which each cell is counted in the histograms, or -1
+	 * if it's not counted at all.  new_cat is used while updating */
+	signed char *cur_cat;
+	signed char *new_cat;
+
+	ThreadPool *pool;
 
 	IndexingMethod unique_indms[256];
 	int active_indms[256];
@@ -197,6 +220,7 @@ static gboolean destroy_sig(GtkWidget *da, CellWindow *w)
 	multihistogram_free(w->hist_al->h);
 	multihistogram_free(w->hist_be->h);
 	multihistogram_free(w->hist_ga->h);
+	thread_pool_free(w->pool);
 	gtk_main_quit();
 	return FALSE;
 }
@@ -620,91 +644,159 @@ static int check_exclude(HistoBox *h, double v)
 }
 
 
-static void scan_cells(CellWindow *w)
+struct scan_args
+{
+	CellWindow *w;
+	HistoBox *hists[6];
+	int n_jobs;
+	int n_started;
+	int n_excl;
+};
+
+
+struct scan_job
 {
+	struct scan_args *args;
 	int i;
-	UnitCell **cells = w->cells;
-	int n_cells = w->n_cells;
-	int n_excl = 0;
-
-	multihistogram_delete_all_values(w->hist_a->h);
-	multihistogram_delete_all_values(w->hist_b->h);
-	multihistogram_delete_all_values(w->hist_c->h);
-	multihistogram_delete_all_values(w->hist_al->h);
-	multihistogram_delete_all_values(w->hist_be->h);
-	multihistogram_delete_all_values(w->hist_ga->h);
-
-	multihistogram_set_num_bins(w->hist_a->h, w->hist_a->n);
-	multihistogram_set_num_bins(w->hist_b->h, w->hist_b->n);
-	multihistogram_set_num_bins(w->hist_c->h, w->hist_c->n);
-	multihistogram_set_num_bins(w->hist_al->h, w->hist_al->n);
-	multihistogram_set_num_bins(w->hist_be->h, w->hist_be->n);
-	multihistogram_set_num_bins(w->hist_ga->h, w->hist_ga->n);
-
-	for ( i=0; i<n_cells; i++ ) {
-
-		double a, b, c, al, be, ga;
-		unsigned int cat, j;
-		int ignore = 0;
-
-		for ( j=0; j<w->n_unique_indms; j++ ) {
-			if ( w->unique_indms[j] == w->indms[i] ) {
-				if ( !w->active_indms[j] ) ignore = 1;
-			}
-		}
+	int n_excl;
+};
 
-		if ( ignore ) {
-			n_excl++;
-			continue;
-		}
 
-		if ( cell_get_parameters(cells[i], &a, &b, &c, &al, &be, &ga) ) {
-			n_excl++;
-			continue;
-		}
-		a *= 1e10;  b *= 1e10;  c *= 1e10;
-		al = rad2deg(al);  be = rad2deg(be);  ga = rad2deg(ga);
-
-		switch ( cell_get_centering(cells[i]) ) {
-			case 'P' : cat = CAT_P; break;
-			case 'A' : cat = CAT_A; break;
-			case 'B' : cat = CAT_B; break;
-			case 'C' : cat = CAT_C; break;
-			case 'I' : cat = CAT_I; break;
-			case 'F' : cat = CAT_F; break;
-			case 'H' : cat = CAT_H; break;
-			case 'R' : cat = CAT_R; break;
+static void *get_scan_job(void *vqargs)
+{
+	struct scan_args *qargs = vqargs;
+	struct scan_job *job;
 
-			default :
-			ERROR("Unknown centering '%c'\n",
-			      cell_get_centering(cells[i]));
+	if ( qargs->n_started >= qargs->n_jobs ) return NULL;
+
+	job = malloc(sizeof(struct scan_job));
+	if ( job == NULL ) return NULL;
+	job->args = qargs;
+	job->i = qargs->n_started++;
+	job->n_excl = 0;
+	return job;
+}
+
+
+static void finalise_scan_job(void *vqargs, void *vjob)
+{
+	struct scan_args *qargs = vqargs;
+	struct scan_job *job = vjob;
+	qargs->n_excl += job->n_excl;
+	free(job);
+}
+
+
+/* Decides which category each cell in one chunk should be counted in */
+static void categorise_cells(void *vjob, int cookie)
+{
+	struct scan_job *job = vjob;
+	CellWindow *w = job->args->w;
+	int start = job->i*CELL_CHUNK_SIZE;
+	int end = start + CELL_CHUNK_SIZE;
+	int i;
+
+	if ( end > w->n_cells ) end = w->n_cells;
+
+	for ( i=start; i<end; i++ ) {
+
+		int cat;
+
+		if ( (w->indm[i] >= 0) && !w->active_indms[w->indm[i]] ) {
+			w->new_cat[i] = -1;
+			job->n_excl++;
 			continue;
 		}
 
-		if ( check_exclude(w->hist_a, a) ||
-		     check_exclude(w->hist_b, b) ||
-		     check_exclude(w->hist_c, c) ||
-		     check_exclude(w->hist_al, al) ||
-		     check_exclude(w->hist_be, be) ||
-		     check_exclude(w->hist_ga, ga) )
+		cat = w->centering[i];
+
+		if ( check_exclude(w->hist_a, w->a[i]) ||
+		     check_exclude(w->hist_b, w->b[i]) ||
+		     check_exclude(w->hist_c, w->c[i]) ||
+		     check_exclude(w->hist_al, w->al[i]) ||
+		     check_exclude(w->hist_be, w->be[i]) ||
+		     check_exclude(w->hist_ga, w->ga[i]) )
 		{
 			cat = CAT_EXCLUDE;
-			n_excl++;
+			job->n_excl++;
 		} else if ( w->cols_on[cat] == 0 ) {
 			cat = CAT_EXCLUDE;
-			n_excl++;
+			job->n_excl++;
 		}
 
-		multihistogram_add_value(w->hist_a->h, a, 1<<cat);
-		multihistogram_add_value(w->hist_b->h, b, 1<<cat);
-		multihistogram_add_value(w->hist_c->h, c, 1<<cat);
-		multihistogram_add_value(w->hist_al->h, al, 1<<cat);
-		multihistogram_add_value(w->hist_be->h, be, 1<<cat);
-		multihistogram_add_value(w->hist_ga->h, ga, 1<<cat);
+		w->new_cat[i] = cat;
 
 	}
+}
+
+
+/* Moves the cells whose category has changed within one histogram, or
+ * rebuilds the histogram if the number of bins has changed */
+static void rebin_histogram(void *vjob, int cookie)
+{
+	struct scan_job *job = vjob;
+	CellWindow *w = job->args->w;
+	HistoBox *h = job->args->hists[job->i];
+	int i;
 
-	STATUS("Selected %i of %i cells\n", n_cells-n_excl, n_cells);
+	if ( h->n_binned != h->n ) {
+
+		multihistogram_set_num_bins(h->h, h->n);
+		for ( i=0; i<w->n_cells; i++ ) {
+			if ( w->new_cat[i] < 0 ) continue;
+			multihistogram_add_value(h->h, h->vals[i],
+			                         1<<w->new_cat[i]);
+		}
+		h->n_binned = h->n;
+
+	} else {
+
+		for ( i=0; i<w->n_cells; i++ ) {
+			if ( w->new_cat[i] == w->cur_cat[i] ) continue;
+			if ( w->cur_cat[i] >= 0 ) {
+				multihistogram_remove_value(h->h, h->vals[i],
+				                            1<<w->cur_cat[i]);
+			}
+			if ( w->new_cat[i] >= 0 ) {
+				multihistogram_add_value(h->h, h->vals[i],
+				                         1<<w->new_cat[i]);
+			}
+		}
+
+	}
+}
+
+
+static void scan_cells(CellWindow *w)
+{
+	struct scan_args args;
+	signed char *tmp;
+
+	args.w = w;
+	args.hists[0] = w->hist_a;
+	args.hists[1] = w->hist_b;
+	args.hists[2] = w->hist_c;
+	args.hists[3] = w->hist_al;
+	args.hists[4] = w->hist_be;
+	args.hists[5] = w->hist_ga;
+	args.n_excl = 0;
+
+	args.n_jobs = (w->n_cells+CELL_CHUNK_SIZE-1)/CELL_CHUNK_SIZE;
+	args.n_started = 0;
+	thread_pool_run(w->pool, categorise_cells, get_scan_job,
+	                finalise_scan_job, &args, args.n_jobs);
+
+	/* One task for each histogram */
+	args.n_jobs = 6;
+	args.n_started = 0;
+	thread_pool_run(w->pool, rebin_histogram, get_scan_job,
+	                finalise_scan_job, &args, args.n_jobs);
+
+	tmp = w->cur_cat;
+	w->cur_cat = w->new_cat;
+	w->new_cat = tmp;
+
+	STATUS("Selected %i of %i cells\n", w->n_cells-args.n_excl, w->n_cells);
 }
 
 
@@ -758,41 +850,12 @@ static void scan_minmax(CellWindow *w)
 	int i;
 
 	for ( i=0; i<w->n_cells; i++ ) {
-
-		double a, b, c, al, be, ga;
-		int j;
-		int found = 0;
-
-		if ( cell_get_parameters(w->cells[i], &a, &b, &c, &al, &be, &ga) ) {
-			ERROR("Cell %i is bad\n", i);
-			continue;
-		}
-		a *= 1e10;  b *= 1e10;  c *= 1e10;
-		al = rad2deg(al);  be = rad2deg(be);  ga = rad2deg(ga);
-
-		check_minmax(w->hist_a, a);
-		check_minmax(w->hist_b, b);
-		check_minmax(w->hist_c, c);
-		check_minmax(w->hist_al, al);
-		check_minmax(w->hist_be, be);
-		check_minmax(w->hist_ga, ga);
-
-		for ( j=0; j<w->n_unique_indms; j++ ) {
-			if ( w->indms[i] == w->unique_indms[j] ) {
-				found = 1;
-				break;
-			}
-		}
-		if ( !found ) {
-			if ( w->n_unique_indms > 255 ) {
-				fprintf(stderr, "Too many indexing methods\n");
-			} else {
-				IndexingMethod m = w->indms[i];
-				w->unique_indms[w->n_unique_indms] = m;
-				w->active_indms[w->n_unique_indms++] = 1;
-			}
-		}
-
+		check_minmax(w->hist_a, w->a[i]);
+		check_minmax(w->hist_b, w->b[i]);
+		check_minmax(w->hist_c, w->c[i]);
+		check_minmax(w->hist_al, w->al[i]);
+		check_minmax(w->hist_be, w->be[i]);
+		check_minmax(w->hist_ga, w->ga[i]);
 	}
 
 	set_minmax(w->hist_a);
@@ -801,6 +864,13 @@ static void scan_minmax(CellWindow *w)
 	set_minmax(w->hist_al);
 	set_minmax(w->hist_be);
 	set_minmax(w->hist_ga);
+
+	w->hist_a->n_binned = 0;
+	w->hist_b->n_binned = 0;
+	w->hist_c->n_binned = 0;
+	w->hist_al->n_binned = 0;
+	w->hist_be->n_binned = 0;
+	w->hist_ga->n_binned = 0;
 }
 
 
@@ -1846,7 +1916,8 @@ static gint keypress_sig(GtkWidget *widget, GdkEventKey *event, HistoBox *h)
 }
 
 
-static HistoBox *histobox_new(CellWindow *w, const char *units, const char *n)
+static HistoBox *histobox_new(CellWindow *w, const double *vals,
+                              const char *units, const char *n)
 {
 	HistoBox *h;
 
@@ -1859,6 +1930,8 @@ static HistoBox *histobox_new(CellWindow *w, const char *units, const char *n)
 	h->min = +INFINITY;
 	h->max = -INFINITY;
 	h->n = 100;  /* Number of bins */
+	h->n_binned = 0;
+	h->vals = vals;
 	h->label = n;
 
 	h->h = multihistogram_new();
@@ -1976,13 +2049,116 @@ static void indexing_method_list(CellWindow *w, GtkWidget *vbox)
 }
 
 
+static int resize_cells(CellWindow *w, int max_cells)
+{
+	double **arrs[6] = { &w->a, &w->b, &w->c, &w->al, &w->be, &w->ga };
+	signed char *centering_new;
+	int *indm_new;
+	int i;
+
+	for ( i=0; i<6; i++ ) {
+		double *new = realloc(*arrs[i], max_cells*sizeof(double));
+		if ( new == NULL ) return 1;
+		*arrs[i] = new;
+	}
+
+	centering_new = realloc(w->centering, max_cells);
+	if ( centering_new == NULL ) return 1;
+	w->centering = centering_new;
+
+	indm_new = realloc(w->indm, max_cells*sizeof(int));
+	if ( indm_new == NULL ) return 1;
+	w->indm = indm_new;
+
+	w->max_cells = max_cells;
+	return 0;
+}
+
+
+static int centering_category(char cen)
+{
+	switch ( cen ) {
+		case 'P' : return CAT_P;
+		case 'A' : return CAT_A;
+		case 'B' : return CAT_B;
+		case 'C' : return CAT_C;
+		case 'I' : return CAT_I;
+		case 'F' : return CAT_F;
+		case 'H' : return CAT_H;
+		case 'R' : return CAT_R;
+		default : return -1;
+	}
+}
+
+
+static int indexing_method_index(CellWindow *w, IndexingMethod m)
+{
+	int j;
+
+	for ( j=0; j<w->n_unique_indms; j++ ) {
+		if ( w->unique_indms[j] == m ) return j;
+	}
+
+	if ( w->n_unique_indms > 255 ) {
+		fprintf(stderr, "Too many indexing methods\n");
+		return -1;
+	}
+
+	w->unique_indms[w->n_unique_indms] = m;
+	w->active_indms[w->n_unique_indms] = 1;
+	return w->n_unique_indms++;
+}
+
+
+/* Returns non-zero if there was no memory for the cell */
+static int add_cell(CellWindow *w, UnitCell *cell, IndexingMethod m)
+{
+	double a, b, c, al, be, ga;
+	int cat;
+
+	if ( cell_get_parameters(cell, &a, &b, &c, &al, &be, &ga) ) {
+		ERROR("Bad cell encountered (skipping)\n");
+		return 0;
+	}
+
+	cat = centering_category(cell_get_centering(cell));
+	if ( cat < 0 ) {
+		ERROR("Unknown centering '%c'\n", cell_get_centering(cell));
+		return 0;
+	}
+
+	if ( !right_handed(cell) ) {
+		ERROR("WARNING: Left-handed cell encountered\n");
+	}
+
+	if ( w->n_cells == w->max_cells ) {
+		int max_cells = (w->max_cells > 0) ? 2*w->max_cells : 1024;
+		if ( resize_cells(w, max_cells) ) {
+			fprintf(stderr, "Failed to allocate memory for cells.\n");
+			return 1;
+		}
+	}
+
+	w->a[w->n_cells] = a*1e10;
+	w->b[w->n_cells] = b*1e10;
+	w->c[w->n_cells] = c*1e10;
+	w->al[w->n_cells] = rad2deg(al);
+	w->be[w->n_cells] = rad2deg(be);
+	w->ga[w->n_cells] = rad2deg(ga);
+	w->centering[w->n_cells] = cat;
+	w->indm[w->n_cells] = indexing_method_index(w, m);
+	w->n_cells++;
+	return 0;
+}
+
+
 static int add_stream(CellWindow *w, const char *stream_filename,
-                      int *pmax_cells, int *pn_total_chunks)
+                      int *pn_total_chunks, int n_threads)
 {
 	Stream *st;
+	StreamReader *sr;
 	int n_chunks = 0;
 	int n_cells = 0;
-	int max_cells = *pmax_cells;
 
 	fprintf(stderr, "%s\r", stream_filename);
 
@@ -1992,53 +2168,30 @@ static int add_stream(CellWindow *w, const char *stream_filename,
 		        stream_filename);
 		return 0;
 	}
+
+	/* The order of the cells doesn't matter */
+	sr = stream_reader_new(st, 0, n_threads, 0);
+	if ( sr == NULL ) {
+		fprintf(stderr, "Failed to read '%s' (skipping)\n",
+		        stream_filename);
+		stream_close(st);
+		return 0;
+	}
+
 	do {
 
 		struct image *image;
 		int i;
 
-		image = stream_read_chunk(st, 0);
+		image = stream_reader_next(sr);
 		if ( image == NULL ) break;
 
 		for ( i=0; i<image->n_crystals; i++ ) {
 
 			Crystal *cr = image->crystals[i].cr;
 
-			if ( w->n_cells == max_cells ) {
-
-				UnitCell **cells_new;
-				IndexingMethod *indms_new;
-				size_t nsz;
-
-				nsz = (max_cells+1024)*sizeof(UnitCell *);
-				cells_new = realloc(w->cells, nsz);
-				if ( cells_new == NULL ) {
-					fprintf(stderr, "Failed to allocate "
-					        "memory for cells.\n");
-					break;
-				}
-
-				nsz = (max_cells+1024)*sizeof(IndexingMethod);
-				indms_new = realloc(w->indms, nsz);
-				if ( indms_new == NULL ) {
-					fprintf(stderr, "Failed to allocate "
-					        "memory for methods.\n");
-					break;
-				}
-
-				max_cells += 1024;
-				*pmax_cells = max_cells;
-				w->cells = cells_new;
-				w->indms = indms_new;
-
-			}
-
-			w->cells[w->n_cells] = cell_new_from_cell(crystal_get_cell(cr));
-			if ( !right_handed(w->cells[w->n_cells]) ) {
-				ERROR("WARNING: Left-handed cell encountered\n");
-			}
-			w->indms[w->n_cells] = image->indexed_by;
-			w->n_cells++;
+			if ( add_cell(w, crystal_get_cell(cr),
+			              image->indexed_by) ) break;
 			n_cells++;
 
 		}
@@ -2055,6 +2208,8 @@ static int add_stream(CellWindow *w, const char *stream_filename,
 
 	fprintf(stderr, "\n");
 
+	stream_reader_free(sr);
+
 	if ( stream_has_old_indexers(st) ) {
 		ERROR("----- Notice -----\n");
 		ERROR("This stream contains indexing methods specified in an old way.\n");
@@ -2077,13 +2232,13 @@ static int add_stream(CellWindow *w, const char *stream_filename,
 int main(int argc, char *argv[])
 {
 	int c;
-	int max_cells = 0;
 	int n_chunks = 0;
 	GtkWidget *box, *vbox;
 	char title[1024];
 	CellWindow w;
 	int i;
 	char *name_for_title;
+	int n_threads = 1;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -2093,7 +2248,7 @@ int main(int argc, char *argv[])
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "h",
+	while ((c = getopt_long(argc, argv, "hj:",
 	                        longopts, NULL)) != -1) {
 
 		switch (c) {
@@ -2109,6 +2264,14 @@ int main(int argc, char *argv[])
 			       crystfel_licence_string());
 			return 0;
 
+			case 'j' :
+			n_threads = atoi(optarg);
+			if ( n_threads < 1 ) {
+				ERROR("Invalid number of threads.\n");
+				return 1;
+			}
+			break;
+
 			default :
 			return 1;
 
@@ -2134,32 +2297,50 @@ int main(int argc, char *argv[])
 
 	gsl_set_error_handler_off();
 
-	w.cells = NULL;
-	w.indms = NULL;
+	w.a = NULL;
+	w.b = NULL;
+	w.c = NULL;
+	w.al = NULL;
+	w.be = NULL;
+	w.ga = NULL;
+	w.centering = NULL;
+	w.indm = NULL;
 	w.n_cells = 0;
+	w.max_cells = 0;
+	w.n_unique_indms = 0;
 
 	while ( optind < argc ) {
-		if ( add_stream(&w, argv[optind++],
-		                &max_cells, &n_chunks) )
-		{
+		if ( add_stream(&w, argv[optind++], &n_chunks, n_threads) ) {
 			return 1;
 		}
 	}
 
+	w.cur_cat = malloc(w.n_cells);
+	w.new_cat = malloc(w.n_cells);
+	if ( (w.n_cells > 0) && ((w.cur_cat == NULL) || (w.new_cat == NULL)) ) {
+		fprintf(stderr, "Failed to allocate memory for cells.\n");
+		return 1;
+	}
+	for ( i=0; i<w.n_cells; i++ ) w.cur_cat[i] = -1;
+
+	w.pool = thread_pool_new(n_threads);
+	if ( w.pool == NULL ) {
+		fprintf(stderr, "Failed to start threads.\n");
+		return 1;
+	}
+
 	fprintf(stderr, "Loaded %i cells from %i total chunks\n",
 	        w.n_cells, n_chunks);
 
 	w.cols_on[0] = 1;
 	for ( i=1; i<8; i++ ) w.cols_on[i] = 2;
 
-	w.hist_a = histobox_new(&w, " Å", "a");
-	w.hist_b = histobox_new(&w, " Å", "b");
-	w.hist_c = histobox_new(&w, " Å", "c");
-	w.hist_al = histobox_new(&w, "°", "α");
-	w.hist_be = histobox_new(&w, "°", "β");
-	w.hist_ga = histobox_new(&w, "°", "γ");
-
-	w.n_unique_indms = 0;
+	w.hist_a = histobox_new(&w, w.a, " Å", "a");
+	w.hist_b = histobox_new(&w, w.b, " Å", "b");
+	w.hist_c = histobox_new(&w, w.c, " Å", "c");
+	w.hist_al = histobox_new(&w, w.al, "°", "α");
+	w.hist_be = histobox_new(&w, w.be, "°", "β");
+	w.hist_ga = histobox_new(&w, w.ga, "°", "γ");
 
 	scan_minmax(&w);
 	scan_cells(&w);
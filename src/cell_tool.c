@@ -43,6 +43,7 @@
 #include <cell-utils.h>
 #include <reflist-utils.h>
 #include <reflist.h>
+#include <possible-refls.h>
 
 #include "version.h"
 
@@ -164,95 +165,25 @@ static int comparecells(UnitCell *cell, const char *comparecell,
 }
 
 
-struct sortmerefl {
-	signed int h;
-	signed int k;
-	signed int l;
-	double resolution;
-	int multi;
-};
-
-
-static int cmpres(const void *av, const void *bv)
-{
-	const struct sortmerefl *a = av;
-	const struct sortmerefl *b = bv;
-	return a->resolution > b->resolution;
-}
-
-
 static int all_rings(UnitCell *cell, SymOpList *sym, double mres)
 {
-	double ax, ay, az;
-	double bx, by, bz;
-	double cx, cy, cz;
-	int hmax, kmax, lmax;
-	signed int h, k, l;
-	RefList *list;
+	PossibleRefls *p;
+	const struct possible_refl *refls;
+	SymOpList *p1 = NULL;
 	int i, n;
-	RefListIterator *iter;
-	Reflection *ring;
-	struct sortmerefl *sortus;
-
-	cell_get_cartesian(cell, &ax, &ay, &az, &bx, &by, &bz, &cx, &cy, &cz);
-	hmax = mres * modulus(ax, ay, az);
-	kmax = mres * modulus(bx, by, bz);
-	lmax = mres * modulus(cx, cy, cz);
-	list = reflist_new();
-	for ( h=-hmax; h<=hmax; h++ ) {
-	for ( k=-kmax; k<=kmax; k++ ) {
-	for ( l=-lmax; l<=lmax; l++ ) {
-
-		signed int ha, ka, la;
-
-		if ( forbidden_reflection(cell, h, k, l) ) continue;
-		if ( 2.0*resolution(cell, h, k, l) > mres ) continue;
-
-		if ( sym != NULL ) {
-
-			Reflection *refl;
-
-			get_asymm(sym, h, k, l, &ha, &ka, &la);
-			refl = find_refl(list, ha, ka, la);
-			if ( refl == NULL ) {
-				refl = add_refl(list, ha, ka, la);
-				set_redundancy(refl, 1);
-			} else {
-				set_redundancy(refl, get_redundancy(refl)+1);
-			}
-
-		} else {
-			Reflection *refl;
-			refl = add_refl(list, h, k, l);
-			set_redundancy(refl, 1);
-		}
 
+	if ( sym == NULL ) {
+		p1 = get_pointgroup("1");
+		sym = p1;
 	}
-	}
-	}
-
-	n = num_reflections(list);
-	sortus = malloc(n*sizeof(struct sortmerefl));
-
-	i = 0;
-	for ( ring = first_refl(list, &iter);
-	      ring != NULL;
-	      ring = next_refl(ring, iter) )
-	{
-		signed int rh, rk, rl;
-
-		get_indices(ring, &rh, &rk, &rl);
-
-		sortus[i].h = rh;
-		sortus[i].k = rk;
-		sortus[i].l = rl;
-		sortus[i].resolution = 2.0*resolution(cell, rh, rk, rl);  /* one over d */
-		sortus[i].multi = get_redundancy(ring);
-		i++;
 
+	p = possible_refls_get(cell, sym, mres, 1);
+	if ( p1 != NULL ) free_symoplist(p1);
+	if ( p == NULL ) {
+		ERROR("Failed to list reflections.\n");
+		return 1;
 	}
-
-	qsort(sortus, n, sizeof(struct sortmerefl), cmpres);
+	refls = possible_refls_list(p, &n);
 
 	STATUS("\nAll powder rings up to %f Ångstrøms.\n", 1e+10/mres);
 	STATUS("Note that screw axis or glide plane absences are not "
@@ -261,11 +192,12 @@ static int all_rings(UnitCell *cell, SymOpList *sym, double mres)
 	STATUS("------------------------------------------------------\n");
 	for ( i=0; i<n; i++ ) {
 		printf("%10.3f %10.3e %4i %4i %4i    m = %i\n",
-		       1e10/sortus[i].resolution, sortus[i].resolution,
-		       sortus[i].h, sortus[i].k, sortus[i].l,
-		       sortus[i].multi);
+		       1e10/refls[i].res, refls[i].res,
+		       refls[i].h, refls[i].k, refls[i].l,
+		       refls[i].multiplicity);
 	}
 
+	possible_refls_free(p);
 	return 0;
 }
 
@@ -46,6 +46,7 @@
 #include <reflist-utils.h>
 #include <cell-utils.h>
 #include <fom.h>
+#include <thread-pool.h>
 
 #include "version.h"
 
@@ -71,6 +72,8 @@ static void show_help(const char *s)
 "      --shell-file=<file>    Write results table to <file>.\n"
 "      --ignore-negs          Ignore reflections with negative intensities.\n"
 "      --zero-negs            Set negative intensities to zero.\n"
+"  -j <n>                     Use <n> threads for the shell statistics.\n"
+"      --deterministic        Same results for any number of threads.\n"
 "\n");
 }
 
@@ -397,17 +400,23 @@ static void wilson_plot(RefList *list, UnitCell *cell, const SymOpList *sym,
 
 static void plot_shells(RefList *list, UnitCell *cell, const SymOpList *sym,
                         double rmin_fix, double rmax_fix, int nshells,
-			const char *shell_file)
+			const char *shell_file, int n_threads)
 {
 	double rmin, rmax;
 	int i;
 	FILE *fh;
 	struct fom_shells *shells;
+	struct fom_context *fctx[5];
 	struct fom_context *nmeas_ctx;
 	struct fom_context *red_ctx;
 	struct fom_context *snr_ctx;
 	struct fom_context *mean_ctx;
 	struct fom_context *compl_ctx;
+	const enum fom_type foms[5] = { FOM_NUM_MEASUREMENTS,
+	                                FOM_REDUNDANCY,
+	                                FOM_SNR,
+	                                FOM_MEAN_INTENSITY,
+	                                FOM_COMPLETENESS };
 
 	fh = fopen(shell_file, "w");
 	if ( fh == NULL ) {
@@ -426,16 +435,19 @@ static void plot_shells(RefList *list, UnitCell *cell, const SymOpList *sym,
 
 	STATUS("Overall values within specified resolution range:\n");
 
-	nmeas_ctx = fom_calculate(list, NULL, cell, shells,
-	                          FOM_NUM_MEASUREMENTS, 0, sym);
-	red_ctx = fom_calculate(list, NULL, cell, shells,
-	                        FOM_REDUNDANCY, 0, sym);
-	snr_ctx = fom_calculate(list, NULL, cell, shells,
-	                        FOM_SNR, 0, sym);
-	mean_ctx = fom_calculate(list, NULL, cell, shells,
-	                         FOM_MEAN_INTENSITY, 0, sym);
-	compl_ctx = fom_calculate(list, NULL, cell, shells,
-	                          FOM_COMPLETENESS, 0, sym);
+	/* All the figures of merit in one pass through the reflections */
+	if ( fom_calculate_multi(list, cell, shells, foms, 5, sym, n_threads,
+	                         fctx) )
+	{
+		ERROR("Failed to calculate figures of merit\n");
+		fclose(fh);
+		return;
+	}
+	nmeas_ctx = fctx[0];
+	red_ctx = fctx[1];
+	snr_ctx = fctx[2];
+	mean_ctx = fctx[3];
+	compl_ctx = fctx[4];
 
 	STATUS("%.0f measurements in total.\n",
 	       fom_overall_value(nmeas_ctx));
@@ -526,6 +538,8 @@ int main(int argc, char *argv[])
 	int zeronegs = 0;
 	float highres, lowres;
 	struct fom_rejections rej;
+	int n_threads = 1;
+	int deterministic = 0;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -547,12 +561,13 @@ int main(int argc, char *argv[])
 		{"ltest",              0, &ltest,              1},
 		{"ignore-negs",        0, &ignorenegs,         1},
 		{"zero-negs",          0, &zeronegs,           1},
+		{"deterministic",      0, &deterministic,      1},
 
 		{0, 0, NULL, 0}
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "hy:p:", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "hy:p:j:", longopts, NULL)) != -1) {
 
 		switch (c) {
 
@@ -575,6 +590,15 @@ int main(int argc, char *argv[])
 			cellfile = strdup(optarg);
 			break;
 
+			case 'j' :
+			if ( (sscanf(optarg, "%i", &n_threads) != 1)
+			  || (n_threads < 1) )
+			{
+				ERROR("Invalid value for -j\n");
+				return 1;
+			}
+			break;
+
 			case 0 :
 			break;
 
@@ -649,6 +673,8 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	set_deterministic_reductions(deterministic);
+
 	if ( !ltest && (ignorenegs || zeronegs) ) {
 		ERROR("WARNING: You are using --zero-negs or --ignore-negs "
 		      "even though it's not required.\n");
@@ -746,7 +772,7 @@ int main(int argc, char *argv[])
 		       shell_file);
 	} else {
 		plot_shells(list, cell, sym, rmin_fix, rmax_fix, nshells,
-		            shell_file);
+		            shell_file, n_threads);
 	}
 
 	free_symoplist(sym);
@@ -0,0 +1,438 @@
+/*
+ * checkpoint.c
+ *
+ * Save and restore the state of partialator between iterations
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <crystal.h>
+#include <cell.h>
+#include <utils.h>
+
+#include "checkpoint.h"
+
+
+/* The file starts with this, followed by a number for checking the byte
+ * order.  Everything is written in the native byte order and layout, so a
+ * checkpoint can only be read on the same kind of machine */
+#define CHECKPOINT_MAGIC "CrystFEL partialator checkpoint 1\n"
+#define CHECKPOINT_BOM (0x01020304)
+
+struct checkpoint_header
+{
+	uint32_t bom;
+	int32_t itn;
+	int32_t n_crystals;
+	int32_t sym_len;
+	int32_t audit_len;
+};
+
+/* Everything needed to carry on from where the checkpoint was taken.  The
+ * other values (partialities etc) are calculated again from these */
+struct checkpoint_crystal
+{
+	double lambda;
+	double bw;
+	double div;
+	double osf;
+	double Bfac;
+	double profile_radius;
+	double mosaicity;
+	double resolution_limit;
+	double det_shift_x;
+	double det_shift_y;
+	double rvecs[9];
+	int32_t serial;
+	int32_t user_flag;
+	int32_t lattice_type;
+	int32_t centering;
+	int32_t unique_axis;
+	int32_t n_refls;
+	int32_t filename_len;
+	int32_t ev_len;
+};
+
+struct checkpoint_refl
+{
+	double intensity;
+	double esd_i;
+	double peak;
+	double mean_bg;
+	double fs;
+	double ss;
+	int32_t h, k, l;
+	int32_t hs, ks, ls;
+	int32_t panel_number;
+	int32_t redundancy;
+	int32_t flag;
+	int32_t pad;
+};
+
+
+static int write_string(FILE *fh, const char *s, int len)
+{
+	if ( len == 0 ) return 0;
+	return fwrite(s, 1, len, fh) != (size_t)len;
+}
+
+
+static char *read_string(FILE *fh, int len)
+{
+	char *s;
+
+	if ( len < 0 ) return NULL;
+	s = malloc(len+1);
+	if ( s == NULL ) return NULL;
+	if ( fread(s, 1, len, fh) != (size_t)len ) {
+		free(s);
+		return NULL;
+	}
+	s[len] = '\0';
+	return s;
+}
+
+
+static int slen(const char *s)
+{
+	if ( s == NULL ) return 0;
+	return strlen(s);
+}
+
+
+static int write_refls(FILE *fh, RefList *list)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		struct checkpoint_refl r;
+		signed int h, k, l;
+
+		memset(&r, 0, sizeof(r));
+		get_indices(refl, &h, &k, &l);
+		r.h = h;  r.k = k;  r.l = l;
+		get_symmetric_indices(refl, &h, &k, &l);
+		r.hs = h;  r.ks = k;  r.ls = l;
+		r.intensity = get_intensity(refl);
+		r.esd_i = get_esd_intensity(refl);
+		r.peak = get_peak(refl);
+		r.mean_bg = get_mean_bg(refl);
+		get_detector_pos(refl, &r.fs, &r.ss);
+		r.panel_number = get_panel_number(refl);
+		r.redundancy = get_redundancy(refl);
+		r.flag = get_flag(refl);
+
+		if ( fwrite(&r, sizeof(r), 1, fh) != 1 ) return 1;
+	}
+
+	return 0;
+}
+
+
+static RefList *read_refls(FILE *fh, int n, int flags)
+{
+	RefList *list;
+	int i;
+
+	list = reflist_new_with_flags(flags);
+	if ( list == NULL ) return NULL;
+
+	for ( i=0; i<n; i++ ) {
+
+		struct checkpoint_refl r;
+		Reflection *refl;
+
+		if ( fread(&r, sizeof(r), 1, fh) != 1 ) {
+			reflist_free(list);
+			return NULL;
+		}
+
+		refl = add_refl(list, r.h, r.k, r.l);
+		if ( refl == NULL ) {
+			reflist_free(list);
+			return NULL;
+		}
+		set_symmetric_indices(refl, r.hs, r.ks, r.ls);
+		set_intensity(refl, r.intensity);
+		set_esd_intensity(refl, r.esd_i);
+		set_peak(refl, r.peak);
+		set_mean_bg(refl, r.mean_bg);
+		set_detector_pos(refl, r.fs, r.ss);
+		set_panel_number(refl, r.panel_number);
+		set_redundancy(refl, r.redundancy);
+		set_flag(refl, r.flag);
+
+	}
+
+	return list;
+}
+
+
+static int write_crystal(FILE *fh, Crystal *cr, RefList *list,
+                         struct image *image)
+{
+	struct checkpoint_crystal c;
+	UnitCell *cell = crystal_get_cell(cr);
+
+	memset(&c, 0, sizeof(c));
+	c.lambda = image->lambda;
+	c.bw = image->bw;
+	c.div = image->div;
+	c.osf = crystal_get_osf(cr);
+	c.Bfac = crystal_get_Bfac(cr);
+	c.profile_radius = crystal_get_profile_radius(cr);
+	c.mosaicity = crystal_get_mosaicity(cr);
+	c.resolution_limit = crystal_get_resolution_limit(cr);
+	crystal_get_det_shift(cr, &c.det_shift_x, &c.det_shift_y);
+	cell_get_reciprocal(cell, &c.rvecs[0], &c.rvecs[1], &c.rvecs[2],
+	                          &c.rvecs[3], &c.rvecs[4], &c.rvecs[5],
+	                          &c.rvecs[6], &c.rvecs[7], &c.rvecs[8]);
+	c.serial = image->serial;
+	c.user_flag = crystal_get_user_flag(cr);
+	c.lattice_type = cell_get_lattice_type(cell);
+	c.centering = cell_get_centering(cell);
+	c.unique_axis = cell_get_unique_axis(cell);
+	c.n_refls = num_reflections(list);
+	c.filename_len = slen(image->filename);
+	c.ev_len = slen(image->ev);
+
+	if ( fwrite(&c, sizeof(c), 1, fh) != 1 ) return 1;
+	if ( write_string(fh, image->filename, c.filename_len) ) return 1;
+	if ( write_string(fh, image->ev, c.ev_len) ) return 1;
+	return write_refls(fh, list);
+}
+
+
+/* Creates a separate image structure for the crystal, in the same way as when
+ * reading the crystals from a stream */
+static struct image *read_crystal(FILE *fh, int flags)
+{
+	struct checkpoint_crystal c;
+	struct image *image;
+	struct rvec as, bs, cs;
+	UnitCell *cell;
+	Crystal *cr;
+	RefList *list;
+
+	if ( fread(&c, sizeof(c), 1, fh) != 1 ) return NULL;
+
+	image = image_new();
+	if ( image == NULL ) return NULL;
+
+	image->lambda = c.lambda;
+	image->bw = c.bw;
+	image->div = c.div;
+	image->serial = c.serial;
+	image->filename = read_string(fh, c.filename_len);
+	if ( c.ev_len > 0 ) image->ev = read_string(fh, c.ev_len);
+	if ( (image->filename == NULL)
+	  || ((c.ev_len > 0) && (image->ev == NULL)) )
+	{
+		image_free(image);
+		return NULL;
+	}
+
+	as.u = c.rvecs[0];  as.v = c.rvecs[1];  as.w = c.rvecs[2];
+	bs.u = c.rvecs[3];  bs.v = c.rvecs[4];  bs.w = c.rvecs[5];
+	cs.u = c.rvecs[6];  cs.v = c.rvecs[7];  cs.w = c.rvecs[8];
+	cell = cell_new_from_reciprocal_axes(as, bs, cs);
+	if ( cell == NULL ) {
+		image_free(image);
+		return NULL;
+	}
+	cell_set_lattice_type(cell, c.lattice_type);
+	cell_set_centering(cell, c.centering);
+	cell_set_unique_axis(cell, c.unique_axis);
+
+	cr = crystal_new();
+	if ( cr == NULL ) {
+		cell_free(cell);
+		image_free(image);
+		return NULL;
+	}
+	crystal_set_cell(cr, cell);
+	crystal_set_osf(cr, c.osf);
+	crystal_set_Bfac(cr, c.Bfac);
+	crystal_set_profile_radius(cr, c.profile_radius);
+	crystal_set_mosaicity(cr, c.mosaicity);
+	crystal_set_resolution_limit(cr, c.resolution_limit);
+	crystal_set_det_shift(cr, c.det_shift_x, c.det_shift_y);
+	crystal_set_user_flag(cr, c.user_flag);
+
+	list = read_refls(fh, c.n_refls, flags);
+	if ( list == NULL ) {
+		crystal_free(cr);
+		image_free(image);
+		return NULL;
+	}
+
+	image_add_crystal_refls(image, cr, list);
+	return image;
+}
+
+
+/* The checkpoint is first written to a temporary file, which then replaces
+ * the old one, so that the previous checkpoint survives if the program is
+ * stopped part of the way through */
+int write_checkpoint(const char *filename, struct checkpoint *ck)
+{
+	struct checkpoint_header hdr;
+	char *tmp;
+	FILE *fh;
+	int i;
+	int r = 0;
+
+	tmp = malloc(strlen(filename)+5);
+	if ( tmp == NULL ) return 1;
+	strcpy(tmp, filename);
+	strcat(tmp, ".tmp");
+
+	fh = fopen(tmp, "wb");
+	if ( fh == NULL ) {
+		ERROR("Failed to open checkpoint file '%s'\n", tmp);
+		free(tmp);
+		return 1;
+	}
+
+	hdr.bom = CHECKPOINT_BOM;
+	hdr.itn = ck->itn;
+	hdr.n_crystals = ck->n_crystals;
+	hdr.sym_len = slen(ck->sym);
+	hdr.audit_len = slen(ck->audit_info);
+
+	if ( fputs(CHECKPOINT_MAGIC, fh) == EOF ) r = 1;
+	if ( !r && (fwrite(&hdr, sizeof(hdr), 1, fh) != 1) ) r = 1;
+	if ( !r ) r = write_string(fh, ck->sym, hdr.sym_len);
+	if ( !r ) r = write_string(fh, ck->audit_info, hdr.audit_len);
+
+	for ( i=0; i<ck->n_crystals; i++ ) {
+		if ( r ) break;
+		r = write_crystal(fh, ck->crystals[i].cr,
+		                  ck->crystals[i].refls, ck->images[i]);
+	}
+
+	if ( !r ) {
+		int32_t n = num_reflections(ck->full);
+		if ( fwrite(&n, sizeof(n), 1, fh) != 1 ) r = 1;
+	}
+	if ( !r ) r = write_refls(fh, ck->full);
+
+	if ( fclose(fh) ) r = 1;
+
+	if ( !r && rename(tmp, filename) ) r = 1;
+
+	if ( r ) {
+		ERROR("Failed to write checkpoint file '%s'\n", filename);
+		remove(tmp);
+	}
+
+	free(tmp);
+	return r;
+}
+
+
+/* The lists of reflections for the crystals will be created with
+ * reflist_flags.  The merged list will not have any contribution lists */
+int read_checkpoint(const char *filename, struct checkpoint *ck,
+                    int reflist_flags)
+{
+	struct checkpoint_header hdr;
+	char magic[sizeof(CHECKPOINT_MAGIC)];
+	FILE *fh;
+	int32_t n_full;
+	int i;
+
+	fh = fopen(filename, "rb");
+	if ( fh == NULL ) {
+		ERROR("Failed to open checkpoint file '%s'\n", filename);
+		return 1;
+	}
+
+	if ( (fread(magic, 1, strlen(CHECKPOINT_MAGIC), fh)
+	                                      != strlen(CHECKPOINT_MAGIC))
+	  || (strncmp(magic, CHECKPOINT_MAGIC, strlen(CHECKPOINT_MAGIC)) != 0)
+	  || (fread(&hdr, sizeof(hdr), 1, fh) != 1)
+	  || (hdr.bom != CHECKPOINT_BOM) )
+	{
+		ERROR("'%s' is not a checkpoint file, or was written on a "
+		      "different kind of computer.\n", filename);
+		fclose(fh);
+		return 1;
+	}
+
+	ck->itn = hdr.itn;
+	ck->n_crystals = 0;
+	ck->full = NULL;
+	ck->sym = read_string(fh, hdr.sym_len);
+	ck->audit_info = read_string(fh, hdr.audit_len);
+	ck->crystals = malloc(hdr.n_crystals*sizeof(struct crystal_refls));
+	ck->images = malloc(hdr.n_crystals*sizeof(struct image *));
+	if ( (ck->sym == NULL) || (ck->audit_info == NULL)
+	  || (ck->crystals == NULL) || (ck->images == NULL) )
+	{
+		ERROR("Failed to read checkpoint header\n");
+		fclose(fh);
+		return 1;
+	}
+
+	for ( i=0; i<hdr.n_crystals; i++ ) {
+
+		struct image *image = read_crystal(fh, reflist_flags);
+		if ( image == NULL ) {
+			ERROR("Failed to read crystal %i from checkpoint\n", i);
+			fclose(fh);
+			return 1;
+		}
+
+		ck->images[i] = image;
+		ck->crystals[i].cr = image->crystals[0].cr;
+		ck->crystals[i].refls = image->crystals[0].refls;
+		ck->n_crystals++;
+
+	}
+
+	if ( (fread(&n_full, sizeof(n_full), 1, fh) != 1)
+	  || ((ck->full = read_refls(fh, n_full, 0)) == NULL) )
+	{
+		ERROR("Failed to read merged reflections from checkpoint\n");
+		fclose(fh);
+		return 1;
+	}
+
+	fclose(fh);
+	return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * checkpoint.h
+ *
+ * Save and restore the state of partialator between iterations
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include "image.h"
+#include "reflist.h"
+
+/* The state of partialator after 'itn' iterations */
+struct checkpoint
+{
+	int itn;
+	char *sym;
+	char *audit_info;
+	int n_crystals;
+	struct crystal_refls *crystals;
+	struct image **images;
+	RefList *full;
+};
+
+extern int write_checkpoint(const char *filename, struct checkpoint *ck);
+extern int read_checkpoint(const char *filename, struct checkpoint *ck,
+                           int reflist_flags);
+
+#endif	/* CHECKPOINT_H */
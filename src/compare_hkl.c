@@ -45,6 +45,7 @@
 #include <reflist-utils.h>
 #include <cell-utils.h>
 #include <fom.h>
+#include <thread-pool.h>
 
 #include "version.h"
 
@@ -64,6 +65,8 @@ static void show_help(const char *s)
 "      --nshells=<n>          Use <n> resolution shells.\n"
 "  -u                         Force scale factor to 1.\n"
 "      --shell-file=<file>    Write resolution shells to <file>.\n"
+"  -j <n>                     Use <n> threads.\n"
+"      --deterministic        Same results for any number of threads.\n"
 "\n"
 "You can control which reflections are included in the calculation:\n"
 "\n"
@@ -106,7 +109,7 @@ static enum fom_type fom_type_from_string(const char *s)
 static void do_fom(RefList *list1, RefList *list2, UnitCell *cell,
                    double rmin, double rmax, enum fom_type fom,
                    int config_unity, int nshells, const char *filename,
-                   SymOpList *sym)
+                   SymOpList *sym, int n_threads)
 {
 	struct fom_shells *shells;
 	struct fom_context *fctx;
@@ -122,8 +125,8 @@ static void do_fom(RefList *list1, RefList *list2, UnitCell *cell,
 		return;
 	}
 
-	fctx = fom_calculate(list1, list2, cell, shells, fom,
-	                     config_unity, sym);
+	fctx = fom_calculate_threaded(list1, list2, cell, shells, fom,
+	                              config_unity, sym, n_threads);
 
 	switch ( fom ) {
 
@@ -367,6 +370,8 @@ int main(int argc, char *argv[])
 	char *shell_file = NULL;
 	float highres, lowres;
 	int mul_cutoff = 0;
+	int n_threads = 1;
+	int deterministic = 0;
 	int anom;
 	struct fom_rejections rej;
 
@@ -387,11 +392,12 @@ int main(int argc, char *argv[])
 		{"min-measurements",   1, NULL,               11},
 		{"ignore-negs",        0, &config_ignorenegs,  1},
 		{"zero-negs",          0, &config_zeronegs,    1},
+		{"deterministic",      0, &deterministic,      1},
 		{0, 0, NULL, 0}
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "hy:p:u",
+	while ((c = getopt_long(argc, argv, "hy:p:uj:",
 	                        longopts, NULL)) != -1)
 	{
 
@@ -489,6 +495,15 @@ int main(int argc, char *argv[])
 			}
 			break;
 
+			case 'j' :
+			if ( (sscanf(optarg, "%i", &n_threads) != 1)
+			  || (n_threads < 1) )
+			{
+				ERROR("Invalid value for -j\n");
+				return 1;
+			}
+			break;
+
 			case '?' :
 			break;
 
@@ -505,6 +520,8 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	set_deterministic_reductions(deterministic);
+
 	if ( !config_ignorenegs && !config_zeronegs ) {
 		switch ( fom )
 		{
@@ -740,7 +757,7 @@ int main(int argc, char *argv[])
 		       rmin/1e9, rmax/1e9, 1e10/rmin, 1e10/rmax);
 	}
 	do_fom(list1_acc, list2_acc, cell, rmin, rmax, fom, config_unity,
-	       nshells, shell_file, sym);
+	       nshells, shell_file, sym, n_threads);
 
 	free(shell_file);
 	reflist_free(list1_acc);
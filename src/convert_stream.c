@@ -0,0 +1,231 @@
+/*
+ * convert_stream.c
+ *
+ * Convert streams between the text and binary formats
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <image.h>
+#include <utils.h>
+#include <stream.h>
+#include <datatemplate.h>
+
+#include "version.h"
+
+
+static void show_help(const char *s)
+{
+	printf("Syntax: %s [options] -i input.stream -o output.stream\n\n", s);
+	printf(
+"Convert a stream between the text and binary formats.\n"
+"\n"
+"  -h, --help                 Display this help message.\n"
+"      --version              Print CrystFEL version number and exit.\n"
+"\n"
+"  -i, --input=<file>         Input stream (text, binary or manifest).\n"
+"  -o, --output=<file>        Output stream.\n"
+"      --binary               Write the output in the binary format.\n"
+"      --text                 Write the output in the text format.\n"
+"\n"
+"By default, the output is in the opposite format to the input.\n"
+);
+}
+
+
+/* Copies the audit information and geometry file from the input stream */
+static void copy_headers(Stream *out, Stream *in)
+{
+	FILE *fh = stream_get_fh(out);
+	char *audit;
+	const char *geom;
+
+	audit = stream_audit_info(in);
+	if ( audit != NULL ) {
+		fputs(audit, fh);
+		free(audit);
+	}
+
+	geom = stream_geometry_file(in);
+	if ( geom != NULL ) {
+		fprintf(fh, STREAM_GEOM_START_MARKER"\n");
+		fputs(geom, fh);
+		fprintf(fh, STREAM_GEOM_END_MARKER"\n");
+	}
+	fflush(fh);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c;
+	char *infile = NULL;
+	char *outfile = NULL;
+	int format = -1;
+	int binary;
+	Stream *in;
+	Stream *out;
+	DataTemplate *dtempl;
+	StreamFlags srf;
+	int n_chunks = 0;
+	int r = 0;
+
+	/* Long options */
+	const struct option longopts[] = {
+		{"help",               0, NULL,               'h'},
+		{"version",            0, NULL,                2 },
+		{"input",              1, NULL,               'i'},
+		{"output",             1, NULL,               'o'},
+		{"binary",             0, &format,             1 },
+		{"text",               0, &format,             0 },
+		{0, 0, NULL, 0}
+	};
+
+	/* Short options */
+	while ((c = getopt_long(argc, argv, "hi:o:",
+	                        longopts, NULL)) != -1) {
+
+		switch (c) {
+
+			case 'h' :
+			show_help(argv[0]);
+			return 0;
+
+			case 2 :
+			printf("CrystFEL: %s\n",
+			       crystfel_version_string());
+			printf("%s\n",
+			       crystfel_licence_string());
+			return 0;
+
+			case 'i' :
+			infile = strdup(optarg);
+			break;
+
+			case 'o' :
+			outfile = strdup(optarg);
+			break;
+
+			case 0 :
+			break;
+
+			case '?' :
+			break;
+
+			default :
+			ERROR("Unhandled option '%c'\n", c);
+			break;
+
+		}
+
+	}
+
+	if ( (infile == NULL) || (outfile == NULL) ) {
+		ERROR("You must specify the input and output filenames.\n");
+		return 1;
+	}
+
+	in = stream_open_for_read(infile);
+	if ( in == NULL ) {
+		ERROR("Failed to open input stream '%s'\n", infile);
+		return 1;
+	}
+
+	if ( stream_geometry_file(in) == NULL ) {
+		ERROR("Input stream does not contain a geometry file.\n");
+		stream_close(in);
+		return 1;
+	}
+
+	dtempl = data_template_new_from_string(stream_geometry_file(in));
+	if ( dtempl == NULL ) {
+		ERROR("Failed to read geometry from input stream.\n");
+		stream_close(in);
+		return 1;
+	}
+
+	if ( format == -1 ) {
+		binary = !stream_is_binary(in);
+	} else {
+		binary = format;
+	}
+
+	if ( binary ) {
+		out = stream_open_for_write_binary(outfile, dtempl);
+	} else {
+		out = stream_open_for_write(outfile, dtempl);
+	}
+	if ( out == NULL ) {
+		ERROR("Failed to open output stream '%s'\n", outfile);
+		stream_close(in);
+		return 1;
+	}
+
+	copy_headers(out, in);
+
+	/* The text format needs the detector geometry to calculate the
+	 * resolution of each peak */
+	srf = STREAM_PEAKS | STREAM_REFLECTIONS;
+	if ( !binary ) srf |= STREAM_DATA_DETGEOM;
+
+	do {
+
+		struct image *image;
+
+		image = stream_read_chunk(in, srf);
+		if ( image == NULL ) break;
+
+		if ( stream_write_chunk(out, image, srf) ) {
+			ERROR("Failed to write chunk for %s %s\n",
+			      image->filename, image->ev);
+			r = 1;
+		}
+
+		image_free(image);
+		n_chunks++;
+
+	} while ( !r );
+
+	STATUS("Converted %i chunks to the %s format.\n",
+	       n_chunks, binary ? "binary" : "text");
+
+	stream_close(out);
+	stream_close(in);
+	data_template_free(dtempl);
+	free(infile);
+	free(outfile);
+
+	return r;
+}
@@ -62,6 +62,11 @@
 #include "version.h"
 
 
+/* The image being displayed, the ones either side of it, and a couple more
+ * for going back and forth */
+#define GUI_IMAGE_CACHE_SIZE (5)
+
+
 static void show_help(const char *s)
 {
 	printf("Syntax: %s [data.stream]\n\n", s);
@@ -139,7 +144,7 @@ static void add_ui_sig(GtkUIManager *ui, GtkWidget *widget,
 static void swap_data_arrays(struct image *a, struct image *b)
 {
 	float **swap;
-	int **swap_bad;
+	uint8_t **swap_bad;
 
 	if ( (a==NULL) || (b==NULL) ) return;
 
@@ -191,6 +196,42 @@ static int should_rescan_streams(struct crystfelproject *proj)
 }
 
 
+/* Gives the displayed image back to the cache */
+static void release_cur_image(struct crystfelproject *proj)
+{
+	if ( proj->cur_image != proj->cur_loaded_image ) {
+		/* Return the borrowed data arrays */
+		swap_data_arrays(proj->cur_loaded_image, proj->cur_image);
+		image_free(proj->cur_image);
+	}
+	gui_image_cache_release(proj->image_cache, proj->cur_loaded_image);
+	proj->cur_image = NULL;
+	proj->cur_loaded_image = NULL;
+}
+
+
+static void prefetch_frame(struct crystfelproject *proj, int frame)
+{
+	if ( (frame < 0) || (frame >= proj->n_frames) ) return;
+	gui_image_cache_prefetch(proj->image_cache, proj->dtempl,
+	                         proj->filenames[frame],
+	                         proj->events[frame]);
+}
+
+
+static void update_frame_buttons(struct crystfelproject *proj)
+{
+	gtk_widget_set_sensitive(proj->next_button,
+	                         !(proj->cur_frame == proj->n_frames-1));
+	gtk_widget_set_sensitive(proj->last_button,
+	                         !(proj->cur_frame == proj->n_frames-1));
+	gtk_widget_set_sensitive(proj->prev_button,
+	                         !(proj->cur_frame == 0));
+	gtk_widget_set_sensitive(proj->first_button,
+	                         !(proj->cur_frame == 0));
+}
+
+
 /* Bring the image view up to date after changing the selected image */
 void update_imageview(struct crystfelproject *proj)
 {
@@ -199,6 +240,7 @@ void update_imageview(struct crystfelproject *proj)
 	char *ev_sep;
 	struct image *image;
 	const gchar *results_name;
+	int loading = 0;
 
 	if ( proj->image_info == NULL ) return;
 
@@ -213,10 +255,10 @@ void update_imageview(struct crystfelproject *proj)
 	}
 
 	if ( file_exists(proj->filenames[proj->cur_frame]) ) {
-		image = image_read(proj->dtempl,
-		                   proj->filenames[proj->cur_frame],
-		                   proj->events[proj->cur_frame],
-		                   0, 0, NULL);
+		image = gui_image_cache_get(proj->image_cache, proj->dtempl,
+		                            proj->filenames[proj->cur_frame],
+		                            proj->events[proj->cur_frame],
+		                            &loading);
 	} else {
 		STATUS("Image data file not present.\n");
 		image = NULL;
@@ -235,32 +277,46 @@ void update_imageview(struct crystfelproject *proj)
 	         ev_str,
 	         proj->cur_frame+1,
 	         proj->n_frames,
-		 (image==NULL)?", load error":"");
+	         loading ? ", loading" : ((image==NULL)?", load error":""));
 	gtk_label_set_text(GTK_LABEL(proj->image_info), tmp);
 
+	update_frame_buttons(proj);
+
+	/* Read the neighbouring frames while the user looks at this one */
+	prefetch_frame(proj, proj->cur_frame+1);
+	prefetch_frame(proj, proj->cur_frame-1);
+
+	/* Keep showing the old image until the new one arrives.  This
+	 * function will be called again when it does. */
+	if ( loading ) return;
+
 	/* Give CrystFELImageView a chance to free resources */
 	crystfel_image_view_set_image(CRYSTFEL_IMAGE_VIEW(proj->imageview),
 	                              NULL);
-	image_free(proj->cur_image);
+	release_cur_image(proj);
 	proj->cur_image = image;
+	proj->cur_loaded_image = image;
 
 	/* Look up results, if applicable */
 	results_name = gtk_combo_box_get_active_id(GTK_COMBO_BOX(proj->results_combo));
 	if ( strcmp(results_name, "crystfel-gui-internal") == 0 ) {
-		update_peaks(proj);
+		update_peaks_background(proj);
 	} else {
 		struct image *res_im;
+		int scanning;
 
 		res_im = find_indexed_image(proj,
 		                            results_name,
 		                            proj->filenames[proj->cur_frame],
 		                            proj->events[proj->cur_frame],
-		                            should_rescan_streams(proj));
+		                            should_rescan_streams(proj),
+		                            &scanning);
 		if ( res_im != NULL ) {
+			/* Borrow the data arrays from the loaded image, until
+			 * release_cur_image() */
 			swap_data_arrays(image, res_im);
-			image_free(proj->cur_image);
 			proj->cur_image = res_im;
-		} else {
+		} else if ( !scanning ) {
 			ERROR("Failed to load chunk from stream.  "
 			      "Just displaying the image.\n");
 		}
@@ -286,15 +342,13 @@ void update_imageview(struct crystfelproject *proj)
 	if ( !proj->range_set ) {
 		crystfel_colour_scale_auto_range(CRYSTFEL_COLOUR_SCALE(proj->colscale));
 	}
+}
 
-	gtk_widget_set_sensitive(proj->next_button,
-	                         !(proj->cur_frame == proj->n_frames-1));
-	gtk_widget_set_sensitive(proj->last_button,
-	                         !(proj->cur_frame == proj->n_frames-1));
-	gtk_widget_set_sensitive(proj->prev_button,
-	                         !(proj->cur_frame == 0));
-	gtk_widget_set_sensitive(proj->first_button,
-	                         !(proj->cur_frame == 0));
+
+static gboolean image_loaded_sig(gpointer vp)
+{
+	update_imageview(vp);
+	return G_SOURCE_REMOVE;
 }
 
 
@@ -553,7 +607,7 @@ static gint rescan_sig(GtkWidget *widget, struct crystfelproject *proj)
 {
 	struct gui_indexing_result *res = current_result(proj);
 	if ( res != NULL ) {
-		update_result_index(res);
+		update_result_index(proj, res);
 	}
 	return FALSE;
 }
@@ -1010,13 +1064,11 @@ static void add_task_buttons(GtkWidget *vbox, struct crystfelproject *proj)
 }
 
 
-static void add_gui_message(enum log_msg_type type, const char *msg,
-                            void *vp)
+static void insert_gui_message(struct crystfelproject *proj, const char *msg)
 {
 	GtkTextBuffer *buf;
 	GtkTextIter iter;
 	GtkTextMark *mark;
-	struct crystfelproject *proj = vp;
 
 	buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(proj->report));
 	gtk_text_buffer_get_end_iter(buf, &iter);
@@ -1031,6 +1083,48 @@ static void add_gui_message(enum log_msg_type type, const char *msg,
 }
 
 
+struct gui_message
+{
+	struct crystfelproject *proj;
+	char *msg;
+};
+
+
+static gboolean insert_gui_message_idle(gpointer vp)
+{
+	struct gui_message *m = vp;
+	insert_gui_message(m->proj, m->msg);
+	free(m->msg);
+	free(m);
+	return G_SOURCE_REMOVE;
+}
+
+
+static void add_gui_message(enum log_msg_type type, const char *msg,
+                            void *vp)
+{
+	struct crystfelproject *proj = vp;
+	struct gui_message *m;
+
+	if ( g_main_context_is_owner(g_main_context_default()) ) {
+		insert_gui_message(proj, msg);
+		return;
+	}
+
+	/* Messages from other threads, e.g. the image loader, have to be
+	 * added to the text buffer in the main loop */
+	m = malloc(sizeof(struct gui_message));
+	if ( m == NULL ) return;
+	m->proj = proj;
+	m->msg = strdup(msg);
+	if ( m->msg == NULL ) {
+		free(m);
+		return;
+	}
+	g_idle_add(insert_gui_message_idle, m);
+}
+
+
 static void clear_log_sig(GtkMenuItem *widget,
                           struct crystfelproject *proj)
 {
@@ -1281,6 +1375,9 @@ int main(int argc, char *argv[])
 	/* Main area stuff (toolbar and imageview) at right */
 	proj.imageview = crystfel_image_view_new();
 	proj.cur_frame = 0;
+	proj.image_cache = gui_image_cache_new(GUI_IMAGE_CACHE_SIZE,
+	                                       image_loaded_sig, &proj);
+	proj.peak_preview = peak_preview_new(&proj);
 	frame = gtk_frame_new(NULL);
 	gtk_frame_set_shadow_type(GTK_FRAME(frame), GTK_SHADOW_IN);
 
@@ -1386,6 +1483,10 @@ int main(int argc, char *argv[])
 	gtk_widget_show_all(proj.window);
 	gtk_main();
 
+	peak_preview_free(proj.peak_preview);
+	release_cur_image(&proj);
+	gui_image_cache_free(proj.image_cache);
+
 	return 0;
 }
 
@@ -38,6 +38,10 @@
 #include <glib-object.h>
 #include <gsl/gsl_statistics_float.h>
 
+#ifdef HAVE_EPOXY
+#include <epoxy/gl.h>
+#endif
+
 #include <utils.h>
 #include <detgeom.h>
 #include <colscale.h>
@@ -45,7 +49,52 @@
 #include "crystfelimageview.h"
 
 
+/* Number of resolutions at which each panel is kept.  Each level after the
+ * first is binned by a factor of two from the one before, so that zoomed-out
+ * views don't have to scale down the whole panel for every redraw. */
+#define MAX_PANEL_LEVELS (7)
+
+/* Number of entries in the colour scale lookup table */
+#define COLOUR_LUT_SIZE (4096)
+
+/* Number of rows handled by each task when binning or colouring a panel */
+#define STRIPE_ROWS (64)
+
+
+struct imageview_panel
+{
+	int         n_levels;
+
+	/* data[0] and bad[0] belong to the image */
+	int         w[MAX_PANEL_LEVELS];
+	int         h[MAX_PANEL_LEVELS];
+	float      *data[MAX_PANEL_LEVELS];
+	uint8_t    *bad[MAX_PANEL_LEVELS];
+	GdkPixbuf  *pixbufs[MAX_PANEL_LEVELS];
+};
+
+
 static int rerender_image(CrystFELImageView *iv);
+static int recolour_panels(CrystFELImageView *iv);
+
+#ifdef HAVE_EPOXY
+static void gl_init(CrystFELImageView *iv);
+static void gl_free(CrystFELImageView *iv);
+static void gl_forget_image(CrystFELImageView *iv);
+static int gl_draw_panels(CrystFELImageView *iv, cairo_t *cr);
+#endif
+
+
+/* Returns non-zero if the panels are being drawn with OpenGL, in which case
+ * the pixbufs are not needed */
+static int using_gl(CrystFELImageView *iv)
+{
+#ifdef HAVE_EPOXY
+	return iv->gl != NULL;
+#else
+	return 0;
+#endif
+}
 
 
 static void scroll_interface_init(GtkScrollable *iface)
@@ -79,24 +128,41 @@ static void redraw(CrystFELImageView *iv)
 
 static void cleanup_image(CrystFELImageView *iv)
 {
-	if ( iv->pixbufs != NULL ) {
+#ifdef HAVE_EPOXY
+	gl_forget_image(iv);
+#endif
+
+	if ( iv->panels != NULL ) {
 		int i;
-		for ( i=0; i<iv->image->detgeom->n_panels; i++ ) {
-			if ( iv->pixbufs[i] != NULL ) {
-				gdk_pixbuf_unref(iv->pixbufs[i]);
+		for ( i=0; i<iv->n_panels; i++ ) {
+			int k;
+			struct imageview_panel *pn = &iv->panels[i];
+			for ( k=0; k<pn->n_levels; k++ ) {
+				if ( pn->pixbufs[k] != NULL ) {
+					gdk_pixbuf_unref(pn->pixbufs[k]);
+				}
+				if ( k == 0 ) continue;
+				free(pn->data[k]);
+				free(pn->bad[k]);
 			}
 		}
 	}
-	free(iv->pixbufs);
+	free(iv->panels);
 
 	iv->image = NULL;
-	iv->pixbufs = NULL;
+	iv->panels = NULL;
+	iv->n_panels = 0;
 }
 
 
 static gint destroy_sig(GtkWidget *window, CrystFELImageView *iv)
 {
 	cleanup_image(iv);
+#ifdef HAVE_EPOXY
+	gl_free(iv);
+#endif
+	thread_pool_free(iv->pool);
+	iv->pool = NULL;
 	return FALSE;
 }
 
@@ -107,6 +173,17 @@ static gint realise_sig(GtkWidget *window, CrystFELImageView *iv)
 }
 
 
+/* The GL context belongs to the GdkWindow, which is about to go away */
+static gint unrealise_sig(GtkWidget *window, CrystFELImageView *iv)
+{
+#ifdef HAVE_EPOXY
+	gl_free(iv);
+	iv->gl_failed = 0;
+#endif
+	return FALSE;
+}
+
+
 static void configure_scroll_adjustments(CrystFELImageView *iv)
 {
 	if ( iv->hadj != NULL ) {
@@ -237,7 +314,7 @@ static void draw_pixel_values(cairo_t *cr,
                               int min_fs, int max_fs,
                               int min_ss, int max_ss,
                               struct detgeom_panel p, float *dp,
-                              int *bad)
+                              uint8_t *bad)
 {
 	int fs, ss;
 	PangoLayout *layout;
@@ -341,14 +418,114 @@ static void check_pixel_visibility(cairo_matrix_t *gtkmatrix,
 }
 
 
+/* The part of the detector which is visible, in metres */
+struct visible_region
+{
+	double min_x;
+	double max_x;
+	double min_y;
+	double max_y;
+};
+
+
+static void add_visible_point(cairo_matrix_t *gtkmatrix, cairo_t *cr,
+                              double x, double y,
+                              struct visible_region *vis)
+{
+	cairo_matrix_transform_point(gtkmatrix, &x, &y);
+	cairo_device_to_user(cr, &x, &y);
+
+	if ( x < vis->min_x ) vis->min_x = x;
+	if ( x > vis->max_x ) vis->max_x = x;
+	if ( y < vis->min_y ) vis->min_y = y;
+	if ( y > vis->max_y ) vis->max_y = y;
+}
+
+
+static void get_visible_region(cairo_t *cr, cairo_matrix_t *gtkmatrix,
+                               CrystFELImageView *iv,
+                               struct visible_region *vis)
+{
+	vis->min_x = +INFINITY;
+	vis->max_x = -INFINITY;
+	vis->min_y = +INFINITY;
+	vis->max_y = -INFINITY;
+	add_visible_point(gtkmatrix, cr, 0.0, 0.0, vis);
+	add_visible_point(gtkmatrix, cr, 0.0, iv->visible_height, vis);
+	add_visible_point(gtkmatrix, cr, iv->visible_width, 0.0, vis);
+	add_visible_point(gtkmatrix, cr, iv->visible_width,
+	                  iv->visible_height, vis);
+}
+
+
+static int is_visible(const struct visible_region *vis, double x, double y,
+                      double margin)
+{
+	return (x > vis->min_x - margin) && (x < vis->max_x + margin)
+	    && (y > vis->min_y - margin) && (y < vis->max_y + margin);
+}
+
+
+static void check_extents(struct detgeom_panel p, double *min_x, double *min_y,
+                          double *max_x, double *max_y, double fs, double ss)
+{
+	double xs, ys;
+
+	xs = (fs*p.fsx + ss*p.ssx + p.cnx) * p.pixel_pitch;
+	ys = (fs*p.fsy + ss*p.ssy + p.cny) * p.pixel_pitch;
+
+	if ( xs > *max_x ) *max_x = xs;
+	if ( ys > *max_y ) *max_y = ys;
+	if ( xs < *min_x ) *min_x = xs;
+	if ( ys < *min_y ) *min_y = ys;
+}
+
+
+static int panel_visible(struct detgeom_panel p,
+                         const struct visible_region *vis)
+{
+	double min_x = +INFINITY;
+	double max_x = -INFINITY;
+	double min_y = +INFINITY;
+	double max_y = -INFINITY;
+
+	check_extents(p, &min_x, &min_y, &max_x, &max_y, 0.0, 0.0);
+	check_extents(p, &min_x, &min_y, &max_x, &max_y, 0.0, p.h);
+	check_extents(p, &min_x, &min_y, &max_x, &max_y, p.w, 0.0);
+	check_extents(p, &min_x, &min_y, &max_x, &max_y, p.w, p.h);
+
+	return (max_x > vis->min_x) && (min_x < vis->max_x)
+	    && (max_y > vis->min_y) && (min_y < vis->max_y);
+}
+
+
 static void draw_panel_rectangle(cairo_t *cr, CrystFELImageView *iv,
-                                 int i, cairo_matrix_t *gtkmatrix)
+                                 int i, cairo_matrix_t *gtkmatrix,
+                                 int fill)
 {
 	struct detgeom_panel p = iv->image->detgeom->panels[i];
+	struct imageview_panel *pn = &iv->panels[i];
 	cairo_matrix_t m;
 	cairo_pattern_t *patt;
 	double xs, ys, pixel_size_on_screen;
 	int have_pixels = 1;
+	int level;
+	double bin;
+
+	xs = p.pixel_pitch;
+	ys = p.pixel_pitch;
+	cairo_user_to_device_distance(cr, &xs, &ys);
+	pixel_size_on_screen = smallest(fabs(xs), fabs(ys));
+
+	/* Use the most binned version of the panel whose pixels are still
+	 * no bigger than the pixels on the screen */
+	level = 0;
+	while ( (level+1 < pn->n_levels)
+	     && (pixel_size_on_screen*(1<<(level+1)) <= 1.0) )
+	{
+		level++;
+	}
+	bin = 1<<level;
 
 	cairo_save(cr);
 
@@ -360,17 +537,26 @@ static void draw_panel_rectangle(cairo_t *cr, CrystFELImageView *iv,
 	                      0.0, 0.0);
 	cairo_transform(cr, &m);
 
-	gdk_cairo_set_source_pixbuf(cr, iv->pixbufs[i], 0.0, 0.0);
-	patt = cairo_get_source(cr);
+	cairo_rectangle(cr, 0.0, 0.0, p.w*p.pixel_pitch, p.h*p.pixel_pitch);
 
-	cairo_pattern_get_matrix(patt, &m);
-	cairo_matrix_scale(&m, 1.0/p.pixel_pitch, 1.0/p.pixel_pitch);
-	cairo_pattern_set_matrix(patt, &m);
+	/* If the panel was already drawn using OpenGL, only the outline is
+	 * needed */
+	if ( fill ) {
 
-	cairo_pattern_set_filter(patt, CAIRO_FILTER_NEAREST);
+		gdk_cairo_set_source_pixbuf(cr, pn->pixbufs[level], 0.0, 0.0);
+		patt = cairo_get_source(cr);
+
+		cairo_pattern_get_matrix(patt, &m);
+		cairo_matrix_scale(&m, 1.0/(bin*p.pixel_pitch),
+		                       1.0/(bin*p.pixel_pitch));
+		cairo_pattern_set_matrix(patt, &m);
+
+		cairo_pattern_set_filter(patt, CAIRO_FILTER_NEAREST);
+
+		cairo_fill_preserve(cr);
+
+	}
 
-	cairo_rectangle(cr, 0.0, 0.0, p.w*p.pixel_pitch, p.h*p.pixel_pitch);
-	cairo_fill_preserve(cr);
 	cairo_set_line_width(cr, 0.00001);
 	cairo_set_source_rgb(cr, 1.0, 0.0, 0.0);
 	cairo_stroke(cr);
@@ -391,10 +577,6 @@ static void draw_panel_rectangle(cairo_t *cr, CrystFELImageView *iv,
 
 	cairo_restore(cr);
 
-	xs = p.pixel_pitch;
-	ys = p.pixel_pitch;
-	cairo_user_to_device_distance(cr, &xs, &ys);
-	pixel_size_on_screen = smallest(fabs(xs), fabs(ys));
 	if ( (pixel_size_on_screen > 40.0) && have_pixels ) {
 		draw_pixel_values(cr, min_fs, max_fs, min_ss, max_ss, p,
 		                  iv->image->dp[i], iv->image->bad[i]);
@@ -403,7 +585,8 @@ static void draw_panel_rectangle(cairo_t *cr, CrystFELImageView *iv,
 
 
 static void draw_peaks(cairo_t *cr, CrystFELImageView *iv,
-                       ImageFeatureList *pks)
+                       ImageFeatureList *pks,
+                       const struct visible_region *vis)
 {
 	int i, n_pks;
 	double bs, lw;
@@ -438,6 +621,8 @@ static void draw_peaks(cairo_t *cr, CrystFELImageView *iv,
 
 		x = p->pixel_pitch*(p->cnx + p->fsx*f->fs + p->ssx*f->ss);
 		y = p->pixel_pitch*(p->cny + p->fsy*f->fs + p->ssy*f->ss);
+		if ( !is_visible(vis, x, y, this_bs) ) continue;
+
 		cairo_rectangle(cr, x-this_bs, y-this_bs, 2*this_bs, 2*this_bs);
 		cairo_set_line_width(cr, this_lw);
 		cairo_set_source_rgba(cr, 1.0, 1.0, 0.0, 0.9);
@@ -516,7 +701,8 @@ static void draw_refls(cairo_t *cr,
                        CrystFELImageView *iv,
                        RefList *list,
                        int label_reflections,
-                       double *colour)
+                       double *colour,
+                       const struct visible_region *vis)
 {
 	const Reflection *refl;
 	RefListIterator *iter;
@@ -556,6 +742,11 @@ static void draw_refls(cairo_t *cr,
 		x = p->pixel_pitch*(p->cnx + p->fsx*fs + p->ssx*ss);
 		y = p->pixel_pitch*(p->cny + p->fsy*fs + p->ssy*ss);
 
+		/* Leave room for the label, which is drawn to the right */
+		if ( !is_visible(vis, x, y, label_reflections
+		                              ? this_bs + 100.0*p->pixel_pitch
+		                              : this_bs) ) continue;
+
 		cairo_arc(cr, x, y, this_bs, 0, 2*M_PI);
 		cairo_set_line_width(cr, this_lw);
 
@@ -659,8 +850,15 @@ static int n_crystal_cols = 4;
 static gint draw_sig(GtkWidget *window, cairo_t *cr, CrystFELImageView *iv)
 {
 	cairo_matrix_t m;
+	struct visible_region vis;
+	int panels_drawn = 0;
 
 	if ( iv->image == NULL ) return FALSE;
+
+#ifdef HAVE_EPOXY
+	if ( (iv->gl == NULL) && !iv->gl_failed ) gl_init(iv);
+#endif
+
 	if ( iv->need_rerender ) rerender_image(iv);
 
 	cairo_save(cr);
@@ -669,6 +867,21 @@ static gint draw_sig(GtkWidget *window, cairo_t *cr, CrystFELImageView *iv)
 	cairo_set_source_rgb(cr, 0.7, 0.7, 0.7);
 	cairo_paint(cr);
 
+#ifdef HAVE_EPOXY
+	if ( (iv->gl != NULL) && (iv->panels != NULL) ) {
+		if ( gl_draw_panels(iv, cr) == 0 ) {
+			panels_drawn = 1;
+		} else {
+			/* Carry on with Cairo from now on */
+			fprintf(stderr, "OpenGL rendering failed - "
+			                "falling back to Cairo.\n");
+			gl_free(iv);
+			iv->gl_failed = 1;
+			recolour_panels(iv);
+		}
+	}
+#endif
+
 	/* Get the transformation matrix before my transformations */
 	cairo_get_matrix(cr, &m);
 
@@ -678,11 +891,15 @@ static gint draw_sig(GtkWidget *window, cairo_t *cr, CrystFELImageView *iv)
 	cairo_translate(cr, -gtk_adjustment_get_value(iv->hadj),
 	                     gtk_adjustment_get_value(iv->vadj));
 
-	if ( iv->pixbufs != NULL ) {
+	get_visible_region(cr, &m, iv, &vis);
+
+	if ( iv->panels != NULL ) {
 		int i;
-		for ( i=0; i<iv->image->detgeom->n_panels; i++ ) {
+		for ( i=0; i<iv->n_panels; i++ ) {
+			if ( !panel_visible(iv->image->detgeom->panels[i],
+			                    &vis) ) continue;
 			cairo_save(cr);
-			draw_panel_rectangle(cr, iv, i, &m);
+			draw_panel_rectangle(cr, iv, i, &m, !panels_drawn);
 			cairo_restore(cr);
 		}
 	}
@@ -701,7 +918,7 @@ static gint draw_sig(GtkWidget *window, cairo_t *cr, CrystFELImageView *iv)
 	}
 
 	if ( iv->show_peaks ) {
-		draw_peaks(cr, iv, iv->image->features);
+		draw_peaks(cr, iv, iv->image->features, &vis);
 	}
 
 	if ( iv->show_refls ) {
@@ -710,7 +927,7 @@ static gint draw_sig(GtkWidget *window, cairo_t *cr, CrystFELImageView *iv)
 			draw_refls(cr, iv,
 			           iv->image->crystals[i].refls,
 			           iv->label_refls,
-			           crystal_cols[i % n_crystal_cols]);
+			           crystal_cols[i % n_crystal_cols], &vis);
 		}
 	}
 
@@ -900,11 +1117,16 @@ GtkWidget *crystfel_image_view_new()
 	iv->show_centre = 1;
 	iv->show_peaks = 0;
 	iv->brightness = 1.0;
-	iv->pixbufs = NULL;
+	iv->n_panels = 0;
+	iv->panels = NULL;
+	iv->pool = NULL;
+	iv->gl = NULL;
+	iv->gl_failed = 0;
 	iv->peak_box_size = 1.0;
 	iv->refl_box_size = 1.0;
 	iv->label_refls = 1;
 	iv->need_rerender = 0;
+	iv->need_recolour = 0;
 	iv->need_recentre = 1;
 	iv->resolution_rings = 0;
 	iv->scale_lo = 0.0;
@@ -914,6 +1136,8 @@ GtkWidget *crystfel_image_view_new()
 	                 G_CALLBACK(destroy_sig), iv);
 	g_signal_connect(G_OBJECT(iv), "realize",
 	                 G_CALLBACK(realise_sig), iv);
+	g_signal_connect(G_OBJECT(iv), "unrealize",
+	                 G_CALLBACK(unrealise_sig), iv);
 	g_signal_connect(G_OBJECT(iv), "button-press-event",
 	                 G_CALLBACK(button_press_sig), iv);
 	g_signal_connect(G_OBJECT(iv), "scroll-event",
@@ -941,21 +1165,6 @@ GtkWidget *crystfel_image_view_new()
 }
 
 
-static void check_extents(struct detgeom_panel p, double *min_x, double *min_y,
-                          double *max_x, double *max_y, double fs, double ss)
-{
-	double xs, ys;
-
-	xs = (fs*p.fsx + ss*p.ssx + p.cnx) * p.pixel_pitch;
-	ys = (fs*p.fsy + ss*p.ssy + p.cny) * p.pixel_pitch;
-
-	if ( xs > *max_x ) *max_x = xs;
-	if ( ys > *max_y ) *max_y = ys;
-	if ( xs < *min_x ) *min_x = xs;
-	if ( ys < *min_y ) *min_y = ys;
-}
-
-
 static void detgeom_pixel_extents(struct detgeom *det,
                                   double *min_x, double *min_y,
                                   double *max_x, double *max_y)
@@ -996,51 +1205,779 @@ static void free_pixbuf(guchar *data, gpointer p)
 }
 
 
-static GdkPixbuf *render_panel(float *data, int *badmap, int w, int h,
-                               int scale_type, double scale_lo, double scale_hi)
+struct colour_lut
+{
+	double  min;
+	double  scale;
+	guchar  rgb[3*COLOUR_LUT_SIZE];
+};
 
 
+static guchar colour_byte(double v)
 {
-	guchar *pixbuf_data;
-	long int i;
+	if ( v < 0.0 ) return 0;
+	if ( v > 1.0 ) return 255;
+	return 255*v;
+}
+
+
+static void make_colour_lut(struct colour_lut *lut, int scale_type,
+                            double scale_lo, double scale_hi)
+{
+	int i;
+	double range = scale_hi - scale_lo;
 
-	/* Rendered (colourful) version */
-	pixbuf_data = malloc(3*w*h);
-	if ( pixbuf_data == NULL ) return NULL;
+	if ( !(range > 0.0) ) range = 1.0;
 
-	for ( i=0; i<w*h; i++ ) {
+	/* The table starts one whole range below the lower limit, so that
+	 * negative values get their own colours */
+	lut->min = scale_lo - range;
+	lut->scale = (COLOUR_LUT_SIZE-1) / (2.0*range);
 
+	for ( i=0; i<COLOUR_LUT_SIZE; i++ ) {
 		double r, g, b;
+		double val = lut->min + i/lut->scale;
+		colscale_lookup(val-scale_lo, range, scale_type, &r, &g, &b);
+		lut->rgb[3*i+0] = colour_byte(r);
+		lut->rgb[3*i+1] = colour_byte(g);
+		lut->rgb[3*i+2] = colour_byte(b);
+	}
+}
+
+
+/* A block of rows of one level of one panel, to be binned or coloured */
+struct stripe
+{
+	struct imageview_panel   *panel;
+	int                       level;
+	int                       row_start;
+	int                       row_end;
+	const struct colour_lut  *lut;
+};
+
+
+struct stripe_queue
+{
+	struct stripe  *stripes;
+	int             n_stripes;
+	int             n_started;
+};
+
+
+static void *get_stripe(void *vqargs)
+{
+	struct stripe_queue *q = vqargs;
+	if ( q->n_started >= q->n_stripes ) return NULL;
+	return &q->stripes[q->n_started++];
+}
+
+
+/* Bins 2x2 from the level before, taking the maximum of the good pixels so
+ * that peaks are still visible */
+static void bin_stripe(void *vs, int cookie)
+{
+	struct stripe *s = vs;
+	struct imageview_panel *pn = s->panel;
+	int k = s->level;
+	int pw = pn->w[k-1];
+	int ph = pn->h[k-1];
+	int x, y;
+
+	for ( y=s->row_start; y<s->row_end; y++ ) {
+	for ( x=0; x<pn->w[k]; x++ ) {
+
+		int dx, dy;
+		int have = 0;
+		float max = 0.0;
+
+		for ( dy=0; dy<2; dy++ ) {
+		for ( dx=0; dx<2; dx++ ) {
 
-		if ( !badmap[i] ) {
+			int px = 2*x + dx;
+			int py = 2*y + dy;
+			float val;
 
-			colscale_lookup(data[i]-scale_lo, scale_hi-scale_lo,
-			                scale_type, &r, &g, &b);
+			if ( (px >= pw) || (py >= ph) ) continue;
+			if ( pn->bad[k-1][px+py*pw] ) continue;
 
-			pixbuf_data[3*i+0] = 255*r;
-			pixbuf_data[3*i+1] = 255*g;
-			pixbuf_data[3*i+2] = 255*b;
+			val = pn->data[k-1][px+py*pw];
+			if ( !have || (val > max) ) max = val;
+			have = 1;
+
+		}
+		}
+
+		pn->data[k][x+y*pn->w[k]] = max;
+		pn->bad[k][x+y*pn->w[k]] = !have;
+
+	}
+	}
+}
+
+
+static void colour_stripe(void *vs, int cookie)
+{
+	struct stripe *s = vs;
+	struct imageview_panel *pn = s->panel;
+	const struct colour_lut *lut = s->lut;
+	int k = s->level;
+	guchar *pixels = gdk_pixbuf_get_pixels(pn->pixbufs[k]);
+	int rowstride = gdk_pixbuf_get_rowstride(pn->pixbufs[k]);
+	int x, y;
+
+	for ( y=s->row_start; y<s->row_end; y++ ) {
+	for ( x=0; x<pn->w[k]; x++ ) {
+
+		guchar *pix = pixels + y*rowstride + 3*x;
+		long int i = x + y*pn->w[k];
+
+		if ( !pn->bad[k][i] ) {
+
+			double idx = (pn->data[k][i] - lut->min)*lut->scale;
+			int n;
+
+			if ( !(idx >= 0.0) ) {
+				n = 0;
+			} else if ( idx > COLOUR_LUT_SIZE-1 ) {
+				n = COLOUR_LUT_SIZE-1;
+			} else {
+				n = idx + 0.5;
+			}
+
+			pix[0] = lut->rgb[3*n+0];
+			pix[1] = lut->rgb[3*n+1];
+			pix[2] = lut->rgb[3*n+2];
 
 		} else {
 
 			/* Bad pixel indicator colour */
-			pixbuf_data[3*i+0] = 30;
-			pixbuf_data[3*i+1] = 20;
-			pixbuf_data[3*i+2] = 0;
+			pix[0] = 30;
+			pix[1] = 20;
+			pix[2] = 0;
 
 		}
 
 	}
+	}
+}
 
-	/* Create the pixbuf from the 8-bit display data */
-	return gdk_pixbuf_new_from_data(pixbuf_data,
-	                                GDK_COLORSPACE_RGB,
-	                                FALSE, 8, w, h, w*3,
-	                                free_pixbuf, NULL);
 
+/* Runs 'work' for every stripe of the given level (or all levels, if 'level'
+ * is negative) of all panels */
+static int run_stripes(CrystFELImageView *iv, TPWorkFunc work, int level,
+                       const struct colour_lut *lut)
+{
+	struct stripe_queue q;
+	int i;
+
+	q.n_stripes = 0;
+	for ( i=0; i<iv->n_panels; i++ ) {
+		int k;
+		struct imageview_panel *pn = &iv->panels[i];
+		for ( k=0; k<pn->n_levels; k++ ) {
+			if ( (level >= 0) && (k != level) ) continue;
+			q.n_stripes += (pn->h[k]+STRIPE_ROWS-1)/STRIPE_ROWS;
+		}
+	}
+	if ( q.n_stripes == 0 ) return 0;
+
+	q.stripes = malloc(q.n_stripes*sizeof(struct stripe));
+	if ( q.stripes == NULL ) return 1;
+	q.n_started = 0;
+
+	q.n_stripes = 0;
+	for ( i=0; i<iv->n_panels; i++ ) {
+		int k;
+		struct imageview_panel *pn = &iv->panels[i];
+		for ( k=0; k<pn->n_levels; k++ ) {
+			int row;
+			if ( (level >= 0) && (k != level) ) continue;
+			for ( row=0; row<pn->h[k]; row+=STRIPE_ROWS ) {
+				struct stripe *s = &q.stripes[q.n_stripes++];
+				s->panel = pn;
+				s->level = k;
+				s->row_start = row;
+				s->row_end = smallest(row+STRIPE_ROWS, pn->h[k]);
+				s->lut = lut;
+			}
+		}
+	}
+
+	thread_pool_run(iv->pool, work, get_stripe, NULL, &q, q.n_stripes);
+	free(q.stripes);
+	return 0;
+}
+
+
+/* Sets up the binned versions of each panel */
+static int make_panels(CrystFELImageView *iv)
+{
+	int i, k;
+	int max_levels = 0;
+
+	iv->n_panels = iv->image->detgeom->n_panels;
+	iv->panels = calloc(iv->n_panels, sizeof(struct imageview_panel));
+	if ( iv->panels == NULL ) return 1;
+
+	for ( i=0; i<iv->n_panels; i++ ) {
+
+		struct imageview_panel *pn = &iv->panels[i];
+
+		pn->w[0] = iv->image->detgeom->panels[i].w;
+		pn->h[0] = iv->image->detgeom->panels[i].h;
+		pn->data[0] = iv->image->dp[i];
+		pn->bad[0] = iv->image->bad[i];
+		pn->n_levels = 1;
+
+		/* No point binning panels which are already small */
+		while ( (pn->n_levels < MAX_PANEL_LEVELS)
+		     && (pn->w[pn->n_levels-1] >= 8)
+		     && (pn->h[pn->n_levels-1] >= 8) )
+		{
+			k = pn->n_levels;
+			pn->w[k] = (pn->w[k-1]+1)/2;
+			pn->h[k] = (pn->h[k-1]+1)/2;
+			pn->data[k] = malloc(pn->w[k]*pn->h[k]*sizeof(float));
+			pn->bad[k] = malloc(pn->w[k]*pn->h[k]);
+			pn->n_levels++;
+			if ( (pn->data[k] == NULL) || (pn->bad[k] == NULL) ) {
+				return 1;
+			}
+		}
+
+		if ( pn->n_levels > max_levels ) max_levels = pn->n_levels;
+
+	}
+
+	/* Each level is made from the one before */
+	for ( k=1; k<max_levels; k++ ) {
+		if ( run_stripes(iv, bin_stripe, k, NULL) ) return 1;
+	}
+
+	return 0;
+}
+
+
+/* Pixbufs are only needed when drawing with Cairo, so they are made when the
+ * panels are first coloured in */
+static int make_pixbufs(CrystFELImageView *iv)
+{
+	int i, k;
+
+	for ( i=0; i<iv->n_panels; i++ ) {
+		struct imageview_panel *pn = &iv->panels[i];
+		for ( k=0; k<pn->n_levels; k++ ) {
+			guchar *pixbuf_data;
+			if ( pn->pixbufs[k] != NULL ) continue;
+			pixbuf_data = malloc(3*pn->w[k]*pn->h[k]);
+			if ( pixbuf_data == NULL ) return 1;
+			pn->pixbufs[k] = gdk_pixbuf_new_from_data(pixbuf_data,
+			                                          GDK_COLORSPACE_RGB,
+			                                          FALSE, 8,
+			                                          pn->w[k], pn->h[k],
+			                                          3*pn->w[k],
+			                                          free_pixbuf, NULL);
+			if ( pn->pixbufs[k] == NULL ) {
+				free(pixbuf_data);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+static int recolour_panels(CrystFELImageView *iv)
+{
+	struct colour_lut *lut;
+	int r;
+
+	if ( iv->panels == NULL ) return 0;
+	if ( make_pixbufs(iv) ) return 1;
+
+	lut = malloc(sizeof(struct colour_lut));
+	if ( lut == NULL ) return 1;
+
+	make_colour_lut(lut, SCALE_COLOUR, iv->scale_lo, iv->scale_hi);
+	r = run_stripes(iv, colour_stripe, -1, lut);
+
+	free(lut);
+	return r;
+}
+
+
+#ifdef HAVE_EPOXY
+
+/* OpenGL state.  The panel data are uploaded as floating point textures, and
+ * the colour scale is applied by the fragment shader, so changing the colour
+ * scale or zooming does not require any work on the CPU.  The panels are
+ * rendered into an off-screen buffer, which is then drawn onto the Cairo
+ * context along with everything else. */
+struct imageview_gl
+{
+	GdkGLContext  *context;
+	GLuint         program;
+	GLint          u_view;
+	GLint          u_lut_min;
+	GLint          u_lut_scale;
+	GLuint         vao;
+
+	/* Size of the off-screen buffer */
+	GLuint         fbo;
+	GLuint         rbo;
+	int            fb_w;
+	int            fb_h;
+
+	/* Colour scale (see make_colour_lut) */
+	GLuint         lut_tex;
+	int            lut_valid;
+	double         lut_lo;
+	double         lut_hi;
+	double         lut_min;
+	double         lut_scale;
+
+	/* For the current image.  The textures for each level of each panel
+	 * are uploaded the first time that level is needed */
+	GLuint         vbo;
+	int            n_panels;
+	GLuint        *data_tex;
+	GLuint        *bad_tex;
+};
+
+
+static const char *gl_vertex_shader =
+	"#version 150\n"
+	"in vec2 position;\n"
+	"in vec2 texcoord;\n"
+	"uniform vec4 view;\n"
+	"out vec2 uv;\n"
+	"void main()\n"
+	"{\n"
+	"	gl_Position = vec4(position*view.xy + view.zw, 0.0, 1.0);\n"
+	"	uv = texcoord;\n"
+	"}\n";
+
+
+/* Matches colour_stripe() */
+static const char *gl_fragment_shader =
+	"#version 150\n"
+	"in vec2 uv;\n"
+	"uniform sampler2D data;\n"
+	"uniform sampler2D bad;\n"
+	"uniform sampler2D lut;\n"
+	"uniform float lut_min;\n"
+	"uniform float lut_scale;\n"
+	"out vec4 colour;\n"
+	"void main()\n"
+	"{\n"
+	"	float idx;\n"
+	"	float max_idx = float(textureSize(lut, 0).x - 1);\n"
+	"	if ( texture(bad, uv).r > 0.0 ) {\n"
+	"		colour = vec4(30.0/255.0, 20.0/255.0, 0.0, 1.0);\n"
+	"		return;\n"
+	"	}\n"
+	"	idx = (texture(data, uv).r - lut_min)*lut_scale;\n"
+	"	if ( !(idx >= 0.0) ) idx = 0.0;\n"
+	"	if ( idx > max_idx ) idx = max_idx;\n"
+	"	colour = vec4(texelFetch(lut, ivec2(int(idx+0.5), 0), 0).rgb,\n"
+	"	              1.0);\n"
+	"}\n";
+
+
+static GLuint gl_compile_shader(GLenum type, const char *source)
+{
+	GLuint shader;
+	GLint status;
+
+	shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if ( status == GL_FALSE ) {
+		char log[1024];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		fprintf(stderr, "Failed to compile shader: %s\n", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+
+	return shader;
+}
+
+
+static int gl_make_program(struct imageview_gl *gl)
+{
+	GLuint vs, fs;
+	GLint status;
+
+	vs = gl_compile_shader(GL_VERTEX_SHADER, gl_vertex_shader);
+	if ( vs == 0 ) return 1;
+	fs = gl_compile_shader(GL_FRAGMENT_SHADER, gl_fragment_shader);
+	if ( fs == 0 ) {
+		glDeleteShader(vs);
+		return 1;
+	}
+
+	gl->program = glCreateProgram();
+	glAttachShader(gl->program, vs);
+	glAttachShader(gl->program, fs);
+	glBindAttribLocation(gl->program, 0, "position");
+	glBindAttribLocation(gl->program, 1, "texcoord");
+	glBindFragDataLocation(gl->program, 0, "colour");
+	glLinkProgram(gl->program);
+	glDetachShader(gl->program, vs);
+	glDetachShader(gl->program, fs);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+
+	glGetProgramiv(gl->program, GL_LINK_STATUS, &status);
+	if ( status == GL_FALSE ) {
+		char log[1024];
+		glGetProgramInfoLog(gl->program, sizeof(log), NULL, log);
+		fprintf(stderr, "Failed to link shaders: %s\n", log);
+		return 1;
+	}
+
+	gl->u_view = glGetUniformLocation(gl->program, "view");
+	gl->u_lut_min = glGetUniformLocation(gl->program, "lut_min");
+	gl->u_lut_scale = glGetUniformLocation(gl->program, "lut_scale");
+
+	glUseProgram(gl->program);
+	glUniform1i(glGetUniformLocation(gl->program, "data"), 0);
+	glUniform1i(glGetUniformLocation(gl->program, "bad"), 1);
+	glUniform1i(glGetUniformLocation(gl->program, "lut"), 2);
+
+	return 0;
 }
 
 
+static void gl_init_failed(CrystFELImageView *iv)
+{
+	iv->gl_failed = 1;
+
+	/* The panels might not have been coloured in yet */
+	iv->need_recolour = 1;
+	iv->need_rerender = 1;
+}
+
+
+/* Sets iv->gl if OpenGL can be used, otherwise sets iv->gl_failed */
+static void gl_init(CrystFELImageView *iv)
+{
+	struct imageview_gl *gl;
+	GdkWindow *win;
+	GError *err = NULL;
+
+	win = gtk_widget_get_window(GTK_WIDGET(iv));
+	if ( win == NULL ) return;
+
+	gl = calloc(1, sizeof(struct imageview_gl));
+	if ( gl == NULL ) {
+		gl_init_failed(iv);
+		return;
+	}
+
+	gl->context = gdk_window_create_gl_context(win, &err);
+	if ( gl->context == NULL ) {
+		fprintf(stderr, "Couldn't create OpenGL context: %s\n",
+		        err->message);
+		g_error_free(err);
+		free(gl);
+		gl_init_failed(iv);
+		return;
+	}
+
+	gdk_gl_context_set_required_version(gl->context, 3, 2);
+	if ( !gdk_gl_context_realize(gl->context, &err) ) {
+		fprintf(stderr, "Couldn't realize OpenGL context: %s\n",
+		        err->message);
+		g_error_free(err);
+		g_object_unref(gl->context);
+		free(gl);
+		gl_init_failed(iv);
+		return;
+	}
+
+	iv->gl = gl;
+	gdk_gl_context_make_current(gl->context);
+
+	if ( gl_make_program(gl) ) {
+		gl_free(iv);
+		gl_init_failed(iv);
+		return;
+	}
+
+	glGenVertexArrays(1, &gl->vao);
+	glGenTextures(1, &gl->lut_tex);
+
+	if ( glGetError() != GL_NO_ERROR ) {
+		gl_free(iv);
+		gl_init_failed(iv);
+		return;
+	}
+}
+
+
+/* Deletes everything to do with the current image */
+static void gl_forget_image(CrystFELImageView *iv)
+{
+	struct imageview_gl *gl = iv->gl;
+
+	if ( gl == NULL ) return;
+	gdk_gl_context_make_current(gl->context);
+
+	if ( gl->data_tex != NULL ) {
+		glDeleteTextures(gl->n_panels*MAX_PANEL_LEVELS, gl->data_tex);
+		glDeleteTextures(gl->n_panels*MAX_PANEL_LEVELS, gl->bad_tex);
+	}
+	free(gl->data_tex);
+	free(gl->bad_tex);
+	gl->data_tex = NULL;
+	gl->bad_tex = NULL;
+	gl->n_panels = 0;
+
+	if ( gl->vbo != 0 ) glDeleteBuffers(1, &gl->vbo);
+	gl->vbo = 0;
+}
+
+
+static void gl_free(CrystFELImageView *iv)
+{
+	struct imageview_gl *gl = iv->gl;
+
+	if ( gl == NULL ) return;
+
+	gl_forget_image(iv);
+	if ( gl->fbo != 0 ) glDeleteFramebuffers(1, &gl->fbo);
+	if ( gl->rbo != 0 ) glDeleteRenderbuffers(1, &gl->rbo);
+	if ( gl->lut_tex != 0 ) glDeleteTextures(1, &gl->lut_tex);
+	if ( gl->vao != 0 ) glDeleteVertexArrays(1, &gl->vao);
+	if ( gl->program != 0 ) glDeleteProgram(gl->program);
+
+	gdk_gl_context_clear_current();
+	g_object_unref(gl->context);
+	free(gl);
+	iv->gl = NULL;
+}
+
+
+/* Uploads the corners of each panel, in metres, and the corresponding
+ * texture coordinates */
+static int gl_setup_image(CrystFELImageView *iv)
+{
+	struct imageview_gl *gl = iv->gl;
+	GLfloat *verts;
+	int i;
+
+	gl->n_panels = iv->n_panels;
+	gl->data_tex = calloc(gl->n_panels*MAX_PANEL_LEVELS, sizeof(GLuint));
+	gl->bad_tex = calloc(gl->n_panels*MAX_PANEL_LEVELS, sizeof(GLuint));
+	if ( (gl->data_tex == NULL) || (gl->bad_tex == NULL) ) return 1;
+
+	verts = malloc(gl->n_panels*16*sizeof(GLfloat));
+	if ( verts == NULL ) return 1;
+
+	for ( i=0; i<gl->n_panels; i++ ) {
+
+		struct detgeom_panel *p = &iv->image->detgeom->panels[i];
+		double ox = p->cnx*p->pixel_pitch;
+		double oy = p->cny*p->pixel_pitch;
+		double fx = p->fsx*p->w*p->pixel_pitch;
+		double fy = p->fsy*p->w*p->pixel_pitch;
+		double sx = p->ssx*p->h*p->pixel_pitch;
+		double sy = p->ssy*p->h*p->pixel_pitch;
+		GLfloat *v = &verts[16*i];
+
+		/* Triangle strip: origin, end of fast scan, end of slow scan,
+		 * opposite corner */
+		v[0] = ox;        v[1] = oy;        v[2] = 0.0;   v[3] = 0.0;
+		v[4] = ox+fx;     v[5] = oy+fy;     v[6] = 1.0;   v[7] = 0.0;
+		v[8] = ox+sx;     v[9] = oy+sy;     v[10] = 0.0;  v[11] = 1.0;
+		v[12] = ox+fx+sx; v[13] = oy+fy+sy; v[14] = 1.0;  v[15] = 1.0;
+
+	}
+
+	glBindVertexArray(gl->vao);
+	glGenBuffers(1, &gl->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, gl->vbo);
+	glBufferData(GL_ARRAY_BUFFER, gl->n_panels*16*sizeof(GLfloat), verts,
+	             GL_STATIC_DRAW);
+	free(verts);
+
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4*sizeof(GLfloat),
+	                      (void *)0);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4*sizeof(GLfloat),
+	                      (void *)(2*sizeof(GLfloat)));
+
+	return glGetError() != GL_NO_ERROR;
+}
+
+
+static GLuint gl_make_texture(GLint internal_format, int w, int h,
+                              GLenum format, GLenum type, const void *data)
+{
+	GLuint tex;
+
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, internal_format, w, h, 0,
+	             format, type, data);
+
+	return tex;
+}
+
+
+static int gl_bind_panel(CrystFELImageView *iv, int i, int level)
+{
+	struct imageview_gl *gl = iv->gl;
+	struct imageview_panel *pn = &iv->panels[i];
+	int n = i*MAX_PANEL_LEVELS + level;
+
+	if ( gl->data_tex[n] == 0 ) {
+		gl->data_tex[n] = gl_make_texture(GL_R32F,
+		                                  pn->w[level], pn->h[level],
+		                                  GL_RED, GL_FLOAT,
+		                                  pn->data[level]);
+		gl->bad_tex[n] = gl_make_texture(GL_R8,
+		                                 pn->w[level], pn->h[level],
+		                                 GL_RED, GL_UNSIGNED_BYTE,
+		                                 pn->bad[level]);
+		if ( glGetError() != GL_NO_ERROR ) return 1;
+	}
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, gl->data_tex[n]);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, gl->bad_tex[n]);
+	return 0;
+}
+
+
+static int gl_update_lut(CrystFELImageView *iv)
+{
+	struct imageview_gl *gl = iv->gl;
+	struct colour_lut *lut;
+
+	if ( gl->lut_valid
+	  && (gl->lut_lo == iv->scale_lo)
+	  && (gl->lut_hi == iv->scale_hi) ) return 0;
+
+	lut = malloc(sizeof(struct colour_lut));
+	if ( lut == NULL ) return 1;
+	make_colour_lut(lut, SCALE_COLOUR, iv->scale_lo, iv->scale_hi);
+
+	glDeleteTextures(1, &gl->lut_tex);
+	gl->lut_tex = gl_make_texture(GL_RGB8, COLOUR_LUT_SIZE, 1,
+	                              GL_RGB, GL_UNSIGNED_BYTE, lut->rgb);
+	gl->lut_min = lut->min;
+	gl->lut_scale = lut->scale;
+	gl->lut_lo = iv->scale_lo;
+	gl->lut_hi = iv->scale_hi;
+	gl->lut_valid = 1;
+	free(lut);
+
+	return glGetError() != GL_NO_ERROR;
+}
+
+
+static int gl_update_framebuffer(struct imageview_gl *gl, int w, int h)
+{
+	if ( (gl->fbo != 0) && (gl->fb_w == w) && (gl->fb_h == h) ) return 0;
+
+	if ( gl->fbo == 0 ) glGenFramebuffers(1, &gl->fbo);
+	if ( gl->rbo == 0 ) glGenRenderbuffers(1, &gl->rbo);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, gl->rbo);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+	glBindFramebuffer(GL_FRAMEBUFFER, gl->fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+	                          GL_RENDERBUFFER, gl->rbo);
+	if ( glCheckFramebufferStatus(GL_FRAMEBUFFER)
+	     != GL_FRAMEBUFFER_COMPLETE ) return 1;
+
+	gl->fb_w = w;
+	gl->fb_h = h;
+	return 0;
+}
+
+
+/* Draws all the panels onto 'cr', which must not have been transformed */
+static int gl_draw_panels(CrystFELImageView *iv, cairo_t *cr)
+{
+	struct imageview_gl *gl = iv->gl;
+	GtkWidget *widget = GTK_WIDGET(iv);
+	int w, h, scale, i;
+	double hv, vv;
+
+	scale = gtk_widget_get_scale_factor(widget);
+	w = gtk_widget_get_allocated_width(widget);
+	h = gtk_widget_get_allocated_height(widget);
+	if ( (w <= 0) || (h <= 0) ) return 0;
+
+	gdk_gl_context_make_current(gl->context);
+
+	if ( (gl->vbo == 0) && gl_setup_image(iv) ) return 1;
+	if ( gl_update_lut(iv) ) return 1;
+	if ( gl_update_framebuffer(gl, w*scale, h*scale) ) return 1;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, gl->fbo);
+	glViewport(0, 0, w*scale, h*scale);
+	glClearColor(0.7, 0.7, 0.7, 1.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	glUseProgram(gl->program);
+	glBindVertexArray(gl->vao);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, gl->lut_tex);
+	glUniform1f(gl->u_lut_min, gl->lut_min);
+	glUniform1f(gl->u_lut_scale, gl->lut_scale);
+
+	/* Same transformation as draw_sig(), but ending up in normalised
+	 * device coordinates instead of screen pixels */
+	hv = gtk_adjustment_get_value(iv->hadj);
+	vv = gtk_adjustment_get_value(iv->vadj);
+	glUniform4f(gl->u_view, 2.0*iv->zoom/w, 2.0*iv->zoom/h,
+	            -2.0*iv->zoom*hv/w - 1.0, 2.0*iv->zoom*vv/h + 1.0);
+
+	for ( i=0; i<iv->n_panels; i++ ) {
+
+		struct imageview_panel *pn = &iv->panels[i];
+		double pitch = iv->image->detgeom->panels[i].pixel_pitch;
+		int level = 0;
+
+		/* Same choice of binning level as draw_panel_rectangle() */
+		while ( (level+1 < pn->n_levels)
+		     && (iv->zoom*scale*pitch*(1<<(level+1)) <= 1.0) )
+		{
+			level++;
+		}
+
+		if ( gl_bind_panel(iv, i, level) ) return 1;
+		glDrawArrays(GL_TRIANGLE_STRIP, 4*i, 4);
+
+	}
+
+	if ( glGetError() != GL_NO_ERROR ) return 1;
+
+	gdk_cairo_draw_from_gl(cr, gtk_widget_get_window(widget),
+	                       gl->rbo, GL_RENDERBUFFER, scale,
+	                       0, 0, w*scale, h*scale);
+
+	return 0;
+}
+
+#endif /* HAVE_EPOXY */
+
+
 static void center_adjustment(GtkAdjustment *adj)
 {
 	double min = gtk_adjustment_get_lower(adj);
@@ -1052,30 +1989,32 @@ static void center_adjustment(GtkAdjustment *adj)
 
 static int rerender_image(CrystFELImageView *iv)
 {
-	int i;
 	double min_x, min_y, max_x, max_y;
 
 	if ( iv->image == NULL ) return 0;
 	if ( iv->image->detgeom == NULL ) return 0;
 
-	if ( iv->pixbufs == NULL ) {
-		iv->pixbufs = calloc(iv->image->detgeom->n_panels,
-		                     sizeof(GdkPixbuf *));
-		if ( iv->pixbufs == NULL ) return 1;
-	} else {
-		for ( i=0; i<iv->image->detgeom->n_panels; i++ ) {
-			gdk_pixbuf_unref(iv->pixbufs[i]);
+	if ( iv->pool == NULL ) {
+		iv->pool = thread_pool_new(g_get_num_processors());
+		if ( iv->pool == NULL ) return 1;
+	}
+
+	/* The binned panels only change with the image, but the colours need
+	 * to be worked out again whenever the colour scale changes */
+	if ( iv->panels == NULL ) {
+		const struct image *image = iv->image;
+		if ( make_panels(iv) ) {
+			cleanup_image(iv);
+			iv->image = image;
+			return 1;
 		}
+		iv->need_recolour = 1;
 	}
 
-	for ( i=0; i<iv->image->detgeom->n_panels; i++ ) {
-		iv->pixbufs[i] = render_panel(iv->image->dp[i],
-		                              iv->image->bad[i],
-		                              iv->image->detgeom->panels[i].w,
-		                              iv->image->detgeom->panels[i].h,
-		                              SCALE_COLOUR,
-		                              iv->scale_lo, iv->scale_hi);
-		if ( iv->pixbufs[i] == NULL ) return 1;
+	/* With OpenGL, the colour scale is applied when drawing */
+	if ( iv->need_recolour ) {
+		if ( !using_gl(iv) && recolour_panels(iv) ) return 1;
+		iv->need_recolour = 0;
 	}
 
 	detgeom_pixel_extents(iv->image->detgeom,
@@ -1128,7 +2067,6 @@ void crystfel_image_view_set_brightness(CrystFELImageView *iv,
                                         double brightness)
 {
 	iv->brightness = brightness;
-	iv->need_rerender = 1;
 	redraw(iv);
 }
 
@@ -1137,7 +2075,6 @@ void crystfel_image_view_set_show_centre(CrystFELImageView *iv,
                                          int show_centre)
 {
 	iv->show_centre = show_centre;
-	iv->need_rerender = 1;
 	redraw(iv);
 }
 
@@ -1146,7 +2083,6 @@ void crystfel_image_view_set_show_peaks(CrystFELImageView *iv,
                                         int show_peaks)
 {
 	iv->show_peaks = show_peaks;
-	iv->need_rerender = 1;
 	redraw(iv);
 }
 
@@ -1155,7 +2091,6 @@ void crystfel_image_view_set_show_reflections(CrystFELImageView *iv,
                                               int show_refls)
 {
 	iv->show_refls = show_refls;
-	iv->need_rerender = 1;
 	redraw(iv);
 }
 
@@ -1164,7 +2099,6 @@ void crystfel_image_view_set_label_reflections(CrystFELImageView *iv,
                                                int label_refls)
 {
 	iv->label_refls = label_refls;
-	iv->need_rerender = 1;
 	redraw(iv);
 }
 
@@ -1173,7 +2107,6 @@ void crystfel_image_view_set_peak_box_size(CrystFELImageView *iv,
                                            float box_size)
 {
 	iv->peak_box_size = box_size;
-	iv->need_rerender = 1;
 	redraw(iv);
 }
 
@@ -1182,7 +2115,6 @@ void crystfel_image_view_set_refl_box_size(CrystFELImageView *iv,
                                            float box_size)
 {
 	iv->refl_box_size = box_size;
-	iv->need_rerender = 1;
 	redraw(iv);
 }
 
@@ -1191,7 +2123,6 @@ void crystfel_image_view_set_resolution_rings(CrystFELImageView *iv,
                                               int rings)
 {
 	iv->resolution_rings = rings;
-	iv->need_rerender = 1;
 	redraw(iv);
 }
 
@@ -1202,5 +2133,6 @@ void crystfel_image_view_set_colour_scale(CrystFELImageView *iv,
 	iv->scale_lo = lo;
 	iv->scale_hi = hi;
 	iv->need_rerender = 1;
+	iv->need_recolour = 1;
 	redraw(iv);
 }
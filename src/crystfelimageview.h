@@ -37,6 +37,7 @@
 
 #include <image.h>
 #include <datatemplate.h>
+#include <thread-pool.h>
 
 #define CRYSTFEL_TYPE_IMAGE_VIEW (crystfel_image_view_get_type())
 
@@ -68,6 +69,7 @@ struct _crystfelimageview
 
 	/* Redraw/scroll stuff */
 	int                  need_rerender;
+	int                  need_recolour;
 	int                  need_recentre;
 	double               scale_lo;
 	double               scale_hi;
@@ -87,7 +89,14 @@ struct _crystfelimageview
 
 	const struct image  *image;
 
-	GdkPixbuf          **pixbufs;
+	/* Rendered versions of each panel, at several resolutions */
+	int                  n_panels;
+	struct imageview_panel *panels;
+	ThreadPool          *pool;
+
+	/* OpenGL state, if panels are being drawn with OpenGL */
+	struct imageview_gl *gl;
+	int                  gl_failed;
 
 	double               brightness;
 	int                  show_centre;
@@ -0,0 +1,214 @@
+/*
+ * distribute.c
+ *
+ * Run partialator across several processes with MPI
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#ifdef HAVE_MPI
+#include <mpi.h>
+#endif
+
+#include <utils.h>
+
+#include "distribute.h"
+
+
+static int rank = 0;
+static int size = 1;
+
+
+#ifdef HAVE_MPI
+
+static int finished = 0;
+
+
+/* Only the first rank prints status messages, but all of them print errors */
+static void log_from_rank(enum log_msg_type type, const char *msg, void *vp)
+{
+	if ( type == LOG_MSG_STATUS ) return;
+	pthread_mutex_lock(&stderr_lock);
+	fprintf(stderr, "rank %i: %s", rank, msg);
+	pthread_mutex_unlock(&stderr_lock);
+}
+
+
+/* If any rank exits early, for example because of an error, the others would
+ * otherwise wait for it forever */
+static void abort_other_ranks(void)
+{
+	if ( !finished ) MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
+
+void dist_init(int *pargc, char ***pargv)
+{
+	int provided;
+
+	/* Only the main thread makes MPI calls */
+	MPI_Init_thread(pargc, pargv, MPI_THREAD_FUNNELED, &provided);
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+	if ( size > 1 ) {
+		atexit(abort_other_ranks);
+		if ( rank > 0 ) set_log_message_func(log_from_rank, NULL);
+	}
+}
+
+
+void dist_finish(void)
+{
+	finished = 1;
+	MPI_Finalize();
+}
+
+
+void dist_sum_doubles(double *vals, int n)
+{
+	if ( size == 1 ) return;
+	MPI_Allreduce(MPI_IN_PLACE, vals, n, MPI_DOUBLE, MPI_SUM,
+	              MPI_COMM_WORLD);
+}
+
+
+void dist_sum_ints(int *vals, int n)
+{
+	if ( size == 1 ) return;
+	MPI_Allreduce(MPI_IN_PLACE, vals, n, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+}
+
+
+/* Returns the data from all ranks, one after the other in rank order.
+ * 'lens' should have space for dist_size() values, and will be filled in with
+ * the length of the data from each rank. */
+void *dist_allgather(const void *data, size_t len, size_t *lens)
+{
+	long long int mylen = len;
+	long long int *all_lens;
+	int *counts;
+	int *displs;
+	long long int total = 0;
+	char *buf;
+	int i;
+
+	if ( size == 1 ) {
+		lens[0] = len;
+		buf = malloc(len > 0 ? len : 1);
+		if ( buf != NULL ) memcpy(buf, data, len);
+		return buf;
+	}
+
+	all_lens = malloc(size*sizeof(long long int));
+	counts = malloc(size*sizeof(int));
+	displs = malloc(size*sizeof(int));
+	if ( (all_lens == NULL) || (counts == NULL) || (displs == NULL) ) {
+		ERROR("Failed to allocate memory for gathering data\n");
+		exit(1);
+	}
+
+	MPI_Allgather(&mylen, 1, MPI_LONG_LONG, all_lens, 1, MPI_LONG_LONG,
+	              MPI_COMM_WORLD);
+
+	for ( i=0; i<size; i++ ) {
+		lens[i] = all_lens[i];
+		counts[i] = all_lens[i];
+		displs[i] = total;
+		total += all_lens[i];
+		if ( total > INT_MAX ) {
+			ERROR("Too much data to gather from all ranks\n");
+			exit(1);
+		}
+	}
+
+	buf = malloc(total > 0 ? total : 1);
+	if ( buf == NULL ) {
+		ERROR("Failed to allocate memory for gathering data\n");
+		exit(1);
+	}
+
+	MPI_Allgatherv(data, len, MPI_BYTE, buf, counts, displs, MPI_BYTE,
+	               MPI_COMM_WORLD);
+
+	free(all_lens);
+	free(counts);
+	free(displs);
+	return buf;
+}
+
+
+#else /* HAVE_MPI */
+
+void dist_init(int *pargc, char ***pargv)
+{
+}
+
+
+void dist_finish(void)
+{
+}
+
+
+void dist_sum_doubles(double *vals, int n)
+{
+}
+
+
+void dist_sum_ints(int *vals, int n)
+{
+}
+
+
+void *dist_allgather(const void *data, size_t len, size_t *lens)
+{
+	char *buf;
+	lens[0] = len;
+	buf = malloc(len > 0 ? len : 1);
+	if ( buf != NULL ) memcpy(buf, data, len);
+	return buf;
+}
+
+#endif /* HAVE_MPI */
+
+
+int dist_rank(void)
+{
+	return rank;
+}
+
+
+int dist_size(void)
+{
+	return size;
+}
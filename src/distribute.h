@@ -0,0 +1,57 @@
+/*
+ * distribute.h
+ *
+ * Run partialator across several processes with MPI
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DISTRIBUTE_H
+#define DISTRIBUTE_H
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stddef.h>
+
+/* Each process ("rank") has its own share of the crystals.  Everything which
+ * depends on all of the crystals, such as the merged intensities, is added
+ * up across the ranks with the functions below, which must be called by all
+ * ranks in the same order.  Without MPI, or with only one rank, they do
+ * nothing. */
+
+extern void dist_init(int *pargc, char ***pargv);
+extern void dist_finish(void);
+
+extern int dist_rank(void);
+extern int dist_size(void);
+
+extern void dist_sum_doubles(double *vals, int n);
+extern void dist_sum_ints(int *vals, int n);
+
+extern void *dist_allgather(const void *data, size_t len, size_t *lens);
+
+#endif	/* DISTRIBUTE_H */
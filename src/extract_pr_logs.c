@@ -0,0 +1,324 @@
+/*
+ * extract_pr_logs.c
+ *
+ * Get partialator's log files out of log archives
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <utils.h>
+
+#include "log-archive.h"
+#include "version.h"
+
+
+static void show_help(const char *s)
+{
+	printf("Syntax: %s [options] logs-cycle00.bin [logs-cycle01.bin ...]\n\n",
+	       s);
+	printf(
+"Extract log files from partialator's log archives (see --log-archive).\n"
+"\n"
+"  -h, --help                 Display this help message.\n"
+"      --version              Print CrystFEL version number and exit.\n"
+"\n"
+"  -o, --output=<dir>         Write the log files in <dir>.  Default: '.'\n"
+"  -l, --list                 List the contents of the archives instead.\n"
+"      --crystal=<n>          Only extract the logs for crystal number <n>.\n"
+"\n"
+"Logs with the same name in several archives are joined together, in the\n"
+"order the archives are given.\n"
+);
+}
+
+
+#define NAME_HASH_SIZE (65521)
+
+struct name_entry
+{
+	char *name;
+	struct name_entry *next;
+};
+
+
+static int name_hash(const char *name)
+{
+	unsigned int h = 0;
+	while ( *name != '\0' ) h = h*31 + (unsigned char)*name++;
+	return h % NAME_HASH_SIZE;
+}
+
+
+/* Returns non-zero if 'name' was already seen, otherwise remembers it */
+static int seen_name(struct name_entry **table, const char *name)
+{
+	int h = name_hash(name);
+	struct name_entry *e;
+
+	for ( e=table[h]; e!=NULL; e=e->next ) {
+		if ( strcmp(e->name, name) == 0 ) return 1;
+	}
+
+	e = malloc(sizeof(struct name_entry));
+	if ( e == NULL ) return 0;
+	e->name = strdup(name);
+	e->next = table[h];
+	table[h] = e;
+	return 0;
+}
+
+
+/* Does 'name' belong to crystal number 'cnum'? */
+static int name_is_crystal(const char *name, int cnum)
+{
+	char tmp[64];
+	const char *p = name;
+	size_t len;
+
+	snprintf(tmp, 64, "crystal%i", cnum);
+	len = strlen(tmp);
+
+	while ( (p = strstr(p, tmp)) != NULL ) {
+		if ( !isdigit(p[len]) ) return 1;
+		p += len;
+	}
+	return 0;
+}
+
+
+/* Write only the lines of pgraph.dat for crystal 'cnum', and the heading */
+static void write_pgraph_lines(FILE *fh, char *data, int cnum)
+{
+	char *line = data;
+
+	while ( *line != '\0' ) {
+
+		char *end = strchr(line, '\n');
+		char *rval;
+		long int v;
+
+		if ( end != NULL ) *end = '\0';
+
+		v = strtol(line, &rval, 10);
+		if ( (rval == line) || (v == cnum) ) fprintf(fh, "%s\n", line);
+
+		if ( end == NULL ) break;
+		line = end+1;
+
+	}
+}
+
+
+static int extract(LogArchive *la, const char *outdir, int cnum,
+                   struct name_entry **seen)
+{
+	int i;
+	int n_written = 0;
+
+	for ( i=0; i<log_archive_num_files(la); i++ ) {
+
+		const char *name = log_archive_file_name(la, i);
+		int is_pgraph = (strncmp(name, "pgraph", 6) == 0);
+		char *data;
+		size_t len;
+		char *fn;
+		FILE *fh;
+
+		if ( (cnum >= 0) && !is_pgraph && !name_is_crystal(name, cnum) ) {
+			continue;
+		}
+
+		data = log_archive_read_file(la, i, &len);
+		if ( data == NULL ) {
+			ERROR("Failed to read %s from archive\n", name);
+			return -1;
+		}
+
+		fn = malloc(strlen(outdir)+strlen(name)+2);
+		if ( fn == NULL ) {
+			free(data);
+			return -1;
+		}
+		strcpy(fn, outdir);
+		strcat(fn, "/");
+		strcat(fn, name);
+
+		fh = fopen(fn, seen_name(seen, name) ? "a" : "w");
+		if ( fh == NULL ) {
+			ERROR("Failed to open '%s'\n", fn);
+			free(fn);
+			free(data);
+			return -1;
+		}
+
+		if ( is_pgraph && (cnum >= 0) ) {
+			write_pgraph_lines(fh, data, cnum);
+		} else {
+			fwrite(data, 1, len, fh);
+		}
+
+		fclose(fh);
+		free(fn);
+		free(data);
+		n_written++;
+	}
+
+	return n_written;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c;
+	char *outdir = NULL;
+	int list = 0;
+	int cnum = -1;
+	char *rval;
+	struct name_entry **seen;
+	int i;
+	int n_written = 0;
+
+	/* Long options */
+	const struct option longopts[] = {
+		{"help",               0, NULL,               'h'},
+		{"version",            0, NULL,                2 },
+		{"output",             1, NULL,               'o'},
+		{"list",               0, NULL,               'l'},
+		{"crystal",            1, NULL,                3 },
+		{0, 0, NULL, 0}
+	};
+
+	/* Short options */
+	while ((c = getopt_long(argc, argv, "ho:l",
+	                        longopts, NULL)) != -1) {
+
+		switch (c) {
+
+			case 'h' :
+			show_help(argv[0]);
+			return 0;
+
+			case 2 :
+			printf("CrystFEL: %s\n",
+			       crystfel_version_string());
+			printf("%s\n",
+			       crystfel_licence_string());
+			return 0;
+
+			case 'o' :
+			outdir = strdup(optarg);
+			break;
+
+			case 'l' :
+			list = 1;
+			break;
+
+			case 3 :
+			cnum = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (cnum < 0) ) {
+				ERROR("Invalid crystal number.\n");
+				return 1;
+			}
+			break;
+
+			case 0 :
+			break;
+
+			case '?' :
+			break;
+
+			default :
+			ERROR("Unhandled option '%c'\n", c);
+			break;
+
+		}
+
+	}
+
+	if ( optind >= argc ) {
+		ERROR("You must give at least one log archive.\n");
+		return 1;
+	}
+
+	if ( outdir == NULL ) outdir = strdup(".");
+
+	seen = calloc(NAME_HASH_SIZE, sizeof(struct name_entry *));
+	if ( seen == NULL ) return 1;
+
+	for ( i=optind; i<argc; i++ ) {
+
+		LogArchive *la;
+		int r;
+
+		la = log_archive_open(argv[i]);
+		if ( la == NULL ) return 1;
+
+		if ( list ) {
+			int j;
+			for ( j=0; j<log_archive_num_files(la); j++ ) {
+				printf("%s: %s\n", argv[i],
+				       log_archive_file_name(la, j));
+			}
+			log_archive_close(la);
+			continue;
+		}
+
+		r = extract(la, outdir, cnum, seen);
+		log_archive_close(la);
+		if ( r < 0 ) return 1;
+		n_written += r;
+
+	}
+
+	if ( !list ) {
+		STATUS("Extracted %i logs from %i archives.\n",
+		       n_written, argc-optind);
+	}
+
+	for ( i=0; i<NAME_HASH_SIZE; i++ ) {
+		struct name_entry *e = seen[i];
+		while ( e != NULL ) {
+			struct name_entry *next = e->next;
+			free(e->name);
+			free(e);
+			e = next;
+		}
+	}
+	free(seen);
+	free(outdir);
+
+	return 0;
+}
@@ -0,0 +1,570 @@
+/*
+ * filter_stream.c
+ *
+ * Select chunks and crystals from a stream, and split streams
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <image.h>
+#include <utils.h>
+#include <stream.h>
+#include <datatemplate.h>
+#include <cell.h>
+#include <cell-utils.h>
+#include <index.h>
+
+#include "version.h"
+
+
+static void show_help(const char *s)
+{
+	printf("Syntax: %s [options] -i input.stream -o output.stream\n\n", s);
+	printf(
+"Select chunks and crystals from a stream, and split streams.\n"
+"\n"
+"  -h, --help                 Display this help message.\n"
+"      --version              Print CrystFEL version number and exit.\n"
+"\n"
+"  -i, --input=<file>         Input stream (text, binary or manifest).\n"
+"  -o, --output=<file>        Output stream.  Give this option more than once\n"
+"                              to share the chunks between several streams.\n"
+"      --rejected=<file>      Write the chunks which don't pass to <file>.\n"
+"  -j <n>                     Use <n> threads for reading the stream.\n"
+"\n"
+"      --indexed-by=<method>  Keep only chunks indexed by <method>, or 'none'\n"
+"                              for the chunks which were not indexed.\n"
+"      --events=<file>        Keep only the frames listed in <file>.\n"
+"  -p, --pdb=<file>           Keep only crystals matching the unit cell in\n"
+"                              <file>.\n"
+"      --tolerance=<tol>      Tolerances for --pdb, in percent and degrees.\n"
+"                              Default: 5,5,5,1.5,1.5,1.5.\n"
+"      --resolution=<d>       Keep only crystals which diffract to better\n"
+"                              than <d> Angstroms.\n"
+"      --start-after=<n>      Skip the first <n> chunks which pass.\n"
+"      --stop-after=<n>       Stop after writing <n> chunks.\n"
+);
+}
+
+
+struct event
+{
+	char *filename;
+	char *ev;  /* NULL for all frames in the file */
+};
+
+
+static int cmp_event(const void *av, const void *bv)
+{
+	const struct event *a = av;
+	const struct event *b = bv;
+	int r;
+
+	r = strcmp(a->filename, b->filename);
+	if ( r != 0 ) return r;
+	if ( a->ev == NULL ) return (b->ev == NULL) ? 0 : -1;
+	if ( b->ev == NULL ) return 1;
+	return strcmp(a->ev, b->ev);
+}
+
+
+/* Reads a list of frames, one per line, as "filename event".  A line with
+ * only a filename selects all the frames in that file. */
+static struct event *read_event_list(const char *filename, int *pn)
+{
+	FILE *fh;
+	struct event *events = NULL;
+	int n = 0;
+	int max = 0;
+	char line[1024];
+
+	fh = fopen(filename, "r");
+	if ( fh == NULL ) {
+		ERROR("Failed to open event list '%s'\n", filename);
+		return NULL;
+	}
+
+	while ( fgets(line, 1023, fh) != NULL ) {
+
+		char *sp;
+
+		chomp(line);
+		if ( line[0] == '\0' ) continue;
+
+		if ( n == max ) {
+			struct event *new_events;
+			max = (max == 0) ? 1024 : 2*max;
+			new_events = realloc(events, max*sizeof(struct event));
+			if ( new_events == NULL ) {
+				ERROR("Failed to allocate event list\n");
+				fclose(fh);
+				return NULL;
+			}
+			events = new_events;
+		}
+
+		sp = strchr(line, ' ');
+		if ( sp != NULL ) {
+			*sp = '\0';
+			sp++;
+			while ( *sp == ' ' ) sp++;
+		}
+		events[n].filename = strdup(line);
+		events[n].ev = ((sp != NULL) && (*sp != '\0')) ? strdup(sp)
+		                                               : NULL;
+		n++;
+
+	}
+
+	fclose(fh);
+	qsort(events, n, sizeof(struct event), cmp_event);
+	*pn = n;
+	return events;
+}
+
+
+static int event_in_list(struct event *events, int n,
+                         const char *filename, const char *ev)
+{
+	struct event key;
+
+	key.filename = (char *)filename;
+	key.ev = (char *)ev;
+	if ( (ev != NULL)
+	  && (bsearch(&key, events, n, sizeof(struct event), cmp_event) != NULL) )
+	{
+		return 1;
+	}
+
+	key.ev = NULL;
+	return bsearch(&key, events, n, sizeof(struct event), cmp_event) != NULL;
+}
+
+
+/* Copies the audit information and geometry file from the input stream */
+static void copy_headers(Stream *out, Stream *in)
+{
+	FILE *fh = stream_get_fh(out);
+	char *audit;
+	const char *geom;
+
+	audit = stream_audit_info(in);
+	if ( audit != NULL ) {
+		fputs(audit, fh);
+		free(audit);
+	}
+
+	geom = stream_geometry_file(in);
+	if ( geom != NULL ) {
+		fprintf(fh, STREAM_GEOM_START_MARKER"\n");
+		fputs(geom, fh);
+		fprintf(fh, STREAM_GEOM_END_MARKER"\n");
+	}
+}
+
+
+static Stream *open_output(const char *filename, Stream *in,
+                           const DataTemplate *dtempl)
+{
+	Stream *out;
+
+	out = stream_open_for_write(filename, dtempl);
+	if ( out == NULL ) {
+		ERROR("Failed to open output stream '%s'\n", filename);
+		return NULL;
+	}
+
+	copy_headers(out, in);
+	stream_start_writer_thread(out);
+	return out;
+}
+
+
+/* Writes the chunk, using the original text if nothing was changed */
+static int write_chunk(Stream *out, struct image *image, const char *text,
+                       size_t len, int modified, StreamFlags srf)
+{
+	if ( (text != NULL) && !modified ) {
+		return stream_write_raw_chunk(out, text, len);
+	}
+	return stream_write_chunk(out, image, srf);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c;
+	char *infile = NULL;
+	char **outfiles = NULL;
+	int n_outfiles = 0;
+	char *rejfile = NULL;
+	char *cellfile = NULL;
+	char *eventfile = NULL;
+	char *indm_str = NULL;
+	IndexingMethod indm = INDEXING_NONE;
+	float ftols[6] = {5.0, 5.0, 5.0, 1.5, 1.5, 1.5};
+	double tols[6];
+	double max_d = 0.0;
+	long int start_after = 0;
+	long int stop_after = 0;
+	int n_threads = 1;
+	UnitCell *cell = NULL;
+	struct event *events = NULL;
+	int n_events = 0;
+	Stream *in;
+	Stream **outs;
+	Stream *rej = NULL;
+	StreamReader *sr;
+	DataTemplate *dtempl;
+	StreamFlags srf;
+	long int n_read = 0;
+	long int n_passed = 0;
+	long int n_written = 0;
+	long int n_modified = 0;
+	int r = 0;
+	int i;
+	char *rval;
+
+	/* Long options */
+	const struct option longopts[] = {
+		{"help",               0, NULL,               'h'},
+		{"version",            0, NULL,                2 },
+		{"input",              1, NULL,               'i'},
+		{"output",             1, NULL,               'o'},
+		{"pdb",                1, NULL,               'p'},
+		{"rejected",           1, NULL,                3 },
+		{"indexed-by",         1, NULL,                4 },
+		{"events",             1, NULL,                5 },
+		{"tolerance",          1, NULL,                6 },
+		{"resolution",         1, NULL,                7 },
+		{"start-after",        1, NULL,                8 },
+		{"stop-after",         1, NULL,                9 },
+		{0, 0, NULL, 0}
+	};
+
+	/* Short options */
+	while ((c = getopt_long(argc, argv, "hi:o:p:j:",
+	                        longopts, NULL)) != -1) {
+
+		switch (c) {
+
+			case 'h' :
+			show_help(argv[0]);
+			return 0;
+
+			case 2 :
+			printf("CrystFEL: %s\n",
+			       crystfel_version_string());
+			printf("%s\n",
+			       crystfel_licence_string());
+			return 0;
+
+			case 'i' :
+			infile = strdup(optarg);
+			break;
+
+			case 'o' :
+			outfiles = realloc(outfiles,
+			                   (n_outfiles+1)*sizeof(char *));
+			if ( outfiles == NULL ) return 1;
+			outfiles[n_outfiles++] = strdup(optarg);
+			break;
+
+			case 'p' :
+			cellfile = strdup(optarg);
+			break;
+
+			case 'j' :
+			n_threads = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (n_threads < 1) ) {
+				ERROR("Invalid value for -j.\n");
+				return 1;
+			}
+			break;
+
+			case 3 :
+			rejfile = strdup(optarg);
+			break;
+
+			case 4 :
+			indm_str = strdup(optarg);
+			break;
+
+			case 5 :
+			eventfile = strdup(optarg);
+			break;
+
+			case 6 :
+			if ( sscanf(optarg, "%f,%f,%f,%f,%f,%f",
+			            &ftols[0], &ftols[1], &ftols[2],
+			            &ftols[3], &ftols[4], &ftols[5]) != 6 )
+			{
+				ERROR("Invalid parameters for '--tolerance'\n");
+				return 1;
+			}
+			break;
+
+			case 7 :
+			max_d = strtod(optarg, &rval);
+			if ( (*rval != '\0') || (max_d <= 0.0) ) {
+				ERROR("Invalid value for --resolution.\n");
+				return 1;
+			}
+			break;
+
+			case 8 :
+			start_after = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (start_after < 0) ) {
+				ERROR("Invalid value for --start-after.\n");
+				return 1;
+			}
+			break;
+
+			case 9 :
+			stop_after = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (stop_after < 1) ) {
+				ERROR("Invalid value for --stop-after.\n");
+				return 1;
+			}
+			break;
+
+			case 0 :
+			break;
+
+			case '?' :
+			break;
+
+			default :
+			ERROR("Unhandled option '%c'\n", c);
+			break;
+
+		}
+
+	}
+
+	if ( (infile == NULL) || (n_outfiles == 0) ) {
+		ERROR("You must specify the input and output filenames.\n");
+		return 1;
+	}
+
+	if ( indm_str != NULL ) {
+		int err;
+		indm = get_indm_from_string_2(indm_str, &err);
+		if ( err ) {
+			ERROR("Unrecognised indexing method '%s'\n", indm_str);
+			return 1;
+		}
+	}
+
+	if ( cellfile != NULL ) {
+		cell = load_cell_from_file(cellfile);
+		if ( cell == NULL ) {
+			ERROR("Failed to load unit cell from '%s'\n", cellfile);
+			return 1;
+		}
+	}
+	for ( i=0; i<3; i++ ) tols[i] = ftols[i]/100.0;
+	for ( i=3; i<6; i++ ) tols[i] = deg2rad(ftols[i]);
+
+	if ( eventfile != NULL ) {
+		events = read_event_list(eventfile, &n_events);
+		if ( events == NULL ) return 1;
+	}
+
+	in = stream_open_for_read(infile);
+	if ( in == NULL ) {
+		ERROR("Failed to open input stream '%s'\n", infile);
+		return 1;
+	}
+
+	if ( stream_geometry_file(in) == NULL ) {
+		ERROR("Input stream does not contain a geometry file.\n");
+		stream_close(in);
+		return 1;
+	}
+
+	dtempl = data_template_new_from_string(stream_geometry_file(in));
+	if ( dtempl == NULL ) {
+		ERROR("Failed to read geometry from input stream.\n");
+		stream_close(in);
+		return 1;
+	}
+
+	outs = malloc(n_outfiles*sizeof(Stream *));
+	if ( outs == NULL ) return 1;
+	for ( i=0; i<n_outfiles; i++ ) {
+		outs[i] = open_output(outfiles[i], in, dtempl);
+		if ( outs[i] == NULL ) return 1;
+	}
+	if ( rejfile != NULL ) {
+		rej = open_output(rejfile, in, dtempl);
+		if ( rej == NULL ) return 1;
+	}
+
+	/* Peaks and reflections are only needed if chunks have to be written
+	 * again, rather than copied */
+	if ( stream_is_binary(in) || (cell != NULL) || (max_d > 0.0) ) {
+		srf = STREAM_PEAKS | STREAM_REFLECTIONS | STREAM_DATA_DETGEOM;
+	} else {
+		srf = 0;
+	}
+
+	sr = stream_reader_new(in, srf, n_threads, 1);
+	if ( sr == NULL ) {
+		ERROR("Failed to start reading stream.\n");
+		return 1;
+	}
+
+	do {
+
+		struct image *image;
+		char *text;
+		size_t len;
+		int pass = 1;
+		int modified = 0;
+
+		image = stream_reader_next_with_text(sr, &text, &len);
+		if ( image == NULL ) break;
+		n_read++;
+
+		if ( (events != NULL)
+		  && !event_in_list(events, n_events, image->filename,
+		                    image->ev) )
+		{
+			pass = 0;
+		}
+
+		if ( (indm_str != NULL)
+		  && ((image->indexed_by & INDEXING_METHOD_MASK)
+		       != (indm & INDEXING_METHOD_MASK)) )
+		{
+			pass = 0;
+		}
+
+		if ( pass && ((cell != NULL) || (max_d > 0.0)) ) {
+
+			int n_ok = 0;
+
+			for ( i=0; i<image->n_crystals; i++ ) {
+
+				Crystal *cr = image->crystals[i].cr;
+				int ok = 1;
+
+				if ( (cell != NULL)
+				  && !compare_cell_parameters(crystal_get_cell(cr),
+				                              cell, tols) )
+				{
+					ok = 0;
+				}
+
+				if ( (max_d > 0.0)
+				  && (crystal_get_resolution_limit(cr)
+				       < 1.0/(max_d*1e-10)) )
+				{
+					ok = 0;
+				}
+
+				/* Flagged crystals are not written */
+				if ( ok ) {
+					n_ok++;
+				} else {
+					crystal_set_user_flag(cr, 1);
+					modified = 1;
+				}
+
+			}
+
+			if ( n_ok == 0 ) pass = 0;
+
+		}
+
+		if ( pass && (n_passed++ >= start_after) ) {
+
+			int o = n_written % n_outfiles;
+			if ( write_chunk(outs[o], image, text, len, modified,
+			                 srf) )
+			{
+				ERROR("Failed to write chunk for %s %s\n",
+				      image->filename, image->ev);
+				r = 1;
+			}
+			if ( modified ) n_modified++;
+			n_written++;
+
+		} else if ( !pass && (rej != NULL) ) {
+
+			/* Rejected chunks are written complete */
+			for ( i=0; i<image->n_crystals; i++ ) {
+				crystal_set_user_flag(image->crystals[i].cr, 0);
+			}
+			if ( write_chunk(rej, image, text, len, 0, srf) ) {
+				ERROR("Failed to write chunk for %s %s\n",
+				      image->filename, image->ev);
+				r = 1;
+			}
+
+		}
+
+		cffree(text);
+		image_free(image);
+
+	} while ( !r && ((stop_after == 0) || (n_written < stop_after)) );
+
+	stream_reader_free(sr);
+
+	STATUS("Read %li chunks, wrote %li", n_read, n_written);
+	if ( n_modified > 0 ) {
+		STATUS(" (%li with some crystals removed)", n_modified);
+	}
+	STATUS(".\n");
+
+	for ( i=0; i<n_outfiles; i++ ) {
+		stream_close(outs[i]);
+		free(outfiles[i]);
+	}
+	stream_close(rej);
+	stream_close(in);
+	data_template_free(dtempl);
+	cell_free(cell);
+	free(outs);
+	free(outfiles);
+	free(infile);
+	free(rejfile);
+	free(cellfile);
+	free(eventfile);
+	free(indm_str);
+
+	return r;
+}
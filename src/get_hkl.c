@@ -43,10 +43,17 @@
 #include <symmetry.h>
 #include <cell.h>
 #include <cell-utils.h>
+#include <thread-pool.h>
 
 #include "version.h"
 
 
+/* The reflections are divided into parts of about this size, which are
+ * processed in parallel.  For adding noise, the division does not depend on
+ * the number of threads, so neither do the results. */
+#define HKL_PART_SIZE (65536)
+
+
 static void show_help(const char *s)
 {
 	printf("Syntax: %s [options]\n\n", s);
@@ -57,6 +64,7 @@ static void show_help(const char *s)
 "      --version              Print CrystFEL version number and exit.\n"
 "\n"
 "  -i, --input=<file>         Read reflections from <file>.\n"
+"  -j <n>                     Use <n> threads.\n"
 "  -y, --symmetry=<sym>       The symmetry of the input reflection list.\n"
 "  -p, --pdb=<file>           PDB file with cell parameters (needed when\n"
 "                              using a resolution cutoff)\n"
@@ -110,24 +118,161 @@ static void copy_notes(RefList *out, RefList *in)
 }
 
 
-/* Apply Poisson noise to all reflections */
-static void poisson_reflections(RefList *list, double adu_per_photon)
+struct hkl_part_args
+{
+	struct reflist_partition *part;
+	int n_started;
+	void (*func)(struct hkl_part_args *args, int i);
+
+	/* One output list for each part, if the operation makes a new list */
+	RefList **out;
+
+	/* Parameters for the operation */
+	RefList *in;
+	double adu_per_photon;
+	int need_all_parts;
+	const SymOpList *initial;
+	const SymOpList *target;
+	int *phase_warning;
+};
+
+
+struct hkl_part_job
+{
+	struct hkl_part_args *args;
+	int i;
+};
+
+
+static void *get_hkl_part(void *vqargs)
+{
+	struct hkl_part_args *qargs = vqargs;
+	struct hkl_part_job *job;
+
+	job = malloc(sizeof(struct hkl_part_job));
+	if ( job == NULL ) return NULL;
+	job->args = qargs;
+	job->i = qargs->n_started++;
+	return job;
+}
+
+
+static void run_hkl_part(void *vjob, int cookie)
+{
+	struct hkl_part_job *job = vjob;
+	job->args->func(job->args, job->i);
+}
+
+
+static void finalise_hkl_part(void *vqargs, void *vjob)
+{
+	free(vjob);
+}
+
+
+/* Operations which make a new list give the same results however the
+ * reflections are divided up, so there is no need to have more parts than
+ * threads.  Each extra part costs a merge at the end. */
+static int num_hkl_parts(RefList *list, int make_lists, int n_threads)
+{
+	int n_parts = num_reflections(list)/HKL_PART_SIZE + 1;
+	if ( make_lists && (n_parts > n_threads) ) n_parts = n_threads;
+	return n_parts;
+}
+
+
+/* Runs args->func for each part of 'list', using n_threads threads.  If
+ * make_lists is set, each part gets its own output list in args->out.
+ * Returns non-zero on error. */
+static int run_hkl_parts(RefList *list, struct hkl_part_args *args,
+                         int make_lists, int n_threads)
+{
+	int n_parts;
+	int i;
+
+	n_parts = num_hkl_parts(list, make_lists, n_threads);
+	args->part = reflist_partition(list, n_parts);
+	if ( args->part == NULL ) return 1;
+	args->n_started = 0;
+
+	args->out = NULL;
+	if ( make_lists ) {
+		args->out = malloc(n_parts*sizeof(RefList *));
+		if ( args->out == NULL ) {
+			reflist_free_partition(args->part);
+			return 1;
+		}
+		for ( i=0; i<n_parts; i++ ) {
+			args->out[i] = reflist_new();
+		}
+	}
+
+	run_threads(n_threads, run_hkl_part, get_hkl_part, finalise_hkl_part,
+	            args, n_parts, 0, 0, 0);
+
+	return 0;
+}
+
+
+/* Combines the output lists from run_hkl_parts(), in order, into the list for
+ * the first part.  If a reflection appears in more than one part, the first
+ * one is kept. */
+static RefList *merge_hkl_parts(struct hkl_part_args *args, RefList *in)
+{
+	RefList *out;
+	int i;
+
+	out = args->out[0];
+	copy_notes(out, in);
+
+	for ( i=1; i<args->part->n_parts; i++ ) {
+
+		Reflection *refl;
+		RefListIterator *iter;
+
+		for ( refl = first_refl(args->out[i], &iter);
+		      refl != NULL;
+		      refl = next_refl(refl, iter) )
+		{
+			signed int h, k, l;
+			Reflection *new;
+
+			get_indices(refl, &h, &k, &l);
+			if ( find_refl(out, h, k, l) != NULL ) continue;
+
+			new = add_refl(out, h, k, l);
+			copy_data(new, refl);
+		}
+
+		reflist_free(args->out[i]);
+
+	}
+
+	free(args->out);
+	reflist_free_partition(args->part);
+	return out;
+}
+
+
+static void poisson_part(struct hkl_part_args *args, int i)
 {
-	Reflection *refl;
-	RefListIterator *iter;
 	gsl_rng *rng;
+	int j;
 
+	/* Each part has its own random number sequence.  The first part uses
+	 * the default seed, as for a single generator */
 	rng = gsl_rng_alloc(gsl_rng_mt19937);
+	gsl_rng_set(rng, i);
 
-	for ( refl = first_refl(list, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) ) {
+	for ( j=args->part->start[i]; j<args->part->start[i+1]; j++ ) {
 
+		Reflection *refl = args->part->refls[j];
 		double val, c;
 
 		val = get_intensity(refl);
 
-		c = adu_per_photon * poisson_noise(rng, val/adu_per_photon);
+		c = args->adu_per_photon
+		      * poisson_noise(rng, val/args->adu_per_photon);
 		set_intensity(refl, c);
 
 	}
@@ -136,6 +281,24 @@ static void poisson_reflections(RefList *list, double adu_per_photon)
 }
 
 
+/* Apply Poisson noise to all reflections */
+static void poisson_reflections(RefList *list, double adu_per_photon,
+                                int n_threads)
+{
+	struct hkl_part_args args;
+
+	args.func = poisson_part;
+	args.adu_per_photon = adu_per_photon;
+
+	if ( run_hkl_parts(list, &args, 0, n_threads) ) {
+		ERROR("Failed to divide up reflections\n");
+		return;
+	}
+
+	reflist_free_partition(args.part);
+}
+
+
 /* Apply 10% uniform noise to all reflections */
 static void noise_reflections(RefList *list)
 {
@@ -159,71 +322,88 @@ static void noise_reflections(RefList *list)
 }
 
 
-static RefList *template_reflections(RefList *list, RefList *template)
+static void template_part(struct hkl_part_args *args, int i)
 {
-	Reflection *refl;
-	RefListIterator *iter;
-	RefList *out;
-
-	out = reflist_new();
-	copy_notes(out, list);
+	int j;
 
-	for ( refl = first_refl(template, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) ) {
+	for ( j=args->part->start[i]; j<args->part->start[i+1]; j++ ) {
 
 		signed int h, k, l;
 		Reflection *new;
 		Reflection *old;
 
-		get_indices(refl, &h, &k, &l);
+		get_indices(args->part->refls[j], &h, &k, &l);
 
-		old = find_refl(list, h, k, l);
+		old = find_refl(args->in, h, k, l);
 		if ( old == NULL ) continue;
 
-		new = add_refl(out, h, k, l);
+		new = add_refl(args->out[i], h, k, l);
 		copy_data(new, old);
 
 	}
+}
 
-	return out;
+
+static RefList *template_reflections(RefList *list, RefList *template,
+                                     int n_threads)
+{
+	struct hkl_part_args args;
+
+	args.func = template_part;
+	args.in = list;
+
+	if ( run_hkl_parts(template, &args, 1, n_threads) ) return NULL;
+
+	return merge_hkl_parts(&args, list);
 }
 
 
-static RefList *twin_reflections(RefList *in, int need_all_parts,
-                                 const SymOpList *holo, const SymOpList *mero)
+static void twin_part(struct hkl_part_args *args, int i)
 {
-	Reflection *refl;
-	RefListIterator *iter;
-	RefList *out;
+	RefList *in = args->in;
+	RefList *out = args->out[i];
+	const SymOpList *holo = args->target;
+	const SymOpList *mero = args->initial;
 	SymOpMask *m;
 	int n;
-
-	out = reflist_new();
-	copy_notes(out, in);
+	int p;
 
 	/* No need to free and reallocate this for every reflection */
 	m = new_symopmask(holo);
 
-	for ( refl = first_refl(in, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
+	for ( p=args->part->start[i]; p<args->part->start[i+1]; p++ )
 	{
+		Reflection *refl = args->part->refls[p];
 		double total, sigma;
 		int multi;
 		signed int h, k, l;
+		signed int ho, ko, lo;
 		int j;
 		int skip;
 
 		/* Figure out where to put the twinned version, and check it's
 		 * not there already. */
-		get_indices(refl, &h, &k, &l);
-		get_asymm(holo, h, k, l, &h, &k, &l);
+		get_indices(refl, &ho, &ko, &lo);
+		get_asymm(holo, ho, ko, lo, &h, &k, &l);
 		if ( find_refl(out, h, k, l) != NULL ) continue;
 
 		special_position(holo, m, h, k, l);
 		n = num_equivs(holo, m);
 
+		/* The twinned reflection is made only once, by the first of
+		 * its equivalents which is in the input list, in case the
+		 * others are in different parts */
+		skip = 0;
+		for ( j=0; j<n; j++ ) {
+			signed int he, ke, le;
+			get_equiv(holo, m, j, h, k, l, &he, &ke, &le);
+			if ( find_refl(in, he, ke, le) != NULL ) {
+				skip = (he != ho) || (ke != ko) || (le != lo);
+				break;
+			}
+		}
+		if ( skip ) continue;
+
 		total = 0.0;
 		sigma = 0.0;
 		multi = 0;
@@ -246,7 +426,7 @@ static RefList *twin_reflections(RefList *in, int need_all_parts,
 			r = find_equiv_in_list(in, he, ke, le, mero,
 			                       &hu, &ku, &lu);
 
-			if ( need_all_parts && !r ) {
+			if ( args->need_all_parts && !r ) {
 
 				ERROR("Twinning %i %i %i requires the %i %i %i "
 				      "reflection (or an equivalent in %s), "
@@ -274,6 +454,8 @@ static RefList *twin_reflections(RefList *in, int need_all_parts,
 				sigma += pow(sigi*mult, 2.0);
 				multi += mult;
 
+				/* Only this thread looks at the reflections
+				 * which contribute to this twinned reflection */
 				set_intensity(part, 0.0);
 				set_esd_intensity(part, 0.0);
 				set_redundancy(part, 0);
@@ -292,40 +474,45 @@ static RefList *twin_reflections(RefList *in, int need_all_parts,
 
 	}
 
-	return out;
+	free_symopmask(m);
 }
 
 
-static RefList *expand_reflections(RefList *in, const SymOpList *initial,
-                                                const SymOpList *target)
+static RefList *twin_reflections(RefList *in, int need_all_parts,
+                                 const SymOpList *holo, const SymOpList *mero,
+                                 int n_threads)
 {
-	Reflection *refl;
-	RefListIterator *iter;
-	RefList *out;
-	SymOpMask *m;
-	int phase_warning = 0;
+	struct hkl_part_args args;
 
-	if ( !is_subgroup(initial, target) ) {
-		ERROR("%s is not a subgroup of %s!\n", symmetry_name(target),
-		                                       symmetry_name(initial));
-		return NULL;
-	}
+	args.func = twin_part;
+	args.in = in;
+	args.need_all_parts = need_all_parts;
+	args.initial = mero;
+	args.target = holo;
 
-	out = reflist_new();
-	copy_notes(out, in);
-	m = new_symopmask(initial);
+	if ( run_hkl_parts(in, &args, 1, n_threads) ) return NULL;
+
+	return merge_hkl_parts(&args, in);
+}
 
-	for ( refl = first_refl(in, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) ) {
 
+static void expand_part(struct hkl_part_args *args, int i)
+{
+	SymOpMask *m;
+	int p;
+
+	m = new_symopmask(args->initial);
+
+	for ( p=args->part->start[i]; p<args->part->start[i+1]; p++ ) {
+
+		Reflection *refl = args->part->refls[p];
 		signed int h, k, l;
 		int n, j;
 
 		get_indices(refl, &h, &k, &l);
 
-		special_position(initial, m, h, k, l);
-		n = num_equivs(initial, m);
+		special_position(args->initial, m, h, k, l);
+		n = num_equivs(args->initial, m);
 
 		/* For each equivalent in the higher symmetry group */
 		for ( j=0; j<n; j++ ) {
@@ -336,27 +523,21 @@ static RefList *expand_reflections(RefList *in, const SymOpList *initial,
 			double ph;
 
 			/* Get the equivalent */
-			get_equiv(initial, m, j, h, k, l, &he, &ke, &le);
+			get_equiv(args->initial, m, j, h, k, l, &he, &ke, &le);
 
 			/* Put it into the asymmetric unit for the target */
-			get_asymm(target, he, ke, le, &he, &ke, &le);
+			get_asymm(args->target, he, ke, le, &he, &ke, &le);
 
-			if ( find_refl(out, he, ke, le) != NULL ) continue;
+			if ( find_refl(args->out[i], he, ke, le) != NULL ) continue;
 
 			/* Make sure the intensity is in the right place */
-			copy = add_refl(out, he, ke, le);
+			copy = add_refl(args->out[i], he, ke, le);
 			copy_data(copy, refl);
 
 			ph = get_phase(refl, &have_phase);
 			if ( have_phase ) {
 				set_phase(copy, ph);
-				if ( !phase_warning ) {
-					ERROR("WARNING: get_hkl can't expand "
-					      "phase values correctly when the "
-					      "structure contains glides or "
-					      "screw axes.\n");
-					phase_warning = 1;
-				}
+				args->phase_warning[i] = 1;
 			}
 
 		}
@@ -364,8 +545,46 @@ static RefList *expand_reflections(RefList *in, const SymOpList *initial,
 	}
 
 	free_symopmask(m);
+}
 
-	return out;
+
+static RefList *expand_reflections(RefList *in, const SymOpList *initial,
+                                   const SymOpList *target, int n_threads)
+{
+	struct hkl_part_args args;
+	int n_parts;
+	int i;
+
+	if ( !is_subgroup(initial, target) ) {
+		ERROR("%s is not a subgroup of %s!\n", symmetry_name(target),
+		                                       symmetry_name(initial));
+		return NULL;
+	}
+
+	n_parts = num_hkl_parts(in, 1, n_threads);
+	args.phase_warning = calloc(n_parts, sizeof(int));
+	if ( args.phase_warning == NULL ) return NULL;
+
+	args.func = expand_part;
+	args.initial = initial;
+	args.target = target;
+
+	if ( run_hkl_parts(in, &args, 1, n_threads) ) {
+		free(args.phase_warning);
+		return NULL;
+	}
+
+	for ( i=0; i<n_parts; i++ ) {
+		if ( args.phase_warning[i] ) {
+			ERROR("WARNING: get_hkl can't expand phase values "
+			      "correctly when the structure contains glides "
+			      "or screw axes.\n");
+			break;
+		}
+	}
+	free(args.phase_warning);
+
+	return merge_hkl_parts(&args, in);
 }
 
 
@@ -473,6 +692,7 @@ int main(int argc, char *argv[])
 	double highres = INFINITY;  /* 1/d value */
 	UnitCell *cell = NULL;
 	char *output_format_str = NULL;
+	int n_threads = 1;
 	int r;
 
 	/* Long options */
@@ -502,7 +722,7 @@ int main(int argc, char *argv[])
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "ht:o:i:w:y:e:p:",
+	while ((c = getopt_long(argc, argv, "ht:o:i:w:y:e:p:j:",
 	                        longopts, NULL)) != -1) {
 
 		switch (c) {
@@ -572,6 +792,15 @@ int main(int argc, char *argv[])
 			output_format_str = strdup(optarg);
 			break;
 
+			case 'j' :
+			if ( (sscanf(optarg, "%i", &n_threads) != 1)
+			  || (n_threads < 1) )
+			{
+				ERROR("Invalid value for -j\n");
+				return 1;
+			}
+			break;
+
 			case 0 :
 			break;
 
@@ -705,7 +934,7 @@ int main(int argc, char *argv[])
 
 	if ( config_poisson ) {
 		if ( have_adu_per_photon ) {
-			poisson_reflections(input, adu_per_photon);
+			poisson_reflections(input, adu_per_photon, n_threads);
 		} else {
 			ERROR("You must give the number of ADU per photon to "
 			      "use --poisson.\n");
@@ -720,7 +949,12 @@ int main(int argc, char *argv[])
 		RefList *new;
 		STATUS("Twinning from %s into %s\n", symmetry_name(mero),
 		                                     symmetry_name(holo));
-		new = twin_reflections(input, config_nap, holo, mero);
+		new = twin_reflections(input, config_nap, holo, mero,
+		                       n_threads);
+		if ( new == NULL ) {
+			ERROR("Failed to twin reflections.\n");
+			return 1;
+		}
 
 		/* Replace old with new */
 		reflist_free(input);
@@ -737,7 +971,11 @@ int main(int argc, char *argv[])
 		RefList *new;
 		STATUS("Expanding from %s into %s\n", symmetry_name(mero),
 		                                      symmetry_name(expand));
-		new = expand_reflections(input, mero, expand);
+		new = expand_reflections(input, mero, expand, n_threads);
+		if ( new == NULL ) {
+			ERROR("Failed to expand reflections.\n");
+			return 1;
+		}
 
 		/* Replace old with new */
 		reflist_free(input);
@@ -795,7 +1033,12 @@ int main(int argc, char *argv[])
 	if ( template ) {
 
 		RefList *t = read_reflections(template);
-		RefList *new = template_reflections(input, t);
+		RefList *new = template_reflections(input, t, n_threads);
+		if ( new == NULL ) {
+			ERROR("Failed to apply template.\n");
+			return 1;
+		}
+		reflist_free(t);
 		reflist_free(input);
 		input = new;
 
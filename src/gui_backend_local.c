@@ -73,6 +73,9 @@ struct local_job
 
 	char *stderr_filename;
 
+	/* Written by indexamajig --status-file, or NULL */
+	char *status_filename;
+
 	GPid pid;
 	guint child_watch_source;
 	GFile *workdir;
@@ -84,6 +87,7 @@ static void free_task(void *job_priv)
 	struct local_job *job = job_priv;
 	g_object_unref(job->workdir);
 	free(job->stderr_filename);
+	free(job->status_filename);
 }
 
 
@@ -161,6 +165,7 @@ static struct local_job *start_local_job(char **args,
 
 	job->workdir = g_file_dup(workdir_file);
 	job->type = type;
+	job->status_filename = NULL;
 
 	STATUS("Running program: ");
 	i = 0;
@@ -208,7 +213,12 @@ static int get_task_status(void *job_priv,
 	switch ( job->type ) {
 
 		case GUI_JOB_INDEXING :
-		n_proc = read_number_processed(job->stderr_filename);
+		/* Fall back on the log if the status file isn't there yet */
+		if ( (job->status_filename == NULL)
+		  || read_indexamajig_status(job->status_filename, &n_proc) )
+		{
+			n_proc = read_number_processed(job->stderr_filename);
+		}
 		*frac_complete = (double)n_proc / job->n_frames;
 		break;
 
@@ -535,6 +545,7 @@ static void *run_indexing(const char *job_title,
 	gchar *stream_rel_filename;
 	gchar *harvest_rel_filename;
 	gchar *mille_rel_filename;
+	gchar *status_rel_filename;
 	GFile *ggeom;
 	GFile *ggeomcopy;
 	GError *error;
@@ -560,6 +571,7 @@ static void *run_indexing(const char *job_title,
 	stream_rel_filename = relative_to_cwd(workdir, "crystfel.stream");
 	harvest_rel_filename = relative_to_cwd(workdir, "parameters.json");
 	mille_rel_filename = relative_to_cwd(workdir, "mille-data");
+	status_rel_filename = relative_to_cwd(workdir, "status.txt");
 
 	/* Copy geometry file into working directory
 	 * Used for geometry refinement, not indexing! */
@@ -580,6 +592,7 @@ static void *run_indexing(const char *job_title,
 	                               stderr_rel_filename,
 	                               harvest_rel_filename,
 	                               mille_rel_filename,
+	                               status_rel_filename,
 	                               NULL,
 	                               &proj->peak_search_params,
 	                               &proj->indexing_params,
@@ -602,6 +615,7 @@ static void *run_indexing(const char *job_title,
 		/* Indexing-specific job data */
 		job->n_frames = proj->n_frames;
 		job->stderr_filename = strdup(stderr_rel_filename);
+		job->status_filename = strdup(status_rel_filename);
 		add_indexing_result(proj, job_title, &stream_rel_filename, 1);
 
 	} else {
@@ -615,6 +629,7 @@ static void *run_indexing(const char *job_title,
 	free(stderr_rel_filename);
 	free(harvest_rel_filename);
 	free(mille_rel_filename);
+	free(status_rel_filename);
 
 	return job;
 }
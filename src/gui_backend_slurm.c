@@ -29,6 +29,7 @@
 #include <glib.h>
 #include <gtk/gtk.h>
 #include <gio/gio.h>
+#include <sys/stat.h>
 
 #include <utils.h>
 
@@ -57,6 +58,8 @@ struct slurm_indexing_opts
 {
 	struct slurm_common_opts common;
 	int block_size;
+	int dynamic;   /* Array tasks take blocks from a shared queue */
+	int n_tasks;   /* Number of array tasks, if dynamic */
 };
 
 
@@ -78,28 +81,64 @@ struct slurm_job
 	GFile *workdir;
 	uint32_t job_id;
 
+	/* From the last time Slurm was asked */
+	int n_alive;
+	int n_running;
+	int new_alive;
+	int new_running;
+	int finished;
+
 	/* For indexing job */
 	int n_frames;
 	int n_blocks;
+	off_t *block_log_sizes;
+	int *block_n_proc;
 
 	/* For merging/ambigator job */
 	char *stderr_filename;
 	int niter;
+	off_t log_size;
+	double frac_complete;
 };
 
 
-static const char *get_str_val(const char *line, const char *key)
+/* Slurm is asked about all running jobs at once, at most once per polling
+ * interval.  The interval gets longer while nothing changes, and goes back
+ * to the minimum when anything does. */
+#define SLURM_POLL_MIN (5*G_USEC_PER_SEC)
+#define SLURM_POLL_MAX (60*G_USEC_PER_SEC)
+
+static struct slurm_job **watched_jobs = NULL;
+static int n_watched_jobs = 0;
+static gint64 last_poll = 0;
+static gint64 poll_interval = SLURM_POLL_MIN;
+
+
+static void watch_job(struct slurm_job *job)
 {
-	const char *pos = strstr(line, key);
-	if ( pos == NULL ) return NULL;
+	struct slurm_job **new_jobs;
 
-	const char *eq = strchr(pos, '=');
-	if ( eq == NULL ) return NULL;
+	new_jobs = realloc(watched_jobs,
+	                   (n_watched_jobs+1)*sizeof(struct slurm_job *));
+	if ( new_jobs == NULL ) return;
+	watched_jobs = new_jobs;
+	watched_jobs[n_watched_jobs++] = job;
+
+	/* Find out about the new job as soon as possible */
+	last_poll = 0;
+	poll_interval = SLURM_POLL_MIN;
+}
 
-	const char *sp = strchr(pos, ' ');
-	if ( sp == NULL ) return NULL;
 
-	return strndup(eq+1, sp-eq-1);
+static void unwatch_job(struct slurm_job *job)
+{
+	int i;
+	for ( i=0; i<n_watched_jobs; i++ ) {
+		if ( watched_jobs[i] == job ) {
+			watched_jobs[i] = watched_jobs[--n_watched_jobs];
+			return;
+		}
+	}
 }
 
 
@@ -123,31 +162,69 @@ static char *g_bytes_to_terminated_array(GBytes *bytes)
 }
 
 
-static int get_job_status(int job_id, int *n_alive, int *n_running)
+static struct slurm_job *find_watched_job(uint32_t job_id)
+{
+	int i;
+	for ( i=0; i<n_watched_jobs; i++ ) {
+		if ( watched_jobs[i]->job_id == job_id ) return watched_jobs[i];
+	}
+	return NULL;
+}
+
+
+static char *watched_job_list()
 {
-	const gchar *args[6];
+	char *list;
+	int i;
+
+	list = malloc(n_watched_jobs*16+16);
+	if ( list == NULL ) return NULL;
+
+	strcpy(list, "--jobs=");
+	for ( i=0; i<n_watched_jobs; i++ ) {
+		char tmp[16];
+		snprintf(tmp, 16, "%s%u", (i>0) ? "," : "",
+		         watched_jobs[i]->job_id);
+		strcat(list, tmp);
+	}
+
+	return list;
+}
+
+
+/* Updates the status of all unfinished jobs with a single call to squeue.
+ * With --array, each task of a job array gets its own line, and %F gives the
+ * ID of the whole array (or of the job itself, if it isn't an array). */
+static int poll_jobs()
+{
+	const gchar *args[7];
 	GError *error = NULL;
 	GSubprocess *sp;
-	char job_id_str[64];
+	char *job_list;
 	char *line;
 	char *nl;
 	GBytes *stdout_buf;
 	GBytes *stderr_buf;
 	char *buf;
 	char *buf_stderr;
+	int changed = 0;
+	int i;
 
-	snprintf(job_id_str, 63, "%i", job_id);
-	args[0] = "scontrol";
-	args[1] = "-o";
-	args[2] = "show";
-	args[3] = "job";
-	args[4] = job_id_str;
+	job_list = watched_job_list();
+	if ( job_list == NULL ) return 1;
+
+	args[0] = "squeue";
+	args[1] = "--noheader";
+	args[2] = "--array";
+	args[3] = "--format=%F %T";
+	args[4] = job_list;
 	args[5] = NULL;
 
 	sp = g_subprocess_newv(args, G_SUBPROCESS_FLAGS_STDOUT_PIPE
 	                           | G_SUBPROCESS_FLAGS_STDERR_PIPE, &error);
+	free(job_list);
 	if ( sp == NULL ) {
-		ERROR("Failed to invoke scontrol: %s\n", error->message);
+		ERROR("Failed to invoke squeue: %s\n", error->message);
 		g_error_free(error);
 		return 1;
 	}
@@ -155,58 +232,65 @@ static int get_job_status(int job_id, int *n_alive, int *n_running)
 	if ( !g_subprocess_communicate(sp, NULL, NULL,
 	                               &stdout_buf, &stderr_buf, &error) )
 	{
-		ERROR("Error communicating with scontrol: %s\n", error->message);
+		ERROR("Error communicating with squeue: %s\n", error->message);
 		g_error_free(error);
+		g_object_unref(sp);
 		return 1;
 	}
+	g_object_unref(sp);
 
 	buf = g_bytes_to_terminated_array(stdout_buf);
 	buf_stderr = g_bytes_to_terminated_array(stderr_buf);
+	if ( (buf == NULL) || (buf_stderr == NULL) ) {
+		free(buf);
+		free(buf_stderr);
+		return 1;
+	}
 
-	if ( buf_stderr[0] != '\0' ) {
-		ERROR("scontrol error: %s\n", buf_stderr);
+	/* squeue complains if a single job is given and Slurm has already
+	 * forgotten about it.  The job has finished in that case. */
+	if ( (buf_stderr[0] != '\0')
+	  && (strstr(buf_stderr, "Invalid job id") == NULL) )
+	{
+		ERROR("squeue error: %s\n", buf_stderr);
 		/* ... but carry on */
 	}
 	free(buf_stderr);
 
-	*n_alive = 0;
-	*n_running = 0;
+	for ( i=0; i<n_watched_jobs; i++ ) {
+		watched_jobs[i]->new_alive = 0;
+		watched_jobs[i]->new_running = 0;
+	}
 
 	/* Parse output */
 	line = &buf[0];
 	nl = strchr(line, '\n');
 	while ( nl != NULL ) {
 
-		int p1, p2;
+		unsigned int job_id;
+		char state[64];
+		struct slurm_job *job;
 
 		nl[0] = '\0';
 
-		const char *state = get_str_val(line, "JobState");
-		const char *array_task_str = get_str_val(line, "ArrayTaskId");
-
-		if ((strcmp(state, "PENDING") == 0)
-		 || (strcmp(state, "SUSPENDED") == 0))
-		{
-			(*n_alive)++;
-		}
-
-		if ((strcmp(state, "RUNNING") == 0)
-		 || (strcmp(state, "COMPLETING") == 0))
+		if ( (sscanf(line, "%u %63s", &job_id, state) == 2)
+		  && ((job = find_watched_job(job_id)) != NULL) )
 		{
-			(*n_running)++;
-		}
+			if ( (strcmp(state, "PENDING") == 0)
+			  || (strcmp(state, "SUSPENDED") == 0) )
+			{
+				job->new_alive++;
+			}
 
-		if ( (array_task_str != NULL)
-		  && (sscanf(array_task_str, "%i-%i", &p1, &p2) == 2) )
-		{
-			/* This is a "job array leader" */
-			if ((strcmp(state, "PENDING") == 0)
-			 || (strcmp(state, "SUSPENDED") == 0)) {
-				(*n_alive) += p2-p1;
+			if ( (strcmp(state, "RUNNING") == 0)
+			  || (strcmp(state, "COMPLETING") == 0) )
+			{
+				job->new_running++;
 			}
-		}
 
-		/* We are not interested in: FAILED, COMPLETED, CANCELLED */
+			/* We are not interested in: FAILED, COMPLETED,
+			 * CANCELLED */
+		}
 
 		line = nl+1;
 		nl = strchr(line, '\n');
@@ -214,38 +298,86 @@ static int get_job_status(int job_id, int *n_alive, int *n_running)
 
 	free(buf);
 
+	/* Jobs which didn't appear at all have finished, and won't be
+	 * asked about again */
+	for ( i=n_watched_jobs-1; i>=0; i-- ) {
+		struct slurm_job *job = watched_jobs[i];
+		if ( (job->new_alive != job->n_alive)
+		  || (job->new_running != job->n_running) )
+		{
+			changed = 1;
+		}
+		job->n_alive = job->new_alive;
+		job->n_running = job->new_running;
+		if ( job->n_alive + job->n_running == 0 ) {
+			job->finished = 1;
+			unwatch_job(job);
+		}
+	}
+
+	if ( changed ) {
+		poll_interval = SLURM_POLL_MIN;
+	} else {
+		poll_interval *= 2;
+		if ( poll_interval > SLURM_POLL_MAX ) {
+			poll_interval = SLURM_POLL_MAX;
+		}
+	}
+
 	return 0;
 }
 
 
-static double indexing_progress(struct slurm_job *job, int n_alive, int n_running)
+static int update_job_status(struct slurm_job *job)
 {
-	/* If there are lots of blocks, just count running jobs instead of
-	 * reading loads of log files */
-	if ( job->n_blocks > 15 ) {
+	gint64 now;
 
-		return (job->n_blocks - n_alive - 0.5*n_running) / job->n_blocks;
+	if ( job->finished ) return 0;
 
-	} else {
+	now = g_get_monotonic_time();
+	if ( (last_poll != 0) && (now - last_poll < poll_interval) ) return 0;
+	last_poll = now;
+
+	return poll_jobs();
+}
+
+
+/* Returns non-zero if the file has changed size since last time */
+static int log_grown(const char *filename, off_t *psize)
+{
+	struct stat s;
+
+	if ( stat(filename, &s) == -1 ) return 0;
+	if ( s.st_size == *psize ) return 0;
+	*psize = s.st_size;
+	return 1;
+}
 
-		int ijob;
-		int n_proc = 0;
 
-		for ( ijob=0; ijob<job->n_blocks; ijob++ ) {
+static double indexing_progress(struct slurm_job *job)
+{
+	int ijob;
+	int n_proc = 0;
 
-			char tmp[128];
-			char *stderr_filename;
+	/* Only the log files which have grown need to be read again */
+	for ( ijob=0; ijob<job->n_blocks; ijob++ ) {
 
-			snprintf(tmp, 127, "stderr-%i.log", ijob);
-			stderr_filename = relative_to_cwd(job->workdir, tmp);
+		char tmp[128];
+		char *stderr_filename;
 
-			n_proc += read_number_processed(stderr_filename);
-			g_free(stderr_filename);
+		snprintf(tmp, 127, "stderr-%i.log", ijob);
+		stderr_filename = relative_to_cwd(job->workdir, tmp);
 
+		if ( log_grown(stderr_filename, &job->block_log_sizes[ijob]) ) {
+			job->block_n_proc[ijob] = read_number_processed(stderr_filename);
 		}
+		g_free(stderr_filename);
+
+		n_proc += job->block_n_proc[ijob];
 
-		return (double)n_proc / job->n_frames;
 	}
+
+	return (double)n_proc / job->n_frames;
 }
 
 
@@ -254,30 +386,36 @@ static int get_task_status(void *job_priv,
                            float *frac_complete)
 {
 	struct slurm_job *job = job_priv;
-	int n_running, n_alive;
 
-	if ( get_job_status(job->job_id, &n_alive, &n_running) ) {
+	if ( update_job_status(job) ) {
 		ERROR("Failed to get task status: %i\n", job->job_id);
 		return 1;
 	}
 
+	*running = !job->finished;
+
 	switch ( job->type ) {
 
 		case GUI_JOB_INDEXING :
-		*frac_complete = indexing_progress(job, n_alive, n_running);
-		*running = (n_alive+n_running > 0);
+		*frac_complete = indexing_progress(job);
 		break;
 
 		case GUI_JOB_AMBIGATOR :
-		*frac_complete = read_ambigator_progress(job->stderr_filename,
-		                                         job->niter);
+		if ( log_grown(job->stderr_filename, &job->log_size) ) {
+			job->frac_complete = read_ambigator_progress(job->stderr_filename,
+			                                             job->niter);
+		}
+		*frac_complete = job->frac_complete;
 		break;
 
 		case GUI_JOB_PROCESS_HKL :
 		case GUI_JOB_PROCESS_HKL_SCALE :
 		case GUI_JOB_PARTIALATOR :
-		*frac_complete = read_merge_progress(job->stderr_filename,
-		                                     job->type);
+		if ( log_grown(job->stderr_filename, &job->log_size) ) {
+			job->frac_complete = read_merge_progress(job->stderr_filename,
+			                                         job->type);
+		}
+		*frac_complete = job->frac_complete;
 		break;
 
 	}
@@ -289,8 +427,11 @@ static int get_task_status(void *job_priv,
 static void free_task(void *job_priv)
 {
 	struct slurm_job *job = job_priv;
+	unwatch_job(job);
 	g_object_unref(job->workdir);
 	free(job->stderr_filename);
+	free(job->block_log_sizes);
+	free(job->block_n_proc);
 }
 
 
@@ -735,6 +876,17 @@ static struct slurm_job *start_slurm_job(enum gui_job_type type,
 		job->job_id = job_id;
 		job->stderr_filename = strdup(stderr_filename);
 		job->workdir = g_file_dup(workdir);
+		job->n_alive = 1;
+		job->n_running = 0;
+		job->finished = 0;
+		job->n_frames = 0;
+		job->n_blocks = 0;
+		job->block_log_sizes = NULL;
+		job->block_n_proc = NULL;
+		job->niter = 0;
+		job->log_size = 0;
+		job->frac_complete = 0.0;
+		watch_job(job);
 
 		STATUS("Submitted batch job ID %i\n", job_id);
 
@@ -782,6 +934,48 @@ static void write_partial_file_list(GFile *workdir,
 }
 
 
+/* Shell code for each array task to keep taking blocks of frames until there
+ * are none left.  A block is claimed by creating its lease directory, which
+ * is atomic even on a shared filesystem.  The block number is in ${BLOCK}. */
+static char *add_dynamic_loop(char *prologue, const char *lease_dir,
+                              int n_blocks)
+{
+	char *str;
+	size_t len;
+
+	if ( prologue == NULL ) return NULL;
+
+	len = strlen(prologue) + 3*strlen(lease_dir) + 256;
+	str = malloc(len);
+	if ( str == NULL ) {
+		free(prologue);
+		return NULL;
+	}
+
+	snprintf(str, len, "%s"
+	         "mkdir -p %s\n"
+	         "BLOCK=0\n"
+	         "while [ ${BLOCK} -lt %i ]; do\n"
+	         "if mkdir %s/block-${BLOCK} 2>/dev/null; then\n"
+	         "echo ${SLURM_ARRAY_TASK_ID} >%s/block-${BLOCK}/task\n",
+	         prologue, lease_dir, n_blocks, lease_dir, lease_dir);
+
+	free(prologue);
+	return str;
+}
+
+
+static int finish_dynamic_loop(const char *script_filename)
+{
+	FILE *fh = fopen(script_filename, "a");
+	if ( fh == NULL ) return 1;
+	fprintf(fh, "fi\n");
+	fprintf(fh, "BLOCK=$((${BLOCK}+1))\n");
+	fprintf(fh, "done\n");
+	return fclose(fh) != 0;
+}
+
+
 static void *run_indexing(const char *job_title,
                           const char *job_notes,
                           struct crystfelproject *proj,
@@ -795,11 +989,17 @@ static void *run_indexing(const char *job_title,
 	char **streams;
 	GFile *workdir;
 	int n_blocks;
+	int n_tasks;
+	const char *block_var;
 	char array_inx[128];
 	char serial_offs[128];
+	char tmp[128];
 	gchar *sc_rel_filename;
 	gchar *stdout_rel_filename;
 	gchar *stderr_rel_filename;
+	gchar *task_stdout_rel_filename;
+	gchar *task_stderr_rel_filename;
+	gchar *lease_rel_dir;
 	gchar *files_rel_filename;
 	gchar *stream_rel_filename;
 	gchar *harvest_rel_filename;
@@ -840,22 +1040,66 @@ static void *run_indexing(const char *job_title,
 		streams[i] = relative_to_cwd(workdir, stream_filename);
 	}
 
-	snprintf(array_inx, 127, "0-%i", n_blocks-1);
-	snprintf(serial_offs, 127, "$((${SLURM_ARRAY_TASK_ID}*%i+1))",
+	/* Either each array task does one block, or a smaller number of
+	 * tasks share out the blocks between them */
+	if ( opts->dynamic ) {
+		n_tasks = (opts->n_tasks < n_blocks) ? opts->n_tasks : n_blocks;
+		if ( n_tasks < 1 ) n_tasks = 1;
+		block_var = "${BLOCK}";
+		STATUS("Sharing the blocks between %i array tasks\n", n_tasks);
+	} else {
+		n_tasks = n_blocks;
+		block_var = "${SLURM_ARRAY_TASK_ID}";
+	}
+
+	snprintf(array_inx, 127, "0-%i", n_tasks-1);
+	snprintf(serial_offs, 127, "$((%s*%i+1))", block_var,
 	         opts->block_size);
 
 	sc_rel_filename = relative_to_cwd(workdir, "run_indexamajig.sh");
-	files_rel_filename = relative_to_cwd(workdir,
-	                                     "files-${SLURM_ARRAY_TASK_ID}.lst");
-	stream_rel_filename = relative_to_cwd(workdir,
-	                                      "crystfel-${SLURM_ARRAY_TASK_ID}.stream");
-	stdout_rel_filename = relative_to_cwd(workdir, "stdout-%a.log");
-	stderr_rel_filename = relative_to_cwd(workdir, "stderr-%a.log");
+	snprintf(tmp, 127, "files-%s.lst", block_var);
+	files_rel_filename = relative_to_cwd(workdir, tmp);
+	snprintf(tmp, 127, "crystfel-%s.stream", block_var);
+	stream_rel_filename = relative_to_cwd(workdir, tmp);
 	harvest_rel_filename = relative_to_cwd(workdir, "parameters.json");
-	mille_rel_filename = relative_to_cwd(workdir, "mille-data-${SLURM_ARRAY_TASK_ID}");
+	snprintf(tmp, 127, "mille-data-%s", block_var);
+	mille_rel_filename = relative_to_cwd(workdir, tmp);
+
+	if ( opts->dynamic ) {
+
+		/* The output from each block goes to its own log files, as
+		 * expected by indexing_progress() */
+		snprintf(tmp, 127, "stdout-%s.log", block_var);
+		stdout_rel_filename = relative_to_cwd(workdir, tmp);
+		snprintf(tmp, 127, "stderr-%s.log", block_var);
+		stderr_rel_filename = relative_to_cwd(workdir, tmp);
+		task_stdout_rel_filename = relative_to_cwd(workdir,
+		                                           "task-stdout-%a.log");
+		task_stderr_rel_filename = relative_to_cwd(workdir,
+		                                           "task-stderr-%a.log");
+		lease_rel_dir = relative_to_cwd(workdir, "leases");
+
+		slurm_prologue = sbatch_bits(&opts->common, job_title,
+		                             array_inx,
+		                             task_stdout_rel_filename,
+		                             task_stderr_rel_filename);
+		slurm_prologue = add_dynamic_loop(slurm_prologue,
+		                                  lease_rel_dir, n_blocks);
+
+		g_free(task_stdout_rel_filename);
+		g_free(task_stderr_rel_filename);
+		g_free(lease_rel_dir);
 
-	slurm_prologue = sbatch_bits(&opts->common, job_title, array_inx,
-	                             stdout_rel_filename, stderr_rel_filename);
+	} else {
+
+		stdout_rel_filename = relative_to_cwd(workdir, "stdout-%a.log");
+		stderr_rel_filename = relative_to_cwd(workdir, "stderr-%a.log");
+		slurm_prologue = sbatch_bits(&opts->common, job_title,
+		                             array_inx,
+		                             stdout_rel_filename,
+		                             stderr_rel_filename);
+
+	}
 
 	/* Copy geometry file into working directory
 	 * Used for geometry refinement, not indexing! */
@@ -867,20 +1111,24 @@ static void *run_indexing(const char *job_title,
 	g_object_unref(ggeom);
 	g_object_unref(ggeomcopy);
 
-	if ( !write_indexamajig_script(sc_rel_filename,
+	if ( (slurm_prologue != NULL)
+	  && !write_indexamajig_script(sc_rel_filename,
 	                               proj->geom_filename,
 	                               "`nproc`",
 	                               files_rel_filename,
 	                               stream_rel_filename,
-	                               NULL, NULL,
+	                               opts->dynamic ? stdout_rel_filename : NULL,
+	                               opts->dynamic ? stderr_rel_filename : NULL,
 	                               harvest_rel_filename,
 	                               mille_rel_filename,
+	                               NULL,
 	                               serial_offs,
 	                               &proj->peak_search_params,
 	                               &proj->indexing_params,
 	                               wavelength_estimate,
 	                               clen_estimate,
-	                               slurm_prologue) )
+	                               slurm_prologue)
+	  && (!opts->dynamic || !finish_dynamic_loop(sc_rel_filename)) )
 	{
 		/* The stderr filename isn't used by indexing_progress() in the
 		 * Slurm backend - it knows where to find the files. */
@@ -895,7 +1143,13 @@ static void *run_indexing(const char *job_title,
 
 	if ( job != NULL ) {
 		job->n_frames = proj->n_frames;
-		job->n_blocks = n_blocks;
+		job->block_log_sizes = calloc(n_blocks, sizeof(off_t));
+		job->block_n_proc = calloc(n_blocks, sizeof(int));
+		if ( (job->block_log_sizes != NULL)
+		  && (job->block_n_proc != NULL) )
+		{
+			job->n_blocks = n_blocks;
+		}
 		add_indexing_result(proj, job_title, streams, n_blocks);
 	}
 
@@ -932,6 +1186,28 @@ static gboolean block_size_focus_sig(GtkEntry *entry, GdkEvent *event,
 }
 
 
+static void n_tasks_activate_sig(GtkEntry *entry, gpointer data)
+{
+	struct slurm_indexing_opts *opts = data;
+	convert_int(gtk_entry_get_text(entry), &opts->n_tasks);
+}
+
+
+static gboolean n_tasks_focus_sig(GtkEntry *entry, GdkEvent *event,
+                                  gpointer data)
+{
+	n_tasks_activate_sig(entry, data);
+	return FALSE;
+}
+
+
+static void dynamic_toggle_sig(GtkToggleButton *toggle, gpointer data)
+{
+	struct slurm_indexing_opts *opts = data;
+	opts->dynamic = gtk_toggle_button_get_active(toggle);
+}
+
+
 static GtkWidget *make_indexing_parameters_widget(void *opts_priv)
 {
 	struct slurm_indexing_opts *opts = opts_priv;
@@ -939,6 +1215,7 @@ static GtkWidget *make_indexing_parameters_widget(void *opts_priv)
 	GtkWidget *hbox;
 	GtkWidget *entry;
 	GtkWidget *label;
+	GtkWidget *toggle;
 	char tmp[64];
 
 	vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 8);
@@ -966,6 +1243,35 @@ static GtkWidget *make_indexing_parameters_widget(void *opts_priv)
 	gtk_box_pack_start(GTK_BOX(hbox), GTK_WIDGET(label),
 	                   FALSE, FALSE, 0);
 
+	hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+	gtk_box_pack_start(GTK_BOX(vbox), GTK_WIDGET(hbox),
+	                   FALSE, FALSE, 0);
+	toggle = gtk_check_button_new_with_label("Share the blocks dynamically between");
+	set_active(toggle, opts->dynamic);
+	gtk_widget_set_tooltip_text(toggle, "Each array task keeps taking "
+	                            "blocks until none are left, so that "
+	                            "slow blocks don't hold up the whole job.  "
+	                            "Use smaller blocks with this option.");
+	gtk_box_pack_start(GTK_BOX(hbox), GTK_WIDGET(toggle),
+	                   FALSE, FALSE, 0);
+	g_signal_connect(G_OBJECT(toggle), "toggled",
+	                 G_CALLBACK(dynamic_toggle_sig), opts);
+	snprintf(tmp, 63, "%i", opts->n_tasks);
+	entry = gtk_entry_new();
+	gtk_entry_set_width_chars(GTK_ENTRY(entry), 5);
+	gtk_entry_set_text(GTK_ENTRY(entry), tmp);
+	gtk_box_pack_start(GTK_BOX(hbox), GTK_WIDGET(entry),
+	                   FALSE, FALSE, 0);
+	g_signal_connect(G_OBJECT(entry), "activate",
+	                 G_CALLBACK(n_tasks_activate_sig),
+	                 opts);
+	g_signal_connect(G_OBJECT(entry), "focus-out-event",
+	                 G_CALLBACK(n_tasks_focus_sig),
+	                 opts);
+	label = gtk_label_new("array tasks");
+	gtk_box_pack_start(GTK_BOX(hbox), GTK_WIDGET(label),
+	                   FALSE, FALSE, 0);
+
 	return vbox;
 }
 
@@ -990,6 +1296,8 @@ static struct slurm_indexing_opts *make_default_slurm_indexing_opts()
 
 	set_default_common_opts(&opts->common);
 	opts->block_size = 1000;
+	opts->dynamic = 0;
+	opts->n_tasks = 16;
 
 	return opts;
 }
@@ -1003,6 +1311,10 @@ static void write_indexing_opts(void *opts_priv, FILE *fh)
 
 	fprintf(fh, "indexing.slurm.block_size %i\n",
 	        opts->block_size);
+	fprintf(fh, "indexing.slurm.dynamic %i\n",
+	        opts->dynamic);
+	fprintf(fh, "indexing.slurm.n_tasks %i\n",
+	        opts->n_tasks);
 }
 
 
@@ -1018,6 +1330,16 @@ static void read_indexing_opt(void *opts_priv,
 		}
 	}
 
+	if ( strcmp(key, "indexing.slurm.dynamic") == 0 ) {
+		opts->dynamic = atoi(val);
+	}
+
+	if ( strcmp(key, "indexing.slurm.n_tasks") == 0 ) {
+		if ( convert_int(val, &opts->n_tasks) ) {
+			ERROR("Invalid number of array tasks: %s\n", val);
+		}
+	}
+
 	if ( strcmp(key, "indexing.slurm.email_address") == 0 ) {
 		opts->common.email_address = strdup(val);
 	}
@@ -60,6 +60,7 @@ struct fom_window
 	GtkWidget *cell_chooser;
 	GtkWidget *graph;
 	GtkWidget *input_combo;
+	GtkWidget *spinner;
 
 	int n_foms;
 	GtkWidget *fom_checkboxes[16];
@@ -70,6 +71,84 @@ struct fom_window
 	enum fom_type *calc_fom_types;
 	double **calc_fom_values;
 	double *calc_fom_overall;
+
+	/* NULL while a calculation is running */
+	struct fom_cache *cache;
+
+	/* Non-NULL while a calculation is running */
+	GCancellable *cancellable;
+	int update_pending;
+	int closed;
+};
+
+
+/* Everything loaded or calculated so far for one dataset, so that only the
+ * parts affected by a change of parameters need to be redone.  While a
+ * calculation is running, this belongs to the worker thread. */
+struct fom_cache
+{
+	/* Merged data, as read from these files */
+	char *hkl;
+	char *hkl1;
+	char *hkl2;
+	SymOpList *sym;
+	RefList *raw_refl;
+	RefList *raw_part1;
+	RefList *raw_part2;
+
+	char *cell_filename;
+	UnitCell *cell;
+
+	/* Reflections selected using these parameters */
+	int selected;
+	double min_res;
+	double max_res;
+	double min_snr;
+	int min_meas;
+	RefList *all_refls;
+	RefList *part1;
+	RefList *part2;
+	RefList *all_refls_anom;
+	RefList *part1_anom;
+	RefList *part2_anom;
+
+	/* Resolution shells, and FoMs calculated using them.  The FoMs are
+	 * indexed in the same way as fom_window.fom_types */
+	struct fom_shells *shells;
+	int nbins;
+	int fom_done[16];
+	double *fom_values[16];
+	double fom_overall[16];
+};
+
+
+struct fom_job
+{
+	struct fom_window *f;
+	struct fom_cache *cache;
+
+	char *name;
+	char *hkl;
+	char *hkl1;
+	char *hkl2;
+	char *cell_filename;
+	UnitCell *cell;
+	double min_res;
+	double max_res;
+	double min_snr;
+	int min_meas;
+	int nbins;
+	int n_sel;
+	int sel[16];
+	enum fom_type sel_types[16];
+
+	/* Results */
+	struct fom_shells *shells;
+	double *shell_centers;
+	int n_foms;
+	enum fom_type *fom_types;
+	double **fom_values;
+	double *fom_overall;
 };
 
 
@@ -85,18 +164,6 @@ static int fom_selected(struct fom_window *f, int i)
 }
 
 
-static int anomalous_foms_selected(struct fom_window *f)
-{
-	int i;
-	for ( i=0; i<f->n_foms; i++ ) {
-		if ( fom_selected(f, i) ) {
-			if ( fom_is_anomalous(f->fom_types[i]) ) return 1;
-		}
-	}
-	return 0;
-}
-
-
 static double *make_shell_centers(struct fom_shells *shells)
 {
 	int i;
@@ -130,50 +197,127 @@ static double *make_fom_vals(struct fom_context *fctx,
 }
 
 
-static int load_dataset(struct gui_merge_result *result,
-                        int need_ano, UnitCell *cell,
-                        double min_res, double max_res,
-                        int min_meas, double min_snr,
-                        SymOpList **psym,
-                        RefList **pall_refls,
-                        RefList **pall_refls_anom,
-                        RefList **ppart1,
-                        RefList **ppart2,
-                        RefList **ppart1_anom,
-                        RefList **ppart2_anom)
+static int same_string(const char *a, const char *b)
+{
+	if ( (a == NULL) || (b == NULL) ) return a == b;
+	return strcmp(a, b) == 0;
+}
+
+
+static void free_shells(struct fom_shells *shells)
+{
+	if ( shells == NULL ) return;
+	cffree(shells->rmins);
+	cffree(shells->rmaxs);
+	cffree(shells);
+}
+
+
+/* Forget the figures of merit, e.g. because the resolution shells changed */
+static void clear_fom_values(struct fom_cache *c)
+{
+	int i;
+	for ( i=0; i<16; i++ ) {
+		free(c->fom_values[i]);
+		c->fom_values[i] = NULL;
+		c->fom_done[i] = 0;
+	}
+}
+
+
+static void clear_selection(struct fom_cache *c)
+{
+	reflist_free(c->all_refls);
+	reflist_free(c->part1);
+	reflist_free(c->part2);
+	reflist_free(c->all_refls_anom);
+	reflist_free(c->part1_anom);
+	reflist_free(c->part2_anom);
+	c->all_refls = NULL;
+	c->part1 = NULL;
+	c->part2 = NULL;
+	c->all_refls_anom = NULL;
+	c->part1_anom = NULL;
+	c->part2_anom = NULL;
+	c->selected = 0;
+
+	free_shells(c->shells);
+	c->shells = NULL;
+	clear_fom_values(c);
+}
+
+
+static void clear_fom_cache(struct fom_cache *c)
+{
+	clear_selection(c);
+	reflist_free(c->raw_refl);
+	reflist_free(c->raw_part1);
+	reflist_free(c->raw_part2);
+	c->raw_refl = NULL;
+	c->raw_part1 = NULL;
+	c->raw_part2 = NULL;
+	free_symoplist(c->sym);
+	c->sym = NULL;
+	free(c->hkl);
+	free(c->hkl1);
+	free(c->hkl2);
+	c->hkl = NULL;
+	c->hkl1 = NULL;
+	c->hkl2 = NULL;
+}
+
+
+static struct fom_cache *new_fom_cache()
+{
+	return calloc(1, sizeof(struct fom_cache));
+}
+
+
+static void free_fom_cache(struct fom_cache *c)
+{
+	if ( c == NULL ) return;
+	clear_fom_cache(c);
+	free(c->cell_filename);
+	cell_free(c->cell);
+	free(c);
+}
+
+
+static int load_dataset(struct fom_cache *c, struct fom_job *job)
 {
 	RefList *raw_refl;
 	RefList *raw_part1;
 	RefList *raw_part2;
-	RefList *all_refls = NULL;
-	RefList *all_refls_anom = NULL;
-	RefList *part1 = NULL;
-	RefList *part2 = NULL;
-	RefList *part1_anom = NULL;
-	RefList *part2_anom = NULL;
-	SymOpList *sym;
 	char *sym_str;
 	char *sym_str_part1;
 	char *sym_str_part2;
 
-	raw_refl = read_reflections_2(result->hkl, &sym_str);
+	clear_fom_cache(c);
+
+	raw_refl = read_reflections_2(job->hkl, &sym_str);
 	if ( raw_refl == NULL ) {
 		ERROR("Failed to load dataset %s (%s)\n",
-		      result->name, result->hkl);
+		      job->name, job->hkl);
 		return 1;
 	}
 
-	raw_part1 = read_reflections_2(result->hkl1, &sym_str_part1);
+	raw_part1 = read_reflections_2(job->hkl1, &sym_str_part1);
 	if ( raw_part1 == NULL ) {
 		ERROR("Failed to load part 1 dataset %s (%s)\n",
-		      result->name, result->hkl1);
+		      job->name, job->hkl1);
+		reflist_free(raw_refl);
+		free(sym_str);
 		return 1;
 	}
 
-	raw_part2 = read_reflections_2(result->hkl2, &sym_str_part2);
+	raw_part2 = read_reflections_2(job->hkl2, &sym_str_part2);
 	if ( raw_part2 == NULL ) {
 		ERROR("Failed to load part 2 dataset %s (%s)\n",
-		      result->name, result->hkl2);
+		      job->name, job->hkl2);
+		reflist_free(raw_refl);
+		reflist_free(raw_part1);
+		free(sym_str);
+		free(sym_str_part1);
 		return 1;
 	}
 
@@ -182,6 +326,9 @@ static int load_dataset(struct gui_merge_result *result,
 	  || (sym_str_part2 == NULL) )
 	{
 		ERROR("Reflection list has no point group\n");
+		free(sym_str);
+		free(sym_str_part1);
+		free(sym_str_part2);
 		reflist_free(raw_refl);
 		reflist_free(raw_part1);
 		reflist_free(raw_part2);
@@ -201,122 +348,245 @@ static int load_dataset(struct gui_merge_result *result,
 		return 1;
 	}
 
-	sym = get_pointgroup(sym_str);
+	c->sym = get_pointgroup(sym_str);
 	free(sym_str);
 	free(sym_str_part1);
 	free(sym_str_part2);
 
-	fom_select_reflections(raw_refl, &all_refls,
-	                       cell, sym,
-	                       1e10/min_res, 1e10/max_res,
-	                       min_snr, 0, 0, min_meas);
-	if ( all_refls == NULL ) {
+	c->raw_refl = raw_refl;
+	c->raw_part1 = raw_part1;
+	c->raw_part2 = raw_part2;
+	c->hkl = strdup(job->hkl);
+	c->hkl1 = strdup(job->hkl1);
+	c->hkl2 = strdup(job->hkl2);
+	return 0;
+}
+
+
+static int select_dataset(struct fom_cache *c, struct fom_job *job)
+{
+	clear_selection(c);
+
+	fom_select_reflections(c->raw_refl, &c->all_refls,
+	                       c->cell, c->sym,
+	                       1e10/job->min_res, 1e10/job->max_res,
+	                       job->min_snr, 0, 0, job->min_meas);
+	if ( c->all_refls == NULL ) {
 		ERROR("Failed to select reflections for dataset '%s'\n",
-		      result->name);
-		reflist_free(raw_refl);
-		reflist_free(raw_part1);
-		reflist_free(raw_part2);
+		      job->name);
 		return 1;
 	}
 
-	fom_select_reflection_pairs(raw_part1, raw_part2,
-	                            &part1, &part2,
-	                            cell, sym, 0,
-	                            1e10/min_res, 1e10/max_res,
-	                            min_snr, 0, 0, min_meas);
-	if ( (part1 == NULL) || (part2 == NULL) ) {
+	fom_select_reflection_pairs(c->raw_part1, c->raw_part2,
+	                            &c->part1, &c->part2,
+	                            c->cell, c->sym, 0,
+	                            1e10/job->min_res, 1e10/job->max_res,
+	                            job->min_snr, 0, 0, job->min_meas);
+	if ( (c->part1 == NULL) || (c->part2 == NULL) ) {
 		ERROR("Failed to select reflection pairs for dataset '%s'\n",
-		      result->name);
-		reflist_free(all_refls);
-		reflist_free(raw_refl);
-		reflist_free(raw_part1);
-		reflist_free(raw_part2);
+		      job->name);
+		clear_selection(c);
 		return 1;
 	}
 
-	if ( need_ano ) {
+	c->min_res = job->min_res;
+	c->max_res = job->max_res;
+	c->min_snr = job->min_snr;
+	c->min_meas = job->min_meas;
+	c->selected = 1;
+	return 0;
+}
 
-		fom_select_reflections(raw_refl, &all_refls_anom,
-		                       cell, sym,
-		                       1e10/min_res, 1e10/max_res,
-		                       min_snr, 0, 0, min_meas);
-		if ( all_refls_anom == NULL ) {
-			ERROR("Failed to load dataset '%s'\n",
-			      result->name);
-			reflist_free(raw_refl);
-			return 1;
-		}
 
-		fom_select_reflection_pairs(raw_part1, raw_part2,
-		                            &part1_anom, &part2_anom,
-		                            cell, sym, 1,
-		                            1e10/min_res, 1e10/max_res,
-		                            min_snr, 0, 0, min_meas);
-		if ( (part1_anom == NULL) || (part2_anom == NULL) ) {
-			ERROR("Failed to select anomalous reflection pairs "
-			      "for dataset '%s'\n", result->name);
-			reflist_free(part1);
-			reflist_free(part2);
-			reflist_free(all_refls);
-			reflist_free(raw_refl);
-			reflist_free(raw_part1);
-			reflist_free(raw_part2);
-			return 1;
-		}
+/* The anomalous selections are only made when an anomalous FoM is needed */
+static int select_anomalous(struct fom_cache *c, struct fom_job *job)
+{
+	fom_select_reflections(c->raw_refl, &c->all_refls_anom,
+	                       c->cell, c->sym,
+	                       1e10/job->min_res, 1e10/job->max_res,
+	                       job->min_snr, 0, 0, job->min_meas);
+	if ( c->all_refls_anom == NULL ) {
+		ERROR("Failed to load dataset '%s'\n", job->name);
+		return 1;
 	}
 
-	reflist_free(raw_refl);
-	reflist_free(raw_part1);
-	reflist_free(raw_part2);
+	fom_select_reflection_pairs(c->raw_part1, c->raw_part2,
+	                            &c->part1_anom, &c->part2_anom,
+	                            c->cell, c->sym, 1,
+	                            1e10/job->min_res, 1e10/job->max_res,
+	                            job->min_snr, 0, 0, job->min_meas);
+	if ( (c->part1_anom == NULL) || (c->part2_anom == NULL) ) {
+		ERROR("Failed to select anomalous reflection pairs "
+		      "for dataset '%s'\n", job->name);
+		reflist_free(c->all_refls_anom);
+		reflist_free(c->part1_anom);
+		reflist_free(c->part2_anom);
+		c->all_refls_anom = NULL;
+		c->part1_anom = NULL;
+		c->part2_anom = NULL;
+		return 1;
+	}
 
-	*pall_refls = all_refls;
-	*pall_refls_anom = all_refls_anom;
-	*ppart1 = part1;
-	*ppart2 = part2;
-	*ppart1_anom = part1_anom;
-	*ppart2_anom = part2_anom;
-	*psym = sym;
 	return 0;
 }
 
 
-static struct fom_context *dispatch_fom(RefList *all_refls,
-                                        RefList *all_refls_anom,
-                                        RefList *part1,
-                                        RefList *part2,
-                                        RefList *part1_anom,
-                                        RefList *part2_anom,
-                                        UnitCell *cell,
-                                        struct fom_shells *shells,
-                                        const SymOpList *sym,
-                                        enum fom_type fom)
+static struct fom_context *dispatch_fom(struct fom_cache *c,
+                                        enum fom_type fom,
+                                        int n_threads)
 {
 	if ( fom_is_anomalous(fom) ) {
 		if ( fom_is_comparison(fom) ) {
-			if ( part1_anom == NULL ) return NULL;
-			if ( part2_anom == NULL ) return NULL;
-			return fom_calculate(part1_anom, part2_anom,
-			                     cell, shells, fom, 1, sym);
+			if ( c->part1_anom == NULL ) return NULL;
+			if ( c->part2_anom == NULL ) return NULL;
+			return fom_calculate_threaded(c->part1_anom,
+			                              c->part2_anom,
+			                              c->cell, c->shells,
+			                              fom, 1, c->sym,
+			                              n_threads);
 		} else {
-			if ( all_refls_anom == NULL ) return NULL;
-			return fom_calculate(all_refls_anom, NULL,
-			                     cell, shells, fom, 1, sym);
+			if ( c->all_refls_anom == NULL ) return NULL;
+			return fom_calculate_threaded(c->all_refls_anom, NULL,
+			                              c->cell, c->shells,
+			                              fom, 1, c->sym,
+			                              n_threads);
 		}
 	} else {
 		if ( fom_is_comparison(fom) ) {
-			if ( part1 == NULL ) return NULL;
-			if ( part2 == NULL ) return NULL;
-			return fom_calculate(part1, part2,
-			                     cell, shells, fom, 1, sym);
+			if ( c->part1 == NULL ) return NULL;
+			if ( c->part2 == NULL ) return NULL;
+			return fom_calculate_threaded(c->part1, c->part2,
+			                              c->cell, c->shells,
+			                              fom, 1, c->sym,
+			                              n_threads);
 		} else {
-			if ( all_refls == NULL ) return NULL;
-			return fom_calculate(all_refls, NULL,
-			                     cell, shells, fom, 1, sym);
+			if ( c->all_refls == NULL ) return NULL;
+			return fom_calculate_threaded(c->all_refls, NULL,
+			                              c->cell, c->shells,
+			                              fom, 1, c->sym,
+			                              n_threads);
 		}
 	}
 }
 
 
+/* Brings the cache up to date with the job's parameters, doing as little
+ * work as possible, then calculates whichever of the selected FoMs aren't
+ * already known.  Returns non-zero on error or cancellation. */
+static int calculate_foms(struct fom_job *job, GCancellable *cancellable)
+{
+	struct fom_cache *c = job->cache;
+	int n_threads = g_get_num_processors();
+	int need_ano = 0;
+	int i;
+
+	if ( !same_string(c->hkl, job->hkl)
+	  || !same_string(c->hkl1, job->hkl1)
+	  || !same_string(c->hkl2, job->hkl2) )
+	{
+		if ( load_dataset(c, job) ) return 1;
+	}
+	if ( g_cancellable_is_cancelled(cancellable) ) return 1;
+
+	if ( !same_string(c->cell_filename, job->cell_filename) ) {
+		clear_selection(c);
+		free(c->cell_filename);
+		c->cell_filename = strdup(job->cell_filename);
+	}
+	cell_free(c->cell);
+	c->cell = job->cell;
+	job->cell = NULL;
+
+	if ( !c->selected
+	  || (c->min_res != job->min_res)
+	  || (c->max_res != job->max_res)
+	  || (c->min_snr != job->min_snr)
+	  || (c->min_meas != job->min_meas) )
+	{
+		if ( select_dataset(c, job) ) return 1;
+	}
+	if ( g_cancellable_is_cancelled(cancellable) ) return 1;
+
+	for ( i=0; i<job->n_sel; i++ ) {
+		if ( fom_is_anomalous(job->sel_types[i]) ) need_ano = 1;
+	}
+	if ( need_ano && (c->all_refls_anom == NULL) ) {
+		if ( select_anomalous(c, job) ) return 1;
+	}
+
+	if ( (c->shells == NULL) || (c->nbins != job->nbins) ) {
+		free_shells(c->shells);
+		clear_fom_values(c);
+		c->shells = fom_make_resolution_shells(1e10/job->min_res,
+		                                       1e10/job->max_res,
+		                                       job->nbins);
+		if ( c->shells == NULL ) {
+			ERROR("Failed to make resolution shells\n");
+			return 1;
+		}
+		c->nbins = job->nbins;
+	}
+
+	for ( i=0; i<job->n_sel; i++ ) {
+
+		struct fom_context *fctx;
+		int fom = job->sel[i];
+
+		if ( g_cancellable_is_cancelled(cancellable) ) return 1;
+		if ( c->fom_done[fom] ) continue;
+
+		fctx = dispatch_fom(c, job->sel_types[i], n_threads);
+		if ( fctx == NULL ) {
+			ERROR("Failed to calculate FoM %i for dataset %s\n",
+			      job->sel_types[i], job->name);
+			continue;
+		}
+
+		c->fom_values[fom] = make_fom_vals(fctx, c->shells);
+		c->fom_overall[fom] = fom_overall_value(fctx);
+		c->fom_done[fom] = 1;
+
+	}
+
+	/* Copies of everything for the graph, which takes ownership */
+	job->shells = fom_make_resolution_shells(1e10/job->min_res,
+	                                         1e10/job->max_res,
+	                                         job->nbins);
+	job->shell_centers = make_shell_centers(c->shells);
+	job->fom_types = malloc(job->n_sel*sizeof(enum fom_type));
+	job->fom_values = malloc(job->n_sel*sizeof(double *));
+	job->fom_overall = malloc(job->n_sel*sizeof(double));
+	if ( (job->shells == NULL) || (job->shell_centers == NULL)
+	  || (job->fom_types == NULL) || (job->fom_values == NULL)
+	  || (job->fom_overall == NULL) ) return 1;
+
+	job->n_foms = 0;
+	for ( i=0; i<job->n_sel; i++ ) {
+		int fom = job->sel[i];
+		double *vals;
+		if ( !c->fom_done[fom] ) continue;
+		vals = malloc(c->shells->nshells*sizeof(double));
+		if ( vals == NULL ) return 1;
+		memcpy(vals, c->fom_values[fom],
+		       c->shells->nshells*sizeof(double));
+		job->fom_types[job->n_foms] = job->sel_types[i];
+		job->fom_values[job->n_foms] = vals;
+		job->fom_overall[job->n_foms] = c->fom_overall[fom];
+		job->n_foms++;
+	}
+
+	return 0;
+}
+
+
+static void fom_thread(GTask *task, gpointer source_object,
+                       gpointer task_data, GCancellable *cancellable)
+{
+	struct fom_job *job = task_data;
+	g_task_return_boolean(task, calculate_foms(job, cancellable) == 0);
+}
+
+
 static void fom_export_response_sig(GtkWidget *dialog, gint resp,
                                     struct fom_window *f)
 {
@@ -380,11 +650,12 @@ static void fom_response_sig(GtkWidget *dialog, gint resp,
 	if ( resp == GTK_RESPONSE_ACCEPT ) {
 		GtkWidget *w;
 		w = gtk_file_chooser_dialog_new("Export filename",
-		                                GTK_WINDOW(f->proj->window),
+		                                GTK_WINDOW(dialog),
 		                                GTK_FILE_CHOOSER_ACTION_SAVE,
 		                                "Export", GTK_RESPONSE_OK,
 		                                NULL);
 		gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(w), TRUE);
+		gtk_window_set_destroy_with_parent(GTK_WINDOW(w), TRUE);
 		g_signal_connect(G_OBJECT(w), "response",
 	                 G_CALLBACK(fom_export_response_sig), f);
 		gtk_widget_show_all(w);
@@ -392,12 +663,112 @@ static void fom_response_sig(GtkWidget *dialog, gint resp,
 }
 
 
+static void free_fom_job(struct fom_job *job)
+{
+	int i;
+
+	free(job->name);
+	free(job->hkl);
+	free(job->hkl1);
+	free(job->hkl2);
+	free(job->cell_filename);
+	cell_free(job->cell);
+	free_shells(job->shells);
+	free(job->shell_centers);
+	free(job->fom_types);
+	if ( job->fom_values != NULL ) {
+		for ( i=0; i<job->n_foms; i++ ) {
+			free(job->fom_values[i]);
+		}
+	}
+	free(job->fom_values);
+	free(job->fom_overall);
+	free_fom_cache(job->cache);
+	free(job);
+}
+
+
+static void free_fom_window(struct fom_window *f)
+{
+	free_fom_cache(f->cache);
+	free_shells(f->calc_shells);
+	free(f->calc_fom_overall);
+	free(f);
+}
+
+
+static void update_fom(GtkWidget *widget, struct fom_window *f);
+
+
+static void fom_finished(GObject *source_object, GAsyncResult *res,
+                         gpointer data)
+{
+	struct fom_job *job = data;
+	struct fom_window *f = job->f;
+
+	f->cache = job->cache;
+	job->cache = NULL;
+	g_object_unref(f->cancellable);
+	f->cancellable = NULL;
+
+	if ( f->closed ) {
+		free_fom_job(job);
+		free_fom_window(f);
+		return;
+	}
+
+	gtk_spinner_stop(GTK_SPINNER(f->spinner));
+
+	if ( g_task_propagate_boolean(G_TASK(res), NULL) ) {
+
+		/* The old graph data is freed by CrystFELFoMGraph
+		 * during the set_data call */
+		crystfel_fom_graph_set_data(CRYSTFEL_FOM_GRAPH(f->graph),
+		                            job->shell_centers,
+		                            job->shells->nshells,
+		                            job->fom_types, job->fom_values,
+		                            job->n_foms);
+
+		free_shells(f->calc_shells);
+		free(f->calc_fom_overall);
+		f->calc_shells = job->shells;
+		f->calc_n_foms = job->n_foms;
+		f->calc_fom_types = job->fom_types;
+		f->calc_fom_values = job->fom_values;
+		f->calc_fom_overall = job->fom_overall;
+
+		job->shells = NULL;
+		job->shell_centers = NULL;
+		job->fom_types = NULL;
+		job->fom_values = NULL;
+		job->fom_overall = NULL;
+	}
+
+	free_fom_job(job);
+
+	if ( f->update_pending ) {
+		f->update_pending = 0;
+		update_fom(NULL, f);
+	}
+}
+
+
 static void update_fom(GtkWidget *widget, struct fom_window *f)
 {
 	int fom;
-	int need_ano;
+	const char *name;
+	struct gui_merge_result *result;
+	struct fom_job *job;
 	UnitCell *cell;
-	struct fom_shells *shells;
+	GTask *task;
+
+	if ( f->cancellable != NULL ) {
+		/* Start again with the new parameters when the current
+		 * calculation has stopped */
+		f->update_pending = 1;
+		g_cancellable_cancel(f->cancellable);
+		return;
+	}
 
 	f->proj->fom_res_min = get_float(f->min_res);
 	f->proj->fom_res_max = get_float(f->max_res);
@@ -421,96 +792,72 @@ static void update_fom(GtkWidget *widget, struct fom_window *f)
 		f->proj->fom_res_max = tmp;
 	}
 
-	shells = fom_make_resolution_shells(1e10/f->proj->fom_res_min,
-	                                    1e10/f->proj->fom_res_max,
-	                                    f->proj->fom_nbins);
-	if ( shells == NULL ) {
-		ERROR("Failed to make resolution shells\n");
+	f->proj->fom_cell_filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(f->cell_chooser));
+	if ( f->proj->fom_cell_filename == NULL ) {
+		ERROR("You must choose the unit cell first.\n");
 		return;
 	}
-
-	f->proj->fom_cell_filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(f->cell_chooser));
 	cell = load_cell_from_file(f->proj->fom_cell_filename);
 	if ( cell == NULL ) {
 		ERROR("Invalid cell file '%s'\n", f->proj->fom_cell_filename);
 		return;
 	}
 
-	need_ano = anomalous_foms_selected(f);
-
-	const char *name;
-	struct gui_merge_result *result;
-	SymOpList *sym = NULL;
-	RefList *all_refls = NULL;
-	RefList *all_refls_anom = NULL;
-	RefList *part1 = NULL;
-	RefList *part2 = NULL;
-	RefList *part1_anom = NULL;
-	RefList *part2_anom = NULL;
-
-	/* Load dataset */
 	name = gtk_combo_box_get_active_id(GTK_COMBO_BOX(f->input_combo));
+	if ( name == NULL ) {
+		cell_free(cell);
+		return;
+	}
 	result = find_merge_result_by_name(f->proj, name);
+	if ( result == NULL ) {
+		cell_free(cell);
+		return;
+	}
 
-	if ( load_dataset(result, need_ano, cell,
-	                  f->proj->fom_res_min,
-	                  f->proj->fom_res_max,
-	                  f->proj->fom_min_meas,
-	                  f->proj->fom_min_snr,
-	                  &sym, &all_refls, &all_refls_anom,
-	                  &part1, &part2, &part1_anom, &part2_anom) )
-	{
+	job = calloc(1, sizeof(struct fom_job));
+	if ( job == NULL ) {
+		cell_free(cell);
 		return;
 	}
 
-	double *shell_centers = malloc(shells->nshells*sizeof(double));
-	double **fom_values = malloc(f->n_foms*sizeof(double *));
-	double *overall_values = malloc(f->n_foms*sizeof(double));
-	enum fom_type *fom_types = malloc(f->n_foms*sizeof(enum fom_type));
+	job->f = f;
+	job->name = strdup(result->name);
+	job->hkl = strdup(result->hkl);
+	job->hkl1 = strdup(result->hkl1);
+	job->hkl2 = strdup(result->hkl2);
+	job->cell_filename = strdup(f->proj->fom_cell_filename);
+	job->cell = cell;
+	job->min_res = f->proj->fom_res_min;
+	job->max_res = f->proj->fom_res_max;
+	job->min_snr = f->proj->fom_min_snr;
+	job->min_meas = f->proj->fom_min_meas;
+	job->nbins = f->proj->fom_nbins;
+	if ( (job->name == NULL) || (job->hkl == NULL)
+	  || (job->hkl1 == NULL) || (job->hkl2 == NULL)
+	  || (job->cell_filename == NULL) )
+	{
+		free_fom_job(job);
+		return;
+	}
 
-	int fomi = 0;
+	job->n_sel = 0;
 	for ( fom=0; fom<f->n_foms; fom++ ) {
-
-		struct fom_context *fctx;
-
 		if ( !fom_selected(f, fom) ) continue;
-
-		fctx = dispatch_fom(all_refls, all_refls_anom,
-		                    part1, part2,
-		                    part1_anom, part2_anom,
-		                    cell, shells, sym,
-		                    f->fom_types[fom]);
-		if ( fctx == NULL ) {
-			ERROR("Failed to calculate FoM %i for dataset %s\n",
-			      f->fom_types[fom], name);
-			continue;
-		}
-
-		fom_types[fomi] = f->fom_types[fom];
-		fom_values[fomi] = make_fom_vals(fctx, shells);
-		overall_values[fomi] = fom_overall_value(fctx);
-		fomi++;
-
+		job->sel[job->n_sel] = fom;
+		job->sel_types[job->n_sel] = f->fom_types[fom];
+		job->n_sel++;
 	}
 
-	free(f->calc_fom_overall);
-	/* All the other old memory is freed by CrystFELFoMGraph
-	 * during the set_data call */
-
-	shell_centers = make_shell_centers(shells);
-	crystfel_fom_graph_set_data(CRYSTFEL_FOM_GRAPH(f->graph),
-	                            shell_centers, shells->nshells,
-	                            fom_types, fom_values, fomi);
-
-	f->calc_shells = shells;
-	f->calc_n_foms = fomi;
-	f->calc_fom_types = fom_types;
-	f->calc_fom_values = fom_values;
-	f->calc_fom_overall = overall_values;
-
-	reflist_free(all_refls);
-	reflist_free(all_refls_anom);
-	free_symoplist(sym);
+	/* The cache belongs to the worker thread until fom_finished() */
+	job->cache = f->cache;
+	f->cache = NULL;
+	f->cancellable = g_cancellable_new();
+	gtk_spinner_start(GTK_SPINNER(f->spinner));
+
+	task = g_task_new(NULL, f->cancellable, fom_finished, job);
+	g_task_set_task_data(task, job, NULL);
+	g_task_run_in_thread(task, fom_thread);
+	g_object_unref(task);
 }
 
 
@@ -673,6 +1020,18 @@ static void cell_file_clear_sig(GtkButton *button,
 }
 
 
+static void fom_destroy_sig(GtkWidget *dialog, struct fom_window *f)
+{
+	if ( f->cancellable != NULL ) {
+		/* Everything will be freed when the calculation stops */
+		f->closed = 1;
+		g_cancellable_cancel(f->cancellable);
+		return;
+	}
+	free_fom_window(f);
+}
+
+
 gint fom_sig(GtkWidget *widget, struct crystfelproject *proj)
 {
 	GtkWidget *dialog;
@@ -690,7 +1049,17 @@ gint fom_sig(GtkWidget *widget, struct crystfelproject *proj)
 
 	f->proj = proj;
 	f->n_foms = 0;
+	f->calc_shells = NULL;
+	f->calc_n_foms = 0;
 	f->calc_fom_overall = NULL;
+	f->cache = new_fom_cache();
+	f->cancellable = NULL;
+	f->update_pending = 0;
+	f->closed = 0;
+	if ( f->cache == NULL ) {
+		free(f);
+		return 0;
+	}
 
 	dialog = gtk_dialog_new_with_buttons("Calculate figures of merit",
 	                                     GTK_WINDOW(proj->window),
@@ -702,6 +1071,9 @@ gint fom_sig(GtkWidget *widget, struct crystfelproject *proj)
 	g_signal_connect(G_OBJECT(dialog), "response",
 	                 G_CALLBACK(fom_response_sig),
 	                 f);
+	g_signal_connect(G_OBJECT(dialog), "destroy",
+	                 G_CALLBACK(fom_destroy_sig),
+	                 f);
 
 	vbox = gtk_vbox_new(FALSE, 0.0);
 	content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
@@ -735,6 +1107,9 @@ gint fom_sig(GtkWidget *widget, struct crystfelproject *proj)
 	                   FALSE, FALSE, 4.0);
 	gtk_menu_button_set_popup(GTK_MENU_BUTTON(button),
 	                          make_fom_menu(f));
+	f->spinner = gtk_spinner_new();
+	gtk_box_pack_start(GTK_BOX(hbox), GTK_WIDGET(f->spinner),
+	                   FALSE, FALSE, 4.0);
 
 	/* Unit cell */
 	hbox = gtk_hbox_new(FALSE, 0.0);
@@ -0,0 +1,529 @@
+/*
+ * gui_imagecache.c
+ *
+ * Load images for the GUI in a separate thread
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* The images for the GUI are read by a loader thread, so that the window
+ * doesn't freeze while reading from a slow filesystem.  The most recently
+ * used images are kept, and the neighbouring frames can be read in advance.
+ *
+ * Images handed out by gui_image_cache_get() still belong to the cache, and
+ * must be given back with gui_image_cache_release().  Only one thread at a
+ * time may read image files (see image_set_file_cache()), so anything else in
+ * the GUI which reads files should do so between gui_image_cache_lock_reading()
+ * and gui_image_cache_unlock_reading(). */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <image.h>
+#include <utils.h>
+
+#include "gui_imagecache.h"
+
+
+enum entry_state
+{
+	ENTRY_FREE,     /* Can be used for a new image */
+	ENTRY_QUEUED,   /* Waiting for the loader thread */
+	ENTRY_LOADING,  /* Being read by the loader thread */
+	ENTRY_READY,    /* Image has been read (or failed) */
+};
+
+
+struct cache_entry
+{
+	enum entry_state state;
+	const DataTemplate *dtempl;
+	char *filename;
+	char *event;
+	struct image *image;
+
+	int wanted;       /* Someone is waiting for this image */
+	int in_use;       /* Number of times handed out and not released */
+	int discarded;    /* Cache was cleared while the image was in use */
+	unsigned long last_used;
+};
+
+
+struct gui_image_cache
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int shutdown;
+
+	/* Held while reading image files */
+	pthread_mutex_t read_lock;
+
+	struct cache_entry *entries;
+	int n_entries;
+	unsigned long clock;
+
+	GSourceFunc loaded_func;
+	gpointer loaded_data;
+};
+
+
+/* Call with the lock held.  Images which someone is waiting for come first,
+ * then the others in the order they were asked for. */
+static struct cache_entry *next_to_load(struct gui_image_cache *ic)
+{
+	struct cache_entry *best = NULL;
+	int i;
+
+	for ( i=0; i<ic->n_entries; i++ ) {
+		struct cache_entry *e = &ic->entries[i];
+		if ( e->state != ENTRY_QUEUED ) continue;
+		if ( e->wanted ) return e;
+		if ( (best == NULL) || (e->last_used < best->last_used) ) {
+			best = e;
+		}
+	}
+
+	return best;
+}
+
+
+static void *loader_thread(void *vp)
+{
+	struct gui_image_cache *ic = vp;
+
+	pthread_mutex_lock(&ic->lock);
+	while ( !ic->shutdown ) {
+
+		struct cache_entry *e = next_to_load(ic);
+		struct image *image;
+
+		if ( e == NULL ) {
+			pthread_cond_wait(&ic->cond, &ic->lock);
+			continue;
+		}
+
+		/* Nothing else touches an entry while it's being loaded */
+		e->state = ENTRY_LOADING;
+		pthread_mutex_unlock(&ic->lock);
+
+		pthread_mutex_lock(&ic->read_lock);
+		image = image_read(e->dtempl, e->filename, e->event,
+		                   0, 0, NULL);
+		pthread_mutex_unlock(&ic->read_lock);
+
+		pthread_mutex_lock(&ic->lock);
+		e->image = image;
+		e->state = ENTRY_READY;
+		e->last_used = ic->clock++;
+		if ( e->wanted ) {
+			e->wanted = 0;
+			g_idle_add(ic->loaded_func, ic->loaded_data);
+		}
+		pthread_cond_broadcast(&ic->cond);
+
+	}
+	pthread_mutex_unlock(&ic->lock);
+
+	return NULL;
+}
+
+
+/**
+ * \param n_images: The maximum number of images to keep
+ * \param loaded_func: Function to call, in the main loop, when an image which
+ *   was not ready for gui_image_cache_get() has been loaded
+ * \param loaded_data: Argument for \p loaded_func
+ *
+ * Starts a loader thread for the GUI.  Memory for \p n_images images will be
+ * needed, which should be enough for the image being displayed plus the ones
+ * being read in advance.
+ *
+ * \returns a new \ref gui_image_cache structure, or NULL on error.
+ */
+struct gui_image_cache *gui_image_cache_new(int n_images,
+                                            GSourceFunc loaded_func,
+                                            gpointer loaded_data)
+{
+	struct gui_image_cache *ic;
+	int i;
+
+	ic = malloc(sizeof(struct gui_image_cache));
+	if ( ic == NULL ) return NULL;
+
+	ic->n_entries = n_images;
+	ic->entries = malloc(n_images*sizeof(struct cache_entry));
+	if ( ic->entries == NULL ) {
+		free(ic);
+		return NULL;
+	}
+
+	for ( i=0; i<n_images; i++ ) {
+		ic->entries[i].state = ENTRY_FREE;
+		ic->entries[i].filename = NULL;
+		ic->entries[i].event = NULL;
+		ic->entries[i].image = NULL;
+		ic->entries[i].in_use = 0;
+		ic->entries[i].discarded = 0;
+	}
+
+	ic->loaded_func = loaded_func;
+	ic->loaded_data = loaded_data;
+	ic->shutdown = 0;
+	ic->clock = 0;
+	pthread_mutex_init(&ic->lock, NULL);
+	pthread_mutex_init(&ic->read_lock, NULL);
+	pthread_cond_init(&ic->cond, NULL);
+
+	if ( pthread_create(&ic->thread, NULL, loader_thread, ic) ) {
+		ERROR("Failed to start image loading thread\n");
+		pthread_mutex_destroy(&ic->lock);
+		pthread_mutex_destroy(&ic->read_lock);
+		pthread_cond_destroy(&ic->cond);
+		free(ic->entries);
+		free(ic);
+		return NULL;
+	}
+
+	return ic;
+}
+
+
+/* Call with the lock held, and not for an entry which is being loaded */
+static void free_entry(struct cache_entry *e)
+{
+	image_free(e->image);
+	free(e->filename);
+	free(e->event);
+	e->image = NULL;
+	e->filename = NULL;
+	e->event = NULL;
+	e->in_use = 0;
+	e->discarded = 0;
+	e->state = ENTRY_FREE;
+}
+
+
+/**
+ * \param ic: A \ref gui_image_cache structure
+ *
+ * Stops the loader thread, waiting for it to finish reading the current image
+ * if necessary, and frees all the images.
+ */
+void gui_image_cache_free(struct gui_image_cache *ic)
+{
+	int i;
+
+	if ( ic == NULL ) return;
+
+	pthread_mutex_lock(&ic->lock);
+	ic->shutdown = 1;
+	pthread_cond_broadcast(&ic->cond);
+	pthread_mutex_unlock(&ic->lock);
+	pthread_join(ic->thread, NULL);
+
+	for ( i=0; i<ic->n_entries; i++ ) {
+		free_entry(&ic->entries[i]);
+	}
+
+	pthread_mutex_destroy(&ic->lock);
+	pthread_mutex_destroy(&ic->read_lock);
+	pthread_cond_destroy(&ic->cond);
+	free(ic->entries);
+	free(ic);
+}
+
+
+static int entry_matches(struct cache_entry *e, const DataTemplate *dtempl,
+                         const char *filename, const char *event)
+{
+	if ( e->state == ENTRY_FREE ) return 0;
+	if ( e->discarded ) return 0;
+	if ( e->dtempl != dtempl ) return 0;
+	if ( strcmp(e->filename, filename) != 0 ) return 0;
+	if ( (e->event == NULL) || (event == NULL) ) {
+		return (e->event == NULL) && (event == NULL);
+	}
+	return strcmp(e->event, event) == 0;
+}
+
+
+/* Call with the lock held */
+static struct cache_entry *find_entry(struct gui_image_cache *ic,
+                                      const DataTemplate *dtempl,
+                                      const char *filename, const char *event)
+{
+	int i;
+	for ( i=0; i<ic->n_entries; i++ ) {
+		if ( entry_matches(&ic->entries[i], dtempl, filename, event) ) {
+			return &ic->entries[i];
+		}
+	}
+	return NULL;
+}
+
+
+/* Call with the lock held.  Returns a free entry, throwing out the least
+ * recently used image if necessary, or NULL if all the entries are busy. */
+static struct cache_entry *new_entry(struct gui_image_cache *ic,
+                                     const DataTemplate *dtempl,
+                                     const char *filename, const char *event)
+{
+	struct cache_entry *e = NULL;
+	int i;
+
+	for ( i=0; i<ic->n_entries; i++ ) {
+		struct cache_entry *c = &ic->entries[i];
+		if ( c->state == ENTRY_FREE ) {
+			e = c;
+			break;
+		}
+		if ( (c->state != ENTRY_READY) || c->in_use ) continue;
+		if ( (e == NULL) || (c->last_used < e->last_used) ) e = c;
+	}
+	if ( e == NULL ) return NULL;
+
+	free_entry(e);
+	e->dtempl = dtempl;
+	e->filename = strdup(filename);
+	e->event = safe_strdup(event);
+	e->wanted = 0;
+	e->last_used = ic->clock++;
+	e->state = ENTRY_QUEUED;
+	pthread_cond_broadcast(&ic->cond);
+
+	return e;
+}
+
+
+/**
+ * \param ic: A \ref gui_image_cache structure
+ * \param dtempl: The \ref DataTemplate for reading the image
+ * \param filename: The filename of the image
+ * \param event: The event ID of the image
+ * \param loading: Place to store whether the image is still being loaded
+ *
+ * Gets an image, if it has already been read.  Otherwise, the image will be
+ * read as soon as possible, before any others which were asked for with
+ * gui_image_cache_prefetch(), and the loaded_func given to
+ * gui_image_cache_new() will be called in the main loop when it's ready.
+ * Prefetches which haven't been started yet are forgotten, on the assumption
+ * that they were for the neighbours of a different image.
+ *
+ * The image remains in the cache, and must be given back with
+ * gui_image_cache_release() when it is no longer needed.
+ *
+ * \returns the image, or NULL if it is still being loaded (in which case
+ * \p loading will be set to non-zero) or could not be read.
+ */
+struct image *gui_image_cache_get(struct gui_image_cache *ic,
+                                  const DataTemplate *dtempl,
+                                  const char *filename, const char *event,
+                                  int *loading)
+{
+	struct cache_entry *e;
+	struct image *image;
+	int i;
+
+	*loading = 0;
+	if ( ic == NULL ) return NULL;
+
+	pthread_mutex_lock(&ic->lock);
+
+	e = find_entry(ic, dtempl, filename, event);
+
+	for ( i=0; i<ic->n_entries; i++ ) {
+		struct cache_entry *c = &ic->entries[i];
+		if ( c == e ) continue;
+		c->wanted = 0;
+		if ( c->state == ENTRY_QUEUED ) free_entry(c);
+	}
+
+	if ( e == NULL ) {
+		e = new_entry(ic, dtempl, filename, event);
+		if ( e == NULL ) {
+			ERROR("No space to load image\n");
+			pthread_mutex_unlock(&ic->lock);
+			return NULL;
+		}
+	}
+
+	if ( e->state != ENTRY_READY ) {
+		e->wanted = 1;
+		*loading = 1;
+		pthread_mutex_unlock(&ic->lock);
+		return NULL;
+	}
+
+	image = e->image;
+	if ( image != NULL ) {
+		e->in_use++;
+		e->last_used = ic->clock++;
+	} else {
+		/* Try again next time, in case the file appears */
+		free_entry(e);
+	}
+
+	pthread_mutex_unlock(&ic->lock);
+	return image;
+}
+
+
+/**
+ * \param ic: A \ref gui_image_cache structure
+ * \param dtempl: The \ref DataTemplate for reading the image
+ * \param filename: The filename of the image
+ * \param event: The event ID of the image
+ *
+ * Asks for an image to be read in advance, if it isn't already in the cache.
+ */
+void gui_image_cache_prefetch(struct gui_image_cache *ic,
+                              const DataTemplate *dtempl,
+                              const char *filename, const char *event)
+{
+	struct cache_entry *e;
+
+	if ( ic == NULL ) return;
+
+	pthread_mutex_lock(&ic->lock);
+	e = find_entry(ic, dtempl, filename, event);
+	if ( e == NULL ) {
+		new_entry(ic, dtempl, filename, event);
+	} else {
+		e->last_used = ic->clock++;
+	}
+	pthread_mutex_unlock(&ic->lock);
+}
+
+
+/**
+ * \param ic: A \ref gui_image_cache structure
+ * \param image: An image from gui_image_cache_get(), or NULL
+ *
+ * Takes another reference to an image which is already in use, so that it
+ * stays in memory until gui_image_cache_release() has been called once more.
+ * This is for handing the image to another thread.
+ */
+void gui_image_cache_hold(struct gui_image_cache *ic, struct image *image)
+{
+	int i;
+
+	if ( (ic == NULL) || (image == NULL) ) return;
+
+	pthread_mutex_lock(&ic->lock);
+	for ( i=0; i<ic->n_entries; i++ ) {
+		struct cache_entry *e = &ic->entries[i];
+		if ( (e->state != ENTRY_READY) || (e->image != image) ) continue;
+		e->in_use++;
+		break;
+	}
+	pthread_mutex_unlock(&ic->lock);
+}
+
+
+/**
+ * \param ic: A \ref gui_image_cache structure
+ * \param image: An image from gui_image_cache_get(), or NULL
+ *
+ * Gives back an image from gui_image_cache_get().  The image stays in the
+ * cache until it's pushed out by newer ones.
+ */
+void gui_image_cache_release(struct gui_image_cache *ic, struct image *image)
+{
+	int i;
+
+	if ( (ic == NULL) || (image == NULL) ) return;
+
+	pthread_mutex_lock(&ic->lock);
+	for ( i=0; i<ic->n_entries; i++ ) {
+		struct cache_entry *e = &ic->entries[i];
+		if ( (e->state != ENTRY_READY) || (e->image != image) ) continue;
+		e->in_use--;
+		if ( e->discarded && (e->in_use == 0) ) free_entry(e);
+		break;
+	}
+	pthread_mutex_unlock(&ic->lock);
+}
+
+
+/**
+ * \param ic: A \ref gui_image_cache structure
+ *
+ * Forgets all the images, waiting for the loader thread to finish reading the
+ * current one if necessary.  Call this before freeing a \ref DataTemplate
+ * which has been given to gui_image_cache_get() or gui_image_cache_prefetch().
+ * Images which are in use will be freed when they are released.
+ */
+void gui_image_cache_clear(struct gui_image_cache *ic)
+{
+	int i;
+
+	if ( ic == NULL ) return;
+
+	pthread_mutex_lock(&ic->lock);
+
+	for ( i=0; i<ic->n_entries; i++ ) {
+		struct cache_entry *e = &ic->entries[i];
+		while ( e->state == ENTRY_LOADING ) {
+			pthread_cond_wait(&ic->cond, &ic->lock);
+		}
+		if ( e->in_use ) {
+			e->discarded = 1;
+		} else {
+			free_entry(e);
+		}
+	}
+
+	pthread_mutex_unlock(&ic->lock);
+}
+
+
+/**
+ * \param ic: A \ref gui_image_cache structure
+ *
+ * Waits until the loader thread isn't reading any files, and stops it from
+ * starting again until gui_image_cache_unlock_reading() is called.
+ */
+void gui_image_cache_lock_reading(struct gui_image_cache *ic)
+{
+	if ( ic == NULL ) return;
+	pthread_mutex_lock(&ic->read_lock);
+}
+
+
+/**
+ * \param ic: A \ref gui_image_cache structure
+ *
+ * Lets the loader thread read files again, after
+ * gui_image_cache_lock_reading().
+ */
+void gui_image_cache_unlock_reading(struct gui_image_cache *ic)
+{
+	if ( ic == NULL ) return;
+	pthread_mutex_unlock(&ic->read_lock);
+}
@@ -0,0 +1,66 @@
+/*
+ * gui_imagecache.h
+ *
+ * Load images for the GUI in a separate thread
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GUI_IMAGECACHE_H
+#define GUI_IMAGECACHE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include <image.h>
+#include <datatemplate.h>
+
+struct gui_image_cache;
+
+extern struct gui_image_cache *gui_image_cache_new(int n_images,
+                                                   GSourceFunc loaded_func,
+                                                   gpointer loaded_data);
+extern void gui_image_cache_free(struct gui_image_cache *ic);
+
+extern struct image *gui_image_cache_get(struct gui_image_cache *ic,
+                                         const DataTemplate *dtempl,
+                                         const char *filename,
+                                         const char *event,
+                                         int *loading);
+extern void gui_image_cache_prefetch(struct gui_image_cache *ic,
+                                     const DataTemplate *dtempl,
+                                     const char *filename,
+                                     const char *event);
+extern void gui_image_cache_hold(struct gui_image_cache *ic,
+                                 struct image *image);
+extern void gui_image_cache_release(struct gui_image_cache *ic,
+                                    struct image *image);
+extern void gui_image_cache_clear(struct gui_image_cache *ic);
+
+extern void gui_image_cache_lock_reading(struct gui_image_cache *ic);
+extern void gui_image_cache_unlock_reading(struct gui_image_cache *ic);
+
+#endif /* GUI_IMAGECACHE_H */
@@ -495,6 +495,8 @@ static void finddata_response_sig(GtkWidget *dialog, gint resp,
 			g_free(proj->geom_filename);
 			proj->geom_filename = geom_filename;
 
+			/* The image loader might be using the old one */
+			gui_image_cache_clear(proj->image_cache);
 			data_template_free(proj->dtempl);
 			proj->dtempl = data_template_new_from_file(geom_filename);
 			if ( proj->dtempl == NULL ) {
@@ -159,10 +159,12 @@ static int get_first_frame_parameters(struct crystfelproject *proj,
 	}
 
 
+	gui_image_cache_lock_reading(proj->image_cache);
 	image = image_read(proj->dtempl,
 	                   proj->filenames[0],
 	                   proj->events[0],
 	                   0, 0, NULL);
+	gui_image_cache_unlock_reading(proj->image_cache);
 
 	if ( image == NULL ) {
 		ERROR("Failed to load first frame\n");
@@ -854,6 +856,7 @@ static char **indexamajig_command_line(const char *geom_filename,
                                        const char *stream_filename,
                                        const char *harvest_filename,
                                        const char *mille_filename,
+                                       const char *status_filename,
                                        const char *serial_start,
                                        struct peak_params *peak_search_params,
                                        struct index_params *indexing_params,
@@ -893,7 +896,8 @@ static char **indexamajig_command_line(const char *geom_filename,
 		add_arg_float(args, n_args++, "min-snr",
 		              peak_search_params->min_snr);
 
-	} else if ( peak_search_params->method == PEAK_PEAKFINDER8 ) {
+	} else if ( (peak_search_params->method == PEAK_PEAKFINDER8)
+	         || (peak_search_params->method == PEAK_PEAKFINDER8_GPU) ) {
 		add_arg_float(args, n_args++, "threshold",
 		              peak_search_params->threshold);
 		add_arg_float(args, n_args++, "min-snr",
@@ -1024,6 +1028,10 @@ static char **indexamajig_command_line(const char *geom_filename,
 
 	add_arg_string(args, n_args++, "harvest-file", harvest_filename);
 
+	if ( status_filename != NULL ) {
+		add_arg_string(args, n_args++, "status-file", status_filename);
+	}
+
 	args[n_args] = NULL;
 	return args;
 }
@@ -1087,6 +1095,37 @@ int read_number_processed(const char *filename)
 }
 
 
+/* Read the number of frames processed from a file written by indexamajig
+ * --status-file.  Returns zero on success, non-zero if the file couldn't be
+ * read (e.g. if indexamajig hasn't written it yet). */
+int read_indexamajig_status(const char *filename, int *n_proc)
+{
+	FILE *fh;
+	int found = 0;
+
+	fh = fopen(filename, "r");
+	if ( fh == NULL ) return 1;
+
+	do {
+		char line[1024];
+		int i;
+
+		if ( fgets(line, 1024, fh) == NULL ) break;
+
+		if ( sscanf(line, "indexamajig_frames_processed_total %i",
+		            &i) == 1 )
+		{
+			*n_proc = i;
+			found = 1;
+		}
+
+	} while ( 1 );
+
+	fclose(fh);
+	return !found;
+}
+
+
 int write_indexamajig_script(const char *script_filename,
                              const char *geom_filename,
                              const char *n_thread_str,
@@ -1096,6 +1135,7 @@ int write_indexamajig_script(const char *script_filename,
                              const char *stderr_filename,
                              const char *harvest_filename,
                              const char *mille_filename,
+                             const char *status_filename,
                              const char *serial_start,
                              struct peak_params *peak_search_params,
                              struct index_params *indexing_params,
@@ -1113,6 +1153,7 @@ int write_indexamajig_script(const char *script_filename,
 	                                   stream_filename,
 	                                   harvest_filename,
 	                                   mille_filename,
+	                                   status_filename,
 	                                   serial_start,
 	                                   peak_search_params,
 	                                   indexing_params,
@@ -43,6 +43,8 @@ extern void cell_explorer_sig(struct crystfelproject *proj);
 
 extern int read_number_processed(const char *filename);
 
+extern int read_indexamajig_status(const char *filename, int *n_proc);
+
 extern int write_indexamajig_script(const char *script_filename,
                                     const char *geom_filename,
                                     const char *n_thread_str,
@@ -52,6 +54,7 @@ extern int write_indexamajig_script(const char *script_filename,
                                     const char *stderr_filename,
                                     const char *harvest_filename,
                                     const char *mille_filename,
+                                    const char *status_filename,
                                     const char *serial_start,
                                     struct peak_params *peak_search_params,
                                     struct index_params *indexing_params,
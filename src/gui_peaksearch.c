@@ -38,6 +38,7 @@
 #include <gtk/gtk.h>
 #include <gdk/gdkkeysyms-compat.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <datatemplate.h>
 #include <peaks.h>
@@ -46,80 +47,434 @@
 #include "crystfelimageview.h"
 #include "gui_project.h"
 #include "crystfel_gui.h"
+#include "gui_peaksearch.h"
 
 
-void update_peaks(struct crystfelproject *proj)
+/* How long the parameters have to stay the same before a search is started
+ * in the background, in milliseconds */
+#define PEAK_PREVIEW_DELAY (200)
+
+
+struct peak_request
 {
-	if ( proj->n_frames == 0 ) return;
-	if ( proj->cur_image == NULL ) return;
+	/* Shallow copy of the image, sharing its data arrays.  The image
+	 * itself is held in the image cache until the request is finished */
+	struct image *held;
+	struct image image;
+	struct peak_params params;
+	unsigned int serial;
+};
 
-	crystfel_image_view_set_peak_box_size(CRYSTFEL_IMAGE_VIEW(proj->imageview),
-	                                      proj->peak_search_params.pk_inn);
 
-	image_feature_list_free(proj->cur_image->features);
-	proj->cur_image->features = NULL;
+struct peak_preview
+{
+	struct crystfelproject *proj;
 
-	switch ( proj->peak_search_params.method ) {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int shutdown;
+
+	/* Serial number of the latest request.  The results of all the
+	 * earlier ones will be thrown away */
+	unsigned int serial;
+
+	/* Waiting for the worker thread, if queued.held != NULL */
+	struct peak_request queued;
+
+	/* Waiting for the main loop, if result_req.held != NULL */
+	struct peak_request result_req;
+	ImageFeatureList *result;
+	guint idle;  /* Source for preview_result_sig(), if not zero */
+
+	/* Only used in the main thread: the latest request, waiting for the
+	 * parameters to stop changing */
+	struct peak_request pending;
+	guint timeout;
+
+	/* Only used by the worker thread */
+	struct pf8_private_data *pf8;
+	struct pf9_private_data *pf9;
+};
 
-		ImageFeatureList *peaks;
+
+static int search_in_background(enum peak_search_method method)
+{
+	switch ( method ) {
 
 		case PEAK_ZAEF:
-		proj->cur_image->features = search_peaks(proj->cur_image,
-		                                         proj->peak_search_params.threshold,
-		                                         proj->peak_search_params.min_sq_gradient,
-		                                         proj->peak_search_params.min_snr,
-		                                         proj->peak_search_params.pk_inn,
-		                                         proj->peak_search_params.pk_mid,
-		                                         proj->peak_search_params.pk_out,
-		                                         1);
-		break;
+		case PEAK_PEAKFINDER8:
+		case PEAK_PEAKFINDER8_GPU:
+		case PEAK_PEAKFINDER9:
+		return 1;
+
+		default:
+		return 0;
+
+	}
+}
+
+
+/* Only for the methods where search_in_background() is true.  pf8 and pf9 can
+ * be NULL. */
+static ImageFeatureList *run_peak_search(struct image *image,
+                                         const struct peak_params *params,
+                                         struct pf8_private_data *pf8,
+                                         struct pf9_private_data *pf9)
+{
+	switch ( params->method ) {
+
+		case PEAK_ZAEF:
+		return search_peaks(image,
+		                    params->threshold,
+		                    params->min_sq_gradient,
+		                    params->min_snr,
+		                    params->pk_inn,
+		                    params->pk_mid,
+		                    params->pk_out,
+		                    1);
 
 		case PEAK_PEAKFINDER8:
-		proj->cur_image->features = peakfinder8(proj->cur_image, 2048,
-		                                        proj->peak_search_params.threshold,
-		                                        proj->peak_search_params.min_snr,
-		                                        proj->peak_search_params.min_pix_count,
-		                                        proj->peak_search_params.max_pix_count,
-		                                        proj->peak_search_params.local_bg_radius,
-		                                        proj->peak_search_params.min_res,
-		                                        proj->peak_search_params.max_res,
-		                                        1,
-							proj->peak_search_params.peakfinder8_fast,
-							NULL);
-		break;
+		case PEAK_PEAKFINDER8_GPU:
+		return peakfinder8(image, 2048,
+		                   params->threshold,
+		                   params->min_snr,
+		                   params->min_pix_count,
+		                   params->max_pix_count,
+		                   params->local_bg_radius,
+		                   params->min_res,
+		                   params->max_res,
+		                   1,
+		                   params->peakfinder8_fast,
+		                   pf8);
 
 		case PEAK_PEAKFINDER9:
-		proj->cur_image->features = search_peaks_peakfinder9(proj->cur_image,
-		                                                     proj->peak_search_params.min_snr_biggest_pix,
-		                                                     proj->peak_search_params.min_snr_peak_pix,
-		                                                     proj->peak_search_params.min_snr,
-		                                                     proj->peak_search_params.min_sig,
-		                                                     proj->peak_search_params.min_peak_over_neighbour,
-		                                                     proj->peak_search_params.local_bg_radius);
-		break;
-
-		case PEAK_HDF5:
-		case PEAK_CXI:
-		peaks = image_read_peaks(proj->dtempl,
-		                         proj->cur_image->filename,
-		                         proj->cur_image->ev,
-		                         proj->peak_search_params.half_pixel_shift);
-		if ( proj->peak_search_params.revalidate ) {
-			proj->cur_image->features = validate_peaks(proj->cur_image, peaks,
-			                                           proj->peak_search_params.min_snr,
-			                                           proj->peak_search_params.pk_inn,
-			                                           proj->peak_search_params.pk_mid,
-			                                           proj->peak_search_params.pk_out,
-			                                           1, 0);
+		return search_peaks_peakfinder9(image,
+		                                params->min_snr_biggest_pix,
+		                                params->min_snr_peak_pix,
+		                                params->min_snr,
+		                                params->min_sig,
+		                                params->min_peak_over_neighbour,
+		                                params->local_bg_radius,
+		                                pf9);
+
+		default:
+		return NULL;
+
+	}
+}
+
+
+static ImageFeatureList *read_file_peaks(struct crystfelproject *proj)
+{
+	ImageFeatureList *peaks;
+	ImageFeatureList *valid;
+
+	gui_image_cache_lock_reading(proj->image_cache);
+	peaks = image_read_peaks(proj->dtempl,
+	                         proj->cur_image->filename,
+	                         proj->cur_image->ev,
+	                         proj->peak_search_params.half_pixel_shift);
+	gui_image_cache_unlock_reading(proj->image_cache);
+
+	if ( !proj->peak_search_params.revalidate ) return peaks;
+
+	valid = validate_peaks(proj->cur_image, peaks,
+	                       proj->peak_search_params.min_snr,
+	                       proj->peak_search_params.pk_inn,
+	                       proj->peak_search_params.pk_mid,
+	                       proj->peak_search_params.pk_out,
+	                       1, 0);
+	image_feature_list_free(peaks);
+	return valid;
+}
+
+
+/* Called by the worker thread */
+static void update_pf8_data(struct peak_preview *pp, struct image *image,
+                            int fast_mode)
+{
+	if ( pf8_private_data_matches(pp->pf8, image->detgeom, fast_mode) ) {
+		return;
+	}
+	if ( pp->pf8 != NULL ) free_pf8_private_data(pp->pf8);
+	pp->pf8 = prepare_peakfinder8(image->detgeom, fast_mode);
+}
+
+
+static gboolean preview_result_sig(gpointer vp)
+{
+	struct peak_preview *pp = vp;
+	struct crystfelproject *proj = pp->proj;
+	struct peak_request req;
+	ImageFeatureList *peaks;
+	int latest;
+
+	pthread_mutex_lock(&pp->lock);
+	req = pp->result_req;
+	peaks = pp->result;
+	latest = (req.serial == pp->serial);
+	pp->result_req.held = NULL;
+	pp->result = NULL;
+	pp->idle = 0;
+	pthread_mutex_unlock(&pp->lock);
+
+	if ( req.held == NULL ) return G_SOURCE_REMOVE;
+
+	/* Otherwise, overtaken by a newer request in the meantime */
+	if ( latest ) {
+		image_feature_list_free(req.held->features);
+		req.held->features = peaks;
+		if ( req.held == proj->cur_image ) {
+			gtk_widget_queue_draw(GTK_WIDGET(proj->imageview));
+		}
+	} else {
+		image_feature_list_free(peaks);
+	}
+	gui_image_cache_release(proj->image_cache, req.held);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+static void *preview_thread(void *vp)
+{
+	struct peak_preview *pp = vp;
+
+	pthread_mutex_lock(&pp->lock);
+	while ( !pp->shutdown ) {
+
+		struct peak_request req;
+		ImageFeatureList *peaks;
+
+		if ( pp->queued.held == NULL ) {
+			pthread_cond_wait(&pp->cond, &pp->lock);
+			continue;
+		}
+
+		req = pp->queued;
+		pp->queued.held = NULL;
+		pthread_mutex_unlock(&pp->lock);
+
+		if ( (req.params.method == PEAK_PEAKFINDER8)
+		  || (req.params.method == PEAK_PEAKFINDER8_GPU) )
+		{
+			update_pf8_data(pp, &req.image,
+			                req.params.peakfinder8_fast);
+		}
+		peaks = run_peak_search(&req.image, &req.params,
+		                        pp->pf8, pp->pf9);
+
+		pthread_mutex_lock(&pp->lock);
+		if ( req.serial == pp->serial ) {
+			if ( pp->result_req.held != NULL ) {
+				/* Can only be an older result */
+				gui_image_cache_release(pp->proj->image_cache,
+				                        pp->result_req.held);
+				image_feature_list_free(pp->result);
+			}
+			pp->result_req = req;
+			pp->result = peaks;
+			if ( pp->idle == 0 ) {
+				pp->idle = g_idle_add(preview_result_sig, pp);
+			}
+		} else {
+			gui_image_cache_release(pp->proj->image_cache,
+			                        req.held);
 			image_feature_list_free(peaks);
 		}
-		break;
 
-		default:
+	}
+	pthread_mutex_unlock(&pp->lock);
+
+	return NULL;
+}
+
+
+/**
+ * \param proj: A \ref crystfelproject
+ *
+ * Starts a worker thread to search for peaks in the current image in the
+ * background, with update_peaks_background().  It must be freed, with
+ * peak_preview_free(), before the image cache.
+ *
+ * \returns a new \ref peak_preview structure, or NULL on error.
+ */
+struct peak_preview *peak_preview_new(struct crystfelproject *proj)
+{
+	struct peak_preview *pp;
+
+	pp = malloc(sizeof(struct peak_preview));
+	if ( pp == NULL ) return NULL;
+
+	pp->proj = proj;
+	pp->shutdown = 0;
+	pp->serial = 0;
+	pp->queued.held = NULL;
+	pp->result_req.held = NULL;
+	pp->result = NULL;
+	pp->idle = 0;
+	pp->pending.held = NULL;
+	pp->timeout = 0;
+	pp->pf8 = NULL;
+	pp->pf9 = prepare_peakfinder9();
+	pthread_mutex_init(&pp->lock, NULL);
+	pthread_cond_init(&pp->cond, NULL);
+
+	if ( pthread_create(&pp->thread, NULL, preview_thread, pp) ) {
+		ERROR("Failed to start peak search thread\n");
+		pthread_mutex_destroy(&pp->lock);
+		pthread_cond_destroy(&pp->cond);
+		free_pf9_private_data(pp->pf9);
+		free(pp);
+		return NULL;
+	}
+
+	return pp;
+}
+
+
+/* Forget all requests which haven't finished yet */
+static void cancel_peak_preview(struct peak_preview *pp)
+{
+	struct image *queued;
+
+	if ( pp == NULL ) return;
+
+	if ( pp->timeout != 0 ) {
+		g_source_remove(pp->timeout);
+		pp->timeout = 0;
+	}
+	gui_image_cache_release(pp->proj->image_cache, pp->pending.held);
+	pp->pending.held = NULL;
+
+	pthread_mutex_lock(&pp->lock);
+	pp->serial++;
+	queued = pp->queued.held;
+	pp->queued.held = NULL;
+	pthread_mutex_unlock(&pp->lock);
+
+	gui_image_cache_release(pp->proj->image_cache, queued);
+}
+
+
+/**
+ * \param pp: A \ref peak_preview structure
+ *
+ * Stops the worker thread, waiting for it to finish the current search if
+ * necessary.  Must be called in the main thread.
+ */
+void peak_preview_free(struct peak_preview *pp)
+{
+	if ( pp == NULL ) return;
+
+	cancel_peak_preview(pp);
+
+	pthread_mutex_lock(&pp->lock);
+	pp->shutdown = 1;
+	pthread_cond_broadcast(&pp->cond);
+	pthread_mutex_unlock(&pp->lock);
+	pthread_join(pp->thread, NULL);
+
+	/* The result won't be needed any more */
+	if ( pp->idle != 0 ) g_source_remove(pp->idle);
+	gui_image_cache_release(pp->proj->image_cache, pp->result_req.held);
+	image_feature_list_free(pp->result);
+
+	if ( pp->pf8 != NULL ) free_pf8_private_data(pp->pf8);
+	free_pf9_private_data(pp->pf9);
+	pthread_mutex_destroy(&pp->lock);
+	pthread_cond_destroy(&pp->cond);
+	free(pp);
+}
+
+
+static gboolean submit_peak_request(gpointer vp)
+{
+	struct peak_preview *pp = vp;
+	struct image *old;
+
+	pp->timeout = 0;
+
+	pthread_mutex_lock(&pp->lock);
+	old = pp->queued.held;
+	pp->queued = pp->pending;
+	pthread_cond_broadcast(&pp->cond);
+	pthread_mutex_unlock(&pp->lock);
+
+	pp->pending.held = NULL;
+	gui_image_cache_release(pp->proj->image_cache, old);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/* Search for peaks in the current image, and wait for the results */
+void update_peaks(struct crystfelproject *proj)
+{
+	if ( proj->n_frames == 0 ) return;
+	if ( proj->cur_image == NULL ) return;
+
+	/* Don't let an older search replace the results */
+	cancel_peak_preview(proj->peak_preview);
+
+	crystfel_image_view_set_peak_box_size(CRYSTFEL_IMAGE_VIEW(proj->imageview),
+	                                      proj->peak_search_params.pk_inn);
+
+	image_feature_list_free(proj->cur_image->features);
+	proj->cur_image->features = NULL;
+
+	if ( search_in_background(proj->peak_search_params.method) ) {
+		proj->cur_image->features = run_peak_search(proj->cur_image,
+		                                            &proj->peak_search_params,
+		                                            NULL, NULL);
+	} else if ( (proj->peak_search_params.method == PEAK_HDF5)
+	         || (proj->peak_search_params.method == PEAK_CXI) )
+	{
+		proj->cur_image->features = read_file_peaks(proj);
+	} else {
 		ERROR("This peak detection method not implemented!\n");
-		break;
+	}
+}
+
+
+/* Search for peaks in the current image in the background.  The search starts
+ * when the parameters have stopped changing, and the image view will be
+ * redrawn when the results are ready, unless another search has been asked
+ * for in the meantime.  Until then, the old peaks are displayed.  Peak lists
+ * from files are read straight away. */
+void update_peaks_background(struct crystfelproject *proj)
+{
+	struct peak_preview *pp = proj->peak_preview;
+
+	if ( proj->n_frames == 0 ) return;
+	if ( proj->cur_image == NULL ) return;
 
+	if ( (pp == NULL)
+	  || (proj->cur_image != proj->cur_loaded_image)
+	  || !search_in_background(proj->peak_search_params.method) )
+	{
+		update_peaks(proj);
+		return;
 	}
+
+	crystfel_image_view_set_peak_box_size(CRYSTFEL_IMAGE_VIEW(proj->imageview),
+	                                      proj->peak_search_params.pk_inn);
+
+	gui_image_cache_release(proj->image_cache, pp->pending.held);
+	gui_image_cache_hold(proj->image_cache, proj->cur_image);
+	pp->pending.held = proj->cur_image;
+	pp->pending.image = *proj->cur_image;
+	pp->pending.image.features = NULL;
+	pp->pending.params = proj->peak_search_params;
+
+	pthread_mutex_lock(&pp->lock);
+	pp->serial++;
+	pp->pending.serial = pp->serial;
+	pthread_mutex_unlock(&pp->lock);
+
+	if ( pp->timeout != 0 ) g_source_remove(pp->timeout);
+	pp->timeout = g_timeout_add(PEAK_PREVIEW_DELAY, submit_peak_request, pp);
 }
 
 
@@ -449,7 +804,6 @@ static void peaksearch_algo_changed(GtkWidget *combo,
 	}
 
 	gtk_widget_show_all(proj->peak_vbox);
-	update_peaks(proj);
 	update_imageview(proj);
 	proj->unsaved = 1;
 }
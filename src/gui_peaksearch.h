@@ -37,5 +37,9 @@ extern gint peaksearch_sig(GtkWidget *widget,
                            struct crystfelproject *proj);
 
 extern void update_peaks(struct crystfelproject *proj);
+extern void update_peaks_background(struct crystfelproject *proj);
+
+extern struct peak_preview *peak_preview_new(struct crystfelproject *proj);
+extern void peak_preview_free(struct peak_preview *pp);
 
 #endif
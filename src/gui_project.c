@@ -1238,6 +1238,9 @@ int default_project(struct crystfelproject *proj)
 	proj->data_search_pattern = 0;
 	proj->dtempl = NULL;
 	proj->cur_image = NULL;
+	proj->cur_loaded_image = NULL;
+	proj->image_cache = NULL;
+	proj->peak_preview = NULL;
 	proj->indexing_opts = NULL;
 	proj->merging_opts = NULL;
 	proj->ambi_opts = NULL;
@@ -1404,6 +1407,8 @@ int add_indexing_result(struct crystfelproject *proj,
 	new_results[proj->n_results].streams = malloc(n_streams*sizeof(char *));
 	new_results[proj->n_results].n_streams = n_streams;
 	new_results[proj->n_results].need_rescan = 0;
+	new_results[proj->n_results].scanning = 0;
+	new_results[proj->n_results].just_scanned = 0;
 	new_results[proj->n_results].indices = malloc(n_streams*sizeof(StreamIndex *));
 
 	for ( i=0; i<n_streams; i++ ) {
@@ -1458,13 +1463,165 @@ struct gui_merge_result *find_merge_result_by_name(struct crystfelproject *proj,
 }
 
 
-void update_result_index(struct gui_indexing_result *result)
+struct result_scan
 {
+	struct crystfelproject *proj;
+	char *result_name;
+	int n_streams;
+	char **streams;
+	StreamIndex **indices;
+	gint n_done;
+
+	GtkWidget *info_bar;
+	GtkWidget *progress_bar;
+	guint timeout;
+};
+
+
+static void scan_thread(GTask *task, gpointer source_object,
+                        gpointer task_data, GCancellable *cancellable)
+{
+	struct result_scan *scan = task_data;
 	int i;
-	for ( i=0; i<result->n_streams; i++ ) {
-		stream_index_free(result->indices[i]);
-		result->indices[i] = stream_make_index(result->streams[i]);
+
+	for ( i=0; i<scan->n_streams; i++ ) {
+		if ( scan->indices[i] == NULL ) {
+			scan->indices[i] = stream_make_index(scan->streams[i]);
+		} else {
+			stream_update_index(scan->indices[i], scan->streams[i]);
+		}
+		g_atomic_int_inc(&scan->n_done);
+	}
+
+	g_task_return_boolean(task, TRUE);
+}
+
+
+static gboolean scan_progress(gpointer data)
+{
+	struct result_scan *scan = data;
+
+	if ( scan->n_streams > 1 ) {
+		double frac = (double)g_atomic_int_get(&scan->n_done)
+		                / scan->n_streams;
+		gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(scan->progress_bar),
+		                              frac);
+	} else {
+		gtk_progress_bar_pulse(GTK_PROGRESS_BAR(scan->progress_bar));
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+
+static void free_result_scan(struct result_scan *scan)
+{
+	int i;
+	for ( i=0; i<scan->n_streams; i++ ) {
+		free(scan->streams[i]);
+		stream_index_free(scan->indices[i]);
+	}
+	free(scan->streams);
+	free(scan->indices);
+	free(scan->result_name);
+	free(scan);
+}
+
+
+static void scan_finished(GObject *source_object, GAsyncResult *res,
+                          gpointer data)
+{
+	struct result_scan *scan = data;
+	struct crystfelproject *proj = scan->proj;
+	struct gui_indexing_result *result;
+
+	g_source_remove(scan->timeout);
+	gtk_widget_destroy(scan->info_bar);
+
+	/* The result might have gone away while it was being scanned */
+	result = find_indexing_result_by_name(proj, scan->result_name);
+	if ( (result != NULL) && result->scanning
+	  && (result->n_streams == scan->n_streams) )
+	{
+		int i;
+		for ( i=0; i<result->n_streams; i++ ) {
+			stream_index_free(result->indices[i]);
+			result->indices[i] = scan->indices[i];
+			scan->indices[i] = NULL;
+		}
+		result->scanning = 0;
+		result->just_scanned = 1;
 	}
+
+	free_result_scan(scan);
+	update_imageview(proj);
+}
+
+
+/* Brings the stream indices for 'result' up to date in the background.  Until
+ * that's finished, the indices belong to the scanning thread, and
+ * find_indexed_image() will not be able to find anything in this result */
+void update_result_index(struct crystfelproject *proj,
+                         struct gui_indexing_result *result)
+{
+	struct result_scan *scan;
+	GtkWidget *bar_area;
+	GTask *task;
+	char tmp[1024];
+	int i;
+
+	if ( result->scanning ) return;
+
+	scan = malloc(sizeof(struct result_scan));
+	if ( scan == NULL ) return;
+	scan->proj = proj;
+	scan->result_name = strdup(result->name);
+	scan->n_streams = result->n_streams;
+	scan->streams = malloc(result->n_streams*sizeof(char *));
+	scan->indices = malloc(result->n_streams*sizeof(StreamIndex *));
+	scan->n_done = 0;
+	if ( (scan->result_name == NULL) || (scan->streams == NULL)
+	  || (scan->indices == NULL) )
+	{
+		free(scan->result_name);
+		free(scan->streams);
+		free(scan->indices);
+		free(scan);
+		return;
+	}
+
+	for ( i=0; i<result->n_streams; i++ ) {
+		scan->streams[i] = strdup(result->streams[i]);
+		scan->indices[i] = result->indices[i];
+		result->indices[i] = NULL;
+	}
+	result->scanning = 1;
+	result->need_rescan = 0;
+
+	scan->info_bar = gtk_info_bar_new();
+	gtk_info_bar_set_message_type(GTK_INFO_BAR(scan->info_bar),
+	                              GTK_MESSAGE_INFO);
+	gtk_box_pack_end(GTK_BOX(proj->main_vbox), GTK_WIDGET(scan->info_bar),
+	                 FALSE, FALSE, 0.0);
+	bar_area = gtk_info_bar_get_content_area(GTK_INFO_BAR(scan->info_bar));
+	scan->progress_bar = gtk_progress_bar_new();
+	gtk_box_pack_start(GTK_BOX(bar_area),
+	                   GTK_WIDGET(scan->progress_bar),
+	                   TRUE, TRUE, 0.0);
+	snprintf(tmp, 1023, "Scanning streams for %s", result->name);
+	gtk_progress_bar_set_text(GTK_PROGRESS_BAR(scan->progress_bar), tmp);
+	gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(scan->progress_bar),
+	                               TRUE);
+	gtk_widget_show_all(scan->info_bar);
+#if GTK_CHECK_VERSION(3,22,29)
+	gtk_info_bar_set_revealed(GTK_INFO_BAR(scan->info_bar), TRUE);
+#endif
+	scan->timeout = g_timeout_add(100, scan_progress, scan);
+
+	task = g_task_new(NULL, NULL, scan_finished, scan);
+	g_task_set_task_data(task, scan, NULL);
+	g_task_run_in_thread(task, scan_thread);
+	g_object_unref(task);
 }
 
 
@@ -1488,54 +1645,65 @@ static int ever_scanned(struct gui_indexing_result *result)
 }
 
 
+static int find_chunk(struct gui_indexing_result *result,
+                      const char *filename, const char *event)
+{
+	int i;
+	for ( i=0; i<result->n_streams; i++ ) {
+		if ( stream_select_chunk(NULL,
+		                         result->indices[i],
+		                         filename,
+		                         event) == 0 ) return i;
+	}
+	return -1;
+}
+
+
 struct image *find_indexed_image(struct crystfelproject *proj,
                                  const char *results_name,
                                  const char *filename,
                                  const char *event,
-                                 int permit_rescan)
+                                 int permit_rescan,
+                                 int *scanning)
 {
 	Stream *st;
 	int i;
-	int found = 0;
+	int just_scanned;
 	struct image *image;
 	struct gui_indexing_result *result;
 
+	*scanning = 0;
+
 	result = find_indexing_result_by_name(proj, results_name);
 	if ( result == NULL ) return NULL;
 
-	if ( !ever_scanned(result) ) {
-		update_result_index(result);
-		result->need_rescan = 0;
+	if ( result->scanning ) {
+		*scanning = 1;
+		return NULL;
 	}
 
-	for ( i=0; i<result->n_streams; i++ ) {
-		if ( stream_select_chunk(NULL,
-		                         result->indices[i],
-		                         filename,
-		                         event) == 0 )
-		{
-			found = 1;
-			break;
-		}
+	just_scanned = result->just_scanned;
+	result->just_scanned = 0;
+
+	/* update_imageview() will be called again when the scan is finished */
+	if ( !ever_scanned(result) && !just_scanned ) {
+		update_result_index(proj, result);
+		*scanning = result->scanning;
+		return NULL;
 	}
 
-	if ( !found && (result->need_rescan || permit_rescan) ) {
+	i = find_chunk(result, filename, event);
+
+	if ( (i < 0) && !just_scanned
+	  && (result->need_rescan || permit_rescan) )
+	{
 		/* Re-scan and try again */
-		update_result_index(result);
-		result->need_rescan = 0;
-		for ( i=0; i<result->n_streams; i++ ) {
-			if ( stream_select_chunk(NULL,
-			                         result->indices[i],
-			                         filename,
-			                         event) == 0 )
-				{
-					found = 1;
-					break;
-				}
-		}
+		update_result_index(proj, result);
+		*scanning = result->scanning;
+		return NULL;
 	}
 
-	if ( !found ) return NULL;
+	if ( i < 0 ) return NULL;
 
 	st = stream_open_for_read(result->streams[i]);
 	if ( stream_select_chunk(st, result->indices[i],
@@ -34,6 +34,8 @@
 #include <peaks.h>
 #include <stream.h>
 
+#include "gui_imagecache.h"
+
 #define MAX_RUNNING_TASKS (16)
 
 enum match_type_id
@@ -131,6 +133,13 @@ struct gui_indexing_result
 	char **streams;
 	StreamIndex **indices;
 	int need_rescan;
+
+	/* Set while the indices are being updated in the background */
+	int scanning;
+
+	/* Set when the indices have just been updated, to avoid updating
+	 * them again straight away if the chunk still can't be found */
+	int just_scanned;
 };
 
 struct gui_merge_result
@@ -143,6 +152,7 @@ struct gui_merge_result
 };
 
 struct crystfelproject;
+struct peak_preview;
 
 struct crystfel_backend {
 
@@ -271,6 +281,15 @@ struct crystfelproject {
 
 	int cur_frame;
 	struct image *cur_image;
+
+	/* Images are loaded in the background.  cur_loaded_image belongs to
+	 * the cache, and cur_image is either the same image or a result from
+	 * a stream which has borrowed its data arrays. */
+	struct gui_image_cache *image_cache;
+	struct image *cur_loaded_image;
+
+	/* Peaks are searched for in the background, for the current image */
+	struct peak_preview *peak_preview;
 	int random_history[N_RANDOM_HISTORY];
 	int n_random_history;
 
@@ -365,9 +384,11 @@ extern struct image *find_indexed_image(struct crystfelproject *proj,
                                         const char *result_name,
                                         const char *filename,
                                         const char *event,
-                                        int permit_rescan);
+                                        int permit_rescan,
+                                        int *scanning);
 
-extern void update_result_index(struct gui_indexing_result *result);
+extern void update_result_index(struct crystfelproject *proj,
+                                struct gui_indexing_result *result);
 
 extern struct gui_indexing_result *find_indexing_result_by_name(struct crystfelproject *proj,
                                                                 const char *name);
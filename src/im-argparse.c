@@ -154,7 +154,11 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		break;
 
 		case 207 :
-		args->zmq_params.addr = strdup(arg);
+		if ( args->zmq_params.n_addrs == 64 ) {
+			ERROR("Too many ZMQ input addresses.\n");
+			return 1;
+		}
+		args->zmq_params.addrs[args->zmq_params.n_addrs++] = strdup(arg);
 		break;
 
 		case 208 :
@@ -245,6 +249,190 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		args->asapo_params.use_ack = 1;
 		break;
 
+		case 227 :
+		args->fork_workers = 1;
+		break;
+
+		case 228 :
+		args->stream_shards = 1;
+		break;
+
+		case 229 :
+		if ( (sscanf(arg, "%d", &args->min_workers) != 1)
+		  || (args->min_workers < 1) )
+		{
+			ERROR("Invalid value for --min-workers\n");
+			return EINVAL;
+		}
+		break;
+
+		case 230 :
+		args->dispatch_listen = strdup(arg);
+		break;
+
+		case 231 :
+		args->dispatch_from = strdup(arg);
+		break;
+
+		case 232 :
+		args->resume = 1;
+		break;
+
+		case 233 :
+		if ( (sscanf(arg, "%d", &args->prefetch) != 1)
+		  || (args->prefetch < 0) )
+		{
+			ERROR("Invalid value for --prefetch\n");
+			return EINVAL;
+		}
+		break;
+
+		case 234 :
+		args->metrics_port = strdup(arg);
+		break;
+
+		case 235 :
+		args->temp_in_memory = 1;
+		break;
+
+		case 236 :
+		if ( (sscanf(arg, "%d", &args->file_cache) != 1)
+		  || (args->file_cache < 0) )
+		{
+			ERROR("Invalid value for --file-cache\n");
+			return EINVAL;
+		}
+		break;
+
+		case 237 :
+		if ( (sscanf(arg, "%d", &args->hdf5_chunk_cache) != 1)
+		  || (args->hdf5_chunk_cache < 0) )
+		{
+			ERROR("Invalid value for --hdf5-chunk-cache\n");
+			return EINVAL;
+		}
+		break;
+
+		case 238 :
+		if ( (sscanf(arg, "%d", &args->decompress_threads) != 1)
+		  || (args->decompress_threads < 0) )
+		{
+			ERROR("Invalid value for --decompress-threads\n");
+			return EINVAL;
+		}
+		break;
+
+		case 239 :
+		args->status_file = strdup(arg);
+		break;
+
+		case 240 :
+		args->zmq_params.pull = 1;
+		break;
+
+		case 241 :
+		args->zmq_output = strdup(arg);
+		break;
+
+		case 242 :
+		args->zmq_output_push = 1;
+		break;
+
+		case 243 :
+		args->zmq_output_refls = 1;
+		break;
+
+		case 244 :
+		if ( (sscanf(arg, "%d", &args->asapo_params.prefetch) != 1)
+		  || (args->asapo_params.prefetch < 0) )
+		{
+			ERROR("Invalid value for --asapo-prefetch\n");
+			return EINVAL;
+		}
+		break;
+
+		case 245 :
+		args->tune.order = 1;
+		break;
+
+		case 246 :
+		r = sscanf(arg, "%f,%f", &args->tune.threshold_min,
+		           &args->tune.threshold_max);
+		if ( (r != 2)
+		  || (args->tune.threshold_min > args->tune.threshold_max) )
+		{
+			ERROR("Invalid value for --tune-threshold\n");
+			return EINVAL;
+		}
+		args->tune.threshold = 1;
+		break;
+
+		case 247 :
+		r = sscanf(arg, "%f,%f", &args->tune.min_snr_min,
+		           &args->tune.min_snr_max);
+		if ( (r != 2)
+		  || (args->tune.min_snr_min > args->tune.min_snr_max) )
+		{
+			ERROR("Invalid value for --tune-min-snr\n");
+			return EINVAL;
+		}
+		args->tune.min_snr = 1;
+		break;
+
+		case 248 :
+		args->trace_file = strdup(arg);
+		break;
+
+		case 249 :
+		args->profile = 1;
+		args->profile_counters = 1;
+		break;
+
+		case 250 :
+		if ( (sscanf(arg, "%lf", &args->benchmark_time) != 1)
+		  || !(args->benchmark_time > 0.0) )
+		{
+			ERROR("Invalid value for --benchmark\n");
+			return EINVAL;
+		}
+		args->profile = 1;
+		break;
+
+		case 251 :
+		args->profile = 1;
+		args->profile_allocs = 1;
+		break;
+
+		case 252 :
+		args->no_frame_arena = 1;
+		break;
+
+		case 253 :
+		args->reintegrate = strdup(arg);
+		break;
+
+		case 254 :
+		args->iargs.huge_pages = parse_huge_pages(arg);
+		if ( args->iargs.huge_pages == HUGE_PAGES_ERROR ) {
+			ERROR("Invalid value for --huge-pages (should be none, "
+			      "transparent or explicit)\n");
+			return EINVAL;
+		}
+		break;
+
+		case 255 :
+		if ( (sscanf(arg, "%d", &args->batch_frames) != 1)
+		  || (args->batch_frames < 1) )
+		{
+			ERROR("Invalid value for --batch-frames\n");
+			return EINVAL;
+		}
+		break;
+
+		case 256 :
+		args->cxi_output = strdup(arg);
+		break;
+
 		/* ---------- Peak search ---------- */
 
 		case 't' :
@@ -401,6 +589,59 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		args->iargs.peak_search.peakfinder8_fast = 1;
 		break;
 
+		case 326 :
+		if ( (sscanf(arg, "%d", &args->peakfinder8_threads) != 1)
+		  || (args->peakfinder8_threads < 1) )
+		{
+			ERROR("Invalid value for --peakfinder8-threads\n");
+			return EINVAL;
+		}
+		break;
+
+		case 328 :
+		if ( (sscanf(arg, "%d", &args->iargs.filter_threads) != 1)
+		  || (args->iargs.filter_threads < 1) )
+		{
+			ERROR("Invalid value for --filter-threads\n");
+			return EINVAL;
+		}
+		break;
+
+		case 327 :
+		args->peakfinder8_cache = strdup(arg);
+		break;
+
+		case 329 :
+		args->peak_cache = strdup(arg);
+		break;
+
+		case 323 :
+		if (sscanf(arg, "%f", &args->iargs.veto_threshold) != 1)
+		{
+			ERROR("Invalid value for --veto-threshold\n");
+			return EINVAL;
+		}
+		args->iargs.veto = 1;
+		break;
+
+		case 324 :
+		if ( (sscanf(arg, "%d", &args->iargs.veto_min_pixels) != 1)
+		  || (args->iargs.veto_min_pixels < 1) )
+		{
+			ERROR("Invalid value for --veto-min-pixels\n");
+			return EINVAL;
+		}
+		break;
+
+		case 325 :
+		if ( (sscanf(arg, "%d", &args->iargs.veto_subsample) != 1)
+		  || (args->iargs.veto_subsample < 1) )
+		{
+			ERROR("Invalid value for --veto-subsample\n");
+			return EINVAL;
+		}
+		break;
+
 		/* ---------- Indexing ---------- */
 
 		case 400 :
@@ -536,6 +777,36 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		args->millefile = strdup(arg);
 		break;
 
+		case 420 :
+		args->if_race = 1;
+		break;
+
+		case 421 :
+		args->if_persistent = 1;
+		break;
+
+		case 422 :
+		if ( sscanf(arg, "%d", &args->n_recent) != 1 ) {
+			ERROR("Invalid value for --recent-orientations\n");
+			return EINVAL;
+		}
+		if ( (args->n_recent < 0)
+		  || (args->n_recent > MAX_RECENT_ORIENTATIONS) )
+		{
+			ERROR("--recent-orientations must be between 0 and %i\n",
+			      MAX_RECENT_ORIENTATIONS);
+			return EINVAL;
+		}
+		break;
+
+		case 423 :
+		args->share_recent = 1;
+		break;
+
+		case 424 :
+		args->mille_per_worker = 1;
+		break;
+
 		/* ---------- Integration ---------- */
 
 		case 501 :
@@ -626,6 +897,19 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		args->iargs.cell_params_only = 1;
 		break;
 
+		case 510 :
+		if ( (sscanf(arg, "%d", &args->iargs.int_threads) != 1)
+		  || (args->iargs.int_threads < 1) )
+		{
+			ERROR("Invalid value for --int-threads\n");
+			return EINVAL;
+		}
+		break;
+
+		case 511 :
+		args->iargs.int_parallel_crystals = 1;
+		break;
+
 		/* ---------- Output ---------- */
 
 		case 601 :
@@ -683,6 +967,10 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		args->queue_sem = strdup(arg);
 		break;
 
+		case 709 :
+		args->shard_file = strdup(arg);
+		break;
+
 		default :
 		return ARGP_ERR_UNKNOWN;
 
@@ -713,11 +1001,13 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 	args->prefix = strdup("");
 	args->check_prefix = 1;
 	args->n_proc = 1;
+	args->min_workers = 0;
 	args->cellfile = NULL;
 	args->indm_str = NULL;
 	args->basename = 0;
-	args->zmq_params.addr = NULL;
+	args->zmq_params.n_addrs = 0;
 	args->zmq_params.request = NULL;
+	args->zmq_params.pull = 0;
 	args->zmq_params.n_subscriptions = 0;
 	args->asapo_params.endpoint = NULL;
 	args->asapo_params.token = NULL;
@@ -729,11 +1019,45 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 	args->asapo_params.write_output_stream = 0;
 	args->asapo_params.consumer_timeout_ms = 500;
 	args->asapo_params.use_ack = 0;
+	args->asapo_params.prefetch = 0;
 	args->cpu_pin = 0;
+	args->fork_workers = 0;
+	args->stream_shards = 0;
+	args->shard_file = NULL;
+	args->dispatch_listen = NULL;
+	args->dispatch_from = NULL;
+	args->resume = 0;
+	args->prefetch = 0;
+	args->metrics_port = NULL;
+	args->status_file = NULL;
+	args->trace_file = NULL;
+	args->profile_counters = 0;
+	args->benchmark_time = 0.0;
+	args->profile_allocs = 0;
+	args->no_frame_arena = 0;
+	args->reintegrate = NULL;
+	args->zmq_output = NULL;
+	args->zmq_output_push = 0;
+	args->zmq_output_refls = 0;
+	args->tune.order = 0;
+	args->tune.threshold = 0;
+	args->tune.min_snr = 0;
+	args->tune.methods = NULL;
+	args->temp_in_memory = 0;
+	args->file_cache = 4;
+	args->hdf5_chunk_cache = 0;
+	args->decompress_threads = 0;
+	args->batch_frames = 1;
+	args->worker_state_ready = 0;
 	args->serial_start = 1;
 	args->if_peaks = 1;
 	args->if_multi = 0;
 	args->if_retry = 1;
+	args->if_race = 0;
+	args->if_persistent = 0;
+	args->n_recent = 0;
+	args->share_recent = 0;
+	args->mille_per_worker = 0;
 	args->if_refine = 1;
 	args->if_checkcell = 1;
 	args->profile = 0;
@@ -760,6 +1084,7 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 	args->iargs.cell = NULL;
 	args->iargs.peak_search.noisefilter = 0;
 	args->iargs.peak_search.median_filter = 0;
+	args->iargs.filter_threads = 1;
 	args->iargs.tols[0] = 0.05;  /* frac (not %) */
 	args->iargs.tols[1] = 0.05;  /* frac (not %) */
 	args->iargs.tols[2] = 0.05;  /* frac (not %) */
@@ -780,7 +1105,13 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 	args->iargs.peak_search.min_peak_over_neighbour = -INFINITY;
 	args->iargs.peak_search.check_hdf5_snr = 0;
 	args->iargs.peak_search.peakfinder8_fast = 0;
+	args->peakfinder8_threads = 1;
+	args->peakfinder8_cache = NULL;
+	args->peak_cache = NULL;
+	args->cxi_output = NULL;
 	args->iargs.pf_private = NULL;
+	args->iargs.pf9_private = NULL;
+	args->iargs.resmaps = NULL;
 	args->iargs.dtempl = NULL;
 	args->iargs.peak_search.method = PEAK_ZAEF;
 	args->iargs.peak_search.half_pixel_shift = 1;
@@ -796,9 +1127,16 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 	args->iargs.stream_nonhits = 1;
 	args->iargs.int_diag = INTDIAG_NONE;
 	args->iargs.min_peaks = 0;
+	args->iargs.veto = 0;
+	args->iargs.veto_threshold = 0.0;
+	args->iargs.veto_min_pixels = 1;
+	args->iargs.veto_subsample = 4;
 	args->iargs.overpredict = 0;
 	args->iargs.cell_params_only = 0;
+	args->iargs.int_threads = 1;
+	args->iargs.int_parallel_crystals = 0;
 	args->iargs.wait_for_file = 0;
+	args->iargs.huge_pages = HUGE_PAGES_NONE;
 	args->iargs.ipriv = NULL;  /* No default */
 	args->iargs.int_meth = integration_method("rings-nocen-nosat-nograd", NULL);
 	args->iargs.push_res = +INFINITY;
@@ -811,6 +1149,9 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 	args->iargs.clen_estimate = NAN;
 	args->iargs.n_threads = 1;
 	args->iargs.data_format = DATA_SOURCE_TYPE_UNKNOWN;
+	args->iargs.reint = NULL;
+	args->iargs.peak_cache = NULL;
+	args->iargs.cxi_output = NULL;
 	args->iargs.mille = 0;
 	args->iargs.max_mille_level = 99;
 
@@ -838,13 +1179,13 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 		{"no-check-prefix", 202, NULL, OPTION_NO_USAGE, "Don't attempt to correct the "
 		        "--prefix"},
 		{"highres", 203, "res", OPTION_NO_USAGE, "Absolute resolution cutoff in Angstroms"},
-		{"profile", 204, NULL, OPTION_NO_USAGE, "Show timing data for performance "
-		        "monitoring"},
+		{"profile", 204, NULL, OPTION_NO_USAGE, "Show a summary of timing data "
+		        "for performance monitoring at the end"},
 		{"temp-dir", 205, "path", OPTION_NO_USAGE, "Location for temporary folder"},
 		{"wait-for-file", 206, "seconds", OPTION_NO_USAGE, "Wait for each file before "
 		        "processing"},
 		{"zmq-input", 207, "addr", OPTION_NO_USAGE, "Receive data over ZeroMQ from "
-			"this location"},
+			"this location (can be repeated)"},
 		{"no-image-data", 208, NULL, OPTION_NO_USAGE, "Do not load image data"},
 		{"spectrum-file", 209, "fn", OPTION_NO_USAGE | OPTION_HIDDEN,
 		       "File containing radiation spectrum"},
@@ -870,6 +1211,67 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 		{"asapo-consumer-timeout", 225, "ms", OPTION_NO_USAGE,
 			"ASAP::O get_next timeout for one frame (milliseconds)"},
 		{"asapo-acks", 226, NULL, OPTION_NO_USAGE, "Use ASAP::O acknowledgements"},
+		{"fork-workers", 227, NULL, OPTION_NO_USAGE,
+			"Set up once, and fork worker processes from there"},
+		{"stream-shards", 228, NULL, OPTION_NO_USAGE,
+			"Workers write separate streams, listed in a manifest"},
+		{"min-workers", 229, "n", OPTION_NO_USAGE,
+			"Vary the number of workers between n and -j"},
+		{"dispatch-listen", 230, "port", OPTION_NO_USAGE,
+			"Hand out events to other indexamajig instances"},
+		{"dispatch-from", 231, "host:port", OPTION_NO_USAGE,
+			"Get events from another indexamajig instance"},
+		{"resume", 232, NULL, OPTION_NO_USAGE,
+			"Skip frames already in the output stream, and append"},
+		{"prefetch", 233, "n", OPTION_NO_USAGE,
+			"Read up to n images ahead in each worker"},
+		{"metrics-port", 234, "port", OPTION_NO_USAGE,
+			"Serve live statistics over HTTP"},
+		{"temp-in-memory", 235, NULL, OPTION_NO_USAGE,
+			"Put the temporary folder on an in-memory filesystem"},
+		{"file-cache", 236, "n", OPTION_NO_USAGE,
+			"Keep up to n HDF5 files open in each worker"},
+		{"hdf5-chunk-cache", 237, "MiB", OPTION_NO_USAGE,
+			"Size of the HDF5 chunk cache for each dataset"},
+		{"decompress-threads", 238, "n", OPTION_NO_USAGE,
+			"Decompress HDF5 chunks in n threads"},
+		{"status-file", 239, "file", OPTION_NO_USAGE,
+			"Write live statistics to a file"},
+		{"zmq-pull", 240, NULL, OPTION_NO_USAGE,
+			"Receive ZeroMQ data using PULL instead of SUB"},
+		{"zmq-output", 241, "addr", OPTION_NO_USAGE,
+			"Send a summary of each frame over ZeroMQ"},
+		{"zmq-output-push", 242, NULL, OPTION_NO_USAGE,
+			"Use PUSH instead of PUB for --zmq-output"},
+		{"zmq-output-reflections", 243, NULL, OPTION_NO_USAGE,
+			"Include the reflections in the --zmq-output messages"},
+		{"asapo-prefetch", 244, "n", OPTION_NO_USAGE,
+			"Fetch up to n ASAP::O messages ahead in each worker"},
+		{"tune-indexing-order", 245, NULL, OPTION_NO_USAGE,
+			"Put the fastest successful indexing methods first"},
+		{"tune-threshold", 246, "min,max", OPTION_NO_USAGE,
+			"Adjust the peakfinder8 threshold within limits"},
+		{"tune-min-snr", 247, "min,max", OPTION_NO_USAGE,
+			"Adjust the peakfinder8 minimum SNR within limits"},
+		{"trace", 248, "file", OPTION_NO_USAGE,
+			"Write a timeline of processing (Chrome JSON format)"},
+		{"profile-counters", 249, NULL, OPTION_NO_USAGE,
+			"Include hardware counters in the --profile summary"},
+		{"benchmark", 250, "seconds", OPTION_NO_USAGE,
+			"Measure throughput, replaying frames from memory"},
+		{"profile-allocs", 251, NULL, OPTION_NO_USAGE,
+			"Include memory allocations in the --profile summary"},
+		{"no-frame-arena", 252, NULL, OPTION_NO_USAGE,
+			"Don't use a per-frame memory arena"},
+		{"reintegrate", 253, "stream", OPTION_NO_USAGE,
+			"Integrate again the crystals in an existing stream"},
+		{"huge-pages", 254, "type", OPTION_NO_USAGE,
+			"Use huge pages for large buffers: none, transparent "
+			"or explicit"},
+		{"batch-frames", 255, "n", OPTION_NO_USAGE,
+			"Read n consecutive frames at once in each worker"},
+		{"cxi-output", 256, "dir", OPTION_NO_USAGE,
+			"Write peak lists and hit flags to CXI files in dir"},
 
 		{NULL, 0, 0, OPTION_DOC, "Peak search options:", 3},
 		{"peaks", 301, "method", 0, "Peak search method.  Default: zaef"},
@@ -878,6 +1280,8 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 		{"hdf5-peaks", 304, "p", OPTION_HIDDEN, "Location of peak table in HDF5 file"},
 		{"median-filter", 305, "n", OPTION_NO_USAGE, "Apply median filter to image data"},
 		{"filter-noise", 306, NULL, OPTION_NO_USAGE, "Apply noise filter to image data"},
+		{"filter-threads", 328, "n", OPTION_NO_USAGE, "Threads for filtering "
+		        "each image (default 1)"},
 		{"threshold", 't', "adu", OPTION_NO_USAGE, "Threshold for peak detection "
 		        "(zaef only, default 800)"},
 		{"min-squared-gradient", 307, "n", OPTION_NO_USAGE, "Minimum squared gradient "
@@ -911,6 +1315,18 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 		{"check-hdf5-snr", 321, NULL, OPTION_NO_USAGE, "Check SNR for peaks from HDF5, "
 		        "CXI or MsgPack (see --min-snr)"},
 		{"peakfinder8-fast", 322, NULL, OPTION_NO_USAGE, "peakfinder8 fast execution"},
+		{"peakfinder8-threads", 326, "n", OPTION_NO_USAGE, "Threads for each "
+		        "peakfinder8 or peakfinder9 search (default 1)"},
+		{"peakfinder8-cache", 327, "dir", OPTION_NO_USAGE, "Keep peakfinder8 "
+		        "geometry calculations in this directory"},
+		{"peak-cache", 329, "dir", OPTION_NO_USAGE, "Save the peaks in this "
+		        "directory, and re-use them in later runs"},
+		{"veto-threshold", 323, "adu", OPTION_NO_USAGE, "Skip the peak search "
+		        "for frames with too few pixels above this value"},
+		{"veto-min-pixels", 324, "n", OPTION_NO_USAGE, "Minimum number of pixels "
+		        "above --veto-threshold (default 1)"},
+		{"veto-subsample", 325, "n", OPTION_NO_USAGE, "Check only every n-th row "
+		        "for the hit veto (default 4)"},
 
 		{NULL, 0, 0, OPTION_DOC, "Indexing options:", 4},
 		{"indexing", 400, "method", 0, "List of indexing methods"},
@@ -943,6 +1359,16 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 		{"mille-dir", 417, "dirname", OPTION_HIDDEN, "Save Millepede data in folder"},
 		{"max-mille-level", 418, "n", 0, "Maximum geometry refinement level"},
 		{"mille-file", 419, "filename", 0, "Filename for Millepede data (default mille-data.bin)"},
+		{"race-indexers", 420, NULL, 0, "Run all indexing methods at once, and "
+		        "take the first result"},
+		{"persistent-indexers", 421, NULL, 0, "Keep MOSFLM and DirAx running "
+		        "between patterns"},
+		{"recent-orientations", 422, "n", 0, "Try refining the last n "
+		        "orientations before indexing"},
+		{"share-recent-orientations", 423, NULL, 0, "Share the recent "
+		        "orientations between all worker processes"},
+		{"mille-per-worker", 424, NULL, 0, "Write a separate Millepede "
+		        "file from each worker process"},
 
 		{NULL, 0, 0, OPTION_DOC, "Integration options:", 5},
 		{"integration", 501, "method", OPTION_NO_USAGE, "Integration method"},
@@ -957,6 +1383,10 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 		{"push-res", 507, "dist", 0, "Integrate higher than apparent resolution cutoff (m^-1)"},
 		{"overpredict", 508, NULL, 0, "Over-predict reflections"},
 		{"cell-parameters-only", 509, NULL, 0, "Don't predict reflections at all"},
+		{"int-threads", 510, "n", 0, "Threads for integrating each crystal "
+		        "(default 1)"},
+		{"int-parallel-crystals", 511, NULL, 0, "Use the integration "
+		        "threads for several crystals at once"},
 
 		{NULL, 0, 0, OPTION_DOC, "Output options:", 6},
 		{"no-non-hits-in-stream", 601, NULL, OPTION_NO_USAGE, "Don't include non-hits in "
@@ -979,6 +1409,7 @@ struct indexamajig_arguments *parse_indexamajig_args(int argc, char *argv[])
 		{"worker-id", 706, "id", OPTION_HIDDEN, "Worker process number"},
 		{"worker-tmpdir", 707, "dir", OPTION_HIDDEN, "Worker temporary dir"},
 		{"queue-semaphore", 708, "sem", OPTION_HIDDEN, "Queue semaphore name"},
+		{"shard-file", 709, "fn", OPTION_HIDDEN, "Stream shard filename"},
 
 		{NULL, 0, 0, OPTION_DOC, "More information:", 99},
 
@@ -1034,8 +1465,11 @@ void cleanup_indexamajig_args(struct indexamajig_arguments *args)
 	free(*args->fromfile_opts_ptr);
 	free(*args->asdf_opts_ptr);
 	free(args->filename);
+	free(args->reintegrate);
 	free(args->outfile);
-	free(args->zmq_params.addr);
+	for ( i=0; i<args->zmq_params.n_addrs; i++ ) {
+		free(args->zmq_params.addrs[i]);
+	}
 	free(args->zmq_params.request);
 	for ( i=0; i<args->zmq_params.n_subscriptions; i++ ) {
 		free(args->zmq_params.subscriptions[i]);
@@ -1052,6 +1486,16 @@ void cleanup_indexamajig_args(struct indexamajig_arguments *args)
 	free(args->worker_tmpdir);
 	free(args->queue_sem);
 	free(args->shm_name);
+	free(args->shard_file);
+	free(args->dispatch_listen);
+	free(args->dispatch_from);
+	free(args->metrics_port);
+	free(args->status_file);
+	free(args->trace_file);
+	free(args->zmq_output);
+	free(args->peakfinder8_cache);
+	free(args->peak_cache);
+	free(args->cxi_output);
 	for ( i=0; i<args->n_copy_headers; i++ ) {
 		free(args->copy_headers[i]);
 	}
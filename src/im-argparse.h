@@ -33,6 +33,7 @@ struct indexamajig_arguments;
 #include <index.h>
 
 #include "process_image.h"
+#include "im-tune.h"
 
 struct indexamajig_arguments
 {
@@ -44,6 +45,7 @@ struct indexamajig_arguments
 	char *prefix;
 	int check_prefix;
 	int n_proc;
+	int min_workers;  /* Non-zero for autoscaling */
 	char *cellfile;
 	char *indm_str;
 	int basename;
@@ -56,6 +58,10 @@ struct indexamajig_arguments
 	int if_peaks;
 	int if_multi;
 	int if_retry;
+	int if_race;
+	int if_persistent;
+	int n_recent;
+	int share_recent;
 	int profile;  /* Whether to do wall-clock time profiling */
 	int no_data_timeout;
 	char **copy_headers;
@@ -63,8 +69,38 @@ struct indexamajig_arguments
 	char *harvest_file;
 	char *milledir;
 	char *millefile;
+	int mille_per_worker;
 	int cpu_pin;
+	int fork_workers;
+	int stream_shards;
+	char *shard_file;
+	char *dispatch_listen;
+	char *dispatch_from;
+	int resume;
+	int prefetch;
+	char *metrics_port;
+	char *status_file;
+	char *trace_file;
+	int profile_counters;
+	double benchmark_time;
+	int profile_allocs;
+	int no_frame_arena;
+	char *reintegrate;
+	char *zmq_output;
+	int zmq_output_push;
+	int zmq_output_refls;
+	struct im_tune_params tune;
+	int temp_in_memory;
+	int file_cache;
+	int hdf5_chunk_cache;
+	int decompress_threads;
+	int batch_frames;
+	int peakfinder8_threads;
+	char *peakfinder8_cache;
+	char *peak_cache;
+	char *cxi_output;
 	int worker;
+	int worker_state_ready;
 	int worker_id;
 	char *worker_tmpdir;
 	int fd_stream;
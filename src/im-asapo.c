@@ -36,6 +36,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include <asapo/consumer_c.h>
 #include <asapo/producer_c.h>
 
@@ -48,6 +49,17 @@
 #include "datatemplate_priv.h"
 
 
+/* A message which has been fetched, but not yet handed out */
+struct asapo_item
+{
+	AsapoMessageDataHandle *msg;
+	uint64_t size;
+	char *meta;
+	char *filename;
+	int message_id;
+};
+
+
 struct im_asapo
 {
 	char *stream;
@@ -56,6 +68,24 @@ struct im_asapo
 	AsapoStringHandle group_id;
 	int wait_for_stream;
 	int use_ack;
+
+	/* Prefetching thread.  If there is one, only it uses the consumer. */
+	int prefetch;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;   /* Space in the queue, acks or stop */
+	pthread_cond_t item_cond;   /* New item, or an empty get_next */
+	struct asapo_item *items;   /* Circular buffer, size 'prefetch' */
+	int first_item;
+	int n_items;
+	int n_polls;                /* Incremented after an empty get_next */
+	int finished;               /* Result of the last empty get_next */
+	int stop;
+
+	/* Message IDs waiting to be acknowledged by the prefetch thread */
+	uint64_t *acks;
+	int n_acks;
+	int max_acks;
 };
 
 
@@ -122,6 +152,9 @@ static int create_producer(struct im_asapo *a, const struct im_asapo_params *par
 }
 
 
+static void *prefetch_thread(void *vp);
+
+
 struct im_asapo *im_asapo_connect(const struct im_asapo_params *params)
 {
 	struct im_asapo *a;
@@ -181,6 +214,29 @@ struct im_asapo *im_asapo_connect(const struct im_asapo_params *params)
 
 	asapo_free_handle(&cred);
 
+	a->prefetch = params->prefetch;
+	if ( a->prefetch > 0 ) {
+
+		a->items = malloc(a->prefetch*sizeof(struct asapo_item));
+		if ( a->items == NULL ) return NULL;
+		a->first_item = 0;
+		a->n_items = 0;
+		a->n_polls = 0;
+		a->finished = 0;
+		a->stop = 0;
+		a->acks = NULL;
+		a->n_acks = 0;
+		a->max_acks = 0;
+		pthread_mutex_init(&a->lock, NULL);
+		pthread_cond_init(&a->work_cond, NULL);
+		pthread_cond_init(&a->item_cond, NULL);
+
+		if ( pthread_create(&a->thread, NULL, prefetch_thread, a) ) {
+			ERROR("Failed to start ASAP::O prefetch thread\n");
+			return NULL;
+		}
+	}
+
 	return a;
 }
 
@@ -203,15 +259,15 @@ static int stream_empty(struct im_asapo *a)
 }
 
 
-void *im_asapo_fetch(struct im_asapo *a, size_t *pdata_size,
-                     char **pmeta, char **pfilename, char **pevent,
-                     int *pfinished, int *pmessageid)
+/* Gets the next message from the consumer.  Returns zero on success, or
+ * non-zero if there was no message, in which case *pfinished says whether the
+ * end of the stream has been reached. */
+static int get_next(struct im_asapo *a, struct asapo_item *item,
+                    int *pfinished)
 {
-	void *data_copy;
 	AsapoMessageMetaHandle meta;
 	AsapoMessageDataHandle data;
 	AsapoErrorHandle err;
-	uint64_t msg_size;
 
 	*pfinished = 0;
 
@@ -234,7 +290,7 @@ void *im_asapo_fetch(struct im_asapo *a, size_t *pdata_size,
 		} else {
 			*pfinished = 1;
 		}
-		return NULL;
+		return 1;
 	}
 
 	if ( asapo_is_error(err) ) {
@@ -242,46 +298,42 @@ void *im_asapo_fetch(struct im_asapo *a, size_t *pdata_size,
 		asapo_free_handle(&err);
 		asapo_free_handle(&meta);
 		asapo_free_handle(&data);
-		return NULL;
+		return 1;
 	}
 
 	profile_start("get-size");
-	msg_size = asapo_message_meta_get_size(meta);
+	item->size = asapo_message_meta_get_size(meta);
 	profile_end("get-size");
 
-	profile_start("malloc-copy");
-	data_copy = malloc(msg_size);
-	if ( data_copy == NULL ) {
-		ERROR("Failed to copy data block.\n");
+	item->msg = malloc(sizeof(AsapoMessageDataHandle));
+	if ( item->msg == NULL ) {
 		asapo_free_handle(&err);
 		asapo_free_handle(&meta);
 		asapo_free_handle(&data);
-		return NULL;
+		return 1;
 	}
-	memcpy(data_copy, asapo_message_data_get_as_chars(data), msg_size);
-	profile_end("malloc-copy");
+	*item->msg = data;
 
 	profile_start("copy-meta");
-	*pmeta = strdup(asapo_message_meta_get_metadata(meta));
-	*pfilename = strdup(asapo_message_meta_get_name(meta));
-	*pevent = strdup("//");
-	*pmessageid = asapo_message_meta_get_id(meta);
+	item->meta = strdup(asapo_message_meta_get_metadata(meta));
+	item->filename = strdup(asapo_message_meta_get_name(meta));
+	item->message_id = asapo_message_meta_get_id(meta);
 	profile_end("copy-meta");
 
 	asapo_free_handle(&err);
 	asapo_free_handle(&meta);
-	asapo_free_handle(&data);
 
-	*pdata_size = msg_size;
-	return data_copy;
+	return 0;
 }
 
 
-void im_asapo_finalise(struct im_asapo *a, uint64_t message_id)
+static void send_acks(struct im_asapo *a, uint64_t *acks, int n_acks)
 {
-	if ( a->use_ack ) {
+	int i;
+
+	for ( i=0; i<n_acks; i++ ) {
 		AsapoErrorHandle err = asapo_new_handle();
-		asapo_consumer_acknowledge(a->consumer, a->group_id, message_id,
+		asapo_consumer_acknowledge(a->consumer, a->group_id, acks[i],
 		                           a->stream, &err);
 		if ( asapo_is_error(err) ) {
 			show_asapo_error("Couldn't acknowledge ASAP::O message", err);
@@ -291,6 +343,157 @@ void im_asapo_finalise(struct im_asapo *a, uint64_t message_id)
 }
 
 
+/* Keeps the queue of messages topped up, and sends the acknowledgements which
+ * have built up in the meantime */
+static void *prefetch_thread(void *vp)
+{
+	struct im_asapo *a = vp;
+	uint64_t *acks = NULL;
+	int max_acks = 0;
+
+	do {
+
+		struct asapo_item item;
+		int n_acks;
+		int finished;
+		int r;
+
+		pthread_mutex_lock(&a->lock);
+		while ( !a->stop && (a->n_items == a->prefetch)
+		     && (a->n_acks == 0) )
+		{
+			pthread_cond_wait(&a->work_cond, &a->lock);
+		}
+
+		/* Swap the list of pending acks with our (empty) one */
+		n_acks = a->n_acks;
+		if ( n_acks > 0 ) {
+			uint64_t *tmp = a->acks;
+			int tmp_max = a->max_acks;
+			a->acks = acks;
+			a->max_acks = max_acks;
+			a->n_acks = 0;
+			acks = tmp;
+			max_acks = tmp_max;
+		}
+		if ( a->stop || (a->n_items == a->prefetch) ) {
+			int stop = a->stop;
+			pthread_mutex_unlock(&a->lock);
+			send_acks(a, acks, n_acks);
+			if ( stop ) break;
+			continue;
+		}
+		pthread_mutex_unlock(&a->lock);
+
+		send_acks(a, acks, n_acks);
+
+		r = get_next(a, &item, &finished);
+
+		pthread_mutex_lock(&a->lock);
+		if ( r == 0 ) {
+			int pos = (a->first_item + a->n_items) % a->prefetch;
+			a->items[pos] = item;
+			a->n_items++;
+		} else {
+			a->finished = finished;
+			a->n_polls++;
+		}
+		pthread_cond_signal(&a->item_cond);
+		pthread_mutex_unlock(&a->lock);
+
+	} while ( 1 );
+
+	free(acks);
+	return NULL;
+}
+
+
+/* Returns a pointer to the data of the next message, without copying it.
+ * The message is returned in *pmsg, and must be released with
+ * im_asapo_release() when the data is no longer needed. */
+void *im_asapo_fetch(struct im_asapo *a, size_t *pdata_size,
+                     char **pmeta, char **pfilename, char **pevent,
+                     int *pfinished, int *pmessageid, void **pmsg)
+{
+	struct asapo_item item;
+
+	*pfinished = 0;
+	*pmsg = NULL;
+
+	if ( a->prefetch > 0 ) {
+
+		int n_polls;
+
+		/* Wait for a message, or for the prefetch thread to find that
+		 * there isn't one */
+		pthread_mutex_lock(&a->lock);
+		n_polls = a->n_polls;
+		while ( (a->n_items == 0) && (a->n_polls == n_polls) ) {
+			pthread_cond_wait(&a->item_cond, &a->lock);
+		}
+		if ( a->n_items == 0 ) {
+			*pfinished = a->finished;
+			pthread_mutex_unlock(&a->lock);
+			return NULL;
+		}
+		item = a->items[a->first_item];
+		a->first_item = (a->first_item + 1) % a->prefetch;
+		a->n_items--;
+		pthread_cond_signal(&a->work_cond);
+		pthread_mutex_unlock(&a->lock);
+
+	} else {
+		if ( get_next(a, &item, pfinished) ) return NULL;
+	}
+
+	*pmeta = item.meta;
+	*pfilename = item.filename;
+	*pevent = strdup("//");
+	*pmessageid = item.message_id;
+	*pdata_size = item.size;
+	*pmsg = item.msg;
+	return (void *)asapo_message_data_get_as_chars(*item.msg);
+}
+
+
+void im_asapo_release(void *vp)
+{
+	AsapoMessageDataHandle *msg = vp;
+	if ( msg == NULL ) return;
+	asapo_free_handle(msg);
+	free(msg);
+}
+
+
+void im_asapo_finalise(struct im_asapo *a, uint64_t message_id)
+{
+	if ( !a->use_ack ) return;
+
+	if ( a->prefetch == 0 ) {
+		send_acks(a, &message_id, 1);
+		return;
+	}
+
+	/* The prefetch thread will send it, along with any others */
+	pthread_mutex_lock(&a->lock);
+	if ( a->n_acks == a->max_acks ) {
+		uint64_t *acks_new;
+		int max_new = (a->max_acks == 0) ? 16 : 2*a->max_acks;
+		acks_new = realloc(a->acks, max_new*sizeof(uint64_t));
+		if ( acks_new == NULL ) {
+			pthread_mutex_unlock(&a->lock);
+			ERROR("Failed to queue ASAP::O acknowledgement\n");
+			return;
+		}
+		a->acks = acks_new;
+		a->max_acks = max_new;
+	}
+	a->acks[a->n_acks++] = message_id;
+	pthread_cond_signal(&a->work_cond);
+	pthread_mutex_unlock(&a->lock);
+}
+
+
 static void send_callback(void *a, AsapoRequestCallbackPayloadHandle payload,
                           AsapoErrorHandle err)
 {
@@ -307,6 +510,20 @@ static void send_real(struct im_asapo *a, struct image *image)
 	AsapoMessageHeaderHandle header;
 	AsapoErrorHandle err;
 	char filename[1024];
+	void *data;
+
+	/* ASAP::O will free() the data after sending it.  If the data block
+	 * belongs to the received message, send a copy instead. */
+	if ( image->data_block_release != NULL ) {
+		data = malloc(image->data_block_size);
+		if ( data == NULL ) {
+			ERROR("Failed to copy data block for sending.\n");
+			return;
+		}
+		memcpy(data, image->data_block, image->data_block_size);
+	} else {
+		data = image->data_block;
+	}
 
 	snprintf(filename, 1024, "processed/%s_hits/%s-%i.data",
 	         a->stream, a->stream, image->serial);
@@ -326,7 +543,7 @@ static void send_real(struct im_asapo *a, struct image *image)
 	       tv.tv_sec, tv.tv_usec);
 
 	err = asapo_new_handle();
-	asapo_producer_send(a->producer, header, image->data_block,
+	asapo_producer_send(a->producer, header, data,
 	                    kTransferData | kStoreInDatabase, a->stream,
 	                    send_callback, &err);
 	if ( asapo_is_error(err) ) {
@@ -339,7 +556,7 @@ static void send_real(struct im_asapo *a, struct image *image)
 	/* Blank out the data block pointer, to avoid it being freed by
 	 * image_free shortly after we return.  Instead, it will be freed
 	 * by send_callback. */
-	image->data_block = NULL;
+	if ( data == image->data_block ) image->data_block = NULL;
 
 	asapo_free_handle(&header);
 	asapo_free_handle(&err);
@@ -404,6 +621,32 @@ void im_asapo_send(struct im_asapo *a, struct image *image, int hit)
 void im_asapo_shutdown(struct im_asapo *a)
 {
 	if ( a == NULL ) return;
+
+	if ( a->prefetch > 0 ) {
+
+		pthread_mutex_lock(&a->lock);
+		a->stop = 1;
+		pthread_cond_signal(&a->work_cond);
+		pthread_mutex_unlock(&a->lock);
+		pthread_join(a->thread, NULL);
+
+		/* Messages left over are not acknowledged, so with --asapo-acks
+		 * ASAP::O will give them to someone else */
+		while ( a->n_items > 0 ) {
+			struct asapo_item *item = &a->items[a->first_item];
+			im_asapo_release(item->msg);
+			free(item->meta);
+			free(item->filename);
+			a->first_item = (a->first_item + 1) % a->prefetch;
+			a->n_items--;
+		}
+		free(a->items);
+		free(a->acks);
+		pthread_mutex_destroy(&a->lock);
+		pthread_cond_destroy(&a->work_cond);
+		pthread_cond_destroy(&a->item_cond);
+	}
+
 	asapo_free_handle(&a->consumer);
 	asapo_free_handle(&a->group_id);
 	free(a);
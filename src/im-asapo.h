@@ -46,6 +46,7 @@ struct im_asapo_params
 	int write_output_stream;
 	int consumer_timeout_ms;
 	int use_ack;
+	int prefetch;
 };
 
 struct im_asapo;
@@ -58,7 +59,9 @@ extern void im_asapo_shutdown(struct im_asapo *a);
 
 extern void *im_asapo_fetch(struct im_asapo *a, size_t *pdata_size,
                             char **pmeta, char **pfilename, char **pevent,
-                            int *pfinished, int *pmessageid);
+                            int *pfinished, int *pmessageid, void **pmsg);
+
+extern void im_asapo_release(void *msg);
 
 extern void im_asapo_finalise(struct im_asapo *a, uint64_t message_id);
 
@@ -78,9 +81,10 @@ static UNUSED void im_asapo_shutdown(struct im_asapo *a)
 
 static UNUSED void *im_asapo_fetch(struct im_asapo *a, size_t *psize,
                                    char **pmeta, char **pfilename, char **pevent,
-                                   int *pfinished, int *pmessageid)
+                                   int *pfinished, int *pmessageid, void **pmsg)
 {
 	*psize = 0;
+	*pmsg = NULL;
 	*pmeta = NULL;
 	*pfilename = NULL;
 	*pevent = NULL;
@@ -89,6 +93,10 @@ static UNUSED void *im_asapo_fetch(struct im_asapo *a, size_t *psize,
 	return NULL;
 }
 
+static UNUSED void im_asapo_release(void *msg)
+{
+}
+
 static UNUSED void im_asapo_send(struct im_asapo *a, struct image *image, int hit)
 {
 }
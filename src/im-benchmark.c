@@ -0,0 +1,224 @@
+/*
+ * im-benchmark.c
+ *
+ * Replay frames from memory, for measuring throughput
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* For --benchmark, the sandbox writes the list of frames to the temporary
+ * folder, and feeds the same events round and round through the queue.  Each
+ * worker reads all of the frames once, before it starts processing, and then
+ * hands a fresh copy of the right one to process_image() for each event.  This
+ * takes the file reading out of the measurement, without changing anything
+ * else about the processing. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <image.h>
+#include <utils.h>
+#include <profile.h>
+
+#include "im-benchmark.h"
+
+
+struct benchmark_frame
+{
+	char *filename;
+	char *event;
+	struct image *image;
+};
+
+
+struct im_benchmark
+{
+	struct benchmark_frame *frames;
+	int n_frames;
+	int last;  /* Most recently used frame, to speed up the search */
+};
+
+
+static char *events_filename(const char *tmpdir)
+{
+	size_t len = strlen(tmpdir) + 32;
+	char *fn = malloc(len);
+	if ( fn == NULL ) return NULL;
+	snprintf(fn, len, "%s/benchmark-events", tmpdir);
+	return fn;
+}
+
+
+/* Called by the sandbox, before starting any workers */
+int im_benchmark_write_events(const char *tmpdir, char **filenames,
+                              char **events, int n)
+{
+	char *fn;
+	FILE *fh;
+	int i;
+
+	fn = events_filename(tmpdir);
+	if ( fn == NULL ) return 1;
+
+	fh = fopen(fn, "w");
+	free(fn);
+	if ( fh == NULL ) {
+		ERROR("Failed to write benchmark frame list: %s\n",
+		      strerror(errno));
+		return 1;
+	}
+
+	for ( i=0; i<n; i++ ) {
+		fprintf(fh, "%s %s\n", filenames[i], events[i]);
+	}
+
+	if ( fclose(fh) ) {
+		ERROR("Failed to write benchmark frame list: %s\n",
+		      strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+
+struct im_benchmark *im_benchmark_new(const struct index_args *iargs,
+                                      const char *tmpdir)
+{
+	struct im_benchmark *bm;
+	char *fn;
+	FILE *fh;
+	char line[1024];
+
+	bm = malloc(sizeof(struct im_benchmark));
+	if ( bm == NULL ) return NULL;
+
+	bm->frames = malloc(BENCHMARK_MAX_FRAMES*sizeof(struct benchmark_frame));
+	if ( bm->frames == NULL ) {
+		free(bm);
+		return NULL;
+	}
+	bm->n_frames = 0;
+	bm->last = 0;
+
+	fn = events_filename(tmpdir);
+	if ( fn == NULL ) {
+		im_benchmark_free(bm);
+		return NULL;
+	}
+	fh = fopen(fn, "r");
+	free(fn);
+	if ( fh == NULL ) {
+		ERROR("Failed to read benchmark frame list: %s\n",
+		      strerror(errno));
+		im_benchmark_free(bm);
+		return NULL;
+	}
+
+	while ( (bm->n_frames < BENCHMARK_MAX_FRAMES)
+	     && (fgets(line, sizeof(line), fh) != NULL) )
+	{
+		struct benchmark_frame *fr;
+		char *sp;
+
+		chomp(line);
+		sp = strrchr(line, ' ');
+		if ( sp == NULL ) continue;
+		sp[0] = '\0';
+
+		fr = &bm->frames[bm->n_frames];
+		fr->image = file_wait_open_read(line, &sp[1], iargs->dtempl,
+		                                0, iargs->no_image_data,
+		                                iargs->no_mask_data,
+		                                NULL, 1);
+		if ( fr->image == NULL ) {
+			ERROR("Failed to read benchmark frame %s %s\n",
+			      line, &sp[1]);
+			continue;
+		}
+		fr->filename = strdup(line);
+		fr->event = strdup(&sp[1]);
+		bm->n_frames++;
+	}
+	fclose(fh);
+
+	if ( bm->n_frames == 0 ) {
+		ERROR("No frames for benchmark\n");
+		im_benchmark_free(bm);
+		return NULL;
+	}
+
+	return bm;
+}
+
+
+void im_benchmark_free(struct im_benchmark *bm)
+{
+	int i;
+
+	if ( bm == NULL ) return;
+
+	for ( i=0; i<bm->n_frames; i++ ) {
+		free(bm->frames[i].filename);
+		free(bm->frames[i].event);
+		image_free(bm->frames[i].image);
+	}
+	free(bm->frames);
+	free(bm);
+}
+
+
+/* Returns a copy of the frame for the event, which the caller (or rather,
+ * process_image()) must free, or NULL if the event isn't one of the frames.
+ * The events normally come in the same order as in the list, so the search
+ * starts just after the previous one. */
+struct image *im_benchmark_get(struct im_benchmark *bm,
+                               const char *filename, const char *event)
+{
+	int i;
+
+	for ( i=0; i<bm->n_frames; i++ ) {
+
+		int idx = (bm->last + i) % bm->n_frames;
+		struct benchmark_frame *fr = &bm->frames[idx];
+
+		if ( (strcmp(fr->filename, filename) == 0)
+		  && (strcmp(fr->event, event) == 0) )
+		{
+			struct image *image;
+			bm->last = (idx+1) % bm->n_frames;
+			profile_start("benchmark-copy-frame");
+			image = image_copy(fr->image);
+			profile_end("benchmark-copy-frame");
+			return image;
+		}
+	}
+
+	return NULL;
+}
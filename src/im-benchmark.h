@@ -0,0 +1,52 @@
+/*
+ * im-benchmark.h
+ *
+ * Replay frames from memory, for measuring throughput
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IM_BENCHMARK_H
+#define IM_BENCHMARK_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "process_image.h"
+
+/* Maximum number of frames to hold in memory (in each worker) */
+#define BENCHMARK_MAX_FRAMES (64)
+
+/* Maximum number of measurements, with different numbers of workers */
+#define BENCHMARK_MAX_STEPS (16)
+
+extern int im_benchmark_write_events(const char *tmpdir, char **filenames,
+                                     char **events, int n);
+extern struct im_benchmark *im_benchmark_new(const struct index_args *iargs,
+                                             const char *tmpdir);
+extern void im_benchmark_free(struct im_benchmark *bm);
+extern struct image *im_benchmark_get(struct im_benchmark *bm,
+                                      const char *filename, const char *event);
+
+#endif /* IM_BENCHMARK_H */
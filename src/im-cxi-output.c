@@ -0,0 +1,442 @@
+/*
+ * im-cxi-output.c
+ *
+ * Peak lists and hit flags in CXI format from indexamajig
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* With --cxi-output, each worker writes its own HDF5 file with one row per
+ * frame, in the order the worker processed them.  The peak arrays use the
+ * same layout as Cheetah's CXI files, so they can be read with "peak_list"
+ * in the geometry file, and the other arrays say where each row came from
+ * and what became of the frame:
+ *
+ *   /entry_1/result_1/nPeaks              int32 [frames]
+ *   /entry_1/result_1/peakXPosRaw         float [frames][CXI_MAX_PEAKS]
+ *   /entry_1/result_1/peakYPosRaw         float [frames][CXI_MAX_PEAKS]
+ *   /entry_1/result_1/peakTotalIntensity  float [frames][CXI_MAX_PEAKS]
+ *   /entry_1/result_1/hit                 int8 [frames]
+ *   /entry_1/result_1/nCrystals           int32 [frames]
+ *   /entry_1/result_1/serial              int32 [frames]
+ *   /entry_1/result_1/filename            string [frames]
+ *   /entry_1/result_1/event               string [frames]
+ *
+ * Peak positions are in the coordinates of the data array in the file, with
+ * Cheetah's convention that 0,0 is the middle of the first pixel (i.e. read
+ * them back with --half-pixel-shift, which is the default).
+ *
+ * The rows are kept in memory and written one whole chunk at a time.  This
+ * uses HDF5 from the worker's main thread, so it can't be combined with
+ * --prefetch. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <hdf5.h>
+
+#include <image.h>
+#include <datatemplate.h>
+#include <utils.h>
+
+#include "im-cxi-output.h"
+
+
+/* Same as Cheetah */
+#define CXI_MAX_PEAKS (2048)
+
+/* Rows per chunk, and per write */
+#define CXI_BLOCK_ROWS (64)
+
+enum
+{
+	COL_NPEAKS,
+	COL_X,
+	COL_Y,
+	COL_I,
+	COL_HIT,
+	COL_NCRYSTALS,
+	COL_SERIAL,
+	COL_FILENAME,
+	COL_EVENT,
+	N_COLS
+};
+
+struct cxi_column
+{
+	const char *name;
+	hid_t type;
+	size_t elsize;
+	int width;     /* 1 for a value per frame, otherwise a row per frame */
+	hid_t dh;
+	char *buf;     /* CXI_BLOCK_ROWS rows */
+};
+
+
+struct im_cxi_output
+{
+	const DataTemplate *dtempl;
+	hid_t fh;
+	hid_t strtype;
+	struct cxi_column cols[N_COLS];
+	hsize_t n_written;
+	int n_buf;
+	int failed;
+};
+
+
+static hid_t column_dcpl(int width)
+{
+	hid_t dcpl;
+	hsize_t chunk[2];
+
+	dcpl = H5Pcreate(H5P_DATASET_CREATE);
+	if ( dcpl < 0 ) return -1;
+
+	chunk[0] = CXI_BLOCK_ROWS;
+	chunk[1] = width;
+	if ( H5Pset_chunk(dcpl, (width > 1) ? 2 : 1, chunk) < 0 ) {
+		H5Pclose(dcpl);
+		return -1;
+	}
+
+	/* The peak arrays are mostly zeroes */
+	if ( (width > 1) && H5Zfilter_avail(H5Z_FILTER_DEFLATE) ) {
+		H5Pset_shuffle(dcpl);
+		H5Pset_deflate(dcpl, 1);
+	}
+
+	return dcpl;
+}
+
+
+static int create_column(hid_t gh, struct cxi_column *col)
+{
+	hsize_t size[2];
+	hsize_t max_size[2];
+	hid_t sh, dcpl;
+	int ndims = (col->width > 1) ? 2 : 1;
+
+	size[0] = 0;
+	size[1] = col->width;
+	max_size[0] = H5S_UNLIMITED;
+	max_size[1] = col->width;
+	sh = H5Screate_simple(ndims, size, max_size);
+	if ( sh < 0 ) return 1;
+
+	dcpl = column_dcpl(col->width);
+	if ( dcpl < 0 ) {
+		H5Sclose(sh);
+		return 1;
+	}
+
+	col->dh = H5Dcreate2(gh, col->name, col->type, sh,
+	                     H5P_DEFAULT, dcpl, H5P_DEFAULT);
+	H5Pclose(dcpl);
+	H5Sclose(sh);
+	if ( col->dh < 0 ) {
+		ERROR("Couldn't create dataset %s\n", col->name);
+		return 1;
+	}
+
+	col->buf = cfcalloc(CXI_BLOCK_ROWS*col->width, col->elsize);
+	if ( col->buf == NULL ) return 1;
+
+	return 0;
+}
+
+
+static void write_cxi_version(hid_t fh)
+{
+	hid_t dh, sh;
+	int version = 140;
+
+	sh = H5Screate(H5S_SCALAR);
+	dh = H5Dcreate2(fh, "cxi_version", H5T_NATIVE_INT, sh,
+	                H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+	if ( dh >= 0 ) {
+		H5Dwrite(dh, H5T_NATIVE_INT, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+		         &version);
+		H5Dclose(dh);
+	}
+	H5Sclose(sh);
+}
+
+
+static void set_column(struct cxi_column *col, const char *name, hid_t type,
+                       size_t elsize, int width)
+{
+	col->name = name;
+	col->type = type;
+	col->elsize = elsize;
+	col->width = width;
+	col->dh = -1;
+	col->buf = NULL;
+}
+
+
+/**
+ * Creates a new CXI file for worker number \p worker_id in \p dir.  The
+ * geometry \p dtempl is used to convert the peak positions to file
+ * coordinates, and must stay valid until im_cxi_output_free().
+ *
+ * \returns the CXI output, or NULL on error.
+ */
+struct im_cxi_output *im_cxi_output_new(const char *dir,
+                                        const DataTemplate *dtempl,
+                                        int worker_id)
+{
+	struct im_cxi_output *co;
+	char host[256];
+	char *path;
+	size_t pl;
+	hid_t gh;
+	int i;
+
+	co = cfmalloc(sizeof(struct im_cxi_output));
+	if ( co == NULL ) return NULL;
+	co->dtempl = dtempl;
+	co->n_written = 0;
+	co->n_buf = 0;
+	co->failed = 0;
+
+	co->strtype = H5Tcopy(H5T_C_S1);
+	H5Tset_size(co->strtype, H5T_VARIABLE);
+
+	set_column(&co->cols[COL_NPEAKS], "nPeaks", H5T_NATIVE_INT32,
+	           sizeof(int32_t), 1);
+	set_column(&co->cols[COL_X], "peakXPosRaw", H5T_NATIVE_FLOAT,
+	           sizeof(float), CXI_MAX_PEAKS);
+	set_column(&co->cols[COL_Y], "peakYPosRaw", H5T_NATIVE_FLOAT,
+	           sizeof(float), CXI_MAX_PEAKS);
+	set_column(&co->cols[COL_I], "peakTotalIntensity", H5T_NATIVE_FLOAT,
+	           sizeof(float), CXI_MAX_PEAKS);
+	set_column(&co->cols[COL_HIT], "hit", H5T_NATIVE_INT8,
+	           sizeof(int8_t), 1);
+	set_column(&co->cols[COL_NCRYSTALS], "nCrystals", H5T_NATIVE_INT32,
+	           sizeof(int32_t), 1);
+	set_column(&co->cols[COL_SERIAL], "serial", H5T_NATIVE_INT32,
+	           sizeof(int32_t), 1);
+	set_column(&co->cols[COL_FILENAME], "filename", co->strtype,
+	           sizeof(char *), 1);
+	set_column(&co->cols[COL_EVENT], "event", co->strtype,
+	           sizeof(char *), 1);
+
+	if ( gethostname(host, sizeof(host)) == -1 ) strcpy(host, "host");
+	host[sizeof(host)-1] = '\0';
+	pl = strlen(dir) + strlen(host) + 64;
+	path = cfmalloc(pl);
+	if ( path == NULL ) {
+		H5Tclose(co->strtype);
+		cffree(co);
+		return NULL;
+	}
+	snprintf(path, pl, "%s/%s-%i-%i.cxi", dir, host, getpid(), worker_id);
+
+	co->fh = H5Fcreate(path, H5F_ACC_EXCL, H5P_DEFAULT, H5P_DEFAULT);
+	if ( co->fh < 0 ) {
+		ERROR("Couldn't create CXI output file %s\n", path);
+		cffree(path);
+		H5Tclose(co->strtype);
+		cffree(co);
+		return NULL;
+	}
+	cffree(path);
+
+	write_cxi_version(co->fh);
+
+	gh = H5Gcreate2(co->fh, "entry_1", H5P_DEFAULT, H5P_DEFAULT,
+	                H5P_DEFAULT);
+	if ( gh >= 0 ) {
+		hid_t rgh = H5Gcreate2(gh, "result_1", H5P_DEFAULT,
+		                       H5P_DEFAULT, H5P_DEFAULT);
+		H5Gclose(gh);
+		gh = rgh;
+	}
+	if ( gh < 0 ) {
+		ERROR("Couldn't create group in CXI output file\n");
+		co->failed = 1;
+		im_cxi_output_free(co);
+		return NULL;
+	}
+
+	for ( i=0; i<N_COLS; i++ ) {
+		if ( create_column(gh, &co->cols[i]) ) {
+			co->failed = 1;
+			H5Gclose(gh);
+			im_cxi_output_free(co);
+			return NULL;
+		}
+	}
+	H5Gclose(gh);
+
+	return co;
+}
+
+
+static int flush_column(struct cxi_column *col, hsize_t n_written, int n)
+{
+	hsize_t size[2];
+	hsize_t offset[2];
+	hsize_t count[2];
+	hid_t sh, mh;
+	int ndims = (col->width > 1) ? 2 : 1;
+	herr_t r;
+
+	size[0] = n_written + n;
+	size[1] = col->width;
+	if ( H5Dset_extent(col->dh, size) < 0 ) return 1;
+
+	sh = H5Dget_space(col->dh);
+	if ( sh < 0 ) return 1;
+
+	offset[0] = n_written;
+	offset[1] = 0;
+	count[0] = n;
+	count[1] = col->width;
+	if ( H5Sselect_hyperslab(sh, H5S_SELECT_SET, offset, NULL,
+	                         count, NULL) < 0 )
+	{
+		H5Sclose(sh);
+		return 1;
+	}
+
+	mh = H5Screate_simple(ndims, count, NULL);
+	r = H5Dwrite(col->dh, col->type, mh, sh, H5P_DEFAULT, col->buf);
+	H5Sclose(mh);
+	H5Sclose(sh);
+
+	return (r < 0);
+}
+
+
+static void flush_rows(struct im_cxi_output *co)
+{
+	int i, j;
+
+	if ( co->n_buf == 0 ) return;
+
+	if ( !co->failed ) {
+		for ( i=0; i<N_COLS; i++ ) {
+			if ( flush_column(&co->cols[i], co->n_written,
+			                  co->n_buf) )
+			{
+				ERROR("Failed to write to CXI output file\n");
+				co->failed = 1;
+				break;
+			}
+		}
+		H5Fflush(co->fh, H5F_SCOPE_LOCAL);
+	}
+
+	for ( j=0; j<co->n_buf; j++ ) {
+		cffree(((char **)co->cols[COL_FILENAME].buf)[j]);
+		cffree(((char **)co->cols[COL_EVENT].buf)[j]);
+	}
+
+	co->n_written += co->n_buf;
+	co->n_buf = 0;
+}
+
+
+/**
+ * Adds a row for \p image to the CXI output.  Frames with more than 2048
+ * peaks only get the first 2048.
+ */
+void im_cxi_output_add(struct im_cxi_output *co, const struct image *image)
+{
+	int r = co->n_buf;
+	float *x, *y, *in;
+	int n, np, i;
+
+	if ( co->failed ) return;
+
+	x = (float *)co->cols[COL_X].buf + r*CXI_MAX_PEAKS;
+	y = (float *)co->cols[COL_Y].buf + r*CXI_MAX_PEAKS;
+	in = (float *)co->cols[COL_I].buf + r*CXI_MAX_PEAKS;
+	memset(x, 0, CXI_MAX_PEAKS*sizeof(float));
+	memset(y, 0, CXI_MAX_PEAKS*sizeof(float));
+	memset(in, 0, CXI_MAX_PEAKS*sizeof(float));
+
+	n = image_feature_count(image->features);
+	np = 0;
+	for ( i=0; i<n; i++ ) {
+
+		const struct imagefeature *f;
+		float fs, ss;
+
+		if ( np == CXI_MAX_PEAKS ) break;
+
+		f = image_get_feature_const(image->features, i);
+		if ( f == NULL ) continue;
+
+		fs = f->fs;
+		ss = f->ss;
+		if ( data_template_panel_to_file_coords(co->dtempl, f->pn,
+		                                        &fs, &ss) ) continue;
+
+		x[np] = fs - 0.5;
+		y[np] = ss - 0.5;
+		in[np] = f->intensity;
+		np++;
+
+	}
+
+	((int32_t *)co->cols[COL_NPEAKS].buf)[r] = np;
+	((int8_t *)co->cols[COL_HIT].buf)[r] = image->hit;
+	((int32_t *)co->cols[COL_NCRYSTALS].buf)[r] = image->n_crystals;
+	((int32_t *)co->cols[COL_SERIAL].buf)[r] = image->serial;
+	((char **)co->cols[COL_FILENAME].buf)[r] = cfstrdup(image->filename != NULL
+	                                                    ? image->filename : "");
+	((char **)co->cols[COL_EVENT].buf)[r] = cfstrdup(image->ev != NULL
+	                                                 ? image->ev : "");
+
+	co->n_buf++;
+	if ( co->n_buf == CXI_BLOCK_ROWS ) flush_rows(co);
+}
+
+
+/**
+ * Writes any remaining rows, and closes the CXI output file.
+ */
+void im_cxi_output_free(struct im_cxi_output *co)
+{
+	int i;
+
+	if ( co == NULL ) return;
+
+	flush_rows(co);
+	for ( i=0; i<N_COLS; i++ ) {
+		if ( co->cols[i].dh >= 0 ) H5Dclose(co->cols[i].dh);
+		cffree(co->cols[i].buf);
+	}
+	H5Tclose(co->strtype);
+	H5Fclose(co->fh);
+	cffree(co);
+}
@@ -0,0 +1,59 @@
+/*
+ * im-cxi-output.h
+ *
+ * Peak lists and hit flags in CXI format from indexamajig
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IM_CXI_OUTPUT_H
+#define IM_CXI_OUTPUT_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <image.h>
+#include <datatemplate.h>
+#include <utils.h>
+
+struct im_cxi_output;
+
+#if defined(HAVE_HDF5)
+
+extern struct im_cxi_output *im_cxi_output_new(const char *dir,
+                                               const DataTemplate *dtempl,
+                                               int worker_id);
+extern void im_cxi_output_add(struct im_cxi_output *co,
+                              const struct image *image);
+extern void im_cxi_output_free(struct im_cxi_output *co);
+
+#else /* defined(HAVE_HDF5) */
+
+static UNUSED struct im_cxi_output *im_cxi_output_new(const char *dir, const DataTemplate *dtempl, int worker_id) { return NULL; }
+static UNUSED void im_cxi_output_add(struct im_cxi_output *co, const struct image *image) { }
+static UNUSED void im_cxi_output_free(struct im_cxi_output *co) { }
+
+#endif /* defined(HAVE_HDF5) */
+
+#endif /* IM_CXI_OUTPUT_H */
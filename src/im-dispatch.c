@@ -0,0 +1,544 @@
+/*
+ * im-dispatch.c
+ *
+ * Hand out events to indexamajig instances on other machines
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* The protocol is line-based text over TCP.  The client asks for up to n
+ * events with "GET n".  The dispatcher replies with one line per event,
+ * "EV <serial> <event ID> <filename>", followed by "OK".  When there are no
+ * more events, the reply is just "DONE".  Serial numbers are assigned by the
+ * dispatcher, so that they are unique across all the clients. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <utils.h>
+
+#include "im-dispatch.h"
+
+
+/* Maximum number of clients connected to the dispatcher at once */
+#define DISPATCH_MAX_CLIENTS (1024)
+
+/* Maximum length of a request line from a client */
+#define DISPATCH_MAX_REQUEST (64)
+
+
+struct dispatch_client
+{
+	int fd;
+	char buf[DISPATCH_MAX_REQUEST];
+	size_t len;
+};
+
+
+struct im_dispatch
+{
+	int fd;
+	FILE *fh;
+	int done;
+
+	/* Events received but not yet handed out */
+	char **filenames;
+	char **events;
+	int *serials;
+	int n_events;
+	int next_event;
+	int max_events;
+};
+
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+	while ( len > 0 ) {
+		ssize_t r = send(fd, buf, len, MSG_NOSIGNAL);
+		if ( r < 0 ) {
+			if ( errno == EINTR ) continue;
+			return 1;
+		}
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+
+/* Opens a TCP socket listening on the given port, on all interfaces.
+ * Returns the file descriptor, or -1 on error. */
+int tcp_listen(const char *port)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	int fd = -1;
+	int r;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	r = getaddrinfo(NULL, port, &hints, &res);
+	if ( r != 0 ) {
+		ERROR("Invalid port '%s': %s\n", port, gai_strerror(r));
+		return -1;
+	}
+
+	for ( ai=res; ai!=NULL; ai=ai->ai_next ) {
+
+		int one = 1;
+
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if ( fd < 0 ) continue;
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if ( (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+		  && (listen(fd, 64) == 0) ) break;
+
+		close(fd);
+		fd = -1;
+
+	}
+	freeaddrinfo(res);
+
+	if ( fd < 0 ) {
+		ERROR("Couldn't listen on port %s: %s\n", port, strerror(errno));
+	}
+	return fd;
+}
+
+
+/* Returns non-zero if the client should be disconnected */
+static int handle_request(struct dispatch_client *cl, const char *line,
+                          int *pserial, int *pfinished,
+                          DispatchEventFunc get_event, void *vp)
+{
+	int n, i;
+	int n_sent = 0;
+
+	if ( sscanf(line, "GET %i", &n) != 1 ) {
+		ERROR("Invalid request from dispatcher client: '%s'\n", line);
+		return 1;
+	}
+
+	for ( i=0; i<n; i++ ) {
+
+		char *filename;
+		char *event;
+		char *reply;
+		size_t len;
+		int r;
+
+		if ( *pfinished ) break;
+		if ( !get_event(vp, &filename, &event) ) {
+			*pfinished = 1;
+			break;
+		}
+
+		len = strlen(filename) + strlen(event) + 32;
+		reply = malloc(len);
+		if ( reply == NULL ) {
+			free(filename);
+			free(event);
+			return 1;
+		}
+		snprintf(reply, len, "EV %i %s %s\n", (*pserial)++, event,
+		         filename);
+		free(filename);
+		free(event);
+
+		r = send_all(cl->fd, reply, strlen(reply));
+		free(reply);
+		if ( r ) return 1;
+		n_sent++;
+
+	}
+
+	if ( n_sent == 0 ) {
+		return send_all(cl->fd, "DONE\n", 5);
+	}
+	return send_all(cl->fd, "OK\n", 3);
+}
+
+
+/* Returns non-zero if the client should be disconnected */
+static int read_from_client(struct dispatch_client *cl, int *pserial,
+                            int *pfinished, DispatchEventFunc get_event,
+                            void *vp)
+{
+	ssize_t r;
+	char *nl;
+
+	r = recv(cl->fd, cl->buf+cl->len, DISPATCH_MAX_REQUEST-cl->len-1, 0);
+	if ( r <= 0 ) return 1;
+	cl->len += r;
+	cl->buf[cl->len] = '\0';
+
+	while ( (nl = strchr(cl->buf, '\n')) != NULL ) {
+		*nl = '\0';
+		if ( handle_request(cl, cl->buf, pserial, pfinished,
+		                    get_event, vp) ) return 1;
+		cl->len -= nl+1-cl->buf;
+		memmove(cl->buf, nl+1, cl->len+1);
+	}
+
+	if ( cl->len == DISPATCH_MAX_REQUEST-1 ) {
+		ERROR("Request from dispatcher client is too long\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * \param port: The TCP port number (or service name) to listen on
+ * \param serial_start: The serial number to give to the first event
+ * \param get_event: Function to call to get each event
+ * \param vp: Private data for \p get_event
+ *
+ * Listens for connections from indexamajig instances (see
+ * im_dispatch_connect()), and hands out events to them as they ask for them.
+ * Returns when all the events have been handed out and all the clients have
+ * disconnected.
+ *
+ * \returns zero on success, non-zero on error.
+ */
+int im_dispatch_serve(const char *port, int serial_start,
+                      DispatchEventFunc get_event, void *vp)
+{
+	int listen_fd;
+	struct dispatch_client *clients;
+	struct pollfd *pfds;
+	int n_clients = 0;
+	int n_connected = 0;
+	int serial = serial_start;
+	int finished = 0;
+
+	listen_fd = tcp_listen(port);
+	if ( listen_fd < 0 ) return 1;
+
+	clients = malloc(DISPATCH_MAX_CLIENTS*sizeof(struct dispatch_client));
+	pfds = malloc((DISPATCH_MAX_CLIENTS+1)*sizeof(struct pollfd));
+	if ( (clients == NULL) || (pfds == NULL) ) {
+		ERROR("Failed to allocate dispatcher clients\n");
+		close(listen_fd);
+		free(clients);
+		free(pfds);
+		return 1;
+	}
+
+	STATUS("Waiting for connections on port %s\n", port);
+
+	while ( !finished || (n_clients > 0) ) {
+
+		int i;
+
+		pfds[0].fd = listen_fd;
+		pfds[0].events = POLLIN;
+		for ( i=0; i<n_clients; i++ ) {
+			pfds[i+1].fd = clients[i].fd;
+			pfds[i+1].events = POLLIN;
+		}
+
+		if ( poll(pfds, n_clients+1, -1) < 0 ) {
+			if ( errno == EINTR ) continue;
+			ERROR("poll() failed: %s\n", strerror(errno));
+			break;
+		}
+
+		/* Work backwards, so that removing a client doesn't upset
+		 * the indices of the ones still to be checked */
+		for ( i=n_clients-1; i>=0; i-- ) {
+			if ( !(pfds[i+1].revents & (POLLIN | POLLHUP | POLLERR)) ) {
+				continue;
+			}
+			if ( read_from_client(&clients[i], &serial, &finished,
+			                      get_event, vp) )
+			{
+				close(clients[i].fd);
+				clients[i] = clients[--n_clients];
+			}
+		}
+
+		if ( pfds[0].revents & POLLIN ) {
+			int fd = accept(listen_fd, NULL, NULL);
+			if ( fd < 0 ) continue;
+			if ( n_clients == DISPATCH_MAX_CLIENTS ) {
+				ERROR("Too many dispatcher clients\n");
+				close(fd);
+				continue;
+			}
+			clients[n_clients].fd = fd;
+			clients[n_clients].len = 0;
+			n_clients++;
+			n_connected++;
+		}
+
+	}
+
+	STATUS("Dispatched %i events to %i clients.\n",
+	       serial - serial_start, n_connected);
+
+	close(listen_fd);
+	free(clients);
+	free(pfds);
+	return 0;
+}
+
+
+/**
+ * \param addr: The address of the dispatcher, as "host:port"
+ *
+ * Connects to an event dispatcher which was started with im_dispatch_serve().
+ *
+ * \returns a new \ref im_dispatch structure, or NULL on error.
+ */
+struct im_dispatch *im_dispatch_connect(const char *addr)
+{
+	struct im_dispatch *d;
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	char *host;
+	char *port;
+	int fd = -1;
+	int r;
+
+	host = strdup(addr);
+	if ( host == NULL ) return NULL;
+	port = strrchr(host, ':');
+	if ( port == NULL ) {
+		ERROR("Dispatcher address must be given as host:port\n");
+		free(host);
+		return NULL;
+	}
+	*port++ = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	r = getaddrinfo(host, port, &hints, &res);
+	if ( r != 0 ) {
+		ERROR("Couldn't look up dispatcher '%s': %s\n",
+		      addr, gai_strerror(r));
+		free(host);
+		return NULL;
+	}
+
+	for ( ai=res; ai!=NULL; ai=ai->ai_next ) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if ( fd < 0 ) continue;
+		if ( connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 ) break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	free(host);
+
+	if ( fd < 0 ) {
+		ERROR("Couldn't connect to dispatcher '%s': %s\n",
+		      addr, strerror(errno));
+		return NULL;
+	}
+
+	d = malloc(sizeof(struct im_dispatch));
+	if ( d == NULL ) {
+		close(fd);
+		return NULL;
+	}
+
+	d->fd = fd;
+	d->fh = fdopen(fd, "r");
+	if ( d->fh == NULL ) {
+		close(fd);
+		free(d);
+		return NULL;
+	}
+	d->done = 0;
+	d->filenames = NULL;
+	d->events = NULL;
+	d->serials = NULL;
+	d->n_events = 0;
+	d->next_event = 0;
+	d->max_events = 0;
+
+	STATUS("Connected to event dispatcher at %s\n", addr);
+	return d;
+}
+
+
+void im_dispatch_shutdown(struct im_dispatch *d)
+{
+	int i;
+
+	if ( d == NULL ) return;
+
+	for ( i=d->next_event; i<d->n_events; i++ ) {
+		free(d->filenames[i]);
+		free(d->events[i]);
+	}
+	fclose(d->fh);  /* Also closes d->fd */
+	free(d->filenames);
+	free(d->events);
+	free(d->serials);
+	free(d);
+}
+
+
+static int resize_event_buffer(struct im_dispatch *d, int n)
+{
+	char **filenames;
+	char **events;
+	int *serials;
+
+	if ( n <= d->max_events ) return 0;
+
+	filenames = realloc(d->filenames, n*sizeof(char *));
+	events = realloc(d->events, n*sizeof(char *));
+	serials = realloc(d->serials, n*sizeof(int));
+	if ( filenames != NULL ) d->filenames = filenames;
+	if ( events != NULL ) d->events = events;
+	if ( serials != NULL ) d->serials = serials;
+	if ( (filenames == NULL) || (events == NULL) || (serials == NULL) ) {
+		return 1;
+	}
+
+	d->max_events = n;
+	return 0;
+}
+
+
+/* Returns non-zero if there are no more events, or after an error */
+static int request_events(struct im_dispatch *d, int n)
+{
+	char req[64];
+	char *line = NULL;
+	size_t len = 0;
+
+	if ( resize_event_buffer(d, n) ) {
+		ERROR("Failed to allocate dispatcher event buffer\n");
+		return 1;
+	}
+
+	snprintf(req, 64, "GET %i\n", n);
+	if ( send_all(d->fd, req, strlen(req)) ) {
+		ERROR("Lost connection to dispatcher: %s\n", strerror(errno));
+		return 1;
+	}
+
+	d->n_events = 0;
+	d->next_event = 0;
+	while ( getline(&line, &len, d->fh) != -1 ) {
+
+		int serial;
+		int pos;
+		char *event;
+		char *filename;
+
+		chomp(line);
+
+		if ( strcmp(line, "OK") == 0 ) {
+			free(line);
+			return 0;
+		}
+		if ( strcmp(line, "DONE") == 0 ) {
+			free(line);
+			return 1;
+		}
+
+		if ( (sscanf(line, "EV %i %n", &serial, &pos) < 1)
+		  || (d->n_events == n) )
+		{
+			ERROR("Invalid reply from dispatcher: '%s'\n", line);
+			break;
+		}
+
+		event = line+pos;
+		filename = strchr(event, ' ');
+		if ( filename == NULL ) {
+			ERROR("Invalid reply from dispatcher: '%s'\n", line);
+			break;
+		}
+		*filename++ = '\0';
+
+		d->filenames[d->n_events] = strdup(filename);
+		d->events[d->n_events] = strdup(event);
+		d->serials[d->n_events] = serial;
+		d->n_events++;
+
+	}
+
+	/* Connection closed or invalid reply.  Process whatever we already
+	 * received, and then stop. */
+	if ( feof(d->fh) ) ERROR("Lost connection to dispatcher\n");
+	free(line);
+	d->done = 1;
+	return d->n_events == 0;
+}
+
+
+/**
+ * \param d: An \ref im_dispatch structure from im_dispatch_connect()
+ * \param n_wanted: The number of events to ask for, if more are needed
+ * \param pfilename: Location at which to store the filename
+ * \param pevent: Location at which to store the event ID
+ * \param pserial: Location at which to store the serial number
+ *
+ * Gets the next event from the dispatcher.  Events are requested in batches
+ * of \p n_wanted, so that the dispatcher keeps the remaining events for
+ * whichever client needs them next.  The filename and event ID must be freed
+ * by the caller.
+ *
+ * \returns 1 if an event was returned, or 0 if there are no more events.
+ */
+int im_dispatch_next(struct im_dispatch *d, int n_wanted,
+                     char **pfilename, char **pevent, int *pserial)
+{
+	if ( d->next_event == d->n_events ) {
+		if ( d->done ) return 0;
+		if ( n_wanted < 1 ) n_wanted = 1;
+		if ( request_events(d, n_wanted) ) d->done = 1;
+		if ( d->next_event == d->n_events ) return 0;
+	}
+
+	*pfilename = d->filenames[d->next_event];
+	*pevent = d->events[d->next_event];
+	*pserial = d->serials[d->next_event];
+	d->next_event++;
+	return 1;
+}
@@ -0,0 +1,50 @@
+/*
+ * im-dispatch.h
+ *
+ * Hand out events to indexamajig instances on other machines
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CRYSTFEL_DISPATCH_H
+#define CRYSTFEL_DISPATCH_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/* Gets the next event to be handed out.  Returns 0 for "no more", otherwise
+ * the filename and event ID must be freed by the caller. */
+typedef int (*DispatchEventFunc)(void *vp, char **pfilename, char **pevent);
+
+extern int tcp_listen(const char *port);
+
+extern int im_dispatch_serve(const char *port, int serial_start,
+                             DispatchEventFunc get_event, void *vp);
+
+extern struct im_dispatch *im_dispatch_connect(const char *addr);
+extern void im_dispatch_shutdown(struct im_dispatch *d);
+extern int im_dispatch_next(struct im_dispatch *d, int n_wanted,
+                            char **pfilename, char **pevent, int *pserial);
+
+#endif /* CRYSTFEL_DISPATCH_H */
@@ -0,0 +1,181 @@
+/*
+ * im-metrics.c
+ *
+ * Serve live statistics over HTTP, for monitoring
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* This is a minimal HTTP server, just enough for Prometheus (or curl) to
+ * fetch the metrics.  It is polled from the main loop of the sandbox, so it
+ * doesn't need a thread of its own.  Every request gets the metrics in reply,
+ * whatever the path. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <utils.h>
+
+#include "im-metrics.h"
+#include "im-dispatch.h"
+
+
+struct im_metrics
+{
+	int fd;
+};
+
+
+/**
+ * \param port: The TCP port number (or service name) to listen on
+ *
+ * Starts listening for HTTP requests for the metrics.  The requests will only
+ * be answered when im_metrics_poll() is called.
+ *
+ * \returns a new \ref im_metrics structure, or NULL on error.
+ */
+struct im_metrics *im_metrics_listen(const char *port)
+{
+	struct im_metrics *m;
+	int fd;
+
+	fd = tcp_listen(port);
+	if ( fd < 0 ) return NULL;
+
+	/* Polled from the main loop, so must never block */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	m = malloc(sizeof(struct im_metrics));
+	if ( m == NULL ) {
+		close(fd);
+		return NULL;
+	}
+	m->fd = fd;
+
+	STATUS("Serving metrics on port %s\n", port);
+	return m;
+}
+
+
+static void send_response(int fd, const char *body)
+{
+	char header[256];
+	const char *parts[2];
+	size_t lens[2];
+	int i;
+
+	snprintf(header, 256, "HTTP/1.0 200 OK\r\n"
+	                      "Content-Type: text/plain; version=0.0.4\r\n"
+	                      "Content-Length: %zu\r\n"
+	                      "Connection: close\r\n\r\n", strlen(body));
+
+	parts[0] = header;  lens[0] = strlen(header);
+	parts[1] = body;    lens[1] = strlen(body);
+
+	for ( i=0; i<2; i++ ) {
+		const char *buf = parts[i];
+		size_t len = lens[i];
+		while ( len > 0 ) {
+			ssize_t r = send(fd, buf, len, MSG_NOSIGNAL);
+			if ( r < 0 ) {
+				if ( errno == EINTR ) continue;
+				return;
+			}
+			buf += r;
+			len -= r;
+		}
+	}
+}
+
+
+static void handle_connection(int fd, MetricsFunc get_metrics, void *vp)
+{
+	char buf[4096];
+	size_t len = 0;
+	struct timeval tv;
+	char *body;
+
+	/* Don't let a slow client hold up the sandbox for long */
+	tv.tv_sec = 0;
+	tv.tv_usec = 200000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* Read the request headers, but ignore them */
+	while ( len < sizeof(buf)-1 ) {
+		ssize_t r = recv(fd, buf+len, sizeof(buf)-1-len, 0);
+		if ( r <= 0 ) return;
+		len += r;
+		buf[len] = '\0';
+		if ( strstr(buf, "\r\n\r\n") != NULL ) break;
+		if ( strstr(buf, "\n\n") != NULL ) break;
+	}
+
+	body = get_metrics(vp);
+	if ( body == NULL ) return;
+	send_response(fd, body);
+	free(body);
+}
+
+
+/**
+ * \param m: An \ref im_metrics structure, or NULL
+ * \param get_metrics: Function to call to get the current metrics
+ * \param vp: Private data for \p get_metrics
+ *
+ * Answers any waiting requests for the metrics, without waiting for new ones.
+ * Does nothing if \p m is NULL.
+ */
+void im_metrics_poll(struct im_metrics *m, MetricsFunc get_metrics, void *vp)
+{
+	int fd;
+
+	if ( m == NULL ) return;
+
+	while ( (fd = accept(m->fd, NULL, NULL)) >= 0 ) {
+		/* The accepted socket doesn't inherit O_NONBLOCK on Linux,
+		 * but it does on some other systems */
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		handle_connection(fd, get_metrics, vp);
+		close(fd);
+	}
+}
+
+
+void im_metrics_shutdown(struct im_metrics *m)
+{
+	if ( m == NULL ) return;
+	close(m->fd);
+	free(m);
+}
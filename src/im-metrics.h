@@ -0,0 +1,44 @@
+/*
+ * im-metrics.h
+ *
+ * Serve live statistics over HTTP, for monitoring
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IM_METRICS_H
+#define IM_METRICS_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/* Returns the current metrics as text, to be freed by the caller */
+typedef char *(*MetricsFunc)(void *vp);
+
+extern struct im_metrics *im_metrics_listen(const char *port);
+extern void im_metrics_poll(struct im_metrics *m, MetricsFunc get_metrics,
+                            void *vp);
+extern void im_metrics_shutdown(struct im_metrics *m);
+
+#endif /* IM_METRICS_H */
@@ -0,0 +1,595 @@
+/*
+ * im-peakcache.c
+ *
+ * Cache of peak search results for indexamajig
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* With --peak-cache, the peaks found for each frame are saved, so that later
+ * runs with the same peak search parameters and geometry can skip the image
+ * filters and the peak search altogether.  The cache for one set of parameters
+ * lives in a subdirectory named after a hash of the parameters and the text of
+ * the geometry file.  Each worker appends the peaks it finds to its own file
+ * ("shard") in there, so there is no locking.  At the start, each worker maps
+ * all the shards left by previous runs and makes a hash table of the frames
+ * in them.  Frames found by other workers in the same run are not seen until
+ * the next run.
+ *
+ * Shard file format (native byte order, checked using the header):
+ *   header (struct pkc_header)
+ *   records, each of them:
+ *     uint32_t key_len, uint32_t n_peaks
+ *     key_len bytes of key: filename, '\0', event (no terminator)
+ *     n_peaks times: double fs, double ss, double intensity, int32_t pn
+ *
+ * Each record is written with a single write(), but a run which was killed
+ * might still leave a partial record at the end.  This is ignored. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <image.h>
+#include <peaks.h>
+#include <utils.h>
+
+#include "im-peakcache.h"
+
+
+#define PKC_MAGIC "CFPKCACH"
+#define PKC_VERSION (1)
+#define PKC_BYTE_ORDER (0x01020304)
+#define PKC_PEAK_SIZE (3*sizeof(double)+sizeof(int32_t))
+
+struct pkc_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t param_hash;
+};
+
+struct pkc_record
+{
+	uint32_t key_len;
+	uint32_t n_peaks;
+};
+
+
+struct im_peakcache
+{
+	char *dir;
+	uint64_t hash;
+	int worker_id;
+	int fd;           /* This worker's shard, opened on first use */
+	int write_failed;
+
+	/* Mapped shards from previous runs */
+	int n_maps;
+	void **maps;
+	size_t *map_sizes;
+
+	/* Records in the mapped shards */
+	int n_recs;
+	int max_recs;
+	const char **recs;
+	uint64_t *rec_hashes;
+
+	/* Open addressing, indices into recs or -1 */
+	int *table;
+	size_t table_size;
+};
+
+
+static void hash_bytes(uint64_t *h, const void *vp, size_t len)
+{
+	const unsigned char *p = vp;
+	size_t i;
+
+	/* FNV-1a */
+	for ( i=0; i<len; i++ ) {
+		*h ^= p[i];
+		*h *= 0x100000001b3ULL;
+	}
+}
+
+
+/* Hash of everything which affects the peaks found in a frame, apart from
+ * the frame itself */
+static uint64_t param_hash(const char *geom, const struct peak_params *pp,
+                           float highres)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int method = pp->method;
+
+	hash_bytes(&h, geom, strlen(geom));
+	hash_bytes(&h, &highres, sizeof(float));
+	hash_bytes(&h, &method, sizeof(int));
+	hash_bytes(&h, &pp->threshold, sizeof(float));
+	hash_bytes(&h, &pp->min_sq_gradient, sizeof(float));
+	hash_bytes(&h, &pp->min_snr, sizeof(float));
+	hash_bytes(&h, &pp->min_pix_count, sizeof(int));
+	hash_bytes(&h, &pp->max_pix_count, sizeof(int));
+	hash_bytes(&h, &pp->local_bg_radius, sizeof(int));
+	hash_bytes(&h, &pp->min_res, sizeof(int));
+	hash_bytes(&h, &pp->max_res, sizeof(int));
+	hash_bytes(&h, &pp->peakfinder8_fast, sizeof(int));
+	hash_bytes(&h, &pp->min_snr_biggest_pix, sizeof(float));
+	hash_bytes(&h, &pp->min_snr_peak_pix, sizeof(float));
+	hash_bytes(&h, &pp->min_sig, sizeof(float));
+	hash_bytes(&h, &pp->min_peak_over_neighbour, sizeof(float));
+	hash_bytes(&h, &pp->pk_inn, sizeof(float));
+	hash_bytes(&h, &pp->pk_mid, sizeof(float));
+	hash_bytes(&h, &pp->pk_out, sizeof(float));
+	hash_bytes(&h, &pp->noisefilter, sizeof(int));
+	hash_bytes(&h, &pp->median_filter, sizeof(int));
+	hash_bytes(&h, &pp->use_saturated, sizeof(int));
+	return h;
+}
+
+
+static uint64_t key_hash(const char *key, size_t key_len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	hash_bytes(&h, key, key_len);
+	return h;
+}
+
+
+static char *make_key(const char *filename, const char *ev, size_t *plen)
+{
+	size_t fl, el;
+	char *key;
+
+	if ( ev == NULL ) ev = "";
+	fl = strlen(filename);
+	el = strlen(ev);
+	key = cfmalloc(fl+1+el+1);
+	if ( key == NULL ) return NULL;
+	memcpy(key, filename, fl+1);
+	memcpy(key+fl+1, ev, el+1);
+	*plen = fl+1+el;
+	return key;
+}
+
+
+static int add_record(struct im_peakcache *pc, const char *rec,
+                      uint64_t h)
+{
+	if ( pc->n_recs == pc->max_recs ) {
+		int new_max = (pc->max_recs == 0) ? 1024 : 2*pc->max_recs;
+		const char **nr;
+		uint64_t *nh;
+		nr = cfrealloc(pc->recs, new_max*sizeof(const char *));
+		if ( nr == NULL ) return 1;
+		pc->recs = nr;
+		nh = cfrealloc(pc->rec_hashes, new_max*sizeof(uint64_t));
+		if ( nh == NULL ) return 1;
+		pc->rec_hashes = nh;
+		pc->max_recs = new_max;
+	}
+	pc->recs[pc->n_recs] = rec;
+	pc->rec_hashes[pc->n_recs] = h;
+	pc->n_recs++;
+	return 0;
+}
+
+
+/* Returns non-zero only if something went badly wrong.  A shard which can't
+ * be used is just skipped. */
+static int map_shard(struct im_peakcache *pc, const char *filename)
+{
+	int fd;
+	struct stat statbuf;
+	void *map;
+	void **nm;
+	size_t *ns;
+	struct pkc_header hdr;
+	size_t pos;
+
+	fd = open(filename, O_RDONLY);
+	if ( fd == -1 ) return 0;
+	if ( (fstat(fd, &statbuf) == -1)
+	  || (statbuf.st_size < (off_t)sizeof(struct pkc_header)) )
+	{
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) return 0;
+
+	memcpy(&hdr, map, sizeof(struct pkc_header));
+	if ( (memcmp(hdr.magic, PKC_MAGIC, 8) != 0)
+	  || (hdr.version != PKC_VERSION)
+	  || (hdr.byte_order != PKC_BYTE_ORDER)
+	  || (hdr.param_hash != pc->hash) )
+	{
+		munmap(map, statbuf.st_size);
+		return 0;
+	}
+
+	nm = cfrealloc(pc->maps, (pc->n_maps+1)*sizeof(void *));
+	if ( nm == NULL ) {
+		munmap(map, statbuf.st_size);
+		return 1;
+	}
+	pc->maps = nm;
+	ns = cfrealloc(pc->map_sizes, (pc->n_maps+1)*sizeof(size_t));
+	if ( ns == NULL ) {
+		munmap(map, statbuf.st_size);
+		return 1;
+	}
+	pc->map_sizes = ns;
+	pc->maps[pc->n_maps] = map;
+	pc->map_sizes[pc->n_maps] = statbuf.st_size;
+	pc->n_maps++;
+
+	pos = sizeof(struct pkc_header);
+	while ( pos + sizeof(struct pkc_record) <= (size_t)statbuf.st_size ) {
+
+		struct pkc_record r;
+		const char *rec = (const char *)map + pos;
+		size_t len;
+
+		memcpy(&r, rec, sizeof(struct pkc_record));
+		len = sizeof(struct pkc_record) + r.key_len
+		        + (size_t)r.n_peaks*PKC_PEAK_SIZE;
+		if ( pos + len > (size_t)statbuf.st_size ) break;
+
+		if ( add_record(pc, rec,
+		                key_hash(rec+sizeof(struct pkc_record),
+		                         r.key_len)) ) return 1;
+		pos += len;
+
+	}
+
+	return 0;
+}
+
+
+static int build_table(struct im_peakcache *pc)
+{
+	int i;
+
+	pc->table_size = 16;
+	while ( pc->table_size < 2*(size_t)pc->n_recs ) pc->table_size *= 2;
+	pc->table = cfmalloc(pc->table_size*sizeof(int));
+	if ( pc->table == NULL ) return 1;
+	for ( i=0; i<(int)pc->table_size; i++ ) pc->table[i] = -1;
+
+	for ( i=0; i<pc->n_recs; i++ ) {
+		size_t slot = pc->rec_hashes[i] & (pc->table_size-1);
+		while ( pc->table[slot] != -1 ) {
+			slot = (slot+1) & (pc->table_size-1);
+		}
+		pc->table[slot] = i;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Opens the peak cache in \p dir for the peak search parameters \p pp, the
+ * resolution limit \p highres and the geometry file \p geom_filename, and
+ * reads the peaks saved by previous runs with the same ones.
+ *
+ * \returns the peak cache, or NULL on error.
+ */
+struct im_peakcache *im_peakcache_new(const char *dir,
+                                      const char *geom_filename,
+                                      const struct peak_params *pp,
+                                      float highres, int worker_id)
+{
+	struct im_peakcache *pc;
+	char *geom;
+	size_t dl;
+	DIR *dh;
+	struct dirent *d;
+
+	geom = load_entire_file(geom_filename);
+	if ( geom == NULL ) {
+		ERROR("Failed to read geometry file for peak cache\n");
+		return NULL;
+	}
+
+	pc = cfmalloc(sizeof(struct im_peakcache));
+	if ( pc == NULL ) {
+		cffree(geom);
+		return NULL;
+	}
+
+	pc->hash = param_hash(geom, pp, highres);
+	cffree(geom);
+	pc->worker_id = worker_id;
+	pc->fd = -1;
+	pc->write_failed = 0;
+	pc->n_maps = 0;
+	pc->maps = NULL;
+	pc->map_sizes = NULL;
+	pc->n_recs = 0;
+	pc->max_recs = 0;
+	pc->recs = NULL;
+	pc->rec_hashes = NULL;
+	pc->table = NULL;
+
+	if ( (mkdir(dir, 0755) == -1) && (errno != EEXIST) ) {
+		ERROR("Failed to create peak cache directory %s: %s\n",
+		      dir, strerror(errno));
+		cffree(pc);
+		return NULL;
+	}
+
+	dl = strlen(dir) + 18;
+	pc->dir = cfmalloc(dl);
+	if ( pc->dir == NULL ) {
+		cffree(pc);
+		return NULL;
+	}
+	snprintf(pc->dir, dl, "%s/%016llx", dir,
+	         (unsigned long long)pc->hash);
+	if ( (mkdir(pc->dir, 0755) == -1) && (errno != EEXIST) ) {
+		ERROR("Failed to create peak cache directory %s: %s\n",
+		      pc->dir, strerror(errno));
+		im_peakcache_free(pc);
+		return NULL;
+	}
+
+	dh = opendir(pc->dir);
+	if ( dh == NULL ) {
+		ERROR("Failed to open peak cache directory %s: %s\n",
+		      pc->dir, strerror(errno));
+		im_peakcache_free(pc);
+		return NULL;
+	}
+	while ( (d = readdir(dh)) != NULL ) {
+
+		size_t nl = strlen(d->d_name);
+		char *path;
+		int r;
+
+		if ( (nl < 5) || (strcmp(d->d_name+nl-4, ".pkc") != 0) ) {
+			continue;
+		}
+
+		path = cfmalloc(strlen(pc->dir)+nl+2);
+		if ( path == NULL ) break;
+		sprintf(path, "%s/%s", pc->dir, d->d_name);
+		r = map_shard(pc, path);
+		cffree(path);
+		if ( r ) {
+			closedir(dh);
+			im_peakcache_free(pc);
+			return NULL;
+		}
+
+	}
+	closedir(dh);
+
+	if ( build_table(pc) ) {
+		im_peakcache_free(pc);
+		return NULL;
+	}
+
+	return pc;
+}
+
+
+void im_peakcache_free(struct im_peakcache *pc)
+{
+	int i;
+
+	if ( pc == NULL ) return;
+	if ( pc->fd != -1 ) close(pc->fd);
+	for ( i=0; i<pc->n_maps; i++ ) {
+		munmap(pc->maps[i], pc->map_sizes[i]);
+	}
+	cffree(pc->maps);
+	cffree(pc->map_sizes);
+	cffree(pc->recs);
+	cffree(pc->rec_hashes);
+	cffree(pc->table);
+	cffree(pc->dir);
+	cffree(pc);
+}
+
+
+/**
+ * Looks up the peaks for a frame in the peak cache.
+ *
+ * \returns a new list of the peaks, or NULL if the frame isn't in the cache.
+ */
+ImageFeatureList *im_peakcache_get(struct im_peakcache *pc,
+                                   const char *filename, const char *ev)
+{
+	char *key;
+	size_t key_len;
+	uint64_t h;
+	size_t slot;
+
+	if ( (pc->n_recs == 0) || (filename == NULL) ) return NULL;
+
+	key = make_key(filename, ev, &key_len);
+	if ( key == NULL ) return NULL;
+	h = key_hash(key, key_len);
+
+	slot = h & (pc->table_size-1);
+	while ( pc->table[slot] != -1 ) {
+
+		int i = pc->table[slot];
+		const char *rec = pc->recs[i];
+		struct pkc_record r;
+
+		memcpy(&r, rec, sizeof(struct pkc_record));
+		if ( (pc->rec_hashes[i] == h) && (r.key_len == key_len)
+		  && (memcmp(rec+sizeof(struct pkc_record), key,
+		             key_len) == 0) )
+		{
+			ImageFeatureList *peaks;
+			const char *p;
+			uint32_t j;
+
+			cffree(key);
+			peaks = image_feature_list_new();
+			if ( peaks == NULL ) return NULL;
+			image_feature_list_reserve(peaks, r.n_peaks);
+
+			p = rec + sizeof(struct pkc_record) + key_len;
+			for ( j=0; j<r.n_peaks; j++ ) {
+				double v[3];
+				int32_t pn;
+				memcpy(v, p, 3*sizeof(double));
+				memcpy(&pn, p+3*sizeof(double),
+				       sizeof(int32_t));
+				image_add_feature(peaks, v[0], v[1], pn, v[2],
+				                  NULL);
+				p += PKC_PEAK_SIZE;
+			}
+			return peaks;
+		}
+
+		slot = (slot+1) & (pc->table_size-1);
+	}
+
+	cffree(key);
+	return NULL;
+}
+
+
+static int open_shard(struct im_peakcache *pc)
+{
+	char host[256];
+	char *path;
+	size_t pl;
+	struct pkc_header hdr;
+
+	if ( gethostname(host, sizeof(host)) == -1 ) strcpy(host, "host");
+	host[sizeof(host)-1] = '\0';
+
+	pl = strlen(pc->dir) + strlen(host) + 64;
+	path = cfmalloc(pl);
+	if ( path == NULL ) return 1;
+	snprintf(path, pl, "%s/%s-%i-%i.pkc", pc->dir, host, getpid(),
+	         pc->worker_id);
+
+	pc->fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+	if ( pc->fd == -1 ) {
+		ERROR("Failed to create peak cache file %s: %s\n",
+		      path, strerror(errno));
+		cffree(path);
+		return 1;
+	}
+	cffree(path);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PKC_MAGIC, 8);
+	hdr.version = PKC_VERSION;
+	hdr.byte_order = PKC_BYTE_ORDER;
+	hdr.param_hash = pc->hash;
+	if ( write(pc->fd, &hdr, sizeof(hdr)) != sizeof(hdr) ) {
+		ERROR("Failed to write peak cache header\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Adds the peaks for a frame to this worker's part of the peak cache.  If
+ * anything goes wrong, a message is shown and the cache is not written to
+ * again.
+ */
+void im_peakcache_put(struct im_peakcache *pc, const char *filename,
+                      const char *ev, ImageFeatureList *peaks)
+{
+	char *key;
+	size_t key_len;
+	struct pkc_record r;
+	char *buf;
+	char *p;
+	size_t len;
+	int n, i;
+
+	if ( pc->write_failed || (filename == NULL) ) return;
+	if ( (pc->fd == -1) && open_shard(pc) ) {
+		pc->write_failed = 1;
+		return;
+	}
+
+	key = make_key(filename, ev, &key_len);
+	if ( key == NULL ) return;
+
+	n = image_feature_count(peaks);
+	r.key_len = key_len;
+	r.n_peaks = 0;
+	len = sizeof(struct pkc_record) + key_len + (size_t)n*PKC_PEAK_SIZE;
+	buf = cfmalloc(len);
+	if ( buf == NULL ) {
+		cffree(key);
+		return;
+	}
+
+	p = buf + sizeof(struct pkc_record) + key_len;
+	for ( i=0; i<n; i++ ) {
+		struct imagefeature *f = image_get_feature(peaks, i);
+		double v[3];
+		int32_t pn;
+		if ( f == NULL ) continue;
+		v[0] = f->fs;
+		v[1] = f->ss;
+		v[2] = f->intensity;
+		pn = f->pn;
+		memcpy(p, v, 3*sizeof(double));
+		memcpy(p+3*sizeof(double), &pn, sizeof(int32_t));
+		p += PKC_PEAK_SIZE;
+		r.n_peaks++;
+	}
+	memcpy(buf, &r, sizeof(struct pkc_record));
+	memcpy(buf+sizeof(struct pkc_record), key, key_len);
+	cffree(key);
+
+	/* One write per record, so that a partial record can only be at the
+	 * end of the file */
+	len = p - buf;
+	if ( write(pc->fd, buf, len) != (ssize_t)len ) {
+		ERROR("Failed to write to peak cache: %s\n", strerror(errno));
+		pc->write_failed = 1;
+	}
+	cffree(buf);
+}
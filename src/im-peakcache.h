@@ -0,0 +1,52 @@
+/*
+ * im-peakcache.h
+ *
+ * Cache of peak search results for indexamajig
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IM_PEAKCACHE_H
+#define IM_PEAKCACHE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <image.h>
+#include <peaks.h>
+
+struct im_peakcache;
+
+extern struct im_peakcache *im_peakcache_new(const char *dir,
+                                             const char *geom_filename,
+                                             const struct peak_params *pp,
+                                             float highres, int worker_id);
+extern void im_peakcache_free(struct im_peakcache *pc);
+extern ImageFeatureList *im_peakcache_get(struct im_peakcache *pc,
+                                          const char *filename,
+                                          const char *ev);
+extern void im_peakcache_put(struct im_peakcache *pc, const char *filename,
+                             const char *ev, ImageFeatureList *peaks);
+
+#endif /* IM_PEAKCACHE_H */
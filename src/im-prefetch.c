@@ -0,0 +1,325 @@
+/*
+ * im-prefetch.c
+ *
+ * Read images in a separate thread, ahead of processing
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Each worker can have one reader thread, which reads the images for the
+ * next few events while the worker processes the current one.  The events
+ * must be requested in the same order as they will be processed.
+ *
+ * All of the image reading (and therefore all HDF5 calls) happens in the
+ * reader thread, so this can't be used when the processing also needs to read
+ * files, e.g. for peak lists from HDF5 files. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <image.h>
+#include <utils.h>
+
+#include "im-prefetch.h"
+
+
+enum slot_state
+{
+	SLOT_FREE,    /* Can be used for a new request */
+	SLOT_QUEUED,  /* Waiting for the reader thread */
+	SLOT_READY,   /* Image has been read (or failed) */
+	SLOT_TAKEN,   /* Image is being processed */
+};
+
+
+struct prefetch_slot
+{
+	enum slot_state state;
+	char *filename;
+	char *event;
+	struct image *image;
+
+	/* Each image in flight needs its own arrays */
+	ImageDataArrays *ida;
+};
+
+
+struct im_prefetch
+{
+	const struct index_args *iargs;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int shutdown;
+
+	/* Ring buffer of slots, in the order of the requests */
+	struct prefetch_slot *slots;
+	int n_slots;
+	int head;       /* Next slot to be handed out */
+	int tail;       /* Next slot to be requested */
+	int next_read;  /* Next slot for the reader thread */
+};
+
+
+static void *prefetch_thread(void *vp)
+{
+	struct im_prefetch *pf = vp;
+
+	pthread_mutex_lock(&pf->lock);
+	while ( !pf->shutdown ) {
+
+		struct prefetch_slot *slot = &pf->slots[pf->next_read];
+		struct image *image;
+
+		if ( slot->state != SLOT_QUEUED ) {
+			pthread_cond_wait(&pf->cond, &pf->lock);
+			continue;
+		}
+
+		/* Only this thread touches a queued slot */
+		pthread_mutex_unlock(&pf->lock);
+		image = file_wait_open_read(slot->filename, slot->event,
+		                            pf->iargs->dtempl,
+		                            pf->iargs->wait_for_file,
+		                            pf->iargs->no_image_data,
+		                            pf->iargs->no_mask_data,
+		                            slot->ida, 0);
+		pthread_mutex_lock(&pf->lock);
+
+		slot->image = image;
+		slot->state = SLOT_READY;
+		pf->next_read = (pf->next_read+1) % pf->n_slots;
+		pthread_cond_broadcast(&pf->cond);
+
+	}
+	pthread_mutex_unlock(&pf->lock);
+
+	return NULL;
+}
+
+
+/**
+ * \param iargs: The indexing arguments, for the image reading options
+ * \param depth: The maximum number of images to read ahead
+ *
+ * Starts a reader thread for reading images ahead of processing.  Memory for
+ * \p depth+1 images will be needed: the ones read ahead, plus the one being
+ * processed.
+ *
+ * \returns a new \ref im_prefetch structure, or NULL on error.
+ */
+struct im_prefetch *im_prefetch_new(const struct index_args *iargs, int depth)
+{
+	struct im_prefetch *pf;
+	int i;
+
+	pf = malloc(sizeof(struct im_prefetch));
+	if ( pf == NULL ) return NULL;
+
+	pf->n_slots = depth+1;
+	pf->slots = malloc(pf->n_slots*sizeof(struct prefetch_slot));
+	if ( pf->slots == NULL ) {
+		free(pf);
+		return NULL;
+	}
+
+	for ( i=0; i<pf->n_slots; i++ ) {
+		pf->slots[i].state = SLOT_FREE;
+		pf->slots[i].filename = NULL;
+		pf->slots[i].event = NULL;
+		pf->slots[i].image = NULL;
+		pf->slots[i].ida = image_data_arrays_new_huge(iargs->huge_pages);
+	}
+
+	pf->iargs = iargs;
+	pf->shutdown = 0;
+	pf->head = 0;
+	pf->tail = 0;
+	pf->next_read = 0;
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->cond, NULL);
+
+	if ( pthread_create(&pf->thread, NULL, prefetch_thread, pf) ) {
+		ERROR("Failed to start image prefetch thread\n");
+		for ( i=0; i<pf->n_slots; i++ ) {
+			image_data_arrays_free(pf->slots[i].ida);
+		}
+		pthread_mutex_destroy(&pf->lock);
+		pthread_cond_destroy(&pf->cond);
+		free(pf->slots);
+		free(pf);
+		return NULL;
+	}
+
+	return pf;
+}
+
+
+static void free_slot_strings(struct prefetch_slot *slot)
+{
+	free(slot->filename);
+	free(slot->event);
+	slot->filename = NULL;
+	slot->event = NULL;
+}
+
+
+/**
+ * \param pf: An \ref im_prefetch structure
+ *
+ * Stops the reader thread, waiting for it to finish reading the current image
+ * if necessary, and frees any images which were not taken.
+ */
+void im_prefetch_free(struct im_prefetch *pf)
+{
+	int i;
+
+	if ( pf == NULL ) return;
+
+	pthread_mutex_lock(&pf->lock);
+	pf->shutdown = 1;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
+	pthread_join(pf->thread, NULL);
+
+	for ( i=0; i<pf->n_slots; i++ ) {
+		image_free(pf->slots[i].image);
+		free_slot_strings(&pf->slots[i]);
+		image_data_arrays_free(pf->slots[i].ida);
+	}
+
+	pthread_mutex_destroy(&pf->lock);
+	pthread_cond_destroy(&pf->cond);
+	free(pf->slots);
+	free(pf);
+}
+
+
+/* The image from the last call to im_prefetch_get() has been freed by now, so
+ * its slot can be re-used.  Call with the lock held. */
+static void release_taken_slot(struct im_prefetch *pf)
+{
+	int prev = (pf->head + pf->n_slots - 1) % pf->n_slots;
+
+	if ( pf->slots[prev].state == SLOT_TAKEN ) {
+		free_slot_strings(&pf->slots[prev]);
+		pf->slots[prev].state = SLOT_FREE;
+	}
+}
+
+
+/**
+ * \param pf: An \ref im_prefetch structure
+ * \param filename: The filename of the image to read
+ * \param event: The event ID of the image to read
+ *
+ * Asks for an image to be read ahead.  This will not wait for space.  The
+ * image from the previous call to im_prefetch_get() must already have been
+ * freed, because its memory might now be re-used.
+ *
+ * \returns zero if the image will be read, or non-zero if too many images
+ * are already waiting.
+ */
+int im_prefetch_request(struct im_prefetch *pf, const char *filename,
+                        const char *event)
+{
+	struct prefetch_slot *slot;
+
+	pthread_mutex_lock(&pf->lock);
+	release_taken_slot(pf);
+
+	slot = &pf->slots[pf->tail];
+	if ( slot->state != SLOT_FREE ) {
+		pthread_mutex_unlock(&pf->lock);
+		return 1;
+	}
+
+	slot->filename = strdup(filename);
+	slot->event = safe_strdup(event);
+	slot->state = SLOT_QUEUED;
+	pf->tail = (pf->tail+1) % pf->n_slots;
+	pthread_cond_broadcast(&pf->cond);
+
+	pthread_mutex_unlock(&pf->lock);
+	return 0;
+}
+
+
+static int slot_matches(struct prefetch_slot *slot, const char *filename,
+                        const char *event)
+{
+	if ( strcmp(slot->filename, filename) != 0 ) return 0;
+	if ( (slot->event == NULL) || (event == NULL) ) {
+		return (slot->event == NULL) && (event == NULL);
+	}
+	return strcmp(slot->event, event) == 0;
+}
+
+
+/**
+ * \param pf: An \ref im_prefetch structure
+ * \param filename: The filename of the image
+ * \param event: The event ID of the image
+ *
+ * Gets the next image requested with im_prefetch_request(), waiting for it to
+ * be read if necessary.  The image from the previous call must already have
+ * been freed, because its memory will now be re-used.
+ *
+ * \returns the image, or NULL if it could not be read or was not requested.
+ * In that case, the caller should read the image itself.
+ */
+struct image *im_prefetch_get(struct im_prefetch *pf, const char *filename,
+                              const char *event)
+{
+	struct prefetch_slot *slot;
+	struct image *image;
+
+	pthread_mutex_lock(&pf->lock);
+	release_taken_slot(pf);
+
+	slot = &pf->slots[pf->head];
+	if ( (slot->state == SLOT_FREE) || (slot->state == SLOT_TAKEN)
+	  || !slot_matches(slot, filename, event) )
+	{
+		pthread_mutex_unlock(&pf->lock);
+		return NULL;
+	}
+
+	while ( slot->state == SLOT_QUEUED ) {
+		pthread_cond_wait(&pf->cond, &pf->lock);
+	}
+
+	image = slot->image;
+	slot->image = NULL;
+	slot->state = SLOT_TAKEN;
+	pf->head = (pf->head+1) % pf->n_slots;
+
+	pthread_mutex_unlock(&pf->lock);
+	return image;
+}
@@ -0,0 +1,46 @@
+/*
+ * im-prefetch.h
+ *
+ * Read images in a separate thread, ahead of processing
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IM_PREFETCH_H
+#define IM_PREFETCH_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "process_image.h"
+
+extern struct im_prefetch *im_prefetch_new(const struct index_args *iargs,
+                                           int depth);
+extern void im_prefetch_free(struct im_prefetch *pf);
+extern int im_prefetch_request(struct im_prefetch *pf, const char *filename,
+                               const char *event);
+extern struct image *im_prefetch_get(struct im_prefetch *pf,
+                                     const char *filename, const char *event);
+
+#endif /* IM_PREFETCH_H */
@@ -0,0 +1,182 @@
+/*
+ * im-reintegrate.c
+ *
+ * Take peaks and crystals from an existing stream, for re-integration
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* For --reintegrate, the main process indexes the old stream (the index is
+ * saved next to the stream, see stream_make_index()) and feeds the frames in
+ * it to the workers, in the same order.  Each worker opens the old stream for
+ * itself, and jumps straight to the chunk for each frame it gets.  The peaks
+ * and crystals from the chunk are moved into the freshly read image, so that
+ * only prediction and integration need to be done again. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <image.h>
+#include <stream.h>
+#include <utils.h>
+
+#include "im-reintegrate.h"
+
+
+struct im_reintegrate
+{
+	Stream *st;
+	StreamIndex *index;
+};
+
+
+/* Returns a temporary file containing the list of frames in the stream, in
+ * the format of the input list for indexamajig (-i) */
+FILE *im_reintegrate_event_list(const char *stream_filename)
+{
+	StreamIndex *index;
+	FILE *fh;
+	int i, n;
+	int n_frames = 0;
+
+	index = stream_make_index(stream_filename);
+	if ( index == NULL ) {
+		ERROR("Failed to index stream '%s'\n", stream_filename);
+		return NULL;
+	}
+
+	fh = tmpfile();
+	if ( fh == NULL ) {
+		ERROR("Failed to create list of frames for re-integration\n");
+		stream_index_free(index);
+		return NULL;
+	}
+
+	n = stream_index_num_chunks(index);
+	for ( i=0; i<n; i++ ) {
+		char *filename;
+		char *ev;
+		if ( stream_index_get_chunk(index, i, &filename, &ev) ) continue;
+		if ( ev != NULL ) {
+			fprintf(fh, "%s %s\n", filename, ev);
+		} else {
+			fprintf(fh, "%s\n", filename);
+		}
+		cffree(filename);
+		cffree(ev);
+		n_frames++;
+	}
+	stream_index_free(index);
+
+	if ( fflush(fh) || (fseek(fh, 0, SEEK_SET) != 0) ) {
+		ERROR("Failed to write list of frames for re-integration\n");
+		fclose(fh);
+		return NULL;
+	}
+
+	STATUS("Re-integrating %i frames from %s\n", n_frames, stream_filename);
+	return fh;
+}
+
+
+struct im_reintegrate *im_reintegrate_new(const char *stream_filename)
+{
+	struct im_reintegrate *ri;
+
+	ri = cfmalloc(sizeof(struct im_reintegrate));
+	if ( ri == NULL ) return NULL;
+
+	/* The main process already brought the saved index up to date, so
+	 * this just loads it */
+	ri->index = stream_make_index(stream_filename);
+	if ( ri->index == NULL ) {
+		ERROR("Failed to index stream '%s'\n", stream_filename);
+		cffree(ri);
+		return NULL;
+	}
+
+	ri->st = stream_open_for_read(stream_filename);
+	if ( ri->st == NULL ) {
+		ERROR("Failed to open stream '%s'\n", stream_filename);
+		stream_index_free(ri->index);
+		cffree(ri);
+		return NULL;
+	}
+
+	return ri;
+}
+
+
+void im_reintegrate_free(struct im_reintegrate *ri)
+{
+	if ( ri == NULL ) return;
+	stream_close(ri->st);
+	stream_index_free(ri->index);
+	cffree(ri);
+}
+
+
+/* Moves the peaks and crystals for 'image' from the old stream into 'image'.
+ * Any reflections in the old stream are not read.  Returns non-zero if the
+ * frame could not be found. */
+int im_reintegrate_take(struct im_reintegrate *ri, struct image *image)
+{
+	struct image *old;
+	int i;
+
+	if ( stream_select_chunk(ri->st, ri->index,
+	                         image->filename, image->ev) )
+	{
+		ERROR("Frame %s %s is not in the stream to re-integrate.\n",
+		      image->filename, image->ev);
+		return 1;
+	}
+
+	old = stream_read_chunk(ri->st, STREAM_PEAKS);
+	if ( old == NULL ) {
+		ERROR("Failed to read chunk for %s %s\n",
+		      image->filename, image->ev);
+		return 1;
+	}
+
+	image_feature_list_free(image->features);
+	image->features = old->features;
+	old->features = NULL;
+
+	free_all_crystals(image);
+	for ( i=0; i<old->n_crystals; i++ ) {
+		image_add_crystal(image, old->crystals[i].cr);
+		old->crystals[i].image_owns_crystal = 0;
+	}
+
+	image->indexed_by = old->indexed_by;
+	image->n_indexing_tries = old->n_indexing_tries;
+
+	image_free(old);
+	return 0;
+}
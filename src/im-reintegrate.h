@@ -0,0 +1,47 @@
+/*
+ * im-reintegrate.h
+ *
+ * Take peaks and crystals from an existing stream, for re-integration
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IM_REINTEGRATE_H
+#define IM_REINTEGRATE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+
+#include <image.h>
+
+struct im_reintegrate;
+
+extern FILE *im_reintegrate_event_list(const char *stream_filename);
+extern struct im_reintegrate *im_reintegrate_new(const char *stream_filename);
+extern void im_reintegrate_free(struct im_reintegrate *ri);
+extern int im_reintegrate_take(struct im_reintegrate *ri, struct image *image);
+
+#endif /* IM_REINTEGRATE_H */
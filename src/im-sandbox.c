@@ -54,6 +54,8 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
+#include <dirent.h>
 #include <assert.h>
 #include <sys/mman.h>
 #include <semaphore.h>
@@ -70,7 +72,24 @@
 #include "im-zmq.h"
 #include "profile.h"
 #include "im-asapo.h"
+#include "im-dispatch.h"
+#include "im-metrics.h"
+#include "im-tune.h"
+#include "im-benchmark.h"
+#include "im-zygote.h"
 #include "predict-refine.h"
+#include "event-list.h"
+#include "uthash.h"
+
+
+/* An event taken from the queue by a worker, which it hadn't started when
+ * its slot was needed or when the worker stopped */
+struct parked_event
+{
+	unsigned int pos;
+	int worker;
+	char *ev;
+};
 
 
 typedef struct
@@ -98,9 +117,12 @@ struct sandbox
 	int argc;
 	char **argv;
 	const char *probed_methods;
+	const char *fromfile_index;  /* Solution index made for the workers */
 
 	/* Worker processes */
 	int n_proc;
+	int min_proc;  /* If non-zero, vary the number of workers (autoscale) */
+	time_t t_last_scale;
 	pid_t *pids;
 	int *running;
 	time_t *last_response;
@@ -109,6 +131,13 @@ struct sandbox
 	int profile;  /* Whether to do wall-clock time profiling */
 	int cpu_pin;
 
+	/* If non-NULL, workers are forked without exec, and call this */
+	SandboxWorkerFunc worker_func;
+	void *worker_data;
+
+	/* If non-NULL, the workers are forked from here, not this process */
+	struct im_zygote *zygote;
+
 	/* Streams to read from (NB not the same indices as the above) */
 	PipeList *st_from_workers;
 	PipeList *mille_from_workers;
@@ -128,9 +157,80 @@ struct sandbox
 	/* If non-NULL, we are using ASAP::O */
 	struct im_asapo_params *asapo_params;
 
+	/* If non-NULL, events which are already in the stream (--resume) */
+	struct completed_events *completed;
+
+	/* If non-NULL, serve live statistics over HTTP */
+	struct im_metrics *metrics;
+
+	/* If non-NULL, write the same statistics to this file */
+	const char *status_file;
+	time_t t_last_status_file;
+	const char *trace_file;
+
+	struct im_tune *tune;
+
+	/* If non-NULL, events come from a dispatcher on another machine */
+	struct im_dispatch *dispatch;
+
+	/* Number of events to keep in the queue.  This is less than the
+	 * queue size when using a dispatcher, so that the other machines
+	 * can take the events instead if they're ready first. */
+	int queue_target;
+
+	/* Events taken back from workers which stopped before starting them,
+	 * to be put in the queue again before any new ones */
+	char **requeue;
+	int n_requeue;
+
+	/* Copies of events which workers have taken but not yet started, made
+	 * when their slots in the queue were needed for new events */
+	struct parked_event *parked;
+	int n_parked;
+	int max_parked;
+
 	/* Final output */
 	Stream *stream;
 	FILE *mille_fh;
+
+	/* If non-NULL, each worker writes its own Mille file, with a filename
+	 * starting with this, instead of sending the data to mille_fh */
+	const char *mille_prefix;
+	int n_mille_files;
+
+	/* If non-NULL, each worker writes its own stream shard, and the
+	 * shards are listed in the manifest */
+	const char *manifest_name;
+	FILE *manifest;
+	int n_shards;
+
+	/* For --benchmark: the same frames are fed round and round, and the
+	 * throughput is measured with 1, 2, 4... workers in turn, each time
+	 * after all of the workers have loaded the frames */
+	double benchmark_time;  /* Seconds per step, or zero */
+	char **bench_filenames;
+	char **bench_events;
+	int n_bench_frames;
+	int next_bench_frame;
+	int bench_n_workers;    /* Workers in the current step */
+	double bench_t_start;   /* Negative while the workers are loading */
+	int bench_n_start;      /* n_processed at bench_t_start */
+	int bench_n_steps;
+	int bench_workers[BENCHMARK_MAX_STEPS];
+	double bench_rate[BENCHMARK_MAX_STEPS];
+};
+
+struct completed_event
+{
+	char *key;
+	UT_hash_handle hh;
+};
+
+struct completed_events
+{
+	struct completed_event *hash;
+	int n;
+	int max_serial;
 };
 
 struct get_pattern_ctx
@@ -140,9 +240,9 @@ struct get_pattern_ctx
 	const DataTemplate *dtempl;
 	const char *prefix;
 	char *filename;
-	char **events;
-	int n_events;
-	int event_index;
+	ImageEventIter *events;
+	int binary;  /* -1 until the first read */
+	char *raw_filename;  /* Binary lists only, before prefix_filename() */
 };
 
 
@@ -155,6 +255,13 @@ time_t get_monotonic_seconds()
 	return tp.tv_sec;
 }
 
+double get_monotonic_time()
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+}
+
 #else
 
 /* Fallback version of the above.  The time according to gettimeofday() is not
@@ -167,6 +274,13 @@ time_t get_monotonic_seconds()
 	return tp.tv_sec;
 }
 
+double get_monotonic_time()
+{
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return tp.tv_sec + tp.tv_usec*1e-6;
+}
+
 #endif
 
 
@@ -216,6 +330,35 @@ static void check_hung_workers(struct sandbox *sb)
 }
 
 
+/* Applies --basename and --prefix to a filename from the input list */
+static char *prefix_filename(struct get_pattern_ctx *gpctx, char *line)
+{
+	if ( gpctx->use_basename ) {
+		char *tmp;
+		tmp = safe_basename(line);
+		free(line);
+		line = tmp;
+	}
+
+	/* Add prefix */
+	if ( gpctx->prefix != NULL ) {
+		char *tmp;
+		size_t len = strlen(line) + strlen(gpctx->prefix) + 1;
+		tmp = malloc(len);
+		if ( tmp == NULL ) {
+			ERROR("Couldn't allocate memory for filename\n");
+			return NULL;
+		}
+		strcpy(tmp, gpctx->prefix);
+		strcat(tmp, line);
+		free(line);
+		line = tmp;
+	}
+
+	return line;
+}
+
+
 static char *read_prefixed_filename(struct get_pattern_ctx *gpctx,
                                     char **event)
 {
@@ -252,29 +395,45 @@ static char *read_prefixed_filename(struct get_pattern_ctx *gpctx,
 		}
 	} /* else no spaces at all */
 
-	if ( gpctx->use_basename ) {
-		char *tmp;
-		tmp = safe_basename(line);
-		free(line);
-		line = tmp;
-	}
+	return prefix_filename(gpctx, line);
+}
 
-	/* Add prefix */
-	if ( gpctx->prefix != NULL ) {
-		char *tmp;
-		size_t len = strlen(line) + strlen(gpctx->prefix) + 1;
-		tmp = malloc(len);
-		if ( tmp == NULL ) {
-			ERROR("Couldn't allocate memory for filename\n");
-			return NULL;
+
+/* Binary event lists (see event-list.h) give the filename and event
+ * directly, without needing to look for the event ID in a line of text */
+static int get_pattern_binary(struct get_pattern_ctx *gpctx,
+                              char **pfilename, char **pevent)
+{
+	char *filename = gpctx->raw_filename;
+	char *evstr;
+	int r;
+
+	r = event_list_read(gpctx->fh, &filename, &evstr);
+
+	if ( filename != gpctx->raw_filename ) {
+		free(gpctx->raw_filename);
+		gpctx->raw_filename = filename;
+		free(gpctx->filename);
+		gpctx->filename = NULL;
+		if ( r == 1 ) {
+			gpctx->filename = prefix_filename(gpctx,
+			                                  strdup(filename));
+			if ( gpctx->filename == NULL ) r = -1;
 		}
-		strcpy(tmp, gpctx->prefix);
-		strcat(tmp, line);
-		free(line);
-		line = tmp;
 	}
 
-	return line;
+	if ( r != 1 ) {
+		if ( r < 0 ) ERROR("Input file read error.\n");
+		free(gpctx->raw_filename);
+		gpctx->raw_filename = NULL;
+		free(gpctx->filename);
+		gpctx->filename = NULL;
+		return 0;
+	}
+
+	*pfilename = gpctx->filename;
+	*pevent = evstr;
+	return 1;
 }
 
 
@@ -285,24 +444,38 @@ static int get_pattern(struct get_pattern_ctx *gpctx,
 	char *filename;
 	char *evstr;
 
+	if ( gpctx->binary == -1 ) {
+		gpctx->binary = event_list_is_binary(gpctx->fh);
+		if ( gpctx->binary == -1 ) {
+			ERROR("Input file is not a valid event list.\n");
+			gpctx->binary = 0;
+			return 0;
+		}
+	}
+	if ( gpctx->binary ) {
+		return get_pattern_binary(gpctx, pfilename, pevent);
+	}
+
 	/* Is an event available already? */
-	if ( (gpctx->events != NULL)
-	  && (gpctx->event_index < gpctx->n_events) )
-	{
-		*pfilename = gpctx->filename;
-		*pevent = gpctx->events[gpctx->event_index++];
-		return 1;
+	if ( gpctx->events != NULL ) {
+		evstr = image_event_iter_next(gpctx->events);
+		if ( evstr != NULL ) {
+			*pfilename = gpctx->filename;
+			*pevent = evstr;
+			return 1;
+		}
+		image_event_iter_free(gpctx->events);
+		gpctx->events = NULL;
 	}
 
 	do {
 
-		/* No events in list.  Time to top it up */
+		/* No events left.  Time to move on to the next file */
 		filename = read_prefixed_filename(gpctx, &evstr);
 
 		/* Nothing left in file -> we're done */
 		if ( filename == NULL ) {
 			free(gpctx->filename);
-			free(gpctx->events);
 			return 0;
 		}
 
@@ -316,26 +489,33 @@ static int get_pattern(struct get_pattern_ctx *gpctx,
 			return 1;
 		}
 
-		/* We got a filename, but no event.  Attempt to expand... */
-		free(gpctx->events);  /* Free the old list.
-		                       * NB The actual strings were freed
-		                       * by fill_queue */
-		gpctx->events = image_expand_frames(gpctx->dtempl, filename,
-		                                    &gpctx->n_events);
+		/* We got a filename, but no event.  Attempt to expand.
+		 * The events are generated one at a time, as the queue
+		 * needs them, so that huge files don't hold up the start
+		 * of processing. */
+		gpctx->events = image_event_iter_new(gpctx->dtempl, filename);
 		if ( gpctx->events == NULL ) {
 			ERROR("Failed to get event list from %s.\n",
 			      filename);
+			free(filename);
+			continue;
+		}
+
+		evstr = image_event_iter_next(gpctx->events);
+		if ( evstr == NULL ) {
+			image_event_iter_free(gpctx->events);
+			gpctx->events = NULL;
+			free(filename);
 		}
 
-	} while ( gpctx->events == NULL );
+	} while ( evstr == NULL );
 
 	/* Save filename for next time */
 	free(gpctx->filename);
 	gpctx->filename = filename;
 
-	gpctx->event_index = 0;
 	*pfilename = gpctx->filename;
-	*pevent = gpctx->events[gpctx->event_index++];
+	*pevent = evstr;
 	return 1;
 }
 
@@ -375,8 +555,7 @@ static size_t pump_chunk(void *buf, size_t len, struct sandbox *sb)
 	if ( endpos == NULL ) return 0;
 
 	chunk_len = (endpos-txt)+strlen(STREAM_CHUNK_END_MARKER"\n");
-	fwrite(buf, 1, chunk_len, stream_get_fh(sb->stream));
-	fflush(stream_get_fh(sb->stream));
+	stream_write_raw_chunk(sb->stream, buf, chunk_len);
 
 	return chunk_len;
 }
@@ -587,6 +766,149 @@ static void try_read(struct sandbox *sb)
 }
 
 
+/* Returns the filename for a new stream shard, and adds it to the manifest.
+ * A new shard is used every time a worker starts, in case the previous worker
+ * in the same slot left an incomplete chunk at the end of its shard. */
+static char *new_shard(struct sandbox *sb)
+{
+	char *filename;
+	const char *base;
+	size_t len;
+
+	if ( sb->manifest == NULL ) return NULL;
+
+	len = strlen(sb->manifest_name) + 32;
+	filename = malloc(len);
+	if ( filename == NULL ) return NULL;
+	snprintf(filename, len, "%s-shard%i", sb->manifest_name,
+	         sb->n_shards++);
+
+	/* The manifest gives the shard filenames relative to itself */
+	base = strrchr(filename, '/');
+	base = (base == NULL) ? filename : base+1;
+	fprintf(sb->manifest, "%s\n", base);
+	fflush(sb->manifest);
+
+	return filename;
+}
+
+
+/* Sets up where a new worker will send its Mille data.  This is normally a
+ * pipe to this process, but with mille_prefix it's a new file, for the same
+ * reason as new_shard().  In that case, mille_pipe[0] is -1. */
+static int open_mille_output(struct sandbox *sb, int mille_pipe[2])
+{
+	char *filename;
+	size_t len;
+	int fd;
+
+	if ( sb->mille_prefix == NULL ) return pipe(mille_pipe);
+
+	len = strlen(sb->mille_prefix) + 32;
+	filename = malloc(len);
+	if ( filename == NULL ) return -1;
+
+	/* Don't overwrite files from an earlier run (e.g. with --resume) */
+	do {
+		snprintf(filename, len, "%s-%i.bin", sb->mille_prefix,
+		         sb->n_mille_files++);
+		fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	} while ( (fd == -1) && (errno == EEXIST) );
+
+	if ( fd == -1 ) {
+		ERROR("Failed to create Mille file %s: %s\n", filename,
+		      strerror(errno));
+		free(filename);
+		return -1;
+	}
+
+	free(filename);
+	mille_pipe[0] = -1;
+	mille_pipe[1] = fd;
+	return 0;
+}
+
+
+static void worker_started(struct sandbox *sb, int slot, pid_t p,
+                           int stream_pipe[2], int mille_pipe[2])
+{
+	/* Parent process gets the 'write' end of the filename pipe
+	 * and the 'read' end of the result pipe. */
+	sb->pids[slot] = p;
+	sb->running[slot] = 1;
+	pthread_mutex_lock(&sb->shared->debug_lock);
+	stamp_response(sb, slot);
+	pthread_mutex_unlock(&sb->shared->debug_lock);
+	add_pipe(sb->st_from_workers, stream_pipe[0]);
+	if ( mille_pipe[0] == -1 ) {
+		close(mille_pipe[1]);
+	} else {
+		add_pipe(sb->mille_from_workers, mille_pipe[0]);
+	}
+	close(stream_pipe[1]);
+}
+
+
+/* Start a worker by forking without exec, so that the worker inherits all the
+ * setup already done by this process.  It's still a separate process, so a
+ * crash in an indexing program only takes down one worker. */
+static void start_forked_worker(struct sandbox *sb, int slot,
+                                int stream_pipe[2], int mille_pipe[2],
+                                const char *shard_file)
+{
+	pid_t p;
+
+	p = fork();
+	if ( p == -1 ) {
+		ERROR("fork() failed!\n");
+		return;
+	}
+
+	if ( p == 0 ) {
+
+		/* The signal handlers belong to the main process */
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGQUIT, SIG_DFL);
+		signal(SIGUSR1, SIG_DFL);
+
+		close(stream_pipe[0]);
+		if ( mille_pipe[0] != -1 ) close(mille_pipe[0]);
+
+		/* Use _exit(), so as not to flush the main process's
+		 * buffered output a second time */
+		_exit(sb->worker_func(sb->worker_data, slot, sb->shm_name,
+		                      sb->sem_name, sb->tmpdir,
+		                      stream_pipe[1], mille_pipe[1],
+		                      shard_file));
+	}
+
+	worker_started(sb, slot, p, stream_pipe, mille_pipe);
+}
+
+
+/* Start a worker by asking the fork server, which did the setup before this
+ * process started any threads.  Returns non-zero on failure. */
+static int start_zygote_worker(struct sandbox *sb, int slot,
+                               int stream_pipe[2], int mille_pipe[2],
+                               const char *shard_file)
+{
+	pid_t p;
+
+	p = im_zygote_spawn(sb->zygote, slot, sb->shm_name, sb->sem_name,
+	                    sb->tmpdir, stream_pipe[1], mille_pipe[1],
+	                    shard_file);
+	if ( p == -1 ) {
+		ERROR("Fork server failed to start worker %i.  Forking it from "
+		      "the main process instead.\n", slot);
+		return 1;
+	}
+
+	worker_started(sb, slot, p, stream_pipe, mille_pipe);
+	return 0;
+}
+
+
 static void start_worker_process(struct sandbox *sb, int slot)
 {
 	pid_t p;
@@ -597,9 +919,11 @@ static void start_worker_process(struct sandbox *sb, int slot)
 	int i;
 	char *tmpdir_copy;
 	char *methods_copy = NULL;
+	char *fromfile_copy = NULL;
 	char *worker_id;
 	char *fd_stream;
 	char *fd_mille;
+	char *shard_file;
 	char buf[1024];
 	const char *indexamajig = NULL;
 	size_t len;
@@ -609,8 +933,8 @@ static void start_worker_process(struct sandbox *sb, int slot)
 		return;
 	}
 
-	if ( pipe(mille_pipe) == - 1 ) {
-		ERROR("pipe() failed!\n");
+	if ( open_mille_output(sb, mille_pipe) == -1 ) {
+		ERROR("Failed to set up Mille output!\n");
 		return;
 	}
 
@@ -626,9 +950,27 @@ static void start_worker_process(struct sandbox *sb, int slot)
 
 	sb->warned_long_running[slot] = 0;
 
+	pthread_mutex_lock(&sb->shared->totals_lock);
+	sb->shared->retire[slot] = 0;
+	sb->shared->bench_ready[slot] = 0;
+	pthread_mutex_unlock(&sb->shared->totals_lock);
+
+	if ( sb->worker_func != NULL ) {
+		shard_file = new_shard(sb);
+		if ( (sb->zygote == NULL)
+		  || start_zygote_worker(sb, slot, stream_pipe, mille_pipe,
+		                         shard_file) )
+		{
+			start_forked_worker(sb, slot, stream_pipe, mille_pipe,
+			                    shard_file);
+		}
+		free(shard_file);
+		return;
+	}
+
 	/* Set up nargv including "new" args */
 	nargc = 0;
-	nargv = malloc((sb->argc+16)*sizeof(char *));
+	nargv = malloc((sb->argc+20)*sizeof(char *));
 	if ( nargv == NULL ) return;
 	for ( i=0; i<sb->argc; i++ ) {
 		nargv[nargc++] = sb->argv[i];
@@ -666,6 +1008,18 @@ static void start_worker_process(struct sandbox *sb, int slot)
 		nargv[nargc++] = "--indexing";
 		nargv[nargc++] = methods_copy;
 	}
+
+	if ( sb->fromfile_index != NULL ) {
+		fromfile_copy = strdup(sb->fromfile_index);
+		nargv[nargc++] = "--fromfile-input-file";
+		nargv[nargc++] = fromfile_copy;
+	}
+
+	shard_file = new_shard(sb);
+	if ( shard_file != NULL ) {
+		nargv[nargc++] = "--shard-file";
+		nargv[nargc++] = shard_file;
+	}
 	nargv[nargc++] = NULL;
 
 	len = readlink("/proc/self/exe", buf, 1024);
@@ -706,21 +1060,14 @@ static void start_worker_process(struct sandbox *sb, int slot)
 
 	free(tmpdir_copy);
 	free(methods_copy);
+	free(fromfile_copy);
 	free(worker_id);
 	free(fd_stream);
 	free(fd_mille);
+	free(shard_file);
 	free(nargv);
 
-	/* Parent process gets the 'write' end of the filename pipe
-	 * and the 'read' end of the result pipe. */
-	sb->pids[slot] = p;
-	sb->running[slot] = 1;
-	pthread_mutex_lock(&sb->shared->debug_lock);
-	stamp_response(sb, slot);
-	pthread_mutex_unlock(&sb->shared->debug_lock);
-	add_pipe(sb->st_from_workers, stream_pipe[0]);
-	add_pipe(sb->mille_from_workers, mille_pipe[0]);
-	close(stream_pipe[1]);
+	worker_started(sb, slot, p, stream_pipe, mille_pipe);
 }
 
 
@@ -734,67 +1081,486 @@ static int any_running(struct sandbox *sb)
 }
 
 
-static void handle_zombie(struct sandbox *sb, int respawn)
+/* When the workers are started by the fork server, this process is a "child
+ * subreaper" (see im-zygote.c), so helper programs (e.g. for indexing) left
+ * behind by crashed workers get re-parented to it.  Clear them up, without
+ * touching the workers. */
+static void reap_orphans(struct sandbox *sb)
 {
-	int i;
+	while ( 1 ) {
 
-	for ( i=0; i<sb->n_proc; i++ ) {
+		siginfo_t info;
+		int i;
 
-		int status, p;
+		info.si_pid = 0;
+		if ( waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) ) return;
+		if ( info.si_pid == 0 ) return;
 
-		if ( !sb->running[i] ) continue;
+		for ( i=0; i<sb->n_proc; i++ ) {
+			if ( sb->running[i] && (sb->pids[i] == info.si_pid) ) {
+				return;
+			}
+		}
+		waitpid(info.si_pid, NULL, WNOHANG);
+	}
+}
 
-		p = waitpid(sb->pids[i], &status, WNOHANG);
 
-		if ( p == -1 ) {
-			ERROR("waitpid(%i) failed: %s.\n", i, strerror(errno));
-			continue;
-		}
+/* The event queue is a ring buffer in the shared memory.  Only the main
+ * process adds events, but any number of workers can take them at the same
+ * time.  The state of each slot is a position in the queue and the number of
+ * the worker holding the slot, plus one (so zero means nobody):
+ *
+ *   (p, 0), p before tail:  event p is waiting to be taken
+ *   (p, 0), p equal to tail:  the slot is free for event p to be added
+ *   (p, n+1):  worker n has taken event p, but not started processing it
+ *
+ * A worker takes an event by changing its state from (p, 0) to (p, n+1) with
+ * a single compare-and-swap, so the queue says who has which events even if
+ * the worker dies straight afterwards.  When the worker starts processing the
+ * event, it records the position in queue_started and frees the slot for
+ * event p+QUEUE_SIZE.  If a worker stops, the main process puts the events it
+ * had taken but not started back in the queue (see reclaim_events()).
+ *
+ * The queue semaphore is posted once for each event added, which tells the
+ * workers when to look in the queue. */
 
-		if ( p == sb->pids[i] ) {
+#define SLOT_STATE(pos, owner) (((unsigned long long)(owner) << 32) | (pos))
+#define SLOT_POS(state) ((unsigned int)((state) & 0xffffffffULL))
+#define SLOT_OWNER(state) ((int)((state) >> 32))
 
-			sb->running[i] = 0;
 
-			if ( WIFEXITED(status) ) {
-				if ( WEXITSTATUS(status) != 0 ) {
-					STATUS("Worker %i returned error code %i\n",
-					       i, WEXITSTATUS(status));
-					STATUS("Shutting down.\n");
-					/* Error status from worker */
-					pthread_mutex_lock(&sb->shared->totals_lock);
-					sb->shared->should_shutdown = 1;
-					pthread_mutex_unlock(&sb->shared->totals_lock);
-				}
-				continue;
-			}
+/* Non-zero if queue position a comes after b, allowing for wrap-around */
+static int pos_after(unsigned int a, unsigned int b)
+{
+	return (int)(a - b) > 0;
+}
 
-			if ( WIFSIGNALED(status) ) {
 
-				if ( (WTERMSIG(status) == SIGINT)
-				  || (WTERMSIG(status) == SIGQUIT) ) continue;
+static void init_event_queue(struct sb_shm *shared)
+{
+	int i;
+	for ( i=0; i<QUEUE_SIZE; i++ ) {
+		atomic_init(&shared->queue_seq[i], SLOT_STATE(i, 0));
+	}
+	for ( i=0; i<MAX_NUM_WORKERS; i++ ) {
+		/* Just before the first event */
+		atomic_init(&shared->queue_started[i], (unsigned int)-1);
+	}
+	atomic_init(&shared->queue_head, 0);
+	atomic_init(&shared->queue_tail, 0);
+}
 
-				STATUS("Worker %i was killed by signal %i\n",
-				       i, WTERMSIG(status));
-				STATUS("Event ID was: %s\n",
-				       sb->shared->last_ev[i]);
-				STATUS("Task ID was: %s\n",
-				       sb->shared->last_task[i]);
-				if ( respawn ) start_worker_process(sb, i);
-			}
 
+/* Moves the head of the queue past the events which have been taken */
+static void advance_queue_head(struct sb_shm *shared)
+{
+	unsigned int head, tail, pos;
+
+	head = atomic_load_explicit(&shared->queue_head, memory_order_relaxed);
+	do {
+		tail = atomic_load_explicit(&shared->queue_tail,
+		                            memory_order_acquire);
+		pos = head;
+		while ( (pos != tail)
+		     && (atomic_load_explicit(&shared->queue_seq[pos % QUEUE_SIZE],
+		                              memory_order_acquire)
+		         != SLOT_STATE(pos, 0)) )
+		{
+			pos++;
 		}
+		if ( pos == head ) return;
+	} while ( !atomic_compare_exchange_weak_explicit(&shared->queue_head,
+	                                                 &head, pos,
+	                                                 memory_order_release,
+	                                                 memory_order_relaxed) );
+}
 
-	}
+
+static int event_queue_length(struct sb_shm *shared)
+{
+	unsigned int head = atomic_load(&shared->queue_head);
+	unsigned int tail = atomic_load(&shared->queue_tail);
+	return tail - head;
 }
 
 
-static int setup_shm(struct sandbox *sb)
+static void drop_started_parked_events(struct sandbox *sb)
 {
-	pthread_mutexattr_t attr;
-	char tmp[128];
-	int shm_fd;
+	int i = 0;
+
+	while ( i < sb->n_parked ) {
+		struct parked_event *pe = &sb->parked[i];
+		unsigned int started;
+		started = atomic_load_explicit(&sb->shared->queue_started[pe->worker],
+		                               memory_order_acquire);
+		if ( pos_after(pe->pos, started) ) {
+			i++;
+			continue;
+		}
+		free(pe->ev);
+		sb->parked[i] = sb->parked[--sb->n_parked];
+	}
+}
 
-	snprintf(tmp, 127, "/indexamajig.shm.%i", getpid());
+
+/* Main process only.  If the next slot is held by a worker which hasn't
+ * started the event yet, the event is copied out of the way, so that the
+ * slot can be re-used without waiting for the worker. */
+static int event_queue_has_space(struct sandbox *sb)
+{
+	struct sb_shm *shared = sb->shared;
+	unsigned int tail;
+	unsigned long long state;
+	struct parked_event *pe;
+
+	tail = atomic_load_explicit(&shared->queue_tail, memory_order_relaxed);
+	state = atomic_load_explicit(&shared->queue_seq[tail % QUEUE_SIZE],
+	                             memory_order_acquire);
+	if ( state == SLOT_STATE(tail, 0) ) return 1;
+	if ( SLOT_OWNER(state) == 0 ) return 0;  /* Queue is full */
+
+	drop_started_parked_events(sb);
+	if ( sb->n_parked == sb->max_parked ) {
+		struct parked_event *np;
+		int new_max = (sb->max_parked == 0) ? 64 : 2*sb->max_parked;
+		np = realloc(sb->parked, new_max*sizeof(struct parked_event));
+		if ( np == NULL ) return 0;
+		sb->parked = np;
+		sb->max_parked = new_max;
+	}
+
+	/* Only this process writes the slot, so the event can be copied
+	 * even if the worker starts it in the meantime */
+	pe = &sb->parked[sb->n_parked];
+	pe->pos = SLOT_POS(state);
+	pe->worker = SLOT_OWNER(state) - 1;
+	pe->ev = strdup(shared->queue[tail % QUEUE_SIZE]);
+	if ( pe->ev == NULL ) return 0;
+
+	if ( atomic_compare_exchange_strong_explicit(&shared->queue_seq[tail % QUEUE_SIZE],
+	                                             &state, SLOT_STATE(tail, 0),
+	                                             memory_order_acq_rel,
+	                                             memory_order_acquire) )
+	{
+		sb->n_parked++;
+		return 1;
+	}
+
+	/* The worker started the event and freed the slot */
+	free(pe->ev);
+	return state == SLOT_STATE(tail, 0);
+}
+
+
+/* Main process only, after checking event_queue_has_space() */
+static void add_event_line(struct sandbox *sb, const char *line)
+{
+	unsigned int tail;
+	char *slot;
+
+	tail = atomic_load_explicit(&sb->shared->queue_tail,
+	                            memory_order_relaxed);
+	slot = sb->shared->queue[tail % QUEUE_SIZE];
+	memset(slot, 0, MAX_EV_LEN);
+	snprintf(slot, MAX_EV_LEN, "%s", line);
+
+	atomic_store_explicit(&sb->shared->queue_tail, tail+1,
+	                      memory_order_release);
+	sem_post(sb->queue_sem);
+}
+
+
+static void add_event(struct sandbox *sb, const char *filename,
+                      const char *evstr, int serial)
+{
+	char line[MAX_EV_LEN];
+	snprintf(line, MAX_EV_LEN, "%s %s %i", filename, evstr, serial);
+	add_event_line(sb, line);
+}
+
+
+/* Puts the events taken back from stopped workers into the queue, before
+ * any new ones.  Main process only. */
+static void add_requeued_events(struct sandbox *sb)
+{
+	int i = 0;
+
+	while ( (i < sb->n_requeue) && event_queue_has_space(sb) ) {
+		add_event_line(sb, sb->requeue[i]);
+		free(sb->requeue[i]);
+		i++;
+	}
+	memmove(sb->requeue, sb->requeue+i, (sb->n_requeue-i)*sizeof(char *));
+	sb->n_requeue -= i;
+}
+
+
+static int compare_parked_events(const void *av, const void *bv)
+{
+	const struct parked_event *a = av;
+	const struct parked_event *b = bv;
+	if ( pos_after(a->pos, b->pos) ) return 1;
+	if ( pos_after(b->pos, a->pos) ) return -1;
+	return 0;
+}
+
+
+/* Takes back the events which worker n had taken from the queue, but not
+ * started, after the worker has stopped.  If 'requeue' is set, they are put
+ * back in the queue, otherwise they are reported as not processed.  The event
+ * which the worker had started is not included, since it might be the reason
+ * why the worker stopped.  Main process only. */
+static void reclaim_events(struct sandbox *sb, int n, int requeue)
+{
+	struct sb_shm *shared = sb->shared;
+	struct parked_event *evs;
+	int n_evs = 0;
+	unsigned int started;
+	int i;
+
+	evs = malloc((QUEUE_SIZE+sb->n_parked)*sizeof(struct parked_event));
+	if ( evs == NULL ) return;
+
+	started = atomic_load_explicit(&shared->queue_started[n],
+	                               memory_order_acquire);
+
+	for ( i=0; i<QUEUE_SIZE; i++ ) {
+		unsigned long long state;
+		unsigned int pos;
+		state = atomic_load_explicit(&shared->queue_seq[i],
+		                             memory_order_acquire);
+		if ( SLOT_OWNER(state) != n+1 ) continue;
+		pos = SLOT_POS(state);
+		if ( pos_after(pos, started) ) {
+			evs[n_evs].pos = pos;
+			evs[n_evs].ev = strdup(shared->queue[i]);
+			if ( evs[n_evs].ev != NULL ) n_evs++;
+		}
+		/* The worker is gone, so nothing else can change the slot */
+		atomic_store_explicit(&shared->queue_seq[i],
+		                      SLOT_STATE(pos+QUEUE_SIZE, 0),
+		                      memory_order_release);
+	}
+
+	i = 0;
+	while ( i < sb->n_parked ) {
+		if ( sb->parked[i].worker != n ) {
+			i++;
+			continue;
+		}
+		if ( pos_after(sb->parked[i].pos, started) ) {
+			evs[n_evs++] = sb->parked[i];
+		} else {
+			free(sb->parked[i].ev);
+		}
+		sb->parked[i] = sb->parked[--sb->n_parked];
+	}
+
+	/* In case the worker stopped while taking events */
+	advance_queue_head(shared);
+
+	qsort(evs, n_evs, sizeof(struct parked_event), compare_parked_events);
+
+	if ( (n_evs > 0) && requeue ) {
+		char **nr;
+		nr = realloc(sb->requeue, (sb->n_requeue+n_evs)*sizeof(char *));
+		if ( nr != NULL ) {
+			STATUS("Worker %i had taken %i more event%s, which will "
+			       "be put back in the queue.\n",
+			       n, n_evs, (n_evs == 1) ? "" : "s");
+			sb->requeue = nr;
+			for ( i=0; i<n_evs; i++ ) {
+				sb->requeue[sb->n_requeue++] = evs[i].ev;
+			}
+			n_evs = 0;
+		}
+	}
+
+	if ( (n_evs > 0) && !shared->should_shutdown ) {
+		STATUS("Worker %i had taken %i more event%s, which will not "
+		       "be processed:\n", n, n_evs, (n_evs == 1) ? "" : "s");
+		for ( i=0; i<n_evs; i++ ) {
+			STATUS("  %s\n", evs[i].ev);
+		}
+	}
+
+	for ( i=0; i<n_evs; i++ ) free(evs[i].ev);
+	free(evs);
+}
+
+
+/**
+ * Takes up to \p max events from the queue, and copies them to \p events,
+ * and their positions in the queue to \p pos.  The caller must already have
+ * waited on \p queue_sem once.  Fewer events are taken when the queue is
+ * getting short, so that the work is shared fairly between the workers, but
+ * not fewer than \p min unless there aren't that many in the queue.
+ *
+ * The events stay with worker \p worker_id until it calls start_event() for
+ * each of them.  If \p worker_id is negative, they are thrown away instead.
+ *
+ * Returns the number of events taken, which might be zero.
+ */
+int take_events(struct sb_shm *shared, sem_t *queue_sem, int worker_id,
+                char events[][MAX_EV_LEN], unsigned int *pos, int min, int max)
+{
+	unsigned int head, tail, p;
+	int n, i;
+	int n_taken = 0;
+
+	head = atomic_load_explicit(&shared->queue_head, memory_order_relaxed);
+	tail = atomic_load_explicit(&shared->queue_tail, memory_order_acquire);
+	if ( tail == head ) return 0;
+	n = (tail - head) / 16;
+	if ( n < min ) n = min;
+	if ( n > max ) n = max;
+	if ( n < 1 ) n = 1;
+
+	for ( p=head; (p != tail) && (n_taken < n); p++ ) {
+
+		atomic_ullong *state = &shared->queue_seq[p % QUEUE_SIZE];
+		unsigned long long expected = SLOT_STATE(p, 0);
+		unsigned long long taken;
+
+		if ( atomic_load_explicit(state, memory_order_acquire)
+		     != expected ) continue;
+
+		/* The slot isn't written while its state is (p, 0), so the
+		 * copy is good if the state is the same afterwards */
+		memcpy(events[n_taken], shared->queue[p % QUEUE_SIZE],
+		       MAX_EV_LEN);
+
+		if ( worker_id < 0 ) {
+			taken = SLOT_STATE(p+QUEUE_SIZE, 0);
+		} else {
+			taken = SLOT_STATE(p, worker_id+1);
+		}
+		if ( atomic_compare_exchange_strong_explicit(state, &expected,
+		                                             taken,
+		                                             memory_order_acq_rel,
+		                                             memory_order_relaxed) )
+		{
+			if ( pos != NULL ) pos[n_taken] = p;
+			n_taken++;
+		}
+	}
+
+	advance_queue_head(shared);
+
+	/* Account for the extra events in the semaphore, so that it doesn't
+	 * wake up other workers for nothing */
+	for ( i=1; i<n_taken; i++ ) {
+		if ( sem_trywait(queue_sem) != 0 ) break;
+	}
+
+	return n_taken;
+}
+
+
+/**
+ * Records that worker \p worker_id has started processing the event at
+ * position \p pos in the queue, which it got from take_events(), and frees
+ * the slot.
+ */
+void start_event(struct sb_shm *shared, int worker_id, unsigned int pos)
+{
+	unsigned long long expected = SLOT_STATE(pos, worker_id+1);
+
+	atomic_store_explicit(&shared->queue_started[worker_id], pos,
+	                      memory_order_release);
+
+	/* This fails if the main process already needed the slot, see
+	 * event_queue_has_space() */
+	atomic_compare_exchange_strong_explicit(&shared->queue_seq[pos % QUEUE_SIZE],
+	                                        &expected,
+	                                        SLOT_STATE(pos+QUEUE_SIZE, 0),
+	                                        memory_order_release,
+	                                        memory_order_relaxed);
+}
+
+
+static void handle_zombie(struct sandbox *sb, int respawn)
+{
+	int i;
+
+	for ( i=0; i<sb->n_proc; i++ ) {
+
+		int status, p;
+
+		if ( !sb->running[i] ) continue;
+
+		p = waitpid(sb->pids[i], &status, WNOHANG);
+
+		if ( p == -1 ) {
+			ERROR("waitpid(%i) failed: %s.\n", i, strerror(errno));
+			continue;
+		}
+
+		if ( p == sb->pids[i] ) {
+
+			sb->running[i] = 0;
+
+			if ( WIFEXITED(status) ) {
+				if ( WEXITSTATUS(status) != 0 ) {
+					STATUS("Worker %i returned error code %i\n",
+					       i, WEXITSTATUS(status));
+					STATUS("Shutting down.\n");
+					/* Error status from worker */
+					pthread_mutex_lock(&sb->shared->totals_lock);
+					sb->shared->should_shutdown = 1;
+					pthread_mutex_unlock(&sb->shared->totals_lock);
+				}
+				reclaim_events(sb, i, respawn);
+				continue;
+			}
+
+			if ( WIFSIGNALED(status) ) {
+
+				if ( (WTERMSIG(status) == SIGINT)
+				  || (WTERMSIG(status) == SIGQUIT) ) continue;
+
+				STATUS("Worker %i was killed by signal %i\n",
+				       i, WTERMSIG(status));
+				STATUS("Event ID was: %s\n",
+				       sb->shared->last_ev[i]);
+				STATUS("Task ID was: %s\n",
+				       sb->shared->last_task[i]);
+				reclaim_events(sb, i, respawn);
+				if ( respawn && !sb->shared->retire[i] ) {
+					start_worker_process(sb, i);
+				}
+			}
+
+		}
+
+	}
+
+	if ( sb->zygote != NULL ) reap_orphans(sb);
+}
+
+
+/* Explicit huge pages can't be used for POSIX shared memory (it would need to
+ * be on a hugetlbfs mount), but transparent huge pages can, if allowed by
+ * /sys/kernel/mm/transparent_hugepage/shmem_enabled.  This is done by the
+ * main process and by each worker, for their own mappings. */
+void advise_shm_huge_pages(struct sb_shm *shared, enum huge_pages hp)
+{
+#ifdef MADV_HUGEPAGE
+	if ( hp != HUGE_PAGES_NONE ) {
+		madvise(shared, sizeof(struct sb_shm), MADV_HUGEPAGE);
+	}
+#endif
+}
+
+
+static int setup_shm(struct sandbox *sb)
+{
+	pthread_mutexattr_t attr;
+	char tmp[128];
+	int shm_fd;
+
+	snprintf(tmp, 127, "/indexamajig.shm.%i", getpid());
 	shm_fd = shm_open(tmp, O_CREAT | O_EXCL | O_RDWR, 0600);
 	if ( shm_fd == -1 ) {
 		ERROR("SHM setup failed: %s\n", strerror(errno));
@@ -815,6 +1581,7 @@ static int setup_shm(struct sandbox *sb)
 		free(sb->shm_name);
 		return 1;
 	}
+	advise_shm_huge_pages(sb->shared, sb->iargs->huge_pages);
 
 	if ( pthread_mutexattr_init(&attr) ) {
 		ERROR("Failed to initialise mutex attr.\n");
@@ -865,18 +1632,282 @@ static int setup_shm(struct sandbox *sb)
 
 	pthread_mutexattr_destroy(&attr);
 
+	if ( recent_orientations_init(&sb->shared->recent, 1) ) {
+		ERROR("Recent orientations lock setup failed.\n");
+		pthread_mutex_destroy(&sb->shared->term_lock);
+		pthread_mutex_destroy(&sb->shared->queue_lock);
+		pthread_mutex_destroy(&sb->shared->debug_lock);
+		pthread_mutex_destroy(&sb->shared->totals_lock);
+		free(sb->shm_name);
+		return 1;
+	}
+
 	return 0;
 }
 
 
-/* Assumes the caller is already holding queue_lock! */
-static int fill_queue(struct get_pattern_ctx *gpctx, struct sandbox *sb)
+/**
+ * Returns non-zero if the queue is empty and no more events will be added.
+ */
+int event_queue_finished(struct sb_shm *shared)
+{
+	int no_more;
+
+	pthread_mutex_lock(&shared->queue_lock);
+	no_more = shared->no_more;
+	pthread_mutex_unlock(&shared->queue_lock);
+
+	/* no_more is set only after the last event has been added, so if the
+	 * queue is still empty now, it will stay that way. */
+	return no_more && (event_queue_length(shared) == 0);
+}
+
+
+static char *completed_key(const char *filename, const char *ev)
+{
+	char *key;
+	size_t len;
+
+	if ( ev == NULL ) ev = "//";
+	len = strlen(filename) + strlen(ev) + 2;
+	key = malloc(len);
+	if ( key == NULL ) return NULL;
+	snprintf(key, len, "%s %s", filename, ev);
+	return key;
+}
+
+
+static void add_completed_event(struct completed_events *ce,
+                                const char *filename, const char *ev)
+{
+	struct completed_event *item;
+	char *key = completed_key(filename, ev);
+
+	if ( key == NULL ) return;
+
+	HASH_FIND_STR(ce->hash, key, item);
+	if ( item != NULL ) {
+		free(key);
+		return;
+	}
+
+	item = malloc(sizeof(struct completed_event));
+	if ( item == NULL ) {
+		free(key);
+		return;
+	}
+	item->key = key;
+	HASH_ADD_KEYPTR(hh, ce->hash, item->key, strlen(item->key), item);
+	ce->n++;
+}
+
+
+/* Adds the events from all the complete chunks in fh, and returns the
+ * position just after the last complete chunk */
+static long int scan_completed_events(struct completed_events *ce, FILE *fh)
+{
+	char *line = NULL;
+	size_t len = 0;
+	char *filename = NULL;
+	char *ev = NULL;
+	int serial = 0;
+	long int good_end = -1;
+	long int pos;
+
+	do {
+
+		/* Whole lines, however long, so that a piece of a long filename
+		 * can't be mistaken for a marker */
+		pos = ftell(fh);
+		if ( getline(&line, &len, fh) == -1 ) break;
+		chomp(line);
+
+		if ( strcmp(line, STREAM_CHUNK_START_MARKER) == 0 ) {
+			/* Everything before the first chunk is headers */
+			if ( good_end < 0 ) good_end = pos;
+			free(filename);
+			free(ev);
+			filename = NULL;
+			ev = NULL;
+			serial = 0;
+		}
+
+		if ( strncmp(line, "Image filename: ", 16) == 0 ) {
+			free(filename);
+			filename = strdup(line+16);
+		}
+
+		if ( strncmp(line, "Event: ", 7) == 0 ) {
+			free(ev);
+			ev = strdup(line+7);
+		}
+
+		sscanf(line, "Image serial number: %i", &serial);
+
+		if ( strcmp(line, STREAM_CHUNK_END_MARKER) == 0 ) {
+			if ( filename != NULL ) {
+				add_completed_event(ce, filename, ev);
+				if ( serial > ce->max_serial ) {
+					ce->max_serial = serial;
+				}
+			}
+			good_end = ftell(fh);
+		}
+
+	} while ( 1 );
+
+	free(line);
+	free(filename);
+	free(ev);
+
+	/* No chunks at all */
+	if ( good_end < 0 ) good_end = ftell(fh);
+	return good_end;
+}
+
+
+/* Finds the events which have already been written to a stream or stream
+ * manifest, for resuming an interrupted run.  Nothing more is needed than the
+ * stream itself, because the chunks are written (and flushed) only when each
+ * event is completely finished.  If the last chunk is incomplete, the stream
+ * will be truncated to the end of the previous chunk, so that more chunks can
+ * be appended.  With a manifest, the shards are not truncated, because a new
+ * shard will be started for each worker anyway. */
+struct completed_events *read_completed_events(const char *filename)
+{
+	struct completed_events *ce;
+	char **shards;
+	int n_shards;
+	FILE *fh;
+
+	ce = malloc(sizeof(struct completed_events));
+	if ( ce == NULL ) return NULL;
+	ce->hash = NULL;
+	ce->n = 0;
+	ce->max_serial = 0;
+
+	shards = stream_manifest_shards(filename, &n_shards);
+	if ( shards != NULL ) {
+
+		int i;
+
+		for ( i=0; i<n_shards; i++ ) {
+			fh = fopen(shards[i], "r");
+			if ( fh == NULL ) continue;
+			scan_completed_events(ce, fh);
+			fclose(fh);
+			free(shards[i]);
+		}
+		free(shards);
+
+	} else {
+
+		long int good_end;
+
+		fh = fopen(filename, "r");
+		if ( fh == NULL ) {
+			ERROR("Failed to open '%s': %s\n", filename,
+			      strerror(errno));
+			free(ce);
+			return NULL;
+		}
+		good_end = scan_completed_events(ce, fh);
+		fclose(fh);
+
+		if ( truncate(filename, good_end) ) {
+			ERROR("Failed to truncate '%s': %s\n", filename,
+			      strerror(errno));
+			free_completed_events(ce);
+			return NULL;
+		}
+
+	}
+
+	return ce;
+}
+
+
+int n_completed_events(struct completed_events *ce)
 {
-	while ( sb->shared->n_events < QUEUE_SIZE ) {
+	return ce->n;
+}
+
 
+int completed_events_max_serial(struct completed_events *ce)
+{
+	return ce->max_serial;
+}
+
+
+static int is_completed_event(struct completed_events *ce,
+                              const char *filename, const char *ev)
+{
+	struct completed_event *item;
+	char *key;
+
+	if ( (ce == NULL) || (ce->n == 0) ) return 0;
+
+	key = completed_key(filename, ev);
+	if ( key == NULL ) return 0;
+	HASH_FIND_STR(ce->hash, key, item);
+	free(key);
+
+	return item != NULL;
+}
+
+
+void free_completed_events(struct completed_events *ce)
+{
+	struct completed_event *item;
+	struct completed_event *tmp;
+
+	if ( ce == NULL ) return;
+
+	HASH_ITER(hh, ce->hash, item, tmp) {
+		HASH_DEL(ce->hash, item);
+		free(item->key);
+		free(item);
+	}
+	free(ce);
+}
+
+
+static int fill_queue(struct get_pattern_ctx *gpctx, struct sandbox *sb)
+{
+	while ( event_queue_has_space(sb)
+	     && (event_queue_length(sb->shared) < sb->queue_target) )
+	{
 		char *filename;
 		char *evstr;
 
+		if ( sb->n_bench_frames > 0 ) {
+			add_event(sb, sb->bench_filenames[sb->next_bench_frame],
+			          sb->bench_events[sb->next_bench_frame],
+			          sb->serial++);
+			sb->next_bench_frame = (sb->next_bench_frame+1)
+			                     % sb->n_bench_frames;
+			continue;
+		}
+
+		if ( sb->dispatch != NULL ) {
+			int n_wanted;
+			int serial;
+			n_wanted = sb->queue_target - event_queue_length(sb->shared);
+			if ( !im_dispatch_next(sb->dispatch, n_wanted,
+			                       &filename, &evstr, &serial) )
+			{
+				return 1;
+			}
+			if ( !is_completed_event(sb->completed, filename,
+			                         evstr) )
+			{
+				add_event(sb, filename, evstr, serial);
+			}
+			free(filename);
+			free(evstr);
+			continue;
+		}
+
 		if ( sb->zmq_params != NULL ) {
 			/* These are just semi-meaningful placeholder values to
 			 * be put into the queue, instead of "(null)".
@@ -893,16 +1924,169 @@ static int fill_queue(struct get_pattern_ctx *gpctx, struct sandbox *sb)
 			snprintf(evstr, 64, "//%i", sb->serial);
 		} else {
 			if ( !get_pattern(gpctx, &filename, &evstr) ) return 1;
+			if ( is_completed_event(sb->completed, filename, evstr) ) {
+				free(evstr);
+				continue;
+			}
 		}
 
-		memset(sb->shared->queue[sb->shared->n_events], 0, MAX_EV_LEN);
-		snprintf(sb->shared->queue[sb->shared->n_events++], MAX_EV_LEN,
-		         "%s %s %i", filename, evstr, sb->serial++);
-		sem_post(sb->queue_sem);
+		add_event(sb, filename, evstr, sb->serial++);
 		free(evstr);
 
 	}
-	return 0;
+	return 0;
+}
+
+
+/* Reads the frames for --benchmark from the input list, and tells the workers
+ * about them.  The workers load them into memory, and fill_queue() sends them
+ * round and round */
+static int load_benchmark_frames(struct get_pattern_ctx *gpctx,
+                                 struct sandbox *sb)
+{
+	char *filename;
+	char *evstr;
+
+	sb->bench_filenames = malloc(BENCHMARK_MAX_FRAMES*sizeof(char *));
+	sb->bench_events = malloc(BENCHMARK_MAX_FRAMES*sizeof(char *));
+	if ( (sb->bench_filenames == NULL) || (sb->bench_events == NULL) ) {
+		return 1;
+	}
+
+	sb->n_bench_frames = 0;
+	while ( (sb->n_bench_frames < BENCHMARK_MAX_FRAMES)
+	     && get_pattern(gpctx, &filename, &evstr) )
+	{
+		sb->bench_filenames[sb->n_bench_frames] = strdup(filename);
+		sb->bench_events[sb->n_bench_frames] = evstr;
+		sb->n_bench_frames++;
+	}
+
+	if ( sb->n_bench_frames == 0 ) {
+		ERROR("No frames for benchmark\n");
+		return 1;
+	}
+
+	STATUS("Benchmark: using %i frames, held in memory by each worker.\n",
+	       sb->n_bench_frames);
+
+	return im_benchmark_write_events(sb->tmpdir, sb->bench_filenames,
+	                                 sb->bench_events, sb->n_bench_frames);
+}
+
+
+static void free_benchmark_frames(struct sandbox *sb)
+{
+	int i;
+	for ( i=0; i<sb->n_bench_frames; i++ ) {
+		free(sb->bench_filenames[i]);
+		free(sb->bench_events[i]);
+	}
+	free(sb->bench_filenames);
+	free(sb->bench_events);
+}
+
+
+/* Throws away everything in the queue, in the same way as a worker would take
+ * the events, so that the end of a benchmark run isn't held up */
+static void drain_queue(struct sandbox *sb)
+{
+	char events[QUEUE_BATCH_MAX][MAX_EV_LEN];
+
+	while ( sem_trywait(sb->queue_sem) == 0 ) {
+		take_events(sb->shared, sb->queue_sem, -1, events, NULL, 1,
+		            QUEUE_BATCH_MAX);
+	}
+}
+
+
+static int benchmark_workers_ready(struct sandbox *sb)
+{
+	int i;
+	int ready = 1;
+
+	pthread_mutex_lock(&sb->shared->totals_lock);
+	for ( i=0; i<sb->bench_n_workers; i++ ) {
+		if ( !sb->shared->bench_ready[i] ) ready = 0;
+	}
+	pthread_mutex_unlock(&sb->shared->totals_lock);
+
+	return ready;
+}
+
+
+static void benchmark_step(struct sandbox *sb)
+{
+	double tNow;
+	int n_processed;
+	int n_next;
+	int i;
+
+	if ( sb->benchmark_time == 0.0 ) return;
+	if ( sb->shared->no_more ) return;
+
+	if ( sb->bench_t_start < 0.0 ) {
+		if ( !benchmark_workers_ready(sb) ) return;
+		pthread_mutex_lock(&sb->shared->totals_lock);
+		sb->bench_n_start = sb->shared->n_processed;
+		pthread_mutex_unlock(&sb->shared->totals_lock);
+		sb->bench_t_start = get_monotonic_time();
+		STATUS("Benchmark: measuring with %i worker%s for %.0f "
+		       "seconds.\n", sb->bench_n_workers,
+		       (sb->bench_n_workers == 1) ? "" : "s",
+		       sb->benchmark_time);
+		return;
+	}
+
+	tNow = get_monotonic_time();
+	if ( tNow - sb->bench_t_start < sb->benchmark_time ) return;
+
+	pthread_mutex_lock(&sb->shared->totals_lock);
+	n_processed = sb->shared->n_processed;
+	pthread_mutex_unlock(&sb->shared->totals_lock);
+
+	sb->bench_workers[sb->bench_n_steps] = sb->bench_n_workers;
+	sb->bench_rate[sb->bench_n_steps] = (n_processed - sb->bench_n_start)
+	                                    / (tNow - sb->bench_t_start);
+	sb->bench_n_steps++;
+
+	if ( (sb->bench_n_workers == sb->n_proc)
+	  || (sb->bench_n_steps == BENCHMARK_MAX_STEPS) )
+	{
+		drain_queue(sb);
+		pthread_mutex_lock(&sb->shared->queue_lock);
+		sb->shared->no_more = 1;
+		pthread_mutex_unlock(&sb->shared->queue_lock);
+		return;
+	}
+
+	n_next = 2*sb->bench_n_workers;
+	if ( n_next > sb->n_proc ) n_next = sb->n_proc;
+	for ( i=sb->bench_n_workers; i<n_next; i++ ) {
+		start_worker_process(sb, i);
+	}
+	sb->bench_n_workers = n_next;
+	sb->bench_t_start = -1.0;
+}
+
+
+static void show_benchmark_results(struct sandbox *sb)
+{
+	int i;
+
+	if ( sb->bench_n_steps == 0 ) return;
+
+	STATUS("Benchmark results (%i frames, not including file reading):\n",
+	       sb->n_bench_frames);
+	STATUS("%8s %10s %12s %11s\n",
+	       "Workers", "Frames/s", "Per worker", "Efficiency");
+	for ( i=0; i<sb->bench_n_steps; i++ ) {
+		int nw = sb->bench_workers[i];
+		double per_worker = sb->bench_rate[i] / nw;
+		double eff = per_worker / sb->bench_rate[0];
+		STATUS("%8i %10.2f %12.2f %10.0f%%\n",
+		       nw, sb->bench_rate[i], per_worker, eff*100.0);
+	}
 }
 
 volatile sig_atomic_t at_zombies = 0;
@@ -950,6 +2134,278 @@ static void check_signals(struct sandbox *sb, int respawn)
 }
 
 
+/* Number of workers which are running and have not been asked to stop */
+static int n_active_workers(struct sandbox *sb)
+{
+	int i;
+	int n = 0;
+
+	pthread_mutex_lock(&sb->shared->totals_lock);
+	for ( i=0; i<sb->n_proc; i++ ) {
+		if ( sb->running[i] && !sb->shared->retire[i] ) n++;
+	}
+	pthread_mutex_unlock(&sb->shared->totals_lock);
+
+	return n;
+}
+
+
+/* Start more workers if all of them are busy and events are waiting, or stop
+ * one of them if it has been idle for a while */
+static void autoscale(struct sandbox *sb)
+{
+	int i;
+	int n_active;
+	int n_busy = 0;
+	int idle = -1;
+	time_t tNow;
+
+	if ( sb->min_proc == 0 ) return;
+	if ( sb->shared->no_more ) return;
+
+	tNow = get_monotonic_seconds();
+	if ( tNow - sb->t_last_scale < AUTOSCALE_INTERVAL ) return;
+	sb->t_last_scale = tNow;
+
+	n_active = n_active_workers(sb);
+
+	pthread_mutex_lock(&sb->shared->debug_lock);
+	for ( i=0; i<sb->n_proc; i++ ) {
+		if ( !sb->running[i] || sb->shared->retire[i] ) continue;
+		if ( sb->shared->busy[i] ) {
+			n_busy++;
+		} else if ( tNow - sb->shared->time_last_start[i]
+		            > AUTOSCALE_IDLE_TIME )
+		{
+			idle = i;
+		}
+	}
+	pthread_mutex_unlock(&sb->shared->debug_lock);
+
+	if ( (n_busy == n_active) && (n_active < sb->n_proc)
+	  && (event_queue_length(sb->shared) > 0) )
+	{
+		/* Grow by half again, to catch up quickly after a burst */
+		int n_new = (n_active+1)/2;
+		if ( n_active + n_new > sb->n_proc ) {
+			n_new = sb->n_proc - n_active;
+		}
+		STATUS("All %i workers are busy - starting %i more.\n",
+		       n_active, n_new);
+		for ( i=0; (i<sb->n_proc) && (n_new>0); i++ ) {
+			if ( sb->running[i] ) continue;
+			start_worker_process(sb, i);
+			n_new--;
+		}
+		return;
+	}
+
+	if ( (idle >= 0) && (n_active > sb->min_proc) ) {
+		STATUS("Worker %i has been idle for more than %i seconds - "
+		       "stopping it.\n", idle, AUTOSCALE_IDLE_TIME);
+		pthread_mutex_lock(&sb->shared->totals_lock);
+		sb->shared->retire[idle] = 1;
+		pthread_mutex_unlock(&sb->shared->totals_lock);
+		/* Wake it up, if it's waiting for an event */
+		sem_post(sb->queue_sem);
+	}
+}
+
+
+static void add_metric(char *buf, size_t max, size_t *ppos,
+                       const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	if ( *ppos >= max ) return;
+
+	va_start(ap, fmt);
+	r = vsnprintf(buf+*ppos, max-*ppos, fmt, ap);
+	va_end(ap);
+
+	if ( r > 0 ) *ppos += r;
+	if ( *ppos >= max ) {
+		/* Truncated - better to lose the last line completely */
+		char *nl = strrchr(buf, '\n');
+		if ( nl != NULL ) nl[1] = '\0';
+		*ppos = max;
+	}
+}
+
+
+static void add_metric_help(char *buf, size_t max, size_t *ppos,
+                            const char *name, const char *type,
+                            const char *help)
+{
+	add_metric(buf, max, ppos, "# HELP %s %s\n# TYPE %s %s\n",
+	           name, help, name, type);
+}
+
+
+/* Returns the current statistics, in Prometheus text format */
+static char *sandbox_metrics(void *vp)
+{
+	struct sandbox *sb = vp;
+	char *buf;
+	size_t max, pos = 0;
+	int n_processed, n_hits, n_hadcrystals, n_crystals, n_vetoed;
+	int i;
+	int n_running = 0;
+	time_t tNow = get_monotonic_seconds();
+
+	max = 4096 + sb->n_proc*(512+MAX_TASK_LEN);
+	buf = malloc(max);
+	if ( buf == NULL ) return NULL;
+	buf[0] = '\0';
+
+	pthread_mutex_lock(&sb->shared->totals_lock);
+	n_processed = sb->shared->n_processed;
+	n_hits = sb->shared->n_hits;
+	n_hadcrystals = sb->shared->n_hadcrystals;
+	n_crystals = sb->shared->n_crystals;
+	n_vetoed = sb->shared->n_vetoed;
+	pthread_mutex_unlock(&sb->shared->totals_lock);
+
+	for ( i=0; i<sb->n_proc; i++ ) {
+		if ( sb->running[i] ) n_running++;
+	}
+
+	add_metric_help(buf, max, &pos, "indexamajig_frames_processed_total",
+	                "counter", "Number of frames processed");
+	add_metric(buf, max, &pos, "indexamajig_frames_processed_total %i\n",
+	           n_processed);
+	add_metric_help(buf, max, &pos, "indexamajig_vetoed_total",
+	                "counter", "Number of frames rejected by the hit veto");
+	add_metric(buf, max, &pos, "indexamajig_vetoed_total %i\n", n_vetoed);
+	add_metric_help(buf, max, &pos, "indexamajig_hits_total",
+	                "counter", "Number of frames which were hits");
+	add_metric(buf, max, &pos, "indexamajig_hits_total %i\n", n_hits);
+	add_metric_help(buf, max, &pos, "indexamajig_indexable_total",
+	                "counter", "Number of frames with at least one crystal");
+	add_metric(buf, max, &pos, "indexamajig_indexable_total %i\n",
+	           n_hadcrystals);
+	add_metric_help(buf, max, &pos, "indexamajig_crystals_total",
+	                "counter", "Number of crystals found");
+	add_metric(buf, max, &pos, "indexamajig_crystals_total %i\n",
+	           n_crystals);
+	add_metric_help(buf, max, &pos, "indexamajig_queue_length",
+	                "gauge", "Number of events waiting for a worker");
+	add_metric(buf, max, &pos, "indexamajig_queue_length %i\n",
+	           event_queue_length(sb->shared));
+	add_metric_help(buf, max, &pos, "indexamajig_workers_running",
+	                "gauge", "Number of worker processes running");
+	add_metric(buf, max, &pos, "indexamajig_workers_running %i\n",
+	           n_running);
+
+	pthread_mutex_lock(&sb->shared->debug_lock);
+
+	add_metric_help(buf, max, &pos, "indexamajig_worker_busy", "gauge",
+	                "Whether the worker is processing a frame");
+	for ( i=0; i<sb->n_proc; i++ ) {
+		if ( !sb->running[i] ) continue;
+		add_metric(buf, max, &pos,
+		           "indexamajig_worker_busy{worker=\"%i\"} %i\n",
+		           i, sb->shared->busy[i]);
+	}
+
+	add_metric_help(buf, max, &pos, "indexamajig_worker_frame_seconds",
+	                "gauge", "Time since the worker started its current "
+	                "or last frame");
+	for ( i=0; i<sb->n_proc; i++ ) {
+		if ( !sb->running[i] ) continue;
+		add_metric(buf, max, &pos,
+		           "indexamajig_worker_frame_seconds{worker=\"%i\"} "
+		           "%lli\n", i,
+		           (long long)(tNow - sb->shared->time_last_start[i]));
+	}
+
+	add_metric_help(buf, max, &pos, "indexamajig_worker_response_seconds",
+	                "gauge", "Time since the worker last responded");
+	for ( i=0; i<sb->n_proc; i++ ) {
+		if ( !sb->running[i] ) continue;
+		add_metric(buf, max, &pos,
+		           "indexamajig_worker_response_seconds{worker=\"%i\"} "
+		           "%lli\n", i,
+		           (long long)(tNow - sb->last_response[i]));
+	}
+
+	add_metric_help(buf, max, &pos,
+	                "indexamajig_worker_processing_seconds_total",
+	                "counter", "Total time spent processing frames");
+	for ( i=0; i<sb->n_proc; i++ ) {
+		add_metric(buf, max, &pos,
+		           "indexamajig_worker_processing_seconds_total"
+		           "{worker=\"%i\"} %.3f\n",
+		           i, sb->shared->time_processing[i]);
+	}
+
+	add_metric_help(buf, max, &pos, "indexamajig_worker_task", "gauge",
+	                "The current task of the worker (always 1)");
+	for ( i=0; i<sb->n_proc; i++ ) {
+		/* The task names never contain quotes or backslashes */
+		if ( !sb->running[i] ) continue;
+		add_metric(buf, max, &pos,
+		           "indexamajig_worker_task{worker=\"%i\",task=\"%s\"} 1\n",
+		           i, sb->shared->last_task[i]);
+	}
+
+	pthread_mutex_unlock(&sb->shared->debug_lock);
+
+	return buf;
+}
+
+
+/* Replace the status file with the current statistics.  The new contents are
+ * written to a temporary file which is then renamed, so that readers never
+ * see a partially written file. */
+static void write_status_file(struct sandbox *sb, int final)
+{
+	char *buf;
+	char *tmp;
+	FILE *fh;
+	time_t tNow;
+
+	if ( sb->status_file == NULL ) return;
+
+	tNow = get_monotonic_seconds();
+	if ( !final && (tNow == sb->t_last_status_file) ) return;
+	sb->t_last_status_file = tNow;
+
+	buf = sandbox_metrics(sb);
+	if ( buf == NULL ) return;
+
+	tmp = malloc(strlen(sb->status_file)+5);
+	if ( tmp == NULL ) {
+		free(buf);
+		return;
+	}
+	strcpy(tmp, sb->status_file);
+	strcat(tmp, ".tmp");
+
+	fh = fopen(tmp, "w");
+	if ( fh == NULL ) {
+		ERROR("Failed to write status file %s\n", tmp);
+		sb->status_file = NULL;
+		free(tmp);
+		free(buf);
+		return;
+	}
+	fputs(buf, fh);
+	fprintf(fh, "# HELP indexamajig_finished Whether all frames have "
+	            "been processed\n");
+	fprintf(fh, "# TYPE indexamajig_finished gauge\n");
+	fprintf(fh, "indexamajig_finished %i\n", final);
+	if ( (fclose(fh) != 0) || (rename(tmp, sb->status_file) != 0) ) {
+		ERROR("Failed to update status file %s\n", sb->status_file);
+		sb->status_file = NULL;
+	}
+
+	free(tmp);
+	free(buf);
+}
+
+
 static void try_status(struct sandbox *sb, int final)
 {
 	int r;
@@ -958,6 +2414,7 @@ static void try_status(struct sandbox *sb, int final)
 	time_t time_this;
 	const char *finalstr;
 	char persec[64];
+	char vetostr[64];
 
 	tNow = get_monotonic_seconds();
 	time_this = tNow - sb->t_last_stats;
@@ -978,10 +2435,17 @@ static void try_status(struct sandbox *sb, int final)
 		snprintf(persec, 64, ", %.1f images/sec",
 		         (double)n_proc_this/time_this);
 	}
-	STATUS("%s%i images processed, %i hits (%.1f%%), "
+	if ( sb->iargs->veto ) {
+		snprintf(vetostr, 64, " (%i vetoed, %.1f%%)",
+		         sb->shared->n_vetoed,
+		         100.0 * sb->shared->n_vetoed / sb->shared->n_processed);
+	} else {
+		vetostr[0] = '\0';
+	}
+	STATUS("%s%i images processed%s, %i hits (%.1f%%), "
 	       "%i indexable (%.1f%% of hits, %.1f%% overall), "
 	       "%i crystals%s.\n",
-	       finalstr, sb->shared->n_processed,
+	       finalstr, sb->shared->n_processed, vetostr,
 	       sb->shared->n_hits,
 	       100.0 * sb->shared->n_hits / sb->shared->n_processed,
 	       sb->shared->n_hadcrystals,
@@ -996,12 +2460,184 @@ static void try_status(struct sandbox *sb, int final)
 }
 
 
+/* Filesystem type for tmpfs, from linux/magic.h */
+#define IM_TMPFS_MAGIC (0x01021994)
+
+/* Where to put the temporary folder for --temp-in-memory */
+#define IM_MEMORY_TEMP_LOCATION "/dev/shm"
+
+
+static int is_in_memory(const char *path)
+{
+	struct statfs fs;
+	if ( statfs(path, &fs) ) return 0;
+	return fs.f_type == IM_TMPFS_MAGIC;
+}
+
+
+/* Delete all the files in a worker folder.  Only for folders in memory,
+ * where anything left over would take up memory until the next reboot. */
+static void delete_all_files(const char *workerdir)
+{
+	DIR *d;
+	struct dirent *dent;
+
+	d = opendir(workerdir);
+	if ( d == NULL ) return;
+
+	while ( (dent = readdir(d)) != NULL ) {
+
+		char *path;
+		size_t pathlen;
+		struct stat s;
+
+		pathlen = strlen(workerdir) + strlen(dent->d_name) + 2;
+		path = malloc(pathlen);
+		if ( path == NULL ) break;
+		snprintf(path, pathlen, "%s/%s", workerdir, dent->d_name);
+
+		if ( (lstat(path, &s) == 0) && S_ISREG(s.st_mode) ) {
+			unlink(path);
+		}
+		free(path);
+
+	}
+
+	closedir(d);
+}
+
+
+/* Combine and display the timings written by each worker process at the end
+ * of its run (see write_worker_profile() in indexamajig.c) */
+static void show_worker_profiles(const char *tmpdir, int n_proc)
+{
+	int slot;
+	int n_read = 0;
+	ProfileSummary *ps;
+
+	ps = profile_summary_new();
+	if ( ps == NULL ) return;
+
+	for ( slot=0; slot<n_proc; slot++ ) {
+
+		char workerdir[1024];
+		DIR *d;
+		struct dirent *dent;
+
+		snprintf(workerdir, 1024, "%s/worker.%i", tmpdir, slot);
+		d = opendir(workerdir);
+		if ( d == NULL ) continue;
+
+		while ( (dent = readdir(d)) != NULL ) {
+
+			char path[1280];
+			FILE *fh;
+
+			if ( strncmp(dent->d_name, "profile.", 8) != 0 ) continue;
+
+			snprintf(path, 1280, "%s/%s", workerdir, dent->d_name);
+			fh = fopen(path, "r");
+			if ( fh == NULL ) continue;
+			if ( profile_summary_read(ps, fh) ) {
+				ERROR("Failed to read timing data from %s\n",
+				      path);
+			} else {
+				n_read++;
+			}
+			fclose(fh);
+			unlink(path);
+
+		}
+
+		closedir(d);
+
+	}
+
+	if ( n_read > 0 ) {
+		STATUS("Timing data from %i worker processes:\n", n_read);
+		profile_summary_print(ps, stderr);
+	}
+	profile_summary_free(ps);
+}
+
+
+static void append_file(FILE *out, const char *path)
+{
+	FILE *fh;
+	char buf[65536];
+	size_t n;
+
+	fh = fopen(path, "r");
+	if ( fh == NULL ) return;
+	while ( (n = fread(buf, 1, sizeof(buf), fh)) > 0 ) {
+		fwrite(buf, 1, n, out);
+	}
+	fclose(fh);
+}
+
+
+/* Join the trace files from the sandbox and each worker process into one
+ * file in the Chrome JSON format */
+static void write_trace(const char *tmpdir, int n_proc, const char *filename)
+{
+	int slot;
+	FILE *fh;
+	char path[1280];
+
+	fh = fopen(filename, "w");
+	if ( fh == NULL ) {
+		ERROR("Failed to open trace file %s: %s\n", filename,
+		      strerror(errno));
+	} else {
+		fprintf(fh, "[\n");
+	}
+
+	snprintf(path, 1280, "%s/trace.sandbox", tmpdir);
+	if ( fh != NULL ) append_file(fh, path);
+	unlink(path);
+
+	for ( slot=0; slot<n_proc; slot++ ) {
+
+		char workerdir[1024];
+		DIR *d;
+		struct dirent *dent;
+
+		snprintf(workerdir, 1024, "%s/worker.%i", tmpdir, slot);
+		d = opendir(workerdir);
+		if ( d == NULL ) continue;
+
+		while ( (dent = readdir(d)) != NULL ) {
+			if ( strncmp(dent->d_name, "trace.", 6) != 0 ) continue;
+			snprintf(path, 1280, "%s/%s", workerdir, dent->d_name);
+			if ( fh != NULL ) append_file(fh, path);
+			unlink(path);
+		}
+
+		closedir(d);
+
+	}
+
+	if ( fh == NULL ) return;
+
+	/* Every record so far was followed by a comma.  Finish with one more,
+	 * to put the sandbox at the top of the display. */
+	fprintf(fh, "{\"name\":\"process_sort_index\",\"ph\":\"M\","
+	        "\"pid\":0,\"tid\":0,\"args\":{\"sort_index\":-1}}\n]\n");
+	if ( fclose(fh) ) {
+		ERROR("Failed to write trace file %s\n", filename);
+	} else {
+		STATUS("Wrote trace to %s\n", filename);
+	}
+}
+
+
 static void delete_temporary_folder(const char *tmpdir, int n_proc)
 {
 	int slot;
 	size_t len, pathlen, workerdirlen;
 	char *workerdir;
 	char *path;
+	int in_memory;
 
 	/* List of files which it's safe to delete */
 	char *files[] = {"gmon.out", "mosflm.lp", "SUMMARY", "XDS.INP",
@@ -1022,10 +2658,16 @@ static void delete_temporary_folder(const char *tmpdir, int n_proc)
 
 	if ( (workerdir == NULL) || (path == NULL) ) return;
 
+	in_memory = is_in_memory(tmpdir);
+
 	snprintf(path, pathlen, "%s/mosflm.lp", tmpdir);
 	unlink(path);
 	snprintf(path, pathlen, "%s/SUMMARY", tmpdir);
 	unlink(path);
+	snprintf(path, pathlen, "%s/fromfile-index", tmpdir);
+	unlink(path);
+	snprintf(path, pathlen, "%s/benchmark-events", tmpdir);
+	unlink(path);
 
 	for ( slot=0; slot<n_proc; slot++ ) {
 
@@ -1039,6 +2681,7 @@ static void delete_temporary_folder(const char *tmpdir, int n_proc)
 			snprintf(path, pathlen, "%s/%s", workerdir, files[i]);
 			unlink(path);
 		}
+		if ( in_memory ) delete_all_files(workerdir);
 
 		if ( rmdir(workerdir) ) {
 			ERROR("Failed to delete worker temporary folder: %s\n",
@@ -1056,12 +2699,22 @@ static void delete_temporary_folder(const char *tmpdir, int n_proc)
 }
 
 
-char *create_tempdir(const char *temp_location)
+char *create_tempdir(const char *temp_location, int in_memory)
 {
 	char *tmpdir;
 	size_t ll;
 	struct stat s;
 
+	if ( in_memory ) {
+		if ( is_in_memory(IM_MEMORY_TEMP_LOCATION) ) {
+			temp_location = IM_MEMORY_TEMP_LOCATION;
+		} else {
+			ERROR("WARNING: %s is not an in-memory filesystem.  "
+			      "The temporary folder will not be in memory.\n",
+			      IM_MEMORY_TEMP_LOCATION);
+		}
+	}
+
 	if ( temp_location == NULL ) {
 		temp_location = "";
 	}
@@ -1096,11 +2749,50 @@ char *create_tempdir(const char *temp_location)
 }
 
 
+static int get_event_for_dispatch(void *vp, char **pfilename, char **pevent)
+{
+	char *filename;
+	char *evstr;
+
+	if ( !get_pattern(vp, &filename, &evstr) ) return 0;
+
+	/* The filename belongs to the get_pattern_ctx */
+	*pfilename = strdup(filename);
+	*pevent = evstr;
+	return 1;
+}
+
+
+/* Hands out the events from the input list to indexamajig instances on other
+ * machines (see --dispatch-from), instead of processing them here */
+int serve_events(const DataTemplate *dtempl, FILE *fh, char *prefix,
+                 int config_basename, int serial_start, const char *port)
+{
+	struct get_pattern_ctx gpctx;
+	int r;
+
+	gpctx.fh = fh;
+	gpctx.use_basename = config_basename;
+	gpctx.dtempl = dtempl;
+	gpctx.prefix = prefix;
+	gpctx.filename = NULL;
+	gpctx.events = NULL;
+	gpctx.binary = -1;
+	gpctx.raw_filename = NULL;
+
+	r = im_dispatch_serve(port, serial_start, get_event_for_dispatch,
+	                      &gpctx);
+	fclose(fh);
+	return r;
+}
+
+
 /* Call under queue_lock */
 static int all_got_end_of_stream(struct sandbox *sb)
 {
 	int i;
 	for ( i=0; i<sb->n_proc; i++ ) {
+		if ( sb->shared->retire[i] ) continue;
 		if ( !sb->shared->end_of_stream[i] ) return 0;
 	}
 	return 1;
@@ -1108,15 +2800,26 @@ static int all_got_end_of_stream(struct sandbox *sb)
 
 
 /* Returns the number of frames processed (not necessarily indexed).
- * If the return value is zero, something is probably wrong. */
-int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
-                   int config_basename, FILE *fh,
+ * If the return value is zero, something is probably wrong.
+ * If min_proc is non-zero, the number of workers will be varied between
+ * min_proc and n_proc according to the load. */
+int create_sandbox(struct index_args *iargs, int n_proc, int min_proc,
+                   char *prefix, int config_basename, FILE *fh,
                    Stream *stream, const char *tmpdir, int serial_start,
                    struct im_zmq_params *zmq_params,
                    struct im_asapo_params *asapo_params,
                    int timeout, int profile, int cpu_pin,
                    int no_data_timeout, int argc, char *argv[],
-                   const char *probed_methods, FILE *mille_fh)
+                   const char *probed_methods, FILE *mille_fh,
+                   SandboxWorkerFunc worker_func, void *worker_data,
+                   struct im_zygote *zygote,
+                   const char *manifest_name, const char *dispatch_addr,
+                   struct completed_events *completed,
+                   const char *metrics_port, const char *status_file,
+                   const char *trace_file,
+                   const struct im_tune_params *tune_params,
+                   const char *mille_prefix, double benchmark_time,
+                   const char *fromfile_index)
 {
 	int i;
 	struct sandbox *sb;
@@ -1126,12 +2829,14 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 	int allDone = 0;
 	struct get_pattern_ctx gpctx;
 	time_t t_last_data;
+	int n_start;
 
 	if ( n_proc > MAX_NUM_WORKERS ) {
 		ERROR("Number of workers (%i) is too large.  Using %i\n",
 		      n_proc, MAX_NUM_WORKERS);
 		n_proc = MAX_NUM_WORKERS;
 	}
+	if ( min_proc > n_proc ) min_proc = n_proc;
 
 	#ifdef HAVE_SCHED_SETAFFINITY
 	int n_cpus = get_nprocs();
@@ -1160,6 +2865,8 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 	sb->n_processed_last_stats = 0;
 	sb->t_last_stats = get_monotonic_seconds();
 	sb->n_proc = n_proc;
+	sb->min_proc = min_proc;
+	sb->t_last_scale = get_monotonic_seconds();
 	sb->iargs = iargs;
 	sb->serial = serial_start;
 	sb->tmpdir = tmpdir;
@@ -1168,9 +2875,57 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 	sb->argc = argc;
 	sb->argv = argv;
 	sb->probed_methods = probed_methods;
+	sb->fromfile_index = fromfile_index;
+	sb->worker_func = worker_func;
+	sb->worker_data = worker_data;
+	sb->zygote = zygote;
 	sb->mille_fh = mille_fh;
+	sb->mille_prefix = mille_prefix;
+	sb->n_mille_files = 0;
+	sb->manifest_name = manifest_name;
+	sb->manifest = NULL;
+	sb->n_shards = 0;
+	sb->completed = completed;
+	sb->benchmark_time = benchmark_time;
+	sb->n_bench_frames = 0;
+	sb->next_bench_frame = 0;
+	sb->bench_n_steps = 0;
+	sb->bench_t_start = -1.0;
+
+	if ( (manifest_name != NULL) && (completed != NULL) ) {
+
+		/* Resuming: add more shards to the existing manifest */
+		char **shards = stream_manifest_shards(manifest_name,
+		                                       &sb->n_shards);
+		if ( shards == NULL ) {
+			ERROR("'%s' is not a stream manifest\n", manifest_name);
+			free(sb);
+			return 0;
+		}
+		for ( i=0; i<sb->n_shards; i++ ) free(shards[i]);
+		free(shards);
+
+		sb->manifest = fopen(manifest_name, "a");
+		if ( sb->manifest == NULL ) {
+			ERROR("Failed to open stream manifest '%s'\n",
+			      manifest_name);
+			free(sb);
+			return 0;
+		}
+
+	} else if ( manifest_name != NULL ) {
+		sb->manifest = fopen(manifest_name, "w");
+		if ( sb->manifest == NULL ) {
+			ERROR("Failed to open stream manifest '%s'\n",
+			      manifest_name);
+			free(sb);
+			return 0;
+		}
+		fprintf(sb->manifest, STREAM_MANIFEST_MARKER"\n");
+		fflush(sb->manifest);
+	}
 
-	if ( zmq_params->addr != NULL ) {
+	if ( zmq_params->n_addrs > 0 ) {
 		sb->zmq_params = zmq_params;
 	} else {
 		sb->zmq_params = NULL;
@@ -1188,6 +2943,35 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 		return 0;
 	}
 
+	sb->metrics = NULL;
+	if ( metrics_port != NULL ) {
+		sb->metrics = im_metrics_listen(metrics_port);
+		if ( sb->metrics == NULL ) {
+			free(sb);
+			return 0;
+		}
+	}
+
+	sb->status_file = status_file;
+	sb->trace_file = trace_file;
+	sb->t_last_status_file = 0;
+
+	sb->queue_target = QUEUE_SIZE;
+	sb->dispatch = NULL;
+	if ( dispatch_addr != NULL ) {
+		sb->dispatch = im_dispatch_connect(dispatch_addr);
+		if ( sb->dispatch == NULL ) {
+			im_metrics_shutdown(sb->metrics);
+			free(sb);
+			return 0;
+		}
+		/* Enough to keep the workers busy while waiting for more */
+		sb->queue_target = 2*n_proc;
+		if ( sb->queue_target > QUEUE_SIZE ) {
+			sb->queue_target = QUEUE_SIZE;
+		}
+	}
+
 	sb->st_from_workers = pipe_list_new();
 	sb->mille_from_workers = pipe_list_new();
 	sb->stream = stream;
@@ -1198,7 +2982,8 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 	gpctx.prefix = prefix;
 	gpctx.filename = NULL;
 	gpctx.events = NULL;
-	gpctx.event_index = 0;
+	gpctx.binary = -1;
+	gpctx.raw_filename = NULL;
 
 	if ( setup_shm(sb) ) {
 		ERROR("Failed to set up SHM.\n");
@@ -1209,9 +2994,34 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 	sb->shared->n_processed = 0;
 	sb->shared->n_hits = 0;
 	sb->shared->n_hadcrystals = 0;
+	sb->shared->n_vetoed = 0;
 	sb->shared->n_crystals = 0;
 	sb->shared->should_shutdown = 0;
 
+	sb->tune = NULL;
+	if ( tune_params->order || tune_params->threshold
+	  || tune_params->min_snr )
+	{
+		sb->tune = im_tune_new(tune_params, sb->shared, iargs);
+		if ( sb->tune == NULL ) {
+			ERROR("Failed to set up online tuning\n");
+			free(sb);
+			return 0;
+		}
+	}
+
+	/* With autoscaling, start with the minimum number of workers.  The
+	 * other slots are marked as retired until they are needed. */
+	n_start = (min_proc > 0) ? min_proc : n_proc;
+	if ( benchmark_time > 0.0 ) n_start = 1;
+	sb->bench_n_workers = n_start;
+	for ( i=0; i<n_proc; i++ ) {
+		sb->shared->retire[i] = (i >= n_start);
+		sb->shared->bench_ready[i] = 0;
+		sb->shared->busy[i] = 0;
+		sb->shared->time_processing[i] = 0.0;
+	}
+
 	/* Set up semaphore to control work queue */
 	snprintf(semname_q, 64, "indexamajig-q%i", getpid());
 	sb->queue_sem = sem_open(semname_q, O_CREAT | O_EXCL,
@@ -1232,14 +3042,31 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 		return 0;
 	}
 
+	/* The sandbox's part of the trace goes in the temporary folder until
+	 * it's combined with the workers' parts at the end */
+	if ( sb->trace_file != NULL ) {
+		char trace_path[1024];
+		snprintf(trace_path, 1024, "%s/trace.sandbox", sb->tmpdir);
+		if ( profile_trace_start(trace_path, 0, "sandbox") ) {
+			ERROR("Failed to start trace: %s\n", strerror(errno));
+			sb->trace_file = NULL;
+		}
+	}
+
+	if ( (benchmark_time > 0.0) && load_benchmark_frames(&gpctx, sb) ) {
+		ERROR("Failed to set up benchmark\n");
+		return 0;
+	}
+
 	/* Fill the queue */
+	init_event_queue(sb->shared);
+	r = fill_queue(&gpctx, sb);
 	pthread_mutex_lock(&sb->shared->queue_lock);
-	sb->shared->n_events = 0;
-	sb->shared->no_more = fill_queue(&gpctx, sb);
+	sb->shared->no_more = r;
 	pthread_mutex_unlock(&sb->shared->queue_lock);
 
 	/* Fork the right number of times */
-	for ( i=0; i<n_proc; i++ ) {
+	for ( i=0; i<n_start; i++ ) {
 		start_worker_process(sb, i);
 	}
 
@@ -1282,7 +3109,9 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 	do {
 
 		/* Check for stream output from workers */
+		profile_start("read-worker-output");
 		try_read(sb);
+		profile_end("read-worker-output");
 
 		/* Check for interrupt or zombies */
 		check_signals(sb, 1);
@@ -1290,27 +3119,49 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 		/* Check for hung workers */
 		check_hung_workers(sb);
 
-		/* Top up the queue if necessary */
-		pthread_mutex_lock(&sb->shared->queue_lock);
-		if ( !sb->shared->no_more && (sb->shared->n_events < QUEUE_SIZE/2) ) {
-			if ( fill_queue(&gpctx, sb) ) sb->shared->no_more = 1;
+		/* Events from workers which stopped go first */
+		add_requeued_events(sb);
+
+		/* Top up the queue if necessary.  Only this process sets
+		 * no_more, so it can be read without the lock. */
+		if ( !sb->shared->no_more
+		  && (event_queue_length(sb->shared) < sb->queue_target/2) )
+		{
+			int finished;
+			profile_start("fill-queue");
+			finished = fill_queue(&gpctx, sb);
+			profile_end("fill-queue");
+			if ( finished ) {
+				pthread_mutex_lock(&sb->shared->queue_lock);
+				sb->shared->no_more = 1;
+				pthread_mutex_unlock(&sb->shared->queue_lock);
+			}
 		}
-		pthread_mutex_unlock(&sb->shared->queue_lock);
+
+		/* Start or stop workers according to the load */
+		autoscale(sb);
+		benchmark_step(sb);
 
 		/* Update progress */
 		try_status(sb, 0);
+		im_metrics_poll(sb->metrics, sandbox_metrics, sb);
+		write_status_file(sb, 0);
+		im_tune_poll(sb->tune, sb->stream);
 
 		/* Begin exit criterion checking */
 		pthread_mutex_lock(&sb->shared->queue_lock);
 		pthread_mutex_lock(&sb->shared->totals_lock);
 
 		/* Case 1: Queue empty and no more coming? */
-		if ( sb->shared->no_more && (sb->shared->n_events == 0) ) allDone = 1;
+		if ( sb->shared->no_more
+		  && (event_queue_length(sb->shared) == 0)
+		  && (sb->n_requeue == 0) ) allDone = 1;
 
-		/* Case 2: Worker process requested immediate shutdown */
+		/* Case 2: Worker process requested immediate shutdown.
+		 * The workers will see should_shutdown and ignore the
+		 * rest of the queue. */
 		if ( sb->shared->should_shutdown ) {
 			allDone = 1;
-			sb->shared->n_events = 0;
 			sb->shared->no_more = 1;
 		}
 
@@ -1348,6 +3199,9 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 			check_signals(sb, 0);
 			check_hung_workers(sb);
 			try_status(sb, 0);
+			im_metrics_poll(sb->metrics, sandbox_metrics, sb);
+			write_status_file(sb, 0);
+			im_tune_poll(sb->tune, sb->stream);
 		}
 		/* If this worker died and got waited by the zombie handler,
 		 * waitpid() returns -1 and the loop still exits. */
@@ -1358,14 +3212,31 @@ int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
 
 	pipe_list_destroy(sb->st_from_workers);
 	pipe_list_destroy(sb->mille_from_workers);
+	if ( sb->manifest != NULL ) fclose(sb->manifest);
+	im_dispatch_shutdown(sb->dispatch);
+	im_metrics_shutdown(sb->metrics);
+	write_status_file(sb, 1);
+	im_tune_report(sb->tune);
+	im_tune_free(sb->tune);
 	free(sb->running);
 	free(sb->last_response);
 	free(sb->pids);
+	for ( i=0; i<sb->n_requeue; i++ ) free(sb->requeue[i]);
+	free(sb->requeue);
+	for ( i=0; i<sb->n_parked; i++ ) free(sb->parked[i].ev);
+	free(sb->parked);
 
 	try_status(sb, 1);
+	show_benchmark_results(sb);
+	free_benchmark_frames(sb);
 	if ( sb->shared->n_processed == 0 ) r = 5;
 	if ( sb->shared->should_shutdown ) r = 1;
 
+	if ( sb->profile ) show_worker_profiles(sb->tmpdir, n_proc);
+	if ( sb->trace_file != NULL ) {
+		profile_trace_stop();
+		write_trace(sb->tmpdir, n_proc, sb->trace_file);
+	}
 	delete_temporary_folder(sb->tmpdir, n_proc);
 
 	shm_unlink(sb->shm_name);
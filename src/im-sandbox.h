@@ -35,8 +35,11 @@
 #define IM_SANDBOX_H
 
 #include <semaphore.h>
+#include <stdatomic.h>
 
 struct sb_shm;
+struct completed_events;
+struct im_zygote;
 
 #include "index.h"
 #include "stream.h"
@@ -44,10 +47,14 @@ struct sb_shm;
 #include "process_image.h"
 #include "im-zmq.h"
 #include "im-asapo.h"
+#include "im-tune.h"
 
-/* Length of event queue */
+/* Length of event queue (must be a power of two) */
 #define QUEUE_SIZE (256)
 
+/* Maximum number of events taken from the queue by a worker at once */
+#define QUEUE_BATCH_MAX (8)
+
 /* Maximum length of an event ID including serial number */
 #define MAX_EV_LEN (1024)
 
@@ -57,13 +64,31 @@ struct sb_shm;
 /* Maximum number of workers */
 #define MAX_NUM_WORKERS (1024)
 
+/* With autoscaling, how often to consider changing the number of workers, and
+ * how long a worker must be idle before it is stopped (both in seconds) */
+#define AUTOSCALE_INTERVAL (5)
+#define AUTOSCALE_IDLE_TIME (30)
+
+/* Maximum number of indexing methods for online tuning (--tune-*) */
+#define TUNE_MAX_METHODS (16)
+
 struct sb_shm
 {
 	pthread_mutex_t term_lock;
 
-	pthread_mutex_t queue_lock;
-	int n_events;
+	/* Event queue: a ring buffer, filled only by the main process, which
+	 * workers can take events from without locking.  The low 32 bits of
+	 * each slot's state are a position in the queue, and the high 32 bits
+	 * are the number of the worker holding it, plus one. */
 	char queue[QUEUE_SIZE][MAX_EV_LEN];
+	atomic_ullong queue_seq[QUEUE_SIZE];
+	atomic_uint queue_head;             /* Next event to be taken */
+	atomic_uint queue_tail;             /* Next event to be added */
+
+	/* Position of the last event each worker started processing */
+	atomic_uint queue_started[MAX_NUM_WORKERS];
+
+	pthread_mutex_t queue_lock;
 	int no_more;
 	int end_of_stream[MAX_NUM_WORKERS];
 
@@ -72,26 +97,100 @@ struct sb_shm
 	char last_task[MAX_NUM_WORKERS][MAX_TASK_LEN];
 	int pings[MAX_NUM_WORKERS];
 	time_t time_last_start[MAX_NUM_WORKERS];
+	int busy[MAX_NUM_WORKERS];  /* Worker is processing a frame */
+	double time_processing[MAX_NUM_WORKERS];  /* Total, in seconds */
 
 	pthread_mutex_t totals_lock;
 	int n_processed;
 	int n_hits;
 	int n_hadcrystals;
 	int n_crystals;
+	int n_vetoed;
 	int should_shutdown;
+	int retire[MAX_NUM_WORKERS];  /* Worker should exit when convenient */
+	int bench_ready[MAX_NUM_WORKERS];  /* Frames loaded for --benchmark */
+
+	/* For --share-recent-orientations */
+	struct recent_orientations recent;
+
+	/* For online tuning (--tune-*), protected by totals_lock.  The
+	 * parameters are set by the main process, and each worker applies them
+	 * when it sees a new generation number.  The statistics are only for
+	 * frames processed using the current generation. */
+	int tune_generation;
+	int tune_applied[MAX_NUM_WORKERS];
+	float tune_threshold;
+	float tune_min_snr;
+	int tune_n_methods;
+	int tune_order[TUNE_MAX_METHODS];  /* Positions in original list */
+	int tune_n_processed;
+	int tune_n_hadcrystals;
+	double tune_time;
+
+	/* Indexing statistics, by position in the original list of methods,
+	 * for all generations */
+	int tune_attempts[TUNE_MAX_METHODS];
+	int tune_successes[TUNE_MAX_METHODS];
+	double tune_method_time[TUNE_MAX_METHODS];
+
+	/* The same, but without fading out, for the report at the end */
+	long long int tune_total_attempts[TUNE_MAX_METHODS];
+	long long int tune_total_successes[TUNE_MAX_METHODS];
+	double tune_total_method_time[TUNE_MAX_METHODS];
 };
 
-extern char *create_tempdir(const char *temp_location);
+/* Function called in each worker process, if the workers are forked from the
+ * main process instead of being started with exec */
+typedef int (*SandboxWorkerFunc)(void *worker_data, int worker_id,
+                                 const char *shm_name, const char *sem_name,
+                                 const char *tmpdir,
+                                 int fd_stream, int fd_mille,
+                                 const char *shard_file);
+
+extern char *create_tempdir(const char *temp_location, int in_memory);
 
 extern time_t get_monotonic_seconds(void);
+extern double get_monotonic_time(void);
+
+extern int take_events(struct sb_shm *shared, sem_t *queue_sem,
+                       int worker_id, char events[][MAX_EV_LEN],
+                       unsigned int *pos, int min, int max);
+
+extern void start_event(struct sb_shm *shared, int worker_id,
+                        unsigned int pos);
+
+extern int event_queue_finished(struct sb_shm *shared);
+
+extern void advise_shm_huge_pages(struct sb_shm *shared, enum huge_pages hp);
 
-extern int create_sandbox(struct index_args *iargs, int n_proc, char *prefix,
-                          int config_basename, FILE *fh,  Stream *stream,
+extern int create_sandbox(struct index_args *iargs, int n_proc, int min_proc,
+                          char *prefix, int config_basename,
+                          FILE *fh,  Stream *stream,
                           const char *tempdir, int serial_start,
                           struct im_zmq_params *zmq_params,
                           struct im_asapo_params *asapo_params,
                           int timeout, int profile, int cpu_pin,
                           int no_data_timeout, int argc, char *argv[],
-                          const char *probed_methods, FILE *mille_fh);
+                          const char *probed_methods, FILE *mille_fh,
+                          SandboxWorkerFunc worker_func, void *worker_data,
+                          struct im_zygote *zygote,
+                          const char *manifest_name,
+                          const char *dispatch_addr,
+                          struct completed_events *completed,
+                          const char *metrics_port,
+                          const char *status_file,
+                          const char *trace_file,
+                          const struct im_tune_params *tune_params,
+                          const char *mille_prefix, double benchmark_time,
+                          const char *fromfile_index);
+
+extern struct completed_events *read_completed_events(const char *filename);
+extern int n_completed_events(struct completed_events *ce);
+extern int completed_events_max_serial(struct completed_events *ce);
+extern void free_completed_events(struct completed_events *ce);
+
+extern int serve_events(const DataTemplate *dtempl, FILE *fh, char *prefix,
+                        int config_basename, int serial_start,
+                        const char *port);
 
 #endif /* IM_SANDBOX_H */
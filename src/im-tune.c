@@ -0,0 +1,497 @@
+/*
+ * im-tune.c
+ *
+ * Online adjustment of parameters from the running statistics
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* The main process looks at the statistics every TUNE_INTERVAL seconds.
+ *
+ * The peakfinder8 threshold and minimum SNR are adjusted by trial and error,
+ * one at a time: the fraction of frames indexed is measured with the current
+ * values, then a step is tried.  The step is kept if more frames are indexed,
+ * or if about the same number are indexed (within one standard error) but
+ * with less time per frame.  Otherwise, the old value is restored and the
+ * next step for that parameter goes the other way.
+ *
+ * The indexing methods are put in order of successes per second spent on
+ * them.  Methods without enough attempts to judge stay where they are. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <utils.h>
+
+#include "im-tune.h"
+#include "im-sandbox.h"
+#include "process_image.h"
+
+
+#define TUNE_INTERVAL (30)
+#define TUNE_MIN_FRAMES (200)
+#define TUNE_MIN_ATTEMPTS (20)
+
+/* Fraction of the allowed range for one step */
+#define TUNE_STEP (0.1)
+
+
+struct tuned_param
+{
+	int enabled;
+	const char *name;
+	float *shm_val;
+	float min;
+	float max;
+	int dir;
+};
+
+
+struct im_tune
+{
+	struct im_tune_params params;
+	struct sb_shm *shared;
+	time_t t_last;
+
+	struct tuned_param p[2];
+	int next_param;
+
+	/* Measurement for the current values, if have_baseline */
+	int have_baseline;
+	int n_base;
+	double yield_base;
+	double cost_base;
+
+	/* Parameter being tried, or -1 */
+	int trial;
+	float old_val;
+
+	IndexingMethod *methods;
+	int n_methods;
+};
+
+
+struct im_tune *im_tune_new(const struct im_tune_params *params,
+                            struct sb_shm *shared,
+                            const struct index_args *iargs)
+{
+	struct im_tune *t;
+	int i;
+
+	t = malloc(sizeof(struct im_tune));
+	if ( t == NULL ) return NULL;
+
+	t->params = *params;
+	t->shared = shared;
+	t->t_last = get_monotonic_seconds();
+	t->next_param = 0;
+	t->have_baseline = 0;
+	t->trial = -1;
+
+	t->p[0].enabled = params->threshold;
+	t->p[0].name = "threshold";
+	t->p[0].shm_val = &shared->tune_threshold;
+	t->p[0].min = params->threshold_min;
+	t->p[0].max = params->threshold_max;
+	t->p[0].dir = +1;
+
+	t->p[1].enabled = params->min_snr;
+	t->p[1].name = "min-snr";
+	t->p[1].shm_val = &shared->tune_min_snr;
+	t->p[1].min = params->min_snr_min;
+	t->p[1].max = params->min_snr_max;
+	t->p[1].dir = +1;
+
+	t->methods = NULL;
+	t->n_methods = 0;
+	if ( params->order && (params->methods != NULL) ) {
+		t->methods = parse_indexing_methods(params->methods,
+		                                    &t->n_methods);
+		if ( t->n_methods > TUNE_MAX_METHODS ) {
+			ERROR("Too many indexing methods to reorder.\n");
+			free(t->methods);
+			free(t);
+			return NULL;
+		}
+	}
+
+	/* Start from the values given on the command line, brought within
+	 * the limits */
+	pthread_mutex_lock(&shared->totals_lock);
+	shared->tune_threshold = iargs->peak_search.threshold;
+	shared->tune_min_snr = iargs->peak_search.min_snr;
+	for ( i=0; i<2; i++ ) {
+		if ( !t->p[i].enabled ) continue;
+		if ( *t->p[i].shm_val < t->p[i].min ) *t->p[i].shm_val = t->p[i].min;
+		if ( *t->p[i].shm_val > t->p[i].max ) *t->p[i].shm_val = t->p[i].max;
+	}
+	shared->tune_n_methods = t->n_methods;
+	for ( i=0; i<t->n_methods; i++ ) shared->tune_order[i] = i;
+	shared->tune_generation = 1;
+	pthread_mutex_unlock(&shared->totals_lock);
+
+	return t;
+}
+
+
+/* Must be called with totals_lock held */
+static void new_generation(struct sb_shm *shared)
+{
+	shared->tune_generation++;
+	shared->tune_n_processed = 0;
+	shared->tune_n_hadcrystals = 0;
+	shared->tune_time = 0.0;
+}
+
+
+static void log_change(struct im_tune *t, Stream *st, const char *what)
+{
+	char line[1024];
+	size_t pos;
+	int i;
+
+	pos = snprintf(line, 1024, "Online tuning: %s.  Now using", what);
+	if ( t->p[0].enabled ) {
+		pos += snprintf(line+pos, 1024-pos, " threshold %.1f,",
+		                t->shared->tune_threshold);
+	}
+	if ( t->p[1].enabled ) {
+		pos += snprintf(line+pos, 1024-pos, " min-snr %.2f,",
+		                t->shared->tune_min_snr);
+	}
+	if ( t->n_methods > 0 ) {
+		pos += snprintf(line+pos, 1024-pos, " indexing methods");
+		for ( i=0; i<t->n_methods; i++ ) {
+			char *str;
+			str = indexer_str(t->methods[t->shared->tune_order[i]]);
+			pos += snprintf(line+pos, 1024-pos, "%c%s",
+			                (i==0) ? ' ' : ',', str);
+			free(str);
+			if ( pos >= 1023 ) break;
+		}
+	}
+	if ( pos >= 1023 ) pos = 1022;
+	if ( line[pos-1] == ',' ) pos--;
+	line[pos++] = '\n';
+	line[pos] = '\0';
+
+	STATUS("%s", line);
+
+	/* The line goes between two chunks, where stream readers ignore it */
+	if ( (st != NULL) && !stream_is_binary(st) ) {
+		stream_write_raw_chunk(st, line, pos);
+	}
+}
+
+
+/* Must be called with totals_lock held */
+static int tune_order(struct im_tune *t)
+{
+	struct sb_shm *shared = t->shared;
+	int pos[TUNE_MAX_METHODS];
+	double rate[TUNE_MAX_METHODS];
+	int n = 0;
+	int i, changed = 0;
+
+	/* Positions in the order which have enough data to judge */
+	for ( i=0; i<t->n_methods; i++ ) {
+		int m = shared->tune_order[i];
+		if ( shared->tune_attempts[m] < TUNE_MIN_ATTEMPTS ) continue;
+		if ( shared->tune_method_time[m] <= 0.0 ) continue;
+		pos[n] = i;
+		rate[n] = shared->tune_successes[m] / shared->tune_method_time[m];
+		n++;
+	}
+
+	/* Insertion sort of those methods, fastest first */
+	for ( i=1; i<n; i++ ) {
+		int j = i;
+		while ( (j > 0) && (rate[j] > rate[j-1]) ) {
+			double tr = rate[j];
+			int tm = shared->tune_order[pos[j]];
+			rate[j] = rate[j-1];
+			rate[j-1] = tr;
+			shared->tune_order[pos[j]] = shared->tune_order[pos[j-1]];
+			shared->tune_order[pos[j-1]] = tm;
+			changed = 1;
+			j--;
+		}
+	}
+
+	/* Let old statistics fade out, in case things change */
+	for ( i=0; i<t->n_methods; i++ ) {
+		shared->tune_attempts[i] /= 2;
+		shared->tune_successes[i] /= 2;
+		shared->tune_method_time[i] /= 2.0;
+	}
+
+	return changed;
+}
+
+
+/* Must be called with totals_lock held.  Returns the parameter which was
+ * changed, or -1 */
+static int start_trial(struct im_tune *t)
+{
+	int k;
+
+	for ( k=0; k<2; k++ ) {
+
+		struct tuned_param *p = &t->p[t->next_param];
+		float step = TUNE_STEP * (p->max - p->min);
+		float v = *p->shm_val;
+		int i = t->next_param;
+
+		t->next_param = (t->next_param + 1) % 2;
+		if ( !p->enabled || (step <= 0.0) ) continue;
+
+		if ( (v + p->dir*step > p->max) || (v + p->dir*step < p->min) ) {
+			p->dir = -p->dir;
+		}
+		v += p->dir*step;
+		if ( v > p->max ) v = p->max;
+		if ( v < p->min ) v = p->min;
+		if ( v == *p->shm_val ) continue;
+
+		t->old_val = *p->shm_val;
+		*p->shm_val = v;
+		return i;
+	}
+
+	return -1;
+}
+
+
+void im_tune_poll(struct im_tune *t, Stream *st)
+{
+	struct sb_shm *shared;
+	time_t tNow;
+	int n;
+	double yield, cost;
+	char what[512];
+
+	if ( t == NULL ) return;
+	shared = t->shared;
+
+	tNow = get_monotonic_seconds();
+	if ( tNow - t->t_last < TUNE_INTERVAL ) return;
+	t->t_last = tNow;
+
+	pthread_mutex_lock(&shared->totals_lock);
+
+	if ( (t->n_methods > 1) && tune_order(t) ) {
+		new_generation(shared);
+		pthread_mutex_unlock(&shared->totals_lock);
+		log_change(t, st, "indexing methods reordered");
+		return;
+	}
+
+	n = shared->tune_n_processed;
+	if ( n < TUNE_MIN_FRAMES ) {
+		pthread_mutex_unlock(&shared->totals_lock);
+		return;
+	}
+	yield = (double)shared->tune_n_hadcrystals / n;
+	cost = shared->tune_time / n;
+
+	what[0] = '\0';
+	if ( t->trial >= 0 ) {
+
+		struct tuned_param *p = &t->p[t->trial];
+		double se;
+		int keep;
+
+		se = sqrt(yield*(1.0-yield)/n
+		          + t->yield_base*(1.0-t->yield_base)/t->n_base);
+		keep = (yield > t->yield_base + se)
+		    || ((yield >= t->yield_base - se) && (cost < t->cost_base));
+
+		if ( keep ) {
+			snprintf(what, 512, "kept new %s (%.1f%% indexed, "
+			         "%.3f s/frame, was %.1f%% and %.3f s/frame)",
+			         p->name, 100.0*yield, cost,
+			         100.0*t->yield_base, t->cost_base);
+			t->n_base = n;
+			t->yield_base = yield;
+			t->cost_base = cost;
+		} else {
+			snprintf(what, 512, "restored %s (%.1f%% indexed, "
+			         "%.3f s/frame, was %.1f%% and %.3f s/frame)",
+			         p->name, 100.0*yield, cost,
+			         100.0*t->yield_base, t->cost_base);
+			*p->shm_val = t->old_val;
+			p->dir = -p->dir;
+			t->have_baseline = 0;
+		}
+		t->trial = -1;
+		new_generation(shared);
+
+	} else if ( !t->have_baseline ) {
+		t->n_base = n;
+		t->yield_base = yield;
+		t->cost_base = cost;
+		t->have_baseline = 1;
+	}
+
+	/* Try the next step straight away, unless the old values were just
+	 * restored and need to be measured again */
+	if ( t->have_baseline ) {
+		t->trial = start_trial(t);
+		if ( t->trial >= 0 ) {
+			new_generation(shared);
+			size_t l = strlen(what);
+			snprintf(what+l, 512-l, "%strying new %s",
+			         (l > 0) ? ", then " : "",
+			         t->p[t->trial].name);
+		}
+	}
+
+	pthread_mutex_unlock(&shared->totals_lock);
+
+	if ( what[0] != '\0' ) log_change(t, st, what);
+}
+
+
+void im_tune_report(struct im_tune *t)
+{
+	struct sb_shm *shared;
+	int i;
+
+	if ( t == NULL ) return;
+	shared = t->shared;
+
+	pthread_mutex_lock(&shared->totals_lock);
+	log_change(t, NULL, "finished");
+	for ( i=0; i<t->n_methods; i++ ) {
+
+		int m = shared->tune_order[i];
+		long long int n_att = shared->tune_total_attempts[m];
+		long long int n_succ = shared->tune_total_successes[m];
+		double time = shared->tune_total_method_time[m];
+		char *str = indexer_str(t->methods[m]);
+
+		if ( n_att == 0 ) {
+			STATUS("   %s: not tried\n", str);
+		} else {
+			STATUS("   %s: %lli attempts, %.1f%% successful, "
+			       "%.3f s per attempt, %.2f successes per second\n",
+			       str, n_att, 100.0*n_succ/n_att, time/n_att,
+			       (time > 0.0) ? n_succ/time : 0.0);
+		}
+		free(str);
+	}
+	pthread_mutex_unlock(&shared->totals_lock);
+}
+
+
+void im_tune_free(struct im_tune *t)
+{
+	if ( t == NULL ) return;
+	free(t->methods);
+	free(t);
+}
+
+
+void im_tune_worker_apply(struct sb_shm *shared, int worker_id,
+                          struct index_args *iargs,
+                          const IndexingMethod *orig, int n_orig)
+{
+	IndexingMethod order[TUNE_MAX_METHODS];
+	int n_order = 0;
+	int i;
+
+	pthread_mutex_lock(&shared->totals_lock);
+	if ( shared->tune_applied[worker_id] == shared->tune_generation ) {
+		pthread_mutex_unlock(&shared->totals_lock);
+		return;
+	}
+	shared->tune_applied[worker_id] = shared->tune_generation;
+	iargs->peak_search.threshold = shared->tune_threshold;
+	iargs->peak_search.min_snr = shared->tune_min_snr;
+	if ( shared->tune_n_methods == n_orig ) {
+		n_order = n_orig;
+		for ( i=0; i<n_orig; i++ ) {
+			order[i] = orig[shared->tune_order[i]];
+		}
+	}
+	pthread_mutex_unlock(&shared->totals_lock);
+
+	if ( (n_order > 1) && (iargs->ipriv != NULL) ) {
+		if ( indexing_set_method_order(iargs->ipriv, order) ) {
+			ERROR("Failed to reorder indexing methods\n");
+		}
+	}
+}
+
+
+void im_tune_worker_stats(struct sb_shm *shared, int worker_id,
+                          IndexingPrivate *ipriv,
+                          const IndexingMethod *orig, int n_orig,
+                          double time)
+{
+	int attempts[TUNE_MAX_METHODS];
+	int successes[TUNE_MAX_METHODS];
+	double method_time[TUNE_MAX_METHODS];
+	const IndexingMethod *methods = NULL;
+	int n = 0;
+	int i;
+
+	if ( ipriv != NULL ) {
+		methods = indexing_methods(ipriv, &n);
+		if ( n > TUNE_MAX_METHODS ) n = 0;
+		for ( i=0; i<n; i++ ) {
+			attempts[i] = 0;
+			successes[i] = 0;
+			method_time[i] = 0.0;
+		}
+		if ( n > 0 ) {
+			indexing_method_stats(ipriv, attempts, successes,
+			                      method_time);
+		}
+	}
+
+	pthread_mutex_lock(&shared->totals_lock);
+	if ( shared->tune_applied[worker_id] == shared->tune_generation ) {
+		shared->tune_time += time;
+	}
+	for ( i=0; i<n; i++ ) {
+		int j;
+		for ( j=0; j<n_orig; j++ ) {
+			if ( orig[j] == methods[i] ) break;
+		}
+		if ( j == n_orig ) continue;
+		shared->tune_attempts[j] += attempts[i];
+		shared->tune_successes[j] += successes[i];
+		shared->tune_method_time[j] += method_time[i];
+		shared->tune_total_attempts[j] += attempts[i];
+		shared->tune_total_successes[j] += successes[i];
+		shared->tune_total_method_time[j] += method_time[i];
+	}
+	pthread_mutex_unlock(&shared->totals_lock);
+}
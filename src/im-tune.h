@@ -0,0 +1,76 @@
+/*
+ * im-tune.h
+ *
+ * Online adjustment of parameters from the running statistics
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IM_TUNE_H
+#define IM_TUNE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <index.h>
+#include <stream.h>
+
+struct sb_shm;
+struct index_args;
+
+struct im_tune_params
+{
+	/* Reorder the indexing methods by successes per second */
+	int order;
+
+	/* Adjust the peakfinder8 threshold and minimum SNR within limits */
+	int threshold;
+	float threshold_min;
+	float threshold_max;
+	int min_snr;
+	float min_snr_min;
+	float min_snr_max;
+
+	/* The indexing methods, as given to setup_indexing() */
+	const char *methods;
+};
+
+/* In the main process */
+extern struct im_tune *im_tune_new(const struct im_tune_params *params,
+                                   struct sb_shm *shared,
+                                   const struct index_args *iargs);
+extern void im_tune_poll(struct im_tune *t, Stream *st);
+extern void im_tune_report(struct im_tune *t);
+extern void im_tune_free(struct im_tune *t);
+
+/* In the workers */
+extern void im_tune_worker_apply(struct sb_shm *shared, int worker_id,
+                                 struct index_args *iargs,
+                                 const IndexingMethod *orig, int n_orig);
+extern void im_tune_worker_stats(struct sb_shm *shared, int worker_id,
+                                 IndexingPrivate *ipriv,
+                                 const IndexingMethod *orig, int n_orig,
+                                 double time);
+
+#endif /* IM_TUNE_H */
@@ -39,53 +39,82 @@
 #include <unistd.h>
 #include <zmq.h>
 
+#ifdef HAVE_MSGPACK
+#include <msgpack.h>
+#endif
+
 #include <image.h>
 #include <utils.h>
+#include <cell.h>
+#include <cell-utils.h>
+#include <reflist.h>
 
 #include "im-zmq.h"
 
 #include "datatemplate_priv.h"
 
 
+/* Maximum number of messages to take from the socket in one go */
+#define ZMQ_BATCH (16)
+
 struct im_zmq
 {
 	void *ctx;
 	void *socket;
-	zmq_msg_t msg;
 	const char *request_str;
 	int request_sent;
+
+	/* Messages already received, but not yet handed out */
+	zmq_msg_t *batch[ZMQ_BATCH];
+	int n_batch;
+	int batch_pos;
 };
 
 
 struct im_zmq *im_zmq_connect(const struct im_zmq_params *params)
 {
 	struct im_zmq *z;
+	const char *mode;
+	int i;
 
 	z = malloc(sizeof(struct im_zmq));
 	if ( z == NULL ) return NULL;
 
+	z->n_batch = 0;
+	z->batch_pos = 0;
+
 	z->ctx = zmq_ctx_new();
 	if ( z->ctx == NULL ) {
 		free(z);
 		return NULL;
 	}
 
-	if ( params->request == NULL ) {
-		STATUS("Connecting ZMQ subscriber to '%s'\n", params->addr);
-		z->socket = zmq_socket(z->ctx, ZMQ_SUB);
-	} else {
-		STATUS("Connecting ZMQ requester to '%s'\n", params->addr);
+	if ( params->request != NULL ) {
+		mode = "requester";
 		z->socket = zmq_socket(z->ctx, ZMQ_REQ);
+	} else if ( params->pull ) {
+		mode = "puller";
+		z->socket = zmq_socket(z->ctx, ZMQ_PULL);
+	} else {
+		mode = "subscriber";
+		z->socket = zmq_socket(z->ctx, ZMQ_SUB);
 	}
 	if ( z->socket == NULL ) {
 		free(z);
 		return NULL;
 	}
 
-	if ( zmq_connect(z->socket, params->addr) == -1 ) {
-		ERROR("ZMQ connection failed: %s\n", zmq_strerror(errno));
-		free(z);
-		return NULL;
+	/* One socket connected to all the senders.  ZeroMQ takes messages
+	 * from each of them in turn (or, for REQ, sends the requests to each
+	 * of them in turn). */
+	for ( i=0; i<params->n_addrs; i++ ) {
+		STATUS("Connecting ZMQ %s to '%s'\n", mode, params->addrs[i]);
+		if ( zmq_connect(z->socket, params->addrs[i]) == -1 ) {
+			ERROR("ZMQ connection failed: %s\n",
+			      zmq_strerror(errno));
+			free(z);
+			return NULL;
+		}
 	}
 
 	int timeout = 3000;
@@ -93,9 +122,7 @@ struct im_zmq *im_zmq_connect(const struct im_zmq_params *params)
 	int linger = 0;;
 	zmq_setsockopt(z->socket, ZMQ_LINGER, &linger, sizeof(linger));
 
-	if ( params->request == NULL ) {
-
-		int i;
+	if ( (params->request == NULL) && !params->pull ) {
 
 		/* SUB mode */
 		if ( params->n_subscriptions == 0 ) {
@@ -116,22 +143,63 @@ struct im_zmq *im_zmq_connect(const struct im_zmq_params *params)
 
 		z->request_str = NULL;
 
-	} else {
+	} else if ( params->request != NULL ) {
 
 		/* REQ mode */
 		z->request_str = params->request;
 		z->request_sent = 0;
 
+	} else {
+
+		/* PULL mode */
+		z->request_str = NULL;
+
 	}
 
 	return z;
 }
 
 
-void *im_zmq_fetch(struct im_zmq *z, size_t *pdata_size)
+static zmq_msg_t *receive_message(struct im_zmq *z, int flags)
+{
+	zmq_msg_t *msg;
+
+	msg = malloc(sizeof(zmq_msg_t));
+	if ( msg == NULL ) return NULL;
+
+	zmq_msg_init(msg);
+	if ( zmq_msg_recv(msg, z->socket, flags) == -1 ) {
+		if ( errno != EAGAIN ) {
+			ERROR("ZMQ recieve failed: %s\n", zmq_strerror(errno));
+		}
+		zmq_msg_close(msg);
+		free(msg);
+		return NULL;
+	}
+
+	return msg;
+}
+
+
+/* Returns a pointer to the data of the received message, without copying
+ * it.  The message itself is put in *pmsg, and must be released with
+ * im_zmq_release() when the data is no longer needed.
+ *
+ * Except in REQ mode, where there can only be one message in flight, each
+ * wakeup takes all the messages which are already waiting (up to ZMQ_BATCH),
+ * and the following calls hand them out without touching the socket. */
+void *im_zmq_fetch(struct im_zmq *z, size_t *pdata_size, void **pmsg)
 {
-	int msg_size;
-	void *data_copy;
+	zmq_msg_t *msg;
+
+	*pmsg = NULL;
+
+	if ( z->batch_pos < z->n_batch ) {
+		msg = z->batch[z->batch_pos++];
+		*pdata_size = zmq_msg_size(msg);
+		*pmsg = msg;
+		return zmq_msg_data(msg);
+	}
 
 	if ( (z->request_str != NULL) && !z->request_sent ) {
 
@@ -147,33 +215,268 @@ void *im_zmq_fetch(struct im_zmq *z, size_t *pdata_size)
 		z->request_sent = 1;
 	}
 
-	/* Receive message */
-	zmq_msg_init(&z->msg);
-	msg_size = zmq_msg_recv(&z->msg, z->socket, 0);
-	if ( msg_size == -1 ) {
-		if ( errno != EAGAIN ) {
-			ERROR("ZMQ recieve failed: %s\n", zmq_strerror(errno));
-		}
-		zmq_msg_close(&z->msg);
-		return NULL;
-	}
+	/* Wait for a message */
+	msg = receive_message(z, 0);
+	if ( msg == NULL ) return NULL;
 
 	/* Reply received.  OK to send request again */
 	z->request_sent = 0;
 
-	data_copy = malloc(msg_size);
-	if ( data_copy == NULL ) return NULL;
-	memcpy(data_copy, zmq_msg_data(&z->msg), msg_size);
+	/* Take any others which have arrived in the meantime */
+	z->n_batch = 0;
+	z->batch_pos = 0;
+	if ( z->request_str == NULL ) {
+		while ( z->n_batch < ZMQ_BATCH ) {
+			zmq_msg_t *next = receive_message(z, ZMQ_DONTWAIT);
+			if ( next == NULL ) break;
+			z->batch[z->n_batch++] = next;
+		}
+	}
+
+	*pdata_size = zmq_msg_size(msg);
+	*pmsg = msg;
+	return zmq_msg_data(msg);
+}
+
 
-	zmq_msg_close(&z->msg);
-	*pdata_size = msg_size;
-	return data_copy;
+void im_zmq_release(void *vp)
+{
+	zmq_msg_t *msg = vp;
+	if ( msg == NULL ) return;
+	zmq_msg_close(msg);
+	free(msg);
 }
 
 
 void im_zmq_shutdown(struct im_zmq *z)
 {
 	if ( z == NULL ) return;
+	while ( z->batch_pos < z->n_batch ) {
+		im_zmq_release(z->batch[z->batch_pos++]);
+	}
 	zmq_close(z->socket);
 	zmq_ctx_destroy(z->ctx);
+	free(z);
 }
+
+
+#ifdef HAVE_MSGPACK
+
+struct im_zmq_output
+{
+	void *ctx;
+	void *socket;
+	int reflections;
+	msgpack_sbuffer sbuf;
+};
+
+
+/* Each worker connects its own socket, so the receiver has to bind */
+struct im_zmq_output *im_zmq_output_new(const char *addr, int push,
+                                        int reflections)
+{
+	struct im_zmq_output *o;
+	int linger = 0;
+	int hwm = 1000;
+
+	o = malloc(sizeof(struct im_zmq_output));
+	if ( o == NULL ) return NULL;
+
+	o->ctx = zmq_ctx_new();
+	if ( o->ctx == NULL ) {
+		free(o);
+		return NULL;
+	}
+
+	o->socket = zmq_socket(o->ctx, push ? ZMQ_PUSH : ZMQ_PUB);
+	if ( o->socket == NULL ) {
+		zmq_ctx_destroy(o->ctx);
+		free(o);
+		return NULL;
+	}
+
+	/* Never hold up the processing for the sake of the receiver */
+	zmq_setsockopt(o->socket, ZMQ_LINGER, &linger, sizeof(linger));
+	zmq_setsockopt(o->socket, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+
+	if ( zmq_connect(o->socket, addr) == -1 ) {
+		ERROR("ZMQ output connection failed: %s\n",
+		      zmq_strerror(errno));
+		zmq_close(o->socket);
+		zmq_ctx_destroy(o->ctx);
+		free(o);
+		return NULL;
+	}
+
+	o->reflections = reflections;
+	msgpack_sbuffer_init(&o->sbuf);
+
+	return o;
+}
+
+
+static void pack_key(msgpack_packer *pk, const char *key)
+{
+	size_t len = strlen(key);
+	msgpack_pack_str(pk, len);
+	msgpack_pack_str_body(pk, key, len);
+}
+
+
+static void pack_string(msgpack_packer *pk, const char *key, const char *val)
+{
+	pack_key(pk, key);
+	if ( val == NULL ) {
+		msgpack_pack_nil(pk);
+	} else {
+		pack_key(pk, val);
+	}
+}
+
+
+static void pack_reflections(msgpack_packer *pk, RefList *list)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	int n = 0;
+	int j;
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		if ( get_redundancy(refl) > 0 ) n++;
+	}
+
+	/* Columns of h, k, l, intensity and sigma(intensity) */
+	msgpack_pack_map(pk, 5);
+	for ( j=0; j<5; j++ ) {
+
+		const char *keys[] = {"h", "k", "l", "intensity", "sigma"};
+
+		pack_key(pk, keys[j]);
+		msgpack_pack_array(pk, n);
+
+		for ( refl = first_refl(list, &iter);
+		      refl != NULL;
+		      refl = next_refl(refl, iter) )
+		{
+			signed int h, k, l;
+
+			if ( get_redundancy(refl) == 0 ) continue;
+			get_indices(refl, &h, &k, &l);
+			switch ( j ) {
+				case 0 : msgpack_pack_int(pk, h); break;
+				case 1 : msgpack_pack_int(pk, k); break;
+				case 2 : msgpack_pack_int(pk, l); break;
+				case 3 : msgpack_pack_float(pk, get_intensity(refl)); break;
+				case 4 : msgpack_pack_float(pk, get_esd_intensity(refl)); break;
+			}
+		}
+	}
+}
+
+
+static void pack_crystal(msgpack_packer *pk, Crystal *cr, RefList *refls,
+                         int reflections)
+{
+	UnitCell *cell = crystal_get_cell(cr);
+	double a, b, c, al, be, ga;
+	char cen[2];
+
+	msgpack_pack_map(pk, reflections ? 5 : 4);
+
+	/* nm and degrees, as in the stream */
+	cell_get_parameters(cell, &a, &b, &c, &al, &be, &ga);
+	pack_key(pk, "cell");
+	msgpack_pack_array(pk, 6);
+	msgpack_pack_double(pk, a*1e9);
+	msgpack_pack_double(pk, b*1e9);
+	msgpack_pack_double(pk, c*1e9);
+	msgpack_pack_double(pk, rad2deg(al));
+	msgpack_pack_double(pk, rad2deg(be));
+	msgpack_pack_double(pk, rad2deg(ga));
+
+	pack_string(pk, "lattice_type",
+	            str_lattice(cell_get_lattice_type(cell)));
+	cen[0] = cell_get_centering(cell);
+	cen[1] = '\0';
+	pack_string(pk, "centering", cen);
+
+	/* nm^-1, as in the stream */
+	pack_key(pk, "resolution_limit");
+	msgpack_pack_double(pk, crystal_get_resolution_limit(cr)/1e9);
+
+	if ( reflections ) {
+		pack_key(pk, "reflections");
+		if ( refls != NULL ) {
+			pack_reflections(pk, refls);
+		} else {
+			msgpack_pack_nil(pk);
+		}
+	}
+}
+
+
+/* Send a summary of the results for this frame */
+void im_zmq_output_send(struct im_zmq_output *o, struct image *image)
+{
+	msgpack_packer pk;
+	int i;
+	int n_crystals = 0;
+
+	if ( o == NULL ) return;
+
+	for ( i=0; i<image->n_crystals; i++ ) {
+		if ( crystal_get_user_flag(image->crystals[i].cr) == 0 ) {
+			n_crystals++;
+		}
+	}
+
+	msgpack_sbuffer_clear(&o->sbuf);
+	msgpack_packer_init(&pk, &o->sbuf, msgpack_sbuffer_write);
+
+	msgpack_pack_map(&pk, 6);
+	pack_string(&pk, "filename", image->filename);
+	pack_string(&pk, "event", image->ev);
+	pack_key(&pk, "serial");
+	msgpack_pack_int(&pk, image->serial);
+	pack_key(&pk, "hit");
+	if ( image->hit ) {
+		msgpack_pack_true(&pk);
+	} else {
+		msgpack_pack_false(&pk);
+	}
+	pack_key(&pk, "n_peaks");
+	msgpack_pack_int(&pk, image_feature_count(image->features));
+	pack_key(&pk, "crystals");
+	msgpack_pack_array(&pk, n_crystals);
+	for ( i=0; i<image->n_crystals; i++ ) {
+		Crystal *cr = image->crystals[i].cr;
+		if ( crystal_get_user_flag(cr) != 0 ) continue;
+		pack_crystal(&pk, cr, image->crystals[i].refls,
+		             o->reflections);
+	}
+
+	/* If the receiver can't keep up, drop the message */
+	if ( zmq_send(o->socket, o->sbuf.data, o->sbuf.size,
+	              ZMQ_DONTWAIT) == -1 )
+	{
+		if ( errno != EAGAIN ) {
+			ERROR("ZMQ output send failed: %s\n",
+			      zmq_strerror(errno));
+		}
+	}
+}
+
+
+void im_zmq_output_shutdown(struct im_zmq_output *o)
+{
+	if ( o == NULL ) return;
+	msgpack_sbuffer_destroy(&o->sbuf);
+	zmq_close(o->socket);
+	zmq_ctx_destroy(o->ctx);
+	free(o);
+}
+
+#endif /* HAVE_MSGPACK */
@@ -38,8 +38,10 @@
 
 struct im_zmq_params
 {
-	char *addr;
+	char *addrs[64];
+	int n_addrs;
 	char *request;
+	int pull;
 	char *subscriptions[256];
 	int n_subscriptions;
 };
@@ -48,14 +50,33 @@ struct im_zmq_params
 
 extern struct im_zmq *im_zmq_connect(const struct im_zmq_params *params);
 extern void im_zmq_shutdown(struct im_zmq *z);
-extern void *im_zmq_fetch(struct im_zmq *z, size_t *pdata_size);
+extern void *im_zmq_fetch(struct im_zmq *z, size_t *pdata_size, void **pmsg);
+extern void im_zmq_release(void *msg);
 
 #else /* defined(HAVE_ZMQ) */
 
 static UNUSED struct im_zmq *im_zmq_connect(const struct im_zmq_params *params) { return NULL; }
 static UNUSED void im_zmq_shutdown(struct im_zmq *z) { }
-static UNUSED void *im_zmq_fetch(struct im_zmq *z, size_t *psize) { *psize = 0; return NULL; }
+static UNUSED void *im_zmq_fetch(struct im_zmq *z, size_t *psize, void **pmsg) { *psize = 0; *pmsg = NULL; return NULL; }
+static UNUSED void im_zmq_release(void *msg) { }
 
 #endif /* defined(HAVE_ZMQ) */
 
+struct image;
+
+#if defined(HAVE_ZMQ) && defined(HAVE_MSGPACK)
+
+extern struct im_zmq_output *im_zmq_output_new(const char *addr, int push,
+                                               int reflections);
+extern void im_zmq_output_send(struct im_zmq_output *o, struct image *image);
+extern void im_zmq_output_shutdown(struct im_zmq_output *o);
+
+#else /* defined(HAVE_ZMQ) && defined(HAVE_MSGPACK) */
+
+static UNUSED struct im_zmq_output *im_zmq_output_new(const char *addr, int push, int reflections) { return NULL; }
+static UNUSED void im_zmq_output_send(struct im_zmq_output *o, struct image *image) { }
+static UNUSED void im_zmq_output_shutdown(struct im_zmq_output *o) { }
+
+#endif /* defined(HAVE_ZMQ) && defined(HAVE_MSGPACK) */
+
 #endif /* CRYSTFEL_ZMQ_H */
@@ -0,0 +1,384 @@
+/*
+ * im-zygote.c
+ *
+ * Fork server for indexamajig worker processes
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* With --fork-workers, the indexing and peak search are set up once, and the
+ * workers are forked from a process which has already done it.  The main
+ * process becomes multi-threaded once the sandbox is running (stream writer,
+ * metrics server), and has a lot of other state by then, so it's not a good
+ * place to fork from.  Instead, a separate process ("zygote") is forked from
+ * the main process straight after the setup, while it still has only one
+ * thread.  It waits for requests from the sandbox and forks each new worker
+ * from its own pristine copy of the setup, which all the workers share
+ * (copy-on-write) with it.
+ *
+ * The sandbox needs to waitpid() the workers, so they have to be its
+ * children.  Each worker is forked from a short-lived intermediate process,
+ * so that it gets re-parented to the main process when the intermediate
+ * process exits.  This needs the main process to be a "child subreaper", which
+ * is Linux-specific.  Where that isn't possible, im_zygote_start() returns
+ * NULL and the sandbox forks the workers itself, as before. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#ifdef HAVE_CHILD_SUBREAPER
+#include <sys/prctl.h>
+#endif
+
+#include <utils.h>
+
+#include "im-zygote.h"
+
+
+struct im_zygote
+{
+	pid_t pid;
+	int sock;
+	int dead;
+};
+
+
+/* Sent by the sandbox, along with the file descriptors, and followed by the
+ * strings (each including the terminator) */
+struct zygote_request
+{
+	int worker_id;
+	int n_fds;
+	size_t len[4];
+};
+
+
+static int write_all(int fd, const void *vbuf, size_t len)
+{
+	const char *buf = vbuf;
+	while ( len > 0 ) {
+		ssize_t r = send(fd, buf, len, MSG_NOSIGNAL);
+		if ( r < 0 ) {
+			if ( errno == EINTR ) continue;
+			return 1;
+		}
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+
+static int read_all(int fd, void *vbuf, size_t len)
+{
+	char *buf = vbuf;
+	while ( len > 0 ) {
+		ssize_t r = read(fd, buf, len);
+		if ( r < 0 ) {
+			if ( errno == EINTR ) continue;
+			return 1;
+		}
+		if ( r == 0 ) return 1;
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+
+/* Receives the header and the file descriptors */
+static int recv_header(int sock, struct zygote_request *req, int fds[2])
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(2*sizeof(int))];
+	ssize_t r;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = req;
+	iov.iov_len = sizeof(struct zygote_request);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	do {
+		r = recvmsg(sock, &msg, MSG_WAITALL);
+	} while ( (r < 0) && (errno == EINTR) );
+	if ( r != sizeof(struct zygote_request) ) return 1;
+
+	fds[0] = -1;
+	fds[1] = -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if ( (cmsg != NULL) && (cmsg->cmsg_level == SOL_SOCKET)
+	  && (cmsg->cmsg_type == SCM_RIGHTS) )
+	{
+		int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if ( n > 2 ) n = 2;
+		memcpy(fds, CMSG_DATA(cmsg), n*sizeof(int));
+	}
+
+	return 0;
+}
+
+
+/* Forks a worker via an intermediate process, and returns its PID */
+static pid_t spawn_worker(int sock, SandboxWorkerFunc worker_func,
+                          void *worker_data, struct zygote_request *req,
+                          int fds[2], char *strs[4])
+{
+	pid_t inter;
+	pid_t w = -1;
+	int pid_pipe[2];
+
+	if ( pipe(pid_pipe) == -1 ) return -1;
+
+	inter = fork();
+	if ( inter == 0 ) {
+
+		close(pid_pipe[0]);
+		w = fork();
+		if ( w == 0 ) {
+			close(pid_pipe[1]);
+			close(sock);
+			signal(SIGINT, SIG_DFL);
+			signal(SIGQUIT, SIG_DFL);
+			_exit(worker_func(worker_data, req->worker_id,
+			                  strs[0], strs[1], strs[2],
+			                  fds[0], fds[1], strs[3]));
+		}
+
+		/* The worker now belongs to the main process */
+		if ( write(pid_pipe[1], &w, sizeof(pid_t)) != sizeof(pid_t) ) {
+			_exit(1);
+		}
+		_exit(0);
+	}
+
+	close(pid_pipe[1]);
+	if ( (inter == -1) || read_all(pid_pipe[0], &w, sizeof(pid_t)) ) {
+		w = -1;
+	}
+	close(pid_pipe[0]);
+	if ( inter != -1 ) waitpid(inter, NULL, 0);
+
+	return w;
+}
+
+
+static void zygote_main(int sock, SandboxWorkerFunc worker_func,
+                        void *worker_data)
+{
+	/* The sandbox decides when everything should stop, and then closes
+	 * the socket */
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+
+	while ( 1 ) {
+
+		struct zygote_request req;
+		int fds[2];
+		char *strs[4];
+		int i;
+		int fail = 0;
+		pid_t w;
+
+		if ( recv_header(sock, &req, fds) ) break;
+
+		for ( i=0; i<4; i++ ) {
+			strs[i] = NULL;
+			if ( fail || (req.len[i] == 0) ) continue;
+			strs[i] = malloc(req.len[i]);
+			if ( (strs[i] == NULL)
+			  || read_all(sock, strs[i], req.len[i]) ) fail = 1;
+		}
+		if ( fail ) break;
+
+		w = spawn_worker(sock, worker_func, worker_data, &req, fds,
+		                 strs);
+
+		for ( i=0; i<2; i++ ) {
+			if ( fds[i] != -1 ) close(fds[i]);
+		}
+		for ( i=0; i<4; i++ ) free(strs[i]);
+
+		if ( write_all(sock, &w, sizeof(pid_t)) ) break;
+	}
+
+	_exit(0);
+}
+
+
+/**
+ * Starts a fork server, which will call \p worker_func in each new worker.
+ * This must be called after the expensive setup, but before the main process
+ * starts any other threads.
+ *
+ * \returns the fork server, or NULL if it couldn't be started (in which case
+ * the caller should fork the workers itself).
+ */
+struct im_zygote *im_zygote_start(SandboxWorkerFunc worker_func,
+                                  void *worker_data)
+{
+	struct im_zygote *z;
+	int sv[2];
+
+#ifdef HAVE_CHILD_SUBREAPER
+	if ( prctl(PR_SET_CHILD_SUBREAPER, 1) ) return NULL;
+#else
+	return NULL;
+#endif
+
+	z = malloc(sizeof(struct im_zygote));
+	if ( z == NULL ) return NULL;
+
+	if ( socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1 ) {
+		free(z);
+		return NULL;
+	}
+
+	/* Don't let the zygote (and later the workers) inherit buffered
+	 * output, which would then be written twice */
+	fflush(NULL);
+
+	z->pid = fork();
+	if ( z->pid == -1 ) {
+		close(sv[0]);
+		close(sv[1]);
+		free(z);
+		return NULL;
+	}
+
+	if ( z->pid == 0 ) {
+		close(sv[0]);
+		zygote_main(sv[1], worker_func, worker_data);
+	}
+
+	close(sv[1]);
+	z->sock = sv[0];
+	z->dead = 0;
+	return z;
+}
+
+
+/**
+ * Asks the fork server for a new worker.  The arguments are the same as for
+ * a \ref SandboxWorkerFunc.  The caller keeps its own copies of the file
+ * descriptors.
+ *
+ * \returns the PID of the new worker, which will be a child of the calling
+ * process, or -1 on error.
+ */
+pid_t im_zygote_spawn(struct im_zygote *z, int worker_id,
+                      const char *shm_name, const char *sem_name,
+                      const char *tmpdir, int fd_stream, int fd_mille,
+                      const char *shard_file)
+{
+	struct zygote_request req;
+	const char *strs[4];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(2*sizeof(int))];
+	int fds[2];
+	ssize_t r;
+	pid_t w;
+	int i;
+
+	if ( z->dead ) return -1;
+
+	strs[0] = shm_name;
+	strs[1] = sem_name;
+	strs[2] = tmpdir;
+	strs[3] = shard_file;
+
+	memset(&req, 0, sizeof(req));
+	req.worker_id = worker_id;
+	for ( i=0; i<4; i++ ) {
+		req.len[i] = (strs[i] == NULL) ? 0 : strlen(strs[i])+1;
+	}
+	req.n_fds = 0;
+	fds[req.n_fds++] = fd_stream;
+	if ( fd_mille != -1 ) fds[req.n_fds++] = fd_mille;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(req.n_fds*sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(req.n_fds*sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, req.n_fds*sizeof(int));
+
+	do {
+		r = sendmsg(z->sock, &msg, MSG_NOSIGNAL);
+	} while ( (r < 0) && (errno == EINTR) );
+	if ( r != sizeof(req) ) {
+		z->dead = 1;
+		return -1;
+	}
+
+	for ( i=0; i<4; i++ ) {
+		if ( req.len[i] == 0 ) continue;
+		if ( write_all(z->sock, strs[i], req.len[i]) ) {
+			z->dead = 1;
+			return -1;
+		}
+	}
+
+	if ( read_all(z->sock, &w, sizeof(pid_t)) ) {
+		z->dead = 1;
+		return -1;
+	}
+
+	return w;
+}
+
+
+/**
+ * Stops the fork server.  Workers which are still running are not affected.
+ */
+void im_zygote_stop(struct im_zygote *z)
+{
+	if ( z == NULL ) return;
+	close(z->sock);
+	waitpid(z->pid, NULL, 0);
+	free(z);
+}
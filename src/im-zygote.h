@@ -0,0 +1,50 @@
+/*
+ * im-zygote.h
+ *
+ * Fork server for indexamajig worker processes
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IM_ZYGOTE_H
+#define IM_ZYGOTE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+
+#include "im-sandbox.h"
+
+struct im_zygote;
+
+extern struct im_zygote *im_zygote_start(SandboxWorkerFunc worker_func,
+                                         void *worker_data);
+extern pid_t im_zygote_spawn(struct im_zygote *z, int worker_id,
+                             const char *shm_name, const char *sem_name,
+                             const char *tmpdir, int fd_stream, int fd_mille,
+                             const char *shard_file);
+extern void im_zygote_stop(struct im_zygote *z);
+
+#endif /* IM_ZYGOTE_H */
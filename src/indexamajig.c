@@ -45,6 +45,7 @@
 #endif
 
 #include <stdlib.h>
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -72,11 +73,19 @@
 #include <datatemplate.h>
 #include <detgeom.h>
 #include <peakfinder8.h>
+#include <frame-arena.h>
 
 #include "im-sandbox.h"
+#include "im-prefetch.h"
+#include "im-benchmark.h"
+#include "im-reintegrate.h"
+#include "im-peakcache.h"
+#include "im-cxi-output.h"
 #include "im-argparse.h"
 #include "im-zmq.h"
 #include "im-asapo.h"
+#include "im-tune.h"
+#include "im-zygote.h"
 #include "version.h"
 #include "json-utils.h"
 #include "profile.h"
@@ -248,17 +257,6 @@ static void write_harvest_file(struct index_args *args,
 }
 
 
-static void shuffle_events(struct sb_shm *sb_shared)
-{
-	int i;
-
-	for ( i=1; i<sb_shared->n_events; i++ ) {
-		memcpy(sb_shared->queue[i-1], sb_shared->queue[i], MAX_EV_LEN);
-	}
-	sb_shared->n_events--;
-}
-
-
 static void pin_to_cpu(int slot)
 {
 	#ifdef HAVE_SCHED_SETAFFINITY
@@ -292,21 +290,232 @@ static void notify_alive_sandbox()
 }
 
 
+/* Returns non-zero if the 'fromfile' indexer will be used with a solution
+ * file in the text format */
+static int uses_fromfile(struct indexamajig_arguments *args,
+                         const char *probed_methods)
+{
+	const char *m = probed_methods;
+	struct fromfile_options *ffo = *args->fromfile_opts_ptr;
+
+	if ( m == NULL ) m = args->indm_str;
+	if ( (m == NULL) || (strstr(m, "file") == NULL) ) return 0;
+	if ( (ffo == NULL) || (ffo->filename == NULL) ) return 0;
+	return !fromfile_is_index(ffo->filename);
+}
+
+
+/* Sets up the parts of a worker which stay the same for the whole run.
+ * This is done by each worker process, or once by the main process if the
+ * workers are to be forked from it (--fork-workers). */
+static int setup_worker_state(struct indexamajig_arguments *args)
+{
+	IndexingFlags flags = 0;
+
+	if ( args->if_checkcell ) {
+		flags |= INDEXING_CHECK_CELL;
+	}
+	if ( args->if_refine ) {
+		flags |= INDEXING_REFINE;
+	}
+	if ( args->if_peaks ) {
+		flags |= INDEXING_CHECK_PEAKS;
+	}
+	if ( args->if_multi ) {
+		flags |= INDEXING_MULTI;
+	}
+	if ( args->if_retry ) {
+		flags |= INDEXING_RETRY;
+	}
+	if ( args->if_race ) {
+		flags |= INDEXING_RACE;
+	}
+	if ( args->if_persistent ) {
+		flags |= INDEXING_PERSISTENT;
+	}
+
+	args->iargs.ipriv = setup_indexing(args->indm_str,
+	                                   args->iargs.cell,
+	                                   args->iargs.tols,
+	                                   flags,
+	                                   args->iargs.wavelength_estimate,
+	                                   args->iargs.clen_estimate,
+	                                   args->iargs.n_threads,
+	                                   *args->taketwo_opts_ptr,
+	                                   *args->xgandalf_opts_ptr,
+	                                   *args->pinkindexer_opts_ptr,
+	                                   *args->felix_opts_ptr,
+	                                   *args->fromfile_opts_ptr,
+	                                   *args->asdf_opts_ptr);
+
+	if ( args->iargs.ipriv == NULL ) {
+		ERROR("Failed to set up indexing system\n");
+		return 1;
+	}
+
+	/* If the geometry doesn't change from frame to frame, |q| for each
+	 * pixel only needs to be calculated once for the resolution cutoff */
+	args->iargs.resmaps = NULL;
+	if ( !isinf(args->iargs.highres) ) {
+		struct detgeom *dg;
+		dg = data_template_get_2d_detgeom_if_possible(args->iargs.dtempl);
+		if ( dg != NULL ) {
+			args->iargs.resmaps = detgeom_qmaps_new(dg, DETGEOM_MAP_QMOD);
+			detgeom_free(dg);
+		}
+	}
+
+	args->iargs.pf_private = NULL;
+	if ( (args->iargs.peak_search.method == PEAK_PEAKFINDER8)
+	  || (args->iargs.peak_search.method == PEAK_PEAKFINDER8_GPU) ) {
+		struct detgeom *dg;
+		dg = data_template_get_2d_detgeom_if_possible(args->iargs.dtempl);
+		if ( dg == NULL ) {
+			ERROR("WARNING: Detector geometry is not static.  "
+			      "Peak search will be slower than optimal.\n");
+		}
+		args->iargs.pf_private = prepare_peakfinder8_cached(dg,
+		                    args->iargs.peak_search.peakfinder8_fast,
+		                    args->peakfinder8_cache);
+		detgeom_free(dg);
+		if ( (args->iargs.peak_search.method == PEAK_PEAKFINDER8_GPU)
+		  && (args->iargs.pf_private == NULL) )
+		{
+			ERROR("peakfinder8-gpu needs a static detector "
+			      "geometry.\n");
+			return 1;
+		}
+	}
+
+	args->iargs.pf9_private = NULL;
+	if ( args->iargs.peak_search.method == PEAK_PEAKFINDER9 ) {
+		args->iargs.pf9_private = prepare_peakfinder9();
+		if ( args->iargs.pf9_private == NULL ) return 1;
+	}
+
+	args->worker_state_ready = 1;
+	return 0;
+}
+
+
+/* Splits an event from the queue, "<filename> <event> <serial>", in place */
+static void split_event_line(char *line, char **pevent_str, char **pser_str)
+{
+	size_t len;
+	int i;
+
+	*pevent_str = NULL;
+	*pser_str = NULL;
+
+	len = strlen(line);
+	assert(len > 1);
+	for ( i=len-1; i>0; i-- ) {
+		if ( line[i] == ' ' ) {
+			line[i] = '\0';
+			*pser_str = &line[i+1];
+			break;
+		}
+	}
+	len = strlen(line);
+	assert(len > 1);
+	for ( i=len-1; i>0; i-- ) {
+		if ( line[i] == ' ' ) {
+			line[i] = '\0';
+			*pevent_str = &line[i+1];
+			break;
+		}
+	}
+}
+
+
+/* Asks the prefetcher to read the images for the events from next_request
+ * onwards, until its queue is full.  Returns the index of the next event which
+ * still needs to be requested. */
+static int request_prefetch(struct im_prefetch *prefetch,
+                            char (*events)[MAX_EV_LEN],
+                            int next_request, int n_events)
+{
+	while ( next_request < n_events ) {
+
+		char *line = strdup(events[next_request]);
+		char *event_str;
+		char *ser_str;
+		int ser;
+
+		split_event_line(line, &event_str, &ser_str);
+
+		/* Only the events which will be processed must be requested,
+		 * because the images will be taken in order */
+		if ( (event_str != NULL) && (ser_str != NULL)
+		  && (sscanf(ser_str, "%i", &ser) == 1)
+		  && im_prefetch_request(prefetch, line, event_str) )
+		{
+			free(line);
+			break;
+		}
+
+		free(line);
+		next_request++;
+
+	}
+	return next_request;
+}
+
+
+/* Write the timings for all the threads in this worker process to its
+ * temporary folder, for the sandbox to combine at the end of the run.  Each
+ * process has its own file, because a replacement for a crashed worker uses
+ * the same folder. */
+static void write_worker_profile(const char *workerdir)
+{
+	char path[1024];
+	FILE *fh;
+
+	snprintf(path, 1024, "%s/profile.%i", workerdir, getpid());
+	fh = fopen(path, "w");
+	if ( fh == NULL ) {
+		ERROR("Failed to write timing data: %s\n", strerror(errno));
+		return;
+	}
+	if ( profile_write(fh) ) {
+		ERROR("Failed to write timing data\n");
+	}
+	fclose(fh);
+}
+
+
 static int run_work(struct indexamajig_arguments *args)
 {
 	int allDone = 0;
 	struct im_zmq *zmqstuff = NULL;
 	struct im_asapo *asapostuff = NULL;
+	struct im_zmq_output *zmqout = NULL;
 	Mille *mille;
 	ImageDataArrays *ida;
+	struct filter_buffers *fb;
+	struct intcontext *ic = NULL;
 	size_t ll;
 	char *tmp;
 	struct stat s;
 	Stream *st;
 	int shm_fd;
 	sem_t *queue_sem;
-	IndexingFlags flags = 0;
-	struct pf8_private_data *pf8_data = NULL;
+	char (*events)[MAX_EV_LEN];
+	unsigned int *event_pos;
+	int max_events = QUEUE_BATCH_MAX;
+	int batch_max;
+	int n_events = 0;
+	int next_event = 0;
+	struct pf8_private_data *pf8_data;
+	ThreadPool *panel_pool = NULL;
+	struct im_prefetch *prefetch = NULL;
+	int next_request = 0;
+	struct im_benchmark *benchmark = NULL;
+	FrameArena *arena = NULL;
+	IndexingMethod *tune_methods = NULL;
+	int n_tune_methods = 0;
+	int tune = args->tune.order || args->tune.threshold
+	        || args->tune.min_snr;
 
 	if ( args->cpu_pin ) pin_to_cpu(args->worker_id);
 	_worker = args->worker_id;
@@ -337,68 +546,114 @@ static int run_work(struct indexamajig_arguments *args)
 		}
 	}
 
-	st = stream_open_fd_for_write(args->fd_stream, args->iargs.dtempl);
+	if ( args->shard_file == NULL ) {
+		st = stream_open_fd_for_write(args->fd_stream,
+		                              args->iargs.dtempl);
+	} else {
+		close(args->fd_stream);
+	}
 
-	if ( args->profile ) {
+	if ( args->profile || (args->trace_file != NULL) ) {
 		profile_init();
 	}
-
-	/* Load unit cell (if given) */
-	if ( args->cellfile != NULL ) {
-		args->iargs.cell = load_cell_from_file(args->cellfile);
-		if ( args->iargs.cell == NULL ) {
-			ERROR("Couldn't read unit cell (from %s)\n", args->cellfile);
-			return 1;
+	if ( args->profile_allocs ) {
+		profile_enable_alloc_stats();
+	}
+	if ( args->profile_counters && profile_enable_counters() ) {
+		if ( args->worker_id == 0 ) {
+			ERROR("WARNING: Hardware counters are not available - "
+			      "check /proc/sys/kernel/perf_event_paranoid\n");
 		}
-	} else {
-		args->iargs.cell = NULL;
 	}
-
-	if ( args->if_checkcell ) {
-		flags |= INDEXING_CHECK_CELL;
+	if ( args->trace_file != NULL ) {
+		char trace_path[1024];
+		char label[64];
+		snprintf(trace_path, 1024, "%s/trace.%i", tmp, getpid());
+		snprintf(label, 64, "worker %i", args->worker_id);
+		if ( profile_trace_start(trace_path, args->worker_id+1, label) ) {
+			ERROR("Failed to start trace: %s\n", strerror(errno));
+		}
 	}
-	if ( args->if_refine ) {
-		flags |= INDEXING_REFINE;
+
+	if ( !args->worker_state_ready ) {
+
+		/* Load unit cell (if given) */
+		if ( args->cellfile != NULL ) {
+			args->iargs.cell = load_cell_from_file(args->cellfile);
+			if ( args->iargs.cell == NULL ) {
+				ERROR("Couldn't read unit cell (from %s)\n",
+				      args->cellfile);
+				return 1;
+			}
+		} else {
+			args->iargs.cell = NULL;
+		}
+
+		if ( setup_worker_state(args) ) return 1;
 	}
-	if ( args->if_peaks ) {
-		flags |= INDEXING_CHECK_PEAKS;
+	pf8_data = args->iargs.pf_private;
+
+	/* Threads for searching the panels of each frame in parallel.  These
+	 * must be started here, in the worker, not before forking. */
+	if ( ((pf8_data != NULL) || (args->iargs.pf9_private != NULL))
+	  && (args->peakfinder8_threads > 1) )
+	{
+		panel_pool = thread_pool_new(args->peakfinder8_threads);
+		if ( panel_pool == NULL ) {
+			ERROR("Failed to start peak search threads\n");
+			return 1;
+		}
+		set_default_thread_pool(panel_pool);
+		if ( pf8_data != NULL ) {
+			pf8_set_num_threads(pf8_data, args->peakfinder8_threads);
+		}
+		pf9_set_num_threads(args->iargs.pf9_private,
+		                    args->peakfinder8_threads);
 	}
-	if ( args->if_multi ) {
-		flags |= INDEXING_MULTI;
+
+	/* The image filters and integration can share the same threads, if
+	 * the numbers match */
+	if ( (panel_pool == NULL) && (args->iargs.filter_threads > 1) ) {
+		panel_pool = thread_pool_new(args->iargs.filter_threads);
+		if ( panel_pool == NULL ) {
+			ERROR("Failed to start image filter threads\n");
+			return 1;
+		}
+		set_default_thread_pool(panel_pool);
 	}
-	if ( args->if_retry ) {
-		flags |= INDEXING_RETRY;
+	if ( (panel_pool == NULL) && (args->iargs.int_threads > 1) ) {
+		panel_pool = thread_pool_new(args->iargs.int_threads);
+		if ( panel_pool == NULL ) {
+			ERROR("Failed to start integration threads\n");
+			return 1;
+		}
+		set_default_thread_pool(panel_pool);
 	}
 
-	args->iargs.ipriv = setup_indexing(args->indm_str,
-	                                   args->iargs.cell,
-	                                   args->iargs.tols,
-	                                   flags,
-	                                   args->iargs.wavelength_estimate,
-	                                   args->iargs.clen_estimate,
-	                                   args->iargs.n_threads,
-	                                   *args->taketwo_opts_ptr,
-	                                   *args->xgandalf_opts_ptr,
-	                                   *args->pinkindexer_opts_ptr,
-	                                   *args->felix_opts_ptr,
-	                                   *args->fromfile_opts_ptr,
-	                                   *args->asdf_opts_ptr);
-
-	if ( args->iargs.ipriv == NULL ) {
-		ERROR("Failed to set up indexing system\n");
-		return 1;
+	/* Likewise, the GPU can't be shared with the parent process */
+	if ( args->iargs.peak_search.method == PEAK_PEAKFINDER8_GPU ) {
+		if ( pf8_enable_gpu(pf8_data) ) {
+			ERROR("Failed to set up GPU for peakfinder8\n");
+			return 1;
+		}
 	}
 
-	if ( args->iargs.peak_search.method == PEAK_PEAKFINDER8 ) {
-		struct detgeom *dg;
-		dg = data_template_get_2d_detgeom_if_possible(args->iargs.dtempl);
-		if ( dg == NULL ) {
-			ERROR("WARNING: Detector geometry is not static.  "
-			      "Peak search will be slower than optimal.\n");
+	if ( args->shard_file != NULL ) {
+		/* Write our own stream, with the same headers as the main one
+		 * would have had */
+		st = stream_open_for_write(args->shard_file, args->iargs.dtempl);
+		if ( st == NULL ) {
+			ERROR("Failed to open stream shard '%s'\n",
+			      args->shard_file);
+			return 1;
+		}
+		stream_write_geometry_file(st, args->geom_filename);
+		stream_write_target_cell(st, args->iargs.cell);
+		stream_write_indexing_methods(st, args->indm_str);
+		if ( stream_start_writer_thread(st) ) {
+			ERROR("Failed to set up stream shard writing\n");
+			return 1;
 		}
-		pf8_data = prepare_peakfinder8(dg, args->iargs.peak_search.peakfinder8_fast);
-		args->iargs.pf_private = pf8_data;
-		detgeom_free(dg);
 	}
 
 	/* Set up SHM */
@@ -413,6 +668,32 @@ static int run_work(struct indexamajig_arguments *args)
 		ERROR("SHM setup failed: %s\n", strerror(errno));
 		return 1;
 	}
+	advise_shm_huge_pages(shared, args->iargs.huge_pages);
+
+	if ( (args->iargs.ipriv != NULL) && (args->n_recent > 0) ) {
+		struct recent_orientations *ro = NULL;
+		if ( args->share_recent ) ro = &shared->recent;
+		if ( indexing_use_recent_orientations(args->iargs.ipriv,
+		                                      args->n_recent, ro) )
+		{
+			ERROR("Failed to set up recent orientations\n");
+			return 1;
+		}
+	}
+
+	/* The original order of the indexing methods, which the online tuning
+	 * refers to */
+	if ( tune && (args->iargs.ipriv != NULL) ) {
+		const IndexingMethod *methods;
+		methods = indexing_methods(args->iargs.ipriv, &n_tune_methods);
+		tune_methods = malloc(n_tune_methods*sizeof(IndexingMethod));
+		if ( tune_methods == NULL ) {
+			ERROR("Failed to allocate indexing methods\n");
+			return 1;
+		}
+		memcpy(tune_methods, methods,
+		       n_tune_methods*sizeof(IndexingMethod));
+	}
 
 	queue_sem = sem_open(args->queue_sem, 0);
 	if ( queue_sem == SEM_FAILED ) {
@@ -421,7 +702,7 @@ static int run_work(struct indexamajig_arguments *args)
 	}
 
 	/* Connect via ZMQ */
-	if ( args->zmq_params.addr != NULL ) {
+	if ( args->zmq_params.n_addrs > 0 ) {
 		zmqstuff = im_zmq_connect(&args->zmq_params);
 		if ( zmqstuff == NULL ) {
 			ERROR("ZMQ setup failed.\n");
@@ -429,6 +710,16 @@ static int run_work(struct indexamajig_arguments *args)
 		}
 	}
 
+	if ( args->zmq_output != NULL ) {
+		zmqout = im_zmq_output_new(args->zmq_output,
+		                           args->zmq_output_push,
+		                           args->zmq_output_refls);
+		if ( zmqout == NULL ) {
+			ERROR("ZMQ output setup failed.\n");
+			return 1;
+		}
+	}
+
 	if ( args->asapo_params.endpoint != NULL ) {
 		asapostuff = im_asapo_connect(&args->asapo_params);
 		if ( asapostuff == NULL ) {
@@ -444,74 +735,171 @@ static int run_work(struct indexamajig_arguments *args)
 
 	mille = crystfel_mille_new_fd(args->fd_mille);
 
-	ida = image_data_arrays_new();
+	ida = image_data_arrays_new_huge(args->iargs.huge_pages);
+	fb = filter_buffers_new(args->iargs.huge_pages);
+
+	/* Consecutive events often come from the same file */
+	image_set_file_cache(args->file_cache,
+	                     (size_t)args->hdf5_chunk_cache*1024*1024);
+	image_set_decompression_threads(args->decompress_threads);
+	image_set_batch_frames(args->batch_frames);
+
+	/* For --benchmark, read all the frames now, and keep them in memory */
+	if ( args->benchmark_time > 0.0 ) {
+		profile_start("benchmark-load-frames");
+		benchmark = im_benchmark_new(&args->iargs,
+		                             args->worker_tmpdir);
+		profile_end("benchmark-load-frames");
+		if ( benchmark == NULL ) return 1;
+		pthread_mutex_lock(&shared->totals_lock);
+		shared->bench_ready[args->worker_id] = 1;
+		pthread_mutex_unlock(&shared->totals_lock);
+	}
+
+	/* Memory for things which don't outlive one frame */
+	if ( !args->no_frame_arena ) {
+		arena = frame_arena_new_huge(args->iargs.huge_pages);
+		if ( arena == NULL ) {
+			ERROR("Failed to allocate frame arena\n");
+			return 1;
+		}
+	}
+
+	/* For --reintegrate, each worker reads the old stream for itself */
+	if ( args->reintegrate != NULL ) {
+		args->iargs.reint = im_reintegrate_new(args->reintegrate);
+		if ( args->iargs.reint == NULL ) return 1;
+	}
+
+	if ( args->peak_cache != NULL ) {
+		args->iargs.peak_cache = im_peakcache_new(args->peak_cache,
+		                                          args->geom_filename,
+		                                          &args->iargs.peak_search,
+		                                          args->iargs.highres,
+		                                          args->worker_id);
+		if ( args->iargs.peak_cache == NULL ) return 1;
+	}
+
+	if ( args->cxi_output != NULL ) {
+		args->iargs.cxi_output = im_cxi_output_new(args->cxi_output,
+		                                           args->iargs.dtempl,
+		                                           args->worker_id);
+		if ( args->iargs.cxi_output == NULL ) return 1;
+	}
+
+	/* Take at least a whole batch of frames from the queue at once, so
+	 * that all the frames read together are processed here */
+	if ( args->batch_frames > max_events ) max_events = args->batch_frames;
+	batch_max = max_events;
+
+	/* Start reading images ahead, if requested.  This is only for files,
+	 * not streamed data */
+	if ( (args->prefetch > 0) && (benchmark == NULL)
+	  && (args->zmq_params.n_addrs == 0)
+	  && (args->asapo_params.endpoint == NULL) )
+	{
+		prefetch = im_prefetch_new(&args->iargs, args->prefetch);
+		if ( prefetch == NULL ) return 1;
+
+		/* Room to take more events before running out */
+		max_events += args->prefetch;
+	}
+
+	/* Events taken from the queue, but not yet processed */
+	events = malloc(max_events*MAX_EV_LEN);
+	event_pos = malloc(max_events*sizeof(unsigned int));
+	if ( (events == NULL) || (event_pos == NULL) ) {
+		ERROR("Failed to allocate event buffer\n");
+		return 1;
+	}
 
 	while ( !allDone ) {
 
 		struct pattern_args pargs;
 		int ser;
 		char *line;
-		size_t len;
-		int i;
 		char *event_str = NULL;
 		char *ser_str = NULL;
 		int ok = 1;
 		int should_shutdown;
+		int retire;
 
 		/* Wait until an event is ready */
-		notify_alive();
-		set_last_task("wait_event");
-		profile_start("wait-queue-semaphore");
-		if ( sem_wait(queue_sem) != 0 ) {
-			ERROR("Failed to wait on queue semaphore: %s\n",
-			      strerror(errno));
+		if ( next_event == n_events ) {
+			notify_alive();
+			set_last_task("wait_event");
+			profile_start("wait-queue-semaphore");
+			if ( sem_wait(queue_sem) != 0 ) {
+				ERROR("Failed to wait on queue semaphore: %s\n",
+				      strerror(errno));
+			}
+			profile_end("wait-queue-semaphore");
 		}
-		profile_end("wait-queue-semaphore");
 
 		/* Get the event from the queue */
 		set_last_task("read_queue");
 		pthread_mutex_lock(&shared->totals_lock);
 		should_shutdown = shared->should_shutdown;
+		retire = shared->retire[args->worker_id];
 		pthread_mutex_unlock(&shared->totals_lock);
-		pthread_mutex_lock(&shared->queue_lock);
-		if ( ((shared->n_events==0) && (shared->no_more))
-		   || should_shutdown )
-		{
-			/* Queue is empty and no more are coming,
-			 * or another process has initiated a shutdown.
-			 * Either way, it's time to get out of here. */
-			pthread_mutex_unlock(&shared->queue_lock);
+		if ( should_shutdown ) {
+			/* Another process has initiated a shutdown */
 			allDone = 1;
 			continue;
 		}
-		if ( shared->n_events == 0 ) {
-			ERROR("Got the semaphore, but no events in queue!\n");
-			ERROR("no_more = %i\n", shared->no_more);
-			pthread_mutex_unlock(&shared->queue_lock);
+		if ( retire && (next_event == n_events) ) {
+			/* Not needed any more (autoscaling), and there are
+			 * no events left which we have taken from the queue */
 			allDone = 1;
 			continue;
 		}
+		if ( next_event == n_events ) {
+			n_events = take_events(shared, queue_sem,
+			                       args->worker_id, events,
+			                       event_pos, args->batch_frames,
+			                       batch_max);
+			next_event = 0;
+			next_request = 0;
+		}
+		if ( n_events == 0 ) {
+			/* Queue is empty.  If no more are coming,
+			 * it's time to get out of here.  Otherwise,
+			 * another worker got there first. */
+			if ( event_queue_finished(shared) ) allDone = 1;
+			continue;
+		}
 
-		line = strdup(shared->queue[0]);
-
-		len = strlen(line);
-		assert(len > 1);
-		for ( i=len-1; i>0; i-- ) {
-			if ( line[i] == ' ' ) {
-				line[i] = '\0';
-				ser_str = &line[i+1];
-				break;
-			}
+		/* Keep the prefetcher busy, by taking more events from the
+		 * queue before the ones we already have run out */
+		if ( (prefetch != NULL) && !retire
+		  && (n_events - next_event <= args->prefetch)
+		  && (sem_trywait(queue_sem) == 0) )
+		{
+			int n_left = n_events - next_event;
+			int n_more;
+			memmove(events[0], events[next_event], n_left*MAX_EV_LEN);
+			memmove(event_pos, &event_pos[next_event],
+			        n_left*sizeof(unsigned int));
+			next_request -= next_event;
+			next_event = 0;
+			n_more = take_events(shared, queue_sem, args->worker_id,
+			                     &events[n_left], &event_pos[n_left],
+			                     args->batch_frames,
+			                     max_events - n_left);
+			n_events = n_left + n_more;
+
+			/* Nothing taken, so the semaphore count wasn't for us.
+			 * Put it back, in case it was the final wake-up for
+			 * a worker which is waiting. */
+			if ( n_more == 0 ) sem_post(queue_sem);
 		}
-		len = strlen(line);
-		assert(len > 1);
-		for ( i=len-1; i>0; i-- ) {
-			if ( line[i] == ' ' ) {
-				line[i] = '\0';
-				event_str = &line[i+1];
-				break;
-			}
+		if ( prefetch != NULL ) {
+			next_request = request_prefetch(prefetch, events,
+			                                next_request, n_events);
 		}
+
+		line = strdup(events[next_event]);
+		split_event_line(line, &event_str, &ser_str);
 		if ( (ser_str != NULL) && (event_str != NULL) ) {
 			if ( sscanf(ser_str, "%i", &ser) != 1 ) {
 				STATUS("Invalid serial number '%s'\n",
@@ -521,17 +909,20 @@ static int run_work(struct indexamajig_arguments *args)
 		}
 		if ( !ok ) {
 			STATUS("Invalid event string '%s'\n",
-			       shared->queue[0]);
+			       events[next_event]);
 			ok = 0;
 		}
 
 		pthread_mutex_lock(&shared->debug_lock);
-		memcpy(shared->last_ev[args->worker_id], shared->queue[0],
+		memcpy(shared->last_ev[args->worker_id], events[next_event],
 		       MAX_EV_LEN);
 		pthread_mutex_unlock(&shared->debug_lock);
 
-		shuffle_events(shared);
-		pthread_mutex_unlock(&shared->queue_lock);
+		/* From now on, if this process dies, the event will not be
+		 * given to another worker */
+		start_event(shared, args->worker_id, event_pos[next_event]);
+
+		next_event++;
 
 		if ( !ok ) continue;
 
@@ -544,20 +935,29 @@ static int run_work(struct indexamajig_arguments *args)
 		/* Default values */
 		pargs.zmq_data = NULL;
 		pargs.zmq_data_size = 0;
+		pargs.zmq_msg = NULL;
 		pargs.asapo_data = NULL;
 		pargs.asapo_data_size = 0;
 		pargs.asapo_meta = NULL;
+		pargs.asapo_msg = NULL;
+		pargs.image = NULL;
 
-		if ( args->zmq_params.addr != NULL ) {
+		if ( args->zmq_params.n_addrs > 0 ) {
 
 			profile_start("zmq-fetch");
 			set_last_task("ZMQ fetch");
 			pargs.zmq_data = im_zmq_fetch(zmqstuff,
-			                              &pargs.zmq_data_size);
+			                              &pargs.zmq_data_size,
+			                              &pargs.zmq_msg);
 			profile_end("zmq-fetch");
 
 			if ( (pargs.zmq_data != NULL)
-			  && (pargs.zmq_data_size > 15) ) ok = 1;
+			  && (pargs.zmq_data_size > 15) )
+			{
+				ok = 1;
+			} else {
+				im_zmq_release(pargs.zmq_msg);
+			}
 
 			/* The filename/event, which will be 'fake' values in
 			 * this case, still came via the event queue.  More
@@ -579,7 +979,8 @@ static int run_work(struct indexamajig_arguments *args)
 			                                  &filename,
 			                                  &event,
 			                                  &finished,
-			                                  &asapo_message_id);
+			                                  &asapo_message_id,
+			                                  &pargs.asapo_msg);
 			profile_end("asapo-fetch");
 			if ( pargs.asapo_data != NULL ) {
 				ok = 1;
@@ -607,17 +1008,56 @@ static int run_work(struct indexamajig_arguments *args)
 
 		} else {
 			ok = 1;
+			if ( benchmark != NULL ) {
+				pargs.image = im_benchmark_get(benchmark,
+				                               pargs.filename,
+				                               pargs.event);
+			} else if ( prefetch != NULL ) {
+				set_last_task("wait for prefetch");
+				profile_start("prefetch-wait");
+				pargs.image = im_prefetch_get(prefetch,
+				                              pargs.filename,
+				                              pargs.event);
+				profile_end("prefetch-wait");
+			}
 		}
 
 		if ( ok ) {
+			double t_start, t_proc;
+			if ( tune ) {
+				im_tune_worker_apply(shared, args->worker_id,
+				                     &args->iargs, tune_methods,
+				                     n_tune_methods);
+			}
 			pthread_mutex_lock(&shared->debug_lock);
 			shared->time_last_start[args->worker_id] = get_monotonic_seconds();
+			shared->busy[args->worker_id] = 1;
 			pthread_mutex_unlock(&shared->debug_lock);
+			t_start = get_monotonic_time();
+			profile_trace_set_serial(ser);
 			profile_start("process-image");
+			frame_arena_set_current(arena);
 			process_image(&args->iargs, &pargs, st, args->worker_id,
 			              args->worker_tmpdir, ser,
-			              shared, asapostuff, mille, ida);
+			              shared, asapostuff, zmqout, mille, ida,
+			              fb, &ic);
+			frame_arena_set_current(NULL);
+			frame_arena_reset(arena);
 			profile_end("process-image");
+			profile_trace_set_serial(0);
+
+			t_proc = get_monotonic_time() - t_start;
+			pthread_mutex_lock(&shared->debug_lock);
+			shared->busy[args->worker_id] = 0;
+			shared->time_processing[args->worker_id] += t_proc;
+			pthread_mutex_unlock(&shared->debug_lock);
+
+			if ( tune ) {
+				im_tune_worker_stats(shared, args->worker_id,
+				                     args->iargs.ipriv,
+				                     tune_methods,
+				                     n_tune_methods, t_proc);
+			}
 
 			if ( asapostuff != NULL ) {
 				im_asapo_finalise(asapostuff, ser);
@@ -630,28 +1070,42 @@ static int run_work(struct indexamajig_arguments *args)
 		 * that it can be queried for "header" values etc.  They will
 		 * eventually be freed by image_free() under process_image(). */
 
-		if ( args->profile ) {
-			profile_print_and_reset(args->worker_id);
-		}
-
 		free(pargs.filename);
 		free(pargs.event);
 	}
 
+	im_prefetch_free(prefetch);
+	im_benchmark_free(benchmark);
+	im_reintegrate_free(args->iargs.reint);
+	im_peakcache_free(args->iargs.peak_cache);
+	im_cxi_output_free(args->iargs.cxi_output);
+	frame_arena_free(arena);
+	if ( args->profile ) write_worker_profile(tmp);
+	profile_trace_stop();
+	free(tune_methods);
 	stream_close(st);
 	free(tmp);
+	free(events);
+	free(event_pos);
 	munmap(shared, sizeof(struct sb_shm));
 	sem_close(queue_sem);
 
+	image_close_cached_files();
 	image_data_arrays_free(ida);
+	filter_buffers_free(fb);
+	intcontext_free(ic);
 	crystfel_mille_free(mille);
 
-	/* These are both no-ops if argument is NULL */
+	/* These are all no-ops if argument is NULL */
 	im_zmq_shutdown(zmqstuff);
+	im_zmq_output_shutdown(zmqout);
 	im_asapo_shutdown(asapostuff);
 
 	data_template_free(args->iargs.dtempl);
 	if ( pf8_data != NULL ) free_pf8_private_data(pf8_data);
+	free_pf9_private_data(args->iargs.pf9_private);
+	detgeom_qmaps_free(args->iargs.resmaps);
+	thread_pool_free(panel_pool);
 	cleanup_indexing(args->iargs.ipriv);
 	cell_free(args->iargs.cell);
 	cleanup_indexamajig_args(args);
@@ -664,6 +1118,27 @@ static int run_work(struct indexamajig_arguments *args)
 }
 
 
+/* Called in a new process forked from the main process (--fork-workers).
+ * The indexing and peak search setup is inherited from the main process. */
+static int fork_worker(void *vp, int worker_id, const char *shm_name,
+                       const char *sem_name, const char *tmpdir,
+                       int fd_stream, int fd_mille, const char *shard_file)
+{
+	struct indexamajig_arguments *args = vp;
+
+	args->worker = 1;
+	args->worker_id = worker_id;
+	args->shm_name = strdup(shm_name);
+	args->queue_sem = strdup(sem_name);
+	args->worker_tmpdir = strdup(tmpdir);
+	args->fd_stream = fd_stream;
+	args->fd_mille = fd_mille;
+	args->shard_file = safe_strdup(shard_file);
+
+	return run_work(args);
+}
+
+
 int main(int argc, char *argv[])
 {
 	FILE *fh = NULL;
@@ -677,9 +1152,12 @@ int main(int argc, char *argv[])
 	double clen_from_dt;
 	int err = 0;
 	char *probed_methods = NULL;
+	char *fromfile_index = NULL;
+	struct completed_events *completed = NULL;
 	size_t mille_fn_len;
 	char *mille_filename;
 	FILE *mille_fh;
+	struct im_zygote *zygote = NULL;
 
 	args = parse_indexamajig_args(argc, argv);
 	if ( args == NULL ) return 1;
@@ -733,6 +1211,12 @@ int main(int argc, char *argv[])
 		args->iargs.peak_search.pk_out = args->iargs.ir_out;
 	}
 
+	/* Re-integration uses the crystals from the old stream */
+	if ( args->reintegrate != NULL ) {
+		free(args->indm_str);
+		args->indm_str = strdup("none");
+	}
+
 	if ( args->worker ) {
 		/* I am a worker process */
 		return run_work(args);
@@ -740,8 +1224,10 @@ int main(int argc, char *argv[])
 
 	/* Check for minimal information */
 	if ( (args->filename == NULL)
-	  && (args->zmq_params.addr == NULL)
-	  && (args->asapo_params.endpoint == NULL) ) {
+	  && (args->zmq_params.n_addrs == 0)
+	  && (args->asapo_params.endpoint == NULL)
+	  && (args->dispatch_from == NULL)
+	  && (args->reintegrate == NULL) ) {
 		ERROR("You need to provide the input filename (use -i)\n");
 		return 1;
 	}
@@ -749,12 +1235,123 @@ int main(int argc, char *argv[])
 		ERROR("You need to specify the geometry filename (use -g)\n");
 		return 1;
 	}
-	if ( args->outfile == NULL ) {
+	if ( (args->outfile == NULL) && (args->dispatch_listen == NULL) ) {
 		ERROR("You need to specify the output filename (use -o)\n");
 		return 1;
 	}
 
-	if ( (args->filename != NULL) && (args->zmq_params.addr != NULL) ) {
+	if ( (args->prefetch > 0)
+	  && ((args->iargs.peak_search.method == PEAK_HDF5)
+	   || (args->iargs.peak_search.method == PEAK_CXI)) )
+	{
+		ERROR("--prefetch cannot be used with --peaks=hdf5 or "
+		      "--peaks=cxi.\n");
+		return 1;
+	}
+
+	if ( (args->cxi_output != NULL) && (args->prefetch > 0) ) {
+		ERROR("--prefetch cannot be used with --cxi-output.\n");
+		return 1;
+	}
+
+#ifndef HAVE_HDF5
+	if ( args->cxi_output != NULL ) {
+		ERROR("Can't write CXI output - compiled without HDF5\n");
+		return 1;
+	}
+#endif
+
+	if ( args->batch_frames > QUEUE_SIZE/4 ) {
+		ERROR("--batch-frames can't be more than %i.\n", QUEUE_SIZE/4);
+		return 1;
+	}
+
+	if ( args->resume && (args->filename == NULL)
+	  && (args->dispatch_from == NULL) )
+	{
+		ERROR("--resume can only be used with --input or "
+		      "--dispatch-from.\n");
+		return 1;
+	}
+
+	if ( args->resume && !args->stream_shards && (args->outfile != NULL)
+	  && (strlen(args->outfile) > 4)
+	  && (strcmp(args->outfile+strlen(args->outfile)-4, ".zst") == 0) )
+	{
+		ERROR("--resume can't be used with a compressed stream.\n");
+		return 1;
+	}
+
+	if ( (args->dispatch_listen != NULL) && (args->filename == NULL) ) {
+		ERROR("You need to provide the input filename (use -i) with "
+		      "--dispatch-listen\n");
+		return 1;
+	}
+
+	if ( (args->dispatch_from != NULL)
+	  && ((args->filename != NULL)
+	   || (args->zmq_params.n_addrs > 0)
+	   || (args->asapo_params.endpoint != NULL)) )
+	{
+		ERROR("The option --dispatch-from cannot be combined with "
+		      "--input, --zmq-input or --asapo-endpoint.\n");
+		return 1;
+	}
+
+	if ( (args->reintegrate != NULL)
+	  && ((args->filename != NULL)
+	   || (args->zmq_params.n_addrs > 0)
+	   || (args->asapo_params.endpoint != NULL)
+	   || (args->dispatch_from != NULL)
+	   || (args->dispatch_listen != NULL)
+	   || args->resume) )
+	{
+		ERROR("The option --reintegrate takes the frames from the stream, "
+		      "and cannot be combined with --input, --zmq-input, "
+		      "--asapo-endpoint, --dispatch-from, --dispatch-listen or "
+		      "--resume.\n");
+		return 1;
+	}
+
+	if ( (args->peak_cache != NULL)
+	  && ((args->zmq_params.n_addrs > 0)
+	   || (args->asapo_params.endpoint != NULL)
+	   || (args->reintegrate != NULL)) )
+	{
+		ERROR("--peak-cache cannot be used with --zmq-input, "
+		      "--asapo-endpoint or --reintegrate.\n");
+		return 1;
+	}
+
+	if ( (args->peak_cache != NULL)
+	  && (args->tune.threshold || args->tune.min_snr) )
+	{
+		ERROR("--peak-cache cannot be used when tuning the peak "
+		      "search.\n");
+		return 1;
+	}
+
+	if ( (args->peak_cache != NULL)
+	  && (args->iargs.peak_search.method != PEAK_ZAEF)
+	  && (args->iargs.peak_search.method != PEAK_PEAKFINDER8)
+	  && (args->iargs.peak_search.method != PEAK_PEAKFINDER8_GPU)
+	  && (args->iargs.peak_search.method != PEAK_PEAKFINDER9) )
+	{
+		ERROR("--peak-cache can only be used with --peaks=zaef, "
+		      "peakfinder8 or peakfinder9.\n");
+		return 1;
+	}
+
+	if ( (args->benchmark_time > 0.0)
+	  && ((args->filename == NULL) || (args->dispatch_listen != NULL)
+	   || args->resume || (args->min_workers > 0)) )
+	{
+		ERROR("--benchmark can only be used with --input, and not with "
+		      "--dispatch-listen, --resume or --min-workers.\n");
+		return 1;
+	}
+
+	if ( (args->filename != NULL) && (args->zmq_params.n_addrs > 0) ) {
 		ERROR("The options --input and --zmq-input are mutually "
 		      "exclusive.\n");
 		return 1;
@@ -766,7 +1363,7 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	if ( (args->asapo_params.endpoint != NULL) && (args->zmq_params.addr != NULL) ) {
+	if ( (args->asapo_params.endpoint != NULL) && (args->zmq_params.n_addrs > 0) ) {
 		ERROR("The options --asapo-endpoint and --zmq-input are mutually "
 		      "exclusive.\n");
 		return 1;
@@ -778,6 +1375,24 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if ( args->zmq_params.pull
+	  && ((args->zmq_params.request != NULL)
+	   || (args->zmq_params.n_subscriptions > 0)) )
+	{
+		ERROR("The option --zmq-pull cannot be used with --zmq-request "
+		      "or --zmq-subscribe.\n");
+		return 1;
+	}
+
+	if ( (args->tune.threshold || args->tune.min_snr)
+	  && (args->iargs.peak_search.method != PEAK_PEAKFINDER8)
+	  && (args->iargs.peak_search.method != PEAK_PEAKFINDER8_GPU) )
+	{
+		ERROR("The options --tune-threshold and --tune-min-snr can "
+		      "only be used with --peaks=peakfinder8.\n");
+		return 1;
+	}
+
 	if ( (args->filename != NULL)
 	  && (strcmp(args->filename, "-") != 0)
 	  && is_hdf5_file(args->filename, &err) )
@@ -808,16 +1423,38 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* For --reintegrate, the input is the list of frames in the stream */
+	if ( args->reintegrate != NULL ) {
+		fh = im_reintegrate_event_list(args->reintegrate);
+		if ( fh == NULL ) return 1;
+	}
+
 	/* Check prefix (if given) */
 	if ( args->check_prefix ) {
 		args->prefix = check_prefix(args->prefix);
 	}
 
+	/* Hand out the events to other indexamajig instances, instead of
+	 * processing them here */
+	if ( args->dispatch_listen != NULL ) {
+		r = serve_events(args->iargs.dtempl, fh, args->prefix,
+		                 args->basename, args->serial_start,
+		                 args->dispatch_listen);
+		data_template_free(args->iargs.dtempl);
+		cleanup_indexamajig_args(args);
+		return r;
+	}
+
 	/* Check number of processes */
 	if ( args->n_proc == 0 ) {
 		ERROR("Invalid number of processes.\n");
 		return 1;
 	}
+	if ( (args->min_workers < 0) || (args->min_workers > args->n_proc) ) {
+		ERROR("The minimum number of workers (--min-workers) must be "
+		      "between 1 and the number given with -j.\n");
+		return 1;
+	}
 
 	/* Load unit cell (if given) */
 	if ( args->cellfile != NULL ) {
@@ -837,7 +1474,7 @@ int main(int argc, char *argv[])
 		STATUS("No reference unit cell provided.\n");
 	}
 
-	tmpdir = create_tempdir(args->temp_location);
+	tmpdir = create_tempdir(args->temp_location, args->temp_in_memory);
 	if ( tmpdir == NULL ) return 1;
 
 	/* Change into temporary folder, temporarily, to control the crap
@@ -870,6 +1507,12 @@ int main(int argc, char *argv[])
 			STATUS("Auto-determined indexing methods: %s\n", probed_methods);
 		}
 
+	} else if ( args->reintegrate != NULL ) {
+
+		STATUS("Re-integrating the crystals from %s\n",
+		       args->reintegrate);
+		args->iargs.ipriv = NULL;
+
 	} else if ( strcmp(args->indm_str, "none") == 0 ) {
 
 		STATUS("Indexing/integration disabled.\n");
@@ -887,6 +1530,24 @@ int main(int argc, char *argv[])
 
 	}
 
+	if ( probed_methods != NULL ) {
+		args->tune.methods = probed_methods;
+	} else if ( strcmp(args->indm_str, "none") != 0 ) {
+		args->tune.methods = args->indm_str;
+	}
+
+	/* XGANDALF and PinkIndexer build large lookup tables during setup */
+	if ( !args->fork_workers && (args->n_proc > 1) ) {
+		const char *m = probed_methods;
+		if ( m == NULL ) m = args->indm_str;
+		if ( (m != NULL) && ((strstr(m, "xgandalf") != NULL)
+		                  || (strstr(m, "pinkindexer") != NULL)) )
+		{
+			STATUS("Hint: use --fork-workers to set up XGANDALF and "
+			       "PinkIndexer once, instead of in every worker.\n");
+		}
+	}
+
 	/* Change back to where we were before.  Sandbox code will create
 	 * worker subdirs inside the temporary folder, and process_image will
 	 * change into them. */
@@ -895,20 +1556,99 @@ int main(int argc, char *argv[])
 		ERROR("Failed to chdir: %s\n", strerror(errno));
 		return 1;
 	}
+
+	/* Sort the solutions for 'fromfile' indexing into an index once, for
+	 * all the workers to share, instead of each reading the text file */
+	if ( uses_fromfile(args, probed_methods) ) {
+		struct fromfile_options *ffo = *args->fromfile_opts_ptr;
+		size_t ll = strlen(rn) + strlen(tmpdir) + 32;
+		fromfile_index = malloc(ll);
+		if ( fromfile_index == NULL ) return 1;
+		if ( tmpdir[0] == '/' ) {
+			snprintf(fromfile_index, ll, "%s/fromfile-index", tmpdir);
+		} else {
+			snprintf(fromfile_index, ll, "%s/%s/fromfile-index",
+			         rn, tmpdir);
+		}
+		STATUS("Indexing solution file %s\n", ffo->filename);
+		if ( fromfile_write_index(ffo->filename, fromfile_index) ) {
+			return 1;
+		}
+		cffree(ffo->filename);
+		ffo->filename = cfstrdup(fromfile_index);
+	}
 	free(rn);
 
-	/* Open output stream */
-	st = stream_open_for_write(args->outfile, args->iargs.dtempl);
-	if ( st == NULL ) {
-		ERROR("Failed to open stream '%s'\n", args->outfile);
-		return 1;
+	/* Find out which frames were already done, if resuming */
+	if ( args->resume ) {
+		completed = read_completed_events(args->outfile);
+		if ( completed == NULL ) {
+			ERROR("Couldn't read the existing stream to resume.\n");
+			return 1;
+		}
+		STATUS("Resuming: %i frames are already in the stream.\n",
+		       n_completed_events(completed));
+		if ( completed_events_max_serial(completed) >= args->serial_start ) {
+			args->serial_start = completed_events_max_serial(completed)+1;
+		}
+	}
+
+	/* Open output stream.  With --stream-shards, the output file will
+	 * instead be a manifest, written by the sandbox, and the workers will
+	 * write the stream headers to their own shards. */
+	if ( !args->stream_shards && args->resume ) {
+
+		/* The headers are already there */
+		int fd = open(args->outfile, O_WRONLY | O_APPEND);
+		if ( fd == -1 ) {
+			ERROR("Failed to open stream '%s': %s\n", args->outfile,
+			      strerror(errno));
+			return 1;
+		}
+		st = stream_open_fd_for_write(fd, args->iargs.dtempl);
+		if ( st == NULL ) {
+			ERROR("Failed to open stream '%s'\n", args->outfile);
+			return 1;
+		}
+
+	} else if ( !args->stream_shards ) {
+
+		st = stream_open_for_write(args->outfile, args->iargs.dtempl);
+		if ( st == NULL ) {
+			ERROR("Failed to open stream '%s'\n", args->outfile);
+			return 1;
+		}
+
+		/* Write audit info */
+		stream_write_commandline_args(st, argc, argv);
+		stream_write_geometry_file(st, args->geom_filename);
+		stream_write_target_cell(st, args->iargs.cell);
+		stream_write_indexing_methods(st, args->indm_str);
+
+	} else {
+		st = NULL;
 	}
 
-	/* Write audit info */
-	stream_write_commandline_args(st, argc, argv);
-	stream_write_geometry_file(st, args->geom_filename);
-	stream_write_target_cell(st, args->iargs.cell);
-	stream_write_indexing_methods(st, args->indm_str);
+	/* Do the expensive setup once, to be inherited by all the workers.
+	 * The fork server has to be started before any other threads. */
+	if ( args->fork_workers ) {
+		if ( probed_methods != NULL ) {
+			free(args->indm_str);
+			args->indm_str = strdup(probed_methods);
+		}
+		if ( setup_worker_state(args) ) return 1;
+		zygote = im_zygote_start(fork_worker, args);
+	}
+
+	/* Write the stream in the background, so that the sandbox can keep
+	 * collecting chunks from the workers.  Not if the workers will be
+	 * forked from this process, because it would be multi-threaded. */
+	if ( (st != NULL) && (!args->fork_workers || (zygote != NULL))
+	  && stream_start_writer_thread(st) )
+	{
+		ERROR("Failed to set up stream writing\n");
+		return 1;
+	}
 
 	if ( (args->harvest_file != NULL) && (args->serial_start <= 1) ) {
 		write_harvest_file(&args->iargs, args->harvest_file,
@@ -931,23 +1671,55 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 	snprintf(mille_filename, mille_fn_len, "%s/%s", args->milledir, args->millefile);
-	mille_fh = fopen(mille_filename, "wb");
-	if ( mille_fh == NULL ) {
-		ERROR("Failed to open Millepede file: %s\n", strerror(errno));
-		return 1;
+	if ( args->mille_per_worker ) {
+		/* The workers will write to mille-data-0.bin etc */
+		size_t l = strlen(mille_filename);
+		if ( (l > 4) && (strcmp(mille_filename+l-4, ".bin") == 0) ) {
+			mille_filename[l-4] = '\0';
+		}
+		mille_fh = NULL;
+	} else {
+		mille_fh = fopen(mille_filename, "wb");
+		if ( mille_fh == NULL ) {
+			ERROR("Failed to open Millepede file: %s\n",
+			      strerror(errno));
+			return 1;
+		}
 	}
-	free(mille_filename);
 
-	r = create_sandbox(&args->iargs, args->n_proc, args->prefix, args->basename,
+	r = create_sandbox(&args->iargs, args->n_proc, args->min_workers,
+	                   args->prefix, args->basename,
 	                   fh, st, tmpdir, args->serial_start,
 	                   &args->zmq_params, &args->asapo_params,
 	                   timeout, args->profile, args->cpu_pin,
 	                   args->no_data_timeout, argc, argv,
-			   probed_methods, mille_fh);
+			   probed_methods, mille_fh,
+	                   args->fork_workers ? fork_worker : NULL, args,
+	                   zygote,
+	                   args->stream_shards ? args->outfile : NULL,
+	                   args->dispatch_from, completed,
+	                   args->metrics_port, args->status_file,
+	                   args->trace_file,
+	                   &args->tune,
+	                   args->mille_per_worker ? mille_filename : NULL,
+	                   args->benchmark_time, fromfile_index);
+
+	im_zygote_stop(zygote);
+	if ( args->worker_state_ready ) {
+		if ( args->iargs.pf_private != NULL ) {
+			free_pf8_private_data(args->iargs.pf_private);
+		}
+		free_pf9_private_data(args->iargs.pf9_private);
+		detgeom_qmaps_free(args->iargs.resmaps);
+		cleanup_indexing(args->iargs.ipriv);
+	}
 
-	fclose(mille_fh);
+	if ( mille_fh != NULL ) fclose(mille_fh);
+	free(mille_filename);
 	free(tmpdir);
 	free(probed_methods);
+	free(fromfile_index);
+	free_completed_events(completed);
 	data_template_free(args->iargs.dtempl);
 	cell_free(args->iargs.cell);
 	stream_close(st);
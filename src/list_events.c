@@ -37,10 +37,13 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #include <utils.h>
 #include <image.h>
 #include <datatemplate.h>
+#include <event-list.h>
 
 #include "version.h"
 
@@ -58,21 +61,269 @@ static void show_help(const char *s)
 "  -i, --input=<file>         Input filename (list of multi-event filenames).\n"
 "  -g, --geometry=<file>      Get data layout from geometry file.\n"
 "  -o, --output=<file>        Output filename (list of events).\n"
+"  -j <n>                     Look at <n> files at once.  Default 1.\n"
+"      --binary               Write a binary event list, which indexamajig can\n"
+"                              read faster than a text list.\n"
 );
 }
 
 
+struct output
+{
+	FILE *fh;
+	int binary;
+};
+
+
+static int output_event(struct output *out, const char *filename,
+                        const char *ev, int first)
+{
+	if ( out->binary ) {
+		if ( first && event_list_write_file(out->fh, filename) ) {
+			return 1;
+		}
+		return event_list_write_event(out->fh, ev);
+	}
+
+	return fprintf(out->fh, "%s %s\n", filename, ev) < 0;
+}
+
+
+static char **read_file_list(FILE *ifh, int *pn)
+{
+	char **files = NULL;
+	int n = 0;
+	int max = 0;
+	char filename[1024];
+
+	while ( fgets(filename, 1024, ifh) != NULL ) {
+
+		chomp(filename);
+
+		if ( n == max ) {
+			char **new_files;
+			max += 1024;
+			new_files = realloc(files, max*sizeof(char *));
+			if ( new_files == NULL ) return NULL;
+			files = new_files;
+		}
+
+		files[n] = strdup(filename);
+		if ( files[n] == NULL ) return NULL;
+		n++;
+
+	}
+
+	*pn = n;
+	return files;
+}
+
+
+static int list_events_serial(const DataTemplate *dtempl, char **files,
+                              int n_files, struct output *out)
+{
+	int i;
+
+	for ( i=0; i<n_files; i++ ) {
+
+		ImageEventIter *iter;
+		char *ev;
+		int num_events = 0;
+
+		iter = image_event_iter_new(dtempl, files[i]);
+		if ( iter == NULL ) {
+			ERROR("Failed to read %s\n", files[i]);
+			return 1;
+		}
+
+		while ( (ev = image_event_iter_next(iter)) != NULL ) {
+			if ( output_event(out, files[i], ev, num_events==0) ) {
+				ERROR("Failed to write event list\n");
+				return 1;
+			}
+			free(ev);
+			num_events++;
+		}
+
+		STATUS("%i events found in %s\n", num_events, files[i]);
+
+		image_event_iter_free(iter);
+
+	}
+
+	return 0;
+}
+
+
+/* Worker process: looks at every n_proc-th file, starting with number
+ * 'first', and sends the events back up the pipe, one per line.  "D" ends the
+ * events for a file, and "X" means the file couldn't be read. */
+static void list_events_worker(const DataTemplate *dtempl, char **files,
+                               int n_files, int first, int n_proc, FILE *fh)
+{
+	int i;
+
+	for ( i=first; i<n_files; i+=n_proc ) {
+
+		ImageEventIter *iter;
+		char *ev;
+
+		iter = image_event_iter_new(dtempl, files[i]);
+		if ( iter == NULL ) {
+			fprintf(fh, "X\n");
+			break;
+		}
+
+		while ( (ev = image_event_iter_next(iter)) != NULL ) {
+			fprintf(fh, "E %s\n", ev);
+			free(ev);
+		}
+		fprintf(fh, "D\n");
+
+		image_event_iter_free(iter);
+
+	}
+
+	fclose(fh);
+}
+
+
+/* The files are shared out between worker processes in turn, so the events
+ * can be collected in the original order by reading from each worker's pipe
+ * in turn. */
+static int list_events_parallel(const DataTemplate *dtempl, char **files,
+                                int n_files, int n_proc, struct output *out)
+{
+	pid_t *pids;
+	FILE **fhs;
+	int i;
+	int r = 0;
+	char *line = NULL;
+	size_t line_len = 0;
+
+	if ( n_proc > n_files ) n_proc = n_files;
+	if ( n_proc < 2 ) return list_events_serial(dtempl, files, n_files, out);
+
+	pids = malloc(n_proc*sizeof(pid_t));
+	fhs = malloc(n_proc*sizeof(FILE *));
+	if ( (pids == NULL) || (fhs == NULL) ) return 1;
+
+	fflush(stdout);
+	fflush(stderr);
+	fflush(out->fh);
+
+	for ( i=0; i<n_proc; i++ ) {
+
+		int fds[2];
+		int j;
+
+		if ( pipe(fds) == -1 ) {
+			ERROR("Couldn't create pipe\n");
+			return 1;
+		}
+
+		pids[i] = fork();
+		if ( pids[i] == -1 ) {
+			ERROR("Couldn't fork worker process\n");
+			return 1;
+		}
+
+		if ( pids[i] == 0 ) {
+			FILE *fh;
+			close(fds[0]);
+			for ( j=0; j<i; j++ ) fclose(fhs[j]);
+			fh = fdopen(fds[1], "w");
+			if ( fh == NULL ) _exit(1);
+			list_events_worker(dtempl, files, n_files, i, n_proc,
+			                   fh);
+			_exit(0);
+		}
+
+		close(fds[1]);
+		fhs[i] = fdopen(fds[0], "r");
+		if ( fhs[i] == NULL ) {
+			ERROR("Couldn't open pipe\n");
+			return 1;
+		}
+
+	}
+
+	for ( i=0; i<n_files; i++ ) {
+
+		FILE *fh = fhs[i % n_proc];
+		int num_events = 0;
+		int done = 0;
+
+		while ( !done ) {
+
+			if ( getline(&line, &line_len, fh) == -1 ) {
+				ERROR("Worker process failed\n");
+				r = 1;
+				break;
+			}
+			chomp(line);
+
+			switch ( line[0] ) {
+
+				case 'E' :
+				if ( output_event(out, files[i], line+2,
+				                  num_events==0) )
+				{
+					ERROR("Failed to write event list\n");
+					r = 1;
+					done = 1;
+				}
+				num_events++;
+				break;
+
+				case 'D' :
+				done = 1;
+				break;
+
+				default :
+				ERROR("Failed to read %s\n", files[i]);
+				r = 1;
+				done = 1;
+				break;
+
+			}
+
+		}
+		if ( r ) break;
+
+		STATUS("%i events found in %s\n", num_events, files[i]);
+
+	}
+
+	for ( i=0; i<n_proc; i++ ) {
+		if ( r ) kill(pids[i], SIGTERM);
+		fclose(fhs[i]);
+		waitpid(pids[i], NULL, 0);
+	}
+
+	free(line);
+	free(pids);
+	free(fhs);
+	return r;
+}
+
+
 int main(int argc, char *argv[])
 {
 	int c;
 	char *input = NULL;
 	char *output = NULL;
 	char *geom = NULL;
-	char *rval;
 	FILE *ifh;
 	FILE *ofh;
 	DataTemplate *dtempl;
 	int err;
+	int n_proc = 1;
+	int binary = 0;
+	char **files;
+	int n_files;
+	int i, r;
+	struct output out;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -81,11 +332,12 @@ int main(int argc, char *argv[])
 		{"input",              1, NULL,               'i'},
 		{"geometry",           1, NULL,               'g'},
 		{"output",             1, NULL,               'o'},
+		{"binary",             0, &binary,             1 },
 		{0, 0, NULL, 0}
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "hi:g:o:",
+	while ((c = getopt_long(argc, argv, "hi:g:o:j:",
 	                        longopts, NULL)) != -1) {
 
 		switch (c) {
@@ -113,6 +365,15 @@ int main(int argc, char *argv[])
 			geom = strdup(optarg);
 			break;
 
+			case 'j' :
+			if ( (sscanf(optarg, "%i", &n_proc) != 1)
+			  || (n_proc < 1) )
+			{
+				ERROR("Invalid value for -j\n");
+				return 1;
+			}
+			break;
+
 			case 0 :
 			break;
 
@@ -152,7 +413,7 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	ofh = fopen(output, "w");
+	ofh = fopen(output, binary ? "wb" : "w");
 	if ( ofh == NULL ) {
 		ERROR("Couldn't open '%s'\n", output);
 		return 1;
@@ -164,41 +425,23 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	do {
-
-		char filename[1024];
-
-		rval = fgets(filename, 1024, ifh);
-		if ( rval != NULL ) {
-
-			char **evlist;
-			int num_events;
-			int i;
-
-			chomp(filename);
-
-			evlist = image_expand_frames(dtempl, filename,
-			                             &num_events);
-			if ( evlist == NULL ) {
-				ERROR("Failed to read %s\n", filename);
-				return 1;
-			}
-
-			for ( i=0; i<num_events; i++ ) {
-				fprintf(ofh, "%s %s\n",
-				        filename, evlist[i]);
-				free(evlist[i]);
-			}
-
-			STATUS("%i events found in %s\n",
-			       num_events, filename);
-
-			free(evlist);
+	files = read_file_list(ifh, &n_files);
+	if ( files == NULL ) {
+		ERROR("Failed to read '%s'\n", input);
+		return 1;
+	}
 
-		}
+	out.fh = ofh;
+	out.binary = binary;
+	if ( binary && event_list_write_header(ofh) ) {
+		ERROR("Failed to write event list\n");
+		return 1;
+	}
 
-	} while ( rval != NULL );
+	r = list_events_parallel(dtempl, files, n_files, n_proc, &out);
 
+	for ( i=0; i<n_files; i++ ) free(files[i]);
+	free(files);
 	data_template_free(dtempl);
 	fclose(ofh);
 	fclose(ifh);
@@ -206,5 +449,5 @@ int main(int argc, char *argv[])
 	free(input);
 	free(output);
 
-	return 0;
+	return r;
 }
@@ -0,0 +1,426 @@
+/*
+ * log-archive.c
+ *
+ * Indexed container for partialator's log files
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <utils.h>
+
+#include "log-archive.h"
+
+
+/* The file starts with this, followed by a number for checking the byte
+ * order.  The log files follow, then the index, then the trailer.  Like the
+ * checkpoint files, everything is in the native byte order. */
+#define LOG_ARCHIVE_MAGIC "CrystFEL log archive 1\n"
+#define LOG_ARCHIVE_BOM (0x01020304)
+#define LOG_ARCHIVE_END "CFLOGEND"
+
+struct archive_index_entry
+{
+	uint64_t offset;
+	uint64_t len;
+	uint32_t name_len;
+	uint32_t pad;
+};
+
+struct archive_trailer
+{
+	uint64_t index_offset;
+	uint64_t n_files;
+	uint32_t bom;
+	char end[8];
+};
+
+struct archive_file
+{
+	char *name;
+	uint64_t offset;
+	uint64_t len;
+};
+
+struct _logarchive
+{
+	int fd;
+	int writing;
+	uint64_t end;         /* Where the next file will go */
+	struct archive_file *files;
+	int n_files;
+	int max_files;
+	pthread_mutex_t lock;
+};
+
+
+static LogArchive *current_archive = NULL;
+
+
+static int write_all(int fd, const void *data, size_t len, uint64_t offset)
+{
+	const char *p = data;
+
+	while ( len > 0 ) {
+		ssize_t r = pwrite(fd, p, len, offset);
+		if ( r <= 0 ) return 1;
+		p += r;
+		len -= r;
+		offset += r;
+	}
+	return 0;
+}
+
+
+static int read_all(int fd, void *data, size_t len, uint64_t offset)
+{
+	char *p = data;
+
+	while ( len > 0 ) {
+		ssize_t r = pread(fd, p, len, offset);
+		if ( r <= 0 ) return 1;
+		p += r;
+		len -= r;
+		offset += r;
+	}
+	return 0;
+}
+
+
+static int add_to_index(LogArchive *la, const char *name, uint64_t offset,
+                        uint64_t len)
+{
+	if ( la->n_files == la->max_files ) {
+		struct archive_file *n;
+		n = realloc(la->files, (la->max_files+1024)
+		                       *sizeof(struct archive_file));
+		if ( n == NULL ) return 1;
+		la->files = n;
+		la->max_files += 1024;
+	}
+
+	la->files[la->n_files].name = strdup(name);
+	if ( la->files[la->n_files].name == NULL ) return 1;
+	la->files[la->n_files].offset = offset;
+	la->files[la->n_files].len = len;
+	la->n_files++;
+	return 0;
+}
+
+
+LogArchive *log_archive_create(const char *filename)
+{
+	LogArchive *la;
+	uint32_t bom = LOG_ARCHIVE_BOM;
+
+	la = calloc(1, sizeof(LogArchive));
+	if ( la == NULL ) return NULL;
+
+	la->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ( la->fd == -1 ) {
+		ERROR("Failed to create log archive '%s'\n", filename);
+		free(la);
+		return NULL;
+	}
+
+	if ( write_all(la->fd, LOG_ARCHIVE_MAGIC, strlen(LOG_ARCHIVE_MAGIC), 0)
+	  || write_all(la->fd, &bom, sizeof(bom), strlen(LOG_ARCHIVE_MAGIC)) )
+	{
+		ERROR("Failed to write log archive '%s'\n", filename);
+		close(la->fd);
+		free(la);
+		return NULL;
+	}
+
+	la->writing = 1;
+	la->end = strlen(LOG_ARCHIVE_MAGIC) + sizeof(bom);
+	pthread_mutex_init(&la->lock, NULL);
+	return la;
+}
+
+
+/* Adds a file to the archive.  Only the space in the file and the index entry
+ * are claimed under the lock, so the data can be written in parallel */
+int log_archive_add(LogArchive *la, const char *name, const char *data,
+                    size_t len)
+{
+	uint64_t offset;
+	int r;
+
+	pthread_mutex_lock(&la->lock);
+	offset = la->end;
+	la->end += len;
+	r = add_to_index(la, name, offset, len);
+	pthread_mutex_unlock(&la->lock);
+	if ( r ) return 1;
+
+	return write_all(la->fd, data, len, offset);
+}
+
+
+static void free_archive(LogArchive *la)
+{
+	int i;
+	for ( i=0; i<la->n_files; i++ ) free(la->files[i].name);
+	free(la->files);
+	pthread_mutex_destroy(&la->lock);
+	close(la->fd);
+	free(la);
+}
+
+
+/* For an archive being written, writes the index.  In any case, frees
+ * everything. */
+int log_archive_close(LogArchive *la)
+{
+	struct archive_trailer t;
+	uint64_t pos;
+	int i;
+	int r = 0;
+
+	if ( la == NULL ) return 0;
+
+	if ( !la->writing ) {
+		free_archive(la);
+		return 0;
+	}
+
+	pos = la->end;
+	for ( i=0; i<la->n_files; i++ ) {
+		struct archive_index_entry e;
+		e.offset = la->files[i].offset;
+		e.len = la->files[i].len;
+		e.name_len = strlen(la->files[i].name);
+		e.pad = 0;
+		r |= write_all(la->fd, &e, sizeof(e), pos);
+		pos += sizeof(e);
+		r |= write_all(la->fd, la->files[i].name, e.name_len, pos);
+		pos += e.name_len;
+	}
+
+	t.index_offset = la->end;
+	t.n_files = la->n_files;
+	t.bom = LOG_ARCHIVE_BOM;
+	memcpy(t.end, LOG_ARCHIVE_END, 8);
+	r |= write_all(la->fd, &t, sizeof(t), pos);
+
+	if ( r ) ERROR("Failed to write log archive index\n");
+
+	free_archive(la);
+	return r;
+}
+
+
+LogArchive *log_archive_open(const char *filename)
+{
+	LogArchive *la;
+	struct archive_trailer t;
+	char magic[sizeof(LOG_ARCHIVE_MAGIC)];
+	off_t size;
+	uint64_t pos;
+	uint64_t i;
+
+	la = calloc(1, sizeof(LogArchive));
+	if ( la == NULL ) return NULL;
+	pthread_mutex_init(&la->lock, NULL);
+
+	la->fd = open(filename, O_RDONLY);
+	if ( la->fd == -1 ) {
+		ERROR("Failed to open log archive '%s'\n", filename);
+		pthread_mutex_destroy(&la->lock);
+		free(la);
+		return NULL;
+	}
+
+	size = lseek(la->fd, 0, SEEK_END);
+	if ( (size < (off_t)(strlen(LOG_ARCHIVE_MAGIC)+sizeof(t)))
+	  || read_all(la->fd, magic, strlen(LOG_ARCHIVE_MAGIC), 0)
+	  || (strncmp(magic, LOG_ARCHIVE_MAGIC, strlen(LOG_ARCHIVE_MAGIC)) != 0) )
+	{
+		ERROR("'%s' is not a log archive\n", filename);
+		free_archive(la);
+		return NULL;
+	}
+
+	if ( read_all(la->fd, &t, sizeof(t), size-sizeof(t))
+	  || (memcmp(t.end, LOG_ARCHIVE_END, 8) != 0) )
+	{
+		ERROR("Log archive '%s' has no index.  Perhaps it was not "
+		      "closed properly?\n", filename);
+		free_archive(la);
+		return NULL;
+	}
+
+	if ( t.bom != LOG_ARCHIVE_BOM ) {
+		ERROR("Log archive '%s' was written on a different kind of "
+		      "computer.\n", filename);
+		free_archive(la);
+		return NULL;
+	}
+
+	pos = t.index_offset;
+	for ( i=0; i<t.n_files; i++ ) {
+
+		struct archive_index_entry e;
+		char *name;
+
+		if ( read_all(la->fd, &e, sizeof(e), pos) ) break;
+		pos += sizeof(e);
+
+		name = malloc(e.name_len+1);
+		if ( name == NULL ) break;
+		if ( read_all(la->fd, name, e.name_len, pos) ) {
+			free(name);
+			break;
+		}
+		name[e.name_len] = '\0';
+		pos += e.name_len;
+
+		if ( add_to_index(la, name, e.offset, e.len) ) {
+			free(name);
+			break;
+		}
+		free(name);
+	}
+
+	if ( i < t.n_files ) {
+		ERROR("Failed to read index of log archive '%s'\n", filename);
+		free_archive(la);
+		return NULL;
+	}
+
+	return la;
+}
+
+
+int log_archive_num_files(LogArchive *la)
+{
+	return la->n_files;
+}
+
+
+const char *log_archive_file_name(LogArchive *la, int i)
+{
+	if ( (i < 0) || (i >= la->n_files) ) return NULL;
+	return la->files[i].name;
+}
+
+
+/* Returns the contents of file number 'i', which must be freed by the
+ * caller.  A terminating zero is added, but is not included in '*plen' */
+char *log_archive_read_file(LogArchive *la, int i, size_t *plen)
+{
+	char *data;
+	size_t len;
+
+	if ( (i < 0) || (i >= la->n_files) ) return NULL;
+
+	len = la->files[i].len;
+	data = malloc(len+1);
+	if ( data == NULL ) return NULL;
+
+	if ( read_all(la->fd, data, len, la->files[i].offset) ) {
+		free(data);
+		return NULL;
+	}
+	data[len] = '\0';
+
+	if ( plen != NULL ) *plen = len;
+	return data;
+}
+
+
+void set_log_archive(LogArchive *la)
+{
+	current_archive = la;
+}
+
+
+/* Opens log file 'name' in the log folder.  If an archive has been set with
+ * set_log_archive(), the log is written to memory instead and added to the
+ * archive by log_close().  Appending then just adds another file of the same
+ * name, which will be joined to the earlier ones when the archive is
+ * extracted. */
+FILE *log_open(struct log_file *lf, const char *log_folder, const char *name,
+               int append)
+{
+	lf->buf = NULL;
+	lf->len = 0;
+	lf->name = NULL;
+
+	if ( current_archive == NULL ) {
+
+		char *fn = malloc(strlen(log_folder)+strlen(name)+2);
+		if ( fn == NULL ) return NULL;
+		strcpy(fn, log_folder);
+		strcat(fn, "/");
+		strcat(fn, name);
+		lf->fh = fopen(fn, append ? "a" : "w");
+		free(fn);
+
+	} else {
+
+		lf->name = strdup(name);
+		if ( lf->name == NULL ) return NULL;
+		lf->fh = open_memstream(&lf->buf, &lf->len);
+		if ( lf->fh == NULL ) {
+			free(lf->name);
+			lf->name = NULL;
+		}
+
+	}
+
+	return lf->fh;
+}
+
+
+void log_close(struct log_file *lf)
+{
+	if ( lf->fh == NULL ) return;
+	fclose(lf->fh);
+	lf->fh = NULL;
+
+	if ( lf->name != NULL ) {
+		if ( log_archive_add(current_archive, lf->name, lf->buf,
+		                     lf->len) )
+		{
+			ERROR("Failed to add %s to log archive\n", lf->name);
+		}
+		free(lf->name);
+		free(lf->buf);
+		lf->name = NULL;
+		lf->buf = NULL;
+	}
+}
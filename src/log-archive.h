@@ -0,0 +1,72 @@
+/*
+ * log-archive.h
+ *
+ * Indexed container for partialator's log files
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef LOG_ARCHIVE_H
+#define LOG_ARCHIVE_H
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* A log archive holds many log files, one after the other, followed by an
+ * index.  Any number of threads can add files at the same time. */
+typedef struct _logarchive LogArchive;
+
+extern LogArchive *log_archive_create(const char *filename);
+extern int log_archive_add(LogArchive *la, const char *name,
+                           const char *data, size_t len);
+extern int log_archive_close(LogArchive *la);
+
+extern LogArchive *log_archive_open(const char *filename);
+extern int log_archive_num_files(LogArchive *la);
+extern const char *log_archive_file_name(LogArchive *la, int i);
+extern char *log_archive_read_file(LogArchive *la, int i, size_t *plen);
+
+/* Sets the archive which log_open() will use.  If it's NULL, which is the
+ * default, the logs are written as separate files in the log folder. */
+extern void set_log_archive(LogArchive *la);
+
+/* One log file being written, either directly or into the archive */
+struct log_file
+{
+	FILE *fh;
+	char *buf;
+	size_t len;
+	char *name;
+};
+
+extern FILE *log_open(struct log_file *lf, const char *log_folder,
+                      const char *name, int append);
+extern void log_close(struct log_file *lf);
+
+#endif	/* LOG_ARCHIVE_H */
@@ -47,6 +47,7 @@
 #include <datatemplate.h>
 #include <detgeom.h>
 #include <image.h>
+#include <thread-pool.h>
 
 #include "version.h"
 
@@ -63,14 +64,45 @@ static void show_help(const char *s)
 "     --badmap              Generate bad pixel map instead of geometry\n"
 "     --good-pixel=<n>      Value for good pixels in bad map.  Default 1.\n"
 "     --bad-pixel=<n>       Value for bad pixels in bad map.  Default 0.\n"
+"     --compress=<n>        Write chunked arrays, compressed with deflate at\n"
+"                            level <n> (1-9).  Default: no compression.\n"
+" -j <n>                    Use <n> threads.  Default 1.\n"
 );
 }
 
 
+/* Chunks of whole rows, about 1 MB each for float data */
+static hid_t array_dcpl(int width, int height, int compress)
+{
+	hid_t dcpl;
+	hsize_t chunk[2];
+
+	dcpl = H5Pcreate(H5P_DATASET_CREATE);
+	if ( dcpl < 0 ) return -1;
+	if ( compress == 0 ) return dcpl;
+
+	chunk[0] = 262144 / width;
+	if ( chunk[0] < 1 ) chunk[0] = 1;
+	if ( chunk[0] > height ) chunk[0] = height;
+	chunk[1] = width;
+
+	if ( (H5Pset_chunk(dcpl, 2, chunk) < 0)
+	  || (H5Pset_shuffle(dcpl) < 0)
+	  || (H5Pset_deflate(dcpl, compress) < 0) )
+	{
+		ERROR("Couldn't set up compression\n");
+		H5Pclose(dcpl);
+		return -1;
+	}
+
+	return dcpl;
+}
+
+
 static void create_array(hid_t gh, const char *name, void *vals,
-                         hid_t type, int width, int height)
+                         hid_t type, int width, int height, int compress)
 {
-	hid_t dh, sh;
+	hid_t dh, sh, dcpl;
 	herr_t r;
 	hsize_t size[2];
 	hsize_t max_size[2];
@@ -83,16 +115,25 @@ static void create_array(hid_t gh, const char *name, void *vals,
 	max_size[1] = width;
 	sh = H5Screate_simple(2, size, max_size);
 
+	dcpl = array_dcpl(width, height, compress);
+	if ( dcpl < 0 ) {
+		H5Sclose(sh);
+		return;
+	}
+
 	dh = H5Dcreate2(gh, name, type, sh,
-	                H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+	                H5P_DEFAULT, dcpl, H5P_DEFAULT);
+	H5Pclose(dcpl);
 	if ( dh < 0 ) {
 		ERROR("Couldn't create dataset\n");
+		H5Sclose(sh);
 		return;
 	}
 
 	r = H5Dwrite(dh, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, vals);
 	if ( r < 0 ) {
 		ERROR("Couldn't write data\n");
+		H5Sclose(sh);
 		H5Dclose(dh);
 		return;
 	}
@@ -132,7 +173,8 @@ static void create_scalar(hid_t gh, const char *name, float val)
 
 static void write_pixelmap_hdf5(const char *filename,
                                 float *x, float *y, float *z,
-                                int width, int height, float res)
+                                int width, int height, float res,
+                                int compress)
 {
 	hid_t fh;
 
@@ -142,9 +184,12 @@ static void write_pixelmap_hdf5(const char *filename,
 		return;
 	}
 
-	create_array(fh, "x", x, H5T_NATIVE_FLOAT, width, height);
-	create_array(fh, "y", y, H5T_NATIVE_FLOAT, width, height);
-	create_array(fh, "z", z, H5T_NATIVE_FLOAT, width, height);
+	create_array(fh, "x", x, H5T_NATIVE_FLOAT, width, height,
+	             compress);
+	create_array(fh, "y", y, H5T_NATIVE_FLOAT, width, height,
+	             compress);
+	create_array(fh, "z", z, H5T_NATIVE_FLOAT, width, height,
+	             compress);
 
 	create_scalar(fh, "res", res);
 
@@ -153,7 +198,7 @@ static void write_pixelmap_hdf5(const char *filename,
 
 
 static void write_badmap_hdf5(const char *filename, uint16_t *b,
-                              int width, int height)
+                              int width, int height, int compress)
 {
 	hid_t fh, gh;
 
@@ -165,12 +210,122 @@ static void write_badmap_hdf5(const char *filename, uint16_t *b,
 
 	gh = H5Gcreate(fh, "data", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
 
-	create_array(gh, "/data/data", b, H5T_STD_U16LE, width, height);
+	create_array(gh, "/data/data", b, H5T_STD_U16LE, width, height,
+	             compress);
 
 	H5Fclose(fh);
 }
 
 
+struct map_args
+{
+	const DataTemplate *dtempl;
+	struct image *image;
+	int w;
+	int h;
+	float *x;
+	float *y;
+	float *z;
+	uint16_t *b;
+	char *covered;
+	int good_pixel_val;
+	int bad_pixel_val;
+	int pn;
+	int fail;
+};
+
+
+struct map_job
+{
+	struct map_args *args;
+	int pn;
+	int fail;
+};
+
+
+static void *get_map_job(void *vqargs)
+{
+	struct map_args *qargs = vqargs;
+	struct map_job *job;
+
+	if ( qargs->pn >= qargs->image->detgeom->n_panels ) return NULL;
+
+	job = malloc(sizeof(struct map_job));
+	if ( job == NULL ) return NULL;
+	job->args = qargs;
+	job->pn = qargs->pn++;
+	job->fail = 0;
+	return job;
+}
+
+
+/* Fills in the maps for all the pixels of one panel */
+static void map_panel(void *vjob, int cookie)
+{
+	struct map_job *job = vjob;
+	struct map_args *args = job->args;
+	struct detgeom_panel *p = &args->image->detgeom->panels[job->pn];
+	int fs, ss;
+
+	for ( ss=0; ss<p->h; ss++ ) {
+	for ( fs=0; fs<p->w; fs++ ) {
+
+		double rx, ry;
+		double xs, ys;
+		float cfs, css;
+		float sfs, sss;
+		size_t idx;
+
+		/* Add half a pixel to fs and ss to get the fs,ss
+		 * coordinates of the CENTRE of the pixel */
+		cfs = fs + 0.5;
+		css = ss + 0.5;
+
+		/* Location of the pixel in the slab */
+		sfs = fs;
+		sss = ss;
+		if ( data_template_panel_to_file_coords(args->dtempl, job->pn,
+		                                        &sfs, &sss)
+		  || (sfs < 0) || (sfs >= args->w)
+		  || (sss < 0) || (sss >= args->h) )
+		{
+			job->fail = 1;
+			return;
+		}
+		idx = (size_t)sfs + (size_t)args->w*sss;
+
+		xs = cfs*p->fsx + css*p->ssx;
+		ys = cfs*p->fsy + css*p->ssy;
+
+		rx = (xs + p->cnx) * p->pixel_pitch;
+		ry = (ys + p->cny) * p->pixel_pitch;
+
+		args->x[idx] = rx;
+		args->y[idx] = ry;
+		args->z[idx] = 0.0;  /* 2D part only */
+
+		if ( args->image->bad[job->pn][fs + p->w*ss] ) {
+			args->b[idx] = args->bad_pixel_val;
+		} else {
+			args->b[idx] = args->good_pixel_val;
+		}
+
+		args->covered[idx] = 1;
+
+	}
+	}
+}
+
+
+static void finalise_map_job(void *vqargs, void *vjob)
+{
+	struct map_args *qargs = vqargs;
+	struct map_job *job = vjob;
+	if ( job->fail ) qargs->fail = 1;
+	free(job);
+}
+
+
 int main(int argc, char *argv[])
 {
 	int c;
@@ -178,14 +333,19 @@ int main(int argc, char *argv[])
 	char *output_file = NULL;
 	DataTemplate *dtempl;
 	struct detgeom *detgeom;
-	int fs, ss, w, h;
+	int w, h;
 	float *x, *y, *z;
 	uint16_t *b;
+	char *covered;
 	float res;
 	struct image *image;
 	int badmap = 0;
 	int good_pixel_val = 1;
 	int bad_pixel_val = 0;
+	int compress = 0;
+	int n_threads = 1;
+	struct map_args args;
+	size_t i;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -194,12 +354,13 @@ int main(int argc, char *argv[])
 		{"badmap",             0, &badmap,             1},
 		{"good-pixel",         1, NULL,              301},
 		{"bad-pixel",          1, NULL,              302},
+		{"compress",           1, NULL,              303},
 		{"version",            0, NULL,                2},
 		{0, 0, NULL, 0}
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "ho:",
+	while ((c = getopt_long(argc, argv, "ho:j:",
 	                        longopts, NULL)) != -1) {
 
 		switch (c) {
@@ -212,6 +373,15 @@ int main(int argc, char *argv[])
 			output_file = strdup(optarg);
 			break;
 
+			case 'j' :
+			if ( (sscanf(optarg, "%i", &n_threads) != 1)
+			  || (n_threads < 1) )
+			{
+				ERROR("Invalid value for -j\n");
+				return 1;
+			}
+			break;
+
 			case 2 :
 			printf("CrystFEL: %s\n",
 			       crystfel_version_string());
@@ -235,6 +405,15 @@ int main(int argc, char *argv[])
 			}
 			break;
 
+			case 303:
+			if ( (sscanf(optarg, "%d", &compress) != 1)
+			  || (compress < 1) || (compress > 9) )
+			{
+				ERROR("Invalid value for --compress\n");
+				return 1;
+			}
+			break;
+
 			case 0 :
 			break;
 
@@ -286,64 +465,56 @@ int main(int argc, char *argv[])
 	}
 	STATUS("Data slab size: %i x %i\n", w, h);
 
-	x = malloc(w*h*sizeof(float));
-	y = malloc(w*h*sizeof(float));
-	z = malloc(w*h*sizeof(float));
-	b = malloc(w*h*sizeof(uint16_t));
-	if ( (x==NULL) || (y==NULL) || (z==NULL) || (b==NULL) ) {
+	x = malloc((size_t)w*h*sizeof(float));
+	y = malloc((size_t)w*h*sizeof(float));
+	z = malloc((size_t)w*h*sizeof(float));
+	b = malloc((size_t)w*h*sizeof(uint16_t));
+	covered = calloc((size_t)w*h, 1);
+	if ( (x==NULL) || (y==NULL) || (z==NULL) || (b==NULL)
+	  || (covered==NULL) )
+	{
 		ERROR("Failed to allocate memory.\n");
 		return 1;
 	}
 
-	/* For every pixel in the slab ... */
-	for ( ss=0; ss<h; ss++ ) {
-	for ( fs=0; fs<w; fs++ ) {
-
-		double rx, ry;
-		double xs, ys;
-		float cfs, css;
-		int pn;
-		struct detgeom_panel *p;
-
-		/* Add half a pixel to fs and ss to get the fs,ss
-		 * coordinates of the CENTRE of the pixel */
-		cfs = fs + 0.5;
-		css = ss + 0.5;
+	/* Work through the panels in parallel.  Each panel occupies its own
+	 * part of the slab, so the jobs don't write to the same pixels. */
+	args.dtempl = dtempl;
+	args.image = image;
+	args.w = w;
+	args.h = h;
+	args.x = x;
+	args.y = y;
+	args.z = z;
+	args.b = b;
+	args.covered = covered;
+	args.good_pixel_val = good_pixel_val;
+	args.bad_pixel_val = bad_pixel_val;
+	args.pn = 0;
+	args.fail = 0;
+	run_threads(n_threads, map_panel, get_map_job, finalise_map_job,
+	            &args, 0, 0, 0, 0);
+
+	if ( args.fail || (args.pn < detgeom->n_panels) ) {
+		ERROR("Couldn't convert coordinates\n");
+		return 1;
+	}
 
-		if ( data_template_slabby_file_to_panel_coords(dtempl,
-		                                               &cfs, &css, &pn) )
-		{
+	/* Every pixel in the slab must belong to a panel */
+	for ( i=0; i<(size_t)w*h; i++ ) {
+		if ( !covered[i] ) {
 			ERROR("Couldn't convert coordinates\n");
 			return 1;
 		}
-
-		p = &detgeom->panels[pn];
-
-		xs = cfs*p->fsx + css*p->ssx;
-		ys = cfs*p->fsy + css*p->ssy;
-
-		rx = (xs + p->cnx) * p->pixel_pitch;
-		ry = (ys + p->cny) * p->pixel_pitch;
-
-		x[fs + w*ss] = rx;
-		y[fs + w*ss] = ry;
-		z[fs + w*ss] = 0.0;  /* 2D part only */
-
-		if ( image->bad[pn][fs + w*ss] ) {
-			b[fs + w*ss] = bad_pixel_val;
-		} else {
-			b[fs + w*ss] = good_pixel_val;
-		}
-
-	}
 	}
+	free(covered);
 
 	res = 1.0 / detgeom->panels[0].pixel_pitch;
 
 	if ( badmap ) {
-		write_badmap_hdf5(output_file, b, w, h);
+		write_badmap_hdf5(output_file, b, w, h, compress);
 	} else {
-		write_pixelmap_hdf5(output_file, x, y, z, w, h, res);
+		write_pixelmap_hdf5(output_file, x, y, z, w, h, res, compress);
 	}
 
 	data_template_free(dtempl);
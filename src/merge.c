@@ -32,6 +32,8 @@
 
 
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <assert.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_vector.h>
@@ -49,14 +51,32 @@
 #include "reflist-utils.h"
 #include "cell-utils.h"
 #include "merge.h"
+#include "thread-pool.h"
+#include "distribute.h"
 
 
+/* The crystals are divided into blocks, one per thread, and each block is
+ * merged separately into its own list without any locking.  The lists are
+ * then combined pairwise, always in the same order.  The result depends only
+ * on the number of blocks, not on which thread happens to do what.  With
+ * set_deterministic_reductions(), the number of blocks doesn't depend on the
+ * number of threads either.
+ *
+ * Several merged lists can be made at once, with each crystal going into any
+ * of them according to 'routes'.  Each block then has one partial merge for
+ * each output list. */
+
 struct merge_queue_args
 {
-	RefList *full;
-	pthread_rwlock_t full_lock;
 	struct crystal_refls *crystals;
+	int n_crystals;
+	RefList **partial;  /* Partial merge for each block and output list */
+	int n_blocks;
+	int n_lists;
+	const int *routes;  /* n_routes output lists per crystal, or NULL */
+	int n_routes;
 	int n_started;
+	int step;           /* Distance between the lists being combined */
 	double push_res;
 	int use_weak;
 	long long int n_reflections;
@@ -67,10 +87,9 @@ struct merge_queue_args
 struct merge_worker_args
 {
 	struct merge_queue_args *qargs;
-	Crystal *crystal;
-	RefList *refls;
-	int crystal_number;
-	int n_reflections;
+	int block;
+	int list;
+	long long int n_reflections;
 };
 
 
@@ -81,177 +100,163 @@ static void *create_merge_job(void *vqargs)
 
 	wargs = malloc(sizeof(struct merge_worker_args));
 	wargs->qargs = qargs;
-	wargs->crystal_number = qargs->n_started;
-	wargs->crystal = qargs->crystals[qargs->n_started].cr;
-	wargs->refls = qargs->crystals[qargs->n_started].refls;
-	qargs->n_started++;
+	wargs->block = qargs->n_started++;
+	wargs->n_reflections = 0;
 
 	return wargs;
 }
 
 
-static int alloc_contribs(struct reflection_contributions *c)
-{
-	c->contribs = realloc(c->contribs, c->max_contrib*sizeof(Reflection *));
-	c->contrib_crystals = realloc(c->contrib_crystals,
-	                              c->max_contrib*sizeof(Crystal *));
-	if ( c->contribs == NULL ) return 1;
-	if ( c->contrib_crystals == NULL ) return 1;
-	return 0;
-}
-
-
-/* Find reflection hkl in 'list', creating it if it's not there, under
- * protection of 'lock' and returning a locked reflection */
-static Reflection *get_locked_reflection(RefList *list, pthread_rwlock_t *lock,
-                                         signed int h, signed int k, signed  int l)
+/* Find reflection hkl in 'list', creating it if it's not there */
+static Reflection *get_merge_reflection(RefList *list, signed int h,
+                                        signed int k, signed int l)
 {
 	Reflection *f;
 
-	pthread_rwlock_rdlock(lock);
 	f = find_refl(list, h, k, l);
-	if ( f == NULL ) {
+	if ( f != NULL ) return f;
 
-		/* Swap read lock for write lock */
-		pthread_rwlock_unlock(lock);
-		pthread_rwlock_wrlock(lock);
+	f = add_refl(list, h, k, l);
+	set_intensity(f, 0.0);
+	set_temp1(f, 0.0);
+	set_temp2(f, 0.0);
+	return f;
+}
 
-		/* In the gap between the unlock and the wrlock, the
-		 * reflection might have been created by another thread.
-		 * So, we must check again */
-		f = find_refl(list, h, k, l);
-		if ( f == NULL ) {
 
-			struct reflection_contributions *c;
-
-			f = add_refl(list, h, k, l);
-			lock_reflection(f);
-			pthread_rwlock_unlock(lock);
-			set_intensity(f, 0.0);
-			set_temp1(f, 0.0);
-			set_temp2(f, 0.0);
-
-			c = malloc(sizeof(struct reflection_contributions));
-			if ( c != NULL ) {
-				c->n_contrib = 0;
-				c->max_contrib = 32;
-				c->contribs = NULL;
-				c->contrib_crystals = NULL;
-				if ( alloc_contribs(c) ) {
-					set_contributions(f, NULL);
-				} else {
-					set_contributions(f, c);
-				}
-			} else {
-				set_contributions(f, NULL);
-			}
+/* Should 'refl' be merged?  The resolution cutoff is checked separately. */
+static int merge_accepts(Reflection *refl, int use_weak, int ln_merge)
+{
+	if ( get_partiality(refl) < MIN_PART_MERGE ) return 0;
+	if ( isnan(get_esd_intensity(refl)) ) return 0;
 
-		} else {
-			/* Someone else created it */
-			lock_reflection(f);
-			pthread_rwlock_unlock(lock);
-		}
+	if ( !use_weak || ln_merge ) {
 
-	} else {
+		if (get_intensity(refl) < 3.0*fabs(get_esd_intensity(refl))) {
+			return 0;
+		}
 
-		lock_reflection(f);
-		pthread_rwlock_unlock(lock);
+		if ( get_flag(refl) ) return 0;
 
 	}
 
-	return f;
+	return 1;
 }
 
 
-static void run_merge_job(void *vwargs, int cookie)
+/* Merges one crystal into each of the lists in 'partial' given by 'routes'.
+ * If 'routes' is NULL, the crystal goes into partial[0] only. */
+static long long int merge_crystal(RefList **partial, const int *routes,
+                                   Crystal *cr, RefList *refls,
+                                   struct merge_queue_args *qargs)
 {
-	struct merge_worker_args *wargs = vwargs;
-	Crystal *cr = wargs->crystal;
-	RefList *full = wargs->qargs->full;
-	double push_res = wargs->qargs->push_res;
-	int ln_merge = wargs->qargs->ln_merge;
+	double push_res = qargs->push_res;
+	int ln_merge = qargs->ln_merge;
 	Reflection *refl;
 	RefListIterator *iter;
 	double G, B;
-
-	wargs->n_reflections = 0;
+	struct cell_rmetric m;
+	long long int n_reflections = 0;
+	int n_routes = (routes == NULL) ? 1 : qargs->n_routes;
+	Reflection *fs[n_routes];
 
 	/* If this crystal's scaling was dodgy, it doesn't contribute to the
 	 * merged intensities */
-	if ( crystal_get_user_flag(cr) != 0 ) return;
+	if ( crystal_get_user_flag(cr) != 0 ) return 0;
 
 	G = crystal_get_osf(cr);
 	B = crystal_get_Bfac(cr);
+	if ( cell_get_reciprocal_metric(crystal_get_cell(cr), &m) ) return 0;
 
-	for ( refl = first_refl(wargs->refls, &iter);
+	for ( refl = first_refl(refls, &iter);
 	      refl != NULL;
 	      refl = next_refl(refl, iter) )
 	{
-		Reflection *f;
 		signed int h, k, l;
-		double mean, sumweight, M2, temp, delta, R;
-		double res, w;
-		struct reflection_contributions *c;
+		double res, w, val;
+		int j;
 
-		if ( get_partiality(refl) < MIN_PART_MERGE ) continue;
-		if ( isnan(get_esd_intensity(refl)) ) continue;
+		if ( !merge_accepts(refl, qargs->use_weak, ln_merge) ) continue;
 
-		if ( !wargs->qargs->use_weak || ln_merge ) {
-
-			if (get_intensity(refl) < 3.0*fabs(get_esd_intensity(refl))) {
+		get_indices(refl, &h, &k, &l);
+		for ( j=0; j<n_routes; j++ ) {
+			int li = (routes == NULL) ? 0 : routes[j];
+			if ( li < 0 ) {
+				fs[j] = NULL;
 				continue;
 			}
-
-			if ( get_flag(refl) ) continue;
-
+			fs[j] = get_merge_reflection(partial[li], h, k, l);
 		}
 
-		get_indices(refl, &h, &k, &l);
-		f = get_locked_reflection(full, &wargs->qargs->full_lock,
-		                          h, k, l);
-
-		mean = get_intensity(f);
-		sumweight = get_temp1(f);
-		M2 = get_temp2(f);
-
-		res = resolution(crystal_get_cell(cr), h, k, l);
+		res = resolution_fast(&m, h, k, l);
 
 		if ( 2.0*res > crystal_get_resolution_limit(cr)+push_res ) {
-			unlock_reflection(f);
 			continue;
 		}
 
 		/* Reflections count less the more they have to be scaled up */
 		w = get_partiality(refl) / correct_reflection_nopart(1.0, refl, G, B, res);
 
-		/* Running mean and variance calculation */
-		temp = w + sumweight;
-		if ( ln_merge ) {
-			delta = log(correct_reflection(get_intensity(refl), refl, G, B, res)) - mean;
-		} else {
-			delta = correct_reflection(get_intensity(refl), refl, G,  B, res) - mean;
+		val = correct_reflection(get_intensity(refl), refl, G, B, res);
+		if ( ln_merge ) val = log(val);
+
+		for ( j=0; j<n_routes; j++ ) {
+
+			Reflection *f = fs[j];
+			double mean, sumweight, M2, temp, delta, R;
+
+			if ( f == NULL ) continue;
+
+			mean = get_intensity(f);
+			sumweight = get_temp1(f);
+			M2 = get_temp2(f);
+
+			/* Running mean and variance calculation */
+			temp = w + sumweight;
+			delta = val - mean;
+			R = delta * w / temp;
+			set_intensity(f, mean + R);
+			set_temp2(f, M2 + sumweight * delta * R);
+			set_temp1(f, temp);
+			set_redundancy(f, get_redundancy(f)+1);
+
 		}
-		R = delta * w / temp;
-		set_intensity(f, mean + R);
-		set_temp2(f, M2 + sumweight * delta * R);
-		set_temp1(f, temp);
-		set_redundancy(f, get_redundancy(f)+1);
-
-		/* Record this contribution */
-		c = get_contributions(f);
-		if ( c != NULL ) {
-			c->contribs[c->n_contrib] = refl;
-			c->contrib_crystals[c->n_contrib++] = cr;
-			if ( c->n_contrib == c->max_contrib ) {
-				c->max_contrib += 64;
-				alloc_contribs(c);
-			}
-		} /* else, too bad! */
 
-		unlock_reflection(f);
+		n_reflections++;
+
+	}
+
+	return n_reflections;
+}
 
-		wargs->n_reflections++;
 
+static void run_merge_job(void *vwargs, int cookie)
+{
+	struct merge_worker_args *wargs = vwargs;
+	struct merge_queue_args *qargs = wargs->qargs;
+	RefList **partial = &qargs->partial[wargs->block*qargs->n_lists];
+	int i, start, end;
+
+	for ( i=0; i<qargs->n_lists; i++ ) {
+		partial[i] = reflist_new_with_flags(REFLIST_ARENA
+		                                    | REFLIST_NO_LOCKS);
+		if ( partial[i] == NULL ) return;
+	}
+
+	start = (long long int)wargs->block * qargs->n_crystals
+	        / qargs->n_blocks;
+	end = (long long int)(wargs->block+1) * qargs->n_crystals
+	      / qargs->n_blocks;
+
+	for ( i=start; i<end; i++ ) {
+		const int *routes = NULL;
+		if ( qargs->routes != NULL ) {
+			routes = &qargs->routes[i*qargs->n_routes];
+		}
+		wargs->n_reflections += merge_crystal(partial, routes,
+		                                      qargs->crystals[i].cr,
+		                                      qargs->crystals[i].refls,
+		                                      qargs);
 	}
 }
 
@@ -265,37 +270,200 @@ static void finalise_merge_job(void *vqargs, void *vwargs)
 }
 
 
-RefList *merge_intensities(struct crystal_refls *crystals, int n,
-                           int n_threads, int min_meas,
-                           double push_res, int use_weak, int ln_merge)
+/* Adds a mean, total weight and sum of squared differences (M2) to the ones
+ * in 'f'.  The means and variances are combined in the same way as the
+ * running calculation in merge_crystal(), as if the new contributions came
+ * afterwards. */
+static void combine_accumulators(Reflection *f, double mean, double wb,
+                                 double M2, int red)
+{
+	double wa, w, delta;
+
+	wa = get_temp1(f);
+	w = wa + wb;
+	delta = mean - get_intensity(f);
+	set_intensity(f, get_intensity(f) + delta*wb/w);
+	set_temp2(f, get_temp2(f) + M2 + delta*delta*wa*wb/w);
+	set_temp1(f, w);
+	set_redundancy(f, get_redundancy(f)+red);
+}
+
+
+/* Adds the partial merge in 'from' to the one in 'to' */
+static void combine_partials(RefList *to, RefList *from)
 {
-	RefList *full;
-	RefList *full2;
-	struct merge_queue_args qargs;
 	Reflection *refl;
 	RefListIterator *iter;
 
-	if ( n == 0 ) return NULL;
+	for ( refl = first_refl(from, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		Reflection *f;
 
-	full = reflist_new();
+		get_indices(refl, &h, &k, &l);
+		f = find_refl(to, h, k, l);
 
-	qargs.full = full;
-	qargs.n_started = 0;
-	qargs.crystals = crystals;
-	qargs.push_res = push_res;
-	qargs.use_weak = use_weak;
-	qargs.n_reflections = 0;
-	qargs.ln_merge = ln_merge;
-	pthread_rwlock_init(&qargs.full_lock, NULL);
+		if ( f == NULL ) {
+			f = add_refl(to, h, k, l);
+			copy_data(f, refl);
+			continue;
+		}
 
-	run_threads(n_threads, run_merge_job, create_merge_job,
-	            finalise_merge_job, &qargs, n, 0, 0, 0);
+		if ( get_temp1(refl) == 0.0 ) continue;
+		combine_accumulators(f, get_intensity(refl), get_temp1(refl),
+		                     get_temp2(refl), get_redundancy(refl));
+	}
+}
+
+
+/* The accumulators for one reflection, for sending to other ranks */
+struct packed_accum
+{
+	double mean;
+	double sumweight;
+	double M2;
+	int32_t h, k, l;
+	int32_t red;
+};
+
+
+/* When running across several ranks, changes the accumulators in 'list' to
+ * the ones for the crystals on all ranks together.  The ranks are combined
+ * in order, so every rank gets exactly the same result. */
+static int merge_across_ranks(RefList *list)
+{
+	struct packed_accum *packed;
+	struct packed_accum *all;
+	size_t lens[dist_size()];
+	RefList *total;
+	Reflection *refl;
+	RefListIterator *iter;
+	int i, r;
 
-	pthread_rwlock_destroy(&qargs.full_lock);
+	packed = malloc(num_reflections(list)*sizeof(struct packed_accum)+1);
+	if ( packed == NULL ) return 1;
 
-	/* Calculate ESDs from variances, including only reflections with
-	 * enough measurements */
-	full2 = reflist_new();
+	for ( refl = first_refl(list, &iter), i=0;
+	      refl != NULL;
+	      refl = next_refl(refl, iter), i++ )
+	{
+		signed int h, k, l;
+		get_indices(refl, &h, &k, &l);
+		packed[i].h = h;
+		packed[i].k = k;
+		packed[i].l = l;
+		packed[i].mean = get_intensity(refl);
+		packed[i].sumweight = get_temp1(refl);
+		packed[i].M2 = get_temp2(refl);
+		packed[i].red = get_redundancy(refl);
+	}
+
+	all = dist_allgather(packed, i*sizeof(struct packed_accum), lens);
+	free(packed);
+	if ( all == NULL ) return 1;
+
+	total = reflist_new_with_flags(REFLIST_ARENA | REFLIST_NO_LOCKS);
+	if ( total == NULL ) {
+		free(all);
+		return 1;
+	}
+
+	packed = all;
+	for ( r=0; r<dist_size(); r++ ) {
+
+		size_t n = lens[r] / sizeof(struct packed_accum);
+		size_t j;
+
+		for ( j=0; j<n; j++ ) {
+
+			struct packed_accum *p = &packed[j];
+			Reflection *f = find_refl(total, p->h, p->k, p->l);
+
+			if ( f == NULL ) {
+				f = add_refl(total, p->h, p->k, p->l);
+				set_intensity(f, p->mean);
+				set_temp1(f, p->sumweight);
+				set_temp2(f, p->M2);
+				set_redundancy(f, p->red);
+				continue;
+			}
+
+			if ( p->sumweight == 0.0 ) continue;
+			combine_accumulators(f, p->mean, p->sumweight, p->M2,
+			                     p->red);
+		}
+
+		packed += n;
+	}
+	free(all);
+
+	for ( refl = first_refl(total, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		Reflection *f;
+
+		get_indices(refl, &h, &k, &l);
+		f = get_merge_reflection(list, h, k, l);
+		set_intensity(f, get_intensity(refl));
+		set_temp1(f, get_temp1(refl));
+		set_temp2(f, get_temp2(refl));
+		set_redundancy(f, get_redundancy(refl));
+	}
+
+	reflist_free(total);
+	return 0;
+}
+
+
+static void *create_combine_job(void *vqargs)
+{
+	struct merge_worker_args *wargs;
+	struct merge_queue_args *qargs = vqargs;
+
+	wargs = malloc(sizeof(struct merge_worker_args));
+	wargs->qargs = qargs;
+	wargs->block = 2 * qargs->step * (qargs->n_started / qargs->n_lists);
+	wargs->list = qargs->n_started % qargs->n_lists;
+	qargs->n_started++;
+
+	return wargs;
+}
+
+
+static void run_combine_job(void *vwargs, int cookie)
+{
+	struct merge_worker_args *wargs = vwargs;
+	struct merge_queue_args *qargs = wargs->qargs;
+	int ito = wargs->block*qargs->n_lists + wargs->list;
+	int ifrom = (wargs->block+qargs->step)*qargs->n_lists + wargs->list;
+	RefList *to = qargs->partial[ito];
+	RefList *from = qargs->partial[ifrom];
+
+	if ( (to != NULL) && (from != NULL) ) combine_partials(to, from);
+	reflist_free(from);
+	qargs->partial[ifrom] = NULL;
+}
+
+
+static void finalise_combine_job(void *vqargs, void *vwargs)
+{
+	free(vwargs);
+}
+
+
+/* Calculates ESDs from variances, including only reflections with enough
+ * measurements.  Frees 'full' and returns the final list. */
+static RefList *finalise_merge(RefList *full, int min_meas, int ln_merge)
+{
+	RefList *full2;
+	Reflection *refl;
+	RefListIterator *iter;
+
+	full2 = reflist_new_arena();
 	if ( full2 == NULL ) return NULL;
 	for ( refl = first_refl(full, &iter);
 	      refl != NULL;
@@ -330,23 +498,281 @@ RefList *merge_intensities(struct crystal_refls *crystals, int n,
 			r2 = add_refl(full2, h, k, l);
 			copy_data(r2, refl);
 
-		} else {
-
-			/* We do not need the contribution list any more */
-			struct reflection_contributions *c;
-			c = get_contributions(refl);
-			free(c->contribs);
-			free(c->contrib_crystals);
-			free(c);
-
 		}
 	}
 
 	reflist_free(full);
+
+	/* The merged list will be searched many times during scaling and
+	 * post-refinement, but not altered */
+	reflist_freeze(full2);
+
 	return full2;
 }
 
 
+static RefList **merge_lists(struct crystal_refls *crystals, int n,
+                             int n_threads, int min_meas, double push_res,
+                             int use_weak, int ln_merge, const int *routes,
+                             int n_routes, int n_lists)
+{
+	struct merge_queue_args qargs;
+	RefList **out;
+	int i;
+
+	if ( n == 0 ) return NULL;
+
+	qargs.n_blocks = reduction_parts(n_threads);
+	if ( qargs.n_blocks > n ) qargs.n_blocks = n;
+	if ( qargs.n_blocks < 1 ) qargs.n_blocks = 1;
+	qargs.partial = calloc(qargs.n_blocks*n_lists, sizeof(RefList *));
+	if ( qargs.partial == NULL ) return NULL;
+
+	qargs.n_started = 0;
+	qargs.crystals = crystals;
+	qargs.n_crystals = n;
+	qargs.n_lists = n_lists;
+	qargs.routes = routes;
+	qargs.n_routes = n_routes;
+	qargs.push_res = push_res;
+	qargs.use_weak = use_weak;
+	qargs.n_reflections = 0;
+	qargs.ln_merge = ln_merge;
+
+	run_threads(n_threads, run_merge_job, create_merge_job,
+	            finalise_merge_job, &qargs, qargs.n_blocks, 0, 0, 0);
+
+	/* Combine the partial merges as a binary tree, for all the output
+	 * lists at the same time */
+	for ( qargs.step=1; qargs.step<qargs.n_blocks; qargs.step*=2 ) {
+		int n_pairs = (qargs.n_blocks - qargs.step + 2*qargs.step - 1)
+		              / (2*qargs.step);
+		qargs.n_started = 0;
+		run_threads(n_threads, run_combine_job, create_combine_job,
+		            finalise_combine_job, &qargs, n_pairs*n_lists,
+		            0, 0, 0);
+	}
+
+	out = calloc(n_lists, sizeof(RefList *));
+	if ( out == NULL ) {
+		for ( i=0; i<n_lists; i++ ) reflist_free(qargs.partial[i]);
+		free(qargs.partial);
+		return NULL;
+	}
+
+	for ( i=0; i<n_lists; i++ ) {
+		if ( qargs.partial[i] == NULL ) continue;
+		if ( (dist_size() > 1)
+		  && merge_across_ranks(qargs.partial[i]) )
+		{
+			ERROR("Failed to combine merged intensities from all "
+			      "ranks\n");
+			exit(1);
+		}
+		out[i] = finalise_merge(qargs.partial[i], min_meas, ln_merge);
+	}
+	free(qargs.partial);
+
+	return out;
+}
+
+
+RefList *merge_intensities(struct crystal_refls *crystals, int n,
+                           int n_threads, int min_meas,
+                           double push_res, int use_weak, int ln_merge)
+{
+	RefList **out;
+	RefList *full;
+
+	out = merge_lists(crystals, n, n_threads, min_meas, push_res,
+	                  use_weak, ln_merge, NULL, 1, 1);
+	if ( out == NULL ) return NULL;
+
+	full = out[0];
+	free(out);
+	return full;
+}
+
+
+RefList **merge_intensities_multi(struct crystal_refls *crystals, int n,
+                                  int n_threads, int min_meas,
+                                  double push_res, int use_weak, int ln_merge,
+                                  const int *routes, int n_routes, int n_lists)
+{
+	return merge_lists(crystals, n, n_threads, min_meas, push_res,
+	                   use_weak, ln_merge, routes, n_routes, n_lists);
+}
+
+
+static unsigned int row_hash(const Reflection *refl, unsigned int mask)
+{
+	uintptr_t p = (uintptr_t)refl;
+	return ((p >> 4) * 2654435761u) & mask;
+}
+
+
+int merge_contributions_row(const struct merge_contributions *mc,
+                            const Reflection *refl)
+{
+	unsigned int h = row_hash(refl, mc->hash_mask);
+
+	while ( mc->hash_rows[h] != -1 ) {
+		if ( mc->rows[mc->hash_rows[h]] == refl ) {
+			return mc->hash_rows[h];
+		}
+		h = (h+1) & mc->hash_mask;
+	}
+
+	return -1;
+}
+
+
+/* Calls 'func' for each observation from 'crystals' which would be merged into
+ * a reflection in 'full', in the same order as merge_intensities() */
+static void for_each_contribution(struct merge_contributions *mc,
+                                  struct crystal_refls *crystals, int n,
+                                  RefList *full, double push_res,
+                                  int use_weak, int ln_merge,
+                                  void (*func)(struct merge_contributions *mc,
+                                               int row, Reflection *refl,
+                                               Crystal *cr))
+{
+	int i;
+
+	for ( i=0; i<n; i++ ) {
+
+		Crystal *cr = crystals[i].cr;
+		Reflection *refl;
+		RefListIterator *iter;
+		const Reflection **matches;
+		struct cell_rmetric m;
+		int j;
+
+		if ( crystal_get_user_flag(cr) != 0 ) continue;
+		if ( cell_get_reciprocal_metric(crystal_get_cell(cr), &m) ) continue;
+
+		matches = reflist_match(crystals[i].refls, full);
+		if ( matches == NULL ) continue;
+
+		for ( refl = first_refl(crystals[i].refls, &iter), j=0;
+		      refl != NULL;
+		      refl = next_refl(refl, iter), j++ )
+		{
+			signed int h, k, l;
+			double res;
+			int row;
+
+			if ( matches[j] == NULL ) continue;
+			if ( !merge_accepts(refl, use_weak, ln_merge) ) continue;
+
+			get_indices(refl, &h, &k, &l);
+			res = resolution_fast(&m, h, k, l);
+			if ( 2.0*res > crystal_get_resolution_limit(cr)+push_res ) {
+				continue;
+			}
+
+			row = merge_contributions_row(mc, matches[j]);
+			if ( row >= 0 ) func(mc, row, refl, cr);
+		}
+	}
+}
+
+
+static void count_contribution(struct merge_contributions *mc, int row,
+                               Reflection *refl, Crystal *cr)
+{
+	mc->offsets[row+1]++;
+}
+
+
+static void add_contribution(struct merge_contributions *mc, int row,
+                             Reflection *refl, Crystal *cr)
+{
+	long long int pos = mc->offsets[row] + mc->n_contrib[row]++;
+	mc->contribs[pos] = refl;
+	mc->contrib_crystals[pos] = cr;
+}
+
+
+/* Finds the observations which were merged into each reflection in 'full',
+ * which should have come from merge_intensities() with the same crystals and
+ * options.  This is done separately from merging, and only when needed,
+ * because most of the time the contributions are not used. */
+struct merge_contributions *merge_contributions(struct crystal_refls *crystals,
+                                                int n, RefList *full,
+                                                double push_res, int use_weak,
+                                                int ln_merge)
+{
+	struct merge_contributions *mc;
+	Reflection *refl;
+	RefListIterator *iter;
+	unsigned int hash_size;
+	long long int total;
+	int i;
+
+	mc = calloc(1, sizeof(struct merge_contributions));
+	if ( mc == NULL ) return NULL;
+
+	mc->n_rows = num_reflections(full);
+	hash_size = 1024;
+	while ( hash_size < 2*(unsigned int)mc->n_rows ) hash_size *= 2;
+	mc->hash_mask = hash_size - 1;
+
+	mc->rows = malloc(mc->n_rows*sizeof(Reflection *)+1);
+	mc->hash_rows = malloc(hash_size*sizeof(int));
+	mc->offsets = calloc(mc->n_rows+1, sizeof(long long int));
+	mc->n_contrib = calloc(mc->n_rows+1, sizeof(int));
+	if ( (mc->rows == NULL) || (mc->hash_rows == NULL)
+	  || (mc->offsets == NULL) || (mc->n_contrib == NULL) )
+	{
+		free_merge_contributions(mc);
+		return NULL;
+	}
+
+	for ( i=0; i<hash_size; i++ ) mc->hash_rows[i] = -1;
+	for ( refl = first_refl(full, &iter), i=0;
+	      refl != NULL;
+	      refl = next_refl(refl, iter), i++ )
+	{
+		unsigned int h = row_hash(refl, mc->hash_mask);
+		while ( mc->hash_rows[h] != -1 ) h = (h+1) & mc->hash_mask;
+		mc->hash_rows[h] = i;
+		mc->rows[i] = refl;
+	}
+
+	/* Count the contributions to each reflection, then fill them in */
+	for_each_contribution(mc, crystals, n, full, push_res, use_weak,
+	                      ln_merge, count_contribution);
+	for ( i=0; i<mc->n_rows; i++ ) mc->offsets[i+1] += mc->offsets[i];
+	total = mc->offsets[mc->n_rows];
+
+	mc->contribs = malloc(total*sizeof(Reflection *)+1);
+	mc->contrib_crystals = malloc(total*sizeof(Crystal *)+1);
+	if ( (mc->contribs == NULL) || (mc->contrib_crystals == NULL) ) {
+		free_merge_contributions(mc);
+		return NULL;
+	}
+
+	for_each_contribution(mc, crystals, n, full, push_res, use_weak,
+	                      ln_merge, add_contribution);
+
+	return mc;
+}
+
+
+void free_merge_contributions(struct merge_contributions *mc)
+{
+	if ( mc == NULL ) return;
+	free(mc->rows);
+	free(mc->hash_rows);
+	free(mc->offsets);
+	free(mc->n_contrib);
+	free(mc->contribs);
+	free(mc->contrib_crystals);
+	free(mc);
+}
+
+
 /* Correct 'val' (probably an intensity from one pattern, maybe an e.s.d.)
  * for scaling and Lorentz factors but not partiality nor polarisation */
 double correct_reflection_nopart(double val, Reflection *refl, double osf,
@@ -377,24 +803,29 @@ double residual(RefList *list, Crystal *cr, const RefList *full, int free,
 	double den = 0.0;
 	double G = crystal_get_osf(cr);
 	double B = crystal_get_Bfac(cr);
-	UnitCell *cell = crystal_get_cell(cr);
+	struct cell_rmetric m;
+	const Reflection **matches;
+	int i;
+
+	if ( cell_get_reciprocal_metric(crystal_get_cell(cr), &m) ) return NAN;
+	matches = reflist_match(list, full);
+	if ( matches == NULL ) return NAN;
 
-	for ( refl = first_refl(list, &iter);
+	for ( refl = first_refl(list, &iter), i=0;
 	      refl != NULL;
-	      refl = next_refl(refl, iter) )
+	      refl = next_refl(refl, iter), i++ )
 	{
 		double w, res;
 		signed int h, k, l;
-		Reflection *match;
+		const Reflection *match = matches[i];
 		double I_full;
 		double int1, pobs, pcalc;
 
 		if ( free != get_flag(refl) ) continue;
+		if ( match == NULL ) continue;
 
 		get_indices(refl, &h, &k, &l);
-		res = resolution(cell, h, k, l);
-		match = find_refl(full, h, k, l);
-		if ( match == NULL ) continue;
+		res = resolution_fast(&m, h, k, l);
 		I_full = get_intensity(match);
 
 		if ( get_redundancy(match) < 2 ) continue;
@@ -433,6 +864,13 @@ double log_residual(RefList *list, Crystal *cr,
 	RefListIterator *iter;
 	int n_used = 0;
 	FILE *fh = NULL;
+	struct cell_rmetric m;
+	const Reflection **matches;
+	int i;
+
+	if ( cell_get_reciprocal_metric(crystal_get_cell(cr), &m) ) return NAN;
+	matches = reflist_match(list, full);
+	if ( matches == NULL ) return NAN;
 
 	G = crystal_get_osf(cr);
 	B = crystal_get_Bfac(cr);
@@ -443,28 +881,27 @@ double log_residual(RefList *list, Crystal *cr,
 		}
 	}
 
-	for ( refl = first_refl(list, &iter);
+	for ( refl = first_refl(list, &iter), i=0;
 	      refl != NULL;
-	      refl = next_refl(refl, iter) )
+	      refl = next_refl(refl, iter), i++ )
 	{
 		double p, L, s, w;
 		signed int h, k, l;
-		Reflection *match;
+		const Reflection *match = matches[i];
 		double esd, I_full, I_partial;
 		double fx;
 
 		if ( free && !get_flag(refl) ) continue;
+		if ( match == NULL ) continue;
 
 		get_indices(refl, &h, &k, &l);
-		match = find_refl(full, h, k, l);
-		if ( match == NULL ) continue;
 
 		p = get_partiality(refl);
 		L = get_lorentz(refl);
 		I_partial = get_intensity(refl);
 		I_full = get_intensity(match);
 		esd = get_esd_intensity(refl);
-		s = resolution(crystal_get_cell(cr), h, k, l);
+		s = resolution_fast(&m, h, k, l);
 
 		if ( I_partial <= 3.0*esd ) continue; /* Also because of log */
 		if ( get_redundancy(match) < 2 ) continue;
@@ -491,6 +928,198 @@ double log_residual(RefList *list, Crystal *cr,
 
 
 /* Has to match run_merge_job to be useful */
+/* Sets up the arrays for up to n_max reflections */
+static int join_alloc(struct joined_refls *j, int n_max)
+{
+	char *mem;
+
+	/* One block for all the arrays, with the doubles first for alignment.
+	 * This is re-used for every crystal handled by the same thread. */
+	mem = thread_pool_scratch(n_max*(7*sizeof(double) + 2*sizeof(int)) + 1);
+	if ( mem == NULL ) return 1;
+	j->s2 = (double *)mem;
+	j->logterm = j->s2 + n_max;
+	j->I_partial = j->logterm + n_max;
+	j->esd = j->I_partial + n_max;
+	j->I_full = j->esd + n_max;
+	j->p = j->I_full + n_max;
+	j->L = j->p + n_max;
+	j->red = (int *)(j->L + n_max);
+	j->flag = j->red + n_max;
+	j->n_total = n_max;
+	j->n = 0;
+
+	return 0;
+}
+
+
+static void join_one(struct joined_refls *j, const Reflection *refl,
+                     const Reflection *match, const struct cell_rmetric *m)
+{
+	signed int h, k, l;
+	double s, p, L, Ip, If;
+	int n = j->n;
+
+	get_indices(refl, &h, &k, &l);
+
+	s = resolution_fast(m, h, k, l);
+	p = get_partiality(refl);
+	L = get_lorentz(refl);
+	Ip = get_intensity(refl);
+	If = get_intensity(match);
+
+	j->s2[n] = s*s;
+	j->p[n] = p;
+	j->L[n] = L;
+	j->I_partial[n] = Ip;
+	j->I_full[n] = If;
+	j->esd[n] = get_esd_intensity(refl);
+	j->red[n] = get_redundancy(match);
+	j->flag[n] = get_flag(refl);
+
+	/* The residual calculations skip the reflections for which
+	 * this can't be calculated */
+	if ( (p > 0.0) && (Ip > 0.0) && (If > 0.0) ) {
+		j->logterm[n] = log(p) + log(If) - log(Ip) - log(L);
+	} else {
+		j->logterm[n] = NAN;
+	}
+
+	j->n++;
+}
+
+
+int join_crystal_refls(RefList *list, Crystal *cr, const RefList *full,
+                       struct joined_refls *j)
+{
+	const Reflection *refl;
+	RefListIterator *iter;
+	struct cell_rmetric m;
+	const Reflection **matches;
+	int i;
+
+	if ( cell_get_reciprocal_metric(crystal_get_cell(cr), &m) ) return 1;
+	matches = reflist_match(list, full);
+	if ( matches == NULL ) return 1;
+
+	if ( join_alloc(j, num_reflections(list)) ) return 1;
+
+	for ( refl = first_refl_const(list, &iter), i=0;
+	      refl != NULL;
+	      refl = next_refl_const(refl, iter), i++ )
+	{
+		if ( matches[i] == NULL ) continue;
+		join_one(j, refl, matches[i], &m);
+	}
+
+	return 0;
+}
+
+
+/* The same as join_crystal_refls() after reindexing the reflections with
+ * operation "idx" of "amb", without actually making the reindexed list.
+ * Reindexing the reflections and the unit cell together leaves everything
+ * except the indices as it was, so only the matches with "full" are
+ * different. */
+int join_crystal_refls_reindexed(RefList *list, Crystal *cr,
+                                 const RefList *full, const SymOpList *amb,
+                                 const SymOpList *sym, int idx,
+                                 struct joined_refls *j)
+{
+	const Reflection *refl;
+	RefListIterator *iter;
+	struct cell_rmetric m;
+
+	if ( cell_get_reciprocal_metric(crystal_get_cell(cr), &m) ) return 1;
+	if ( join_alloc(j, num_reflections(list)) ) return 1;
+
+	for ( refl = first_refl_const(list, &iter);
+	      refl != NULL;
+	      refl = next_refl_const(refl, iter) )
+	{
+		signed int h, k, l;
+		const Reflection *match;
+
+		get_indices(refl, &h, &k, &l);
+		get_equiv(amb, NULL, idx, h, k, l, &h, &k, &l);
+		get_asymm(sym, h, k, l, &h, &k, &l);
+
+		match = find_refl(full, h, k, l);
+		if ( match == NULL ) continue;
+		join_one(j, refl, match, &m);
+	}
+
+	return 0;
+}
+
+
+double joined_residual(const struct joined_refls *j, double G, double B,
+                       int free, int *pn_used)
+{
+	int i;
+	int n_used = 0;
+	double num = 0.0;
+	double den = 0.0;
+
+	for ( i=0; i<j->n; i++ ) {
+
+		double corr, int1, pobs, w;
+
+		if ( free != j->flag[i] ) continue;
+		if ( j->red[i] < 2 ) continue;
+
+		corr = G * exp(-B*j->s2[i]) * j->L[i];
+		int1 = j->I_partial[i] / corr;
+		pobs = int1 / j->I_full[i];
+		if ( pobs > 1.0 ) pobs = 1.0;
+		if ( pobs < 0.0 ) pobs = 0.0;
+
+		w = corr;
+		if ( isnan(w) ) w = 0.0;
+
+		num += w*fabs(pobs-j->p[i]);
+		den += w;
+		n_used++;
+
+	}
+
+	if ( pn_used != NULL ) *pn_used = n_used;
+	return num/den;
+}
+
+
+/* Same as log_residual(), but using the pre-joined values.  There are no
+ * logarithms or exponentials to calculate here, since they are all in
+ * 'logterm' apart from log(G), and the loop vectorises well. */
+double joined_log_residual(const struct joined_refls *j, double G, double B,
+                           int free, int *pn_used)
+{
+	int i;
+	int n_used = 0;
+	double dev = 0.0;
+	double lnG = log(G);
+
+	for ( i=0; i<j->n; i++ ) {
+
+		double fx;
+
+		if ( free && !j->flag[i] ) continue;
+		if ( j->I_partial[i] <= 3.0*j->esd[i] ) continue;
+		if ( j->red[i] < 2 ) continue;
+		if ( j->I_full[i] <= 0.0 ) continue;
+		if ( j->p[i] <= 0.0 ) continue;
+
+		fx = lnG - B*j->s2[i] + j->logterm[i];
+		dev += fx*fx;
+		n_used++;
+
+	}
+
+	if ( pn_used != NULL ) *pn_used = n_used;
+	return dev;
+}
+
+
 void write_unmerged(const char *fn,
                     struct crystal_refls *crystals,
                     struct image **images,
@@ -39,6 +39,7 @@
 #include "crystal.h"
 #include "reflist.h"
 #include "geometry.h"
+#include "symmetry.h"
 
 /* Minimum partiality of a reflection for it to be merged */
 #define MIN_PART_MERGE (0.3)
@@ -48,6 +49,47 @@ extern RefList *merge_intensities(struct crystal_refls *crystals, int n, int n_t
                                   int min_meas, double push_res, int use_weak,
                                   int ln_merge);
 
+/* Merges the crystals into 'n_lists' separate lists in one go.  'routes' has
+ * 'n_routes' entries for each crystal, giving the indices of the lists which
+ * the crystal should be merged into, or -1 for unused entries.  Returns an
+ * array of 'n_lists' merged lists, which should be freed (along with the
+ * lists) by the caller. */
+extern RefList **merge_intensities_multi(struct crystal_refls *crystals, int n,
+                                         int n_threads, int min_meas,
+                                         double push_res, int use_weak,
+                                         int ln_merge, const int *routes,
+                                         int n_routes, int n_lists);
+
+/* The observations which were merged into each reflection of a merged list.
+ * The contributions to rows[i] are contribs[offsets[i]] up to (but not
+ * including) contribs[offsets[i+1]], from the crystals in the same places in
+ * contrib_crystals.  The rows are in the same order as the merged list. */
+struct merge_contributions
+{
+	int n_rows;
+	Reflection **rows;
+	long long int *offsets;
+	Reflection **contribs;
+	Crystal **contrib_crystals;
+
+	/* Private */
+	int *n_contrib;
+	int *hash_rows;
+	unsigned int hash_mask;
+};
+
+extern struct merge_contributions *merge_contributions(struct crystal_refls *crystals,
+                                                       int n, RefList *full,
+                                                       double push_res,
+                                                       int use_weak,
+                                                       int ln_merge);
+
+/* Returns the row number for merged reflection 'refl', or -1 */
+extern int merge_contributions_row(const struct merge_contributions *mc,
+                                   const Reflection *refl);
+
+extern void free_merge_contributions(struct merge_contributions *mc);
+
 extern double correct_reflection_nopart(double val, Reflection *refl,
                                         double osf, double Bfac, double res);
 
@@ -60,6 +102,44 @@ extern double residual(RefList *list, Crystal *cr, const RefList *full, int free
 extern double log_residual(RefList *list, Crystal *cr, const RefList *full, int free,
                            int *pn_used, const char *filename);
 
+/* The reflections from one crystal which have a match in the merged list,
+ * with the values needed for scaling and residuals in separate arrays.
+ * This allows the residuals to be calculated many times over without
+ * repeating the lookups in the merged list or the resolution calculations,
+ * as long as the cell, partialities and merged intensities stay the same.
+ * The arrays are in the calling thread's scratch space (see
+ * thread_pool_scratch()), so each thread can only use one at a time, and they
+ * don't need to be freed. */
+struct joined_refls
+{
+	int n;             /* Number of matched reflections */
+	int n_total;       /* Number of reflections in the crystal's list */
+	double *s2;        /* Resolution squared */
+	double *logterm;   /* log(p) + log(I_full) - log(I_partial) - log(L) */
+	double *I_partial;
+	double *esd;
+	double *I_full;
+	double *p;
+	double *L;
+	int *red;          /* Redundancy of merged reflection */
+	int *flag;         /* Free flag of the crystal's reflection */
+};
+
+extern int join_crystal_refls(RefList *list, Crystal *cr, const RefList *full,
+                              struct joined_refls *j);
+
+extern int join_crystal_refls_reindexed(RefList *list, Crystal *cr,
+                                        const RefList *full,
+                                        const SymOpList *amb,
+                                        const SymOpList *sym, int idx,
+                                        struct joined_refls *j);
+
+extern double joined_residual(const struct joined_refls *j, double G, double B,
+                              int free, int *pn_used);
+
+extern double joined_log_residual(const struct joined_refls *j, double G,
+                                  double B, int free, int *pn_used);
+
 extern void write_unmerged(const char *fn,
                            struct crystal_refls *crystals,
                            struct image **images,
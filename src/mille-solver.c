@@ -0,0 +1,654 @@
+/*
+ * mille-solver.c
+ *
+ * Solve for detector alignment parameters from Mille data
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* This does the same calculation as Millepede-II's "inversion" method, for
+ * the linear problem written by crystfel-mille.c.  Each record (crystal) has
+ * its own local parameters, which are eliminated from the normal equations as
+ * the records are read, leaving a normal matrix for the global parameters
+ * only.  The records are divided between threads, each with its own copy of
+ * the matrix, and the copies are added up at the end.
+ *
+ * The zero-sum constraints are applied by eliminating one parameter from
+ * each constrained set, which is possible because no parameter is in more
+ * than one set.  The remaining system is symmetric and positive definite, and
+ * is solved by Cholesky decomposition. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <gsl/gsl_errno.h>
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_linalg.h>
+
+#include <utils.h>
+#include <thread-pool.h>
+
+#include "mille-solver.h"
+
+
+/* crystfel-mille.c writes 9 local parameters (reciprocal basis vectors) */
+#define MAX_LOCAL (32)
+
+#define RECORDS_PER_TASK (256)
+
+
+struct label_index
+{
+	int label;
+	int idx;  /* Among the free parameters, or -1 if fixed */
+};
+
+
+struct accumulator
+{
+	double *C;  /* n_free x n_free */
+	double *b;
+	long n_records;
+	long n_rejected;
+	long n_meas;
+
+	/* Scratch space for the current record */
+	int *slot;        /* For each free parameter, row in G, or -1 */
+	int *used;        /* Free parameters used by the record */
+	double *G;        /* Global-local part of the normal matrix */
+	double *H;
+};
+
+
+struct solve_queue
+{
+	char **filenames;
+	int n_files;
+	int cur_file;
+	FILE *fh;
+	int read_error;
+
+	struct label_index *index;
+	int n_labels;
+	int n_free;
+
+	struct accumulator *acc;
+};
+
+
+struct solve_task
+{
+	struct solve_queue *q;
+	char *buf;
+	size_t len;
+};
+
+
+static int cmp_label(const void *av, const void *bv)
+{
+	const struct label_index *a = av;
+	const struct label_index *b = bv;
+	if ( a->label < b->label ) return -1;
+	if ( a->label > b->label ) return +1;
+	return 0;
+}
+
+
+static int free_index(struct solve_queue *q, int label)
+{
+	struct label_index key;
+	struct label_index *f;
+
+	key.label = label;
+	f = bsearch(&key, q->index, q->n_labels, sizeof(struct label_index),
+	            cmp_label);
+	if ( f == NULL ) return -1;
+	return f->idx;
+}
+
+
+/* Reads one record onto the end of the buffer.  Returns 1 at the end of the
+ * file, or -1 on error */
+static int read_record(FILE *fh, char **buf, size_t *len, size_t *max_len)
+{
+	int nw;
+	size_t rec_len;
+
+	if ( fread(&nw, sizeof(int), 1, fh) != 1 ) {
+		return feof(fh) ? 1 : -1;
+	}
+
+	if ( (nw < 2) || (nw % 2) ) {
+		/* Negative means double precision, which isn't written by
+		 * crystfel-mille.c */
+		ERROR("Unrecognised Mille record (length %i)\n", nw);
+		return -1;
+	}
+
+	rec_len = sizeof(int) + (nw/2)*(sizeof(float)+sizeof(int));
+	if ( *len + rec_len > *max_len ) {
+		char *nbuf;
+		size_t nmax = 2*(*max_len) + rec_len;
+		nbuf = realloc(*buf, nmax);
+		if ( nbuf == NULL ) return -1;
+		*buf = nbuf;
+		*max_len = nmax;
+	}
+
+	memcpy(*buf + *len, &nw, sizeof(int));
+	if ( fread(*buf + *len + sizeof(int), 1, rec_len-sizeof(int), fh)
+	     != rec_len-sizeof(int) )
+	{
+		ERROR("Mille file ends part way through a record\n");
+		return -1;
+	}
+	*len += rec_len;
+
+	return 0;
+}
+
+
+static void *get_task(void *vp)
+{
+	struct solve_queue *q = vp;
+	struct solve_task *task;
+	size_t max_len = 0;
+	int n = 0;
+
+	task = malloc(sizeof(struct solve_task));
+	if ( task == NULL ) return NULL;
+	task->q = q;
+	task->buf = NULL;
+	task->len = 0;
+
+	while ( (n < RECORDS_PER_TASK) && (q->cur_file < q->n_files) ) {
+
+		int r;
+
+		if ( q->fh == NULL ) {
+			q->fh = fopen(q->filenames[q->cur_file], "rb");
+			if ( q->fh == NULL ) {
+				ERROR("Failed to open %s: %s\n",
+				      q->filenames[q->cur_file],
+				      strerror(errno));
+				q->read_error = 1;
+				q->cur_file = q->n_files;
+				break;
+			}
+		}
+
+		r = read_record(q->fh, &task->buf, &task->len, &max_len);
+		if ( r == 0 ) {
+			n++;
+			continue;
+		}
+
+		if ( r == -1 ) {
+			ERROR("Failed to read %s\n", q->filenames[q->cur_file]);
+			q->read_error = 1;
+		}
+		fclose(q->fh);
+		q->fh = NULL;
+		q->cur_file++;
+	}
+
+	if ( n == 0 ) {
+		free(task->buf);
+		free(task);
+		return NULL;
+	}
+
+	return task;
+}
+
+
+/* Adds the contributions of one record to the normal equations */
+static void add_record(struct solve_queue *q, struct accumulator *acc,
+                       const float *f, const int *l, int m)
+{
+	double gamma[MAX_LOCAL*MAX_LOCAL];
+	double beta[MAX_LOCAL];
+	double gbeta[MAX_LOCAL];
+	gsl_matrix_view gv;
+	gsl_vector_view bv, xv;
+	int nl = 0;
+	int n_used = 0;
+	int pass;
+	int i, j, k;
+	const int n = q->n_free;
+
+	for ( i=0; i<MAX_LOCAL*MAX_LOCAL; i++ ) gamma[i] = 0.0;
+	for ( i=0; i<MAX_LOCAL; i++ ) beta[i] = 0.0;
+
+	/* Pass 0 finds the local part, pass 1 does the rest once the local
+	 * part has been checked */
+	for ( pass=0; pass<2; pass++ ) {
+
+		i = 1;  /* Entry 0 is a placeholder */
+		while ( i < m ) {
+
+			int loc_start, loc_end, glob_start, glob_end;
+			double r, w;
+
+			if ( l[i] != 0 ) goto bad;
+			r = f[i++];
+
+			loc_start = i;
+			while ( (i < m) && (l[i] != 0) ) i++;
+			loc_end = i;
+			if ( i == m ) goto bad;
+			if ( f[i] <= 0.0 ) goto bad;
+			w = 1.0 / ((double)f[i]*f[i]);
+			i++;
+
+			glob_start = i;
+			while ( (i < m) && (l[i] != 0) ) i++;
+			glob_end = i;
+
+			if ( pass == 0 ) {
+
+				acc->n_meas++;
+
+				for ( j=loc_start; j<loc_end; j++ ) {
+					int lj = l[j]-1;
+					if ( (lj < 0) || (lj >= MAX_LOCAL) ) {
+						goto bad;
+					}
+					if ( lj+1 > nl ) nl = lj+1;
+					beta[lj] += w * f[j] * r;
+					for ( k=loc_start; k<loc_end; k++ ) {
+						int lk = l[k]-1;
+						if ( (lk < 0) || (lk >= MAX_LOCAL) ) {
+							goto bad;
+						}
+						gamma[lj*MAX_LOCAL+lk] += w * f[j] * f[k];
+					}
+				}
+
+			} else {
+
+				for ( j=glob_start; j<glob_end; j++ ) {
+
+					int gj = free_index(q, l[j]);
+					int row;
+					if ( gj < 0 ) continue;
+
+					row = acc->slot[gj];
+					if ( row == -1 ) {
+						row = n_used;
+						acc->slot[gj] = n_used;
+						acc->used[n_used++] = gj;
+						for ( k=0; k<nl; k++ ) {
+							acc->G[row*MAX_LOCAL+k] = 0.0;
+						}
+					}
+
+					acc->b[gj] += w * f[j] * r;
+					for ( k=loc_start; k<loc_end; k++ ) {
+						acc->G[row*MAX_LOCAL+l[k]-1] += w * f[j] * f[k];
+					}
+					for ( k=glob_start; k<glob_end; k++ ) {
+						int gk = free_index(q, l[k]);
+						if ( gk < 0 ) continue;
+						acc->C[gj*n+gk] += w * f[j] * f[k];
+					}
+				}
+			}
+		}
+
+		if ( pass == 0 ) {
+			if ( nl == 0 ) goto bad;
+			gv = gsl_matrix_view_array_with_tda(gamma, nl, nl,
+			                                    MAX_LOCAL);
+			if ( gsl_linalg_cholesky_decomp(&gv.matrix) ) goto bad;
+		}
+	}
+
+	/* Eliminate the local parameters:
+	 *  C -= G Gamma^-1 G^T  and  b -= G Gamma^-1 beta */
+	bv = gsl_vector_view_array(beta, nl);
+	xv = gsl_vector_view_array(gbeta, nl);
+	gsl_linalg_cholesky_solve(&gv.matrix, &bv.vector, &xv.vector);
+
+	for ( j=0; j<n_used; j++ ) {
+		gsl_vector_view hv;
+		double s = 0.0;
+		bv = gsl_vector_view_array(&acc->G[j*MAX_LOCAL], nl);
+		hv = gsl_vector_view_array(&acc->H[j*MAX_LOCAL], nl);
+		gsl_linalg_cholesky_solve(&gv.matrix, &bv.vector, &hv.vector);
+		for ( k=0; k<nl; k++ ) s += acc->G[j*MAX_LOCAL+k] * gbeta[k];
+		acc->b[acc->used[j]] -= s;
+	}
+
+	for ( j=0; j<n_used; j++ ) {
+		const double *gj = &acc->G[j*MAX_LOCAL];
+		double *Crow = &acc->C[acc->used[j]*n];
+		for ( k=0; k<n_used; k++ ) {
+			const double *hk = &acc->H[k*MAX_LOCAL];
+			double s = 0.0;
+			int p;
+			for ( p=0; p<nl; p++ ) s += gj[p] * hk[p];
+			Crow[acc->used[k]] -= s;
+		}
+	}
+
+	for ( j=0; j<n_used; j++ ) acc->slot[acc->used[j]] = -1;
+	acc->n_records++;
+	return;
+
+bad:
+	/* Nothing has been added to the global part in pass 0, and pass 1
+	 * doesn't fail */
+	acc->n_rejected++;
+}
+
+
+static void run_task(void *vp, int cookie)
+{
+	struct solve_task *task = vp;
+	struct solve_queue *q = task->q;
+	size_t pos = 0;
+
+	while ( pos < task->len ) {
+
+		int nw;
+		const float *f;
+		const int *l;
+
+		memcpy(&nw, task->buf+pos, sizeof(int));
+		pos += sizeof(int);
+		f = (const float *)(task->buf+pos);
+		pos += (nw/2)*sizeof(float);
+		l = (const int *)(task->buf+pos);
+		pos += (nw/2)*sizeof(int);
+
+		add_record(q, &q->acc[cookie], f, l, nw/2);
+	}
+}
+
+
+static void finalise_task(void *qp, void *vp)
+{
+	struct solve_task *task = vp;
+	free(task->buf);
+	free(task);
+}
+
+
+static int setup_accumulator(struct accumulator *acc, int n)
+{
+	int i;
+
+	acc->C = calloc((size_t)n*n, sizeof(double));
+	acc->b = calloc(n, sizeof(double));
+	acc->slot = malloc(n*sizeof(int));
+	acc->used = malloc(n*sizeof(int));
+	acc->G = malloc(n*MAX_LOCAL*sizeof(double));
+	acc->H = malloc(n*MAX_LOCAL*sizeof(double));
+	acc->n_records = 0;
+	acc->n_rejected = 0;
+	acc->n_meas = 0;
+	if ( (acc->C == NULL) || (acc->b == NULL) || (acc->slot == NULL)
+	  || (acc->used == NULL) || (acc->G == NULL) || (acc->H == NULL) )
+	{
+		return 1;
+	}
+
+	for ( i=0; i<n; i++ ) acc->slot[i] = -1;
+	return 0;
+}
+
+
+static void free_accumulator(struct accumulator *acc)
+{
+	free(acc->C);
+	free(acc->b);
+	free(acc->slot);
+	free(acc->used);
+	free(acc->G);
+	free(acc->H);
+}
+
+
+/* Solves C x = b for the free parameters, subject to the constraints */
+static int solve_constrained(const double *C, const double *b, int n,
+                             struct solve_queue *q,
+                             struct mille_constraint *cons, int n_cons,
+                             double *x)
+{
+	int *partner;  /* Parameter to be eliminated along with this one */
+	int *red;      /* Index in the reduced system, or -1 if eliminated */
+	int *unred;
+	double *Cr;
+	double *br;
+	double *y;
+	int m, i, j;
+	int r = 0;
+
+	partner = malloc(n*sizeof(int));
+	red = malloc(n*sizeof(int));
+	unred = malloc(n*sizeof(int));
+	if ( (partner == NULL) || (red == NULL) || (unred == NULL) ) return 1;
+
+	for ( i=0; i<n; i++ ) {
+		partner[i] = -1;
+		red[i] = 0;
+	}
+
+	/* In each constrained set, the last free parameter is replaced by
+	 * minus the sum of the others */
+	for ( i=0; i<n_cons; i++ ) {
+		int e = -1;
+		for ( j=cons[i].n-1; j>=0; j-- ) {
+			e = free_index(q, cons[i].labels[j]);
+			if ( e >= 0 ) break;
+		}
+		if ( e < 0 ) continue;
+		red[e] = -1;
+		for ( j=0; j<cons[i].n; j++ ) {
+			int k = free_index(q, cons[i].labels[j]);
+			if ( (k >= 0) && (k != e) ) partner[k] = e;
+		}
+	}
+
+	m = 0;
+	for ( i=0; i<n; i++ ) {
+		if ( red[i] == -1 ) continue;
+		red[i] = m;
+		unred[m++] = i;
+	}
+
+	Cr = malloc((size_t)m*m*sizeof(double));
+	br = malloc(m*sizeof(double));
+	y = malloc(m*sizeof(double));
+	if ( (Cr == NULL) || (br == NULL) || (y == NULL) ) {
+		free(partner);  free(red);  free(unred);
+		free(Cr);  free(br);  free(y);
+		return 1;
+	}
+
+	/* Cr = Z^T C Z and br = Z^T b, where each column of Z has a 1 for
+	 * the parameter and -1 for its partner */
+	for ( i=0; i<m; i++ ) {
+		int ji = unred[i];
+		int pi = partner[ji];
+		br[i] = b[ji] - ((pi >= 0) ? b[pi] : 0.0);
+		for ( j=0; j<m; j++ ) {
+			int jj = unred[j];
+			int pj = partner[jj];
+			double v = C[ji*n+jj];
+			if ( pj >= 0 ) v -= C[ji*n+pj];
+			if ( pi >= 0 ) v -= C[pi*n+jj];
+			if ( (pi >= 0) && (pj >= 0) ) v += C[pi*n+pj];
+			Cr[i*m+j] = v;
+		}
+	}
+
+	/* Parameters without any data stay where they are */
+	for ( i=0; i<m; i++ ) {
+		if ( Cr[i*m+i] > 0.0 ) continue;
+		for ( j=0; j<m; j++ ) {
+			Cr[i*m+j] = 0.0;
+			Cr[j*m+i] = 0.0;
+		}
+		Cr[i*m+i] = 1.0;
+		br[i] = 0.0;
+	}
+
+	if ( m > 0 ) {
+		gsl_matrix_view cv = gsl_matrix_view_array(Cr, m, m);
+		gsl_vector_view bv = gsl_vector_view_array(br, m);
+		gsl_vector_view yv = gsl_vector_view_array(y, m);
+		if ( gsl_linalg_cholesky_decomp(&cv.matrix) ) {
+			ERROR("The alignment parameters are not fully "
+			      "determined by the data.\n");
+			r = 1;
+		} else {
+			gsl_linalg_cholesky_solve(&cv.matrix, &bv.vector,
+			                          &yv.vector);
+		}
+	}
+
+	if ( r == 0 ) {
+		for ( i=0; i<n; i++ ) x[i] = 0.0;
+		for ( i=0; i<m; i++ ) {
+			int ji = unred[i];
+			x[ji] = y[i];
+			if ( partner[ji] >= 0 ) x[partner[ji]] -= y[i];
+		}
+	}
+
+	free(partner);
+	free(red);
+	free(unred);
+	free(Cr);
+	free(br);
+	free(y);
+	return r;
+}
+
+
+/**
+ * \param filenames Mille data files, as written by crystfel-mille.c
+ * \param n_files Number of files
+ * \param params The global parameters.  The shifts are filled in.
+ * \param n_params Number of global parameters
+ * \param cons Constraints
+ * \param n_cons Number of constraints
+ * \param n_threads Number of threads to use
+ *
+ * Finds the global parameter shifts which best fit the Mille data, with the
+ * local parameters for each record eliminated.  Global parameters which appear
+ * in the data but not in \p params are treated as fixed.
+ *
+ * \returns zero on success.
+ */
+int mille_solve(char **filenames, int n_files,
+                struct mille_param *params, int n_params,
+                struct mille_constraint *cons, int n_cons,
+                int n_threads)
+{
+	struct solve_queue q;
+	double *x;
+	long n_records = 0;
+	long n_rejected = 0;
+	long n_meas = 0;
+	int i, t;
+	int n;
+	int r;
+
+	q.filenames = filenames;
+	q.n_files = n_files;
+	q.cur_file = 0;
+	q.fh = NULL;
+	q.read_error = 0;
+
+	q.index = malloc(n_params*sizeof(struct label_index));
+	if ( q.index == NULL ) return 1;
+	n = 0;
+	for ( i=0; i<n_params; i++ ) {
+		q.index[i].label = params[i].label;
+		q.index[i].idx = params[i].fixed ? -1 : n++;
+	}
+	q.n_labels = n_params;
+	q.n_free = n;
+	qsort(q.index, n_params, sizeof(struct label_index), cmp_label);
+
+	q.acc = malloc(n_threads*sizeof(struct accumulator));
+	if ( q.acc == NULL ) return 1;
+	for ( t=0; t<n_threads; t++ ) {
+		if ( setup_accumulator(&q.acc[t], n) ) {
+			ERROR("Failed to allocate normal matrix\n");
+			return 1;
+		}
+	}
+
+	STATUS("Reading Mille data for %i free parameters\n", n);
+	run_threads(n_threads, run_task, get_task, finalise_task, &q, 0,
+	            0, 0, 0);
+	if ( q.read_error ) return 1;
+
+	/* Add up the contributions from the threads */
+	for ( t=0; t<n_threads; t++ ) {
+		if ( t > 0 ) {
+			size_t k;
+			for ( k=0; k<(size_t)n*n; k++ ) {
+				q.acc[0].C[k] += q.acc[t].C[k];
+			}
+			for ( k=0; k<n; k++ ) {
+				q.acc[0].b[k] += q.acc[t].b[k];
+			}
+		}
+		n_records += q.acc[t].n_records;
+		n_rejected += q.acc[t].n_rejected;
+		n_meas += q.acc[t].n_meas;
+	}
+	STATUS("Used %li records (%li measurements)\n", n_records, n_meas);
+	if ( n_rejected > 0 ) {
+		STATUS("Rejected %li records which could not be used\n",
+		       n_rejected);
+	}
+
+	x = malloc(n*sizeof(double));
+	if ( x == NULL ) return 1;
+	r = solve_constrained(q.acc[0].C, q.acc[0].b, n, &q, cons, n_cons, x);
+
+	if ( r == 0 ) {
+		n = 0;
+		for ( i=0; i<n_params; i++ ) {
+			params[i].shift = params[i].fixed ? 0.0 : x[n++];
+		}
+	}
+
+	free(x);
+	for ( t=0; t<n_threads; t++ ) free_accumulator(&q.acc[t]);
+	free(q.acc);
+	free(q.index);
+	return r;
+}
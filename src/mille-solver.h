@@ -0,0 +1,59 @@
+/*
+ * mille-solver.h
+ *
+ * Solve for detector alignment parameters from Mille data
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MILLE_SOLVER_H
+#define MILLE_SOLVER_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/* One global parameter, as in the "Parameter" section of a Millepede
+ * steering file */
+struct mille_param
+{
+	int label;
+	int fixed;
+
+	/* Result */
+	double shift;
+};
+
+/* The parameters with these labels must add up to zero */
+struct mille_constraint
+{
+	int *labels;
+	int n;
+};
+
+extern int mille_solve(char **filenames, int n_files,
+                       struct mille_param *params, int n_params,
+                       struct mille_constraint *cons, int n_cons,
+                       int n_threads);
+
+#endif /* MILLE_SOLVER_H */
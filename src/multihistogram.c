@@ -109,6 +109,22 @@ void multihistogram_add_value(MultiHistogram *hi, double val, unsigned int cat)
 }
 
 
+void multihistogram_remove_value(MultiHistogram *hi, double val,
+                                 unsigned int cat)
+{
+	int i, j;
+
+	j = (val - hi->min) / hi->bin_width;
+
+	if ( j < 0 ) j = 0;
+	if ( j >= hi->n_bins ) j = hi->n_bins - 1;
+
+	for ( i=0; i<32; i++ ) {
+		if ( cat & (unsigned)1<<i ) hi->bins[i][j]--;
+	}
+}
+
+
 int *multihistogram_get_data(MultiHistogram *hi, int cat)
 {
 	if ( cat < 0 ) return NULL;
@@ -39,6 +39,7 @@
 #include <getopt.h>
 #include <assert.h>
 #include <pthread.h>
+#include <signal.h>
 #include <gsl/gsl_errno.h>
 #include <sys/stat.h>
 
@@ -58,6 +59,9 @@
 #include "post-refinement.h"
 #include "merge.h"
 #include "rejection.h"
+#include "checkpoint.h"
+#include "log-archive.h"
+#include "distribute.h"
 #include "version.h"
 #include "json-utils.h"
 
@@ -168,64 +172,31 @@ static void add_to_csplit(struct custom_split *csplit, const char *id,
 }
 
 
-/* Write two-way split results (i.e. for CC1/2 etc) for this list of crystals */
-static void write_split(struct crystal_refls *crystals, int n_crystals,
-                        const char *outfile, int nthreads, PartialityModel pmodel,
-                        int min_measurements, SymOpList *sym, double push_res)
+/* Find the dataset number for the crystal from 'image', or -1 if none */
+static signed int find_dsn_for_image(struct custom_split *csplit,
+                                     struct image *image)
 {
-	char tmp[1024];
-	RefList *split;
-	struct crystal_refls *crystals1;
-	struct crystal_refls *crystals2;
-	int n_crystals1 = 0;
-	int n_crystals2 = 0;
-	int i;
-
-	if ( n_crystals == 0 ) {
-		ERROR("No crystals for split!\n");
-		return;
-	}
-
-	crystals1 = malloc(n_crystals * sizeof(struct crystal_refls));
-	if ( crystals1 == NULL ) return;
-
-	crystals2 = malloc(n_crystals * sizeof(struct crystal_refls));
-	if ( crystals2 == NULL ) return;
+	const char *fn;
+	char *evs;
+	char *id;
+	int dsn;
 
-	for ( i=0; i<n_crystals; i++ ) {
-		if ( i % 2 ) {
-			crystals1[n_crystals1] = crystals[i];
-			n_crystals1++;
-		} else {
-			crystals2[n_crystals2] = crystals[i];
-			n_crystals2++;
-		}
-	}
-	snprintf(tmp, 1024, "%s1", outfile);
-	split = merge_intensities(crystals1, n_crystals1, nthreads,
-		                  min_measurements, push_res, 1, 0);
+	fn = image->filename;
+	evs = image->ev;
+	if ( evs == NULL ) evs = "//";
 
-	if ( split == NULL ) {
-		ERROR("Not enough crystals for two way split!\n");
-		free(crystals1);
-		free(crystals2);
-		return;
+	id = malloc(strlen(evs)+strlen(fn)+2);
+	if ( id == NULL ) {
+		ERROR("Failed to allocate ID\n");
+		return -1;
 	}
+	strcpy(id, fn);
+	strcat(id, " ");
+	strcat(id, evs);
+	dsn = find_dsn_for_id(csplit, id);
+	free(id);
 
-	STATUS("Writing two-way split to %s ", tmp);
-	write_reflist_2(tmp, split, sym);
-	free_contribs(split);
-	reflist_free(split);
-	snprintf(tmp, 1024, "%s2", outfile);
-	split = merge_intensities(crystals2, n_crystals2, nthreads,
-		                  min_measurements, push_res, 1, 0);
-	STATUS("and %s\n", tmp);
-	write_reflist_2(tmp, split, sym);
-	free_contribs(split);
-	reflist_free(split);
-
-	free(crystals1);
-	free(crystals2);
+	return dsn;
 }
 
 
@@ -256,67 +227,128 @@ static char *insert_into_filename(const char *fn, const char *add)
 }
 
 
-/* Write custom split results (including a two-way split) */
-static void write_custom_split(struct custom_split *csplit, int dsn,
-                               struct crystal_refls *crystals,
-                               struct image **images, int n_crystals,
-                               PartialityModel pmodel, int min_measurements,
-                               double push_res, SymOpList *sym, int nthreads,
-                               const char *outfile)
+static void write_split_list(RefList *list, int n, const char *fn,
+                             SymOpList *sym)
 {
-	char *tmp;
-	RefList *split;
-	struct crystal_refls crystalsn[n_crystals];
-	int n_crystalsn = 0;
+	if ( (n == 0) || (list == NULL) ) return;
+	write_reflist_2(fn, list, sym);
+}
+
+
+/* Write two-way split results (i.e. for CC1/2 etc), and the custom split
+ * results (each including a two-way split) if 'csplit' is not NULL.
+ * All of the lists are merged together, in one pass through the crystals. */
+static void write_splits(struct crystal_refls *crystals, struct image **images,
+                         int n_crystals, struct custom_split *csplit,
+                         const char *outfile, int nthreads,
+                         int min_measurements, SymOpList *sym, double push_res)
+{
+	char tmp[1024];
+	int n_datasets;
+	int n_lists;
+	int *routes;
+	int *n_in_list;
+	RefList **lists;
 	int i;
 
+	if ( n_crystals == 0 ) {
+		ERROR("No crystals for split!\n");
+		return;
+	}
+
+	/* Lists 0 and 1 are the two halves of the whole data.  Then, for each
+	 * custom dataset, the whole dataset followed by its two halves. */
+	n_datasets = (csplit != NULL) ? csplit->n_datasets : 0;
+	n_lists = 2 + 3*n_datasets;
+
+	routes = malloc(3*n_crystals*sizeof(int));
+	n_in_list = calloc(n_lists, sizeof(int));
+	if ( (routes == NULL) || (n_in_list == NULL) ) {
+		ERROR("Failed to allocate split lists\n");
+		free(routes);
+		free(n_in_list);
+		return;
+	}
+
 	for ( i=0; i<n_crystals; i++ ) {
 
-		const char *fn;
-		char *evs;
-		char *id;
-		int dsn_crystal;
+		int *r = &routes[3*i];
+		int dsn = -1;
 
-		fn = images[i]->filename;
-		evs = images[i]->ev;
-		if ( evs == NULL ) evs = "//";
+		r[0] = (i % 2) ? 0 : 1;
+		r[1] = -1;
+		r[2] = -1;
+		n_in_list[r[0]]++;
 
-		id = malloc(strlen(evs)+strlen(fn)+2);
-		if ( id == NULL ) {
-			ERROR("Failed to allocate ID\n");
-			return;
-		}
-		strcpy(id, fn);
-		strcat(id, " ");
-		strcat(id, evs);
-		dsn_crystal = find_dsn_for_id(csplit, id);
-		free(id);
-		if ( dsn == dsn_crystal ) {
-			crystalsn[n_crystalsn] = crystals[i];
-			n_crystalsn++;
-		}
+		if ( csplit != NULL ) dsn = find_dsn_for_image(csplit, images[i]);
+		if ( dsn == -1 ) continue;
 
-	}
+		r[1] = 2 + 3*dsn;
+		r[2] = (n_in_list[r[1]] % 2) ? 3+3*dsn : 4+3*dsn;
+		n_in_list[r[1]]++;
+		n_in_list[r[2]]++;
 
-	tmp = insert_into_filename(outfile, csplit->dataset_names[dsn]);
+	}
 
-	if ( n_crystalsn == 0 ) {
-		ERROR("Not writing dataset '%s' because it contains no "
-		      "crystals\n", csplit->dataset_names[dsn]);
+	lists = merge_intensities_multi(crystals, n_crystals, nthreads,
+	                                min_measurements, push_res, 1, 0,
+	                                routes, 3, n_lists);
+	free(routes);
+	if ( lists == NULL ) {
+		free(n_in_list);
 		return;
 	}
 
-	STATUS("Writing dataset '%s' to %s (%i crystals)\n",
-	       csplit->dataset_names[dsn], tmp, n_crystalsn);
-	split = merge_intensities(crystalsn, n_crystalsn, nthreads,
-		                  min_measurements, push_res, 1, 0);
-	write_reflist_2(tmp, split, sym);
-	free_contribs(split);
-	reflist_free(split);
+	/* Only the first rank writes the files */
+	dist_sum_ints(n_in_list, n_lists);
+	if ( dist_rank() > 0 ) n_datasets = 0;
+
+	if ( dist_rank() > 0 ) {
+		/* Nothing to write */
+	} else if ( n_in_list[0] == 0 ) {
+		ERROR("Not enough crystals for two way split!\n");
+	} else {
+		snprintf(tmp, 1024, "%s1", outfile);
+		STATUS("Writing two-way split to %s ", tmp);
+		write_split_list(lists[0], n_in_list[0], tmp, sym);
+		snprintf(tmp, 1024, "%s2", outfile);
+		STATUS("and %s\n", tmp);
+		write_split_list(lists[1], n_in_list[1], tmp, sym);
+	}
+
+	for ( i=0; i<n_datasets; i++ ) {
 
-	write_split(crystalsn, n_crystalsn, tmp, nthreads, pmodel,
-	            min_measurements, sym, push_res);
-	free(tmp);
+		char *dsfn;
+		int l = 2 + 3*i;
+
+		if ( n_in_list[l] == 0 ) {
+			ERROR("Not writing dataset '%s' because it contains no "
+			      "crystals\n", csplit->dataset_names[i]);
+			continue;
+		}
+
+		dsfn = insert_into_filename(outfile, csplit->dataset_names[i]);
+		STATUS("Writing dataset '%s' to %s (%i crystals)\n",
+		       csplit->dataset_names[i], dsfn, n_in_list[l]);
+		write_split_list(lists[l], n_in_list[l], dsfn, sym);
+
+		if ( n_in_list[l+1] == 0 ) {
+			ERROR("Not enough crystals for two way split!\n");
+		} else {
+			snprintf(tmp, 1024, "%s1", dsfn);
+			STATUS("Writing two-way split to %s ", tmp);
+			write_split_list(lists[l+1], n_in_list[l+1], tmp, sym);
+			snprintf(tmp, 1024, "%s2", dsfn);
+			STATUS("and %s\n", tmp);
+			write_split_list(lists[l+2], n_in_list[l+2], tmp, sym);
+		}
+		free(dsfn);
+
+	}
+
+	for ( i=0; i<n_lists; i++ ) reflist_free(lists[i]);
+	free(lists);
+	free(n_in_list);
 }
 
 
@@ -340,6 +372,8 @@ static void show_help(const char *s)
 "      --no-scale             Disable scale factor (G, B) refinement.\n"
 "      --no-Bscale            Disable B factor scaling.\n"
 "      --no-pr                Disable orientation/physics refinement.\n"
+"      --pr-method=<method>   Post-refinement method: search (default) or bfgs.\n"
+"      --benchmark-pr         Compare the post-refinement methods.\n"
 "      --no-deltacchalf       Disable rejection based on deltaCChalf.\n"
 "  -m, --model=<model>        Specify partiality model.\n"
 "      --min-measurements=<n> Minimum number of measurements to require.\n"
@@ -353,7 +387,15 @@ static void show_help(const char *s)
 "      --custom-split         List of files for custom dataset splitting.\n"
 "      --max-rel-B            Maximum allowable relative |B| factor.\n"
 "      --no-logs              Do not write extensive log files.\n"
+"      --lean-reflections     Store reflections compactly to save memory.\n"
+"      --spill-dir=<dir>      Keep reflections in a working file in <dir>.\n"
+"      --checkpoint=<file>    Save the state after each cycle to <file>.\n"
+"      --resume-from=<file>   Carry on from a checkpoint instead of streams.\n"
+"      --cpu-pin              Pin worker threads to CPUs.\n"
+"      --deterministic        Same results for any number of threads.\n"
+"      --spectrum-table=<n>   Tabulate spectra with <n> samples (faster).\n"
 "      --log-folder=<fn>      Location for log folder.\n"
+"      --log-archive          Put the logs for each cycle in one file.\n"
 "  -w <pg>                    Apparent point group for resolving ambiguities.\n"
 "      --operator=<op>        Indexing ambiguity operator for resolving.\n"
 "      --force-bandwidth=<n>  Set all bandwidths to <n> (fraction).\n"
@@ -368,27 +410,7 @@ static signed int find_first_crystal(struct image **images, int n_crystals,
 	int i;
 
 	for ( i=0; i<n_crystals; i++ ) {
-		const char *fn;
-		char *evs;
-		char *id;
-		int dsn_crystal;
-
-		fn = images[i]->filename;
-		evs = images[i]->ev;
-		if ( evs == NULL ) evs = "//";
-
-		id = malloc(strlen(evs)+strlen(fn)+2);
-		if ( id == NULL ) {
-			ERROR("Failed to allocate ID\n");
-			return -1;
-		}
-		strcpy(id, fn);
-		strcat(id, " ");
-		strcat(id, evs);
-		dsn_crystal = find_dsn_for_id(csplit, id);
-		free(id);
-
-		if ( dsn == dsn_crystal ) return i;
+		if ( dsn == find_dsn_for_image(csplit, images[i]) ) return i;
 	}
 	return -1;
 }
@@ -403,29 +425,14 @@ static void check_csplit(struct crystal_refls *crystals, struct image **images,
 	int n_cry = 0;
 	int n_nocry = 0;
 
+	int *has_cry;
+
 	STATUS("Checking your custom split datasets...\n");
 
 	for ( i=0; i<n_crystals; i++ ) {
 
-		const char *fn;
-		char *evs;
-		char *id;
-		int dsn_crystal;
-
-		fn = images[i]->filename;
-		evs = images[i]->ev;
-		if ( evs == NULL ) evs = "//";
+		int dsn_crystal = find_dsn_for_image(csplit, images[i]);
 
-		id = malloc(strlen(evs)+strlen(fn)+2);
-		if ( id == NULL ) {
-			ERROR("Failed to allocate ID\n");
-			return;
-		}
-		strcpy(id, fn);
-		strcat(id, " ");
-		strcat(id, evs);
-		dsn_crystal = find_dsn_for_id(csplit, id);
-		free(id);
 		if ( dsn_crystal == -1 ) {
 			n_nosplit++;
 		} else {
@@ -434,11 +441,20 @@ static void check_csplit(struct crystal_refls *crystals, struct image **images,
 
 	}
 
-	for ( i=0; i<csplit->n_datasets; i++ ) {
+	dist_sum_ints(&n_split, 1);
+	dist_sum_ints(&n_nosplit, 1);
 
+	has_cry = malloc(csplit->n_datasets*sizeof(int));
+	if ( has_cry == NULL ) return;
+	for ( i=0; i<csplit->n_datasets; i++ ) {
 		/* Try to find a crystal with dsn = i */
-		if ( find_first_crystal(images, n_crystals, csplit, i) != -1 )
-		{
+		has_cry[i] = find_first_crystal(images, n_crystals, csplit, i) != -1;
+	}
+	dist_sum_ints(has_cry, csplit->n_datasets);
+
+	for ( i=0; i<csplit->n_datasets; i++ ) {
+
+		if ( has_cry[i] ) {
 			n_cry++;
 		} else {
 			n_nocry++;
@@ -447,6 +463,8 @@ static void check_csplit(struct crystal_refls *crystals, struct image **images,
 		}
 	}
 
+	free(has_cry);
+
 	STATUS("Please check that these numbers match your expectations:\n");
 	STATUS("    Number of crystals assigned to a dataset: %i\n", n_split);
 	STATUS(" Number of crystals with no dataset assigned: %i\n", n_nosplit);
@@ -584,34 +602,64 @@ static void display_progress(int n_images, int n_crystals)
 }
 
 
-static RefList *apply_max_adu(RefList *list, double max_adu)
+/* Like asymmetric_indices(), but with extra flags for the new list */
+static RefList *asymmetric_copy(RefList *list, const SymOpList *sym, int flags)
 {
 	RefList *nlist;
 	Reflection *refl;
 	RefListIterator *iter;
 
-	nlist = reflist_new();
+	nlist = reflist_new_with_flags(reflist_get_flags(list) | flags);
 	if ( nlist == NULL ) return NULL;
 
 	for ( refl = first_refl(list, &iter);
 	      refl != NULL;
 	      refl = next_refl(refl, iter) )
 	{
-		if ( get_peak(refl) < max_adu ) {
-			signed int h, k, l;
-			get_indices(refl, &h, &k, &l);
-			Reflection *nrefl = add_refl(nlist, h, k, l);
-			if ( nrefl == NULL ) {
-				ERROR("Failed to add reflection\n");
-				return NULL;
-			}
-			copy_data(nrefl, refl);
+		signed int h, k, l;
+		signed int ha, ka, la;
+		Reflection *nrefl;
+
+		get_indices(refl, &h, &k, &l);
+		get_asymm(sym, h, k, l, &ha, &ka, &la);
+		nrefl = add_refl(nlist, ha, ka, la);
+		if ( nrefl == NULL ) {
+			ERROR("Failed to add reflection\n");
+			reflist_free(nlist);
+			return NULL;
 		}
+		copy_data(nrefl, refl);
+		set_symmetric_indices(nrefl, h, k, l);
 	}
 	return nlist;
 }
 
 
+static void save_checkpoint(const char *filename, int itn, SymOpList *sym,
+                            char *audit_info, struct crystal_refls *crystals,
+                            struct image **images, int n_crystals,
+                            RefList *full)
+{
+	struct checkpoint ck;
+
+	if ( filename == NULL ) return;
+
+	ck.itn = itn;
+	ck.sym = (char *)symmetry_name(sym);
+	ck.audit_info = audit_info;
+	ck.n_crystals = n_crystals;
+	ck.crystals = crystals;
+	ck.images = images;
+	ck.full = full;
+
+	/* A failure here is not fatal, because the refinement can carry on */
+	if ( write_checkpoint(filename, &ck) == 0 ) {
+		STATUS("Saved checkpoint after %i cycles to %s\n",
+		       itn, filename);
+	}
+}
+
+
 static void skip_to_end(FILE *fh)
 {
 	int c;
@@ -689,6 +737,8 @@ static void write_to_pgraph(FILE *fh, RefList *list, RefList *full, Crystal *cr,
 	double B = crystal_get_Bfac(cr);
 	UnitCell *cell = crystal_get_cell(cr);
 	char ins[16];
+	const Reflection **matches;
+	int i;
 
 	if ( inum >= 0 ) {
 		snprintf(ins, 12, "%i", inum);
@@ -697,27 +747,28 @@ static void write_to_pgraph(FILE *fh, RefList *list, RefList *full, Crystal *cr,
 		ins[1] = '\0';
 	}
 
+	matches = reflist_match(list, full);
+	if ( matches == NULL ) return;
 
-	for ( refl = first_refl(list, &iter);
+	for ( refl = first_refl(list, &iter), i=0;
 	      refl != NULL;
-	      refl = next_refl(refl, iter) )
+	      refl = next_refl(refl, iter), i++ )
 	{
 		signed int h, k, l;
 		double pobs, pcalc;
 		double res, Ipart;
-		Reflection *match;
+		const Reflection *match = matches[i];
 
 		if ( !get_flag(refl) ) continue;  /* Not free-flagged */
 
 		/* Strong reflections only */
 		if ( get_intensity(refl) < 3.0*get_esd_intensity(refl) ) continue;
 
+		if ( match == NULL ) continue;
+
 		get_indices(refl, &h, &k, &l);
 		res = resolution(cell, h, k, l);
 
-		match = find_refl(full, h, k, l);
-		if ( match == NULL ) continue;
-
 		/* Don't calculate pobs if reference reflection is weak */
 		if ( fabs(get_intensity(match)) / get_esd_intensity(match) < 3.0 ) continue;
 
@@ -740,19 +791,15 @@ static void write_pgraph(RefList *full, struct crystal_refls *crystals, int n_cr
                          const char *log_folder)
 {
 	FILE *fh;
+	struct log_file lf;
 	char tmp[256];
 	int i;
 
-	snprintf(tmp, 256, "%s/pgraph%s.dat", log_folder, suff);
-
-	if ( iter == 0 ) {
-		fh = fopen(tmp, "w");
-	} else {
-		fh = fopen(tmp, "a");
-	}
+	snprintf(tmp, 256, "pgraph%s.dat", suff);
 
+	fh = log_open(&lf, log_folder, tmp, iter != 0);
 	if ( fh == NULL ) {
-		ERROR("Failed to open '%s'\n", tmp);
+		ERROR("Failed to open '%s/%s'\n", log_folder, tmp);
 		return;
 	}
 
@@ -766,7 +813,68 @@ static void write_pgraph(RefList *full, struct crystal_refls *crystals, int n_cr
 		                crystals[i].cr, i, iter);
 	}
 
-	fclose(fh);
+	log_close(&lf);
+}
+
+
+/* With --log-archive, all the logs for each cycle go into one file */
+static LogArchive *start_log_archive(int use_archive, const char *log_folder,
+                                     signed int cycle)
+{
+	char tmp[1024];
+	LogArchive *la;
+
+	if ( !use_archive ) return NULL;
+
+	if ( cycle >= 0 ) {
+		snprintf(tmp, 1024, "%s/logs-cycle%.2d.bin", log_folder, cycle);
+	} else {
+		snprintf(tmp, 1024, "%s/logs-cycleF.bin", log_folder);
+	}
+
+	/* If this fails, the logs will be written as separate files */
+	la = log_archive_create(tmp);
+	set_log_archive(la);
+	return la;
+}
+
+
+static void end_log_archive(LogArchive *la)
+{
+	set_log_archive(NULL);
+	log_archive_close(la);
+}
+
+
+/* Only deltaCChalf needs to know which reflections went into the merge, and
+ * there is nothing to know when using reference reflections */
+static struct merge_contributions *contributions_for_rejection(struct crystal_refls *crystals,
+                                                               int n_crystals,
+                                                               RefList *full,
+                                                               RefList *reference,
+                                                               int no_deltacchalf,
+                                                               double push_res)
+{
+	if ( (reference != NULL) || no_deltacchalf ) return NULL;
+	return merge_contributions(crystals, n_crystals, full, push_res, 1, 0);
+}
+
+
+/* Adds up the residuals from all ranks */
+static void sum_residuals(double *r, double *free_r, double *log_r,
+                          double *free_log_r)
+{
+	double sums[4];
+
+	sums[0] = *r;
+	sums[1] = *free_r;
+	sums[2] = *log_r;
+	sums[3] = *free_log_r;
+	dist_sum_doubles(sums, 4);
+	*r = sums[0];
+	*free_r = sums[1];
+	*log_r = sums[2];
+	*free_log_r = sums[3];
 }
 
 
@@ -786,6 +894,7 @@ static void all_residuals(struct crystal_refls *crystals, int n_crystals, RefLis
 	int n_non_linear_free = 0;
 	int n_non_log = 0;
 	int n_non_log_free = 0;
+	int counts[9];
 
 	*presidual = 0.0;
 	*pfree_residual = 0.0;
@@ -796,29 +905,41 @@ static void all_residuals(struct crystal_refls *crystals, int n_crystals, RefLis
 
 		double r, free_r, log_r, free_log_r;
 		int n;
+		struct joined_refls j;
+		double G, B;
 
 		if ( crystal_get_user_flag(crystals[i].cr) ) continue;
 
+		/* All four residuals use the same matches in the merged list */
+		if ( join_crystal_refls(crystals[i].refls, crystals[i].cr,
+		                        full, &j) )
+		{
+			ERROR("Failed to allocate memory for residuals.\n");
+			continue;
+		}
+		G = crystal_get_osf(crystals[i].cr);
+		B = crystal_get_Bfac(crystals[i].cr);
+
 		/* Scaling should have been done right before calling this */
-		r = residual(crystals[i].refls, crystals[i].cr, full, 0, &n, NULL);
+		r = joined_residual(&j, G, B, 0, &n);
 		if ( n == 0 ) {
 			n_non_linear++;
 		} else if ( isnan(r) ) {
 			n_nan_linear++;
 		}
-		free_r = residual(crystals[i].refls, crystals[i].cr, full, 1, &n, NULL);
+		free_r = joined_residual(&j, G, B, 1, &n);
 		if ( n == 0 ) {
 			n_non_linear_free++;
 		} else if ( isnan(free_r) ) {
 			n_nan_linear_free++;
 		}
-		log_r = log_residual(crystals[i].refls, crystals[i].cr, full, 0, &n, NULL);
+		log_r = joined_log_residual(&j, G, B, 0, &n);
 		if ( n == 0 ) {
 			n_non_log++;
 		} else if ( isnan(log_r) ) {
 			n_nan_log++;
 		}
-		free_log_r = log_residual(crystals[i].refls, crystals[i].cr, full, 1, &n, NULL);
+		free_log_r = joined_log_residual(&j, G, B, 1, &n);
 		if ( n == 0 ) {
 			n_non_log_free++;
 		} else if ( isnan(free_log_r) ) {
@@ -837,6 +958,28 @@ static void all_residuals(struct crystal_refls *crystals, int n_crystals, RefLis
 		n_used++;
 	}
 
+	sum_residuals(presidual, pfree_residual, plog_residual,
+	              pfree_log_residual);
+	counts[0] = n_used;
+	counts[1] = n_nan_linear;
+	counts[2] = n_nan_linear_free;
+	counts[3] = n_nan_log;
+	counts[4] = n_nan_log_free;
+	counts[5] = n_non_linear;
+	counts[6] = n_non_linear_free;
+	counts[7] = n_non_log;
+	counts[8] = n_non_log_free;
+	dist_sum_ints(counts, 9);
+	n_used = counts[0];
+	n_nan_linear = counts[1];
+	n_nan_linear_free = counts[2];
+	n_nan_log = counts[3];
+	n_nan_log_free = counts[4];
+	n_non_linear = counts[5];
+	n_non_linear_free = counts[6];
+	n_non_log = counts[7];
+	n_non_log_free = counts[8];
+
 	if ( n_non_linear ) {
 		ERROR("WARNING: %i crystals had no reflections in linear "
 		      "residual calculation\n", n_non_linear);
@@ -1067,6 +1210,42 @@ static void write_harvest_file(const char *filename,
 }
 
 
+/* Cancelled by Ctrl-C, to stop refinement early */
+static TPCancelToken *interrupt_token = NULL;
+
+static void sigint_handler(int sig, siginfo_t *si, void *uc_v)
+{
+	tp_cancel(interrupt_token);
+}
+
+
+static void catch_interrupt()
+{
+	struct sigaction sa;
+
+	interrupt_token = tp_cancel_token_new();
+	if ( interrupt_token == NULL ) return;
+
+	/* A second Ctrl-C will stop the program as usual */
+	sa.sa_flags = SA_SIGINFO | SA_RESETHAND | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_sigaction = sigint_handler;
+	if ( sigaction(SIGINT, &sa, NULL) == -1 ) {
+		ERROR("Failed to set signal handler!\n");
+		tp_cancel_token_free(interrupt_token);
+		interrupt_token = NULL;
+	}
+}
+
+
+static void release_interrupt()
+{
+	signal(SIGINT, SIG_DFL);
+	tp_cancel_token_free(interrupt_token);
+	interrupt_token = NULL;
+}
+
+
 int main(int argc, char *argv[])
 {
 	int c;
@@ -1082,11 +1261,14 @@ int main(int argc, char *argv[])
 	SymOpList *w_sym;
 	int nthreads = 1;
 	int istream, icmd, icryst, itn;
+	int start_itn = 0;
+	int resumed = 0;
 	int n_iter = 10;
 	RefList *full;
 	int n_images = 0;
 	int n_crystals = 0;
 	int n_crystals_seen = 0;
+	int n_accepted = 0;
 	char cmdline[1024];
 	int no_scale = 0;
 	int no_Bscale = 0;
@@ -1115,6 +1297,11 @@ int main(int argc, char *argv[])
 	char *rfile = NULL;
 	RefList *reference = NULL;
 	int no_logs = 0;
+	int log_archive = 0;
+	LogArchive *la;
+	struct merge_contributions *mc;
+	enum pr_method pr_method = PR_METHOD_SEARCH;
+	int benchmark_pr = 0;
 	char *w_sym_str = NULL;
 	char *operator = NULL;
 	double force_bandwidth = -1.0;
@@ -1125,8 +1312,19 @@ int main(int argc, char *argv[])
 	double min_res = 0.0;
 	int do_write_logs = 0;
 	int no_deltacchalf = 0;
+	int lean_reflections = 0;
+	int cpu_pin = 0;
+	int deterministic = 0;
+	StreamFlags stream_flags;
+	int spill_flags = 0;
+	ThreadPool *pool;
 	char *harvest_file = NULL;
 	char *log_folder = "pr-logs";
+	int spectrum_table = 0;
+	double max_table_err = 0.0;
+	char *spill_dir = NULL;
+	char *checkpoint_fn = NULL;
+	char *resume_fn = NULL;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -1162,6 +1360,11 @@ int main(int argc, char *argv[])
 		{"harvest-file",       1, NULL,               16},
 		{"log-folder",         1, NULL,               17},
 		{"unmerged-output",    1, NULL,               18},
+		{"spectrum-table",     1, NULL,               19},
+		{"spill-dir",          1, NULL,               20},
+		{"checkpoint",         1, NULL,               21},
+		{"resume-from",        1, NULL,               22},
+		{"pr-method",          1, NULL,               23},
 
 		{"no-scale",           0, &no_scale,           1},
 		{"no-Bscale",          0, &no_Bscale,          1},
@@ -1169,7 +1372,12 @@ int main(int argc, char *argv[])
 		{"no-free",            0, &no_free,            1},
 		{"output-every-cycle", 0, &output_everycycle,  1},
 		{"no-logs",            0, &no_logs,            1},
+		{"log-archive",        0, &log_archive,        1},
 		{"no-deltacchalf",     0, &no_deltacchalf,     1},
+		{"lean-reflections",   0, &lean_reflections,   1},
+		{"cpu-pin",            0, &cpu_pin,            1},
+		{"deterministic",      0, &deterministic,      1},
+		{"benchmark-pr",       0, &benchmark_pr,       1},
 
 		{0, 0, NULL, 0}
 	};
@@ -1359,6 +1567,39 @@ int main(int argc, char *argv[])
 			unmerged_filename = strdup(optarg);
 			break;
 
+			case 19 :
+			errno = 0;
+			spectrum_table = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (spectrum_table < 2) ) {
+				ERROR("Invalid value for --spectrum-table.\n");
+				return 1;
+			}
+			break;
+
+			case 20 :
+			spill_dir = strdup(optarg);
+			break;
+
+			case 21 :
+			checkpoint_fn = strdup(optarg);
+			break;
+
+			case 22 :
+			resume_fn = strdup(optarg);
+			break;
+
+			case 23 :
+			if ( strcmp(optarg, "search") == 0 ) {
+				pr_method = PR_METHOD_SEARCH;
+			} else if ( strcmp(optarg, "bfgs") == 0 ) {
+				pr_method = PR_METHOD_BFGS;
+			} else {
+				ERROR("Unknown post-refinement method '%s'.\n",
+				      optarg);
+				return 1;
+			}
+			break;
+
 			case 0 :
 			break;
 
@@ -1377,12 +1618,39 @@ int main(int argc, char *argv[])
 		add_stream(argv[optind++], &stream_list);
 	}
 
+	/* When started with mpirun (or similar), each rank takes a share of
+	 * the crystals */
+	dist_init(&argc, &argv);
+	if ( dist_size() > 1 ) {
+		if ( (checkpoint_fn != NULL) || (resume_fn != NULL) ) {
+			ERROR("--checkpoint and --resume-from can't be used "
+			      "with MPI.\n");
+			return 1;
+		}
+		if ( unmerged_filename != NULL ) {
+			ERROR("--unmerged-output can't be used with MPI.\n");
+			return 1;
+		}
+		STATUS("Running on %i ranks.\n", dist_size());
+	}
+
 	if ( nthreads < 1 ) {
 		ERROR("Invalid number of threads.\n");
 		return 1;
 	}
 
-	if ( stream_list.n == 0 ) {
+	if ( resume_fn != NULL ) {
+		if ( stream_list.n > 0 ) {
+			ERROR("Don't give any input filenames with "
+			      "--resume-from.\n");
+			return 1;
+		}
+		if ( sparams_fn != NULL ) {
+			ERROR("--start-params can't be used with "
+			      "--resume-from.\n");
+			return 1;
+		}
+	} else if ( stream_list.n == 0 ) {
 		ERROR("Please give at least one input filename\n");
 		return 1;
 	}
@@ -1462,9 +1730,10 @@ int main(int argc, char *argv[])
 		scaleflags |= SCALE_NO_B;
 	}
 
-	/* Decide whether or not to create stuff in the pr-logs folder */
+	/* Decide whether or not to create stuff in the pr-logs folder.
+	 * With MPI, only the first rank writes logs, for its own crystals. */
 	if ( !(no_logs || (no_pr && pmodel == PMODEL_UNITY)) ) {
-		do_write_logs = 1;
+		do_write_logs = (dist_rank() == 0);
 	} else {
 		do_write_logs = 0;
 	}
@@ -1482,7 +1751,7 @@ int main(int argc, char *argv[])
 				return 1;
 			}
 		}
-	} else {
+	} else if ( dist_rank() == 0 ) {
 		struct stat s;
 		if ( stat(log_folder, &s) != -1 ) {
 			ERROR("WARNING: Log folder (%s) exists, but I will not "
@@ -1510,12 +1779,13 @@ int main(int argc, char *argv[])
 		}
 		reference = asymmetric_indices(rread, sym);
 		reflist_free(rread);
+		reflist_freeze(reference);
 		ERROR("WARNING: Using an external reference.\n");
 		ERROR("WARNING: If you publish a structure based on the result,"
 		      " expect to have to retract your paper!\n");
 	}
 
-	if ( harvest_file != NULL ) {
+	if ( (harvest_file != NULL) && (dist_rank() == 0) ) {
 		write_harvest_file(harvest_file,
 		                   pmodel_str,
 		                   symmetry_name(sym),
@@ -1553,15 +1823,41 @@ int main(int argc, char *argv[])
 		sparams_fh = NULL;
 	}
 
+	stream_flags = STREAM_REFLECTIONS;
+	if ( lean_reflections ) stream_flags |= STREAM_LEAN_REFLECTIONS;
+
+	if ( spill_dir != NULL ) {
+		if ( reflist_set_spill_dir(spill_dir) ) return 1;
+		spill_flags = REFLIST_SPILL;
+		STATUS("Reflections will be kept in a working file in %s\n",
+		       spill_dir);
+		free(spill_dir);
+	}
+
 	audit_info = NULL;
 	for ( istream=0; istream<stream_list.n; istream++ ) {
 
+		StreamReader *sr;
 		Stream *st = stream_open_for_read(stream_list.filenames[istream]);
 		if ( st == NULL ) {
 			ERROR("Couldn't open %s\n", stream_list.filenames[istream]);
 			return 1;
 		}
 
+		/* Saturated reflections, those which won't be merged and those
+		 * of crystals with too low resolution are left out while
+		 * reading, so they never take up memory */
+		stream_set_reflection_cutoffs(st, max_adu, min_res, push_res);
+
+		/* In order, because the initial scaling factors and the free
+		 * reflection selection depend on it */
+		sr = stream_reader_new(st, stream_flags, nthreads, 1);
+		if ( sr == NULL ) {
+			ERROR("Couldn't start reading %s\n",
+			      stream_list.filenames[istream]);
+			return 1;
+		}
+
 		if ( audit_info == NULL ) {
 			audit_info = stream_audit_info(st);
 		}
@@ -1571,7 +1867,7 @@ int main(int argc, char *argv[])
 			struct image *image;
 			int i;
 
-			image = stream_read_chunk(st, STREAM_REFLECTIONS);
+			image = stream_reader_next(sr);
 			if ( image == NULL ) break;
 
 			if ( isnan(image->div) || isnan(image->bw) ) {
@@ -1595,11 +1891,21 @@ int main(int argc, char *argv[])
 
 				lowest_r = lowest_reflection(crystal_get_cell(image->crystals[i].cr));
 				if ( crystal_get_profile_radius(image->crystals[i].cr) > 0.5*lowest_r ) {
-					ERROR("Rejecting %s %s crystal %i because "
-					      "profile radius is obviously too big (%e %e).\n",
-					      image->filename, image->ev, i,
-					      crystal_get_profile_radius(image->crystals[i].cr),
-					      lowest_r);
+					if ( dist_rank() == 0 ) {
+						ERROR("Rejecting %s %s crystal %i because "
+						      "profile radius is obviously too big (%e %e).\n",
+						      image->filename, image->ev, i,
+						      crystal_get_profile_radius(image->crystals[i].cr),
+						      lowest_r);
+					}
+					continue;
+				}
+
+				/* With MPI, the crystals are shared out in turn */
+				n_accepted++;
+				if ( (n_accepted-1) % dist_size() != dist_rank() ) {
+					if ( sparams_fh != NULL ) skip_to_end(sparams_fh);
+					if ( n_accepted == stop_after ) break;
 					continue;
 				}
 
@@ -1643,11 +1949,24 @@ int main(int argc, char *argv[])
 				image_for_crystal->bad = NULL;
 				image_for_crystal->sat = NULL;
 
-				cr_refl = apply_max_adu(image->crystals[i].refls, max_adu);
+				cr_refl = image->crystals[i].refls;
 				if ( !no_free ) select_free_reflections(cr_refl, rng);
+
+				/* Size the symmetry lookup table using the
+				 * first crystal.  Anything outside it is still
+				 * handled, just more slowly */
+				if ( n_crystals == 0 ) {
+					double rmin, rmax;
+					resolution_limits(cr_refl, crystal_get_cell(cr),
+					                  &rmin, &rmax);
+					make_asymm_table_for_cell(sym,
+					                          crystal_get_cell(cr),
+					                          rmax);
+				}
+
 				image_add_crystal_refls(image_for_crystal, cr,
-				                        asymmetric_indices(cr_refl, sym));
-				reflist_free(cr_refl);
+				                        asymmetric_copy(cr_refl, sym,
+				                                        spill_flags));
 
 				crystals[n_crystals].cr = image_for_crystal->crystals[0].cr;
 				crystals[n_crystals].refls = image_for_crystal->crystals[0].refls;
@@ -1661,9 +1980,17 @@ int main(int argc, char *argv[])
 					return 1;
 				}
 
+				if ( spectrum_table > 0 ) {
+					Spectrum *spec = image_for_crystal->spectrum;
+					double err;
+					err = spectrum_set_density_table(spec,
+					                                 spectrum_table);
+					if ( err > max_table_err ) max_table_err = err;
+				}
+
 				n_crystals++;
 
-				if ( n_crystals == stop_after ) break;
+				if ( n_accepted == stop_after ) break;
 
 			}
 
@@ -1675,10 +2002,11 @@ int main(int argc, char *argv[])
 				display_progress(n_images, n_crystals);
 			}
 
-			if ( (stop_after>0) && (n_crystals == stop_after) ) break;
+			if ( (stop_after>0) && (n_accepted == stop_after) ) break;
 
 		} while ( 1 );
 
+		stream_reader_free(sr);
 		stream_close(st);
 
 	}
@@ -1686,10 +2014,74 @@ int main(int argc, char *argv[])
 	free(stream_list.filenames);
 	free(stream_list.streams);
 
-	display_progress(n_images, n_crystals);
-	fprintf(stderr, "\n");
+	if ( resume_fn != NULL ) {
+
+		struct checkpoint ck;
+		int flags = REFLIST_ARENA | REFLIST_NO_LOCKS;
+
+		if ( lean_reflections ) flags |= REFLIST_LEAN;
+		if ( spill_dir != NULL ) flags |= REFLIST_SPILL;
+		if ( read_checkpoint(resume_fn, &ck, flags) ) return 1;
+
+		if ( strcmp(ck.sym, symmetry_name(sym)) != 0 ) {
+			ERROR("The checkpoint was made with point group %s, "
+			      "not %s.\n", ck.sym, symmetry_name(sym));
+			return 1;
+		}
+		free(ck.sym);
+
+		crystals = ck.crystals;
+		images = ck.images;
+		n_crystals = ck.n_crystals;
+		start_itn = ck.itn;
+		full = ck.full;
+		if ( ck.audit_info[0] != '\0' ) {
+			audit_info = ck.audit_info;
+		} else {
+			free(ck.audit_info);
+		}
+
+		for ( icryst=0; icryst<n_crystals; icryst++ ) {
+			struct image *image = images[icryst];
+			image->spectrum = spectrum_generate_gaussian(image->lambda,
+			                                             image->bw);
+			if ( spectrum_table > 0 ) {
+				double err;
+				err = spectrum_set_density_table(image->spectrum,
+				                                 spectrum_table);
+				if ( err > max_table_err ) max_table_err = err;
+			}
+		}
+
+		STATUS("Resuming from %s after %i cycles of refinement, "
+		       "with %i crystals.\n", resume_fn, start_itn, n_crystals);
+		free(resume_fn);
+		resumed = 1;
+
+	} else {
+		display_progress(n_images, n_crystals);
+		fprintf(stderr, "\n");
+	}
+
+	if ( dist_size() > 1 ) {
+		int counts[2];
+		counts[0] = n_crystals;
+		counts[1] = (n_crystals == 0);
+		dist_sum_ints(counts, 2);
+		if ( counts[1] ) {
+			ERROR("Not enough crystals for all of the ranks.\n");
+			return 1;
+		}
+		STATUS("%i crystals shared between the ranks.\n", counts[0]);
+	}
 	if ( sparams_fh != NULL ) fclose(sparams_fh);
 
+	if ( spectrum_table > 0 ) {
+		STATUS("Spectra tabulated with %i samples.  Largest "
+		       "interpolation error: %.2e of the peak density.\n",
+		       spectrum_table, max_table_err);
+	}
+
 	STATUS("Initial partiality calculation...\n");
 	for ( icryst=0; icryst<n_crystals; icryst++ ) {
 
@@ -1697,54 +2089,95 @@ int main(int argc, char *argv[])
 		RefList *refls = crystals[icryst].refls;
 		update_predictions(refls, cr, images[icryst]);
 
-		/* Polarisation correction requires kpred values */
-		polarisation_correction(refls, crystal_get_cell(cr), polarisation);
+		/* Polarisation correction requires kpred values.  The
+		 * intensities in a checkpoint have already been corrected. */
+		if ( !resumed ) {
+			polarisation_correction(refls, crystal_get_cell(cr),
+			                        polarisation);
+		}
 		calculate_partialities(refls, cr, images[icryst], pmodel);
 	}
 
 	if (csplit != NULL) check_csplit(crystals, images, n_crystals, csplit);
 
+	/* Re-use the same worker threads for all the parallel parts */
+	pool = thread_pool_new_with_flags(nthreads,
+	                                  cpu_pin ? TP_PIN_THREADS : 0);
+	set_default_thread_pool(pool);
+	set_deterministic_reductions(deterministic);
+
 	/* Make a first pass at cutting out crap */
 	//STATUS("Early rejection...\n");
 	//early_rejection(crystals, n_crystals);
 
-	/* Create reference data set if we don't already have one */
-	if ( reference == NULL ) {
-		if ( !no_scale ) {
-			STATUS("Initial scaling...\n");
-			scale_all(crystals, n_crystals, nthreads, scaleflags);
+	if ( resumed ) {
+
+		/* The checkpoint contains the merged intensities from the
+		 * last cycle, unless there is an external reference */
+		if ( reference != NULL ) {
+			reflist_free(full);
+			full = reference;
 		}
-		full = merge_intensities(crystals, n_crystals, nthreads,
-		                         min_measurements, push_res, 1, 0);
+
 	} else {
-		full = reference;
-	}
 
-	/* Check rejection and write figures of merit */
-	check_rejection(crystals, n_crystals, full, max_B, no_deltacchalf,
-	                nthreads);
-	show_all_residuals(crystals, n_crystals, full, no_free);
+		/* Create reference data set if we don't already have one */
+		if ( reference == NULL ) {
+			if ( !no_scale ) {
+				STATUS("Initial scaling...\n");
+				scale_all(crystals, n_crystals, nthreads, scaleflags);
+			}
+			full = merge_intensities(crystals, n_crystals, nthreads,
+			                         min_measurements, push_res, 1, 0);
+		} else {
+			full = reference;
+		}
+
+		/* Check rejection and write figures of merit */
+		mc = contributions_for_rejection(crystals, n_crystals, full,
+		                                 reference, no_deltacchalf,
+		                                 push_res);
+		check_rejection(crystals, n_crystals, full, mc, max_B,
+		                no_deltacchalf, nthreads);
+		free_merge_contributions(mc);
+		show_all_residuals(crystals, n_crystals, full, no_free);
+
+		if ( do_write_logs ) {
+			la = start_log_archive(log_archive, log_folder, 0);
+			write_pgraph(full, crystals, n_crystals, 0, "", log_folder);
+			write_logs_parallel(crystals, images, n_crystals, full, 0, nthreads,
+			                    scaleflags, pmodel, log_folder);
+			end_log_archive(la);
+		}
+
+		save_checkpoint(checkpoint_fn, 0, sym, audit_info, crystals,
+		                images, n_crystals, full);
 
-	if ( do_write_logs ) {
-		write_pgraph(full, crystals, n_crystals, 0, "", log_folder);
-		write_logs_parallel(crystals, images, n_crystals, full, 0, nthreads,
-		                    scaleflags, pmodel, log_folder);
 	}
 
-	/* Iterate */
-	for ( itn=0; itn<n_iter; itn++ ) {
+	/* Iterate.  Ctrl-C skips the rest of the refinement */
+	catch_interrupt();
+	for ( itn=start_itn; itn<n_iter; itn++ ) {
+
+		/* All ranks must stop together */
+		int cancelled = tp_cancelled(interrupt_token);
+		dist_sum_ints(&cancelled, 1);
+		if ( cancelled ) break;
 
 		STATUS("Scaling and refinement cycle %i of %i\n", itn+1, n_iter);
 
+		la = start_log_archive(log_archive && do_write_logs, log_folder,
+		                       itn+1);
+
 		if ( !no_pr ) {
 			refine_all(crystals, images, n_crystals, full, nthreads, pmodel,
-			           itn+1, no_logs, sym, amb, scaleflags,
-			           log_folder);
+			           itn+1, !do_write_logs, sym, amb, scaleflags,
+			           log_folder, pr_method, benchmark_pr,
+			           interrupt_token);
 		}
 
 		/* Create new reference if needed */
 		if ( reference == NULL ) {
-			free_contribs(full);
 			reflist_free(full);
 			if ( !no_scale ) {
 				scale_all(crystals, n_crystals, nthreads,
@@ -1755,14 +2188,22 @@ int main(int argc, char *argv[])
 			                         push_res, 1, 0);
 		} /* else full still equals reference */
 
-		check_rejection(crystals, n_crystals, full, max_B,
+		mc = contributions_for_rejection(crystals, n_crystals, full,
+		                                 reference, no_deltacchalf,
+		                                 push_res);
+		check_rejection(crystals, n_crystals, full, mc, max_B,
 		                no_deltacchalf, nthreads);
+		free_merge_contributions(mc);
 		show_all_residuals(crystals, n_crystals, full, no_free);
 
 		if ( do_write_logs ) {
 			write_pgraph(full, crystals, n_crystals, itn+1, "",
 			             log_folder);
 		}
+		end_log_archive(la);
+
+		save_checkpoint(checkpoint_fn, itn+1, sym, audit_info, crystals,
+		                images, n_crystals, full);
 
 		if ( output_everycycle ) {
 
@@ -1770,32 +2211,26 @@ int main(int argc, char *argv[])
 			snprintf(tmp, 1024, "iter%.2d_%s", itn+1, outfile);
 
 			/* Output results */
-			STATUS("Writing overall results to %s\n", tmp);
-			write_reflist_2(tmp, full, sym);
-
-			/* Output split results */
-			write_split(crystals, n_crystals, tmp, nthreads, pmodel,
-			            min_measurements, sym, push_res);
-
-			/* Output custom split results */
-			if ( csplit != NULL ) {
-				int j;
-				for ( j=0; j<csplit->n_datasets; j++ ) {
-					write_custom_split(csplit, j, crystals,
-					                   images, n_crystals, pmodel,
-					                   min_measurements,
-							   push_res, sym,
-					                   nthreads, tmp);
-				}
+			if ( dist_rank() == 0 ) {
+				STATUS("Writing overall results to %s\n", tmp);
+				write_reflist_2(tmp, full, sym);
 			}
 
+			/* Output split and custom split results */
+			write_splits(crystals, images, n_crystals, csplit, tmp,
+			             nthreads, min_measurements, sym, push_res);
+
 		}
 	}
 
+	if ( tp_cancelled(interrupt_token) ) {
+		STATUS("Interrupted - skipping to final merge.\n");
+	}
+	release_interrupt();
+
 	/* Final merge */
 	STATUS("Final merge...\n");
 	if ( reference == NULL ) {
-		free_contribs(full);
 		reflist_free(full);
 		if ( !no_scale ) {
 			scale_all(crystals, n_crystals, nthreads, scaleflags);
@@ -1815,9 +2250,11 @@ int main(int argc, char *argv[])
 	/* Write final figures of merit (no rejection any more) */
 	show_all_residuals(crystals, n_crystals, full, no_free);
 	if ( do_write_logs ) {
+		la = start_log_archive(log_archive, log_folder, -1);
 		write_pgraph(full, crystals, n_crystals, -1, "", log_folder);
 		write_logs_parallel(crystals, images, n_crystals, full, -1, nthreads,
 		                    scaleflags, pmodel, log_folder);
+		end_log_archive(la);
 	}
 
 	/* Output results */
@@ -1828,29 +2265,21 @@ int main(int argc, char *argv[])
 		reflist_add_notes(full, audit_info);
 		free(audit_info);
 	}
-	write_reflist_2(outfile, full, sym);
+	if ( dist_rank() == 0 ) write_reflist_2(outfile, full, sym);
 
-	/* Output split results */
-	write_split(crystals, n_crystals, outfile, nthreads, pmodel,
-	            min_measurements, sym, push_res);
-
-	/* Output custom split results */
-	if ( csplit != NULL ) {
-		int i;
-		for ( i=0; i<csplit->n_datasets; i++ ) {
-			write_custom_split(csplit, i, crystals, images, n_crystals,
-			                   pmodel, min_measurements, push_res,
-			                   sym, nthreads, outfile);
-		}
-	}
+	/* Output split and custom split results */
+	write_splits(crystals, images, n_crystals, csplit, outfile, nthreads,
+	             min_measurements, sym, push_res);
 
 	/* Clean up */
+	set_default_thread_pool(NULL);
+	thread_pool_free(pool);
 	gsl_rng_free(rng);
-	free_contribs(full);
 	reflist_free(full);
 	free_symoplist(sym);
 	free(outfile);
 	free(crystals);
+	dist_finish();
 
 	return 0;
 }
@@ -32,7 +32,10 @@
 
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <sys/time.h>
 
 #include "image.h"
 #include "post-refinement.h"
@@ -44,6 +47,8 @@
 #include "reflist-utils.h"
 #include "scaling.h"
 #include "merge.h"
+#include "log-archive.h"
+#include "distribute.h"
 
 struct rf_alteration
 {
@@ -66,6 +71,34 @@ struct rf_priv
 	Crystal *cr_tgt;         /**< Crystal to use for testing modifications */
 	struct image image_tgt;  /**< Image structure to go with cr_tgt */
 	RefList *refls;          /**< The reflections to use */
+
+	int n_eval;              /**< Number of residual evaluations so far */
+
+	struct trial_refl *trials;  /**< See make_trials() */
+	int n_trials;
+	double trial_lambda;     /**< Wavelength of image_tgt.spectrum */
+};
+
+
+/* Everything about a reflection which the residual depends on, apart from
+ * the partiality.  None of it changes between trials. */
+struct trial_refl
+{
+	double xl, yl, zl;  /* Reciprocal lattice position before rotation */
+	double q2;
+	double pobs;
+	double w;
+	double p;           /* Partiality, if it doesn't depend on anything */
+	int free;
+};
+
+
+/* Results from refining one crystal, for --benchmark-pr */
+struct pr_stats
+{
+	int n_eval;
+	double time;
+	double fom;
 };
 
 
@@ -100,6 +133,19 @@ const char *str_prflag(enum prflag flag)
 }
 
 
+/* A new spectrum for apply_parameters() to fill in, tabulated in the same way
+ * as the original */
+static Spectrum *target_spectrum(struct image *image)
+{
+	Spectrum *spectrum = spectrum_new();
+	if ( (spectrum != NULL) && (image->spectrum != NULL) ) {
+		int n = spectrum_get_density_table_size(image->spectrum);
+		spectrum_set_density_table(spectrum, n);
+	}
+	return spectrum;
+}
+
+
 static void rotate_cell_xy(UnitCell *source, UnitCell *tgt,
                            double ang1, double ang2)
 {
@@ -173,35 +219,208 @@ static void apply_parameters(Crystal *cr_orig, Crystal *cr_tgt,
 }
 
 
+/* Only these partiality models use the excitation errors or partialities
+ * calculated by update_predictions().  The others work out everything they
+ * need from the crystal and image parameters, and the residual doesn't
+ * depend on the spot positions. */
+static int pmodel_uses_predictions(PartialityModel pmodel)
+{
+	return (pmodel == PMODEL_OFFSET) || (pmodel == PMODEL_GGPM);
+}
+
+
+/* Residual for a trial, using the values stored by make_trials().  Only the
+ * z-component of the rotated reciprocal lattice position is needed. */
+static double trial_residual(struct rf_priv *pv, struct rf_alteration alter,
+                             double R0, double lambda, int free)
+{
+	double sx = sin(alter.rot_x);
+	double cx = cos(alter.rot_x);
+	double sy = sin(alter.rot_y);
+	double cy = cos(alter.rot_y);
+	double m = crystal_get_mosaicity(pv->cr);
+	double num = 0.0;
+	double den = 0.0;
+	int i;
+
+	if ( (pv->pmodel == PMODEL_XSPHERE) && (lambda != pv->trial_lambda) ) {
+		struct gaussian g;
+		g.kcen = 1.0/lambda;
+		g.sigma = pv->image->bw/lambda;
+		g.area = 1;
+		spectrum_set_gaussians(pv->image_tgt.spectrum, &g, 1);
+		pv->trial_lambda = lambda;
+	}
+
+	for ( i=0; i<pv->n_trials; i++ ) {
+
+		const struct trial_refl *t = &pv->trials[i];
+		double p;
+
+		if ( t->free != free ) continue;
+
+		if ( pv->pmodel == PMODEL_XSPHERE ) {
+			double z1 = -t->yl*sx + t->zl*cx;
+			double zl = -t->xl*sy + z1*cy;
+			double R = fabs(R0) + m*sqrt(t->q2);
+			p = xsphere_partiality(t->q2, zl, R, lambda,
+			                       pv->image_tgt.spectrum);
+		} else {
+			p = t->p;
+		}
+
+		num += t->w*fabs(t->pobs - p);
+		den += t->w;
+
+	}
+
+	return num/den;
+}
+
+
 static double calc_residual(struct rf_priv *pv, struct rf_alteration alter,
                             int free)
 {
-	apply_parameters(pv->cr, pv->cr_tgt, pv->image, &pv->image_tgt, alter);
+	double R = crystal_get_profile_radius(pv->cr)+alter.delta_R;
+	double lambda = pv->image->lambda+alter.delta_wave;
 
-	if ( fabs(crystal_get_profile_radius(pv->cr_tgt)) > 5e9 ) {
+	pv->n_eval++;
+
+	if ( fabs(R) > 5e9 ) {
 		STATUS("radius > 5e9\n");
 		return NAN;
 	}
 
 	/* Can happen with grid scans and certain --force-radius values */
-	if ( fabs(crystal_get_profile_radius(pv->cr_tgt)) < 0.0000001e9 ) {
+	if ( fabs(R) < 0.0000001e9 ) {
 		//STATUS("radius very small\n");
 		return NAN;
 	}
 
-	if ( pv->image_tgt.lambda <= 0.0 ) {
+	if ( lambda <= 0.0 ) {
 		STATUS("lambda < 0\n");
 		return NAN;
 	}
 
-	update_predictions(pv->refls, pv->cr_tgt, &pv->image_tgt);
-	calculate_partialities(pv->refls, pv->cr_tgt, &pv->image_tgt, pv->pmodel);
+	if ( pv->trials != NULL ) {
+		return trial_residual(pv, alter, R, lambda, free);
+	}
 
+	apply_parameters(pv->cr, pv->cr_tgt, pv->image, &pv->image_tgt, alter);
+
+	/* The exact update is done after the refinement, in do_pr_refine() */
+	if ( pmodel_uses_predictions(pv->pmodel) ) {
+		update_predictions(pv->refls, pv->cr_tgt, &pv->image_tgt);
+	}
+	calculate_partialities(pv->refls, pv->cr_tgt, &pv->image_tgt, pv->pmodel);
 
 	return residual(pv->refls, pv->cr_tgt, pv->full, free, NULL, NULL);
 }
 
 
+/* Works out everything which calc_residual() needs that doesn't change
+ * between trials, in the same way as residual() and calculate_partialities()
+ * would, so that trials don't have to set up a new crystal and recalculate
+ * all the partialities.  Not possible if the partiality model needs the
+ * predictions to be updated. */
+static void make_trials(struct rf_priv *pv)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	const Reflection **matches;
+	UnitCell *cell = crystal_get_cell(pv->cr);
+	double G = crystal_get_osf(pv->cr);
+	double B = crystal_get_Bfac(pv->cr);
+	double asx, asy, asz, bsx, bsy, bsz, csx, csy, csz;
+	int i;
+
+	pv->trials = NULL;
+	pv->n_trials = 0;
+	pv->trial_lambda = NAN;
+
+	if ( pmodel_uses_predictions(pv->pmodel) ) return;
+
+	matches = reflist_match(pv->refls, pv->full);
+	if ( matches == NULL ) return;
+
+	/* The partialities don't depend on the parameters for these */
+	if ( pv->pmodel != PMODEL_XSPHERE ) {
+		calculate_partialities(pv->refls, pv->cr, pv->image, pv->pmodel);
+	}
+
+	pv->trials = malloc(num_reflections(pv->refls)*sizeof(struct trial_refl));
+	if ( pv->trials == NULL ) return;
+
+	cell_get_reciprocal(cell, &asx, &asy, &asz,
+	                          &bsx, &bsy, &bsz,
+	                          &csx, &csy, &csz);
+
+	for ( refl = first_refl(pv->refls, &iter), i=0;
+	      refl != NULL;
+	      refl = next_refl(refl, iter), i++ )
+	{
+		struct trial_refl *t;
+		signed int h, k, l;
+		const Reflection *match = matches[i];
+		double res, int1;
+
+		if ( match == NULL ) continue;
+		if ( get_redundancy(match) < 2 ) continue;
+
+		t = &pv->trials[pv->n_trials++];
+		t->free = get_flag(refl);
+
+		get_indices(refl, &h, &k, &l);
+		res = resolution(cell, h, k, l);
+		int1 = correct_reflection_nopart(get_intensity(refl), refl,
+		                                 G, B, res);
+		t->pobs = int1 / get_intensity(match);
+		if ( t->pobs > 1.0 ) t->pobs = 1.0;
+		if ( t->pobs < 0.0 ) t->pobs = 0.0;
+
+		t->w = 1.0 / correct_reflection_nopart(1.0, refl, G, B, res);
+		if ( isnan(t->w) ) t->w = 0.0;
+
+		get_symmetric_indices(refl, &h, &k, &l);
+		t->xl = h*asx + k*bsx + l*csx;
+		t->yl = h*asy + k*bsy + l*csy;
+		t->zl = h*asz + k*bsz + l*csz;
+		t->q2 = t->xl*t->xl + t->yl*t->yl + t->zl*t->zl;
+
+		t->p = get_partiality(refl);
+	}
+}
+
+
+static void setup_rf_priv(struct rf_priv *priv, Crystal *cr,
+                          struct image *image, RefList *list,
+                          const RefList *full, int serial, int scaleflags,
+                          PartialityModel pmodel)
+{
+	priv->cr = cr;
+	priv->full = full;
+	priv->serial = serial;
+	priv->scaleflags = scaleflags;
+	priv->pmodel = pmodel;
+	priv->cr_tgt = crystal_copy(cr);
+	priv->image = image;
+	priv->image_tgt = *image;
+	priv->image_tgt.spectrum = target_spectrum(image);
+	priv->refls = copy_reflist(list);
+	priv->n_eval = 0;
+	make_trials(priv);
+}
+
+
+static void free_rf_priv(struct rf_priv *priv)
+{
+	reflist_free(priv->refls);
+	crystal_free(priv->cr_tgt);
+	spectrum_free(priv->image_tgt.spectrum);
+	free(priv->trials);
+}
+
+
 static RefList *reindex_reflections(RefList *input, SymOpList *amb,
                                     SymOpList *sym, int idx)
 {
@@ -209,7 +428,7 @@ static RefList *reindex_reflections(RefList *input, SymOpList *amb,
 	Reflection *refl;
 	RefListIterator *iter;
 
-	n = reflist_new();
+	n = reflist_new_with_flags(reflist_get_flags(input));
 
 	for ( refl = first_refl(input, &iter);
 	      refl != NULL;
@@ -264,11 +483,15 @@ static void reindex_cell(UnitCell *cell, SymOpList *amb, int idx)
 }
 
 
+/* Each reindexing is tried without making a reindexed list.  As soon as one
+ * gives a lower residual, it is applied, and the remaining ones are tried
+ * on top of it. */
 static void try_reindex(RefList **prefls, Crystal *crin, struct image *image,
                         const RefList *full, SymOpList *sym, SymOpList *amb,
                         int scaleflags, PartialityModel pmodel)
 {
 	double residual_original;
+	double G, B;
 	int idx, n;
 
 	if ( sym == NULL || amb == NULL ) return;
@@ -276,38 +499,44 @@ static void try_reindex(RefList **prefls, Crystal *crin, struct image *image,
 	if ( scale_one_crystal(*prefls, crin, full, scaleflags) ) return;
 	residual_original = residual(*prefls, crin, full, 0, NULL, NULL);
 
+	/* The trial scaling must not change the crystal */
+	G = crystal_get_osf(crin);
+	B = crystal_get_Bfac(crin);
+
 	n = num_equivs(amb, NULL);
 
 	for ( idx=0; idx<n; idx++ ) {
 
-		RefList *list;
-		Crystal *cr;
+		struct joined_refls j;
 
-		cr = crystal_copy(crin);
+		if ( join_crystal_refls_reindexed(*prefls, crin, full, amb, sym,
+		                                  idx, &j) ) continue;
 
-		reindex_cell(crystal_get_cell(cr), amb, idx);
-		list = reindex_reflections(*prefls, amb, sym, idx);
-
-		update_predictions(list, cr, image);
-		calculate_partialities(list, cr, image, pmodel);
-		if ( scale_one_crystal(list, cr, full, scaleflags) == 0 ) {
+		if ( scale_joined(&j, crin, scaleflags) == 0 ) {
 
 			double residual_flipped;
-			residual_flipped = residual(list, cr, full, 0, NULL, NULL);
+			residual_flipped = joined_residual(&j,
+			                                   crystal_get_osf(crin),
+			                                   crystal_get_Bfac(crin),
+			                                   0, NULL);
 
 			if ( residual_flipped < residual_original ) {
-				crystal_set_cell(crin, crystal_relinquish_cell(cr));
+				RefList *list;
+				list = reindex_reflections(*prefls, amb, sym,
+				                           idx);
+				reindex_cell(crystal_get_cell(crin), amb, idx);
+				update_predictions(list, crin, image);
+				calculate_partialities(list, crin, image,
+				                       pmodel);
 				reflist_free(*prefls);
 				*prefls = list;
 				residual_original = residual_flipped;
-			} else {
-				reflist_free(list);
 			}
 		}
 
-		crystal_free(cr);
+		crystal_set_osf(crin, G);
+		crystal_set_Bfac(crin, B);
 	}
-
 }
 
 
@@ -316,19 +545,15 @@ void write_test_logs(Crystal *crystal, struct image *image, const RefList *full,
                      const char *log_folder)
 {
 	FILE *fh;
+	struct log_file lf;
 	char tmp[256];
 	char ins[16];
 
-	snprintf(tmp, 256, "%s/parameters-crystal%i.dat", log_folder, serial);
-
-	if ( cycle == 0 ) {
-		fh = fopen(tmp, "w");
-	} else {
-		fh = fopen(tmp, "a");
-	}
+	snprintf(tmp, 256, "parameters-crystal%i.dat", serial);
 
+	fh = log_open(&lf, log_folder, tmp, cycle != 0);
 	if ( fh == NULL ) {
-		ERROR("Failed to open '%s'\n", tmp);
+		ERROR("Failed to open '%s/%s'\n", log_folder, tmp);
 		return;
 	}
 
@@ -357,7 +582,7 @@ void write_test_logs(Crystal *crystal, struct image *image, const RefList *full,
 	        asx/1e10, bsx/1e10, csx/1e10,
 	        asy/1e10, bsy/1e10, csy/1e10,
 	        asz/1e10, bsz/1e10, csz/1e10);
-	fclose(fh);
+	log_close(&lf);
 }
 
 
@@ -366,6 +591,7 @@ void write_specgraph(RefList *list, Crystal *crystal, struct image *image, const
                      const char *log_folder)
 {
 	FILE *fh;
+	struct log_file lf;
 	char tmp[256];
 	Reflection *refl;
 	RefListIterator *iter;
@@ -373,17 +599,17 @@ void write_specgraph(RefList *list, Crystal *crystal, struct image *image, const
 	double B = crystal_get_Bfac(crystal);
 	UnitCell *cell;
 	char ins[16];
+	const Reflection **matches;
+	int i;
 
-	snprintf(tmp, 256, "%s/specgraph-crystal%i.dat", log_folder, serial);
+	matches = reflist_match(list, full);
+	if ( matches == NULL ) return;
 
-	if ( cycle == 0 ) {
-		fh = fopen(tmp, "w");
-	} else {
-		fh = fopen(tmp, "a");
-	}
+	snprintf(tmp, 256, "specgraph-crystal%i.dat", serial);
 
+	fh = log_open(&lf, log_folder, tmp, cycle != 0);
 	if ( fh == NULL ) {
-		ERROR("Failed to open '%s'\n", tmp);
+		ERROR("Failed to open '%s/%s'\n", log_folder, tmp);
 		return;
 	}
 
@@ -401,24 +627,22 @@ void write_specgraph(RefList *list, Crystal *crystal, struct image *image, const
 		ins[1] = '\0';
 	}
 
-	for ( refl = first_refl(list, &iter);
+	for ( refl = first_refl(list, &iter), i=0;
 	      refl != NULL;
-	      refl = next_refl(refl, iter) )
+	      refl = next_refl(refl, iter), i++ )
 	{
 		double Ipart, Ifull, pobs, pcalc;
 		double res;
 		signed int h, k, l;
-		Reflection *match;
+		const Reflection *match = matches[i];
 
 		/* Strong reflections only */
 		if ( get_intensity(refl) < 3.0*get_esd_intensity(refl) ) continue;
+		if ( match == NULL ) continue;
 
 		get_indices(refl, &h, &k, &l);
 		res = resolution(cell, h, k, l);
 
-		match = find_refl(full, h, k, l);
-		if ( match == NULL ) continue;
-
 		/* Don't calculate pobs if reference reflection is weak */
 		if ( fabs(get_intensity(match)) / get_esd_intensity(match) < 3.0 ) continue;
 
@@ -432,7 +656,7 @@ void write_specgraph(RefList *list, Crystal *crystal, struct image *image, const
 
 	}
 
-	fclose(fh);
+	log_close(&lf);
 }
 
 
@@ -443,25 +667,13 @@ static void write_angle_grid(RefList *list_in, Crystal *cr, struct image *image,
                              const char *log_folder)
 {
 	FILE *fh;
+	struct log_file lf;
 	char fn[64];
 	char ins[16];
 	struct rf_priv priv;
-	UnitCell *cell;
-	Spectrum *spectrum;
-
-	priv.cr = cr;
-	priv.full = full;
-	priv.serial = serial;
-	priv.scaleflags = scaleflags;
-	priv.pmodel = pmodel;
-	priv.cr_tgt = crystal_copy(cr);
-	priv.image = image;
-	priv.image_tgt = *image;
-	spectrum = spectrum_new();
-	priv.image_tgt.spectrum = spectrum;
-	priv.refls = copy_reflist(list_in);
-	cell = cell_new_from_cell(crystal_get_cell(cr));
-	crystal_set_cell(priv.cr_tgt, cell);
+
+	setup_rf_priv(&priv, cr, image, list_in, full, serial, scaleflags,
+	              pmodel);
 
 	if ( cycle >= 0 ) {
 		snprintf(ins, 16, "%i", cycle);
@@ -470,9 +682,8 @@ static void write_angle_grid(RefList *list_in, Crystal *cr, struct image *image,
 		ins[1] = '\0';
 	}
 
-	snprintf(fn, 64, "%s/grid-crystal%i-cycle%s-ang1-ang2.dat",
-	         log_folder, serial, ins);
-	fh = fopen(fn, "w");
+	snprintf(fn, 64, "grid-crystal%i-cycle%s-ang1-ang2.dat", serial, ins);
+	fh = log_open(&lf, log_folder, fn, 0);
 	if ( fh != NULL ) {
 		double v1, v2;
 		fprintf(fh, "%e %e %e %s\n", -5.0e-3, 5.0e-3, 0.0, "rot_x/rad");
@@ -493,12 +704,10 @@ static void write_angle_grid(RefList *list_in, Crystal *cr, struct image *image,
 			}
 			fprintf(fh, "\n");
 		}
-		fclose(fh);
+		log_close(&lf);
 	}
 
-	reflist_free(priv.refls);
-	crystal_free(priv.cr_tgt);
-	spectrum_free(spectrum);
+	free_rf_priv(&priv);
 }
 
 
@@ -509,25 +718,13 @@ static void write_radius_grid(RefList *list_in, Crystal *cr, struct image *image
                               const char *log_folder)
 {
 	FILE *fh;
+	struct log_file lf;
 	char fn[64];
 	char ins[16];
 	struct rf_priv priv;
-	UnitCell *cell;
-	Spectrum *spectrum;
-
-	priv.cr = cr;
-	priv.full = full;
-	priv.serial = serial;
-	priv.scaleflags = scaleflags;
-	priv.pmodel = pmodel;
-	priv.cr_tgt = crystal_copy(cr);
-	priv.image = image;
-	priv.image_tgt = *image;
-	spectrum = spectrum_new();
-	priv.image_tgt.spectrum = spectrum;
-	priv.refls = copy_reflist(list_in);
-	cell = cell_new_from_cell(crystal_get_cell(cr));
-	crystal_set_cell(priv.cr_tgt, cell);
+
+	setup_rf_priv(&priv, cr, image, list_in, full, serial, scaleflags,
+	              pmodel);
 
 	if ( cycle >= 0 ) {
 		snprintf(ins, 16, "%i", cycle);
@@ -536,9 +733,8 @@ static void write_radius_grid(RefList *list_in, Crystal *cr, struct image *image
 		ins[1] = '\0';
 	}
 
-	snprintf(fn, 64, "%s/grid-crystal%i-cycle%s-R-wave.dat",
-	         log_folder, serial, ins);
-	fh = fopen(fn, "w");
+	snprintf(fn, 64, "grid-crystal%i-cycle%s-R-wave.dat", serial, ins);
+	fh = log_open(&lf, log_folder, fn, 0);
 	if ( fh != NULL ) {
 		double v1, v2;
 		fprintf(fh, "%e %e %e %s\n", -4e-13, 4e-13, 0.0, "wavelength change/m");
@@ -559,12 +755,10 @@ static void write_radius_grid(RefList *list_in, Crystal *cr, struct image *image
 			}
 			fprintf(fh, "\n");
 		}
-		fclose(fh);
+		log_close(&lf);
 	}
 
-	reflist_free(priv.refls);
-	crystal_free(priv.cr_tgt);
-	spectrum_free(spectrum);
+	free_rf_priv(&priv);
 }
 
 
@@ -641,38 +835,249 @@ static void zero_alter(struct rf_alteration *alter)
 }
 
 
+/* The BFGS refinement works with all the parameters at once, in units of the
+ * step sizes used by the search in do_pr_refine() so that they have similar
+ * magnitudes.  The gradients are found by finite differences, because the
+ * partialities are not differentiable in closed form for all the models. */
+#define BFGS_N_PARAMS (4)
+#define BFGS_MAX_ITER (10)
+#define BFGS_FD_STEP (0.1)
+#define BFGS_MAX_STEP (5.0)
+#define BFGS_MAX_BACKTRACK (4)
+
+static const double bfgs_units[BFGS_N_PARAMS] = { 0.1e-3, 0.1e-3, 1e5, 2.0e-14 };
+
+
+static struct rf_alteration alter_from_vec(const double *x)
+{
+	struct rf_alteration alter;
+	alter.rot_x = x[0]*bfgs_units[0];
+	alter.rot_y = x[1]*bfgs_units[1];
+	alter.delta_R = x[2]*bfgs_units[2];
+	alter.delta_wave = x[3]*bfgs_units[3];
+	return alter;
+}
+
+
+static void vec_from_alter(struct rf_alteration alter, double *x)
+{
+	x[0] = alter.rot_x/bfgs_units[0];
+	x[1] = alter.rot_y/bfgs_units[1];
+	x[2] = alter.delta_R/bfgs_units[2];
+	x[3] = alter.delta_wave/bfgs_units[3];
+}
+
+
+static double dot4(const double *a, const double *b)
+{
+	int i;
+	double d = 0.0;
+	for ( i=0; i<BFGS_N_PARAMS; i++ ) d += a[i]*b[i];
+	return d;
+}
+
+
+/* Forward differences, or backward ones if the forward step goes somewhere
+ * the residual can't be calculated */
+static int residual_gradient(struct rf_priv *priv, const double *x, double f,
+                             double *g)
+{
+	int i;
+
+	for ( i=0; i<BFGS_N_PARAMS; i++ ) {
+
+		double xh[BFGS_N_PARAMS];
+		double fh;
+
+		memcpy(xh, x, sizeof(xh));
+		xh[i] += BFGS_FD_STEP;
+		fh = calc_residual(priv, alter_from_vec(xh), 0);
+		if ( !isnan(fh) ) {
+			g[i] = (fh - f) / BFGS_FD_STEP;
+			continue;
+		}
+
+		xh[i] = x[i] - BFGS_FD_STEP;
+		fh = calc_residual(priv, alter_from_vec(xh), 0);
+		if ( isnan(fh) ) return 1;
+		g[i] = (f - fh) / BFGS_FD_STEP;
+
+	}
+
+	return 0;
+}
+
+
+static void identity4(double *H, double scale)
+{
+	int i, j;
+	for ( i=0; i<BFGS_N_PARAMS; i++ ) {
+		for ( j=0; j<BFGS_N_PARAMS; j++ ) {
+			H[i*BFGS_N_PARAMS+j] = (i==j) ? scale : 0.0;
+		}
+	}
+}
+
+
+/* Quasi-Newton refinement of all the parameters together, starting from
+ * "cur", where the residual is "fom" */
+static void refine_bfgs(struct rf_alteration *cur, double fom,
+                        struct rf_priv *priv, int *total_iter, FILE *fh)
+{
+	double x[BFGS_N_PARAMS];
+	double g[BFGS_N_PARAMS];
+	double H[BFGS_N_PARAMS*BFGS_N_PARAMS];  /* Inverse Hessian estimate */
+	double f = fom;
+	int n_iter;
+	int n_updates = 0;
+
+	if ( isnan(f) ) return;
+
+	vec_from_alter(*cur, x);
+	if ( residual_gradient(priv, x, f, g) ) return;
+	identity4(H, 1.0);
+
+	for ( n_iter=0; n_iter<BFGS_MAX_ITER; n_iter++ ) {
+
+		double p[BFGS_N_PARAMS];
+		double xn[BFGS_N_PARAMS];
+		double gn[BFGS_N_PARAMS];
+		double s[BFGS_N_PARAMS];
+		double y[BFGS_N_PARAMS];
+		double Hy[BFGS_N_PARAMS];
+		double fn = NAN;
+		double gp, plen, t, sy;
+		int i, j, tries;
+
+		for ( i=0; i<BFGS_N_PARAMS; i++ ) {
+			p[i] = 0.0;
+			for ( j=0; j<BFGS_N_PARAMS; j++ ) {
+				p[i] -= H[i*BFGS_N_PARAMS+j]*g[j];
+			}
+		}
+
+		/* Not a descent direction: start again from steepest descent */
+		gp = dot4(g, p);
+		if ( gp >= 0.0 ) {
+			identity4(H, 1.0);
+			n_updates = 0;
+			for ( i=0; i<BFGS_N_PARAMS; i++ ) p[i] = -g[i];
+			gp = dot4(g, p);
+			if ( gp == 0.0 ) break;
+		}
+
+		/* Until there is some curvature information, take a step of the
+		 * same size as the search would.  Never go much further. */
+		plen = sqrt(dot4(p, p));
+		if ( (n_updates == 0) && (plen > 0.0) ) {
+			for ( i=0; i<BFGS_N_PARAMS; i++ ) p[i] /= plen;
+			gp /= plen;
+		} else if ( plen > BFGS_MAX_STEP ) {
+			for ( i=0; i<BFGS_N_PARAMS; i++ ) p[i] *= BFGS_MAX_STEP/plen;
+			gp *= BFGS_MAX_STEP/plen;
+		}
+
+		/* Backtracking line search */
+		t = 1.0;
+		for ( tries=0; tries<BFGS_MAX_BACKTRACK; tries++ ) {
+			for ( i=0; i<BFGS_N_PARAMS; i++ ) xn[i] = x[i] + t*p[i];
+			fn = calc_residual(priv, alter_from_vec(xn), 0);
+			if ( !isnan(fn) && (fn <= f + 1e-4*t*gp) ) break;
+			t *= 0.25;
+		}
+		if ( tries == BFGS_MAX_BACKTRACK ) break;
+
+		memcpy(x, xn, sizeof(x));
+		*cur = alter_from_vec(x);
+		(*total_iter)++;
+
+		if ( fh != NULL ) {
+			double freefom = calc_residual(priv, *cur, 1);
+			fprintf(fh, "%5i %10.8f  %10.8f %10.8f %10.8f  %e  %e\n",
+			        *total_iter, fn, freefom,
+			        cur->rot_x, cur->rot_y,
+			        crystal_get_profile_radius(priv->cr)+cur->delta_R,
+			        priv->image->lambda+cur->delta_wave);
+		}
+
+		if ( f - fn < 1e-4*f ) break;
+		if ( residual_gradient(priv, x, fn, gn) ) break;
+
+		for ( i=0; i<BFGS_N_PARAMS; i++ ) {
+			s[i] = t*p[i];
+			y[i] = gn[i] - g[i];
+		}
+		f = fn;
+		memcpy(g, gn, sizeof(g));
+
+		/* Skip the update if it would not keep H positive definite */
+		sy = dot4(s, y);
+		if ( sy <= 1e-12 ) continue;
+
+		/* Scale the initial estimate before the first update */
+		if ( n_updates == 0 ) identity4(H, sy/dot4(y, y));
+
+		for ( i=0; i<BFGS_N_PARAMS; i++ ) {
+			Hy[i] = 0.0;
+			for ( j=0; j<BFGS_N_PARAMS; j++ ) {
+				Hy[i] += H[i*BFGS_N_PARAMS+j]*y[j];
+			}
+		}
+		for ( i=0; i<BFGS_N_PARAMS; i++ ) {
+			for ( j=0; j<BFGS_N_PARAMS; j++ ) {
+				H[i*BFGS_N_PARAMS+j] += (1.0 + dot4(y, Hy)/sy)*s[i]*s[j]/sy
+				                        - (Hy[i]*s[j] + s[i]*Hy[j])/sy;
+			}
+		}
+		n_updates++;
+
+	}
+}
+
+
+#ifdef HAVE_CLOCK_GETTIME
+
+static double get_time()
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+}
+
+#else
+
+static double get_time()
+{
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return tp.tv_sec + tp.tv_usec*1e-6;
+}
+
+#endif
+
+
 static void do_pr_refine(RefList **plist_in, Crystal *cr, struct image *image,
                          const RefList *full,
                          PartialityModel pmodel, int serial,
                          int cycle, int write_logs,
                          SymOpList *sym, SymOpList *amb, int scaleflags,
-                         const char *log_folder)
+                         const char *log_folder, enum pr_method method,
+                         struct pr_stats *stats)
 {
 	struct rf_priv priv;
 	struct rf_alteration alter;
 	int n_iter = 0;
 	double fom, freefom;
 	FILE *fh = NULL;
-	UnitCell *cell;
-	Spectrum *spectrum;
+	struct log_file lf;
+	double t_start = get_time();
 
 	try_reindex(plist_in, cr, image, full, sym, amb, scaleflags, pmodel);
 
 	zero_alter(&alter);
 
-	priv.cr = cr;
-	priv.full = full;
-	priv.serial = serial;
-	priv.scaleflags = scaleflags;
-	priv.pmodel = pmodel;
-	priv.cr_tgt = crystal_copy(cr);
-	priv.image = image;
-	priv.image_tgt = *image;
-	spectrum = spectrum_new();
-	priv.image_tgt.spectrum = spectrum;
-	priv.refls = copy_reflist(*plist_in);
-	cell = cell_new_from_cell(crystal_get_cell(cr));
-	crystal_set_cell(priv.cr_tgt, cell);
+	setup_rf_priv(&priv, cr, image, *plist_in, full, serial, scaleflags,
+	              pmodel);
 
 	fom = calc_residual(&priv, alter, 0);
 	freefom = calc_residual(&priv, alter, 1);
@@ -681,9 +1086,8 @@ static void do_pr_refine(RefList **plist_in, Crystal *cr, struct image *image,
 
 		char fn[64];
 
-		snprintf(fn, 63, "%s/crystal%i-cycle%i.log",
-		         log_folder, serial, cycle);
-		fh = fopen(fn, "w");
+		snprintf(fn, 63, "crystal%i-cycle%i.log", serial, cycle);
+		fh = log_open(&lf, log_folder, fn, 0);
 		if ( fh != NULL ) {
 			fprintf(fh, "iter  FoM        FreeFoM     rotx/rad   "
 			            "roty/rad    radius/m      wavelength/m\n");
@@ -696,23 +1100,37 @@ static void do_pr_refine(RefList **plist_in, Crystal *cr, struct image *image,
 
 	}
 
-	/* Refine orientation */
-	struct rf_alteration dirns[4];
-	zero_alter(&dirns[0]);  dirns[0].rot_x += 0.1e-3;
-	zero_alter(&dirns[1]);  dirns[1].rot_x -= 0.1e-3;
-	zero_alter(&dirns[2]);  dirns[2].rot_y += 0.1e-3;
-	zero_alter(&dirns[3]);  dirns[3].rot_y -= 0.1e-3;
-	refine_loop(&alter, dirns, 4, &priv, &n_iter, fh);
+	if ( method == PR_METHOD_BFGS ) {
+
+		refine_bfgs(&alter, fom, &priv, &n_iter, fh);
 
-	/* Refine profile radius */
-	zero_alter(&dirns[0]);  dirns[0].delta_R += 1e5;
-	zero_alter(&dirns[1]);  dirns[1].delta_R -= 1e5;
-	refine_loop(&alter, dirns, 2, &priv, &n_iter, fh);
+	} else {
 
-	/* Refine wavelength */
-	zero_alter(&dirns[0]);  dirns[0].delta_wave += 2.0e-14;
-	zero_alter(&dirns[1]);  dirns[1].delta_wave -= 2.0e-14;
-	refine_loop(&alter, dirns, 2, &priv, &n_iter, fh);
+		/* Refine orientation */
+		struct rf_alteration dirns[4];
+		zero_alter(&dirns[0]);  dirns[0].rot_x += 0.1e-3;
+		zero_alter(&dirns[1]);  dirns[1].rot_x -= 0.1e-3;
+		zero_alter(&dirns[2]);  dirns[2].rot_y += 0.1e-3;
+		zero_alter(&dirns[3]);  dirns[3].rot_y -= 0.1e-3;
+		refine_loop(&alter, dirns, 4, &priv, &n_iter, fh);
+
+		/* Refine profile radius */
+		zero_alter(&dirns[0]);  dirns[0].delta_R += 1e5;
+		zero_alter(&dirns[1]);  dirns[1].delta_R -= 1e5;
+		refine_loop(&alter, dirns, 2, &priv, &n_iter, fh);
+
+		/* Refine wavelength */
+		zero_alter(&dirns[0]);  dirns[0].delta_wave += 2.0e-14;
+		zero_alter(&dirns[1]);  dirns[1].delta_wave -= 2.0e-14;
+		refine_loop(&alter, dirns, 2, &priv, &n_iter, fh);
+
+	}
+
+	if ( stats != NULL ) {
+		stats->n_eval = priv.n_eval;
+		stats->time = get_time() - t_start;
+		stats->fom = calc_residual(&priv, alter, 0);
+	}
 
 	/* Apply the final shifts */
 	apply_parameters(cr, cr, image, image, alter);
@@ -731,12 +1149,10 @@ static void do_pr_refine(RefList **plist_in, Crystal *cr, struct image *image,
 	}
 
 	if ( fh != NULL ) {
-		fclose(fh);
+		log_close(&lf);
 	}
 
-	reflist_free(priv.refls);
-	crystal_free(priv.cr_tgt);
-	spectrum_free(spectrum);
+	free_rf_priv(&priv);
 }
 
 
@@ -754,6 +1170,11 @@ struct refine_args
 	SymOpList *amb;
 	int scaleflags;
 	const char *log_folder;
+	enum pr_method method;
+	int benchmark;
+
+	/* For --benchmark-pr, with the selected method and the other one */
+	struct pr_stats stats[2];
 };
 
 
@@ -765,9 +1186,52 @@ struct pr_queue_args
 	struct image **images;
 	int n_crystals;
 	struct refine_args task_defaults;
+
+	/* Totals for --benchmark-pr: evaluations, time, residual and number of
+	 * crystals with a residual, for each method */
+	double bench[2][4];
 };
 
 
+static enum pr_method other_method(enum pr_method method)
+{
+	if ( method == PR_METHOD_BFGS ) return PR_METHOD_SEARCH;
+	return PR_METHOD_BFGS;
+}
+
+
+static const char *str_pr_method(enum pr_method method)
+{
+	if ( method == PR_METHOD_BFGS ) return "bfgs";
+	return "search";
+}
+
+
+/* Refines a copy of the crystal with the other method, leaving the real one
+ * alone */
+static void benchmark_other_method(struct refine_args *pargs)
+{
+	Crystal *cr;
+	struct image image;
+	RefList *refls;
+
+	cr = crystal_copy(pargs->crystal);
+	image = *pargs->image;
+	image.spectrum = target_spectrum(pargs->image);
+	refls = copy_reflist(*pargs->prefls);
+
+	do_pr_refine(&refls, cr, &image, pargs->full, pargs->pmodel,
+	             pargs->serial, pargs->cycle, 0,
+	             pargs->sym, pargs->amb, pargs->scaleflags,
+	             pargs->log_folder, other_method(pargs->method),
+	             &pargs->stats[1]);
+
+	reflist_free(refls);
+	crystal_free(cr);
+	spectrum_free(image.spectrum);
+}
+
+
 static void refine_image(void *task, int id)
 {
 	struct refine_args *pargs = task;
@@ -775,11 +1239,14 @@ static void refine_image(void *task, int id)
 
 	write_logs = !pargs->no_logs && (pargs->serial % 20 == 0);
 
+	if ( pargs->benchmark ) benchmark_other_method(pargs);
+
 	do_pr_refine(pargs->prefls, pargs->crystal, pargs->image,
 	             pargs->full, pargs->pmodel,
 	             pargs->serial, pargs->cycle, write_logs,
 	             pargs->sym, pargs->amb, pargs->scaleflags,
-	             pargs->log_folder);
+	             pargs->log_folder, pargs->method,
+	             pargs->benchmark ? &pargs->stats[0] : NULL);
 }
 
 
@@ -805,6 +1272,19 @@ static void *get_image(void *vqargs)
 static void done_image(void *vqargs, void *task)
 {
 	struct pr_queue_args *qa = vqargs;
+	struct refine_args *pargs = task;
+
+	if ( pargs->benchmark ) {
+		int i;
+		for ( i=0; i<2; i++ ) {
+			qa->bench[i][0] += pargs->stats[i].n_eval;
+			qa->bench[i][1] += pargs->stats[i].time;
+			if ( !isnan(pargs->stats[i].fom) ) {
+				qa->bench[i][2] += pargs->stats[i].fom;
+				qa->bench[i][3] += 1.0;
+			}
+		}
+	}
 
 	qa->n_done++;
 
@@ -817,10 +1297,12 @@ void refine_all(struct crystal_refls *crystals, struct image **images, int n_cry
                 RefList *full, int nthreads, PartialityModel pmodel,
                 int cycle, int no_logs,
                 SymOpList *sym, SymOpList *amb, int scaleflags,
-                const char *log_folder)
+                const char *log_folder, enum pr_method method,
+                int benchmark, TPCancelToken *cancel)
 {
 	struct refine_args task_defaults;
 	struct pr_queue_args qargs;
+	struct thread_pool_opts tpopts = {.cancel = cancel};
 
 	task_defaults.full = full;
 	task_defaults.crystal = NULL;
@@ -834,8 +1316,11 @@ void refine_all(struct crystal_refls *crystals, struct image **images, int n_cry
 	task_defaults.scaleflags = scaleflags;
 	task_defaults.serial = 0;
 	task_defaults.log_folder = log_folder;
+	task_defaults.method = method;
+	task_defaults.benchmark = benchmark;
 
 	qargs.task_defaults = task_defaults;
+	memset(qargs.bench, 0, sizeof(qargs.bench));
 	qargs.n_started = 0;
 	qargs.n_done = 0;
 	qargs.n_crystals = n_crystals;
@@ -845,6 +1330,23 @@ void refine_all(struct crystal_refls *crystals, struct image **images, int n_cry
 	/* Don't have threads which are doing nothing */
 	if ( n_crystals < nthreads ) nthreads = n_crystals;
 
-	run_threads(nthreads, refine_image, get_image, done_image,
-	            &qargs, n_crystals, 0, 0, 0);
+	run_threads_opts(nthreads, refine_image, get_image, done_image,
+	                 &qargs, n_crystals, &tpopts);
+
+	if ( benchmark ) {
+
+		int i;
+
+		dist_sum_doubles(&qargs.bench[0][0], 8);
+
+		for ( i=0; i<2; i++ ) {
+			enum pr_method m = (i==0) ? method : other_method(method);
+			STATUS("Post-refinement with %6s: %10.0f residual "
+			       "evaluations, %8.2f s, mean residual %10.8f\n",
+			       str_pr_method(m), qargs.bench[i][0],
+			       qargs.bench[i][1],
+			       qargs.bench[i][2]/qargs.bench[i][3]);
+		}
+
+	}
 }
@@ -42,6 +42,7 @@
 #include "crystal.h"
 #include "geometry.h"
 #include "symmetry.h"
+#include "thread-pool.h"
 
 
 enum prflag
@@ -56,6 +57,13 @@ enum prflag
 };
 
 
+enum pr_method
+{
+	PR_METHOD_SEARCH,  /* One parameter at a time, in fixed steps */
+	PR_METHOD_BFGS,    /* All parameters together, quasi-Newton */
+};
+
+
 extern const char *str_prflag(enum prflag flag);
 
 extern void refine_all(struct crystal_refls *crystals, struct image **images,
@@ -63,7 +71,8 @@ extern void refine_all(struct crystal_refls *crystals, struct image **images,
                        RefList *full, int nthreads, PartialityModel pmodel,
                        int cycle, int no_logs,
                        SymOpList *sym, SymOpList *amb, int scaleflags,
-                       const char *log_folder);
+                       const char *log_folder, enum pr_method method,
+                       int benchmark, TPCancelToken *cancel);
 
 extern void write_gridscan(RefList *list, Crystal *cr, struct image *image,
                            const RefList *full,
@@ -42,6 +42,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <errno.h>
+#include <gsl/gsl_rng.h>
+#include <gsl/gsl_randist.h>
+#include <gsl/gsl_sort.h>
+#include <gsl/gsl_statistics.h>
 
 #include <utils.h>
 #include <reflist-utils.h>
@@ -53,6 +58,8 @@
 #include <thread-pool.h>
 #include <geometry.h>
 #include <cell-utils.h>
+#include <cell.h>
+#include <fom.h>
 
 #include "version.h"
 
@@ -92,6 +99,20 @@ static void show_help(const char *s)
 "      --max-adu=<n>         Maximum peak value.  Default: infinity.\n"
 "      --min-res=<n>         Merge only crystals which diffract above <n> A.\n"
 "      --push-res=<n>        Integrate higher than apparent resolution cutoff.\n"
+"  -j <n>                    Use <n> threads for reading and merging.\n"
+"      --deterministic       Merge in the same order as with one thread.\n"
+"      --state=<filename>    Add to the merging state in <filename>, and\n"
+"                             update it afterwards.\n"
+"      --live-fom=<n>        Show CC1/2, completeness and I/sigI every <n>\n"
+"                             crystals.  Requires -p and --highres.\n"
+"      --bootstrap=<n>       Calculate confidence intervals for CC1/2 and\n"
+"                             Rsplit from <n> resamples of the crystals.\n"
+"                             Requires -p and --highres.\n"
+"  -p, --pdb=<filename>      Unit cell file for --live-fom and --bootstrap.\n"
+"      --highres=<n>         High resolution limit for --live-fom and\n"
+"                             --bootstrap, in A.\n"
+"      --nshells=<n>         Number of resolution shells for --live-fom and\n"
+"                             --bootstrap.  Default: 10.\n"
 );
 }
 
@@ -270,16 +291,13 @@ static void apply_kpred(double k, RefList *list)
 }
 
 
-static int merge_crystal(RefList *model, struct image *image, Crystal *cr,
-                         RefList *new_refl, RefList *reference, const SymOpList *sym,
-                         double **hist_vals, signed int hist_h,
-                         signed int hist_k, signed int hist_l, int *hist_n,
-                         struct polarisation p, double min_snr, double max_adu,
-                         double push_res, double min_cc, int do_scale,
-                         FILE *stat)
+/* Applies the corrections to a crystal, and compares it to the reference (if
+ * any).  Returns non-zero if the crystal should not be merged. */
+static int check_crystal(struct image *image, Crystal *cr, RefList *new_refl,
+                         RefList *reference, const SymOpList *sym,
+                         struct polarisation p, double min_cc, int do_scale,
+                         double *pscale, double *pcc)
 {
-	Reflection *refl;
-	RefListIterator *iter;
 	double scale;
 
 	/* First, correct for polarisation */
@@ -297,43 +315,71 @@ static int merge_crystal(RefList *model, struct image *image, Crystal *cr,
 		if ( cc < min_cc ) return 1;
 		if ( isnan(scale) ) return 1;
 		if ( scale <= 0.0 ) return 1;
-		if ( stat != NULL ) {
-			fprintf(stat, "%s %s %f %f\n", image->filename,
-			        image->ev, scale, cc);
-		}
+		*pcc = cc;
 
 	} else {
 		scale = 1.0;
+		*pcc = NAN;
 	}
 
+	*pscale = scale;
+	return 0;
+}
+
+
+/* Returns non-zero if the measurement should be merged */
+static int use_measurement(Reflection *refl, Crystal *cr, double scale,
+                           double min_snr, double max_adu, double push_res)
+{
+	double refl_intensity, refl_sigma;
+	double res, max_res;
+	signed int h, k, l;
+
+	refl_intensity = scale * get_intensity(refl);
+	refl_sigma = scale * get_esd_intensity(refl);
+
+	if ( (min_snr > -INFINITY) && isnan(refl_sigma) ) return 0;
+	if ( refl_intensity < min_snr * refl_sigma ) return 0;
+
+	if ( get_peak(refl) > max_adu ) return 0;
+
+	get_indices(refl, &h, &k, &l);
+	max_res = push_res + crystal_get_resolution_limit(cr);
+	res = 2.0*resolution(crystal_get_cell(cr), h, k, l);
+	if ( res > max_res ) return 0;
+
+	return 1;
+}
+
+
+static void add_crystal(RefList *model, Crystal *cr, RefList *new_refl,
+                        double scale, const SymOpList *sym,
+                        double **hist_vals, signed int hist_h,
+                        signed int hist_k, signed int hist_l, int *hist_n,
+                        double min_snr, double max_adu, double push_res)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+
 	for ( refl = first_refl(new_refl, &iter);
 	      refl != NULL;
 	      refl = next_refl(refl, iter) )
 	{
-		double refl_intensity, refl_sigma, refl_pk;
+		double refl_intensity;
 		signed int h, k, l;
 		int model_redundancy;
 		Reflection *model_version;
 		double w;
 		double temp, delta, R, mean, M2, sumweight;
-		double res, max_res;
+
+		if ( !use_measurement(refl, cr, scale, min_snr, max_adu,
+		                      push_res) ) continue;
 
 		refl_intensity = scale * get_intensity(refl);
-		refl_sigma = scale * get_esd_intensity(refl);
-		refl_pk = get_peak(refl);
 		w = 1.0;//pow(refl_sigma, -2.0);
 
-		if ( (min_snr > -INFINITY) && isnan(refl_sigma) ) continue;
-		if ( refl_intensity < min_snr * refl_sigma ) continue;
-
-		if ( refl_pk > max_adu ) continue;
-
 		get_indices(refl, &h, &k, &l);
 
-		max_res = push_res + crystal_get_resolution_limit(cr);
-		res = 2.0*resolution(crystal_get_cell(cr), h, k, l);
-		if ( res > max_res ) continue;
-
 		/* Put into the asymmetric unit for the target group */
 		get_asymm(sym, h, k, l, &h, &k, &l);
 
@@ -375,8 +421,103 @@ static int merge_crystal(RefList *model, struct image *image, Crystal *cr,
 		}
 
 	}
+}
 
-	return 0;
+
+/* Adds the same measurements as add_crystal() to the live figures of merit */
+static void add_crystal_to_fom(struct fom_stream *fs, Crystal *cr,
+                               RefList *new_refl, double scale, int half,
+                               double min_snr, double max_adu,
+                               double push_res)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+
+	for ( refl = first_refl(new_refl, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+
+		if ( !use_measurement(refl, cr, scale, min_snr, max_adu,
+		                      push_res) ) continue;
+
+		get_indices(refl, &h, &k, &l);
+		fom_stream_add(fs, h, k, l, scale*get_intensity(refl), half);
+	}
+}
+
+
+static void show_live_fom(struct fom_stream *fs, int n_crystals_used)
+{
+	pthread_mutex_lock(&stderr_lock);
+	fprintf(stderr, "\n");
+	pthread_mutex_unlock(&stderr_lock);
+	STATUS("After %i crystals: CC1/2 = %.4f, completeness = %.2f%%, "
+	       "<I/sigI> = %.2f\n", n_crystals_used,
+	       fom_stream_overall_value(fs, FOM_CC),
+	       100.0*fom_stream_overall_value(fs, FOM_COMPLETENESS),
+	       fom_stream_overall_value(fs, FOM_SNR));
+}
+
+
+static void show_fom_shells(struct fom_stream *fs, struct fom_shells *shells)
+{
+	int i;
+
+	STATUS("  1/d centre   d / A      CC1/2   Compl/%%   <I/sigI>  "
+	       "Redundancy\n");
+	for ( i=0; i<shells->nshells; i++ ) {
+		double cen = fom_shell_centre(shells, i);
+		STATUS("%10.3f  %8.2f  %9.4f  %8.2f  %9.2f  %10.1f\n",
+		       cen/1e9, 1e10/cen,
+		       fom_stream_shell_value(fs, FOM_CC, i),
+		       100.0*fom_stream_shell_value(fs, FOM_COMPLETENESS, i),
+		       fom_stream_shell_value(fs, FOM_SNR, i),
+		       fom_stream_shell_value(fs, FOM_REDUNDANCY, i));
+	}
+	STATUS("Overall: CC1/2 = %.4f, completeness = %.2f%%, "
+	       "<I/sigI> = %.2f, redundancy = %.1f\n",
+	       fom_stream_overall_value(fs, FOM_CC),
+	       100.0*fom_stream_overall_value(fs, FOM_COMPLETENESS),
+	       fom_stream_overall_value(fs, FOM_SNR),
+	       fom_stream_overall_value(fs, FOM_REDUNDANCY));
+}
+
+
+/* Adds the running sums in "from" to the ones in "model" */
+static void combine_models(RefList *model, RefList *from)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+
+	for ( refl = first_refl(from, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		Reflection *model_version;
+		double wa, wb, w, delta;
+
+		get_indices(refl, &h, &k, &l);
+		model_version = find_refl(model, h, k, l);
+		if ( model_version == NULL ) {
+			model_version = add_refl(model, h, k, l);
+		}
+
+		wa = get_temp1(model_version);
+		wb = get_temp1(refl);
+		w = wa + wb;
+		delta = get_intensity(refl) - get_intensity(model_version);
+
+		set_intensity(model_version,
+		              get_intensity(model_version) + delta*wb/w);
+		set_temp2(model_version, get_temp2(model_version)
+		                         + get_temp2(refl) + delta*delta*wa*wb/w);
+		set_temp1(model_version, w);
+		set_redundancy(model_version, get_redundancy(model_version)
+		                              + get_redundancy(refl));
+	}
 }
 
 
@@ -394,9 +535,309 @@ static void display_progress(int n_images, int n_crystals, int n_crystals_used)
 }
 
 
+/* Number of chunks to read for each thread before merging them */
+#define MERGE_BATCH (64)
+
+struct merge_job
+{
+	struct merge_args *args;
+	struct image *image;
+	Crystal *cr;
+	RefList *refls;
+
+	/* Counters as they were after this crystal was read */
+	int n_images;
+	int n_crystals;
+	int n_crystals_seen;
+
+	int accepted;
+	double scale;
+	double cc;
+
+	/* Set if the crystal was merged, i.e. not after --stop-after */
+	int merged;
+
+	/* Measurements for the histogram, when merging into accum */
+	double *hist_vals;
+	int hist_n;
+};
+
+
+struct merge_args
+{
+	struct merge_job *jobs;
+	int n_jobs;
+	int n_started;
+
+	/* One list for each thread to merge into, or NULL if the crystals
+	 * should be merged in order after each batch */
+	RefList **accum;
+
+	RefList *reference;
+	const SymOpList *sym;
+	struct polarisation p;
+	double min_snr;
+	double max_adu;
+	double push_res;
+	double min_cc;
+	int do_scale;
+	signed int hist_h;
+	signed int hist_k;
+	signed int hist_l;
+};
+
+
+/* Bootstrap resampling of the crystals, for confidence intervals on the
+ * figures of merit.  Instead of drawing exactly N crystals with replacement,
+ * each crystal is included in each resample a Poisson(1)-distributed number
+ * of times, so that the resamples can be built up as the data are read. */
+struct bootstrap_task
+{
+	struct bootstrap *bs;
+	int b;
+};
+
+
+struct bootstrap
+{
+	int n;
+	struct fom_stream **fs;
+	gsl_rng **rng;
+	struct bootstrap_task *tasks;
+
+	/* The current batch of crystals */
+	struct merge_job *jobs;
+	int n_jobs;
+	int n_started;
+
+	double min_snr;
+	double max_adu;
+	double push_res;
+};
+
+
+static void bootstrap_free(struct bootstrap *bs)
+{
+	int i;
+
+	for ( i=0; i<bs->n; i++ ) {
+		fom_stream_free(bs->fs[i]);
+		gsl_rng_free(bs->rng[i]);
+	}
+	free(bs->fs);
+	free(bs->rng);
+	free(bs->tasks);
+	free(bs);
+}
+
+
+static struct bootstrap *bootstrap_new(int n, UnitCell *cell,
+                                       struct fom_shells *shells,
+                                       const SymOpList *sym, int min_meas,
+                                       double min_snr, double max_adu,
+                                       double push_res)
+{
+	struct bootstrap *bs;
+	int i;
+
+	bs = malloc(sizeof(struct bootstrap));
+	if ( bs == NULL ) return NULL;
+
+	bs->n = n;
+	bs->fs = calloc(n, sizeof(struct fom_stream *));
+	bs->rng = calloc(n, sizeof(gsl_rng *));
+	bs->tasks = malloc(n*sizeof(struct bootstrap_task));
+	if ( (bs->fs == NULL) || (bs->rng == NULL) || (bs->tasks == NULL) ) {
+		free(bs->fs);
+		free(bs->rng);
+		free(bs->tasks);
+		free(bs);
+		return NULL;
+	}
+
+	for ( i=0; i<n; i++ ) {
+		bs->fs[i] = fom_stream_new(cell, shells, sym, min_meas);
+		bs->rng[i] = gsl_rng_alloc(gsl_rng_mt19937);
+		if ( (bs->fs[i] == NULL) || (bs->rng[i] == NULL) ) {
+			bootstrap_free(bs);
+			return NULL;
+		}
+		gsl_rng_set(bs->rng[i], i+1);
+		bs->tasks[i].bs = bs;
+		bs->tasks[i].b = i;
+	}
+
+	bs->min_snr = min_snr;
+	bs->max_adu = max_adu;
+	bs->push_res = push_res;
+	return bs;
+}
+
+
+static void *get_bootstrap_task(void *vqargs)
+{
+	struct bootstrap *bs = vqargs;
+	return &bs->tasks[bs->n_started++];
+}
+
+
+/* Adds the crystals of the current batch to one resample, in order, so that
+ * the result does not depend on the number of threads */
+static void run_bootstrap_task(void *vtask, int cookie)
+{
+	struct bootstrap_task *task = vtask;
+	struct bootstrap *bs = task->bs;
+	int b = task->b;
+	int i;
+
+	for ( i=0; i<bs->n_jobs; i++ ) {
+
+		struct merge_job *job = &bs->jobs[i];
+		unsigned int w, j;
+
+		if ( !job->merged ) continue;
+
+		w = gsl_ran_poisson(bs->rng[b], 1.0);
+		for ( j=0; j<w; j++ ) {
+			add_crystal_to_fom(bs->fs[b], job->cr, job->refls,
+			                   job->scale, job->n_crystals_seen % 2,
+			                   bs->min_snr, bs->max_adu,
+			                   bs->push_res);
+		}
+	}
+}
+
+
+static void bootstrap_batch(struct bootstrap *bs, struct merge_job *jobs,
+                            int n_jobs, int n_threads)
+{
+	bs->jobs = jobs;
+	bs->n_jobs = n_jobs;
+	bs->n_started = 0;
+	run_threads(n_threads, run_bootstrap_task, get_bootstrap_task,
+	            NULL, bs, bs->n, 0, 0, 0);
+}
+
+
+/* Writes the mean and 95% interval of one figure of merit over the resamples,
+ * using "vals" as workspace */
+static void show_bootstrap_value(struct bootstrap *bs, enum fom_type fom,
+                                 int shell, double *vals, char *out)
+{
+	int i;
+	int n = 0;
+
+	for ( i=0; i<bs->n; i++ ) {
+		double v;
+		if ( shell < 0 ) {
+			v = fom_stream_overall_value(bs->fs[i], fom);
+		} else {
+			v = fom_stream_shell_value(bs->fs[i], fom, shell);
+		}
+		if ( isfinite(v) ) vals[n++] = v;
+	}
+
+	if ( n < 2 ) {
+		sprintf(out, "%28s", "-");
+		return;
+	}
+
+	gsl_sort(vals, 1, n);
+	sprintf(out, "%8.4f [%8.4f,%8.4f]", gsl_stats_mean(vals, 1, n),
+	        gsl_stats_quantile_from_sorted_data(vals, 1, n, 0.025),
+	        gsl_stats_quantile_from_sorted_data(vals, 1, n, 0.975));
+}
+
+
+static void show_bootstrap(struct bootstrap *bs, struct fom_shells *shells)
+{
+	double *vals;
+	char cc[64];
+	char rs[64];
+	int i;
+
+	vals = malloc(bs->n*sizeof(double));
+	if ( vals == NULL ) return;
+
+	STATUS("Mean values and 95%% intervals from %i bootstrap resamples:\n",
+	       bs->n);
+	STATUS("  1/d centre   d / A  %28s  %28s\n", "CC1/2", "Rsplit");
+	for ( i=0; i<shells->nshells; i++ ) {
+		double cen = fom_shell_centre(shells, i);
+		show_bootstrap_value(bs, FOM_CC, i, vals, cc);
+		show_bootstrap_value(bs, FOM_RSPLIT, i, vals, rs);
+		STATUS("%10.3f  %8.2f  %s  %s\n", cen/1e9, 1e10/cen, cc, rs);
+	}
+	show_bootstrap_value(bs, FOM_CC, -1, vals, cc);
+	show_bootstrap_value(bs, FOM_RSPLIT, -1, vals, rs);
+	STATUS("%20s  %s  %s\n", "Overall", cc, rs);
+
+	free(vals);
+}
+
+
+static void *get_merge_job(void *vqargs)
+{
+	struct merge_args *qargs = vqargs;
+	return &qargs->jobs[qargs->n_started++];
+}
+
+
+static void run_merge_job(void *vjob, int cookie)
+{
+	struct merge_job *job = vjob;
+	struct merge_args *args = job->args;
+
+	job->accepted = !check_crystal(job->image, job->cr, job->refls,
+	                               args->reference, args->sym, args->p,
+	                               args->min_cc, args->do_scale,
+	                               &job->scale, &job->cc);
+
+	if ( job->accepted && (args->accum != NULL) ) {
+		add_crystal(args->accum[cookie], job->cr, job->refls,
+		            job->scale, args->sym, &job->hist_vals,
+		            args->hist_h, args->hist_k, args->hist_l,
+		            &job->hist_n, args->min_snr, args->max_adu,
+		            args->push_res);
+	}
+}
+
+
+/* Makes the asymmetric unit lookup table for the symmetry operations, large
+ * enough for the reflections in the first batch of crystals.  Reflections
+ * from later crystals outside the table are handled without it. */
+static void make_symmetry_table(SymOpList *sym, struct merge_job *jobs,
+                                int n_jobs)
+{
+	signed int max_h = 0;
+	signed int max_k = 0;
+	signed int max_l = 0;
+	int i;
+
+	for ( i=0; i<n_jobs; i++ ) {
+
+		Reflection *refl;
+		RefListIterator *iter;
+
+		for ( refl = first_refl(jobs[i].refls, &iter);
+		      refl != NULL;
+		      refl = next_refl(refl, iter) )
+		{
+			signed int h, k, l;
+			get_indices(refl, &h, &k, &l);
+			if ( abs(h) > max_h ) max_h = abs(h);
+			if ( abs(k) > max_k ) max_k = abs(k);
+			if ( abs(l) > max_l ) max_l = abs(l);
+		}
+	}
+
+	make_asymm_table(sym, max_h, max_k, max_l);
+}
+
+
 static int merge_stream(Stream *st,
                         RefList *model, RefList *reference,
-                        const SymOpList *sym,
+                        SymOpList *sym,
                         double **hist_vals, signed int hist_h,
                         signed int hist_k, signed int hist_l,
                         int *hist_i, struct polarisation p,
@@ -407,56 +848,201 @@ static int merge_stream(Stream *st,
                         int flag_even_odd, char *stat_output,
                         int *pn_images, int *pn_crystals,
                         int *pn_crystals_used, int *pn_crystals_seen,
-                        FILE *stat)
+                        FILE *stat, int n_threads, RefList **accum,
+                        struct fom_stream *fs, int live_fom,
+                        struct bootstrap *boot)
 {
 	int n_images = *pn_images;
 	int n_crystals = *pn_crystals;
 	int n_crystals_used = *pn_crystals_used;
 	int n_crystals_seen = *pn_crystals_seen;
+	StreamReader *sr;
+	struct merge_args args;
+	struct image **images;
+	int max_images = MERGE_BATCH*n_threads;
+	int max_jobs = 0;
+	int finished = 0;
+
+	/* In order, because of --start-after and --even-only */
+	sr = stream_reader_new(st, STREAM_REFLECTIONS, n_threads, 1);
+	if ( sr == NULL ) return 1;
+
+	images = malloc(max_images*sizeof(struct image *));
+	if ( images == NULL ) {
+		stream_reader_free(sr);
+		return 1;
+	}
+
+	args.jobs = NULL;
+	args.accum = accum;
+	args.reference = reference;
+	args.sym = sym;
+	args.p = p;
+	args.min_snr = min_snr;
+	args.max_adu = max_adu;
+	args.push_res = push_res;
+	args.min_cc = min_cc;
+	args.do_scale = do_scale;
+	args.hist_h = hist_h;
+	args.hist_k = hist_k;
+	args.hist_l = hist_l;
 
 	do {
 
-		struct image *image;
+		int n_batch = 0;
 		int i;
 
-		/* Get data from next chunk */
-		image = stream_read_chunk(st, STREAM_REFLECTIONS);
-		if ( image == NULL ) break;
+		args.n_jobs = 0;
+		args.n_started = 0;
 
-		n_images++;
+		/* Read a batch, and choose the crystals to merge */
+		while ( n_batch < max_images ) {
 
-		for ( i=0; i<image->n_crystals; i++ ) {
+			struct image *image;
 
-			Crystal *cr = image->crystals[i].cr;
-			RefList *refls = image->crystals[i].refls;
+			image = stream_reader_next(sr);
+			if ( image == NULL ) {
+				finished = 1;
+				break;
+			}
+
+			images[n_batch++] = image;
+			n_images++;
+
+			for ( i=0; i<image->n_crystals; i++ ) {
+
+				Crystal *cr = image->crystals[i].cr;
+				struct merge_job *job;
+
+				n_crystals_seen++;
+				if ( (n_crystals_seen <= start_after)
+				  || (crystal_get_resolution_limit(cr) < min_res)
+				  || !(flag_even_odd == 2 || n_crystals_seen%2 == flag_even_odd) )
+				{
+					continue;
+				}
 
-			n_crystals_seen++;
-			if ( (n_crystals_seen > start_after)
-			  && (crystal_get_resolution_limit(cr) >= min_res)
-			  && (flag_even_odd == 2 || n_crystals_seen%2 == flag_even_odd) )
-			{
-				int r;
 				n_crystals++;
-				r = merge_crystal(model, image, cr, refls,
-				                  reference, sym, hist_vals,
-						  hist_h, hist_k, hist_l,
-				                  hist_i, p,
-						  min_snr, max_adu, push_res,
-						  min_cc, do_scale, stat);
-				if ( r == 0 ) n_crystals_used++;
+
+				if ( args.n_jobs == max_jobs ) {
+					struct merge_job *jobs_new;
+					jobs_new = realloc(args.jobs,
+					                   (max_jobs+256)*sizeof(struct merge_job));
+					if ( jobs_new == NULL ) {
+						ERROR("Failed to allocate merge jobs\n");
+						return 1;
+					}
+					args.jobs = jobs_new;
+					max_jobs += 256;
+				}
+
+				job = &args.jobs[args.n_jobs++];
+				job->args = &args;
+				job->image = image;
+				job->cr = cr;
+				job->refls = image->crystals[i].refls;
+				job->n_images = n_images;
+				job->n_crystals = n_crystals;
+				job->n_crystals_seen = n_crystals_seen;
+				job->hist_n = 0;
+				job->merged = 0;
+				if ( (*hist_vals != NULL) && (accum != NULL) ) {
+					job->hist_vals = malloc(sizeof(double));
+				} else {
+					job->hist_vals = NULL;
+				}
+			}
+		}
+
+		/* The table must be ready before the threads use it */
+		if ( (*pn_images == 0) && (n_images == n_batch) ) {
+			make_symmetry_table(sym, args.jobs, args.n_jobs);
+		}
+
+		if ( args.n_jobs > 0 ) {
+			run_threads(n_threads, run_merge_job, get_merge_job,
+			            NULL, &args, args.n_jobs, 0, 0, 0);
+		}
+
+		/* Count the results, and merge the crystals if they weren't
+		 * merged by the threads, in the order they were read */
+		for ( i=0; i<args.n_jobs; i++ ) {
+
+			struct merge_job *job = &args.jobs[i];
+			int j;
+
+			if ( finished == 2 ) {
+				free(job->hist_vals);
+				continue;
+			}
+
+			if ( job->accepted ) {
+
+				n_crystals_used++;
+				job->merged = 1;
+
+				if ( (stat != NULL) && (reference != NULL) ) {
+					fprintf(stat, "%s %s %f %f\n",
+					        job->image->filename,
+					        job->image->ev,
+					        job->scale, job->cc);
+				}
+
+				if ( accum == NULL ) {
+					add_crystal(model, job->cr, job->refls,
+					            job->scale, sym, hist_vals,
+					            hist_h, hist_k, hist_l, hist_i,
+					            min_snr, max_adu, push_res);
+				}
+
+				if ( (fs != NULL) && (live_fom > 0) ) {
+					add_crystal_to_fom(fs, job->cr,
+					                   job->refls, job->scale,
+					                   job->n_crystals_seen % 2,
+					                   min_snr, max_adu,
+					                   push_res);
+					if ( n_crystals_used % live_fom == 0 ) {
+						show_live_fom(fs, n_crystals_used);
+					}
+				}
+
+				for ( j=0; j<job->hist_n; j++ ) {
+					*hist_vals = check_hist_size(*hist_i,
+					                             *hist_vals);
+					if ( *hist_vals == NULL ) break;
+					(*hist_vals)[*hist_i] = job->hist_vals[j];
+					*hist_i += 1;
+				}
+
 			}
 
-			if ( (stop_after>0) && (n_crystals_used == stop_after) ) break;
+			free(job->hist_vals);
 
+			/* Only possible when merging in order (see merge_all) */
+			if ( (stop_after>0) && (n_crystals_used == stop_after) ) {
+				n_images = job->n_images;
+				n_crystals = job->n_crystals;
+				n_crystals_seen = job->n_crystals_seen;
+				finished = 2;
+			}
 		}
 
-		image_free(image);
+		if ( (boot != NULL) && (args.n_jobs > 0) ) {
+			bootstrap_batch(boot, args.jobs, args.n_jobs,
+			                n_threads);
+		}
+
+		for ( i=0; i<n_batch; i++ ) {
+			image_free(images[i]);
+		}
 
 		display_progress(n_images, n_crystals_seen, n_crystals_used);
 
-		if ( (stop_after>0) && (n_crystals_used == stop_after) ) break;
+	} while ( !finished );
 
-	} while ( 1 );
+	free(args.jobs);
+	free(images);
+	stream_reader_free(sr);
 
 	*pn_images = n_images;
 	*pn_crystals = n_crystals;
@@ -475,9 +1061,13 @@ struct stream_list
 };
 
 
+/* Unless "ordered" is set, each thread merges crystals into its own list, and
+ * the lists are combined at the end.  The result is the same apart from the
+ * order of the floating point operations, which depends on which thread
+ * merged each crystal. */
 static int merge_all(struct stream_list *streams,
                      RefList *model, RefList *reference,
-                     const SymOpList *sym,
+                     SymOpList *sym,
                      double **hist_vals, signed int hist_h,
                      signed int hist_k, signed int hist_l,
                      int *hist_i, struct polarisation p,
@@ -485,16 +1075,19 @@ static int merge_all(struct stream_list *streams,
                      double min_snr, double max_adu,
                      int start_after, int stop_after, double min_res,
                      double push_res, double min_cc, int do_scale,
-                     int flag_even_odd, char *stat_output)
+                     int flag_even_odd, char *stat_output, int n_threads,
+                     int ordered, int *pn_crystals_seen,
+                     struct fom_stream *fs, int live_fom,
+                     struct bootstrap *boot)
 {
-	Reflection *refl;
-	RefListIterator *iter;
 	int i;
 	int n_images = 0;
 	int n_crystals = 0;
 	int n_crystals_used = 0;
-	int n_crystals_seen = 0;
+	int n_crystals_seen = *pn_crystals_seen;
 	FILE *stat = NULL;
+	RefList **accum = NULL;
+	int r = 0;
 
 	if ( stat_output != NULL ) {
 		stat = fopen(stat_output, "w");
@@ -504,6 +1097,15 @@ static int merge_all(struct stream_list *streams,
 		}
 	}
 
+	/* --stop-after has to count the crystals in order */
+	if ( !ordered && (stop_after == 0) ) {
+		accum = malloc(n_threads*sizeof(RefList *));
+		if ( accum == NULL ) return 1;
+		for ( i=0; i<n_threads; i++ ) {
+			accum[i] = reflist_new();
+		}
+	}
+
 	for ( i=0; i<streams->n; i++ ) {
 		if ( merge_stream(streams->streams[i],
 		                  model, reference, sym,
@@ -513,9 +1115,36 @@ static int merge_all(struct stream_list *streams,
 		                  push_res, min_cc, do_scale,
 		                  flag_even_odd, stat_output,
 		                  &n_images, &n_crystals, &n_crystals_used,
-		                  &n_crystals_seen, stat) ) return 1;
+		                  &n_crystals_seen, stat, n_threads, accum,
+		                  fs, live_fom, boot) )
+		{
+			r = 1;
+			break;
+		}
+	}
+
+	if ( accum != NULL ) {
+		for ( i=0; i<n_threads; i++ ) {
+			combine_models(model, accum[i]);
+			reflist_free(accum[i]);
+		}
+		free(accum);
+	}
+
+	if ( stat != NULL ) {
+		fclose(stat);
 	}
 
+	*pn_crystals_seen = n_crystals_seen;
+	return r;
+}
+
+
+/* Turns the running sums into the final intensities and ESDs */
+static void finalise_model(RefList *model, int min_measurements)
+{
+	Reflection *refl;
+	RefListIterator *iter;
 
 	for ( refl = first_refl(model, &iter);
 	      refl != NULL;
@@ -533,15 +1162,130 @@ static int merge_all(struct stream_list *streams,
 		var = get_temp2(refl) / get_temp1(refl);
 		set_esd_intensity(refl, sqrt(var)/sqrt(red));
 	}
+}
+
+
+#define STATE_HEADER "CrystFEL process_hkl merging state"
+
+/* Reads the running sums from a previous run into the (empty) model.
+ * A missing file is not an error, because the first run creates it. */
+static int read_merge_state(const char *filename, RefList *model,
+                            const SymOpList *sym, int *pn_crystals_seen)
+{
+	FILE *fh;
+	char line[1024];
+	char symname[64];
+	int n_refl = 0;
+
+	fh = fopen(filename, "r");
+	if ( fh == NULL ) {
+		if ( errno == ENOENT ) {
+			STATUS("Merging state file %s does not exist yet, "
+			       "starting from scratch.\n", filename);
+			return 0;
+		}
+		ERROR("Failed to open merging state file %s\n", filename);
+		return 1;
+	}
+
+	if ( (fgets(line, 1024, fh) == NULL)
+	  || (strncmp(line, STATE_HEADER, strlen(STATE_HEADER)) != 0)
+	  || (fscanf(fh, "%63s %i\n", symname, pn_crystals_seen) != 2) )
+	{
+		ERROR("%s is not a merging state file.\n", filename);
+		fclose(fh);
+		return 1;
+	}
+
+	if ( strcmp(symname, symmetry_name(sym)) != 0 ) {
+		ERROR("Merging state in %s is for point group %s, not %s.\n",
+		      filename, symname, symmetry_name(sym));
+		fclose(fh);
+		return 1;
+	}
+
+	while ( fgets(line, 1024, fh) != NULL ) {
+
+		signed int h, k, l;
+		double mean, sumweight, M2;
+		int red;
+		Reflection *refl;
+
+		if ( sscanf(line, "%i %i %i %lf %lf %lf %i", &h, &k, &l,
+		            &mean, &sumweight, &M2, &red) != 7 )
+		{
+			ERROR("Invalid line in merging state file: %s\n", line);
+			fclose(fh);
+			return 1;
+		}
+
+		refl = add_refl(model, h, k, l);
+		set_intensity(refl, mean);
+		set_temp1(refl, sumweight);
+		set_temp2(refl, M2);
+		set_redundancy(refl, red);
+		n_refl++;
 
-	if ( stat != NULL ) {
-		fclose(stat);
 	}
 
+	fclose(fh);
+	STATUS("Read merging state for %i reflections from %i crystals "
+	       "from %s\n", n_refl, *pn_crystals_seen, filename);
 	return 0;
 }
 
 
+/* Writes the running sums, before finalise_model() discards the reflections
+ * with too few measurements.  The old state is only replaced once the new
+ * one has been completely written. */
+static int write_merge_state(const char *filename, RefList *model,
+                             const SymOpList *sym, int n_crystals_seen)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	char *tmp;
+	FILE *fh;
+	int r = 0;
+
+	tmp = malloc(strlen(filename)+5);
+	if ( tmp == NULL ) return 1;
+	strcpy(tmp, filename);
+	strcat(tmp, ".tmp");
+
+	fh = fopen(tmp, "w");
+	if ( fh == NULL ) {
+		ERROR("Failed to open %s\n", tmp);
+		free(tmp);
+		return 1;
+	}
+
+	fprintf(fh, STATE_HEADER"\n");
+	fprintf(fh, "%s %i\n", symmetry_name(sym), n_crystals_seen);
+
+	for ( refl = first_refl(model, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		get_indices(refl, &h, &k, &l);
+		fprintf(fh, "%i %i %i %.17g %.17g %.17g %i\n", h, k, l,
+		        get_intensity(refl), get_temp1(refl), get_temp2(refl),
+		        get_redundancy(refl));
+	}
+
+	if ( ferror(fh) ) r = 1;
+	if ( fclose(fh) ) r = 1;
+	if ( !r && rename(tmp, filename) ) r = 1;
+	if ( r ) {
+		ERROR("Failed to write merging state to %s\n", filename);
+		remove(tmp);
+	}
+
+	free(tmp);
+	return r;
+}
+
+
 static int add_stream(const char *filename, struct stream_list *list)
 {
 	if ( list->n == list->max_n ) {
@@ -610,7 +1354,21 @@ int main(int argc, char *argv[])
 	double push_res = +INFINITY;
 	double min_cc = -INFINITY;
 	int twopass = 0;
+	int n_threads = 1;
+	int deterministic = 0;
+	ThreadPool *pool;
+	int live_fom = 0;
+	int n_bootstrap = 0;
+	struct bootstrap *boot = NULL;
+	char *cellfile = NULL;
+	double highres = 0.0;
+	int nshells = 10;
+	UnitCell *cell = NULL;
+	struct fom_shells *shells = NULL;
+	struct fom_stream *fs = NULL;
 	char *audit_info;
+	char *state_fn = NULL;
+	int n_crystals_seen = 0;
 	struct stream_list stream_list = {.n = 0,
 	                                  .max_n = 0,
 	                                  .filenames = NULL,
@@ -642,11 +1400,18 @@ int main(int argc, char *argv[])
 		{"polarization",       1, NULL,               10}, /* compat */
 		{"no-polarisation",    0, NULL,               11},
 		{"no-polarization",    0, NULL,               11}, /* compat */
+		{"state",              1, NULL,               12},
+		{"deterministic",      0, &deterministic,      1},
+		{"live-fom",           1, NULL,               13},
+		{"pdb",                1, NULL,               'p'},
+		{"highres",            1, NULL,               14},
+		{"nshells",            1, NULL,               15},
+		{"bootstrap",          1, NULL,               16},
 		{0, 0, NULL, 0}
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "hi:e:o:y:g:s:f:z:",
+	while ((c = getopt_long(argc, argv, "hi:e:o:y:g:s:f:z:j:p:",
 	                        longopts, NULL)) != -1) {
 
 		switch (c) {
@@ -695,6 +1460,15 @@ int main(int argc, char *argv[])
 			histo_params = strdup(optarg);
 			break;
 
+			case 'j' :
+			errno = 0;
+			n_threads = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (n_threads < 1) ) {
+				ERROR("Invalid value for -j.\n");
+				return 1;
+			}
+			break;
+
 			case 2 :
 			errno = 0;
 			min_measurements = strtol(optarg, &rval, 10);
@@ -779,6 +1553,50 @@ int main(int argc, char *argv[])
 			polarisation = parse_polarisation("none");
 			break;
 
+			case 12 :
+			state_fn = strdup(optarg);
+			break;
+
+			case 13 :
+			live_fom = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (live_fom < 1) ) {
+				ERROR("Invalid value for --live-fom (%s)\n",
+				      optarg);
+				return 1;
+			}
+			break;
+
+			case 'p' :
+			cellfile = strdup(optarg);
+			break;
+
+			case 14 :
+			highres = strtod(optarg, &rval);
+			if ( (*rval != '\0') || (highres <= 0.0) ) {
+				ERROR("Invalid value for --highres (%s)\n",
+				      optarg);
+				return 1;
+			}
+			break;
+
+			case 15 :
+			nshells = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (nshells < 1) ) {
+				ERROR("Invalid value for --nshells (%s)\n",
+				      optarg);
+				return 1;
+			}
+			break;
+
+			case 16 :
+			n_bootstrap = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (n_bootstrap < 2) ) {
+				ERROR("Invalid value for --bootstrap (%s)\n",
+				      optarg);
+				return 1;
+			}
+			break;
+
 			case 0 :
 			break;
 
@@ -872,12 +1690,66 @@ int main(int argc, char *argv[])
 	/* Need to do a second pass if we are scaling */
 	if ( config_scale ) twopass = 1;
 
+	/* The second pass compares each crystal to a model of all the data,
+	 * which can't be done when adding new data to an existing state */
+	if ( twopass && (state_fn != NULL) ) {
+		ERROR("--state can't be used with --scale, --min-cc or "
+		      "--stat.\n");
+		return 1;
+	}
+
+	if ( state_fn != NULL ) {
+		if ( read_merge_state(state_fn, model, sym,
+		                      &n_crystals_seen) ) return 1;
+	}
+
+	if ( live_fom || n_bootstrap ) {
+		if ( (cellfile == NULL) || (highres == 0.0) ) {
+			ERROR("--live-fom and --bootstrap need a unit cell (-p) "
+			      "and --highres.\n");
+			return 1;
+		}
+		cell = load_cell_from_file(cellfile);
+		if ( cell == NULL ) {
+			ERROR("Failed to load unit cell from %s\n", cellfile);
+			return 1;
+		}
+		free(cellfile);
+		shells = fom_make_resolution_shells(0.0, 1e10/highres, nshells);
+		if ( shells == NULL ) return 1;
+	}
+
+	if ( live_fom ) {
+		fs = fom_stream_new(cell, shells, sym, min_measurements);
+		if ( fs == NULL ) {
+			ERROR("Failed to set up live figures of merit.\n");
+			return 1;
+		}
+	}
+
+	if ( n_bootstrap ) {
+		boot = bootstrap_new(n_bootstrap, cell, shells, sym,
+		                     min_measurements, min_snr, max_adu,
+		                     push_res);
+		if ( boot == NULL ) {
+			ERROR("Failed to set up bootstrap resampling.\n");
+			return 1;
+		}
+	}
+
+	/* Keep the same threads for all the batches */
+	pool = thread_pool_new(n_threads);
+	set_default_thread_pool(pool);
+
 	hist_i = 0;
 	merge_r = merge_all(&stream_list, model, NULL, sym,
 	                    &hist_vals, hist_h, hist_k, hist_l,
 	                    &hist_i, polarisation, min_measurements, min_snr,
 	                    max_adu, start_after, stop_after, min_res, push_res,
-	                    min_cc, config_scale, flag_even_odd, stat_output);
+	                    min_cc, config_scale, flag_even_odd, stat_output,
+	                    n_threads, deterministic, &n_crystals_seen,
+	                    twopass ? NULL : fs, live_fom,
+	                    twopass ? NULL : boot);
 	fprintf(stderr, "\n");
 	if ( merge_r ) {
 		ERROR("Error while reading stream.\n");
@@ -898,8 +1770,10 @@ int main(int argc, char *argv[])
 
 			STATUS("Second pass for scaling and/or CCs...\n");
 
+			finalise_model(model, min_measurements);
 			reference = model;
 			model = reflist_new();
+			n_crystals_seen = 0;
 
 			if ( hist_vals != NULL ) {
 				free(hist_vals);
@@ -912,7 +1786,9 @@ int main(int argc, char *argv[])
 				      polarisation, min_measurements, min_snr,
 				      max_adu, start_after, stop_after, min_res,
 				      push_res, min_cc, config_scale,
-				      flag_even_odd, stat_output);
+				      flag_even_odd, stat_output, n_threads,
+				      deterministic, &n_crystals_seen,
+				      fs, live_fom, boot);
 			fprintf(stderr, "\n");
 			if ( r ) {
 				ERROR("Error while reading stream.\n");
@@ -925,6 +1801,29 @@ int main(int argc, char *argv[])
 
 	}
 
+	set_default_thread_pool(NULL);
+	thread_pool_free(pool);
+
+	if ( state_fn != NULL ) {
+		if ( write_merge_state(state_fn, model, sym,
+		                       n_crystals_seen) ) return 1;
+		free(state_fn);
+	}
+
+	finalise_model(model, min_measurements);
+
+	if ( fs != NULL ) {
+		show_fom_shells(fs, shells);
+		fom_stream_free(fs);
+	}
+
+	if ( boot != NULL ) {
+		show_bootstrap(boot, shells);
+		bootstrap_free(boot);
+	}
+
+	if ( cell != NULL ) cell_free(cell);
+
 	if ( space_for_hist && (hist_i >= space_for_hist) ) {
 		ERROR("Histogram array was too small!\n");
 	}
@@ -37,8 +37,15 @@
 #include <gsl/gsl_statistics_double.h>
 #include <gsl/gsl_sort.h>
 #include <unistd.h>
+#include <string.h>
+#include <time.h>
 #include <sys/stat.h>
 
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
 #include <utils.h>
 #include <index.h>
 #include <peaks.h>
@@ -57,69 +64,237 @@
 #include "im-sandbox.h"
 #include "im-zmq.h"
 #include "im-asapo.h"
+#include "im-reintegrate.h"
+#include "im-peakcache.h"
+#include "im-cxi-output.h"
 #include "peaks.h"
 #include "peakfinder8.h"
 
-static float **backup_image_data(float **dp, struct detgeom *det)
+/* Filtered copies of the image data, which only the peak search sees.  The
+ * arrays are kept from one frame to the next, all in one block so that they
+ * can use huge pages. */
+struct filter_buffers
+{
+	float **dp;
+	int np;
+	char *block;
+	size_t block_size;
+	enum huge_pages hp;
+};
+
+
+struct filter_buffers *filter_buffers_new(enum huge_pages hp)
+{
+	struct filter_buffers *fb = malloc(sizeof(struct filter_buffers));
+	if ( fb == NULL ) return NULL;
+	fb->dp = NULL;
+	fb->np = 0;
+	fb->block = NULL;
+	fb->block_size = 0;
+	fb->hp = hp;
+	return fb;
+}
+
+
+void filter_buffers_free(struct filter_buffers *fb)
+{
+	if ( fb == NULL ) return;
+	cffree_huge(fb->block, fb->block_size, fb->hp);
+	free(fb->dp);
+	free(fb);
+}
+
+
+/* Each panel starts on a new cache line */
+static size_t filter_panel_size(struct detgeom_panel *p)
+{
+	return (p->w * p->h * sizeof(float) + 63) & ~(size_t)63;
+}
+
+
+static float **get_filter_buffers(struct filter_buffers *fb,
+                                  struct detgeom *det)
 {
-	float **bu;
 	int i;
+	size_t total = 0;
+	size_t pos = 0;
+
+	if ( fb->np != det->n_panels ) {
+		float **dp = calloc(det->n_panels, sizeof(float *));
+		if ( dp == NULL ) return NULL;
+		free(fb->dp);
+		fb->dp = dp;
+		fb->np = det->n_panels;
+	}
 
-	bu = malloc(det->n_panels * sizeof(float *));
-	if ( bu == NULL ) return NULL;
+	for ( i=0; i<det->n_panels; i++ ) {
+		total += filter_panel_size(&det->panels[i]);
+	}
+
+	if ( fb->block_size < total ) {
+		cffree_huge(fb->block, fb->block_size, fb->hp);
+		fb->block = cfmalloc_huge(total, fb->hp);
+		if ( fb->block == NULL ) {
+			fb->block_size = 0;
+			return NULL;
+		}
+		fb->block_size = total;
+	}
 
 	for ( i=0; i<det->n_panels; i++ ) {
+		fb->dp[i] = (float *)(fb->block + pos);
+		pos += filter_panel_size(&det->panels[i]);
+	}
 
-		size_t data_size;
+	return fb->dp;
+}
+
+
+/* Counts the pixels above the threshold in every n-th row of each panel,
+ * ignoring bad pixels, and stopping at "enough".  The rows are scanned without
+ * branches, so that the compiler can vectorise the loop. */
+static int veto_count(struct image *image, float threshold, int step,
+                      int enough)
+{
+	int pn;
+	int n = 0;
+
+	for ( pn=0; pn<image->detgeom->n_panels; pn++ ) {
+
+		struct detgeom_panel *p = &image->detgeom->panels[pn];
+		int ss;
+
+		for ( ss=0; ss<p->h; ss+=step ) {
+
+			const float *row = &image->dp[pn][ss*p->w];
+			const uint8_t *bad = &image->bad[pn][ss*p->w];
+			int n_row = 0;
+			int fs;
+
+			for ( fs=0; fs<p->w; fs++ ) {
+				n_row += (row[fs] > threshold) & (bad[fs] == 0);
+			}
+
+			n += n_row;
+			if ( n >= enough ) return n;
 
-		data_size = det->panels[i].w * det->panels[i].h * sizeof(float);
-		bu[i] = malloc(data_size);
-		if ( bu[i] == NULL ) {
-			free(bu);
-			ERROR("Failed to allocate pre-filter backup.\n");
-			return NULL;
 		}
+	}
+
+	return n;
+}
+
+
+/* Watches the directory containing a file, so that we find out straight away
+ * when the file appears or has been completely written.  If inotify isn't
+ * available (or the limit on the number of watches has been reached), this
+ * falls back to polling.  Network filesystems might not report changes made
+ * on other machines, so the file should still be checked after each wait. */
+struct file_watch
+{
+	int fd;            /* -1 means just poll */
+	const char *name;  /* Final part of the filename */
+};
+
+
+static void file_watch_start(struct file_watch *fw, const char *filename)
+{
+	const char *slash = strrchr(filename, '/');
 
-		memcpy(bu[i], dp[i], data_size);
+	fw->fd = -1;
+	fw->name = (slash == NULL) ? filename : slash+1;
 
+#ifdef HAVE_INOTIFY
+	char *dir;
+
+	if ( slash == NULL ) {
+		dir = strdup(".");
+	} else {
+		dir = strdup(filename);
+		if ( dir != NULL ) {
+			/* Keep the slash if it's the root directory */
+			dir[(slash == filename) ? 1 : slash-filename] = '\0';
+		}
 	}
+	if ( dir == NULL ) return;
+
+	fw->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if ( (fw->fd != -1)
+	  && (inotify_add_watch(fw->fd, dir,
+	                        IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE) == -1) )
+	{
+		close(fw->fd);
+		fw->fd = -1;
+	}
+	free(dir);
+#endif
+}
 
-	return bu;
+
+static void file_watch_stop(struct file_watch *fw)
+{
+	if ( fw->fd != -1 ) close(fw->fd);
+	fw->fd = -1;
 }
 
 
-static void restore_image_data(float **dp, struct detgeom *det, float **bu)
+/* Waits for up to one second for something to happen to the file.  Returns 1
+ * if the file was closed after writing (or renamed into place), 0 otherwise.
+ * Appearance of the file only cuts the wait short. */
+static int file_watch_wait(struct file_watch *fw)
 {
-	int i;
+#ifdef HAVE_INOTIFY
+	if ( fw->fd != -1 ) {
+
+		char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+		struct pollfd pfd;
+		ssize_t len;
+		char *ptr;
+		int done = 0;
+
+		pfd.fd = fw->fd;
+		pfd.events = POLLIN;
+		if ( poll(&pfd, 1, 1000) <= 0 ) return 0;
+
+		len = read(fw->fd, buf, sizeof(buf));
+		for ( ptr=buf; ptr<buf+len; ) {
+			const struct inotify_event *ev;
+			ev = (const struct inotify_event *)ptr;
+			if ( (ev->len > 0) && (strcmp(ev->name, fw->name) == 0)
+			  && (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) )
+			{
+				done = 1;
+			}
+			ptr += sizeof(struct inotify_event) + ev->len;
+		}
+		return done;
 
-	for ( i=0; i<det->n_panels; i++ ) {
-		size_t data_size;
-		data_size = det->panels[i].w * det->panels[i].h * sizeof(float);
-		memcpy(dp[i], bu[i], data_size);
-		free(bu[i]);
 	}
-	free(bu);
+#endif
+
+	sleep(1);
+	return 0;
 }
 
 
-static struct image *file_wait_open_read(const char *filename,
-                                         const char *event,
-                                         DataTemplate *dtempl,
-                                         struct sb_shm *sb_shared,
-                                         signed int wait_for_file,
-                                         int cookie,
-                                         int no_image_data,
-                                         int no_mask_data,
-                                         ImageDataArrays *ida)
+/* If report_task is zero, the current task will not be updated.  This is for
+ * reading in a different thread from the one doing the processing. */
+struct image *file_wait_open_read(const char *filename, const char *event,
+                                  DataTemplate *dtempl,
+                                  signed int wait_for_file,
+                                  int no_image_data, int no_mask_data,
+                                  ImageDataArrays *ida, int report_task)
 {
-	signed int file_wait_time = wait_for_file;
+	time_t deadline = time(NULL) + wait_for_file;
 	int wait_message_done = 0;
 	int read_retry_done = 0;
 	int r;
 	struct image *image;
+	struct file_watch fw;
 
-	set_last_task("wait for file");
+	if ( report_task ) set_last_task("wait for file");
 
+	fw.fd = -1;
 	do {
 
 		struct stat statbuf;
@@ -128,21 +303,24 @@ static struct image *file_wait_open_read(const char *filename,
 		r = stat(filename, &statbuf);
 		if ( r ) {
 
-			if ( (wait_for_file != 0) && (file_wait_time != 0) ) {
-
+			if ( (wait_for_file != 0)
+			  && ((wait_for_file == -1) || (time(NULL) < deadline)) )
+			{
 				if ( !wait_message_done ) {
 					STATUS("Waiting for '%s'\n", filename);
 					wait_message_done = 1;
+					/* Check again after starting to watch,
+					 * in case it appeared in the meantime */
+					file_watch_start(&fw, filename);
+					continue;
 				}
 
-				sleep(1);
-				if ( wait_for_file != -1 ) {
-					file_wait_time--;
-				}
+				file_watch_wait(&fw);
 				continue;
 
 			}
 
+			file_watch_stop(&fw);
 			ERROR("File not found: %s (process_image)\n", filename);
 			return NULL;
 		}
@@ -151,7 +329,7 @@ static struct image *file_wait_open_read(const char *filename,
 
 	do {
 
-		set_last_task("read file");
+		if ( report_task ) set_last_task("read file");
 		notify_alive();
 
 		profile_start("image-read");
@@ -160,19 +338,33 @@ static struct image *file_wait_open_read(const char *filename,
 		profile_end("image-read");
 		if ( image == NULL ) {
 			if ( wait_for_file && !read_retry_done ) {
+
+				time_t retry = time(NULL) + 10;
+
 				read_retry_done = 1;
 				STATUS("File '%s' exists but could not be read."
-				       "  Trying again after 10 seconds.\n",
-				       filename);
-				sleep(10);
+				       "  Trying again when it has been written, "
+				       "or after 10 seconds.\n", filename);
+
+				/* If we were watching before the file
+				 * appeared, the event for it being closed
+				 * will be waiting for us if it already
+				 * happened */
+				if ( fw.fd == -1 ) file_watch_start(&fw, filename);
+				while ( time(NULL) < retry ) {
+					notify_alive();
+					if ( file_watch_wait(&fw) ) break;
+				}
 				continue;
 			}
+			file_watch_stop(&fw);
 			ERROR("Couldn't read image: %s\n", filename);
 			return NULL;
 		}
 
 	} while ( image == NULL );
 
+	file_watch_stop(&fw);
 	return image;
 }
 
@@ -181,29 +373,37 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
                    Stream *st, int cookie, const char *tmpdir,
                    int serial, struct sb_shm *sb_shared,
                    struct im_asapo *asapostuff,
-                   Mille *mille, ImageDataArrays *ida)
+                   struct im_zmq_output *zmqout,
+                   Mille *mille, ImageDataArrays *ida,
+                   struct filter_buffers *fb,
+                   struct intcontext **pic)
 {
 	struct image *image;
 	int i;
 	int r;
 	int ret;
 	char *rn;
-	float **prefilter;
+	float **unfiltered;
 	int any_crystals;
+	int vetoed;
+	enum peak_search_method peak_method;
+	ImageFeatureList *cached_peaks;
 
 	if ( pargs->zmq_data != NULL ) {
 
 		set_last_task("unpacking ZMQ data");
 		profile_start("read-zmq-data");
-		image = image_read_data_block(iargs->dtempl,
-		                              pargs->zmq_data,
-		                              pargs->zmq_data_size,
-		                              NULL,
-		                              iargs->data_format,
-		                              serial,
-		                              iargs->no_image_data,
-		                              iargs->no_mask_data,
-		                              ida);
+		image = image_read_data_block_ref(iargs->dtempl,
+		                                  pargs->zmq_data,
+		                                  pargs->zmq_data_size,
+		                                  im_zmq_release,
+		                                  pargs->zmq_msg,
+		                                  NULL,
+		                                  iargs->data_format,
+		                                  serial,
+		                                  iargs->no_image_data,
+		                                  iargs->no_mask_data,
+		                                  ida);
 		profile_end("read-zmq-data");
 		if ( image == NULL ) return;
 
@@ -218,15 +418,45 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 
 		set_last_task("unpacking ASAP::O data");
 		profile_start("read-asapo-data");
-		image = image_read_data_block(iargs->dtempl,
-		                              pargs->asapo_data,
-		                              pargs->asapo_data_size,
-		                              pargs->asapo_meta,
-		                              iargs->data_format,
-		                              serial,
-		                              iargs->no_image_data,
-		                              iargs->no_mask_data,
-		                              ida);
+		if ( iargs->data_format == DATA_SOURCE_TYPE_MSGPACK ) {
+
+			/* MessagePack panel data might point into the data
+			 * block, and be changed by the filters.  The data
+			 * block is sent on as it is, so it needs its own
+			 * copy. */
+			char *data = malloc(pargs->asapo_data_size);
+			if ( data != NULL ) {
+				memcpy(data, pargs->asapo_data,
+				       pargs->asapo_data_size);
+			}
+			im_asapo_release(pargs->asapo_msg);
+			if ( data == NULL ) {
+				profile_end("read-asapo-data");
+				return;
+			}
+			image = image_read_data_block(iargs->dtempl,
+			                              data,
+			                              pargs->asapo_data_size,
+			                              pargs->asapo_meta,
+			                              iargs->data_format,
+			                              serial,
+			                              iargs->no_image_data,
+			                              iargs->no_mask_data,
+			                              ida);
+
+		} else {
+			image = image_read_data_block_ref(iargs->dtempl,
+			                                  pargs->asapo_data,
+			                                  pargs->asapo_data_size,
+			                                  im_asapo_release,
+			                                  pargs->asapo_msg,
+			                                  pargs->asapo_meta,
+			                                  iargs->data_format,
+			                                  serial,
+			                                  iargs->no_image_data,
+			                                  iargs->no_mask_data,
+			                                  ida);
+		}
 		profile_end("read-asapo-data");
 		if ( image == NULL ) return;
 
@@ -236,16 +466,21 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 		image->filename = strdup(pargs->filename);
 		image->ev = strdup(pargs->event);
 
+	} else if ( pargs->image != NULL ) {
+
+		/* Already read by the prefetcher, or copied from the
+		 * frames held in memory for --benchmark */
+		image = pargs->image;
+		pargs->image = NULL;
+
 	} else {
 		profile_start("file-wait-open-read");
 		image = file_wait_open_read(pargs->filename, pargs->event,
 		                            iargs->dtempl,
-		                            sb_shared,
 		                            iargs->wait_for_file,
-		                            cookie,
 		                            iargs->no_image_data,
 		                            iargs->no_mask_data,
-		                            ida);
+		                            ida, 1);
 		profile_end("file-wait-open-read");
 		if ( image == NULL ) {
 			if ( iargs->wait_for_file != 0 ) {
@@ -259,39 +494,88 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 
 	image->serial = serial;
 
-	/* Take snapshot of image before applying horrible noise filters */
+	/* Peaks found by a previous run with the same peak search */
+	cached_peaks = NULL;
+	if ( (iargs->peak_cache != NULL) && (iargs->reint == NULL) ) {
+		set_last_task("peak cache");
+		profile_start("peak-cache-read");
+		cached_peaks = im_peakcache_get(iargs->peak_cache,
+		                                image->filename, image->ev);
+		profile_end("peak-cache-read");
+	}
+
+	/* Quick check for frames which can't possibly be hits */
+	vetoed = 0;
+	if ( iargs->veto && (iargs->reint == NULL) && (cached_peaks == NULL) ) {
+		set_last_task("hit veto");
+		profile_start("hit-veto");
+		if ( veto_count(image, iargs->veto_threshold,
+		                iargs->veto_subsample,
+		                iargs->veto_min_pixels) < iargs->veto_min_pixels )
+		{
+			vetoed = 1;
+		}
+		profile_end("hit-veto");
+	}
+
+	/* Apply horrible noise filters to a separate copy of the image, which
+	 * only the peak search will see */
 	set_last_task("image filter");
 	profile_start("image-filter");
 	notify_alive();
 
-	if ( (iargs->peak_search.median_filter > 0) || iargs->peak_search.noisefilter ) {
-		profile_start("data-backup");
-		prefilter = backup_image_data(image->dp, image->detgeom);
-		profile_end("data-backup");
-	} else {
-		prefilter = NULL;
-	}
+	unfiltered = NULL;
+	if ( !vetoed && (iargs->reint == NULL) && (cached_peaks == NULL)
+	  && ((iargs->peak_search.median_filter > 0)
+	   || iargs->peak_search.noisefilter) )
+	{
 
-	if ( iargs->peak_search.median_filter > 0 ) {
-		profile_start("median-filter");
-		filter_median(image, iargs->peak_search.median_filter);
-		profile_end("median-filter");
-	}
+		float **filtered = get_filter_buffers(fb, image->detgeom);
+
+		if ( filtered != NULL ) {
+
+			float **from = image->dp;
 
-	if ( iargs->peak_search.noisefilter ) {
-		profile_start("median-filter");
-		filter_noise(image);
-		profile_end("noise-filter");
+			if ( iargs->peak_search.median_filter > 0 ) {
+				profile_start("median-filter");
+				filter_median_data(image->detgeom, image->dp,
+				                   filtered,
+				                   iargs->peak_search.median_filter,
+				                   iargs->filter_threads);
+				profile_end("median-filter");
+				from = filtered;
+			}
+
+			if ( iargs->peak_search.noisefilter ) {
+				profile_start("noise-filter");
+				filter_noise_data_threaded(image->detgeom, from,
+				                           filtered,
+				                           iargs->filter_threads);
+				profile_end("noise-filter");
+			}
+
+			unfiltered = image->dp;
+			image->dp = filtered;
+
+		} else {
+			ERROR("Failed to allocate filtered image data.\n");
+		}
 	}
 	profile_end("image-filter");
 
 	set_last_task("resolution range");
 	notify_alive();
-	mark_resolution_range_as_bad(image, iargs->highres, +INFINITY);
+	mark_resolution_range_as_bad_maps(image, iargs->resmaps,
+	                                  iargs->highres, +INFINITY);
 
 	notify_alive();
 	profile_start("peak-search");
-	switch ( iargs->peak_search.method ) {
+	if ( vetoed || (iargs->reint != NULL) || (cached_peaks != NULL) ) {
+		peak_method = PEAK_NONE;
+	} else {
+		peak_method = iargs->peak_search.method;
+	}
+	switch ( peak_method ) {
 
 		ImageFeatureList *peaks;
 
@@ -329,6 +613,7 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 		break;
 
 		case PEAK_PEAKFINDER8:
+		case PEAK_PEAKFINDER8_GPU:
 		set_last_task("peaksearch:pf8");
 		image->features = peakfinder8(image, 2048,
 		                              iargs->peak_search.threshold,
@@ -351,7 +636,8 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 		                                           iargs->peak_search.min_snr,
 		                                           iargs->peak_search.min_sig,
 		                                           iargs->peak_search.min_peak_over_neighbour,
-		                                           iargs->peak_search.local_bg_radius);
+		                                           iargs->peak_search.local_bg_radius,
+		                                           iargs->pf9_private);
 		break;
 
 		case PEAK_MSGPACK:
@@ -379,20 +665,44 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 		break;
 
 	}
+	if ( vetoed ) {
+		image->features = image_feature_list_new();
+	}
+	profile_end("peak-search");
+
+	if ( cached_peaks != NULL ) {
+		image->features = cached_peaks;
+	} else if ( (iargs->peak_cache != NULL) && (peak_method != PEAK_NONE)
+	         && (image->features != NULL) )
+	{
+		set_last_task("peak cache");
+		profile_start("peak-cache-write");
+		im_peakcache_put(iargs->peak_cache, image->filename,
+		                 image->ev, image->features);
+		profile_end("peak-cache-write");
+	}
+
+	/* Re-integration: take the peaks and crystals from the old stream */
+	if ( iargs->reint != NULL ) {
+		set_last_task("reintegrate:read chunk");
+		profile_start("reintegrate-read");
+		if ( im_reintegrate_take(iargs->reint, image) ) {
+			image->features = image_feature_list_new();
+		}
+		profile_end("reintegrate-read");
+	}
+
 	if ( image->features == NULL ) {
 		ERROR("Peak search failed for image %s (event %s).\n",
 		      image->filename, image->ev);
 	}
-	profile_end("peak-search");
 
 	image->peak_resolution = estimate_peak_resolution(image->features,
 	                                                  image->lambda,
 	                                                  image->detgeom);
 
-	if ( prefilter != NULL ) {
-		profile_start("restore-filter-backup");
-		restore_image_data(image->dp, image->detgeom, prefilter);
-		profile_end("restore-filter-backup");
+	if ( unfiltered != NULL ) {
+		image->dp = unfiltered;
 	}
 
 	rn = getcwd(NULL, 0);
@@ -411,7 +721,12 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 		image->div = 0.0;
 	}
 
-	if ( image_feature_count(image->features) < iargs->min_peaks ) {
+	/* Frames with crystals from the old stream (--reintegrate) are hits,
+	 * whatever the number of peaks */
+	if ( (image->n_crystals == 0)
+	  && (vetoed
+	   || (image_feature_count(image->features) < iargs->min_peaks)) )
+	{
 		r = chdir(rn);
 		if ( r ) {
 			ERROR("Failed to chdir: %s\n", strerror(errno));
@@ -428,11 +743,14 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 	}
 	image->hit = 1;
 
-	/* Index the pattern */
-	set_last_task("indexing");
-	profile_start("index");
-	index_pattern_5(image, iargs->ipriv, mille, iargs->max_mille_level);
-	profile_end("index");
+	/* Index the pattern, unless the crystals came from the old stream */
+	if ( iargs->reint == NULL ) {
+		set_last_task("indexing");
+		profile_start("index");
+		index_pattern_5(image, iargs->ipriv, mille,
+		                iargs->max_mille_level);
+		profile_end("index");
+	}
 
 	r = chdir(rn);
 	if ( r ) {
@@ -469,12 +787,14 @@ void process_image(const struct index_args *iargs, struct pattern_args *pargs,
 		set_last_task("integration");
 		profile_start("integration");
 		notify_alive();
-		integrate_all_5(image, iargs->int_meth, PMODEL_XSPHERE,
+		integrate_all_8(image, iargs->int_meth, PMODEL_XSPHERE,
 		                iargs->push_res,
 		                iargs->ir_inn, iargs->ir_mid, iargs->ir_out,
 		                iargs->int_diag, iargs->int_diag_h,
 		                iargs->int_diag_k, iargs->int_diag_l,
-		                &sb_shared->term_lock, iargs->overpredict);
+		                &sb_shared->term_lock, iargs->overpredict, pic,
+		                iargs->int_threads,
+		                iargs->int_parallel_crystals);
 		profile_end("integration");
 	}
 
@@ -500,6 +820,15 @@ streamwrite:
 	im_asapo_send(asapostuff, image, image->hit);
 
 out:
+	/* Results summary, including for frames not written to the stream */
+	im_zmq_output_send(zmqout, image);
+	if ( iargs->cxi_output != NULL ) {
+		set_last_task("CXI output");
+		profile_start("write-cxi");
+		im_cxi_output_add(iargs->cxi_output, image);
+		profile_end("write-cxi");
+	}
+
 	/* Count crystals which are still good */
 	set_last_task("process_image finalisation");
 	notify_alive();
@@ -514,6 +843,11 @@ out:
 	sb_shared->n_processed++;
 	sb_shared->n_hits += image->hit;
 	sb_shared->n_hadcrystals += any_crystals;
+	sb_shared->n_vetoed += vetoed;
+	if ( sb_shared->tune_applied[cookie] == sb_shared->tune_generation ) {
+		sb_shared->tune_n_processed++;
+		sb_shared->tune_n_hadcrystals += any_crystals;
+	}
 	pthread_mutex_unlock(&sb_shared->totals_lock);
 
 	/* Free image (including detgeom) */
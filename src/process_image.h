@@ -45,6 +45,7 @@ struct index_args;
 #include "peaks.h"
 #include "image.h"
 #include "im-asapo.h"
+#include "im-zmq.h"
 #include "predict-refine.h"
 
 
@@ -57,14 +58,24 @@ struct index_args
 	int no_image_data;
 	int no_mask_data;
 	float highres;
+	struct detgeom_qmaps *resmaps;  /* For applying highres */
 	DataSourceType data_format;
+	struct im_reintegrate *reint;  /* Peaks and crystals from old stream */
+	struct im_peakcache *peak_cache;  /* Peaks from previous runs */
+	enum huge_pages huge_pages;  /* For the big per-worker buffers */
 
 	/* Peak search */
 	struct peak_params peak_search;
 	void *pf_private;
+	struct pf9_private_data *pf9_private;
+	int filter_threads;
 
 	/* Hit finding */
 	int min_peaks;
+	int veto;
+	float veto_threshold;
+	int veto_min_pixels;
+	int veto_subsample;
 
 	/* Indexing */
 	IndexingPrivate *ipriv;
@@ -90,10 +101,13 @@ struct index_args
 	float fix_divergence;
 	int overpredict;
 	int cell_params_only;
+	int int_threads;
+	int int_parallel_crystals;
 
 	/* Output */
 	int stream_flags;
 	int stream_nonhits;
+	struct im_cxi_output *cxi_output;  /* Peaks and hit flags in CXI files */
 };
 
 
@@ -108,19 +122,42 @@ struct pattern_args
 
 	void *zmq_data;
 	size_t zmq_data_size;
+	void *zmq_msg;   /* zmq_data is inside this message */
 
 	char *asapo_data;
 	size_t asapo_data_size;
 	char *asapo_meta;
+	void *asapo_msg;   /* asapo_data is inside this message */
+
+	/* If non-NULL, the image has already been read (see im-prefetch.c),
+	 * and process_image() will take ownership of it */
+	struct image *image;
 };
 
 
+/* Re-usable buffers for filtered image data, see process_image.c */
+struct filter_buffers;
+
 extern void process_image(const struct index_args *iargs,
                           struct pattern_args *pargs, Stream *st,
                           int cookie, const char *tmpdir, int serial,
                           struct sb_shm *sb_shared,
                           struct im_asapo *asapostuff,
-                          Mille *mille, ImageDataArrays *ida);
+                          struct im_zmq_output *zmqout,
+                          Mille *mille, ImageDataArrays *ida,
+                          struct filter_buffers *fb,
+                          struct intcontext **pic);
+
+extern struct filter_buffers *filter_buffers_new(enum huge_pages hp);
+extern void filter_buffers_free(struct filter_buffers *fb);
+
+extern struct image *file_wait_open_read(const char *filename,
+                                         const char *event,
+                                         DataTemplate *dtempl,
+                                         signed int wait_for_file,
+                                         int no_image_data, int no_mask_data,
+                                         ImageDataArrays *ida,
+                                         int report_task);
 
 
 #endif	/* PROCESS_IMAGE_H */
@@ -41,6 +41,7 @@
 #include "cell-utils.h"
 #include "post-refinement.h"
 #include "merge.h"
+#include "distribute.h"
 
 
 static double mean_intensity(RefList *list)
@@ -93,186 +94,313 @@ void early_rejection(struct crystal_refls *crystals, int n)
 }
 
 
-static int calculate_refl_mean_var(RefList *full)
+/* Adds up the values of temp1 and temp2 in 'full' across all ranks.  All
+ * ranks have the same reflections in 'full', in the same order. */
+static void sum_across_ranks(RefList *full)
 {
 	Reflection *refl;
 	RefListIterator *iter;
-	signed int oh = 0;
-	signed int ok = 0;
-	signed int ol = 0;
+	double *vals;
+	int i;
 
-	/* Iterate over all reflections */
-	for ( refl = first_refl(full, &iter);
+	vals = malloc(2*num_reflections(full)*sizeof(double)+1);
+	if ( vals == NULL ) {
+		ERROR("Failed to allocate memory for deltaCChalf\n");
+		exit(1);
+	}
+
+	for ( refl = first_refl(full, &iter), i=0;
 	      refl != NULL;
-	      refl = next_refl(refl, iter) )
+	      refl = next_refl(refl, iter), i+=2 )
+	{
+		vals[i] = get_temp1(refl);
+		vals[i+1] = get_temp2(refl);
+	}
+
+	dist_sum_doubles(vals, i);
+
+	for ( refl = first_refl(full, &iter), i=0;
+	      refl != NULL;
+	      refl = next_refl(refl, iter), i+=2 )
 	{
-		struct reflection_contributions *c;
-		int j;
+		set_temp1(refl, vals[i]);
+		set_temp2(refl, vals[i+1]);
+	}
+
+	free(vals);
+}
+
+
+/* The sums of the contributions to one merged reflection, shifted by the
+ * merged intensity K, from all ranks.  These are all that's needed to work out
+ * the mean and variance of the reflection, with or without any one crystal. */
+struct refl_sums
+{
+	double K;
+	double Ex;
+	double Ex2;
+	int n_contrib;
+	double res;  /* NaN if no contributions on this rank */
+};
+
+
+/* Returns the sums for each row of 'mc' */
+static struct refl_sums *calculate_refl_sums(RefList *full,
+                                             struct merge_contributions *mc)
+{
+	struct refl_sums *sums;
+	int i;
+
+	sums = malloc(mc->n_rows*sizeof(struct refl_sums));
+	if ( sums == NULL ) return NULL;
+
+	for ( i=0; i<mc->n_rows; i++ ) {
+
+		Reflection *refl = mc->rows[i];
+		long long int j;
+		long long int start = mc->offsets[i];
+		long long int end = mc->offsets[i+1];
 		signed int h, k, l;
 		double res;
 		double K;
 		double Ex = 0.0;
 		double Ex2 = 0.0;
 
-		get_indices(refl, &h, &k, &l);
-
-		/* next_refl() will iterate over multiple copies of the same
-		 * unique reflection, but we are only interested in seeing each
-		 * unique reflection once. */
-		if ( (h==oh) && (k==ok) && (l==ol) ) continue;
-		oh = h;  ok = k;  ol = l;
-
 		/* We use the mean (merged) intensity as the reference point
 		 * for shifting the data in the variance calculation */
 		K = get_intensity(refl);
+		sums[i].K = K;
+
+		/* When running across several ranks, there might not be any
+		 * contributions from the crystals on this one */
+		if ( start == end ) {
+			set_temp1(refl, 0.0);
+			set_temp2(refl, 0.0);
+			sums[i].res = NAN;
+			continue;
+		}
 
-		c = get_contributions(refl);
-		if ( c == NULL ) return 1;
+		get_indices(refl, &h, &k, &l);
 
 		/* Calculate the resolution just once, using the cell from the
 		 * first crystal to contribute, otherwise it takes too long */
-		res = resolution(crystal_get_cell(c->contrib_crystals[0]),
+		res = resolution(crystal_get_cell(mc->contrib_crystals[start]),
 		                 h, k, l);
+		sums[i].res = res;
 
 		/* Mean of contributions */
-		for ( j=0; j<c->n_contrib; j++ ) {
+		for ( j=start; j<end; j++ ) {
 
 			double Ii, G, B;
+			Reflection *c = mc->contribs[j];
 
-			G = crystal_get_osf(c->contrib_crystals[j]);
-			B = crystal_get_Bfac(c->contrib_crystals[j]);
-			Ii = correct_reflection(get_intensity(c->contribs[j]), c->contribs[j], G, B, res);
+			G = crystal_get_osf(mc->contrib_crystals[j]);
+			B = crystal_get_Bfac(mc->contrib_crystals[j]);
+			Ii = correct_reflection(get_intensity(c), c, G, B, res);
 
 			Ex += Ii - K;
 			Ex2 += (Ii - K) * (Ii - K);
 
 		}
 
-		if ( c->n_contrib < 2 ) continue;
-
 		set_temp1(refl, Ex);
 		set_temp2(refl, Ex2);
 	}
 
-	return 0;
+	if ( dist_size() > 1 ) sum_across_ranks(full);
+
+	for ( i=0; i<mc->n_rows; i++ ) {
+		sums[i].Ex = get_temp1(mc->rows[i]);
+		sums[i].Ex2 = get_temp2(mc->rows[i]);
+		/* The number of contributions from all ranks */
+		sums[i].n_contrib = get_redundancy(mc->rows[i]);
+	}
+
+	return sums;
 }
 
 
-static double calculate_cchalf(RefList *template, RefList *full,
-                               Crystal *exclude, int *pnref)
+/* Running totals for CChalf */
+struct cchalf_acc
 {
-	Reflection *trefl;
-	RefListIterator *iter;
-	double sig2E, sig2Y;
-	int n = 0;
-	double wSum = 0.0;
-	double mean = 0.0;
-	double S = 0.0;
-	double all_sum_var = 0.0;
-	signed int oh = 0;
-	signed int ok = 0;
-	signed int ol = 0;
+	int n;
+	double wSum;
+	double mean;
+	double S;
+	double all_sum_var;
+};
 
-	/* "template" is the list of reflections to be included in CChalf */
-	for ( trefl = first_refl(template, &iter);
-	      trefl != NULL;
-	      trefl = next_refl(trefl, iter) )
-	{
-		signed int h, k, l;
-		double refl_mean, refl_var;
-		double Ex, Ex2, K;
-		int n_removed = 0;
-		double w = 1.0;
-		double meanOld;
-		double res;
-		struct reflection_contributions *c;
-		Reflection *refl;
-		Reflection *exrefl;
 
-		/* The values we need are stored in the "full" list, not the
-		 * template list */
-		get_indices(trefl, &h, &k, &l);
+static void cchalf_acc_init(struct cchalf_acc *acc)
+{
+	acc->n = 0;
+	acc->wSum = 0.0;
+	acc->mean = 0.0;
+	acc->S = 0.0;
+	acc->all_sum_var = 0.0;
+}
 
-		if ( (h==oh) && (k==ok) && (l==ol) ) continue;
-		oh = h;  ok = k;  ol = l;
 
-		refl = find_refl(full, h, k, l);
-		if ( refl == NULL ) continue;  /* However, there might not have
-		                                * been enough measurements for
-		                                * it to appear in "full" */
+/* Adds a reflection with n_contrib contributions, and sums Ex and Ex2 of the
+ * contributions relative to K */
+static void cchalf_acc_add(struct cchalf_acc *acc, int n_contrib,
+                           double Ex, double Ex2, double K)
+{
+	double refl_mean, refl_var;
+	double w = 1.0;
+	double meanOld;
 
-		/* We use the mean (merged) intensity as the reference point
-		 * for shifting the data in the variance calculation */
-		K = get_intensity(refl);
-		Ex = get_temp1(refl);
-		Ex2 = get_temp2(refl);
-		c = get_contributions(refl);
-		assert(c != NULL);
+	if ( n_contrib < 2 ) return;
 
-		/* Resolution from first contributing crystal, like above */
-		res = resolution(crystal_get_cell(c->contrib_crystals[0]),
-		                 h, k, l);
+	refl_mean = K + (Ex / n_contrib);
+	refl_var = (Ex2 - (Ex*Ex)/n_contrib) / (n_contrib - 1);
+	refl_var /= n_contrib / 2.0;
 
-		/* Remove contribution(s) from the excluded crystal.
-		 * If the crystal is marked as bad, we should not remove it
-		 * because it did not contribute in the first place.  */
-		if ( exclude != NULL && !crystal_get_user_flag(exclude) ) {
-			exrefl = find_refl(template, h, k, l);
-		} else {
-			exrefl = NULL;
-		}
+	acc->all_sum_var += refl_var;
+	acc->n++;
 
-		while ( exrefl != NULL ) {
+	/* Running variance calculation to get sig2Y */
+	acc->wSum += w;
+	meanOld = acc->mean;
+	acc->mean = meanOld + (w/acc->wSum) * (refl_mean - meanOld);
+	acc->S += w * (refl_mean - meanOld) * (refl_mean - acc->mean);
+}
 
-			double G, B;
 
-			G = crystal_get_osf(exclude);
-			B = crystal_get_Bfac(exclude);
+static double cchalf_acc_value(struct cchalf_acc *acc)
+{
+	double sig2E, sig2Y;
+	sig2E = acc->all_sum_var / acc->n;
+	sig2Y = acc->S / (acc->wSum - 1.0);
+	return (sig2Y - 0.5*sig2E) / (sig2Y + 0.5*sig2E);
+}
 
-			if ( get_partiality(exrefl) > MIN_PART_MERGE ) {
 
-				double Ii = correct_reflection(get_intensity(exrefl), exrefl, G, B, res);
+static double overall_cchalf(struct merge_contributions *mc,
+                             const struct refl_sums *sums, int *pnref)
+{
+	struct cchalf_acc acc;
+	int i;
 
-				/* Remove contribution of this reflection */
-				Ex -= Ii - K;
-				Ex2 -= (Ii - K)*(Ii - K);
+	cchalf_acc_init(&acc);
+	for ( i=0; i<mc->n_rows; i++ ) {
+		cchalf_acc_add(&acc, sums[i].n_contrib, sums[i].Ex,
+		               sums[i].Ex2, sums[i].K);
+	}
 
-				n_removed++;
+	*pnref = acc.n;
+	return cchalf_acc_value(&acc);
+}
 
-			}
 
-			exrefl = next_found_refl(exrefl);
-		}
+/* Calculates CChalf over the reflections in 'refls', both with and without
+ * the contributions from crystal 'cr', in one pass.  Several observations of
+ * the same reflection come one after the other in the list, so the
+ * contributions to remove can be added up as the list is read. */
+static void crystal_cchalf(RefList *refls, Crystal *cr, RefList *full,
+                           struct merge_contributions *mc,
+                           const struct refl_sums *sums,
+                           double *pwith, double *pwithout, int *pnref)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	struct cchalf_acc with;
+	struct cchalf_acc without;
+	const struct refl_sums *cur = NULL;
+	signed int oh = 0;
+	signed int ok = 0;
+	signed int ol = 0;
+	double res = 0.0;
+	double rem_Ex = 0.0;
+	double rem_Ex2 = 0.0;
+	int n_removed = 0;
+	double G, B;
+	int remove;
+
+	cchalf_acc_init(&with);
+	cchalf_acc_init(&without);
+
+	/* If the crystal is marked as bad, we should not remove it
+	 * because it did not contribute in the first place.  */
+	remove = !crystal_get_user_flag(cr);
+	G = crystal_get_osf(cr);
+	B = crystal_get_Bfac(cr);
+
+	for ( refl = first_refl(refls, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
 
-		if ( c->n_contrib - n_removed < 2 ) continue;
+		get_indices(refl, &h, &k, &l);
 
-		refl_mean = K + (Ex / (c->n_contrib - n_removed));
-		refl_var = (Ex2 - (Ex*Ex)/(c->n_contrib - n_removed)) / (c->n_contrib - n_removed - 1);
-		refl_var /= (c->n_contrib - n_removed) / 2.0;
+		if ( (h!=oh) || (k!=ok) || (l!=ol) || (cur == NULL) ) {
 
-		all_sum_var += refl_var;
-		n++;
+			Reflection *frefl;
 
-		/* Running variance calculation to get sig2Y */
-		wSum += w;
-		meanOld = mean;
-		mean = meanOld + (w/wSum) * (refl_mean - meanOld);
-		S += w * (refl_mean - meanOld) * (refl_mean - mean);
-	}
+			if ( cur != NULL ) {
+				cchalf_acc_add(&with, cur->n_contrib, cur->Ex,
+				               cur->Ex2, cur->K);
+				cchalf_acc_add(&without,
+				               cur->n_contrib - n_removed,
+				               cur->Ex - rem_Ex,
+				               cur->Ex2 - rem_Ex2, cur->K);
+			}
 
-	sig2E = all_sum_var / n;
-	sig2Y = S / (wSum - 1.0);
+			oh = h;  ok = k;  ol = l;
+			rem_Ex = 0.0;
+			rem_Ex2 = 0.0;
+			n_removed = 0;
+			cur = NULL;
+
+			/* However, there might not have been enough
+			 * measurements for it to appear in "full" */
+			frefl = find_refl(full, h, k, l);
+			if ( frefl != NULL ) {
+				int row = merge_contributions_row(mc, frefl);
+				assert(row >= 0);
+				cur = &sums[row];
+				/* Resolution from first contributing crystal,
+				 * like in calculate_refl_sums() */
+				if ( !isnan(cur->res) ) {
+					res = cur->res;
+				} else {
+					res = resolution(crystal_get_cell(cr),
+					                 h, k, l);
+				}
+			}
+
+		}
+
+		if ( (cur != NULL) && remove
+		  && (get_partiality(refl) > MIN_PART_MERGE) )
+		{
+			double Ii = correct_reflection(get_intensity(refl),
+			                               refl, G, B, res);
+			rem_Ex += Ii - cur->K;
+			rem_Ex2 += (Ii - cur->K)*(Ii - cur->K);
+			n_removed++;
+		}
 
-	if ( pnref != NULL ) {
-		*pnref = n;
 	}
-	return (sig2Y - 0.5*sig2E) / (sig2Y + 0.5*sig2E);
+
+	if ( cur != NULL ) {
+		cchalf_acc_add(&with, cur->n_contrib, cur->Ex, cur->Ex2, cur->K);
+		cchalf_acc_add(&without, cur->n_contrib - n_removed,
+		               cur->Ex - rem_Ex, cur->Ex2 - rem_Ex2, cur->K);
+	}
+
+	*pwith = cchalf_acc_value(&with);
+	*pwithout = cchalf_acc_value(&without);
+	*pnref = without.n;
 }
 
 
 struct deltacchalf_queue_args
 {
 	RefList *full;
+	struct merge_contributions *mc;
+	const struct refl_sums *sums;
 	struct crystal_refls *crystals;
 	int n_crystals;
 	int n_done;
@@ -286,6 +414,8 @@ struct deltacchalf_queue_args
 struct deltacchalf_worker_args
 {
 	RefList *full;
+	struct merge_contributions *mc;
+	const struct refl_sums *sums;
 	Crystal *crystal;
 	RefList *refls;
 	int crystal_number;
@@ -303,6 +433,8 @@ static void *create_deltacchalf_job(void *vqargs)
 	wargs = malloc(sizeof(struct deltacchalf_worker_args));
 
 	wargs->full = qargs->full;
+	wargs->mc = qargs->mc;
+	wargs->sums = qargs->sums;
 	wargs->crystal = qargs->crystals[qargs->n_started].cr;
 	wargs->refls = qargs->crystals[qargs->n_started].refls;
 	wargs->crystal_number = qargs->n_started;
@@ -320,13 +452,8 @@ static void run_deltacchalf_job(void *vwargs, int cookie)
 	double cchalf, cchalfi;
 	struct deltacchalf_worker_args *wargs = vwargs;
 	int nref = 0;
-	cchalf = calculate_cchalf(wargs->refls, wargs->full, NULL, &nref);
-	cchalfi = calculate_cchalf(wargs->refls, wargs->full, wargs->crystal, &nref);
-	//STATUS("Frame %i:", i);
-	//STATUS("   With = %f  ", cchalf*100.0);
-	//STATUS("Without = %f", cchalfi*100.0);
-	//STATUS("  Delta = %f  ", (cchalf - cchalfi)*100.0);
-	//STATUS("(nref = %i)\n", nref);
+	crystal_cchalf(wargs->refls, wargs->crystal, wargs->full, wargs->mc,
+	               wargs->sums, &cchalf, &cchalfi, &nref);
 	if ( nref == 0 ) {
 		wargs->deltaCChalf = 0.0;
 		wargs->non = 1;
@@ -355,7 +482,8 @@ static void finalise_deltacchalf_job(void *vqargs, void *vwargs)
 
 
 static void check_deltacchalf(struct crystal_refls *crystals, int n,
-                              RefList *full, int n_threads)
+                              RefList *full, struct merge_contributions *mc,
+                              int n_threads)
 {
 	double cchalf;
 	int i;
@@ -363,23 +491,33 @@ static void check_deltacchalf(struct crystal_refls *crystals, int n,
 	double mean, sd;
 	int nref = 0;
 	struct deltacchalf_queue_args qargs;
+	struct refl_sums *rsums;
 
-	if ( calculate_refl_mean_var(full) ) {
+	if ( mc == NULL ) {
 		STATUS("No reflection contributions for deltaCChalf "
 		       "calculation (using reference reflections?)\n");
 		return;
 	}
 
-	cchalf = calculate_cchalf(full, full, NULL, &nref);
+	rsums = calculate_refl_sums(full, mc);
+	if ( rsums == NULL ) {
+		ERROR("Not enough memory for deltaCChalf check\n");
+		return;
+	}
+
+	cchalf = overall_cchalf(mc, rsums, &nref);
 	STATUS("Overall CChalf = %f %% (%i reflections)\n", cchalf*100.0, nref);
 
 	vals = malloc(n*sizeof(double));
 	if ( vals == NULL ) {
 		ERROR("Not enough memory for deltaCChalf check\n");
+		free(rsums);
 		return;
 	}
 
 	qargs.full = full;
+	qargs.mc = mc;
+	qargs.sums = rsums;
 	qargs.crystals = crystals;
 	qargs.n_started = 0;
 	qargs.n_crystals = n;
@@ -390,6 +528,9 @@ static void check_deltacchalf(struct crystal_refls *crystals, int n,
 	run_threads(n_threads, run_deltacchalf_job, create_deltacchalf_job,
 	            finalise_deltacchalf_job, &qargs, n, 0, 0, 0);
 
+	dist_sum_ints(&qargs.n_non, 1);
+	dist_sum_ints(&qargs.n_nan, 1);
+
 	if ( qargs.n_non > 0 ) {
 		STATUS("WARNING: %i patterns had no reflections in deltaCChalf "
 		       "calculation (I set deltaCChalf=zero for them)\n",
@@ -400,8 +541,21 @@ static void check_deltacchalf(struct crystal_refls *crystals, int n,
 		       "replaced with zero\n", qargs.n_nan);
 	}
 
-	mean = gsl_stats_mean(vals, 1, n);
-	sd = gsl_stats_sd_m(vals, 1, n, mean);
+	if ( dist_size() == 1 ) {
+		mean = gsl_stats_mean(vals, 1, n);
+		sd = gsl_stats_sd_m(vals, 1, n, mean);
+	} else {
+		double sums[2];
+		sums[0] = 0.0;
+		sums[1] = n;
+		for ( i=0; i<n; i++ ) sums[0] += vals[i];
+		dist_sum_doubles(sums, 2);
+		mean = sums[0] / sums[1];
+		sd = 0.0;
+		for ( i=0; i<n; i++ ) sd += (vals[i]-mean)*(vals[i]-mean);
+		dist_sum_doubles(&sd, 1);
+		sd = sqrt(sd / (sums[1]-1.0));
+	}
 	STATUS("deltaCChalf = %f ± %f %%\n", mean*100.0, sd*100.0);
 
 	for ( i=0; i<n; i++ ) {
@@ -413,6 +567,7 @@ static void check_deltacchalf(struct crystal_refls *crystals, int n,
 	}
 
 	free(vals);
+	free(rsums);
 }
 
 
@@ -432,6 +587,9 @@ static void show_duds(struct crystal_refls *crystals, int n_crystals)
 		if ( flag != PRFLAG_OK ) any_bad++;
 	}
 
+	dist_sum_ints(bads, 32);
+	dist_sum_ints(&any_bad, 1);
+
 	if ( any_bad ) {
 		STATUS("%i bad crystals:\n", any_bad);
 		for ( j=0; j<32; j++ ) {
@@ -444,14 +602,15 @@ static void show_duds(struct crystal_refls *crystals, int n_crystals)
 
 
 void check_rejection(struct crystal_refls *crystals, int n, RefList *full,
-                     double max_B, int no_deltacchalf, int n_threads)
+                     struct merge_contributions *mc, double max_B,
+                     int no_deltacchalf, int n_threads)
 {
 	int i;
 	int n_acc = 0;
 
 	/* Check according to delta CC½ */
 	if ( !no_deltacchalf && (full != NULL) ) {
-		 check_deltacchalf(crystals, n, full, n_threads);
+		 check_deltacchalf(crystals, n, full, mc, n_threads);
 	}
 
 	for ( i=0; i<n; i++ ) {
@@ -461,6 +620,8 @@ void check_rejection(struct crystal_refls *crystals, int n, RefList *full,
 		if ( crystal_get_user_flag(crystals[i].cr) == 0 ) n_acc++;
 	}
 
+	dist_sum_ints(&n_acc, 1);
+
 	show_duds(crystals, n);
 
 	if ( n_acc < 2 ) {
@@ -36,9 +36,11 @@
 
 
 #include "image.h"
+#include "merge.h"
 
 extern void early_rejection(struct crystal_refls *crystals, int n);
 extern void check_rejection(struct crystal_refls *crystals, int n, RefList *full,
-                            double max_B, int no_deltacchalf, int n_threads);
+                            struct merge_contributions *mc, double max_B,
+                            int no_deltacchalf, int n_threads);
 
 #endif	/* REJECTION_H */
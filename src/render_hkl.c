@@ -116,75 +116,69 @@ static void show_help(const char *s)
 #ifdef HAVE_CAIRO
 
 
-static double max_value(RefList *list, int wght, const SymOpList *sym)
+struct zone_point
 {
-	Reflection *refl;
-	RefListIterator *iter;
-	double max = -INFINITY;
-	SymOpMask *m;
-
-	m = new_symopmask(sym);
+	double xi;
+	double yi;
+	double val;
+};
 
-	for ( refl = first_refl(list, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
-	{
-		double val;
-		int n;
-		signed int h, k, l;
 
-		get_indices(refl, &h, &k, &l);
+/* The reflections in one zone, in the 2D basis of the cut */
+struct zone_points
+{
+	struct zone_point *pts;
+	int n;
+	int max;
+	double max_val;  /* Over all reflections, not only the ones in the zone */
+};
 
-		special_position(sym, m, h, k, l);
-		n = num_equivs(sym, m);
 
-		switch ( wght ) {
+static double refl_value(Reflection *refl, int wght, int n)
+{
+	double val;
 
-			case WGHT_I :
-			val = get_intensity(refl);
-			break;
+	switch ( wght ) {
 
-			case WGHT_SQRTI :
-			val = get_intensity(refl);
-			val = (val>0.0) ? sqrt(val) : 0.0;
-			break;
+		case WGHT_I :
+		val = get_intensity(refl);
+		break;
 
-			case WGHT_COUNTS :
-			val = get_redundancy(refl);
-			val /= (double)n;
-			break;
+		case WGHT_SQRTI :
+		val = get_intensity(refl);
+		val = (val>0.0) ? sqrt(val) : 0.0;
+		break;
 
-			case WGHT_RAWCOUNTS :
-			val = get_redundancy(refl);
-			break;
+		case WGHT_COUNTS :
+		val = get_redundancy(refl);
+		val /= (double)n;
+		break;
 
-			default :
-			ERROR("Invalid weighting.\n");
-			abort();
+		case WGHT_RAWCOUNTS :
+		val = get_redundancy(refl);
+		break;
 
-		}
+		default :
+		ERROR("Invalid weighting.\n");
+		abort();
 
-		if ( val > max ) max = val;
 	}
 
-	return max;
+	return val;
 }
 
 
-static void draw_circles(double xh, double xk, double xl,
-                         double yh, double yk, double yl,
-                         signed int zh, signed int zk, signed int zl,
-                         RefList *list, const SymOpList *sym,
-                         cairo_t *dctx, int wght, double boost, int colscale,
-                         UnitCell *cell, double radius, double theta,
-                         double as, double bs, double cx, double cy,
-                         double scale, double max_val, signed int zone)
+/* Works out the matrix which takes Miller indices to coordinates in the basis
+ * of the cut (x, y) and the zone axis.  Also returns the length of the zone
+ * axis in direct space. */
+static int zone_basis(UnitCell *cell,
+                      double xh, double xk, double xl,
+                      double yh, double yk, double yl,
+                      signed int zh, signed int zk, signed int zl,
+                      double *inv, double *pza_len)
 {
-	Reflection *refl;
-	RefListIterator *iter;
-	SymOpMask *m;
 	gsl_matrix *basis;
-	gsl_vector *ind;
+	gsl_matrix *basis_inv;
 	gsl_permutation *p;
 	int signum;
 	double adx, ady, adz;
@@ -196,20 +190,19 @@ static void draw_circles(double xh, double xk, double xl,
 	double csx, csy, csz;
 	gsl_matrix *A;
 	double za_len;
-
-	m = new_symopmask(sym);
+	int i, j;
 
 	/* Get the zone axis direction in cartesian coordinates */
 	za = gsl_vector_alloc(3);
 	if ( za == NULL ) {
 		ERROR("Couldn't allocate za\n");
-		return;
+		return 1;
 	}
 	if ( cell_get_cartesian(cell, &adx, &ady, &adz,
 	                              &bdx, &bdy, &bdz,
 	                              &cdx, &cdy, &cdz) ) {
 		ERROR("Couldn't get cartesian parameters\n");
-		return;
+		return 1;
 	}
 	gsl_vector_set(za, 0, adx*zh + bdx*zk + cdx*zl);
 	gsl_vector_set(za, 1, ady*zh + bdy*zk + cdy*zl);
@@ -221,19 +214,20 @@ static void draw_circles(double xh, double xk, double xl,
 	za_len = gsl_blas_dnrm2(za);
 	gsl_blas_dscal(1.0/za_len, za);
 	gsl_blas_dscal(1.0/za_len, za);
+	*pza_len = za_len;
 
 	/* Express it in terms of the basis vectors of the reciprocal lattice */
 	if ( cell_get_reciprocal(cell, &asx, &asy, &asz,
 	                               &bsx, &bsy, &bsz,
 	                               &csx, &csy, &csz) ) {
 		ERROR("Couldn't get reciprocal parameters\n");
-		return;
+		return 1;
 	}
 
 	A = gsl_matrix_alloc(3, 3);
 	if ( A == NULL ) {
 		ERROR("Couldn't allocate A\n");
-		return;
+		return 1;
 	}
 	gsl_matrix_set(A, 0, 0, asx);
 	gsl_matrix_set(A, 1, 0, asy);
@@ -257,7 +251,8 @@ static void draw_circles(double xh, double xk, double xl,
 	gsl_matrix_free(A);
 
 	basis = gsl_matrix_alloc(3, 3);
-	if ( basis == NULL ) return;
+	basis_inv = gsl_matrix_alloc(3, 3);
+	if ( (basis == NULL) || (basis_inv == NULL) ) return 1;
 
 	gsl_matrix_set(basis, 0, 0, xh);
 	gsl_matrix_set(basis, 1, 0, xk);
@@ -268,28 +263,87 @@ static void draw_circles(double xh, double xk, double xl,
 	gsl_matrix_set(basis, 0, 2, gsl_vector_get(za, 0));
 	gsl_matrix_set(basis, 1, 2, gsl_vector_get(za, 1));
 	gsl_matrix_set(basis, 2, 2, gsl_vector_get(za, 2));
+
+	/* Invert once, instead of solving for every reflection */
 	gsl_linalg_LU_decomp(basis, p, &signum);
+	gsl_linalg_LU_invert(basis, p, basis_inv);
+	for ( i=0; i<3; i++ ) {
+		for ( j=0; j<3; j++ ) {
+			inv[3*i+j] = gsl_matrix_get(basis_inv, i, j);
+		}
+	}
 
 	gsl_vector_free(za);
+	gsl_matrix_free(basis);
+	gsl_matrix_free(basis_inv);
+	gsl_permutation_free(p);
+	return 0;
+}
+
 
-	ind = gsl_vector_alloc(3);
-	if ( ind == NULL ) return;
+static int add_zone_point(struct zone_points *zp, double xi, double yi,
+                          double val)
+{
+	if ( zp->n == zp->max ) {
+		int new_max = (zp->max == 0) ? 1024 : 2*zp->max;
+		struct zone_point *new_pts;
+		new_pts = realloc(zp->pts, new_max*sizeof(struct zone_point));
+		if ( new_pts == NULL ) return 1;
+		zp->pts = new_pts;
+		zp->max = new_max;
+	}
+
+	zp->pts[zp->n].xi = xi;
+	zp->pts[zp->n].yi = yi;
+	zp->pts[zp->n].val = val;
+	zp->n++;
+	return 0;
+}
+
+
+/* Finds the maximum value and all the points in the zone, in one pass over the
+ * list.  Reflections which are too close to the origin to have any
+ * equivalents in the zone are not expanded by symmetry. */
+static int find_zone_points(struct zone_points *zp, RefList *list,
+                            UnitCell *cell, const SymOpList *sym, int wght,
+                            const double *inv, double za_len,
+                            signed int zh, signed int zk, signed int zl,
+                            signed int zone)
+{
+	Reflection *refl;
+	RefListIterator *iter;
+	SymOpMask *m;
+
+	zp->pts = NULL;
+	zp->n = 0;
+	zp->max = 0;
+	zp->max_val = -INFINITY;
+
+	m = new_symopmask(sym);
+	if ( m == NULL ) return 1;
 
-	/* Iterate over all reflections */
 	for ( refl = first_refl(list, &iter);
 	      refl != NULL;
 	      refl = next_refl(refl, iter) )
 	{
-		double u, v, val;
 		signed int ha, ka, la;
 		int i, n;
-		double r, g, b;
+		double val;
 
 		get_indices(refl, &ha, &ka, &la);
 
 		special_position(sym, m, ha, ka, la);
 		n = num_equivs(sym, m);
 
+		val = refl_value(refl, wght, n);
+		if ( val > zp->max_val ) zp->max_val = val;
+
+		/* h.z = g.z_direct, so the zone index of any equivalent can be
+		 * no more than |g| times the length of the direct axis */
+		if ( abs(zone) > 2.0*resolution(cell, ha, ka, la)*za_len + 0.5 ) {
+			continue;
+		}
+
 		for ( i=0; i<n; i++ ) {
 
 			signed int h, k, l;
@@ -300,61 +354,106 @@ static void draw_circles(double xh, double xk, double xl,
 			/* Is the reflection in the zone? */
 			if ( h*zh + k*zk + l*zl != zone) continue;
 
-			gsl_vector_set(ind, 0, h);
-			gsl_vector_set(ind, 1, k);
-			gsl_vector_set(ind, 2, l);
-			gsl_linalg_LU_svx(basis, p, ind);
-			xi = gsl_vector_get(ind, 0);
-			yi = gsl_vector_get(ind, 1);
+			xi = inv[0]*h + inv[1]*k + inv[2]*l;
+			yi = inv[3]*h + inv[4]*k + inv[5]*l;
+
+			if ( add_zone_point(zp, xi, yi, val) ) {
+				free_symopmask(m);
+				return 1;
+			}
 
-			switch ( wght) {
+		}
 
-				case WGHT_I :
-				val = get_intensity(refl);
-				break;
+	}
 
-				case WGHT_SQRTI :
-				val = get_intensity(refl);
-				val = (val>0.0) ? sqrt(val) : 0.0;
-				break;
+	free_symopmask(m);
+	return 0;
+}
 
-				case WGHT_COUNTS :
-				val = get_redundancy(refl);
-				val /= (double)n;
-				break;
 
-				case WGHT_RAWCOUNTS :
-				val = get_redundancy(refl);
-				break;
+struct drawn_point
+{
+	unsigned int colour;
+	double x;
+	double y;
+};
 
-				default :
-				ERROR("Invalid weighting.\n");
-				abort();
 
-			}
+static int cmp_colour(const void *av, const void *bv)
+{
+	const struct drawn_point *a = av;
+	const struct drawn_point *b = bv;
+	if ( a->colour < b->colour ) return -1;
+	if ( a->colour > b->colour ) return +1;
+	return 0;
+}
 
-			/* Absolute location in image based on 2D basis */
-			u = (double)xi*as*sin(theta);
-			v = (double)xi*as*cos(theta) + (double)yi*bs;
 
-			cairo_arc(dctx, ((double)cx)+u*scale,
-				        ((double)cy)+v*scale,
-				        radius, 0.0, 2.0*M_PI);
+static unsigned int colour_channel(double v)
+{
+	if ( v < 0.0 ) return 0;
+	if ( v > 1.0 ) return 255;
+	return lrint(v*255.0);
+}
 
-			colscale_lookup(val, max_val/boost, colscale,
-			                &r, &g, &b);
-			cairo_set_source_rgb(dctx, r, g, b);
-			cairo_fill(dctx);
 
-		}
+/* Draws the points grouped by colour, with one fill for each colour.  The
+ * colours are rounded to 8 bits per channel to make the groups. */
+static void draw_circles(struct zone_points *zp, cairo_t *dctx,
+                         double boost, int colscale, double radius,
+                         double theta, double as, double bs,
+                         double cx, double cy, double scale, double max_val)
+{
+	struct drawn_point *dp;
+	int i;
 
+	dp = malloc(zp->n*sizeof(struct drawn_point));
+	if ( dp == NULL ) {
+		ERROR("Couldn't allocate points\n");
+		return;
 	}
 
-	gsl_matrix_free(basis);
-	gsl_vector_free(ind);
-	gsl_permutation_free(p);
+	for ( i=0; i<zp->n; i++ ) {
 
-	free_symopmask(m);
+		double u, v;
+		double r, g, b;
+
+		/* Absolute location in image based on 2D basis */
+		u = zp->pts[i].xi*as*sin(theta);
+		v = zp->pts[i].xi*as*cos(theta) + zp->pts[i].yi*bs;
+		dp[i].x = cx + u*scale;
+		dp[i].y = cy + v*scale;
+
+		colscale_lookup(zp->pts[i].val, max_val/boost, colscale,
+		                &r, &g, &b);
+		dp[i].colour = colour_channel(r) << 16
+		             | colour_channel(g) << 8
+		             | colour_channel(b);
+
+	}
+
+	qsort(dp, zp->n, sizeof(struct drawn_point), cmp_colour);
+
+	for ( i=0; i<zp->n; i++ ) {
+
+		unsigned int col = dp[i].colour;
+
+		cairo_new_path(dctx);
+		while ( (i < zp->n) && (dp[i].colour == col) ) {
+			cairo_new_sub_path(dctx);
+			cairo_arc(dctx, dp[i].x, dp[i].y, radius, 0.0, 2.0*M_PI);
+			i++;
+		}
+		i--;
+
+		cairo_set_source_rgb(dctx, ((col >> 16) & 0xff)/255.0,
+		                           ((col >> 8) & 0xff)/255.0,
+		                           (col & 0xff)/255.0);
+		cairo_fill(dctx);
+
+	}
+
+	free(dp);
 }
 
 
@@ -436,6 +535,9 @@ static void render_za(UnitCell *cell, RefList *list,
 	int png;
 	double rmin, rmax;
 	int i;
+	double basis_inv[9];
+	double za_len;
+	struct zone_points zp;
 
 	/* Vector product to determine the zone axis. */
 	zh = yk*xl - yl*xk;
@@ -469,9 +571,20 @@ static void render_za(UnitCell *cell, RefList *list,
 	       " (d = %.2f - %.2f A)\n",
 	       rmin/1e9, rmax/1e9, (1.0/rmin)/1e-10, (1.0/rmax)/1e-10);
 
-	max_val = max_value(list, wght, sym);
+	if ( zone_basis(cell, xh, xk, xl, yh, yk, yl, zh, zk, zl,
+	                basis_inv, &za_len) ) return;
+	if ( find_zone_points(&zp, list, cell, sym, wght, basis_inv, za_len,
+	                      zh, zk, zl, zone) )
+	{
+		ERROR("Couldn't find reflections in zone\n");
+		free(zp.pts);
+		return;
+	}
+
+	max_val = zp.max_val;
 	if ( max_val <= 0.0 ) {
 		STATUS("Couldn't find max value.\n");
+		free(zp.pts);
 		return;
 	}
 
@@ -508,6 +621,7 @@ static void render_za(UnitCell *cell, RefList *list,
 	if ( cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS ) {
 		ERROR("Couldn't create Cairo surface\n");
 		cairo_surface_destroy(surface);
+		free(zp.pts);
 		return;
 	}
 
@@ -515,6 +629,7 @@ static void render_za(UnitCell *cell, RefList *list,
 	if ( cairo_status(dctx) != CAIRO_STATUS_SUCCESS ) {
 		ERROR("Couldn't create Cairo context\n");
 		cairo_surface_destroy(surface);
+		free(zp.pts);
 		return;
 	}
 
@@ -531,10 +646,9 @@ static void render_za(UnitCell *cell, RefList *list,
 	cx = 532.0 - size.width;
 	cy = 512.0 - 20.0;
 
-	draw_circles(xh, xk, xl, yh, yk, yl, zh, zk, zl,
-	             list, sym, dctx, wght, boost, colscale, cell,
-	             max_r, theta, as, bs, cx, cy, scale,
-	             max_val, zone);
+	draw_circles(&zp, dctx, boost, colscale, max_r, theta, as, bs,
+	             cx, cy, scale, max_val);
+	free(zp.pts);
 
 	/* Resolution rings */
 	for ( i=0; i<rings->n_rings; i++ ) {
@@ -33,12 +33,6 @@
 
 #include <stdlib.h>
 #include <assert.h>
-#include <gsl/gsl_matrix.h>
-#include <gsl/gsl_vector.h>
-#include <gsl/gsl_linalg.h>
-#include <gsl/gsl_eigen.h>
-#include <gsl/gsl_fit.h>
-#include <gsl/gsl_statistics_double.h>
 
 #include "merge.h"
 #include "post-refinement.h"
@@ -47,6 +41,7 @@
 #include "cell-utils.h"
 #include "scaling.h"
 #include "reflist-utils.h"
+#include "distribute.h"
 
 
 struct scale_args
@@ -55,6 +50,8 @@ struct scale_args
 	Crystal *crystal;
 	RefList *refls;
 	int flags;
+	double *res_before;
+	double *res_after;
 };
 
 
@@ -65,13 +62,31 @@ struct scale_queue_args
 	struct crystal_refls *crystals;
 	int n_crystals;
 	struct scale_args task_defaults;
+	double *res_before;  /* Log residual of each crystal before scaling */
+	double *res_after;   /* ... and after */
 };
 
 
+/* The log residuals before and after scaling are calculated here as well,
+ * so that the lookups in the merged list only need to be done once */
 static void scale_crystal(void *task, int id)
 {
 	struct scale_args *pargs = task;
-	scale_one_crystal(pargs->refls, pargs->crystal, pargs->full, pargs->flags);
+	struct joined_refls j;
+	Crystal *cr = pargs->crystal;
+
+	if ( join_crystal_refls(pargs->refls, cr, pargs->full, &j) ) {
+		ERROR("Failed to allocate memory for scaling.\n");
+		*pargs->res_before = NAN;
+		*pargs->res_after = NAN;
+		return;
+	}
+
+	*pargs->res_before = joined_log_residual(&j, crystal_get_osf(cr),
+	                                         crystal_get_Bfac(cr), 0, NULL);
+	scale_joined(&j, cr, pargs->flags);
+	*pargs->res_after = joined_log_residual(&j, crystal_get_osf(cr),
+	                                        crystal_get_Bfac(cr), 0, NULL);
 }
 
 
@@ -85,6 +100,8 @@ static void *get_crystal(void *vqargs)
 
 	task->crystal = qargs->crystals[qargs->n_started].cr;
 	task->refls = qargs->crystals[qargs->n_started].refls;
+	task->res_before = &qargs->res_before[qargs->n_started];
+	task->res_after = &qargs->res_after[qargs->n_started];
 
 	qargs->n_started++;
 
@@ -101,8 +118,9 @@ static void done_crystal(void *vqargs, void *task)
 }
 
 
+/* Adds up the log residuals calculated by scale_crystal(), in order */
 static double total_log_r(struct crystal_refls *crystals, int n_crystals,
-                          RefList *full, int *ninc)
+                          double *res, int *ninc)
 {
 	int i;
 	double total = 0.0;
@@ -111,8 +129,7 @@ static double total_log_r(struct crystal_refls *crystals, int n_crystals,
 	for ( i=0; i<n_crystals; i++ ) {
 		double r;
 		if ( crystal_get_user_flag(crystals[i].cr) ) continue;
-		r = log_residual(crystals[i].refls, crystals[i].cr,
-		                 full, 0, NULL, NULL);
+		r = res[i];
 		if ( isnan(r) ) continue;
 		total += r;
 		n++;
@@ -131,6 +148,11 @@ void scale_all(struct crystal_refls *crystals, int n_crystals, int nthreads, int
 	double old_res, new_res;
 	int niter = 0;
 
+	/* Scaling one crystal is quick, so take several at once.
+	 * get_crystal() and done_crystal() do not share any state. */
+	struct thread_pool_opts tpopts = {.chunk_size = 8,
+	                                  .final_locking = TP_FINAL_SEPARATE_LOCK};
+
 	task_defaults.crystal = NULL;
 	task_defaults.flags = scaleflags;
 	task_defaults.full = NULL;  /* (not used) */
@@ -138,6 +160,14 @@ void scale_all(struct crystal_refls *crystals, int n_crystals, int nthreads, int
 	qargs.task_defaults = task_defaults;
 	qargs.n_crystals = n_crystals;
 	qargs.crystals = crystals;
+	qargs.res_before = malloc(n_crystals*sizeof(double));
+	qargs.res_after = malloc(n_crystals*sizeof(double));
+	if ( (qargs.res_before == NULL) || (qargs.res_after == NULL) ) {
+		ERROR("Failed to allocate memory for scaling.\n");
+		free(qargs.res_before);
+		free(qargs.res_after);
+		return;
+	}
 
 	/* Don't have threads which are doing nothing */
 	if ( n_crystals < nthreads ) nthreads = n_crystals;
@@ -147,31 +177,45 @@ void scale_all(struct crystal_refls *crystals, int n_crystals, int nthreads, int
 		RefList *full;
 		int ninc;
 		double bef_res;
+		double sums[5];
 
 		full = merge_intensities(crystals, n_crystals, nthreads,
 		                         2, INFINITY, 0, 1);
 		old_res = new_res;
-		bef_res = total_log_r(crystals, n_crystals, full, NULL);
 
 		qargs.task_defaults.full = full;
 		qargs.n_started = 0;
 		qargs.n_done = 0;
-		run_threads(nthreads, scale_crystal, get_crystal, done_crystal,
-		            &qargs, n_crystals, 0, 0, 0);
+		run_threads_opts(nthreads, scale_crystal, get_crystal,
+		                 done_crystal, &qargs, n_crystals, &tpopts);
 
-		new_res = total_log_r(crystals, n_crystals, full, &ninc);
-		STATUS("Log residual went from %e to %e, %i crystals\n",
-		       bef_res, new_res, ninc);
+		bef_res = total_log_r(crystals, n_crystals, qargs.res_before, NULL);
+		new_res = total_log_r(crystals, n_crystals, qargs.res_after, &ninc);
 
 		int i;
 		double meanB = 0.0;
 		for ( i=0; i<n_crystals; i++ ) {
 			meanB += crystal_get_Bfac(crystals[i].cr);
 		}
-		meanB /= n_crystals;
+
+		/* All ranks must agree on when to stop */
+		sums[0] = bef_res;
+		sums[1] = new_res;
+		sums[2] = ninc;
+		sums[3] = meanB;
+		sums[4] = n_crystals;
+		dist_sum_doubles(sums, 5);
+		bef_res = sums[0];
+		new_res = sums[1];
+		ninc = sums[2];
+		meanB = sums[3];
+
+		STATUS("Log residual went from %e to %e, %i crystals\n",
+		       bef_res, new_res, ninc);
+
+		meanB /= sums[4];
 		STATUS("Mean B = %e\n", meanB);
 
-		free_contribs(full);
 		reflist_free(full);
 		niter++;
 
@@ -180,22 +224,19 @@ void scale_all(struct crystal_refls *crystals, int n_crystals, int nthreads, int
 	if ( niter == 10 ) {
 		ERROR("Too many iterations - giving up!\n");
 	}
+
+	free(qargs.res_before);
+	free(qargs.res_after);
 }
 
 
-/* Calculates G and B, by which cr's reflections should be multiplied to fit reference */
-int scale_one_crystal(const RefList *listS, Crystal *cr,
-                      const RefList *listR, int flags)
+/* Calculates G and B, by which cr's reflections should be multiplied to fit
+ * the merged list which was used to create 'j' */
+int scale_joined(const struct joined_refls *j, Crystal *cr, int flags)
 {
-	const Reflection *reflS;
-	RefListIterator *iter;
-	int max_n = 256;
+	int i;
 	int n = 0;
-	double *x;
-	double *y;
-	double *w;
-	int r;
-	double cov00, cov01, cov11, chisq;
+	int used[10];
 	int n_esdS = 0;
 	int n_ihS = 0;
 	int n_ihR = 0;
@@ -204,49 +245,25 @@ int scale_one_crystal(const RefList *listS, Crystal *cr,
 	int n_infS = 0;
 	int n_infR = 0;
 	int n_part = 0;
-	int n_nom = 0;
+	int n_nom = j->n_total - j->n;
 	int n_red = 0;
-	UnitCell *cell = crystal_get_cell(cr);
 	double G, B;
 
-	assert(cell != NULL);
-	assert(listR != NULL);
-	assert(listS != NULL);
-
-	x = malloc(max_n*sizeof(double));
-	w = malloc(max_n*sizeof(double));
-	y = malloc(max_n*sizeof(double));
-	if ( (x==NULL) || (y==NULL) || (w==NULL) ) {
-		ERROR("Failed to allocate memory for scaling.\n");
-		return 1;
-	}
-
-	int nb = 0;
-	for ( reflS = first_refl_const(listS, &iter);
-	      reflS != NULL;
-	      reflS = next_refl_const(reflS, iter) )
-	{
-		signed int h, k, l;
-		const Reflection *reflR;
-		double IhR, IhS, esdS, pS, LS;
-		double s;
-
-		nb++;
-
-		get_indices(reflS, &h, &k, &l);
-		reflR = find_refl(listR, h, k, l);
-		if ( reflR == NULL ) {
-			n_nom++;
-			continue;
-		}
+	/* Weighted means and (co-)moments of x=s^2 and y=log(ratio),
+	 * accumulated in one pass */
+	double sw = 0.0;
+	double mx = 0.0;
+	double my = 0.0;
+	double sxx = 0.0;
+	double sxy = 0.0;
 
-		s = resolution(cell, h, k, l);
+	for ( i=0; i<j->n; i++ ) {
 
-		IhR = get_intensity(reflR);
-		IhS = get_intensity(reflS);
-		esdS = get_esd_intensity(reflS);
-		pS = get_partiality(reflS);
-		LS = get_lorentz(reflS);
+		double IhR = j->I_full[i];
+		double IhS = j->I_partial[i];
+		double esdS = j->esd[i];
+		double pS = j->p[i];
+		double x, y, dx;
 
 		/* Problem cases in approximate descending order of severity */
 		if ( isnan(IhR) ) { n_nanR++; continue; }
@@ -257,33 +274,27 @@ int scale_one_crystal(const RefList *listS, Crystal *cr,
 		if ( IhS <= 0.0 ) { n_ihS++; continue; }
 		if ( IhS <= 3.0*esdS ) { n_esdS++; continue; }
 		if ( IhR <= 0.0 ) { n_ihR++; continue; }
-		if ( get_redundancy(reflR) < 2 ) { n_red++; continue; }
-
-		if ( n == max_n ) {
-			max_n *= 2;
-			x = srealloc(x, max_n*sizeof(double));
-			y = srealloc(y, max_n*sizeof(double));
-			w = srealloc(w, max_n*sizeof(double));
-			if ( (x==NULL) || (y==NULL) || (w==NULL) ) {
-				free(x);
-				free(y);
-				free(w);
-				ERROR("Failed to allocate memory for scaling.\n");
-				return 1;
-			}
+		if ( j->red[i] < 2 ) { n_red++; continue; }
 
-		}
+		x = j->s2[i];
+		y = -j->logterm[i];
+
+		/* Weight is the partiality */
+		sw += pS;
+		dx = x - mx;
+		mx += dx * pS / sw;
+		my += (y - my) * pS / sw;
+		sxx += pS * dx * (x - mx);
+		sxy += pS * dx * (y - my);
 
-		x[n] = s*s;
-		y[n] = log(LS) + log(IhS) -log(pS) - log(IhR);
-		w[n] = pS;
+		if ( n < 10 ) used[n] = i;
 		n++;
 
 	}
 
 	if ( n < 2 ) {
 		if ( flags & SCALE_VERBOSE_ERRORS ) {
-			ERROR("Not enough reflections for scaling (had %i, but %i remain)\n", nb, n);
+			ERROR("Not enough reflections for scaling (had %i, but %i remain)\n", j->n_total, n);
 			if ( n_esdS ) ERROR("%i subject reflection esd\n", n_esdS);
 			if ( n_ihR ) ERROR("%i reference reflection intensity\n", n_ihR);
 			if ( n_red ) ERROR("%i reference reflection redundancy\n", n_red);
@@ -295,26 +306,15 @@ int scale_one_crystal(const RefList *listS, Crystal *cr,
 			if ( n_part ) ERROR("%i subject reflection partiality\n", n_part);
 			if ( n_nom ) ERROR("%i no match in reference list\n", n_nom);
 		}
-		free(x);
-		free(y);
-		free(w);
 		return 1;
 	}
 
 	if ( flags & SCALE_NO_B ) {
-		G = gsl_stats_wmean(w, 1, y, 1, n);
+		G = my;
 		B = 0.0;
-		r = 0;
 	} else {
-		r = gsl_fit_wlinear(x, 1, w, 1, y, 1, n, &G, &B, &cov00, &cov01, &cov11, &chisq);
-	}
-
-	if ( r ) {
-		ERROR("Scaling failed.\n");
-		free(x);
-		free(y);
-		free(w);
-		return 1;
+		B = sxy / sxx;
+		G = my - B*mx;
 	}
 
 	if ( isnan(G) ) {
@@ -322,25 +322,36 @@ int scale_one_crystal(const RefList *listS, Crystal *cr,
 		if ( flags & SCALE_VERBOSE_ERRORS ) {
 			ERROR("Scaling gave NaN (%i pairs)\n", n);
 			if ( n < 10 ) {
-				int i;
 				for ( i=0; i<n; i++ ) {
-					STATUS("%3i %e %e %e\n", i, x[i], y[i], w[i]);
+					int k = used[i];
+					STATUS("%3i %e %e %e\n", i, j->s2[k],
+					       -j->logterm[k], j->p[k]);
 				}
 			}
 		}
 
-		free(x);
-		free(y);
-		free(w);
 		return 1;
 	}
 
 	crystal_set_osf(cr, exp(G));
 	crystal_set_Bfac(cr, -B);
 
-	free(x);
-	free(y);
-	free(w);
-
 	return 0;
 }
+
+
+int scale_one_crystal(RefList *listS, Crystal *cr,
+                      const RefList *listR, int flags)
+{
+	struct joined_refls j;
+
+	assert(crystal_get_cell(cr) != NULL);
+	assert(listR != NULL);
+	assert(listS != NULL);
+
+	if ( join_crystal_refls(listS, cr, listR, &j) ) {
+		ERROR("Failed to allocate memory for scaling.\n");
+		return 1;
+	}
+	return scale_joined(&j, cr, flags);
+}
@@ -37,6 +37,7 @@
 
 #include "crystal.h"
 #include "geometry.h"
+#include "merge.h"
 
 enum ScaleFlags
 {
@@ -45,7 +46,9 @@ enum ScaleFlags
 	SCALE_VERBOSE_ERRORS = 1<<1,
 };
 
-extern int scale_one_crystal(const RefList *listS, Crystal *cr,
+extern int scale_joined(const struct joined_refls *j, Crystal *cr, int flags);
+
+extern int scale_one_crystal(RefList *listS, Crystal *cr,
                              const RefList *reference, int flags);
 
 extern void scale_all(struct crystal_refls *crystals, int n_crystals,
@@ -0,0 +1,1296 @@
+/*
+ * sim_frames.c
+ *
+ * Generate synthetic frames for load testing
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include <gsl/gsl_rng.h>
+
+#include <image.h>
+#include <utils.h>
+#include <cell.h>
+#include <cell-utils.h>
+#include <crystal.h>
+#include <geometry.h>
+#include <reflist.h>
+#include <datatemplate.h>
+#include <detgeom.h>
+#include <thread-pool.h>
+
+#ifdef HAVE_HDF5
+#include <hdf5.h>
+#endif
+
+#if defined(HAVE_ZMQ) && defined(HAVE_MSGPACK)
+#include <zmq.h>
+#include <msgpack.h>
+#endif
+
+#include "version.h"
+
+#include "datatemplate_priv.h"
+
+
+static void show_syntax(const char *s)
+{
+	printf("Syntax: %s -g <geometry> [-p <cell>] [options]\n", s);
+}
+
+
+static void show_help(const char *s)
+{
+	show_syntax(s);
+	printf("\nGenerate synthetic frames for load testing.\n"
+	       "\n"
+	       "  -g, --geometry=file        Detector geometry file\n"
+	       "  -p, --pdb=file             Unit cell file (needed for hits)\n"
+	       "  -n, --frames=n             Number of frames (default 100)\n"
+	       "  -o, --output=prefix        Write files called prefix-NNNNNN.h5\n"
+	       "      --cbf                  Write CBF files instead of HDF5\n"
+	       "      --frames-per-file=n    Frames in each HDF5 file (default 1)\n"
+	       "  -l, --list=file            Write a list of the frames to file\n"
+	       "      --zmq-output=addr      Send frames to ZeroMQ socket at addr\n"
+	       "      --zmq-pub              Publish the frames, instead of PUSH\n"
+	       "      --rate=hz              Target frame rate (default: maximum)\n"
+	       "      --hit-rate=f           Fraction of frames with crystals\n"
+	       "                              (default 0.1)\n"
+	       "      --crystals=n           Up to n crystals per hit (default 1)\n"
+	       "      --background=n         Mean background, photons per pixel\n"
+	       "                              (default 1)\n"
+	       "      --intensity=n          Mean photons in a full reflection\n"
+	       "                              (default 1000)\n"
+	       "      --spot-size=px         Width (sigma) of spots (default 0.7)\n"
+	       "      --profile-radius=r     Reflection radius, nm^-1 (default\n"
+	       "                              0.005)\n"
+	       "      --highres=d            Resolution limit, Angstroms\n"
+	       "      --seed=n               Random number seed (default 1)\n"
+	       "  -j n                       Generate frames using n threads\n"
+	       "\n"
+	       "  -h, --help                 Display this help message\n"
+	       "      --version              Print CrystFEL version number and exit\n");
+}
+
+
+#ifdef HAVE_CLOCK_GETTIME
+
+static double get_time()
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+}
+
+#else
+
+#include <sys/time.h>
+
+static double get_time()
+{
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return tp.tv_sec + tp.tv_usec*1e-6;
+}
+
+#endif
+
+
+struct sim_params
+{
+	double hit_rate;
+	int max_crystals;
+	double background;     /* Photons per pixel */
+	double intensity;      /* Photons in a fully recorded reflection */
+	double spot_size;      /* Pixels */
+	double profile_radius; /* m^-1 */
+	double highres;        /* m^-1 */
+};
+
+
+struct sim_args;
+
+
+/* A frame, rendered into the layout of the data array in the file */
+struct sim_frame
+{
+	struct sim_args *args;
+	float *slab;
+	int hit;
+	int n_crystals;
+};
+
+
+struct sim_output
+{
+	const DataTemplate *dtempl;
+	int w;  /* Size of data slab */
+	int h;
+
+	const char *prefix;
+	int cbf;
+	int frames_per_file;
+	int stacked;   /* Data has a placeholder dimension for the frame */
+	int n_files;
+	int frame_in_file;
+	char *filename;
+	FILE *list;
+
+#ifdef HAVE_HDF5
+	hid_t fh;
+	hid_t dh;
+#endif
+
+#if defined(HAVE_ZMQ) && defined(HAVE_MSGPACK)
+	void *zmq_ctx;
+	void *zmq_socket;
+	msgpack_sbuffer sbuf;
+#endif
+};
+
+
+struct sim_args
+{
+	const DataTemplate *dtempl;
+	const struct sim_params *params;
+	UnitCell *cell;
+	int n_frames;
+
+	/* One of each for each thread */
+	struct image **images;
+	gsl_rng **rngs;
+
+	/* Poisson-distributed background, in photons.  Each frame takes its
+	 * background from a randomly chosen stretch of this, which is twice
+	 * as long as the detector has pixels. */
+	float *bg_pool;
+	size_t n_pixels;
+
+	struct sim_output *out;
+	double rate;
+	double t_start;
+	double t_last_report;
+	int n_started;
+	int n_done;
+	int n_hits;
+	int n_done_last_report;
+	int fail;
+};
+
+
+/* A pseudo-random number in [0,1) for each set of indices, so that the
+ * intensities are the same in every frame */
+static double hkl_random(signed int h, signed int k, signed int l)
+{
+	uint64_t x;
+
+	x = (uint64_t)(h & 0xfffff) | ((uint64_t)(k & 0xfffff) << 20)
+	    | ((uint64_t)(l & 0xfffff) << 40);
+
+	/* splitmix64 finaliser */
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	x = x ^ (x >> 31);
+
+	return (x >> 11) * (1.0/9007199254740992.0);
+}
+
+
+static void add_spot(struct image *image, int pn, double fs, double ss,
+                     double photons, double sigma, gsl_rng *rng)
+{
+	struct detgeom_panel *p = &image->detgeom->panels[pn];
+	int r = ceil(3.0*sigma);
+	int ifs, iss;
+	int cfs = fs;
+	int css = ss;
+	double norm = 1.0/(2.0*M_PI*sigma*sigma);
+
+	for ( iss=css-r; iss<=css+r; iss++ ) {
+	for ( ifs=cfs-r; ifs<=cfs+r; ifs++ ) {
+
+		double dfs, dss, mean;
+
+		if ( (ifs < 0) || (ifs >= p->w) ) continue;
+		if ( (iss < 0) || (iss >= p->h) ) continue;
+
+		/* Distance from the middle of the pixel */
+		dfs = ifs + 0.5 - fs;
+		dss = iss + 0.5 - ss;
+		mean = photons * norm
+		       * exp(-(dfs*dfs + dss*dss)/(2.0*sigma*sigma));
+		if ( mean < 0.01 ) continue;
+
+		image->dp[pn][ifs + p->w*iss] += poisson_noise(rng, mean)
+		                                 * p->adu_per_photon;
+
+	}
+	}
+}
+
+
+static void add_crystal(struct image *image, const struct sim_params *params,
+                        UnitCell *cell, gsl_rng *rng)
+{
+	Crystal *cr;
+	RefList *list;
+	Reflection *refl;
+	RefListIterator *iter;
+
+	cr = crystal_new();
+	if ( cr == NULL ) return;
+	crystal_set_cell(cr, cell_rotate(cell, random_quaternion(rng)));
+	crystal_set_profile_radius(cr, params->profile_radius);
+	crystal_set_mosaicity(cr, 0.0);
+
+	list = predict_to_res(cr, image, params->highres);
+	if ( list == NULL ) {
+		crystal_free(cr);
+		return;
+	}
+	calculate_partialities(list, cr, image, PMODEL_XSPHERE);
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		double fs, ss;
+		signed int h, k, l;
+		double wilson;
+
+		get_indices(refl, &h, &k, &l);
+		get_detector_pos(refl, &fs, &ss);
+
+		/* Exponential distribution of intensities (Wilson
+		 * statistics for an acentric reflection) */
+		wilson = -log(1.0 - hkl_random(h, k, l));
+
+		add_spot(image, get_panel_number(refl), fs, ss,
+		         params->intensity * get_partiality(refl) * wilson,
+		         params->spot_size, rng);
+	}
+
+	reflist_free(list);
+	crystal_free(cr);
+}
+
+
+/* Copies the panel data into the layout of the data array in the file */
+static void image_to_slab(const DataTemplate *dtempl, struct image *image,
+                          float *slab, int w)
+{
+	int pn;
+
+	for ( pn=0; pn<dtempl->n_panels; pn++ ) {
+
+		struct panel_template *p = &dtempl->panels[pn];
+		int ss;
+
+		for ( ss=0; ss<PANEL_HEIGHT(p); ss++ ) {
+			size_t idx = p->orig_min_fs
+			             + (size_t)w*(p->orig_min_ss + ss);
+			memcpy(&slab[idx], &image->dp[pn][ss*PANEL_WIDTH(p)],
+			       PANEL_WIDTH(p)*sizeof(float));
+		}
+
+	}
+}
+
+
+static void *get_frame(void *vp)
+{
+	struct sim_args *args = vp;
+	struct sim_frame *frame;
+
+	if ( args->fail ) return NULL;
+	if ( args->n_started >= args->n_frames ) return NULL;
+
+	frame = cfmalloc(sizeof(struct sim_frame));
+	if ( frame == NULL ) return NULL;
+	frame->args = args;
+	frame->slab = NULL;
+	args->n_started++;
+
+	return frame;
+}
+
+
+static void make_frame(void *vp, int cookie)
+{
+	struct sim_frame *frame = vp;
+	struct sim_args *args = frame->args;
+	const struct sim_params *params = args->params;
+	struct image *image = args->images[cookie];
+	gsl_rng *rng = args->rngs[cookie];
+	size_t offs;
+	int pn;
+	int i;
+
+	/* Background and noise */
+	offs = gsl_rng_uniform_int(rng, args->n_pixels);
+	for ( pn=0; pn<image->detgeom->n_panels; pn++ ) {
+		struct detgeom_panel *p = &image->detgeom->panels[pn];
+		long int j;
+		for ( j=0; j<p->w*p->h; j++ ) {
+			image->dp[pn][j] = args->bg_pool[offs++]
+			                   * p->adu_per_photon;
+		}
+	}
+
+	frame->hit = gsl_rng_uniform(rng) < params->hit_rate;
+	frame->n_crystals = 0;
+	if ( frame->hit ) {
+		frame->n_crystals = 1 + gsl_rng_uniform_int(rng,
+		                                            params->max_crystals);
+		for ( i=0; i<frame->n_crystals; i++ ) {
+			add_crystal(image, params, args->cell, rng);
+		}
+	}
+
+	frame->slab = cfmalloc((size_t)args->out->w*args->out->h
+	                       * sizeof(float));
+	if ( frame->slab == NULL ) return;
+	image_to_slab(args->dtempl, image, frame->slab, args->out->w);
+}
+
+
+#ifdef HAVE_HDF5
+
+static void close_hdf5(struct sim_output *out)
+{
+	if ( out->fh < 0 ) return;
+	H5Dclose(out->dh);
+	H5Fclose(out->fh);
+	out->fh = -1;
+}
+
+
+/* Creates all the groups leading up to the dataset */
+static int make_parent_groups(hid_t fh, const char *path)
+{
+	char *tmp = cfstrdup(path);
+	char *sl;
+
+	if ( tmp == NULL ) return 1;
+
+	for ( sl = strchr(tmp+1, '/'); sl != NULL; sl = strchr(sl+1, '/') ) {
+
+		hid_t gh;
+
+		*sl = '\0';
+		if ( H5Lexists(fh, tmp, H5P_DEFAULT) <= 0 ) {
+			gh = H5Gcreate2(fh, tmp, H5P_DEFAULT, H5P_DEFAULT,
+			                H5P_DEFAULT);
+			if ( gh < 0 ) {
+				ERROR("Couldn't create group '%s'\n", tmp);
+				cffree(tmp);
+				return 1;
+			}
+			H5Gclose(gh);
+		}
+		*sl = '/';
+
+	}
+
+	cffree(tmp);
+	return 0;
+}
+
+
+static int open_hdf5(struct sim_output *out)
+{
+	const char *path = out->dtempl->panels[0].data;
+	hsize_t dims[3], max_dims[3], chunk[3];
+	int nd;
+	hid_t sh, dcpl;
+
+	out->fh = H5Fcreate(out->filename, H5F_ACC_TRUNC, H5P_DEFAULT,
+	                    H5P_DEFAULT);
+	if ( out->fh < 0 ) {
+		ERROR("Couldn't create '%s'\n", out->filename);
+		return 1;
+	}
+
+	if ( make_parent_groups(out->fh, path) ) {
+		H5Fclose(out->fh);
+		out->fh = -1;
+		return 1;
+	}
+
+	if ( out->stacked ) {
+		nd = 3;
+		dims[0] = 0;
+		max_dims[0] = H5S_UNLIMITED;
+		chunk[0] = 1;
+	} else {
+		nd = 2;
+	}
+	dims[nd-2] = out->h;
+	dims[nd-1] = out->w;
+	max_dims[nd-2] = out->h;
+	max_dims[nd-1] = out->w;
+	chunk[nd-2] = out->h;
+	chunk[nd-1] = out->w;
+
+	sh = H5Screate_simple(nd, dims, max_dims);
+	dcpl = H5Pcreate(H5P_DATASET_CREATE);
+	H5Pset_chunk(dcpl, nd, chunk);
+	out->dh = H5Dcreate2(out->fh, path, H5T_NATIVE_FLOAT, sh,
+	                     H5P_DEFAULT, dcpl, H5P_DEFAULT);
+	H5Pclose(dcpl);
+	H5Sclose(sh);
+	if ( out->dh < 0 ) {
+		ERROR("Couldn't create dataset '%s'\n", path);
+		H5Fclose(out->fh);
+		out->fh = -1;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static int write_hdf5(struct sim_output *out, const float *slab)
+{
+	hsize_t start[3], count[3], size[3];
+	hid_t sh, msh;
+	herr_t r;
+
+	if ( !out->stacked ) {
+		r = H5Dwrite(out->dh, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL,
+		             H5P_DEFAULT, slab);
+		return r < 0;
+	}
+
+	size[0] = out->frame_in_file + 1;
+	size[1] = out->h;
+	size[2] = out->w;
+	if ( H5Dset_extent(out->dh, size) < 0 ) return 1;
+
+	start[0] = out->frame_in_file;
+	start[1] = 0;
+	start[2] = 0;
+	count[0] = 1;
+	count[1] = out->h;
+	count[2] = out->w;
+	sh = H5Dget_space(out->dh);
+	H5Sselect_hyperslab(sh, H5S_SELECT_SET, start, NULL, count, NULL);
+	msh = H5Screate_simple(3, count, NULL);
+	r = H5Dwrite(out->dh, H5T_NATIVE_FLOAT, msh, sh, H5P_DEFAULT, slab);
+	H5Sclose(msh);
+	H5Sclose(sh);
+
+	return r < 0;
+}
+
+#else /* HAVE_HDF5 */
+
+static void close_hdf5(struct sim_output *out)
+{
+}
+
+static int open_hdf5(struct sim_output *out)
+{
+	ERROR("This installation of CrystFEL can't write HDF5 files.\n");
+	return 1;
+}
+
+static int write_hdf5(struct sim_output *out, const float *slab)
+{
+	return 1;
+}
+
+#endif /* HAVE_HDF5 */
+
+
+/* Byte offset compression, as in section 2.3.3.6 of International Tables
+ * volume G */
+static size_t cbf_byte_offset(const int32_t *vals, size_t n, uint8_t *out)
+{
+	size_t i;
+	size_t pos = 0;
+	int32_t prev = 0;
+
+	for ( i=0; i<n; i++ ) {
+
+		int64_t delta = (int64_t)vals[i] - prev;
+		prev = vals[i];
+
+		if ( (delta > -128) && (delta < 128) ) {
+			out[pos++] = (uint8_t)(int8_t)delta;
+		} else if ( (delta > -32768) && (delta < 32768) ) {
+			out[pos++] = 0x80;
+			out[pos++] = delta & 0xff;
+			out[pos++] = (delta >> 8) & 0xff;
+		} else {
+			out[pos++] = 0x80;
+			out[pos++] = 0x00;
+			out[pos++] = 0x80;
+			out[pos++] = delta & 0xff;
+			out[pos++] = (delta >> 8) & 0xff;
+			out[pos++] = (delta >> 16) & 0xff;
+			out[pos++] = (delta >> 24) & 0xff;
+		}
+
+	}
+
+	return pos;
+}
+
+
+static int write_cbf(struct sim_output *out, const float *slab)
+{
+	size_t n = (size_t)out->w*out->h;
+	int32_t *vals;
+	uint8_t *comp;
+	size_t len, i;
+	FILE *fh;
+	int r = 0;
+
+	vals = cfmalloc(n*sizeof(int32_t));
+	comp = cfmalloc(n*7);
+	if ( (vals == NULL) || (comp == NULL) ) {
+		cffree(vals);
+		cffree(comp);
+		return 1;
+	}
+
+	for ( i=0; i<n; i++ ) vals[i] = lrintf(slab[i]);
+	len = cbf_byte_offset(vals, n, comp);
+	cffree(vals);
+
+	fh = fopen(out->filename, "wb");
+	if ( fh == NULL ) {
+		ERROR("Couldn't create '%s'\n", out->filename);
+		cffree(comp);
+		return 1;
+	}
+
+	fprintf(fh, "###CBF: VERSION 1.5\n"
+	            "# Synthetic frame generated by CrystFEL sim_frames\n"
+	            "\n"
+	            "data_sim_frames\n"
+	            "\n"
+	            "_array_data.data\n"
+	            ";\n"
+	            "--CIF-BINARY-FORMAT-SECTION--\n"
+	            "Content-Type: application/octet-stream;\n"
+	            "     conversions=\"x-CBF_BYTE_OFFSET\"\n"
+	            "Content-Transfer-Encoding: BINARY\n"
+	            "X-Binary-Size: %zu\n"
+	            "X-Binary-ID: 1\n"
+	            "X-Binary-Element-Type: \"signed 32-bit integer\"\n"
+	            "X-Binary-Element-Byte-Order: LITTLE_ENDIAN\n"
+	            "X-Binary-Number-of-Elements: %zu\n"
+	            "X-Binary-Size-Fastest-Dimension: %i\n"
+	            "X-Binary-Size-Second-Dimension: %i\n"
+	            "X-Binary-Size-Padding: 0\n"
+	            "\n"
+	            "\x0c\x1a\x04\xd5", len, n, out->w, out->h);
+	if ( fwrite(comp, 1, len, fh) != len ) r = 1;
+	fprintf(fh, "\n--CIF-BINARY-FORMAT-SECTION----\n;\n");
+	if ( fclose(fh) ) r = 1;
+
+	cffree(comp);
+	if ( r ) ERROR("Failed to write '%s'\n", out->filename);
+	return r;
+}
+
+
+#if defined(HAVE_ZMQ) && defined(HAVE_MSGPACK)
+
+static void pack_key(msgpack_packer *pk, const char *key)
+{
+	size_t len = strlen(key);
+	msgpack_pack_str(pk, len);
+	msgpack_pack_str_body(pk, key, len);
+}
+
+
+/* The layout which image_msgpack_read() expects */
+static int send_zmq(struct sim_output *out, struct sim_frame *frame)
+{
+	msgpack_packer pk;
+	size_t size = (size_t)out->w*out->h*sizeof(float);
+
+	msgpack_sbuffer_clear(&out->sbuf);
+	msgpack_packer_init(&pk, &out->sbuf, msgpack_sbuffer_write);
+
+	msgpack_pack_map(&pk, 3);
+	pack_key(&pk, out->dtempl->panels[0].data);
+	msgpack_pack_map(&pk, 3);
+	pack_key(&pk, "type");
+	msgpack_pack_str(&pk, 3);
+	msgpack_pack_str_body(&pk, "<f4", 3);
+	pack_key(&pk, "shape");
+	msgpack_pack_array(&pk, 2);
+	msgpack_pack_int(&pk, out->h);
+	msgpack_pack_int(&pk, out->w);
+	pack_key(&pk, "data");
+	msgpack_pack_bin(&pk, size);
+	msgpack_pack_bin_body(&pk, frame->slab, size);
+	pack_key(&pk, "hit");
+	msgpack_pack_int(&pk, frame->hit);
+	pack_key(&pk, "n_crystals");
+	msgpack_pack_int(&pk, frame->n_crystals);
+
+	/* Unlike indexamajig's output, wait for the receiver: the point is
+	 * to find out how fast it can go */
+	if ( zmq_send(out->zmq_socket, out->sbuf.data, out->sbuf.size, 0) == -1 ) {
+		ERROR("ZMQ send failed: %s\n", zmq_strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static int open_zmq(struct sim_output *out, const char *addr, int pub)
+{
+	out->zmq_ctx = zmq_ctx_new();
+	if ( out->zmq_ctx == NULL ) return 1;
+
+	out->zmq_socket = zmq_socket(out->zmq_ctx, pub ? ZMQ_PUB : ZMQ_PUSH);
+	if ( out->zmq_socket == NULL ) {
+		zmq_ctx_destroy(out->zmq_ctx);
+		out->zmq_ctx = NULL;
+		return 1;
+	}
+
+	/* indexamajig connects to us */
+	STATUS("Binding ZMQ %s socket to '%s'\n", pub ? "PUB" : "PUSH", addr);
+	if ( zmq_bind(out->zmq_socket, addr) == -1 ) {
+		ERROR("ZMQ bind failed: %s\n", zmq_strerror(errno));
+		zmq_close(out->zmq_socket);
+		zmq_ctx_destroy(out->zmq_ctx);
+		out->zmq_ctx = NULL;
+		return 1;
+	}
+
+	msgpack_sbuffer_init(&out->sbuf);
+	return 0;
+}
+
+
+static void close_zmq(struct sim_output *out)
+{
+	if ( out->zmq_ctx == NULL ) return;
+	msgpack_sbuffer_destroy(&out->sbuf);
+	zmq_close(out->zmq_socket);
+	zmq_ctx_destroy(out->zmq_ctx);
+}
+
+#else /* defined(HAVE_ZMQ) && defined(HAVE_MSGPACK) */
+
+static int send_zmq(struct sim_output *out, struct sim_frame *frame)
+{
+	return 1;
+}
+
+static int open_zmq(struct sim_output *out, const char *addr, int pub)
+{
+	ERROR("This installation of CrystFEL can't send frames over ZMQ.\n");
+	return 1;
+}
+
+static void close_zmq(struct sim_output *out)
+{
+}
+
+#endif /* defined(HAVE_ZMQ) && defined(HAVE_MSGPACK) */
+
+
+static int using_zmq(struct sim_output *out)
+{
+#if defined(HAVE_ZMQ) && defined(HAVE_MSGPACK)
+	return out->zmq_ctx != NULL;
+#else
+	return 0;
+#endif
+}
+
+
+static int write_frame(struct sim_output *out, struct sim_frame *frame)
+{
+	if ( using_zmq(out) && send_zmq(out, frame) ) return 1;
+
+	if ( out->prefix == NULL ) return 0;
+
+	if ( out->cbf ) {
+		snprintf(out->filename, strlen(out->prefix)+32, "%s-%06i.cbf",
+		         out->prefix, out->n_files++);
+		if ( write_cbf(out, frame->slab) ) return 1;
+		if ( out->list != NULL ) fprintf(out->list, "%s\n", out->filename);
+		return 0;
+	}
+
+	if ( out->frame_in_file == 0 ) {
+		snprintf(out->filename, strlen(out->prefix)+32, "%s-%06i.h5",
+		         out->prefix, out->n_files++);
+		if ( open_hdf5(out) ) return 1;
+	}
+
+	if ( write_hdf5(out, frame->slab) ) {
+		ERROR("Failed to write frame to '%s'\n", out->filename);
+		return 1;
+	}
+
+	if ( out->list != NULL ) {
+		if ( out->stacked ) {
+			fprintf(out->list, "%s //%i\n", out->filename,
+			        out->frame_in_file);
+		} else {
+			fprintf(out->list, "%s\n", out->filename);
+		}
+	}
+
+	if ( ++out->frame_in_file == out->frames_per_file ) {
+		close_hdf5(out);
+		out->frame_in_file = 0;
+	}
+
+	return 0;
+}
+
+
+/* Called with the queue lock held, so only one frame is written at a time,
+ * and it's safe to use HDF5 and ZeroMQ from here */
+static void finish_frame(void *vp, void *vf)
+{
+	struct sim_args *args = vp;
+	struct sim_frame *frame = vf;
+	double now;
+
+	if ( frame->slab == NULL ) {
+		ERROR("Failed to generate frame\n");
+		args->fail = 1;
+		cffree(frame);
+		return;
+	}
+
+	/* Hold back the frame until its time */
+	if ( args->rate > 0.0 ) {
+		double due = args->t_start + args->n_done/args->rate;
+		double wait = due - get_time();
+		if ( wait > 0.0 ) {
+			struct timespec ts;
+			ts.tv_sec = wait;
+			ts.tv_nsec = (wait - ts.tv_sec)*1e9;
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	if ( write_frame(args->out, frame) ) args->fail = 1;
+	args->n_done++;
+	if ( frame->hit ) args->n_hits++;
+
+	now = get_time();
+	if ( now - args->t_last_report > 5.0 ) {
+		STATUS("%i frames written (%i hits), %.1f frames/sec\n",
+		       args->n_done, args->n_hits,
+		       (args->n_done - args->n_done_last_report)
+		        / (now - args->t_last_report));
+		args->t_last_report = now;
+		args->n_done_last_report = args->n_done;
+	}
+
+	cffree(frame->slab);
+	cffree(frame);
+}
+
+
+/* Every panel must come from the same 2D array in the file, possibly with a
+ * placeholder dimension for the frame number */
+static int check_data_layout(const DataTemplate *dtempl, int *pstacked)
+{
+	int i, j;
+	int stacked = -1;
+
+	for ( i=0; i<dtempl->n_panels; i++ ) {
+
+		struct panel_template *p = &dtempl->panels[i];
+		int nd = 0;
+		int this_stacked;
+
+		if ( (p->data == NULL) || (strchr(p->data, '%') != NULL) ) {
+			ERROR("The data locations in the geometry file must "
+			      "not contain placeholders.\n");
+			return 1;
+		}
+		if ( strcmp(p->data, dtempl->panels[0].data) != 0 ) {
+			ERROR("All panels must be in the same data array.\n");
+			return 1;
+		}
+
+		for ( j=0; j<MAX_DIMS; j++ ) {
+			if ( p->dims[j] == DIM_UNDEFINED ) break;
+			nd++;
+		}
+
+		if ( (nd == 2) && (p->dims[0] == DIM_SS)
+		  && (p->dims[1] == DIM_FS) )
+		{
+			this_stacked = 0;
+		} else if ( (nd == 3) && (p->dims[0] == DIM_PLACEHOLDER)
+		         && (p->dims[1] == DIM_SS) && (p->dims[2] == DIM_FS) )
+		{
+			this_stacked = 1;
+		} else {
+			ERROR("The data array dimensions must be either "
+			      "'ss, fs' or '%%, ss, fs'.\n");
+			return 1;
+		}
+
+		if ( (stacked != -1) && (this_stacked != stacked) ) {
+			ERROR("All panels must have the same dimensions.\n");
+			return 1;
+		}
+		stacked = this_stacked;
+
+	}
+
+	*pstacked = stacked;
+	return 0;
+}
+
+
+/* Like data_template_get_slab_extents(), but allowing a placeholder
+ * dimension */
+static void get_slab_extents(const DataTemplate *dtempl, int *pw, int *ph)
+{
+	int i;
+	int w = 0;
+	int h = 0;
+
+	for ( i=0; i<dtempl->n_panels; i++ ) {
+		struct panel_template *p = &dtempl->panels[i];
+		if ( p->orig_max_fs > w ) w = p->orig_max_fs;
+		if ( p->orig_max_ss > h ) h = p->orig_max_ss;
+	}
+
+	*pw = w + 1;
+	*ph = h + 1;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c;
+	char *geom_file = NULL;
+	char *cell_file = NULL;
+	char *list_file = NULL;
+	char *zmq_addr = NULL;
+	int zmq_pub = 0;
+	int n_threads = 1;
+	unsigned long int seed = 1;
+	double highres = 0.0;
+	struct sim_params params;
+	struct sim_output out;
+	struct sim_args args;
+	DataTemplate *dtempl;
+	struct image *image;
+	gsl_rng *rng;
+	double t_end;
+	size_t j;
+	int i;
+
+	params.hit_rate = 0.1;
+	params.max_crystals = 1;
+	params.background = 1.0;
+	params.intensity = 1000.0;
+	params.spot_size = 0.7;
+	params.profile_radius = 0.005e9;
+
+	out.prefix = NULL;
+	out.cbf = 0;
+	out.frames_per_file = 1;
+	out.n_files = 0;
+	out.frame_in_file = 0;
+	out.filename = NULL;
+	out.list = NULL;
+#ifdef HAVE_HDF5
+	out.fh = -1;
+#endif
+#if defined(HAVE_ZMQ) && defined(HAVE_MSGPACK)
+	out.zmq_ctx = NULL;
+#endif
+
+	args.n_frames = 100;
+	args.rate = 0.0;
+
+	const struct option longopts[] = {
+		{"help",               0, NULL,               'h'},
+		{"version",            0, NULL,                2 },
+		{"geometry",           1, NULL,               'g'},
+		{"pdb",                1, NULL,               'p'},
+		{"frames",             1, NULL,               'n'},
+		{"output",             1, NULL,               'o'},
+		{"list",               1, NULL,               'l'},
+		{"cbf",                0, NULL,                3 },
+		{"frames-per-file",    1, NULL,                4 },
+		{"zmq-output",         1, NULL,                5 },
+		{"zmq-pub",            0, NULL,                6 },
+		{"rate",               1, NULL,                7 },
+		{"hit-rate",           1, NULL,                8 },
+		{"crystals",           1, NULL,                9 },
+		{"background",         1, NULL,               10 },
+		{"intensity",          1, NULL,               11 },
+		{"spot-size",          1, NULL,               12 },
+		{"profile-radius",     1, NULL,               13 },
+		{"highres",            1, NULL,               14 },
+		{"seed",               1, NULL,               15 },
+		{0, 0, NULL, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "hg:p:n:o:l:j:",
+	                        longopts, NULL)) != -1) {
+
+		switch (c) {
+
+			case 'h' :
+			show_help(argv[0]);
+			return 0;
+
+			case 2 :
+			printf("CrystFEL: %s\n", crystfel_version_string());
+			printf("%s\n", crystfel_licence_string());
+			return 0;
+
+			case 'g' :
+			geom_file = strdup(optarg);
+			break;
+
+			case 'p' :
+			cell_file = strdup(optarg);
+			break;
+
+			case 'n' :
+			if ( (sscanf(optarg, "%d", &args.n_frames) != 1)
+			  || (args.n_frames < 1) )
+			{
+				ERROR("Invalid value for --frames\n");
+				return 1;
+			}
+			break;
+
+			case 'o' :
+			out.prefix = strdup(optarg);
+			break;
+
+			case 'l' :
+			list_file = strdup(optarg);
+			break;
+
+			case 'j' :
+			if ( (sscanf(optarg, "%d", &n_threads) != 1)
+			  || (n_threads < 1) )
+			{
+				ERROR("Invalid value for -j\n");
+				return 1;
+			}
+			break;
+
+			case 3 :
+			out.cbf = 1;
+			break;
+
+			case 4 :
+			if ( (sscanf(optarg, "%d", &out.frames_per_file) != 1)
+			  || (out.frames_per_file < 1) )
+			{
+				ERROR("Invalid value for --frames-per-file\n");
+				return 1;
+			}
+			break;
+
+			case 5 :
+			zmq_addr = strdup(optarg);
+			break;
+
+			case 6 :
+			zmq_pub = 1;
+			break;
+
+			case 7 :
+			if ( (sscanf(optarg, "%lf", &args.rate) != 1)
+			  || (args.rate < 0.0) )
+			{
+				ERROR("Invalid value for --rate\n");
+				return 1;
+			}
+			break;
+
+			case 8 :
+			if ( (sscanf(optarg, "%lf", &params.hit_rate) != 1)
+			  || (params.hit_rate < 0.0) || (params.hit_rate > 1.0) )
+			{
+				ERROR("Invalid value for --hit-rate\n");
+				return 1;
+			}
+			break;
+
+			case 9 :
+			if ( (sscanf(optarg, "%d", &params.max_crystals) != 1)
+			  || (params.max_crystals < 1) )
+			{
+				ERROR("Invalid value for --crystals\n");
+				return 1;
+			}
+			break;
+
+			case 10 :
+			if ( (sscanf(optarg, "%lf", &params.background) != 1)
+			  || (params.background < 0.0) )
+			{
+				ERROR("Invalid value for --background\n");
+				return 1;
+			}
+			break;
+
+			case 11 :
+			if ( (sscanf(optarg, "%lf", &params.intensity) != 1)
+			  || (params.intensity < 0.0) )
+			{
+				ERROR("Invalid value for --intensity\n");
+				return 1;
+			}
+			break;
+
+			case 12 :
+			if ( (sscanf(optarg, "%lf", &params.spot_size) != 1)
+			  || (params.spot_size <= 0.0) )
+			{
+				ERROR("Invalid value for --spot-size\n");
+				return 1;
+			}
+			break;
+
+			case 13 :
+			if ( (sscanf(optarg, "%lf", &params.profile_radius) != 1)
+			  || (params.profile_radius <= 0.0) )
+			{
+				ERROR("Invalid value for --profile-radius\n");
+				return 1;
+			}
+			params.profile_radius *= 1e9;
+			break;
+
+			case 14 :
+			if ( (sscanf(optarg, "%lf", &highres) != 1)
+			  || (highres <= 0.0) )
+			{
+				ERROR("Invalid value for --highres\n");
+				return 1;
+			}
+			highres = 1.0 / (highres*1e-10);
+			break;
+
+			case 15 :
+			if ( sscanf(optarg, "%lu", &seed) != 1 ) {
+				ERROR("Invalid value for --seed\n");
+				return 1;
+			}
+			break;
+
+			case 0 :
+			break;
+
+			case '?' :
+			break;
+
+			default :
+			ERROR("Unhandled option '%c'\n", c);
+			break;
+
+		}
+
+	}
+
+	if ( geom_file == NULL ) {
+		ERROR("You must specify the geometry file (-g).\n");
+		return 1;
+	}
+
+	if ( (out.prefix == NULL) && (zmq_addr == NULL) ) {
+		ERROR("You must give --output and/or --zmq-output.\n");
+		return 1;
+	}
+
+	if ( (list_file != NULL) && (out.prefix == NULL) ) {
+		ERROR("--list only makes sense with --output.\n");
+		return 1;
+	}
+
+	if ( out.cbf && (out.frames_per_file > 1) ) {
+		ERROR("Only one frame can be written to each CBF file.\n");
+		return 1;
+	}
+
+	if ( (cell_file == NULL) && (params.hit_rate > 0.0) ) {
+		ERROR("You must give a unit cell (-p), or --hit-rate=0.\n");
+		return 1;
+	}
+
+	dtempl = data_template_new_from_file(geom_file);
+	if ( dtempl == NULL ) {
+		ERROR("Failed to read geometry from '%s'\n", geom_file);
+		return 1;
+	}
+	free(geom_file);
+
+	if ( check_data_layout(dtempl, &out.stacked) ) return 1;
+	if ( !out.stacked && (out.frames_per_file > 1) && !out.cbf ) {
+		ERROR("To put several frames in each file, the geometry file "
+		      "needs a placeholder dimension (dim0 = %%).\n");
+		return 1;
+	}
+
+	get_slab_extents(dtempl, &out.w, &out.h);
+	out.dtempl = dtempl;
+
+	if ( cell_file != NULL ) {
+		args.cell = load_cell_from_file(cell_file);
+		if ( args.cell == NULL ) {
+			ERROR("Failed to load cell from '%s'\n", cell_file);
+			return 1;
+		}
+		free(cell_file);
+	} else {
+		args.cell = NULL;
+	}
+
+	args.images = cfmalloc(n_threads*sizeof(struct image *));
+	args.rngs = cfmalloc(n_threads*sizeof(gsl_rng *));
+	if ( (args.images == NULL) || (args.rngs == NULL) ) {
+		ERROR("Failed to allocate memory\n");
+		return 1;
+	}
+
+	rng = gsl_rng_alloc(gsl_rng_mt19937);
+	gsl_rng_set(rng, seed);
+
+	for ( i=0; i<n_threads; i++ ) {
+		args.images[i] = image_create_for_simulation(dtempl);
+		if ( args.images[i] == NULL ) {
+			ERROR("Couldn't create image.  The geometry file must "
+			      "not refer to any values in image headers.\n");
+			return 1;
+		}
+		args.rngs[i] = gsl_rng_alloc(gsl_rng_mt19937);
+		gsl_rng_set(args.rngs[i], gsl_rng_get(rng));
+	}
+	image = args.images[0];
+
+	if ( highres > 0.0 ) {
+		params.highres = highres;
+	} else {
+		params.highres = detgeom_max_resolution(image->detgeom,
+		                                        image->lambda);
+	}
+	STATUS("Resolution limit: %.2f Angstroms\n",
+	       1e10/params.highres);
+
+	args.n_pixels = 0;
+	for ( i=0; i<image->detgeom->n_panels; i++ ) {
+		args.n_pixels += (size_t)image->detgeom->panels[i].w
+		                 * image->detgeom->panels[i].h;
+	}
+	args.bg_pool = cfmalloc(2*args.n_pixels*sizeof(float));
+	if ( args.bg_pool == NULL ) {
+		ERROR("Failed to allocate background\n");
+		return 1;
+	}
+	for ( j=0; j<2*args.n_pixels; j++ ) {
+		args.bg_pool[j] = poisson_noise(rng, params.background);
+	}
+
+	if ( out.prefix != NULL ) {
+		out.filename = cfmalloc(strlen(out.prefix)+32);
+		if ( out.filename == NULL ) return 1;
+	}
+
+	if ( list_file != NULL ) {
+		out.list = fopen(list_file, "w");
+		if ( out.list == NULL ) {
+			ERROR("Couldn't open '%s'\n", list_file);
+			return 1;
+		}
+		free(list_file);
+	}
+
+	if ( zmq_addr != NULL ) {
+		if ( open_zmq(&out, zmq_addr, zmq_pub) ) return 1;
+		free(zmq_addr);
+	}
+
+	args.dtempl = dtempl;
+	args.params = &params;
+	args.out = &out;
+	args.n_started = 0;
+	args.n_done = 0;
+	args.n_hits = 0;
+	args.n_done_last_report = 0;
+	args.fail = 0;
+	args.t_start = get_time();
+	args.t_last_report = args.t_start;
+
+	run_threads(n_threads, make_frame, get_frame, finish_frame,
+	            &args, 0, 0, 0, 0);
+
+	t_end = get_time();
+	STATUS("%i frames (%i hits) in %.1f seconds: %.1f frames/sec\n",
+	       args.n_done, args.n_hits, t_end - args.t_start,
+	       args.n_done / (t_end - args.t_start));
+
+	if ( out.prefix != NULL ) close_hdf5(&out);
+	close_zmq(&out);
+	if ( out.list != NULL ) fclose(out.list);
+
+	for ( i=0; i<n_threads; i++ ) {
+		image_free(args.images[i]);
+		gsl_rng_free(args.rngs[i]);
+	}
+	cffree(args.images);
+	cffree(args.rngs);
+	cffree(args.bg_pool);
+	cffree(out.filename);
+	cell_free(args.cell);
+	gsl_rng_free(rng);
+	data_template_free(dtempl);
+
+	return args.fail;
+}
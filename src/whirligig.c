@@ -46,6 +46,7 @@
 #include <integer_matrix.h>
 #include <reflist.h>
 #include <reflist-utils.h>
+#include <thread-pool.h>
 
 #include "version.h"
 
@@ -77,6 +78,27 @@ struct series_stats
 };
 
 
+/* One comparison between two cells, for the candidate joins which are
+ * checked in parallel */
+struct join_test
+{
+	UnitCell       *cell1;
+	UnitCell       *cell2;
+	const double   *tols;
+
+	/* Results */
+	int             match;
+	IntegerMatrix  *m;
+};
+
+
+struct join_queue
+{
+	struct join_test *tests;
+	int               n_started;
+};
+
+
 static void do_op(const IntegerMatrix *op,
                   signed int h, signed int k, signed int l,
                   signed int *he, signed int *ke, signed int *le)
@@ -294,13 +316,62 @@ static int crystal_used(struct window *win, int pos, int cn)
 }
 
 
+static void *get_join_test(void *vqargs)
+{
+	struct join_queue *q = vqargs;
+	return &q->tests[q->n_started++];
+}
+
+
+static void run_join_test(void *vtest, int cookie)
+{
+	struct join_test *t = vtest;
+	t->m = NULL;
+	t->match = compare_permuted_cell_parameters_and_orientation(t->cell1,
+	                                                            t->cell2,
+	                                                            t->tols,
+	                                                            &t->m);
+}
+
+
+/* Carry out all the comparisons in 'tests', using n_threads threads */
+static void run_join_tests(struct join_test *tests, int n_tests,
+                           int n_threads)
+{
+	struct join_queue q;
+	int i;
+
+	/* Make sure the Cartesian axes have been calculated, so that the
+	 * worker threads only read from the cells */
+	for ( i=0; i<n_tests; i++ ) {
+		double ax, ay, az, bx, by, bz, cx, cy, cz;
+		cell_get_cartesian(tests[i].cell1, &ax, &ay, &az,
+		                   &bx, &by, &bz, &cx, &cy, &cz);
+		cell_get_cartesian(tests[i].cell2, &ax, &ay, &az,
+		                   &bx, &by, &bz, &cx, &cy, &cz);
+	}
+
+	if ( (n_threads < 2) || (n_tests < 2) ) {
+		for ( i=0; i<n_tests; i++ ) run_join_test(&tests[i], 0);
+		return;
+	}
+
+	q.tests = tests;
+	q.n_started = 0;
+	run_threads(n_threads, run_join_test, get_join_test, NULL, &q,
+	            n_tests, 0, 0, 0);
+}
+
+
 static IntegerMatrix *try_all(struct window *win, int n1, int n2,
-                              int *c1, int *c2)
+                              int *c1, int *c2, int n_threads)
 {
 	int i, j;
-	IntegerMatrix *m;
+	IntegerMatrix *m = NULL;
 	struct image *i1;
 	struct image *i2;
+	struct join_test *tests;
+	int n_tests = 0;
 	const double tols[] = {0.1, 0.1, 0.1,
 	                       deg2rad(5.0), deg2rad(5.0), deg2rad(5.0)};
 
@@ -312,26 +383,44 @@ static IntegerMatrix *try_all(struct window *win, int n1, int n2,
 	i1 = &win->img[n1];
 	i2 = &win->img[n2];
 
+	tests = malloc(i1->n_crystals*i2->n_crystals*sizeof(struct join_test));
+	if ( tests == NULL ) return NULL;
+
+	/* Crystals which are already part of a series can't be used */
 	for ( i=0; i<i1->n_crystals; i++ ) {
-	for ( j=0; j<i2->n_crystals; j++ ) {
+		if ( crystal_used(win, n1, i) ) continue;
+		for ( j=0; j<i2->n_crystals; j++ ) {
+			if ( crystal_used(win, n2, j) ) continue;
+			tests[n_tests].cell1 = crystal_get_cell(i1->crystals[i].cr);
+			tests[n_tests].cell2 = crystal_get_cell(i2->crystals[j].cr);
+			tests[n_tests].tols = tols;
+			n_tests++;
+		}
+	}
 
-		if ( compare_permuted_cell_parameters_and_orientation(crystal_get_cell(i1->crystals[i].cr),
-		                                                      crystal_get_cell(i2->crystals[j].cr),
-		                                                      tols, &m) )
-		{
-			if ( !crystal_used(win, n1, i)
-			  && !crystal_used(win, n2, j) )
-			{
-				*c1 = i;
-				*c2 = j;
-				return m;
+	run_join_tests(tests, n_tests, n_threads);
+
+	/* Take the first match, in the same order as before */
+	n_tests = 0;
+	for ( i=0; i<i1->n_crystals; i++ ) {
+		if ( crystal_used(win, n1, i) ) continue;
+		for ( j=0; j<i2->n_crystals; j++ ) {
+			if ( crystal_used(win, n2, j) ) continue;
+			if ( tests[n_tests].match ) {
+				if ( m == NULL ) {
+					*c1 = i;
+					*c2 = j;
+					m = tests[n_tests].m;
+				} else {
+					intmat_free(tests[n_tests].m);
+				}
 			}
+			n_tests++;
 		}
-
-	}
 	}
 
-	return NULL;
+	free(tests);
+	return m;
 }
 
 
@@ -364,41 +453,78 @@ static int find_available_series(struct window *win)
 }
 
 
-/* Try to fit p1 in with p2 */
-static int try_join(struct window *win, int sn)
+/* Try to join the crystals in the frame at join_ptr to each of the active
+ * series */
+static void try_join_all(struct window *win, int n_threads)
 {
-	int j;
-	Crystal *cr;
-	UnitCell *ref;
+	int sn;
+	struct join_test *tests;
+	UnitCell *ref[MAX_SER];
+	int n_tests = 0;
 	const int sp = win->join_ptr - 1;
+	const int n_cr = win->img[win->join_ptr].n_crystals;
 	const double tols[] = {0.1, 0.1, 0.1,
 	                       deg2rad(5.0), deg2rad(5.0), deg2rad(5.0)};
 
-	/* Get the appropriately transformed cell from the last crystal in this
-	 * series */
-	cr = win->img[sp].crystals[win->ser[sn][sp]].cr;
-	ref = cell_transform_intmat(crystal_get_cell(cr), win->mat[sn][sp]);
-
-	for ( j=0; j<win->img[win->join_ptr].n_crystals; j++ ) {
-		Crystal *cr2;
-		cr2 = win->img[win->join_ptr].crystals[j].cr;
-		if ( compare_permuted_cell_parameters_and_orientation(ref, crystal_get_cell(cr2),
-		                                                      tols,
-		                                                      &win->mat[sn][win->join_ptr]) )
-		{
-			win->ser[sn][win->join_ptr] = j;
-			cell_free(ref);
-			return 1;
+	tests = malloc(MAX_SER*n_cr*sizeof(struct join_test));
+	if ( tests == NULL ) return;
+
+	for ( sn=0; sn<MAX_SER; sn++ ) {
+
+		int j;
+		Crystal *cr;
+
+		ref[sn] = NULL;
+		if ( win->ser[sn][sp] == -1 ) continue;
+
+		/* Get the appropriately transformed cell from the last
+		 * crystal in this series */
+		cr = win->img[sp].crystals[win->ser[sn][sp]].cr;
+		ref[sn] = cell_transform_intmat(crystal_get_cell(cr),
+		                                win->mat[sn][sp]);
+
+		for ( j=0; j<n_cr; j++ ) {
+			Crystal *cr2 = win->img[win->join_ptr].crystals[j].cr;
+			tests[n_tests].cell1 = ref[sn];
+			tests[n_tests].cell2 = crystal_get_cell(cr2);
+			tests[n_tests].tols = tols;
+			n_tests++;
 		}
+
 	}
 
-	cell_free(ref);
+	run_join_tests(tests, n_tests, n_threads);
 
-	return 0;
+	/* Each series takes the first crystal which matches */
+	n_tests = 0;
+	for ( sn=0; sn<MAX_SER; sn++ ) {
+
+		int j;
+		int found = 0;
+
+		if ( ref[sn] == NULL ) continue;
+
+		for ( j=0; j<n_cr; j++ ) {
+			struct join_test *t = &tests[n_tests++];
+			if ( !t->match ) continue;
+			if ( !found ) {
+				win->ser[sn][win->join_ptr] = j;
+				win->mat[sn][win->join_ptr] = t->m;
+				found = 1;
+			} else {
+				intmat_free(t->m);
+			}
+		}
+
+		cell_free(ref[sn]);
+
+	}
+
+	free(tests);
 }
 
 
-static void connect_series(struct window *win)
+static void connect_series(struct window *win, int n_threads)
 {
 	while ( win->join_ptr < win->ws ) {
 
@@ -412,12 +538,7 @@ static void connect_series(struct window *win)
 
 		/* Try to join this frame to each of the active series */
 		if ( win->join_ptr > 1 ) {
-			int i;
-			for ( i=0; i<MAX_SER; i++ ) {
-				if ( win->ser[i][win->join_ptr-1] != -1 ) {
-					try_join(win, i);
-				}
-			}
+			try_join_all(win, n_threads);
 		}
 
 		/* Try to nucleate a new series here */
@@ -427,7 +548,7 @@ static void connect_series(struct window *win)
 			IntegerMatrix *m;
 			int c1, c2;
 			m = try_all(win, win->join_ptr-1, win->join_ptr,
-			            &c1, &c2);
+			            &c1, &c2, n_threads);
 			if ( m != NULL ) {
 				int sn = find_available_series(win);
 				win->ser[sn][win->join_ptr-1] = c1;
@@ -580,7 +701,9 @@ static void show_help(const char *s)
 "      --version              Print CrystFEL version number and exit.\n"
 "\n"
 "      --window-size=n        History size for finding connected crystals.\n"
-"      --output-dir=folder    Put output files in <folder>.\n");
+"      --output-dir=folder    Put output files in <folder>.\n"
+"  -j <n>                     Use <n> threads for reading the stream and\n"
+"                              matching crystals.\n");
 }
 
 
@@ -601,6 +724,7 @@ int main(int argc, char *argv[])
 {
 	int c;
 	Stream *st;
+	StreamReader *sr;
 	struct window win;
 	int i;
 	char *rval;
@@ -611,6 +735,7 @@ int main(int argc, char *argv[])
 	int default_window_size = 16;
 	char *outdir = ".";
 	int verbose = 0;
+	int n_threads = 1;
 
 	/* Long options */
 	const struct option longopts[] = {
@@ -626,7 +751,7 @@ int main(int argc, char *argv[])
 	};
 
 	/* Short options */
-	while ((c = getopt_long(argc, argv, "h",
+	while ((c = getopt_long(argc, argv, "hj:",
 	                        longopts, NULL)) != -1)
 	{
 
@@ -660,6 +785,15 @@ int main(int argc, char *argv[])
 			outdir = strdup(optarg);
 			break;
 
+			case 'j' :
+			errno = 0;
+			n_threads = strtol(optarg, &rval, 10);
+			if ( (*rval != '\0') || (n_threads < 1) ) {
+				ERROR("Invalid value for -j.\n");
+				return 1;
+			}
+			break;
+
 			case 0 :
 			break;
 
@@ -685,6 +819,13 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	/* The series are found from the order of the frames */
+	sr = stream_reader_new(st, STREAM_REFLECTIONS, n_threads, 1);
+	if ( sr == NULL ) {
+		ERROR("Failed to start reading input stream\n");
+		return 1;
+	}
+
 	/* Allocate initial window */
 	win.ws = default_window_size;
 	win.img = calloc(win.ws, sizeof(struct image));
@@ -725,7 +866,7 @@ int main(int argc, char *argv[])
 
 		struct image *image;
 
-		image = stream_read_chunk(st, STREAM_REFLECTIONS);
+		image = stream_reader_next(sr);
 
 		if ( image == NULL ) break;
 
@@ -742,7 +883,7 @@ int main(int argc, char *argv[])
 		}
 
 		add_to_window(image, &win, &ss);
-		connect_series(&win);
+		connect_series(&win, n_threads);
 
 		if ( verbose ) {
 			for ( i=0; i<win.ws; i++ ) {
@@ -769,6 +910,7 @@ int main(int argc, char *argv[])
 	display_progress(n_images);
 	printf("\n");
 
+	stream_reader_free(sr);
 	stream_close(st);
 
 	find_and_process_series(&win, 1, &ss, outdir);
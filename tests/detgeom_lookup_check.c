@@ -0,0 +1,180 @@
+/*
+ * detgeom_lookup_check.c
+ *
+ * Check that detgeom_lookup_panels() never leaves out a panel
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+
+#include <detgeom.h>
+
+
+static double rnd(void)
+{
+	return (double)rand()/RAND_MAX;
+}
+
+
+/* A ring of tilted panels around the beam, plus some at the sides and
+ * behind the sample */
+static void make_panels(struct detgeom *det, int n)
+{
+	int i;
+
+	det->n_panels = n;
+	det->panels = calloc(n, sizeof(struct detgeom_panel));
+	det->top_group = NULL;
+	det->lookup = NULL;
+
+	for ( i=0; i<n; i++ ) {
+
+		struct detgeom_panel *p = &det->panels[i];
+		double ang = 2.0*M_PI*rnd();
+		double tilt = 0.3*(rnd()-0.5);
+		double r = 20.0 + 800.0*rnd();
+		double dist = (i % 10 == 0) ? -300.0 : 600.0;
+
+		p->name = strdup("panel");
+		p->w = 16 + rand() % 200;
+		p->h = 16 + rand() % 200;
+		p->pixel_pitch = 100e-6;
+		p->fsx = -sin(ang);
+		p->fsy = cos(ang);
+		p->fsz = tilt;
+		p->ssx = cos(ang);
+		p->ssy = sin(ang);
+		p->ssz = 0.0;
+		p->cnx = r*cos(ang);
+		p->cny = r*sin(ang);
+		p->cnz = dist + 50.0*rnd();
+
+		if ( i % 7 == 0 ) {
+			/* Facing sideways */
+			p->ssx = 0.0;
+			p->ssy = 0.0;
+			p->ssz = 1.0;
+			p->cnx = 400.0 + 10.0*rnd();
+			p->cny = -100.0*rnd();
+			p->cnz = -50.0;
+			p->fsx = 0.0;
+			p->fsy = 1.0;
+			p->fsz = 0.0;
+		}
+
+	}
+}
+
+
+static int check_panels(struct detgeom *det, double shift)
+{
+	int i;
+
+	for ( i=0; i<det->n_panels; i++ ) {
+
+		struct detgeom_panel *p = &det->panels[i];
+		int j;
+
+		for ( j=0; j<1000; j++ ) {
+
+			double fs, ss, x, y, z, sx, sy;
+			const int *list;
+			int n, k, found;
+
+			/* Include the edges and corners */
+			fs = (j < 4) ? (j & 1)*p->w : rnd()*p->w;
+			ss = (j < 4) ? ((j & 2)/2)*p->h : rnd()*p->h;
+			sx = shift*(2.0*rnd()-1.0)/sqrt(2.0);
+			sy = shift*(2.0*rnd()-1.0)/sqrt(2.0);
+
+			x = p->cnx + fs*p->fsx + ss*p->ssx + sx/p->pixel_pitch;
+			y = p->cny + fs*p->fsy + ss*p->ssy + sy/p->pixel_pitch;
+			z = p->cnz + fs*p->fsz + ss*p->ssz;
+
+			list = detgeom_lookup_panels(det, x, y, z, shift, &n);
+			if ( list == NULL ) {
+				fprintf(stderr, "No lookup table\n");
+				return 1;
+			}
+
+			found = 0;
+			for ( k=0; k<n; k++ ) {
+				if ( (k > 0) && (list[k] <= list[k-1]) ) {
+					fprintf(stderr, "List not in order\n");
+					return 1;
+				}
+				if ( list[k] == i ) found = 1;
+			}
+			if ( !found ) {
+				fprintf(stderr, "Panel %i missing at %f,%f "
+				        "(shift %e)\n", i, fs, ss, shift);
+				return 1;
+			}
+
+		}
+
+	}
+
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct detgeom *det;
+	int fail = 0;
+
+	srand(17);
+	det = malloc(sizeof(struct detgeom));
+	make_panels(det, 300);
+
+	if ( detgeom_update_lookup(det) ) {
+		fprintf(stderr, "Failed to make lookup table\n");
+		return 1;
+	}
+
+	fail |= check_panels(det, 0.0);
+	fail |= check_panels(det, 1e-3);
+
+	/* Too far for the table */
+	if ( detgeom_lookup_panels(det, 0.0, 0.0, 1.0, 1.0, NULL) != NULL ) {
+		fprintf(stderr, "Lookup table used for big shift\n");
+		fail = 1;
+	}
+
+	/* Moving the panels should give a new table */
+	det->panels[5].cnz += 100.0;
+	if ( detgeom_update_lookup(det) ) {
+		fprintf(stderr, "Failed to re-make lookup table\n");
+		return 1;
+	}
+	fail |= check_panels(det, 0.0);
+
+	detgeom_free(det);
+
+	return fail;
+}
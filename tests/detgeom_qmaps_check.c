@@ -0,0 +1,176 @@
+/*
+ * detgeom_qmaps_check.c
+ *
+ * Check the per-pixel reciprocal space maps against detgeom_transform_coords()
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+
+#include <detgeom.h>
+#include <utils.h>
+
+
+static void make_panels(struct detgeom *det, int n)
+{
+	int i;
+
+	det->n_panels = n;
+	det->panels = calloc(n, sizeof(struct detgeom_panel));
+	det->top_group = NULL;
+	det->lookup = NULL;
+
+	for ( i=0; i<n; i++ ) {
+
+		struct detgeom_panel *p = &det->panels[i];
+		double ang = 2.0*M_PI*i/n;
+
+		p->name = strdup("panel");
+		p->w = 37;
+		p->h = 23;
+		p->pixel_pitch = 75e-6;
+		p->fsx = -sin(ang);
+		p->fsy = cos(ang);
+		p->fsz = 0.1;
+		p->ssx = cos(ang);
+		p->ssy = sin(ang);
+		p->ssz = 0.0;
+		p->cnx = 30.0*cos(ang);
+		p->cny = 30.0*sin(ang);
+		p->cnz = (i == 0) ? -400.0 : 1000.0;
+
+	}
+}
+
+
+static int check_maps(struct detgeom *det, struct detgeom_qmaps *qm,
+                      double wavelength)
+{
+	int i;
+
+	for ( i=0; i<det->n_panels; i++ ) {
+
+		struct detgeom_panel *p = &det->panels[i];
+		const float *qmod = detgeom_qmaps_qmod(qm, i);
+		const float *tt = detgeom_qmaps_twotheta(qm, i);
+		const float *qvec = detgeom_qmaps_qvec(qm, i);
+		int fs, ss;
+
+		for ( ss=0; ss<p->h; ss++ ) {
+		for ( fs=0; fs<p->w; fs++ ) {
+
+			double r[3];
+			double mod, twotheta;
+			int idx = fs + p->w*ss;
+			int k;
+
+			detgeom_transform_coords(p, fs, ss, wavelength,
+			                         0.0, 0.0, r);
+			mod = modulus(r[0], r[1], r[2]);
+			twotheta = 2.0*asin(mod*wavelength/2.0);
+
+			if ( fabs(qmod[idx]/wavelength - mod) > 1e-6*mod ) {
+				fprintf(stderr, "|q| wrong at %i %i,%i: "
+				        "%e %e\n", i, fs, ss,
+				        qmod[idx]/wavelength, mod);
+				return 1;
+			}
+
+			if ( fabs(tt[idx] - twotheta) > 1e-5 ) {
+				fprintf(stderr, "2theta wrong at %i %i,%i: "
+				        "%e %e\n", i, fs, ss, tt[idx],
+				        twotheta);
+				return 1;
+			}
+
+			for ( k=0; k<3; k++ ) {
+				double v = qvec[3*idx+k]/wavelength;
+				if ( fabs(v - r[k]) > 1e-6*mod ) {
+					fprintf(stderr, "q[%i] wrong at %i "
+					        "%i,%i: %e %e\n", k, i, fs, ss,
+					        v, r[k]);
+					return 1;
+				}
+			}
+
+		}
+		}
+
+	}
+
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct detgeom *det;
+	struct detgeom_qmaps *qm;
+	int fail = 0;
+
+	det = malloc(sizeof(struct detgeom));
+	make_panels(det, 6);
+
+	qm = detgeom_qmaps_new(det, DETGEOM_MAP_QMOD | DETGEOM_MAP_TWOTHETA
+	                             | DETGEOM_MAP_QVEC);
+	if ( qm == NULL ) {
+		fprintf(stderr, "Failed to make maps\n");
+		return 1;
+	}
+
+	/* Same maps for any wavelength */
+	fail |= check_maps(det, qm, 1e-10);
+	fail |= check_maps(det, qm, 3e-12);
+
+	if ( !detgeom_qmaps_valid(qm, det) ) {
+		fprintf(stderr, "Maps should be valid\n");
+		fail = 1;
+	}
+
+	/* Moving a panel should make the maps out of date */
+	det->panels[3].cnx += 1.0;
+	if ( detgeom_qmaps_valid(qm, det) ) {
+		fprintf(stderr, "Maps should not be valid after moving panel\n");
+		fail = 1;
+	}
+	detgeom_qmaps_free(qm);
+
+	/* Only the requested maps */
+	qm = detgeom_qmaps_new(det, DETGEOM_MAP_QMOD);
+	if ( (qm == NULL) || (detgeom_qmaps_qmod(qm, 0) == NULL)
+	  || (detgeom_qmaps_twotheta(qm, 0) != NULL)
+	  || (detgeom_qmaps_qvec(qm, 0) != NULL) )
+	{
+		fprintf(stderr, "Wrong maps\n");
+		fail = 1;
+	}
+	detgeom_qmaps_free(qm);
+
+	detgeom_free(det);
+
+	return fail;
+}
@@ -0,0 +1,228 @@
+/*
+ * feature_index_check.c
+ *
+ * Check that image_feature_closest() finds the closest feature
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <image.h>
+#include <utils.h>
+
+
+/* The simple way: look at every feature */
+static int slow_closest(ImageFeatureList *flist, double fs, double ss, int pn,
+                        double *pd)
+{
+	int i;
+	double dmin = +HUGE_VAL;
+	int closest = -1;
+
+	for ( i=0; i<image_feature_count(flist); i++ ) {
+		struct imagefeature *f = image_get_feature(flist, i);
+		double ds;
+		if ( f->pn != pn ) continue;
+		ds = distance(f->fs, f->ss, fs, ss);
+		if ( ds < dmin ) {
+			dmin = ds;
+			closest = i;
+		}
+	}
+
+	*pd = dmin;
+	return closest;
+}
+
+
+static int check_queries(ImageFeatureList *flist, int n_queries, int n_panels)
+{
+	int i;
+
+	for ( i=0; i<n_queries; i++ ) {
+
+		/* Some of the queries are outside the area of the features */
+		double fs = (double)rand()/RAND_MAX * 1400.0 - 100.0;
+		double ss = (double)rand()/RAND_MAX * 700.0 - 100.0;
+		int pn = rand() % (n_panels+1);
+		double d_slow, d;
+		int idx_slow, idx = -1;
+		struct imagefeature *f;
+
+		idx_slow = slow_closest(flist, fs, ss, pn, &d_slow);
+		f = image_feature_closest(flist, fs, ss, pn, &d, &idx);
+
+		if ( idx_slow < 0 ) {
+			if ( f != NULL ) {
+				fprintf(stderr, "Found a feature on an empty "
+				        "panel\n");
+				return 1;
+			}
+			continue;
+		}
+
+		if ( (f == NULL) || (idx != idx_slow) || (d != d_slow) ) {
+			fprintf(stderr, "Wrong closest feature for %f,%f "
+			        "panel %i: %i %f instead of %i %f\n",
+			        fs, ss, pn, idx, d, idx_slow, d_slow);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+static int check_arrays(ImageFeatureList *flist)
+{
+	struct imagefeature_arrays arr;
+	int i;
+
+	if ( image_feature_list_arrays(flist, &arr) ) {
+		fprintf(stderr, "Failed to get arrays\n");
+		return 1;
+	}
+
+	if ( arr.n != image_feature_count(flist) ) {
+		fprintf(stderr, "Wrong number of features in arrays\n");
+		return 1;
+	}
+
+	for ( i=0; i<arr.n; i++ ) {
+		struct imagefeature *f = image_get_feature(flist, i);
+		if ( (f->fs != arr.fs[i]) || (f->ss != arr.ss[i])
+		  || (f->pn != arr.pn[i]) || (f->intensity != arr.intensity[i]) )
+		{
+			fprintf(stderr, "Arrays don't match feature %i\n", i);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+static int check_remove_features(ImageFeatureList *flist)
+{
+	int n = image_feature_count(flist);
+	ImageFeatureList *copy;
+	char *remove;
+	int i, j, n_removed;
+
+	copy = image_feature_list_copy(flist);
+	remove = malloc(n);
+	n_removed = 0;
+	for ( i=0; i<n; i++ ) {
+		remove[i] = (rand() % 3 == 0);
+		if ( remove[i] ) n_removed++;
+	}
+
+	if ( image_remove_features(flist, remove) != n_removed ) {
+		fprintf(stderr, "Wrong number of features removed\n");
+		return 1;
+	}
+
+	if ( image_feature_count(flist) != n - n_removed ) {
+		fprintf(stderr, "Wrong number of features left\n");
+		return 1;
+	}
+
+	j = 0;
+	for ( i=0; i<n; i++ ) {
+		struct imagefeature *a, *b;
+		if ( remove[i] ) continue;
+		a = image_get_feature(copy, i);
+		b = image_get_feature(flist, j++);
+		if ( (a->fs != b->fs) || (a->ss != b->ss) || (a->pn != b->pn) ) {
+			fprintf(stderr, "Wrong feature left at %i\n", j-1);
+			return 1;
+		}
+	}
+
+	free(remove);
+	image_feature_list_free(copy);
+	return check_arrays(flist);
+}
+
+
+int main(int argc, char *argv[])
+{
+	ImageFeatureList *flist;
+	int n_panels = 4;
+	int i;
+
+	srand(1);
+	flist = image_feature_list_new();
+
+	/* Small list, no index */
+	for ( i=0; i<20; i++ ) {
+		image_add_feature(flist, rand() % 1024, rand() % 512,
+		                  rand() % n_panels, 1.0, NULL);
+	}
+	if ( check_queries(flist, 200, n_panels) ) return 1;
+	if ( check_arrays(flist) ) return 1;
+
+	/* Bigger list, including features at exactly the same place */
+	for ( i=0; i<2000; i++ ) {
+		image_add_feature(flist, rand() % 1024, rand() % 512,
+		                  rand() % n_panels, 1.0, NULL);
+	}
+	if ( check_queries(flist, 2000, n_panels) ) return 1;
+
+	/* Features added after the index was built */
+	for ( i=0; i<3000; i++ ) {
+		image_add_feature(flist, (double)rand()/RAND_MAX*1024.0,
+		                  (double)rand()/RAND_MAX*512.0,
+		                  rand() % n_panels, 1.0, NULL);
+		if ( i % 100 == 0 ) {
+			if ( check_queries(flist, 20, n_panels) ) return 1;
+		}
+	}
+	if ( check_queries(flist, 2000, n_panels) ) return 1;
+
+	/* Features removed */
+	for ( i=0; i<1000; i++ ) {
+		image_remove_feature(flist, rand() % image_feature_count(flist));
+	}
+	if ( check_queries(flist, 2000, n_panels) ) return 1;
+	if ( check_arrays(flist) ) return 1;
+
+	/* Lots of features removed at once */
+	if ( check_remove_features(flist) ) return 1;
+	if ( check_queries(flist, 2000, n_panels) ) return 1;
+
+	/* Features added after the arrays were made */
+	for ( i=0; i<5000; i++ ) {
+		image_add_feature(flist, (double)rand()/RAND_MAX*1024.0,
+		                  (double)rand()/RAND_MAX*512.0,
+		                  rand() % n_panels, i, NULL);
+	}
+	if ( check_arrays(flist) ) return 1;
+	if ( check_queries(flist, 2000, n_panels) ) return 1;
+
+	image_feature_list_free(flist);
+	return 0;
+}
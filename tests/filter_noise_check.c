@@ -0,0 +1,141 @@
+/*
+ * filter_noise_check.c
+ *
+ * Check that filter_noise_data() zeroes the right pixels
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <detgeom.h>
+#include <filters.h>
+
+
+/* The simple way: look at all nine pixels */
+static float slow_noise_filter(const float *data, int w, int h, int fs, int ss)
+{
+	int dfs, dss;
+
+	for ( dss=-1; dss<=+1; dss++ ) {
+	for ( dfs=-1; dfs<=+1; dfs++ ) {
+		int nfs = fs+dfs;
+		int nss = ss+dss;
+		if ( (nfs < 0) || (nfs >= w) || (nss < 0) || (nss >= h) ) continue;
+		if ( data[nfs+w*nss] < 0.0 ) return 0.0;
+	}
+	}
+
+	return data[fs+w*ss];
+}
+
+
+static int check_filter(struct detgeom *det, float **orig, int n_threads,
+                        int in_place)
+{
+	float **out;
+	int pn;
+	int fail = 0;
+
+	out = malloc(det->n_panels*sizeof(float *));
+	for ( pn=0; pn<det->n_panels; pn++ ) {
+		struct detgeom_panel *p = &det->panels[pn];
+		out[pn] = malloc(p->w*p->h*sizeof(float));
+		if ( in_place ) {
+			memcpy(out[pn], orig[pn], p->w*p->h*sizeof(float));
+		} else {
+			memset(out[pn], 0xff, p->w*p->h*sizeof(float));
+		}
+	}
+
+	if ( n_threads == 1 ) {
+		filter_noise_data(det, in_place ? out : orig, out);
+	} else {
+		filter_noise_data_threaded(det, in_place ? out : orig, out,
+		                           n_threads);
+	}
+
+	for ( pn=0; pn<det->n_panels; pn++ ) {
+		struct detgeom_panel *p = &det->panels[pn];
+		int fs, ss;
+		for ( ss=0; ss<p->h; ss++ ) {
+		for ( fs=0; fs<p->w; fs++ ) {
+			float exp = slow_noise_filter(orig[pn], p->w, p->h,
+			                              fs, ss);
+			if ( out[pn][fs+p->w*ss] != exp ) {
+				fprintf(stderr, "Wrong value on panel %i at "
+				        "%i,%i (%i threads, in place=%i): "
+				        "%f instead of %f\n", pn, fs, ss,
+				        n_threads, in_place,
+				        out[pn][fs+p->w*ss], exp);
+				fail = 1;
+			}
+		}
+		}
+		free(out[pn]);
+	}
+	free(out);
+
+	return fail;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct detgeom det;
+	float **data;
+	int sizes[][2] = { {1,1}, {1,9}, {9,1}, {2,2}, {7,5}, {64,33}, {3,100} };
+	int pn;
+	int fail = 0;
+
+	det.n_panels = sizeof(sizes)/sizeof(sizes[0]);
+	det.panels = calloc(det.n_panels, sizeof(struct detgeom_panel));
+	det.top_group = NULL;
+	det.lookup = NULL;
+	data = malloc(det.n_panels*sizeof(float *));
+
+	srand(42);
+	for ( pn=0; pn<det.n_panels; pn++ ) {
+		int i;
+		det.panels[pn].w = sizes[pn][0];
+		det.panels[pn].h = sizes[pn][1];
+		data[pn] = malloc(sizes[pn][0]*sizes[pn][1]*sizeof(float));
+		for ( i=0; i<sizes[pn][0]*sizes[pn][1]; i++ ) {
+			/* Mostly positive, with a few negative pixels */
+			data[pn][i] = (rand() % 100) - 3;
+		}
+	}
+
+	fail |= check_filter(&det, data, 1, 0);
+	fail |= check_filter(&det, data, 1, 1);
+	fail |= check_filter(&det, data, 3, 0);
+	fail |= check_filter(&det, data, 3, 1);
+
+	for ( pn=0; pn<det.n_panels; pn++ ) free(data[pn]);
+	free(data);
+	free(det.panels);
+
+	return fail;
+}
@@ -0,0 +1,314 @@
+/*
+ * fom_multi_check.c
+ *
+ * Check calculation of several figures of merit in one pass
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include <reflist.h>
+#include <cell.h>
+#include <cell-utils.h>
+#include <symmetry.h>
+#include <utils.h>
+#include <fom.h>
+#include <possible-refls.h>
+
+
+#define N_FOMS (5)
+
+
+/* Counts the possible reflections the slow way, by looking at every reflection
+ * and remembering which asymmetric ones have already been seen */
+static long int *slow_possible(struct fom_shells *shells, UnitCell *cell,
+                               const SymOpList *sym)
+{
+	RefList *counted;
+	long int *possible;
+	signed int h, k, l;
+	double asx, asy, asz, bsx, bsy, bsz, csx, csy, csz;
+	int hmax, kmax, lmax;
+	double rmax = shells->rmaxs[shells->nshells-1];
+
+	possible = calloc(shells->nshells, sizeof(long int));
+	counted = reflist_new();
+
+	cell_get_cartesian(cell, &asx, &asy, &asz, &bsx, &bsy, &bsz,
+	                   &csx, &csy, &csz);
+	hmax = rmax * modulus(asx, asy, asz);
+	kmax = rmax * modulus(bsx, bsy, bsz);
+	lmax = rmax * modulus(csx, csy, csz);
+
+	for ( h=-hmax; h<=hmax; h++ ) {
+	for ( k=-kmax; k<=kmax; k++ ) {
+	for ( l=-lmax; l<=lmax; l++ ) {
+		signed int hs, ks, ls;
+		double d;
+		int i;
+		if ( forbidden_reflection(cell, h, k, l) ) continue;
+		get_asymm(sym, h, k, l, &hs, &ks, &ls);
+		d = 2.0 * resolution(cell, hs, ks, ls);
+		for ( i=0; i<shells->nshells; i++ ) {
+			if ( (d>shells->rmins[i]) && (d<=shells->rmaxs[i]) ) {
+				if ( find_refl(counted, hs, ks, ls) == NULL ) {
+					add_refl(counted, hs, ks, ls);
+					possible[i]++;
+				}
+				break;
+			}
+		}
+	}
+	}
+	}
+
+	reflist_free(counted);
+	return possible;
+}
+
+
+/* Every reflection within the resolution limit should be counted by the
+ * multiplicity of exactly one of the unique reflections.  The resolution of
+ * the asymmetric equivalent is used, because rounding errors can put some of
+ * the equivalents on the other side of the limit. */
+static int check_multiplicity(UnitCell *cell, const SymOpList *sym,
+                              const char *sym_str)
+{
+	PossibleRefls *p;
+	const struct possible_refl *refls;
+	double asx, asy, asz, bsx, bsy, bsz, csx, csy, csz;
+	int hmax, kmax, lmax;
+	signed int h, k, l;
+	long int n_all = 0;
+	long int n_mult = 0;
+	const double rmax = 2.0e9;
+	int i, n;
+
+	cell_get_cartesian(cell, &asx, &asy, &asz, &bsx, &bsy, &bsz,
+	                   &csx, &csy, &csz);
+	hmax = rmax * modulus(asx, asy, asz);
+	kmax = rmax * modulus(bsx, bsy, bsz);
+	lmax = rmax * modulus(csx, csy, csz);
+	for ( h=-hmax; h<=hmax; h++ ) {
+	for ( k=-kmax; k<=kmax; k++ ) {
+	for ( l=-lmax; l<=lmax; l++ ) {
+		signed int hs, ks, ls;
+		if ( (h==0) && (k==0) && (l==0) ) continue;
+		if ( forbidden_reflection(cell, h, k, l) ) continue;
+		get_asymm(sym, h, k, l, &hs, &ks, &ls);
+		if ( 2.0*resolution(cell, hs, ks, ls) > rmax ) continue;
+		n_all++;
+	}
+	}
+	}
+
+	p = possible_refls_get(cell, sym, rmax, 2);
+	if ( p == NULL ) return 1;
+	refls = possible_refls_list(p, &n);
+	for ( i=0; i<n; i++ ) {
+		n_mult += refls[i].multiplicity;
+		if ( (i > 0) && (refls[i].res < refls[i-1].res) ) {
+			printf("%s: list not in order\n", sym_str);
+			return 1;
+		}
+	}
+	possible_refls_free(p);
+
+	if ( n_mult != n_all ) {
+		printf("%s: total multiplicity %li, should be %li\n",
+		       sym_str, n_mult, n_all);
+		return 1;
+	}
+	return 0;
+}
+
+
+static int check_cell(UnitCell *cell, const char *sym_str)
+{
+	SymOpList *sym = get_pointgroup(sym_str);
+	RefList *list = reflist_new();
+	struct fom_shells *shells;
+	struct fom_context *single[N_FOMS];
+	struct fom_context *multi[N_FOMS];
+	const enum fom_type foms[N_FOMS] = { FOM_NUM_MEASUREMENTS,
+	                                     FOM_REDUNDANCY,
+	                                     FOM_SNR,
+	                                     FOM_MEAN_INTENSITY,
+	                                     FOM_COMPLETENESS };
+	long int *slow;
+	signed int h, k, l;
+	int i, f;
+	int fail = 0;
+	int n = 0;
+
+	shells = fom_make_resolution_shells(0.05e9, 4.0e9, 10);
+
+	/* Every third unique reflection within the resolution range */
+	for ( h=-20; h<=20; h++ ) {
+	for ( k=-20; k<=20; k++ ) {
+	for ( l=-20; l<=20; l++ ) {
+		signed int hs, ks, ls;
+		double d;
+		Reflection *refl;
+		get_asymm(sym, h, k, l, &hs, &ks, &ls);
+		if ( (hs != h) || (ks != k) || (ls != l) ) continue;
+		if ( forbidden_reflection(cell, h, k, l) ) continue;
+		d = 2.0 * resolution(cell, h, k, l);
+		if ( (d <= 0.05e9) || (d > 4.0e9) ) continue;
+		if ( (n++ % 3) != 0 ) continue;
+		refl = add_refl(list, h, k, l);
+		set_intensity(refl, 100.0 + (n % 97));
+		set_esd_intensity(refl, 1.0 + (n % 13));
+		set_redundancy(refl, 1 + (n % 7));
+	}
+	}
+	}
+
+	/* The possible reflections will be counted (with several threads) for
+	 * the first calculation, and remembered for the second */
+	if ( fom_calculate_multi(list, cell, shells, foms, N_FOMS, sym, 3,
+	                         multi) ) return 1;
+
+	for ( f=0; f<N_FOMS; f++ ) {
+		single[f] = fom_calculate(list, NULL, cell, shells, foms[f],
+		                          0, sym);
+		if ( single[f] == NULL ) return 1;
+	}
+
+	for ( f=0; f<N_FOMS; f++ ) {
+		for ( i=0; i<shells->nshells; i++ ) {
+			double v1 = fom_shell_value(single[f], i);
+			double v2 = fom_shell_value(multi[f], i);
+			if ( fabs(v1-v2) > 1e-9*fabs(v1) ) {
+				printf("%s shell %i: %e %e\n", fom_name(foms[f]),
+				       i, v1, v2);
+				fail = 1;
+			}
+		}
+	}
+
+	/* Compare with the slow way of counting */
+	slow = slow_possible(shells, cell, sym);
+	for ( i=0; i<shells->nshells; i++ ) {
+		long int p1 = fom_shell_num_possible(single[N_FOMS-1], i);
+		long int p2 = fom_shell_num_possible(multi[N_FOMS-1], i);
+		if ( (p1 != slow[i]) || (p2 != slow[i]) ) {
+			printf("%s %c shell %i: possible %li %li, should be "
+			       "%li\n", sym_str, cell_get_centering(cell), i,
+			       p1, p2, slow[i]);
+			fail = 1;
+		}
+	}
+	printf("%s %c: %i possible reflections\n", sym_str,
+	       cell_get_centering(cell),
+	       fom_overall_num_possible(multi[N_FOMS-1]));
+
+	fail += check_multiplicity(cell, sym, sym_str);
+
+	free(slow);
+	reflist_free(list);
+	free_symoplist(sym);
+	return fail;
+}
+
+
+static int check_all(void)
+{
+	UnitCell *cell;
+	int fail = 0;
+
+	cell = cell_new_from_parameters(30e-10, 40e-10, 50e-10,
+	                                deg2rad(90.0), deg2rad(90.0),
+	                                deg2rad(90.0));
+	cell_set_centering(cell, 'C');
+	cell_set_lattice_type(cell, L_ORTHORHOMBIC);
+	fail += check_cell(cell, "mmm");
+	fail += check_cell(cell, "222");
+	cell_free(cell);
+
+	cell = cell_new_from_parameters(40e-10, 40e-10, 60e-10,
+	                                deg2rad(90.0), deg2rad(90.0),
+	                                deg2rad(120.0));
+	cell_set_centering(cell, 'P');
+	cell_set_lattice_type(cell, L_HEXAGONAL);
+	cell_set_unique_axis(cell, 'c');
+	fail += check_cell(cell, "6/mmm");
+	cell_free(cell);
+
+	cell = cell_new_from_parameters(35e-10, 35e-10, 35e-10,
+	                                deg2rad(90.0), deg2rad(90.0),
+	                                deg2rad(90.0));
+	cell_set_centering(cell, 'I');
+	cell_set_lattice_type(cell, L_CUBIC);
+	fail += check_cell(cell, "m-3m");
+	cell_free(cell);
+
+	return fail;
+}
+
+
+/* Pushes all of the lists out of the memory cache */
+static void evict_all(void)
+{
+	UnitCell *cell;
+	SymOpList *sym;
+	int i;
+
+	cell = cell_new_from_parameters(20e-10, 20e-10, 20e-10,
+	                                deg2rad(90.0), deg2rad(90.0),
+	                                deg2rad(90.0));
+	sym = get_pointgroup("m-3m");
+	for ( i=0; i<16; i++ ) {
+		possible_refls_free(possible_refls_get(cell, sym,
+		                                       (i+1)*0.1e9, 1));
+	}
+	free_symoplist(sym);
+	cell_free(cell);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int fail = 0;
+	char tmpdir[] = "/tmp/fom_multi_check-XXXXXX";
+	char cmd[128];
+
+	if ( mkdtemp(tmpdir) == NULL ) return 1;
+	possible_refls_set_cache_dir(tmpdir);
+
+	fail += check_all();
+
+	/* Again, with the lists read back from the cache files */
+	evict_all();
+	fail += check_all();
+
+	snprintf(cmd, 128, "rm -rf %s", tmpdir);
+	if ( system(cmd) ) fail = 1;
+
+	return fail;
+}
@@ -0,0 +1,168 @@
+/*
+ * frame_arena_check.c
+ *
+ * Check that reflection lists work with memory from a frame arena
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <reflist.h>
+#include <frame-arena.h>
+
+
+static int check_alloc(FrameArena *fa)
+{
+	int i;
+	for ( i=0; i<10000; i++ ) {
+		size_t size = 1 + (i*37) % 3000;
+		unsigned char *mem = frame_arena_alloc(fa, size);
+		size_t j;
+		if ( mem == NULL ) {
+			fprintf(stderr, "Allocation failed\n");
+			return 1;
+		}
+		if ( (uintptr_t)mem % 16 != 0 ) {
+			fprintf(stderr, "Allocation not aligned\n");
+			return 1;
+		}
+		for ( j=0; j<size; j++ ) {
+			if ( mem[j] != 0 ) {
+				fprintf(stderr, "Memory not zeroed\n");
+				return 1;
+			}
+		}
+		for ( j=0; j<size; j++ ) mem[j] = 0xff;
+	}
+
+	/* Something bigger than one block */
+	if ( frame_arena_alloc(fa, 5*1024*1024) == NULL ) {
+		fprintf(stderr, "Large allocation failed\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static int check_frame(int frame)
+{
+	RefList *list;
+	Reflection *refl;
+	RefListIterator *iter;
+	signed int h, k, l;
+	int n = 0;
+
+	list = reflist_new();
+	for ( h=-10; h<=10; h++ ) {
+	for ( k=-10; k<=10; k++ ) {
+	for ( l=-10; l<=10; l++ ) {
+		refl = add_refl(list, h, k, l);
+		set_intensity(refl, h+k+l+frame);
+	}
+	}
+	}
+
+	/* Reflections created separately, as in predict_to_res() */
+	refl = reflection_new(20, 20, 20);
+	reflection_free(refl);
+	refl = reflection_new(20, 0, 0);
+	set_intensity(refl, 20+frame);
+	add_refl_to_list(refl, list);
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		get_indices(refl, &h, &k, &l);
+		if ( get_intensity(refl) != h+k+l+frame ) {
+			fprintf(stderr, "Wrong intensity for %i %i %i\n",
+			        h, k, l);
+			reflist_free(list);
+			return 1;
+		}
+		n++;
+	}
+
+	reflist_free(list);
+
+	if ( n != 21*21*21 + 1 ) {
+		fprintf(stderr, "Wrong number of reflections (%i)\n", n);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static int check_arena(enum huge_pages hp)
+{
+	FrameArena *fa;
+	size_t size;
+	int i;
+
+	fa = frame_arena_new_huge(hp);
+	if ( fa == NULL ) return 1;
+
+	if ( check_alloc(fa) ) return 1;
+	frame_arena_reset(fa);
+	if ( check_alloc(fa) ) return 1;
+	frame_arena_reset(fa);
+
+	for ( i=0; i<20; i++ ) {
+		frame_arena_set_current(fa);
+		if ( check_frame(i) ) return 1;
+		frame_arena_set_current(NULL);
+		frame_arena_reset(fa);
+		if ( i == 0 ) size = frame_arena_size(fa);
+	}
+
+	/* After the first frame, the memory should be re-used */
+	if ( frame_arena_size(fa) != size ) {
+		fprintf(stderr, "Arena grew from %zi to %zi\n",
+		        size, frame_arena_size(fa));
+		return 1;
+	}
+
+	frame_arena_free(fa);
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	if ( check_arena(HUGE_PAGES_NONE) ) return 1;
+
+	/* Explicit huge pages probably aren't available, in which case this
+	 * checks the fallback to transparent huge pages */
+	if ( check_arena(HUGE_PAGES_TRANSPARENT) ) return 1;
+	if ( check_arena(HUGE_PAGES_EXPLICIT) ) return 1;
+
+	/* Without an arena */
+	if ( check_frame(0) ) return 1;
+
+	return 0;
+}
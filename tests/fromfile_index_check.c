@@ -0,0 +1,170 @@
+/*
+ * fromfile_index_check.c
+ *
+ * Check that the binary solution index gives the same results as the text file
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include <image.h>
+#include <index.h>
+#include <cell.h>
+#include <crystal.h>
+
+#include "../libcrystfel/src/indexers/fromfile.h"
+
+
+#define N_FILES (20)
+#define N_EVENTS (50)
+
+
+static int n_crystals_for(int f, int e)
+{
+	return (f*7+e) % 4;   /* Including some with none at all */
+}
+
+
+static int write_solutions(const char *filename)
+{
+	FILE *fh;
+	int f, e, i;
+
+	fh = fopen(filename, "w");
+	if ( fh == NULL ) return 1;
+
+	/* In reverse order, so that the index has to sort them */
+	for ( f=N_FILES-1; f>=0; f-- ) {
+	for ( e=N_EVENTS-1; e>=0; e-- ) {
+		for ( i=0; i<n_crystals_for(f, e); i++ ) {
+			fprintf(fh, "/data/run %i.h5 //%i %f 0 0 0 %f 0 0 0 %f "
+			        "%f %f oP\n", f, e, 0.1+0.01*i, 0.2+0.001*e,
+			        0.3+0.001*f, 0.01*i, -0.01*e);
+		}
+	}
+	}
+
+	fclose(fh);
+	return 0;
+}
+
+
+static int check_image(void *priv, int f, int e, int expected, int index)
+{
+	struct image *image;
+	char filename[64];
+	char ev[64];
+	int n, i;
+
+	snprintf(filename, 64, "/data/run %i.h5", f);
+	snprintf(ev, 64, "//%i", e);
+
+	image = image_new();
+	image->filename = strdup(filename);
+	image->ev = strdup(ev);
+
+	n = fromfile_index(image, priv);
+	if ( (n != expected) || (image->n_crystals != n) ) {
+		fprintf(stderr, "%s %s: %i crystals instead of %i\n",
+		        filename, ev, n, expected);
+		return 1;
+	}
+
+	for ( i=0; i<n; i++ ) {
+		double asx, asy, asz, bsx, bsy, bsz, csx, csy, csz;
+		double dx, dy;
+		Crystal *cr = image->crystals[i].cr;
+		cell_get_reciprocal(crystal_get_cell(cr), &asx, &asy, &asz,
+		                    &bsx, &bsy, &bsz, &csx, &csy, &csz);
+		crystal_get_det_shift(cr, &dx, &dy);
+		if ( (fabs(asx - (0.1+0.01*i)*1e9) > 1e3)
+		  || (fabs(bsy - (0.2+0.001*e)*1e9) > 1e3)
+		  || (fabs(csz - (0.3+0.001*f)*1e9) > 1e3)
+		  || (fabs(dx - 0.01*i*1e-3) > 1e-9)
+		  || (fabs(dy + 0.01*e*1e-3) > 1e-9) )
+		{
+			fprintf(stderr, "%s %s: wrong crystal %i (%s)\n",
+			        filename, ev, i, index ? "index" : "text");
+			return 1;
+		}
+	}
+
+	image_free(image);
+	return 0;
+}
+
+
+static int check_all(const char *filename, int index)
+{
+	IndexingMethod indm = INDEXING_FILE;
+	struct fromfile_options opts;
+	void *priv;
+	int f, e;
+
+	opts.filename = (char *)filename;
+	priv = fromfile_prepare(&indm, &opts);
+	if ( priv == NULL ) return 1;
+
+	for ( f=0; f<N_FILES; f++ ) {
+		for ( e=0; e<N_EVENTS; e++ ) {
+			if ( check_image(priv, f, e, n_crystals_for(f, e),
+			                 index) ) return 1;
+		}
+	}
+
+	/* Not in the file at all */
+	if ( check_image(priv, N_FILES, 1, 0, index) ) return 1;
+
+	fromfile_cleanup(priv);
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	char sol_filename[64];
+	char index_filename[64];
+	int r;
+
+	snprintf(sol_filename, 64, "/tmp/fromfile-check-%i.sol", getpid());
+	snprintf(index_filename, 64, "/tmp/fromfile-check-%i.idx", getpid());
+
+	if ( write_solutions(sol_filename) ) return 1;
+	if ( fromfile_write_index(sol_filename, index_filename) ) return 1;
+
+	if ( fromfile_is_index(sol_filename) || !fromfile_is_index(index_filename) ) {
+		fprintf(stderr, "Index not recognised\n");
+		return 1;
+	}
+
+	r = check_all(sol_filename, 0) || check_all(index_filename, 1);
+
+	unlink(sol_filename);
+	unlink(index_filename);
+	return r;
+}
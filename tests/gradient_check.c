@@ -37,6 +37,14 @@
 #include "gradient_check_utils.h"
 
 
+#ifdef CHANGE_CELL
+static int batch_matches(float batch, float single)
+{
+	return fabs(batch - single) <= 1e-5*fabs(single) + 1e-30;
+}
+#endif
+
+
 int main(int argc, char *argv[])
 {
 	struct image image;
@@ -118,6 +126,16 @@ int main(int argc, char *argv[])
 	update_predictions(image.crystals[0].refls, image.crystals[0].cr, &image);
 	after = make_dev_list(rps, n_refls, image.detgeom);
 
+	#ifdef CHANGE_CELL
+	/* All the cell gradients at once should give the same results */
+	float *batch_r = malloc(N_CELL_PARAMS*n_refls*sizeof(float));
+	float *batch_fs = malloc(N_CELL_PARAMS*n_refls*sizeof(float));
+	float *batch_ss = malloc(N_CELL_PARAMS*n_refls*sizeof(float));
+	int n_wrong_batch = 0;
+	cell_gradients(rps, n_refls, cell, &image, panel_matrices,
+	               batch_r, batch_fs, batch_ss);
+	#endif
+
 	for ( i=0; i<n_refls; i++ ) {
 
 		float calc[3];
@@ -155,6 +173,12 @@ int main(int argc, char *argv[])
 		if ( fabs(obs[0] - calc[0]) > 1e-2 ) n_wrong_r++;
 		if ( fabs(obs[1] - calc[1]) > 1e-8 ) n_wrong_fs++;
 		if ( fabs(obs[2] - calc[2]) > 1e-8 ) n_wrong_ss++;
+		if ( !batch_matches(batch_r[N_CELL_PARAMS*i+TEST_GPARAM], calc[0])
+		  || !batch_matches(batch_fs[N_CELL_PARAMS*i+TEST_GPARAM], calc[1])
+		  || !batch_matches(batch_ss[N_CELL_PARAMS*i+TEST_GPARAM], calc[2]) )
+		{
+			n_wrong_batch++;
+		}
 		#endif
 
 	}
@@ -183,5 +207,16 @@ int main(int argc, char *argv[])
 		fail = 1;
 	}
 
+	#ifdef CHANGE_CELL
+	if ( n_wrong_batch > 0 ) {
+		fprintf(stderr, "%i out of %i batched gradients didn't match.\n",
+		        n_wrong_batch, n_refls);
+		fail = 1;
+	}
+	free(batch_r);
+	free(batch_fs);
+	free(batch_ss);
+	#endif
+
 	return fail;
 }
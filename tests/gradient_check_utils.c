@@ -94,6 +94,8 @@ struct reflpeak *make_test_image(int *pn_refls, struct image *image)
 
 	image->detgeom = malloc(sizeof(struct detgeom));
 	image->detgeom->n_panels = 1;
+	image->detgeom->top_group = NULL;
+	image->detgeom->lookup = NULL;
 	image->detgeom->panels = malloc(sizeof(struct detgeom_panel));
 	image->detgeom->panels[0].name = "panel";
 	image->detgeom->panels[0].adu_per_photon = 1.0;
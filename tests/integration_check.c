@@ -50,6 +50,9 @@ int main(int argc, char *argv[])
 	Reflection *refl;
 	UnitCell *cell;
 	struct intcontext *ic;
+	struct intcontext *ic_reused;
+	RefList *list2;
+	Reflection *refl2;
 	const int ir_inn = 2;
 	const int ir_mid = 4;
 	const int ir_out = 6;
@@ -98,6 +101,15 @@ int main(int argc, char *argv[])
 	image.n_crystals = 0;
 	image.crystals = NULL;
 
+	/* A context which will be re-used for every reflection, starting with
+	 * a different box size so that it has to be re-allocated */
+	ic_reused = intcontext_new(&image, NULL, INTEGRATION_RINGS,
+	                           ir_inn, ir_mid+2, ir_out+2, NULL);
+	if ( ic_reused == NULL ) {
+		ERROR("Failed to initialise integration.\n");
+		return 1;
+	}
+
 	hi = histogram_init();
 
 	for ( i=0; i<300; i++ ) {
@@ -129,6 +141,30 @@ int main(int argc, char *argv[])
 		}
 
 		integrate_rings_once(refl, ic, 0);
+		intcontext_free(ic);
+
+		/* The re-used context should give exactly the same result */
+		list2 = reflist_new();
+		refl2 = add_refl(list2, 0, 0, 0);
+		set_detector_pos(refl2, 64, 64);
+		set_panel_number(refl2, 0);
+		if ( intcontext_reset(ic_reused, &image, cell, INTEGRATION_RINGS,
+		                      ir_inn, ir_mid, ir_out, NULL) )
+		{
+			ERROR("Failed to reset integration context.\n");
+			return 1;
+		}
+		integrate_rings_once(refl2, ic_reused, 0);
+		if ( (get_intensity(refl2) != get_intensity(refl))
+		  || (get_esd_intensity(refl2) != get_esd_intensity(refl)) )
+		{
+			ERROR("Re-used context gave a different result: "
+			      "%f +/- %f instead of %f +/- %f\n",
+			      get_intensity(refl2), get_esd_intensity(refl2),
+			      get_intensity(refl), get_esd_intensity(refl));
+			fail = 1;
+		}
+		reflist_free(list2);
 
 		cell_free(cell);
 
@@ -141,6 +177,7 @@ int main(int argc, char *argv[])
 	histogram_show(hi);
 
 	histogram_free(hi);
+	intcontext_free(ic_reused);
 	detgeom_free(image.detgeom);
 	free(image.dp[0]);
 	free(image.dp);
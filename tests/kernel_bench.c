@@ -0,0 +1,714 @@
+/*
+ * kernel_bench.c
+ *
+ * Micro-benchmarks for the most time-consuming parts of CrystFEL
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Usage: kernel_bench <name> [<filename>]
+ *
+ * Runs one benchmark repeatedly, for at least BENCH_MIN_ITERATIONS times and
+ * at least BENCH_MIN_TIME seconds, and writes the result to standard output as
+ * one JSON object.  All the synthetic data comes from a random number
+ * generator with a fixed seed, so the work done is the same every time. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <gsl/gsl_rng.h>
+#include <gsl/gsl_randist.h>
+
+#include <image.h>
+#include <utils.h>
+#include <cell.h>
+#include <cell-utils.h>
+#include <reflist.h>
+#include <symmetry.h>
+#include <geometry.h>
+#include <integration.h>
+#include <peakfinder8.h>
+#include <stream.h>
+
+#include "../src/merge.h"
+#include "../src/scaling.h"
+
+#define BENCH_MIN_ITERATIONS (5)
+#define BENCH_MAX_ITERATIONS (1000)
+#define BENCH_MIN_TIME (2.0)
+#define BENCH_SEED (12345)
+
+/* Runs one iteration of a benchmark.  Returns non-zero on error */
+typedef int (*BenchFunc)(void *priv);
+
+
+static double bench_time(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec*1e-9;
+}
+
+
+static int cmpd(const void *av, const void *bv)
+{
+	double a = *(double *)av;
+	double b = *(double *)bv;
+	if ( a < b ) return -1;
+	if ( a > b ) return +1;
+	return 0;
+}
+
+
+/* 'n_items' is the number of reflections, pixels, bytes etc handled by each
+ * iteration, for the throughput figure */
+static int run_bench(const char *name, BenchFunc func, void *priv,
+                     double n_items, const char *unit)
+{
+	double times[BENCH_MAX_ITERATIONS];
+	double total = 0.0;
+	int n = 0;
+
+	/* Once to warm up the caches */
+	if ( func(priv) ) {
+		ERROR("Benchmark '%s' failed\n", name);
+		return 1;
+	}
+
+	while ( (n < BENCH_MIN_ITERATIONS)
+	     || ((total < BENCH_MIN_TIME) && (n < BENCH_MAX_ITERATIONS)) )
+	{
+		double t = bench_time();
+		if ( func(priv) ) {
+			ERROR("Benchmark '%s' failed\n", name);
+			return 1;
+		}
+		times[n] = bench_time() - t;
+		total += times[n++];
+	}
+
+	qsort(times, n, sizeof(double), cmpd);
+
+	printf("{\"benchmark\": \"%s\", \"iterations\": %i, "
+	       "\"min_s\": %.9f, \"median_s\": %.9f, \"mean_s\": %.9f, "
+	       "\"items_per_iteration\": %.0f, \"unit\": \"%s\", "
+	       "\"items_per_s\": %.1f}\n",
+	       name, n, times[0], times[n/2], total/n,
+	       n_items, unit, n_items/times[n/2]);
+	return 0;
+}
+
+
+/* Makes an image with one square panel, with the beam in the middle */
+static struct image *make_image(int w, double pixel_pitch, double clen)
+{
+	struct image *image;
+	struct detgeom_panel *p;
+
+	image = image_new();
+	image->lambda = ph_eV_to_lambda(9000.0);
+	image->bw = 0.001;
+	image->div = 0.0;
+	image->spectrum = spectrum_generate_gaussian(image->lambda, image->bw);
+
+	image->detgeom = calloc(1, sizeof(struct detgeom));
+	image->detgeom->n_panels = 1;
+	image->detgeom->panels = calloc(1, sizeof(struct detgeom_panel));
+	p = &image->detgeom->panels[0];
+	p->name = cfstrdup("panel0");
+	p->w = w;
+	p->h = w;
+	p->fsx = 1.0;
+	p->ssy = 1.0;
+	p->cnx = -w/2;
+	p->cny = -w/2;
+	p->cnz = clen / pixel_pitch;
+	p->pixel_pitch = pixel_pitch;
+	p->adu_per_photon = 1.0;
+	p->max_adu = INFINITY;
+
+	image->dp = malloc(sizeof(float *));
+	image->dp[0] = calloc(w*w, sizeof(float));
+	image->bad = malloc(sizeof(uint8_t *));
+	image->bad[0] = calloc(w*w, sizeof(uint8_t));
+
+	return image;
+}
+
+
+static void add_spot(struct image *image, double fs, double ss, double peak)
+{
+	int w = image->detgeom->panels[0].w;
+	int x, y;
+
+	for ( x=fs-4; x<=fs+4; x++ ) {
+		for ( y=ss-4; y<=ss+4; y++ ) {
+			double r2 = (x-fs)*(x-fs) + (y-ss)*(y-ss);
+			if ( (x < 0) || (x >= w) || (y < 0) || (y >= w) ) continue;
+			image->dp[0][x+w*y] += peak * exp(-r2/2.0);
+		}
+	}
+}
+
+
+static Crystal *make_crystal(gsl_rng *rng, double a)
+{
+	Crystal *cr;
+	UnitCell *cell;
+
+	cell = cell_new_from_parameters(a, a, a, deg2rad(90.0),
+	                                deg2rad(90.0), deg2rad(90.0));
+	cr = crystal_new();
+	crystal_set_cell(cr, cell_rotate(cell, random_quaternion(rng)));
+	crystal_set_profile_radius(cr, 0.005e9);
+	crystal_set_mosaicity(cr, 0.0);
+	crystal_set_osf(cr, 1.0);
+	crystal_set_Bfac(cr, 0.0);
+	crystal_set_resolution_limit(cr, INFINITY);
+	cell_free(cell);
+	return cr;
+}
+
+
+/* ---------------------------- RefList ---------------------------- */
+
+#define REFLIST_N (200000)
+
+struct reflist_bench
+{
+	signed int h[REFLIST_N];
+	signed int k[REFLIST_N];
+	signed int l[REFLIST_N];
+	RefList *list;
+};
+
+
+static int reflist_insert(void *vp)
+{
+	struct reflist_bench *rb = vp;
+	RefList *list = reflist_new();
+	int i;
+	for ( i=0; i<REFLIST_N; i++ ) {
+		add_refl(list, rb->h[i], rb->k[i], rb->l[i]);
+	}
+	reflist_free(list);
+	return 0;
+}
+
+
+static int reflist_find(void *vp)
+{
+	struct reflist_bench *rb = vp;
+	int i;
+	for ( i=0; i<REFLIST_N; i++ ) {
+		if ( find_refl(rb->list, rb->h[i], rb->k[i], rb->l[i]) == NULL ) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+static int reflist_iterate(void *vp)
+{
+	struct reflist_bench *rb = vp;
+	Reflection *refl;
+	RefListIterator *iter;
+	int n = 0;
+	for ( refl = first_refl(rb->list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		n++;
+	}
+	return (n != REFLIST_N);
+}
+
+
+static int bench_reflist(const char *name, gsl_rng *rng)
+{
+	struct reflist_bench *rb;
+	BenchFunc func;
+	int i, r;
+
+	rb = malloc(sizeof(struct reflist_bench));
+	rb->list = reflist_new();
+	for ( i=0; i<REFLIST_N; i++ ) {
+		rb->h[i] = gsl_rng_uniform_int(rng, 120) - 60;
+		rb->k[i] = gsl_rng_uniform_int(rng, 120) - 60;
+		rb->l[i] = gsl_rng_uniform_int(rng, 120) - 60;
+		add_refl(rb->list, rb->h[i], rb->k[i], rb->l[i]);
+	}
+
+	if ( strcmp(name, "reflist_insert") == 0 ) {
+		func = reflist_insert;
+	} else if ( strcmp(name, "reflist_find") == 0 ) {
+		func = reflist_find;
+	} else {
+		func = reflist_iterate;
+	}
+
+	r = run_bench(name, func, rb, REFLIST_N, "reflections");
+	reflist_free(rb->list);
+	free(rb);
+	return r;
+}
+
+
+/* ---------------------------- Symmetry ---------------------------- */
+
+#define ASYMM_MAX (30)
+
+static int get_asymm_all(void *vp)
+{
+	const SymOpList *sym = vp;
+	signed int h, k, l;
+	signed int ha, ka, la;
+	long int sum = 0;
+
+	for ( h=-ASYMM_MAX; h<=ASYMM_MAX; h++ ) {
+	for ( k=-ASYMM_MAX; k<=ASYMM_MAX; k++ ) {
+	for ( l=-ASYMM_MAX; l<=ASYMM_MAX; l++ ) {
+		get_asymm(sym, h, k, l, &ha, &ka, &la);
+		sum += ha + ka + la;
+	}
+	}
+	}
+
+	return (sum == 42);  /* Just to use the result */
+}
+
+
+static int bench_get_asymm(void)
+{
+	SymOpList *sym = get_pointgroup("6/mmm");
+	double n = pow(2*ASYMM_MAX+1, 3);
+	int r = run_bench("get_asymm", get_asymm_all, sym, n, "reflections");
+	free_symoplist(sym);
+	return r;
+}
+
+
+/* ---------------------------- Prediction ---------------------------- */
+
+struct predict_bench
+{
+	struct image *image;
+	Crystal *cr;
+	RefList *list;
+};
+
+
+static int predict(void *vp)
+{
+	struct predict_bench *pb = vp;
+	RefList *list;
+	list = predict_to_res(pb->cr, pb->image,
+	                      detgeom_max_resolution(pb->image->detgeom,
+	                                             pb->image->lambda));
+	if ( list == NULL ) return 1;
+	reflist_free(list);
+	return 0;
+}
+
+
+static int partialities(void *vp)
+{
+	struct predict_bench *pb = vp;
+	calculate_partialities(pb->list, pb->cr, pb->image, PMODEL_XSPHERE);
+	return 0;
+}
+
+
+static int bench_prediction(const char *name, gsl_rng *rng)
+{
+	struct predict_bench pb;
+	int r;
+
+	pb.image = make_image(2048, 75e-6, 100e-3);
+	pb.cr = make_crystal(rng, 100e-10);
+	pb.list = predict_to_res(pb.cr, pb.image,
+	                         detgeom_max_resolution(pb.image->detgeom,
+	                                                pb.image->lambda));
+
+	if ( strcmp(name, "predict_to_res") == 0 ) {
+		r = run_bench(name, predict, &pb, num_reflections(pb.list),
+		              "reflections");
+	} else {
+		r = run_bench(name, partialities, &pb,
+		              num_reflections(pb.list), "reflections");
+	}
+
+	reflist_free(pb.list);
+	crystal_free(pb.cr);
+	image_free(pb.image);
+	return r;
+}
+
+
+/* ---------------------------- Peakfinder8 ---------------------------- */
+
+struct pf8_bench
+{
+	struct image *image;
+	struct pf8_private_data *pf8;
+};
+
+
+static int pf8(void *vp)
+{
+	struct pf8_bench *pb = vp;
+	ImageFeatureList *peaks;
+	peaks = peakfinder8(pb->image, 2048, 200.0, 5.0, 2, 200, 3,
+	                    0, 5000, 1, 0, pb->pf8);
+	if ( peaks == NULL ) return 1;
+	image_feature_list_free(peaks);
+	return 0;
+}
+
+
+static int bench_peakfinder8(gsl_rng *rng)
+{
+	struct pf8_bench pb;
+	const int w = 2048;
+	int i, r;
+
+	pb.image = make_image(w, 75e-6, 100e-3);
+	for ( i=0; i<w*w; i++ ) {
+		pb.image->dp[0][i] = 20.0 + gsl_ran_gaussian(rng, 5.0);
+	}
+	for ( i=0; i<500; i++ ) {
+		add_spot(pb.image, gsl_rng_uniform(rng)*w,
+		         gsl_rng_uniform(rng)*w, 2000.0);
+	}
+
+	pb.pf8 = prepare_peakfinder8(pb.image->detgeom, 0);
+	if ( pb.pf8 == NULL ) return 1;
+
+	r = run_bench("peakfinder8", pf8, &pb, w*w, "pixels");
+
+	free_pf8_private_data(pb.pf8);
+	image_free(pb.image);
+	return r;
+}
+
+
+/* ---------------------------- Integration ---------------------------- */
+
+struct integrate_bench
+{
+	struct image *image;
+	IntegrationMethod meth;
+	int n_refls;
+};
+
+
+static int integrate(void *vp)
+{
+	struct integrate_bench *ib = vp;
+	integrate_all_5(ib->image, ib->meth, PMODEL_XSPHERE, 0.0,
+	                3.0, 4.0, 6.0, INTDIAG_NONE, 0, 0, 0, NULL, 0);
+	ib->n_refls = num_reflections(ib->image->crystals[0].refls);
+	reflist_free(ib->image->crystals[0].refls);
+	ib->image->crystals[0].refls = NULL;
+	return 0;
+}
+
+
+static int bench_integration(const char *name, gsl_rng *rng)
+{
+	struct integrate_bench ib;
+	const int w = 1024;
+	Crystal *cr;
+	RefList *list;
+	Reflection *refl;
+	RefListIterator *iter;
+	int i, r;
+
+	ib.image = make_image(w, 100e-6, 100e-3);
+	for ( i=0; i<w*w; i++ ) {
+		ib.image->dp[0][i] = poisson_noise(rng, 10.0);
+	}
+
+	/* Put a spot and a peak at the position of every reflection */
+	cr = make_crystal(rng, 100e-10);
+	list = predict_to_res(cr, ib.image,
+	                      detgeom_max_resolution(ib.image->detgeom,
+	                                             ib.image->lambda));
+	ib.image->features = image_feature_list_new();
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		double fs, ss;
+		get_detector_pos(refl, &fs, &ss);
+		add_spot(ib.image, fs, ss, 100.0);
+		image_add_feature(ib.image->features, fs, ss, 0, 100.0, NULL);
+	}
+	reflist_free(list);
+	image_add_crystal_refls(ib.image, cr, NULL);
+
+	if ( strcmp(name, "integrate_prof2d") == 0 ) {
+		ib.meth = INTEGRATION_DEFAULTS_PROF2D;
+	} else {
+		ib.meth = INTEGRATION_DEFAULTS_RINGS;
+	}
+
+	/* To find the number of reflections */
+	integrate(&ib);
+
+	r = run_bench(name, integrate, &ib, ib.n_refls, "reflections");
+
+	image_free(ib.image);
+	return r;
+}
+
+
+/* ---------------------------- Stream ---------------------------- */
+
+struct stream_bench
+{
+	const char *filename;
+	int n_chunks;
+};
+
+
+static int read_stream(void *vp)
+{
+	struct stream_bench *sb = vp;
+	Stream *st;
+	struct image *image;
+
+	st = stream_open_for_read(sb->filename);
+	if ( st == NULL ) return 1;
+
+	sb->n_chunks = 0;
+	while ( (image = stream_read_chunk(st, STREAM_REFLECTIONS
+	                                       | STREAM_PEAKS)) != NULL )
+	{
+		image_free(image);
+		sb->n_chunks++;
+	}
+
+	stream_close(st);
+	return 0;
+}
+
+
+static int bench_stream_read_chunk(const char *filename)
+{
+	struct stream_bench sb;
+	FILE *fh;
+	long size;
+
+	if ( filename == NULL ) {
+		ERROR("Stream benchmark needs a stream filename\n");
+		return 1;
+	}
+
+	fh = fopen(filename, "r");
+	if ( fh == NULL ) {
+		ERROR("Failed to open '%s'\n", filename);
+		return 1;
+	}
+	fseek(fh, 0, SEEK_END);
+	size = ftell(fh);
+	fclose(fh);
+
+	sb.filename = filename;
+	return run_bench("stream_read_chunk", read_stream, &sb, size, "bytes");
+}
+
+
+/* ---------------------------- Merging and scaling ---------------------------- */
+
+#define MERGE_N_CRYSTALS (1000)
+#define MERGE_N_REFLS (2000)
+
+struct merge_bench
+{
+	struct crystal_refls *crystals;
+};
+
+
+static int merge(void *vp)
+{
+	struct merge_bench *mb = vp;
+	RefList *full;
+	full = merge_intensities(mb->crystals, MERGE_N_CRYSTALS, 1,
+	                         2, INFINITY, 0, 0);
+	if ( full == NULL ) return 1;
+	reflist_free(full);
+	return 0;
+}
+
+
+static int scale(void *vp)
+{
+	struct merge_bench *mb = vp;
+	int i;
+
+	/* Start from the same place every time */
+	for ( i=0; i<MERGE_N_CRYSTALS; i++ ) {
+		crystal_set_osf(mb->crystals[i].cr, 1.0);
+		crystal_set_Bfac(mb->crystals[i].cr, 0.0);
+	}
+
+	scale_all(mb->crystals, MERGE_N_CRYSTALS, 1, SCALE_NONE);
+	return 0;
+}
+
+
+static int bench_merge(const char *name, gsl_rng *rng)
+{
+	struct merge_bench mb;
+	RefList *truth;
+	UnitCell *cell;
+	double n_obs = 0.0;
+	int i, r;
+
+	cell = cell_new_from_parameters(50e-10, 50e-10, 50e-10, deg2rad(90.0),
+	                                deg2rad(90.0), deg2rad(90.0));
+
+	truth = reflist_new();
+	mb.crystals = malloc(MERGE_N_CRYSTALS*sizeof(struct crystal_refls));
+
+	for ( i=0; i<MERGE_N_CRYSTALS; i++ ) {
+
+		RefList *list = reflist_new();
+		double G = 0.5 + gsl_rng_uniform(rng);
+		int j;
+
+		for ( j=0; j<MERGE_N_REFLS; j++ ) {
+
+			signed int h, k, l;
+			Reflection *refl;
+			Reflection *t;
+			double p, intens;
+
+			h = gsl_rng_uniform_int(rng, 25);
+			k = gsl_rng_uniform_int(rng, 25);
+			l = gsl_rng_uniform_int(rng, 25);
+			if ( find_refl(list, h, k, l) != NULL ) continue;
+
+			t = find_refl(truth, h, k, l);
+			if ( t == NULL ) {
+				t = add_refl(truth, h, k, l);
+				set_intensity(t, 100.0 + 1000.0*gsl_rng_uniform(rng));
+			}
+
+			p = 0.3 + 0.7*gsl_rng_uniform(rng);
+			intens = get_intensity(t) * G * p;
+			refl = add_refl(list, h, k, l);
+			set_intensity(refl, intens + gsl_ran_gaussian(rng, 0.05*intens));
+			set_esd_intensity(refl, 0.05*intens);
+			set_partiality(refl, p);
+			set_lorentz(refl, 1.0);
+			set_redundancy(refl, 1);
+			n_obs++;
+
+		}
+
+		mb.crystals[i].cr = crystal_new();
+		crystal_set_cell(mb.crystals[i].cr, cell_new_from_cell(cell));
+		crystal_set_osf(mb.crystals[i].cr, 1.0);
+		crystal_set_Bfac(mb.crystals[i].cr, 0.0);
+		crystal_set_resolution_limit(mb.crystals[i].cr, INFINITY);
+		crystal_set_user_flag(mb.crystals[i].cr, 0);
+		mb.crystals[i].refls = list;
+
+	}
+
+	if ( strcmp(name, "merge_intensities") == 0 ) {
+		r = run_bench(name, merge, &mb, n_obs, "observations");
+	} else {
+		r = run_bench(name, scale, &mb, n_obs, "observations");
+	}
+
+	for ( i=0; i<MERGE_N_CRYSTALS; i++ ) {
+		reflist_free(mb.crystals[i].refls);
+		crystal_free(mb.crystals[i].cr);
+	}
+	free(mb.crystals);
+	reflist_free(truth);
+	cell_free(cell);
+	return r;
+}
+
+
+int main(int argc, char *argv[])
+{
+	gsl_rng *rng;
+	const char *name;
+	const char *filename;
+	int r;
+
+	if ( argc < 2 ) {
+		ERROR("Syntax: %s <benchmark> [<filename>]\n", argv[0]);
+		return 1;
+	}
+	name = argv[1];
+	filename = (argc > 2) ? argv[2] : NULL;
+
+	rng = gsl_rng_alloc(gsl_rng_mt19937);
+	gsl_rng_set(rng, BENCH_SEED);
+
+	if ( (strcmp(name, "reflist_insert") == 0)
+	  || (strcmp(name, "reflist_find") == 0)
+	  || (strcmp(name, "reflist_iterate") == 0) )
+	{
+		r = bench_reflist(name, rng);
+
+	} else if ( strcmp(name, "get_asymm") == 0 ) {
+		r = bench_get_asymm();
+
+	} else if ( (strcmp(name, "predict_to_res") == 0)
+	         || (strcmp(name, "calculate_partialities") == 0) )
+	{
+		r = bench_prediction(name, rng);
+
+	} else if ( strcmp(name, "peakfinder8") == 0 ) {
+		r = bench_peakfinder8(rng);
+
+	} else if ( (strcmp(name, "integrate_rings") == 0)
+	         || (strcmp(name, "integrate_prof2d") == 0) )
+	{
+		r = bench_integration(name, rng);
+
+	} else if ( strcmp(name, "stream_read_chunk") == 0 ) {
+		r = bench_stream_read_chunk(filename);
+
+	} else if ( (strcmp(name, "merge_intensities") == 0)
+	         || (strcmp(name, "scale_all") == 0) )
+	{
+		r = bench_merge(name, rng);
+
+	} else {
+		ERROR("Unknown benchmark '%s'\n", name);
+		r = 1;
+	}
+
+	gsl_rng_free(rng);
+	return r;
+}
@@ -43,7 +43,7 @@ struct refltemp {
 #define RANDOM_INDEX (1022*random()/RAND_MAX - 511)
 
 
-static int test_lists(int num_items)
+static int test_lists(int num_items, int flags)
 {
 	struct refltemp *check;
 	RefList *list;
@@ -53,7 +53,7 @@ static int test_lists(int num_items)
 	RefListIterator *iter;
 
 	check = malloc(num_items * sizeof(struct refltemp));
-	list = reflist_new();
+	list = reflist_new_with_flags(flags);
 
 	h = RANDOM_INDEX;
 	k = RANDOM_INDEX;
@@ -167,12 +167,247 @@ static int test_lists(int num_items)
 
 	}
 
+	/* Check again, using the hash table */
+	if ( reflist_freeze(list) ) {
+		fprintf(stderr, "Failed to freeze list\n");
+		return 1;
+	}
+	for ( i=0; i<num_items; i++ ) {
+
+		signed int h, k, l;
+		Reflection *refl;
+		int n = 0;
+
+		h = check[i].h;
+		k = check[i].k;
+		l = check[i].l;
+
+		for ( refl = find_refl(list, h, k, l);
+		      refl != NULL;
+		      refl = next_found_refl(refl) ) n++;
+
+		if ( n != check[i].num ) {
+			fprintf(stderr, "Frozen list: found %i copies of "
+			        "%3i %3i %3i, expected %i\n",
+			        n, h, k, l, check[i].num);
+			return 1;
+		}
+
+	}
+
 	reflist_free(list);
 	free(check);
 
 	return 0;
 }
 
+static int test_lean(void)
+{
+	RefList *lean;
+	RefList *full;
+	Reflection *rl;
+	Reflection *rf;
+	int have_phase;
+	signed int hs, ks, ls;
+
+	lean = reflist_new_with_flags(REFLIST_LEAN);
+	full = reflist_new();
+
+	rl = add_refl(lean, 1, 2, 3);
+	set_intensity(rl, 1234.5);
+	set_esd_intensity(rl, 12.25);
+	set_partiality(rl, 0.75);
+	set_symmetric_indices(rl, -1, -2, -3);
+	set_temp1(rl, 1.0e10 + 1.0);
+	set_phase(rl, 1.0);
+	set_peak(rl, 100.0);
+
+	get_phase(rl, &have_phase);
+	if ( have_phase ) {
+		fprintf(stderr, "Lean reflection should not have a phase\n");
+		return 1;
+	}
+	if ( get_peak(rl) != 100.0 ) {
+		fprintf(stderr, "Lean reflection lost its peak height\n");
+		return 1;
+	}
+
+	rf = add_refl(full, 1, 2, 3);
+	copy_data(rf, rl);
+	get_symmetric_indices(rf, &hs, &ks, &ls);
+	if ( (get_intensity(rf) != 1234.5) || (get_esd_intensity(rf) != 12.25)
+	  || (get_partiality(rf) != 0.75) || (get_temp1(rf) != 1.0e10 + 1.0)
+	  || (hs != -1) || (ks != -2) || (ls != -3) )
+	{
+		fprintf(stderr, "Lean reflection not copied correctly\n");
+		return 1;
+	}
+
+	set_intensity(rf, 100.0);
+	copy_data(rl, rf);
+	if ( get_intensity(rl) != 100.0 ) {
+		fprintf(stderr, "Full reflection not copied correctly\n");
+		return 1;
+	}
+
+	reflist_free(lean);
+	reflist_free(full);
+	return 0;
+}
+
+
+static int test_columns(int num_items)
+{
+	RefList *list;
+	Reflection *refl;
+	RefListIterator *iter;
+	struct reflist_columns *cols;
+	int i;
+
+	list = reflist_new();
+	for ( i=0; i<num_items; i++ ) {
+		refl = add_refl(list, RANDOM_INDEX, RANDOM_INDEX, RANDOM_INDEX);
+		set_intensity(refl, i);
+		set_partiality(refl, 0.5);
+		set_detector_pos(refl, i, 2*i);
+		set_panel_number(refl, i % 8);
+	}
+
+	cols = reflist_get_columns(list);
+	if ( cols == NULL ) {
+		fprintf(stderr, "Failed to get columns\n");
+		return 1;
+	}
+	if ( cols->n != num_reflections(list) ) {
+		fprintf(stderr, "Columns have %i reflections, list has %i\n",
+		        cols->n, num_reflections(list));
+		return 1;
+	}
+
+	for ( i=0; i<cols->n; i++ ) {
+		cols->intensity[i] *= 2.0;
+		cols->partiality[i] = 1.0;
+		cols->redundancy[i] = 7;
+	}
+	reflist_put_columns(cols, RCOL_INTENSITY | RCOL_REDUNDANCY);
+
+	i = 0;
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		get_indices(refl, &h, &k, &l);
+		if ( (cols->refls[i] != refl) || (h != cols->h[i])
+		  || (k != cols->k[i]) || (l != cols->l[i]) )
+		{
+			fprintf(stderr, "Columns are in the wrong order\n");
+			return 1;
+		}
+		if ( get_intensity(refl) != cols->intensity[i] ) {
+			fprintf(stderr, "Intensity not written back\n");
+			return 1;
+		}
+		if ( get_partiality(refl) != 0.5 ) {
+			fprintf(stderr, "Partiality should not be written\n");
+			return 1;
+		}
+		if ( get_redundancy(refl) != 7 ) {
+			fprintf(stderr, "Redundancy not written back\n");
+			return 1;
+		}
+		if ( (cols->fs[i]*2 != cols->ss[i])
+		  || (cols->panel_number[i] != (int)cols->fs[i] % 8) )
+		{
+			fprintf(stderr, "Wrong detector position\n");
+			return 1;
+		}
+		i++;
+	}
+
+	reflist_free_columns(cols);
+	reflist_free(list);
+	return 0;
+}
+
+
+static int test_partition(int num_items, int n_parts)
+{
+	RefList *list;
+	Reflection *refl;
+	struct reflist_partition *part;
+	int i, j;
+	int total = 0;
+
+	/* Small range of indices, so that there are plenty of duplicates */
+	list = reflist_new();
+	for ( i=0; i<num_items; i++ ) {
+		refl = add_refl(list, random()%5-2, random()%5-2, random()%5-2);
+		set_flag(refl, 0);
+	}
+
+	part = reflist_partition(list, n_parts);
+	if ( part == NULL ) {
+		fprintf(stderr, "Failed to partition list\n");
+		return 1;
+	}
+
+	for ( i=0; i<n_parts; i++ ) {
+
+		if ( part->start[i+1] < part->start[i] ) {
+			fprintf(stderr, "Range %i is backwards\n", i);
+			return 1;
+		}
+
+		for ( j=part->start[i]; j<part->start[i+1]; j++ ) {
+
+			Reflection *dup;
+			signed int h, k, l;
+
+			refl = part->refls[j];
+			set_flag(refl, get_flag(refl)+1);
+			total++;
+
+			/* All copies must be in the same range */
+			get_indices(refl, &h, &k, &l);
+			for ( dup = find_refl(list, h, k, l);
+			      dup != NULL;
+			      dup = next_found_refl(dup) )
+			{
+				int m, found = 0;
+				for ( m=part->start[i]; m<part->start[i+1]; m++ ) {
+					if ( part->refls[m] == dup ) found = 1;
+				}
+				if ( !found ) {
+					fprintf(stderr, "Duplicate reflections "
+					        "in different ranges\n");
+					return 1;
+				}
+			}
+
+		}
+	}
+
+	if ( total != num_reflections(list) ) {
+		fprintf(stderr, "Partition covers %i reflections, list has %i\n",
+		        total, num_reflections(list));
+		return 1;
+	}
+
+	for ( i=0; i<part->start[n_parts]; i++ ) {
+		if ( get_flag(part->refls[i]) != 1 ) {
+			fprintf(stderr, "Reflection visited %i times\n",
+			        get_flag(part->refls[i]));
+			return 1;
+		}
+	}
+
+	reflist_free_partition(part);
+	reflist_free(list);
+	return 0;
+}
+
+
 int main(int argc, char *argv[])
 {
 	int i;
@@ -180,7 +415,43 @@ int main(int argc, char *argv[])
 	printf("Running list test...\n");
 
 	for ( i=0; i<100; i++ ) {
-		if ( test_lists(4096*random()/RAND_MAX) ) return 1;
+		if ( test_lists(4096*random()/RAND_MAX, 0) ) return 1;
+	}
+
+	printf("Running list test with arena allocation...\n");
+
+	for ( i=0; i<100; i++ ) {
+		if ( test_lists(4096*random()/RAND_MAX, REFLIST_ARENA) ) return 1;
+	}
+
+	printf("Running list test without locks...\n");
+
+	for ( i=0; i<100; i++ ) {
+		if ( test_lists(4096*random()/RAND_MAX,
+		                REFLIST_ARENA | REFLIST_NO_LOCKS) ) return 1;
+	}
+
+	printf("Running list test with lean reflections...\n");
+
+	for ( i=0; i<100; i++ ) {
+		if ( test_lists(4096*random()/RAND_MAX,
+		                REFLIST_ARENA | REFLIST_NO_LOCKS
+		                 | REFLIST_LEAN) ) return 1;
+	}
+	if ( test_lean() ) return 1;
+
+	printf("Running columnar access test...\n");
+
+	if ( test_columns(0) ) return 1;
+	for ( i=0; i<10; i++ ) {
+		if ( test_columns(4096*random()/RAND_MAX) ) return 1;
+	}
+
+	printf("Running partition test...\n");
+
+	if ( test_partition(0, 4) ) return 1;
+	for ( i=0; i<10; i++ ) {
+		if ( test_partition(4096*random()/RAND_MAX, 1+i) ) return 1;
 	}
 
 	return 0;
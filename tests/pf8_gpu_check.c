@@ -0,0 +1,286 @@
+/*
+ * pf8_gpu_check.c
+ *
+ * Check that the GPU version of peakfinder8 finds the same peaks as the CPU
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <image.h>
+#include <detgeom.h>
+#include <peakfinder8.h>
+
+
+#define N_FRAMES (3)
+#define N_PEAKS (40)
+#define MAX_N_PEAKS (2000)
+
+
+static struct detgeom *make_detector()
+{
+	struct detgeom *det;
+	int pn;
+
+	det = calloc(1, sizeof(struct detgeom));
+	det->n_panels = 2;
+	det->panels = calloc(det->n_panels, sizeof(struct detgeom_panel));
+
+	/* Two panels side by side, with the beam between them */
+	for ( pn=0; pn<det->n_panels; pn++ ) {
+		struct detgeom_panel *p = &det->panels[pn];
+		p->w = 128;
+		p->h = 256;
+		p->fsx = 1.0;
+		p->fsy = 0.0;
+		p->ssx = 0.0;
+		p->ssy = 1.0;
+		p->cnx = (pn == 0) ? -133.0 : 5.0;
+		p->cny = -128.0;
+		p->cnz = 1000.0;
+		p->pixel_pitch = 100e-6;
+		p->adu_per_photon = 1.0;
+		p->max_adu = +INFINITY;
+	}
+
+	return det;
+}
+
+
+/* Background falling off with radius, noise, and some Gaussian spots */
+static void make_frame(struct image *image, struct detgeom *det)
+{
+	int pn, k;
+
+	image->detgeom = det;
+	image->bad = NULL;
+	image->sat = NULL;
+	image->dp = malloc(det->n_panels*sizeof(float *));
+
+	for ( pn=0; pn<det->n_panels; pn++ ) {
+
+		struct detgeom_panel *p = &det->panels[pn];
+		int fs, ss;
+
+		image->dp[pn] = malloc(p->w*p->h*sizeof(float));
+		for ( ss=0; ss<p->h; ss++ ) {
+		for ( fs=0; fs<p->w; fs++ ) {
+			double x = p->cnx + fs;
+			double y = p->cny + ss;
+			double r = sqrt(x*x + y*y);
+			image->dp[pn][fs+p->w*ss] = 200.0/(1.0+r/50.0)
+			                            + (rand() % 100)/10.0;
+		}
+		}
+	}
+
+	for ( k=0; k<N_PEAKS; k++ ) {
+
+		struct detgeom_panel *p;
+		double cfs, css, height;
+		int fs, ss;
+
+		pn = rand() % det->n_panels;
+		p = &det->panels[pn];
+		cfs = 5 + rand() % (p->w-10) + (rand() % 100)/100.0;
+		css = 5 + rand() % (p->h-10) + (rand() % 100)/100.0;
+		height = 200.0 + rand() % 1000;
+
+		for ( ss=css-4; ss<=css+4; ss++ ) {
+		for ( fs=cfs-4; fs<=cfs+4; fs++ ) {
+			double dfs = fs+0.5 - cfs;
+			double dss = ss+0.5 - css;
+			image->dp[pn][fs+p->w*ss] += height
+			                   * exp(-(dfs*dfs + dss*dss)/2.0);
+		}
+		}
+	}
+}
+
+
+static void free_frame(struct image *image)
+{
+	int pn;
+
+	for ( pn=0; pn<image->detgeom->n_panels; pn++ ) {
+		free(image->dp[pn]);
+	}
+	free(image->dp);
+}
+
+
+static int run_pf8(struct image **images, ImageFeatureList **peaks,
+                   struct pf8_private_data *pf8, int multi)
+{
+	int i;
+
+	if ( multi ) {
+		return peakfinder8_multi(images, N_FRAMES, peaks, MAX_N_PEAKS,
+		                         50.0, 5.0, 2, 200, 3, 0, 1000, 1, pf8);
+	}
+
+	for ( i=0; i<N_FRAMES; i++ ) {
+		peaks[i] = peakfinder8(images[i], MAX_N_PEAKS, 50.0, 5.0, 2, 200,
+		                       3, 0, 1000, 1, 0, pf8);
+		if ( peaks[i] == NULL ) return 1;
+	}
+	return 0;
+}
+
+
+/* The backgrounds can differ in the last bits depending on the summation
+ * order, so the peak intensities are only compared approximately */
+static int compare_peaks(ImageFeatureList **a, ImageFeatureList **b,
+                         const char *what)
+{
+	int i;
+	int fail = 0;
+
+	for ( i=0; i<N_FRAMES; i++ ) {
+
+		int n, k;
+
+		if ( (a[i] == NULL) || (b[i] == NULL) ) {
+			fprintf(stderr, "%s: no peaks for frame %i\n", what, i);
+			return 1;
+		}
+
+		n = image_feature_count(a[i]);
+		if ( image_feature_count(b[i]) != n ) {
+			fprintf(stderr, "%s: frame %i has %i peaks instead "
+			        "of %i\n", what, i, image_feature_count(b[i]), n);
+			fail = 1;
+			continue;
+		}
+		if ( n < N_PEAKS/2 ) {
+			fprintf(stderr, "%s: only %i peaks found in frame %i\n",
+			        what, n, i);
+			fail = 1;
+		}
+
+		for ( k=0; k<n; k++ ) {
+			const struct imagefeature *fa, *fb;
+			fa = image_get_feature_const(a[i], k);
+			fb = image_get_feature_const(b[i], k);
+			if ( (fa->pn != fb->pn)
+			  || (fabs(fa->fs - fb->fs) > 1e-3)
+			  || (fabs(fa->ss - fb->ss) > 1e-3)
+			  || (fabs(fa->intensity - fb->intensity)
+			      > 1e-3*fabs(fa->intensity)+1e-3) )
+			{
+				fprintf(stderr, "%s: frame %i peak %i is "
+				        "%i %f,%f %f instead of %i %f,%f %f\n",
+				        what, i, k,
+				        fb->pn, fb->fs, fb->ss, fb->intensity,
+				        fa->pn, fa->fs, fa->ss, fa->intensity);
+				fail = 1;
+			}
+		}
+	}
+
+	return fail;
+}
+
+
+static void free_peaks(ImageFeatureList **peaks)
+{
+	int i;
+	for ( i=0; i<N_FRAMES; i++ ) {
+		image_feature_list_free(peaks[i]);
+		peaks[i] = NULL;
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct detgeom *det;
+	struct image frames[N_FRAMES];
+	struct image *images[N_FRAMES];
+	ImageFeatureList *cpu[N_FRAMES];
+	ImageFeatureList *other[N_FRAMES];
+	struct pf8_private_data *pf8;
+	int i;
+	int fail = 0;
+
+	srand(42);
+	det = make_detector();
+	for ( i=0; i<N_FRAMES; i++ ) {
+		make_frame(&frames[i], det);
+		images[i] = &frames[i];
+	}
+
+	pf8 = prepare_peakfinder8(det, 0);
+	if ( pf8 == NULL ) {
+		fprintf(stderr, "Failed to prepare peakfinder8\n");
+		return 1;
+	}
+
+	/* Reference: one frame at a time on the CPU */
+	if ( run_pf8(images, cpu, pf8, 0) ) {
+		fprintf(stderr, "CPU peakfinder8 failed\n");
+		return 1;
+	}
+
+	/* Several frames at once on the CPU must give exactly the same */
+	if ( run_pf8(images, other, pf8, 1) ) {
+		fprintf(stderr, "CPU peakfinder8_multi failed\n");
+		return 1;
+	}
+	fail |= compare_peaks(cpu, other, "CPU, several frames");
+	free_peaks(other);
+
+	if ( pf8_enable_gpu(pf8) ) {
+		printf("No GPU available - skipping GPU comparison\n");
+		free_peaks(cpu);
+		free_pf8_private_data(pf8);
+		for ( i=0; i<N_FRAMES; i++ ) free_frame(&frames[i]);
+		return fail ? 1 : 77;
+	}
+
+	if ( run_pf8(images, other, pf8, 0) ) {
+		fprintf(stderr, "GPU peakfinder8 failed\n");
+		return 1;
+	}
+	fail |= compare_peaks(cpu, other, "GPU, one frame");
+	free_peaks(other);
+
+	if ( run_pf8(images, other, pf8, 1) ) {
+		fprintf(stderr, "GPU peakfinder8_multi failed\n");
+		return 1;
+	}
+	fail |= compare_peaks(cpu, other, "GPU, several frames");
+	free_peaks(other);
+
+	free_peaks(cpu);
+	free_pf8_private_data(pf8);
+	for ( i=0; i<N_FRAMES; i++ ) free_frame(&frames[i]);
+	free(det->panels);
+	free(det);
+
+	return fail;
+}
@@ -35,6 +35,7 @@
 #include <cell-utils.h>
 #include <geometry.h>
 #include <integration.h>
+#include <reflist-utils.h>
 
 #include "histogram.h"
 
@@ -61,6 +62,7 @@ int main(int argc, char *argv[])
 	const int w = 1024;
 	const int h = 1024;
 	RefList *list;
+	RefList *list_single;
 	RefListIterator *iter;
 	Reflection *refl;
 	UnitCell *cell;
@@ -169,10 +171,51 @@ int main(int argc, char *argv[])
 
 	STATUS("%i strong, %i weak\n", n_strong, n_weak);
 
+	/* Fit the boxes one at a time as well, for comparison */
+	list_single = copy_reflist(list);
+	integration_set_prof2d_batch(0);
+	integrate_prof2d(INTEGRATION_PROF2D, cr, list_single, &image,
+	                 INTDIAG_NONE, 0, 0, 0, ir_inn, ir_mid, ir_out, 0,
+	                 NULL);
+	integration_set_prof2d_batch(1);
+
 	integrate_prof2d(INTEGRATION_PROF2D, cr, list, &image,
 	                 INTDIAG_NONE, 0, 0, 0, ir_inn, ir_mid, ir_out, 0,
 	                 NULL);
 
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		signed int h, k, l;
+		Reflection *refl2;
+		double i1, i2, s1, s2, tol;
+
+		get_indices(refl, &h, &k, &l);
+		refl2 = find_refl(list_single, h, k, l);
+
+		if ( get_redundancy(refl) != get_redundancy(refl2) ) {
+			ERROR("Batched and single fits disagree about "
+			      "%i %i %i\n", h, k, l);
+			fail = 1;
+			continue;
+		}
+		if ( get_redundancy(refl) == 0 ) continue;
+
+		i1 = get_intensity(refl);
+		i2 = get_intensity(refl2);
+		s1 = get_esd_intensity(refl);
+		s2 = get_esd_intensity(refl2);
+		tol = 1e-12 * fmax(fabs(i2), s2);
+		if ( (fabs(i1-i2) > tol) || (fabs(s1-s2) > tol) ) {
+			ERROR("Batched fit differs for %i %i %i: "
+			      "%e +/- %e instead of %e +/- %e\n",
+			      h, k, l, i1, s1, i2, s2);
+			fail = 1;
+		}
+	}
+	reflist_free(list_single);
+
 	printf("Weak reflections:\n");
 	hi = histogram_init();
 	for ( refl = first_refl(list, &iter);
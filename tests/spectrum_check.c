@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <math.h>
 
 #include <spectrum.h>
 #include <utils.h>
@@ -54,6 +55,47 @@ static int check_integral(Spectrum *s, int nsamp)
 }
 
 
+/* Compare the tabulated density with the real one */
+static int check_table(Spectrum *s, int n_table, double max_allowed)
+{
+	double min, max, step;
+	int i;
+	const int nsamp = 997;
+	double exact[nsamp+1];
+	double max_val = 0.0;
+	double max_err = 0.0;
+	double err;
+
+	spectrum_set_density_table(s, 0);
+	spectrum_get_range(s, &min, &max);
+	step = (max-min)/nsamp;
+	for ( i=0; i<=nsamp; i++ ) {
+		exact[i] = spectrum_get_density_at_k(s, min+i*step);
+		if ( exact[i] > max_val ) max_val = exact[i];
+	}
+
+	err = spectrum_set_density_table(s, n_table);
+	if ( spectrum_get_density_table_size(s) != n_table ) {
+		fprintf(stderr, "Table size not set\n");
+		return 1;
+	}
+
+	for ( i=0; i<=nsamp; i++ ) {
+		double y = spectrum_get_density_at_k(s, min+i*step);
+		if ( fabs(y-exact[i]) > max_err ) max_err = fabs(y-exact[i]);
+	}
+	max_err /= max_val;
+
+	fprintf(stderr, "Table with %i samples: error %e (reported %e)\n",
+	        n_table, max_err, err);
+	spectrum_set_density_table(s, 0);
+
+	if ( (err < 0.0) || (err > max_allowed) ) return 1;
+	if ( max_err > 2.0*err + 1e-12 ) return 1;
+	return 0;
+}
+
+
 static void plot_spectrum(Spectrum *s)
 {
 	double min, max, step;
@@ -84,23 +126,36 @@ int main(int argc, char *argv[])
 	gauss.area = 1.0;
 	spectrum_set_gaussians(s, &gauss, 1);
 	r += check_integral(s, 100);
+	r += check_table(s, 1024, 1e-4);
+
+	/* The table should follow changes to the spectrum */
+	spectrum_set_density_table(s, 1024);
+	gauss.sigma = ph_eV_to_k(20);
+	spectrum_set_gaussians(s, &gauss, 1);
+	r += check_integral(s, 100);
+	r += check_table(s, 1024, 1e-4);
 	spectrum_free(s);
 
 	s = spectrum_generate_sase(ph_eV_to_lambda(9000), 0.01, 0.0001, rng);
 	r += check_integral(s, 100);
+	r += check_table(s, 4096, 1e-3);
 	plot_spectrum(s);
 	spectrum_free(s);
 
 	s = spectrum_generate_gaussian(ph_eV_to_lambda(9000), 0.01);
 	r += check_integral(s, 100);
+	r += check_table(s, 1024, 1e-4);
 	spectrum_free(s);
 
+	/* The edges can't be tabulated accurately */
 	s = spectrum_generate_tophat(ph_eV_to_lambda(9000), 0.01);
 	r += check_integral(s, 100);
+	r += check_table(s, 1024, 1.0);
 	spectrum_free(s);
 
 	s = spectrum_generate_twocolour(ph_eV_to_lambda(9000), 0.001, ph_eV_to_k(100));
 	r += check_integral(s, 100);
+	r += check_table(s, 1024, 1e-4);
 	spectrum_free(s);
 
 	gsl_rng_free(rng);
@@ -0,0 +1,170 @@
+/*
+ * stream_index_update.c
+ *
+ * Check updating of stream indices as the stream grows
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stream.h"
+
+
+#define MAX_CHUNKS (1024)
+
+static char *filenames[MAX_CHUNKS];
+static int n_filenames = 0;
+
+
+static int count_found(StreamIndex *index)
+{
+	int i;
+	int n = 0;
+	for ( i=0; i<n_filenames; i++ ) {
+		if ( stream_select_chunk(NULL, index, filenames[i], NULL) == 0 ) n++;
+	}
+	return n;
+}
+
+
+/* The entries should come back in the order of the stream */
+static int check_enumeration(StreamIndex *index)
+{
+	int i;
+	int n = 0;
+	for ( i=0; i<stream_index_num_chunks(index); i++ ) {
+		char *filename;
+		char *ev;
+		if ( stream_index_get_chunk(index, i, &filename, &ev) ) continue;
+		if ( (n >= n_filenames) || (strcmp(filename, filenames[n]) != 0)
+		  || (ev != NULL) )
+		{
+			printf("Entry %i: '%s' '%s'\n", i, filename, ev);
+			return 1;
+		}
+		free(filename);
+		n++;
+	}
+	printf("%i chunks enumerated\n", n);
+	return n != n_filenames;
+}
+
+
+static int write_part(const char *filename, const char *data,
+                      size_t start, size_t end, const char *mode)
+{
+	FILE *fh = fopen(filename, mode);
+	if ( fh == NULL ) return 1;
+	if ( fwrite(data+start, 1, end-start, fh) != end-start ) return 1;
+	return fclose(fh) != 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	FILE *fh;
+	char line[1024];
+	char *data;
+	long len;
+	size_t cut1, cut2;
+	const char *end;
+	StreamIndex *index;
+	int n;
+	const char *stream = "stream_index_update_check.stream";
+
+	fh = fopen(argv[1], "rb");
+	if ( fh == NULL ) return 1;
+	while ( fgets(line, 1024, fh) != NULL ) {
+		if ( strncmp(line, "Image filename: ", 16) != 0 ) continue;
+		line[strlen(line)-1] = '\0';
+		if ( n_filenames == MAX_CHUNKS ) return 1;
+		filenames[n_filenames++] = strdup(line+16);
+	}
+	fseek(fh, 0, SEEK_END);
+	len = ftell(fh);
+	rewind(fh);
+	data = malloc(len);
+	if ( data == NULL ) return 1;
+	if ( fread(data, 1, len, fh) != (size_t)len ) return 1;
+	fclose(fh);
+
+	/* Part way through a chunk */
+	cut1 = len/3;
+
+	/* Just after the end marker of the next chunk, but before the end of
+	 * the line */
+	end = strstr(data+cut1, STREAM_CHUNK_END_MARKER);
+	if ( end == NULL ) return 1;
+	cut2 = end - data + strlen(STREAM_CHUNK_END_MARKER);
+
+	remove("stream_index_update_check.stream.idx");
+	if ( write_part(stream, data, 0, cut1, "wb") ) return 1;
+	index = stream_make_index(stream);
+	if ( index == NULL ) return 1;
+	n = count_found(index);
+	printf("%i chunks in first part\n", n);
+	if ( (n == 0) || (n >= n_filenames) ) return 1;
+
+	if ( write_part(stream, data, cut1, cut2, "ab") ) return 1;
+	if ( stream_update_index(index, stream) ) return 1;
+	printf("%i chunks after incomplete end marker\n", count_found(index));
+	if ( count_found(index) != n ) return 1;
+
+	if ( write_part(stream, data, cut2, len, "ab") ) return 1;
+	if ( stream_update_index(index, stream) ) return 1;
+	n = count_found(index);
+	printf("%i chunks after update\n", n);
+	if ( n != n_filenames ) return 1;
+	stream_index_free(index);
+
+	/* Saved index should be used, and be complete */
+	index = stream_make_index(stream);
+	if ( index == NULL ) return 1;
+	n = count_found(index);
+	printf("%i chunks from saved index\n", n);
+	if ( n != n_filenames ) return 1;
+	if ( check_enumeration(index) ) return 1;
+	stream_index_free(index);
+
+	/* Saved index for the start of the stream, which then grows */
+	if ( write_part(stream, data, 0, cut1, "wb") ) return 1;
+	index = stream_make_index(stream);
+	stream_index_free(index);
+	if ( write_part(stream, data, cut1, len, "ab") ) return 1;
+	index = stream_make_index(stream);
+	if ( index == NULL ) return 1;
+	n = count_found(index);
+	printf("%i chunks from out of date saved index\n", n);
+	if ( n != n_filenames ) return 1;
+	stream_index_free(index);
+
+	remove(stream);
+	remove("stream_index_update_check.stream.idx");
+	free(data);
+
+	return 0;
+}
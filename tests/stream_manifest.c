@@ -0,0 +1,86 @@
+/*
+ * stream_manifest.c
+ *
+ * Check reading of sharded streams via a manifest
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stream.h"
+#include "image.h"
+
+
+static int count_chunks(Stream *st)
+{
+	int n = 0;
+	do {
+		struct image *image = stream_read_chunk(st, 0);
+		if ( image == NULL ) break;
+		n++;
+		image_free(image);
+	} while ( 1 );
+	return n;
+}
+
+
+int main(int argc, char *argv[])
+{
+	Stream *st;
+	FILE *fh;
+	int n;
+	const char *manifest = "stream_manifest_check.manifest";
+	char *stream_filename = argv[1];
+
+	/* The same shard twice, with a missing one in between */
+	fh = fopen(manifest, "w");
+	if ( fh == NULL ) return 1;
+	fprintf(fh, STREAM_MANIFEST_MARKER"\n");
+	fprintf(fh, "%s\n", stream_filename);
+	fprintf(fh, "does-not-exist.stream\n");
+	fprintf(fh, "%s\n", stream_filename);
+	fclose(fh);
+
+	st = stream_open_for_read(manifest);
+	if ( st == NULL ) {
+		fprintf(stderr, "Failed to open manifest\n");
+		return 1;
+	}
+
+	n = count_chunks(st);
+	printf("Got %i chunks\n", n);
+	if ( n != 140 ) return 1;
+
+	if ( stream_rewind(st) ) return 1;
+	n = count_chunks(st);
+	printf("Got %i chunks after rewind\n", n);
+	if ( n != 140 ) return 1;
+
+	stream_close(st);
+	remove(manifest);
+
+	return 0;
+}
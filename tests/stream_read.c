@@ -31,12 +31,43 @@
 
 #include "stream.h"
 #include "image.h"
+#include "reflist.h"
+#include "cell-utils.h"
 
-int main(int argc, char *argv[])
+
+/* Cutoffs for stream_set_reflection_cutoffs() */
+#define MAX_PEAK (500.0)
+#define MIN_RES (2.0e9)
+#define PUSH_RES (0.2e9)
+
+
+struct totals
+{
+	int n_chunks;
+	int n_crystals;
+	int n_refls;
+	int n_pass;
+	double sum_intensity;
+};
+
+
+/* The reflections which should be left after the cutoffs */
+static int passes_cutoffs(Reflection *refl, Crystal *cr)
+{
+	signed int h, k, l;
+	double lim = crystal_get_resolution_limit(cr);
+
+	get_indices(refl, &h, &k, &l);
+	if ( lim < MIN_RES ) return 0;
+	if ( !(get_peak(refl) < MAX_PEAK) ) return 0;
+	return 2.0*resolution(crystal_get_cell(cr), h, k, l) <= lim+PUSH_RES;
+}
+
+
+static int read_all(const char *stream_filename, StreamFlags srf, int cut,
+                    struct totals *t)
 {
 	Stream *st;
-	int n;
-	char *stream_filename = argv[1];
 
 	st = stream_open_for_read(stream_filename);
 	if ( st == NULL ) {
@@ -45,18 +76,85 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	n = 0;
+	if ( cut ) {
+		stream_set_reflection_cutoffs(st, MAX_PEAK, MIN_RES, PUSH_RES);
+	}
+
+	t->n_chunks = 0;
+	t->n_crystals = 0;
+	t->n_refls = 0;
+	t->n_pass = 0;
+	t->sum_intensity = 0.0;
 	do {
 
-		struct image *image = stream_read_chunk(st, 0);
+		int i;
+		struct image *image = stream_read_chunk(st, srf);
 		if ( image == NULL ) break;
-		n++;
+		t->n_chunks++;
+
+		for ( i=0; i<image->n_crystals; i++ ) {
+
+			RefList *list;
+			Reflection *refl;
+			RefListIterator *iter;
+
+			t->n_crystals++;
+			if ( srf & STREAM_DEFER_REFLECTIONS ) {
+				list = stream_crystal_refls(st, image, i, srf);
+			} else {
+				list = image->crystals[i].refls;
+			}
+			if ( list == NULL ) continue;
+
+			for ( refl = first_refl(list, &iter);
+			      refl != NULL;
+			      refl = next_refl(refl, iter) )
+			{
+				t->n_refls++;
+				t->n_pass += passes_cutoffs(refl,
+				                            image->crystals[i].cr);
+				t->sum_intensity += get_intensity(refl);
+			}
+		}
 
 		image_free(image);
 
 	} while ( 1 );
 
-	printf("Got %i chunks\n", n);
+	stream_close(st);
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct totals plain, refls, deferred, cut, cut_deferred;
+
+	if ( read_all(argv[1], 0, 0, &plain) ) return 1;
+	if ( read_all(argv[1], STREAM_REFLECTIONS, 0, &refls) ) return 1;
+	if ( read_all(argv[1], STREAM_DEFER_REFLECTIONS, 0, &deferred) ) return 1;
+	if ( read_all(argv[1], STREAM_REFLECTIONS, 1, &cut) ) return 1;
+	if ( read_all(argv[1], STREAM_DEFER_REFLECTIONS, 1,
+	              &cut_deferred) ) return 1;
+
+	printf("Got %i chunks, %i crystals, %i reflections\n",
+	       plain.n_chunks, plain.n_crystals, refls.n_refls);
+
+	if ( plain.n_chunks != 70 ) return 1;
+	if ( plain.n_refls != 0 ) return 1;
+	if ( (refls.n_chunks != 70) || (deferred.n_chunks != 70) ) return 1;
+	if ( (refls.n_crystals != plain.n_crystals)
+	  || (deferred.n_crystals != plain.n_crystals) ) return 1;
+	if ( refls.n_refls == 0 ) return 1;
+	if ( deferred.n_refls != refls.n_refls ) return 1;
+	if ( deferred.sum_intensity != refls.sum_intensity ) return 1;
+
+	printf("%i reflections left after cutoffs\n", cut.n_refls);
+	if ( (refls.n_pass == 0) || (refls.n_pass == refls.n_refls) ) return 1;
+	if ( cut.n_refls != refls.n_pass ) return 1;
+	if ( cut.n_pass != cut.n_refls ) return 1;
+	if ( cut_deferred.n_refls != cut.n_refls ) return 1;
+	if ( cut_deferred.sum_intensity != cut.sum_intensity ) return 1;
 
-	return (n != 70);
+	return 0;
 }
@@ -44,6 +44,109 @@ static const char *maybenot(int v)
 }
 
 
+/* Checks that the lookup table gives the same asymmetric indices as the normal
+ * calculation, both inside and outside the table */
+static void check_equivs(SymOpList *sym, const char *pg, int *fail)
+{
+	int p, n;
+
+	n = num_equivs(sym, NULL);
+	for ( p=0; p<n; p++ ) {
+
+		IntegerMatrix *op = get_symop(sym, NULL, p);
+		signed int hkl[3];
+
+		for ( hkl[0]=-3; hkl[0]<=3; hkl[0]++ ) {
+		for ( hkl[1]=-3; hkl[1]<=3; hkl[1]++ ) {
+		for ( hkl[2]=-3; hkl[2]<=3; hkl[2]++ ) {
+
+			signed int he, ke, le;
+			signed int *ans;
+
+			get_equiv(sym, NULL, p, hkl[0], hkl[1], hkl[2],
+			          &he, &ke, &le);
+			ans = transform_indices(op, hkl);
+			if ( (he != ans[0]) || (ke != ans[1]) || (le != ans[2]) ) {
+				ERROR("Operation %i of '%s' gives %i %i %i -> "
+				      "%i %i %i, not %i %i %i\n", p, pg,
+				      hkl[0], hkl[1], hkl[2], he, ke, le,
+				      ans[0], ans[1], ans[2]);
+				*fail = 1;
+			}
+			free(ans);
+
+		}
+		}
+		}
+
+	}
+}
+
+
+static void check_asymm_table(SymOpList *sym, const char *pg, int *fail)
+{
+	const int lim = 7;
+	const int n = 2*lim+1;
+	signed int *ref;
+	signed int h, k, l;
+	int i;
+
+	ref = malloc(3*n*n*n*sizeof(signed int));
+	if ( ref == NULL ) {
+		*fail = 1;
+		return;
+	}
+
+	i = 0;
+	for ( h=-lim; h<=lim; h++ ) {
+	for ( k=-lim; k<=lim; k++ ) {
+	for ( l=-lim; l<=lim; l++ ) {
+		get_asymm(sym, h, k, l, &ref[i], &ref[i+1], &ref[i+2]);
+		i += 3;
+	}
+	}
+	}
+
+	if ( make_asymm_table(sym, 5, 4, 3) ) {
+		ERROR("Failed to make lookup table for '%s'\n", pg);
+		*fail = 1;
+		free(ref);
+		return;
+	}
+
+	i = 0;
+	for ( h=-lim; h<=lim; h++ ) {
+	for ( k=-lim; k<=lim; k++ ) {
+	for ( l=-lim; l<=lim; l++ ) {
+
+		signed int ha, ka, la;
+		signed int he, ke, le;
+		int op;
+
+		op = get_asymm_op(sym, h, k, l, &ha, &ka, &la);
+		if ( (ha != ref[i]) || (ka != ref[i+1]) || (la != ref[i+2]) ) {
+			ERROR("Lookup table for '%s' gives %i %i %i -> "
+			      "%i %i %i, not %i %i %i\n", pg, h, k, l,
+			      ha, ka, la, ref[i], ref[i+1], ref[i+2]);
+			*fail = 1;
+		}
+
+		get_equiv(sym, NULL, op, h, k, l, &he, &ke, &le);
+		if ( (he != ha) || (ke != ka) || (le != la) ) {
+			ERROR("Wrong operation %i for %i %i %i in '%s'\n",
+			      op, h, k, l, pg);
+			*fail = 1;
+		}
+
+		i += 3;
+	}
+	}
+	}
+
+	free(ref);
+}
+
+
 static void check_pg_props(const char *pg, int answer, int centro, int *fail)
 {
 	SymOpList *sym;
@@ -74,6 +177,9 @@ static void check_pg_props(const char *pg, int answer, int centro, int *fail)
 		*fail = 1;
 	}
 
+	check_equivs(sym, pg, fail);
+	check_asymm_table(sym, pg, fail);
+
 	free_symoplist(sym);
 }
 
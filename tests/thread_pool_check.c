@@ -0,0 +1,227 @@
+/*
+ * thread_pool_check.c
+ *
+ * Check the thread pool
+ *
+ * Copyright © 2026 Deutsches Elektronen-Synchrotron DESY,
+ *                  a research centre of the Helmholtz Association.
+ *
+ * Authors:
+ *   2026 agent <agent@local>
+ *
+ * This file is part of CrystFEL.
+ *
+ * CrystFEL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrystFEL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CrystFEL.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <thread-pool.h>
+
+
+#define N_TASKS (1000)
+
+
+struct queue_args
+{
+	int n_started;
+	int n_done;
+	long int sum;
+	int nested;
+	TPCancelToken *cancel;
+};
+
+
+struct task
+{
+	int n;
+	long int result;
+	int nested;
+	TPCancelToken *cancel;
+};
+
+
+static void *get_task(void *vqargs)
+{
+	struct queue_args *qargs = vqargs;
+	struct task *task;
+
+	if ( qargs->n_started == N_TASKS ) return NULL;
+
+	task = malloc(sizeof(struct task));
+	task->n = qargs->n_started++;
+	task->nested = qargs->nested;
+	task->cancel = qargs->cancel;
+	return task;
+}
+
+
+static void final(void *vqargs, void *vtask)
+{
+	struct queue_args *qargs = vqargs;
+	struct task *task = vtask;
+	qargs->sum += task->result;
+	qargs->n_done++;
+	free(task);
+}
+
+
+static long int run_batch(int n_threads, ThreadPool *pool, int nested,
+                          const struct thread_pool_opts *opts);
+
+
+static void work(void *vtask, int cookie)
+{
+	struct task *task = vtask;
+	long int *scratch;
+
+	/* Scratch memory belongs to this thread alone */
+	scratch = thread_pool_scratch((task->n % 4 + 1)*sizeof(long int));
+	if ( scratch == NULL ) {
+		task->result = -1;
+		return;
+	}
+	scratch[task->n % 4] = task->n;
+	task->result = scratch[task->n % 4];
+
+	if ( (task->cancel != NULL) && (task->n == N_TASKS/10) ) {
+		tp_cancel(task->cancel);
+	}
+
+	/* Nested use of run_threads() should not deadlock */
+	if ( task->nested && (task->n == 0) ) {
+		if ( run_batch(2, NULL, 0, NULL) != N_TASKS*(N_TASKS-1)/2 ) {
+			task->result = -1;
+		}
+	}
+}
+
+
+static long int run_batch(int n_threads, ThreadPool *pool, int nested,
+                          const struct thread_pool_opts *opts)
+{
+	struct queue_args qargs;
+	int n;
+
+	qargs.n_started = 0;
+	qargs.n_done = 0;
+	qargs.sum = 0;
+	qargs.nested = nested;
+	qargs.cancel = NULL;
+
+	if ( pool != NULL ) {
+		n = thread_pool_run_opts(pool, work, get_task, final, &qargs,
+		                         0, opts);
+	} else {
+		n = run_threads_opts(n_threads, work, get_task, final, &qargs,
+		                     0, opts);
+	}
+
+	if ( (n != N_TASKS) || (qargs.n_done != N_TASKS) ) {
+		fprintf(stderr, "Completed %i/%i tasks (expected %i)\n",
+		        n, qargs.n_done, N_TASKS);
+		return -1;
+	}
+
+	return qargs.sum;
+}
+
+
+/* Returns the number of tasks completed */
+static int run_cancelled(TPCancelToken *tok)
+{
+	struct queue_args qargs;
+	struct thread_pool_opts opts = {.cancel = tok};
+	int n;
+
+	qargs.n_started = 0;
+	qargs.n_done = 0;
+	qargs.sum = 0;
+	qargs.nested = 0;
+	qargs.cancel = tok;
+
+	n = run_threads_opts(4, work, get_task, final, &qargs, 0, &opts);
+
+	if ( (n != qargs.n_done) || (n != qargs.n_started) ) {
+		fprintf(stderr, "Completed %i/%i tasks, started %i\n",
+		        n, qargs.n_done, qargs.n_started);
+		return -1;
+	}
+
+	return n;
+}
+
+
+int main(int argc, char *argv[])
+{
+	ThreadPool *pool;
+	long int expected = N_TASKS*(N_TASKS-1)/2;
+	struct thread_pool_opts opts = {.chunk_size = 7,
+	                                .final_locking = TP_FINAL_SEPARATE_LOCK};
+	TPCancelToken *tok;
+	int i, n;
+
+	if ( run_batch(4, NULL, 0, NULL) != expected ) return 1;
+	if ( run_batch(4, NULL, 0, &opts) != expected ) return 1;
+
+	pool = thread_pool_new(4);
+	if ( pool == NULL ) return 1;
+
+	for ( i=0; i<10; i++ ) {
+		if ( run_batch(0, pool, 0, NULL) != expected ) return 1;
+	}
+
+	set_default_thread_pool(pool);
+	for ( i=0; i<10; i++ ) {
+		if ( run_batch(4, NULL, 0, NULL) != expected ) return 1;
+		if ( run_batch(2, NULL, 0, &opts) != expected ) return 1;
+	}
+	if ( run_batch(4, NULL, 1, &opts) != expected ) return 1;
+	set_default_thread_pool(NULL);
+
+	thread_pool_free(pool);
+
+	tok = tp_cancel_token_new();
+	if ( tok == NULL ) return 1;
+	if ( tp_cancelled(NULL) ) return 1;
+
+	/* Cancelled by a work function */
+	n = run_cancelled(tok);
+	if ( (n <= N_TASKS/10) || (n >= N_TASKS) ) {
+		fprintf(stderr, "Cancellation didn't work (%i tasks)\n", n);
+		return 1;
+	}
+	if ( !tp_cancelled(tok) ) return 1;
+
+	/* Already cancelled */
+	if ( run_cancelled(tok) != 0 ) return 1;
+
+	/* Reset */
+	tp_cancel_reset(tok);
+	if ( tp_cancelled(tok) ) return 1;
+
+	/* Deadline already passed */
+	tp_cancel_set_timeout(tok, -1.0);
+	if ( run_cancelled(tok) != 0 ) return 1;
+	tp_cancel_token_free(tok);
+
+	pool = thread_pool_new_with_flags(3, TP_PIN_THREADS);
+	if ( pool == NULL ) return 1;
+	if ( run_batch(0, pool, 0, &opts) != expected ) return 1;
+	thread_pool_free(pool);
+
+	return 0;
+}